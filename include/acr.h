@@ -24,10 +24,16 @@ extern "C" {
 #include <string>
 #include <list>
 #include <vector>
+#include <atomic>
+#include <memory>
+#include <set>
 
 #include "sas.h"
+#include "header_index.h"
 #include "ralf_processor.h"
 #include "servercaps.h"
+#include "instrumented_mutex.h"
+#include "snmp_counter_table.h"
 
 /// Class tracking state required for Rf ACR messages.  An instance of this
 /// class is created for each SIP transaction that requires accounting, and
@@ -90,6 +96,10 @@ public:
   /// Called with all responses as received by the node.  When acting as an
   /// S-CSCF, this includes all forwarded responses received from ASs
   /// invoked in the service chain.
+  ///
+  /// Unlike the other update methods, this may be called without holding the
+  /// ACR lock (and must not be called while holding it), so that responses
+  /// received on different forks don't contend for the ACR.
   /// @param   rsp            A pointer to the parsed SIP response message.
   /// @param   timestamp      Timestamp of the response transmission.
   virtual void rx_response(pjsip_msg* rsp, pj_time_val timestamp=unspec);
@@ -120,6 +130,11 @@ public:
   /// @param   caps           Capabiliies as received from I-CSCF.
   virtual void server_capabilities(const ServerCapabilities& caps);
 
+  /// As above, but shares the capabilities rather than copying them.  The
+  /// capabilities mustn't be modified once passed to the ACR.
+  /// @param   caps           Capabiliies as received from I-CSCF.
+  virtual void server_capabilities(std::shared_ptr<const ServerCapabilities> caps);
+
   /// Returns the JSON encoded message in string form.
   ///
   /// If the ACR has been cancelled, this function's behaviour is unspecified
@@ -151,7 +166,7 @@ public:
   ///
   /// An ACR can be accessed from multiple threads (if there are multiple
   /// SproutletTsx objects that use the same ACR), so those threads must call
-  /// lock() before accessing the ACR.
+  /// lock() before accessing the ACR (other than through rx_response()).
   virtual void lock();
 
   /// Release the lock on the ACR.
@@ -214,6 +229,55 @@ public:
 };
 
 
+/// Policy for which EVENT ACRs are sent to Ralf.  Session ACRs (START,
+/// INTERIM and STOP) are always sent, but a CDF that only bills sessions has
+/// no use for the EVENT ACRs generated for every REGISTER, SUBSCRIBE, NOTIFY
+/// and PUBLISH, so these can be suppressed per node functionality, node role
+/// and method.  Suppressed ACRs are dropped before their JSON is built, and
+/// are counted so the CDF operator still gets an aggregated view of them.
+class ACRPolicy
+{
+public:
+  /// Constructor.
+  /// @param suppressed_tbl       Counter of suppressed ACRs (may be NULL).
+  ACRPolicy(SNMP::CounterTable* suppressed_tbl = NULL);
+
+  /// Destructor.
+  ~ACRPolicy();
+
+  /// Adds rules parsed from a comma separated list, where each rule is of
+  /// the form <node>:<method>[:orig|:term], <node> is one of scscf, pcscf,
+  /// icscf, bgcf, ibcf, as or * (meaning all of them) and <method> is a SIP
+  /// method or *.  For example "scscf:REGISTER,*:NOTIFY:term".  Returns
+  /// false (having added none of the rules) if any rule is invalid.
+  bool add_rules(const std::string& rules);
+
+  /// Returns true if no EVENT ACRs are suppressed.
+  bool empty() const { return _empty; }
+
+  /// Called just before an EVENT ACR is sent.  Returns true (and counts the
+  /// ACR) if it should be dropped.
+  bool suppress_event(ACR::Node node, ACR::NodeRole role, const std::string& method);
+
+  /// The number of ACRs suppressed since the policy was created.
+  uint64_t suppressed_count() const { return _suppressed_count.load(); }
+
+private:
+  /// Node values run from SCSCF (0) to IBCF (7).
+  static const int NUM_NODES = ACR::IBCF + 1;
+  static const int NUM_ROLES = 2;
+
+  /// The methods whose EVENT ACRs are suppressed for each node and role.  A
+  /// method of * matches every method.
+  std::set<std::string> _methods[NUM_NODES][NUM_ROLES];
+
+  bool _empty;
+
+  SNMP::CounterTable* _suppressed_tbl;
+  std::atomic<uint64_t> _suppressed_count;
+};
+
+
 /// Implementation of the ACR for IMS Rf billing.
 class RalfACR : public ACR
 {
@@ -223,7 +287,8 @@ public:
           SAS::TrailId trail,
           Node node_functionality,
           Initiator initiator,
-          NodeRole role);
+          NodeRole role,
+          ACRPolicy* policy = NULL);
 
   /// Destructor.
   ~RalfACR();
@@ -276,6 +341,11 @@ public:
   /// @param   caps           Capabiliies as received from I-CSCF.
   virtual void server_capabilities(const ServerCapabilities& caps);
 
+  /// As above, but shares the capabilities rather than copying them.  The
+  /// capabilities mustn't be modified once passed to the ACR.
+  /// @param   caps           Capabiliies as received from I-CSCF.
+  virtual void server_capabilities(std::shared_ptr<const ServerCapabilities> caps);
+
   /// Returns the JSON encoded message in string form.
   /// @param   timestamp      Timestamp to be used as Event-Timestamp AVP.
   virtual std::string get_message(pj_time_val timestamp=unspec);
@@ -369,49 +439,77 @@ private:
                               const MediaDescription& media);
 
   void encode_media_components(rapidjson::Writer<rapidjson::StringBuffer>* writer,
-                               const std::vector<std::string>& sdp,
+                               const std::string& sdp,
                                SDPType sdp_type,
                                Initiator initiator_flag,
                                const std::string& initiator_party);
 
-  void split_sdp(const std::string& sdp, std::vector<std::string>& lines);
+  /// A received response, recorded without taking the ACR lock.  Only the
+  /// first final response needs the full ACR, so every other response just
+  /// records its status code and any charging function addresses, which are
+  /// applied when the log is next merged.
+  struct ResponseEvent
+  {
+    ResponseEvent* next;
+    int status_code;
+    bool has_charging_addresses;
+    std::list<std::string> ccfs;
+    std::list<std::string> ecfs;
+  };
+
+  /// Adds an event to the response log.  This is lock-free.
+  void log_response(ResponseEvent* event);
 
-  void store_charging_addresses(pjsip_msg* msg);
+  /// Applies the events in the response log to the ACR in the order they
+  /// were logged, and empties the log.  Must be called with the ACR lock
+  /// held (or when the ACR is only accessed from one thread).
+  void merge_response_log();
 
-  void store_subscription_ids(pjsip_msg* msg);
+  static bool find_charging_addresses(const HeaderIndex& hdrs,
+                                      std::list<std::string>& ccfs,
+                                      std::list<std::string>& ecfs);
+
+  void store_charging_addresses(const HeaderIndex& hdrs);
+
+  void store_subscription_ids(const HeaderIndex& hdrs);
 
   SubscriptionId uri_to_subscription_id(pjsip_uri* uri);
 
-  void store_calling_party_addresses(pjsip_msg* msg);
+  void store_calling_party_addresses(const HeaderIndex& hdrs);
 
   void store_called_party_address(pjsip_msg* msg);
 
-  void store_called_asserted_ids(pjsip_msg* msg);
+  void store_called_asserted_ids(const HeaderIndex& hdrs);
 
-  void store_associated_uris(pjsip_msg* msg);
+  void store_associated_uris(const HeaderIndex& hdrs);
 
-  void store_charging_info(pjsip_msg* msg);
+  void store_charging_info(const HeaderIndex& hdrs);
 
-  void store_media_description(pjsip_msg* msg,
+  void store_media_description(const HeaderIndex& hdrs,
                                MediaDescription& description);
 
-  void store_media_components(pjsip_msg* msg, MediaComponents& components);
+  void store_media_components(const HeaderIndex& hdrs,
+                              MediaComponents& components);
 
-  void store_message_bodies(pjsip_msg* msg);
+  void store_message_bodies(const HeaderIndex& hdrs);
 
   void store_instance_id(pjsip_msg* msg);
 
   std::string hdr_contents(pjsip_hdr* hdr);
 
-  pthread_mutex_t _acr_lock;
+  InstrumentedMutex _acr_lock;
 
   RalfProcessor* _ralf;
   SAS::TrailId _trail;
+  ACRPolicy* _policy;
 
   Initiator _initiator;
 
   bool _first_req;
-  bool _first_rsp;
+  std::atomic<bool> _first_rsp;
+
+  /// Responses received but not yet merged, most recent first.
+  std::atomic<ResponseEvent*> _response_log;
 
   std::list<std::string> _ccfs;
   std::list<std::string> _ecfs;
@@ -468,7 +566,7 @@ private:
 
   std::string _served_party_ip_address;
 
-  ServerCapabilities _server_caps;
+  std::shared_ptr<const ServerCapabilities> _server_caps;
 
   std::list<MessageBody> _msg_bodies;
 
@@ -498,8 +596,11 @@ public:
   /// @param ralf                 RalfProcessor pool set up to connect to
   ///                             Ralf cluster.
   /// @param node_functionality   Node-Functionality value to set in ACRs.
+  /// @param policy               Policy for suppressing EVENT ACRs (may be
+  ///                             NULL to send them all).
   RalfACRFactory(RalfProcessor* ralf,
-                 ACR::Node node_functionality);
+                 ACR::Node node_functionality,
+                 ACRPolicy* policy = NULL);
 
   /// Destructor.
   ~RalfACRFactory();
@@ -517,6 +618,7 @@ public:
 private:
   RalfProcessor* _ralf;
   ACR::Node _node_functionality;
+  ACRPolicy* _policy;
 };
 
 #endif
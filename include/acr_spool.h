@@ -0,0 +1,85 @@
+/**
+ * @file acr_spool.h Disk spool for ACRs that can't be sent to Ralf.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ACR_SPOOL_H__
+#define ACR_SPOOL_H__
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+#include "sas.h"
+
+/// An append-only, memory-mapped spool file of ACRs waiting to be sent to
+/// Ralf.
+///
+/// ACRs are appended at the write offset and taken from the read offset.
+/// The file never wraps - once every ACR in it has been taken both offsets
+/// go back to the start.  The offsets are kept in the file, so ACRs that were
+/// spooled but not replayed before a restart are replayed afterwards.
+class AcrSpool
+{
+public:
+  /// Constructor.
+  /// @param file_name          The spool file, created if it doesn't exist.
+  /// @param max_bytes          The size of the spool file.
+  AcrSpool(const std::string& file_name, size_t max_bytes);
+
+  /// Destructor.
+  ~AcrSpool();
+
+  /// Opens and maps the spool file.  Returns false if it can't be used.
+  bool init();
+
+  /// Appends an ACR to the spool.  Returns false if there isn't room.
+  bool append(const std::string& path,
+              const std::string& message,
+              SAS::TrailId trail);
+
+  /// Takes the oldest ACR from the spool.  Returns false if it's empty.
+  bool take(std::string& path,
+            std::string& message,
+            SAS::TrailId& trail);
+
+  /// Returns the number of ACRs in the spool.
+  uint32_t count();
+
+private:
+  /// The header at the start of the file.
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t read_offset;
+    uint64_t write_offset;
+  };
+
+  /// The header in front of each ACR in the file.
+  struct Record
+  {
+    uint32_t path_len;
+    uint32_t message_len;
+    uint64_t trail;
+  };
+
+  static const uint32_t MAGIC = 0x52414c46;
+
+  const std::string _file_name;
+  const size_t _max_bytes;
+
+  int _fd;
+  char* _map;
+  Header* _header;
+
+  std::mutex _lock;
+};
+
+#endif
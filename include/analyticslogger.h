@@ -15,8 +15,17 @@
 #ifndef ANALYTICSLOGGER_H__
 #define ANALYTICSLOGGER_H__
 
+#include <stdint.h>
 #include <sstream>
+#include <atomic>
+#include <thread>
 
+/// Writes analytics logs to syslog.
+///
+/// Logs are timestamped and queued on a lock-free ring by the thread making
+/// them, and written out to syslog in batches by a background thread, so a
+/// slow syslog never holds up SIP processing.  If the ring fills up, new logs
+/// are dropped (and counted) rather than waiting for room.
 class AnalyticsLogger
 {
 public:
@@ -25,6 +34,16 @@ public:
 
   void log_with_tag_and_timestamp(char* log);
 
+  /// Writes out the queued logs and stops the writer thread.  Subclasses
+  /// that override write() must call this from their destructor.
+  void stop();
+
+  /// Returns the number of logs dropped because the ring was full.
+  uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+  /// The number of logs that can be queued.
+  static const uint64_t RING_SIZE = 1024;
+
   virtual void registration(const std::string& aor,
                     const std::string& binding_id,
                     const std::string& contact,
@@ -50,8 +69,40 @@ public:
   virtual void call_disconnected(const std::string& call_id,
                          int reason);
 
+protected:
+  /// Writes a timestamped log.  This runs on the writer thread.
+  virtual void write(const char* log);
+
 private:
   static const int BUFFER_SIZE = 1000;
+  static const int TIMESTAMP_SIZE = 32;
+
+  /// A slot on the ring.  Its sequence number says whose turn it is - it is
+  /// free for the producer queueing the log at that position, and full (for
+  /// the writer) once it is one more than that.
+  struct Slot
+  {
+    std::atomic<uint64_t> seq;
+    char log[TIMESTAMP_SIZE + BUFFER_SIZE];
+  };
+
+  /// Body of the writer thread.
+  void writer();
+
+  /// Writes out all the logs in the ring.  Returns how many were written.
+  int drain();
+
+  Slot* _ring;
+
+  /// The next position for producers to claim.
+  std::atomic<uint64_t> _head;
+
+  /// The next position for the writer to write.  Only used by the writer.
+  uint64_t _tail;
+
+  std::atomic<uint64_t> _dropped;
+  std::atomic<bool> _stopping;
+  std::thread _writer;
 };
 
 #endif
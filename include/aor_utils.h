@@ -36,6 +36,12 @@ std::string pub_gruu_str(const Binding* binding, pj_pool_t* pool);
 // this binding has no GRUU.
 std::string pub_gruu_quoted_string(const Binding* binding, pj_pool_t* pool);
 
+// As pub_gruu_quoted_string, but prints the GRUU straight into the pool
+// rather than building strings.  Returns false if this binding has no GRUU.
+bool pub_gruu_quoted_pj_str(const Binding* binding,
+                            pj_pool_t* pool,
+                            pj_str_t& gruu);
+
 };
 
 #endif
@@ -9,11 +9,14 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <atomic>
 #include <map>
+#include <memory>
 #include <string>
 
 #include "pdlog.h"
 #include "alarm.h"
+#include "instrumented_mutex.h"
 
 #ifndef AS_COMMUNICATION_TRACKER_H_
 #define AS_COMMUNICATION_TRACKER_H_
@@ -30,14 +33,69 @@ public:
   /// @param as_ok_log     - The log to generate when communication to an AS
   ///                        has started succeeding again.
   ///
+  /// @param failure_threshold
+  ///                      - The number of consecutive failures after which an
+  ///                        AS's circuit breaker opens.  0 disables the
+  ///                        circuit breakers.
+  /// @param retry_interval_ms
+  ///                      - While an AS's circuit breaker is open, one
+  ///                        request is let through to it this often to test
+  ///                        whether it has recovered.
+  ///
   /// The object takes ownership of the alarm and the logs passed to it.
   AsCommunicationTracker(Alarm* alarm,
                          const PDLog2<const char*, const char*>* as_failed_log,
-                         const PDLog1<const char*>* as_ok_log);
+                         const PDLog1<const char*>* as_ok_log,
+                         int failure_threshold = 0,
+                         uint64_t retry_interval_ms = DEFAULT_RETRY_INTERVAL_MS);
 
   /// Destructor.
   virtual ~AsCommunicationTracker();
 
+  /// The state the tracker keeps for one AS.  The fields are only used by
+  /// the tracker.  Every field but the URI is atomic, so that successes,
+  /// failures and circuit breaker checks for an AS don't need the tracker's
+  /// lock.
+  struct AsSlot
+  {
+    AsSlot(const std::string& as_uri) :
+      uri(as_uri),
+      failures(0),
+      failed(false),
+      consecutive_failures(0),
+      retry_time_ms(0)
+    {}
+
+    const std::string uri;
+
+    // The number of failures since the last check of the ASs.
+    std::atomic<int> failures;
+
+    // Whether the AS is treated as failed - that is, the failed log has been
+    // generated and the OK log hasn't yet.  Only changed under the tracker's
+    // lock.
+    std::atomic<bool> failed;
+
+    // Circuit breaker state.  The circuit is open once consecutive_failures
+    // reaches the threshold, and the next probe is let through at
+    // retry_time_ms.
+    std::atomic<int> consecutive_failures;
+    std::atomic<uint64_t> retry_time_ms;
+  };
+
+  /// Finds the slot for an AS, creating it if this is the first time the AS
+  /// has been seen.  This takes the tracker's lock, so callers that report
+  /// on the same AS several times should look the slot up once and use the
+  /// methods below that take it.  Slots last as long as the tracker.
+  ///
+  /// @param as_uri - The URI of the AS in question.
+  AsSlot* slot(const std::string& as_uri);
+
+  /// Versions of the methods below for an AS that's already been looked up.
+  virtual void on_success(AsSlot* slot);
+  virtual void on_failure(AsSlot* slot, const std::string& reason);
+  virtual bool is_circuit_open(AsSlot* slot);
+
   /// Method to be called when communication to an Application Server succeeds.
   ///
   /// @param as_uri - The URI of the AS in question.
@@ -51,21 +109,39 @@ public:
   ///                 "SIP 500 response received"
   virtual void on_failure(const std::string& as_uri, const std::string& reason);
 
+  /// Method to be called before invoking an Application Server.  Returns true
+  /// if the AS's circuit breaker is open, in which case the caller should not
+  /// send the AS the request but apply the iFC's default handling straight
+  /// away.  Once every retry interval it returns false for one request, which
+  /// then probes whether the AS has recovered.
+  ///
+  /// @param as_uri - The URI of the AS in question.
+  virtual bool is_circuit_open(const std::string& as_uri);
+
+  static const uint64_t DEFAULT_RETRY_INTERVAL_MS = 10 * 1000;
+
 private:
-  // A lock that protects all member variables of this class.
-  pthread_mutex_t _lock;
+  // A lock that protects _slots and _num_failed, and is held while checking
+  // the ASs.
+  InstrumentedMutex _lock;
 
-  // A count of how many times we have had a communication failure to each AS
-  // in the last time period.
-  std::map<std::string, int> _as_failures;
+  // The slots for every AS seen, keyed by URI.
+  std::map<std::string, std::unique_ptr<AsSlot> > _slots;
 
-  // The time (in ms since the epoch) at which we should check the _as_failures
-  // to determine if some ASs are now OK again.
+  // The number of ASs that are treated as failed.  The alarm is raised while
+  // this is non-zero.
+  int _num_failed;
+
+  // The time (in ms since the epoch) at which we should check the slots to
+  // determine if some ASs are now OK again.
   std::atomic<uint64_t> _next_check_time_ms;
 
-  // The length of time that must pass between checks of _as_failures.
+  // The length of time that must pass between checks of the slots.
   const static uint64_t NEXT_CHECK_INTERVAL_MS = 5 * 60 * 1000;
 
+  const int _failure_threshold;
+  const uint64_t _retry_interval_ms;
+
   // The alarm to raise when communication to some Application Servers is
   // failing.
   Alarm* _alarm;
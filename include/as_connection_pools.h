@@ -0,0 +1,75 @@
+/**
+ * @file as_connection_pools.h Pools of connections to application servers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef AS_CONNECTION_POOLS_H__
+#define AS_CONNECTION_POOLS_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <string>
+#include <vector>
+
+#include "sip_connection_pool.h"
+
+/// Persistent pools of TCP connections to the application servers that iFCs
+/// route to.
+///
+/// Without pools, requests to an AS go through the PJSIP transport manager,
+/// which opens a single connection to the AS on demand and closes it when it
+/// is idle, so busy hours see connection churn and head-of-line blocking on
+/// that one connection.  With pools, each AS gets a SIPConnectionPool of
+/// several connections, which are kept open, recycled periodically, and
+/// picked between by load.
+///
+/// The S-CSCF learns the AS targets from the iFC ServerNames it routes to.
+/// Only ServerNames with transport=tcp are pooled, as for any other AS the
+/// transport is chosen when the request is resolved.  The pool for a target
+/// is created the first time a request is forwarded to it (rather than to a
+/// local Sproutlet), so the first few requests to each AS use the transport
+/// manager while the pool connects.
+namespace ASConnectionPools
+{
+  /// Sets the number of connections in each pool, and the average period in
+  /// seconds after which each is recycled.  Pools are disabled (the
+  /// default) if the number of connections is zero.  Must be called before
+  /// any requests are handled.
+  void configure(int num_connections,
+                 int recycle_period,
+                 pjsip_tpfactory* tp_factory);
+
+  /// Records an iFC ServerName as an AS target.  This is cheap if the target
+  /// is already known, so can be called every time the AS is invoked.
+  void add_target(const pjsip_sip_uri* server_name);
+
+  /// If the request is going to a known AS target and its pool has a
+  /// connection, sets the connection as the request's transport and returns
+  /// the pool, which the caller must tell when the request completes.
+  /// Otherwise leaves the request alone and returns NULL.
+  SIPConnectionPool* select(pjsip_tx_data* tdata);
+
+  /// The state of the pool to one AS target.
+  struct Stats
+  {
+    std::string target;
+    int connections;
+    int in_flight;
+  };
+
+  /// Returns the state of every pool, in target order.
+  std::vector<Stats> stats();
+
+  /// Destroys the pools, quiescing their connections.
+  void terminate();
+}
+
+#endif
@@ -18,6 +18,7 @@ extern "C" {
 }
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "log.h"
@@ -25,6 +26,10 @@ extern "C" {
 #include "ifchandler.h"
 #include "acr.h"
 #include "fifcservice.h"
+#include "hssconnection.h"
+#include "instrumented_mutex.h"
+#include "as_communication_tracker.h"
+#include "memory_accounting.h"
 
 // Forward declarations.
 class UASTransaction;
@@ -93,7 +98,8 @@ private:
           ACR* acr,
           FIFCService* fifc_service,
           IFCConfiguration ifc_configuration,
-          std::string scscf_uri);
+          std::string scscf_uri,
+          const HSSConnection::irs_info* irs_info);
   ~AsChain();
 
   bool inc_ref()
@@ -142,6 +148,9 @@ private:
     std::string as_uri;
     int status_code;
     bool timeout;
+    // The AS's slot in the communication tracker for its default handling,
+    // once it's been looked up.
+    AsCommunicationTracker::AsSlot* tracker_slot;
   } AsInformation;
   std::vector<AsInformation> _as_info;
 
@@ -170,6 +179,13 @@ private:
 
   // The S-CSCF URI for which this AsChain was created
   const std::string _scscf_uri;
+
+  /// The served user's subscriber state, as read from the HSS when the chain
+  /// was created, so that the S-CSCF transactions handling the request each
+  /// time it comes back from an AS needn't read it again.  Only valid if
+  /// _has_irs_info is set.
+  const bool _has_irs_info;
+  const HSSConnection::irs_info _irs_info;
 };
 
 
@@ -297,6 +313,14 @@ public:
     return (_as_chain != NULL) ? _as_chain->_scscf_uri : "";
   }
 
+  /// Returns the served user's subscriber state stored when the chain was
+  /// created, or NULL if there isn't any.
+  const HSSConnection::irs_info* irs_info() const
+  {
+    return ((_as_chain != NULL) && (_as_chain->_has_irs_info)) ?
+             &_as_chain->_irs_info : NULL;
+  }
+
   /// Called on receipt of each response from the AS.
   void on_response(int status_code);
 
@@ -330,7 +354,8 @@ public:
                                      ACR* acr,
                                      FIFCService* fifc_service,
                                      IFCConfiguration ifc_configuration,
-                                     std::string scscf_uri);
+                                     std::string scscf_uri,
+                                     const HSSConnection::irs_info* irs_info = NULL);
 
   pjsip_status_code on_initial_request(pjsip_msg* msg,
                                        std::string& server_name,
@@ -349,6 +374,21 @@ public:
     return is_set() ? _as_chain->_as_info[_index].as_uri : "";
   }
 
+  /// @return The communication tracker slot cached for the AS associated
+  /// with this AS chain link, or NULL if it hasn't been looked up.
+  AsCommunicationTracker::AsSlot* tracker_slot() const
+  {
+    return is_set() ? _as_chain->_as_info[_index].tracker_slot : NULL;
+  }
+
+  void set_tracker_slot(AsCommunicationTracker::AsSlot* slot)
+  {
+    if (is_set())
+    {
+      _as_chain->_as_info[_index].tracker_slot = slot;
+    }
+  }
+
 private:
   friend class AsChainTable;
 
@@ -400,7 +440,36 @@ private:
 
   static const int TOKEN_LENGTH = 10;
 
-  /// Map from ODI token to pair of (AsChain, index).
-  std::map<std::string, AsChainLink> _odi_token_map;
-  pthread_mutex_t _lock;
+  /// The number of shards the ODI tokens are spread over.
+  static const int NUM_SHARDS = 64;
+
+  /// The tokens are spread over a number of shards, each with its own lock,
+  /// so that calls on different AS chains don't contend.  A chain's tokens
+  /// are usually in different shards.
+  struct Shard
+  {
+    Shard() : lock("as_chain_table") {}
+
+    InstrumentedMutex lock;
+
+    /// Map from ODI token to pair of (AsChain, index).
+    std::unordered_map<std::string, AsChainLink> odi_token_map;
+  };
+
+  Shard& shard(const std::string& token)
+  {
+    // The low bits of the hash pick the bucket within the shard, so use
+    // the high bits to pick the shard.
+    return _shards[(std::hash<std::string>()(token) >> 32) % NUM_SHARDS];
+  }
+
+  Shard _shards[NUM_SHARDS];
+
+  /// The memory used by an entry in a shard's map - the entry itself and
+  /// the hash node's next pointer and cached hash.  The tokens are short
+  /// enough not to need allocating.
+  static const size_t ENTRY_BYTES =
+    sizeof(std::pair<const std::string, AsChainLink>) + 2 * sizeof(void*);
+
+  MemoryAccounting::Account* _memory_account;
 };
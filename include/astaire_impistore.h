@@ -15,6 +15,8 @@
 
 #include "store.h"
 #include "impistore.h"
+#include "snmp_event_accumulator_table.h"
+#include "utils.h"
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
@@ -23,8 +25,11 @@
 /// simple KV store API with atomic write and record expiry semantics.  The
 /// underlying store can be any implementation that implements the Store API.
 ///
-/// We read and write a JSON object representing the full IMPI, including its
-/// authentication challenges, keyed solely off its private ID.
+/// We read and write a JSON object or a compact binary record (see
+/// CompactEncoding) representing the full IMPI, including its authentication
+/// challenges, keyed solely off its private ID.  Records are always read in
+/// either format, so the format written can be changed without losing
+/// existing records.
 class AstaireImpiStore : public ImpiStore
 {
 public:
@@ -48,6 +53,9 @@ public:
     /// Serialization to JSON.
     std::string to_json();
 
+    /// Serialization to compact binary.
+    std::string to_binary();
+
     /// Memcached CAS value.
     uint64_t _cas;
 
@@ -55,9 +63,21 @@ public:
     friend class AstaireImpiStore;
   };
 
+  /// The format used when writing records.
+  enum Serialization
+  {
+    JSON,
+    BINARY
+  };
+
   /// Constructor.
   /// @param data_store    A pointer to the underlying data store.
-  AstaireImpiStore(Store* data_store);
+  /// @param serialization The format to write records in.
+  /// @param latency_tbl   Optional table to accumulate the latency of
+  ///                      operations on the underlying store in.
+  AstaireImpiStore(Store* data_store,
+                   Serialization serialization = Serialization::JSON,
+                   SNMP::EventAccumulatorTable* latency_tbl = NULL);
 
   /// Destructor.
   virtual ~AstaireImpiStore();
@@ -94,12 +114,29 @@ public:
   /// Deserialization from JSON.
   static AstaireImpiStore::Impi* from_json(const std::string& impi, rapidjson::Value* json);
 
+  /// Deserialization from compact binary.
+  static AstaireImpiStore::Impi* from_binary(const std::string& impi, const std::string& data);
+
+  /// Returns whether a stored record is in the compact binary format (rather
+  /// than JSON).
+  static bool is_binary(const std::string& data);
+
 private:
   /// Identifier for IMPI table.
   static const std::string TABLE_IMPI;
 
   /// The underlying data store.
   Store* _data_store;
+
+  /// The format to write records in.
+  Serialization _serialization;
+
+  /// Table to accumulate store latency in (may be NULL).
+  SNMP::EventAccumulatorTable* _latency_tbl;
+
+  /// Accumulate the latency of a store operation, timed by the specified
+  /// stopwatch.
+  void accumulate_latency(Utils::StopWatch& stopWatch);
 };
 
 #endif
@@ -0,0 +1,121 @@
+/**
+ * @file async_dnsresolver.h class definition for an asynchronous DNS resolver
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+///
+///
+
+#ifndef ASYNC_DNSRESOLVER_H__
+#define ASYNC_DNSRESOLVER_H__
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <ares.h>
+#include "sas.h"
+#include "baseresolver.h"
+#include "dnsresolver.h"
+
+/// @class AsyncDNSResolver
+///
+/// Asynchronous DNS resolver using the ares library.  A single ares channel is
+/// shared by all threads and driven by a dedicated event thread, so many
+/// queries can be in flight at once without any thread blocking on them.
+/// Concurrent queries for the same domain are coalesced into a single DNS
+/// query.  This class is thread-safe.
+class AsyncDNSResolver
+{
+public:
+  /// Callback for the result of a NAPTR query.  The reply is only valid for
+  /// the duration of the callback, and is NULL unless status is ARES_SUCCESS.
+  /// ttl is the number of seconds for which the result may be cached (see
+  /// DNSResolver::parse_ttl).  Callbacks are run on the resolver's event
+  /// thread, so must not block.
+  typedef std::function<void(int status,
+                             const struct ares_naptr_reply* naptr_reply,
+                             int ttl)>
+          NaptrCallback;
+
+  AsyncDNSResolver(const std::vector<struct IP46Address>& servers);
+  virtual ~AsyncDNSResolver();
+
+  /// Perform a NAPTR query for the specified domain, logging to the trail and
+  /// calling the callback with the result.
+  virtual void perform_naptr_query(const std::string& domain,
+                                   NaptrCallback callback,
+                                   SAS::TrailId trail);
+
+private:
+  /// A request for the result of a query.
+  struct Waiter
+  {
+    NaptrCallback callback;
+    SAS::TrailId trail;
+  };
+
+  /// A query that has been sent to the DNS server.
+  struct PendingQuery
+  {
+    AsyncDNSResolver* resolver;
+    std::string domain;
+    std::vector<Waiter> waiters;
+    int status;
+    struct ares_naptr_reply* naptr_reply;
+    int ttl;
+  };
+
+  // The event thread function - static, wrapping the member function below.
+  static void* event_thread(void* p);
+  // Drive the ares channel until the resolver is destroyed.
+  void event_loop();
+
+  // ares callback function - static, wrapping the member function below.
+  static void ares_callback(void* arg,
+                            int status,
+                            int timeouts,
+                            unsigned char* abuf,
+                            int alen);
+  // Handle receiving a NAPTR reply or timeout.  Called with _lock held.
+  void ares_callback(PendingQuery* query,
+                     int status,
+                     unsigned char* abuf,
+                     int alen);
+
+  // Run the callbacks for completed queries, and free them.  Must be called
+  // without _lock held (as the callbacks may issue further queries).
+  static void complete_queries(std::vector<PendingQuery*>& completed);
+
+  // Wake up the event thread from poll.
+  void wake_event_thread();
+
+  // Protects all of the fields below.
+  pthread_mutex_t _lock;
+
+  // The ares data structure that controls actually making the queries.
+  ares_channel _channel;
+  // Pointer to a linked list of servers
+  struct ares_addr_node _ares_addrs[DNSResolver::MAX_SERVERS];
+
+  // The queries that are in flight, indexed by domain.
+  std::map<std::string, PendingQuery*> _pending;
+
+  // Queries that have completed, but whose callbacks haven't yet been run.
+  std::vector<PendingQuery*> _completed;
+
+  // Pipe used to wake the event thread when a new query is sent.
+  int _wake_pipe[2];
+
+  bool _terminated;
+  pthread_t _thread;
+};
+
+#endif
@@ -0,0 +1,89 @@
+/**
+ * @file auth_timeout_batcher.h Definition of AuthTimeoutBatcher - sets one
+ * Chronos timer for each batch of authentication challenges.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef AUTH_TIMEOUT_BATCHER_H__
+#define AUTH_TIMEOUT_BATCHER_H__
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "chronosconnection.h"
+#include "sas.h"
+
+/// Sets the Chronos timers that check whether authentication challenges have
+/// timed out.
+///
+/// Rather than setting a timer for each challenge (and deleting it again when
+/// the challenge is answered), the challenges issued during each interval are
+/// collected up and a single timer is set for them all when the interval
+/// ends.  A challenge that is answered before then is simply dropped from the
+/// batch.  Challenges that are answered after the timer has been set are
+/// ignored when it pops, as their nonce count has moved on.
+class AuthTimeoutBatcher
+{
+public:
+  /// Constructor.
+  /// @param chronos     - The Chronos connection to set timers on.
+  /// @param interval_ms - How long to collect challenges for before setting
+  ///                      a timer for them.  This is capped so that the
+  ///                      timer always pops before the challenges expire.
+  AuthTimeoutBatcher(ChronosConnection* chronos, int interval_ms);
+  ~AuthTimeoutBatcher();
+
+  /// Adds a challenge to the current batch.
+  void add_challenge(const std::string& impi,
+                     const std::string& impu,
+                     const std::string& nonce,
+                     SAS::TrailId trail);
+
+  /// Removes a challenge that has been answered from the current batch, if it
+  /// is still in it.
+  void remove_challenge(const std::string& impi,
+                        const std::string& nonce);
+
+  /// Sets the timer for the current batch now.
+  void flush();
+
+  /// The longest interval that challenges are collected for.
+  static const int MAX_INTERVAL_MS = 5000;
+
+  /// How long after a batch is sent its timer pops.
+  static const int TIMEOUT_S = 30;
+
+private:
+  struct Challenge
+  {
+    std::string impi;
+    std::string impu;
+    std::string nonce;
+    SAS::TrailId trail;
+  };
+
+  void flusher();
+
+  ChronosConnection* _chronos;
+  const int _interval_ms;
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  bool _terminated;
+
+  // The current batch, indexed by IMPI and nonce.
+  std::map<std::string, Challenge> _batch;
+
+  std::thread _flusher;
+};
+
+#endif
@@ -19,11 +19,18 @@ extern "C" {
 #include <stdint.h>
 }
 
+#include <memory>
+#include <mutex>
+
 #include "pjutils.h"
 #include "stack.h"
 #include "acr.h"
 #include "sproutlet.h"
 #include "impistore.h"
+#include "impi_challenge_writer.h"
+#include "av_prefetcher.h"
+#include "auth_timeout_batcher.h"
+#include "sharded_lru_cache.h"
 #include "hssconnection.h"
 #include "chronosconnection.h"
 #include "acr.h"
@@ -101,7 +108,15 @@ public:
                           AnalyticsLogger* analytics_logger,
                           SNMP::AuthenticationStatsTables* auth_stats_tbls,
                           bool nonce_count_supported_arg,
-                          int cfg_max_expires);
+                          int cfg_max_expires,
+                          ExceptionHandler* exception_handler = NULL,
+                          int challenge_write_threads = 0,
+                          int challenge_cache_ttl = 0,
+                          int remote_store_timeout_ms = 0,
+                          int av_prefetch_count = 0,
+                          int av_prefetch_ttl = 0,
+                          int credential_cache_ttl = 0,
+                          int auth_timeout_batch_ms = 0);
   ~AuthenticationSproutlet();
 
   bool init();
@@ -118,16 +133,23 @@ private:
                             SAS::TrailId trail);
 
   /// Read an IMPI from the store (preferring the local store, but falling back
-  /// to GR stores if necessary).
+  /// to GR stores if necessary).  If challenges are written in the background
+  /// and the challenge with the specified nonce was written recently, this
+  /// returns an IMPI object holding just that challenge without reading the
+  /// store.
   ///
   /// @param impi  - The IMPI to read.
+  /// @param nonce - The nonce of the challenge the caller is interested in.
   /// @param trail - SAS trail ID.
   ///
   /// @return      - The IMPI object, or NULL if there was a store failure.
   ImpiStore::Impi* read_impi(const std::string& impi,
+                             const std::string& nonce,
                              SAS::TrailId trail);
 
-  /// Write a challenge to the IMPI stores. This handles GR replication.
+  /// Write a challenge to the IMPI stores. This handles GR replication.  If
+  /// challenges are written in the background this just queues the write,
+  /// and always succeeds.
   ///
   /// @param impi           - The IMPI the challenge relates to.
   /// @param auth_challenge - The challenge to write.
@@ -143,6 +165,13 @@ private:
                                 ImpiStore::Impi* impi_obj,
                                 SAS::TrailId trail);
 
+  /// Write a challenge to the IMPI stores now, handling GR replication.
+  /// Parameters are as for write_challenge.
+  Store::Status write_challenge_to_stores(const std::string& impi,
+                                          ImpiStore::AuthChallenge* auth_challenge,
+                                          ImpiStore::Impi* impi_obj,
+                                          SAS::TrailId trail);
+
   /// Write a challenge to a single store.
   ///
   /// @param store          - The store to write to.
@@ -161,6 +190,40 @@ private:
                                          ImpiStore::Impi* impi_obj,
                                          SAS::TrailId trail);
 
+  /// Cache a digest challenge that this node has issued or verified, so that
+  /// responses to it on non-REGISTER requests can be checked without reading
+  /// the IMPI store.  Does nothing if credentials aren't cached.
+  ///
+  /// @param impi           - The IMPI the challenge relates to.
+  /// @param auth_challenge - The challenge (which the caller keeps ownership
+  ///                         of).
+  void cache_credentials(const std::string& impi,
+                         ImpiStore::AuthChallenge* auth_challenge);
+
+  /// Look up a cached digest challenge.
+  ///
+  /// @return - A copy of the challenge (which the caller owns), or NULL if it
+  ///           isn't cached.
+  ImpiStore::AuthChallenge* find_credentials(const std::string& impi,
+                                             const std::string& nonce);
+
+  /// Record that a response to a cached challenge has been accepted, moving
+  /// the cached nonce count on past it.  This fails if a response with the
+  /// same (or a later) nonce count has already been accepted on this node,
+  /// which means the request may be a replay.
+  ///
+  /// @param impi        - The IMPI the challenge relates to.
+  /// @param nonce       - The challenge's nonce.
+  /// @param nonce_count - The nonce count on the response.
+  ///
+  /// @return            - Whether the nonce count was claimed.
+  bool claim_nonce_count(const std::string& impi,
+                         const std::string& nonce,
+                         uint32_t nonce_count);
+
+  /// Returns how long to cache a challenge for.
+  int credential_cache_ttl(ImpiStore::AuthChallenge* auth_challenge);
+
   friend class AuthenticationSproutletTsx;
 
   // Realm to use on AKA challenges.
@@ -171,6 +234,10 @@ private:
 
   ChronosConnection* _chronos;
 
+  // Sets one Chronos timer for each batch of challenges, or NULL if a timer is
+  // set for each challenge.
+  AuthTimeoutBatcher* _auth_timeout_batcher;
+
   // Factory for creating ACR messages for Rf billing.
   ACRFactory* _acr_factory;
 
@@ -179,6 +246,37 @@ private:
   ImpiStore* _impi_store;
   std::vector<ImpiStore*> _remote_impi_stores;
 
+  // How long to wait for writes to the remote IMPI stores (which are made in
+  // parallel with the write to the local store), or zero to wait for them to
+  // complete.
+  int _remote_store_timeout_ms;
+
+  // Writes challenges to the IMPI stores in the background, or NULL if they
+  // are written synchronously.
+  ImpiChallengeWriter* _challenge_writer;
+
+  // The number of recently written challenges to cache.
+  static const size_t CHALLENGE_CACHE_SIZE = 10000;
+
+  // Keeps pools of AVs fetched from the HSS in advance, or NULL if AVs are
+  // only fetched when they're needed.
+  AvPrefetcher* _av_prefetcher;
+
+  // The number of subscribers to keep prefetched AVs for.
+  static const size_t AV_PREFETCH_MAX_IMPIS = 10000;
+
+  // Digest challenges issued or verified on this node, keyed by IMPI and
+  // nonce, or NULL if they aren't cached.  Updates to the nonce counts of
+  // cached challenges are made under the lock, so that each nonce count is
+  // only accepted once.
+  ShardedLRUCache<std::string, std::shared_ptr<const ImpiStore::AuthChallenge>>* _credential_cache;
+  int _credential_cache_ttl;
+  std::mutex _credential_cache_lock;
+
+  // The number of challenges to cache credentials for.
+  static const size_t CREDENTIAL_CACHE_SIZE = 10000;
+  static const int CREDENTIAL_CACHE_SHARDS = 16;
+
   // Analytics logger.
   AnalyticsLogger* _analytics;
 
@@ -0,0 +1,139 @@
+/**
+ * @file av_prefetcher.h Definition of AvPrefetcher - keeps pools of unused
+ * authentication vectors fetched from the HSS in advance.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef AV_PREFETCHER_H__
+#define AV_PREFETCHER_H__
+
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "hssconnection.h"
+#include "sas.h"
+
+/// Keeps a small pool of unused authentication vectors for each IMPI that has
+/// recently been challenged, so that challenges can usually be issued without
+/// waiting for the HSS.
+///
+/// The first challenge for a subscriber gets its AV from the HSS as normal,
+/// and then a batch of AVs is requested from the HSS in the background to fill
+/// the subscriber's pool.  Each AV is only handed out once, and whenever one
+/// is taken the pool is topped up again.  AVs that have been in the pool for
+/// too long are discarded, and the pool is emptied on an AKA SQN resync
+/// (since the resync makes any AKA vectors fetched before it stale).
+///
+/// The background requests are made with HSSConnection's asynchronous API, so
+/// should only be used if that has its own request threads.
+class AvPrefetcher
+{
+public:
+  /// Constructor.
+  /// @param hss       - The connection to the HSS.
+  /// @param pool_size - Number of unused AVs to keep for each subscriber.
+  /// @param ttl       - Time in seconds for which to keep unused AVs.
+  /// @param max_impis - Maximum number of subscribers to keep AVs for.  When
+  ///                    this is reached the least recently challenged
+  ///                    subscriber's AVs are discarded.
+  AvPrefetcher(HSSConnection* hss,
+               int pool_size,
+               int ttl,
+               size_t max_impis);
+
+  /// Destructor.  Background requests that haven't completed yet are left to
+  /// complete, and their AVs are discarded.
+  ~AvPrefetcher();
+
+  /// Get an AV for a challenge, taking one from the pool if there is one and
+  /// getting one from the HSS otherwise.  This takes the same parameters as
+  /// HSSConnection::get_auth_vector, and the caller owns the returned AV.
+  ///
+  /// If resync_auth is set, the subscriber's pool is emptied and the AV is
+  /// always got from the HSS.
+  HTTPCode get_auth_vector(const std::string& private_user_id,
+                           const std::string& public_user_id,
+                           const std::string& auth_type,
+                           const std::string& resync_auth,
+                           const std::string& server_name,
+                           rapidjson::Document*& av,
+                           SAS::TrailId trail);
+
+  /// Discard all the unused AVs for an IMPI.
+  void invalidate(const std::string& private_user_id);
+
+  /// Returns the number of unused AVs held for an IMPI.
+  size_t num_avs(const std::string& private_user_id);
+
+private:
+  struct PooledAv
+  {
+    rapidjson::Document* av;
+    unsigned long expiry_ms;
+  };
+
+  struct Entry
+  {
+    std::deque<PooledAv> avs;
+
+    // The number of background requests for this entry that haven't
+    // completed.
+    int in_flight;
+
+    // Identifies this version of the entry.  This changes whenever the entry
+    // is invalidated, so that AVs requested before that are discarded.
+    uint64_t generation;
+
+    // This entry's position in the LRU list.
+    std::list<std::string>::iterator lru;
+  };
+
+  /// The state shared with the background requests, which may complete after
+  /// the prefetcher has been destroyed.
+  struct State
+  {
+    std::mutex lock;
+    std::map<std::string, Entry> entries;
+    std::list<std::string> lru;
+    uint64_t next_generation;
+    int ttl_ms;
+  };
+
+  // Entries are keyed on everything that is passed to the HSS, with the IMPI
+  // first so that all the entries for an IMPI can be found together.
+  static std::string key(const std::string& private_user_id,
+                         const std::string& public_user_id,
+                         const std::string& auth_type,
+                         const std::string& server_name);
+
+  // Remove an entry, deleting its AVs.  Must be called with the state lock
+  // held.
+  static void erase_entry(State* state,
+                          std::map<std::string, Entry>::iterator entry);
+
+  // Called when a background request completes.
+  static void on_prefetched(std::shared_ptr<State> state,
+                            const std::string& key,
+                            uint64_t generation,
+                            HTTPCode rc,
+                            rapidjson::Document* av);
+
+  static unsigned long now_ms();
+
+  HSSConnection* _hss;
+  int _pool_size;
+  size_t _max_impis;
+  std::shared_ptr<State> _state;
+};
+
+#endif
@@ -22,6 +22,8 @@
 #include "stack.h"
 #include "pjmodule.h"
 #include "acr.h"
+#include "stage_latency.h"
+#include "pj_str_index.h"
 
 /// Class implementing basic SIP proxy functionality.  Various methods in
 /// this class can be overriden to implement different proxy behaviours.
@@ -228,6 +230,10 @@ protected:
     /// initialised to a 408 Request Timeout response.
     pjsip_tx_data* _final_rsp;
 
+    /// When we started forwarding the current set of targets, used as the
+    /// start of each branch's setup time.  0 if we haven't started.
+    StageLatency::Ticks _forward_start;
+
     bool _pending_destroy;
     int _context_count;
 
@@ -260,8 +266,12 @@ protected:
     virtual void send_request();
 
     /// Cancels the pending transaction, using the specified status code in the
-    /// Reason header.
-    virtual void cancel_pending_tsx(int st_code, const std::string& reason);
+    /// Reason header.  If a Reason header is supplied (because all the forks
+    /// of a request are being cancelled), the CANCEL gets a copy of that
+    /// instead of building its own.
+    virtual void cancel_pending_tsx(int st_code,
+                                    const std::string& reason,
+                                    const pjsip_hdr* reason_hdr=NULL);
 
     /// Attempts a retry of the request.
     virtual bool retry_request();
@@ -349,6 +359,13 @@ protected:
     /// the maximum number of attempts has been attempted.
     bool get_next_server();
 
+    /// Sends the request to the first of the resolved servers.
+    void send_to_first_server();
+
+    /// Called on a worker thread when the next hop has been resolved
+    /// asynchronously.
+    void on_resolved(BaseAddrIterator* servers_iter);
+
     /// Owning proxy object.
     BasicProxy* _proxy;
 
@@ -375,6 +392,25 @@ protected:
     /// Iterator to the list of available servers.
     BaseAddrIterator* _servers_iter;
 
+    /// The blacklist states of the servers we're allowed to send to.
+    int _allowed_host_state;
+
+    /// Whether we're waiting for the next hop to be resolved.  The context
+    /// count is held while we wait.
+    bool _resolving;
+
+    /// Whether the transaction was cancelled while we were waiting for the
+    /// next hop to be resolved.
+    bool _cancelled_while_resolving;
+
+    /// When setup of this branch started, or 0 once the request has been
+    /// sent.
+    StageLatency::Ticks _setup_start;
+
+    /// When the request was sent to the current server, or 0 once it has
+    /// responded.
+    StageLatency::Ticks _sent_time;
+
     /// Current server target.
     Target _current_server;
 
@@ -454,7 +490,13 @@ protected:
   /// acting as a stateless proxy pool identified by the domain-name
   /// pool.example.com, then the `_stateless_proxies` set should contain the
   /// entry "pool.example.com", not one entry for each server.
-  std::set<std::string> _stateless_proxies;
+  ///
+  /// This is indexed on the (case-insensitive) host, so the next hop's host
+  /// can be looked up without copying it.
+  PjStrIndex<bool> _stateless_proxies;
+
+  /// Time from starting to fork a request to each branch being sent.
+  StageHistogram* _branch_setup_stage;
 
   friend class UASTsx; friend class UACTsx;
 };
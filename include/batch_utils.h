@@ -0,0 +1,62 @@
+/**
+ * @file batch_utils.h Utilities for processing batches of independent
+ * operations in parallel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BATCH_UTILS_H__
+#define BATCH_UTILS_H__
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+namespace BatchUtils
+{
+  /// The maximum number of threads used to process a batch.
+  const unsigned int MAX_BATCH_THREADS = 8;
+
+  /// Call fn(ii) for each ii in [0, count), using the calling thread and up
+  /// to max_threads - 1 other threads, and return once every call has
+  /// completed.  This allows the store and HTTP round trips for a batch of
+  /// subscribers to overlap rather than running one after another.
+  ///
+  /// fn must be safe to call concurrently with itself.  The other threads are
+  /// registered with PJSIP, so fn may send SIP messages.
+  void run_in_parallel(size_t count,
+                       const std::function<void(size_t ii)>& fn,
+                       unsigned int max_threads = MAX_BATCH_THREADS);
+
+  /// An operation on the store at one site.
+  struct SiteOperation
+  {
+    /// The name of the site, used in logs.
+    std::string site;
+
+    std::function<void()> fn;
+  };
+
+  /// Call local_fn on the calling thread and each of remote_ops on its own
+  /// thread, so that the round trips to each site overlap, and return once
+  /// every call has completed or deadline_ms has passed, whichever is first.
+  /// A deadline of zero means wait for every call to complete.
+  ///
+  /// Remote operations that are still running at the deadline carry on in the
+  /// background, so their functions must own (or share ownership of) any
+  /// state they use, and must not assume the caller is still waiting.  The
+  /// local operation always completes before this returns.
+  ///
+  /// @return - true if every remote operation completed by the deadline.
+  bool run_at_sites(const std::function<void()>& local_fn,
+                    const std::vector<SiteOperation>& remote_ops,
+                    int deadline_ms);
+}
+
+#endif
@@ -16,6 +16,7 @@
 #define BGCFSERVICE_H__
 
 #include <map>
+#include <memory>
 #include <string>
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
@@ -23,6 +24,9 @@
 #include <functional>
 #include "updater.h"
 #include "sas.h"
+#include "prefix_trie.h"
+#include "config_snapshot.h"
+#include "route_table.h"
 
 class BgcfService
 {
@@ -38,15 +42,52 @@ public:
   std::vector<std::string> get_route_from_number(const std::string &number,
                                                  SAS::TrailId trail) const;
 
+  /// A route - the URIs to route on to, in order.  For routes loaded from
+  /// JSON this refers to the loaded configuration (keeping it alive), so
+  /// nothing is copied.
+  typedef std::shared_ptr<const std::vector<std::string>> Route;
+
+  /// As get_route_from_domain and get_route_from_number, but return the
+  /// route without copying it, or NULL if there isn't one.
+  Route lookup_route_from_domain(const std::string &domain,
+                                 SAS::TrailId trail) const;
+  Route lookup_route_from_number(const std::string &number,
+                                 SAS::TrailId trail) const;
+
 private:
-  std::map<std::string, std::vector<std::string>> _domain_routes;
-  std::map<std::string, std::vector<std::string>> _number_routes;
+  /// The routes from a single load of the configuration.  This is never
+  /// modified once built - a reload builds a new table and swaps it in.
+  ///
+  /// The routes are either parsed from JSON configuration into the map and
+  /// trie, or (if the configuration file is a compiled route table) held in
+  /// the mapped table.
+  struct RouteTable
+  {
+    std::map<std::string, std::vector<std::string>> domain_routes;
+    PrefixTrie<std::vector<std::string>> number_routes;
+    std::shared_ptr<const CompiledRouteTable> compiled;
+
+    /// These return the matching route, or NULL.  Routes in the map and
+    /// trie are returned in place, and compiled routes are decoded into
+    /// scratch.
+    const std::vector<std::string>* find_domain(
+                                 const std::string& domain,
+                                 std::vector<std::string>& scratch) const;
+    const std::vector<std::string>* find_number(
+                                 const std::string& number,
+                                 std::vector<std::string>& scratch,
+                                 std::string& prefix) const;
+  };
+
+  /// Makes a Route for a route found in a table.
+  static Route make_route(const std::shared_ptr<const RouteTable>& routes,
+                          const std::vector<std::string>* route,
+                          std::vector<std::string>& scratch);
+
+  // The current route table.
+  ConfigSnapshot<RouteTable> _routes;
   std::string _configuration;
   Updater<void, BgcfService>* _updater;
-
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _routes_rw_lock;
 };
 
 #endif
@@ -27,8 +27,11 @@ extern "C" {
 #include "bgcfservice.h"
 #include "sproutlet.h"
 #include "enumservice.h"
+#include "tsx_arena.h"
 
 #include <map>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
@@ -67,15 +70,23 @@ private:
   ///
   /// @return            - The URIs to route the message on to (in order).
   /// @param domain      - The domain to find the route to.
-  std::vector<std::string> get_route_from_domain(const std::string &domain,
-                                                 SAS::TrailId trail) const;
+  BgcfService::Route get_route_from_domain(const std::string &domain,
+                                           SAS::TrailId trail) const;
 
   /// Lookup a route from the configured rules.
   ///
   /// @return            - The URIs to route the message on to (in order).
   /// @param number      - The number to route on
-  std::vector<std::string> get_route_from_number(const std::string &number,
-                                                 SAS::TrailId trail) const;
+  BgcfService::Route get_route_from_number(const std::string &number,
+                                           SAS::TrailId trail) const;
+
+  /// Gets a configured route URI, parsing it the first time it's used.
+  ///
+  /// @return            - A copy of the URI in the pool, or NULL if it isn't
+  ///                      a valid SIP URI.
+  /// @param route       - The route URI from the configuration.
+  /// @param pool        - The pool to copy the URI into.
+  pjsip_sip_uri* get_route_uri(const std::string& route, pj_pool_t* pool);
 
   /// Get an ACR instance from the factory.
   /// @param trail                SAS trail identifier to use for the ACR.
@@ -96,10 +107,19 @@ private:
   ACRFactory* _acr_factory;
 
   bool _override_npdi;
+
+  /// The route URIs parsed so far, indexed by the configured string (with
+  /// NULL for routes that aren't valid SIP URIs).  They're held in their own
+  /// pool, which is never freed until the sproutlet is.  This is bounded, as
+  /// a compiled route table may have very many different routes.
+  static const size_t MAX_ROUTE_URIS = 1024;
+  std::mutex _route_uris_lock;
+  std::unordered_map<std::string, pjsip_sip_uri*> _route_uris;
+  pj_pool_t* _route_uri_pool;
 };
 
 
-class BGCFSproutletTsx : public SproutletTsx
+class BGCFSproutletTsx : public SproutletTsx, public TsxArenaAllocated
 {
 public:
   BGCFSproutletTsx(BGCFSproutlet* bgcf);
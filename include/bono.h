@@ -15,9 +15,11 @@
 // Forward declarations.
 class UASTransaction;
 class UACTransaction;
+class Flow;
 
 #include <list>
 
+#include "utils.h"
 #include "pjutils.h"
 #include "analyticslogger.h"
 #include "stack.h"
@@ -28,6 +30,7 @@ class UACTransaction;
 #include "icscfrouter.h"
 #include "acr.h"
 #include "session_expires_helper.h"
+#include "timer_wheel.h"
 
 /// Short-lived data structure holding details of how we are to serve
 // this request.
@@ -101,6 +104,7 @@ public:
                             pjsip_tx_data* tdata,
                             TrustBoundary* trust,
                             ACR* acr,
+                            Flow* client_flow,
                             UASTransaction** uas_data_ptr);
   static UASTransaction* get_from_tsx(pjsip_transaction* tsx);
 
@@ -122,9 +126,6 @@ public:
   inline SAS::TrailId trail() { return (_tsx != NULL) ? get_trail(_tsx) : 0; }
   inline const char* name() { return (_tsx != NULL) ? _tsx->obj_name : "unknown"; }
 
-  void trying_timer_expired();
-  static void trying_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
-
   // Enters/exits this UASTransaction's context.  This takes a group lock,
   // single-threading any processing on this UASTransaction and associated
   // UACTransactions.  While in the UASTransaction's context, it will not be
@@ -145,7 +146,8 @@ private:
                  pjsip_rx_data* rdata,
                  pjsip_tx_data* tdata,
                  TrustBoundary* trust,
-                 ACR* acr);
+                 ACR* acr,
+                 Flow* client_flow);
   void log_on_tsx_start(const pjsip_rx_data* rdata);
   void log_on_tsx_complete();
   pj_status_t init_uac_transactions(TargetList& targets);
@@ -164,8 +166,6 @@ private:
                                int max_targets,
                                SAS::TrailId trail);
 
-  void cancel_trying_timer();
-
   pj_grp_lock_t*       _lock;      //< Lock to protect this UASTransaction and the underlying PJSIP transaction
   pjsip_transaction*   _tsx;
   int                  _num_targets;
@@ -203,10 +203,10 @@ private:
   /// Object to handle session expires processing.
   SessionExpiresHelper _se_helper;
 
-public:
-  pj_timer_entry       _trying_timer;
-  static const int     TRYING_TIMER = 1;
-  pthread_mutex_t      _trying_timer_lock;
+  /// The client's flow, if the request is an INVITE or BYE from or to a
+  /// client, so that dialog tracking doesn't have to find it again when the
+  /// transaction completes.  We hold a reference on it.  NULL otherwise.
+  Flow*                _client_flow;
 };
 
 // This is the data that is attached to the UAC transaction
@@ -231,6 +231,9 @@ public:
   void liveness_timer_expired();
 
   static void liveness_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
+  static void liveness_wheel_callback(TimerWheel::Entry* entry);
+  void start_liveness_timer();
+  void cancel_liveness_timer();
 
   // Enters/exits this UACTransaction's context.  This takes a group lock,
   // single-threading any processing on this UACTransaction, the associated
@@ -270,6 +273,16 @@ private:
   int                  _liveness_timeout;
   pj_timer_entry       _liveness_timer;
   static const int LIVENESS_TIMER = 1;
+
+  // The liveness timer's entry on a worker's timer wheel, which is used in
+  // preference to _liveness_timer when the timer is started on a worker.
+  TimerWheel::Entry    _liveness_wheel_entry;
+
+  // The upstream connection pool connection this transaction was sent on
+  // (if any), and how long it's been waiting for a response.
+  pjsip_transport*     _upstream_tp;
+  Utils::StopWatch     _upstream_stop_watch;
+  void upstream_request_complete(bool responded);
 };
 
 pj_status_t init_stateful_proxy(pj_bool_t enable_access_proxy,
@@ -287,7 +300,9 @@ pj_status_t init_stateful_proxy(pj_bool_t enable_access_proxy,
                                 QuiescingManager* quiescing_manager,
                                 bool icscf_enabled,
                                 bool scscf_enabled,
-                                bool emerg_reg_accepted);
+                                bool emerg_reg_accepted,
+                                bool upstream_least_loaded=false,
+                                bool upstream_affinity=false);
 
 void destroy_stateful_proxy();
 
@@ -14,6 +14,7 @@
 
 #include <string>
 #include <set>
+#include <map>
 
 #include "hssconnection.h"
 #include "subscriber_manager.h"
@@ -52,15 +53,25 @@ struct options
   int                                  pcscf_untrusted_port;
   int                                  pcscf_trusted_port;
   int                                  webrtc_port;
+  int                                  webrtc_threads;
   std::string                          upstream_proxy;
   int                                  upstream_proxy_port;
   int                                  upstream_proxy_connections;
   int                                  upstream_proxy_recycle;
+  bool                                 upstream_least_loaded;
+  bool                                 upstream_affinity;
   bool                                 ibcf;
   std::string                          external_icscf_uri;
   int                                  record_routing_model;
   int                                  default_session_expires;
   int                                  target_latency_us;
+  int                                  dependency_target_latency_us;
+  int                                  flight_recorder_threshold_ms;
+  int                                  worker_stall_threshold_ms;
+  bool                                 worker_stall_stacks;
+  std::vector<std::string>             warmup_targets;
+  std::string                          warmup_impus_file;
+  int                                  warmup_timeout_ms;
   std::string                          local_host;
   std::string                          public_host;
   std::string                          home_domain;
@@ -70,6 +81,8 @@ struct options
   std::string                          local_alias_hosts;
   std::string                          remote_alias_hosts;
   bool                                 always_serve_remote_aliases;
+  bool                                 stateless_in_dialog;
+  bool                                 collapse_record_routes;
   std::string                          trusted_hosts;
   bool                                 auth_enabled;
   std::string                          auth_realm;
@@ -81,10 +94,19 @@ struct options
   std::vector<std::string>             impi_stores;
   std::string                          ralf_server;
   int                                  ralf_threads;
+  int                                  ralf_batch_size;
+  int                                  ralf_batch_delay_ms;
+  std::string                          ralf_spool_file;
+  int                                  ralf_spool_size_mb;
+  int                                  ralf_max_queued_acrs;
+  int                                  ralf_spool_replay_rate;
+  std::string                          suppress_event_acrs;
   std::vector<std::string>             dns_servers;
   std::vector<std::string>             enum_servers;
   std::string                          enum_suffix;
   std::string                          enum_file;
+  bool                                 async_enum;
+  int                                  enum_cache_size;
   bool                                 default_tel_uri_translation;
   bool                                 analytics_enabled;
   std::string                          analytics_directory;
@@ -93,15 +115,40 @@ struct options
   std::string                          http_address;
   int                                  http_port;
   int                                  http_threads;
+  int                                  http_timer_threads;
+  int                                  http_provisioning_threads;
+  int                                  http_max_tasks;
   std::string                          billing_cdf;
   bool                                 emerg_reg_accepted;
   int                                  worker_threads;
+  int                                  max_worker_threads;
+  int                                  reserved_worker_threads;
+  int                                  quiesce_drain_rate;
+  int                                  pjsip_threads;
+  int                                  tdata_pool_cache_size;
+  int                                  udp_batch_size;
+  int                                  udp_rx_sockets;
+  bool                                 lazy_header_parsing;
+  bool                                 huge_page_pools;
+  bool                                 sas_message_logging_thread;
+  std::string                          sip_capture_dir;
+  int                                  sip_capture_file_size;
+  int                                  sip_capture_files;
+  std::vector<std::string>             sip_capture_filters;
+  bool                                 worker_affinity;
+  std::vector<int>                     worker_cpus;
   bool                                 log_to_file;
   std::string                          log_directory;
   int                                  log_level;
   bool                                 interactive;
   bool                                 daemon;
   bool                                 override_npdi;
+  bool                                 local_terminating_shortcut;
+  bool                                 cache_served_user_state;
+  std::map<std::string, int>           sproutlet_max_workers;
+  int                                  as_connections;
+  int                                  as_connection_recycle;
+  int                                  registration_prefetch_threads;
   int                                  max_tokens;
   float                                init_token_rate;
   float                                min_token_rate;
@@ -109,19 +156,30 @@ struct options
   int                                  cass_target_latency_us;
   int                                  exception_max_ttl;
   int                                  sip_blacklist_duration;
+  int                                  sip_resolver_threads;
+  int                                  sip_hot_targets;
+  int                                  sip_max_stale_targets;
+  bool                                 sip_latency_ordering;
   int                                  http_blacklist_duration;
   int                                  astaire_blacklist_duration;
   int                                  sip_tcp_connect_timeout;
   int                                  sip_tcp_send_timeout;
+  int                                  sip_tcp_send_queue_limit;
   int                                  dns_timeout;
   int                                  session_continued_timeout_ms;
   int                                  session_terminated_timeout_ms;
+  int                                  as_failure_threshold;
+  int                                  as_retry_interval_ms;
   std::set<std::string>                stateless_proxies;
   int                                  max_sproutlet_depth;
   std::string                          pbxes;
   std::string                          pbx_service_route;
   uint32_t                             non_register_auth_mode;
   bool                                 force_third_party_register_body;
+  int                                  third_party_register_rate;
+  int                                  third_party_refresh_percent;
+  int                                  initial_register_rate;
+  int                                  register_retry_after;
   std::string                          pidfile;
   std::map<std::string, std::multimap<std::string, std::string>>
                                        plugin_options;
@@ -131,6 +189,8 @@ struct options
   bool                                 nonce_count_supported;
   std::string                          scscf_node_uri;
   bool                                 sas_signaling_if;
+  int                                  sas_detail_percent;
+  int                                  sas_overload_detail_percent;
   bool                                 disable_tcp_switch;
   std::string                          chronos_hostname;
   std::string                          sprout_chronos_callback_uri;
@@ -139,7 +199,31 @@ struct options
   std::string                          dummy_app_server;
   bool                                 http_acr_logging;
   int                                  homestead_timeout;
+  int                                  hss_cache_ttl;
+  int                                  hss_cache_size;
+  int                                  hss_threads;
+  int                                  icscf_hss_cache_ttl;
+  int                                  icscf_hss_cache_size;
+  int                                  http2_connections;
+  int                                  homestead_hedge_percentile;
+  int                                  homestead_hedge_budget;
+  bool                                 http_compression;
+  int                                  aor_cache_ttl;
+  int                                  aor_cache_size;
+  int                                  simservs_cache_ttl;
+  int                                  simservs_cache_size;
+  bool                                 impi_store_binary;
+  int                                  impi_write_threads;
+  int                                  impi_cache_ttl;
+  int                                  impi_remote_store_timeout;
+  int                                  av_prefetch_count;
+  int                                  av_prefetch_ttl;
+  int                                  auth_credential_cache_ttl;
+  int                                  auth_timeout_batch_ms;
+  int                                  chronos_timer_batch_ms;
   int                                  request_on_queue_timeout;
+  int                                  request_deadline;
+  bool                                 deferred_load_reports;
   std::set<std::string>                blacklisted_scscfs;
   bool                                 enable_orig_sip_to_tel_coerce;
   bool                                 ram_record_everything;
@@ -160,6 +244,7 @@ extern SubscriberManager* subscriber_manager;
 extern ImpiStore* local_impi_store;
 extern std::vector<ImpiStore*> remote_impi_stores;
 extern RalfProcessor* ralf_processor;
+extern ACRPolicy* acr_policy;
 extern DnsCachedResolver* dns_resolver;
 extern HttpResolver* http_resolver;
 extern ACRFactory* scscf_acr_factory;
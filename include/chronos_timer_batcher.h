@@ -0,0 +1,125 @@
+/**
+ * @file chronos_timer_batcher.h Definition of ChronosTimerBatcher - coalesces
+ * the updates to the Chronos timers of AoRs.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CHRONOS_TIMER_BATCHER_H__
+#define CHRONOS_TIMER_BATCHER_H__
+
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "chronosconnection.h"
+#include "sas.h"
+
+/// A ChronosConnection that coalesces updates to existing timers.
+///
+/// S4 updates (or deletes) an AoR's Chronos timer every time it writes the
+/// AoR, so registration churn turns into one Chronos request per AoR write.
+/// This sits between S4 and the real connection.  Updates and deletes are
+/// collected for each interval, and only the last one for each timer is sent
+/// when the interval ends, all from one thread so they reuse its connection
+/// to Chronos.  An update that would leave the timer popping when it already
+/// does (within a second, the precision of a timer interval), with the same
+/// callback and body, isn't sent at all.
+///
+/// New timers are still created as they are asked for, as S4 needs their
+/// IDs straight away.  Updates and deletes are reported as successful when
+/// they're queued - a failure to send one is only logged.
+class ChronosTimerBatcher : public ChronosConnection
+{
+public:
+  /// Constructor.
+  /// @param chronos     - The Chronos connection to send requests on.
+  /// @param interval_ms - How long to collect updates for before sending
+  ///                      them.  This is capped so that a timer never pops
+  ///                      much later than it was asked to.
+  ChronosTimerBatcher(ChronosConnection* chronos, int interval_ms);
+  virtual ~ChronosTimerBatcher();
+
+  virtual HTTPCode send_delete(const std::string& delete_identity,
+                               SAS::TrailId trail);
+  virtual HTTPCode send_put(std::string& put_identity,
+                            uint32_t timer_interval,
+                            const std::string& callback_uri,
+                            const std::string& opaque_data,
+                            SAS::TrailId trail,
+                            const std::map<std::string, uint32_t>& tags);
+  virtual HTTPCode send_post(std::string& post_identity,
+                             uint32_t timer_interval,
+                             const std::string& callback_uri,
+                             const std::string& opaque_data,
+                             SAS::TrailId trail,
+                             const std::map<std::string, uint32_t>& tags);
+
+  /// Sends the updates collected so far now.
+  void flush();
+
+  /// The longest interval that updates are collected for.
+  static const int MAX_INTERVAL_MS = 1000;
+
+  /// The most timers whose last update is remembered (to spot updates that
+  /// don't change anything).  If there are more, they are all forgotten.
+  static const size_t MAX_TIMERS = 1000000;
+
+private:
+  // An update or delete waiting to be sent.
+  struct Update
+  {
+    bool del;
+    uint32_t timer_interval;
+    std::string callback_uri;
+    std::string opaque_data;
+    SAS::TrailId trail;
+    std::map<std::string, uint32_t> tags;
+  };
+
+  // What a timer was last set to - when it pops, and a hash of its callback,
+  // body and tags.
+  struct Timer
+  {
+    uint64_t pop_time_ms;
+    size_t hash;
+  };
+
+  static uint64_t now_ms();
+  static size_t hash(const std::string& callback_uri,
+                     const std::string& opaque_data,
+                     const std::map<std::string, uint32_t>& tags);
+
+  // Records what a timer has been set to.  Must be called with the lock held.
+  void record_timer(const std::string& timer_id,
+                    uint32_t timer_interval,
+                    size_t hash);
+
+  void flusher();
+
+  ChronosConnection* _chronos;
+  const int _interval_ms;
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  bool _terminated;
+
+  // The updates waiting to be sent, indexed by timer ID.
+  std::map<std::string, Update> _updates;
+
+  // The timers that have been set, indexed by timer ID.
+  std::unordered_map<std::string, Timer> _timers;
+
+  std::thread _flusher;
+};
+
+#endif
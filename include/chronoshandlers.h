@@ -12,6 +12,7 @@
 #ifndef CHRONOSHANDLERS_H__
 #define CHRONOSHANDLERS_H__
 
+#include "rapidjson/document.h"
 #include "handlers.h"
 
 class ChronosAuthTimeoutTask : public AuthTimeoutTask
@@ -27,6 +28,7 @@ public:
 
 protected:
   HTTPCode handle_response(std::string body);
+  HTTPCode handle_batch(const rapidjson::Value& challenges);
 };
 
 
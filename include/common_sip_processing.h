@@ -24,10 +24,14 @@ extern "C" {
 #include "snmp_counter_table.h"
 #include "snmp_counter_by_scope_table.h"
 #include "health_checker.h"
+#include "sas_message_log.h"
+#include "sip_capture.h"
 
 pj_status_t
 init_common_sip_processing(SNMP::CounterByScopeTable* requests_counter_arg,
-                           HealthChecker* health_checker_arg);
+                           HealthChecker* health_checker_arg,
+                           SasMessageLog* sas_message_log_arg = NULL,
+                           SipCapture* sip_capture_arg = NULL);
 
 void unregister_common_processing_module(void);
 
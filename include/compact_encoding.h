@@ -0,0 +1,99 @@
+/**
+ * @file compact_encoding.h Compact binary encoding for records held in
+ * memcached/Astaire.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef COMPACT_ENCODING_H__
+#define COMPACT_ENCODING_H__
+
+#include <string>
+#include <stdint.h>
+
+/// A record is encoded as a sequence of fields.  Each field starts with a
+/// varint holding the field's tag (a small number identifying the field,
+/// in place of a JSON field name) and its wire type, followed by either a
+/// varint value or a varint length and that many bytes.  Nested records are
+/// encoded as bytes fields.
+///
+/// Readers skip fields with tags that they don't recognise, so new fields can
+/// be added without changing the encoding's version.
+namespace CompactEncoding
+{
+  enum WireType
+  {
+    VARINT = 0,
+    BYTES = 2
+  };
+
+  /// Builds an encoded record.
+  class Writer
+  {
+  public:
+    void add_uint(uint32_t tag, uint64_t value);
+
+    /// Signed values are zigzag encoded, so small negative values are short.
+    void add_int(uint32_t tag, int64_t value);
+
+    void add_bytes(uint32_t tag, const std::string& value);
+
+    /// Add a nested record.
+    void add_record(uint32_t tag, const Writer& record);
+
+    /// Add a raw byte (for example a version header) that isn't a field.
+    void add_raw_byte(uint8_t value) { _data.push_back((char)value); }
+
+    const std::string& data() const { return _data; }
+
+  private:
+    void write_varint(uint64_t value);
+
+    std::string _data;
+  };
+
+  /// Reads the fields of an encoded record in turn.
+  class Reader
+  {
+  public:
+    Reader(const char* data, size_t length) :
+      _data(data),
+      _end(data + length),
+      _error(false) {}
+
+    Reader(const std::string& data) : Reader(data.data(), data.length()) {}
+
+    /// Read the next field.  Returns false once there are no more fields, or
+    /// if the record is badly formed (in which case error() returns true).
+    bool next(uint32_t& tag,
+              WireType& type,
+              uint64_t& uint_value,
+              std::string& bytes_value);
+
+    /// Read a raw byte that isn't a field.  Returns false at the end of the
+    /// record.
+    bool read_raw_byte(uint8_t& value);
+
+    bool error() const { return _error; }
+
+    /// Convert a zigzag encoded varint back to a signed value.
+    static int64_t to_int(uint64_t value)
+    {
+      return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+
+  private:
+    bool read_varint(uint64_t& value);
+
+    const char* _data;
+    const char* _end;
+    bool _error;
+  };
+};
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file config_snapshot.h Definition of ConfigSnapshot - holder for an
+ * immutable, hot-reloadable configuration object.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CONFIG_SNAPSHOT_H__
+#define CONFIG_SNAPSHOT_H__
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <pthread.h>
+
+/// Holds the current snapshot of a piece of configuration.
+///
+/// Configuration is never modified in place.  Instead, an update (typically
+/// from an Updater callback) builds a complete new object and publishes it
+/// with set().  Readers call get() to take a reference to the current
+/// snapshot, which stays valid for as long as they hold it, even if a new
+/// snapshot is published in the meantime.
+///
+/// Readers don't take any lock.  Each thread caches a reference to the
+/// snapshot it last saw along with a generation number, so in the common case
+/// (where nothing has changed) get() just reads the generation number and
+/// takes a reference on the cached snapshot.  A consequence is that an old
+/// snapshot is only freed once every thread that has used it has picked up
+/// the new one.
+template <class T>
+class ConfigSnapshot
+{
+public:
+  /// Construct a holder whose initial snapshot is a default-constructed T.
+  ConfigSnapshot() :
+    _current(std::make_shared<const T>()),
+    _generation(0)
+  {
+    pthread_key_create(&_thread_local, &ConfigSnapshot::destroy_cached);
+  }
+
+  ~ConfigSnapshot()
+  {
+    // Clean up this thread's cached snapshot now, rather than waiting for
+    // pthread_exit.  This supports use by single-threaded code (e.g., UTs).
+    // Any other threads that are still running and have a cached snapshot
+    // leak it, but in production this object lives as long as the process.
+    Cached* cached = (Cached*)pthread_getspecific(_thread_local);
+    if (cached != NULL)
+    {
+      pthread_setspecific(_thread_local, NULL);
+      delete cached;
+    }
+
+    pthread_key_delete(_thread_local);
+  }
+
+  /// Get the current snapshot.
+  std::shared_ptr<const T> get() const
+  {
+    // Read the generation before the snapshot - if a new snapshot is being
+    // published concurrently we might pick it up with the old generation, but
+    // that just means we'll fetch it again next time.
+    uint64_t generation = _generation.load(std::memory_order_acquire);
+    Cached* cached = (Cached*)pthread_getspecific(_thread_local);
+
+    if (cached == NULL)
+    {
+      cached = new Cached();
+      cached->snapshot = std::atomic_load(&_current);
+      cached->generation = generation;
+      pthread_setspecific(_thread_local, cached);
+    }
+    else if (cached->generation != generation)
+    {
+      cached->snapshot = std::atomic_load(&_current);
+      cached->generation = generation;
+    }
+
+    return cached->snapshot;
+  }
+
+  /// Publish a new snapshot.
+  void set(std::shared_ptr<const T> snapshot)
+  {
+    std::atomic_store(&_current, snapshot);
+    _generation.fetch_add(1, std::memory_order_release);
+  }
+
+private:
+  struct Cached
+  {
+    std::shared_ptr<const T> snapshot;
+    uint64_t generation;
+  };
+
+  static void destroy_cached(void* cached)
+  {
+    delete (Cached*)cached;
+  }
+
+  std::shared_ptr<const T> _current;
+  std::atomic<uint64_t> _generation;
+
+  // The thread-local store - used for each thread's cached snapshot.
+  pthread_key_t _thread_local;
+};
+
+#endif
@@ -21,8 +21,11 @@ extern "C" {
 }
 
 // Common STL includes.
+#include <atomic>
 #include <map>
 
+#include "instrumented_mutex.h"
+
 /// Interface that the ConnectionTracker notifies when quiescing connections has
 /// completed.
 class ConnectionsQuiescedInterface
@@ -34,7 +37,11 @@ public:
 class ConnectionTracker
 {
 public:
-  ConnectionTracker(ConnectionsQuiescedInterface *handler);
+  /// @param drain_rate - The most connections to shut down each second when
+  ///                      quiescing, so that clients reconnect to other nodes
+  ///                      gradually rather than all at once.  Zero means shut
+  ///                      them all down straight away.
+  ConnectionTracker(ConnectionsQuiescedInterface *handler, int drain_rate = 0);
   ~ConnectionTracker();
 
   /// Notify the connection tracker that a connection is active (usually because
@@ -42,8 +49,9 @@ public:
   void connection_active(pjsip_transport *tp);
 
   /// Quiesce all connections.  When this is called all current connections are
-  /// gracefully shutdown, and the connection tracker is put in a state where
-  /// subsequent new connections are also gracefully shutdown.
+  /// gracefully shutdown (at the drain rate, if there is one), and the
+  /// connection tracker is put in a state where subsequent new connections are
+  /// also gracefully shutdown.
   //
   /// It is only legal to call this method when the connection tracker is
   /// in normal operation (there has never been a call to quiesce, or there
@@ -59,18 +67,51 @@ public:
   void unquiesce();
 
 private:
-  // This must be held when accessing _connection_listeners, to avoid contention
-  // between the transport thread and websocket threads.
-  pthread_mutex_t _lock;
+  /// The connections are split across a number of shards, each with its own
+  /// lock, so that threads handling messages on different connections don't
+  /// contend.
+  static const int NUM_SHARDS = 16;
+
+  /// A shard of the connections known to the connection tracker, and their
+  /// state listeners.  This only includes connection-based transports (not
+  /// datagram transports).
+  ///
+  /// The lock must be held when accessing the listeners, to avoid contention
+  /// between the transport thread and websocket threads.  It is recursive as
+  /// shutting down a transport can call back into the tracker.
+  struct Shard
+  {
+    Shard() : lock("connection_tracker", true) {}
+
+    InstrumentedMutex lock;
+    std::map<pjsip_transport *, pjsip_tp_state_listener_key *> listeners;
+  };
+
+  Shard& shard_for(pjsip_transport *tp);
+
+  /// Shut down up to max_connections connections that haven't already been
+  /// shut down (or all of them, if max_connections is zero).  Returns whether
+  /// there are any left to shut down.
+  bool shutdown_connections(int max_connections);
+
+  // Called every second while draining connections.
+  static void on_drain_timer(pj_timer_heap_t* th, pj_timer_entry* e);
+
+  // The most connections to shut down each second when quiescing.
+  int _drain_rate;
+
+  // Timer for shutting down the next batch of connections.  Only accessed on
+  // the PJSIP transport thread.
+  pj_timer_entry _drain_timer;
+  bool _drain_timer_running;
+
+  Shard _shards[NUM_SHARDS];
 
-  // A map of all the connections known to the connection manager, and their
-  // state listeners.  This is a set of pjsip transports, but only includes
-  // connection-based transports (not datagram transports).
-  std::map<pjsip_transport *, pjsip_tp_state_listener_key *>
-                                                          _connection_listeners;
+  // The total number of connections across all the shards.
+  std::atomic<int> _num_connections;
 
   // Whether the connection manager is quiescing it's connections.
-  pj_bool_t _quiescing;
+  std::atomic<bool> _quiescing;
 
   // Pointer to the object that handles quiesce-complete notifications.
   ConnectionsQuiescedInterface *_on_quiesced_handler;
@@ -99,6 +99,8 @@ const pj_str_t STR_ISUB = pj_str((char*)"isub");
 const pj_str_t STR_EXT = pj_str((char*)"ext");
 const pj_str_t STR_USER_PHONE = pj_str((char*)"phone");
 const pj_str_t STR_DIALOG_ID = pj_str((char*)"dialog_id");
+const pj_str_t STR_COLLAPSED_RR = pj_str((char*)"crr");
+const pj_str_t STR_COLLAPSED_RR_FTAG = pj_str((char*)"crr-ftag");
 const pj_str_t STR_TARGET = pj_str((char*)"target");
 const pj_str_t STR_CONDITIONS = pj_str((char*)"conditions");
 const pj_str_t STR_NO_REPLY_TIMER = pj_str((char*)"no-reply-timer");
@@ -48,6 +48,66 @@ void add_implicit_filters(const pjsip_msg* msg,
 
 // Utility functions for comparing feature sets.
 enum MatchResult { YES, NO };
+
+// A single feature value, parsed ready for matching.
+struct FeatureValue
+{
+  enum Type { STRING, NUMERIC, TOKENS };
+
+  // Parses the value.  This never throws - an invalid numeric is only
+  // reported (by throwing FeatureParseError) if it is matched against.
+  explicit FeatureValue(std::string value);
+
+  Type type;
+
+  // The string literal (including the angle brackets), for STRING values.
+  std::string literal;
+
+  // The range, for NUMERIC values.
+  bool numeric_valid;
+  float minimum;
+  float maximum;
+
+  // The lower-cased and trimmed tokens, for TOKENS values.
+  std::vector<std::string> tokens;
+};
+
+// A feature predicate from an Accept-Contact or Reject-Contact header.  These
+// are parsed once per request rather than once for every binding they're
+// compared with.
+struct FeaturePredicate
+{
+  std::vector<std::pair<std::string, FeatureValue>> features;
+  bool explicit_match;
+  bool required_match;
+};
+
+FeaturePredicate compile_feature_predicate(pjsip_accept_contact_hdr* accept);
+FeaturePredicate compile_feature_predicate(pjsip_reject_contact_hdr* reject);
+
+// The features of a Contact.  Each feature is parsed the first time it is
+// looked up, so it's only parsed once however many predicates it's compared
+// with.
+class ContactFeatures
+{
+public:
+  ContactFeatures(const FeatureSet& feature_set) : _feature_set(feature_set) {}
+
+  // Returns the named feature, or NULL if the Contact doesn't have it.
+  const FeatureValue* find(const std::string& name);
+
+private:
+  const FeatureSet& _feature_set;
+  std::map<std::string, FeatureValue> _values;
+};
+
+MatchResult match_accept_predicate(ContactFeatures& contact_features,
+                                   const FeaturePredicate& accept);
+MatchResult match_reject_predicate(ContactFeatures& contact_features,
+                                   const FeaturePredicate& reject);
+MatchResult match_feature_values(const std::string& name,
+                                 const FeatureValue& matcher,
+                                 const FeatureValue& matchee);
 MatchResult match_feature_sets(const FeatureSet& contact_filter_set,
                                pjsip_accept_contact_hdr* accept);
 MatchResult match_feature_sets(const FeatureSet& contact_filter_set,
@@ -0,0 +1,32 @@
+/**
+ * @file cpu_affinity.h Pinning threads to sets of CPUs.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CPU_AFFINITY_H__
+#define CPU_AFFINITY_H__
+
+#include <string>
+#include <vector>
+
+namespace CpuAffinity
+{
+  /// Parses a list of CPUs in the form used by taskset and cpusets, for
+  /// example "0-7,16-23".  On success, cpus holds the CPUs in ascending order
+  /// without duplicates.  Returns false if the list is empty or invalid.
+  bool parse_cpu_list(const std::string& list, std::vector<int>& cpus);
+
+  /// Restricts the calling thread to the given CPUs.  Linux allocates memory
+  /// on the NUMA node of the CPU that first touches it, so pinning a thread to
+  /// the CPUs of one node also keeps the memory it allocates (such as its
+  /// pools) local to it.  Returns false if the thread couldn't be pinned.
+  bool pin_current_thread(const std::vector<int>& cpus);
+}
+
+#endif
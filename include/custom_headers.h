@@ -17,8 +17,10 @@ extern "C" {
 #include <pjsip/print_util.h>
 }
 
-// Main entry point
-pj_status_t register_custom_headers();
+// Main entry point.  If lazy is set, the IMS headers are stored unparsed when
+// a message is received, and only parsed when they are first looked up (see
+// pjsip_lazy_hdr below).  This can be called again to change the mode.
+pj_status_t register_custom_headers(bool lazy = false);
 
 /// Custom header structures.
 
@@ -71,8 +73,44 @@ typedef struct pjsip_reject_contact_hdr {
   pjsip_param feature_set;
 } pjsip_reject_contact_hdr;
 
+/// A header whose parsing has been deferred.  This holds the header's raw
+/// value, which it prints unchanged, until it is first looked up through
+/// PJUtils::find_hdr_by_name (or PJUtils::find_hdr_by_names or a
+/// HeaderIndex), at which point parse_lazy_hdr replaces it in the message with
+/// the headers its parser builds.  If the value can't be parsed, the header
+/// stays in the message but lookups skip over it.
+///
+/// Code that only reads a header can look it up with PJUtils::peek_hdr_by_name
+/// instead, which parses it (using peek_lazy_hdr) without replacing it.  The
+/// header stays clean, so it's still forwarded by copying the bytes that were
+/// received rather than by printing the parsed header.
+///
+/// Code must never cast a header found any other way to one of the custom
+/// header structures above when lazy parsing is enabled.
+typedef struct pjsip_lazy_hdr {
+  PJSIP_DECL_HDR_MEMBER(struct pjsip_lazy_hdr);
+  pj_str_t hvalue;
+  pj_pool_t* pool;
+  pjsip_parse_hdr_func* parser;
+
+  // Once the value has been parsed, parsed is the first header the parser
+  // returned (or NULL if the value was invalid).  The header is dirty once
+  // the parsed headers have replaced it in the message.
+  pj_bool_t is_parsed;
+  pj_bool_t is_dirty;
+  pjsip_hdr* parsed;
+} pjsip_lazy_hdr;
+
 /// Utility functions (parse, create, init, clone, print_on)
 
+// Lazily parsed headers
+bool is_lazy_hdr(const pjsip_hdr* hdr);
+pjsip_hdr* parse_lazy_hdr(pjsip_hdr* hdr);
+const pjsip_hdr* peek_lazy_hdr(pjsip_hdr* hdr);
+void* pjsip_lazy_hdr_clone(pj_pool_t* pool, const void* o);
+void* pjsip_lazy_hdr_shallow_clone(pj_pool_t* pool, const void* o);
+int pjsip_lazy_hdr_print_on(void* h, char* buf, pj_size_t len);
+
 // Privacy
 pjsip_generic_array_hdr* pjsip_privacy_hdr_create( pj_pool_t *pool, const pj_str_t *hnames);
 pjsip_hdr* parse_hdr_privacy(pjsip_parse_ctx* ctx);
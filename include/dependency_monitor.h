@@ -0,0 +1,86 @@
+/**
+ * @file dependency_monitor.h Overload control for each downstream dependency.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef DEPENDENCY_MONITOR_H__
+#define DEPENDENCY_MONITOR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+
+/// Tracks the latency of each of the downstream services Sprout depends on,
+/// and sheds requests that need a service that is running slowly.
+///
+/// The LoadMonitor throttles all requests when Sprout as a whole is slow.
+/// When one dependency slows down the worker threads block on it, so the
+/// LoadMonitor ends up throttling requests that don't need that dependency
+/// at all.  This keeps a separate budget for each dependency instead.
+///
+/// Each dependency has a smoothed latency.  While it is over the target, the
+/// proportion of requests that need the dependency that are shed rises
+/// multiplicatively, and once it's back under the target the proportion
+/// falls linearly.  A few requests are always admitted, so that the latency
+/// can be seen to recover.
+class DependencyMonitor
+{
+public:
+  enum Dependency
+  {
+    HSS = 0,
+    STORE,
+    ENUM,
+    XDMS,
+    NUM_DEPENDENCIES
+  };
+
+  /// A set of dependencies, as a bitmask.
+  typedef uint32_t Dependencies;
+
+  static Dependencies mask(Dependency dependency)
+  {
+    return 1u << dependency;
+  }
+
+  /// Constructor.
+  /// @param target_latency_us - The target latency of each dependency.
+  DependencyMonitor(unsigned long target_latency_us);
+  ~DependencyMonitor();
+
+  /// Records the latency of a request to a dependency.
+  void request_complete(Dependency dependency, unsigned long latency_us);
+
+  /// Returns whether to admit a request that needs the given dependencies.
+  bool admit(Dependencies dependencies);
+
+  /// Returns the proportion (in thousandths) of requests needing the
+  /// dependency that are being shed.
+  int shed_per_mille(Dependency dependency) const;
+
+  /// Number of latency samples between adjustments of the shed rate.
+  static const int ADJUST_PERIOD = 20;
+
+  /// The most requests that are ever shed, in thousandths.
+  static const int MAX_SHED_PER_MILLE = 900;
+
+private:
+  struct State
+  {
+    pthread_mutex_t lock;
+    double smoothed_latency_us;
+    int samples;
+    std::atomic<int> shed_per_mille;
+  };
+
+  const unsigned long _target_latency_us;
+  State _state[NUM_DEPENDENCIES];
+};
+
+#endif
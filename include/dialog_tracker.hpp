@@ -18,20 +18,27 @@ class DialogTracker {
   FlowTable* _ft;
 public:
   DialogTracker(FlowTable* ft): _ft(ft) {};
+
+  /// If the caller already holds a reference to the client's flow (for
+  /// example, one cached on the transaction when it was created) it can
+  /// pass it as client_flow, and the flow isn't looked up again.
   void on_uas_tsx_complete(const pjsip_tx_data* original_request,
                            const pjsip_transaction* tsx,
                            const pjsip_event* event,
-                           bool is_client);
+                           bool is_client,
+                           Flow* client_flow = NULL);
 private:
   void on_dialog_start(const pjsip_tx_data* original_request,
                        const pjsip_transaction* tsx,
                        const pjsip_event* event,
-                       bool is_client);
+                       bool is_client,
+                       Flow* client_flow);
 
   void on_dialog_end(const pjsip_tx_data* original_request,
                      const pjsip_transaction* tsx,
                      const pjsip_event* event,
-                     bool is_client);
+                     bool is_client,
+                     Flow* client_flow);
 
   Flow* get_client_flow(const pjsip_tx_data* original_request,
                        const pjsip_transaction* tsx,
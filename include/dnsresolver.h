@@ -16,6 +16,7 @@
 #define DNSRESOLVER_H__
 
 #include <string>
+#include <vector>
 #include <netinet/in.h>
 #include <ares.h>
 #include "sas.h"
@@ -35,17 +36,43 @@ public:
   // Helper function wrapping the destructor for use as thread-local callbacks.
   static void destroy(DNSResolver* resolver);
   // Perform a NAPTR query for the specified domain, returning the results in
-  // the naptr_reply structure, and logging to the trail.  The caller must
-  // call free_naptr_reply when it has finished with naptr_reply.
-  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail);
+  // the naptr_reply structure, and logging to the trail.  ttl is set to the
+  // number of seconds for which the result may be cached (see parse_ttl).
+  // The caller must call free_naptr_reply when it has finished with
+  // naptr_reply.
+  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail);
   // Free a naptr_reply structure.
   virtual void free_naptr_reply(struct ares_naptr_reply* naptr_reply) const;
 
+  // The maximum number of DNS servers that are used.
+  static const int MAX_SERVERS = 3;
+
+  // Initialize an ares channel to query the specified servers (up to
+  // MAX_SERVERS of them), using the given array to hold the server list.
+  static void init_channel(ares_channel* channel,
+                           struct ares_addr_node ares_addrs[MAX_SERVERS],
+                           const std::vector<struct IP46Address>& servers);
+
+  // Work out how long (in seconds) the result of a NAPTR query may be cached
+  // for, given its status and the raw DNS response.  For a successful query
+  // this is the lowest TTL of the NAPTR records.  For a negative response it
+  // is taken from the SOA record in the authority section (RFC 2308).
+  // Returns 0 if the result must not be cached.
+  static int parse_ttl(int status, const unsigned char* abuf, int alen);
+
 private:
   // Send a query for the specified domain.
   void send_naptr_query(const std::string& domain, SAS::TrailId trail);
   // Wait for a response to the query.
   void wait_for_response();
+  // Advance ptr past the (possibly compressed) domain name it points to.
+  // Returns false if the name is not valid.
+  static bool skip_name(const unsigned char*& ptr,
+                        const unsigned char* abuf,
+                        int alen);
+  // Read a 16 or 32 bit value in network byte order.
+  static inline int read_u16(const unsigned char* ptr) { return (ptr[0] << 8) | ptr[1]; }
+  static inline unsigned int read_u32(const unsigned char* ptr) { return ((unsigned int)read_u16(ptr) << 16) | read_u16(ptr + 2); }
   // ares callback function - static, wrapping the member function below.
   static void ares_callback(void* arg,
                             int status,
@@ -74,8 +101,11 @@ private:
   // The reply data structure.  Only valid between ares_callback and
   // perform_naptr_query returning, and only if _status is ARES_SUCCESS.
   struct ares_naptr_reply* _naptr_reply;
+  // The TTL of the last query.  Only valid between ares_callback and
+  // perform_naptr_query returning.
+  int _ttl;
   // Pointer to a linked list of servers
-  struct ares_addr_node _ares_addrs[3];
+  struct ares_addr_node _ares_addrs[MAX_SERVERS];
 
 };
 
@@ -15,8 +15,13 @@
 #ifndef ENUMSERVICE_H__
 #define ENUMSERVICE_H__
 
+#include <functional>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
 #include <netinet/in.h>
@@ -24,8 +29,14 @@
 #include "sas.h"
 #include "baseresolver.h"
 #include "dnsresolver.h"
+#include "async_dnsresolver.h"
+#include "sharded_lru_cache.h"
+#include "prefix_trie.h"
+#include "config_snapshot.h"
+#include "route_table.h"
 #include "communicationmonitor.h"
 #include "updater.h"
+#include "number_normalizer.h"
 
 /// @class EnumService
 ///
@@ -41,6 +52,41 @@ public:
   /// Translate a PSTN number to a SIP URI.
   virtual std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const = 0;
 
+  /// Callback for an asynchronous ENUM lookup.  The string is the translated
+  /// SIP URI, or empty if the lookup failed.
+  typedef std::function<void(std::string)> LookupCallback;
+
+  /// Translate a PSTN number to a SIP URI asynchronously, calling the callback
+  /// with the result.  By default this just does the lookup synchronously and
+  /// calls the callback inline - services that do network I/O override this
+  /// to run the callback on a worker thread once the lookup completes.
+  virtual void lookup_uri_from_user_async(const std::string& user,
+                                          LookupCallback callback,
+                                          SAS::TrailId trail) const
+  {
+    callback(lookup_uri_from_user(user, trail));
+  }
+
+  /// Whether lookup_uri_from_user_async can finish after it returns (so the
+  /// callback may run later, on another thread).  If not, it's no better
+  /// than the synchronous lookup.
+  virtual bool has_async_lookup() const { return false; }
+
+  /// Translate a PSTN number to a SIP URI, reusing the answer to an earlier
+  /// lookup of the same number on the same SAS trail.  The sproutlets that
+  /// handle a request can each translate it (for example, the S-CSCF at the
+  /// end of originating processing and then the BGCF), and this saves
+  /// repeating the lookup.  Answers are only kept for a few seconds, so they
+  /// don't outlive the transaction.
+  std::string memoized_lookup_uri_from_user(const std::string& user,
+                                            SAS::TrailId trail) const;
+
+  /// The asynchronous equivalent of memoized_lookup_uri_from_user.  A
+  /// remembered answer is passed to the callback straight away.
+  void memoized_lookup_uri_from_user_async(const std::string& user,
+                                           LookupCallback callback,
+                                           SAS::TrailId trail) const;
+
   // Parse a string of the form !<regex>!<replace>! into a regular expression
   // and a replacement string.
   static bool parse_regex_replace(const std::string& regex_replace, boost::regex& regex, std::string& replace);
@@ -50,9 +96,38 @@ public:
   // first character, or just 0-9 for subsequent characters.  Since the ENUM
   // "First Well Known Rule" is the identity, the Application Unique String is
   // also the first key to use.
-  static const boost::regex CHARS_TO_STRIP_FROM_UAS;
-  static std::string user_to_aus(const std::string& user) { return boost::regex_replace(user, CHARS_TO_STRIP_FROM_UAS, std::string("")); };
+  static std::string user_to_aus(const std::string& user) { return NumberNormalizer::to_aus(user); };
+
+private:
+  /// A remembered answer, and when to forget it.
+  struct Memo
+  {
+    std::string uri;
+    unsigned long expiry_ms;
+  };
+
+  typedef std::map<std::pair<SAS::TrailId, std::string>, Memo> Memos;
 
+  static unsigned long now_ms();
+
+  /// Finds the remembered answer for a lookup, if there is one.
+  bool find_memo(const std::string& user,
+                 SAS::TrailId trail,
+                 std::string& uri) const;
+
+  /// Remembers the answer to a lookup.
+  void add_memo(const std::string& user,
+                SAS::TrailId trail,
+                const std::string& uri) const;
+
+  /// How long answers are remembered for.
+  static const unsigned long MEMO_LIFETIME_MS = 2000;
+
+  /// The number of answers at which expired ones are forgotten.
+  static const size_t MAX_MEMOS = 1024;
+
+  mutable std::mutex _memos_lock;
+  mutable Memos _memos;
 };
 
 
@@ -95,16 +170,31 @@ private:
     std::string replace;
   };
 
-  std::vector<NumberPrefix> _number_prefixes;
-  std::map<std::string, NumberPrefix> _prefix_regex_map;
+  /// The number prefixes from a single load of the configuration.  This is
+  /// never modified once built - a reload builds a new table and swaps it in.
+  ///
+  /// If the configuration file is a compiled route table, the number prefixes
+  /// are held in the mapped table instead, and each prefix's regular
+  /// expression is compiled the first time it is used.
+  struct NumberPrefixTable
+  {
+    std::vector<NumberPrefix> number_prefixes;
+    PrefixTrie<NumberPrefix> prefix_trie;
+    std::shared_ptr<const CompiledRouteTable> compiled;
+    // Indexed by entry in the compiled table.  Each slot is set (atomically)
+    // at most once, and never changed after that.
+    mutable std::vector<std::shared_ptr<const NumberPrefix>> compiled_prefixes;
+  };
+
+  // The current number prefix table.
+  ConfigSnapshot<NumberPrefixTable> _number_prefixes;
   std::string _configuration;
   Updater<void, JSONEnumService>* _updater;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _number_prefixes_rw_lock;
-
-  const NumberPrefix* prefix_match(const std::string& number) const;
+  static const NumberPrefix* prefix_match(const NumberPrefixTable& table,
+                                          const std::string& number);
+  static const NumberPrefix* compiled_prefix_at(const NumberPrefixTable& table,
+                                                int idx);
 };
 
 /// @class DNSEnumService
@@ -117,14 +207,23 @@ public:
                  const std::string& dns_suffix = ".e164.arpa",
                  const DNSResolverFactory* resolver_factory =
                                                        new DNSResolverFactory(),
-                 CommunicationMonitor* comm_monitor = NULL);
+                 CommunicationMonitor* comm_monitor = NULL,
+                 bool async_resolver = false,
+                 size_t cache_size = 0,
+                 const ShardedLRUCacheStatsTables& cache_stats_tbls =
+                                                 ShardedLRUCacheStatsTables());
   ~DNSEnumService();
 
   std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const;
 
-  // Characters to strip from a key before turning it into a domain.  This is
-  // all non-digit characters.
-  static const boost::regex CHARS_TO_STRIP_FROM_DOMAIN;
+  /// If the service was created with an asynchronous resolver, this runs the
+  /// lookup without blocking the calling thread, and the callback is run on
+  /// a worker thread.
+  void lookup_uri_from_user_async(const std::string& user,
+                                  LookupCallback callback,
+                                  SAS::TrailId trail) const;
+
+  bool has_async_lookup() const { return (_async_resolver != NULL); }
 
 private:
   /// @class Rule
@@ -163,6 +262,70 @@ private:
   // Maximum number of DNS queries per request.
   static const int MAX_DNS_QUERIES = 5;
 
+  // Number of shards in the NAPTR cache.
+  static const int NUM_CACHE_SHARDS = 16;
+
+  /// The result of a NAPTR query for a single domain, as held in the cache.
+  struct NaptrResult
+  {
+    int status;
+    // The rules from the reply, sorted by order and preference.  Only set if
+    // status is ARES_SUCCESS.
+    std::vector<Rule> rules;
+  };
+
+  typedef ShardedLRUCache<std::string, std::shared_ptr<const NaptrResult> >
+          NaptrCache;
+
+  /// The state of a single ENUM lookup, which may span several DNS queries.
+  struct LookupState
+  {
+    std::string user;
+    // The Application Unique String, and the current key (or, once complete,
+    // the result).
+    std::string aus;
+    std::string string;
+    bool complete;
+    bool failed;
+    bool server_failed;
+    int dns_queries;
+    SAS::TrailId trail;
+
+    // Whether another query is needed.
+    bool more_queries() const
+    {
+      return ((!complete) && (!failed) && (dns_queries < MAX_DNS_QUERIES));
+    }
+  };
+
+  // Start a lookup, logging to SAS.
+  static void start_lookup(const std::string& user,
+                           SAS::TrailId trail,
+                           LookupState& state);
+  // Build a NaptrResult from the result of a NAPTR query.
+  static std::shared_ptr<const NaptrResult> make_naptr_result(
+                                   int status,
+                                   const struct ares_naptr_reply* naptr_reply);
+  // Process the result of the NAPTR query for the current key.
+  static void process_naptr_result(const NaptrResult& result,
+                                   LookupState& state);
+  // Look up a domain in the NAPTR cache.  Returns true if the result was
+  // found.
+  bool find_in_cache(const std::string& domain,
+                     std::shared_ptr<const NaptrResult>& result,
+                     SAS::TrailId trail) const;
+  // Add the result of a query to the NAPTR cache, if it can be cached.
+  void add_to_cache(const std::string& domain,
+                    std::shared_ptr<const NaptrResult> result,
+                    int ttl) const;
+  // Finish a lookup, logging to SAS and updating the communication monitor.
+  // Returns the result of the lookup.
+  std::string finish_lookup(LookupState& state) const;
+  // Send the NAPTR query for the current key on the asynchronous resolver,
+  // calling the callback with the result once the lookup has finished.
+  void send_async_query(std::shared_ptr<LookupState> state,
+                        LookupCallback callback) const;
+
   // Converts a key to an ENUM domain name.
   std::string key_to_domain(const std::string& key) const;
   // Gets a resolver (from thread-local data).
@@ -179,6 +342,12 @@ private:
   pthread_key_t _thread_local;
   // DNSResolverFactory, used for constructing DNSResolvers when required.
   const DNSResolverFactory* _resolver_factory;
+  // Asynchronous resolver shared by all threads, if enabled.  If this is set
+  // it is used in preference to the thread-local resolvers.
+  AsyncDNSResolver* _async_resolver;
+  // Cache of NAPTR query results, keyed by domain, or NULL if caching is
+  // disabled.
+  NaptrCache* _cache;
 
   // Helper used to track enum communication state, and issue/clear alarms
   // based upon recent activity.
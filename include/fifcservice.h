@@ -16,6 +16,7 @@
 #include "updater.h"
 #include "ifc.h"
 #include "alarm.h"
+#include "config_snapshot.h"
 
 #ifndef FIFCSERVICE_H__
 #define FIFCSERVICE_H__
@@ -33,19 +34,16 @@ public:
   /// Updates the fallback iFCs.
   void update_fifcs();
 
-  /// Get the fallback iFCs
+  /// Get the fallback iFCs.  The iFCs are compiled when the configuration is
+  /// loaded, and own their own memory, so ifc_doc isn't used.
   std::vector<Ifc> get_fallback_ifcs(rapidxml::xml_document<>* ifc_doc) const;
 
 private:
   Alarm* _alarm;
-  std::vector<std::string> _fallback_ifcs;
+  ConfigSnapshot<std::vector<Ifc>> _fallback_ifcs;
   std::string _configuration;
   Updater<void, FIFCService>* _updater;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the calss, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _sets_rw_lock;
-
   // Helper functions to set/clear the alarm.
   void set_alarm();
   void clear_alarm();
@@ -0,0 +1,74 @@
+/**
+ * @file flight_recorder.h Per-thread flight recorder of the steps taken to
+ * process each message, dumped when processing is slow or fails.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FLIGHT_RECORDER_H__
+#define FLIGHT_RECORDER_H__
+
+#include <stdint.h>
+#include <string>
+
+#include "sas.h"
+#include "stage_latency.h"
+
+/// Each worker thread records cheap, timestamped marks as it processes a
+/// message into a ring buffer of its own.  The marks are thrown away unless
+/// the message took longer than the threshold to process or ended in an
+/// error, in which case they are written to the log.  This gives detail on
+/// the odd slow transaction without the cost of detailed SAS logging for
+/// every one.
+namespace FlightRecorder
+{
+  /// The number of marks kept for each thread.  A transaction that records
+  /// more than this only keeps its most recent marks.
+  static const int RING_SIZE = 256;
+
+  /// The maximum length of a mark's label, including its detail.
+  static const int LABEL_LENGTH = 40;
+
+  /// The default maximum number of records written to the log each second,
+  /// so a burst of slow transactions under overload doesn't flood the log.
+  static const int MAX_DUMPS_PER_SECOND = 10;
+
+  /// Sets the latency over which a transaction's record is dumped, and how
+  /// many records can be dumped each second.  A threshold of 0 turns the
+  /// recorder off.
+  void set_threshold_us(uint64_t threshold_us,
+                        int max_dumps_per_second = MAX_DUMPS_PER_SECOND);
+
+  /// Starts recording a new transaction on the calling thread, discarding
+  /// the record of any transaction that wasn't ended.
+  void begin(SAS::TrailId trail);
+
+  /// Returns whether the calling thread is recording a transaction.
+  bool active();
+
+  /// Records a mark in the current transaction, if there is one.  The label
+  /// (and detail) are copied and truncated to LABEL_LENGTH.
+  void mark(const char* label, int64_t arg = 0);
+  void mark(const char* label, const std::string& detail, int64_t arg = 0);
+
+  /// Notes that the current transaction failed, so it is dumped whatever its
+  /// latency.
+  void error();
+
+  /// Ends the current transaction, dumping it to the log if it took longer
+  /// than the threshold or failed.  Returns the record if it was dumped, or
+  /// an empty string otherwise.
+  std::string end(uint64_t latency_us);
+
+  /// The number of records that have been dumped, and that were suppressed
+  /// because too many were dumped in the same second.
+  uint64_t dumped();
+  uint64_t suppressed();
+}
+
+#endif
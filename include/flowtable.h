@@ -24,11 +24,14 @@ extern "C" {
 #include <map>
 #include <unordered_map>
 #include <string>
+#include <vector>
 #include <atomic>
 
 #include "snmp_scalar.h"
 #include "stack.h"
 #include "quiescing_manager.h"
+#include "instrumented_mutex.h"
+#include "memory_accounting.h"
 
 class FlowTable;
 
@@ -41,8 +44,8 @@ public:
   /// Returns a pointer to the remote address for this flow.
   inline const pj_sockaddr* remote_addr() const { return &_remote_addr; };
 
-  /// Returns a reference to the flow token.
-  inline const std::string& token() const { return _token; };
+  /// Returns the flow token.
+  inline std::string token() const { return std::string(_token); };
 
   void touch();
 
@@ -69,8 +72,6 @@ public:
                                          pjsip_transport_state state,
                                          const pjsip_transport_state_info *info);
 
-  static void on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e);
-
   friend class FlowTable;
 
 private:
@@ -80,50 +81,86 @@ private:
   static const int TOKEN_LENGTH = 10;
 
   void select_default_identity();
-  void restart_timer(int id, int timeout);
+  void restart_timer(int id, int timeout, bool earlier_only=false);
+  void timer_pop(int id, int now);
   void expiry_timer();
 
-  void inc_ref();
+  /// Recomputes the memory used by this flow, and updates the flow table's
+  /// total.  Must be called with _flow_lock held.
+  void update_memory();
+
+  /// Adds a reference to the flow, unless it has none left (in which case
+  /// it's being removed, and this returns false).
+  bool inc_ref();
 
   FlowTable* _flow_table;
   pjsip_transport* _transport;
   pjsip_tp_state_listener_key* _tp_state_listener_key;
   pj_sockaddr _remote_addr;
-  std::string _token;
-
-  /// Timer used to expire the associated registration bindings.  This is also
-  /// used to expire idle UDP flows (ie. when there are no more associated
-  /// registration bindings.
-  pj_timer_entry _timer;
+  char _token[TOKEN_LENGTH + 1];
+
+  /// The flow's timer, on the FlowTable's timer wheel.  This is used to
+  /// expire the associated registration bindings, and also to expire idle
+  /// UDP flows (ie. when there are no more associated registration
+  /// bindings).  These are only accessed with the wheel lock held.
+  Flow* _wheel_prev;
+  Flow* _wheel_next;
+  int _wheel_slot;
+  int _timer_id;
+  int _timer_deadline;
+
+  /// When the flow was last touched, in timer wheel time.  The idle timer
+  /// isn't moved when the flow is touched - instead this is checked when
+  /// it pops.
+  std::atomic<int> _last_touch;
 
   /// Lock used to protect accesses to the various data structures managing
   /// the identifiers authorized on this flow.
-  pthread_mutex_t _flow_lock;
+  InstrumentedMutex _flow_lock;
 
-  /// Map holding all the authenticated identifiers for this flow.  The key
-  /// is a normalized address of record/public identity, the value is the
-  /// full name-addr that should be used in P-Asserted-ID, the expiry
-  /// time, and whether this identity can be used as a default identity.
+  /// An authenticated identifier for this flow - the normalized address of
+  /// record/public identity, the full name-addr that should be used in
+  /// P-Asserted-ID, the (interned) service route, the expiry time, and
+  /// whether this identity can be used as a default identity.
   struct AuthId
   {
+    std::string aor;
     std::string name_addr;
+    const std::string* service_route;
     int expires;
     bool default_id;
-    std::string service_route;
   };
 
-  typedef std::unordered_map<std::string, struct AuthId> auth_id_map;
-  auth_id_map _authorized_ids;
+  /// The authenticated identifiers for this flow.  Almost all flows have
+  /// only one or two, so the first few are held in the flow itself and any
+  /// more overflow onto the heap.  Entries aren't kept in any order.
+  static const int INLINE_IDS = 2;
+  AuthId _inline_ids[INLINE_IDS];
+  std::vector<AuthId> _overflow_ids;
+  int _num_ids;
+
+  AuthId& id_at(int index)
+  {
+    return (index < INLINE_IDS) ? _inline_ids[index] :
+                                  _overflow_ids[index - INLINE_IDS];
+  }
 
-  /// The default identity for this flow.
-  std::string _default_id;
+  int find_id(const std::string& aor);
+  AuthId& add_id(const std::string& aor);
+  void erase_id(int index);
 
-  /// Counts the references to this Flow.  This can only be updated or tested
-  /// by a thread which currently holds the FlowTable::_flow_map_lock.
-  int _refs;
+  /// Index of the default identity for this flow, or -1 if there isn't one.
+  int _default_idx;
+
+  /// The memory this flow has added to the flow table's total.
+  size_t _memory;
+
+  /// Counts the references to this Flow.  Once this reaches zero the flow
+  /// is being removed, and the FlowTable won't hand it out again.
+  std::atomic<int> _refs;
 
   // Counts the number of active dialogs on this flow. This can be
-  // updated or tested without FlowTable::_flow_map_lock being held.
+  // updated or tested without holding any FlowTable lock.
   std::atomic_long _dialogs;
 
   /// Timer identifiers - the timer either runs as an expiry timer (when there
@@ -143,7 +180,9 @@ private:
 class FlowTable : public QuiesceFlowsInterface
 {
 public:
-  FlowTable(QuiescingManager* qm, SNMP::U32Scalar* connection_count);
+  FlowTable(QuiescingManager* qm,
+            SNMP::U32Scalar* connection_count,
+            SNMP::U32Scalar* memory_per_flow = NULL);
   virtual ~FlowTable();
 
   /// Create a flow corresponding to the specified received message.
@@ -168,6 +207,19 @@ public:
   void unquiesce();
   bool is_quiescing();
 
+  /// Returns the number of flows in each shard of the table.
+  std::vector<size_t> shard_occupancy();
+
+  /// The number of shards the flows are spread over.
+  static const int NUM_SHARDS = 64;
+
+  /// Returns the current time on the timer wheel, in seconds.
+  int wheel_time() const { return _now.load(std::memory_order_relaxed); }
+
+  /// Pops any flow timers that are due by the specified wheel time.  This is
+  /// called every second by the tick timer.
+  void process_timers(int now);
+
   friend class Flow;
 
 private:
@@ -186,23 +238,26 @@ private:
     {
     }
 
-    /// Override operator< so this can be used as a map key.
-    bool operator< (const FlowKey& other) const
+    bool operator== (const FlowKey& other) const
     {
-      // Compare the transport type first.
-      if (_type < other._type)
-      {
-        return true;
-      }
-      else if (_type > other._type)
-      {
-        return false;
-      }
-      else
+      return ((_type == other._type) &&
+              (pj_sockaddr_cmp(&_raddr, &other._raddr) == 0));
+    }
+
+    /// Hashes the transport type, address and port.
+    size_t hash() const
+    {
+      // FNV-1a.
+      uint64_t hash = 14695981039346656037ull;
+      const unsigned char* addr = (const unsigned char*)pj_sockaddr_get_addr(&_raddr);
+      unsigned int len = pj_sockaddr_get_addr_len(&_raddr);
+      for (unsigned int ii = 0; ii < len; ++ii)
       {
-        // The transport is the same, so check the remote addresses.
-        return (pj_sockaddr_cmp(&_raddr, &other._raddr) < 0);
+        hash = (hash ^ addr[ii]) * 1099511628211ull;
       }
+      hash = (hash ^ pj_sockaddr_get_port(&_raddr)) * 1099511628211ull;
+      hash = (hash ^ (unsigned int)_type) * 1099511628211ull;
+      return (size_t)hash;
     }
 
   private:
@@ -210,14 +265,81 @@ private:
     pj_sockaddr _raddr;
   };
 
-  pthread_mutex_t _flow_map_lock;
-  std::map<FlowKey, Flow*> _tp2flow_map;        // map from transport addresses to flow
-  std::map<std::string, Flow*> _tk2flow_map;    // map from token to flow
+  struct FlowKeyHash
+  {
+    size_t operator()(const FlowKey& key) const { return key.hash(); }
+  };
+
+  /// The flows are spread over a number of shards, each with its own lock,
+  /// so that requests on different flows don't contend.  Each flow is in
+  /// one shard by its transport address and one (usually different) shard
+  /// by its token.  When both locks are needed, the address shard's lock is
+  /// always taken first.
+  struct AddressShard
+  {
+    AddressShard() : lock("flow_table_address") {}
+
+    InstrumentedMutex lock;
+    std::unordered_map<FlowKey, Flow*, FlowKeyHash> flows;
+  };
+
+  struct TokenShard
+  {
+    TokenShard() : lock("flow_table_token") {}
+
+    InstrumentedMutex lock;
+    std::unordered_map<std::string, Flow*> flows;
+  };
+
+  AddressShard& address_shard(const FlowKey& key)
+  {
+    // The low bits of the hash pick the bucket within the shard, so use
+    // the high bits to pick the shard.
+    return _address_shards[(key.hash() >> 32) % NUM_SHARDS];
+  }
+
+  TokenShard& token_shard(const std::string& token)
+  {
+    return _token_shards[(std::hash<std::string>()(token) >> 32) % NUM_SHARDS];
+  }
+
+  AddressShard _address_shards[NUM_SHARDS];
+  TokenShard _token_shards[NUM_SHARDS];
+
+  /// Serializes checks on whether quiescing has finished.
+  InstrumentedMutex _quiesce_lock;
 
   // Statistics
   void report_flow_count();
+  void adjust_flow_memory(long delta);
+
+  /// The flows' idle and expiry timers are kept on a coarse timer wheel with
+  /// a slot per second, driven by a single PJSIP timer, rather than each
+  /// flow having its own entry in PJSIP's timer heap.  Timers further out
+  /// than the wheel stay in their slot until the wheel comes round to them
+  /// in the right lap.
+  static const int WHEEL_SLOTS = 1024;
+
+  void schedule_timer(Flow* flow, int id, int timeout, bool earlier_only);
+  void cancel_timer(Flow* flow);
+  bool idle_timer_expired(Flow* flow, int now);
+  void link_timer(Flow* flow, int id, int deadline);
+  void unlink_timer(Flow* flow);
+
+  static int monotonic_now();
+  static void on_tick(pj_timer_heap_t* th, pj_timer_entry* e);
+
+  InstrumentedMutex _wheel_lock;
+  Flow* _wheel[WHEEL_SLOTS];
+  int _wheel_time;
+  std::atomic<int> _now;
+  pj_timer_entry _tick_timer;
+  std::atomic<int> _flow_count;
+  std::atomic<long> _flow_memory;
   SNMP::U32Scalar* _conn_count;
-  bool _quiescing;
+  SNMP::U32Scalar* _memory_per_flow;
+  MemoryAccounting::Account* _memory_account;
+  std::atomic<bool> _quiescing;
   QuiescingManager* _qm;
 
 };
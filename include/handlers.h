@@ -18,6 +18,7 @@
 #include "subscriber_manager.h"
 #include "sipresolver.h"
 #include "impistore.h"
+#include "send_queue_monitor.h"
 
 /// Base AuthTimeoutTask class for tasks that implement authentication timeout
 /// callbacks from specific timer services.
@@ -58,16 +59,19 @@ public:
     Config(SubscriberManager* sm,
            SIPResolver* sipresolver,
            ImpiStore* local_impi_store,
-           std::vector<ImpiStore*> remote_impi_stores) :
+           std::vector<ImpiStore*> remote_impi_stores,
+           int remote_store_timeout_ms = 0) :
       _sm(sm),
       _sipresolver(sipresolver),
       _local_impi_store(local_impi_store),
-      _remote_impi_stores(remote_impi_stores)
+      _remote_impi_stores(remote_impi_stores),
+      _remote_store_timeout_ms(remote_store_timeout_ms)
     {}
     SubscriberManager* _sm;
     SIPResolver* _sipresolver;
     ImpiStore* _local_impi_store;
     std::vector<ImpiStore*> _remote_impi_stores;
+    int _remote_store_timeout_ms;
   };
 
 
@@ -116,7 +120,19 @@ protected:
   ///
   /// @param store[in]        ImpiStore where IMPIs are to be deleted
   /// @param impi[in]         IMPI to be deleted
-  void delete_impi_from_store(ImpiStore* store, const std::string& impi);
+  /// @param trail[in]        SAS trail
+  static void delete_impi_from_store(ImpiStore* store,
+                                     const std::string& impi,
+                                     SAS::TrailId trail);
+
+  /// @brief Delete a set of IMPIs from an ImpiStore
+  ///
+  /// @param store[in]        ImpiStore where IMPIs are to be deleted
+  /// @param impis[in]        IMPIs to be deleted
+  /// @param trail[in]        SAS trail
+  static void delete_impis_from_store(ImpiStore* store,
+                                      const std::set<std::string>& impis,
+                                      SAS::TrailId trail);
 
   const Config* _cfg;
   std::map<std::string, std::string> _bindings;
@@ -143,12 +159,17 @@ public:
   void run();
 
 protected:
-  /// Write information about all bindings in an AoR to a JSON string
+  /// Write information about the bindings in an AoR to a JSON string
   ///
   /// @param bindings[in]   map of binding_id to Binding object in an AoR
+  /// @param offset[in]     the number of bindings to skip
+  /// @param limit[in]      the maximum number of bindings to write, or 0 to
+  ///                       write them all
   ///
-  /// @return JSON string containing all bindings information
-  std::string serialize_data(const Bindings& bindings);
+  /// @return JSON string containing the bindings information
+  std::string serialize_data(const Bindings& bindings,
+                             size_t offset = 0,
+                             size_t limit = 0);
   const Config* _cfg;
 };
 
@@ -172,12 +193,17 @@ public:
   void run();
 
 protected:
-  /// Write information about all subscriptions in an AoR to a JSON string
+  /// Write information about the subscriptions in an AoR to a JSON string
   ///
   /// @param subscription[in]   map of to_tag and Subscription object in an AoR
+  /// @param offset[in]         the number of subscriptions to skip
+  /// @param limit[in]          the maximum number of subscriptions to write,
+  ///                           or 0 to write them all
   ///
-  /// @return JSON string containing all subscription information
-  std::string serialize_data(const Subscriptions& subscriptions);
+  /// @return JSON string containing the subscription information
+  std::string serialize_data(const Subscriptions& subscriptions,
+                             size_t offset = 0,
+                             size_t limit = 0);
   const Config* _cfg;
 };
 
@@ -211,6 +237,179 @@ private:
   const Config* _cfg;
 };
 
+/// Task to report the per-stage latencies of SIP processing.
+class GetStageLatenciesTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config() {}
+  };
+
+  GetStageLatenciesTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail)
+  {};
+
+  void run();
+
+protected:
+  /// Write a summary of every stage to a JSON string.
+  std::string serialize_data();
+};
+
+/// Task to report the CPU time used by each Sproutlet.
+class GetSproutletCpuTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config() {}
+  };
+
+  GetSproutletCpuTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail)
+  {};
+
+  void run();
+
+protected:
+  /// Write the CPU time of every Sproutlet to a JSON string.
+  std::string serialize_data();
+};
+
+/// Task to report the wait and hold times of Sprout's instrumented locks.
+class GetLockStatsTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config() {}
+  };
+
+  GetLockStatsTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail)
+  {};
+
+  void run();
+
+protected:
+  /// Write the statistics of every named lock to a JSON string.
+  std::string serialize_data();
+};
+
+/// Task to report the data waiting to be sent on each SIP connection.
+class GetSendQueuesTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config(SendQueueMonitor* monitor) : _monitor(monitor) {}
+
+    /// NULL if the send queues aren't being tracked.
+    SendQueueMonitor* _monitor;
+  };
+
+  GetSendQueuesTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail), _cfg(cfg)
+  {};
+
+  void run();
+
+protected:
+  /// Write the queue of every connection to a JSON string.
+  std::string serialize_data();
+
+  const Config* _cfg;
+};
+
+/// Task for taking a CPU or allocation profile of sprout, for the management
+/// interface.  The profile is taken over the number of seconds given by the
+/// "seconds" parameter, blocking the thread handling the request while it
+/// is, and is returned in pprof's format, or as folded stacks if the "format"
+/// parameter is "folded".
+class GetProfileTask : public HttpStackUtils::Task
+{
+public:
+  enum Type { CPU, ALLOCS };
+
+  struct Config
+  {
+    Config(Type type) : _type(type) {}
+
+    Type _type;
+  };
+
+  GetProfileTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail), _cfg(cfg)
+  {};
+
+  void run();
+
+  static const int DEFAULT_SECONDS = 30;
+  static const int MAX_SECONDS = 300;
+  static const int CPU_FREQUENCY_HZ = 100;
+
+protected:
+  const Config* _cfg;
+};
+
+/// Task to report the metrics in Metrics' registry in OpenMetrics text
+/// format, for scraping.
+class GetMetricsTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config() {}
+  };
+
+  GetMetricsTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail)
+  {};
+
+  void run();
+};
+
+/// Task to report the memory accounted to each subsystem.
+class GetMemoryTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config() {}
+  };
+
+  GetMemoryTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail)
+  {};
+
+  void run();
+
+protected:
+  /// Write the usage of every account to a JSON string.
+  std::string serialize_data();
+};
+
+/// Task to report the connection pools to application servers.
+class GetASConnectionsTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config() {}
+  };
+
+  GetASConnectionsTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail)
+  {};
+
+  void run();
+
+protected:
+  /// Write the state of every pool to a JSON string.
+  std::string serialize_data();
+};
+
 /// Task for receiving user data sent by Homestead when it receives a PPR.
 /// It will send NOTIFYs if the associated URIs have changed (by calling
 /// into the SM).
@@ -235,7 +434,7 @@ public:
   void run();
 
  
-  /// Parse push profile request to populate _associated_uris for this task
+  /// Parse push profile request to populate _profile for this task
   ///
   /// @param body[in]   request body of Push Profile
   /// @param trail[in]  SAS logging
@@ -245,8 +444,8 @@ public:
   ///  HTTP_BAD_REQUEST - failed to parse request body as JSON/XML
   HTTPCode get_associated_uris(std::string body, SAS::TrailId trail);
 
-  /// Get subscriber manager to update associated uris based on _associated_uris
-  /// that is populated in get_associated_uris
+  /// Get subscriber manager to update the subscriber based on _profile that
+  /// is populated in get_associated_uris
   ///
   /// @param trail[in]   SAS logging
   ///
@@ -262,6 +461,6 @@ public:
 protected:
   const Config* _cfg;
   std::string _default_public_id;
-  AssociatedURIs _associated_uris;
+  PushedProfile _profile;
 };
 #endif
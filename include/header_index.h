@@ -0,0 +1,74 @@
+/**
+ * @file header_index.h Definition of HeaderIndex - an index of the commonly
+ * used headers in a SIP message.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HEADER_INDEX_H__
+#define HEADER_INDEX_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+/// Index of the first header with each of the commonly used names (the
+/// custom headers registered in custom_headers.cpp, plus a few other IMS
+/// headers) in a SIP message.
+///
+/// Looking a header up by name in a pjsip_msg walks the header list
+/// comparing strings.  Code that looks up several headers in the same
+/// message can instead build a HeaderIndex, which walks the list once, and
+/// then finds the first header with an indexed name in constant time.
+/// Lookups of other names fall back to walking the list, so find() always
+/// gives the same answer as PJUtils::find_hdr_by_name (including parsing
+/// lazily parsed headers when they're found).
+///
+/// The index doesn't allocate, so is cheap to build on the stack.  It is only
+/// valid while the message's headers are unchanged, other than by the
+/// index's own insert_first(), add() and remove() methods.
+class HeaderIndex
+{
+public:
+  /// Constructor.  Indexes the message's headers.
+  HeaderIndex(pjsip_msg* msg);
+
+  /// Returns the message that is indexed.
+  pjsip_msg* msg() const { return _msg; }
+
+  /// Returns the first header with the given name, or NULL.
+  pjsip_hdr* find(const pj_str_t* name) const;
+
+  /// Returns the next header after hdr with the given name, or NULL.
+  pjsip_hdr* find_next(const pj_str_t* name, const pjsip_hdr* hdr) const;
+
+  /// Adds a header to the start of the message.
+  void insert_first(pjsip_hdr* hdr);
+
+  /// Adds a header to the end of the message.
+  void add(pjsip_hdr* hdr);
+
+  /// Removes a header from the message.
+  void remove(pjsip_hdr* hdr);
+
+  /// Returns whether headers with the given name are indexed.
+  static bool is_indexed(const pj_str_t* name);
+
+  static const int MAX_INDEXED = 24;
+
+private:
+  /// Returns the slot in _first for the given name, or -1 if it isn't indexed.
+  static int slot(const pj_str_t* name);
+
+  pjsip_msg* _msg;
+
+  // This is updated when find() parses a lazily parsed header.
+  mutable pjsip_hdr* _first[MAX_INDEXED];
+};
+
+#endif
@@ -13,16 +13,28 @@
 #define HSSCONNECTION_H__
 
 #include <curl/curl.h>
+#include <functional>
+#include <memory>
+#include <future>
+#include <pthread.h>
 #include "rapidjson/document.h"
 
 #include "httpconnection.h"
+#include "multiplexed_httpclient.h"
 #include "rapidxml/rapidxml.hpp"
 #include "ifchandler.h"
 #include "sas.h"
 #include "snmp_event_accumulator_table.h"
 #include "load_monitor.h"
 #include "associated_uris.h"
+#include "profile_diff.h"
+#include "http_content_decoder.h"
 #include "sifcservice.h"
+#include "sharded_lru_cache.h"
+#include "stage_latency.h"
+#include "metrics.h"
+
+class ExceptionHandler;
 
 /// @class HSSConnection
 ///
@@ -85,7 +97,21 @@ public:
                 SNMP::EventAccumulatorTable* homestead_lir_latency_tbl,
                 CommunicationMonitor* comm_monitor,
                 SIFCService* sifc_service,
-                long homestead_timeout_ms);
+                long homestead_timeout_ms,
+                int irs_cache_ttl = 0,
+                size_t irs_cache_size = 0,
+                const ShardedLRUCacheStatsTables& irs_cache_stats_tbls =
+                                                 ShardedLRUCacheStatsTables(),
+                SNMP::CounterTable* coalesced_tbl = NULL,
+                ExceptionHandler* exception_handler = NULL,
+                int async_threads = 0,
+                int http2_connections = 0,
+                SNMP::IPCountTable* http2_stream_count_tbl = NULL,
+                SNMP::EventAccumulatorTable* http2_rtt_tbl = NULL,
+                int hedge_percentile = 0,
+                int hedge_budget_percent = 0,
+                SNMP::CounterTable* hedged_tbl = NULL,
+                bool compression = false);
   virtual ~HSSConnection();
 
   HTTPCode get_auth_vector(const std::string& private_user_id,
@@ -115,7 +141,55 @@ public:
   virtual HTTPCode get_registration_data(const std::string& public_id,
                                          irs_info& irs_info,
                                          SAS::TrailId trail);
-  rapidxml::xml_document<>* parse_xml(std::string raw, const std::string& url);
+
+  /// Asynchronous variants of get_auth_vector, update_registration_state and
+  /// get_registration_data.  The request is made on one of this object's
+  /// request threads, and the callback is run on that thread with the result
+  /// (so callers that need to resume on a worker thread should use
+  /// PJUtils::run_callback_on_worker_thread).  The auth vector callback takes
+  /// ownership of the document.
+  ///
+  /// If this object was created without any request threads, the request is
+  /// made and the callback run before these methods return.
+  typedef std::function<void(HTTPCode rc,
+                             rapidjson::Document* object)> AuthVectorCallback;
+  typedef std::function<void(HTTPCode rc,
+                             irs_info& irs_info)> IrsCallback;
+
+  void get_auth_vector_async(const std::string& private_user_id,
+                             const std::string& public_user_id,
+                             const std::string& auth_type,
+                             const std::string& resync_auth,
+                             const std::string& server_name,
+                             AuthVectorCallback callback,
+                             SAS::TrailId trail);
+  virtual void update_registration_state_async(const irs_query& irs_query,
+                                               IrsCallback callback,
+                                               SAS::TrailId trail);
+  virtual void get_registration_data_async(const std::string& public_id,
+                                           IrsCallback callback,
+                                           SAS::TrailId trail);
+
+  /// Parse a Homestead response in place.  The returned document owns the
+  /// buffer that it was parsed from.  Returns NULL if the response isn't
+  /// valid XML.
+  std::shared_ptr<rapidxml::xml_document<>> parse_xml(std::string&& raw_data,
+                                                      const std::string& url = "");
+
+  /// Remove any cached registration data for the IMPU, and for the other
+  /// IMPUs in its implicit registration set.  This must be called whenever
+  /// the subscriber's data may have changed other than through this object
+  /// (for example, on a Push Profile Request from the HSS).
+  virtual void invalidate_cached_registration_data(const std::string& public_id);
+
+  /// Bring any cached registration data for the IMPU's implicit registration
+  /// set up to date with a profile pushed by the HSS.  If only the iFCs of
+  /// some IMPUs have changed, only those are parsed again; if any IMPU has
+  /// been added, removed or barred, or there's no cached data to compare
+  /// against, the cached data is invalidated.
+  virtual void update_cached_service_profiles(const std::string& public_id,
+                                              const PushedProfile& profile,
+                                              SAS::TrailId trail);
 
   static const std::string REG;
   static const std::string CALL;
@@ -130,13 +204,23 @@ private:
                                rapidjson::Document*& object,
                                SAS::TrailId trail);
   virtual long get_xml_object(const std::string& path,
-                              rapidxml::xml_document<>*& root,
+                              std::shared_ptr<rapidxml::xml_document<>>& root,
                               SAS::TrailId trail);
   virtual long put_for_xml_object(const std::string& path,
                                   std::string body,
                                   const bool& cache_allowed,
-                                  rapidxml::xml_document<>*& root,
+                                  std::shared_ptr<rapidxml::xml_document<>>& root,
                                   SAS::TrailId trail);
+
+  // Send a request to Homestead, over HTTP/2 if it is enabled, and return the
+  // response code and body.
+  HTTPCode send_request(HttpClient::RequestType type,
+                        const std::string& path,
+                        const std::string& body,
+                        const std::vector<std::string>& headers,
+                        std::string& response_body,
+                        SAS::TrailId trail);
+
   HTTPCode put_homestead_xml(const irs_query& irs_query,
                              std::shared_ptr<rapidxml::xml_document<>>& root,
                              SAS::TrailId trail);
@@ -144,14 +228,66 @@ private:
                              std::shared_ptr<rapidxml::xml_document<>>& root,
                              SAS::TrailId trail);
 
+  // Cache of registration data, as described in hssconnection.cpp.
+  bool find_in_cache(const std::string& public_id,
+                     irs_info& irs_info,
+                     SAS::TrailId trail);
+  void add_to_cache(const std::string& public_id, const irs_info& irs_info);
+
+  // Coalescing of concurrent identical requests, as described in
+  // hssconnection.cpp.
+  typedef std::pair<HTTPCode, irs_info> IrsResult;
+  HTTPCode coalesce(const std::string& key,
+                    irs_info& irs_info,
+                    SAS::TrailId trail,
+                    std::function<HTTPCode(struct irs_info&)> fetch);
+
+  // Run a request on one of the request threads.  If the request can't be
+  // completed (because the thread hit an exception), fail is run instead.
+  void run_async(std::function<void()> run, std::function<void()> fail);
+
+  // The number of shards in the registration data cache.
+  static const int NUM_CACHE_SHARDS = 16;
+
   HttpClient* _client;
   HttpConnection* _http;
+
+  // Client multiplexing requests over HTTP/2 connections, or NULL if requests
+  // are sent through _http.
+  MultiplexedHttpClient* _http2;
+
+  /// Decides when to hedge GETs over HTTP/2 (NULL if they aren't hedged).
+  RequestHedger* _hedger;
+
   SNMP::EventAccumulatorTable* _latency_tbl;
   SNMP::EventAccumulatorTable* _mar_latency_tbl;
   SNMP::EventAccumulatorTable* _sar_latency_tbl;
   SNMP::EventAccumulatorTable* _uar_latency_tbl;
   SNMP::EventAccumulatorTable* _lir_latency_tbl;
+  StageHistogram* _latency_stage;
+  Metrics::Histogram* _latency_metric;
   SIFCService* _sifc_service;
+
+  // Statistics for compressed responses, or NULL if compression isn't
+  // offered to Homestead.
+  HttpContentDecoder::Stats* _compression_stats;
+
+  // The registration data cache, indexed by IMPU, or NULL if caching is
+  // disabled.
+  int _irs_cache_ttl;
+  ShardedLRUCache<std::string, std::shared_ptr<const irs_info>>* _irs_cache;
+
+  // The registration data requests currently in progress, indexed by a key
+  // identifying the request, and the count of requests that were coalesced
+  // with one of them.
+  pthread_mutex_t _in_flight_lock;
+  std::map<std::string, std::shared_future<IrsResult>> _in_flight;
+  SNMP::CounterTable* _coalesced_tbl;
+
+  // The pool of threads that make asynchronous requests, or NULL if they are
+  // made on the calling thread.
+  class AsyncPool;
+  AsyncPool* _async_pool;
 };
 
 #endif
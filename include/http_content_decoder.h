@@ -0,0 +1,93 @@
+/**
+ * @file http_content_decoder.h Decoding of compressed HTTP response bodies.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HTTP_CONTENT_DECODER_H__
+#define HTTP_CONTENT_DECODER_H__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <zlib.h>
+
+#include "metrics.h"
+
+/// Decodes an HTTP response body sent with a Content-Encoding of gzip or
+/// deflate.
+///
+/// Clients that send ACCEPT_ENCODING with a request may get the response
+/// body compressed.  The decoder is given the body as it arrives, and
+/// appends the decompressed data to the caller's buffer, so the compressed
+/// body is never held in full, and the decompressed body can be parsed in
+/// place without another copy.  A body without a Content-Encoding is
+/// appended as it is.
+class HttpContentDecoder
+{
+public:
+  /// The header offering the encodings that can be decoded.
+  static const char* const ACCEPT_ENCODING;
+
+  /// Metrics for the responses from one dependency, named after it.  The
+  /// bytes saved is how much smaller compressed bodies were on the wire than
+  /// decompressed.
+  struct Stats
+  {
+    Stats(const std::string& dependency);
+
+    Metrics::Counter* compressed_responses;
+    Metrics::Counter* saved_bytes;
+    Metrics::Histogram* decode_time;
+  };
+
+  /// Constructor.
+  /// @param stats  - Where to report the decoding of compressed bodies (may be
+  ///                 NULL).
+  HttpContentDecoder(Stats* stats = NULL);
+  ~HttpContentDecoder();
+
+  /// Sets the encoding of the body, from the value of its Content-Encoding
+  /// header.  Returns false if the encoding isn't one that can be decoded.
+  bool set_encoding(const std::string& content_encoding);
+
+  /// Sets the encoding from a raw response header line, if it is a
+  /// Content-Encoding header.  Returns false if it names an encoding that
+  /// can't be decoded.
+  bool header(const char* line, size_t length);
+
+  /// Decodes the next part of the body, appending it to out.  Returns false
+  /// if the body is corrupt.
+  bool write(const char* data, size_t length, std::string& out);
+
+  /// Called once the whole body has been written.  Returns false if the body
+  /// was cut short, and reports the decoding.
+  bool finish();
+
+  /// Returns the Content-Encoding from a set of response headers, or an
+  /// empty string if there isn't one.  Header names aren't case sensitive.
+  static std::string content_encoding(const std::map<std::string, std::string>& headers);
+
+  /// Decodes a whole body, sent with the given Content-Encoding, in place.
+  static bool decode(const std::string& content_encoding,
+                     std::string& body,
+                     Stats* stats = NULL);
+
+private:
+  Stats* _stats;
+  bool _compressed;
+  bool _failed;
+  bool _ended;
+  z_stream _stream;
+
+  uint64_t _in_bytes;
+  uint64_t _out_bytes;
+  uint64_t _decode_ns;
+};
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @file http_task_pool.h Definition of HttpTaskPool - runs HTTP tasks off the
+ * HTTP stack's threads.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HTTP_TASK_POOL_H__
+#define HTTP_TASK_POOL_H__
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include "exception_handler.h"
+#include "httpstack.h"
+#include "httpstack_utils.h"
+#include "log.h"
+
+/// A pool of threads that HTTP tasks are run on.
+///
+/// Most of the tasks behind Sprout's HTTP interfaces block on S4 or the HSS,
+/// so a burst of slow requests (such as a large push-profile or bulk
+/// deregistration from Homestead) can tie up every HTTP thread.  Running each
+/// kind of traffic on its own pool means that it can only tie up its own
+/// threads - so, for example, Chronos timer pops are still handled while
+/// provisioning requests are queued.
+class HttpTaskPool
+{
+public:
+  /// Constructor.
+  /// @param name              - The name of the pool, used in logs.
+  /// @param num_threads       - The number of threads to run tasks on.
+  /// @param exception_handler - Handles exceptions thrown by tasks.
+  HttpTaskPool(const std::string& name,
+               unsigned int num_threads,
+               ExceptionHandler* exception_handler);
+  ~HttpTaskPool();
+
+  /// Runs a task on one of the pool's threads.
+  /// @param run  - Runs the task.
+  /// @param fail - Called instead of (or part way through) run if the task
+  ///               throws an exception.
+  void add_task(std::function<void()> run,
+                std::function<void()> fail);
+
+  const std::string& name() const { return _name; }
+
+private:
+  class Pool;
+
+  std::string _name;
+  Pool* _pool;
+};
+
+/// An HTTP handler that creates a task for each request and runs it on an
+/// HttpTaskPool, rather than on the HTTP thread that received the request.
+/// Each handler limits how many of its tasks can be queued or running at
+/// once, and rejects requests over the limit with a 503, so that one endpoint
+/// can't fill its pool's queue.
+///
+/// B is the handler this replaces (which is used to handle requests on the
+/// HTTP thread if there's no pool), so that requests are SAS logged in the
+/// same way.
+template <class H, class C, class B = HttpStackUtils::SpawningHandler<H, C>>
+class PooledHandler : public B
+{
+public:
+  PooledHandler(const C* cfg, HttpTaskPool* pool, int max_tasks) :
+    B(cfg),
+    _cfg(cfg),
+    _pool(pool),
+    _max_tasks(max_tasks),
+    _tasks(0)
+  {
+  }
+
+  void process_request(HttpStack::Request& req, SAS::TrailId trail) override
+  {
+    if (_pool == NULL)
+    {
+      B::process_request(req, trail);
+      return;
+    }
+
+    if (++_tasks > _max_tasks)
+    {
+      --_tasks;
+      TRC_WARNING("Rejecting request for %s - %d requests are already waiting for the %s pool",
+                  req.path().c_str(),
+                  _max_tasks,
+                  _pool->name().c_str());
+      req.send_reply(HTTP_SERVER_UNAVAILABLE, trail);
+      return;
+    }
+
+    // Create the task here, as it takes its copy of the request.  Tasks
+    // delete themselves once they've sent their reply.
+    H* task = new H(req, _cfg, trail);
+    _pool->add_task([this, task]() { task->run(); --_tasks; },
+                    [this]() { --_tasks; });
+  }
+
+private:
+  const C* _cfg;
+  HttpTaskPool* _pool;
+  const int _max_tasks;
+  std::atomic<int> _tasks;
+};
+
+#endif
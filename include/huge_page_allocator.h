@@ -0,0 +1,119 @@
+/**
+ * @file huge_page_allocator.h Definition of HugePageAllocator - allocates PJ
+ * pool blocks from huge page arenas.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HUGE_PAGE_ALLOCATOR_H__
+#define HUGE_PAGE_ALLOCATOR_H__
+
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "snmp_scalar.h"
+
+/// Allocates the blocks that PJ pools are made of from 2MB arenas, each of
+/// which is backed by a single huge page where the system has them reserved
+/// (and is otherwise aligned so that transparent huge pages can back it).
+///
+/// Block sizes are rounded up to a power of two between MIN_BLOCK_SIZE and
+/// MAX_BLOCK_SIZE, and freed blocks are kept on a free list for their size
+/// and reused.  Arenas are never returned to the system, so the memory used
+/// for pools grows to the peak needed and then stays flat, rather than the
+/// heap fragmenting under the churn of short-lived pools.  Larger blocks
+/// aren't handled, and must be allocated as usual.
+class HugePageAllocator
+{
+public:
+  HugePageAllocator();
+
+  /// Destructor.  Unmaps all the arenas, so every block must already have
+  /// been freed.
+  ~HugePageAllocator();
+
+  /// Returns whether blocks of this size are allocated by this object.
+  static bool handles(size_t size) { return (size <= MAX_BLOCK_SIZE); }
+
+  /// Allocates a block, which must be a size this object handles.  Returns
+  /// NULL if a new arena was needed but couldn't be mapped.
+  void* alloc(size_t size);
+
+  /// Frees a block.  size must be the size the block was allocated with.
+  void free(void* mem, size_t size);
+
+  /// Returns the number of bytes in the arenas, the number of those on free
+  /// lists or not yet used, and the number requested by the blocks currently
+  /// allocated.  The difference between the last two is lost to rounding.
+  size_t arena_bytes() const { return _arena_bytes; }
+  size_t free_bytes() const { return _free_bytes; }
+  size_t in_use_bytes() const { return _in_use_bytes; }
+
+  /// Returns the number of arenas backed by explicitly reserved huge pages.
+  /// The rest rely on transparent huge pages.
+  int huge_page_arenas() const { return _huge_page_arenas; }
+
+  /// Sets the scalars to report the size of the arenas and the bytes in use
+  /// in.  These are updated by update_stats.
+  void set_stats_scalars(SNMP::U32Scalar* arena_bytes_scalar,
+                         SNMP::U32Scalar* in_use_bytes_scalar);
+  void update_stats();
+
+  static const size_t ARENA_SIZE = 2 * 1024 * 1024;
+  static const size_t MIN_BLOCK_SIZE = 1024;
+  static const size_t MAX_BLOCK_SIZE = 256 * 1024;
+
+private:
+  /// The size classes are the powers of two from MIN_BLOCK_SIZE to
+  /// MAX_BLOCK_SIZE.
+  static const int NUM_CLASSES = 9;
+
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  struct SizeClass
+  {
+    std::mutex lock;
+    FreeBlock* head;
+  };
+
+  static int size_class(size_t size);
+  static size_t class_size(int size_class) { return MIN_BLOCK_SIZE << size_class; }
+
+  /// Pushes a block onto the free list for its size class.
+  void push(int size_class, void* mem);
+
+  /// Carves a new block from the current arena, mapping another if needed.
+  void* carve(int size_class);
+
+  /// Maps a new arena.  Must be called with _arena_lock held.
+  bool new_arena();
+
+  SizeClass _classes[NUM_CLASSES];
+
+  // The arenas, and the part of the latest one that hasn't been carved into
+  // blocks yet, protected by _arena_lock.
+  std::mutex _arena_lock;
+  std::vector<void*> _arenas;
+  char* _arena_pos;
+  char* _arena_end;
+
+  std::atomic<size_t> _arena_bytes;
+  std::atomic<size_t> _free_bytes;
+  std::atomic<size_t> _in_use_bytes;
+  std::atomic<int> _huge_page_arenas;
+
+  SNMP::U32Scalar* _arena_bytes_scalar;
+  SNMP::U32Scalar* _in_use_bytes_scalar;
+};
+
+#endif
@@ -12,13 +12,55 @@
 #ifndef ICSCFROUTER_H__
 #define ICSCFROUTER_H__
 
+#include <memory>
+
 #include "hssconnection.h"
 #include "scscfselector.h"
 #include "servercaps.h"
 #include "acr.h"
+#include "sharded_lru_cache.h"
 
 #include "rapidjson/document.h"
 
+/// Cache of the results of the I-CSCF's HSS queries.  The S-CSCF (or
+/// capabilities) the HSS returns for a subscriber rarely change, so these are
+/// cached for a short time rather than querying the HSS for every REGISTER
+/// and every terminating request.  A cached result is discarded if the
+/// I-CSCF has to retry to a different S-CSCF.
+class ICSCFQueryCache
+{
+public:
+  ICSCFQueryCache(int ttl,
+                  size_t size,
+                  const ShardedLRUCacheStatsTables& stats_tbls);
+
+  /// The result of a successful HSS query.
+  struct Result
+  {
+    std::shared_ptr<const ServerCapabilities> hss_rsp;
+    bool queried_caps;
+  };
+
+  /// Keys for UAR and LIR results.
+  static std::string uar_key(const std::string& impi,
+                             const std::string& impu,
+                             const std::string& visited_network,
+                             const std::string& auth_type,
+                             bool emergency);
+  static std::string lir_key(const std::string& impu, bool originating);
+
+  bool find(const std::string& key, Result& result);
+  void add(const std::string& key, const Result& result);
+  void invalidate(const std::string& key);
+
+private:
+  // The number of shards in the cache.
+  static const int NUM_CACHE_SHARDS = 16;
+
+  int _ttl;
+  ShardedLRUCache<std::string, std::shared_ptr<const Result>> _cache;
+};
+
 /// Class implementing common routing functions of an I-CSCF.
 class ICSCFRouter
 {
@@ -28,7 +70,8 @@ public:
               SAS::TrailId trail,
               ACR* acr,
               int port,
-              std::set<std::string> blacklisted_scscfs = std::set<std::string>());
+              std::set<std::string> blacklisted_scscfs = std::set<std::string>(),
+              ICSCFQueryCache* query_cache = NULL);
   virtual ~ICSCFRouter();
 
   int get_scscf(pj_pool_t* pool,
@@ -47,6 +90,16 @@ protected:
   /// Parses a set of capabilities in the HSS response.
   bool parse_capabilities(rapidjson::Value& caps, std::vector<int>& parsed_caps);
 
+  /// Uses the cached result of an HSS query, if there is one.  Returns true
+  /// if a cached result was found.
+  bool find_cached_rsp(const std::string& key);
+
+  /// Caches the result of a successful HSS query.
+  void cache_rsp(const std::string& key);
+
+  /// Cache of HSS query results, or NULL if caching is disabled.
+  ICSCFQueryCache* _query_cache;
+
   /// Homestead connection class for performing HSS queries.
   HSSConnection* _hss;
 
@@ -68,8 +121,9 @@ protected:
   bool _queried_caps;
 
   /// Structure storing the most recent response from the HSS for this
-  /// transaction.
-  ServerCapabilities _hss_rsp;
+  /// transaction.  This is never modified once it has been parsed, so it is
+  /// shared with the query cache and the ACR rather than copied.
+  std::shared_ptr<const ServerCapabilities> _hss_rsp;
 
   /// The list of S-CSCFs already attempted for this request.
   std::vector<std::string> _attempted_scscfs;
@@ -93,7 +147,8 @@ public:
                 const std::string& visited_network,
                 const std::string& auth_type,
                 const bool& emergency,
-                std::set<std::string> blacklisted_scscfs = std::set<std::string>());
+                std::set<std::string> blacklisted_scscfs = std::set<std::string>(),
+                ICSCFQueryCache* query_cache = NULL);
   ~ICSCFUARouter();
 
 private:
@@ -129,7 +184,8 @@ public:
                  int port,
                  const std::string& impu,
                  bool originating,
-                 std::set<std::string> blacklisted_scscfs = std::set<std::string>());
+                 std::set<std::string> blacklisted_scscfs = std::set<std::string>(),
+                 ICSCFQueryCache* query_cache = NULL);
   ~ICSCFLIRouter();
 
   /// Function to change the _impu we're looking up. This is used after
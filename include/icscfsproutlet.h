@@ -33,6 +33,7 @@ extern "C" {
 #include "snmp_success_fail_count_by_request_type_table.h"
 #include "snmp_success_fail_count_table.h"
 #include "compositesproutlet.h"
+#include "tsx_arena.h"
 
 class ICSCFSproutletTsx;
 class ICSCFSproutletRegTsx;
@@ -54,7 +55,8 @@ public:
                  SNMP::SuccessFailCountByRequestTypeTable* outgoing_sip_transactions_tbl,
                  bool override_npdi,
                  int network_function_port,
-                 std::set<std::string> blacklisted_scscfs = std::set<std::string>());
+                 std::set<std::string> blacklisted_scscfs = std::set<std::string>(),
+                 ICSCFQueryCache* query_cache = NULL);
 
   virtual ~ICSCFSproutlet();
 
@@ -133,10 +135,13 @@ private:
 
   /// The list of blacklisted S-CSCFs
   std::set<std::string> _blacklisted_scscfs;
+
+  /// Cache of HSS query results, or NULL if caching is disabled.
+  ICSCFQueryCache* _query_cache;
 };
 
 
-class ICSCFSproutletTsx : public CompositeSproutletTsx
+class ICSCFSproutletTsx : public CompositeSproutletTsx, public TsxArenaAllocated
 {
 public:
   ICSCFSproutletTsx(ICSCFSproutlet* icscf,
@@ -193,7 +198,7 @@ private:
   bool _session_set_up;
 };
 
-class ICSCFSproutletRegTsx : public CompositeSproutletTsx
+class ICSCFSproutletRegTsx : public CompositeSproutletTsx, public TsxArenaAllocated
 {
 public:
   ICSCFSproutletRegTsx(ICSCFSproutlet* icscf, const std::string& next_hop_service);
@@ -20,6 +20,9 @@ extern "C" {
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+
+#include <boost/regex.hpp>
 
 #include "rapidxml/rapidxml.hpp"
 #include "sessioncase.h"
@@ -69,38 +72,179 @@ struct AsInvocation
 };
 
 /// A single Initial Filter Criterion (iFC).
+//
+// The iFC XML is compiled when the Ifc is created into a flat list of service
+// point triggers with pre-compiled regular expressions, and it is this
+// compiled form that is evaluated against each request.  Copies of an Ifc
+// share the compiled form.
 class Ifc
 {
 public:
-  Ifc(rapidxml::xml_node<>* ifc) :
-    _ifc(ifc)
-  {
-  }
+  Ifc(rapidxml::xml_node<>* ifc);
+
+  /// This constructor creates an Ifc from a node in a document that is shared
+  // between many Ifcs (e.g. the shared or fallback iFC configuration).  The
+  // Ifc, and any copies of it, keep the document alive.
+  Ifc(rapidxml::xml_node<>* ifc,
+      std::shared_ptr<rapidxml::xml_document<> > owner);
 
   /// This constructor creates an Ifc and makes sure that all of its
   // associated memory is owned by the passed in XML document.
   Ifc(std::string ifc_str,
       rapidxml::xml_document<>* ifc_doc);
 
+  class MatchCache;
+
+  /// Tests whether the iFC matches a message.  The iFCs evaluated against a
+  // message can share a MatchCache, so that the parts of the message that
+  // are matched against are only extracted once, and an SPT that's the same
+  // as one in an iFC already evaluated isn't matched again.
   bool filter_matches(const SessionCase& session_case,
                       const bool is_registered,
                       const bool is_initial_registration,
                       pjsip_msg* msg,
-                      SAS::TrailId trail) const;
+                      SAS::TrailId trail,
+                      MatchCache* cache = NULL) const;
 
   AsInvocation as_invocation() const;
 
+  /// Reports the full XML of this iFC to SAS.  This is done once when the
+  // iFCs for a served user are loaded, so that evaluating the iFC only needs
+  // to log a compact identifier.
+  void report_to_sas(SAS::TrailId trail) const;
+
+  /// Whether to log the full iFC XML to SAS every time it is evaluated,
+  // rather than the compact identifier.
+  static bool sas_log_full_ifcs;
+
 private:
 
 class ifc_error : public std::exception {};
 
+  /// An error found while compiling the iFC.  This is raised at the point in
+  // evaluation where it would have been hit when evaluating the XML directly,
+  // so a broken iFC is reported and skipped in exactly the same way.
+  struct DeferredError
+  {
+    // Set if the error was an XML error hit parsing a value.
+    std::shared_ptr<xml_error> _xml_error;
+
+    // Otherwise, the reason that the iFC is invalid.  Empty if there is no
+    // error.
+    std::string _invalid_reason;
+
+    bool is_set() const
+    {
+      return (_xml_error || !_invalid_reason.empty());
+    }
+
+    void raise(const std::string& server_name, SAS::TrailId trail) const;
+  };
+
+  /// A compiled service point trigger.
+  struct CompiledSpt
+  {
+    enum SptClass
+    {
+      METHOD,
+      SIP_HEADER,
+      SESSION_CASE,
+      REQUEST_URI,
+      SESSION_DESCRIPTION,
+      UNKNOWN
+    };
+
+    CompiledSpt() :
+      _negated(false),
+      _spt_class(UNKNOWN),
+      _is_register(false),
+      _has_content(false),
+      _session_case(0),
+      _unusual_req_uri(false)
+    {}
+
+    DeferredError _negated_error;
+    bool _negated;
+
+    // Any error finding the class of the SPT, or compiling its main regex or
+    // value.
+    DeferredError _error;
+    std::string _class_name;
+    SptClass _spt_class;
+
+    // Method.  If this is REGISTER, the registration types to match (if any).
+    std::string _method;
+    bool _is_register;
+    std::vector<int> _reg_types;
+    DeferredError _reg_type_error;
+
+    // SIPHeader and SessionDescription.  _regex matches the header name or
+    // SDP line type, and _content_regex the header value or SDP line content.
+    // RequestURI also uses _regex.
+    boost::regex _regex;
+    bool _has_content;
+    boost::regex _content_regex;
+    DeferredError _content_error;
+
+    // SessionCase.
+    int _session_case;
+
+    // RequestURI.
+    bool _unusual_req_uri;
+
+    // Identifies the regular expressions of a SIPHeader, RequestURI or
+    // SessionDescription SPT, so that SPTs with the same regular expressions
+    // share their result in a MatchCache.
+    std::string _match_key;
+
+    std::vector<int32_t> _groups;
+    DeferredError _group_error;
+  };
+
+  /// A compiled iFC.
+  struct CompiledIfc
+  {
+    CompiledIfc() :
+      _has_ppi(false),
+      _ppi_reg(false),
+      _has_trigger(false),
+      _cnf(false)
+    {}
+
+    // The iFC XML, printed once for SAS logging.
+    std::string _ifc_str;
+
+    // A compact identifier for the iFC for SAS logging, made up of its
+    // priority and server name.
+    std::string _sas_id;
+
+    // Any error finding the ServerName.
+    DeferredError _as_error;
+    std::string _server_name;
+
+    DeferredError _ppi_error;
+    bool _has_ppi;
+    bool _ppi_reg;
+
+    bool _has_trigger;
+    DeferredError _cnf_error;
+    bool _cnf;
+
+    std::vector<CompiledSpt> _spts;
+  };
+
+  static std::shared_ptr<CompiledIfc> compile(rapidxml::xml_node<>* ifc);
+
+  static void compile_spt(rapidxml::xml_node<>* spt,
+                          CompiledSpt& compiled);
+
   static bool spt_matches(const SessionCase& session_case,
                           const bool is_registered,
                           const bool is_initial_registration,
                           pjsip_msg *msg,
-                          rapidxml::xml_node<>* spt,
-                          std::string ifc_str,
-                          std::string server_name,
+                          const CompiledSpt& spt,
+                          const std::string& server_name,
+                          MatchCache& cache,
                           SAS::TrailId trail);
 
   static void handle_invalid_ifc(std::string error,
@@ -116,5 +260,58 @@ class ifc_error : public std::exception {};
                                  SAS::TrailId trail);
 
   rapidxml::xml_node<>* _ifc;
-  std::string _server_name;
+  std::shared_ptr<const CompiledIfc> _compiled;
+
+  // The document that owns _ifc, if it isn't owned by the caller.
+  std::shared_ptr<rapidxml::xml_document<> > _owner;
 };
+
+/// The parts of a message that SPTs are matched against, and the results of
+// matching them.  A cache must only be used for one message, and while the
+// message isn't changed.
+class Ifc::MatchCache
+{
+public:
+  MatchCache() :
+    _headers_found(false),
+    _req_uri_found(false),
+    _sdp_found(false)
+  {}
+
+private:
+  friend class Ifc;
+
+  // The result of matching a SIPHeader or SessionDescription SPT - whether
+  // any header name or SDP line type matched (which is when an error in the
+  // content regex is raised), and whether the SPT matched.
+  struct Result
+  {
+    bool type_matched;
+    bool matched;
+  };
+
+  struct Header
+  {
+    pjsip_hdr* hdr;
+    std::string name;
+    bool value_found;
+    std::string value;
+  };
+
+  Result sip_header(pjsip_msg* msg, const CompiledSpt& spt);
+  bool request_uri(pjsip_msg* msg, const CompiledSpt& spt);
+  Result session_description(pjsip_msg* msg, const CompiledSpt& spt);
+
+  bool _headers_found;
+  std::vector<Header> _headers;
+
+  bool _req_uri_found;
+  std::string _req_uri;
+
+  bool _sdp_found;
+  std::vector<std::string> _sdp_lines;
+
+  // Keyed on the SPTs' _match_key.
+  std::unordered_map<std::string, Result> _results;
+};
+
@@ -56,6 +56,12 @@ public:
     return _ifcs;
   }
 
+  /// The document the iFCs were parsed from (NULL if they weren't).
+  const std::shared_ptr<rapidxml::xml_document<>>& doc() const
+  {
+    return _ifc_doc;
+  }
+
 private:
   std::shared_ptr<rapidxml::xml_document<> > _ifc_doc;
   std::vector<Ifc> _ifcs;
@@ -0,0 +1,111 @@
+/**
+ * @file impi_challenge_writer.h Definition of ImpiChallengeWriter - writes
+ * authentication challenges to the IMPI store in the background.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IMPI_CHALLENGE_WRITER_H__
+#define IMPI_CHALLENGE_WRITER_H__
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <pthread.h>
+
+#include "impistore.h"
+#include "sharded_lru_cache.h"
+#include "exception_handler.h"
+#include "sas.h"
+
+/// Writes authentication challenges to the IMPI store on a pool of background
+/// threads, rather than on the thread handling the request.
+///
+/// Writes are coalesced - if a challenge is written again before the earlier
+/// write has been made (for example, because the challenge has been
+/// responded to and its nonce count updated), only the later version is
+/// written.  Every challenge written is also held in a local cache for a few
+/// seconds, so the response to the challenge can usually be checked without
+/// reading the store, even if the write hasn't completed yet.
+///
+/// Challenges written through other nodes are only seen once they have been
+/// written to the store, and a failed write is only logged - the challenge
+/// may then only be usable on this node.
+class ImpiChallengeWriter
+{
+public:
+  /// The function that actually writes a challenge to the store(s).
+  typedef std::function<Store::Status(const std::string& impi,
+                                      ImpiStore::AuthChallenge* auth_challenge,
+                                      SAS::TrailId trail)> WriteFn;
+
+  /// Constructor.
+  /// @param write_fn          - Function to write challenges to the store.
+  /// @param num_threads       - Number of threads to write on.
+  /// @param cache_ttl         - Time in seconds to cache challenges for.
+  /// @param cache_size        - Maximum number of challenges to cache.
+  /// @param exception_handler - Exception handler for the writing threads.
+  ImpiChallengeWriter(WriteFn write_fn,
+                      int num_threads,
+                      int cache_ttl,
+                      size_t cache_size,
+                      ExceptionHandler* exception_handler);
+
+  /// Destructor.  Any writes that haven't been made yet are lost.
+  ~ImpiChallengeWriter();
+
+  /// Queue a write of a challenge.  The writer takes a copy of the challenge,
+  /// so the caller keeps ownership of it.
+  void write(const std::string& impi,
+             ImpiStore::AuthChallenge* auth_challenge,
+             SAS::TrailId trail);
+
+  /// Look up a recently written challenge.
+  ///
+  /// @return - A copy of the challenge (which the caller owns), or NULL if it
+  ///           isn't cached.
+  ImpiStore::AuthChallenge* find(const std::string& impi,
+                                 const std::string& nonce);
+
+  /// Returns the number of writes that haven't been started yet.
+  size_t num_pending();
+
+private:
+  class Pool;
+
+  struct PendingWrite
+  {
+    std::string impi;
+    ImpiStore::AuthChallenge* auth_challenge;
+    SAS::TrailId trail;
+  };
+
+  static std::string cache_key(const std::string& impi,
+                               const std::string& nonce);
+
+  // Make the pending write for the specified key (called on the pool's
+  // threads).
+  void process_write(const std::string& key);
+
+  WriteFn _write_fn;
+  int _cache_ttl;
+
+  // Writes that haven't been started yet, keyed by IMPI and nonce.  Each key
+  // is on the pool's queue exactly once while it is in this map.
+  std::map<std::string, PendingWrite> _pending;
+  pthread_mutex_t _pending_lock;
+
+  ShardedLRUCache<std::string, std::shared_ptr<const ImpiStore::AuthChallenge>> _cache;
+
+  Pool* _pool;
+
+  static const int NUM_CACHE_SHARDS = 16;
+};
+
+#endif
@@ -13,6 +13,7 @@
 #define IMPISTORE_H_
 
 #include "store.h"
+#include "compact_encoding.h"
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
@@ -70,6 +71,12 @@ public:
     /// Destructor must be virtual as we're going to extend this class.
     virtual ~AuthChallenge() {};
 
+    /// Returns a copy of this challenge, which the caller owns.
+    virtual ImpiStore::AuthChallenge* clone() const
+    {
+      return new ImpiStore::AuthChallenge(*this);
+    }
+
     /// Write to JSON writer (IMPI format).
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>* writer,
                             bool expiry_in_ms = false);
@@ -79,6 +86,13 @@ public:
                                                bool expiry_in_ms = false,
                                                bool include_expired = false);
 
+    /// Write to compact binary writer (IMPI format).
+    virtual void write_binary(CompactEncoding::Writer& writer);
+
+    /// Deserialization from compact binary (IMPI format).
+    static ImpiStore::AuthChallenge* from_binary(const std::string& data,
+                                                 bool include_expired = false);
+
     /// Getters and setters
     Type get_type()
     {
@@ -170,7 +184,24 @@ public:
       return _updated;
     }
 
+  protected:
+    /// Read a field of the compact binary format into this challenge.
+    /// Unrecognised fields are ignored.
+    virtual void read_binary_field(uint32_t tag,
+                                   CompactEncoding::WireType type,
+                                   uint64_t uint_value,
+                                   const std::string& bytes_value);
+
+    /// Returns whether the type-specific fields required for a challenge of
+    /// this type are present, logging any that are missing.
+    virtual bool has_required_fields() { return true; }
+
   private:
+    /// Check and default the base fields of a deserialized challenge,
+    /// deleting it and returning NULL if it must be dropped.
+    static ImpiStore::AuthChallenge* check_fields(ImpiStore::AuthChallenge* auth_challenge,
+                                                  bool include_expired);
+
     /// Constructor.
     /// @param _type         Type of authentication challenge.
     ///
@@ -245,10 +276,18 @@ public:
     /// Destructor.
     virtual ~DigestAuthChallenge() {};
 
+    virtual ImpiStore::AuthChallenge* clone() const override
+    {
+      return new ImpiStore::DigestAuthChallenge(*this);
+    }
+
     /// Write to JSON writer (IMPI format).
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>* writer,
                             bool expiry_in_ms = false) override;
 
+    /// Write to compact binary writer (IMPI format).
+    virtual void write_binary(CompactEncoding::Writer& writer) override;
+
     /// Deserialization from JSON (IMPI format).
     static ImpiStore::DigestAuthChallenge* from_json(rapidjson::Value* json);
 
@@ -286,6 +325,14 @@ public:
       _ha1 = ha1;
     }
 
+  protected:
+    virtual void read_binary_field(uint32_t tag,
+                                   CompactEncoding::WireType type,
+                                   uint64_t uint_value,
+                                   const std::string& bytes_value) override;
+
+    virtual bool has_required_fields() override;
+
   private:
     /// Constructor.
     DigestAuthChallenge() :
@@ -304,8 +351,10 @@ public:
     std::string _ha1;
 
     // The IMPI store is a friend so it can call our JSON serialization
-    // functions.
+    // functions, and the base class so it can construct us when
+    // deserializing.
     friend class ImpiStore;
+    friend class AuthChallenge;
   };
 
   /// @class ImpiStore::AKAAuthChallenge
@@ -327,10 +376,18 @@ public:
     /// Destructor.
     virtual ~AKAAuthChallenge() {};
 
+    virtual ImpiStore::AuthChallenge* clone() const override
+    {
+      return new ImpiStore::AKAAuthChallenge(*this);
+    }
+
     /// Write to JSON writer (IMPI format).
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>* writer,
                             bool expiry_in_ms = false) override;
 
+    /// Write to compact binary writer (IMPI format).
+    virtual void write_binary(CompactEncoding::Writer& writer) override;
+
     /// Deserialization from JSON (IMPI format).
     static ImpiStore::AKAAuthChallenge* from_json(rapidjson::Value* json);
 
@@ -346,6 +403,14 @@ public:
       _response = response;
     }
 
+  protected:
+    virtual void read_binary_field(uint32_t tag,
+                                   CompactEncoding::WireType type,
+                                   uint64_t uint_value,
+                                   const std::string& bytes_value) override;
+
+    virtual bool has_required_fields() override;
+
   private:
     /// Constructor.
     AKAAuthChallenge() :
@@ -356,8 +421,10 @@ public:
     std::string _response;
 
     // The IMPI store is a friend so it can call our JSON serialization
-    // functions.
+    // functions, and the base class so it can construct us when
+    // deserializing.
     friend class ImpiStore;
+    friend class AuthChallenge;
   };
 
   /// @class ImpiStore::Impi
@@ -425,6 +492,20 @@ public:
   virtual Store::Status delete_impi(Impi* impi,
                                     SAS::TrailId trail) = 0;
 
+  /// Retrieves the IMPIs for several private user identities at once.  The
+  /// default implementation issues the lookups in parallel, so the round
+  /// trips to the store overlap rather than running one after another.
+  ///
+  /// @param impis                The private user identities.
+  /// @param impi_objs[out]       The IMPI for each private identity, in the
+  ///                             same order, as returned by get_impi.  The
+  ///                             caller owns the returned objects.
+  /// @param include_expired      Whether to include expired challenges.
+  virtual void get_impis(const std::vector<std::string>& impis,
+                         std::vector<Impi*>& impi_objs,
+                         SAS::TrailId trail,
+                         bool include_expired = false);
+
 protected:
   static rapidjson::Document* json_from_string(const std::string& string);
 };
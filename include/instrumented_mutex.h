@@ -0,0 +1,156 @@
+/**
+ * @file instrumented_mutex.h Mutexes that record how long they are waited
+ * for and held.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef INSTRUMENTED_MUTEX_H__
+#define INSTRUMENTED_MUTEX_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "stage_latency.h"
+
+/// Statistics shared by all the locks with the same name (for example, all
+/// the shards of a table).  The histograms record nanoseconds.
+struct LockStats
+{
+  LockStats() : acquisitions(0), contended(0) {}
+
+  /// The number of times the locks have been taken.
+  std::atomic<uint64_t> acquisitions;
+
+  /// The number of times a lock was already held when a thread wanted it.
+  std::atomic<uint64_t> contended;
+
+  /// How long threads waited for the locks, when they were already held.
+  StageHistogram wait_ns;
+
+  /// How long the locks were held for.
+  StageHistogram hold_ns;
+};
+
+/// Always-on instrumentation of Sprout's hot locks, to show which of them
+/// contend under load.
+namespace LockInstrumentation
+{
+  /// Returns the statistics for the named locks, creating them if needed.
+  /// This takes a lock, so mutexes that are created often should look the
+  /// statistics up once and keep the pointer, which stays valid for the life
+  /// of the process.
+  LockStats* stats(const std::string& name);
+
+  struct LockSummary
+  {
+    std::string name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    StageHistogram::Summary wait_ns;
+    StageHistogram::Summary hold_ns;
+  };
+
+  /// Returns a summary of every named lock, sorted by name.
+  std::vector<LockSummary> summaries();
+}
+
+/// A pthread mutex that records its wait and hold times against a LockStats.
+/// It can be used with std::lock_guard and std::unique_lock.
+///
+/// Taking a free lock costs a trylock, two reads of the TSC and a few relaxed
+/// atomic operations on top of the plain mutex.  The clock is only read
+/// again when the lock is contended.
+class InstrumentedMutex
+{
+public:
+  /// @param name      - The name of the lock, which it shares statistics
+  ///                    with other locks of the same name.
+  /// @param recursive - Whether the lock can be taken again by the thread
+  ///                    that holds it.  The hold time is then from the
+  ///                    outermost lock to the matching unlock.
+  InstrumentedMutex(const std::string& name, bool recursive = false);
+  InstrumentedMutex(LockStats* stats, bool recursive = false);
+  ~InstrumentedMutex();
+
+  InstrumentedMutex(const InstrumentedMutex&) = delete;
+  InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+  void lock()
+  {
+    if (pthread_mutex_trylock(&_mutex) != 0)
+    {
+      StageLatency::Ticks start = StageLatency::now();
+      pthread_mutex_lock(&_mutex);
+      _stats->contended.fetch_add(1, std::memory_order_relaxed);
+      _stats->wait_ns.record(StageLatency::ticks_to_ns(StageLatency::now() - start));
+    }
+
+    locked();
+  }
+
+  bool try_lock()
+  {
+    if (pthread_mutex_trylock(&_mutex) != 0)
+    {
+      return false;
+    }
+
+    locked();
+    return true;
+  }
+
+  void unlock()
+  {
+    if (--_depth == 0)
+    {
+      record_hold();
+    }
+
+    pthread_mutex_unlock(&_mutex);
+  }
+
+  /// Waits on a condition variable with this (non-recursive) lock held.  The
+  /// time spent waiting isn't counted as holding the lock.
+  void wait(pthread_cond_t* cond);
+
+  /// As wait, with a timeout.  Returns the result of pthread_cond_timedwait.
+  int timedwait(pthread_cond_t* cond, const struct timespec* deadline);
+
+private:
+  void locked()
+  {
+    if (_depth++ == 0)
+    {
+      _locked_at = StageLatency::now();
+      _stats->acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void record_hold()
+  {
+    StageLatency::Ticks now = StageLatency::now();
+    _stats->hold_ns.record((now > _locked_at) ?
+                             StageLatency::ticks_to_ns(now - _locked_at) : 0);
+  }
+
+  void init(bool recursive);
+
+  pthread_mutex_t _mutex;
+  LockStats* _stats;
+
+  // These are only accessed by the thread holding the lock.
+  int _depth;
+  StageLatency::Ticks _locked_at;
+};
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * @file load_report_queue.h Deferring worker threads' latency reports to the
+ * load monitor.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef LOAD_REPORT_QUEUE_H__
+#define LOAD_REPORT_QUEUE_H__
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "sas.h"
+#include "load_monitor.h"
+
+/// Queues the latencies that worker threads report to the load monitor, so
+/// that they are passed on by the transport thread just before it next asks
+/// the load monitor to admit a request.
+///
+/// The load monitor updates its token bucket and latency statistics under a
+/// single lock, so with every worker reporting each message's latency to it
+/// directly, the transport thread's admission check contends with all of
+/// them.  Instead each worker has its own single-producer queue of reports,
+/// which it adds to without taking any lock, and only one thread at a time
+/// (normally the transport thread) takes the load monitor's lock.  The
+/// workers read the load monitor's target latency from a copy refreshed
+/// when reports are passed on.
+///
+/// If a worker's queue fills up (because no requests are arriving to flush
+/// it), or the worker doesn't have a queue, its reports go straight to the
+/// load monitor.
+class LoadReportQueue
+{
+public:
+  /// Constructor.
+  /// @param load_monitor  - The load monitor to pass the reports to.
+  /// @param num_workers   - The number of worker queues, each used by one
+  ///                        worker thread.
+  LoadReportQueue(LoadMonitor* load_monitor, size_t num_workers);
+
+  ~LoadReportQueue();
+
+  /// Reports the latency of a message processed by the given worker.  Only
+  /// one thread may report for each worker index.
+  void request_complete(int worker_index,
+                        unsigned long latency_us,
+                        SAS::TrailId trail);
+
+  /// Passes the queued reports to the load monitor.  If another thread is
+  /// already doing so, this returns straight away.
+  void flush();
+
+  /// The load monitor's target latency as of the last flush.
+  unsigned long get_target_latency_us() const
+  {
+    return _target_latency_us.load(std::memory_order_relaxed);
+  }
+
+  /// The number of reports each worker queue holds.
+  static const size_t QUEUE_SIZE = 1024;
+
+private:
+  struct Report
+  {
+    unsigned long latency_us;
+    SAS::TrailId trail;
+  };
+
+  /// A worker's queue.  The head is only written by the worker and the tail
+  /// only by the thread holding _flush_lock, so they are kept on separate
+  /// cache lines.
+  struct WorkerQueue
+  {
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    Report reports[QUEUE_SIZE];
+  };
+
+  LoadMonitor* _load_monitor;
+  std::vector<WorkerQueue*> _queues;
+  std::mutex _flush_lock;
+  std::atomic<unsigned long> _target_latency_us;
+};
+
+#endif
@@ -113,13 +113,7 @@ public:
   {}
 
   /// Destructor.
-  ~MangelwurzelTsx()
-  {
-    if (_unmodified_request != NULL)
-    {
-      free_msg(_unmodified_request);
-    }
-  }
+  ~MangelwurzelTsx() {}
 
   /// Implementation of SproutletTsx methods in mangelwurzel.
   virtual void on_rx_initial_request(pjsip_msg* req);
@@ -130,8 +124,9 @@ private:
   /// The config object for this transaction.
   Config _config;
 
-  /// The original request that started this transaction.
-  pjsip_msg* _unmodified_request;
+  /// The original request that started this transaction.  This is only read,
+  /// so isn't cloned.
+  const pjsip_msg* _unmodified_request;
 
   /// Helper functions for manipulating SIP messages.
   void mangle_dialog_identifiers(pjsip_msg* req, pj_pool_t* pool);
@@ -143,9 +138,11 @@ private:
   void mangle_record_routes(pjsip_msg* msg, pj_pool_t* pool);
   void mangle_routes(pjsip_msg* msg, pj_pool_t* pool);
 
-  void mangle_string(std::string& str);
+  void mangle_string(pj_str_t& str, pj_pool_t* pool);
   void rot13(std::string& str);
+  void rot13(char* str, size_t len);
   void reverse(std::string& str);
+  void reverse(char* str, size_t len);
 
   void strip_via_hdrs(pjsip_msg* req);
   void add_via_hdrs(pjsip_msg* rsp, pj_pool_t* pool);
@@ -0,0 +1,107 @@
+/**
+ * @file memory_accounting.h Accounting of memory use by subsystem.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMORY_ACCOUNTING_H__
+#define MEMORY_ACCOUNTING_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// Accounting of the memory used by each subsystem, so that the process's
+/// RSS can be attributed.
+///
+/// Each subsystem has a named account, holding its current usage in bytes
+/// and the highest it has been.  Subsystems either adjust their account as
+/// they allocate and free (which is a relaxed atomic add), or, where that
+/// would be on a hot path or the usage is easier to estimate from the size
+/// of a container, give the account a sampler that is called whenever the
+/// usage is read.  The figures for containers are estimates, from the number
+/// of entries and the size of each, and don't include memory the entries
+/// point to.
+///
+/// Every account is reported on the management interface at /memory and as
+/// gauges at /metrics.
+namespace MemoryAccounting
+{
+  class Account
+  {
+  public:
+    Account(const std::string& name);
+
+    const std::string& name() const { return _name; }
+
+    /// Adjusts the usage by the given (possibly negative) number of bytes.
+    void adjust(int64_t delta)
+    {
+      int64_t bytes = _bytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+      update_high_water(bytes);
+    }
+
+    void add(size_t bytes) { adjust((int64_t)bytes); }
+    void remove(size_t bytes) { adjust(-(int64_t)bytes); }
+
+    /// Sets the function that returns the usage, which replaces adjusting
+    /// the account.  The owner must clear it (by setting an empty function)
+    /// before anything the sampler uses is destroyed.
+    void set_sampler(std::function<size_t()> sampler);
+
+    /// Returns the current usage, sampling it if there is a sampler.
+    int64_t bytes();
+
+    /// Returns the highest usage seen.  For an account with a sampler, this
+    /// is the highest sampled.
+    int64_t high_water() const
+    {
+      return _high_water.load(std::memory_order_relaxed);
+    }
+
+  private:
+    void update_high_water(int64_t bytes)
+    {
+      int64_t high_water = _high_water.load(std::memory_order_relaxed);
+      while ((bytes > high_water) &&
+             (!_high_water.compare_exchange_weak(high_water,
+                                                 bytes,
+                                                 std::memory_order_relaxed)))
+      {
+      }
+    }
+
+    const std::string _name;
+    std::atomic<int64_t> _bytes;
+    std::atomic<int64_t> _high_water;
+
+    std::mutex _sampler_lock;
+    std::function<size_t()> _sampler;
+  };
+
+  /// Returns the named account, creating it if needed.  This takes a lock,
+  /// so callers should look the account up once and keep the pointer, which
+  /// stays valid for the life of the process.
+  Account* account(const std::string& name);
+
+  /// The usage of one account.
+  struct Usage
+  {
+    std::string name;
+    int64_t bytes;
+    int64_t high_water;
+  };
+
+  /// Returns the usage of every account, in name order.
+  std::vector<Usage> usage();
+}
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * @file metrics.h Metrics exported in OpenMetrics format.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef METRICS_H__
+#define METRICS_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// Metrics that are scraped (by Prometheus, for example) from the management
+/// HTTP interface in OpenMetrics text format.  These are fed from the same
+/// places as the corresponding SNMP statistics, but are cumulative and, for
+/// latencies, have the full distribution rather than a mean and variance per
+/// period.
+///
+/// Each metric is split into shards, and each thread updates the shard for
+/// its own index, so updates are a relaxed atomic add on a cache line that is
+/// normally only used by that thread.  A scrape adds the shards up, so may
+/// miss updates made while it runs.
+namespace Metrics
+{
+  /// The number of shards in each metric.  Threads beyond this share shards,
+  /// which is still correct, just with more cache line contention.
+  static const int NUM_SHARDS = 64;
+
+  /// Returns the calling thread's shard index.
+  int shard();
+
+  /// A count that only goes up.
+  class Counter
+  {
+  public:
+    Counter();
+
+    void increment(uint64_t value = 1)
+    {
+      _shards[shard()].value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+  private:
+    // Shards are padded rather than aligned to a cache line, as the
+    // metrics are allocated on the heap, but either way each shard's value
+    // is on a different line from its neighbours'.
+    struct Shard
+    {
+      std::atomic<uint64_t> value;
+      char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    Shard _shards[NUM_SHARDS];
+  };
+
+  /// A histogram of durations, recorded in microseconds and exported in
+  /// seconds.
+  class Histogram
+  {
+  public:
+    /// Constructor.
+    /// @param bounds_us  - The upper bounds of the buckets, in increasing
+    ///                     order.  There is also an unbounded bucket above
+    ///                     the last.
+    Histogram(const std::vector<uint64_t>& bounds_us);
+    ~Histogram();
+
+    /// Records a duration.
+    void observe(uint64_t us);
+
+    /// Totals across the shards.  The counts are per bucket (not
+    /// cumulative), with the unbounded bucket last.
+    void totals(std::vector<uint64_t>& counts, uint64_t& sum_us) const;
+
+    const std::vector<uint64_t>& bounds_us() const { return _bounds_us; }
+
+  private:
+    // Padded as for Counter.  Each shard's buckets are allocated
+    // separately.
+    struct Shard
+    {
+      std::atomic<uint64_t> sum_us;
+      std::atomic<uint64_t>* buckets;
+      char pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<uint64_t>*)];
+    };
+
+    const std::vector<uint64_t> _bounds_us;
+    Shard _shards[NUM_SHARDS];
+  };
+
+  /// Bucket bounds suited to the latency of a dependency, or of processing a
+  /// SIP message - 500us to 10s.
+  extern const std::vector<uint64_t> LATENCY_BOUNDS_US;
+
+  /// Returns the named counter, creating it if needed.  This takes a lock, so
+  /// callers on hot paths should look the metric up once and keep the
+  /// pointer, which stays valid for the life of the process.
+  Counter* counter(const std::string& name, const std::string& help);
+
+  /// Returns the named histogram, creating it with the given bounds if
+  /// needed.  As for counter(), the pointer should be kept.
+  Histogram* histogram(const std::string& name,
+                       const std::string& help,
+                       const std::vector<uint64_t>& bounds_us = LATENCY_BOUNDS_US);
+
+  /// Registers a gauge, whose value is read from the given function whenever
+  /// the metrics are rendered.  A gauge registered with the name of an
+  /// existing one replaces it.
+  void gauge(const std::string& name,
+             const std::string& help,
+             std::function<double()> value);
+
+  /// Renders all the metrics in OpenMetrics text format.
+  std::string render();
+
+  /// The content type of the rendered metrics.
+  extern const char* const CONTENT_TYPE;
+}
+
+#endif
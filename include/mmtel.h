@@ -15,6 +15,8 @@
 #ifndef MMTEL_H__
 #define MMTEL_H__
 
+#include <atomic>
+#include <memory>
 #include <string>
 
 extern "C" {
@@ -30,6 +32,8 @@ extern "C" {
 #include "simservs.h"
 #include "aschain.h"
 #include "counter.h"
+#include "sharded_lru_cache.h"
+#include "snmp_event_accumulator_table.h"
 
 class CDivCallback
 {
@@ -40,10 +44,23 @@ public:
 class Mmtel : public AppServer
 {
 public:
+  /// Constructor.
+  ///
+  /// If simservs_cache_ttl and simservs_cache_size are both non-zero, users'
+  /// parsed simservs documents are cached for simservs_cache_ttl seconds, so
+  /// calls don't each fetch and parse them from the XDMS.  For each cache
+  /// hit, latency_saved_tbl (if not NULL) accumulates the average time the
+  /// XDMS fetches are currently taking.  If registration prefetching is
+  /// enabled, users' simservs are also fetched into the cache when they
+  /// register.
   Mmtel(const std::string& service_name,
-        XDMConnection* xdm_client) :
-    AppServer(service_name),
-    _xdmc(xdm_client) {};
+        XDMConnection* xdm_client,
+        int simservs_cache_ttl = 0,
+        size_t simservs_cache_size = 0,
+        const ShardedLRUCacheStatsTables& simservs_cache_stats_tbls =
+                                              ShardedLRUCacheStatsTables(),
+        SNMP::EventAccumulatorTable* latency_saved_tbl = NULL);
+  virtual ~Mmtel();
 
   AppServerTsx* get_app_tsx(SproutletHelper* helper,
                             pjsip_msg* req,
@@ -54,7 +71,29 @@ public:
 private:
   XDMConnection* _xdmc;
 
-  simservs *get_user_services(std::string public_id, SAS::TrailId trail);
+  std::shared_ptr<const simservs> get_user_services(std::string public_id,
+                                                    SAS::TrailId trail);
+  std::shared_ptr<const simservs> fetch_user_services(const std::string& public_id,
+                                                      SAS::TrailId trail);
+  void prefetch_user_services(const std::string& public_id,
+                              SAS::TrailId trail);
+
+  // The number of shards in the simservs cache.
+  static const int NUM_CACHE_SHARDS = 16;
+
+  // The simservs cache, indexed by public ID, or NULL if caching is
+  // disabled.
+  int _simservs_cache_ttl;
+  ShardedLRUCache<std::string, std::shared_ptr<const simservs>>* _simservs_cache;
+
+  // The handler that fills the cache when users register, if the cache is
+  // enabled.
+  int _prefetch_handler;
+
+  // A moving average of how long fetching simservs from the XDMS takes, in
+  // microseconds, and where to record the time each cache hit saves.
+  std::atomic<unsigned long> _avg_xdm_latency_us;
+  SNMP::EventAccumulatorTable* _latency_saved_tbl;
 };
 
 // Cut-down AS that invokes MMTEL-style call diversion configured through
@@ -86,7 +125,7 @@ class MmtelTsx : public AppServerTsx
 {
 public:
   MmtelTsx(pjsip_msg* req,
-           simservs* user_services,
+           std::shared_ptr<const simservs> user_services,
            SAS::TrailId trail,
            CDivCallback* cdiv_callback = NULL);
   ~MmtelTsx();
@@ -99,7 +138,7 @@ private:
   bool _originating;
   pjsip_method_e _method;
   std::string _country_code;
-  simservs* _user_services;
+  std::shared_ptr<const simservs> _user_services;
   CDivCallback* _cdiv_callback;
   bool _ringing;
   unsigned int _media_conditions;
@@ -110,13 +149,21 @@ private:
   pjsip_status_code apply_ob_call_barring(pjsip_msg* req);
   pjsip_status_code apply_ib_call_barring(pjsip_msg* req);
   pjsip_status_code apply_call_barring(const std::vector<simservs::CBRule>* ruleset,
+                                       unsigned int rule_conditions,
                                        pjsip_msg* req);
   pjsip_status_code apply_ob_privacy(pjsip_msg* req, pj_pool_t* pool);
   pjsip_status_code apply_ib_privacy(pjsip_msg* req, pj_pool_t* pool);
   pjsip_status_code apply_cdiv_on_req(pjsip_msg* req, unsigned int conditions, pjsip_status_code code);
   bool apply_cdiv_on_rsp(pjsip_msg* rsp, unsigned int conditions, pjsip_status_code code);
   std::string check_call_diversion_rules(unsigned int conditions);
-  bool check_cb_rule(const simservs::CBRule& rule, pjsip_msg* req);
+  // The conditions that are considered by call barring rules.
+  static const unsigned int CB_CONDITIONS =
+    simservs::Rule::CONDITION_ROAMING |
+    simservs::Rule::CONDITION_INTERNATIONAL |
+    simservs::Rule::CONDITION_INTERNATIONAL_EXHC;
+
+  unsigned int get_cb_conditions(unsigned int rule_conditions, pjsip_msg* req);
+  bool is_international_call(pjsip_msg* req);
 
   unsigned int condition_from_status(int code);
   static int parse_privacy_headers(pjsip_generic_array_hdr *header_array);
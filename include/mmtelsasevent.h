@@ -25,6 +25,7 @@ namespace SASEvent
   const int ORIGINATING_SERVICES_DISABLED = MMTEL_BASE + 0x000003;
   const int TERMINATING_SERVICES_ENABLED = MMTEL_BASE + 0x000004;
   const int TERMINATING_SERVICES_DISABLED = MMTEL_BASE + 0x000005;
+  const int SIMSERVS_CACHE_HIT = MMTEL_BASE + 0x000006;
 
   const int CALL_DIVERSION_INVOKED = MMTEL_BASE + 0x000010;
   const int NO_TARGET_PARAM = MMTEL_BASE + 0x000011;
@@ -0,0 +1,212 @@
+/**
+ * @file multiplexed_httpclient.h Definition of MultiplexedHttpClient - an
+ * HTTP/2 client that multiplexes requests over a few long-lived connections.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MULTIPLEXED_HTTPCLIENT_H__
+#define MULTIPLEXED_HTTPCLIENT_H__
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+
+#include "httpconnection.h"
+#include "sas.h"
+#include "load_monitor.h"
+#include "communicationmonitor.h"
+#include "snmp_ip_count_table.h"
+#include "snmp_event_accumulator_table.h"
+#include "request_hedger.h"
+#include "http_content_decoder.h"
+
+/// HTTP/2 client for a single server (typically a load-balanced VIP).
+///
+/// HttpClient uses a curl handle, and so a TCP connection, per calling thread
+/// per server, so connections are short of traffic and often have to be
+/// re-established, paying for TCP slow-start (and any TLS handshake) each
+/// time.  This client instead keeps a small, fixed number of connections to
+/// the server, each driven by its own thread, and sends every request as a
+/// stream on the least loaded connection.
+///
+/// Plain HTTP connections use HTTP/2 with prior knowledge (h2c), so the
+/// server must support it.  The server name is resolved by curl rather than
+/// an HttpResolver, so there is no blacklisting of individual addresses.
+///
+/// The number of streams in flight is reported in an IP count table, keyed by
+/// the address each connection is connected to, and the round trip time of
+/// each stream (from the request being sent to the first byte of the
+/// response) in an event accumulator table.
+///
+/// If given a RequestHedger, GET requests that haven't been answered by the
+/// hedger's deadline are sent again on a different connection (which, behind
+/// a load balancer, will usually reach a different server), and the first
+/// successful response wins.  The other request is cancelled.
+///
+/// If given compression stats, requests offer gzip and deflate response
+/// bodies, which are decompressed as they arrive.
+class MultiplexedHttpClient
+{
+public:
+  /// Constructor.
+  /// @param server           - The server to connect to, as host[:port].
+  /// @param scheme           - "http" or "https".
+  /// @param num_connections  - The number of connections to keep open.
+  /// @param timeout_ms       - Timeout for each request.
+  /// @param load_monitor     - Load monitor told about overloaded responses
+  ///                           (may be NULL).
+  /// @param comm_monitor     - Communication monitor told about the success or
+  ///                           failure of each request (may be NULL).
+  /// @param stream_count_tbl - Table of streams in flight by remote address
+  ///                           (may be NULL).
+  /// @param rtt_tbl          - Table of stream round trip times (may be NULL).
+  /// @param hedger           - Decides when to hedge GET requests (may be
+  ///                           NULL, and must outlive the client).
+  /// @param compression_stats - Where to report the decoding of compressed
+  ///                           responses, or NULL to not offer compression
+  ///                           (must outlive the client).
+  MultiplexedHttpClient(const std::string& server,
+                        const std::string& scheme,
+                        int num_connections,
+                        long timeout_ms,
+                        LoadMonitor* load_monitor,
+                        CommunicationMonitor* comm_monitor,
+                        SNMP::IPCountTable* stream_count_tbl,
+                        SNMP::EventAccumulatorTable* rtt_tbl,
+                        RequestHedger* hedger = NULL,
+                        HttpContentDecoder::Stats* compression_stats = NULL);
+
+  /// Destructor.  Requests still in flight fail.
+  virtual ~MultiplexedHttpClient();
+
+  /// Send a request and wait for the response.
+  ///
+  /// @param method        - The HTTP method, e.g. "GET".
+  /// @param path          - The path (and query) to request.
+  /// @param body          - The request body (may be empty).
+  /// @param headers       - Extra headers, each as "Name: value".
+  /// @param response_body - Filled in with the response body.
+  /// @param trail         - SAS trail.
+  ///
+  /// @return - The HTTP status code of the response, or HTTP_SERVER_UNAVAILABLE
+  ///           or HTTP_GATEWAY_TIMEOUT if no response was received.
+  virtual HTTPCode send_request(const std::string& method,
+                                const std::string& path,
+                                const std::string& body,
+                                const std::vector<std::string>& headers,
+                                std::string& response_body,
+                                SAS::TrailId trail);
+
+  /// Returns the number of streams in flight on each connection.
+  std::vector<int> stream_counts();
+
+private:
+  /// A request that has been handed to a connection.
+  struct Transfer
+  {
+    CURL* easy;
+    curl_slist* headers;
+    std::string response_body;
+    std::unique_ptr<HttpContentDecoder> decoder;
+    size_t connection;
+    std::string remote_ip;
+    CURLcode result;
+    bool done;
+
+    // Signalled when the transfer is done.  A hedged request and its hedge
+    // share the caller's condition variable.
+    std::condition_variable* cond;
+  };
+
+  /// A connection to the server, with the thread that drives it.
+  struct Connection
+  {
+    CURLM* multi;
+
+    // Pipe used to wake the thread when requests are queued to it.
+    int wake_fds[2];
+
+    // Requests waiting to be picked up by the thread, protected by _lock.
+    std::deque<Transfer*> queue;
+
+    // Requests to be cancelled by the thread, protected by _lock.
+    std::deque<Transfer*> cancels;
+
+    // Requests queued or in flight, protected by _lock.
+    int streams;
+
+    // The address the connection was last seen connected to, protected by
+    // _lock.  Empty until the first request on the connection completes.
+    std::string remote_ip;
+
+    std::thread thread;
+  };
+
+  /// Sets up a transfer for a request.
+  void prepare_transfer(Transfer* transfer,
+                        std::condition_variable* cond,
+                        const std::string& method,
+                        const std::string& path,
+                        const std::string& body,
+                        const std::vector<std::string>& headers);
+
+  /// Frees a transfer's curl handles once it's done.
+  static void cleanup_transfer(Transfer* transfer);
+
+  /// Hands a transfer to the connection with the fewest streams in flight,
+  /// other than the one given (if any).  Returns false if the client is
+  /// shutting down.
+  bool queue_transfer(Transfer* transfer, const Connection* avoid);
+
+  /// Asks the thread driving a transfer to cancel it, and waits for it to be
+  /// done.  Must be called with the lock held.
+  void cancel_transfer(Transfer* transfer, std::unique_lock<std::mutex>& lock);
+
+  /// The body of each connection's thread.
+  void run(Connection* connection);
+
+  /// Called on a connection's thread when a request completes.
+  void complete(Transfer* transfer, CURLcode result);
+
+  /// Map a curl error to the HTTP code returned to the caller.
+  static HTTPCode curl_code_to_http_code(CURLcode code);
+
+  /// Accumulate callback for response bodies, which are decoded if they
+  /// were compressed.
+  static size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+  /// Callback for response headers, which looks for the Content-Encoding.
+  static size_t header_callback(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+  CURL* create_easy(const std::string& method,
+                    const std::string& path,
+                    const std::string& body,
+                    curl_slist* headers,
+                    Transfer* transfer);
+
+  const std::string _base_url;
+  const long _timeout_ms;
+  LoadMonitor* _load_monitor;
+  CommunicationMonitor* _comm_monitor;
+  SNMP::IPCountTable* _stream_count_tbl;
+  SNMP::EventAccumulatorTable* _rtt_tbl;
+  RequestHedger* _hedger;
+  HttpContentDecoder::Stats* _compression_stats;
+
+  std::mutex _lock;
+  bool _terminated;
+  std::vector<Connection*> _connections;
+};
+
+#endif
@@ -23,6 +23,7 @@ extern "C" {
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -93,27 +94,34 @@ public:
                             SAS::TrailId trail);
 
 private:
-  pj_status_t create_subscription_notify(
-                                  pjsip_tx_data** tdata_notify,
-                                  Subscription* s,
-                                  const std::string& aor,
-                                  const AssociatedURIs& associated_uris,
-                                  int cseq,
-                                  const ClassifiedBindings& classified_bindings,
-                                  const RegistrationState& reg_state,
-                                  int now,
-                                  SAS::TrailId trail);
+  /// The reg-info body for an AoR, compiled into a template.  The body is
+  /// the same for every subscription apart from the registration IDs, so the
+  /// template is a list of chunks of XML, with the registration id attribute
+  /// written between each pair of chunks.
+  struct RegInfo
+  {
+    std::vector<std::string> chunks;
+    RegistrationState reg_state;
+  };
+
+  void build_reg_info(const AssociatedURIs& associated_uris,
+                      const ClassifiedBindings& classified_bindings,
+                      const RegistrationState& reg_state,
+                      RegInfo& reg_info,
+                      SAS::TrailId trail);
+
+  pj_status_t create_subscription_notify(pjsip_tx_data** tdata_notify,
+                                         Subscription* s,
+                                         int cseq,
+                                         const RegInfo& reg_info,
+                                         int now);
 
   pj_status_t create_notify(pjsip_tx_data** tdata_notify,
                             Subscription* subscription,
-                            const std::string& aor,
-                            const AssociatedURIs& associated_uris,
                             int cseq,
-                            const ClassifiedBindings& classified_bindings,
-                            const RegistrationState& reg_state,
+                            const RegInfo& reg_info,
                             const SubscriptionState& subscription_state,
-                            int expiry,
-                            SAS::TrailId trail);
+                            int expiry);
 
   pj_status_t create_request_from_subscription(pjsip_tx_data** p_tdata,
                                                Subscription* subscription,
@@ -121,34 +129,19 @@ private:
                                                pj_str_t* body);
 
   pj_status_t notify_create_body(pjsip_msg_body* body,
-                                  pj_pool_t *pool,
-                                  const std::string& aor,
-                                  const AssociatedURIs& associated_uris,
-                                  Subscription* subscription,
-                                  const ClassifiedBindings& classified_bindings,
-                                  const RegistrationState& reg_state,
-                                  SAS::TrailId trail);
-
-  pj_xml_node* notify_create_reg_state_xml(
-                                  pj_pool_t *pool,
-                                  const std::string& aor,
-                                  const AssociatedURIs& associated_uris,
-                                  Subscription* subscription,
-                                  const ClassifiedBindings& classified_bindings,
-                                  const RegistrationState& reg_state,
-                                  SAS::TrailId trail);
-
-  pj_xml_node* create_reg_node(pj_pool_t* pool,
-                               pj_str_t* aor,
-                               pj_str_t* id,
-                               pj_str_t* state);
-
-
-  pj_xml_node* create_contact_node(pj_pool_t* pool,
-                                   pj_str_t* id,
-                                   pj_str_t* state,
-                                   pj_str_t* event);
-
+                                 pj_pool_t *pool,
+                                 Subscription* subscription,
+                                 const RegInfo& reg_info);
+
+  static void append_xml_attr(std::string& xml,
+                              const pj_str_t& name,
+                              const std::string& value);
+
+  static void append_xml_leaf(std::string& xml,
+                              int indent,
+                              const pj_str_t& name,
+                              const std::string& attr_xml,
+                              const std::string& content);
 };
 
 #endif
@@ -0,0 +1,44 @@
+/**
+ * @file number_normalizer.h Normalization of telephone numbers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef NUMBER_NORMALIZER_H__
+#define NUMBER_NORMALIZER_H__
+
+#include <stddef.h>
+#include <string>
+
+/// Normalization of telephone numbers for ENUM and BGCF lookups.
+///
+/// Each function makes a single pass over the number, looking each character
+/// up in a table of character classes, so replaces a regular expression
+/// replace (and the allocations that go with it) with one copy.
+namespace NumberNormalizer
+{
+  /// Strips the RFC 3966 visual separators ("-", ".", "(" and ")") from a
+  /// number.  This matches Utils::remove_visual_separators.
+  std::string remove_visual_separators(const char* number, size_t length);
+  inline std::string remove_visual_separators(const std::string& number)
+  {
+    return remove_visual_separators(number.data(), number.length());
+  }
+
+  /// Converts a user to an ENUM Application Unique String, by stripping
+  /// everything other than 0-9, and + as the first character.
+  std::string to_aus(const std::string& user);
+
+  /// Builds the ENUM domain for a key - its digits, in reverse order and
+  /// separated by dots, followed by the suffix (for example, "+1-234" and
+  /// ".e164.arpa" give "4.3.2.1.e164.arpa").  Characters other than 0-9 are
+  /// ignored.
+  std::string enum_domain(const std::string& key, const std::string& suffix);
+}
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * @file pj_str_index.h Definition of PjStrIndex - a hash index keyed on
+ * strings that is looked up with pj_str_t.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PJ_STR_INDEX_H__
+#define PJ_STR_INDEX_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <vector>
+
+/// Index from strings to values, for lookups on the SIP routing path.
+///
+/// Entries are added while the owner is being set up, and the index is then
+/// only read, so lookups take no lock.  Lookups are made directly on a
+/// pj_str_t (or pointer and length), so there's no need to construct a
+/// std::string for the key, and the table is kept at most a quarter full so
+/// a lookup nearly always takes a single probe.
+///
+/// Keys can be compared case-insensitively (as is needed for hostnames).
+template <class T>
+class PjStrIndex
+{
+public:
+  /// Constructor.
+  /// @param case_insensitive - Whether keys are compared case-insensitively.
+  /// @param not_found        - The value returned by find() for a key that
+  ///                           isn't in the index.
+  PjStrIndex(bool case_insensitive, T not_found) :
+    _case_insensitive(case_insensitive),
+    _not_found(not_found),
+    _slots(MIN_SLOTS),
+    _size(0)
+  {
+  }
+
+  /// Add an entry.  Not thread-safe with respect to find().
+  ///
+  /// @return - false (leaving the index unchanged) if the key is already in
+  ///           the index.
+  bool insert(const std::string& key, T value)
+  {
+    if (find_slot(key.data(), key.length()) != NULL)
+    {
+      return false;
+    }
+
+    if ((_size + 1) * MAX_LOAD_FACTOR > _slots.size())
+    {
+      std::vector<Slot> old_slots;
+      old_slots.swap(_slots);
+      _slots.resize(old_slots.size() * 2);
+
+      for (Slot& slot : old_slots)
+      {
+        if (slot.used)
+        {
+          place(slot);
+        }
+      }
+    }
+
+    Slot slot;
+    slot.used = true;
+    slot.hash = hash(key.data(), key.length());
+    slot.key = key;
+    slot.value = value;
+    place(slot);
+    ++_size;
+
+    return true;
+  }
+
+  /// Look up a key, returning the not_found value if it isn't in the index.
+  T find(const char* key, size_t len) const
+  {
+    const Slot* slot = find_slot(key, len);
+    return (slot != NULL) ? slot->value : _not_found;
+  }
+
+  T find(const pj_str_t* key) const
+  {
+    return find(key->ptr, key->slen);
+  }
+
+  size_t size() const { return _size; }
+
+private:
+  struct Slot
+  {
+    Slot() : used(false), hash(0), key(), value() {}
+
+    bool used;
+    uint32_t hash;
+    std::string key;
+    T value;
+  };
+
+  /// Hashes a key a word at a time.  Case is folded by setting the 0x20 bit
+  /// of every byte, which maps upper case ASCII letters to lower case (and
+  /// some punctuation onto other characters, which only costs a collision).
+  uint32_t hash(const char* key, size_t len) const
+  {
+    const uint64_t fold_mask = _case_insensitive ? 0x2020202020202020ull : 0;
+    uint64_t h = len;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t))
+    {
+      uint64_t word;
+      memcpy(&word, key, sizeof(word));
+      h = (h ^ (word | fold_mask)) * 0x9e3779b97f4a7c15ull;
+      key += sizeof(word);
+    }
+
+    if (len > 0)
+    {
+      uint64_t word = 0;
+      for (size_t ii = 0; ii < len; ++ii)
+      {
+        word = (word << 8) | (unsigned char)key[ii];
+      }
+      h = (h ^ (word | fold_mask)) * 0x9e3779b97f4a7c15ull;
+    }
+
+    // Mix the high bits into the low bits, which select the slot.
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return (uint32_t)h;
+  }
+
+  bool equal(const char* key1, const char* key2, size_t len) const
+  {
+    // Keys usually match exactly, even if case doesn't matter.
+    if (memcmp(key1, key2, len) == 0)
+    {
+      return true;
+    }
+    else if (!_case_insensitive)
+    {
+      return false;
+    }
+
+    return (strncasecmp(key1, key2, len) == 0);
+  }
+
+  const Slot* find_slot(const char* key, size_t len) const
+  {
+    uint32_t h = hash(key, len);
+    size_t mask = _slots.size() - 1;
+
+    for (size_t ii = h & mask; _slots[ii].used; ii = (ii + 1) & mask)
+    {
+      const Slot& slot = _slots[ii];
+      if ((slot.hash == h) &&
+          (slot.key.length() == len) &&
+          (equal(slot.key.data(), key, len)))
+      {
+        return &slot;
+      }
+    }
+
+    return NULL;
+  }
+
+  /// Put a slot in the first free position for its hash (the table always
+  /// has free positions).
+  void place(Slot& slot)
+  {
+    size_t mask = _slots.size() - 1;
+    size_t ii = slot.hash & mask;
+
+    while (_slots[ii].used)
+    {
+      ii = (ii + 1) & mask;
+    }
+
+    _slots[ii] = slot;
+  }
+
+  // The table size must be a power of two.
+  static const size_t MIN_SLOTS = 16;
+  static const size_t MAX_LOAD_FACTOR = 4;
+
+  const bool _case_insensitive;
+  const T _not_found;
+  std::vector<Slot> _slots;
+  size_t _size;
+};
+
+#endif
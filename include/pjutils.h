@@ -22,6 +22,7 @@ extern "C" {
 
 #include <string>
 #include <map>
+#include <unordered_set>
 #include <deque>
 #include "sas.h"
 #include "sipresolver.h"
@@ -44,9 +45,18 @@ pj_str_t uri_to_pj_str(pjsip_uri_context_e context,
                        const pjsip_uri* uri,
                        pj_pool_t* pool);
 
+pj_str_t uri_to_pj_str(pjsip_uri_context_e context,
+                       const pjsip_uri* uri,
+                       char* buf,
+                       size_t size);
+
 std::string uri_to_string(pjsip_uri_context_e context,
                           const pjsip_uri* uri);
 
+void add_uri_param(SAS::Event& event,
+                   pjsip_uri_context_e context,
+                   const pjsip_uri* uri);
+
 std::string strip_uri_scheme(const std::string& uri);
 
 pjsip_uri* uri_from_string(const std::string& uri_s,
@@ -69,6 +79,7 @@ std::string body_to_string(pjsip_msg_body* body);
 
 std::string extract_username(pjsip_authorization_hdr* auth_hdr, pjsip_uri* impu_uri);
 
+pj_str_t public_id_to_pj_str(const pjsip_uri* uri, char* buf, size_t size);
 std::string public_id_from_uri(const pjsip_uri* uri);
 pj_bool_t valid_public_id_from_uri(const pjsip_uri* uri, std::string& impu);
 
@@ -113,6 +124,32 @@ void add_route_header(pjsip_msg* msg, pjsip_sip_uri* uri, pj_pool_t* pool);
 void remove_hdr(pjsip_msg* msg,
                 const pj_str_t* name);
 
+/// Finds a header by name, as pjsip_msg_find_hdr_by_name does, parsing it
+/// first if it was received with lazy header parsing enabled.  Anything that
+/// casts the header it finds to a custom header structure must use this.
+/// Parsing the header changes the message's header list, but not what it
+/// means, so this takes a const message as PJSIP's find functions do.
+void* find_hdr_by_name(const pjsip_msg* msg,
+                       const pj_str_t* name,
+                       const void* start);
+
+/// Finds the first header with the given name, for code that only reads it.
+/// If the header was received with lazy header parsing enabled, it is parsed
+/// but left clean, so the message still forwards the bytes that were received
+/// rather than printing the parsed header.  The header returned mustn't be
+/// changed, and mustn't be used to find the headers after it (as it may not
+/// be in the message).
+const void* peek_hdr_by_name(const pjsip_msg* msg,
+                             const pj_str_t* name);
+
+/// Finds a header by its full or compact name, as
+/// pjsip_msg_find_hdr_by_names does, parsing it first if it was received with
+/// lazy header parsing enabled.
+void* find_hdr_by_names(const pjsip_msg* msg,
+                        const pj_str_t* name,
+                        const pj_str_t* sname,
+                        const void* start);
+
 void set_generic_header(pjsip_tx_data* tdata,
                         const pj_str_t* name,
                         const pj_str_t* value);
@@ -131,6 +168,21 @@ pjsip_tx_data* clone_msg(pjsip_endpoint* endpt,
 pjsip_tx_data* clone_msg(pjsip_endpoint* endpt,
                          pjsip_tx_data* tdata);
 
+/// Clones a message as clone_msg does, except that a plain text body (such as
+/// SDP) is shared with the original rather than copied, as bodies are never
+/// modified in place.  The caller must keep the original alive for as long as
+/// the clone (or any clone of the clone) uses the body, and call
+/// unshare_body before the clone is passed anywhere that might outlive the
+/// original.
+pjsip_tx_data* clone_msg_sharing_body(pjsip_endpoint* endpt,
+                                      pjsip_tx_data* tdata);
+
+/// Gives the message its own copy of its body, if the body was shared by
+/// clone_msg_sharing_body.
+///
+/// @returns - The number of bytes copied.
+size_t unshare_body(pjsip_tx_data* tdata);
+
 pj_status_t create_response(pjsip_endpoint *endpt,
                             const pjsip_rx_data *rdata,
                             int st_code,
@@ -159,6 +211,10 @@ pjsip_tx_data* create_cancel(pjsip_endpoint* endpt,
                              pjsip_tx_data* tdata,
                              int reason_code);
 
+pjsip_tx_data* create_cancel(pjsip_endpoint* endpt,
+                             pjsip_tx_data* tdata,
+                             const pjsip_hdr* reason_hdr);
+
 BaseAddrIterator* resolve_iter(const std::string& name,
                                int port,
                                int transport,
@@ -175,6 +231,11 @@ BaseAddrIterator* resolve_next_hop_iter(pjsip_tx_data* tdata,
                                         int allowed_host_state,
                                         SAS::TrailId trail);
 
+BaseAddrIterator* resolve_next_hop_iter_async(pjsip_tx_data* tdata,
+                                              int allowed_host_state,
+                                              SIPResolver::ResolveCallback callback,
+                                              SAS::TrailId trail);
+
 void resolve_next_hop(pjsip_tx_data* tdata,
                       int retries,
                       std::vector<AddrInfo>& servers,
@@ -185,6 +246,12 @@ void blacklist(AddrInfo& server);
 
 void success(AddrInfo& server);
 
+void record_latency(const AddrInfo& server, unsigned long latency_us);
+
+void record_overload(const AddrInfo& server, int retry_after_s);
+
+BaseAddrIterator* avoid_overloaded(BaseAddrIterator* servers_iter);
+
 void set_dest_info(pjsip_tx_data* tdata, const AddrInfo& ai);
 
 void generate_new_branch_id(pjsip_tx_data* tdata);
@@ -267,11 +334,24 @@ pjsip_via_hdr* add_top_via(pjsip_tx_data* tdata);
 
 void remove_top_via(pjsip_tx_data* tdata);
 
+pjsip_hdr* create_reason_hdr(pj_pool_t* pool, int reason_code);
+
 void add_reason(pjsip_tx_data* tdata, int reason_code);
 
-bool compare_pj_sockaddr(const pj_sockaddr& lhs, const pj_sockaddr& rhs);
+/// Hashes and compares socket addresses on their address family and IP
+/// address, ignoring the port, so that a set of hosts can be looked up with
+/// the address a message was received from as it is.
+struct SockaddrHostHash
+{
+  size_t operator()(const pj_sockaddr& addr) const;
+};
 
-typedef std::map<pj_sockaddr, bool, bool(*)(const pj_sockaddr&, const pj_sockaddr&)> host_list_t;
+struct SockaddrHostEqual
+{
+  bool operator()(const pj_sockaddr& lhs, const pj_sockaddr& rhs) const;
+};
+
+typedef std::unordered_set<pj_sockaddr, SockaddrHostHash, SockaddrHostEqual> host_set_t;
 
 void create_random_token(size_t length, std::string& token);
 
@@ -338,6 +418,19 @@ void translate_request_uri(pjsip_msg* req,
                            bool should_override_npdi,
                            SAS::TrailId trail);
 
+/// The two halves of translate_request_uri, for callers that do the ENUM
+/// lookup asynchronously.  enum_user_to_translate returns whether the
+/// Request-URI should be translated, and if so the user to look up, and
+/// apply_enum_translation updates the Request-URI with the lookup's answer.
+bool enum_user_to_translate(pjsip_msg* req,
+                            std::string& user,
+                            SAS::TrailId trail);
+void apply_enum_translation(pjsip_msg* req,
+                            pj_pool_t* pool,
+                            const std::string& translated_uri,
+                            bool should_override_npdi,
+                            SAS::TrailId trail);
+
 void update_request_uri_np_data(pjsip_msg* req,
                                 pj_pool_t* pool,
                                 EnumService* enum_service,
@@ -0,0 +1,192 @@
+/**
+ * @file prefix_trie.h Definition of PrefixTrie - a longest-prefix-match index
+ * over strings (typically telephone numbers).
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PREFIX_TRIE_H__
+#define PREFIX_TRIE_H__
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Index mapping string prefixes to values.
+///
+/// A lookup returns the value for the longest prefix of the number.  For
+/// compatibility with the prefix tables this replaces, a number which is
+/// itself a prefix of one or more keys is treated as matching those keys, and
+/// the value for the greatest such key is returned.
+///
+/// The trie is built up with insert() and then only read, so it can be shared
+/// between threads without locking once it has been built.
+template <class V>
+class PrefixTrie
+{
+public:
+  PrefixTrie() : _nodes(1) {}
+
+  /// Add a key to the index.  If the key is already present, the existing
+  /// value is kept.
+  void insert(const std::string& key, const V& value)
+  {
+    int existing_idx = find_node(key);
+
+    if ((existing_idx >= 0) && (_nodes[existing_idx].entry >= 0))
+    {
+      return;
+    }
+
+    int entry_idx = _entries.size();
+    int node_idx = 0;
+    update_subtree_max(node_idx, key, entry_idx);
+
+    for (std::string::const_iterator c = key.begin(); c != key.end(); ++c)
+    {
+      node_idx = get_or_add_child(node_idx, *c);
+      update_subtree_max(node_idx, key, entry_idx);
+    }
+
+    _nodes[node_idx].entry = entry_idx;
+    _entries.push_back(std::make_pair(key, value));
+  }
+
+  /// Find the value for the longest prefix of the number, as described above.
+  /// Returns NULL if there is no match.  The returned pointer is valid for the
+  /// lifetime of the trie.
+  const V* longest_prefix_match(const std::string& number,
+                                std::string* matched_key = NULL) const
+  {
+    int node_idx = 0;
+    int best = _nodes[0].entry;
+
+    for (std::string::const_iterator c = number.begin(); c != number.end(); ++c)
+    {
+      node_idx = get_child(node_idx, *c);
+
+      if (node_idx < 0)
+      {
+        break;
+      }
+
+      if (_nodes[node_idx].entry >= 0)
+      {
+        best = _nodes[node_idx].entry;
+      }
+    }
+
+    if (node_idx >= 0)
+    {
+      // We've used up the whole number, so any key we're a prefix of matches,
+      // and the greatest of them wins.
+      if (_nodes[node_idx].subtree_max >= 0)
+      {
+        best = _nodes[node_idx].subtree_max;
+      }
+    }
+
+    if (best < 0)
+    {
+      return NULL;
+    }
+
+    if (matched_key != NULL)
+    {
+      *matched_key = _entries[best].first;
+    }
+
+    return &_entries[best].second;
+  }
+
+  /// Returns the number of keys in the index.
+  size_t size() const { return _entries.size(); }
+
+private:
+  struct Node
+  {
+    Node() : entry(-1), subtree_max(-1) {}
+
+    // The children of this node, sorted by character.
+    std::vector<std::pair<char, int> > children;
+    // The index of the entry for the key ending at this node, or -1.
+    int entry;
+    // The index of the entry with the greatest key in the subtree rooted at
+    // this node (including this node), or -1.
+    int subtree_max;
+  };
+
+  int get_child(int node_idx, char c) const
+  {
+    const std::vector<std::pair<char, int> >& children = _nodes[node_idx].children;
+
+    for (size_t ii = 0; ii < children.size(); ++ii)
+    {
+      if (children[ii].first == c)
+      {
+        return children[ii].second;
+      }
+    }
+
+    return -1;
+  }
+
+  int get_or_add_child(int node_idx, char c)
+  {
+    int child_idx = get_child(node_idx, c);
+
+    if (child_idx < 0)
+    {
+      child_idx = _nodes.size();
+      _nodes.push_back(Node());
+
+      std::vector<std::pair<char, int> >& children = _nodes[node_idx].children;
+      typename std::vector<std::pair<char, int> >::iterator it = children.begin();
+
+      while ((it != children.end()) && (it->first < c))
+      {
+        ++it;
+      }
+
+      children.insert(it, std::make_pair(c, child_idx));
+    }
+
+    return child_idx;
+  }
+
+  void update_subtree_max(int node_idx, const std::string& key, int entry_idx)
+  {
+    Node& node = _nodes[node_idx];
+
+    if ((node.subtree_max < 0) ||
+        (_entries[node.subtree_max].first < key))
+    {
+      node.subtree_max = entry_idx;
+    }
+  }
+
+  // Returns the index of the node for the key, or -1 if there isn't one.
+  int find_node(const std::string& key) const
+  {
+    int node_idx = 0;
+
+    for (std::string::const_iterator c = key.begin();
+         (c != key.end()) && (node_idx >= 0);
+         ++c)
+    {
+      node_idx = get_child(node_idx, *c);
+    }
+
+    return node_idx;
+  }
+
+  std::vector<Node> _nodes;
+  std::vector<std::pair<std::string, V> > _entries;
+};
+
+#endif
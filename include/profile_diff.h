@@ -0,0 +1,98 @@
+/**
+ * @file profile_diff.h Comparison of two versions of a subscriber's service
+ * profiles.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PROFILE_DIFF_H__
+#define PROFILE_DIFF_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rapidxml/rapidxml.hpp"
+#include "associated_uris.h"
+
+/// What an IMSSubscription says about one public identity, reduced to hashes
+/// so that two versions of the subscription can be compared cheaply.
+struct ProfileDigest
+{
+  /// Hash of the PublicIdentity element, which holds the identity's barring
+  /// indication, wildcard and display name.
+  size_t identity;
+
+  /// Hash of the rest of the ServiceProfile containing the identity - its
+  /// iFCs, shared iFC sets and core network service authorization.
+  size_t services;
+
+  /// The ServiceProfile element, which belongs to the document the digest
+  /// was computed from.
+  rapidxml::xml_node<>* service_profile;
+};
+
+/// Digests of each public identity in an IMSSubscription, by identity.
+typedef std::map<std::string, ProfileDigest> ProfileDigests;
+
+/// A profile pushed by the HSS.  The digests are computed when the push is
+/// parsed, and refer to nodes in the document.
+struct PushedProfile
+{
+  std::shared_ptr<rapidxml::xml_document<>> doc;
+  AssociatedURIs associated_uris;
+  ProfileDigests digests;
+};
+
+/// The public identities that differ between two versions of a subscriber's
+/// IMSSubscription.
+struct ProfileDiff
+{
+  /// Identities only in the new version.
+  std::vector<std::string> added;
+
+  /// Identities only in the old version.
+  std::vector<std::string> removed;
+
+  /// Identities in both versions whose PublicIdentity element changed.
+  std::vector<std::string> identity_changed;
+
+  /// Identities in both versions whose iFCs (or other service data) changed.
+  /// An identity can be in this and identity_changed.
+  std::vector<std::string> services_changed;
+
+  /// Whether the versions are the same.
+  bool empty() const
+  {
+    return (added.empty() &&
+            removed.empty() &&
+            identity_changed.empty() &&
+            services_changed.empty());
+  }
+
+  /// Whether any identity was added, removed or changed, in which case the
+  /// associated URIs (and the aliases of each identity) may have changed.
+  bool identities_changed() const
+  {
+    return (!added.empty() ||
+            !removed.empty() ||
+            !identity_changed.empty());
+  }
+
+  /// Computes the digest of each public identity in an IMSSubscription
+  /// element.  Returns false if a PublicIdentity element has no Identity.
+  static bool digest(rapidxml::xml_node<>* imss, ProfileDigests& digests);
+
+  /// Compares the digests of two versions of a subscription.  This walks
+  /// the two sets of digests once, side by side.
+  static ProfileDiff compare(const ProfileDigests& old_digests,
+                             const ProfileDigests& new_digests);
+};
+
+#endif
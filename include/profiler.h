@@ -0,0 +1,66 @@
+/**
+ * @file profiler.h On-demand CPU and allocation profiling.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PROFILER_H__
+#define PROFILER_H__
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+/// Sampling profilers that can be turned on in a running sprout, for finding
+/// out where it is spending its CPU and memory under real load.
+///
+/// The CPU profiler samples the stacks of all threads using SIGPROF, so costs
+/// nothing while it isn't running.  The allocation profiler samples roughly
+/// one allocation in every SAMPLE_BYTES bytes allocated once it has been
+/// started, and costs a single load of a flag per allocation while it isn't.
+///
+/// Profiles are written in the formats that pprof reads - the legacy binary
+/// CPU profile and the heap_v2 text heap profile - or, if folded is set, as
+/// folded stacks (one line per distinct stack with its count) for flame graph
+/// tools.
+namespace Profiler
+{
+  /// The mean number of bytes allocated between samples.
+  const size_t SAMPLE_BYTES = 512 * 1024;
+
+  /// Profiles the CPU use of every thread for the given number of seconds at
+  /// the given frequency, blocking the calling thread while it does.  Returns
+  /// false if a CPU profile is already being taken.
+  bool profile_cpu(int seconds, int frequency_hz, bool folded, std::string& profile);
+
+  /// Samples allocations for the given number of seconds, blocking the calling
+  /// thread while it does, and reports the bytes allocated at each sampled
+  /// call site.  Returns false if an allocation profile is already being
+  /// taken.
+  bool profile_allocs(int seconds, bool folded, std::string& profile);
+
+  /// Installs the hook that samples PJSIP's pool allocations.  This must be
+  /// called before any caching pools are initialised.
+  void install_pool_hook();
+
+  /// Whether allocations are being sampled.
+  extern std::atomic<bool> allocs_active;
+
+  void sample_allocation(size_t bytes);
+
+  /// Called for every allocation sprout makes.
+  inline void record_allocation(size_t bytes)
+  {
+    if (allocs_active.load(std::memory_order_relaxed))
+    {
+      sample_allocation(bytes);
+    }
+  }
+}
+
+#endif
@@ -12,18 +12,55 @@
 #ifndef RALF_PROCESSOR_H_
 #define RALF_PROCESSOR_H_
 
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "threadpool.h"
 #include "sas.h"
+#include "acr_spool.h"
 #include "httpconnection.h"
 #include "exception_handler.h"
+#include "snmp_event_accumulator_table.h"
+#include "snmp_scalar.h"
+#include "memory_accounting.h"
 
 class RalfProcessor
 {
 public:
   /// Constructor
+  /// @param ralf_connection    The connection to Ralf.
+  /// @param exception_handler  Exception handler.
+  /// @param ralf_threads       Number of threads sending ACRs to Ralf.
+  /// @param batch_size         The most ACRs to hand to a Ralf thread at once.
+  ///                           1 (the default) hands each ACR over as soon as
+  ///                           it is queued.
+  /// @param batch_delay_ms     The longest an ACR waits for a batch to fill
+  ///                           before the batch is handed over anyway.
+  /// @param batch_size_tbl     Table of the number of ACRs in each batch (may
+  ///                           be NULL).
+  /// @param queue_depth_scalar Number of ACRs waiting to be sent (may be NULL).
+  /// @param spool              Spool for ACRs that can't be sent or queued
+  ///                           (may be NULL).  The processor takes ownership.
+  /// @param max_queued         The most ACRs to queue in memory before
+  ///                           spooling new ones.  Only used with a spool.
+  /// @param replay_rate        The most spooled ACRs to replay each second.
+  /// @param spooled_scalar     Number of ACRs in the spool (may be NULL).
   RalfProcessor(HttpConnection* ralf_connection,
                 ExceptionHandler* exception_handler,
-                const int ralf_threads);
+                const int ralf_threads,
+                const int batch_size = 1,
+                const int batch_delay_ms = 0,
+                SNMP::EventAccumulatorTable* batch_size_tbl = NULL,
+                SNMP::U32Scalar* queue_depth_scalar = NULL,
+                AcrSpool* spool = NULL,
+                const int max_queued = 0,
+                const int replay_rate = 0,
+                SNMP::U32Scalar* spooled_scalar = NULL);
 
   /// Destructor
   virtual ~RalfProcessor();
@@ -35,13 +72,16 @@ public:
     SAS::TrailId trail;
   };
 
+  /// A batch of requests, sent in order by a single Ralf thread.
+  typedef std::vector<RalfRequest*> RalfBatch;
+
   /// This function adds a ralf request to the pool. Actually sending
   /// the Ralf request must be done in a separate thread to avoid
   /// introducing unnecessary latencies in the call path.
   /// @param rr         The RalfRequest to add to the queue
   virtual void send_request_to_ralf(RalfRequest* rr);
 
-  static void exception_callback(RalfProcessor::RalfRequest* work)
+  static void exception_callback(RalfProcessor::RalfBatch* work)
   {
     // No recovery behaviour as this is asynchronous, so we can't sensibly
     // respond
@@ -50,16 +90,18 @@ public:
 private:
   /// @class Pool
   /// The thread pool used by the ralf processor
-  class Pool : public ThreadPool<RalfProcessor::RalfRequest*>
+  class Pool : public ThreadPool<RalfProcessor::RalfBatch*>
   {
   public:
     /// Constructor.
+    /// @param processor          The processor that owns this pool.
     /// @param ralf_connection    A pointer to the underlying ralf connection.
     /// @param num_threads        Number of ralf threads to start
     /// @param exception_handler  Exception handler
-    Pool(HttpConnection* ralf_connection,
+    Pool(RalfProcessor* processor,
+         HttpConnection* ralf_connection,
          ExceptionHandler* exception_handler,
-         void (*callback)(RalfProcessor::RalfRequest*),
+         void (*callback)(RalfProcessor::RalfBatch*),
          unsigned int num_threads);
 
     /// Destructor
@@ -67,7 +109,10 @@ private:
 
   private:
     /// Called by worker threads when they pull work off the queue.
-    virtual void process_work(RalfProcessor::RalfRequest*&);
+    virtual void process_work(RalfProcessor::RalfBatch*&);
+
+    /// The processor that owns this pool.
+    RalfProcessor* _processor;
 
     /// Underlying Ralf connection
     HttpConnection* _ralf_connection;
@@ -75,8 +120,63 @@ private:
 
   friend class Pool;
 
+  /// Hands the pending batch to the thread pool.  Must be called with _lock
+  /// held.
+  void flush_batch();
+
+  /// Body of the thread that hands over batches that have waited for too
+  /// long.
+  void batcher();
+
+  /// Updates the count of ACRs waiting to be sent, and the memory they use,
+  /// as an ACR is queued (change is 1) or finished with (change is -1).
+  void adjust_queue_depth(int change, const RalfRequest* rr);
+
+  /// Returns the memory used by a request.
+  static size_t request_bytes(const RalfRequest* rr);
+
+  /// Writes a request to the spool, deleting it.  Returns false (and drops
+  /// the request) if there's no spool or it's full.
+  bool spool_request(RalfRequest* rr);
+
+  /// Called when a request to Ralf fails.
+  void send_failed(RalfRequest* rr);
+
+  /// Body of the thread that replays spooled ACRs once Ralf has recovered.
+  void replayer();
+
   ///  Thread pool
   Pool* _thread_pool;
+
+  const size_t _batch_size;
+  const int _batch_delay_ms;
+  SNMP::EventAccumulatorTable* _batch_size_tbl;
+  SNMP::U32Scalar* _queue_depth_scalar;
+
+  /// The number of ACRs queued or being sent.
+  std::atomic<int> _queue_depth;
+  MemoryAccounting::Account* _memory_account;
+
+  /// The batch being filled, and when its first ACR was queued.  These are
+  /// protected by _lock.
+  std::mutex _lock;
+  std::condition_variable _cond;
+  RalfBatch* _pending;
+  std::chrono::steady_clock::time_point _pending_since;
+  bool _terminated;
+
+  std::thread _batcher;
+
+  /// The spool, and when a request to Ralf last failed (in milliseconds on
+  /// the steady clock).  Spooled ACRs aren't replayed until Ralf has been
+  /// working for a while.
+  AcrSpool* _spool;
+  const int _max_queued;
+  const int _replay_rate;
+  SNMP::U32Scalar* _spooled_scalar;
+  std::atomic<int64_t> _last_failure_ms;
+
+  std::thread _replayer;
 };
 
 #endif
@@ -0,0 +1,51 @@
+/**
+ * @file random_token.h Fast generation of random tokens.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RANDOM_TOKEN_H__
+#define RANDOM_TOKEN_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// Generation of the random tokens that name flows, AS chain steps and
+/// authentication challenges.
+///
+/// Each thread has its own ChaCha20 generator, seeded from /dev/urandom, so
+/// generating a token takes no locks and makes no system calls.  The
+/// generator produces its output a kilobyte at a time, and rekeys itself
+/// from the start of each batch, so output that has already been used
+/// can't be recovered from the generator's state.
+namespace RandomToken
+{
+  /// Creates a token of the given length from the base64 alphabet.
+  void create(size_t length, std::string& token);
+
+  /// Creates several tokens of the given length at once, appending them to
+  /// the vector.
+  void create(size_t count, size_t length, std::vector<std::string>& tokens);
+
+  /// Fills the buffer with random lowercase hex digits.  It isn't null
+  /// terminated.
+  void create_hex(char* buf, size_t length);
+
+  /// Fills the buffer with random bytes.
+  void fill(uint8_t* buf, size_t length);
+
+  /// The ChaCha20 block function from RFC 7539, which produces 64 bytes of
+  /// output from a key, a block counter and a nonce.  Exposed for testing.
+  void chacha20_block(const uint32_t key[8],
+                      uint32_t counter,
+                      const uint32_t nonce[3],
+                      uint8_t out[64]);
+}
+
+#endif
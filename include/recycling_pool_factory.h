@@ -0,0 +1,273 @@
+/**
+ * @file recycling_pool_factory.h Definition of RecyclingPoolFactory - a PJ
+ * pool factory that reuses the pools of released SIP messages.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RECYCLING_POOL_FACTORY_H__
+#define RECYCLING_POOL_FACTORY_H__
+
+extern "C" {
+#include <pjlib.h>
+#include <pjsip.h>
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "snmp_success_fail_count_table.h"
+#include "snmp_scalar.h"
+#include "huge_page_allocator.h"
+#include "memory_accounting.h"
+#include "metrics.h"
+
+/// Pool factory for the SIP endpoint.
+///
+/// Every pjsip_tx_data (created by PJUtils::clone_msg, create_response,
+/// create_request_fwd and so on) has its own pool, allocated when the message
+/// is created and freed when it is released.  Pools created by this factory
+/// with the size PJSIP uses for tx_data pools are instead reset and kept on a
+/// free list when they are released, and reused by the next tx_data created.
+/// Pools of any other size are allocated and freed as usual.
+///
+/// Each thread has its own free list of up to cache_size pools, so most
+/// creates and releases take no locks.  Messages are often created on one
+/// thread and released on another, so a thread with a full list passes half
+/// of it to a shared depot, and a thread with an empty list takes pools from
+/// the depot.  A background thread frees any pools that have sat in the depot
+/// unused for a whole trim interval, so the memory retained falls back after
+/// a burst of traffic.
+///
+/// tx_data pools also learn how big each kind of message (requests and
+/// responses of each method) gets.  PJUtils says what kind of message each
+/// tx_data it creates is for with a SizeHint, and a sample of the pools of
+/// each kind is measured when they are released.  Each trim, the factory
+/// works out how much each kind typically outgrows a pool's first block, and
+/// sets that as the increment of that kind's pools, so a large INVITE grows
+/// its pool once rather than in several small steps.  The first block stays
+/// the size PJSIP asks for, so that pools can be reused for any kind of
+/// message.  The pools created and the times they grew are counted for each
+/// kind in the sprout_tdata_pools_* and sprout_tdata_pool_growths_* metrics.
+///
+/// If given a HugePageAllocator, the blocks of all the pools it handles come
+/// from that rather than from the heap.
+///
+/// The memory in the pools is accounted (see MemoryAccounting) to the owner
+/// of each pool, which is worked out from the pool's name - transactions,
+/// tx_data, rx_data, dialogs and everything else - with pools on free lists
+/// accounted separately.  Each owner has its own pj_pool_factory, which
+/// pools are created from or moved to, so that the factory passed to the
+/// block allocation callbacks identifies the account.
+class RecyclingPoolFactory
+{
+public:
+  /// Constructor.
+  /// @param cache_size       - The maximum number of pools on each thread's
+  ///                           free list.  0 disables reuse.
+  /// @param trim_interval_ms - How often to free unused pools from the
+  ///                           depot.
+  /// @param block_allocator  - If not NULL, allocates the pools' blocks.  It
+  ///                           must outlive the factory.
+  RecyclingPoolFactory(int cache_size,
+                       int trim_interval_ms = DEFAULT_TRIM_INTERVAL_MS,
+                       HugePageAllocator* block_allocator = NULL);
+
+  /// Destructor.  Frees all the pools on free lists - any other pools
+  /// created by the factory must already have been released.
+  ~RecyclingPoolFactory();
+
+  /// Returns the PJ pool factory to create pools from.
+  pj_pool_factory* factory() { return &_factories[OTHER].base; }
+
+  /// Sets the tables to report pool reuse in.  Each pool created for a
+  /// tx_data counts as an attempt, succeeding if the pool was reused.
+  void set_stats_tables(SNMP::SuccessFailCountTable* reuse_tbl,
+                        SNMP::U32Scalar* retained_bytes_scalar);
+
+  /// Returns the number of pools on free lists.
+  size_t num_cached() const { return _num_cached; }
+
+  /// Returns the number of bytes held by pools on free lists.
+  size_t retained_bytes() const;
+
+  /// Returns the number of tx_data pools that were reused, and that had to be
+  /// allocated.
+  uint64_t num_reused() const { return _num_reused; }
+  uint64_t num_allocated() const { return _num_allocated; }
+
+  /// Free any pools that have been in the depot for the whole of the last
+  /// trim interval, and update the increments of tx_data pools from the
+  /// sizes seen since the last trim.  Called periodically by the trim thread.
+  void trim();
+
+  /// While in scope, tells the factory which kind of message the next
+  /// tx_data the calling thread creates is for - a request or response (as
+  /// given by response) with the method of msg.  msg may be a request or a
+  /// response.
+  class SizeHint
+  {
+  public:
+    SizeHint(const pjsip_msg* msg, bool response);
+    ~SizeHint();
+  };
+
+  /// Returns the increment of new tx_data pools for the kind of message.
+  size_t tdata_increment(const pjsip_msg* msg, bool response) const;
+
+  static const int DEFAULT_CACHE_SIZE = 32;
+  static const int DEFAULT_TRIM_INTERVAL_MS = 10000;
+
+private:
+  /// The depot holds at most this many threads' worth of pools.
+  static const size_t MAX_DEPOT_CACHES = 16;
+
+  /// The kinds of message that tx_data pool sizes are learned for - requests
+  /// then responses for each method PJSIP knows, then messages with no hint.
+  static const int NUM_METHODS = PJSIP_OTHER_METHOD + 1;
+  static const int UNCLASSIFIED = NUM_METHODS * 2;
+  static const int NUM_SIZE_CLASSES = UNCLASSIFIED + 1;
+
+  /// Pool sizes are recorded in buckets of this many bytes, with sizes beyond
+  /// the last bucket counted in it.
+  static const size_t SIZE_BUCKET_BYTES = 1024;
+  static const int NUM_SIZE_BUCKETS = 64;
+
+  /// One in this many released pools on each thread is measured.
+  static const int SIZE_SAMPLE_INTERVAL = 8;
+
+  /// The number of samples needed to set the increment for a kind of
+  /// message, and the fraction of messages (in percent) that should need to
+  /// grow their pool at most once.
+  static const uint32_t MIN_SIZE_SAMPLES = 32;
+  static const int SIZE_PERCENTILE = 95;
+
+  /// The learned sizes of one kind of message.
+  struct SizeClass
+  {
+    /// The increment of new pools for this kind of message.
+    std::atomic<size_t> increment;
+
+    /// The sizes of the pools sampled since the last trim, counted by
+    /// bucket.  Halved at each trim, so older samples fade out.
+    std::atomic<uint32_t> sizes[NUM_SIZE_BUCKETS];
+
+    Metrics::Counter* pools;
+    Metrics::Counter* growths;
+  };
+
+  /// Returns the index of the size class for a kind of message.
+  static int size_class(const pjsip_msg* msg, bool response);
+
+  /// Records the size of a released tx_data pool.
+  void record_size(SizeClass* size_class, pj_pool_t* pool);
+
+  /// Recalculates a size class's increment from its samples.
+  void learn_increment(SizeClass* size_class);
+
+  /// A thread's free list.
+  struct LocalCache
+  {
+    std::vector<pj_pool_t*> pools;
+  };
+
+  /// The owners that pool memory is accounted to.
+  enum PoolOwner
+  {
+    TRANSACTION,
+    TX_DATA,
+    RX_DATA,
+    DIALOG,
+    OTHER,
+    CACHED,
+    NUM_POOL_OWNERS
+  };
+
+  /// Returns the owner of a pool with the given name.
+  static PoolOwner pool_owner(const char* name);
+
+  /// The pj_pool_factory for pools of one owner, with a pointer back to this
+  /// object for the callbacks.  The factory for OTHER is the one passed to
+  /// PJSIP.
+  struct Factory
+  {
+    pj_pool_factory base;
+    RecyclingPoolFactory* owner;
+    MemoryAccounting::Account* account;
+  };
+
+  static pj_pool_t* create_pool_cb(pj_pool_factory* factory,
+                                   const char* name,
+                                   pj_size_t initial_size,
+                                   pj_size_t increment_size,
+                                   pj_pool_callback* callback);
+  static void release_pool_cb(pj_pool_factory* factory, pj_pool_t* pool);
+  static void dump_status_cb(pj_pool_factory* factory, pj_bool_t detail);
+  static void* block_alloc_cb(pj_pool_factory* factory, pj_size_t size);
+  static void block_free_cb(pj_pool_factory* factory, void* mem, pj_size_t size);
+
+  pj_pool_t* create_pool(const char* name,
+                         pj_size_t initial_size,
+                         pj_size_t increment_size,
+                         pj_pool_callback* callback);
+  void release_pool(pj_pool_t* pool);
+
+  /// Returns the calling thread's free list, creating it if necessary.
+  LocalCache* local_cache();
+
+  /// Moves a pool to the given owner's factory and account.
+  void move_pool(pj_pool_t* pool, Factory* to);
+
+  /// Frees a pool that isn't going to be reused.
+  void destroy_pool(pj_pool_t* pool);
+
+  /// The body of the trim thread.
+  void trim_thread();
+
+  Factory _factories[NUM_POOL_OWNERS];
+  const size_t _cache_size;
+  const int _trim_interval_ms;
+  HugePageAllocator* const _block_allocator;
+
+  // Identifies this factory to the thread-local pointers to free lists.
+  const uint64_t _id;
+
+  // The capacity of a newly created (or reset) tx_data pool, or 0 until the
+  // first one has been created.
+  std::atomic<size_t> _pool_capacity;
+
+  // The learned sizes of each kind of message.  Each tx_data pool points to
+  // its kind's SizeClass with its factory_data.
+  SizeClass _size_classes[NUM_SIZE_CLASSES];
+
+  // The depot, all the threads' free lists (which are only freed when the
+  // factory is destroyed) and the lowest size of the depot since it was last
+  // trimmed, all protected by _depot_lock.
+  std::mutex _depot_lock;
+  std::vector<pj_pool_t*> _depot;
+  std::vector<LocalCache*> _local_caches;
+  size_t _depot_low_water;
+
+  std::atomic<size_t> _num_cached;
+  std::atomic<uint64_t> _num_reused;
+  std::atomic<uint64_t> _num_allocated;
+
+  SNMP::SuccessFailCountTable* _reuse_tbl;
+  SNMP::U32Scalar* _retained_bytes_scalar;
+
+  bool _terminated;
+  std::condition_variable _trim_cond;
+  std::thread _trim_thread;
+
+  static std::atomic<uint64_t> _next_id;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/**
+ * @file register_admission.h Definition of RegisterAdmission - paces the
+ * initial registrations that the registrar accepts during a registration
+ * storm.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REGISTER_ADMISSION_H__
+#define REGISTER_ADMISSION_H__
+
+#include <mutex>
+
+/// Limits the rate at which initial registrations are admitted.
+///
+/// After an outage, a large number of UEs may try to register at once.  Each
+/// initial registration is much more expensive than a re-registration (it
+/// creates the AoR and triggers third-party REGISTERs and NOTIFYs), so these
+/// are admitted at a configured rate, and the rest are told to retry after a
+/// randomised interval so that the retries are spread out.  Re-registrations
+/// and deregistrations aren't limited, so the existing registrations are kept
+/// up to date throughout.
+///
+/// A storm is logged when initial registrations start being rejected, and
+/// its end is logged once none have been rejected for a while.
+class RegisterAdmission
+{
+public:
+  /// Constructor.
+  /// @param initial_register_rate - The most initial registrations to admit
+  ///                                each second.  Up to a second's worth can
+  ///                                be admitted in a burst.
+  /// @param max_retry_after       - The longest Retry-After, in seconds, to
+  ///                                give rejected registrations.
+  RegisterAdmission(int initial_register_rate, int max_retry_after);
+
+  /// Whether to admit an initial registration.
+  bool admit_initial_register();
+
+  /// The Retry-After, in seconds, to give a rejected registration.  This is
+  /// picked at random from the upper half of the configured range.
+  int retry_after();
+
+private:
+  static unsigned long now_ms();
+
+  /// How long after the last rejection the storm is considered to be over.
+  static const unsigned long STORM_HOLD_MS = 10000;
+
+  const int _rate;
+  const int _max_retry_after;
+
+  std::mutex _lock;
+
+  // The number of initial registrations that can currently be admitted,
+  // scaled up by 1000 so that it can be topped up every millisecond.
+  long _tokens;
+  unsigned long _last_refill_ms;
+
+  bool _in_storm;
+  unsigned long _last_rejected_ms;
+};
+
+#endif
@@ -28,6 +28,7 @@
 #include "session_expires_helper.h"
 #include "as_communication_tracker.h"
 #include "compositesproutlet.h"
+#include "register_admission.h"
 
 class RegistrarSproutletTsx;
 
@@ -61,7 +62,9 @@ public:
                      SubscriberManager* sm,
                      ACRFactory* rfacr_factory,
                      int cfg_max_expires,
-                     SNMP::RegistrationStatsTables* reg_stats_tbls);
+                     SNMP::RegistrationStatsTables* reg_stats_tbls,
+                     int initial_register_rate = 0,
+                     int register_retry_after = 0);
   ~RegistrarSproutlet();
 
   bool init();
@@ -94,6 +97,9 @@ private:
   // registration attempts.
   SNMP::RegistrationStatsTables* _reg_stats_tbls;
 
+  // Limits the rate of initial registrations, or NULL if they aren't limited.
+  RegisterAdmission* _register_admission;
+
   // The next service to route requests onto if the sproutlet does not handle
   // them itself.
   std::string _next_hop_service;
@@ -0,0 +1,61 @@
+/**
+ * @file registration_prefetch.h Prefetching subscriber data when subscribers
+ * register.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REGISTRATION_PREFETCH_H__
+#define REGISTRATION_PREFETCH_H__
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "exception_handler.h"
+#include "sas.h"
+
+/// Lets services fill their caches with a subscriber's data when the
+/// subscriber registers, so that the first call to or from the subscriber
+/// doesn't wait for it.
+///
+/// Calls are routed to the S-CSCF the subscriber registered with, so the
+/// data is prefetched on the node that will use it.  The registrar tells this
+/// module which IMPUs have registered, and the handlers that services have
+/// added are run for each of them on background threads.  Registrations are
+/// dropped rather than queued without limit if the threads fall behind.
+namespace RegistrationPrefetch
+{
+  /// Fetches a registered IMPU's data into a service's cache.  Called on a
+  /// prefetch thread, so it may block.
+  typedef std::function<void(const std::string& impu, SAS::TrailId trail)> Handler;
+
+  /// Starts the prefetch threads, with at most max_queued registrations
+  /// waiting for them.  Prefetching is disabled (the default) if num_threads
+  /// is zero.
+  void start(ExceptionHandler* exception_handler,
+             int num_threads,
+             int max_queued);
+
+  /// Stops the prefetch threads, discarding any queued registrations.  Must
+  /// be called before the services with handlers are destroyed.
+  void stop();
+
+  /// Adds a handler, returning an ID to remove it with.
+  int add_handler(Handler handler);
+  void remove_handler(int id);
+
+  /// Whether prefetching is enabled.
+  bool enabled();
+
+  /// Called when a REGISTER has succeeded, with the IMPUs that can now be
+  /// called.
+  void registered(const std::vector<std::string>& impus, SAS::TrailId trail);
+}
+
+#endif
@@ -12,6 +12,12 @@
 #ifndef REGISTRATION_SENDER_H__
 #define REGISTRATION_SENDER_H__
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
 #include "ifc.h"
 #include "ifchandler.h"
 #include "fifcservice.h"
@@ -58,10 +64,22 @@ public:
   /// @param  force_third_party_register_body
   ///                           Whether the thrid party register body should
   ///                           contain the received register and its response
+  /// @param  third_party_register_rate
+  ///                           The most 3rd party registers to send each
+  ///                           second. Registers over this rate are queued.
+  ///                           0 means that registers aren't paced
+  /// @param  third_party_refresh_percent
+  ///                           How far through an AS's registration (as a
+  ///                           percentage of its expiry) a re-registration
+  ///                           must be before it is passed on to the AS.
+  ///                           Earlier re-registrations are suppressed. 0
+  ///                           means that all re-registrations are passed on
   RegistrationSender(IFCConfiguration ifc_configuration,
                      FIFCService* fifc_service,
                      SNMP::RegistrationStatsTables* third_party_reg_stats_tbls,
-                     bool force_third_party_register_body);
+                     bool force_third_party_register_body,
+                     int third_party_register_rate = 0,
+                     int third_party_refresh_percent = 0);
 
   /// Registration sender destructor
   virtual ~RegistrationSender();
@@ -153,6 +171,13 @@ private:
   /// @param[in]  ok_response_msg
   ///                           The response to the REGISTER message. This may
   ///                           be included in the body of 3rd party registers
+  /// @param[in]  received_register_str
+  ///                           The received register message, printed once
+  ///                           for all the application servers if any of them
+  ///                           need it in their body
+  /// @param[in]  ok_response_str
+  ///                           The response to the REGISTER message, printed
+  ///                           in the same way
   /// @param[in]  served_user   The IMPU we are sending 3rd party registers for
   /// @param[in]  as            The application server we are sending a 3rd
   ///                           party register to
@@ -163,6 +188,8 @@ private:
   /// @param[in]  trail         The SAS trail ID
   void send_register_to_as(pjsip_msg* received_register_msg,
                            pjsip_msg* ok_response_msg,
+                           const std::string& received_register_str,
+                           const std::string& ok_response_str,
                            const std::string& served_user,
                            const AsInvocation& as,
                            int expires,
@@ -184,6 +211,7 @@ private:
     RegistrationSender* registration_sender;
     DeregistrationEventConsumer* dereg_event_consumer;
     std::string served_user;
+    std::string server_name;
     DefaultHandling default_handling;
     int expires;
     bool is_initial_registration;
@@ -210,6 +238,51 @@ private:
     /// Run the callback
     void run() override;
   };
+
+  /// Sends a 3rd party register statefully, or queues it for the pacer
+  /// thread if we're pacing them.
+  void send_or_queue(pjsip_tx_data* tdata, ThirdPartyRegData* tsxdata);
+
+  /// Entry point for the thread that sends queued 3rd party registers.
+  void pacer();
+
+  /// How often the pacer thread sends registers.
+  static const int PACING_INTERVAL_MS = 100;
+
+  /// Whether a 3rd party re-register to an AS can be skipped, because the
+  /// AS's registration is still well within its expiry.
+  bool suppress_refresh(const std::string& served_user,
+                        const AsInvocation& as,
+                        int expires,
+                        bool is_initial_registration);
+
+  /// Records the result of a 3rd party register to an AS.
+  void record_as_registration(const std::string& served_user,
+                              const std::string& server_name,
+                              int expires,
+                              bool success);
+
+  static uint64_t current_time_ms();
+
+  const int _third_party_register_rate;
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::deque<std::pair<pjsip_tx_data*, ThirdPartyRegData*>> _queue;
+  bool _terminated;
+  std::thread _pacer;
+
+  /// The last successful 3rd party register to each AS for each served user.
+  /// Only kept if we're suppressing re-registrations.
+  struct AsRegistration
+  {
+    uint64_t sent_ms;
+    int expires;
+  };
+
+  const int _third_party_refresh_percent;
+  std::mutex _as_registrations_lock;
+  std::map<std::pair<std::string, std::string>, AsRegistration> _as_registrations;
 };
 
 #endif
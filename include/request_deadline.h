@@ -0,0 +1,65 @@
+/**
+ * @file request_deadline.h Deadlines for the dependency calls made while
+ * processing a SIP message.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REQUEST_DEADLINE_H__
+#define REQUEST_DEADLINE_H__
+
+#include <chrono>
+
+/// Each thread can have a deadline for the work it is currently doing.  The
+/// worker threads set one while processing each SIP message, based on how
+/// long the message waited on the queue, and the clients of Sprout's
+/// dependencies (Homestead, the XDMS and ENUM) check it before making a call,
+/// so that a message which has already used up its time doesn't then wait a
+/// full timeout for each dependency.  Calls made with no deadline set behave
+/// as they always have.
+///
+/// The deadline is thread-local, so work handed off to another thread must
+/// take the deadline with it (see Scope).
+namespace RequestDeadline
+{
+  typedef std::chrono::steady_clock Clock;
+
+  /// Sets the current thread's deadline for as long as the scope exists,
+  /// restoring any previous deadline when it ends.
+  class Scope
+  {
+  public:
+    /// Sets a deadline budget_us after a message arrived, where the message
+    /// has already waited elapsed_us.  A budget of 0 means no deadline.
+    Scope(unsigned long budget_us, unsigned long elapsed_us);
+
+    /// Sets the given deadline, e.g. one captured from another thread with
+    /// get().  If has_deadline is false, there is no deadline.
+    Scope(bool has_deadline, Clock::time_point deadline);
+
+    ~Scope();
+
+  private:
+    bool _prev_has_deadline;
+    Clock::time_point _prev_deadline;
+  };
+
+  /// Gets the current thread's deadline.  Returns false if there isn't one.
+  bool get(Clock::time_point& deadline);
+
+  /// Returns true if the current thread has a deadline and it has passed.
+  bool expired();
+
+  /// Returns the smaller of the given timeout and the time left before the
+  /// current thread's deadline (but at least 1ms, so that a call that is
+  /// made anyway doesn't wait forever).  A timeout of 0 or less means no
+  /// timeout.
+  long cap_timeout_ms(long timeout_ms);
+}
+
+#endif
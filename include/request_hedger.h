@@ -0,0 +1,94 @@
+/**
+ * @file request_hedger.h Deciding when to hedge slow requests.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REQUEST_HEDGER_H__
+#define REQUEST_HEDGER_H__
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "snmp_counter_table.h"
+
+/// Decides when a request that hasn't been answered yet should be hedged,
+/// that is, sent again to another target with the first answer winning.
+///
+/// The hedge delay is a percentile of the latencies of recent requests, so
+/// only requests slower than (say) 95% of their peers are hedged, and it
+/// follows the server's latency as it changes.  No requests are hedged until
+/// enough latencies have been recorded.
+///
+/// Hedges are also limited by a budget, which is a percentage of the number
+/// of requests, so that a server which is slow across the board doesn't get
+/// twice the load.  The budget accrues as requests are made, up to a limit so
+/// that it can't build up during a quiet period and then all be spent at
+/// once.
+class RequestHedger
+{
+public:
+  /// Constructor.
+  /// @param percentile     - The percentile of recent latencies after which
+  ///                         to hedge, e.g. 95.
+  /// @param budget_percent - The most hedges to send, as a percentage of the
+  ///                         number of requests.
+  /// @param min_delay_ms   - The shortest hedge delay, however fast recent
+  ///                         requests have been.
+  /// @param hedged_tbl     - Counter of hedges sent (may be NULL).
+  RequestHedger(int percentile,
+                int budget_percent,
+                long min_delay_ms = DEFAULT_MIN_DELAY_MS,
+                SNMP::CounterTable* hedged_tbl = NULL);
+
+  /// Called when a request is started.  Returns the time in milliseconds
+  /// after which to hedge it, or -1 if it shouldn't be hedged.
+  long start_request();
+
+  /// Called when a request's deadline has passed.  Returns true (and counts
+  /// the hedge) if there is enough budget left to hedge it.
+  bool take_hedge();
+
+  /// Records the latency of a completed request.
+  void record_latency(unsigned long latency_us);
+
+  /// The current hedge delay, or -1 if there aren't enough latencies yet.
+  long delay_ms() const { return _delay_ms.load(); }
+
+  static const long DEFAULT_MIN_DELAY_MS = 2;
+
+  /// The number of recent latencies the percentile is taken over, and how
+  /// many new latencies are recorded between recalculations.
+  static const size_t NUM_SAMPLES = 256;
+  static const size_t RECALCULATE_INTERVAL = 32;
+
+private:
+  /// The budget is kept in hundredths of a hedge, so each request adds the
+  /// budget percentage to it and each hedge takes 100.
+  static const int TOKENS_PER_HEDGE = 100;
+  static const int MAX_TOKENS = 10 * TOKENS_PER_HEDGE;
+
+  void recalculate();
+
+  const int _percentile;
+  const int _budget_percent;
+  const long _min_delay_ms;
+  SNMP::CounterTable* _hedged_tbl;
+
+  std::atomic<long> _delay_ms;
+  std::atomic<int> _tokens;
+
+  /// Ring of the most recent latencies, protected by _lock.
+  std::mutex _lock;
+  std::vector<unsigned long> _samples_us;
+  size_t _next_sample;
+  size_t _new_samples;
+};
+
+#endif
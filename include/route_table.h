@@ -0,0 +1,154 @@
+/**
+ * @file route_table.h Definition of CompiledRouteTable - a read-only route
+ * table loaded by memory-mapping a file compiled offline from JSON
+ * configuration.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ROUTE_TABLE_H__
+#define ROUTE_TABLE_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/// Route table mapping keys to lists of strings, stored in a compact binary
+/// file which is memory-mapped rather than parsed.
+///
+/// The table has two sections: domain entries, which are looked up by exact
+/// match, and number entries, which are looked up by longest prefix match
+/// (with the same semantics as PrefixTrie).  Each section is an array of
+/// fixed-size entries sorted by key, and all strings are held in a single
+/// string pool, so loading a table just means mapping the file and checking
+/// that it is well-formed.  The mapped pages are shared by every process that
+/// loads the same file.
+///
+/// Files are written by the Builder (see sprout-route-compiler).  A file that
+/// is in use must never be modified in place - the Builder writes a new file
+/// and renames it over the old one.
+class CompiledRouteTable
+{
+public:
+  ~CompiledRouteTable();
+
+  /// Returns whether the specified file is a compiled route table (as opposed
+  /// to, say, JSON configuration), judging by its first few bytes.
+  static bool is_compiled(const std::string& path);
+
+  /// Map a compiled route table from the specified file.  Returns NULL (and
+  /// logs the reason) if the file can't be mapped or is badly formed.
+  static CompiledRouteTable* load(const std::string& path);
+
+  /// Look up a domain entry by exact match.  Returns true (and fills in the
+  /// values) if there is an entry for the domain.
+  bool find_domain(const std::string& domain,
+                   std::vector<std::string>& values) const;
+
+  /// Look up the number entry for the longest prefix of the number.  Returns
+  /// the index of the entry (for use with number_values_at()), or -1 if there
+  /// is no match.
+  int find_number(const std::string& number,
+                  std::string* matched_key = NULL) const;
+
+  /// Returns the values of the number entry with the specified index.
+  std::vector<std::string> number_values_at(int idx) const;
+
+  /// Returns the number of domain and number entries in the table.
+  size_t num_domains() const { return _header->domain_count; }
+  size_t num_numbers() const { return _header->number_count; }
+
+  /// Collects entries and writes them out as a compiled route table.
+  class Builder
+  {
+  public:
+    /// Add an entry.  If there's already an entry for the key in the same
+    /// section, the existing entry is kept.
+    void add_domain(const std::string& domain,
+                    const std::vector<std::string>& values);
+    void add_number(const std::string& number,
+                    const std::vector<std::string>& values);
+
+    /// Write the table to the specified file, which is replaced atomically.
+    /// Returns false (and fills in the error) on failure.
+    bool write(const std::string& path, std::string& error) const;
+
+  private:
+    typedef std::map<std::string, std::vector<std::string>> Entries;
+
+    Entries _domains;
+    Entries _numbers;
+  };
+
+private:
+  // The on-disk format.  All integers are in host byte order, and all offsets
+  // are in bytes from the start of the file, except for string offsets which
+  // are from the start of the string pool.
+  struct StringRef
+  {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  struct Entry
+  {
+    StringRef key;
+    // The index of the first value in the values array, and the number of
+    // values.
+    uint32_t first_value;
+    uint32_t num_values;
+  };
+
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t domain_count;
+    uint32_t domain_offset;
+    uint32_t number_count;
+    uint32_t number_offset;
+    uint32_t value_count;
+    uint32_t value_offset;
+    uint32_t string_pool_length;
+    uint32_t string_pool_offset;
+  };
+
+  static const char MAGIC[8];
+  static const uint32_t VERSION = 1;
+
+  CompiledRouteTable(void* base, size_t length);
+
+  // Check that every entry, value and string lies within the file, and set
+  // up the pointers to each section.
+  bool validate();
+  bool validate_section(uint32_t count, uint32_t offset) const;
+
+  // Compare the key of an entry with the first len characters of a string.
+  int compare_key(const Entry& entry, const char* str, size_t len) const;
+
+  // Find the entry in a section whose key exactly matches the string, or
+  // return -1.
+  int find_exact(const Entry* entries,
+                 uint32_t count,
+                 const char* str,
+                 size_t len) const;
+
+  std::string get_string(const StringRef& ref) const;
+  std::vector<std::string> get_values(const Entry& entry) const;
+
+  void* _base;
+  size_t _length;
+  const Header* _header;
+  const Entry* _domains;
+  const Entry* _numbers;
+  const StringRef* _values;
+  const char* _string_pool;
+};
+
+#endif
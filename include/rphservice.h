@@ -14,13 +14,20 @@
 
 #include <map>
 #include <string>
+#include <vector>
+#include <stdint.h>
 #include <boost/thread.hpp>
 #include <boost/algorithm/string.hpp>
 
+extern "C" {
+#include <pjlib.h>
+}
+
 #include "updater.h"
 #include "sip_event_priority.h"
 #include "sas.h"
 #include "alarm.h"
+#include "config_snapshot.h"
 
 /// These vector contains the 5 IANA namespaces which are defined in RFC 4412
 /// section 12.6.
@@ -47,6 +54,11 @@ public:
   virtual SIPEventPriorityLevel lookup_priority(std::string rph_value,
                                                 SAS::TrailId trail);
 
+  /// Lookup the priority of an RPH value, without copying it.  This is used
+  /// to classify every message on the transport thread, so doesn't allocate.
+  virtual SIPEventPriorityLevel lookup_priority(const pj_str_t& rph_value,
+                                                SAS::TrailId trail);
+
 private:
   Alarm* _alarm;
   std::string _configuration;
@@ -62,12 +74,52 @@ private:
       return k1 < k2;
     }
   };
-  std::map<std::string, SIPEventPriorityLevel, str_cmp_ci> _rph_map;
-  Updater<void, RPHService>* _updater;
+  typedef std::map<std::string, SIPEventPriorityLevel, str_cmp_ci> RPHMap;
+
+  /// The RPH configuration compiled for lookups - a perfect hash table of the
+  /// lowercased RPH values.  The hash is case-insensitive, and its seed and
+  /// size are chosen when the table is built so that no two values share a
+  /// slot, so a lookup hashes the value once and compares it with at most
+  /// one configured value.
+  class RPHTable
+  {
+  public:
+    /// Builds an empty table, used until the configuration is loaded.
+    RPHTable();
+
+    /// Builds the table from the configuration.
+    RPHTable(const RPHMap& rph_map);
+
+    /// Looks up an RPH value.  Returns false if it isn't configured.
+    bool find(const pj_str_t& rph_value,
+              SIPEventPriorityLevel& priority) const;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _sets_rw_lock;
+    /// Returns whether no RPH values are configured.
+    bool empty() const { return _values.empty(); }
+
+  private:
+    struct Slot
+    {
+      /// Where the value is in _values.  Empty slots have a length of zero.
+      uint32_t offset;
+      uint32_t length;
+      SIPEventPriorityLevel priority;
+    };
+
+    /// Tries to place every value with the specified seed.  Returns false if
+    /// two values hash to the same slot.
+    bool place(const RPHMap& rph_map, uint32_t seed);
+
+    static uint32_t hash(const char* value, size_t length, uint32_t seed);
+
+    /// The lowercased values, one after another.
+    std::string _values;
+    std::vector<Slot> _slots;
+    uint32_t _seed;
+  };
+
+  ConfigSnapshot<RPHTable> _rph_table;
+  Updater<void, RPHService>* _updater;
 
   // Helper functions to set/clear the alarm.
   void set_alarm();
@@ -0,0 +1,110 @@
+/**
+ * @file sas_message_log.h Logging SIP messages to SAS on a background thread.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SAS_MESSAGE_LOG_H__
+#define SAS_MESSAGE_LOG_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#include "sas.h"
+
+/// Builds and reports the SAS events for sent and received SIP messages on a
+/// background thread.
+///
+/// The thread handling a message still correlates it to its trail and raises
+/// its markers, as later processing needs the trail and the markers need the
+/// parsed message.  Only the message event, which holds a copy of the whole
+/// message, is deferred - the message's bytes are copied onto a lock-free
+/// ring, and the event is built and reported by the logging thread.  If the
+/// ring is full the event is reported straight away, so messages are never
+/// missing from SAS.
+///
+/// SAS orders the events in a trail by when they were reported, so a message
+/// event may appear slightly after the first events that processing the
+/// message logged.
+class SasMessageLog
+{
+public:
+  SasMessageLog();
+
+  /// Destructor.  Reports any queued events and stops the logging thread.
+  ~SasMessageLog();
+
+  /// Logs a message event, with the parameters of the RX_SIP_MSG and
+  /// TX_SIP_MSG events.  The message is copied, so needn't outlive the call.
+  void log(SAS::TrailId trail,
+           uint32_t event_id,
+           uint32_t transport_type,
+           uint32_t port,
+           const char* name,
+           int len,
+           const char* msg);
+
+  /// Returns the number of events reported straight away because the ring
+  /// was full.
+  uint64_t overflowed() const { return _overflowed.load(std::memory_order_relaxed); }
+
+  /// Builds and reports a message event.
+  static void report(SAS::TrailId trail,
+                     uint32_t event_id,
+                     uint32_t transport_type,
+                     uint32_t port,
+                     const char* name,
+                     int len,
+                     const char* msg);
+
+  /// The number of events that can be queued.
+  static const uint64_t RING_SIZE = 4096;
+
+private:
+  /// A slot on the ring.  As for AnalyticsLogger, its sequence number says
+  /// whose turn it is - it is free for the producer queueing the event at
+  /// that position, and full (for the logging thread) once it is one more
+  /// than that.
+  struct Slot
+  {
+    std::atomic<uint64_t> seq;
+    SAS::TrailId trail;
+    uint32_t event_id;
+    uint32_t transport_type;
+    uint32_t port;
+    char name[PJ_INET6_ADDRSTRLEN];
+    int len;
+    char* msg;
+  };
+
+  /// Body of the logging thread.
+  void writer();
+
+  /// Reports all the events in the ring.  Returns how many were reported.
+  int drain();
+
+  Slot* _ring;
+
+  /// The next position for producers to claim.
+  std::atomic<uint64_t> _head;
+
+  /// The next position for the logging thread to report.  Only used by the
+  /// logging thread.
+  uint64_t _tail;
+
+  std::atomic<uint64_t> _overflowed;
+  std::atomic<bool> _stopping;
+  std::thread _writer;
+};
+
+#endif
@@ -0,0 +1,57 @@
+/**
+ * @file sas_sampling.h Sampling of detailed SAS events.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SAS_SAMPLING_H__
+#define SAS_SAMPLING_H__
+
+#include <stdint.h>
+#include <atomic>
+
+#include "sas.h"
+
+/// Decides whether to log detailed SAS events on a trail.
+///
+/// Most SAS events on a transaction just record progress through Sprout's
+/// processing, and each one costs formatting and allocations to build.  The
+/// events that matter for diagnosis (messages, markers, and errors) are
+/// always logged, but callers building a detailed event should check
+/// detail_enabled() first, and skip building the event altogether if it is
+/// false.
+///
+/// A configurable proportion of trails get detailed events, with a separate
+/// (usually lower) proportion while Sprout is overloaded.  The decision is
+/// made per trail, so a trail either has all of its detailed events or none.
+namespace SASSampling
+{
+  /// Sets the proportions (in percent) of trails that get detailed events,
+  /// normally and while overloaded.
+  void configure(int detail_percent, int overload_detail_percent);
+
+  /// Called when a request is rejected due to overload.  Sprout is treated
+  /// as overloaded for a second afterwards.
+  void report_overload();
+
+  /// Decides whether detailed events on a trail are logged, when some are
+  /// being sampled.
+  bool sample(SAS::TrailId trail);
+
+  /// Whether sampling is in use.  While it isn't (the default), checking
+  /// whether to log detailed events is a single relaxed load.
+  extern std::atomic<bool> sampling;
+
+  /// Returns whether to build and log detailed SAS events on this trail.
+  inline bool detail_enabled(SAS::TrailId trail)
+  {
+    return (!sampling.load(std::memory_order_relaxed)) || sample(trail);
+  }
+}
+
+#endif
@@ -12,6 +12,7 @@
 #ifndef SCSCFSELECTOR_H__
 #define SCSCFSELECTOR_H__
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <map>
@@ -19,6 +20,7 @@
 #include <boost/thread.hpp>
 #include "updater.h"
 #include "sas.h"
+#include "config_snapshot.h"
 
 class SCSCFSelector
 {
@@ -36,19 +38,44 @@ public:
                         const std::vector<std::string> &rejects,
                         SAS::TrailId trail);
 private:
+  // Capabilities are held as bitsets, with each capability that any S-CSCF
+  // has mapped to a bit.
+  typedef std::vector<uint64_t> cap_bits_t;
+
   typedef struct scscf
   {
     std::string server;
     int priority;
     int weight;
-    std::vector<int> capabilities;
+    cap_bits_t capabilities;
   } scscf_t;
 
+  typedef struct scscf_config
+  {
+    std::vector<scscf_t> scscfs;
+    std::map<int, size_t> cap_bit;
+    size_t cap_words;
+  } scscf_config_t;
+
+  // Converts a list of capabilities to a bitset.  Returns false if any of the
+  // capabilities aren't known.
+  static bool to_cap_bits(const scscf_config_t& config,
+                          const std::vector<int>& capabilities,
+                          cap_bits_t& cap_bits);
+
+  // Builds the list of capabilities to log to SAS.
+  static std::string caps_str(const std::vector<int>& capabilities);
+
+  static void report_selected(const scscf_t& scscf,
+                              const std::vector<int>& mandatory,
+                              const std::vector<int>& optional,
+                              const std::vector<std::string>& rejects,
+                              SAS::TrailId trail);
+
   std::string _fallback_scscf_uri;
   std::string _configuration;
-  std::vector<scscf> _scscfs;
+  ConfigSnapshot<scscf_config_t> _scscfs;
   Updater<void, SCSCFSelector>* _updater;
-  boost::shared_mutex _scscfs_rw_lock;
 };
 
 #endif
@@ -39,6 +39,7 @@ extern "C" {
 #include "compositesproutlet.h"
 #include "subscriber_manager.h"
 #include "httpclient.h"
+#include "tsx_arena.h"
 
 class SCSCFSproutletTsx;
 
@@ -76,7 +77,9 @@ public:
                  int session_continued_timeout = DEFAULT_SESSION_CONTINUED_TIMEOUT,
                  int session_terminated_timeout = DEFAULT_SESSION_TERMINATED_TIMEOUT,
                  AsCommunicationTracker* sess_term_as_tracker = NULL,
-                 AsCommunicationTracker* sess_cont_as_tracker = NULL);
+                 AsCommunicationTracker* sess_cont_as_tracker = NULL,
+                 bool local_terminating_shortcut = false,
+                 bool cache_served_user_state = false);
 
   /// SCSCFSproutlet destructor.
   ~SCSCFSproutlet();
@@ -100,6 +103,8 @@ public:
   void set_override_npdi(bool v) { _override_npdi = v; }
   void set_session_continued_timeout(int timeout) { _session_continued_timeout_ms = timeout; }
   void set_session_terminated_timeout(int timeout) { _session_terminated_timeout_ms = timeout; }
+  void set_local_terminating_shortcut(bool v) { _local_terminating_shortcut = v; }
+  void set_cache_served_user_state(bool v) { _cache_served_user_state = v; }
 
   inline bool should_override_npdi() const
   {
@@ -143,6 +148,15 @@ private:
                     Bindings& bindings,
                     SAS::TrailId trail);
 
+  /// Checks whether a public ID belongs to a subscriber that is registered
+  /// with this S-CSCF, using Homestead's cached registration data (so this
+  /// never results in a request to the HSS) and the local bindings.
+  ///
+  /// @param[in]  public_id  - The public ID of the subscriber.
+  /// @param[in]  trail      - The SAS trail ID.
+  bool is_registered_locally(const std::string& public_id,
+                             SAS::TrailId trail);
+
   /// Freed the bindings object, which was returned by the subscriber manager,
   /// as this object is owned by the sproutlet.
   ///
@@ -165,20 +179,30 @@ private:
 
   /// Record that communication with an AS failed.
   ///
-  /// @param uri               - The URI of the AS.
+  /// @param as_chain_link     - The AS chain link that invoked the AS.
   /// @param reason            - Textual representation of the reason the AS is
   ///                            being treated as failed.
-  /// @param default_handling  - The AS's default handling.
-  void track_app_serv_comm_failure(const std::string& uri,
-                                   const std::string& reason,
-                                   DefaultHandling default_handling);
+  void track_app_serv_comm_failure(AsChainLink& as_chain_link,
+                                   const std::string& reason);
 
   /// Record that communication with an AS succeeded.
   ///
-  /// @param uri               - The URI of the AS.
-  /// @param default_handling  - The AS's default handling.
-  void track_app_serv_comm_success(const std::string& uri,
-                                   DefaultHandling default_handling);
+  /// @param as_chain_link     - The AS chain link that invoked the AS.
+  void track_app_serv_comm_success(AsChainLink& as_chain_link);
+
+  /// Check whether an AS's circuit breaker is open, in which case it should
+  /// be bypassed rather than invoked.
+  ///
+  /// @param as_chain_link     - The AS chain link that's invoking the AS.
+  bool app_serv_circuit_open(AsChainLink& as_chain_link);
+
+  /// Finds the communication tracker for an AS chain link's AS (according to
+  /// its default handling) and the AS's slot in it, which is cached on the
+  /// AS chain so it's only looked up once.
+  ///
+  /// @return The tracker, or NULL if there isn't one.
+  AsCommunicationTracker* app_serv_tracker(AsChainLink& as_chain_link,
+                                           AsCommunicationTracker::AsSlot*& slot);
 
   /// Record the time an INVITE took to reach ringing state.
   ///
@@ -242,6 +266,16 @@ private:
 
   bool _override_npdi;
 
+  /// Whether requests to subscribers registered with this S-CSCF are routed
+  /// straight back to it at the end of originating processing, rather than
+  /// through the I-CSCF.
+  bool _local_terminating_shortcut;
+
+  /// Whether the served user's subscriber state is stored in the AsChain, so
+  /// that it's read from the HSS once for the whole chain rather than each
+  /// time the request comes back from an AS.
+  bool _cache_served_user_state;
+
   /// Instance of the fallback iFC class, which contains any fallback iFCs that
   /// the S-CSCF should apply.
   FIFCService* _fifcservice;
@@ -256,6 +290,9 @@ private:
 
   /// String versions of the cluster URIs.
   std::string _scscf_cluster_uri_str;
+
+  /// The S-CSCF cluster URI, as printed in routing headers.
+  std::string _scscf_cluster_uri_routing_str;
   std::string _scscf_node_uri_str;
   std::string _icscf_uri_str;
   std::string _bgcf_uri_str;
@@ -280,7 +317,7 @@ private:
 ///
 /// S-SCSCF sproutlet transaction class. Used to perform S-CSCF processing on a
 /// single request.
-class SCSCFSproutletTsx : public CompositeSproutletTsx
+class SCSCFSproutletTsx : public CompositeSproutletTsx, public TsxArenaAllocated
 {
 public:
   /// SCSCFSproutletTsx constructor.
@@ -345,6 +382,10 @@ private:
   void route_to_as(pjsip_msg* req,
                    const std::string& server_name);
 
+  /// Apply the default handling for an application server that isn't being
+  /// invoked because its circuit breaker is open.
+  void bypass_failed_as(pjsip_msg* req);
+
   /// Route the request to the I-CSCF.
   void route_to_icscf(pjsip_msg* req);
 
@@ -354,6 +395,18 @@ private:
   /// @param reason   - The SAS Event ID to log as the reason
   void route_to_bgcf(pjsip_msg* req, int reason);
 
+  /// Translate the RequestURI of a request at the end of originating
+  /// processing using the ENUM service, without blocking this thread, and
+  /// then route it.
+  ///
+  /// @param req      - The request to translate and route
+  /// @param user     - The user to look up
+  void translate_and_route_async(pjsip_msg* req, const std::string& user);
+
+  /// Route a request at the end of originating processing, once its
+  /// RequestURI has been translated using the ENUM service.
+  void route_translated_request(pjsip_msg* req);
+
   /// Route the request to the terminating side S-CSCF.
   void route_to_term_scscf(pjsip_msg* req);
 
@@ -439,6 +492,12 @@ private:
   HTTPCode read_hss_data(std::string public_id,
                          const HSSConnection::irs_query& irs_query);
 
+  /// Sets the class variables derived from the subscriber's data in
+  /// _irs_info, and marks the data as cached.
+  ///
+  /// @param[in] public_id  - The public ID of the subscriber whose info it is.
+  void store_hss_data(const std::string& public_id);
+
   /// Add the S-CSCF sproutlet into a dialog.
   /// The third parameter passed may be attached to the Record-Route and can be
   /// used to recover the billing role that is in use on subsequent in-dialog
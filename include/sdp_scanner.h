@@ -0,0 +1,83 @@
+/**
+ * @file sdp_scanner.h Lightweight scanning of SDP bodies.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SDP_SCANNER_H__
+#define SDP_SCANNER_H__
+
+#include <stddef.h>
+
+extern "C" {
+#include <pjlib.h>
+}
+
+/// Scans an SDP body for the lines, media descriptions and connection
+/// information in it, for code that only needs to inspect the SDP.  Unlike
+/// pjmedia's SDP parser, this doesn't need a pool and doesn't allocate or
+/// copy anything - everything it returns points into the SDP, so is only
+/// valid while the SDP is unchanged.
+///
+/// Carriage returns at the ends of lines are removed, and blank lines are
+/// skipped.
+class SdpScanner
+{
+public:
+  SdpScanner(const char* data, size_t len);
+
+  /// A line of SDP.  type is the character before the '=', and value is
+  /// everything after it.
+  struct Line
+  {
+    pj_str_t line;
+    char type;
+    pj_str_t value;
+  };
+
+  /// Gets the next line of the SDP.  Returns false at the end of the SDP.
+  bool next_line(Line& line);
+
+  /// A media description, from an m= line and the lines after it.
+  struct Media
+  {
+    /// The whole m= line.
+    pj_str_t line;
+
+    /// The fields of the m= line.  fmts is the list of formats (for RTP,
+    /// the payload types of the codecs), separated by spaces.
+    pj_str_t media;
+    int port;
+    pj_str_t proto;
+    pj_str_t fmts;
+
+    /// The value of the media description's c= line, or of the session's
+    /// c= line if it doesn't have one.  This is empty if neither has one.
+    pj_str_t connection;
+  };
+
+  /// Gets the next media description in the SDP, skipping any session lines
+  /// before it.  Returns false if there are no more media descriptions.
+  /// This mustn't be mixed with next_line on the same scanner.
+  bool next_media(Media& media);
+
+  /// Gets the next space separated token from a list (such as the fmts of a
+  /// media description), and removes it from the list.  Returns false if
+  /// there are no more tokens.
+  static bool next_token(pj_str_t& list, pj_str_t& token);
+
+private:
+  const char* _pos;
+  const char* _end;
+
+  /// The session's c= line, which is found while looking for the first
+  /// media description.
+  pj_str_t _session_connection;
+};
+
+#endif
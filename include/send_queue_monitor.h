@@ -0,0 +1,117 @@
+/**
+ * @file send_queue_monitor.h Tracks the data queued to each SIP connection.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SEND_QUEUE_MONITOR_H__
+#define SEND_QUEUE_MONITOR_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib-util.h>
+#include <pjlib.h>
+}
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "baseresolver.h"
+#include "snmp_counter_table.h"
+
+/// Tracks how much data is waiting to be sent on each connection-oriented SIP
+/// transport, so that new requests aren't queued to peers that have stopped
+/// reading.
+///
+/// PJSIP queues messages to a TCP connection when the socket won't take any
+/// more, and only gives up on them after the TCP send timeout.  Each message
+/// sent on a connection is remembered (holding a reference to it) until PJSIP
+/// has finished sending it, and a connection is saturated while the messages
+/// PJSIP hasn't finished sending add up to more than the configured limit.
+/// Connections send their data in order, so messages are forgotten from the
+/// front of each queue.
+class SendQueueMonitor
+{
+public:
+  /// Constructor.
+  /// @param max_queued_bytes - The amount of data queued to a connection at
+  ///                           which it is saturated.
+  /// @param saturated_tbl    - Counts requests that weren't sent to a peer
+  ///                           because its connection was saturated.
+  SendQueueMonitor(size_t max_queued_bytes,
+                   SNMP::CounterTable* saturated_tbl);
+  ~SendQueueMonitor();
+
+  /// Called for each message just before PJSIP sends it.
+  void on_tx_msg(pjsip_tx_data* tdata);
+
+  /// Whether the existing connection to a server (if there is one) is
+  /// saturated.  Saturated servers are counted.
+  bool is_saturated(const AddrInfo& server);
+
+  /// Whether a connection is saturated.  Saturated connections are counted.
+  bool is_saturated(pjsip_transport* tp);
+
+  /// The data queued to one connection.
+  struct QueueSummary
+  {
+    std::string remote;
+    size_t messages;
+    size_t bytes;
+  };
+
+  /// Returns the data queued to every connection with any, sorted by remote
+  /// address.
+  std::vector<QueueSummary> queues();
+
+private:
+  struct Queued
+  {
+    pjsip_tx_data* tdata;
+    size_t bytes;
+  };
+
+  struct Queue
+  {
+    std::string remote;
+    std::deque<Queued> msgs;
+    size_t bytes;
+  };
+
+  typedef std::map<pj_sockaddr,
+                   Queue,
+                   bool(*)(const pj_sockaddr&, const pj_sockaddr&)> Queues;
+
+  /// Forgets the messages at the front of a queue that have been sent,
+  /// adding them to the list to release once the lock has been dropped.  Must
+  /// be called with the lock held.
+  static void release_sent(Queue& queue, std::vector<pjsip_tx_data*>& sent);
+
+  /// Forgets the sent messages on every queue, and the queues that are now
+  /// empty.  Must be called with the lock held.
+  void release_all_sent(std::vector<pjsip_tx_data*>& sent);
+
+  bool queue_saturated(const pj_sockaddr& remote);
+
+  static unsigned long now_ms();
+
+  /// How often to forget messages that have been sent on quiet connections.
+  static const unsigned long SWEEP_INTERVAL_MS = 1000;
+
+  const size_t _max_queued_bytes;
+  SNMP::CounterTable* _saturated_tbl;
+
+  std::mutex _lock;
+  Queues _queues;
+  unsigned long _last_sweep_ms;
+};
+
+#endif
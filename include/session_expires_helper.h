@@ -39,7 +39,7 @@ public:
   /// target session interval subject to the constraints of the RFC.
   ///
   /// @param req   - The request to process. This method mutates the request in
-  ///                place.
+  ///                place, but only if the session interval changes.
   /// @param pool  - The pool associated with the request.
   /// @param trail - SAS trail ID.
   void process_request(pjsip_msg* req,
@@ -0,0 +1,271 @@
+/**
+ * @file sharded_lru_cache.h Definition of ShardedLRUCache - a thread-safe,
+ * size-bounded cache whose entries expire after a per-entry TTL.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_LRU_CACHE_H__
+#define SHARDED_LRU_CACHE_H__
+
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+
+#include "snmp_counter_table.h"
+
+/// The statistics tables maintained by a ShardedLRUCache.  Any of these may be
+/// NULL.
+struct ShardedLRUCacheStatsTables
+{
+  SNMP::CounterTable* hits_tbl;
+  SNMP::CounterTable* misses_tbl;
+  SNMP::CounterTable* evictions_tbl;
+};
+
+/// Cache mapping keys to values, with each entry expiring after its own TTL.
+///
+/// The cache is split into a number of shards (selected by hashing the key),
+/// each with its own lock and LRU list, so that threads looking up different
+/// keys rarely contend.  When a shard is full the least recently used entry
+/// in that shard is evicted.
+template <class K, class V>
+class ShardedLRUCache
+{
+public:
+  /// Construct a cache holding up to (roughly) capacity entries, split into
+  /// the specified number of shards.
+  ShardedLRUCache(size_t capacity,
+                  int num_shards,
+                  const ShardedLRUCacheStatsTables& stats_tbls) :
+    _shard_capacity((capacity + num_shards - 1) / num_shards),
+    _shards(num_shards),
+    _stats_tbls(stats_tbls)
+  {
+    for (int ii = 0; ii < num_shards; ++ii)
+    {
+      _shards[ii] = new Shard();
+      pthread_mutex_init(&_shards[ii]->lock, NULL);
+    }
+  }
+
+  ~ShardedLRUCache()
+  {
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      pthread_mutex_destroy(&_shards[ii]->lock);
+      delete _shards[ii]; _shards[ii] = NULL;
+    }
+  }
+
+  /// Look up a key.  Returns true and fills in value if there is an unexpired
+  /// entry for the key, and false otherwise.
+  bool get(const K& key, V& value)
+  {
+    Shard* shard = get_shard(key);
+    bool found = false;
+
+    pthread_mutex_lock(&shard->lock);
+
+    typename Index::iterator it = shard->index.find(key);
+
+    if (it != shard->index.end())
+    {
+      if (it->second->expiry_ms > now_ms())
+      {
+        // Move the entry to the front of the LRU list.
+        shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+        value = it->second->value;
+        found = true;
+      }
+      else
+      {
+        // The entry has expired, so remove it.
+        shard->lru.erase(it->second);
+        shard->index.erase(it);
+      }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    increment(found ? _stats_tbls.hits_tbl : _stats_tbls.misses_tbl);
+
+    return found;
+  }
+
+  /// Returns whether there is an unexpired entry for a key.  Unlike get(),
+  /// this doesn't count as a hit or a miss or make the entry more recently
+  /// used.
+  bool contains(const K& key)
+  {
+    Shard* shard = get_shard(key);
+
+    pthread_mutex_lock(&shard->lock);
+    typename Index::iterator it = shard->index.find(key);
+    bool found = ((it != shard->index.end()) &&
+                  (it->second->expiry_ms > now_ms()));
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+  }
+
+  /// Add an entry to the cache, replacing any existing entry for the key.  The
+  /// entry expires after ttl_secs seconds.  Entries with a TTL of zero (or
+  /// less) are not cached.
+  void put(const K& key, const V& value, int ttl_secs)
+  {
+    if ((ttl_secs <= 0) || (_shard_capacity == 0))
+    {
+      return;
+    }
+
+    Shard* shard = get_shard(key);
+    bool evicted = false;
+
+    pthread_mutex_lock(&shard->lock);
+
+    typename Index::iterator it = shard->index.find(key);
+
+    if (it != shard->index.end())
+    {
+      shard->lru.erase(it->second);
+      shard->index.erase(it);
+    }
+    else if (shard->index.size() >= _shard_capacity)
+    {
+      // The shard is full, so evict the least recently used entry.
+      shard->index.erase(shard->lru.back().key);
+      shard->lru.pop_back();
+      evicted = true;
+    }
+
+    Entry entry = {key, value, now_ms() + ((unsigned long)ttl_secs * 1000)};
+    shard->lru.push_front(entry);
+    shard->index[key] = shard->lru.begin();
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (evicted)
+    {
+      increment(_stats_tbls.evictions_tbl);
+    }
+  }
+
+  /// Remove the entry for a key, if there is one.  Returns true if there was
+  /// an unexpired entry, in which case its value is returned in value (if
+  /// specified).
+  bool erase(const K& key, V* value = NULL)
+  {
+    Shard* shard = get_shard(key);
+    bool found = false;
+
+    pthread_mutex_lock(&shard->lock);
+
+    typename Index::iterator it = shard->index.find(key);
+
+    if (it != shard->index.end())
+    {
+      if (it->second->expiry_ms > now_ms())
+      {
+        if (value != NULL)
+        {
+          *value = it->second->value;
+        }
+
+        found = true;
+      }
+
+      shard->lru.erase(it->second);
+      shard->index.erase(it);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+  }
+
+  /// Returns the number of entries in the cache (including any that have
+  /// expired but not yet been removed).
+  size_t size()
+  {
+    size_t size = 0;
+
+    for (size_t ii = 0; ii < _shards.size(); ++ii)
+    {
+      pthread_mutex_lock(&_shards[ii]->lock);
+      size += _shards[ii]->index.size();
+      pthread_mutex_unlock(&_shards[ii]->lock);
+    }
+
+    return size;
+  }
+
+  /// Returns an estimate of the memory used by the cache's entries, from
+  /// the number of entries.  This doesn't include memory the keys or values
+  /// point to, but callers can add an estimate of it per entry.
+  size_t memory(size_t extra_bytes_per_entry = 0)
+  {
+    return size() * (ENTRY_BYTES + extra_bytes_per_entry);
+  }
+
+private:
+  struct Entry
+  {
+    K key;
+    V value;
+    unsigned long expiry_ms;
+  };
+
+  typedef std::list<Entry> LRUList;
+  typedef std::unordered_map<K, typename LRUList::iterator> Index;
+
+  /// The memory used by an entry - its LRU list node (with two pointers) and
+  /// its index node (with a next pointer and cached hash).
+  static const size_t ENTRY_BYTES =
+    sizeof(Entry) + 2 * sizeof(void*) +
+    sizeof(typename Index::value_type) + 2 * sizeof(void*);
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    // Entries in most recently used order.
+    LRUList lru;
+    Index index;
+  };
+
+  Shard* get_shard(const K& key)
+  {
+    return _shards[std::hash<K>()(key) % _shards.size()];
+  }
+
+  static void increment(SNMP::CounterTable* tbl)
+  {
+    if (tbl != NULL)
+    {
+      tbl->increment();
+    }
+  }
+
+  // Returns the current time in milliseconds from a monotonic clock.
+  static unsigned long now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+  }
+
+  size_t _shard_capacity;
+  std::vector<Shard*> _shards;
+  ShardedLRUCacheStatsTables _stats_tbls;
+};
+
+#endif
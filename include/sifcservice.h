@@ -23,6 +23,7 @@
 #include "ifc.h"
 #include "alarm.h"
 #include "snmp_counter_table.h"
+#include "config_snapshot.h"
 
 class SIFCService
 {
@@ -40,7 +41,9 @@ public:
   /// Updates the shared iFC sets
   void update_sets();
 
-  /// Get the iFCs that belong to a set of IDs
+  /// Get the iFCs that belong to a set of IDs.  The iFCs are compiled when
+  /// the configuration is loaded, and own their own memory, so ifc_doc isn't
+  /// used.
   virtual void get_ifcs_from_id(std::multimap<int32_t, Ifc>& ifc_map,
                                 const std::set<int32_t>& id,
                                 std::shared_ptr<xml_document<> > ifc_doc,
@@ -49,14 +52,11 @@ public:
 private:
   Alarm* _alarm;
   SNMP::CounterTable* _no_shared_ifcs_set_tbl;
-  std::map<int32_t, std::vector<std::pair<int32_t, std::string>>> _shared_ifc_sets;
+  typedef std::map<int32_t, std::vector<std::pair<int32_t, Ifc>>> SetMap;
+  ConfigSnapshot<SetMap> _shared_ifc_sets;
   std::string _configuration;
   Updater<void, SIFCService>* _updater;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _sets_rw_lock;
-
   // Helper functions to set/clear the alarm.
   void set_alarm();
   void clear_alarm();
@@ -45,6 +45,8 @@ public:
     static const unsigned int CONDITION_ROAMING =            0x0040;
     static const unsigned int CONDITION_INTERNATIONAL =      0x0080;
     static const unsigned int CONDITION_INTERNATIONAL_EXHC = 0x0100;
+    static const unsigned int CONDITION_MEDIA =
+      CONDITION_MEDIA_AUDIO | CONDITION_MEDIA_VIDEO;
     unsigned int conditions() const;
 
   private:
@@ -75,19 +77,24 @@ public:
     bool _allow_call;
   };
 
-  bool oip_enabled();
-  bool oir_enabled();
-  bool oir_presentation_restricted();
+  bool oip_enabled() const;
+  bool oir_enabled() const;
+  bool oir_presentation_restricted() const;
   bool cdiv_enabled() const;
   unsigned int cdiv_no_reply_timer() const;
   const std::vector<CDIVRule>* cdiv_rules() const;
+  unsigned int cdiv_rule_conditions() const;
   bool inbound_cb_enabled() const;
   bool outbound_cb_enabled() const;
   const std::vector<CBRule>* inbound_cb_rules() const;
   const std::vector<CBRule>* outbound_cb_rules() const;
+  unsigned int inbound_cb_rule_conditions() const;
+  unsigned int outbound_cb_rule_conditions() const;
 
 private:
   bool check_active(rapidxml::xml_node<> *service);
+  static unsigned int rule_conditions(const std::vector<CDIVRule>& rules);
+  static unsigned int rule_conditions(const std::vector<CBRule>& rules);
 
   bool _oip_enabled;
 
@@ -102,6 +109,13 @@ private:
   bool _outbound_cb_enabled;
   std::vector<CBRule> _inbound_cb_rules;
   std::vector<CBRule> _outbound_cb_rules;
+
+  // The union of the conditions used by each rule set, worked out when the
+  // rules are loaded so that evaluating them only needs to look at those
+  // parts of a message that some rule actually depends on.
+  unsigned int _cdiv_rule_conditions;
+  unsigned int _inbound_cb_rule_conditions;
+  unsigned int _outbound_cb_rule_conditions;
 };
 
 #endif
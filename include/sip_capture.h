@@ -0,0 +1,159 @@
+/**
+ * @file sip_capture.h Capturing sent and received SIP messages to pcapng
+ * files.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SIP_CAPTURE_H__
+#define SIP_CAPTURE_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <stdint.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sas.h"
+
+/// Captures sent and received SIP messages, with their addresses and SAS
+/// trails, to a rotating set of pcapng files that Wireshark can read.  This
+/// is much cheaper than logging the messages at verbose level, so can be
+/// left on on a live node.
+///
+/// As for SasMessageLog, the thread handling a message only copies it onto
+/// a lock-free ring, and a background thread writes it out.  Each file is
+/// created at its full size and mapped into memory, so writing a message is
+/// a copy rather than a system call.  Once a file is full the next is
+/// started, and once there are num_files the oldest is overwritten.  If the
+/// ring is full the message isn't captured.
+///
+/// Messages are written as Wireshark "exported PDUs", which carry the
+/// addresses, ports and transport of the message in front of the SIP
+/// message itself, with the message's SAS trail ID as the packet comment.
+class SipCapture
+{
+public:
+  /// Constructor.
+  /// @param directory  - The directory to write the files to.
+  /// @param file_size  - The size of each file, in bytes.
+  /// @param num_files  - The number of files to rotate through.
+  /// @param filters    - If not empty, only messages that match one of
+  ///                     these are captured.  Entries starting "sip:",
+  ///                     "sips:" or "tel:" are IMPUs, which match any message
+  ///                     they appear in, and other entries are Call-IDs.
+  SipCapture(const std::string& directory,
+             size_t file_size,
+             int num_files,
+             const std::vector<std::string>& filters);
+
+  /// Destructor.  Writes any queued messages and closes the current file.
+  ~SipCapture();
+
+  /// Whether the first capture file could be created.
+  bool ok() const { return _ok; }
+
+  /// Captures a message if it passes the filters.  The message is copied,
+  /// so needn't outlive the call.
+  /// @param tx           - Whether the message was sent (or received).
+  /// @param reliable     - Whether the transport is TCP (or UDP).
+  /// @param local_addr   - The local address of the transport.
+  /// @param remote_addr  - The address the message was sent to or received
+  ///                       from.
+  /// @param call_id      - The message's Call-ID, or NULL if it has none.
+  void capture(bool tx,
+               bool reliable,
+               const pj_sockaddr* local_addr,
+               const pj_sockaddr* remote_addr,
+               SAS::TrailId trail,
+               const pj_str_t* call_id,
+               int len,
+               const char* msg);
+
+  /// Returns the number of messages that weren't captured because the ring
+  /// was full.
+  uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+  /// The number of messages that can be queued.
+  static const uint64_t RING_SIZE = 4096;
+
+private:
+  /// A slot on the ring, used as for SasMessageLog.
+  struct Slot
+  {
+    std::atomic<uint64_t> seq;
+    uint64_t timestamp_ns;
+    bool tx;
+    bool reliable;
+    pj_sockaddr local_addr;
+    pj_sockaddr remote_addr;
+    SAS::TrailId trail;
+    int len;
+    char* msg;
+  };
+
+  bool matches(const pj_str_t* call_id, int len, const char* msg) const;
+
+  /// Body of the writing thread.
+  void writer();
+
+  /// Writes all the messages in the ring.  Returns how many were written.
+  int drain();
+
+  /// Builds the pcapng block for a message in _block.
+  void build_packet_block(const Slot& slot);
+
+  /// Copies _block to the current file, starting the next file if it
+  /// doesn't fit.
+  void write_block();
+
+  /// Copies _block to the current file if it fits.
+  bool copy_block();
+
+  bool open_file();
+  void close_file();
+
+  const std::string _directory;
+  const size_t _file_size;
+  const int _num_files;
+
+  std::set<std::string> _call_ids;
+  std::vector<std::string> _impus;
+
+  /// The current file, which only the writing thread uses once it has
+  /// started.
+  int _file_index;
+  int _fd;
+  char* _map;
+  size_t _used;
+  std::vector<char> _block;
+
+  /// Whether the first file could be created, in which case the writing
+  /// thread is running.
+  bool _ok;
+
+  Slot* _ring;
+
+  /// The next position for producers to claim.
+  std::atomic<uint64_t> _head;
+
+  /// The next position for the writing thread to write.  Only used by the
+  /// writing thread.
+  uint64_t _tail;
+
+  std::atomic<uint64_t> _dropped;
+  std::atomic<bool> _stopping;
+  std::thread _writer;
+};
+
+#endif
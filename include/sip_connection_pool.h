@@ -16,29 +16,78 @@ extern "C" {
 #include <pjsip.h>
 }
 
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <map>
 #include <string>
 #include <random>
+#include <cstdint>
 
 #include "snmp_ip_count_table.h"
+#include "instrumented_mutex.h"
 
 class SIPConnectionPool
 {
 public:
+  /// How get_connection picks a connection.
+  enum Selection
+  {
+    /// Any connected connection, at random.
+    RANDOM,
+
+    /// The connection with the fewest transactions in flight, weighted by
+    /// its recent response latency.
+    LEAST_LOADED,
+
+    /// A connection to the host that the request's affinity key (the
+    /// subscriber's public identity) hashes to, so that each subscriber's
+    /// requests go to the same upstream node while it stays connected.
+    /// This uses rendezvous hashing over the hosts with connected
+    /// connections, so when a host fails only its subscribers move (each to
+    /// its next preferred host), and they move back when it recovers.
+    /// Requests with no key are handled as for RANDOM.
+    AFFINITY
+  };
+
+  /// The count table, which records the connections to each host, may be
+  /// NULL.
   SIPConnectionPool(pjsip_host_port* target,
                  int num_connections,
                  int recycle_period,
                  pj_pool_t* pool,
                  pjsip_endpoint* endpt,
                  pjsip_tpfactory* tp_factory,
-                 SNMP::IPCountTable* sprout_count_tbl);
+                 SNMP::IPCountTable* sprout_count_tbl,
+                 Selection selection=RANDOM,
+                 SNMP::IPCountTable* sprout_load_tbl=NULL);
   ~SIPConnectionPool();
 
   void init();
 
   pjsip_transport* get_connection();
 
+  /// Gets a connection for a request, using the affinity key to pick the
+  /// host if the pool uses AFFINITY selection.  The key may be NULL.
+  pjsip_transport* get_connection(const pj_str_t* affinity_key);
+
+  /// Records that a transaction has been started on a connection from the
+  /// pool.  Neither this nor request_complete takes a lock.
+  void request_started(pjsip_transport* tp);
+
+  /// Records that a transaction started on a connection from the pool has
+  /// finished.  The transport may have been destroyed by now, so is only
+  /// used to look up its connection.  If latency_us is negative the
+  /// transaction got no response, so it doesn't count towards the latency.
+  void request_complete(pjsip_transport* tp, long latency_us);
+
+  /// Returns the number of connected connections.
+  int num_connected() const;
+
+  /// Returns the number of transactions in flight across the connected
+  /// connections.
+  int in_flight() const;
+
   // Callback static function passed to PJSIP
   static void transport_state(pjsip_transport* tp,
                               pjsip_transport_state state,
@@ -48,6 +97,34 @@ public:
   static int recycle_thread(void* p);
 
 private:
+  /// A connection in the pool, along with the load on it - the transactions
+  /// in flight on it, and a smoothed average of their response latency.
+  ///
+  /// A connection holds the pool's reference to its transport, and releases
+  /// it when it is destroyed.  Connections are shared between the slot that
+  /// owns them and the published list of connected connections, so a
+  /// connection that a reader has just picked stays valid (and so can safely
+  /// have another reference added to its transport) even if it is
+  /// concurrently removed from the pool.
+  struct Connection
+  {
+    Connection(pjsip_transport* tp);
+    ~Connection();
+
+    pjsip_transport* const tp;
+    const std::string host;
+
+    /// A hash of the host, for AFFINITY selection.
+    const uint64_t host_hash;
+    std::atomic<int> in_flight;
+    std::atomic<double> latency_us;
+    std::atomic<int> samples;
+  };
+
+  /// An immutable list of the connected connections.  get_connection and the
+  /// load tracking only ever look at the current list, so don't take a lock.
+  typedef std::vector<std::shared_ptr<Connection>> ConnectionList;
+
   pj_status_t resolve_host(const pj_str_t* host, int port, pj_sockaddr* addr);
   pj_status_t create_connection(int hash_slot);
   void quiesce_connection(int hash_slot);
@@ -56,6 +133,14 @@ private:
   void recycle_connections();
   void increment_connection_count(pjsip_transport *);
   void decrement_connection_count(pjsip_transport *);
+  void publish_connections();
+  void report_load();
+  std::shared_ptr<const ConnectionList> connections() const;
+  static Connection* find_connection(const ConnectionList& connections,
+                                     pjsip_transport* tp);
+  bool is_slow(const Connection* connection);
+  static uint64_t hash(const char* data, size_t len);
+  static uint64_t affinity_weight(uint64_t host_hash, uint64_t key_hash);
 
   pjsip_host_port _target;
   int _num_connections;
@@ -74,26 +159,44 @@ private:
   pj_thread_t* _recycler;
   volatile bool _terminated;
 
-  /// Number of active connections in the hash.
-  int _active_connections;
-
-  /// Structure to keep track of the connection in a slot in the hash.  tp
-  /// is set as soon as the connection is started, but it is disconnected
+  /// Structure to keep track of the connection in a slot in the hash.  The
+  /// connection is set as soon as it is started, but it is disconnected
   /// until we get a notification from PJSIP that the connection is connected.
   typedef struct tp_hash_slot
   {
-    pjsip_transport* tp;
+    std::shared_ptr<Connection> connection;
     pjsip_tp_state_listener_key *listener_key;
     pj_bool_t connected;
     int recycle_time;
   } tp_hash_slot;
 
-  pthread_mutex_t _tp_hash_lock;
+  Selection _selection;
+
+  /// A connection is recycled early if its latency is this many times the
+  /// average across the pool, once it has this many samples.
+  static const int SLOW_LATENCY_FACTOR = 3;
+  static const int SLOW_MIN_SAMPLES = 20;
+
+  /// The hash and the map are only used when connections are created, change
+  /// state or are removed.  This lock must be held to access them, and to
+  /// publish a new list of connected connections.
+  InstrumentedMutex _tp_hash_lock;
   std::vector<tp_hash_slot> _tp_hash;
   std::map<pjsip_transport*, int> _tp_map;
 
+  /// The current list of connected connections.  This is only accessed with
+  /// std::atomic_load and std::atomic_store.  ConfigSnapshot isn't used as
+  /// it caches snapshots per thread, which would keep old connections (and
+  /// so their transports) alive until every thread had next used the pool.
+  std::shared_ptr<const ConnectionList> _connected;
+
   // Statistics
   SNMP::IPCountTable* _sprout_count_tbl;
+  SNMP::IPCountTable* _sprout_load_tbl;
+
+  /// The transactions in flight to each host, as last reported in
+  /// _sprout_load_tbl.  Only accessed on the recycler thread.
+  std::map<std::string, int> _reported_load;
 };
 
 #endif // CONNECTION_POOL_H__
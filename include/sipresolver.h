@@ -12,8 +12,63 @@
 #ifndef SIPRESOLVER_H__
 #define SIPRESOLVER_H__
 
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
 #include "baseresolver.h"
+#include "exception_handler.h"
 #include "sas.h"
+#include "snmp_counter_table.h"
+#include "snmp_scalar.h"
+
+/// Iterator over a shared, immutable list of targets.
+class SharedAddrIterator : public BaseAddrIterator
+{
+public:
+  SharedAddrIterator(std::shared_ptr<const std::vector<AddrInfo>> targets) :
+    _targets(targets),
+    _next(0)
+  {
+  }
+
+  virtual ~SharedAddrIterator() {}
+
+  virtual std::vector<AddrInfo> take(int num_requested_targets);
+  virtual bool next(AddrInfo& target);
+
+private:
+  std::shared_ptr<const std::vector<AddrInfo>> _targets;
+  size_t _next;
+};
+
+/// Iterator that returns targets already taken from another iterator, and
+/// then the rest of that iterator's targets.
+class PrefixedAddrIterator : public BaseAddrIterator
+{
+public:
+  /// Takes ownership of rest.
+  PrefixedAddrIterator(const std::vector<AddrInfo>& prefix,
+                       BaseAddrIterator* rest) :
+    _prefix(prefix),
+    _next(0),
+    _rest(rest)
+  {
+  }
+
+  virtual ~PrefixedAddrIterator() { delete _rest; _rest = NULL; }
+
+  virtual std::vector<AddrInfo> take(int num_requested_targets);
+  virtual bool next(AddrInfo& target);
+
+private:
+  std::vector<AddrInfo> _prefix;
+  size_t _next;
+  BaseAddrIterator* _rest;
+};
 
 class SIPResolver : public BaseResolver
 {
@@ -39,6 +94,71 @@ public:
                                  int allowed_host_state,
                                  SAS::TrailId trail = 0);
 
+  /// Callback used to pass back the results of an asynchronous resolution.
+  /// The callee takes ownership of the iterator.
+  typedef std::function<void(BaseAddrIterator*)> ResolveCallback;
+
+  /// Starts a pool of threads on which resolve_iter_async does the DNS
+  /// lookups, so that the calling threads don't block waiting for DNS.  If
+  /// this isn't called, resolve_iter_async resolves on the calling thread.
+  void start_async_resolution(int num_threads,
+                              ExceptionHandler* exception_handler);
+
+  /// Resolves the target in the same way as resolve_iter, but without
+  /// blocking the calling thread on DNS where possible.
+  ///
+  /// If the targets can be found without a DNS lookup (because the name is
+  /// an IP address, or asynchronous resolution isn't enabled) the iterator is
+  /// returned directly and the callback is not called.  Otherwise this
+  /// returns NULL, and the callback is called with the iterator on one of the
+  /// resolver threads once resolution has completed.
+  BaseAddrIterator* resolve_iter_async(const std::string& name,
+                                       int af,
+                                       int port,
+                                       int transport,
+                                       int allowed_host_state,
+                                       ResolveCallback callback,
+                                       SAS::TrailId trail = 0);
+
+  /// Keeps a copy of the targets of the most recently used next hops, and
+  /// refreshes them (on the resolver threads, if they have been started) when
+  /// their DNS records expire.  While the refresh is in progress, requests
+  /// for that next hop are given the previous targets for up to max_stale
+  /// seconds rather than waiting for DNS.
+  /// @param max_hot_targets  - The most next hops to keep targets for.
+  /// @param max_stale        - How long after its records expire to keep using
+  ///                           a next hop's previous targets.
+  /// @param hot_targets_scalar - Reports how many next hops we're keeping.
+  /// @param refreshes_tbl    - Counts refreshes of next hops' targets.
+  /// @param stale_tbl        - Counts requests given their previous targets.
+  void enable_hot_targets(size_t max_hot_targets,
+                          int max_stale,
+                          SNMP::U32Scalar* hot_targets_scalar,
+                          SNMP::CounterTable* refreshes_tbl,
+                          SNMP::CounterTable* stale_tbl);
+
+  /// Orders SRV targets by how quickly they have responded recently.  Of the
+  /// first two targets chosen (at random, by SRV weight) for a next hop, the
+  /// second is tried first if they have the same SRV priority and it has
+  /// been responding much more quickly.  Call this at start of day.
+  void enable_latency_ordering();
+
+  /// Records how long a target took to respond to a request.
+  void record_latency(const AddrInfo& target, unsigned long latency_us);
+
+  /// Records that a target rejected a request because it is overloaded (with
+  /// a 503 and a Retry-After header), so that requests are sent to other
+  /// targets for a while.  The target isn't blacklisted, as it is still
+  /// working.
+  /// @param retry_after_s - The Retry-After value.  Sprout sends zero when it
+  ///                        sheds load, so the target is avoided for at least
+  ///                        OVERLOAD_DURATION_MS.
+  void record_overload(const AddrInfo& target, int retry_after_s);
+
+  /// If the first of the targets has recently said it is overloaded and the
+  /// second hasn't, puts the second first.  Takes ownership of targets_iter.
+  BaseAddrIterator* avoid_overloaded(BaseAddrIterator* targets_iter);
+
   /// Default duration to blacklist hosts after we fail to connect to them.
   static const int DEFAULT_BLACKLIST_DURATION = 30;
 
@@ -47,6 +167,123 @@ public:
   static const int DEFAULT_GRAYLIST_DURATION = 30;
 
   std::string get_transport_str(int transport);
+
+private:
+  /// Does the resolution for resolve_iter.  If ttl is not NULL, it is set to
+  /// the number of seconds until the first of the DNS records used expires.
+  BaseAddrIterator* resolve_targets(const std::string& name,
+                                    int af,
+                                    int port,
+                                    int transport,
+                                    int allowed_host_state,
+                                    int* ttl,
+                                    SAS::TrailId trail);
+
+  /// Refreshes the targets of a hot next hop.
+  void refresh_hot_target(const std::string& key,
+                          const std::string& name,
+                          int af,
+                          int port,
+                          int transport);
+
+  static std::string target_key(const std::string& name,
+                                    int af,
+                                    int port,
+                                    int transport);
+
+  static unsigned long now_ms();
+
+  /// Puts the quicker of the first two SRV targets first, if latency
+  /// ordering is enabled.  Takes ownership of targets_iter.
+  BaseAddrIterator* order_by_latency(BaseAddrIterator* targets_iter,
+                                     const std::string& srv_name);
+
+  /// Gets a target's recent response latency.  Returns false if it hasn't
+  /// responded recently.
+  bool latency_estimate(const AddrInfo& target, unsigned long& latency_us);
+
+  /// Returns the SRV priority of a target, from the cached records of the SRV
+  /// name it was resolved from, or -1 if it isn't known.
+  int srv_priority(DnsResult& srv_result, const AddrInfo& target);
+
+  /// A target's recent response latency.
+  struct LatencyEstimate
+  {
+    unsigned long latency_us;
+    unsigned long updated_ms;
+  };
+
+  bool _latency_ordering;
+  std::mutex _latencies_lock;
+  std::map<std::string, LatencyEstimate> _latencies;
+
+  /// The most targets to keep latencies for.
+  static const size_t MAX_LATENCIES = 4096;
+
+  /// How long a latency estimate is used for once the target stops
+  /// responding.
+  static const unsigned long LATENCY_DECAY_MS = 30000;
+
+  /// Each response moves the estimate this fraction (1/n) of the way towards
+  /// its latency.
+  static const unsigned long LATENCY_GAIN = 8;
+
+  /// Returns whether a target has said it is overloaded recently enough that
+  /// it should be avoided.
+  bool is_overloaded(const AddrInfo& target, unsigned long now);
+
+  /// When each target that has recently said it is overloaded should next
+  /// be tried first, in ms since an arbitrary point (see now_ms).
+  std::mutex _overloaded_lock;
+  std::map<std::string, unsigned long> _overloaded;
+
+  /// The latest of the times in _overloaded, so that while no target is
+  /// overloaded avoid_overloaded doesn't take the lock.
+  std::atomic<unsigned long> _overloaded_until_ms;
+
+  /// The most targets to keep overload state for.
+  static const size_t MAX_OVERLOADED = 1024;
+
+  /// The shortest time a target is avoided for once it has said it is
+  /// overloaded.
+  static const unsigned long OVERLOAD_DURATION_MS = 2000;
+
+  /// The targets that IP address next hops resolve to, keyed on the name,
+  /// port and transport.  These only depend on the host state if some host
+  /// states aren't allowed, so are only used when all host states are.
+  std::mutex _ip_targets_lock;
+  std::map<std::string, std::shared_ptr<const std::vector<AddrInfo>>> _ip_targets;
+
+  /// The most IP address next hops to keep targets for.
+  static const size_t MAX_IP_TARGETS = 1024;
+
+  class AsyncPool;
+  AsyncPool* _async_pool;
+
+  /// The targets of a recently used next hop.
+  struct HotTarget
+  {
+    std::string name;
+    int af;
+    int port;
+    int transport;
+    std::vector<AddrInfo> targets;
+    unsigned long expiry_ms;
+    bool refreshing;
+    std::list<std::string>::iterator lru;
+  };
+
+  /// The most targets to keep for each hot next hop.
+  static const int MAX_HOT_TARGET_ADDRS = 16;
+
+  std::mutex _hot_targets_lock;
+  std::map<std::string, HotTarget> _hot_targets;
+  std::list<std::string> _hot_targets_lru;
+  size_t _max_hot_targets;
+  unsigned long _max_stale_ms;
+  SNMP::U32Scalar* _hot_targets_scalar;
+  SNMP::CounterTable* _refreshes_tbl;
+  SNMP::CounterTable* _stale_tbl;
 };
 
 #endif
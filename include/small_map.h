@@ -0,0 +1,178 @@
+/**
+ * @file small_map.h Definitions of SmallVector and SmallMap - containers
+ * that hold a few entries without allocating.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SMALL_MAP_H__
+#define SMALL_MAP_H__
+
+#include <stddef.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/// Vector that stores up to N entries inside the object itself, and only
+/// allocates if it grows beyond that.
+///
+/// Entries are kept in the order they were added, and erasing an entry
+/// moves the later entries down, so erase invalidates iterators to the
+/// erased entry and to any after it.  The type must be default-constructible
+/// and assignable.
+template <class T, size_t N>
+class SmallVector
+{
+public:
+  typedef T value_type;
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  SmallVector() : _data(_inline), _size(0), _capacity(N) {}
+
+  // Iterators point into the object, so it can't be copied.
+  SmallVector(const SmallVector&) = delete;
+  SmallVector& operator=(const SmallVector&) = delete;
+
+  iterator begin() { return _data; }
+  iterator end() { return _data + _size; }
+  const_iterator begin() const { return _data; }
+  const_iterator end() const { return _data + _size; }
+
+  bool empty() const { return (_size == 0); }
+  size_t size() const { return _size; }
+
+  T& front() { return _data[0]; }
+  T& operator[](size_t index) { return _data[index]; }
+
+  void push_back(const T& value)
+  {
+    if (_size == _capacity)
+    {
+      grow();
+    }
+
+    _data[_size++] = value;
+  }
+
+  void erase(iterator it)
+  {
+    std::move(it + 1, end(), it);
+    --_size;
+
+    // Reset the vacated entry so it doesn't hold on to anything.
+    _data[_size] = T();
+  }
+
+  void clear()
+  {
+    while (!empty())
+    {
+      erase(end() - 1);
+    }
+  }
+
+private:
+  void grow()
+  {
+    std::vector<T> storage(_capacity * 2);
+    std::move(begin(), end(), storage.begin());
+    _overflow.swap(storage);
+    _data = _overflow.data();
+    _capacity = _overflow.size();
+  }
+
+  T _inline[N];
+  std::vector<T> _overflow;
+  T* _data;
+  size_t _size;
+  size_t _capacity;
+};
+
+/// Map that stores up to N entries without allocating, for the bookkeeping
+/// of a transaction, which usually has only one or two of anything.
+///
+/// Lookups search the entries linearly, which for a few entries is faster
+/// than following the nodes of a std::map.  Entries are iterated in the
+/// order they were added, and the same iterator invalidation rules as for
+/// SmallVector apply.
+template <class K, class V, size_t N>
+class SmallMap
+{
+public:
+  typedef std::pair<K, V> value_type;
+  typedef typename SmallVector<value_type, N>::iterator iterator;
+  typedef typename SmallVector<value_type, N>::const_iterator const_iterator;
+
+  SmallMap() : _entries() {}
+
+  iterator begin() { return _entries.begin(); }
+  iterator end() { return _entries.end(); }
+  const_iterator begin() const { return _entries.begin(); }
+  const_iterator end() const { return _entries.end(); }
+
+  bool empty() const { return _entries.empty(); }
+  size_t size() const { return _entries.size(); }
+
+  iterator find(const K& key)
+  {
+    return std::find_if(begin(), end(),
+                        [&key](const value_type& entry) { return entry.first == key; });
+  }
+
+  const_iterator find(const K& key) const
+  {
+    return std::find_if(begin(), end(),
+                        [&key](const value_type& entry) { return entry.first == key; });
+  }
+
+  /// Returns the value for a key, adding a default value if the key isn't
+  /// already in the map.
+  V& operator[](const K& key)
+  {
+    iterator it = find(key);
+
+    if (it == end())
+    {
+      _entries.push_back(value_type(key, V()));
+      it = end() - 1;
+    }
+
+    return it->second;
+  }
+
+  void erase(iterator it)
+  {
+    _entries.erase(it);
+  }
+
+  /// Erases the entry for a key.  Takes a copy of the key, as it may refer to
+  /// an entry in another of the caller's maps.
+  size_t erase(K key)
+  {
+    iterator it = find(key);
+
+    if (it == end())
+    {
+      return 0;
+    }
+
+    _entries.erase(it);
+    return 1;
+  }
+
+  void clear()
+  {
+    _entries.clear();
+  }
+
+private:
+  SmallVector<value_type, N> _entries;
+};
+
+#endif
@@ -0,0 +1,209 @@
+/**
+ * @file snmp_shards.h Per-thread aggregation of SNMP statistics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SNMP_SHARDS_H__
+#define SNMP_SHARDS_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "metrics.h"
+
+/// Aggregation of updates to SNMP statistics tables in per-thread shards.
+///
+/// The SNMP tables take a lock on every update, so updating them from every
+/// thread for every SIP message bounces the lock (and the table's
+/// statistics) between cores.  The classes here wrap a table, and collect
+/// updates in shards, each of which is normally only used by one thread (as
+/// the shards of the Metrics are).  A tick thread flushes the shards into
+/// the table every FLUSH_INTERVAL_MS, so the table sees exactly the same
+/// updates, and the SNMP agent reports the same statistics, up to one tick
+/// late.
+namespace SNMPShards
+{
+  /// How often the shards are flushed to the tables.
+  static const int FLUSH_INTERVAL_MS = 100;
+
+  /// The most samples a shard of an Accumulator holds.  If a shard fills
+  /// before it's flushed, the thread updating it flushes it.
+  static const size_t MAX_SAMPLES = 1024;
+
+  /// Base class of the wrappers, which registers them to be flushed.
+  class Aggregator
+  {
+  public:
+    virtual ~Aggregator() {}
+
+    /// Passes the updates collected so far to the table.
+    virtual void flush() = 0;
+
+  protected:
+    /// Starts and stops the tick thread flushing this.  The subclass must
+    /// register once it's constructed, and unregister before it's destroyed.
+    void register_aggregator();
+    void unregister_aggregator();
+  };
+
+  /// Starts the tick thread.  Until it's started, updates are only passed to
+  /// the tables by flush_all(), or when the wrappers are destroyed.
+  void start();
+
+  /// Stops the tick thread, and flushes every wrapper.
+  void stop();
+
+  /// Flushes every wrapper.
+  void flush_all();
+
+  /// Wraps a table of counters (a CounterTable or CounterByScopeTable).
+  template <class Table>
+  class Counter : public Aggregator
+  {
+  public:
+    Counter(Table* tbl) :
+      _tbl(tbl)
+    {
+      for (int ii = 0; ii < Metrics::NUM_SHARDS; ++ii)
+      {
+        _shards[ii].count = 0;
+      }
+
+      register_aggregator();
+    }
+
+    virtual ~Counter()
+    {
+      unregister_aggregator();
+      flush();
+    }
+
+    void increment()
+    {
+      _shards[Metrics::shard()].count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    virtual void flush()
+    {
+      for (int ii = 0; ii < Metrics::NUM_SHARDS; ++ii)
+      {
+        // The table can only be incremented by one at a time.
+        for (uint64_t count = _shards[ii].count.exchange(0, std::memory_order_relaxed);
+             count > 0;
+             --count)
+        {
+          _tbl->increment();
+        }
+      }
+    }
+
+  private:
+    // Padded as for Metrics::Counter.
+    struct Shard
+    {
+      std::atomic<uint64_t> count;
+      char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    Table* _tbl;
+    Shard _shards[Metrics::NUM_SHARDS];
+  };
+
+  /// Wraps a table of accumulated samples (an EventAccumulatorTable or
+  /// EventAccumulatorByScopeTable).  The table works out the statistics
+  /// (mean, variance and so on) from the samples, so each sample is kept
+  /// until it's flushed, rather than a summary.
+  template <class Table>
+  class Accumulator : public Aggregator
+  {
+  public:
+    Accumulator(Table* tbl) :
+      _tbl(tbl)
+    {
+      register_aggregator();
+    }
+
+    virtual ~Accumulator()
+    {
+      unregister_aggregator();
+      flush();
+    }
+
+    void accumulate(uint32_t sample)
+    {
+      Shard& shard = _shards[Metrics::shard()];
+      bool full;
+
+      {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.samples.push_back(sample);
+        full = (shard.samples.size() >= MAX_SAMPLES);
+      }
+
+      if (full)
+      {
+        drain(shard);
+      }
+    }
+
+    virtual void flush()
+    {
+      for (int ii = 0; ii < Metrics::NUM_SHARDS; ++ii)
+      {
+        drain(_shards[ii]);
+      }
+    }
+
+  private:
+    // The lock is only ever contended by a flush.  The padding keeps each
+    // shard's lock and buffer off its neighbours' cache lines.
+    struct Shard
+    {
+      std::mutex lock;
+      std::vector<uint32_t> samples;
+      char pad[64];
+    };
+
+    // Passes a shard's samples to the table, without holding the shard's
+    // lock while the table is updated.
+    void drain(Shard& shard)
+    {
+      std::vector<uint32_t> samples;
+
+      {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        samples.swap(shard.samples);
+      }
+
+      for (uint32_t sample : samples)
+      {
+        _tbl->accumulate(sample);
+      }
+
+      // Give the buffer back, so the thread using the shard doesn't have to
+      // allocate another.
+      samples.clear();
+
+      {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if (shard.samples.empty())
+        {
+          shard.samples.swap(samples);
+        }
+      }
+    }
+
+    Table* _tbl;
+    Shard _shards[Metrics::NUM_SHARDS];
+  };
+}
+
+#endif
@@ -19,12 +19,13 @@ extern "C" {
 #include <stdint.h>
 }
 
+#include <functional>
 #include <list>
 #include "baseresolver.h"
 #include "snmp_success_fail_count_by_request_type_table.h"
 #include "fork_error_state.h"
 
-#define API_VERSION 1
+#define API_VERSION 3
 
 class SproutletHelper;
 class SproutletTsxHelper;
@@ -404,6 +405,39 @@ public:
   /// @return     The local hostname part of the URI.
   virtual std::string get_local_hostname(const pjsip_sip_uri* uri,
                                          bool default_to_root=false) const = 0;
+
+  /// Returns the original request, without cloning it, for Sproutlets that
+  /// only need to read it.  Unlike original_request, this still has the top
+  /// Route header on it if that refers to this node.  It remains valid for
+  /// the life of the transaction.
+  ///
+  /// This was added in version 2 of the API.  It is after all the methods in
+  /// version 1 so that Sproutlets built against version 1 still work.
+  ///
+  /// @returns             - The original request message.
+  ///
+  virtual const pjsip_msg* original_request_view() const = 0;
+
+  /// The function returned by defer_processing.  It is passed the processing
+  /// to do once the Sproutlet's asynchronous work has completed.
+  typedef std::function<void(std::function<void()>)> Resumer;
+
+  /// Lets a Sproutlet wait for some asynchronous work (such as a DNS lookup)
+  /// without blocking its thread.  The Sproutlet returns without sending
+  /// anything, and calls the returned function exactly once (on any thread)
+  /// when the work completes.  The processing passed to it is then run on a
+  /// worker thread in the transaction's context, as if it were a callback
+  /// from the proxy, and the transaction isn't destroyed before it has run.
+  /// If the transaction has completed by then (for example, because it was
+  /// cancelled), the processing isn't run.
+  ///
+  /// This was added in version 3 of the API, after the methods in version 2.
+  /// By default the processing is run as soon as the function is called.
+  ///
+  /// @returns             - The function to call when the work completes.
+  ///
+  virtual Resumer defer_processing()
+    {return [](std::function<void()> processing) { processing(); };}
 };
 
 
@@ -517,6 +551,22 @@ protected:
   pjsip_msg* original_request()
     {return _helper->original_request();}
 
+  /// Returns the original request, without cloning it, for Sproutlets that
+  /// only need to read it.  This still has the top Route header on it.
+  ///
+  /// @returns             - The original request message.
+  ///
+  const pjsip_msg* original_request_view() const
+    {return _helper->original_request_view();}
+
+  /// Lets the Sproutlet wait for some asynchronous work without blocking its
+  /// thread.  See SproutletTsxHelper::defer_processing.
+  ///
+  /// @returns             - The function to call when the work completes.
+  ///
+  SproutletTsxHelper::Resumer defer_processing()
+    {return _helper->defer_processing();}
+
   /// Sets the transport on this request to be the same as on the original.
   ///
   /// @param  req          - The request message on which to set the
@@ -0,0 +1,153 @@
+/**
+ * @file sproutlet_cpu.h Accounting of the CPU time each Sproutlet uses.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SPROUTLET_CPU_H__
+#define SPROUTLET_CPU_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "snmp_event_accumulator_table.h"
+
+/// The CPU time used by one Sproutlet's callbacks, and the worker threads
+/// they occupy.  Recording takes a few relaxed atomic operations, so an
+/// account can be shared by all threads.
+///
+/// The account is also the Sproutlet's bulkhead.  Sproutlets share the
+/// worker threads, so one that blocks (on a slow backend, say) could occupy
+/// all of them, and stop every other Sproutlet from running.  With a limit
+/// on the workers a Sproutlet may occupy, new transactions for it are
+/// rejected while it is at the limit, leaving the remaining workers for
+/// everything else.  Callbacks for its existing transactions still run.
+class SproutletCpuAccount
+{
+public:
+  /// @param tbl  - Accumulates the CPU time of each callback in microseconds,
+  ///               or NULL.
+  /// @param name - The Sproutlet's name.
+  SproutletCpuAccount(SNMP::EventAccumulatorTable* tbl,
+                      const std::string& name = "");
+  ~SproutletCpuAccount();
+
+  /// The Sproutlet's name, which is valid for the life of the account.
+  const char* name() const
+  {
+    return _name.c_str();
+  }
+
+  /// Records the CPU time one callback used.
+  void record(uint64_t ns);
+
+  /// Records a worker thread starting and finishing running callbacks.
+  void enter();
+  void leave();
+
+  /// Sets the most worker threads this Sproutlet may occupy before new
+  /// transactions are rejected.  Zero (the default) means no limit.
+  void set_max_workers(int max_workers)
+  {
+    _max_workers.store(max_workers, std::memory_order_relaxed);
+  }
+
+  /// Returns whether a new transaction may start, or counts it as rejected
+  /// if the Sproutlet is at its limit.
+  bool admit();
+
+  struct Summary
+  {
+    uint64_t callbacks;
+    uint64_t total_us;
+    uint64_t max_us;
+    int busy_workers;
+    int max_busy_workers;
+    int max_workers;
+    uint64_t rejected;
+  };
+
+  Summary summary() const;
+
+private:
+  SNMP::EventAccumulatorTable* _tbl;
+  std::string _name;
+  std::atomic<uint64_t> _callbacks;
+  std::atomic<uint64_t> _total_ns;
+  std::atomic<uint64_t> _max_ns;
+  std::atomic<int> _busy_workers;
+  std::atomic<int> _max_busy_workers;
+  std::atomic<int> _max_workers;
+  std::atomic<uint64_t> _rejected;
+};
+
+/// Always-on accounting of the CPU time (CLOCK_THREAD_CPUTIME_ID) that each
+/// Sproutlet uses in its callbacks from the SproutletProxy, so that a
+/// Sproutlet (particularly one loaded from a plugin) that is using more than
+/// its share can be found.
+///
+/// Accounts are identified by Sproutlet name.  Each has an SNMP table of the
+/// CPU time per callback at .1.2.826.0.1.1578918.9.3.78.<index>, where the
+/// index is given by the order in which the accounts were created (and is
+/// reported with the other statistics over HTTP).  The workers each
+/// Sproutlet occupies and the transactions its bulkhead rejects are
+/// reported over HTTP and as metrics.
+namespace SproutletCpu
+{
+  /// Returns the CPU time used by the calling thread.
+  uint64_t thread_cpu_ns();
+
+  /// Returns the account for the named Sproutlet, creating it if needed.
+  /// This takes a lock, so callers should look the account up once and keep
+  /// the pointer, which stays valid for the life of the process.
+  SproutletCpuAccount* account(const std::string& name);
+
+  /// Sets the most worker threads the named Sproutlet may occupy (see
+  /// SproutletCpuAccount::set_max_workers), whether or not its account has
+  /// been created yet.
+  void set_max_workers(const std::string& name, int max_workers);
+
+  /// Times a callback, from construction to destruction, and records its CPU
+  /// time against an account (which may be NULL).  If a callback is timed
+  /// while another is being timed on the same thread, its time is only
+  /// counted against the inner callback's account.  The thread counts as
+  /// occupied by each account it is running a callback for.
+  class Timer
+  {
+  public:
+    Timer(SproutletCpuAccount* account);
+    ~Timer();
+
+  private:
+    /// Returns whether a timer, or one it is inside, is for the given
+    /// account, in which case the thread is already counted as occupied by
+    /// it.
+    static bool running(const Timer* timer, const SproutletCpuAccount* account);
+
+    SproutletCpuAccount* _account;
+    bool _occupies;
+    Timer* _outer;
+    const char* _outer_activity;
+    uint64_t _start_ns;
+    uint64_t _inner_ns;
+  };
+
+  struct AccountSummary
+  {
+    std::string name;
+    int index;
+    SproutletCpuAccount::Summary summary;
+  };
+
+  /// Returns a summary of every account, sorted by name.
+  std::vector<AccountSummary> summaries();
+}
+
+#endif
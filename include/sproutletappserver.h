@@ -24,8 +24,10 @@ extern "C" {
 #include "stack.h"
 #include "appserver.h"
 #include "sproutlet.h"
+#include "tsx_arena.h"
 
-class SproutletAppServerTsxHelper : public AppServerTsxHelper
+class SproutletAppServerTsxHelper : public AppServerTsxHelper,
+                                    public TsxArenaAllocated
 {
 public:
   /// Constructor.
@@ -189,6 +191,9 @@ private:
   pjsip_sip_uri* get_reflexive_uri(pj_pool_t* pool) const;
 
   SproutletTsxHelper* _helper;
+
+  /// Pool holding the onward route set.  This is only created if there are
+  /// any Route headers to store.
   pj_pool_t* _pool;
   pjsip_route_hdr _route_set;
   bool _record_routed;
@@ -229,7 +234,7 @@ private:
   AppServer* _app;
 };
 
-class SproutletAppServerShimTsx : public SproutletTsx
+class SproutletAppServerShimTsx : public SproutletTsx, public TsxArenaAllocated
 {
 public:
   /// Constructor
@@ -21,8 +21,16 @@
 #include "pjutils.h"
 #include "sproutlet.h"
 #include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
 #include "snmp_sip_request_types.h"
 #include "sproutlet_options.h"
+#include "pj_str_index.h"
+#include "small_map.h"
+#include "tsx_arena.h"
+#include "timer_wheel.h"
+#include "stage_latency.h"
+#include "sproutlet_cpu.h"
+#include "sip_connection_pool.h"
 
 class SproutletWrapper;
 
@@ -55,6 +63,15 @@ public:
   /// @param[in]  max_sproutlet_depth          The maximum number of Sproutlets
   ///                                          that can be invoked in a row
   ///                                          before we break the loop.
+  /// @param[in]  bytes_cloned_tbl             SNMP table for the number of
+  ///                                          bytes of SIP message cloned
+  ///                                          for each transaction.
+  /// @param[in]  stateless_in_dialog          Whether in-dialog requests that
+  ///                                          need no Sproutlet processing
+  ///                                          are forwarded statelessly.
+  /// @param[in]  collapse_record_routes       Whether the Record-Routes that
+  ///                                          the Sproutlets add to a request
+  ///                                          are collapsed into one.
   SproutletProxy(pjsip_endpoint* endpt,
                  int priority,
                  const std::string& root_uri,
@@ -65,7 +82,10 @@ public:
                  const std::set<std::string>& stateless_proxies,
                  SNMP::CounterTable* route_to_remote_alias_tbl,
                  SNMP::CounterTable* accept_for_remote_alias_tbl,
-                 int max_sproutlet_depth=DEFAULT_MAX_SPROUTLET_DEPTH);
+                 int max_sproutlet_depth=DEFAULT_MAX_SPROUTLET_DEPTH,
+                 SNMP::EventAccumulatorTable* bytes_cloned_tbl=NULL,
+                 bool stateless_in_dialog=false,
+                 bool collapse_record_routes=false);
 
   /// Destructor.
   virtual ~SproutletProxy();
@@ -147,6 +167,31 @@ protected:
   /// Create Sproutlet UAS transaction objects.
   BasicProxy::UASTsx* create_uas_tsx();
 
+  /// Process a transaction (that is, non-CANCEL) request.
+  void on_tsx_request(pjsip_rx_data* rdata) override;
+
+  /// Forwards an in-dialog request statelessly, without creating any
+  /// Sproutlet state, if it is only routed through an S-CSCF hop that isn't
+  /// billed.  Returns false if the request needs processing as normal.
+  bool forward_in_dialog_statelessly(pjsip_rx_data* rdata);
+
+  /// Returns whether a Via branch was generated by
+  /// forward_in_dialog_statelessly.
+  static bool is_stateless_branch(const pj_str_t* branch);
+
+  /// Collapses the Record-Routes that Sproutlets on this node have added to
+  /// a dialog-creating request leaving the node into one, which lists the
+  /// others (and the dialog's original From tag) in its parameters.  The
+  /// original request is the one received by this node, which has none of
+  /// those Record-Routes.
+  void collapse_record_routes(pjsip_tx_data* tdata,
+                              const pjsip_msg* original_req) const;
+
+  /// If the top Route of a request is a collapsed Record-Route, replaces it
+  /// with the Routes it lists, in the order for the end of the dialog that
+  /// sent the request - so the Sproutlets see the Routes they record-routed.
+  void expand_collapsed_route(pjsip_msg* req, pj_pool_t* pool) const;
+
   /// Registers a sproutlet.
   bool register_sproutlet(Sproutlet* sproutlet);
 
@@ -190,6 +235,14 @@ protected:
     std::string& local_hostname,
     SPROUTLET_SELECTION_TYPES& selection_type) const;
 
+  /// As above, but returns the alias and local hostname as slices of the
+  /// passed in URI, so nothing needs copying on the routing path.
+  SproutletMatch match_sproutlet_from_uri(
+    const pjsip_uri* uri,
+    pj_str_t& alias,
+    pj_str_t& local_hostname,
+    SPROUTLET_SELECTION_TYPES& selection_type) const;
+
   /// Create a URI that routes to a given Sproutlet.
   pjsip_sip_uri* create_sproutlet_uri(pj_pool_t* pool,
                                       Sproutlet* sproutlet) const;
@@ -239,6 +292,11 @@ protected:
   std::string get_local_hostname(const pjsip_sip_uri* uri,
                                  bool default_to_root=false) const;
 
+  /// As above, but returns the local hostname as a slice of the passed in URI
+  /// (or of the root URI).
+  pj_str_t get_local_hostname_str(const pjsip_sip_uri* uri,
+                                  bool default_to_root) const;
+
   /// @brief      Compares the given hostname to the alias lists and returns the
   ///             match locality.
   ///
@@ -289,6 +347,9 @@ protected:
     /// Handle a timer pop.
     static void on_timer_pop(pj_timer_heap_t* th, pj_timer_entry* tentry);
 
+    /// Handle a timer pop on a worker's timer wheel.
+    static void on_wheel_timer_pop(TimerWheel::Entry* entry);
+
   protected:
 
     // A Callback object to be run on a worker thread
@@ -332,6 +393,10 @@ protected:
       UASTsx* uas_tsx;
       SproutletWrapper* sproutlet_wrapper;
       void* context;
+
+      // The entry used if the timer is scheduled on a worker's timer wheel
+      // rather than the PJSIP timer heap - see schedule_timer.
+      TimerWheel::Entry wheel_entry;
     };
 
     // The timer callback object, which is run on a worker thread
@@ -431,13 +496,17 @@ protected:
     /// The root Sproutlet for this transaction.
     SproutletWrapper* _root;
 
+    /// The number of forks the mappings hold without allocating.  Most
+    /// transactions have only one or two.
+    static const size_t INLINE_FORKS = 4;
+
     /// Templated type used to map from upstream Sproutlet/fork to the
     /// downstream Sproutlet or UACTsx.
     template<typename T>
     struct DMap
     {
-      typedef std::map<std::pair<SproutletWrapper*, int>, T> type;
-      typedef typename std::map<std::pair<SproutletWrapper*, int>, T>::iterator iterator;
+      typedef SmallMap<std::pair<SproutletWrapper*, int>, T, INLINE_FORKS> type;
+      typedef typename type::iterator iterator;
     };
 
     /// Mapping from upstream Sproutlet/fork to downstream Sproutlet.
@@ -448,9 +517,27 @@ protected:
 
     /// Mapping from downstream Sproutlet or UAC transaction to upstream
     /// Sproutlet/fork.
-    typedef std::map<void*, std::pair<SproutletWrapper*, int> > UMap;
+    typedef SmallMap<void*, std::pair<SproutletWrapper*, int>, INLINE_FORKS> UMap;
     UMap _umap;
 
+    /// A request sent on a connection from an application server's pool,
+    /// which the pool is told about when the request completes.
+    struct PooledRequest
+    {
+      SIPConnectionPool* pool;
+      pjsip_transport* tp;
+      StageLatency::Ticks start;
+    };
+
+    /// Mapping from UAC transaction to the pooled connection its request was
+    /// sent on, if any.
+    typedef SmallMap<UACTsx*, PooledRequest, INLINE_FORKS> PooledRequests;
+    PooledRequests _pooled_requests;
+
+    /// Tells the pool (if any) that a UAC transaction's request has
+    /// completed.  If got_response is false, the request got no response.
+    void pooled_request_complete(UACTsx* uac_tsx, bool got_response);
+
     /// Queue of pending requests to be scheduled.
     typedef struct
     {
@@ -477,6 +564,24 @@ protected:
     /// The UASTsx will persist while there are pending timers.
     std::set<pj_timer_entry*> _pending_timers;
 
+    /// Requests whose bodies are shared by clones within this transaction.
+    /// A reference to each is held until the transaction is destroyed.
+    std::set<pjsip_tx_data*> _body_sources;
+
+    /// Number of bytes of SIP message cloned for this transaction.
+    size_t _bytes_cloned;
+
+    /// Arena that the SproutletWrappers, and the SproutletTsxs of Sproutlets
+    /// that opt in, are allocated from.
+    TsxArena* _arena;
+
+    /// Adds the size of a cloned message to the count of bytes cloned.
+    void record_clone(pjsip_tx_data* clone);
+
+    /// Keeps the source of a body shared by clone_msg_sharing_body alive
+    /// until the transaction is destroyed.
+    void hold_body_source(pjsip_tx_data* source);
+
     /// Count of the number of UASTsx objects currently active. Used for
     /// debugging purposes.
     static std::atomic_int _num_instances;
@@ -493,23 +598,49 @@ protected:
 
   std::map<std::string, Sproutlet*> _services;
 
+  /// Index of _services (and host locality) used for routing, so that the
+  /// service names and hosts in URIs can be looked up directly.
+  PjStrIndex<Sproutlet*> _service_index;
+  PjStrIndex<AliasMatchLocality> _host_index;
+
   std::map<int, Sproutlet*> _ports;
 
   std::list<Sproutlet*> _sproutlets;
 
+  /// Per-stage latency tracing of each Sproutlet's on_rx_initial_request.
+  /// This is only changed when Sproutlets are registered.
+  std::map<const Sproutlet*, StageHistogram*> _initial_request_stages;
+
+  /// The account of the CPU time each Sproutlet uses in its callbacks.  This
+  /// is only changed when Sproutlets are registered.
+  std::map<const Sproutlet*, SproutletCpuAccount*> _cpu_accounts;
+
+  /// Returns the CPU account for a Sproutlet, or NULL if it has none.
+  SproutletCpuAccount* cpu_account(const Sproutlet* sproutlet) const;
+
   static const pj_str_t STR_SERVICE;
 
+  /// The prefix of the Via branch added to requests forwarded statelessly,
+  /// which identifies the responses to forward.
+  static const pj_str_t STR_STATELESS_BRANCH_PREFIX;
+
   SNMP::CounterTable* _route_to_remote_alias_tbl;
   SNMP::CounterTable* _accept_for_remote_alias_tbl;
 
   const int _max_sproutlet_depth;
 
+  SNMP::EventAccumulatorTable* _bytes_cloned_tbl;
+
+  const bool _stateless_in_dialog;
+
+  const bool _collapse_record_routes;
+
   friend class UASTsx;
   friend class SproutletWrapper;
 };
 
 
-class SproutletWrapper : public SproutletTsxHelper
+class SproutletWrapper : public SproutletTsxHelper, public TsxArenaAllocated
 {
 public:
   static constexpr const char* EXTERNAL_NETWORK_FUNCTION = "EXTERNAL";
@@ -536,6 +667,7 @@ public:
   /// the following.
   void add_to_dialog(const std::string& dialog_id="");
   pjsip_msg* original_request();
+  const pjsip_msg* original_request_view() const;
   void copy_original_transport(pjsip_msg*);
   const char* msg_info(pjsip_msg*);
   const pjsip_route_hdr* route_hdr() const;
@@ -558,6 +690,7 @@ public:
   void cancel_timer(TimerID id);
   bool timer_running(TimerID id);
   SAS::TrailId trail() const;
+  Resumer defer_processing();
   bool is_uri_reflexive(const pjsip_uri*) const;
   pjsip_sip_uri* get_reflexive_uri(pj_pool_t*) const;
   pjsip_sip_uri* get_routing_uri(const pjsip_msg* req) const;
@@ -586,6 +719,8 @@ private:
 
   void process_actions(bool complete_after_actions);
   void aggregate_response(pjsip_tx_data* rsp);
+  void set_best_response(pjsip_tx_data* rsp);
+  bool holding_global_failure() const;
   int count_pending_responses();
   int count_pending_actionable_responses();
   void tx_request(SproutletProxy::SendRequest req, int fork_id);
@@ -604,6 +739,10 @@ private:
 
   SproutletTsx* _sproutlet_tsx;
 
+  /// The account that the CPU time of the Sproutlet's callbacks is recorded
+  /// against, or NULL.
+  SproutletCpuAccount* _cpu_account;
+
   std::string _service_name;
   std::string _service_host;
 
@@ -632,13 +771,17 @@ private:
   // The depth of this wrapper in the transaction tree.  Used to detect loops.
   int _depth;
 
-  typedef std::unordered_map<const pjsip_msg*, pjsip_tx_data*> Packets;
+  // The messages, requests and responses a Sproutlet has in flight.  There
+  // are usually only a few, so these are held without allocating.  Requests
+  // are keyed on fork ID, and as fork IDs are allocated in increasing order
+  // they are sent in the order of their fork IDs.
+  typedef SmallMap<const pjsip_msg*, pjsip_tx_data*, 8> Packets;
   Packets _packets;
 
-  typedef std::map<int, SproutletProxy::SendRequest> Requests;
+  typedef SmallMap<int, SproutletProxy::SendRequest, 4> Requests;
   Requests _send_requests;
 
-  typedef std::list<pjsip_tx_data*> Responses;
+  typedef SmallVector<pjsip_tx_data*, 4> Responses;
   Responses _send_responses;
 
   int _pending_sends;
@@ -654,6 +797,10 @@ private:
   // SproutletWrapper must not be destroyed.
   int _process_actions_entered;
 
+  // The number of defer_processing calls whose processing hasn't run yet.
+  // If it is non-zero, the SproutletWrapper must not be destroyed.
+  int _pending_deferrals;
+
   /// Vector keeping track of the status of each fork.  The state field can
   /// only ever take a subset of the values defined by PJSIP - NULL, CALLING,
   /// PROCEEDING and TERMINATED.
@@ -662,6 +809,7 @@ private:
     ForkState state;
     pjsip_tx_data* req;
     bool pending_cancel;
+    bool cancelled;
     int cancel_st_code;
     std::string cancel_reason;
     bool pending_response;
@@ -112,6 +112,7 @@ namespace SASEvent
   const int REGISTER_NO_CONTACTS = SPROUT_BASE + 0x000088;
   const int REGISTER_FAILED_5636 = SPROUT_BASE + 0x000089;
   const int REGISTER_EMERGENCY = SPROUT_BASE + 0x00008A;
+  const int REGISTER_STORM_REJECTED = SPROUT_BASE + 0x00008B;
 
   const int IMPISTORE_AV_SET_SUCCESS = SPROUT_BASE + 0x000090;
   const int IMPISTORE_AV_GET_SUCCESS = SPROUT_BASE + 0x000091;
@@ -146,7 +147,11 @@ namespace SASEvent
   const int REJECT_AS_NO_MATCHING_IFC = SPROUT_BASE + 0x0000C8;
   const int STARTING_FALLBACK_IFCS_LOOKUP = SPROUT_BASE + 0x0000C9;
   const int FIRST_FALLBACK_IFC = SPROUT_BASE + 0x0000CA;
+  const int IFC_LOADED = SPROUT_BASE + 0x0000CB;
   const int IFC_UNUSUAL = SPROUT_BASE + 0x0000CC;
+  const int ENUM_CACHE_HIT = SPROUT_BASE + 0x0000CD;
+  const int HSS_CACHE_HIT = SPROUT_BASE + 0x0000CE;
+  const int HSS_REQUEST_COALESCED = SPROUT_BASE + 0x0000CF;
 
   const int TRANSPORT_FAILURE = SPROUT_BASE + 0x0000D0;
   const int TIMEOUT_FAILURE = SPROUT_BASE + 0x0000D1;
@@ -239,8 +244,11 @@ namespace SASEvent
   const int AS_REGISTER_START = SPROUT_BASE + 0x0190;
   const int AS_REGISTER_FAILED = SPROUT_BASE + 0x0191;
   const int AS_DEREGISTER_FAILED = SPROUT_BASE + 0x0192;
+  const int AS_REGISTER_SUPPRESSED = SPROUT_BASE + 0x0193;
 
   const int REGISTRATION_EXPIRED = SPROUT_BASE + 0x01A0;
+
+  const int AOR_CACHE_HIT = SPROUT_BASE + 0x01B0;
 } //namespace SASEvent
 
 #endif
@@ -18,15 +18,20 @@ extern "C" {
 }
 
 #include <string>
+#include <vector>
 #include <unordered_set>
 
 #include "sas.h"
+#include "snmp_counter_table.h"
 #include "quiescing_manager.h"
 #include "load_monitor.h"
 #include "sipresolver.h"
+#include "recycling_pool_factory.h"
 
 /* Pre-declariations */
 class LastValueCache;
+class DependencyMonitor;
+class SendQueueMonitor;
 
 /* Options */
 struct stack_data_struct
@@ -34,9 +39,12 @@ struct stack_data_struct
   SIPResolver*         sipresolver;
 
   pj_caching_pool      cp;
+  RecyclingPoolFactory* endpt_pool_factory;
+  HugePageAllocator*   endpt_pool_allocator;
   pj_pool_t           *pool;
   pjsip_endpoint      *endpt;
   pj_thread_t         *pjsip_transport_thread;
+  std::vector<pj_thread_t*> pjsip_transport_threads;
   int                  pcscf_untrusted_port;
   pjsip_tpfactory     *pcscf_untrusted_tcp_factory;
   int                  pcscf_trusted_port;
@@ -63,6 +71,14 @@ struct stack_data_struct
   std::vector<pj_str_t> name;
   LastValueCache *     stats_aggregator;
 
+  // Overload control for each downstream dependency, or NULL if it is
+  // disabled.
+  DependencyMonitor*   dependency_monitor;
+
+  // Tracks the data queued to each SIP connection, or NULL if the amount
+  // queued isn't limited.
+  SendQueueMonitor*    send_queue_monitor;
+
   bool record_route_on_every_hop;
   bool record_route_on_initiation_of_originating;
   bool record_route_on_initiation_of_terminating;
@@ -74,24 +90,41 @@ struct stack_data_struct
   int sip_tcp_connect_timeout;
   int sip_tcp_send_timeout;
   bool enable_orig_sip_to_tel_coerce;
+
+  // The most datagrams read per call by the batched UDP transport, or 0 to
+  // use PJSIP's UDP transport.
+  int udp_batch_size;
+
+  // The number of sockets (each with its own receive thread) the batched UDP
+  // transport has for each port.
+  int udp_rx_sockets;
+
+  // Whether the IMS headers are only parsed when they're looked up.
+  bool lazy_header_parsing;
 };
 
 extern struct stack_data_struct stack_data;
 
+/// The index of the PJSIP transport thread this is, or -1 on any other thread.
+/// Each transport thread sets this for itself before it starts polling, so
+/// (unlike stack_data.pjsip_transport_threads, which is only filled in once
+/// pj_thread_create returns) it is never read before it's set.
+extern __thread int transport_thread_index;
+
 inline bool is_pjsip_transport_thread()
 {
 #ifdef UNIT_TEST
   // This check doesn't make sense in UT, where we use a different threading model
   return true;
 #else
-  return (pj_thread_this() == stack_data.pjsip_transport_thread);
+  return (transport_thread_index >= 0);
 #endif
 }
 
 #define CHECK_PJ_TRANSPORT_THREAD() \
   if (!is_pjsip_transport_thread()) \
   { \
-    TRC_ERROR("Function expected to be called on PJSIP transport thread (%s) has been called on different thread (%s)", pj_thread_get_name(stack_data.pjsip_transport_thread), pj_thread_get_name(pj_thread_this())); \
+    TRC_ERROR("Function expected to be called on a PJSIP transport thread has been called on different thread (%s)", pj_thread_get_name(pj_thread_this())); \
   };
 
 inline void set_trail(pjsip_rx_data* rdata, SAS::TrailId trail)
@@ -153,12 +186,27 @@ extern pj_status_t init_stack(int pcscf_trusted_port,
                               QuiescingManager *quiescing_mgr,
                               const std::string& cdf_domain,
                               std::vector<std::string> sproutlet_uris,
-                              bool enable_orig_sip_to_tel_coerce);
-extern pj_status_t start_pjsip_thread();
-extern pj_status_t stop_pjsip_thread();
+                              bool enable_orig_sip_to_tel_coerce,
+                              int tdata_pool_cache_size,
+                              int udp_batch_size,
+                              bool lazy_header_parsing,
+                              int quiesce_drain_rate = 0,
+                              bool huge_page_pools = false,
+                              int udp_rx_sockets = 1);
+/// Starts the PJSIP transport threads.  Each thread polls the endpoint's
+/// ioqueue, which hands each ready socket to exactly one thread at a time, so
+/// listening sockets and accepted connections are spread across the threads.
+///
+/// @param num_pjsip_threads    - The number of transport threads to start.
+/// @param rx_count_tbls        - Optional per-thread counters of received
+///                               messages (either empty, or one per thread).
+extern pj_status_t start_pjsip_threads(int num_pjsip_threads,
+                                       std::vector<SNMP::CounterTable*> rx_count_tbls);
+extern pj_status_t stop_pjsip_threads();
 extern void stop_stack();
 extern void destroy_stack();
-extern pj_status_t init_pjsip();
+extern pj_status_t init_pjsip(int tdata_pool_cache_size=RecyclingPoolFactory::DEFAULT_CACHE_SIZE,
+                              bool huge_page_pools=false);
 extern void term_pjsip();
 
 extern const std::string* known_statnames;
@@ -0,0 +1,147 @@
+/**
+ * @file stage_latency.h Per-stage latency tracing of SIP processing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STAGE_LATENCY_H__
+#define STAGE_LATENCY_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// Log-linear histogram of latencies in microseconds, in the style of an HDR
+/// histogram.  Each power of two is split into 16 buckets, so values are
+/// recorded to within about 6%, up to about 71 minutes.
+///
+/// Recording a value takes a few relaxed atomic operations and no locks, so
+/// the histogram can be shared by all threads.
+class StageHistogram
+{
+public:
+  StageHistogram();
+
+  /// Records a latency.
+  void record(uint64_t us);
+
+  /// Summary of the recorded latencies.
+  struct Summary
+  {
+    uint64_t count;
+    uint64_t mean_us;
+    uint64_t p50_us;
+    uint64_t p90_us;
+    uint64_t p99_us;
+    uint64_t p999_us;
+    uint64_t max_us;
+  };
+
+  /// Returns a summary of the latencies recorded so far.  This can run
+  /// concurrently with record(), in which case it may miss recent values.
+  Summary summary() const;
+
+  /// Bucket layout, exposed for testing.
+  static const int SUB_BUCKET_BITS = 4;
+  static const int MAX_VALUE_BITS = 32;
+  static const int NUM_BUCKETS =
+    (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+  static int bucket(uint64_t us);
+  static uint64_t bucket_upper_bound(int bucket);
+
+private:
+  std::atomic<uint64_t> _buckets[NUM_BUCKETS];
+  std::atomic<uint64_t> _sum_us;
+  std::atomic<uint64_t> _max_us;
+};
+
+/// Always-on tracing of how long each stage of SIP processing takes.
+///
+/// Stages are identified by name, and each has a StageHistogram.  The fixed
+/// stages are:
+/// -  "transport_receive" - from PJSIP reading the message off the socket to
+///    it being queued for a worker thread.
+/// -  "dispatcher_queue" - from being queued to a worker thread picking it up.
+/// -  "worker_cpu" - the worker thread's processing, excluding blocking I/O.
+/// -  "send" - from a message being queued to every message sent while
+///    processing it.
+/// and the dynamic stages are:
+/// -  "sproutlet:<name>" - each Sproutlet's on_rx_initial_request.
+/// -  "homestead" - every Homestead request.
+/// -  "fork_branch_setup" - from starting to forward a request to each of its
+///    branches being sent.
+/// -  "io:<reason>" - each type of blocking I/O on a worker thread (for
+///    example memcached, DNS or HTTP).
+namespace StageLatency
+{
+  typedef uint64_t Ticks;
+
+  /// Calibrates the tick rate.  Call once at start of day.  Until then, ticks
+  /// are assumed to be nanoseconds.
+  void init();
+
+  /// Reads the clock.  On x86 this reads the TSC, which is far cheaper than
+  /// asking the kernel for the time.
+  inline Ticks now()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (Ticks)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+  }
+
+  /// Converts a number of ticks to microseconds.
+  uint64_t ticks_to_us(Ticks ticks);
+
+  /// Converts a number of ticks to nanoseconds.
+  uint64_t ticks_to_ns(Ticks ticks);
+
+  /// Returns the histogram for the named stage, creating it if needed.  This
+  /// takes a lock, so callers on hot paths should look the stage up once and
+  /// keep the pointer, which stays valid for the life of the process.
+  StageHistogram* stage(const std::string& name);
+
+  /// Records the time since start against a stage.  Does nothing if stage is
+  /// NULL.
+  inline void record_since(StageHistogram* stage, Ticks start)
+  {
+    if (stage != NULL)
+    {
+      Ticks end = now();
+      stage->record((end > start) ? ticks_to_us(end - start) : 0);
+    }
+  }
+
+  /// Sets the time at which the event the calling thread is processing was
+  /// queued, or 0 when it finishes.  Used to time the "send" stage.
+  void set_event_start(Ticks start);
+
+  /// Returns the time set by set_event_start on this thread, or 0.
+  Ticks event_start();
+
+  /// Summary of one stage.
+  struct StageSummary
+  {
+    std::string name;
+    StageHistogram::Summary summary;
+  };
+
+  /// Returns a summary of every stage, sorted by name.
+  std::vector<StageSummary> summaries();
+}
+
+#endif
@@ -0,0 +1,68 @@
+/**
+ * @file startup_stages.h Running Sprout's startup stages in parallel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STARTUP_STAGES_H__
+#define STARTUP_STAGES_H__
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/// A set of named initialization stages, each of which may depend on some of
+/// the others.  Running them runs each stage on its own thread as soon as the
+/// stages it depends on have finished, so stages that don't depend on each
+/// other (for example, loading configuration files and connecting to
+/// different stores) overlap.  The time each stage takes is logged.
+///
+/// Stages must only depend on stages added before them, so there can't be
+/// any cycles.  They mustn't share state that isn't thread-safe unless one
+/// depends on the other.
+class StartupStages
+{
+public:
+  /// A stage returns false if it failed, in which case the stages that
+  /// depend on it aren't run.
+  typedef std::function<bool()> Stage;
+
+  StartupStages();
+
+  /// Adds a stage.  Logs an error and fails the whole run if any of the
+  /// stages it depends on haven't been added.
+  void add(const std::string& name,
+           Stage stage,
+           const std::vector<std::string>& depends_on = {});
+
+  /// Runs all the stages, and returns once they have all finished or been
+  /// skipped.  Returns false if any of them failed.
+  bool run();
+
+  /// How long each stage that ran took, in milliseconds.
+  const std::map<std::string, long>& durations_ms() const
+  {
+    return _durations_ms;
+  }
+
+private:
+  struct Entry
+  {
+    std::string name;
+    Stage stage;
+    std::vector<int> depends_on;
+  };
+
+  std::vector<Entry> _stages;
+  std::map<std::string, int> _index;
+  std::map<std::string, long> _durations_ms;
+  bool _valid;
+};
+
+#endif
@@ -13,6 +13,7 @@
 #define SUBSCRIBER_DATA_UTILS_H__
 
 #include <string>
+#include <vector>
 
 #include "aor.h"
 #include "sas.h"
@@ -88,6 +89,18 @@ struct ClassifiedSubscription
   std::string _reasons; // Stores reasons for requiring a notify (for logging)
 };
 
+/// The bindings and subscriptions that one write to an AoR adds, updates or
+/// removes.  This is recorded as the write's patch is built, so the analytics
+/// logs for the write only look at what it changed, rather than comparing the
+/// whole of the original and updated AoRs.
+struct AoRChanges
+{
+  std::vector<std::string> updated_binding_ids;
+  std::vector<std::string> removed_binding_ids;
+  std::vector<std::string> updated_subscription_ids;
+  std::vector<std::string> removed_subscription_ids;
+};
+
 /// Iterate over all original and current bindings and classify them as removed
 /// ("EXPIRED"), created ("CREATED"), refreshed ("REFRESHED"), shortened
 /// ("SHORTENED") or unchanged ("REGISTERED").
@@ -19,6 +19,9 @@ extern "C" {
 #include <string>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -33,6 +36,7 @@ extern "C" {
 #include "notify_sender.h"
 #include "registration_sender.h"
 #include "subscriber_data_utils.h"
+#include "sharded_lru_cache.h"
 
 /// @class SubscriberManager
 ///
@@ -56,7 +60,11 @@ public:
                     HSSConnection* hss_connection,
                     AnalyticsLogger* analytics_logger,
                     NotifySender* notify_sender,
-                    RegistrationSender* registration_sender);
+                    RegistrationSender* registration_sender,
+                    int aor_cache_ttl = 0,
+                    size_t aor_cache_size = 0,
+                    const ShardedLRUCacheStatsTables& aor_cache_stats_tbls =
+                                                 ShardedLRUCacheStatsTables());
 
   /// Destructor.
   virtual ~SubscriberManager();
@@ -176,6 +184,32 @@ public:
                                 Bindings& bindings,
                                 SAS::TrailId trail);
 
+  /// Gets all bindings stored for each of a number of AoR IDs, as
+  /// get_bindings.  The AoRs are read in parallel.
+  ///
+  /// @param[in]  aor_ids       The AoR IDs to lookup in the store
+  /// @param[out] bindings      The bindings for each AoR, in the same order
+  ///                           as aor_ids. It is the responsibility of the
+  ///                           clients to free these bindings
+  /// @param[out] rcs           The result of the lookup for each AoR, in the
+  ///                           same order as aor_ids
+  /// @param[in]  trail         The SAS trail ID
+  virtual void get_bindings_multi(const std::vector<std::string>& aor_ids,
+                                  std::vector<Bindings>& bindings,
+                                  std::vector<HTTPCode>& rcs,
+                                  SAS::TrailId trail);
+
+  /// Deregisters each of a number of subscribers completely, as
+  /// deregister_subscriber.  The subscribers are deregistered in parallel.
+  ///
+  /// @param[in]  public_ids    The public IDs to deregister
+  /// @param[in]  trail         The SAS trail ID
+  ///
+  /// @return HTTP_OK if every subscriber was deregistered, otherwise the
+  ///         result for one of the subscribers that failed
+  virtual HTTPCode deregister_subscribers(const std::vector<std::string>& public_ids,
+                                          SAS::TrailId trail);
+
   /// Gets all subscriptions stored for a given AoR ID. If there are any expired
   /// subscriptions, these are not returned.
   ///
@@ -228,6 +262,21 @@ public:
                                           const AssociatedURIs& associated_uris,
                                           SAS::TrailId trail);
 
+  /// Update a subscriber for a profile pushed by the HSS.  The push is
+  /// compared with the cached registration data, so that only the IMPUs it
+  /// changes have their cached data invalidated or their iFCs parsed again,
+  /// and the AoR is only rewritten (and NOTIFYs sent) if the associated URIs
+  /// have changed.
+  ///
+  /// @param[in]  aor_id        The AoR ID to lookup in the store, which must
+  ///                           be a default public ID (as for
+  ///                           update_associated_uris)
+  /// @param[in]  profile       The pushed profile
+  /// @param[in]  trail         The SAS trail ID
+  virtual HTTPCode update_service_profile(const std::string& aor_id,
+                                          const PushedProfile& profile,
+                                          SAS::TrailId trail);
+
   /// Handle a timer pop.
   ///
   /// @param[in]  aor_id        The AoR ID to handle a timer pop for
@@ -235,6 +284,14 @@ public:
   virtual void handle_timer_pop(const std::string& aor_id,
                                 SAS::TrailId trail);
 
+  /// Handle a batch of timer pops.  An AoR that appears more than once (or
+  /// that is already waiting to be handled) is only handled once.
+  ///
+  /// @param[in]  aor_ids       The AoR IDs to handle timer pops for
+  /// @param[in]  trail         The SAS trail ID
+  virtual void handle_timer_pops(const std::vector<std::string>& aor_ids,
+                                 SAS::TrailId trail);
+
   /// Register a subscriber with its application servers
   ///
   /// @param[in]  received_register_message
@@ -266,6 +323,33 @@ private:
   NotifySender* _notify_sender;
   RegistrationSender* _registration_sender;
 
+  // The AoR cache, indexed by AoR ID, or NULL if caching is disabled.  See
+  // subscriber_manager.cpp.
+  int _aor_cache_ttl;
+  ShardedLRUCache<std::string, std::shared_ptr<const AoR>>* _aor_cache;
+
+  // The number of shards in the AoR cache.
+  static const int NUM_CACHE_SHARDS = 16;
+
+  // Timer pops waiting to be handled, with the trail each arrived on, and the
+  // number of worker thread jobs started to handle them.  See
+  // handle_timer_pops.
+  std::mutex _timer_pop_lock;
+  std::map<std::string, SAS::TrailId> _pending_timer_pops;
+  size_t _timer_pop_jobs;
+
+  // The most timer pops each worker thread job handles.
+  static const size_t TIMER_POP_BATCH_SIZE = 64;
+
+  void handle_pending_timer_pops();
+
+  bool find_cached_aor(const std::string& aor_id,
+                       std::shared_ptr<const AoR>& aor,
+                       SAS::TrailId trail);
+  void add_cached_aor(const std::string& aor_id,
+                      const std::shared_ptr<const AoR>& aor);
+  void invalidate_cached_aor(const std::string& aor_id);
+
   /// Internal functions that methods on the interface call.
   HTTPCode register_subscriber_internal(const std::string& aor_id,
                                         const std::string& server_name,
@@ -291,6 +375,9 @@ private:
                                 SAS::TrailId trail);
   void handle_timer_pop_internal(const std::string& aor_id,
                                  SAS::TrailId trail);
+  HTTPCode update_aor_associated_uris(const std::string& aor_id,
+                                      const AssociatedURIs& associated_uris,
+                                      SAS::TrailId trail);
 
   /// Helper function to get the default public ID from the HSS.
   HTTPCode get_cached_default_id(const std::string& public_id,
@@ -305,7 +392,21 @@ private:
                                                    const Bindings& bindings_to_update,
                                                    const std::vector<std::string> binding_ids_to_remove);
 
-  /// Sends NOTIFYs by looking at the original and updated AoRs.
+  /// Whether a reregister only refreshes existing bindings - it doesn't
+  /// remove any bindings, or change any binding's contact URI.
+  bool is_refresh(const AoR& orig_aor,
+                  const Bindings& bindings_to_update,
+                  const std::vector<std::string>& binding_ids_to_remove);
+
+  /// Whether a SUBSCRIBE only refreshes existing subscriptions - it doesn't
+  /// add or remove any subscriptions.
+  bool is_subscription_refresh(const AoR& orig_aor,
+                               const Subscriptions& subscriptions_to_update,
+                               const std::vector<std::string>& subscription_ids_to_remove);
+
+  /// Sends NOTIFYs by looking at the original and updated AoRs.  The
+  /// NotifySender may update the subscriptions in the AoRs as it sends, so
+  /// callers must not use them afterwards.
   void send_notifys(const std::string& aor_id,
                     AoR* orig_aor,
                     AoR* updated_aor,
@@ -324,7 +425,7 @@ private:
   void log_removed_bindings(const AoR& orig_aor,
                             const std::vector<std::string>& binding_ids);
   void log_updated_bindings(const AoR& updated_aor,
-                            const Bindings& binding_pairs,
+                            const SubscriberDataUtils::AoRChanges& changes,
                             int now);
   void log_subscriptions(std::string default_impu,
                          const AoR& orig_aor,
@@ -332,24 +433,36 @@ private:
                          const std::vector<std::string>& subscription_ids,
                          int now);
 
-  /// Methods to build patch objects.
+  /// Methods to build patch objects.  Those that update or remove bindings or
+  /// subscriptions also record what the patch changes.
   void build_patch(PatchObject& po,
+                   SubscriberDataUtils::AoRChanges& changes,
                    const Bindings& update_bindings,
                    const std::vector<std::string>& remove_bindings,
                    const std::vector<std::string>& remove_subscriptions,
                    const AssociatedURIs& associated_uris);
   void build_patch(PatchObject& po,
+                   SubscriberDataUtils::AoRChanges& changes,
                    const Bindings& update_bindings,
                    const AssociatedURIs& associated_uris);
   void build_patch(PatchObject& po,
+                   SubscriberDataUtils::AoRChanges& changes,
+                   const Bindings& update_bindings);
+  void build_patch(PatchObject& po,
+                   SubscriberDataUtils::AoRChanges& changes,
                    const Subscriptions& update_subscriptions,
                    const std::vector<std::string>& remove_subscriptions,
                    const AssociatedURIs& associated_uris);
   void build_patch(PatchObject& po,
+                   SubscriberDataUtils::AoRChanges& changes,
+                   const Subscriptions& update_subscriptions);
+  void build_patch(PatchObject& po,
+                   SubscriberDataUtils::AoRChanges& changes,
                    const std::vector<std::string>& remove_bindings,
                    const std::vector<std::string>& remove_subscriptions,
                    const AssociatedURIs& associated_uris);
   void build_patch(PatchObject& po,
+                   SubscriberDataUtils::AoRChanges& changes,
                    const std::vector<std::string>& remove_bindings,
                    const std::vector<std::string>& remove_subscriptions);
   void build_patch(PatchObject& po,
@@ -25,8 +25,17 @@ extern "C" {
 #include "snmp_success_fail_count_by_priority_and_scope_table.h"
 #include "exception_handler.h"
 #include "snmp_counter_by_scope_table.h"
+#include "snmp_counter_table.h"
+#include "snmp_scalar.h"
 #include "sip_event_priority.h"
 #include "eventq.h"
+#include "timer_wheel.h"
+#include "stage_latency.h"
+
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <vector>
 
 pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    SNMP::EventAccumulatorByScopeTable* latency_tbl_arg,
@@ -36,7 +45,16 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    LoadMonitor* load_monitor_arg,
                                    RPHService* rph_service_arg,
                                    ExceptionHandler* exception_handler_arg,
-                                   unsigned long request_on_queue_timeout);
+                                   unsigned long request_on_queue_timeout,
+                                   bool worker_affinity_arg = false,
+                                   SNMP::CounterTable* worker_steals_tbl_arg = NULL,
+                                   int max_worker_threads_arg = 0,
+                                   SNMP::U32Scalar* worker_threads_scalar_arg = NULL,
+                                   SNMP::U32Scalar* blocked_workers_scalar_arg = NULL,
+                                   int reserved_worker_threads_arg = 0,
+                                   const std::vector<int>& worker_cpus_arg = {},
+                                   unsigned long request_deadline_ms_arg = 0,
+                                   bool defer_load_reports_arg = false);
 
 void unregister_thread_dispatcher(void);
 
@@ -66,10 +84,17 @@ struct SipEvent
   // message has been on the queue
   Utils::StopWatch stop_watch;
 
+  // When the event was queued, for per-stage latency tracing.
+  StageLatency::Ticks queued_ticks;
+
   // The event data itself
   SipEventData event_data;
 
-  SipEvent() : type(MESSAGE), priority(SIPEventPriorityLevel::NORMAL_PRIORITY) {}
+  SipEvent() :
+    type(MESSAGE),
+    priority(SIPEventPriorityLevel::NORMAL_PRIORITY),
+    queued_ticks(0)
+  {}
 
   // Compares two SipEvents. Returns true if rhs is 'larger' than lhs, where
   // 'larger' SipEvents are those that should be processed earlier.
@@ -105,7 +130,29 @@ struct SipEvent
 // element is added to the queue or the queue is terminated.
 // Returns true if an element was processed, and false if the queue was
 // terminated.
-bool process_queue_element();
+//
+// If worker affinity is enabled, worker_index identifies the worker whose
+// queue the element is taken from (or which steals from another worker).  The
+// worker's due timers are popped first, and it only waits for an element
+// until its next timer is due (returning true if none arrives).
+bool process_queue_element(int worker_index = 0);
+
+// The queue depth at which requests that have already been queued for longer
+// than the request_on_queue_timeout are swept off the queue in bulk when a new
+// event is pushed, rather than each being dequeued and rejected in turn.  If
+// worker affinity is enabled this is the depth of each worker's queue.
+const int EXPIRY_SWEEP_QUEUE_DEPTH = 32;
+
+// Schedules a timer on the calling worker thread's timer wheel, so that the
+// timer's callback is called on this worker once the duration has passed.
+// Returns false (without scheduling the timer) if worker affinity isn't
+// enabled or the caller isn't a worker thread, in which case the caller should
+// use a PJSIP timer instead.
+bool schedule_worker_timer(TimerWheel::Entry* entry, int duration_ms);
+
+// Cancels a timer scheduled by schedule_worker_timer.  This may be called on
+// any thread.  Returns false if the timer wasn't scheduled.
+bool cancel_worker_timer(TimerWheel::Entry* entry);
 
 // Add a Callback object to the queue, to be run on a worker thread.
 void add_callback_to_queue(PJUtils::Callback*);
@@ -149,4 +196,136 @@ public:
                       std::function<bool(SipEvent, SipEvent)> > _queue;
 };
 
+// Implements eventq::Backend as one FIFO per SIPEventPriorityLevel, drained in
+// strict priority order.
+//
+// Events are pushed onto the queue in the order in which they arrive, so at a
+// given priority level FIFO order is the same as oldest-first order.  This
+// gives the same ordering as PriorityEventQueueBackend without any heap
+// operations or stopwatch reads while the queue lock is held - push and pop
+// are both O(1) (amortized over the number of priority levels).
+class MultiQueueEventQueueBackend : public eventq<SipEvent>::Backend
+{
+public:
+  static const int NUM_PRIORITY_LEVELS =
+    (int)SIPEventPriorityLevel::HIGH_PRIORITY_15 + 1;
+
+  MultiQueueEventQueueBackend() :
+    _size(0),
+    _highest(0),
+    _sweep_depth(0),
+    _sweep_max_age_us(0)
+  {}
+  virtual ~MultiQueueEventQueueBackend() {}
+
+  virtual const SipEvent& front()
+  {
+    return _queues[_highest].front();
+  }
+
+  virtual bool empty()
+  {
+    return (_size == 0);
+  }
+
+  virtual int size()
+  {
+    return _size;
+  }
+
+  virtual void push(const SipEvent& value)
+  {
+    int level = priority_to_level(value.priority);
+    _queues[level].push_back(value);
+    ++_size;
+
+    if (level > _highest)
+    {
+      _highest = level;
+    }
+
+    if ((_sweep_depth > 0) && (_size >= _sweep_depth))
+    {
+      std::lock_guard<std::mutex> guard(_expired_lock);
+      remove_expired(_sweep_max_age_us, _expired);
+    }
+  }
+
+  virtual void pop()
+  {
+    _queues[_highest].pop_front();
+    --_size;
+
+    // Move down to the next non-empty level (if there is one).
+    while ((_highest > 0) && (_queues[_highest].empty()))
+    {
+      --_highest;
+    }
+  }
+
+  // Removes requests at or below normal priority that have been queued for
+  // longer than max_age_us, and appends them to expired.  Callbacks and
+  // responses are never removed.  Returns the number of events removed.  This
+  // must be called with the lock that protects the queue held.
+  //
+  // Each level is in age order, so this only reads the stop watches of the
+  // expired events and of the first event that hasn't expired.
+  int remove_expired(unsigned long max_age_us, std::vector<SipEvent>& expired);
+
+  // Makes each push that leaves the queue at least depth events deep remove
+  // the requests that have been queued for longer than max_age_us.  They are
+  // held until collected by take_expired.  This is for use when the queue is
+  // wrapped in an eventq, which holds its lock over push.
+  void set_expiry_sweep(int depth, unsigned long max_age_us)
+  {
+    _sweep_depth = depth;
+    _sweep_max_age_us = max_age_us;
+  }
+
+  // Moves the requests removed by pushes onto expired.  This may be called
+  // without holding the lock that protects the queue.
+  void take_expired(std::vector<SipEvent>& expired)
+  {
+    std::lock_guard<std::mutex> guard(_expired_lock);
+    expired.insert(expired.end(), _expired.begin(), _expired.end());
+    _expired.clear();
+  }
+
+private:
+  // Maps a priority onto an index into _queues.  Any out of range priority is
+  // treated as the nearest valid level.
+  static int priority_to_level(SIPEventPriorityLevel priority)
+  {
+    int level = (int)priority;
+
+    if (level < 0)
+    {
+      level = 0;
+    }
+    else if (level >= NUM_PRIORITY_LEVELS)
+    {
+      level = NUM_PRIORITY_LEVELS - 1;
+    }
+
+    return level;
+  }
+
+  std::deque<SipEvent> _queues[NUM_PRIORITY_LEVELS];
+
+  // The number of events across all the queues.
+  int _size;
+
+  // The highest priority level that may have events queued.  All levels above
+  // this are empty.
+  int _highest;
+
+  // Settings for sweeping expired requests on push.  Zero depth disables it.
+  int _sweep_depth;
+  unsigned long _sweep_max_age_us;
+
+  // Requests removed on push, waiting to be rejected.
+  std::mutex _expired_lock;
+  std::vector<SipEvent> _expired;
+};
+
 #endif
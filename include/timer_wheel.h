@@ -0,0 +1,113 @@
+/**
+ * @file timer_wheel.h Definition of TimerWheel - a hierarchical timer wheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TIMER_WHEEL_H__
+#define TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include <vector>
+
+/// Hierarchical timer wheel with a resolution of one millisecond.
+///
+/// There are four levels of 64 slots.  A timer is put straight into the slot
+/// for its expiry time on the lowest level that covers it, so scheduling and
+/// cancelling a timer take constant time.  The slots of the higher levels
+/// each cover a range of times, and as time reaches a slot its timers are
+/// moved down a level, until they reach the lowest level and pop.  Timers
+/// more than about 4.6 hours away are parked on the top level until they're
+/// near enough.
+///
+/// The wheel doesn't read the clock or take any locks - the owner passes the
+/// current time in, and must serialise calls.
+class TimerWheel
+{
+public:
+  /// A timer.  The entry is owned by the caller, and must stay valid until
+  /// it has popped or been cancelled.
+  struct Entry
+  {
+    /// The function called when the timer pops.
+    void (*cb)(Entry* entry);
+    void* user_data;
+
+    /// For use by the owner of the wheel the entry is scheduled on.
+    int owner;
+
+    // Internal state.
+    Entry* prev;
+    Entry* next;
+    uint64_t expiry_ms;
+    int level;
+    int slot;
+    bool scheduled;
+  };
+
+  /// Initialises a timer entry.
+  static void init_entry(Entry* entry, void (*cb)(Entry*), void* user_data);
+
+  /// Returns whether the entry is scheduled on a wheel.
+  static bool is_scheduled(const Entry* entry) { return entry->scheduled; }
+
+  /// Constructor.
+  /// @param now_ms - The current time, in milliseconds.
+  TimerWheel(uint64_t now_ms);
+
+  /// Schedules a timer, which must not already be scheduled, to pop after
+  /// the given duration.
+  void schedule(Entry* entry, uint64_t now_ms, uint64_t duration_ms);
+
+  /// Cancels a timer.  Returns false if it wasn't scheduled.
+  bool cancel(Entry* entry);
+
+  /// Moves the wheel on to the given time, appending the timers that have
+  /// popped to expired (in the order they should pop).  The timers'
+  /// callbacks aren't called, so the caller can call them having released
+  /// any lock protecting the wheel.
+  void advance(uint64_t now_ms, std::vector<Entry*>& expired);
+
+  /// Returns the earliest time at which the wheel might have timers to pop,
+  /// or UINT64_MAX if there are no timers.  This may be before the next timer
+  /// is due, when one needs moving down a level.
+  uint64_t next_event_ms() const;
+
+  /// Returns the number of scheduled timers.
+  size_t size() const { return _size; }
+
+private:
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const uint64_t SLOT_MASK = SLOTS - 1;
+
+  /// Timers further away than this are parked on the top level.
+  static const uint64_t MAX_DELTA = (1ull << (LEVELS * SLOT_BITS)) - 1;
+
+  /// Adds an entry to the slot for its expiry time.
+  void insert(Entry* entry);
+
+  /// Removes an entry from its slot.
+  void unlink(Entry* entry);
+
+  /// Moves the timers in a slot down a level.
+  void cascade(int level, int slot);
+
+  /// The current time.  Every slot for an earlier time has been processed.
+  uint64_t _now_ms;
+
+  Entry* _slots[LEVELS][SLOTS];
+
+  /// Which slots of each level have timers in them.
+  uint64_t _occupied[LEVELS];
+
+  size_t _size;
+};
+
+#endif
@@ -0,0 +1,107 @@
+/**
+ * @file tsx_arena.h Definition of TsxArena - a bump-pointer allocator for the
+ * objects that make up a transaction.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TSX_ARENA_H__
+#define TSX_ARENA_H__
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+/// Arena that the objects created to process a transaction (the Sproutlet
+/// transactions and their wrappers) are allocated from.
+///
+/// Allocations bump a pointer through blocks of memory, the first of which is
+/// part of the arena itself, and freeing an object does nothing but drop a
+/// reference to the arena.  All the memory is freed in one go once the owner
+/// has released the arena and every object allocated from it has been
+/// freed, so objects may safely outlive the transaction that created them.
+///
+/// Allocations must only be made by one thread at a time (for a transaction
+/// this is the thread holding the transaction's lock), but objects may be
+/// freed on any thread.
+class TsxArena
+{
+public:
+  /// Constructor.  The arena starts with a reference held by its owner.
+  TsxArena();
+
+  /// Releases the owner's reference.  The arena must not be allocated from
+  /// after this.
+  void release();
+
+  /// Allocates memory from the arena, adding a reference for it.
+  void* allocate(size_t size);
+
+  /// Drops the reference added by an allocation.
+  void deallocate() { drop_refs(1); }
+
+  /// Returns the number of bytes allocated from the arena.
+  size_t bytes_allocated() const { return _bytes_allocated; }
+
+  /// Returns the arena that objects created on this thread are allocated
+  /// from, or NULL.
+  static TsxArena* current();
+
+  /// Sets the current arena for this thread for the lifetime of the Scope.
+  class Scope
+  {
+  public:
+    Scope(TsxArena* arena);
+    ~Scope();
+
+  private:
+    TsxArena* _prev;
+  };
+
+  static const size_t BLOCK_SIZE = 4096;
+
+  /// Allocations at least this big get a block to themselves.
+  static const size_t MAX_SHARED_ALLOCATION = BLOCK_SIZE / 4;
+
+  /// All allocations are aligned to this.
+  static const size_t ALIGNMENT = 16;
+
+private:
+  /// The arena is deleted when its last reference is dropped.
+  ~TsxArena();
+
+  void drop_refs(long refs);
+
+  alignas(ALIGNMENT) char _first_block[BLOCK_SIZE];
+  std::vector<char*> _blocks;
+  char* _next;
+  char* _end;
+  size_t _bytes_allocated;
+
+  // The references to the arena are counted without an atomic operation for
+  // each allocation.  _refs starts at OWNER_REFS, allocations are counted in
+  // _allocations (which only the allocating thread touches), and release()
+  // adjusts _refs by the difference, so that it reaches zero once the owner
+  // has released the arena and every allocation has been freed.
+  static const long OWNER_REFS = 1L << 56;
+  long _allocations;
+  std::atomic<long> _refs;
+};
+
+/// Base class for objects that opt in to being allocated from the current
+/// transaction arena.  Objects created when there is no current arena are
+/// allocated from the heap as usual, and objects are deleted as usual
+/// whichever way they were allocated.
+class TsxArenaAllocated
+{
+public:
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
+};
+
+#endif
@@ -0,0 +1,57 @@
+/**
+ * @file tsx_index.h Sharded index of the proxies' PJSIP transactions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TSX_INDEX_H__
+#define TSX_INDEX_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <stddef.h>
+
+/// An index of the PJSIP transactions that the proxies (BasicProxy, and so
+/// the SproutletProxy, and Bono) are bound to, keyed on the transaction key.
+///
+/// PJSIP's transaction layer keeps every transaction in one hash table
+/// behind one mutex, which every lookup takes.  This index is split into
+/// shards by a hash of the key (which is mostly the Via branch), each with
+/// its own lock, so lookups for different transactions - correlating
+/// responses, ACKs and CANCELs to their transactions - don't contend.
+///
+/// A transaction is added when a proxy binds to it, and removed when the
+/// proxy unbinds, which it always does before the transaction is destroyed.
+/// Lookups for transactions that aren't in the index (those created by
+/// other modules) fall back to PJSIP's transaction layer.
+namespace TsxIndex
+{
+  static const int NUM_SHARDS = 64;
+
+  /// Adds a transaction, under its transaction key.  Adding a transaction
+  /// that's already in the index has no effect.
+  void add(pjsip_transaction* tsx);
+
+  /// Removes a transaction.  Removing a transaction that isn't in the index
+  /// has no effect.
+  void remove(pjsip_transaction* tsx);
+
+  /// Finds a transaction from a key built by pjsip_tsx_create_key.  As for
+  /// pjsip_tsx_layer_find_tsx, if lock is true then the transaction's group
+  /// lock is held on return.
+  ///
+  /// @return The transaction, or NULL if there's no transaction with the key.
+  pjsip_transaction* find(const pj_str_t* key, bool lock);
+
+  /// The number of transactions in the index.
+  size_t size();
+}
+
+#endif
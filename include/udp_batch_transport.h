@@ -0,0 +1,50 @@
+/**
+ * @file udp_batch_transport.h UDP transport that receives in batches.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef UDP_BATCH_TRANSPORT_H__
+#define UDP_BATCH_TRANSPORT_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+/// Creates and registers a UDP transport that is used in place of PJSIP's
+/// own.  Rather than reading one datagram per call on the PJSIP transport
+/// threads, it has a thread of its own that reads up to batch_size datagrams
+/// per recvmmsg call into a ring of preallocated rdata, and passes each to
+/// the transport manager.  Messages are sent directly with sendto.
+///
+/// With num_sockets greater than one, the transport has that many sockets
+/// sharing the port (with SO_REUSEPORT), each with its own receive thread,
+/// so that receiving and parsing are spread across threads.  The kernel
+/// keeps each source address on the same socket, so messages from one peer
+/// are still received in order.
+///
+/// The transport is destroyed (and its thread stopped) by the transport
+/// manager along with the rest of the transports.
+extern pj_status_t create_udp_batch_transport(pjsip_endpoint* endpt,
+                                              const pj_sockaddr* addr,
+                                              const pjsip_host_port* published_name,
+                                              unsigned batch_size,
+                                              unsigned num_sockets,
+                                              pjsip_transport** p_transport);
+
+/// If rdata was received by a batched UDP transport, takes the received
+/// packet and the message parsed from it from the transport, without copying
+/// them, and returns an rdata for them that the caller owns.  The caller
+/// frees this with pjsip_rx_data_free_cloned, as if it were a clone.
+///
+/// Returns NULL if rdata wasn't received by a batched UDP transport (or
+/// can't be taken), in which case the caller must clone it instead.  This
+/// must only be called while the transport manager is passing rdata up.
+extern pjsip_rx_data* udp_batch_take_rdata(pjsip_rx_data* rdata);
+
+#endif
@@ -44,6 +44,13 @@ namespace URIClassifier
 
   bool is_user_numeric(pj_str_t user);
 
+  /// Builds a hash index of home_domains and the node's local names
+  /// (stack_data.name), so that classify_uri doesn't have to search them.
+  /// Call this once they have been set up, and again if they change.  Until
+  /// it is called they are searched linearly.  Not thread-safe with respect
+  /// to classify_uri.
+  void index_hosts();
+
   extern bool enforce_user_phone;
   extern bool enforce_global;
   extern std::vector<pj_str_t*> home_domains;
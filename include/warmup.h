@@ -0,0 +1,88 @@
+/**
+ * @file warmup.h Warming up Sprout's caches before it takes traffic.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef WARMUP_H__
+#define WARMUP_H__
+
+#include <string>
+#include <vector>
+
+class SIPResolver;
+class HSSConnection;
+
+/// Fills the caches that would otherwise fill on live traffic after Sprout
+/// starts, so that the first calls after a restart or upgrade aren't slow
+/// enough to trip the load monitor's throttling.  This resolves the
+/// configured next hops (filling the DNS, NAPTR and SRV caches) and fetches
+/// the registration data of a list of hot IMPUs from Homestead (filling the
+/// registration data cache, and compiling their iFCs).
+///
+/// Sprout runs the warmup before it starts polling its SIP transports, so it
+/// doesn't process any SIP messages until the warmup is complete.
+class Warmup
+{
+public:
+  /// The maximum number of Homestead requests in flight at once, so that a
+  /// node starting up doesn't swamp Homestead.
+  static const int MAX_OUTSTANDING_FETCHES = 16;
+
+  /// Either of these may be NULL, in which case that part of the warmup is
+  /// skipped.
+  Warmup(SIPResolver* sip_resolver,
+         HSSConnection* hss_connection,
+         int addr_family);
+
+  /// The results of a warmup.
+  struct Result
+  {
+    int targets_resolved;
+    int targets_failed;
+    int impus_fetched;
+    int impus_failed;
+
+    /// Whether the warmup finished before the timeout.
+    bool complete;
+  };
+
+  /// Resolves each of the targets, and then fetches the registration data of
+  /// each of the IMPUs, giving up after timeout_ms.
+  ///
+  /// @param targets    - SIP URIs or host[:port] names of the next hops.
+  /// @param impus      - The IMPUs to fetch.
+  /// @param timeout_ms - How long the whole warmup can take.
+  Result run(const std::vector<std::string>& targets,
+             const std::vector<std::string>& impus,
+             int timeout_ms);
+
+  /// Reads IMPUs from a file, one per line.  Blank lines and lines starting
+  /// with # are ignored.  Returns false if the file can't be read.
+  static bool read_impus(const std::string& filename,
+                         std::vector<std::string>& impus);
+
+  /// A next hop target, split into the parts the SIP resolver needs.
+  struct Target
+  {
+    std::string host;
+    int port;
+    int transport;
+  };
+
+  /// Parses a target, which is either a SIP URI or a host name or IP address
+  /// with an optional port.  Returns false if it can't be parsed.
+  static bool parse_target(const std::string& target, Target& parsed);
+
+private:
+  SIPResolver* _sip_resolver;
+  HSSConnection* _hss_connection;
+  int _addr_family;
+};
+
+#endif
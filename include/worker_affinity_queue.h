@@ -0,0 +1,127 @@
+/**
+ * @file worker_affinity_queue.h Definition of WorkerAffinityQueue - a set of
+ * per-worker event queues with work stealing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef WORKER_AFFINITY_QUEUE_H__
+#define WORKER_AFFINITY_QUEUE_H__
+
+#include <pthread.h>
+#include <vector>
+
+#include "thread_dispatcher.h"
+#include "instrumented_mutex.h"
+
+/// Queue of SipEvents with one queue per worker thread.
+///
+/// Each event is pushed onto the queue of a particular "home" worker, and
+/// that worker processes the events on its own queue in priority order.  If a
+/// worker has nothing on its own queue it steals the next event from the
+/// worker with the deepest queue, so no worker sits idle while there is work
+/// queued.
+///
+/// All the queues are protected by a single lock, but each worker waits on its
+/// own condition variable.  This means that a push wakes up the home worker if
+/// it is idle, and only wakes another worker (to steal the event) if the home
+/// worker is busy.
+class WorkerAffinityQueue
+{
+public:
+  WorkerAffinityQueue(int num_workers);
+  ~WorkerAffinityQueue();
+
+  /// Sets the time (in milliseconds) after which the queue is considered
+  /// deadlocked if events are queued but none have been popped.  Zero (the
+  /// default) disables deadlock detection.
+  void set_deadlock_threshold(unsigned long threshold_ms);
+
+  /// Returns true if there are events on the queue but no worker has popped
+  /// one for longer than the deadlock threshold.
+  bool is_deadlocked();
+
+  /// Pushes an event onto the given worker's queue.  Returns the depth of that
+  /// worker's queue after the event has been added.
+  int push(int worker, const SipEvent& event);
+
+  /// Pops the next event for the given worker, blocking until an event is
+  /// available or the queue is terminated.  stolen is set to true if the
+  /// event was taken from another worker's queue.  Returns false if the queue
+  /// has been terminated.
+  bool pop(int worker, SipEvent& event, bool& stolen);
+
+  /// As above, but waits for at most timeout_ms milliseconds (or for ever if
+  /// timeout_ms is negative).  Returns false with timed_out set if no event
+  /// arrived in time.
+  bool pop(int worker,
+           SipEvent& event,
+           bool& stolen,
+           int timeout_ms,
+           bool& timed_out);
+
+  /// Makes each push that leaves a worker's queue at least depth events deep
+  /// remove the requests on that queue that have been queued for longer than
+  /// max_age_us.  They are held until collected by take_expired.  Zero depth
+  /// (the default) disables this.
+  void set_expiry_sweep(int depth, unsigned long max_age_us);
+
+  /// Moves the requests removed by pushes onto expired.
+  void take_expired(std::vector<SipEvent>& expired);
+
+  /// Returns the total number of events queued across all workers.
+  int size();
+
+  /// Returns the number of events on the given worker's queue.
+  int size(int worker);
+
+  /// Returns the number of workers that this queue serves.
+  int num_workers() const { return _num_workers; }
+
+  /// Terminates the queue, waking all the waiting workers, and returns any
+  /// events that were still queued.
+  void terminate(std::vector<SipEvent>& remaining);
+
+private:
+  // Returns the index of the worker with the deepest queue, or -1 if there
+  // are no events queued.  Must be called with _lock held.
+  int deepest_queue();
+
+  // Returns the current time in milliseconds from a monotonic clock.
+  static unsigned long now_ms();
+
+  int _num_workers;
+
+  // Protects all the fields below.
+  InstrumentedMutex _lock;
+
+  // One queue, condition variable and idle flag per worker.
+  std::vector<MultiQueueEventQueueBackend*> _queues;
+  std::vector<pthread_cond_t> _conds;
+  std::vector<bool> _idle;
+
+  // The total number of events queued.
+  int _size;
+
+  bool _terminated;
+
+  unsigned long _deadlock_threshold_ms;
+
+  // Settings for sweeping expired requests on push.
+  int _sweep_depth;
+  unsigned long _sweep_max_age_us;
+
+  // Requests removed on push, waiting to be rejected.
+  std::vector<SipEvent> _expired;
+
+  // The last time a worker popped an event (or the time that an event was
+  // pushed onto an empty queue).
+  unsigned long _last_service_ms;
+};
+
+#endif
@@ -0,0 +1,56 @@
+/**
+ * @file worker_pool_sizer.h Decides how many worker threads to run.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef WORKER_POOL_SIZER_H__
+#define WORKER_POOL_SIZER_H__
+
+/// Decides how many worker threads to run, from periodic samples of the depth
+/// of the queue and of how many workers are blocked on I/O.
+///
+/// Workers spend most of their time blocked on Homestead, memcached and so on,
+/// so the number of workers needed to keep the CPUs busy rises and falls with
+/// the latency of those services.  The pool grows when messages are queueing
+/// but fewer workers are runnable than there are CPUs (that is, the CPUs are
+/// idle because the workers are blocked), and shrinks back towards the
+/// minimum once the queue has been empty for a while.
+class WorkerPoolSizer
+{
+public:
+  /// Constructor.
+  /// @param min_workers - The number of workers to start with, and the fewest
+  ///                      that are ever run.
+  /// @param max_workers - The most workers that are ever run.
+  /// @param num_cpus    - The number of CPUs available to the workers.
+  WorkerPoolSizer(int min_workers, int max_workers, int num_cpus);
+
+  /// Returns the number of workers there should be, given a sample of the
+  /// current state of the pool.
+  /// @param workers     - The number of workers currently running.
+  /// @param blocked     - The number of those workers blocked on I/O.
+  /// @param queue_depth - The number of events queued for the workers.
+  int target(int workers, int blocked, int queue_depth);
+
+  int min_workers() const { return _min_workers; }
+  int max_workers() const { return _max_workers; }
+
+  /// The number of consecutive idle samples before the pool starts to shrink.
+  static const int SHRINK_DELAY_SAMPLES = 50;
+
+private:
+  const int _min_workers;
+  const int _max_workers;
+  const int _num_cpus;
+
+  // The number of consecutive samples for which the pool has been idle.
+  int _idle_samples;
+};
+
+#endif
@@ -0,0 +1,89 @@
+/**
+ * @file worker_watchdog.h Detection of worker threads that are stuck.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef WORKER_WATCHDOG_H__
+#define WORKER_WATCHDOG_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// Watchdog for worker threads that are stuck on one message.
+///
+/// Each worker thread publishes, in a slot of its own, when it started on
+/// its current message or callback, what it is doing (the Sproutlet whose
+/// callback it is running) and what it is blocked on (the dependency named
+/// by CW_IO_STARTS).  Publishing is a few relaxed stores.  A watchdog thread
+/// checks the slots periodically, and flags any thread that has been busy
+/// for longer than the threshold - it logs what the thread is doing, counts
+/// it, and (optionally) logs its stack, which it captures by signalling the
+/// thread.  When a dependency is slow, this shows which one is holding the
+/// workers, rather than just a drop in throughput.
+namespace WorkerWatchdog
+{
+  /// The most threads that can be watched at once.
+  static const int MAX_THREADS = 512;
+
+  /// The longest thread name, activity or dependency kept, including the
+  /// terminating null.
+  static const int TAG_LENGTH = 48;
+
+  /// Starts watching the calling thread.  If MAX_THREADS threads are already
+  /// watched, the thread isn't watched, and the other functions here do
+  /// nothing on it.
+  void register_thread(const std::string& name);
+
+  /// Stops watching the calling thread.
+  void unregister_thread();
+
+  /// Marks the start and end of a message or callback on the calling thread.
+  void busy();
+  void idle();
+
+  /// Sets what the calling thread is doing, returning what it was doing
+  /// before (NULL for nothing in particular).  The activity isn't copied, so
+  /// must stay valid for as long as it is set.
+  const char* set_activity(const char* activity);
+
+  /// Sets and clears the dependency the calling thread is blocked on.  The
+  /// dependency is copied (and truncated to TAG_LENGTH).
+  void set_waiting(const std::string& dependency);
+  void clear_waiting();
+
+  /// Starts the watchdog thread, which flags threads busy for longer than
+  /// the threshold.  A threshold of 0 turns the watchdog off.
+  void start(int threshold_ms, bool capture_stacks);
+
+  /// Stops the watchdog thread.
+  void stop();
+
+  /// A thread that has been busy for too long.
+  struct Stall
+  {
+    std::string thread;
+    uint64_t busy_ms;
+    std::string activity;
+    std::string waiting;
+  };
+
+  /// Checks the watched threads once, as the watchdog thread does, returning
+  /// the threads that are newly found to be stuck.  Each time a thread is
+  /// stuck is only reported once.  Exposed for testing.
+  std::vector<Stall> check(uint64_t threshold_ms);
+
+  /// The number of threads that are stuck, as of the last check.
+  int stuck();
+
+  /// The number of times a thread has been found to be stuck.
+  uint64_t stalls();
+}
+
+#endif
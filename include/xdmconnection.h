@@ -15,10 +15,12 @@
 #include <string>
 #include <curl/curl.h>
 #include "httpconnection.h"
+#include "multiplexed_httpclient.h"
 #include "sas.h"
 #include "load_monitor.h"
 #include "snmp_ip_count_table.h"
 #include "snmp_event_accumulator_table.h"
+#include "http_content_decoder.h"
 
 class XDMConnection
 {
@@ -27,7 +29,11 @@ public:
                 HttpResolver* resolver,
                 LoadMonitor *load_monitor,
                 SNMP::IPCountTable* xdm_cxn_count,
-                SNMP::EventAccumulatorTable* xdm_latency);
+                SNMP::EventAccumulatorTable* xdm_latency,
+                int http2_connections = 0,
+                SNMP::IPCountTable* http2_stream_count_tbl = NULL,
+                SNMP::EventAccumulatorTable* http2_rtt_tbl = NULL,
+                bool compression = false);
   XDMConnection(HttpConnection* http, SNMP::EventAccumulatorTable* xdm_latency);
   virtual ~XDMConnection();
 
@@ -36,7 +42,19 @@ public:
 private:
   HttpClient* _client;
   HttpConnection* _http;
+
+  // Client multiplexing requests over HTTP/2 connections, or NULL if requests
+  // are sent through _http.
+  MultiplexedHttpClient* _http2;
+
   SNMP::EventAccumulatorTable* _latency_tbl;
+
+  // Statistics for compressed responses, or NULL if compression isn't
+  // offered to the XDMS.
+  HttpContentDecoder::Stats* _compression_stats;
+
+  // Timeout for requests sent over HTTP/2.
+  static const long HTTP2_TIMEOUT_MS = 1000;
 };
 
 #endif
@@ -19,9 +19,12 @@ sprout_test:
 sprout_full_test:
 	${MAKE} -C ${SPROUT_DIR} full_test
 
+sprout_bench:
+	${MAKE} -C ${SPROUT_DIR} bench
+
 sprout_clean:
 	${MAKE} -C ${SPROUT_DIR} clean
 
 sprout_distclean: sprout_clean
 
-.PHONY: sprout sprout_test sprout_clean sprout_distclean
+.PHONY: sprout sprout_test sprout_bench sprout_clean sprout_distclean
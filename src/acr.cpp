@@ -16,6 +16,7 @@
 #include "custom_headers.h"
 #include "acr.h"
 #include "sproutsasevent.h"
+#include "sdp_scanner.h"
 
 const pj_time_val ACR::unspec = {-1,0};
 
@@ -53,6 +54,10 @@ void ACR::server_capabilities(const ServerCapabilities& caps)
 {
 }
 
+void ACR::server_capabilities(std::shared_ptr<const ServerCapabilities> caps)
+{
+}
+
 void ACR::send_message(pj_time_val timestamp)
 {
   TRC_DEBUG("Sending Null ACR (%p)", this);
@@ -144,16 +149,145 @@ ACR* ACRFactory::get_acr(SAS::TrailId trail,
   return new ACR();
 }
 
+ACRPolicy::ACRPolicy(SNMP::CounterTable* suppressed_tbl) :
+  _empty(true),
+  _suppressed_tbl(suppressed_tbl),
+  _suppressed_count(0)
+{
+}
+
+ACRPolicy::~ACRPolicy()
+{
+}
+
+bool ACRPolicy::add_rules(const std::string& rules)
+{
+  static const struct { const char* name; ACR::Node node; } NODES[] =
+  {
+    {"scscf", ACR::SCSCF},
+    {"pcscf", ACR::PCSCF},
+    {"icscf", ACR::ICSCF},
+    {"bgcf", ACR::BGCF},
+    {"ibcf", ACR::IBCF},
+    {"as", ACR::AS},
+  };
+
+  // Parse all the rules before applying any of them, so an invalid rule
+  // leaves the policy unchanged.
+  struct Rule
+  {
+    std::vector<ACR::Node> nodes;
+    std::vector<ACR::NodeRole> roles;
+    std::string method;
+  };
+  std::vector<Rule> parsed_rules;
+
+  std::vector<std::string> rule_strs;
+  Utils::split_string(rules, ',', rule_strs, 0, true);
+
+  for (const std::string& rule_str : rule_strs)
+  {
+    std::vector<std::string> fields;
+    Utils::split_string(rule_str, ':', fields, 0, true);
+
+    if ((fields.size() < 2) || (fields.size() > 3) || (fields[1].empty()))
+    {
+      TRC_ERROR("Invalid EVENT ACR suppression rule %s", rule_str.c_str());
+      return false;
+    }
+
+    Rule rule;
+    for (size_t ii = 0; ii < sizeof(NODES) / sizeof(NODES[0]); ++ii)
+    {
+      if ((fields[0] == "*") || (fields[0] == NODES[ii].name))
+      {
+        rule.nodes.push_back(NODES[ii].node);
+      }
+    }
+
+    if (fields.size() == 2)
+    {
+      rule.roles.push_back(ACR::NODE_ROLE_ORIGINATING);
+      rule.roles.push_back(ACR::NODE_ROLE_TERMINATING);
+    }
+    else if (fields[2] == "orig")
+    {
+      rule.roles.push_back(ACR::NODE_ROLE_ORIGINATING);
+    }
+    else if (fields[2] == "term")
+    {
+      rule.roles.push_back(ACR::NODE_ROLE_TERMINATING);
+    }
+
+    if ((rule.nodes.empty()) || (rule.roles.empty()))
+    {
+      TRC_ERROR("Invalid EVENT ACR suppression rule %s", rule_str.c_str());
+      return false;
+    }
+
+    rule.method = fields[1];
+    parsed_rules.push_back(rule);
+  }
+
+  for (const Rule& rule : parsed_rules)
+  {
+    for (ACR::Node node : rule.nodes)
+    {
+      for (ACR::NodeRole role : rule.roles)
+      {
+        TRC_STATUS("Suppressing %s EVENT ACRs for %s %s",
+                   rule.method.c_str(),
+                   ACR::node_role_str(role).c_str(),
+                   ACR::node_name(node).c_str());
+        _methods[node][role].insert(rule.method);
+        _empty = false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool ACRPolicy::suppress_event(ACR::Node node,
+                               ACR::NodeRole role,
+                               const std::string& method)
+{
+  const std::set<std::string>& methods = _methods[node][role];
+
+  if ((methods.empty()) ||
+      ((methods.find(method) == methods.end()) &&
+       (methods.find("*") == methods.end())))
+  {
+    return false;
+  }
+
+  _suppressed_count++;
+  if (_suppressed_tbl != NULL)
+  {
+    _suppressed_tbl->increment();
+  }
+
+  return true;
+}
+
+// ACRs are created for every transaction, so look up the statistics for their
+// locks once.
+static LockStats* acr_lock_stats = LockInstrumentation::stats("acr");
+
 RalfACR::RalfACR(RalfProcessor* ralf,
                  SAS::TrailId trail,
                  Node node_functionality,
                  Initiator initiator,
-                 NodeRole role) :
+                 NodeRole role,
+                 ACRPolicy* policy) :
+  _acr_lock(acr_lock_stats),
   _ralf(ralf),
   _trail(trail),
+  _policy(policy),
   _initiator(initiator),
   _first_req(true),
   _first_rsp(true),
+  _response_log(NULL),
   _interim_interval(0),
   _node_role(role),
   _node_functionality(node_functionality),
@@ -164,15 +298,19 @@ RalfACR::RalfACR(RalfProcessor* ralf,
   _req_timestamp.sec = 0;
   _rsp_timestamp.sec = 0;
 
-  pthread_mutex_init(&_acr_lock, NULL);
-
   TRC_DEBUG("Created %s Ralf ACR",
             ACR::node_name(_node_functionality).c_str(), this);
 }
 
 RalfACR::~RalfACR()
 {
-  pthread_mutex_destroy(&_acr_lock);
+  ResponseEvent* event = _response_log.load(std::memory_order_acquire);
+  while (event != NULL)
+  {
+    ResponseEvent* next = event->next;
+    delete event;
+    event = next;
+  }
 }
 
 void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
@@ -183,6 +321,9 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
+  // Index the headers, as we look up several of them.
+  HeaderIndex req_hdrs(req);
+
   if (_first_req)
   {
     // This is the first time we have seen a request for this transaction,
@@ -256,7 +397,7 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
         (_method == "NOTIFY"))
     {
       pjsip_generic_string_hdr* event_hdr = (pjsip_generic_string_hdr*)
-                             pjsip_msg_find_hdr_by_name(req, &STR_EVENT, NULL);
+                             req_hdrs.find(&STR_EVENT);
       if (event_hdr != NULL)
       {
         _event = PJUtils::pj_str_to_string(&event_hdr->hvalue);
@@ -318,10 +459,10 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
     if (req->line.req.method.id == PJSIP_INVITE_METHOD)
     {
       pjsip_session_expires_hdr* sess_expires = (pjsip_session_expires_hdr*)
-                               pjsip_msg_find_hdr_by_names(req,
-                                                           &STR_SESSION_EXPIRES,
-                                                           &STR_X,
-                                                           NULL);
+                               PJUtils::find_hdr_by_names(req,
+                                                          &STR_SESSION_EXPIRES,
+                                                          &STR_X,
+                                                          NULL);
       if (sess_expires != NULL)
       {
         _interim_interval = sess_expires->expires;
@@ -340,7 +481,7 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
     {
       // For originating requests take the subscription identifiers from
       // P-Asserted-Identity headers in the original request.
-      store_subscription_ids(req);
+      store_subscription_ids(req_hdrs);
     }
 
     if ((_method == "REGISTER") &&
@@ -359,7 +500,7 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
     }
 
     // Store the calling party addresses (from P-Asserted-Identity headers).
-    store_calling_party_addresses(req);
+    store_calling_party_addresses(req_hdrs);
 
     // Store the RequestURI in case it is needed for a Requested-Party-Address
     // AVP or as a Media-Originator-Party AVP.
@@ -367,17 +508,17 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
                PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, req->line.req.uri);
 
     // Store IOIs and ICID from P-Charging-Vector header if present.
-    store_charging_info(req);
+    store_charging_info(req_hdrs);
 
     // In the originating case we always take SDP and other message bodies
     // from the original request.
     if (_node_role == NODE_ROLE_ORIGINATING)
     {
       // Store media description if present.
-      store_media_description(req, _media);
+      store_media_description(req_hdrs, _media);
 
       // Store non-SDP message bodies if present.
-      store_message_bodies(req);
+      store_message_bodies(req_hdrs);
     }
 
     // Store contents of Reason header(s) if CANCEL or BYE request.
@@ -385,29 +526,29 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
         (req->line.req.method.id == PJSIP_BYE_METHOD))
     {
       pjsip_generic_string_hdr* reason_hdr = (pjsip_generic_string_hdr*)
-                            pjsip_msg_find_hdr_by_name(req, &STR_REASON, NULL);
+                            req_hdrs.find(&STR_REASON);
       while (reason_hdr != NULL)
       {
         _reasons.push_back(PJUtils::pj_str_to_string(&reason_hdr->hvalue));
         reason_hdr = (pjsip_generic_string_hdr*)
-                pjsip_msg_find_hdr_by_name(req, &STR_REASON, reason_hdr->next);
+                req_hdrs.find_next(&STR_REASON, reason_hdr);
       }
     }
 
     // Store contents of P-Access-Network-Info headers if present.
     pjsip_generic_string_hdr* pani_hdr = (pjsip_generic_string_hdr*)
-                           pjsip_msg_find_hdr_by_name(req, &STR_P_A_N_I, NULL);
+                           req_hdrs.find(&STR_P_A_N_I);
     while (pani_hdr != NULL)
     {
       _access_network_info.push_back(
                                  PJUtils::pj_str_to_string(&pani_hdr->hvalue));
       pani_hdr = (pjsip_generic_string_hdr*)
-                 pjsip_msg_find_hdr_by_name(req, &STR_P_A_N_I, pani_hdr->next);
+                 req_hdrs.find_next(&STR_P_A_N_I, pani_hdr);
     }
 
     // Store contents of P-Visited-Network-ID header.
     pjsip_generic_string_hdr* pvni_hdr = (pjsip_generic_string_hdr*)
-                           pjsip_msg_find_hdr_by_name(req, &STR_P_V_N_I, NULL);
+                           req_hdrs.find(&STR_P_V_N_I);
     if (pvni_hdr != NULL)
     {
       _visited_network_id = PJUtils::pj_str_to_string(&pvni_hdr->hvalue);
@@ -424,7 +565,7 @@ void RalfACR::rx_request(pjsip_msg* req, pj_time_val timestamp)
   // requests.
 
   // Store the charging function addresses if present.
-  store_charging_addresses(req);
+  store_charging_addresses(req_hdrs);
 
   if (_node_role == NODE_ROLE_TERMINATING)
   {
@@ -446,6 +587,13 @@ void RalfACR::tx_request(pjsip_msg* req, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
+  // Apply any responses received so far before the request updates the
+  // charging function addresses.
+  merge_response_log();
+
+  // Index the headers, as we look up several of them.
+  HeaderIndex req_hdrs(req);
+
   // Store the contents of the top-most route header if present.
   pjsip_route_hdr* route_hdr = (pjsip_route_hdr*)
                                   pjsip_msg_find_hdr(req, PJSIP_H_ROUTE, NULL);
@@ -459,10 +607,10 @@ void RalfACR::tx_request(pjsip_msg* req, pj_time_val timestamp)
   if (req->line.req.method.id == PJSIP_INVITE_METHOD)
   {
     pjsip_session_expires_hdr* sess_expires = (pjsip_session_expires_hdr*)
-                             pjsip_msg_find_hdr_by_names(req,
-                                                         &STR_SESSION_EXPIRES,
-                                                         &STR_X,
-                                                         NULL);
+                             PJUtils::find_hdr_by_names(req,
+                                                        &STR_SESSION_EXPIRES,
+                                                        &STR_X,
+                                                        NULL);
     if (sess_expires != NULL)
     {
       _interim_interval = sess_expires->expires;
@@ -478,17 +626,17 @@ void RalfACR::tx_request(pjsip_msg* req, pj_time_val timestamp)
   }
 
   // Store the charging function addresses if present.
-  store_charging_addresses(req);
+  store_charging_addresses(req_hdrs);
 
   // If this is a terminating request store the SDP and non-SDP bodies from
   // every transmitted request.
   if (_node_role == NODE_ROLE_TERMINATING)
   {
     // Store media description if present.
-    store_media_description(req, _media);
+    store_media_description(req_hdrs, _media);
 
     // Store non-SDP message bodies if present.
-    store_message_bodies(req);
+    store_message_bodies(req_hdrs);
   }
 }
 
@@ -501,43 +649,60 @@ void RalfACR::rx_response(pjsip_msg* rsp, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
-  if (rsp->line.status.code >= PJSIP_SC_OK)
+  // Index the headers, as we look up several of them.
+  HeaderIndex rsp_hdrs(rsp);
+
+  if ((rsp->line.status.code >= PJSIP_SC_OK) &&
+      (_first_rsp.load(std::memory_order_relaxed)) &&
+      (_first_rsp.exchange(false)))
   {
-    // This is a final response.
-    if (_first_rsp)
-    {
-      _first_rsp = false;
+    // This is the first final response, which fills in much of the ACR, so
+    // take the lock to process it.  This only happens once per ACR.
+    _acr_lock.lock();
 
-      // Store IOIs and ICID from P-Charging-Vector header if present.
-      store_charging_info(rsp);
+    // Apply any earlier responses first, so the latest status code and
+    // charging function addresses win.
+    merge_response_log();
 
-      if (_node_role == NODE_ROLE_TERMINATING)
-      {
-        // For terminating requests take the subscription identifiers from
-        // P-Asserted-Identity headers in the first response.
-        store_subscription_ids(rsp);
+    // Store IOIs and ICID from P-Charging-Vector header if present.
+    store_charging_info(rsp_hdrs);
 
-        // For terminating requests store media from the first received final
-        // response.
-        store_media_description(rsp, _media);
+    if (_node_role == NODE_ROLE_TERMINATING)
+    {
+      // For terminating requests take the subscription identifiers from
+      // P-Asserted-Identity headers in the first response.
+      store_subscription_ids(rsp_hdrs);
 
-        // Store non-SDP message bodies if present.
-        store_message_bodies(rsp);
-      }
+      // For terminating requests store media from the first received final
+      // response.
+      store_media_description(rsp_hdrs, _media);
 
-      if (rsp->line.status.code >= PJSIP_SC_OK)
-      {
-        // First 200 OK response, so store the called asserted identities.
-        store_called_asserted_ids(rsp);
-      }
+      // Store non-SDP message bodies if present.
+      store_message_bodies(rsp_hdrs);
     }
-  }
 
-  // Store the charging function addresses if present.
-  store_charging_addresses(rsp);
+    // First final response, so store the called asserted identities.
+    store_called_asserted_ids(rsp_hdrs);
 
-  // Store the latest status code.
-  _status_code = rsp->line.status.code;
+    // Store the charging function addresses if present.
+    store_charging_addresses(rsp_hdrs);
+
+    // Store the latest status code.
+    _status_code = rsp->line.status.code;
+
+    _acr_lock.unlock();
+  }
+  else
+  {
+    // Any other response only updates the status code and charging function
+    // addresses, so record it in the log without taking the lock.
+    ResponseEvent* event = new ResponseEvent();
+    event->status_code = rsp->line.status.code;
+    event->has_charging_addresses = find_charging_addresses(rsp_hdrs,
+                                                            event->ccfs,
+                                                            event->ecfs);
+    log_response(event);
+  }
 }
 
 void RalfACR::tx_response(pjsip_msg* rsp, pj_time_val timestamp)
@@ -548,18 +713,25 @@ void RalfACR::tx_response(pjsip_msg* rsp, pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
+  // Apply any responses received so far, as the transmitted response
+  // supersedes their status code.
+  merge_response_log();
+
+  // Index the headers, as we look up several of them.
+  HeaderIndex rsp_hdrs(rsp);
+
   _rsp_timestamp = timestamp;
 
   // Store the charging function addresses if present.
-  store_charging_addresses(rsp);
+  store_charging_addresses(rsp_hdrs);
 
   if (_node_role == NODE_ROLE_ORIGINATING)
   {
     // For originating requests store media from the final transmitted response.
-    store_media_description(rsp, _media);
+    store_media_description(rsp_hdrs, _media);
 
     // Store non-SDP message bodies if present.
-    store_message_bodies(rsp);
+    store_message_bodies(rsp_hdrs);
   }
 
   if ((_method == "REGISTER") &&
@@ -568,7 +740,7 @@ void RalfACR::tx_response(pjsip_msg* rsp, pj_time_val timestamp)
     // Store the associated URIs from the 200 OK/REGISTER response.  These
     // are stored from the transmitted response to catch the case where the
     // S-CSCF has generated the response itself.
-    store_associated_uris(rsp);
+    store_associated_uris(rsp_hdrs);
   }
 
   // Store the latest status code.
@@ -619,6 +791,13 @@ void RalfACR::server_capabilities(const ServerCapabilities& caps)
 {
   // Store the server capabilities.
   TRC_DEBUG("Storing Server-Capabilities");
+  _server_caps = std::make_shared<ServerCapabilities>(caps);
+}
+
+void RalfACR::server_capabilities(std::shared_ptr<const ServerCapabilities> caps)
+{
+  // Store a reference to the server capabilities.
+  TRC_DEBUG("Storing Server-Capabilities");
   _server_caps = caps;
 }
 
@@ -629,6 +808,24 @@ void RalfACR::send_message(pj_time_val timestamp)
   // call `get_message()` to produce our request body.
   assert(!_cancelled);
 
+  merge_response_log();
+
+  // Check whether the policy drops this ACR before building it.  Only EVENT
+  // records are ever dropped, so this never breaks up a session's records
+  // (and a failed INVITE, which has been changed to an EVENT, is treated
+  // like any other EVENT).
+  if ((_record_type == EVENT_RECORD) &&
+      (_policy != NULL) &&
+      (!_policy->empty()) &&
+      (_policy->suppress_event(_node_functionality, _node_role, _method)))
+  {
+    TRC_DEBUG("Suppressing %s %s EVENT ACR (%p)",
+              ACR::node_name(_node_functionality).c_str(),
+              _method.c_str(),
+              this);
+    return;
+  }
+
   // If we have a CCF or ECF, or this isn't a record type that needs one, send
   // the message.
   if ((!_ccfs.empty()) ||
@@ -673,13 +870,18 @@ std::string RalfACR::get_message(pj_time_val timestamp)
 
   TRC_DEBUG("Building message");
 
+  merge_response_log();
+
   if (timestamp.sec == -1)
   {
     // Timestamp is unspecified, so get the current time.
     pj_gettimeofday(&timestamp);
   }
 
-  rapidjson::StringBuffer sb;
+  // Each thread reuses the same buffer, so once it has grown to the size of a
+  // typical ACR, rendering one doesn't need to reallocate it.
+  static thread_local rapidjson::StringBuffer sb;
+  sb.Clear();
   rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
   writer.StartObject();
 
@@ -1017,14 +1219,17 @@ std::string RalfACR::get_message(pj_time_val timestamp)
   if (_node_functionality == ICSCF)
   {
     TRC_DEBUG("Adding Server-Capabilities AVP group");
+    static const ServerCapabilities NO_SERVER_CAPS;
+    const ServerCapabilities& server_caps =
+               (_server_caps != nullptr) ? *_server_caps : NO_SERVER_CAPS;
     writer.String("Server-Capabilities");
     writer.StartObject();
     {
       writer.String("Mandatory-Capability");
       writer.StartArray();
 
-      for (std::vector<int>::const_iterator i = _server_caps.mandatory_caps.begin();
-           i != _server_caps.mandatory_caps.end();
+      for (std::vector<int>::const_iterator i = server_caps.mandatory_caps.begin();
+           i != server_caps.mandatory_caps.end();
            ++i)
       {
         writer.Int(*i);
@@ -1034,8 +1239,8 @@ std::string RalfACR::get_message(pj_time_val timestamp)
       writer.String("Optional-Capability");
       writer.StartArray();
 
-      for (std::vector<int>::const_iterator i = _server_caps.optional_caps.begin();
-           i != _server_caps.optional_caps.end();
+      for (std::vector<int>::const_iterator i = server_caps.optional_caps.begin();
+           i != server_caps.optional_caps.end();
            ++i)
       {
         writer.Int(*i);
@@ -1043,13 +1248,13 @@ std::string RalfACR::get_message(pj_time_val timestamp)
 
       writer.EndArray();
 
-      if (!_server_caps.scscf.empty())
+      if (!server_caps.scscf.empty())
       {
         // Note that the Server-Name in Server-Capabilities is an array AVP
         // according to 6.3.4/TS 29.229.
         writer.String("Server-Name");
         writer.StartArray();
-        writer.String(_server_caps.scscf.c_str());
+        writer.String(server_caps.scscf.c_str());
         writer.EndArray();
       }
     }
@@ -1278,7 +1483,7 @@ std::string RalfACR::get_message(pj_time_val timestamp)
   writer.EndObject(); // End whole object
 
   // Render the message to a string and return it.
-  return sb.GetString();
+  return std::string(sb.GetString(), sb.GetSize());
 }
 
 void RalfACR::set_default_ccf(const std::string& default_ccf)
@@ -1298,95 +1503,103 @@ void RalfACR::override_session_id(const std::string& session_id)
 
 void RalfACR::lock()
 {
-  pthread_mutex_lock(&_acr_lock);
+  _acr_lock.lock();
 }
 
 void RalfACR::unlock()
 {
-  pthread_mutex_unlock(&_acr_lock);
+  _acr_lock.unlock();
 }
 
 void RalfACR::encode_sdp_description(
                              rapidjson::Writer<rapidjson::StringBuffer>* writer,
                              const MediaDescription& media)
 {
-  // Split the offer and answer in to lines.
-  std::vector<std::string> offer;
-  split_sdp(media.offer.sdp, offer);
-  std::vector<std::string> answer;
-  split_sdp(media.answer.sdp, answer);
-
   // First add the SDP-Session-Description AVPs.  We take these from the
   // answer if there is one, and from the offer otherwise (rather than
-  // repeating them).
+  // repeating them).  The SDP is scanned rather than split in to lines, so
+  // nothing is copied.
   TRC_DEBUG("Adding SDP-Session-Description AVPs");
-  std::vector<std::string>& session_sdp = (answer.empty()) ? offer : answer;
-
-  if (session_sdp.size() > 0)
+  SdpScanner::Line line;
+  const std::string* session_sdp = &media.answer.sdp;
+  if (!SdpScanner(session_sdp->data(), session_sdp->length()).next_line(line))
   {
-    writer->String("SDP-Session-Description");
-    writer->StartArray();
-
-    for (size_t ii = 0; ii < session_sdp.size(); ++ii)
-    {
-      if (session_sdp[ii][0] == 'm')
-      {
-        break;
-      }
-      writer->String(session_sdp[ii].c_str());
-    }
-
-    writer->EndArray();
+    session_sdp = &media.offer.sdp;
   }
 
-  // Now parse and encode the offer and answer media components.
-  if ((offer.size() > 0) || (answer.size() > 0))
+  SdpScanner session(session_sdp->data(), session_sdp->length());
+  if (!session.next_line(line))
   {
-    writer->String("SDP-Media-Component");
-    writer->StartArray();
+    // Neither the offer nor the answer has any SDP.
+    return;
+  }
 
-    TRC_DEBUG("Adding media AVPs for offer");
-    encode_media_components(writer,
-                            offer,
-                            SDP_OFFER,
-                            media.offer.initiator_flag,
-                            media.offer.initiator_party);
+  writer->String("SDP-Session-Description");
+  writer->StartArray();
 
-    TRC_DEBUG("Adding media AVPs for answer");
-    encode_media_components(writer,
-                            answer,
-                            SDP_ANSWER,
-                            media.answer.initiator_flag,
-                            media.answer.initiator_party);
-    writer->EndArray();
-  }
+  do
+  {
+    if (line.type == 'm')
+    {
+      break;
+    }
+    writer->String(line.line.ptr, line.line.slen);
+  }
+  while (session.next_line(line));
+
+  writer->EndArray();
+
+  // Now encode the offer and answer media components.
+  writer->String("SDP-Media-Component");
+  writer->StartArray();
+
+  TRC_DEBUG("Adding media AVPs for offer");
+  encode_media_components(writer,
+                          media.offer.sdp,
+                          SDP_OFFER,
+                          media.offer.initiator_flag,
+                          media.offer.initiator_party);
+
+  TRC_DEBUG("Adding media AVPs for answer");
+  encode_media_components(writer,
+                          media.answer.sdp,
+                          SDP_ANSWER,
+                          media.answer.initiator_flag,
+                          media.answer.initiator_party);
+  writer->EndArray();
 }
 
 void RalfACR::encode_media_components(
                              rapidjson::Writer<rapidjson::StringBuffer>* writer,
-                             const std::vector<std::string>& sdp,
+                             const std::string& sdp,
                              SDPType sdp_type,
                              Initiator initiator_flag,
                              const std::string& initiator_party)
 {
-  for (size_t ii = 0; ii < sdp.size(); )
+  SdpScanner scanner(sdp.data(), sdp.length());
+  SdpScanner::Line line;
+  bool more = scanner.next_line(line);
+
+  while (more)
   {
-    if (sdp[ii][0] == 'm')
+    if (line.type == 'm')
     {
       // Generate an SDP-Media-Component AVP.
       writer->StartObject();
 
       // Add the SDP-Media-Name AVP.
       writer->String("SDP-Media-Name");
-      writer->String(sdp[ii].c_str());
+      writer->String(line.line.ptr, line.line.slen);
 
       // Add SDP-Media-Description AVPs.
       writer->String("SDP-Media-Description");
       writer->StartArray();
 
-      for (ii = ii + 1; (ii < sdp.size()) && (sdp[ii][0] != 'm'); ++ii)
+      for (more = scanner.next_line(line);
+           (more) && (line.type != 'm');
+           more = scanner.next_line(line))
       {
-        writer->String(sdp[ii].c_str());
+        writer->String(line.line.ptr, line.line.slen);
       }
 
       writer->EndArray();
@@ -1422,98 +1635,115 @@ void RalfACR::encode_media_components(
     else
     {
       // Not an m= line, so move to the next one.
-      ++ii;
+      more = scanner.next_line(line);
     }
   }
 }
 
-/// Splits a block of SDP in to individual lines, removing any carriage
-/// return characters at the end of the lines if present.
-void RalfACR::split_sdp(const std::string& sdp, std::vector<std::string>& lines)
+void RalfACR::log_response(ResponseEvent* event)
+{
+  event->next = _response_log.load(std::memory_order_relaxed);
+  while (!_response_log.compare_exchange_weak(event->next,
+                                              event,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed))
+  {
+  }
+}
+
+void RalfACR::merge_response_log()
 {
-  size_t start_pos = 0;
-  size_t end_pos;
-  size_t next_start_pos;
+  ResponseEvent* event = _response_log.exchange(NULL, std::memory_order_acquire);
+  if (event == NULL)
+  {
+    return;
+  }
 
-  do
+  // The log is most recent first, so reverse it to apply the events in the
+  // order they happened.
+  ResponseEvent* oldest = NULL;
+  while (event != NULL)
   {
-    end_pos = sdp.find('\n', start_pos);
-    if (end_pos == std::string::npos)
-    {
-      // Reached the end of the string.
-      next_start_pos = std::string::npos;
-      end_pos = sdp.length();
-    }
-    else
-    {
-      // Found a line feed.
-      next_start_pos = end_pos + 1;
-    }
+    ResponseEvent* next = event->next;
+    event->next = oldest;
+    oldest = event;
+    event = next;
+  }
 
-    if (sdp[end_pos - 1] == '\r')
+  while (oldest != NULL)
+  {
+    // Only store charging addresses for START or EVENT ACRs - they are not
+    // needed for INTERIM or STOP ACRs.
+    if ((oldest->has_charging_addresses) &&
+        ((_record_type == START_RECORD) ||
+         (_record_type == EVENT_RECORD)))
     {
-      // Line ends in carriage return, so strip it.
-      end_pos = end_pos - 1;
+      _ccfs.swap(oldest->ccfs);
+      _ecfs.swap(oldest->ecfs);
     }
 
-    if (end_pos > start_pos)
-    {
-      // Non-blank line, so add it to output.
-      lines.push_back(sdp.substr(start_pos, end_pos - start_pos));
-    }
+    _status_code = oldest->status_code;
 
-    // Move to the start of the next line.
-    start_pos = next_start_pos;
+    ResponseEvent* next = oldest->next;
+    delete oldest;
+    oldest = next;
   }
-  while (start_pos != std::string::npos);
 }
 
-void RalfACR::store_charging_addresses(pjsip_msg* msg)
+bool RalfACR::find_charging_addresses(const HeaderIndex& hdrs,
+                                      std::list<std::string>& ccfs,
+                                      std::list<std::string>& ecfs)
+{
+  pjsip_p_c_f_a_hdr* p_cfa_hdr = (pjsip_p_c_f_a_hdr*)hdrs.find(&STR_P_C_F_A);
+  if (p_cfa_hdr == NULL)
+  {
+    return false;
+  }
+
+  // Clear out any existing entries.
+  TRC_DEBUG("Found a P-Charging-Function-Address header");
+  ccfs.clear();
+  ecfs.clear();
+
+  // Copy CCFs from the header.
+  for (pjsip_param* p = p_cfa_hdr->ccf.next;
+       (p != NULL) && (p != &p_cfa_hdr->ccf);
+       p = p->next)
+  {
+    ccfs.push_back(PJUtils::pj_str_to_string(&p->value));
+  }
+
+  // Copy ECFs from the header.
+  for (pjsip_param* p = p_cfa_hdr->ecf.next;
+       (p != NULL) && (p != &p_cfa_hdr->ecf);
+       p = p->next)
+  {
+    ecfs.push_back(PJUtils::pj_str_to_string(&p->value));
+  }
+  TRC_DEBUG("%d ccfs and %d ecfs", ccfs.size(), ecfs.size());
+
+  return true;
+}
+
+void RalfACR::store_charging_addresses(const HeaderIndex& hdrs)
 {
   // Only store charging addresses for START or EVENT ACRs - they are not
   // needed for INTERIM or STOP ACRs.
   if ((_record_type == START_RECORD) ||
       (_record_type == EVENT_RECORD))
   {
-    pjsip_p_c_f_a_hdr* p_cfa_hdr = (pjsip_p_c_f_a_hdr*)
-                             pjsip_msg_find_hdr_by_name(msg, &STR_P_C_F_A, NULL);
-    if (p_cfa_hdr != NULL)
-    {
-      // Clear out any existing entries.
-      TRC_DEBUG("Found a P-Charging-Function-Address header");
-      _ccfs.clear();
-      _ecfs.clear();
-
-      // Copy CCFs from the header.
-      for (pjsip_param* p = p_cfa_hdr->ccf.next;
-           (p != NULL) && (p != &p_cfa_hdr->ccf);
-           p = p->next)
-      {
-        _ccfs.push_back(PJUtils::pj_str_to_string(&p->value));
-      }
-
-      // Copy ECFs from the header.
-      for (pjsip_param* p = p_cfa_hdr->ecf.next;
-           (p != NULL) && (p != &p_cfa_hdr->ecf);
-           p = p->next)
-      {
-        _ecfs.push_back(PJUtils::pj_str_to_string(&p->value));
-      }
-      TRC_DEBUG("%d ccfs and %d ecfs", _ccfs.size(), _ecfs.size());
-    }
+    find_charging_addresses(hdrs, _ccfs, _ecfs);
   }
 }
 
-void RalfACR::store_subscription_ids(pjsip_msg* msg)
+void RalfACR::store_subscription_ids(const HeaderIndex& hdrs)
 {
-  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)
-               pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL);
+  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)hdrs.find(&STR_P_ASSERTED_IDENTITY);
   while (pa_id != NULL)
   {
     pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(&pa_id->name_addr);
     _subscription_ids.push_back(uri_to_subscription_id(uri));
-    pa_id = (pjsip_routing_hdr*)
-        pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, pa_id->next);
+    pa_id = (pjsip_routing_hdr*)hdrs.find_next(&STR_P_ASSERTED_IDENTITY, pa_id);
   }
   TRC_DEBUG("Stored %d subscription identifiers", _subscription_ids.size());
 }
@@ -1538,17 +1768,15 @@ RalfACR::SubscriptionId RalfACR::uri_to_subscription_id(pjsip_uri* uri)
   return id;
 }
 
-void RalfACR::store_calling_party_addresses(pjsip_msg* msg)
+void RalfACR::store_calling_party_addresses(const HeaderIndex& hdrs)
 {
-  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)
-               pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL);
+  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)hdrs.find(&STR_P_ASSERTED_IDENTITY);
   while (pa_id != NULL)
   {
     pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(&pa_id->name_addr);
     _calling_party_addresses.push_back(
                          PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, uri));
-    pa_id = (pjsip_routing_hdr*)
-        pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, pa_id->next);
+    pa_id = (pjsip_routing_hdr*)hdrs.find_next(&STR_P_ASSERTED_IDENTITY, pa_id);
   }
 }
 
@@ -1558,39 +1786,34 @@ void RalfACR::store_called_party_address(pjsip_msg* msg)
                PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, msg->line.req.uri);
 }
 
-void RalfACR::store_called_asserted_ids(pjsip_msg* msg)
+void RalfACR::store_called_asserted_ids(const HeaderIndex& hdrs)
 {
-  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)
-               pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL);
+  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)hdrs.find(&STR_P_ASSERTED_IDENTITY);
   while (pa_id != NULL)
   {
     pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(&pa_id->name_addr);
     _called_asserted_ids.push_back(
                          PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, uri));
-    pa_id = (pjsip_routing_hdr*)
-        pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, pa_id->next);
+    pa_id = (pjsip_routing_hdr*)hdrs.find_next(&STR_P_ASSERTED_IDENTITY, pa_id);
   }
 }
 
-void RalfACR::store_associated_uris(pjsip_msg* msg)
+void RalfACR::store_associated_uris(const HeaderIndex& hdrs)
 {
   TRC_DEBUG("Store associated URIs");
-  pjsip_routing_hdr* pau = (pjsip_routing_hdr*)
-                  pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSOCIATED_URI, NULL);
+  pjsip_routing_hdr* pau = (pjsip_routing_hdr*)hdrs.find(&STR_P_ASSOCIATED_URI);
   while (pau != NULL)
   {
     pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(&pau->name_addr);
     _associated_uris.push_back(
                          PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, uri));
-    pau = (pjsip_routing_hdr*)
-             pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSOCIATED_URI, pau->next);
+    pau = (pjsip_routing_hdr*)hdrs.find_next(&STR_P_ASSOCIATED_URI, pau);
   }
 }
 
-void RalfACR::store_charging_info(pjsip_msg* msg)
+void RalfACR::store_charging_info(const HeaderIndex& hdrs)
 {
-  pjsip_p_c_v_hdr* pcv_hdr = (pjsip_p_c_v_hdr*)
-                             pjsip_msg_find_hdr_by_name(msg, &STR_P_C_V, NULL);
+  pjsip_p_c_v_hdr* pcv_hdr = (pjsip_p_c_v_hdr*)hdrs.find(&STR_P_C_V);
   if (pcv_hdr != NULL)
   {
     TRC_DEBUG("Found P-Charging-Vector header, store information");
@@ -1610,8 +1833,11 @@ void RalfACR::store_charging_info(pjsip_msg* msg)
   }
 }
 
-void RalfACR::store_media_description(pjsip_msg* msg, MediaDescription& description)
+void RalfACR::store_media_description(const HeaderIndex& hdrs,
+                                      MediaDescription& description)
 {
+  pjsip_msg* msg = hdrs.msg();
+
   // If the message has an SDP body store it in the offer or answer slot.
   pjsip_msg_body* body = msg->body;
 
@@ -1625,26 +1851,28 @@ void RalfACR::store_media_description(pjsip_msg* msg, MediaDescription& descript
     if (_method == "ACK")
     {
       // ACKs can only every carry answers.
-      store_media_components(msg, description.answer);
+      store_media_components(hdrs, description.answer);
     }
     else if ((msg->type == PJSIP_REQUEST_MSG) ||
              (description.offer.sdp == ""))
     {
       // Either a request (so by definition an offer), or no offer on the
       // request, so store as the offer.
-      store_media_components(msg, description.offer);
+      store_media_components(hdrs, description.offer);
     }
     else
     {
       // Store the SDP as the answer.
-      store_media_components(msg, description.answer);
+      store_media_components(hdrs, description.answer);
     }
   }
   // LCOV_EXCL_STOP
 }
 
-void RalfACR::store_media_components(pjsip_msg* msg, MediaComponents& components)
+void RalfACR::store_media_components(const HeaderIndex& hdrs,
+                                     MediaComponents& components)
 {
+  pjsip_msg* msg = hdrs.msg();
   pjsip_msg_body* body = msg->body;
 
   // Store the SDP body.
@@ -1670,8 +1898,7 @@ void RalfACR::store_media_components(pjsip_msg* msg, MediaComponents& components
   // from the message (request or response) if present, or the RequestURI from
   // the original request if the message is a response and there is no
   // P-Asserted-Identity.
-  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)
-               pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL);
+  pjsip_routing_hdr* pa_id = (pjsip_routing_hdr*)hdrs.find(&STR_P_ASSERTED_IDENTITY);
   if (pa_id != NULL)
   {
     pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(&pa_id->name_addr);
@@ -1684,8 +1911,9 @@ void RalfACR::store_media_components(pjsip_msg* msg, MediaComponents& components
   }
 }
 
-void RalfACR::store_message_bodies(pjsip_msg* msg)
+void RalfACR::store_message_bodies(const HeaderIndex& hdrs)
 {
+  pjsip_msg* msg = hdrs.msg();
   pjsip_msg_body* msg_body = msg->body;
 
   if ((msg_body != NULL) &&
@@ -1695,12 +1923,16 @@ void RalfACR::store_message_bodies(pjsip_msg* msg)
     // Create a MessageBody structure encoding the required information about
     // the message body.
     MessageBody body;
-    body.type = PJUtils::pj_str_to_string(&msg_body->content_type.type)
-                + "/"
-                + PJUtils::pj_str_to_string(&msg_body->content_type.subtype);
+    body.type.reserve(msg_body->content_type.type.slen + 1 +
+                      msg_body->content_type.subtype.slen);
+    body.type.append(msg_body->content_type.type.ptr,
+                     msg_body->content_type.type.slen);
+    body.type.append(1, '/');
+    body.type.append(msg_body->content_type.subtype.ptr,
+                     msg_body->content_type.subtype.slen);
     body.length = msg_body->len;
     pjsip_generic_string_hdr* cdisp_hdr = (pjsip_generic_string_hdr*)
-               pjsip_msg_find_hdr_by_name(msg, &STR_CONTENT_DISPOSITION, NULL);
+                                        hdrs.find(&STR_CONTENT_DISPOSITION);
 
     if (cdisp_hdr != NULL)
     {
@@ -1774,9 +2006,11 @@ std::string RalfACR::hdr_contents(pjsip_hdr* hdr)
 
 /// RalfACRFactory Constructor.
 RalfACRFactory::RalfACRFactory(RalfProcessor* ralf,
-                               ACR::Node node_functionality) :
+                               ACR::Node node_functionality,
+                               ACRPolicy* policy) :
   _ralf(ralf),
-  _node_functionality(node_functionality)
+  _node_functionality(node_functionality),
+  _policy(policy)
 {
   TRC_DEBUG("Created RalfACR factory for node type %s",
             ACR::node_name(_node_functionality).c_str());
@@ -1796,6 +2030,11 @@ ACR* RalfACRFactory::get_acr(SAS::TrailId trail,
             ACR::node_name(_node_functionality).c_str(),
             ACR::node_role_str(role).c_str());
 
-  return (ACR*)new RalfACR(_ralf, trail, _node_functionality, initiator, role);
+  return (ACR*)new RalfACR(_ralf,
+                           trail,
+                           _node_functionality,
+                           initiator,
+                           role,
+                           _policy);
 }
 
@@ -0,0 +1,181 @@
+/**
+ * @file acr_spool.cpp Disk spool for ACRs that can't be sent to Ralf.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "acr_spool.h"
+
+const uint32_t AcrSpool::MAGIC;
+
+AcrSpool::AcrSpool(const std::string& file_name, size_t max_bytes) :
+  _file_name(file_name),
+  _max_bytes(max_bytes),
+  _fd(-1),
+  _map(NULL),
+  _header(NULL)
+{
+}
+
+AcrSpool::~AcrSpool()
+{
+  if (_map != NULL)
+  {
+    msync(_map, _max_bytes, MS_SYNC);
+    munmap(_map, _max_bytes);
+  }
+
+  if (_fd >= 0)
+  {
+    close(_fd);
+  }
+}
+
+bool AcrSpool::init()
+{
+  if (_max_bytes <= sizeof(Header))
+  {
+    TRC_ERROR("ACR spool size of %lu bytes is too small", _max_bytes);
+    return false;
+  }
+
+  _fd = open(_file_name.c_str(), O_RDWR | O_CREAT, 0600);
+  if (_fd < 0)
+  {
+    TRC_ERROR("Failed to open ACR spool file %s: %s",
+              _file_name.c_str(), strerror(errno));
+    return false;
+  }
+
+  if (ftruncate(_fd, _max_bytes) != 0)
+  {
+    TRC_ERROR("Failed to size ACR spool file %s: %s",
+              _file_name.c_str(), strerror(errno));
+    return false;
+  }
+
+  void* map = mmap(NULL, _max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED)
+  {
+    TRC_ERROR("Failed to map ACR spool file %s: %s",
+              _file_name.c_str(), strerror(errno));
+    return false;
+  }
+
+  _map = (char*)map;
+  _header = (Header*)_map;
+
+  if ((_header->magic == MAGIC) &&
+      (_header->read_offset >= sizeof(Header)) &&
+      (_header->read_offset <= _header->write_offset) &&
+      (_header->write_offset <= _max_bytes))
+  {
+    TRC_STATUS("Replaying %u ACRs from spool file %s",
+               _header->count, _file_name.c_str());
+  }
+  else
+  {
+    // A new spool file, or one written by something else, so start afresh.
+    _header->magic = MAGIC;
+    _header->count = 0;
+    _header->read_offset = sizeof(Header);
+    _header->write_offset = sizeof(Header);
+  }
+
+  return true;
+}
+
+bool AcrSpool::append(const std::string& path,
+                      const std::string& message,
+                      SAS::TrailId trail)
+{
+  size_t len = sizeof(Record) + path.size() + message.size();
+
+  std::lock_guard<std::mutex> guard(_lock);
+
+  if (_header->write_offset + len > _max_bytes)
+  {
+    TRC_WARNING("ACR spool file %s is full - dropping ACR", _file_name.c_str());
+    return false;
+  }
+
+  Record record;
+  record.path_len = path.size();
+  record.message_len = message.size();
+  record.trail = trail;
+
+  char* p = _map + _header->write_offset;
+  memcpy(p, &record, sizeof(record));
+  memcpy(p + sizeof(record), path.data(), path.size());
+  memcpy(p + sizeof(record) + path.size(), message.data(), message.size());
+
+  // Only move the write offset once the ACR is in place.
+  _header->write_offset += len;
+  ++_header->count;
+
+  return true;
+}
+
+bool AcrSpool::take(std::string& path,
+                    std::string& message,
+                    SAS::TrailId& trail)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  if (_header->read_offset + sizeof(Record) > _header->write_offset)
+  {
+    return false;
+  }
+
+  Record record;
+  const char* p = _map + _header->read_offset;
+  memcpy(&record, p, sizeof(record));
+
+  size_t len = sizeof(Record) + record.path_len + record.message_len;
+  if (_header->read_offset + len > _header->write_offset)
+  {
+    // LCOV_EXCL_START - only if the file has been corrupted
+    TRC_ERROR("ACR spool file %s is corrupt - discarding its contents",
+              _file_name.c_str());
+    _header->count = 0;
+    _header->read_offset = sizeof(Header);
+    _header->write_offset = sizeof(Header);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  path.assign(p + sizeof(record), record.path_len);
+  message.assign(p + sizeof(record) + record.path_len, record.message_len);
+  trail = record.trail;
+
+  _header->read_offset += len;
+  --_header->count;
+
+  if (_header->read_offset == _header->write_offset)
+  {
+    // Everything has been taken, so start again from the beginning.
+    _header->read_offset = sizeof(Header);
+    _header->write_offset = sizeof(Header);
+  }
+
+  return true;
+}
+
+uint32_t AcrSpool::count()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  return _header->count;
+}
@@ -25,34 +25,165 @@
 #include <string>
 
 #include "analyticslogger.h"
+#include "log.h"
 
-AnalyticsLogger::AnalyticsLogger()
+// How long the writer thread waits for more logs once the ring is empty.
+static const int WRITER_INTERVAL_MS = 10;
+
+const uint64_t AnalyticsLogger::RING_SIZE;
+
+AnalyticsLogger::AnalyticsLogger() :
+  _ring(new Slot[RING_SIZE]),
+  _head(0),
+  _tail(0),
+  _dropped(0),
+  _stopping(false)
 {
+  for (uint64_t ii = 0; ii < RING_SIZE; ++ii)
+  {
+    _ring[ii].seq.store(ii, std::memory_order_relaxed);
+  }
+
+  _writer = std::thread(&AnalyticsLogger::writer, this);
 }
 
 AnalyticsLogger::~AnalyticsLogger()
 {
+  stop();
+  delete[] _ring; _ring = NULL;
+}
+
+void AnalyticsLogger::stop()
+{
+  _stopping.store(true);
+
+  if (_writer.joinable())
+  {
+    _writer.join();
+  }
 }
 
 void AnalyticsLogger::log_with_tag_and_timestamp(char* log)
 {
-  // Add the current UTC time, in RFC3339 format.
+  // Claim a slot on the ring.
+  uint64_t pos = _head.load(std::memory_order_relaxed);
+  Slot* slot;
+
+  while (true)
+  {
+    slot = &_ring[pos % RING_SIZE];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+
+    if (seq == pos)
+    {
+      if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (seq < pos)
+    {
+      // The writer hasn't written out the log that was in this slot, so the
+      // ring is full.  Drop this log rather than wait.
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  // Add the current UTC time, in RFC3339 format.  Everything but the
+  // milliseconds only changes once a second, so each thread caches it.
+  static thread_local time_t cached_sec = -1;
+  static thread_local char cached_timestamp[TIMESTAMP_SIZE];
+
   struct timespec timespec;
-  struct tm dt;
   clock_gettime(CLOCK_REALTIME, &timespec);
-  gmtime_r(&timespec.tv_sec, &dt);
-  char timestamp[100];
-  sprintf(timestamp,
-          "%4.4d-%2.2d-%2.2dT%2.2d:%2.2d:%2.2d.%3.3d+00:00",
-          (dt.tm_year + 1900),
-          (dt.tm_mon + 1),
-          dt.tm_mday,
-          dt.tm_hour,
-          dt.tm_min,
-          dt.tm_sec,
-          (int)(timespec.tv_nsec / 1000000));
-
-  syslog(LOG_INFO, "<analytics> %s %s", timestamp, log);
+
+  if (timespec.tv_sec != cached_sec)
+  {
+    struct tm dt;
+    gmtime_r(&timespec.tv_sec, &dt);
+    snprintf(cached_timestamp, sizeof(cached_timestamp),
+             "%4.4d-%2.2d-%2.2dT%2.2d:%2.2d:%2.2d",
+             (dt.tm_year + 1900),
+             (dt.tm_mon + 1),
+             dt.tm_mday,
+             dt.tm_hour,
+             dt.tm_min,
+             dt.tm_sec);
+    cached_sec = timespec.tv_sec;
+  }
+
+  snprintf(slot->log, sizeof(slot->log),
+           "%s.%3.3d+00:00 %s",
+           cached_timestamp,
+           (int)(timespec.tv_nsec / 1000000),
+           log);
+
+  // Hand the slot to the writer.
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+void AnalyticsLogger::write(const char* log)
+{
+  syslog(LOG_INFO, "<analytics> %s", log);
+}
+
+int AnalyticsLogger::drain()
+{
+  int written = 0;
+
+  while (true)
+  {
+    Slot* slot = &_ring[_tail % RING_SIZE];
+    if (slot->seq.load(std::memory_order_acquire) != _tail + 1)
+    {
+      break;
+    }
+
+    write(slot->log);
+
+    // Free the slot for the producer that next comes round the ring to it.
+    slot->seq.store(_tail + RING_SIZE, std::memory_order_release);
+    ++_tail;
+    ++written;
+  }
+
+  return written;
+}
+
+void AnalyticsLogger::writer()
+{
+  uint64_t reported_dropped = 0;
+
+  while (true)
+  {
+    // Write out everything that's queued in one go.
+    bool stopping = _stopping.load();
+    int written = drain();
+
+    uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+    if (dropped != reported_dropped)
+    {
+      TRC_WARNING("Dropped %lu analytics logs as syslog isn't keeping up",
+                  dropped - reported_dropped);
+      reported_dropped = dropped;
+    }
+
+    if (written == 0)
+    {
+      if (stopping)
+      {
+        break;
+      }
+
+      struct timespec delay = {0, WRITER_INTERVAL_MS * 1000 * 1000};
+      nanosleep(&delay, NULL);
+    }
+  }
 }
 
 void AnalyticsLogger::registration(const std::string& aor,
@@ -18,11 +18,12 @@ namespace AoRUtils {
 
 pjsip_sip_uri* pub_gruu(const Binding* binding, pj_pool_t* pool)
 {
-  pjsip_sip_uri* uri = (pjsip_sip_uri*)PJUtils::uri_from_string(binding->_address_of_record, pool);
+  // Check for an instance-id before parsing the address of record, as most
+  // bindings without one don't need the parse.
+  std::map<std::string, std::string>::const_iterator instance =
+    binding->_params.find("+sip.instance");
 
-  if ((binding->_params.find("+sip.instance") == binding->_params.cend()) ||
-      (uri == NULL) ||
-      !PJSIP_URI_SCHEME_IS_SIP(uri))
+  if (instance == binding->_params.cend())
   {
     // GRUUs are only valid for SIP URIs with an instance-id.
     return NULL;
@@ -31,7 +32,7 @@ pjsip_sip_uri* pub_gruu(const Binding* binding, pj_pool_t* pool)
   // The instance parameter might be too short to be a valid GRUU. Specifically
   // if its less than 2 characters in length, the stripping function will give
   // us a buffer underrun, so exit now.
-  std::string sip_instance = binding->_params.at("+sip.instance");
+  const std::string& sip_instance = instance->second;
 
   if (sip_instance.length() < 2)
   {
@@ -39,6 +40,15 @@ pjsip_sip_uri* pub_gruu(const Binding* binding, pj_pool_t* pool)
     return NULL;
   }
 
+  pjsip_sip_uri* uri = (pjsip_sip_uri*)PJUtils::uri_from_string(binding->_address_of_record, pool);
+
+  if ((uri == NULL) ||
+      !PJSIP_URI_SCHEME_IS_SIP(uri))
+  {
+    // GRUUs are only valid for SIP URIs with an instance-id.
+    return NULL;
+  }
+
   pjsip_param* gr_param = (pjsip_param*) pj_pool_alloc(pool, sizeof(pjsip_param));
   gr_param->name = STR_GR;
   pj_strdup2(pool, &gr_param->value, sip_instance.c_str());
@@ -86,4 +96,36 @@ std::string pub_gruu_quoted_string(const Binding* binding, pj_pool_t* pool)
   return ret;
 }
 
+bool pub_gruu_quoted_pj_str(const Binding* binding,
+                            pj_pool_t* pool,
+                            pj_str_t& gruu)
+{
+  pjsip_sip_uri* pub_gruu_uri = pub_gruu(binding, pool);
+
+  if (pub_gruu_uri == NULL)
+  {
+    return false;
+  }
+
+  // Print the GRUU straight into the pool, between quotes.
+  char* buf = (char*)pj_pool_alloc(pool, PJSIP_MAX_URL_SIZE + 2);
+  int len = pjsip_uri_print(PJSIP_URI_IN_REQ_URI,
+                            pub_gruu_uri,
+                            buf + 1,
+                            PJSIP_MAX_URL_SIZE);
+
+  if (len <= 0)
+  {
+    // LCOV_EXCL_START - GRUUs are well below the maximum URL size.
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  buf[0] = '"';
+  buf[len + 1] = '"';
+  gruu.ptr = buf;
+  gruu.slen = len + 2;
+  return true;
+}
+
 }; // namespace AoRUtils
@@ -11,16 +11,22 @@
 
 #include "as_communication_tracker.h"
 
+const uint64_t AsCommunicationTracker::DEFAULT_RETRY_INTERVAL_MS;
+
 AsCommunicationTracker::AsCommunicationTracker(Alarm* alarm,
                                                const PDLog2<const char*, const char*>* as_failed_log,
-                                               const PDLog1<const char*>* as_ok_log) :
+                                               const PDLog1<const char*>* as_ok_log,
+                                               int failure_threshold,
+                                               uint64_t retry_interval_ms) :
+  _lock("as_communication_tracker"),
+  _num_failed(0),
   _next_check_time_ms(current_time_ms() + NEXT_CHECK_INTERVAL_MS),
+  _failure_threshold(failure_threshold),
+  _retry_interval_ms(retry_interval_ms),
   _alarm(alarm),
   _as_failed_log(as_failed_log),
   _as_ok_log(as_ok_log)
 {
-  pthread_mutex_init(&_lock, NULL);
-
   // Clear the alarm on startup so we don't get alarms hanging over from a
   // previous run. If an AS is actually in error, we'll alarm as soon as we
   // detect a failure.
@@ -34,49 +40,114 @@ AsCommunicationTracker::AsCommunicationTracker(Alarm* alarm,
 
 AsCommunicationTracker::~AsCommunicationTracker()
 {
-  pthread_mutex_destroy(&_lock);
+}
+
+
+AsCommunicationTracker::AsSlot* AsCommunicationTracker::slot(const std::string& as_uri)
+{
+  _lock.lock();
+  std::unique_ptr<AsSlot>& slot = _slots[as_uri];
+
+  if (!slot)
+  {
+    slot.reset(new AsSlot(as_uri));
+  }
+
+  AsSlot* ret = slot.get();
+  _lock.unlock();
+
+  return ret;
 }
 
 
 void AsCommunicationTracker::on_success(const std::string& as_uri)
 {
-  TRC_DEBUG("Communication with AS %s successful", as_uri.c_str());
-  check_for_healthy_app_servers();
+  on_success(slot(as_uri));
 }
 
 
 void AsCommunicationTracker::on_failure(const std::string& as_uri,
                                         const std::string& reason)
 {
-  TRC_DEBUG("Communication with AS %s failed", as_uri.c_str());
+  on_failure(slot(as_uri), reason);
+}
+
 
-  pthread_mutex_lock(&_lock);
+bool AsCommunicationTracker::is_circuit_open(const std::string& as_uri)
+{
+  return is_circuit_open(slot(as_uri));
+}
 
-  // If we didn't know of any failed ASs, we do now so we should raise the
-  // alarm.
-  if (_as_failures.empty())
+
+void AsCommunicationTracker::on_success(AsSlot* slot)
+{
+  TRC_DEBUG("Communication with AS %s successful", slot->uri.c_str());
+
+  // The AS has responded, so close its circuit breaker.
+  if ((slot->consecutive_failures.load() > 0) &&
+      (slot->consecutive_failures.exchange(0) >= _failure_threshold))
   {
-    TRC_DEBUG("First failure - raise the alarm");
-    _alarm->set();
+    TRC_INFO("AS %s has recovered - closing its circuit breaker",
+             slot->uri.c_str());
   }
 
-  // Add an entry to the failed ASs map (incrementing the count of failures if
-  // it has already failed).
-  std::map<std::string, int>::iterator as_iter = _as_failures.find(as_uri);
+  check_for_healthy_app_servers();
+}
+
 
-  if (as_iter != _as_failures.end())
+void AsCommunicationTracker::on_failure(AsSlot* slot,
+                                        const std::string& reason)
+{
+  TRC_DEBUG("Communication with AS %s failed", slot->uri.c_str());
+
+  // Count the failure before checking whether the AS is already treated as
+  // failed, so that a check of the ASs running at the same time either sees
+  // the failure or leaves the AS unfailed for us to fail again below.
+  slot->failures.fetch_add(1);
+
+  if (!slot->failed.load())
   {
-    as_iter->second++;
+    _lock.lock();
+
+    if (!slot->failed.load())
+    {
+      // If we didn't know of any failed ASs, we do now so we should raise the
+      // alarm.
+      if (_num_failed == 0)
+      {
+        TRC_DEBUG("First failure - raise the alarm");
+        _alarm->set();
+      }
+
+      // This is the first time we've spotted that the AS has failed, so log
+      // this fact.
+      TRC_DEBUG("First failure for this AS - generate log");
+      _as_failed_log->log(slot->uri.c_str(), reason.c_str());
+      slot->failed = true;
+      ++_num_failed;
+    }
+
+    _lock.unlock();
   }
-  else
+
+  if (_failure_threshold > 0)
   {
-    // This is the first time we've spotted that the AS has failed, so log this
-    // fact.
-    TRC_DEBUG("First failure for this AS - generate log");
-    _as_failed_log->log(as_uri.c_str(), reason.c_str());
-    _as_failures[as_uri] = 1;
+    // Count the failure towards the AS's circuit breaker.  If this opens the
+    // circuit (or is the failure of a probe while it's open) then requests
+    // skip the AS until the next retry time.
+    int consecutive_failures = slot->consecutive_failures.fetch_add(1) + 1;
+
+    if (consecutive_failures >= _failure_threshold)
+    {
+      if (consecutive_failures == _failure_threshold)
+      {
+        TRC_WARNING("AS %s has failed %d times in a row - opening its circuit breaker",
+                    slot->uri.c_str(), _failure_threshold);
+      }
+
+      slot->retry_time_ms = current_time_ms() + _retry_interval_ms;
+    }
   }
-  pthread_mutex_unlock(&_lock);
 
   // Even though communication to this AS has failed, other ASs may have become
   // healthy recently so we still need to check them.
@@ -84,6 +155,36 @@ void AsCommunicationTracker::on_failure(const std::string& as_uri,
 }
 
 
+bool AsCommunicationTracker::is_circuit_open(AsSlot* slot)
+{
+  if ((_failure_threshold <= 0) ||
+      (slot->consecutive_failures.load() < _failure_threshold))
+  {
+    return false;
+  }
+
+  uint64_t retry_time_ms = slot->retry_time_ms.load();
+  uint64_t now = current_time_ms();
+
+  if (now < retry_time_ms)
+  {
+    return true;
+  }
+
+  // Time to probe the AS.  Let this request through, and keep skipping the
+  // AS for the others until the probe succeeds or the next retry time comes
+  // round.  If another request got here first, it's the probe.
+  if (!slot->retry_time_ms.compare_exchange_strong(retry_time_ms,
+                                                   now + _retry_interval_ms))
+  {
+    return true;
+  }
+
+  TRC_INFO("Probing AS %s with open circuit breaker", slot->uri.c_str());
+  return false;
+}
+
+
 void AsCommunicationTracker::check_for_healthy_app_servers()
 {
   uint64_t now = current_time_ms();
@@ -92,7 +193,7 @@ void AsCommunicationTracker::check_for_healthy_app_servers()
 
   if (now > _next_check_time_ms)
   {
-    pthread_mutex_lock(&_lock);
+    _lock.lock();
 
     if (now > _next_check_time_ms)
     {
@@ -101,43 +202,52 @@ void AsCommunicationTracker::check_for_healthy_app_servers()
       // Don't check again for a while.
       _next_check_time_ms = current_time_ms() + NEXT_CHECK_INTERVAL_MS;
 
-      // Iterate through all the AS in our map. If any of them have not had
+      // Iterate through all the failed ASs. If any of them have not had
       // any failures in the last time period we will log they are now working
-      // correctly and remove them from the map.
+      // correctly.
       //
-      // We mutate the map as we iterate over it. The non-standard loop
-      // construct avoids iterator invalidation.
-      std::map<std::string, int>::iterator curr_as = _as_failures.begin();
-      std::map<std::string, int>::iterator next_as;
-
       // We build this string for logging which ASs are in failure.
       std::string failed_as_string;
 
-      while (curr_as != _as_failures.end())
+      for (std::map<std::string, std::unique_ptr<AsSlot> >::iterator it = _slots.begin();
+           it != _slots.end();
+           ++it)
       {
-        next_as = std::next(curr_as);
+        AsSlot* slot = it->second.get();
 
-        if (curr_as->second == 0)
+        if (!slot->failed.load())
         {
-          TRC_DEBUG("AS %s has become healthy", curr_as->first.c_str());
-          _as_ok_log->log(curr_as->first.c_str());
-          _as_failures.erase(curr_as);
+          continue;
         }
-        else
+
+        if (slot->failures.exchange(0) == 0)
         {
-          if (failed_as_string != "")
+          // No failures this period.  A failure that raced with the exchange
+          // may have seen the AS as still failed, and not logged, so only
+          // treat the AS as healthy if there's been no failure once it's no
+          // longer marked as failed.
+          slot->failed = false;
+
+          if (slot->failures.load() == 0)
           {
-            failed_as_string += ", ";
+            TRC_DEBUG("AS %s has become healthy", slot->uri.c_str());
+            _as_ok_log->log(slot->uri.c_str());
+            --_num_failed;
+            continue;
           }
 
-          failed_as_string += curr_as->first;
-          curr_as->second = 0;
+          slot->failed = true;
+        }
+
+        if (failed_as_string != "")
+        {
+          failed_as_string += ", ";
         }
 
-        curr_as = next_as;
+        failed_as_string += slot->uri;
       }
 
-      if (_as_failures.empty())
+      if (_num_failed == 0)
       {
         TRC_DEBUG("All ASs OK - clear the alarm");
         // No ASs are currently failed. Clear the alarm.
@@ -151,7 +261,7 @@ void AsCommunicationTracker::check_for_healthy_app_servers()
       }
     }
 
-    pthread_mutex_unlock(&_lock);
+    _lock.unlock();
   }
 }
 
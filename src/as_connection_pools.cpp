@@ -0,0 +1,256 @@
+/**
+ * @file as_connection_pools.cpp Pools of connections to application servers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include "log.h"
+#include "pjutils.h"
+#include "stack.h"
+#include "as_connection_pools.h"
+
+namespace ASConnectionPools
+{
+  /// The pool for one target.  Both are NULL until the pool is created.
+  struct Entry
+  {
+    SIPConnectionPool* conn_pool;
+
+    /// Holds the target's host name, which the connection pool refers to,
+    /// and its recycler thread.
+    pj_pool_t* pool;
+  };
+
+  /// The pools, by target.
+  struct Registry
+  {
+    Registry() :
+      enabled(false),
+      num_connections(0),
+      recycle_period(0),
+      tp_factory(NULL)
+    {
+    }
+
+    /// Whether there are pools, which can be checked without the lock.
+    std::atomic<bool> enabled;
+
+    std::mutex lock;
+    int num_connections;
+    int recycle_period;
+    pjsip_tpfactory* tp_factory;
+    std::map<std::string, Entry> pools;
+  };
+
+  static Registry& registry()
+  {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  /// Returns the target for a URI, which is empty if the URI can't be
+  /// pooled.
+  static std::string target(const pjsip_uri* uri)
+  {
+    if ((uri == NULL) ||
+        (!PJSIP_URI_SCHEME_IS_SIP(uri)))
+    {
+      return "";
+    }
+
+    const pjsip_sip_uri* sip_uri = (const pjsip_sip_uri*)pjsip_uri_get_uri((pjsip_uri*)uri);
+
+    if (pj_stricmp2(&sip_uri->transport_param, "tcp") != 0)
+    {
+      return "";
+    }
+
+    int port = (sip_uri->port != 0) ? sip_uri->port : 5060;
+    return PJUtils::pj_str_to_string(&sip_uri->host) + ":" + std::to_string(port);
+  }
+
+  void configure(int num_connections,
+                 int recycle_period,
+                 pjsip_tpfactory* tp_factory)
+  {
+    Registry& pools = registry();
+    std::lock_guard<std::mutex> guard(pools.lock);
+
+    pools.num_connections = num_connections;
+    pools.recycle_period = recycle_period;
+    pools.tp_factory = tp_factory;
+    pools.enabled = (num_connections > 0);
+  }
+
+  void add_target(const pjsip_sip_uri* server_name)
+  {
+    Registry& pools = registry();
+
+    if (!pools.enabled)
+    {
+      return;
+    }
+
+    std::string as_target = target((const pjsip_uri*)server_name);
+
+    if (as_target.empty())
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(pools.lock);
+
+    if ((pools.num_connections > 0) &&
+        (pools.pools.find(as_target) == pools.pools.end()))
+    {
+      TRC_DEBUG("Learned application server target %s", as_target.c_str());
+      pools.pools[as_target] = {NULL, NULL};
+    }
+  }
+
+  SIPConnectionPool* select(pjsip_tx_data* tdata)
+  {
+    Registry& pools = registry();
+
+    if ((!pools.enabled) ||
+        (tdata->tp_sel.type == PJSIP_TPSELECTOR_TRANSPORT))
+    {
+      // There are no pools, or the transport has already been chosen.
+      return NULL;
+    }
+
+    std::string as_target = target(PJUtils::next_hop(tdata->msg));
+
+    if (as_target.empty())
+    {
+      return NULL;
+    }
+
+    SIPConnectionPool* conn_pool = NULL;
+    bool created = false;
+    {
+      std::lock_guard<std::mutex> guard(pools.lock);
+      std::map<std::string, Entry>::iterator i = pools.pools.find(as_target);
+
+      if (i == pools.pools.end())
+      {
+        // Not an AS target.
+        return NULL;
+      }
+
+      if (i->second.conn_pool == NULL)
+      {
+        // This is the first request forwarded to this AS, so create its pool.
+        const pjsip_sip_uri* uri =
+          (const pjsip_sip_uri*)pjsip_uri_get_uri(PJUtils::next_hop(tdata->msg));
+        i->second.pool = pj_pool_create(&stack_data.cp.factory,
+                                        "as-connection-pool",
+                                        512,
+                                        512,
+                                        NULL);
+        pjsip_host_port pool_target;
+        pj_strdup(i->second.pool, &pool_target.host, &uri->host);
+        pool_target.port = (uri->port != 0) ? uri->port : 5060;
+
+        TRC_STATUS("Creating connection pool to application server %s",
+                   as_target.c_str());
+        i->second.conn_pool = new SIPConnectionPool(&pool_target,
+                                                    pools.num_connections,
+                                                    pools.recycle_period,
+                                                    i->second.pool,
+                                                    stack_data.endpt,
+                                                    pools.tp_factory,
+                                                    NULL,
+                                                    SIPConnectionPool::LEAST_LOADED);
+        created = true;
+      }
+
+      conn_pool = i->second.conn_pool;
+    }
+
+    if (created)
+    {
+      // Start the pool's connections.  This resolves the target, so is done
+      // without the lock held.  Requests that find the pool before it has
+      // connected use the transport manager.
+      conn_pool->init();
+    }
+
+    pjsip_transport* tp = conn_pool->get_connection();
+
+    if (tp == NULL)
+    {
+      TRC_DEBUG("No connections to %s yet", as_target.c_str());
+      return NULL;
+    }
+
+    TRC_DEBUG("Sending request to %s on pooled connection %s",
+              as_target.c_str(),
+              tp->obj_name);
+    pjsip_tpselector tp_selector;
+    tp_selector.type = PJSIP_TPSELECTOR_TRANSPORT;
+    tp_selector.u.transport = tp;
+    pjsip_tx_data_set_transport(tdata, &tp_selector);
+
+    // Setting the transport on the request adds a reference to it, so remove
+    // the one the pool added.
+    pjsip_transport_dec_ref(tp);
+
+    return conn_pool;
+  }
+
+  std::vector<Stats> stats()
+  {
+    Registry& pools = registry();
+    std::lock_guard<std::mutex> guard(pools.lock);
+    std::vector<Stats> stats;
+
+    for (const std::pair<const std::string, Entry>& pool : pools.pools)
+    {
+      const SIPConnectionPool* conn_pool = pool.second.conn_pool;
+      stats.push_back({pool.first,
+                       (conn_pool != NULL) ? conn_pool->num_connected() : 0,
+                       (conn_pool != NULL) ? conn_pool->in_flight() : 0});
+    }
+
+    return stats;
+  }
+
+  void terminate()
+  {
+    Registry& pools = registry();
+    std::map<std::string, Entry> terminating;
+    {
+      std::lock_guard<std::mutex> guard(pools.lock);
+      terminating.swap(pools.pools);
+      pools.num_connections = 0;
+      pools.enabled = false;
+    }
+
+    // The pools are destroyed without the lock held, as quiescing their
+    // connections calls back into PJSIP.
+    for (const std::pair<const std::string, Entry>& pool : terminating)
+    {
+      delete pool.second.conn_pool;
+
+      if (pool.second.pool != NULL)
+      {
+        pj_pool_release(pool.second.pool);
+      }
+    }
+  }
+}
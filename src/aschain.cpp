@@ -13,6 +13,7 @@
 
 #include "log.h"
 #include "pjutils.h"
+#include "random_token.h"
 
 #include "constants.h"
 #include "aschain.h"
@@ -34,7 +35,8 @@ AsChain::AsChain(AsChainTable* as_chain_table,
                  ACR* acr,
                  FIFCService* fifc_service,
                  IFCConfiguration ifc_configuration,
-                 std::string scscf_uri) :
+                 std::string scscf_uri,
+                 const HSSConnection::irs_info* irs_info) :
   _as_chain_table(as_chain_table),
   _refs(1),  // for the initial chain link being returned
   _as_info(ifcs.size() + 1),
@@ -50,7 +52,9 @@ AsChain::AsChain(AsChainTable* as_chain_table,
   _ifc_configuration(ifc_configuration),
   _using_standard_ifcs(true),
   _root(NULL),
-  _scscf_uri(scscf_uri)
+  _scscf_uri(scscf_uri),
+  _has_irs_info(irs_info != NULL),
+  _irs_info((irs_info != NULL) ? *irs_info : HSSConnection::irs_info())
 {
   TRC_DEBUG("Creating AsChain %p with %d iFCs and adding to map", this, ifcs.size());
   _as_chain_table->register_(this, _odi_tokens);
@@ -154,7 +158,8 @@ AsChainLink AsChainLink::create_as_chain(AsChainTable* as_chain_table,
                                          ACR* acr,
                                          FIFCService* fifc_service,
                                          IFCConfiguration ifc_configuration,
-                                         std::string scscf_uri)
+                                         std::string scscf_uri,
+                                         const HSSConnection::irs_info* irs_info)
 {
   AsChain* as_chain = new AsChain(as_chain_table,
                                   session_case,
@@ -165,7 +170,8 @@ AsChainLink AsChainLink::create_as_chain(AsChainTable* as_chain_table,
                                   acr,
                                   fifc_service,
                                   ifc_configuration,
-                                  scscf_uri);
+                                  scscf_uri,
+                                  irs_info);
   return AsChainLink(as_chain, 0u);
 }
 
@@ -288,6 +294,10 @@ void AsChainLink::get_next_application_server(pjsip_msg* msg,
                           _as_chain->_fallback_ifcs;
   got_dummy_as = false;
 
+  // The iFCs are all evaluated against the same message, so share the
+  // results of matching their SPTs.
+  Ifc::MatchCache cache;
+
   while (!complete())
   {
     const Ifc& ifc = ifcs[_index];
@@ -295,7 +305,8 @@ void AsChainLink::get_next_application_server(pjsip_msg* msg,
                            _as_chain->_is_registered,
                            false,
                            msg,
-                           trail()))
+                           trail(),
+                           &cache))
     {
       TRC_DEBUG("Matched iFC %s", to_string().c_str());
       AsInvocation application_server = ifc.as_invocation();
@@ -349,15 +360,17 @@ void AsChainLink::on_response(int status_code)
 }
 
 
-AsChainTable::AsChainTable()
+const int AsChainTable::NUM_SHARDS;
+const size_t AsChainTable::ENTRY_BYTES;
+
+AsChainTable::AsChainTable() :
+  _memory_account(MemoryAccounting::account("as_chain_table"))
 {
-  pthread_mutex_init(&_lock, NULL);
 }
 
 
 AsChainTable::~AsChainTable()
 {
-  pthread_mutex_destroy(&_lock);
 }
 
 
@@ -366,32 +379,36 @@ AsChainTable::~AsChainTable()
 void AsChainTable::register_(AsChain* as_chain, std::vector<std::string>& tokens)
 {
   size_t len = as_chain->size() + 1;
-  pthread_mutex_lock(&_lock);
+  size_t first = tokens.size();
+  RandomToken::create(len, TOKEN_LENGTH, tokens);
 
   for (size_t i = 0; i < len; i++)
   {
-    std::string token;
-    Utils::create_random_token(TOKEN_LENGTH, token);
-    tokens.push_back(token);
-    _odi_token_map[token] = AsChainLink(as_chain, i);
+    const std::string& token = tokens[first + i];
+
+    Shard& token_shard = shard(token);
+    token_shard.lock.lock();
+    token_shard.odi_token_map[token] = AsChainLink(as_chain, i);
+    token_shard.lock.unlock();
   }
 
-  pthread_mutex_unlock(&_lock);
+  _memory_account->add(len * ENTRY_BYTES);
 }
 
 
 void AsChainTable::unregister(std::vector<std::string>& tokens)
 {
-  pthread_mutex_lock(&_lock);
-
   for (std::vector<std::string>::iterator it = tokens.begin();
        it != tokens.end();
        ++it)
   {
-    _odi_token_map.erase(*it);
-  }
+    Shard& token_shard = shard(*it);
+    token_shard.lock.lock();
+    size_t erased = token_shard.odi_token_map.erase(*it);
+    token_shard.lock.unlock();
 
-  pthread_mutex_unlock(&_lock);
+    _memory_account->remove(erased * ENTRY_BYTES);
+  }
 }
 
 
@@ -431,12 +448,13 @@ void AsChain::reset_chain(bool using_standard_ifcs)
 // is finished with the link.
 AsChainLink AsChainTable::lookup(const std::string& token)
 {
-  pthread_mutex_lock(&_lock);
-  std::map<std::string, AsChainLink>::const_iterator it =
-                                                    _odi_token_map.find(token);
-  if (it == _odi_token_map.end())
+  Shard& token_shard = shard(token);
+  token_shard.lock.lock();
+  std::unordered_map<std::string, AsChainLink>::const_iterator it =
+                                           token_shard.odi_token_map.find(token);
+  if (it == token_shard.odi_token_map.end())
   {
-    pthread_mutex_unlock(&_lock);
+    token_shard.lock.unlock();
     return AsChainLink(NULL, 0);
   }
   else
@@ -448,13 +466,14 @@ AsChainLink AsChainTable::lookup(const std::string& token)
       // Flag that the AS corresponding to the previous link in the chain has
       // effectively responded.
       as_chain_link._as_chain->_responsive[as_chain_link._index - 1] = true;
-      pthread_mutex_unlock(&_lock);
-      return as_chain_link;
+      AsChainLink found = as_chain_link;
+      token_shard.lock.unlock();
+      return found;
     } else {
       // Failed to increment the count - AS chain must be in the process of
       // being destroyed.  Pretend we didn't find it.
       // LCOV_EXCL_START - Can't hit this window condition in UT.
-      pthread_mutex_unlock(&_lock);
+      token_shard.lock.unlock();
       return AsChainLink(NULL, 0);
       // LCOV_EXCL_STOP
     }
@@ -22,6 +22,8 @@
 #include <rapidjson/stringbuffer.h>
 #include "rapidjson/error/en.h"
 #include "json_parse_utils.h"
+#include "stack.h"
+#include "dependency_monitor.h"
 #include <algorithm>
 
 // Constant table names.
@@ -30,6 +32,14 @@ const std::string AstaireImpiStore::TABLE_IMPI = "impi";
 // JSON field names and values.
 static const char* const JSON_AUTH_CHALLENGES = "authChallenges";
 
+// Compact binary records start with a zero byte (which can't start a JSON
+// record) followed by the version of the encoding.
+static const uint8_t BINARY_MARKER = 0;
+static const uint8_t BINARY_VERSION = 1;
+
+// Compact binary field tags.
+static const uint32_t TAG_AUTH_CHALLENGE = 1;
+
 std::string AstaireImpiStore::Impi::to_json()
 {
   // Build a writer, serialize the IMPI to it and return the result.
@@ -68,6 +78,78 @@ void AstaireImpiStore::Impi::write_json(rapidjson::Writer<rapidjson::StringBuffe
   // The private ID itself is part of the key, so isn't stored in the JSON itself.
 }
 
+std::string AstaireImpiStore::Impi::to_binary()
+{
+  // Write the header, and then each of the unexpired AuthChallenges as a
+  // nested record.
+  int now = time(NULL);
+  CompactEncoding::Writer writer;
+  writer.add_raw_byte(BINARY_MARKER);
+  writer.add_raw_byte(BINARY_VERSION);
+
+  for (std::vector<ImpiStore::AuthChallenge*>::iterator it = auth_challenges.begin();
+       it != auth_challenges.end();
+       it++)
+  {
+    if ((*it)->get_expires() > now)
+    {
+      CompactEncoding::Writer challenge_writer;
+      (*it)->write_binary(challenge_writer);
+      writer.add_record(TAG_AUTH_CHALLENGE, challenge_writer);
+    }
+  }
+
+  return writer.data();
+}
+
+bool AstaireImpiStore::is_binary(const std::string& data)
+{
+  return ((!data.empty()) && ((uint8_t)data[0] == BINARY_MARKER));
+}
+
+AstaireImpiStore::Impi* AstaireImpiStore::from_binary(const std::string& impi, const std::string& data)
+{
+  CompactEncoding::Reader reader(data);
+  uint8_t marker;
+  uint8_t version;
+
+  if ((!reader.read_raw_byte(marker)) ||
+      (marker != BINARY_MARKER) ||
+      (!reader.read_raw_byte(version)) ||
+      (version != BINARY_VERSION))
+  {
+    TRC_WARNING("Unrecognised binary IMPI version - dropping");
+    return NULL;
+  }
+
+  AstaireImpiStore::Impi* impi_obj = new AstaireImpiStore::Impi(impi);
+  uint32_t tag;
+  CompactEncoding::WireType type;
+  uint64_t uint_value;
+  std::string bytes_value;
+
+  while (reader.next(tag, type, uint_value, bytes_value))
+  {
+    if ((tag == TAG_AUTH_CHALLENGE) && (type == CompactEncoding::BYTES))
+    {
+      ImpiStore::AuthChallenge* auth_challenge =
+                           ImpiStore::AuthChallenge::from_binary(bytes_value);
+      if (auth_challenge != NULL)
+      {
+        impi_obj->auth_challenges.push_back(auth_challenge);
+      }
+    }
+  }
+
+  if (reader.error())
+  {
+    TRC_WARNING("Binary IMPI is badly formed - dropping");
+    delete impi_obj; impi_obj = NULL;
+  }
+
+  return impi_obj;
+}
+
 AstaireImpiStore::Impi* AstaireImpiStore::from_json(const std::string& impi, const std::string& json)
 {
   // Simply parse the string to JSON, and then call through to the
@@ -114,8 +196,12 @@ AstaireImpiStore::Impi* AstaireImpiStore::from_json(const std::string& impi, rap
   return impi_obj;
 }
 
-AstaireImpiStore::AstaireImpiStore(Store* data_store) :
-  _data_store(data_store)
+AstaireImpiStore::AstaireImpiStore(Store* data_store,
+                                   Serialization serialization,
+                                   SNMP::EventAccumulatorTable* latency_tbl) :
+  _data_store(data_store),
+  _serialization(serialization),
+  _latency_tbl(latency_tbl)
 {
 }
 
@@ -130,15 +216,34 @@ Store::Status AstaireImpiStore::set_impi(ImpiStore::Impi* impi,
   int now = time(NULL);
 
   // First serialize the IMPI and set it in the store.
-  std::string data = astaire_impi->to_json();
-  TRC_DEBUG("Storing IMPI for %s\n%s", impi->impi.c_str(), data.c_str());
+  std::string data;
+  Store::Format format;
+
+  if (_serialization == Serialization::BINARY)
+  {
+    data = astaire_impi->to_binary();
+    format = Store::Format::BINARY;
+    TRC_DEBUG("Storing IMPI for %s (%lu bytes binary)",
+              impi->impi.c_str(), data.length());
+  }
+  else
+  {
+    data = astaire_impi->to_json();
+    format = Store::Format::JSON;
+    TRC_DEBUG("Storing IMPI for %s\n%s", impi->impi.c_str(), data.c_str());
+  }
+
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
   Store::Status status = _data_store->set_data(TABLE_IMPI,
                                                astaire_impi->impi,
                                                data,
                                                astaire_impi->_cas,
                                                astaire_impi->get_expires() - now,
                                                trail,
-                                               Store::Format::JSON);
+                                               format);
+  accumulate_latency(stopWatch);
+
   if (status == Store::Status::OK)
   {
     SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_SET_SUCCESS, 0);
@@ -172,20 +277,36 @@ ImpiStore::Impi* AstaireImpiStore::get_impi(const std::string& impi,
   AstaireImpiStore::Impi* impi_obj = NULL;
   std::string data;
   uint64_t cas;
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
   Store::Status status = _data_store->get_data(TABLE_IMPI,
                                                impi,
                                                data,
                                                cas,
                                                trail,
-                                               Store::Format::JSON);
+                                               (_serialization == Serialization::BINARY) ?
+                                                 Store::Format::BINARY :
+                                                 Store::Format::JSON);
+  accumulate_latency(stopWatch);
+
   if (status == Store::Status::OK)
   {
-    TRC_DEBUG("Retrieved IMPI for %s\n%s", impi.c_str(), data.c_str());
     SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_GET_SUCCESS, 0);
     event.add_var_param(impi);
     SAS::report_event(event);
 
-    impi_obj = AstaireImpiStore::from_json(impi, data);
+    // Records may be in either format, whichever we're configured to write.
+    if (is_binary(data))
+    {
+      TRC_DEBUG("Retrieved IMPI for %s (%lu bytes binary)",
+                impi.c_str(), data.length());
+      impi_obj = AstaireImpiStore::from_binary(impi, data);
+    }
+    else
+    {
+      TRC_DEBUG("Retrieved IMPI for %s\n%s", impi.c_str(), data.c_str());
+      impi_obj = AstaireImpiStore::from_json(impi, data);
+    }
     if (impi_obj == NULL)
     {
       // IMPI was corrupt. Create a new one.
@@ -213,9 +334,13 @@ Store::Status AstaireImpiStore::delete_impi(ImpiStore::Impi* impi,
 {
   // First, delete the IMPI data from the store.
   TRC_DEBUG("Deleting IMPI for %s", impi->impi.c_str());
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
   Store::Status status = _data_store->delete_data(TABLE_IMPI,
                                                   impi->impi,
                                                   trail);
+  accumulate_latency(stopWatch);
+
   if (status == Store::Status::OK)
   {
     SAS::Event event(trail, SASEvent::IMPISTORE_IMPI_DELETE_SUCCESS, 0);
@@ -235,3 +360,22 @@ Store::Status AstaireImpiStore::delete_impi(ImpiStore::Impi* impi,
 
   return status;
 }
+
+void AstaireImpiStore::accumulate_latency(Utils::StopWatch& stopWatch)
+{
+  unsigned long latency_us = 0;
+
+  if (stopWatch.read(latency_us))
+  {
+    if (_latency_tbl != NULL)
+    {
+      _latency_tbl->accumulate(latency_us);
+    }
+
+    if (stack_data.dependency_monitor != NULL)
+    {
+      stack_data.dependency_monitor->request_complete(DependencyMonitor::STORE,
+                                                      latency_us);
+    }
+  }
+}
@@ -0,0 +1,328 @@
+/**
+ * @file async_dnsresolver.cpp class implementation for an asynchronous DNS
+ * resolver
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+///
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/nameser.h>
+#include <poll.h>
+
+#include "async_dnsresolver.h"
+#include "log.h"
+#include "sproutsasevent.h"
+
+// The longest time the event thread waits in poll if ares has no timeouts
+// pending (in milliseconds).
+static const int MAX_POLL_TIMEOUT_MS = 1000;
+
+// LCOV_EXCL_START - needs a real DNS server
+AsyncDNSResolver::AsyncDNSResolver(const std::vector<struct IP46Address>& servers) :
+  _terminated(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  DNSResolver::init_channel(&_channel, _ares_addrs, servers);
+
+  if (pipe(_wake_pipe) != 0)
+  {
+    TRC_ERROR("Failed to create wake pipe for DNS resolver: %s", strerror(errno));
+    _wake_pipe[0] = -1;
+    _wake_pipe[1] = -1;
+  }
+  else
+  {
+    fcntl(_wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+
+  int rc = pthread_create(&_thread, NULL, &AsyncDNSResolver::event_thread, this);
+
+  if (rc != 0)
+  {
+    TRC_ERROR("Failed to create DNS resolver thread: %s", strerror(rc));
+  }
+}
+
+
+AsyncDNSResolver::~AsyncDNSResolver()
+{
+  // Stop the event thread.
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_mutex_unlock(&_lock);
+  wake_event_thread();
+  pthread_join(_thread, NULL);
+
+  // Destroying the channel fails any outstanding queries, so their callbacks
+  // are still run.
+  pthread_mutex_lock(&_lock);
+  ares_destroy(_channel);
+  std::vector<PendingQuery*> completed;
+  completed.swap(_completed);
+  pthread_mutex_unlock(&_lock);
+
+  complete_queries(completed);
+
+  close(_wake_pipe[0]);
+  close(_wake_pipe[1]);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void AsyncDNSResolver::perform_naptr_query(const std::string& domain,
+                                           NaptrCallback callback,
+                                           SAS::TrailId trail)
+{
+  // Log the query.
+  SAS::Event event(trail, SASEvent::TX_ENUM_REQ, 0);
+  event.add_var_param(domain);
+  SAS::report_event(event);
+
+  Waiter waiter = {callback, trail};
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, PendingQuery*>::iterator it = _pending.find(domain);
+
+  if (it != _pending.end())
+  {
+    // There's already a query in flight for this domain, so just wait for its
+    // result.
+    TRC_DEBUG("Joining in-flight DNS NAPTR query for %s", domain.c_str());
+    it->second->waiters.push_back(waiter);
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+
+  PendingQuery* query = new PendingQuery();
+  query->resolver = this;
+  query->domain = domain;
+  query->waiters.push_back(waiter);
+  query->status = ARES_SUCCESS;
+  query->naptr_reply = NULL;
+  query->ttl = 0;
+  _pending[domain] = query;
+
+  // Send the query.  ares may call the callback immediately (for example if
+  // the query can't be sent), in which case the query is just added to the
+  // completed list.
+  TRC_DEBUG("Sending DNS NAPTR query for %s", domain.c_str());
+  ares_query(_channel,
+             domain.c_str(),
+             ns_c_in,
+             ns_t_naptr,
+             AsyncDNSResolver::ares_callback,
+             query);
+
+  pthread_mutex_unlock(&_lock);
+
+  wake_event_thread();
+}
+
+
+void* AsyncDNSResolver::event_thread(void* p)
+{
+  ((AsyncDNSResolver*)p)->event_loop();
+  return NULL;
+}
+
+
+void AsyncDNSResolver::event_loop()
+{
+  while (true)
+  {
+    pthread_mutex_lock(&_lock);
+
+    if (_terminated)
+    {
+      pthread_mutex_unlock(&_lock);
+      break;
+    }
+
+    // Call into ares to get details of the sockets it's using.
+    ares_socket_t scks[ARES_GETSOCK_MAXNUM];
+    int rw_bits = ares_getsock(_channel, scks, ARES_GETSOCK_MAXNUM);
+
+    // Translate these sockets into pollfd structures.  The first entry is
+    // always the wake pipe.
+    int num_fds = 1;
+    struct pollfd fds[ARES_GETSOCK_MAXNUM + 1];
+    fds[0].fd = _wake_pipe[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+
+    for (int sck_idx = 0; sck_idx < ARES_GETSOCK_MAXNUM; sck_idx++)
+    {
+      struct pollfd* fd = &fds[num_fds];
+      fd->fd = scks[sck_idx];
+      fd->events = 0;
+      fd->revents = 0;
+      if (ARES_GETSOCK_READABLE(rw_bits, sck_idx))
+      {
+        fd->events |= POLLRDNORM | POLLIN;
+      }
+      if (ARES_GETSOCK_WRITABLE(rw_bits, sck_idx))
+      {
+        fd->events |= POLLWRNORM | POLLOUT;
+      }
+      if (fd->events != 0)
+      {
+        num_fds++;
+      }
+    }
+
+    // Calculate the timeout.
+    struct timeval max_tv;
+    max_tv.tv_sec = MAX_POLL_TIMEOUT_MS / 1000;
+    max_tv.tv_usec = (MAX_POLL_TIMEOUT_MS % 1000) * 1000;
+    struct timeval tv;
+    struct timeval* tvp = ares_timeout(_channel, &max_tv, &tv);
+
+    pthread_mutex_unlock(&_lock);
+
+    // Wait for events on these file descriptors.
+    int rc = poll(fds, num_fds, tvp->tv_sec * 1000 + tvp->tv_usec / 1000);
+
+    if (fds[0].revents != 0)
+    {
+      // Drain the wake pipe.
+      char buf[64];
+      while (read(_wake_pipe[0], buf, sizeof(buf)) > 0)
+      {
+      }
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    if (rc > 0)
+    {
+      for (int fd_idx = 1; fd_idx < num_fds; fd_idx++)
+      {
+        struct pollfd* fd = &fds[fd_idx];
+        if (fd->revents != 0)
+        {
+          // Call into ares to notify it of the event.  The interface requires
+          // that we pass separate file descriptors for read and write events
+          // or ARES_SOCKET_BAD if no event has occurred.
+          ares_process_fd(_channel,
+                          fd->revents & (POLLRDNORM | POLLIN) ? fd->fd : ARES_SOCKET_BAD,
+                          fd->revents & (POLLWRNORM | POLLOUT) ? fd->fd : ARES_SOCKET_BAD);
+        }
+      }
+    }
+
+    // Call into ares with no file descriptor to let it handle timeouts.
+    ares_process_fd(_channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+
+    std::vector<PendingQuery*> completed;
+    completed.swap(_completed);
+
+    pthread_mutex_unlock(&_lock);
+
+    complete_queries(completed);
+  }
+}
+
+
+void AsyncDNSResolver::ares_callback(void* arg,
+                                     int status,
+                                     int timeouts,
+                                     unsigned char* abuf,
+                                     int alen)
+{
+  PendingQuery* query = (PendingQuery*)arg;
+  query->resolver->ares_callback(query, status, abuf, alen);
+}
+
+
+void AsyncDNSResolver::ares_callback(PendingQuery* query,
+                                     int status,
+                                     unsigned char* abuf,
+                                     int alen)
+{
+  query->status = status;
+
+  if (status == ARES_SUCCESS)
+  {
+    // Log that we've succeeded to every trail waiting for this query.
+    for (const Waiter& waiter : query->waiters)
+    {
+      SAS::Event event(waiter.trail, SASEvent::RX_ENUM_RSP, 0);
+      event.add_var_param(query->domain);
+      event.add_var_param(alen, abuf);
+      SAS::report_event(event);
+    }
+
+    // Parse the reply.
+    query->status = ares_parse_naptr_reply(abuf, alen, &query->naptr_reply);
+    if (query->status != ARES_SUCCESS)
+    {
+      TRC_WARNING("Unparseable DNS ENUM response from host %s: %s", query->domain.c_str(), ares_strerror(query->status));
+    }
+  }
+  else
+  {
+    // Log that we've failed.
+    TRC_WARNING("DNS ENUM query failed for host %s: %s", query->domain.c_str(), ares_strerror(status));
+
+    for (const Waiter& waiter : query->waiters)
+    {
+      SAS::Event event(waiter.trail, SASEvent::RX_ENUM_ERR, 0);
+      event.add_static_param(status);
+      event.add_var_param(query->domain);
+      SAS::report_event(event);
+    }
+  }
+
+  query->ttl = DNSResolver::parse_ttl(query->status, abuf, alen);
+
+  // This query is no longer in flight, so a new query for the same domain
+  // must go to the DNS server.
+  _pending.erase(query->domain);
+  _completed.push_back(query);
+}
+
+
+void AsyncDNSResolver::complete_queries(std::vector<PendingQuery*>& completed)
+{
+  for (PendingQuery* query : completed)
+  {
+    for (const Waiter& waiter : query->waiters)
+    {
+      waiter.callback(query->status, query->naptr_reply, query->ttl);
+    }
+
+    if (query->naptr_reply != NULL)
+    {
+      ares_free_data(query->naptr_reply);
+      query->naptr_reply = NULL;
+    }
+
+    delete query;
+  }
+
+  completed.clear();
+}
+
+
+void AsyncDNSResolver::wake_event_thread()
+{
+  char wake = 0;
+  if (write(_wake_pipe[1], &wake, 1) < 0)
+  {
+    // The pipe is full, so the event thread already has a wake up pending.
+    TRC_DEBUG("DNS resolver wake pipe is full");
+  }
+}
+// LCOV_EXCL_STOP
@@ -0,0 +1,133 @@
+/**
+ * @file auth_timeout_batcher.cpp Implementation of AuthTimeoutBatcher.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+#include "auth_timeout_batcher.h"
+#include "log.h"
+
+AuthTimeoutBatcher::AuthTimeoutBatcher(ChronosConnection* chronos,
+                                       int interval_ms) :
+  _chronos(chronos),
+  _interval_ms(std::min(std::max(1, interval_ms), MAX_INTERVAL_MS)),
+  _terminated(false)
+{
+  TRC_STATUS("Setting authentication timeout timers every %dms", _interval_ms);
+  _flusher = std::thread(&AuthTimeoutBatcher::flusher, this);
+}
+
+AuthTimeoutBatcher::~AuthTimeoutBatcher()
+{
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _terminated = true;
+    _cond.notify_all();
+  }
+
+  if (_flusher.joinable())
+  {
+    _flusher.join();
+  }
+}
+
+void AuthTimeoutBatcher::add_challenge(const std::string& impi,
+                                       const std::string& impu,
+                                       const std::string& nonce,
+                                       SAS::TrailId trail)
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  _batch[impi + '\0' + nonce] = Challenge{impi, impu, nonce, trail};
+}
+
+void AuthTimeoutBatcher::remove_challenge(const std::string& impi,
+                                          const std::string& nonce)
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  _batch.erase(impi + '\0' + nonce);
+}
+
+void AuthTimeoutBatcher::flush()
+{
+  std::map<std::string, Challenge> batch;
+
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    batch.swap(_batch);
+  }
+
+  if (batch.empty())
+  {
+    return;
+  }
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.String("challenges");
+  writer.StartArray();
+
+  for (const std::pair<const std::string, Challenge>& entry : batch)
+  {
+    writer.StartObject();
+    writer.String("impi"); writer.String(entry.second.impi.c_str());
+    writer.String("impu"); writer.String(entry.second.impu.c_str());
+    writer.String("nonce"); writer.String(entry.second.nonce.c_str());
+    writer.EndObject();
+  }
+
+  writer.EndArray();
+  writer.EndObject();
+
+  // The timer is logged on the first challenge's trail - each challenge is
+  // correlated to its own trail when the timer pops.
+  TRC_DEBUG("Set Chronos timer for %lu authentication challenges", batch.size());
+  std::string timer_id;
+  HTTPCode status = _chronos->send_post(timer_id,
+                                        TIMEOUT_S,
+                                        "/authentication-timeout",
+                                        sb.GetString(),
+                                        batch.begin()->second.trail);
+
+  if (status != HTTP_OK)
+  {
+    TRC_WARNING("Failed to set Chronos timer for %lu authentication challenges: %d",
+                batch.size(),
+                status);
+  }
+}
+
+void AuthTimeoutBatcher::flusher()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+  while (!_terminated)
+  {
+    next += std::chrono::milliseconds(_interval_ms);
+    while ((!_terminated) && (std::chrono::steady_clock::now() < next))
+    {
+      _cond.wait_until(lock, next);
+    }
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    // Set the timer without the lock held.
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
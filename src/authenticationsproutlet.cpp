@@ -16,6 +16,8 @@
 #include <openssl/hmac.h>
 #include "base64.h"
 #include "scscf_utils.h"
+#include "batch_utils.h"
+#include "random_token.h"
 
 // Configuring PJSIP with a realm of "*" means that all realms are considered.
 const pj_str_t WILDCARD_REALM = pj_str((char*)"*");
@@ -59,16 +61,30 @@ AuthenticationSproutlet::AuthenticationSproutlet(const std::string& name,
                                                  AnalyticsLogger* analytics_logger,
                                                  SNMP::AuthenticationStatsTables* auth_stats_tbls,
                                                  bool nonce_count_supported_arg,
-                                                 int cfg_max_expires) :
+                                                 int cfg_max_expires,
+                                                 ExceptionHandler* exception_handler,
+                                                 int challenge_write_threads,
+                                                 int challenge_cache_ttl,
+                                                 int remote_store_timeout_ms,
+                                                 int av_prefetch_count,
+                                                 int av_prefetch_ttl,
+                                                 int credential_cache_ttl,
+                                                 int auth_timeout_batch_ms) :
   Sproutlet(name, port, uri, "", aliases, NULL, NULL, network_function),
   _aka_realm((realm_name != "") ?
     pj_strdup3(stack_data.pool, realm_name.c_str()) :
     stack_data.local_host),
   _hss(hss_connection),
   _chronos(chronos_connection),
+  _auth_timeout_batcher(NULL),
   _acr_factory(rfacr_factory),
   _impi_store(_impi_store),
   _remote_impi_stores(remote_impi_stores),
+  _remote_store_timeout_ms(remote_store_timeout_ms),
+  _challenge_writer(NULL),
+  _av_prefetcher(NULL),
+  _credential_cache(NULL),
+  _credential_cache_ttl(credential_cache_ttl),
   _analytics(analytics_logger),
   _auth_stats_tables(auth_stats_tbls),
   _nonce_count_supported(nonce_count_supported_arg),
@@ -76,9 +92,55 @@ AuthenticationSproutlet::AuthenticationSproutlet(const std::string& name,
   _non_register_auth_mode(non_register_auth_mode_param),
   _next_hop_service(next_hop_service)
 {
+  if (challenge_write_threads > 0)
+  {
+    _challenge_writer =
+      new ImpiChallengeWriter([this](const std::string& impi,
+                                     ImpiStore::AuthChallenge* auth_challenge,
+                                     SAS::TrailId trail)
+                              {
+                                return write_challenge_to_stores(impi,
+                                                                 auth_challenge,
+                                                                 NULL,
+                                                                 trail);
+                              },
+                              challenge_write_threads,
+                              challenge_cache_ttl,
+                              CHALLENGE_CACHE_SIZE,
+                              exception_handler);
+  }
+
+  if (av_prefetch_count > 0)
+  {
+    _av_prefetcher = new AvPrefetcher(hss_connection,
+                                      av_prefetch_count,
+                                      av_prefetch_ttl,
+                                      AV_PREFETCH_MAX_IMPIS);
+  }
+
+  if ((auth_timeout_batch_ms > 0) && (chronos_connection != NULL))
+  {
+    _auth_timeout_batcher = new AuthTimeoutBatcher(chronos_connection,
+                                                   auth_timeout_batch_ms);
+  }
+
+  if (credential_cache_ttl > 0)
+  {
+    _credential_cache =
+      new ShardedLRUCache<std::string, std::shared_ptr<const ImpiStore::AuthChallenge>>(
+                                                 CREDENTIAL_CACHE_SIZE,
+                                                 CREDENTIAL_CACHE_SHARDS,
+                                                 ShardedLRUCacheStatsTables());
+  }
 }
 
-AuthenticationSproutlet::~AuthenticationSproutlet() {}
+AuthenticationSproutlet::~AuthenticationSproutlet()
+{
+  delete _auth_timeout_batcher; _auth_timeout_batcher = NULL;
+  delete _credential_cache; _credential_cache = NULL;
+  delete _av_prefetcher; _av_prefetcher = NULL;
+  delete _challenge_writer; _challenge_writer = NULL;
+}
 
 bool AuthenticationSproutlet::init()
 {
@@ -495,7 +557,31 @@ AuthenticationVector* AuthenticationSproutletTsx::get_av_from_store(const std::s
 {
   AuthenticationVector* av = nullptr;
 
-  ImpiStore::Impi* impi_obj = _authentication->read_impi(impi, trail());
+  ImpiStore::AuthChallenge* cached = _authentication->find_credentials(impi, nonce);
+
+  if (cached != nullptr)
+  {
+    // Only digest challenges are cached.
+    ImpiStore::DigestAuthChallenge* digest_challenge =
+      dynamic_cast<ImpiStore::DigestAuthChallenge*>(cached);
+
+    DigestAv* digest_av = new DigestAv();
+    digest_av->qop = digest_challenge->get_qop();
+    digest_av->realm = digest_challenge->get_realm();
+    digest_av->ha1 = digest_challenge->get_ha1();
+    delete cached;
+
+    // We haven't read the IMPI from the store, so the caller must read it
+    // when it writes its challenge.
+    if (out_impi_obj != nullptr)
+    {
+      *out_impi_obj = nullptr;
+    }
+
+    return digest_av;
+  }
+
+  ImpiStore::Impi* impi_obj = _authentication->read_impi(impi, nonce, trail());
 
   if (impi_obj != nullptr)
   {
@@ -570,19 +656,34 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
   {
     // This is either a REGISTER, or a request that Sprout should authenticate
     // by treating it like a REGISTER. Get the Authentication Vector from the
-    // HSS.
+    // HSS (or one we've already fetched from it, if AVs are prefetched).
     PJUtils::get_impi_and_impu(req, impi, impu_for_hss, get_pool(req), trail());
     TRC_DEBUG("Get AV from HSS for impi=%s impu=%s",
               impi.c_str(), impu_for_hss.c_str());
 
     rapidjson::Document* doc = NULL;
-    HTTPCode http_code = _authentication->_hss->get_auth_vector(impi,
-                                                                impu_for_hss,
-                                                                auth_type,
-                                                                resync,
-                                                                _scscf_uri,
-                                                                doc,
-                                                                trail());
+    HTTPCode http_code;
+
+    if (_authentication->_av_prefetcher != NULL)
+    {
+      http_code = _authentication->_av_prefetcher->get_auth_vector(impi,
+                                                                   impu_for_hss,
+                                                                   auth_type,
+                                                                   resync,
+                                                                   _scscf_uri,
+                                                                   doc,
+                                                                   trail());
+    }
+    else
+    {
+      http_code = _authentication->_hss->get_auth_vector(impi,
+                                                         impu_for_hss,
+                                                         auth_type,
+                                                         resync,
+                                                         _scscf_uri,
+                                                         doc,
+                                                         trail());
+    }
     av_source_unavailable = ((http_code == HTTP_SERVER_UNAVAILABLE) ||
                              (http_code == HTTP_GATEWAY_TIMEOUT));
 
@@ -650,7 +751,7 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
     // Digest authentication).
     hdr->scheme = STR_DIGEST;
     pj_pool_t* rsp_pool = get_pool(rsp);
-    pj_create_random_string(buf, sizeof(buf));
+    RandomToken::create_hex(buf, sizeof(buf));
     pj_strdup(rsp_pool, &hdr->challenge.digest.opaque, &random);
 
     // Log the opaque value to SAS to enable us to correlate this challenge
@@ -757,7 +858,7 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
 
       pj_strdup2(rsp_pool, &hdr->challenge.digest.realm, digest->realm.c_str());
       hdr->challenge.digest.algorithm = STR_MD5;
-      pj_create_random_string(buf, sizeof(buf));
+      RandomToken::create_hex(buf, sizeof(buf));
       nonce.assign(buf, sizeof(buf));
       pj_strdup(rsp_pool, &hdr->challenge.digest.nonce, &random);
       pj_strdup2(rsp_pool, &hdr->challenge.digest.qop, digest->qop.c_str());
@@ -794,7 +895,15 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
     std::string nonce = auth_challenge->get_nonce();
 
     // Create a timer to track the authentication challenge expiry.
-    if ((!impu_for_hss.empty()) && (_authentication->_chronos))
+    if ((!impu_for_hss.empty()) && (_authentication->_auth_timeout_batcher))
+    {
+      TRC_DEBUG("Add challenge to the next AUTHENTICATION_TIMEOUT timer");
+      _authentication->_auth_timeout_batcher->add_challenge(impi,
+                                                            impu_for_hss,
+                                                            nonce,
+                                                            trail());
+    }
+    else if ((!impu_for_hss.empty()) && (_authentication->_chronos))
     {
       TRC_DEBUG("Set chronos timer for AUTHENTICATION_TIMEOUT SAR");
 
@@ -838,6 +947,11 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
     if (status == Store::OK)
     {
       TRC_DEBUG("Successfully stored nonce %s in memcached", nonce.c_str());
+
+      if (req->line.req.method.id != PJSIP_REGISTER_METHOD)
+      {
+        _authentication->cache_credentials(impi, auth_challenge);
+      }
     }
     else
     {
@@ -851,6 +965,11 @@ void AuthenticationSproutletTsx::create_challenge(pjsip_digest_credential* crede
       // Also attempt to delete the chronos timer we stored for this challenge.
       // This stops the a timer pop not finding an AV, and triggering a cycle of
       // timer pops in every site attempting to find an AV that never existed.
+      if (_authentication->_auth_timeout_batcher)
+      {
+        _authentication->_auth_timeout_batcher->remove_challenge(impi, nonce);
+      }
+
       if ((_authentication->_chronos) && (auth_challenge->get_timer_id() != ""))
       {
         HTTPCode status;
@@ -929,7 +1048,29 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
   {
     std::string impi = PJUtils::pj_str_to_string(&credentials->username);
     std::string nonce = PJUtils::pj_str_to_string(&credentials->nonce);
-    impi_obj = _authentication->read_impi(impi, trail());
+
+    // Non-REGISTERs are usually responses to challenges that this node has
+    // issued or verified, so check the credential cache before the store.
+    bool cached_challenge = false;
+
+    if (!is_register)
+    {
+      ImpiStore::AuthChallenge* cached =
+                             _authentication->find_credentials(impi, nonce);
+
+      if (cached != NULL)
+      {
+        impi_obj = new ImpiStore::Impi(impi);
+        impi_obj->auth_challenges.push_back(cached);
+        cached_challenge = true;
+      }
+    }
+
+    if (impi_obj == NULL)
+    {
+      impi_obj = _authentication->read_impi(impi, nonce, trail());
+    }
+
     ImpiStore::AuthChallenge* auth_challenge = NULL;
     if (impi_obj != NULL)
     {
@@ -1046,6 +1187,23 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
                                       &sc,
                                       (void*)auth_challenge);
 
+      if ((status == PJ_SUCCESS) &&
+          (auth_challenge != NULL) &&
+          (cached_challenge) &&
+          (!_authentication->claim_nonce_count(impi, nonce, nonce_count)))
+      {
+        // A response with this nonce count has been accepted since we looked
+        // up the challenge - this might be a replay attack.
+        TRC_INFO("Nonce count supplied (%d) has already been accepted - ignore it",
+                 nonce_count);
+        SAS::Event event(trail(), SASEvent::AUTHENTICATION_NC_TOO_LOW, 0);
+        event.add_static_param(nonce_count);
+        event.add_static_param(nonce_count + 1);
+        SAS::report_event(event);
+
+        status = PJSIP_EAUTHACCNOTFOUND;
+      }
+
       if ((status == PJ_SUCCESS) && (auth_challenge != NULL))
       {
         // The authentication information in the request was verified.
@@ -1066,6 +1224,12 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 
         // The challenge has been authenticated against successfully, so we can
         // remove the Chronos timer set at creation to trigger expiry, if present.
+        if (_authentication->_auth_timeout_batcher)
+        {
+          _authentication->_auth_timeout_batcher->remove_challenge(impi,
+                                                                   auth_challenge->get_nonce());
+        }
+
         if ((_authentication->_chronos) && (auth_challenge->get_timer_id() != ""))
         {
           HTTPCode status;
@@ -1102,9 +1266,22 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
           }
         }
 
-        // Write the challenge back to the store.
+        // Write the challenge back to the store.  If the challenge came from
+        // the credential cache then we haven't read the IMPI from the store.
         Store::Status store_status =
-          _authentication->write_challenge(impi, auth_challenge, impi_obj, trail());
+          _authentication->write_challenge(impi,
+                                           auth_challenge,
+                                           cached_challenge ? NULL : impi_obj,
+                                           trail());
+
+        // Cache the challenge with its new nonce count if it may be used to
+        // authenticate non-REGISTER requests.
+        if ((!is_register) ||
+            (_authentication->_non_register_auth_mode &
+                NonRegisterAuthentication::INITIAL_REQ_FROM_REG_DIGEST_ENDPOINT))
+        {
+          _authentication->cache_credentials(impi, auth_challenge);
+        }
 
         if (store_status != Store::OK)
         {
@@ -1293,7 +1470,7 @@ void AuthenticationSproutletTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
   if (_authenticated_using_sip_digest)
   {
     pjsip_routing_hdr* sr_hdr = (pjsip_routing_hdr*)
-      pjsip_msg_find_hdr_by_name(rsp, &STR_SERVICE_ROUTE, nullptr);
+      PJUtils::find_hdr_by_name(rsp, &STR_SERVICE_ROUTE, nullptr);
 
     if (sr_hdr != nullptr)
     {
@@ -1302,8 +1479,12 @@ void AuthenticationSproutletTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
       TRC_DEBUG("Add parameters to Service-Route username=%s, nonce=%s",
                 escaped_username.c_str(), escaped_nonce.c_str());
 
+      // The registrar may share the Service-Route URI between responses, so
+      // clone it before adding the parameters.
       pj_pool_t* pool = get_pool(rsp);
-      pjsip_sip_uri* sr_uri = (pjsip_sip_uri*)pjsip_uri_get_uri(&sr_hdr->name_addr);
+      pjsip_sip_uri* sr_uri = (pjsip_sip_uri*)
+        pjsip_uri_clone(pool, pjsip_uri_get_uri(&sr_hdr->name_addr));
+      sr_hdr->name_addr.uri = (pjsip_uri*)sr_uri;
 
       pjsip_param *username_param = PJ_POOL_ALLOC_T(pool, pjsip_param);
       pj_strdup(pool, &username_param->name, &STR_USERNAME);
@@ -1326,22 +1507,163 @@ Store::Status AuthenticationSproutlet::write_challenge(const std::string& impi,
                                                        ImpiStore::Impi* impi_obj,
                                                        SAS::TrailId trail)
 {
-  Store::Status status = write_challenge_to_store(_impi_store,
-                                                  impi,
-                                                  auth_challenge,
-                                                  impi_obj,
-                                                  trail);
+  if (_challenge_writer != NULL)
+  {
+    // The IMPI object is ignored, as it may be out of date by the time the
+    // write is made (or may have come from the writer's cache).
+    TRC_DEBUG("Queue write of challenge for %s", impi.c_str());
+    _challenge_writer->write(impi, auth_challenge, trail);
+    return Store::OK;
+  }
+
+  return write_challenge_to_stores(impi, auth_challenge, impi_obj, trail);
+}
+
 
-  if ((status == Store::OK) && !_remote_impi_stores.empty())
+void AuthenticationSproutlet::cache_credentials(const std::string& impi,
+                                                ImpiStore::AuthChallenge* auth_challenge)
+{
+  if ((_credential_cache == NULL) ||
+      (auth_challenge->get_type() != ImpiStore::AuthChallenge::Type::DIGEST))
   {
-    TRC_DEBUG("Replicate challenge to backup stores");
+    return;
+  }
 
-    for (ImpiStore* store: _remote_impi_stores)
-    {
-      write_challenge_to_store(store, impi, auth_challenge, impi_obj, trail);
-    }
+  TRC_DEBUG("Cache credentials for %s/%s",
+            impi.c_str(), auth_challenge->get_nonce().c_str());
+
+  std::string key = impi + '\0' + auth_challenge->get_nonce();
+  ImpiStore::AuthChallenge* copy = auth_challenge->clone();
+  std::shared_ptr<const ImpiStore::AuthChallenge> cached;
+
+  std::lock_guard<std::mutex> lock(_credential_cache_lock);
+
+  if (_credential_cache->get(key, cached))
+  {
+    // Don't move the nonce count back if a later response has been accepted
+    // in the meantime.
+    ImpiStore::AuthChallenge* current = cached->clone();
+    copy->set_nonce_count(std::max(copy->get_nonce_count(),
+                                   current->get_nonce_count()));
+    delete current;
+  }
+
+  _credential_cache->put(key,
+                         std::shared_ptr<const ImpiStore::AuthChallenge>(copy),
+                         credential_cache_ttl(copy));
+}
+
+ImpiStore::AuthChallenge* AuthenticationSproutlet::find_credentials(const std::string& impi,
+                                                                    const std::string& nonce)
+{
+  std::shared_ptr<const ImpiStore::AuthChallenge> auth_challenge;
+
+  if ((_credential_cache != NULL) &&
+      (_credential_cache->get(impi + '\0' + nonce, auth_challenge)))
+  {
+    TRC_DEBUG("Found cached credentials for %s/%s", impi.c_str(), nonce.c_str());
+    return auth_challenge->clone();
+  }
+
+  return NULL;
+}
+
+bool AuthenticationSproutlet::claim_nonce_count(const std::string& impi,
+                                                const std::string& nonce,
+                                                uint32_t nonce_count)
+{
+  if (_credential_cache == NULL)
+  {
+    return true;
+  }
+
+  std::string key = impi + '\0' + nonce;
+  std::shared_ptr<const ImpiStore::AuthChallenge> cached;
+
+  std::lock_guard<std::mutex> lock(_credential_cache_lock);
+
+  if (!_credential_cache->get(key, cached))
+  {
+    // The challenge has dropped out of the cache, so there's nothing to check
+    // against (the store still gets the new nonce count written to it).
+    return true;
+  }
+
+  ImpiStore::AuthChallenge* auth_challenge = cached->clone();
+  bool claimed = (auth_challenge->get_nonce_count() <= nonce_count);
+
+  if (claimed)
+  {
+    auth_challenge->set_nonce_count(nonce_count + 1);
+    _credential_cache->put(key,
+                           std::shared_ptr<const ImpiStore::AuthChallenge>(auth_challenge),
+                           credential_cache_ttl(auth_challenge));
+  }
+  else
+  {
+    delete auth_challenge;
+  }
+
+  return claimed;
+}
+
+int AuthenticationSproutlet::credential_cache_ttl(ImpiStore::AuthChallenge* auth_challenge)
+{
+  // Never cache the challenge for longer than it lives in the store.
+  return std::min(_credential_cache_ttl,
+                  auth_challenge->get_expires() - (int)time(NULL));
+}
+
+Store::Status AuthenticationSproutlet::write_challenge_to_stores(const std::string& impi,
+                                                                 ImpiStore::AuthChallenge* auth_challenge,
+                                                                 ImpiStore::Impi* impi_obj,
+                                                                 SAS::TrailId trail)
+{
+  Store::Status status = Store::OK;
+
+  if (_remote_impi_stores.empty())
+  {
+    return write_challenge_to_store(_impi_store,
+                                    impi,
+                                    auth_challenge,
+                                    impi_obj,
+                                    trail);
+  }
+
+  // Write to the local and remote stores in parallel, rather than paying for
+  // the round trip to each site in turn.  Each remote write has its own copy
+  // of the challenge and reads the IMPI from its own store, as it may outlive
+  // this call if the remote store is slow.
+  TRC_DEBUG("Replicate challenge to backup stores");
+  std::vector<BatchUtils::SiteOperation> remote_ops;
+
+  for (size_t ii = 0; ii < _remote_impi_stores.size(); ++ii)
+  {
+    ImpiStore* store = _remote_impi_stores[ii];
+    std::shared_ptr<ImpiStore::AuthChallenge> challenge(auth_challenge->clone());
+
+    remote_ops.push_back({"remote site " + std::to_string(ii + 1),
+                          [this, store, impi, challenge, trail]()
+                          {
+                            write_challenge_to_store(store,
+                                                     impi,
+                                                     challenge.get(),
+                                                     NULL,
+                                                     trail);
+                          }});
   }
 
+  BatchUtils::run_at_sites([&]()
+                           {
+                             status = write_challenge_to_store(_impi_store,
+                                                               impi,
+                                                               auth_challenge,
+                                                               impi_obj,
+                                                               trail);
+                           },
+                           remote_ops,
+                           _remote_store_timeout_ms);
+
   return status;
 }
 
@@ -1429,8 +1751,22 @@ Store::Status AuthenticationSproutlet::
 }
 
 ImpiStore::Impi* AuthenticationSproutlet::read_impi(const std::string& impi,
+                                                    const std::string& nonce,
                                                     SAS::TrailId trail)
 {
+  if (_challenge_writer != NULL)
+  {
+    ImpiStore::AuthChallenge* auth_challenge = _challenge_writer->find(impi, nonce);
+
+    if (auth_challenge != NULL)
+    {
+      TRC_DEBUG("Found recently written challenge for IMPI %s", impi.c_str());
+      ImpiStore::Impi* impi_obj = new ImpiStore::Impi(impi);
+      impi_obj->auth_challenges.push_back(auth_challenge);
+      return impi_obj;
+    }
+  }
+
   TRC_DEBUG("Lookup IMPI object: impi=%s", impi.c_str());
   ImpiStore::Impi* impi_obj = _impi_store->get_impi(impi, trail);
 
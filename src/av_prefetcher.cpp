@@ -0,0 +1,286 @@
+/**
+ * @file av_prefetcher.cpp Implementation of AvPrefetcher.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+
+#include "av_prefetcher.h"
+#include "log.h"
+
+AvPrefetcher::AvPrefetcher(HSSConnection* hss,
+                           int pool_size,
+                           int ttl,
+                           size_t max_impis) :
+  _hss(hss),
+  _pool_size(pool_size),
+  _max_impis(max_impis),
+  _state(new State())
+{
+  _state->next_generation = 0;
+  _state->ttl_ms = ttl * 1000;
+}
+
+AvPrefetcher::~AvPrefetcher()
+{
+  // Background requests hold a reference to the state, so just empty it - any
+  // AVs that arrive later are discarded.
+  std::lock_guard<std::mutex> lock(_state->lock);
+
+  while (!_state->entries.empty())
+  {
+    erase_entry(_state.get(), _state->entries.begin());
+  }
+}
+
+HTTPCode AvPrefetcher::get_auth_vector(const std::string& private_user_id,
+                                       const std::string& public_user_id,
+                                       const std::string& auth_type,
+                                       const std::string& resync_auth,
+                                       const std::string& server_name,
+                                       rapidjson::Document*& av,
+                                       SAS::TrailId trail)
+{
+  if (!resync_auth.empty())
+  {
+    // The HSS moves the subscriber's SQN on as part of the resync, so any AKA
+    // vectors we already have are no use.
+    TRC_DEBUG("Discard prefetched AVs for %s on resync",
+              private_user_id.c_str());
+    invalidate(private_user_id);
+  }
+
+  std::string entry_key = key(private_user_id,
+                              public_user_id,
+                              auth_type,
+                              server_name);
+  av = NULL;
+  int to_fetch = 0;
+  uint64_t generation = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(_state->lock);
+    std::map<std::string, Entry>::iterator entry =
+                                              _state->entries.find(entry_key);
+
+    if (entry == _state->entries.end())
+    {
+      if ((_state->entries.size() >= _max_impis) && (!_state->lru.empty()))
+      {
+        erase_entry(_state.get(), _state->entries.find(_state->lru.back()));
+      }
+
+      entry = _state->entries.emplace(entry_key, Entry()).first;
+      entry->second.in_flight = 0;
+      entry->second.generation = _state->next_generation++;
+      entry->second.lru = _state->lru.insert(_state->lru.begin(), entry_key);
+    }
+    else
+    {
+      _state->lru.splice(_state->lru.begin(), _state->lru, entry->second.lru);
+    }
+
+    // Take the oldest unexpired AV, throwing away any expired ones.
+    unsigned long now = now_ms();
+    std::deque<PooledAv>& avs = entry->second.avs;
+
+    while ((!avs.empty()) && (av == NULL))
+    {
+      PooledAv pooled = avs.front();
+      avs.pop_front();
+
+      if (pooled.expiry_ms > now)
+      {
+        av = pooled.av;
+      }
+      else
+      {
+        delete pooled.av;
+      }
+    }
+
+    // Work out how many AVs to request to fill the pool back up, and reserve
+    // them now so that concurrent challenges don't request them too.
+    to_fetch = _pool_size - (int)avs.size() - entry->second.in_flight;
+
+    if (to_fetch < 0)
+    {
+      to_fetch = 0;
+    }
+
+    entry->second.in_flight += to_fetch;
+    generation = entry->second.generation;
+  }
+
+  HTTPCode rc = HTTP_OK;
+
+  if (av != NULL)
+  {
+    TRC_DEBUG("Using prefetched AV for %s", private_user_id.c_str());
+  }
+  else
+  {
+    rc = _hss->get_auth_vector(private_user_id,
+                               public_user_id,
+                               auth_type,
+                               resync_auth,
+                               server_name,
+                               av,
+                               trail);
+  }
+
+  if (rc != HTTP_OK)
+  {
+    // Don't prefetch for subscribers the HSS can't give us AVs for (or while
+    // it is failing), so give back the requests we reserved.
+    std::lock_guard<std::mutex> lock(_state->lock);
+    std::map<std::string, Entry>::iterator entry =
+                                              _state->entries.find(entry_key);
+
+    if ((entry != _state->entries.end()) &&
+        (entry->second.generation == generation))
+    {
+      entry->second.in_flight -= to_fetch;
+    }
+
+    to_fetch = 0;
+  }
+
+  if (to_fetch > 0)
+  {
+    // Request the AVs in the background.  Note that these are requested
+    // after any resync has completed, so they are generated from the new SQN.
+    TRC_DEBUG("Prefetch %d AVs for %s", to_fetch, private_user_id.c_str());
+    std::shared_ptr<State> state = _state;
+
+    for (int ii = 0; ii < to_fetch; ++ii)
+    {
+      _hss->get_auth_vector_async(private_user_id,
+                                  public_user_id,
+                                  auth_type,
+                                  "",
+                                  server_name,
+                                  [state, entry_key, generation](HTTPCode rc,
+                                                                 rapidjson::Document* av)
+                                  {
+                                    on_prefetched(state,
+                                                  entry_key,
+                                                  generation,
+                                                  rc,
+                                                  av);
+                                  },
+                                  trail);
+    }
+  }
+
+  return rc;
+}
+
+void AvPrefetcher::invalidate(const std::string& private_user_id)
+{
+  std::string prefix = private_user_id;
+  prefix.push_back('\0');
+
+  std::lock_guard<std::mutex> lock(_state->lock);
+  std::map<std::string, Entry>::iterator entry =
+                                         _state->entries.lower_bound(prefix);
+
+  while ((entry != _state->entries.end()) &&
+         (entry->first.compare(0, prefix.size(), prefix) == 0))
+  {
+    std::map<std::string, Entry>::iterator next = std::next(entry);
+    erase_entry(_state.get(), entry);
+    entry = next;
+  }
+}
+
+size_t AvPrefetcher::num_avs(const std::string& private_user_id)
+{
+  std::string prefix = private_user_id;
+  prefix.push_back('\0');
+  size_t num_avs = 0;
+
+  std::lock_guard<std::mutex> lock(_state->lock);
+
+  for (std::map<std::string, Entry>::iterator entry =
+                                         _state->entries.lower_bound(prefix);
+       (entry != _state->entries.end()) &&
+       (entry->first.compare(0, prefix.size(), prefix) == 0);
+       ++entry)
+  {
+    num_avs += entry->second.avs.size();
+  }
+
+  return num_avs;
+}
+
+std::string AvPrefetcher::key(const std::string& private_user_id,
+                              const std::string& public_user_id,
+                              const std::string& auth_type,
+                              const std::string& server_name)
+{
+  std::string key = private_user_id;
+  key.push_back('\0');
+  key.append(public_user_id);
+  key.push_back('\0');
+  key.append(auth_type);
+  key.push_back('\0');
+  key.append(server_name);
+  return key;
+}
+
+void AvPrefetcher::erase_entry(State* state,
+                               std::map<std::string, Entry>::iterator entry)
+{
+  for (PooledAv& pooled : entry->second.avs)
+  {
+    delete pooled.av;
+  }
+
+  state->lru.erase(entry->second.lru);
+  state->entries.erase(entry);
+}
+
+void AvPrefetcher::on_prefetched(std::shared_ptr<State> state,
+                                 const std::string& key,
+                                 uint64_t generation,
+                                 HTTPCode rc,
+                                 rapidjson::Document* av)
+{
+  {
+    std::lock_guard<std::mutex> lock(state->lock);
+    std::map<std::string, Entry>::iterator entry = state->entries.find(key);
+
+    if ((entry != state->entries.end()) &&
+        (entry->second.generation == generation))
+    {
+      if (entry->second.in_flight > 0)
+      {
+        entry->second.in_flight--;
+      }
+
+      if ((rc == HTTP_OK) && (av != NULL))
+      {
+        entry->second.avs.push_back(PooledAv{av, now_ms() + state->ttl_ms});
+        av = NULL;
+      }
+    }
+  }
+
+  // The AV wasn't wanted (because the request failed, or the entry has been
+  // invalidated or evicted since it was requested).
+  delete av;
+}
+
+unsigned long AvPrefetcher::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
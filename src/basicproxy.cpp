@@ -29,6 +29,8 @@ extern "C" {
 #include "constants.h"
 #include "basicproxy.h"
 #include "uri_classifier.h"
+#include "send_queue_monitor.h"
+#include "tsx_index.h"
 
 
 BasicProxy::BasicProxy(pjsip_endpoint* endpt,
@@ -40,8 +42,13 @@ BasicProxy::BasicProxy(pjsip_endpoint* endpt,
   _mod_tu(this, endpt, name + "-tu", priority, PJMODULE_MASK_TU),
   _delay_trying(delay_trying),
   _endpt(endpt),
-  _stateless_proxies(stateless_proxies)
+  _stateless_proxies(true, false),
+  _branch_setup_stage(StageLatency::stage("fork_branch_setup"))
 {
+  for (const std::string& stateless_proxy : stateless_proxies)
+  {
+    _stateless_proxies.insert(stateless_proxy, true);
+  }
 }
 
 
@@ -212,12 +219,14 @@ void BasicProxy::on_tsx_state(pjsip_transaction* tsx, pjsip_event* event)
 void BasicProxy::bind_transaction(void* uas_uac_tsx, pjsip_transaction* tsx)
 {
   tsx->mod_data[_mod_tu.id()] = uas_uac_tsx;
+  TsxIndex::add(tsx);
 }
 
 
 /// Unbinds a UASTsx or UACTsx object from a PJSIP transaction.
 void BasicProxy::unbind_transaction(pjsip_transaction* tsx)
 {
+  TsxIndex::remove(tsx);
   tsx->mod_data[_mod_tu.id()] = NULL;
 }
 
@@ -273,7 +282,7 @@ void BasicProxy::on_cancel_request(pjsip_rx_data* rdata)
   // Find the UAS INVITE transaction.
   pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
                        pjsip_get_invite_method(), rdata);
-  invite_uas = pjsip_tsx_layer_find_tsx(&key, PJ_TRUE);
+  invite_uas = TsxIndex::find(&key, true);
   if (!invite_uas)
   {
     // Invite transaction not found, respond to CANCEL with 481
@@ -437,6 +446,7 @@ BasicProxy::UASTsx::UASTsx(BasicProxy* proxy) :
   _pending_sends(0),
   _pending_responses(0),
   _final_rsp(NULL),
+  _forward_start(0),
   _pending_destroy(false),
   _context_count(0)
 {
@@ -895,8 +905,11 @@ pj_status_t BasicProxy::UASTsx::forward_to_targets()
 {
   pj_status_t status = PJ_EUNKNOWN;
 
-  // Initialise the UAC data structures for each new target.
+  // Initialise the UAC data structures for each new target.  Each branch's
+  // next hop is resolved as it is sent (on the SIP resolver threads if there
+  // are any), so resolving one branch overlaps with cloning the next.
   _pending_sends = _targets.size();
+  _forward_start = StageLatency::now();
 
   while (!_targets.empty())
   {
@@ -1356,6 +1369,14 @@ void BasicProxy::UASTsx::cancel_pending_uac_tsx(int st_code,
   TRC_DEBUG("%s - Cancel %d pending UAC transactions",
             name(), _pending_responses);
 
+  // All the CANCELs carry the same Reason header, so build it once here and
+  // copy it onto each of them.
+  pjsip_hdr* reason_hdr = NULL;
+  if ((st_code != 0) && (_req != NULL))
+  {
+    reason_hdr = PJUtils::create_reason_hdr(_req->pool, st_code);
+  }
+
   for (size_t ii = 0; ii < _uac_tsx.size(); ++ii)
   {
     uac_tsx = _uac_tsx[ii];
@@ -1380,7 +1401,7 @@ void BasicProxy::UASTsx::cancel_pending_uac_tsx(int st_code,
         dissociate(uac_tsx);
       }
 
-      uac_tsx->cancel_pending_tsx(st_code, reason);
+      uac_tsx->cancel_pending_tsx(st_code, reason, reason_hdr);
     }
   }
 }
@@ -1571,6 +1592,11 @@ BasicProxy::UACTsx::UACTsx(BasicProxy* proxy,
   _tsx(NULL),
   _tdata(NULL),
   _servers_iter(NULL),
+  _allowed_host_state(BaseResolver::ALL_LISTS),
+  _resolving(false),
+  _cancelled_while_resolving(false),
+  _setup_start(0),
+  _sent_time(0),
   _current_server(),
   _cancel_tsx(NULL),
   _timer_c(),
@@ -1642,6 +1668,8 @@ pj_status_t BasicProxy::UACTsx::init(pjsip_tx_data* tdata,
   pj_status_t status;
 
   _trail = _uas_tsx->trail();
+  _setup_start = (_uas_tsx->_forward_start != 0) ? _uas_tsx->_forward_start :
+                                                   StageLatency::now();
 
   // Add a new top Via header to the request.  This must be done before creating
   // the PJSIP UAC transaction as otherwise response correlation won't work.
@@ -1681,22 +1709,23 @@ pj_status_t BasicProxy::UACTsx::init(pjsip_tx_data* tdata,
   _tdata = tdata;
   pjsip_tx_data_add_ref(_tdata);
 
-  if (tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT)
+  _allowed_host_state = allowed_host_state;
+
+  if ((tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT) && (_lock == NULL))
   {
-    // Resolve the next hop destination for this request to a set of target
+    // Resolve the next hop destination for this ACK to a set of target
     // servers (IP address/port/transport tuples). The maximum number of times
-    // to attempt the call is stored in _num_attempts.
+    // to attempt the call is stored in _num_attempts.  Other requests are
+    // resolved when they are sent, as that may be done asynchronously.
     _servers_iter = PJUtils::resolve_next_hop_iter(tdata, allowed_host_state, trail());
   }
 
   // Work out whether this UAC transaction is to a stateless proxy.
   pjsip_sip_uri* next_hop_uri = (pjsip_sip_uri*)PJUtils::next_hop(tdata->msg);
-  std::string next_hop = std::string(next_hop_uri->host.ptr,
-                                     next_hop_uri->host.slen);
-  _stateless_proxy = (_proxy->_stateless_proxies.find(next_hop) !=
-                      _proxy->_stateless_proxies.end());
-  TRC_DEBUG("Next hop %s %s a stateless proxy",
-            next_hop.c_str(),
+  _stateless_proxy = _proxy->_stateless_proxies.find(&next_hop_uri->host);
+  TRC_DEBUG("Next hop %.*s %s a stateless proxy",
+            (int)next_hop_uri->host.slen,
+            next_hop_uri->host.ptr,
             _stateless_proxy ? "is" : "is not");
 
   return PJ_SUCCESS;
@@ -1708,11 +1737,124 @@ void BasicProxy::UACTsx::send_request()
 {
   enter_context();
 
-  pj_status_t status = PJ_SUCCESS;
-
   TRC_DEBUG("Sending request for %s",
             PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, _tdata->msg->line.req.uri).c_str());
 
+  if ((_tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT) &&
+      (_servers_iter == NULL))
+  {
+    // Resolve the next hop destination for this request to a set of target
+    // servers (IP address/port/transport tuples).  If this needs a DNS lookup
+    // it may be done on one of the SIP resolver threads, in which case we
+    // hold on to our context until the results come back (on a worker
+    // thread) and send the request then.
+    _resolving = true;
+    _context_count++;
+    UACTsx* uac_tsx = this;
+    _servers_iter = PJUtils::resolve_next_hop_iter_async(
+                      _tdata,
+                      _allowed_host_state,
+                      [uac_tsx](BaseAddrIterator* servers_iter)
+                      {
+                        PJUtils::run_callback_on_worker_thread(
+                          [uac_tsx, servers_iter]()
+                          {
+                            uac_tsx->on_resolved(servers_iter);
+                          },
+                          false);
+                      },
+                      trail());
+
+    if (_servers_iter != NULL)
+    {
+      // The next hop was resolved straight away.
+      _resolving = false;
+      _context_count--;
+      send_to_first_server();
+    }
+    else
+    {
+      TRC_DEBUG("%s - Waiting for next hop to be resolved", name());
+    }
+  }
+  else
+  {
+    send_to_first_server();
+  }
+
+  exit_context();
+}
+
+
+/// Called when the next hop for this request has been resolved
+/// asynchronously.
+void BasicProxy::UACTsx::on_resolved(BaseAddrIterator* servers_iter)
+{
+  enter_context();
+
+  // We no longer need the context we held while we were waiting.
+  _context_count--;
+  _resolving = false;
+  _servers_iter = servers_iter;
+
+  if ((!_pending_destroy) &&
+      (_uas_tsx != NULL) &&
+      (!_cancelled_while_resolving))
+  {
+    send_to_first_server();
+  }
+  else
+  {
+    // The request has been cancelled, or the transaction has gone away, while
+    // we were resolving the next hop, so don't send it.  Release the
+    // reference to the request that would have been passed to PJSIP.
+    TRC_DEBUG("%s - Request abandoned while resolving next hop", name());
+    pjsip_tx_data_dec_ref(_tdata);
+
+    if ((_cancelled_while_resolving) &&
+        (_uas_tsx != NULL) &&
+        (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD))
+    {
+      // Respond to the cancelled INVITE as the downstream node would have.
+      pjsip_tx_data* rsp;
+      pj_status_t status = PJUtils::create_response(stack_data.endpt,
+                                                    _tdata,
+                                                    PJSIP_SC_REQUEST_TERMINATED,
+                                                    NULL,
+                                                    &rsp);
+      if (status == PJ_SUCCESS)
+      {
+        // Remove the top Via header (we must do this as we built the response
+        // from a request where we've added an extra Via).
+        pjsip_msg_find_remove_hdr(rsp->msg, PJSIP_H_VIA, NULL);
+        _uas_tsx->on_new_client_response(this, rsp);
+      }
+    }
+
+    if ((_tsx != NULL) &&
+        (_tsx->state != PJSIP_TSX_STATE_TERMINATED) &&
+        (_tsx->state != PJSIP_TSX_STATE_DESTROYED))
+    {
+      pjsip_tsx_terminate(_tsx, PJSIP_SC_REQUEST_TERMINATED);
+    }
+  }
+
+  exit_context();
+}
+
+
+/// Sends the request to the first of the servers the next hop resolved to.
+void BasicProxy::UACTsx::send_to_first_server()
+{
+  pj_status_t status = PJ_SUCCESS;
+
+  // Don't send new requests on connections that already have too much data
+  // waiting to be sent.  ACKs are still sent, as they complete transactions
+  // rather than starting new ones.
+  SendQueueMonitor* send_queue_monitor = (_tsx != NULL) ?
+                                         stack_data.send_queue_monitor : NULL;
+  bool saturated = false;
+
   if (_tdata->tp_sel.type == PJSIP_TPSELECTOR_TRANSPORT)
   {
     // The transport has already been selected for this request, so
@@ -1720,12 +1862,42 @@ void BasicProxy::UACTsx::send_request()
     TRC_DEBUG("Transport %s (%s) pre-selected for transaction",
               _tdata->tp_sel.u.transport->obj_name,
               _tdata->tp_sel.u.transport->info);
-    pjsip_tsx_set_transport(_tsx, &_tdata->tp_sel);
+
+    if ((send_queue_monitor != NULL) &&
+        (send_queue_monitor->is_saturated(_tdata->tp_sel.u.transport)))
+    {
+      // There's nowhere else to send the request, so fail it now rather
+      // than queue it behind everything else.
+      TRC_INFO("Connection %s is saturated",
+               _tdata->tp_sel.u.transport->obj_name);
+      saturated = true;
+      status = PJ_ETOOMANY;
+    }
+    else
+    {
+      pjsip_tsx_set_transport(_tsx, &_tdata->tp_sel);
+    }
   }
   else
   {
-    // Get the next server from the address iterator.
-    if (get_next_server())
+    // Get the next server from the address iterator, skipping (and
+    // blacklisting) any whose connection is saturated.  A server that has
+    // recently said it is overloaded is tried after the next one.
+    _servers_iter = PJUtils::avoid_overloaded(_servers_iter);
+    bool found = get_next_server();
+
+    while ((found) &&
+           (send_queue_monitor != NULL) &&
+           (send_queue_monitor->is_saturated(_current_server.address())))
+    {
+      TRC_INFO("Connection to %s is saturated, try another server",
+               _current_server.address().to_string().c_str());
+      _current_server.failed();
+      saturated = true;
+      found = get_next_server();
+    }
+
+    if (found)
     {
       // We have resolved servers to try, so set up the destination information
       // in the request.
@@ -1753,8 +1925,18 @@ void BasicProxy::UACTsx::send_request()
     else
     {
       // Send non-ACK request statefully.
+      _sent_time = StageLatency::now();
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
+      if ((status == PJ_SUCCESS) && (_setup_start != 0))
+      {
+        // Record how long this branch took to set up, including waiting for
+        // the branches before it and for its next hop to be resolved.
+        // Retries aren't counted.
+        StageLatency::record_since(_proxy->_branch_setup_stage, _setup_start);
+        _setup_start = 0;
+      }
+
       if ((status == PJ_SUCCESS) &&
           (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD))
       {
@@ -1806,7 +1988,12 @@ void BasicProxy::UACTsx::send_request()
       ForkErrorState fork_error;
       std::string reason;
 
-      if (_current_server.is_set())
+      if (saturated)
+      {
+        fork_error = ForkErrorState::TRANSPORT_ERROR;
+        reason = "Connection to peer is saturated";
+      }
+      else if (_current_server.is_set())
       {
         // LCOV_EXCL_START - don't expect failure to send messages in UT
         fork_error = ForkErrorState::TRANSPORT_ERROR;
@@ -1824,30 +2011,41 @@ void BasicProxy::UACTsx::send_request()
 
     _pending_destroy = true;
   }
-
-  exit_context();
 }
 
 
 /// Cancels the pending transaction, using the specified status code in the
 /// Reason header.
-void BasicProxy::UACTsx::cancel_pending_tsx(int st_code, const std::string& reason)
+void BasicProxy::UACTsx::cancel_pending_tsx(int st_code,
+                                            const std::string& reason,
+                                            const pjsip_hdr* reason_hdr)
 {
   if (_tsx != NULL)
   {
     enter_context();
 
     TRC_DEBUG("Found transaction %s status=%d", name(), _tsx->status_code);
-    if (_tsx->status_code < 200)
+    if (_resolving)
+    {
+      // The request hasn't been sent yet, so just make sure it isn't sent
+      // once the next hop has been resolved.
+      TRC_DEBUG("Cancel request before it is sent");
+      _cancelled_while_resolving = true;
+    }
+    else if (_tsx->status_code < 200)
     {
       if (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD)
       {
         TRC_DEBUG("Sending CANCEL request");
 
         // See issue 1232.
-        pjsip_tx_data *cancel = PJUtils::create_cancel(stack_data.endpt,
-                                                       _tsx->last_tx,
-                                                       st_code);
+        pjsip_tx_data *cancel = (reason_hdr != NULL) ?
+                                 PJUtils::create_cancel(stack_data.endpt,
+                                                        _tsx->last_tx,
+                                                        reason_hdr) :
+                                 PJUtils::create_cancel(stack_data.endpt,
+                                                        _tsx->last_tx,
+                                                        st_code);
         set_trail(cancel, _trail);
 
         SAS::Event cancel_tsx_event(_trail, SASEvent::CANCELLING_TSX, 0);
@@ -1966,6 +2164,18 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
       stop_timer_c();
     }
 
+    if ((_current_server.is_set()) &&
+        (_sent_time != 0) &&
+        (event->body.tsx_state.type == PJSIP_EVENT_RX_MSG))
+    {
+      // This is the first response from the server, so feed how long it
+      // took into the server's latency estimate.
+      PJUtils::record_latency(
+                 _current_server.address(),
+                 StageLatency::ticks_to_us(StageLatency::now() - _sent_time));
+      _sent_time = 0;
+    }
+
     if (_current_server.is_set())
     {
       // Check to see if the destination server has failed so we can blacklist
@@ -2007,8 +2217,22 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
       {
         // The server returned a 503 error.  We don't blacklist in this case
         // as it may indicated a transient overload condition, but we can
-        // retry to an alternate server if one is available.
+        // retry to an alternate server if one is available.  If it has a
+        // Retry-After header the server is shedding load, so other requests
+        // avoid it for a while too.
         TRC_DEBUG("Server returned a 503 error");
+        if (event->body.tsx_state.type == PJSIP_EVENT_RX_MSG)
+        {
+          pjsip_retry_after_hdr* retry_after = (pjsip_retry_after_hdr*)
+            pjsip_msg_find_hdr(event->body.tsx_state.src.rdata->msg_info.msg,
+                               PJSIP_H_RETRY_AFTER,
+                               NULL);
+          if (retry_after != NULL)
+          {
+            PJUtils::record_overload(_current_server.address(),
+                                     retry_after->ivalue);
+          }
+        }
        _current_server.succeeded();
         retrying = retry_request();
       }
@@ -2205,6 +2429,7 @@ bool BasicProxy::UACTsx::retry_request()
       // Copy across the destination information for a retry and try to
       // resend the request.
       PJUtils::set_dest_info(_tdata, _current_server.address());
+      _sent_time = StageLatency::now();
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
       if (status == PJ_SUCCESS)
@@ -0,0 +1,141 @@
+/**
+ * @file batch_utils.cpp Utilities for processing batches of independent
+ * operations in parallel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "batch_utils.h"
+#include "log.h"
+
+// Register the calling thread with PJSIP.  The descriptor must stay in scope
+// for the lifetime of the thread.
+#define REGISTER_PJ_THREAD(NAME)                                               \
+  pj_thread_desc desc;                                                         \
+  pj_bzero(desc, sizeof(desc));                                                \
+  pj_thread_t* pj_thread = NULL;                                               \
+                                                                               \
+  if (pj_thread_register(NAME, desc, &pj_thread) != PJ_SUCCESS)                \
+  {                                                                            \
+    TRC_ERROR("Failed to register %s with pjsip", NAME);                       \
+  }
+
+void BatchUtils::run_in_parallel(size_t count,
+                                 const std::function<void(size_t ii)>& fn,
+                                 unsigned int max_threads)
+{
+  // Each thread repeatedly takes the next unprocessed index.
+  std::atomic<size_t> next(0);
+  auto process = [&next, count, &fn]()
+  {
+    for (size_t ii = next++; ii < count; ii = next++)
+    {
+      fn(ii);
+    }
+  };
+
+  size_t num_threads = std::min((size_t)std::max(max_threads, 1u), count);
+  std::vector<std::thread> threads;
+
+  for (size_t thread = 1; thread < num_threads; ++thread)
+  {
+    threads.push_back(std::thread([&process]()
+    {
+#ifndef UNIT_TEST
+      REGISTER_PJ_THREAD("SproutBatchThread");
+#endif
+
+      process();
+    }));
+  }
+
+  process();
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+}
+
+bool BatchUtils::run_at_sites(const std::function<void()>& local_fn,
+                              const std::vector<SiteOperation>& remote_ops,
+                              int deadline_ms)
+{
+  // The state shared with the remote threads, which may outlive this call.
+  struct State
+  {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<bool> done;
+    size_t remaining;
+  };
+
+  std::shared_ptr<State> state = std::make_shared<State>();
+  state->done.resize(remote_ops.size(), false);
+  state->remaining = remote_ops.size();
+
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline_ms);
+
+  for (size_t ii = 0; ii < remote_ops.size(); ++ii)
+  {
+    std::function<void()> fn = remote_ops[ii].fn;
+
+    std::thread([state, ii, fn]()
+    {
+#ifndef UNIT_TEST
+      REGISTER_PJ_THREAD("SproutSiteThread");
+#endif
+
+      fn();
+
+      std::lock_guard<std::mutex> guard(state->lock);
+      state->done[ii] = true;
+      state->remaining--;
+      state->cond.notify_all();
+    }).detach();
+  }
+
+  local_fn();
+
+  std::unique_lock<std::mutex> lock(state->lock);
+  std::function<bool()> all_done = [&state]() { return state->remaining == 0; };
+
+  if (deadline_ms <= 0)
+  {
+    state->cond.wait(lock, all_done);
+  }
+  else if (!state->cond.wait_until(lock, deadline, all_done))
+  {
+    for (size_t ii = 0; ii < remote_ops.size(); ++ii)
+    {
+      if (!state->done[ii])
+      {
+        TRC_WARNING("Operation on site %s did not complete within %dms - continuing in the background",
+                    remote_ops[ii].site.c_str(), deadline_ms);
+      }
+    }
+
+    return false;
+  }
+
+  return true;
+}
@@ -75,7 +75,9 @@ bool BGCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
 
     // Create the BGCF ACR factory.
     _acr_factory = (ralf_processor != NULL) ?
-                       (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::BGCF) :
+                       (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                       ACR::BGCF,
+                                                       acr_policy) :
                        new ACRFactory();
 
     // Create the Sproutlet.
@@ -19,8 +19,10 @@
 #include "bgcfservice.h"
 #include "log.h"
 #include "sas.h"
+#include "sas_sampling.h"
 #include "sproutsasevent.h"
 #include "pjutils.h"
+#include "number_normalizer.h"
 #include "sprout_pd_definitions.h"
 
 BgcfService::BgcfService(std::string configuration) :
@@ -47,6 +49,25 @@ void BgcfService::update_routes()
 
   TRC_STATUS("Loading BGCF configuration from %s", _configuration.c_str());
 
+  if (CompiledRouteTable::is_compiled(_configuration))
+  {
+    // The configuration has been compiled, so just map it in.
+    CompiledRouteTable* compiled = CompiledRouteTable::load(_configuration);
+
+    if (compiled == NULL)
+    {
+      CL_SPROUT_BGCF_FILE_INVALID.log();
+      return;
+    }
+
+    TRC_STATUS("Loaded %lu domain and %lu number routes",
+               compiled->num_domains(), compiled->num_numbers());
+    std::shared_ptr<RouteTable> new_routes = std::make_shared<RouteTable>();
+    new_routes->compiled.reset(compiled);
+    _routes.set(new_routes);
+    return;
+  }
+
   // Read from the file
   std::ifstream fs(_configuration.c_str());
   std::string bgcf_str((std::istreambuf_iterator<char>(fs)),
@@ -77,8 +98,7 @@ void BgcfService::update_routes()
 
   try
   {
-    std::map<std::string, std::vector<std::string>> new_domain_routes;
-    std::map<std::string, std::vector<std::string>> new_number_routes;
+    std::shared_ptr<RouteTable> new_routes = std::make_shared<RouteTable>();
 
     JSON_ASSERT_CONTAINS(doc, "routes");
     JSON_ASSERT_ARRAY(doc["routes"]);
@@ -116,14 +136,14 @@ void BgcfService::update_routes()
         if ((*routes_it).HasMember("domain"))
         {
           routing_value = (*routes_it)["domain"].GetString();
-          new_domain_routes.insert(std::make_pair(routing_value, route_vec));
+          new_routes->domain_routes.insert(std::make_pair(routing_value, route_vec));
         }
         else
         {
           routing_value = (*routes_it)["number"].GetString();
-          new_number_routes.insert(
-                    std::make_pair(Utils::remove_visual_separators(routing_value),
-                                   route_vec));
+          new_routes->number_routes.insert(
+                                NumberNormalizer::remove_visual_separators(routing_value),
+                                route_vec);
         }
 
         route_vec.clear();
@@ -137,10 +157,9 @@ void BgcfService::update_routes()
       }
     }
 
-    // Take a write lock on the mutex in RAII style
-    boost::lock_guard<boost::shared_mutex> write_lock(_routes_rw_lock);
-    _domain_routes = new_domain_routes;
-    _number_routes = new_number_routes;
+    // Publish the new routes.  Any lookups still using the old ones keep them
+    // alive until they finish.
+    _routes.set(new_routes);
   }
   catch (JsonFormatError err)
   {
@@ -156,112 +175,178 @@ BgcfService::~BgcfService()
   _updater = NULL;
 }
 
+// Logs the route found for a domain or number to SAS.
+static void report_route(SAS::TrailId trail,
+                         int event_id,
+                         const std::string& key,
+                         const std::vector<std::string>& route)
+{
+  if (!SASSampling::detail_enabled(trail))
+  {
+    return;
+  }
+
+  size_t len = 0;
+  for (const std::string& hop : route)
+  {
+    len += hop.size() + 1;
+  }
+
+  std::string route_string;
+  route_string.reserve(len);
+  for (const std::string& hop : route)
+  {
+    route_string.append(hop).append(1, ';');
+  }
+
+  SAS::Event event(trail, event_id, 0);
+  event.add_var_param(key);
+  event.add_var_param(route_string);
+  SAS::report_event(event);
+}
+
 std::vector<std::string> BgcfService::get_route_from_domain(
                                                 const std::string &domain,
                                                 SAS::TrailId trail) const
+{
+  Route route = lookup_route_from_domain(domain, trail);
+  return (route != nullptr) ? *route : std::vector<std::string>();
+}
+
+std::vector<std::string> BgcfService::get_route_from_number(
+                                                const std::string &number,
+                                                SAS::TrailId trail) const
+{
+  Route route = lookup_route_from_number(number, trail);
+  return (route != nullptr) ? *route : std::vector<std::string>();
+}
+
+BgcfService::Route BgcfService::lookup_route_from_domain(
+                                                const std::string &domain,
+                                                SAS::TrailId trail) const
 {
   TRC_DEBUG("Getting route for URI domain %s via BGCF lookup", domain.c_str());
 
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_routes_rw_lock);
+  // Take a reference to the current routes, which keeps them valid for the
+  // rest of this function even if the configuration is reloaded.
+  std::shared_ptr<const RouteTable> routes = _routes.get();
+  std::vector<std::string> scratch;
 
   // First try the specified domain.
-  std::map<std::string, std::vector<std::string>>::const_iterator i =
-                                                    _domain_routes.find(domain);
-  if (i != _domain_routes.end())
+  const std::vector<std::string>* route = routes->find_domain(domain, scratch);
+  if (route != NULL)
   {
     TRC_INFO("Found route to domain %s", domain.c_str());
 
-    SAS::Event event(trail, SASEvent::BGCF_FOUND_ROUTE_DOMAIN, 0);
-    event.add_var_param(domain);
-    std::string route_string;
+    report_route(trail, SASEvent::BGCF_FOUND_ROUTE_DOMAIN, domain, *route);
 
-    for (std::vector<std::string>::const_iterator ii = i->second.begin(); ii != i->second.end(); ++ii)
-    {
-      route_string = route_string + *ii + ";";
-    }
-
-    event.add_var_param(route_string);
-    SAS::report_event(event);
-
-    return i->second;
+    return make_route(routes, route, scratch);
   }
 
   // Then try the default domain (*).
-  i = _domain_routes.find("*");
-  if (i != _domain_routes.end())
+  route = routes->find_domain("*", scratch);
+  if (route != NULL)
   {
     TRC_INFO("Found default route");
 
-    SAS::Event event(trail, SASEvent::BGCF_DEFAULT_ROUTE_DOMAIN, 0);
-    event.add_var_param(domain);
-    std::string route_string;
+    report_route(trail, SASEvent::BGCF_DEFAULT_ROUTE_DOMAIN, domain, *route);
 
-    for (std::vector<std::string>::const_iterator ii = i->second.begin(); ii != i->second.end(); ++ii)
-    {
-      route_string = route_string + *ii + ";";
-    }
-
-    event.add_var_param(route_string);
-    SAS::report_event(event);
-
-    return i->second;
+    return make_route(routes, route, scratch);
   }
 
   SAS::Event event(trail, SASEvent::BGCF_NO_ROUTE_DOMAIN, 0);
   event.add_var_param(domain);
   SAS::report_event(event);
 
-  return std::vector<std::string>();
+  return Route();
 }
 
-std::vector<std::string> BgcfService::get_route_from_number(
+BgcfService::Route BgcfService::lookup_route_from_number(
                                                 const std::string &number,
                                                 SAS::TrailId trail) const
 {
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_routes_rw_lock);
-
-  // The number routes map is ordered by length of key. Start from the end of
-  // the map to get the longest prefixes first.
-  for (std::map<std::string, std::vector<std::string>>::const_reverse_iterator it =
-        _number_routes.rbegin();
-       it != _number_routes.rend();
-       it++)
+  // Take a reference to the current routes, which keeps them valid for the
+  // rest of this function even if the configuration is reloaded.
+  std::shared_ptr<const RouteTable> routes = _routes.get();
+
+  // Find the longest matching prefix.
+  std::string prefix;
+  std::vector<std::string> scratch;
+
+  const std::vector<std::string>* route =
+    routes->find_number(NumberNormalizer::remove_visual_separators(number),
+                        scratch,
+                        prefix);
+  if (route != NULL)
   {
-    int len = std::min(number.size(), (*it).first.size());
-
-    if (Utils::remove_visual_separators(number).compare(0,
-                                                        len,
-                                                        (*it).first,
-                                                        0,
-                                                        len) == 0)
-    {
-      // Found a match, so return it
-      TRC_DEBUG("Match found. Number: %s, prefix: %s",
-                number.c_str(), (*it).first.c_str());
-
-      SAS::Event event(trail, SASEvent::BGCF_FOUND_ROUTE_NUMBER, 0);
-      event.add_var_param(number);
-      std::string route_string;
-
-      for (std::vector<std::string>::const_iterator ii = (*it).second.begin();
-                                                    ii != (*it).second.end();
-                                                    ++ii)
-      {
-        route_string = route_string + *ii + ";";
-      }
+    // Found a match, so return it
+    TRC_DEBUG("Match found. Number: %s, prefix: %s",
+              number.c_str(), prefix.c_str());
 
-      event.add_var_param(route_string);
-      SAS::report_event(event);
+    report_route(trail, SASEvent::BGCF_FOUND_ROUTE_NUMBER, number, *route);
 
-      return (*it).second;
-    }
+    return make_route(routes, route, scratch);
   }
 
   SAS::Event event(trail, SASEvent::BGCF_NO_ROUTE_NUMBER, 0);
   event.add_var_param(number);
   SAS::report_event(event);
 
-  return std::vector<std::string>();
+  return Route();
+}
+
+BgcfService::Route BgcfService::make_route(
+                          const std::shared_ptr<const RouteTable>& routes,
+                          const std::vector<std::string>* route,
+                          std::vector<std::string>& scratch)
+{
+  if (route == &scratch)
+  {
+    // The route was decoded from a compiled table, so the Route owns it.
+    return std::make_shared<const std::vector<std::string>>(std::move(scratch));
+  }
+
+  // The route is in the table, so share ownership of the table.
+  return Route(routes, route);
+}
+
+const std::vector<std::string>* BgcfService::RouteTable::find_domain(
+                                  const std::string& domain,
+                                  std::vector<std::string>& scratch) const
+{
+  if (compiled != NULL)
+  {
+    return compiled->find_domain(domain, scratch) ? &scratch : NULL;
+  }
+
+  std::map<std::string, std::vector<std::string>>::const_iterator i =
+                                                    domain_routes.find(domain);
+
+  if (i == domain_routes.end())
+  {
+    return NULL;
+  }
+
+  return &i->second;
+}
+
+const std::vector<std::string>* BgcfService::RouteTable::find_number(
+                                  const std::string& number,
+                                  std::vector<std::string>& scratch,
+                                  std::string& prefix) const
+{
+  if (compiled != NULL)
+  {
+    int idx = compiled->find_number(number, &prefix);
+
+    if (idx < 0)
+    {
+      return NULL;
+    }
+
+    scratch = compiled->number_values_at(idx);
+    return &scratch;
+  }
+
+  return number_routes.longest_prefix_match(number, &prefix);
 }
@@ -30,7 +30,8 @@ BGCFSproutlet::BGCFSproutlet(const std::string& bgcf_name,
   _bgcf_service(bgcf_service),
   _enum_service(enum_service),
   _acr_factory(acr_factory),
-  _override_npdi(override_npdi)
+  _override_npdi(override_npdi),
+  _route_uri_pool(NULL)
 {
 }
 
@@ -38,6 +39,10 @@ BGCFSproutlet::BGCFSproutlet(const std::string& bgcf_name,
 /// BGCFSproutlet destructor.
 BGCFSproutlet::~BGCFSproutlet()
 {
+  if (_route_uri_pool != NULL)
+  {
+    pj_pool_release(_route_uri_pool);
+  }
 }
 
 
@@ -58,22 +63,84 @@ SproutletTsx* BGCFSproutlet::get_tsx(SproutletHelper* helper,
 ///
 /// @return            - The URIs to route the message on to (in order).
 /// @param domain      - The domain to find a route for.
-std::vector<std::string> BGCFSproutlet::get_route_from_domain(
+BgcfService::Route BGCFSproutlet::get_route_from_domain(
                                                   const std::string &domain,
                                                   SAS::TrailId trail) const
 {
-  return _bgcf_service->get_route_from_domain(domain, trail);
+  return _bgcf_service->lookup_route_from_domain(domain, trail);
 }
 
 /// Look up a route from the configured rules.
 ///
 /// @return            - The URIs to route the message on to (in order).
 /// @param domain      - The domain to find a route for.
-std::vector<std::string> BGCFSproutlet::get_route_from_number(
+BgcfService::Route BGCFSproutlet::get_route_from_number(
                                                   const std::string &number,
                                                   SAS::TrailId trail) const
 {
-  return _bgcf_service->get_route_from_number(number, trail);
+  return _bgcf_service->lookup_route_from_number(number, trail);
+}
+
+/// Gets a configured route URI, parsing it the first time it's used.
+///
+/// @return            - A copy of the URI in the pool, or NULL if it isn't a
+///                      valid SIP URI.
+/// @param route       - The route URI from the configuration.
+/// @param pool        - The pool to copy the URI into.
+pjsip_sip_uri* BGCFSproutlet::get_route_uri(const std::string& route,
+                                            pj_pool_t* pool)
+{
+  std::unique_lock<std::mutex> lock(_route_uris_lock);
+  pjsip_sip_uri* route_uri = NULL;
+
+  std::unordered_map<std::string, pjsip_sip_uri*>::const_iterator it =
+                                                       _route_uris.find(route);
+  if (it != _route_uris.end())
+  {
+    route_uri = it->second;
+  }
+  else
+  {
+    pj_pool_t* parse_pool = pool;
+
+    if (_route_uris.size() < MAX_ROUTE_URIS)
+    {
+      if (_route_uri_pool == NULL)
+      {
+        _route_uri_pool = pj_pool_create(&stack_data.cp.factory,
+                                         "bgcf-routes",
+                                         4096,
+                                         4096,
+                                         NULL);
+      }
+
+      parse_pool = _route_uri_pool;
+    }
+
+    pjsip_uri* uri = PJUtils::uri_from_string(route, parse_pool, PJ_TRUE);
+    uri = (uri == NULL) ? uri : (pjsip_uri*)pjsip_uri_get_uri(uri);
+
+    if ((uri != NULL) && (PJSIP_URI_SCHEME_IS_SIP(uri)))
+    {
+      route_uri = (pjsip_sip_uri*)uri;
+    }
+
+    if (parse_pool != pool)
+    {
+      _route_uris[route] = route_uri;
+    }
+    else
+    {
+      // The cache is full, so the URI has been parsed straight into the
+      // caller's pool.
+      return route_uri;
+    }
+  }
+
+  // The caller may modify the URI (for example, when it's added as a Route),
+  // so return a copy.
+  return (route_uri != NULL) ?
+           (pjsip_sip_uri*)pjsip_uri_clone(pool, (pjsip_uri*)route_uri) : NULL;
 }
 
 /// Get an ACR instance from the factory.
@@ -112,7 +179,7 @@ void BGCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
   _acr = _bgcf->get_acr(trail());
   _acr->rx_request(req);
 
-  std::vector<std::string> bgcf_routes;
+  BgcfService::Route bgcf_routes;
   std::string routing_value;
   bool routing_with_number = false;
   PJUtils::update_request_uri_np_data(req,
@@ -130,7 +197,7 @@ void BGCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 
     // If there are no matching routes, just route based on the domain - this
     // only matches any wild card routing set up
-    if (bgcf_routes.empty())
+    if ((bgcf_routes == nullptr) || (bgcf_routes->empty()))
     {
       routing_value = "";
       bgcf_routes = _bgcf->get_route_from_domain(routing_value, trail());
@@ -150,7 +217,7 @@ void BGCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 
     // If there are no matching routes, just route based on the domain - this
     // only matches any wild card routing set up
-    if (bgcf_routes.empty())
+    if ((bgcf_routes == nullptr) || (bgcf_routes->empty()))
     {
       routing_value = "";
       bgcf_routes = _bgcf->get_route_from_domain(routing_value, trail());
@@ -168,23 +235,21 @@ void BGCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
     bgcf_routes = _bgcf->get_route_from_domain(routing_value, trail());
   }
 
-  if (!bgcf_routes.empty())
+  if ((bgcf_routes != nullptr) && (!bgcf_routes->empty()))
   {
     // The BGCF should be in control of what routes get added - delete existing
     // ones first.
     PJUtils::remove_hdr(req, &STR_ROUTE);
 
-    for (std::vector<std::string>::iterator ii = bgcf_routes.begin();
-         ii != bgcf_routes.end();
+    for (std::vector<std::string>::const_iterator ii = bgcf_routes->begin();
+         ii != bgcf_routes->end();
          ++ii)
     {
-      pjsip_uri* route_uri = PJUtils::uri_from_string(*ii, get_pool(req), PJ_TRUE);
-      route_uri = (route_uri == NULL) ? route_uri :
-                                        (pjsip_uri*)pjsip_uri_get_uri(route_uri);
+      pjsip_sip_uri* route_uri = _bgcf->get_route_uri(*ii, get_pool(req));
 
-      if (route_uri != NULL && PJSIP_URI_SCHEME_IS_SIP(route_uri))
+      if (route_uri != NULL)
       {
-        PJUtils::add_route_header(req, (pjsip_sip_uri*)route_uri, get_pool(req));
+        PJUtils::add_route_header(req, route_uri, get_pool(req));
       }
       else
       {
@@ -100,6 +100,8 @@ extern "C" {
 #include "scscfselector.h"
 #include "contact_filtering.h"
 #include "uri_classifier.h"
+#include "thread_dispatcher.h"
+#include "tsx_index.h"
 
 static AnalyticsLogger* analytics_logger;
 static ACRFactory* cscf_acr_factory;
@@ -109,7 +111,9 @@ static pjsip_uri* upstream_proxy;
 static SIPConnectionPool* upstream_conn_pool = NULL;
 
 static SNMP::IPCountTable* sprout_ip_tbl = NULL;
+static SNMP::IPCountTable* sprout_load_tbl = NULL;
 static SNMP::U32Scalar* flow_count = NULL;
+static SNMP::U32Scalar* flow_memory = NULL;
 
 static FlowTable* flow_table;
 static DialogTracker* dialog_tracker;
@@ -120,8 +124,8 @@ static bool icscf = false;
 static bool scscf = false;
 static bool allow_emergency_reg = false;
 
-PJUtils::host_list_t trusted_hosts(&PJUtils::compare_pj_sockaddr);
-PJUtils::host_list_t pbx_hosts(&PJUtils::compare_pj_sockaddr);
+PJUtils::host_set_t trusted_hosts;
+PJUtils::host_set_t pbx_hosts;
 std::string pbx_service_route;
 
 //
@@ -185,7 +189,8 @@ static
 int proxy_process_access_routing(pjsip_rx_data *rdata,
                                  pjsip_tx_data *tdata,
                                  TrustBoundary **trust,
-                                 Target **target);
+                                 Target **target,
+                                 Flow **client_flow = NULL);
 static bool ibcf_trusted_peer(const pj_sockaddr& addr);
 static bool is_pbx(const pj_sockaddr& addr);
 static pj_status_t proxy_process_routing(pjsip_tx_data *tdata);
@@ -381,6 +386,7 @@ void process_tsx_request(pjsip_rx_data* rdata)
   Target *target = NULL;
   ACR* acr = NULL;
   ACR* downstream_acr = NULL;
+  Flow* client_flow = NULL;
   TrailFlusher trail_flusher(get_trail(rdata));
 
   // Verify incoming request.
@@ -402,7 +408,16 @@ void process_tsx_request(pjsip_rx_data* rdata)
 
   assert(edge_proxy);
   // Process access proxy routing.  This also does IBCF function if enabled.
-  status_code = proxy_process_access_routing(rdata, tdata, &trust, &target);
+  // INVITEs and BYEs are the requests dialog tracking looks at, so for those
+  // keep hold of the client's flow for the transaction to use.
+  pjsip_method_e method = rdata->msg_info.msg->line.req.method.id;
+  bool track_dialog = ((method == PJSIP_INVITE_METHOD) ||
+                       (method == PJSIP_BYE_METHOD));
+  status_code = proxy_process_access_routing(rdata,
+                                             tdata,
+                                             &trust,
+                                             &target,
+                                             track_dialog ? &client_flow : NULL);
   if (status_code != PJSIP_SC_OK)
   {
     // Request failed routing checks, so reject it.
@@ -428,6 +443,10 @@ void process_tsx_request(pjsip_rx_data* rdata)
     TRC_ERROR("Error processing route, %s",
               PJUtils::pj_status_to_string(status).c_str());
 
+    if (client_flow != NULL)
+    {
+      client_flow->dec_ref();
+    }
     delete target; target = NULL;
     delete acr; acr = NULL;
     delete downstream_acr; downstream_acr = NULL;
@@ -540,7 +559,7 @@ void process_tsx_request(pjsip_rx_data* rdata)
 
   // Create the transaction.  This implicitly enters its context, so we're
   // safe to operate on it (and have to exit its context below).
-  status = UASTransaction::create(rdata, tdata, trust, acr, &uas_data);
+  status = UASTransaction::create(rdata, tdata, trust, acr, client_flow, &uas_data);
 
   // The UAS transaction is responsible for flushing the trail when it is
   // terminated.
@@ -554,14 +573,19 @@ void process_tsx_request(pjsip_rx_data* rdata)
     // Delete the request since we're not forwarding it
     pjsip_tx_data_dec_ref(tdata);
     reject_request(rdata, PJSIP_SC_INTERNAL_SERVER_ERROR);
+    if (client_flow != NULL)
+    {
+      client_flow->dec_ref();
+    }
     delete acr; acr = NULL;
     delete downstream_acr; downstream_acr = NULL;
     delete target; target = NULL;
     return;
   }
 
-  // UASTrancation has taken ownership of the ACR.
+  // UASTrancation has taken ownership of the ACR and the flow reference.
   acr = NULL;
+  client_flow = NULL;
 
   assert(target);
   uas_data->access_proxy_handle_non_cancel(target);
@@ -584,7 +608,7 @@ void process_cancel_request(pjsip_rx_data* rdata)
   // Find the UAS INVITE transaction
   pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
                        pjsip_get_invite_method(), rdata);
-  invite_uas = pjsip_tsx_layer_find_tsx(&key, PJ_TRUE);
+  invite_uas = TsxIndex::find(&key, true);
   if (!invite_uas)
   {
     // Invite transaction not found, respond to CANCEL with 481
@@ -865,9 +889,9 @@ static void extract_preferred_identities(pjsip_tx_data* tdata, std::vector<pjsip
 {
   pjsip_routing_hdr* p_preferred_id;
   p_preferred_id = (pjsip_routing_hdr*)
-                       pjsip_msg_find_hdr_by_name(tdata->msg,
-                                                  &STR_P_PREFERRED_IDENTITY,
-                                                  NULL);
+                       PJUtils::find_hdr_by_name(tdata->msg,
+                                                 &STR_P_PREFERRED_IDENTITY,
+                                                 NULL);
 
   while (p_preferred_id != NULL)
   {
@@ -877,7 +901,7 @@ static void extract_preferred_identities(pjsip_tx_data* tdata, std::vector<pjsip
 
     pj_list_erase(p_preferred_id);
 
-    p_preferred_id = (pjsip_routing_hdr*)pjsip_msg_find_hdr_by_name(tdata->msg, &STR_P_PREFERRED_IDENTITY, next_hdr);
+    p_preferred_id = (pjsip_routing_hdr*)PJUtils::find_hdr_by_name(tdata->msg, &STR_P_PREFERRED_IDENTITY, next_hdr);
   }
 }
 
@@ -977,10 +1001,25 @@ static void proxy_route_upstream(pjsip_rx_data* rdata,
       pj_list_insert_after(&upstream_uri->other_param, orig_param);
     }
 
-    // Select a transport for the request.
+    // Select a transport for the request.  The served user's public
+    // identity is the affinity key, so that if the pool uses affinity
+    // selection each subscriber's requests go to the same Sprout node.
     if (upstream_conn_pool != NULL)
     {
-      target_p->transport = upstream_conn_pool->get_connection();
+      pjsip_uri* served_user =
+        (orig_param || (*trust == &TrustBoundary::INBOUND_EDGE_CLIENT)) ?
+          PJUtils::orig_served_user(tdata->msg, tdata->pool, 0) :
+          PJUtils::term_served_user(tdata->msg);
+      char served_user_buf[500];
+      pj_str_t affinity_key = {NULL, 0};
+      if (served_user != NULL)
+      {
+        affinity_key = PJUtils::public_id_to_pj_str(served_user,
+                                                    served_user_buf,
+                                                    sizeof(served_user_buf));
+      }
+
+      target_p->transport = upstream_conn_pool->get_connection(&affinity_key);
       if (target_p->transport != NULL)
       {
         pj_memcpy(&target_p->remote_addr,
@@ -1000,13 +1039,17 @@ static void proxy_route_upstream(pjsip_rx_data* rdata,
 
 
 /// Perform access-proxy-specific routing.
+///
+/// If client_flow is supplied and the request is from or to a client, it is
+/// set to that client's flow, with a reference the caller must release.
 #ifndef UNIT_TEST
 static
 #endif
 int proxy_process_access_routing(pjsip_rx_data *rdata,
                                  pjsip_tx_data *tdata,
                                  TrustBoundary **trust,
-                                 Target **target)
+                                 Target **target,
+                                 Flow **client_flow)
 {
   pj_status_t status;
   Flow* src_flow = NULL;
@@ -1446,6 +1489,24 @@ int proxy_process_access_routing(pjsip_rx_data *rdata,
       PJUtils::add_record_route(tdata, "TCP", stack_data.pcscf_untrusted_port, NULL, stack_data.public_host);   // @TODO - transport type?
     }
 
+    // Pass the client's flow back to the caller if it wants it, so that it
+    // doesn't have to look it up again when the transaction completes.
+    // This is the same flow DialogTracker would find - the source flow if
+    // the request came from the client, else the flow named in the Route.
+    if (client_flow != NULL)
+    {
+      if (src_flow != NULL)
+      {
+        *client_flow = src_flow;
+        src_flow = NULL;
+      }
+      else if (tgt_flow != NULL)
+      {
+        *client_flow = tgt_flow;
+        tgt_flow = NULL;
+      }
+    }
+
     // Decrement references on flows as we have finished with them.
     if (tgt_flow != NULL)
     {
@@ -1468,13 +1529,8 @@ int proxy_process_access_routing(pjsip_rx_data *rdata,
 static bool is_pbx(const pj_sockaddr& addr)
 {
   // Check whether the source IP address of the message is in the list of
-  // trusted hosts.  Zero out the source port before doing the search.
-  pj_sockaddr sockaddr;
-  pj_sockaddr_cp(&sockaddr, &addr);
-  pj_sockaddr_set_port(&sockaddr, 0);
-  PJUtils::host_list_t::const_iterator i = pbx_hosts.find(sockaddr);
-
-  return (i != pbx_hosts.end());
+  // PBXes.  The set ignores the port.
+  return (pbx_hosts.find(addr) != pbx_hosts.end());
 }
 
 
@@ -1484,13 +1540,8 @@ static bool is_pbx(const pj_sockaddr& addr)
 static bool ibcf_trusted_peer(const pj_sockaddr& addr)
 {
   // Check whether the source IP address of the message is in the list of
-  // trusted hosts.  Zero out the source port before doing the search.
-  pj_sockaddr sockaddr;
-  pj_sockaddr_cp(&sockaddr, &addr);
-  pj_sockaddr_set_port(&sockaddr, 0);
-  PJUtils::host_list_t::const_iterator i = trusted_hosts.find(sockaddr);
-
-  return (i != trusted_hosts.end());
+  // trusted hosts.  The set ignores the port.
+  return (trusted_hosts.find(addr) != trusted_hosts.end());
 }
 
 
@@ -1600,20 +1651,6 @@ static ACR::NodeRole acr_node_role(pjsip_msg *req)
 
 ///@}
 
-void UASTransaction::cancel_trying_timer()
-{
-  pthread_mutex_lock(&_trying_timer_lock);
-
-  if (_trying_timer.id == TRYING_TIMER)
-  {
-    // The deferred trying timer is running, so cancel it.
-    _trying_timer.id = 0;
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_trying_timer);
-  }
-
-  pthread_mutex_unlock(&_trying_timer_lock);
-}
-
 ///@{
 // IN-TRANSACTION PROCESSING
 
@@ -1623,7 +1660,7 @@ static void proxy_process_register_response(pjsip_rx_data* rdata)
   // this is a signal that the registrar accepted the REGISTER and so
   // authenticated the client.
   pjsip_routing_hdr* path_hdr = (pjsip_routing_hdr*)
-              pjsip_msg_find_hdr_by_name(rdata->msg_info.msg, &STR_PATH, NULL);
+              PJUtils::find_hdr_by_name(rdata->msg_info.msg, &STR_PATH, NULL);
   if (path_hdr != NULL)
   {
     // The response has a Path header in it, so extract the URI so we can
@@ -1656,9 +1693,9 @@ static void proxy_process_register_response(pjsip_rx_data* rdata)
         // authorized identity.
         std::string service_route;
         pjsip_route_hdr* h_sr = (pjsip_route_hdr*)
-                               pjsip_msg_find_hdr_by_name(rdata->msg_info.msg,
-                                                          &STR_SERVICE_ROUTE,
-                                                          NULL);
+                               PJUtils::find_hdr_by_name(rdata->msg_info.msg,
+                                                         &STR_SERVICE_ROUTE,
+                                                         NULL);
 
         if (h_sr != NULL)
         {
@@ -1670,9 +1707,9 @@ static void proxy_process_register_response(pjsip_rx_data* rdata)
         // them on the flow.  This is either the list in the P-Associated-URI
         // header, if supplied, or the URI in the To header.
         pjsip_route_hdr* p_assoc_uri = (pjsip_route_hdr*)
-                             pjsip_msg_find_hdr_by_name(rdata->msg_info.msg,
-                                                        &STR_P_ASSOCIATED_URI,
-                                                        NULL);
+                             PJUtils::find_hdr_by_name(rdata->msg_info.msg,
+                                                       &STR_P_ASSOCIATED_URI,
+                                                       NULL);
         if (p_assoc_uri != NULL)
         {
           // Use P-Associated-URIs list as list of authenticated URIs.
@@ -1685,9 +1722,9 @@ static void proxy_process_register_response(pjsip_rx_data* rdata)
                                     is_default,
                                     max_expires);
             p_assoc_uri = (pjsip_route_hdr*)
-                              pjsip_msg_find_hdr_by_name(rdata->msg_info.msg,
-                                                         &STR_P_ASSOCIATED_URI,
-                                                         p_assoc_uri->next);
+                              PJUtils::find_hdr_by_name(rdata->msg_info.msg,
+                                                        &STR_P_ASSOCIATED_URI,
+                                                        p_assoc_uri->next);
             is_default = false;
           }
         }
@@ -1723,7 +1760,8 @@ UASTransaction::UASTransaction(pjsip_transaction* tsx,
                                pjsip_rx_data* rdata,
                                pjsip_tx_data* tdata,
                                TrustBoundary* trust,
-                               ACR* acr) :
+                               ACR* acr,
+                               Flow* client_flow) :
   _tsx(tsx),
   _num_targets(0),
   _pending_targets(0),
@@ -1736,7 +1774,8 @@ UASTransaction::UASTransaction(pjsip_transaction* tsx,
   _upstream_acr(acr),
   _downstream_acr(acr),
   _in_dialog(false),
-  _se_helper(stack_data.default_session_expires)
+  _se_helper(stack_data.default_session_expires),
+  _client_flow(client_flow)
 {
   TRC_DEBUG("UASTransaction constructor (%p)", this);
   TRC_DEBUG("ACR (%p)", acr);
@@ -1766,11 +1805,7 @@ UASTransaction::UASTransaction(pjsip_transaction* tsx,
   log_on_tsx_start(rdata);
 
   _tsx->mod_data[mod_tu.id] = this;
-
-  // initialise deferred trying timer
-  pthread_mutex_init(&_trying_timer_lock, NULL);
-  pj_timer_entry_init(&_trying_timer, 0, (void*)this, &trying_timer_callback);
-  _trying_timer.id = 0;
+  TsxIndex::add(_tsx);
 
   // Record whether or not this is an in-dialog request.  This is needed
   // to determine whether or not to send interim ACRs on provisional
@@ -1789,6 +1824,7 @@ UASTransaction::~UASTransaction()
 
   if (_tsx != NULL)
   {
+    TsxIndex::remove(_tsx);
     _tsx->mod_data[mod_tu.id] = NULL;
   }
 
@@ -1799,9 +1835,6 @@ UASTransaction::~UASTransaction()
     cancel_pending_uac_tsx(0, true);
   }
 
-  cancel_trying_timer();
-  pthread_mutex_destroy(&_trying_timer_lock);
-
   // Disconnect all UAC transactions from the UAS transaction.
   TRC_DEBUG("Disconnect UAC transactions from UAS transaction");
   for (int ii = 0; ii < _num_targets; ++ii)
@@ -1845,6 +1878,12 @@ UASTransaction::~UASTransaction()
     _best_rsp = NULL;
   }
 
+  if (_client_flow != NULL)
+  {
+    _client_flow->dec_ref();
+    _client_flow = NULL;
+  }
+
   pj_grp_lock_release(_lock);
   pj_grp_lock_dec_ref(_lock);
 
@@ -1862,6 +1901,7 @@ pj_status_t UASTransaction::create(pjsip_rx_data* rdata,
                                    pjsip_tx_data* tdata,
                                    TrustBoundary* trust,
                                    ACR* acr,
+                                   Flow* client_flow,
                                    UASTransaction** uas_data_ptr)
 {
   // Create a group lock, and take it.  This avoids the transaction being
@@ -1889,7 +1929,7 @@ pj_status_t UASTransaction::create(pjsip_rx_data* rdata,
   }
 
   // Allocate UAS data to keep track of the transaction.
-  *uas_data_ptr = new UASTransaction(uas_tsx, rdata, tdata, trust, acr);
+  *uas_data_ptr = new UASTransaction(uas_tsx, rdata, tdata, trust, acr, client_flow);
 
   // Enter the transaction's context, and then release our copy of the
   // group lock.
@@ -2179,7 +2219,7 @@ void UASTransaction::on_tsx_state(pjsip_event* event)
     assert(edge_proxy);
     SIPPeerType stype  = determine_source(_tsx->transport, _tsx->addr);
     bool is_client = (stype == SIP_PEER_CLIENT);
-    dialog_tracker->on_uas_tsx_complete(_req, _tsx, event, is_client);
+    dialog_tracker->on_uas_tsx_complete(_req, _tsx, event, is_client, _client_flow);
 
     log_on_tsx_complete();
   }
@@ -2193,6 +2233,7 @@ void UASTransaction::on_tsx_state(pjsip_event* event)
       // pending UAC transactions they should be cancelled.
       cancel_pending_uac_tsx(0, true);
     }
+    TsxIndex::remove(_tsx);
     _tsx->mod_data[mod_tu.id] = NULL;
     _tsx = NULL;
     _pending_destroy = true;
@@ -2551,7 +2592,8 @@ UACTransaction::UACTransaction(UASTransaction* uas_data,
   _servers(),
   _current_server(0),
   _pending_destroy(false),
-  _context_count(0)
+  _context_count(0),
+  _upstream_tp(NULL)
 {
   // Add a reference to the request so we can be sure it remains valid for retries.
   pjsip_tx_data_add_ref(_tdata);
@@ -2561,9 +2603,12 @@ UACTransaction::UACTransaction(UASTransaction* uas_data,
   pj_grp_lock_add_ref(tsx->grp_lock);
 
   _tsx->mod_data[mod_tu.id] = this;
+  TsxIndex::add(_tsx);
 
-  // Initialise the liveness timer.
+  // Initialise the liveness timer, which runs on the sending worker's timer
+  // wheel if it can, and on the PJSIP timer heap otherwise.
   pj_timer_entry_init(&_liveness_timer, 0, (void*)this, &liveness_timer_callback);
+  TimerWheel::init_entry(&_liveness_wheel_entry, &liveness_wheel_callback, (void*)this);
 }
 
 /// UACTransaction destructor.  On entry, the group lock must be held.  On
@@ -2574,6 +2619,7 @@ UACTransaction::~UACTransaction()
 
   if (_tsx != NULL)
   {
+    TsxIndex::remove(_tsx);
     _tsx->mod_data[mod_tu.id] = NULL;
   }
 
@@ -2588,13 +2634,13 @@ UACTransaction::~UACTransaction()
     _tdata = NULL;
   }
 
-  if (_liveness_timer.id == LIVENESS_TIMER)
+  if (_upstream_tp != NULL)
   {
-    // The liveness timer is running, so cancel it.
-    _liveness_timer.id = 0;
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_liveness_timer);
+    upstream_request_complete(false);
   }
 
+  cancel_liveness_timer();
+
   if ((_tsx != NULL) &&
       (_tsx->state != PJSIP_TSX_STATE_TERMINATED) &&
       (_tsx->state != PJSIP_TSX_STATE_DESTROYED))
@@ -2722,6 +2768,15 @@ void UACTransaction::set_target(const struct Target& target)
          sizeof(pj_sockaddr_in) : sizeof(pj_sockaddr_in6);
     _tdata->dest_info.cur_addr = 0;
 
+    if ((target.upstream_route) && (upstream_conn_pool != NULL))
+    {
+      // The transport came from the upstream connection pool, so track the
+      // load on it.
+      _upstream_tp = target.transport;
+      _upstream_stop_watch.start();
+      upstream_conn_pool->request_started(_upstream_tp);
+    }
+
     // Remove the reference to the transport added when it was chosen.
     pjsip_transport_dec_ref(target.transport);
   }
@@ -2735,6 +2790,25 @@ void UACTransaction::set_target(const struct Target& target)
   exit_context();
 }
 
+// Tells the upstream connection pool that the transaction on one of its
+// connections has finished, and how long it took if it got a response.
+void UACTransaction::upstream_request_complete(bool responded)
+{
+  if (upstream_conn_pool != NULL)
+  {
+    unsigned long latency_us = 0;
+    long sample_us = -1;
+    if ((responded) && (_upstream_stop_watch.read(latency_us)))
+    {
+      sample_us = (long)latency_us;
+    }
+
+    upstream_conn_pool->request_complete(_upstream_tp, sample_us);
+  }
+
+  _upstream_tp = NULL;
+}
+
 // Sends the initial request on this UAC transaction.
 void UACTransaction::send_request()
 {
@@ -2793,9 +2867,7 @@ void UACTransaction::send_request()
     // Sent the request successfully.
     if (_liveness_timeout != 0)
     {
-      _liveness_timer.id = LIVENESS_TIMER;
-      pj_time_val delay = {_liveness_timeout, 0};
-      pjsip_endpt_schedule_timer(stack_data.endpt, &_liveness_timer, &delay);
+      start_liveness_timer();
     }
   }
 
@@ -2868,6 +2940,21 @@ void UACTransaction::on_tsx_state(pjsip_event* event)
   // terminated or been cancelled.
   TRC_DEBUG("%s - uac_data = %p, uas_data = %p", name(), this, _uas_data);
 
+  if ((_upstream_tp != NULL) && (event->body.tsx_state.tsx == _tsx))
+  {
+    // Let the upstream connection pool know when the transaction sent on one
+    // of its connections gets a final response, or fails.
+    if ((event->body.tsx_state.type == PJSIP_EVENT_RX_MSG) &&
+        (event->body.tsx_state.src.rdata->msg_info.msg->line.status.code >= 200))
+    {
+      upstream_request_complete(true);
+    }
+    else if (_tsx->state == PJSIP_TSX_STATE_TERMINATED)
+    {
+      upstream_request_complete(false);
+    }
+  }
+
   // Check that the event is on the current UAC transaction (we may have
   // created a new one for a retry) and is still connected to the UAS
   // transaction.
@@ -2906,12 +2993,8 @@ void UACTransaction::on_tsx_state(pjsip_event* event)
       if (event->body.tsx_state.type == PJSIP_EVENT_RX_MSG)
       {
         TRC_DEBUG("%s - RX_MSG on active UAC transaction", name());
-        if (_liveness_timer.id == LIVENESS_TIMER)
-        {
-          // The liveness timer is running on this transaction, so cancel it.
-          _liveness_timer.id = 0;
-          pjsip_endpt_cancel_timer(stack_data.endpt, &_liveness_timer);
-        }
+        // Cancel the liveness timer, if it's running on this transaction.
+        cancel_liveness_timer();
 
         if (_uas_data != NULL) {
           pjsip_rx_data* rdata = event->body.tsx_state.src.rdata;
@@ -2954,6 +3037,7 @@ void UACTransaction::on_tsx_state(pjsip_event* event)
       (_tsx->state == PJSIP_TSX_STATE_DESTROYED))
   {
     TRC_DEBUG("%s - UAC tsx destroyed", _tsx->obj_name);
+    TsxIndex::remove(_tsx);
     _tsx->mod_data[mod_tu.id] = NULL;
     _tsx = NULL;
     _pending_destroy = true;
@@ -2992,8 +3076,10 @@ bool UACTransaction::retry_request()
       TRC_DEBUG("Created transaction for retry, so send request");
       pjsip_transaction* original_tsx = _tsx;
       _tsx = retry_tsx;
+      TsxIndex::remove(original_tsx);
       original_tsx->mod_data[mod_tu.id] = NULL;
       _tsx->mod_data[mod_tu.id] = this;
+      TsxIndex::add(_tsx);
 
       // Add the trail from the UAS transaction to the UAC transaction.
       set_trail(_tsx, _uas_data->trail());
@@ -3018,9 +3104,11 @@ bool UACTransaction::retry_request()
         // through to the end.  Must decrement the reference count on the
         // request as pjsip_tsx_send_msg won't do it if it fails.
         pjsip_tx_data_dec_ref(_tdata);
+        TsxIndex::remove(_tsx);
         _tsx->mod_data[mod_tu.id] = NULL;
         _tsx = original_tsx;
         _tsx->mod_data[mod_tu.id] = this;
+        TsxIndex::add(_tsx);
       }
     }
   }
@@ -3057,32 +3145,42 @@ void UACTransaction::liveness_timer_callback(pj_timer_heap_t *timer_heap, struct
   }
 }
 
-/// Handle the trying timer expiring on this transaction.
-void UASTransaction::trying_timer_expired()
+/// Static method called on a worker thread when a liveness timer on its
+/// timer wheel expires.
+void UACTransaction::liveness_wheel_callback(TimerWheel::Entry* entry)
 {
-  enter_context();
-  pthread_mutex_lock(&_trying_timer_lock);
+  ((UACTransaction*)entry->user_data)->liveness_timer_expired();
+}
+
+/// Starts the liveness timer.  On a worker thread with its own timer wheel
+/// this is a constant time insert under that worker's lock, and the timer
+/// pops on the same worker in a batch with the others that are due.
+/// Otherwise, the timer goes on the PJSIP timer heap.
+void UACTransaction::start_liveness_timer()
+{
+  // A retried request restarts the timer.
+  cancel_liveness_timer();
 
-  if ((_trying_timer.id == TRYING_TIMER) &&
-      (_tsx->state == PJSIP_TSX_STATE_TRYING))
+  if (!schedule_worker_timer(&_liveness_wheel_entry, _liveness_timeout * 1000))
   {
-    // Transaction is still in Trying state, so send a 100 Trying response
-    // now.
-    send_response(100);
-    _trying_timer.id = 0;
+    _liveness_timer.id = LIVENESS_TIMER;
+    pj_time_val delay = {_liveness_timeout, 0};
+    pjsip_endpt_schedule_timer(stack_data.endpt, &_liveness_timer, &delay);
   }
-
-  pthread_mutex_unlock(&_trying_timer_lock);
-  exit_context();
 }
 
-/// Static method called by PJSIP when a trying timer expires.  The instance
-/// is stored in the user_data field of the timer entry.
-void UASTransaction::trying_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+/// Cancels the liveness timer, if it is running.
+void UACTransaction::cancel_liveness_timer()
 {
-  if (entry->id == TRYING_TIMER)
+  if (_liveness_wheel_entry.owner >= 0)
+  {
+    cancel_worker_timer(&_liveness_wheel_entry);
+  }
+
+  if (_liveness_timer.id == LIVENESS_TIMER)
   {
-    ((UASTransaction*)entry->user_data)->trying_timer_expired();
+    _liveness_timer.id = 0;
+    pjsip_endpt_cancel_timer(stack_data.endpt, &_liveness_timer);
   }
 }
 
@@ -3145,7 +3243,9 @@ pj_status_t init_stateful_proxy(pj_bool_t enable_edge_proxy,
                                 QuiescingManager* quiescing_manager,
                                 bool icscf_enabled,
                                 bool scscf_enabled,
-                                bool emerg_reg_accepted)
+                                bool emerg_reg_accepted,
+                                bool upstream_least_loaded,
+                                bool upstream_affinity)
 {
   analytics_logger = analytics;
   icscf = icscf_enabled;
@@ -3167,7 +3267,9 @@ pj_status_t init_stateful_proxy(pj_bool_t enable_edge_proxy,
   // and handle access proxy quiescing.
   flow_count = new SNMP::U32Scalar("bono_connected_clients",
                                    ".1.2.826.0.1.1578918.9.2.1");
-  flow_table = new FlowTable(quiescing_manager, flow_count);
+  flow_memory = new SNMP::U32Scalar("bono_flow_memory_bytes",
+                                    ".1.2.826.0.1.1578918.9.2.10");
+  flow_table = new FlowTable(quiescing_manager, flow_count, flow_memory);
   quiescing_manager->register_flows_handler(flow_table);
 
   // Create a dialog tracker to count dialogs on each flow
@@ -3181,13 +3283,19 @@ pj_status_t init_stateful_proxy(pj_bool_t enable_edge_proxy,
     pool_target.port = upstream_proxy_port;
     sprout_ip_tbl = SNMP::IPCountTable::create("bono_connected_sprouts",
                                                ".1.2.826.0.1.1578918.9.2.3.1");
+    sprout_load_tbl = SNMP::IPCountTable::create("bono_sprout_transactions_in_flight",
+                                                 ".1.2.826.0.1.1578918.9.2.11.1");
     upstream_conn_pool = new SIPConnectionPool(&pool_target,
         upstream_proxy_connections,
         upstream_proxy_recycle,
         stack_data.pool,
         stack_data.endpt,
         stack_data.pcscf_trusted_tcp_factory,
-        sprout_ip_tbl);
+        sprout_ip_tbl,
+        upstream_least_loaded ? SIPConnectionPool::LEAST_LOADED :
+        upstream_affinity ? SIPConnectionPool::AFFINITY :
+                            SIPConnectionPool::RANDOM,
+        sprout_load_tbl);
     upstream_conn_pool->init();
   }
 
@@ -3212,7 +3320,7 @@ pj_status_t init_stateful_proxy(pj_bool_t enable_edge_proxy,
       }
       char buf[100];
       TRC_STATUS("Adding host %s to list", pj_sockaddr_print(&sockaddr, buf, sizeof(buf), 1));
-      trusted_hosts.insert(std::make_pair(sockaddr, true));
+      trusted_hosts.insert(sockaddr);
     }
   }
 
@@ -3234,7 +3342,7 @@ pj_status_t init_stateful_proxy(pj_bool_t enable_edge_proxy,
     }
     char buf[100];
     TRC_STATUS("Adding PBX %s to list", pj_sockaddr_print(&sockaddr, buf, sizeof(buf), 1));
-    pbx_hosts.insert(std::make_pair(sockaddr, true));
+    pbx_hosts.insert(sockaddr);
   }
 
   // If present, check the PBX service route is valid.
@@ -3275,12 +3383,15 @@ void destroy_stateful_proxy()
   // connections.
   delete upstream_conn_pool; upstream_conn_pool = NULL;
   delete sprout_ip_tbl; sprout_ip_tbl = NULL;
+  delete sprout_load_tbl; sprout_load_tbl = NULL;
 
   // Destroy the flow table.
-  delete flow_count;
-  flow_count = NULL;
   delete flow_table;
   flow_table = NULL;
+  delete flow_count;
+  flow_count = NULL;
+  delete flow_memory;
+  flow_memory = NULL;
 
   delete dialog_tracker;
   dialog_tracker = NULL;
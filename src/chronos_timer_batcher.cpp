@@ -0,0 +1,257 @@
+/**
+ * @file chronos_timer_batcher.cpp Implementation of ChronosTimerBatcher.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include "chronos_timer_batcher.h"
+#include "log.h"
+
+const int ChronosTimerBatcher::MAX_INTERVAL_MS;
+const size_t ChronosTimerBatcher::MAX_TIMERS;
+
+ChronosTimerBatcher::ChronosTimerBatcher(ChronosConnection* chronos,
+                                         int interval_ms) :
+  // The base connection is never used - every request goes to the wrapped
+  // connection.
+  ChronosConnection("", NULL),
+  _chronos(chronos),
+  _interval_ms(std::min(std::max(1, interval_ms), MAX_INTERVAL_MS)),
+  _terminated(false)
+{
+  TRC_STATUS("Sending AoR timer updates to Chronos every %dms", _interval_ms);
+  _flusher = std::thread(&ChronosTimerBatcher::flusher, this);
+}
+
+ChronosTimerBatcher::~ChronosTimerBatcher()
+{
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _terminated = true;
+    _cond.notify_all();
+  }
+
+  if (_flusher.joinable())
+  {
+    _flusher.join();
+  }
+
+  // Send anything that was collected after the last flush.
+  flush();
+}
+
+HTTPCode ChronosTimerBatcher::send_delete(const std::string& delete_identity,
+                                          SAS::TrailId trail)
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  Update& update = _updates[delete_identity];
+  update.del = true;
+  update.trail = trail;
+  update.callback_uri.clear();
+  update.opaque_data.clear();
+  update.tags.clear();
+  _timers.erase(delete_identity);
+  return HTTP_OK;
+}
+
+HTTPCode ChronosTimerBatcher::send_put(std::string& put_identity,
+                                       uint32_t timer_interval,
+                                       const std::string& callback_uri,
+                                       const std::string& opaque_data,
+                                       SAS::TrailId trail,
+                                       const std::map<std::string, uint32_t>& tags)
+{
+  size_t timer_hash = hash(callback_uri, opaque_data, tags);
+
+  std::unique_lock<std::mutex> lock(_lock);
+  std::map<std::string, Update>::iterator update = _updates.find(put_identity);
+
+  if (update == _updates.end())
+  {
+    std::unordered_map<std::string, Timer>::const_iterator timer =
+                                                    _timers.find(put_identity);
+    if (timer != _timers.end())
+    {
+      uint64_t pop_time_ms = now_ms() + (uint64_t)timer_interval * 1000;
+      uint64_t difference_ms = (pop_time_ms > timer->second.pop_time_ms) ?
+                                 pop_time_ms - timer->second.pop_time_ms :
+                                 timer->second.pop_time_ms - pop_time_ms;
+
+      if ((difference_ms < 1000) && (timer->second.hash == timer_hash))
+      {
+        // The timer is already set to this.
+        TRC_DEBUG("Chronos timer %s is unchanged", put_identity.c_str());
+        return HTTP_OK;
+      }
+    }
+
+    update = _updates.emplace(put_identity, Update()).first;
+  }
+
+  // Replace any update to this timer that's already waiting.
+  update->second.del = false;
+  update->second.timer_interval = timer_interval;
+  update->second.callback_uri = callback_uri;
+  update->second.opaque_data = opaque_data;
+  update->second.trail = trail;
+  update->second.tags = tags;
+  return HTTP_OK;
+}
+
+HTTPCode ChronosTimerBatcher::send_post(std::string& post_identity,
+                                        uint32_t timer_interval,
+                                        const std::string& callback_uri,
+                                        const std::string& opaque_data,
+                                        SAS::TrailId trail,
+                                        const std::map<std::string, uint32_t>& tags)
+{
+  // The caller needs the new timer's ID, so this can't wait.
+  HTTPCode status = _chronos->send_post(post_identity,
+                                        timer_interval,
+                                        callback_uri,
+                                        opaque_data,
+                                        trail,
+                                        tags);
+
+  if (status == HTTP_OK)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    record_timer(post_identity,
+                 timer_interval,
+                 hash(callback_uri, opaque_data, tags));
+  }
+
+  return status;
+}
+
+void ChronosTimerBatcher::flush()
+{
+  std::map<std::string, Update> updates;
+
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    updates.swap(_updates);
+  }
+
+  if (updates.empty())
+  {
+    return;
+  }
+
+  TRC_DEBUG("Send %lu Chronos timer updates", updates.size());
+
+  for (std::pair<const std::string, Update>& entry : updates)
+  {
+    std::string timer_id = entry.first;
+    Update& update = entry.second;
+    HTTPCode status;
+
+    if (update.del)
+    {
+      status = _chronos->send_delete(timer_id, update.trail);
+    }
+    else
+    {
+      status = _chronos->send_put(timer_id,
+                                  update.timer_interval,
+                                  update.callback_uri,
+                                  update.opaque_data,
+                                  update.trail,
+                                  update.tags);
+    }
+
+    std::unique_lock<std::mutex> lock(_lock);
+
+    if ((!update.del) &&
+        (status == HTTP_OK) &&
+        (_updates.find(timer_id) == _updates.end()))
+    {
+      record_timer(timer_id,
+                   update.timer_interval,
+                   hash(update.callback_uri, update.opaque_data, update.tags));
+    }
+    else
+    {
+      // Either this failed, or the timer has been deleted or changed again
+      // since, so don't skip the next update.
+      _timers.erase(timer_id);
+    }
+
+    if ((status != HTTP_OK) &&
+        ((!update.del) || (status != HTTP_NOT_FOUND)))
+    {
+      TRC_WARNING("Failed to %s Chronos timer %s: %d",
+                  update.del ? "delete" : "update",
+                  timer_id.c_str(),
+                  status);
+    }
+  }
+}
+
+uint64_t ChronosTimerBatcher::now_ms()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t ChronosTimerBatcher::hash(const std::string& callback_uri,
+                                 const std::string& opaque_data,
+                                 const std::map<std::string, uint32_t>& tags)
+{
+  std::string key = callback_uri + '\0' + opaque_data;
+
+  for (const std::pair<const std::string, uint32_t>& tag : tags)
+  {
+    key += '\0' + tag.first + '=' + std::to_string(tag.second);
+  }
+
+  return std::hash<std::string>()(key);
+}
+
+void ChronosTimerBatcher::record_timer(const std::string& timer_id,
+                                       uint32_t timer_interval,
+                                       size_t hash)
+{
+  if (_timers.size() >= MAX_TIMERS)
+  {
+    // Forgetting the timers only means that their next updates are sent.
+    TRC_DEBUG("Forget %lu Chronos timers", _timers.size());
+    _timers.clear();
+  }
+
+  _timers[timer_id] = Timer{now_ms() + (uint64_t)timer_interval * 1000, hash};
+}
+
+void ChronosTimerBatcher::flusher()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+  while (!_terminated)
+  {
+    next += std::chrono::milliseconds(_interval_ms);
+    while ((!_terminated) && (std::chrono::steady_clock::now() < next))
+    {
+      _cond.wait_until(lock, next);
+    }
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    // Send the updates without the lock held.
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
@@ -63,6 +63,11 @@ HTTPCode ChronosAuthTimeoutTask::handle_response(std::string body)
     return HTTP_BAD_REQUEST;
   }
 
+  if ((doc.IsObject()) && (doc.HasMember("challenges")))
+  {
+    return handle_batch(doc["challenges"]);
+  }
+
   try
   {
     JSON_GET_STRING_MEMBER(doc, "impu", impu);
@@ -76,3 +81,49 @@ HTTPCode ChronosAuthTimeoutTask::handle_response(std::string body)
   }
   return timeout_auth_challenge(impu, impi, nonce);
 }
+
+// Handles a timer set for a batch of challenges by AuthTimeoutBatcher.  Each
+// challenge is checked in turn, and if any of them fail we return an error so
+// that the timer service retries the whole batch in a different Sprout (which
+// is safe, as the AUTHENTICATION_TIMEOUT SAR is idempotent).
+HTTPCode ChronosAuthTimeoutTask::handle_batch(const rapidjson::Value& challenges)
+{
+  if (!challenges.IsArray())
+  {
+    TRC_INFO("Badly formed opaque data (challenges is not an array)");
+    return HTTP_BAD_REQUEST;
+  }
+
+  HTTPCode rc = HTTP_OK;
+
+  for (rapidjson::Value::ConstValueIterator challenge = challenges.Begin();
+       challenge != challenges.End();
+       ++challenge)
+  {
+    std::string impi;
+    std::string impu;
+    std::string nonce;
+
+    try
+    {
+      JSON_GET_STRING_MEMBER(*challenge, "impu", impu);
+      JSON_GET_STRING_MEMBER(*challenge, "impi", impi);
+      JSON_GET_STRING_MEMBER(*challenge, "nonce", nonce);
+    }
+    catch (JsonFormatError err)
+    {
+      TRC_INFO("Badly formed opaque data (missing impu, impi or nonce");
+      rc = HTTP_BAD_REQUEST;
+      continue;
+    }
+
+    HTTPCode challenge_rc = timeout_auth_challenge(impu, impi, nonce);
+
+    if ((challenge_rc != HTTP_OK) && (rc != HTTP_BAD_REQUEST))
+    {
+      rc = challenge_rc;
+    }
+  }
+
+  return rc;
+}
@@ -37,9 +37,21 @@ extern "C" {
 #include "utils.h"
 #include "health_checker.h"
 #include "uri_classifier.h"
-
-static SNMP::CounterByScopeTable* requests_counter = NULL;
+#include "stage_latency.h"
+#include "flight_recorder.h"
+#include "send_queue_monitor.h"
+#include "tsx_index.h"
+#include "sas_message_log.h"
+#include "metrics.h"
+#include "snmp_shards.h"
+
+// Counted per thread, and passed to the SNMP table periodically.
+static SNMPShards::Counter<SNMP::CounterByScopeTable>* requests_counter = NULL;
+static Metrics::Counter* requests_metric = NULL;
 static HealthChecker* health_checker = NULL;
+static StageHistogram* send_stage = NULL;
+static SasMessageLog* sas_message_log = NULL;
+static SipCapture* sip_capture = NULL;
 
 static pj_bool_t process_on_rx_msg(pjsip_rx_data* rdata);
 static pj_status_t process_on_tx_msg(pjsip_tx_data* tdata);
@@ -104,6 +116,29 @@ static void local_log_tx_msg(pjsip_tx_data* tdata)
 }
 
 // LCOV_EXCL_START - can't meaningfully test SAS in UT
+
+// Logs the event holding a sent or received message, on the SAS logging
+// thread if there is one.
+static void sas_log_msg_event(SAS::TrailId trail,
+                              uint32_t event_id,
+                              pjsip_transport* transport,
+                              int port,
+                              const char* name,
+                              int len,
+                              const char* msg)
+{
+  uint32_t transport_type = pjsip_transport_get_type_from_flag(transport->flag);
+
+  if (sas_message_log != NULL)
+  {
+    sas_message_log->log(trail, event_id, transport_type, port, name, len, msg);
+  }
+  else
+  {
+    SasMessageLog::report(trail, event_id, transport_type, port, name, len, msg);
+  }
+}
+
 static void sas_log_rx_msg(pjsip_rx_data* rdata)
 {
   bool first_message_in_trail = false;
@@ -138,7 +173,7 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
     pj_str_t key;
     pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_ROLE_UAC,
                          &rdata->msg_info.cseq->method, rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_FALSE);
+    pjsip_transaction* tsx = TsxIndex::find(&key, false);
     if (tsx)
     {
       // Found the UAC transaction, so get the trail if there is one.
@@ -152,7 +187,7 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
     pj_str_t key;
     pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
                          &rdata->msg_info.cseq->method, rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_FALSE);
+    pjsip_transaction* tsx = TsxIndex::find(&key, false);
     if (tsx)
     {
       // Found the UAS transaction, so get the trail if there is one.
@@ -166,7 +201,7 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
     pj_str_t key;
     pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
                          pjsip_get_invite_method(), rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_FALSE);
+    pjsip_transaction* tsx = TsxIndex::find(&key, false);
     if (tsx)
     {
       // Found the INVITE UAS transaction, so get the trail if there is one.
@@ -256,12 +291,13 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
   }
 
   // Log the message event.
-  SAS::Event event(trail, SASEvent::RX_SIP_MSG, 0);
-  event.add_static_param(pjsip_transport_get_type_from_flag(rdata->tp_info.transport->flag));
-  event.add_static_param(rdata->pkt_info.src_port);
-  event.add_var_param(rdata->pkt_info.src_name);
-  event.add_var_param(rdata->msg_info.len, rdata->msg_info.msg_buf);
-  SAS::report_event(event);
+  sas_log_msg_event(trail,
+                    SASEvent::RX_SIP_MSG,
+                    rdata->tp_info.transport,
+                    rdata->pkt_info.src_port,
+                    rdata->pkt_info.src_name,
+                    rdata->msg_info.len,
+                    rdata->msg_info.msg_buf);
 }
 
 
@@ -303,12 +339,13 @@ static void sas_log_tx_msg(pjsip_tx_data *tdata)
     }
 
     // Log the message event.
-    SAS::Event event(trail, SASEvent::TX_SIP_MSG, 0);
-    event.add_static_param(pjsip_transport_get_type_from_flag(tdata->tp_info.transport->flag));
-    event.add_static_param(tdata->tp_info.dst_port);
-    event.add_var_param(tdata->tp_info.dst_name);
-    event.add_var_param((int)(tdata->buf.cur - tdata->buf.start), tdata->buf.start);
-    SAS::report_event(event);
+    sas_log_msg_event(trail,
+                      SASEvent::TX_SIP_MSG,
+                      tdata->tp_info.transport,
+                      tdata->tp_info.dst_port,
+                      tdata->tp_info.dst_name,
+                      (int)(tdata->buf.cur - tdata->buf.start),
+                      tdata->buf.start);
   }
   else
   {
@@ -325,7 +362,20 @@ static pj_bool_t process_on_rx_msg(pjsip_rx_data* rdata)
   local_log_rx_msg(rdata);
   sas_log_rx_msg(rdata);
 
+  if (sip_capture != NULL)
+  {
+    sip_capture->capture(false,
+                         PJSIP_TRANSPORT_IS_RELIABLE(rdata->tp_info.transport),
+                         &rdata->tp_info.transport->local_addr,
+                         &rdata->pkt_info.src_addr,
+                         get_trail(rdata),
+                         (rdata->msg_info.cid != NULL) ? &rdata->msg_info.cid->id : NULL,
+                         rdata->msg_info.len,
+                         rdata->msg_info.msg_buf);
+  }
+
   requests_counter->increment();
+  requests_metric->increment();
 
   // If a message has parse errors, reject it (if it's a request other than ACK)
   // or drop it (if it's a response or an ACK request).
@@ -389,6 +439,52 @@ static pj_status_t process_on_tx_msg(pjsip_tx_data* tdata)
   local_log_tx_msg(tdata);
   sas_log_tx_msg(tdata);
 
+  if (sip_capture != NULL)
+  {
+    pjsip_cid_hdr* cid = PJSIP_MSG_CID_HDR(tdata->msg);
+    sip_capture->capture(true,
+                         PJSIP_TRANSPORT_IS_RELIABLE(tdata->tp_info.transport),
+                         &tdata->tp_info.transport->local_addr,
+                         &tdata->tp_info.dst_addr,
+                         get_trail(tdata),
+                         (cid != NULL) ? &cid->id : NULL,
+                         (int)(tdata->buf.cur - tdata->buf.start),
+                         tdata->buf.start);
+  }
+
+  // Note the message in the flight record of the transaction being
+  // processed, which counts as failed if it sends a server error.
+  if (FlightRecorder::active())
+  {
+    if (tdata->msg->type == PJSIP_REQUEST_MSG)
+    {
+      FlightRecorder::mark("tx",
+                           PJUtils::pj_str_to_string(&tdata->msg->line.req.method.name));
+    }
+    else
+    {
+      FlightRecorder::mark("tx-response", tdata->msg->line.status.code);
+
+      if (tdata->msg->line.status.code >= PJSIP_SC_INTERNAL_SERVER_ERROR)
+      {
+        FlightRecorder::error();
+      }
+    }
+  }
+
+  // If this is sent while processing a received message, trace the time
+  // since that message was queued.
+  StageLatency::Ticks event_start = StageLatency::event_start();
+  if (event_start != 0)
+  {
+    StageLatency::record_since(send_stage, event_start);
+  }
+
+  if (stack_data.send_queue_monitor != NULL)
+  {
+    stack_data.send_queue_monitor->on_tx_msg(tdata);
+  }
+
   // Return success so the message gets transmitted.
   return PJ_SUCCESS;
 }
@@ -396,16 +492,30 @@ static pj_status_t process_on_tx_msg(pjsip_tx_data* tdata)
 
 pj_status_t
 init_common_sip_processing(SNMP::CounterByScopeTable* requests_counter_arg,
-                           HealthChecker* health_checker_arg)
+                           HealthChecker* health_checker_arg,
+                           SasMessageLog* sas_message_log_arg,
+                           SipCapture* sip_capture_arg)
 {
   // Register the stack modules.
   pjsip_endpt_register_module(stack_data.endpt, &mod_common_processing);
   stack_data.sas_logging_module_id = mod_common_processing.id;
 
-  requests_counter = requests_counter_arg;
+  delete requests_counter;
+  requests_counter = (requests_counter_arg != NULL) ?
+    new SNMPShards::Counter<SNMP::CounterByScopeTable>(requests_counter_arg) :
+    NULL;
 
   health_checker = health_checker_arg;
 
+  sas_message_log = sas_message_log_arg;
+
+  sip_capture = sip_capture_arg;
+
+  send_stage = StageLatency::stage("send");
+
+  requests_metric = Metrics::counter("sprout_sip_messages_received",
+                                     "SIP messages received");
+
   return PJ_SUCCESS;
 }
 
@@ -413,4 +523,5 @@ init_common_sip_processing(SNMP::CounterByScopeTable* requests_counter_arg,
 void unregister_common_processing_module(void)
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_common_processing);
+  delete requests_counter; requests_counter = NULL;
 }
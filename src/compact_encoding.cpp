@@ -0,0 +1,138 @@
+/**
+ * @file compact_encoding.cpp Compact binary encoding for records held in
+ * memcached/Astaire.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "compact_encoding.h"
+
+namespace CompactEncoding
+{
+
+void Writer::write_varint(uint64_t value)
+{
+  // Seven bits per byte, least significant first, with the top bit set on
+  // every byte but the last.
+  while (value >= 0x80)
+  {
+    _data.push_back((char)((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+
+  _data.push_back((char)value);
+}
+
+void Writer::add_uint(uint32_t tag, uint64_t value)
+{
+  write_varint(((uint64_t)tag << 3) | VARINT);
+  write_varint(value);
+}
+
+void Writer::add_int(uint32_t tag, int64_t value)
+{
+  add_uint(tag, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void Writer::add_bytes(uint32_t tag, const std::string& value)
+{
+  write_varint(((uint64_t)tag << 3) | BYTES);
+  write_varint(value.length());
+  _data.append(value);
+}
+
+void Writer::add_record(uint32_t tag, const Writer& record)
+{
+  add_bytes(tag, record._data);
+}
+
+bool Reader::read_varint(uint64_t& value)
+{
+  value = 0;
+
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    if (_data == _end)
+    {
+      return false;
+    }
+
+    uint8_t byte = (uint8_t)*_data++;
+    value |= (uint64_t)(byte & 0x7F) << shift;
+
+    if ((byte & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Reader::read_raw_byte(uint8_t& value)
+{
+  if ((_error) || (_data == _end))
+  {
+    return false;
+  }
+
+  value = (uint8_t)*_data++;
+  return true;
+}
+
+bool Reader::next(uint32_t& tag,
+                  WireType& type,
+                  uint64_t& uint_value,
+                  std::string& bytes_value)
+{
+  if ((_error) || (_data == _end))
+  {
+    return false;
+  }
+
+  uint64_t key;
+
+  if (!read_varint(key))
+  {
+    _error = true;
+    return false;
+  }
+
+  tag = (uint32_t)(key >> 3);
+
+  switch (key & 0x07)
+  {
+    case VARINT:
+      type = VARINT;
+      _error = !read_varint(uint_value);
+      break;
+
+    case BYTES:
+      type = BYTES;
+      if ((!read_varint(uint_value)) ||
+          (uint_value > (uint64_t)(_end - _data)))
+      {
+        _error = true;
+      }
+      else
+      {
+        bytes_value.assign(_data, uint_value);
+        _data += uint_value;
+      }
+      break;
+
+    default:
+      // We can't skip a field of an unknown wire type.
+      _error = true;
+      break;
+  }
+
+  return !_error;
+}
+
+};
@@ -17,35 +17,52 @@
 #include "connection_tracker.h"
 #include "stack.h"
 
+const int ConnectionTracker::NUM_SHARDS;
+
 ConnectionTracker::ConnectionTracker(
-                              ConnectionsQuiescedInterface *on_quiesced_handler)
+                              ConnectionsQuiescedInterface *on_quiesced_handler,
+                              int drain_rate)
 :
-  _connection_listeners(),
-  _quiescing(PJ_FALSE),
+  _drain_rate(drain_rate),
+  _drain_timer_running(false),
+  _num_connections(0),
+  _quiescing(false),
   _on_quiesced_handler(on_quiesced_handler)
 {
-  // Lock has always been MUTEX_RECURSIVE
-  pthread_mutexattr_t attrs;
-  pthread_mutexattr_init(&attrs);
-  pthread_mutexattr_settype(&attrs, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init(&_lock, &attrs);
-  pthread_mutexattr_destroy(&attrs);
+  pj_timer_entry_init(&_drain_timer, 0, (void*)this, &on_drain_timer);
 }
 
 
 ConnectionTracker::~ConnectionTracker()
 {
-  for (std::map<pjsip_transport *, pjsip_tp_state_listener_key *>::iterator
-                                             it = _connection_listeners.begin();
-       it != _connection_listeners.end();
-       ++it)
+  if (_drain_timer_running)
   {
-    TRC_DEBUG("Stop listening on connection %p", it->first);
-    pjsip_transport_remove_state_listener(it->first,
-                                          it->second,
-                                          (void *)this);
+    pjsip_endpt_cancel_timer(stack_data.endpt, &_drain_timer);
   }
-  pthread_mutex_destroy(&_lock);
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    Shard& shard = _shards[ii];
+    for (std::map<pjsip_transport *, pjsip_tp_state_listener_key *>::iterator
+                                                   it = shard.listeners.begin();
+         it != shard.listeners.end();
+         ++it)
+    {
+      TRC_DEBUG("Stop listening on connection %p", it->first);
+      pjsip_transport_remove_state_listener(it->first,
+                                            it->second,
+                                            (void *)this);
+    }
+  }
+}
+
+
+ConnectionTracker::Shard& ConnectionTracker::shard_for(pjsip_transport *tp)
+{
+  // Transports are allocated from their own pools, so the low bits of their
+  // addresses are much the same.  Mix the address before picking a shard.
+  uint64_t hash = (uint64_t)(uintptr_t)tp * 0x9E3779B97F4A7C15ULL;
+  return _shards[(hash >> 32) % NUM_SHARDS];
 }
 
 
@@ -66,31 +83,34 @@ void ConnectionTracker::connection_state_update(pjsip_transport *tp,
   {
     TRC_DEBUG("Connection %p has been destroyed", tp);
 
-    pthread_mutex_lock(&_lock);
+    Shard& shard = shard_for(tp);
+    shard.lock.lock();
     // We expect to only be called on the PJSIP transport thread, and our data
     // race/locking safety is based on this assumption. Raise an error log if
     // this is not the case.
     CHECK_PJ_TRANSPORT_THREAD();
 
-    _connection_listeners.erase(tp);
-
-    // If we're quiescing and there are no more active connections, then
-    // quiescing is complete.
-    if (_quiescing)
+    if (shard.listeners.erase(tp) > 0)
     {
-      if (_connection_listeners.empty())
-      {
-        TRC_DEBUG("Connection quiescing complete");
-        quiesce_complete = PJ_TRUE;
-      }
-      else
+      int remaining = --_num_connections;
+
+      // If we're quiescing and there are no more active connections, then
+      // quiescing is complete.
+      if (_quiescing)
       {
-        TRC_STATUS("Quiescing, %d more connections to destroy",
-                   _connection_listeners.size());
+        if (remaining == 0)
+        {
+          TRC_DEBUG("Connection quiescing complete");
+          quiesce_complete = PJ_TRUE;
+        }
+        else
+        {
+          TRC_STATUS("Quiescing, %d more connections to destroy", remaining);
+        }
       }
     }
 
-    pthread_mutex_unlock(&_lock);
+    shard.lock.unlock();
 
     // If quiescing is now complete notify the quiescing manager.
     // Done without the lock to avoid potential deadlock.
@@ -106,7 +126,8 @@ void ConnectionTracker::connection_active(pjsip_transport *tp)
   // We only track connection-oriented transports.
   if ((tp->flag & PJSIP_TRANSPORT_DATAGRAM) == 0)
   {
-    pthread_mutex_lock(&_lock);
+    Shard& shard = shard_for(tp);
+    shard.lock.lock();
 
     // We expect to be called by only websocket transport threads, or the PJSIP
     // transport thread. We must NOT be called by the PJSIP worker thread.
@@ -117,7 +138,7 @@ void ConnectionTracker::connection_active(pjsip_transport *tp)
       CHECK_PJ_TRANSPORT_THREAD();
     }
 
-    if (_connection_listeners.find(tp) == _connection_listeners.end())
+    if (shard.listeners.find(tp) == shard.listeners.end())
     {
       // New connection. Register a state listener so we know when it gets
       // destroyed.
@@ -134,7 +155,8 @@ void ConnectionTracker::connection_active(pjsip_transport *tp)
       }
 
       // Record the listener.
-      _connection_listeners[tp] = key;
+      shard.listeners[tp] = key;
+      ++_num_connections;
 
       // If we're quiescing, shutdown the transport immediately.  The connection
       // will be closed when all transactions that use it have ended.
@@ -144,13 +166,16 @@ void ConnectionTracker::connection_active(pjsip_transport *tp)
       // first time the connection tracker heard about it was after quiesing had
       // started).  Trying to establish new connections after quiescing has
       // started should fail as the listening socket will have been closed.
+      //
+      // quiesce() sets the flag before it walks the shards, so a connection
+      // added concurrently is either seen by the walk or shut down here.
       if (_quiescing)
       {
         TRC_STATUS("Quiescing newly created connection");
         pjsip_transport_shutdown(tp);
       }
     }
-    pthread_mutex_unlock(&_lock);
+    shard.lock.unlock();
   }
 }
 
@@ -161,7 +186,6 @@ void ConnectionTracker::quiesce()
 
   TRC_STATUS("Start quiescing connections");
 
-  pthread_mutex_lock(&_lock);
   // We expect to only be called on the PJSIP transport thread, and our data
   // race/locking safety is based on this assumption. Raise an error log if
   // this is not the case.
@@ -170,40 +194,26 @@ void ConnectionTracker::quiesce()
   // Flag that we're now quiescing. It is illegal to call this method if we're
   // already quiescing.
   assert(!_quiescing);
-  _quiescing = PJ_TRUE;
+  _quiescing = true;
 
   TRC_STATUS("Quiescing %d transactions", pjsip_tsx_layer_get_tsx_count());
 
-  if (_connection_listeners.empty())
+  if (_num_connections == 0)
   {
     // There are no active connections, so quiescing is already complete.
     TRC_STATUS("Connection quiescing complete");
     quiesce_complete = PJ_TRUE;
   }
-  else
+  else if (shutdown_connections(_drain_rate))
   {
-    // Call shutdown on each connection. PJSIP's reference counting means a
-    // connection will be closed once all transactions that use it have
-    // completed.
-    for (std::map<pjsip_transport *, pjsip_tp_state_listener_key *>::iterator
-                                             it = _connection_listeners.begin();
-         it != _connection_listeners.end();
-         ++it)
-    {
-      TRC_STATUS("Shutdown connection %p", it->first);
-      pj_status_t rc = pjsip_transport_shutdown(it->first);
-
-      if (rc != PJ_SUCCESS)
-      {
-        // LCOV_EXCL_START - Not tested in UT
-        TRC_STATUS("Failed to shut down the connection");
-        // LCOV_EXCL_STOP
-      }
-    }
+    // We're draining connections, and there are more to shut down, so shut
+    // down the next batch in a second.
+    TRC_STATUS("Draining connections at %d per second", _drain_rate);
+    pj_time_val delay = {1, 0};
+    pjsip_endpt_schedule_timer(stack_data.endpt, &_drain_timer, &delay);
+    _drain_timer_running = true;
   }
 
-  pthread_mutex_unlock(&_lock);
-
   // If quiescing is now complete notify the quiescing manager.
   // Done without the lock to avoid potential deadlock.
   if (quiesce_complete) {
@@ -216,7 +226,6 @@ void ConnectionTracker::unquiesce()
 {
   TRC_DEBUG("Unquiesce connections");
 
-  pthread_mutex_lock(&_lock);
   // We expect to only be called on the PJSIP transport thread, and our data
   // race/locking safety is based on this assumption. Raise an error log if
   // this is not the case.
@@ -229,7 +238,76 @@ void ConnectionTracker::unquiesce()
   //
   // Note it is illegal to call this method if we're not quiescing.
   assert(_quiescing);
-  _quiescing = PJ_FALSE;
+  _quiescing = false;
+
+  // Stop draining.  The connections we haven't shut down yet carry on as
+  // normal.
+  if (_drain_timer_running)
+  {
+    pjsip_endpt_cancel_timer(stack_data.endpt, &_drain_timer);
+    _drain_timer_running = false;
+  }
+}
+
+
+bool ConnectionTracker::shutdown_connections(int max_connections)
+{
+  int shutdown = 0;
+  bool more = false;
+
+  // Call shutdown on each connection. PJSIP's reference counting means a
+  // connection will be closed once all transactions that use it have
+  // completed.
+  for (int ii = 0; (ii < NUM_SHARDS) && (!more); ++ii)
+  {
+    Shard& shard = _shards[ii];
+    shard.lock.lock();
+
+    for (std::map<pjsip_transport *, pjsip_tp_state_listener_key *>::iterator
+                                                 it = shard.listeners.begin();
+         it != shard.listeners.end();
+         ++it)
+    {
+      if (it->first->is_shutdown)
+      {
+        continue;
+      }
+
+      if ((max_connections > 0) && (shutdown >= max_connections))
+      {
+        more = true;
+        break;
+      }
+
+      TRC_STATUS("Shutdown connection %p", it->first);
+      pj_status_t rc = pjsip_transport_shutdown(it->first);
+      ++shutdown;
 
-  pthread_mutex_unlock(&_lock);
+      if (rc != PJ_SUCCESS)
+      {
+        // LCOV_EXCL_START - Not tested in UT
+        TRC_STATUS("Failed to shut down the connection");
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    shard.lock.unlock();
+  }
+
+  return more;
+}
+
+
+void ConnectionTracker::on_drain_timer(pj_timer_heap_t* th, pj_timer_entry* e)
+{
+  ConnectionTracker* tracker = (ConnectionTracker*)e->user_data;
+  tracker->_drain_timer_running = false;
+
+  if ((tracker->_quiescing) &&
+      (tracker->shutdown_connections(tracker->_drain_rate)))
+  {
+    pj_time_val delay = {1, 0};
+    pjsip_endpt_schedule_timer(stack_data.endpt, &tracker->_drain_timer, &delay);
+    tracker->_drain_timer_running = true;
+  }
 }
@@ -15,9 +15,37 @@
 #include "sproutsasevent.h"
 #include "aor_utils.h"
 
+#include <algorithm>
 #include <limits>
 #include <boost/algorithm/string.hpp>
 
+// A binding that has passed filtering, with what's needed to rank it against
+// the others.  Bindings are only converted to Targets (which means parsing
+// their URIs and Path headers) once they've been picked.
+struct Candidate
+{
+  Bindings::const_iterator binding;
+  bool deprioritized;
+};
+
+static bool compare_priorities(uint32_t q1, bool deprioritized1, int expiry1,
+                               uint32_t q2, bool deprioritized2, int expiry2);
+static void convert_candidates(const std::string& aor,
+                               std::vector<Candidate>::const_iterator begin,
+                               std::vector<Candidate>::const_iterator end,
+                               pj_pool_t* pool,
+                               TargetList& targets);
+
+static bool compare_candidates(const Candidate& c1, const Candidate& c2)
+{
+  return compare_priorities(c1.binding->second->_priority,
+                            c1.deprioritized,
+                            c1.binding->second->_expires,
+                            c2.binding->second->_priority,
+                            c2.deprioritized,
+                            c2.binding->second->_expires);
+}
+
 // Entry point for contact filtering.  Convert the set of bindings to a set of
 // Targets, applying filtering where required.
 void filter_bindings_to_targets(const std::string& aor,
@@ -34,34 +62,34 @@ void filter_bindings_to_targets(const std::string& aor,
 
   // Extract all the Accept-Contact headers.
   pjsip_accept_contact_hdr* accept_header = (pjsip_accept_contact_hdr*)
-    pjsip_msg_find_hdr_by_names(msg,
-                                &STR_ACCEPT_CONTACT,
-                                &STR_ACCEPT_CONTACT_SHORT,
-                                NULL);
+    PJUtils::find_hdr_by_names(msg,
+                               &STR_ACCEPT_CONTACT,
+                               &STR_ACCEPT_CONTACT_SHORT,
+                               NULL);
   while (accept_header != NULL)
   {
     accept_headers.push_back(accept_header);
     accept_header = (pjsip_accept_contact_hdr*)
-      pjsip_msg_find_hdr_by_names(msg,
-                                  &STR_ACCEPT_CONTACT,
-                                  &STR_ACCEPT_CONTACT_SHORT,
-                                  accept_header->next);
+      PJUtils::find_hdr_by_names(msg,
+                                 &STR_ACCEPT_CONTACT,
+                                 &STR_ACCEPT_CONTACT_SHORT,
+                                 accept_header->next);
   }
 
   // Extract all the Reject-Contact headers.
   pjsip_reject_contact_hdr* reject_header = (pjsip_reject_contact_hdr*)
-    pjsip_msg_find_hdr_by_names(msg,
-                                &STR_REJECT_CONTACT,
-                                &STR_REJECT_CONTACT_SHORT,
-                                NULL);
+    PJUtils::find_hdr_by_names(msg,
+                               &STR_REJECT_CONTACT,
+                               &STR_REJECT_CONTACT_SHORT,
+                               NULL);
   while (reject_header != NULL)
   {
     reject_headers.push_back(reject_header);
     reject_header = (pjsip_reject_contact_hdr*)
-      pjsip_msg_find_hdr_by_names(msg,
-                                  &STR_REJECT_CONTACT,
-                                  &STR_REJECT_CONTACT_SHORT,
-                                  reject_header->next);
+      PJUtils::find_hdr_by_names(msg,
+                                 &STR_REJECT_CONTACT,
+                                 &STR_REJECT_CONTACT_SHORT,
+                                 reject_header->next);
   }
 
   // Maybe add an implicit filter.
@@ -70,6 +98,21 @@ void filter_bindings_to_targets(const std::string& aor,
                        accept_headers,
                        reject_headers);
 
+  // Parse the feature predicates up front, rather than again for every
+  // binding they're compared with.
+  std::vector<FeaturePredicate> accept_predicates;
+  std::vector<FeaturePredicate> reject_predicates;
+
+  for (pjsip_accept_contact_hdr* accept : accept_headers)
+  {
+    accept_predicates.push_back(compile_feature_predicate(accept));
+  }
+
+  for (pjsip_reject_contact_hdr* reject : reject_headers)
+  {
+    reject_predicates.push_back(compile_feature_predicate(reject));
+  }
+
   // Iterate over the Bindings, checking if they're valid and creating a target
   // if so.
   int bindings_rejected_due_to_gruu = 0;
@@ -83,6 +126,9 @@ void filter_bindings_to_targets(const std::string& aor,
   }
 
   // Loop over the bindings, trying to match each.
+  std::vector<Candidate> candidates;
+  candidates.reserve(bindings.size());
+
   for (Bindings::const_iterator binding = bindings.begin();
        binding != bindings.end();
        ++binding)
@@ -125,11 +171,13 @@ void filter_bindings_to_targets(const std::string& aor,
     }
 
     // Perform Reject-Contact filtering.
-    for (std::vector<pjsip_reject_contact_hdr*>::iterator reject = reject_headers.begin();
-         reject != reject_headers.end() && (!rejected);
+    ContactFeatures contact_features(binding->second->_params);
+
+    for (std::vector<FeaturePredicate>::const_iterator reject = reject_predicates.begin();
+         reject != reject_predicates.end() && (!rejected);
          ++reject)
     {
-      if (match_feature_sets(binding->second->_params, *reject) == YES)
+      if (match_reject_predicate(contact_features, *reject) == YES)
       {
         TRC_DEBUG("Rejecting Contact: header matching Reject-Contact header");
         // TODO SAS log.
@@ -141,14 +189,14 @@ void filter_bindings_to_targets(const std::string& aor,
     // headers, Accept-Contact headers have a "require" parameter,
     // which determines whetner to reject or just deprioritise
     // non-matching bindings.
-    for (std::vector<pjsip_accept_contact_hdr*>::iterator accept = accept_headers.begin();
-         accept != accept_headers.end() && (!rejected);
+    for (std::vector<FeaturePredicate>::const_iterator accept = accept_predicates.begin();
+         accept != accept_predicates.end() && (!rejected);
          ++accept)
     {
-      MatchResult accept_rc = match_feature_sets(binding->second->_params, *accept);
+      MatchResult accept_rc = match_accept_predicate(contact_features, *accept);
       if (accept_rc == NO)
       {
-        if ((*accept)->required_match) {
+        if (accept->required_match) {
           TRC_DEBUG("Rejecting Contact: header matching Accept-Contact header");
           // TODO SAS log.
           rejected = true;
@@ -162,22 +210,35 @@ void filter_bindings_to_targets(const std::string& aor,
       }
     }
 
-    // Assuming we're still allowed to use this Contact, create a target from it.
+    // Assuming we're still allowed to use this Contact, it's a candidate
+    // target.
     if (!rejected)
     {
-      // There's a chance the records in the store are invalid, if so we'll drop
-      // the target.
-      Target target;
-      bool valid = binding_to_target(aor,
-                                     binding->first,
-                                     *binding->second,
-                                     deprioritized,
-                                     pool,
-                                     target);
-      if (valid)
-      {
-        targets.push_back(target);
-      }
+      candidates.push_back({binding, deprioritized});
+    }
+  }
+
+  if (candidates.size() <= (unsigned long)max_targets)
+  {
+    // Every candidate can be used, so keep them in binding order.
+    convert_candidates(aor, candidates.begin(), candidates.end(), pool, targets);
+  }
+  else
+  {
+    // Pick the best max_targets candidates without sorting the rest, and
+    // only convert those.  If any of them turn out to be invalid, pick
+    // replacements from the ones left.
+    std::vector<Candidate>::iterator next = candidates.begin();
+    while ((targets.size() < (unsigned long)max_targets) &&
+           (next != candidates.end()))
+    {
+      std::vector<Candidate>::iterator end =
+        next + std::min((long)(max_targets - targets.size()),
+                        (long)(candidates.end() - next));
+      std::nth_element(next, end, candidates.end(), compare_candidates);
+      std::sort(next, end, compare_candidates);
+      convert_candidates(aor, next, end, pool, targets);
+      next = end;
     }
   }
 
@@ -192,7 +253,7 @@ void filter_bindings_to_targets(const std::string& aor,
   }
 
   SAS::Event event(trail, SASEvent::BINDINGS_FROM_TARGETS, 0);
-  event.add_static_param(targets.size());
+  event.add_static_param(candidates.size());
   event.add_static_param(bindings.size());
   SAS::report_event(event);
 
@@ -201,9 +262,33 @@ void filter_bindings_to_targets(const std::string& aor,
     SAS::Event event(trail, SASEvent::ALL_BINDINGS_FILTERED, 0);
     SAS::report_event(event);
   }
+}
 
-  // Prune the excess targets to prevent over-forking.
-  prune_targets(max_targets, targets);
+// Convert a range of candidates to Targets, dropping any that are invalid.
+static void convert_candidates(const std::string& aor,
+                               std::vector<Candidate>::const_iterator begin,
+                               std::vector<Candidate>::const_iterator end,
+                               pj_pool_t* pool,
+                               TargetList& targets)
+{
+  for (std::vector<Candidate>::const_iterator candidate = begin;
+       candidate != end;
+       ++candidate)
+  {
+    // There's a chance the records in the store are invalid, if so we'll drop
+    // the target.
+    Target target;
+    bool valid = binding_to_target(aor,
+                                   candidate->binding->first,
+                                   *candidate->binding->second,
+                                   candidate->deprioritized,
+                                   pool,
+                                   target);
+    if (valid)
+    {
+      targets.push_back(target);
+    }
+  }
 }
 
 // Convert a binding to its equivalent Target.  This can fail if (for example),
@@ -313,6 +398,57 @@ void add_implicit_filters(const pjsip_msg* msg,
   }
 }
 
+// Parses the feature parameters on an Accept-Contact or Reject-Contact header.
+static void compile_features(const pjsip_param* feature_set,
+                             FeaturePredicate& predicate)
+{
+  for (const pjsip_param* feature_param = feature_set->next;
+       feature_param != feature_set;
+       feature_param = feature_param->next)
+  {
+    predicate.features.emplace_back(
+                       PJUtils::pj_str_to_string(&feature_param->name),
+                       FeatureValue(PJUtils::pj_str_to_string(&feature_param->value)));
+  }
+}
+
+FeaturePredicate compile_feature_predicate(pjsip_accept_contact_hdr* accept)
+{
+  FeaturePredicate predicate;
+  predicate.explicit_match = accept->explicit_match;
+  predicate.required_match = accept->required_match;
+  compile_features(&accept->feature_set, predicate);
+  return predicate;
+}
+
+FeaturePredicate compile_feature_predicate(pjsip_reject_contact_hdr* reject)
+{
+  FeaturePredicate predicate;
+  predicate.explicit_match = false;
+  predicate.required_match = false;
+  compile_features(&reject->feature_set, predicate);
+  return predicate;
+}
+
+const FeatureValue* ContactFeatures::find(const std::string& name)
+{
+  std::map<std::string, FeatureValue>::const_iterator value = _values.find(name);
+
+  if (value == _values.end())
+  {
+    FeatureSet::const_iterator feature = _feature_set.find(name);
+
+    if (feature == _feature_set.end())
+    {
+      return NULL;
+    }
+
+    value = _values.emplace(name, FeatureValue(feature->second)).first;
+  }
+
+  return &value->second;
+}
+
 // Compares the feature predicate in the Contact header with the
 // feature predicate in the Accept-Contact header. Under the RFC 3841
 // logic, two feature predicates match if there is any feature
@@ -322,49 +458,46 @@ void add_implicit_filters(const pjsip_msg* msg,
 // the features in the Accept-Contact header (i.e. the list of feature
 // names in the Contact header must be a subset of the list in the
 // Accept-Contact header).
-MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
-                               pjsip_accept_contact_hdr* accept)
+MatchResult match_accept_predicate(ContactFeatures& contact_features,
+                                   const FeaturePredicate& accept)
 {
   MatchResult rc = YES;
 
-  // Iterate over the parameters on the Accept-Contact header, we can drop out
+  // Iterate over the features in the Accept-Contact header, we can drop out
   // early if the main match value ever drops to NO since there's no way it will
   // change to YES afterwards.
-  for (pjsip_param* feature_param = accept->feature_set.next;
-       (feature_param != &accept->feature_set) && (rc != NO);
-       feature_param = feature_param->next)
+  for (std::vector<std::pair<std::string, FeatureValue>>::const_iterator feature =
+         accept.features.begin();
+       (feature != accept.features.end()) && (rc != NO);
+       ++feature)
   {
-    std::string feature_name = PJUtils::pj_str_to_string(&feature_param->name);
-    std::string feature_value = PJUtils::pj_str_to_string(&feature_param->value);
-    TRC_DEBUG("Trying to match Accept-Contact parameter '%s' (value '%s')", feature_name.c_str(), feature_value.c_str());
-
-    Feature feature(feature_name, feature_value);
+    TRC_DEBUG("Trying to match Accept-Contact parameter '%s'", feature->first.c_str());
 
     // Now find the Contact's version of this feature.
-    FeatureSet::const_iterator contact_feature;
-    contact_feature = contact_feature_set.find(feature_name);
+    const FeatureValue* contact_feature = contact_features.find(feature->first);
 
     // Now attempt to compare the two features.
-    if (contact_feature == contact_feature_set.end())
+    if (contact_feature == NULL)
     {
       // Contact header doesn't contain a feature in the
       // Accept-Contact header - should fail the match if "explicit"
       // was specified.
-      if (accept->explicit_match)
+      if (accept.explicit_match)
       {
         rc = NO;
-        TRC_DEBUG("Parameter %s is not in the Contact parameters and is explicitly required", feature_name.c_str());
+        TRC_DEBUG("Parameter %s is not in the Contact parameters and is explicitly required", feature->first.c_str());
       }
       else
       {
         rc = YES;
-        TRC_DEBUG("Parameter %s is not in the Contact parameters but is not explicitly required", feature_name.c_str());
+        TRC_DEBUG("Parameter %s is not in the Contact parameters but is not explicitly required", feature->first.c_str());
       }
     }
     else
     {
-      rc = match_feature(feature,
-                         *contact_feature);
+      rc = match_feature_values(feature->first,
+                                feature->second,
+                                *contact_feature);
     }
   }
 
@@ -372,200 +505,180 @@ MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
 }
 
 // Compares the feature predicate in the Reject-Contact header with the
-// feature predicate in the Accept-Contact header. Under the RFC 3841
+// feature predicate in the Contact header. Under the RFC 3841
 // logic, two feature predicates match if there is any feature
 // collection which could satisfy them both.
-MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
-                               pjsip_reject_contact_hdr* reject)
+MatchResult match_reject_predicate(ContactFeatures& contact_features,
+                                   const FeaturePredicate& reject)
 {
   MatchResult rc = YES;
 
-  // Iterate over the parameters on the Reject-Contact header, since
+  // Iterate over the features in the Reject-Contact header, since
   // the only way a Reject-Contact header can match is perfectly, we
   // can drop out early if rc is ever non-YES.
-  for (pjsip_param* feature_param = reject->feature_set.next;
-       (feature_param != &reject->feature_set) && (rc == YES);
-       feature_param = feature_param->next)
+  for (std::vector<std::pair<std::string, FeatureValue>>::const_iterator feature =
+         reject.features.begin();
+       (feature != reject.features.end()) && (rc == YES);
+       ++feature)
   {
-    std::string feature_name = PJUtils::pj_str_to_string(&feature_param->name);
-    std::string feature_value = PJUtils::pj_str_to_string(&feature_param->value);
-    TRC_DEBUG("Trying to match Reject-Contact parameter '%s' (value '%s')", feature_name.c_str(), feature_value.c_str());
-
-    Feature feature(feature_name, feature_value);
+    TRC_DEBUG("Trying to match Reject-Contact parameter '%s'", feature->first.c_str());
 
     // Now find the Contact's version of this feature.
-    FeatureSet::const_iterator contact_feature;
-    contact_feature = contact_feature_set.find(feature_name);
+    const FeatureValue* contact_feature = contact_features.find(feature->first);
 
     // Now attempt to compare the two features.
-    if (contact_feature == contact_feature_set.end())
+    if (contact_feature == NULL)
     {
       // The Contact header doesn't contain this feature tag, so this
       // Reject-Contact predicate is discarded.
       rc = NO;
-      TRC_DEBUG("Parameter %s is not in the Contact parameters", feature_name.c_str());
+      TRC_DEBUG("Parameter %s is not in the Contact parameters", feature->first.c_str());
     }
     else
     {
-      rc = match_feature(feature,
-                         *contact_feature);
+      rc = match_feature_values(feature->first,
+                                feature->second,
+                                *contact_feature);
     }
   }
 
   return rc;
 }
 
+MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
+                               pjsip_accept_contact_hdr* accept)
+{
+  ContactFeatures contact_features(contact_feature_set);
+  return match_accept_predicate(contact_features,
+                                compile_feature_predicate(accept));
+}
+
+MatchResult match_feature_sets(const FeatureSet& contact_feature_set,
+                               pjsip_reject_contact_hdr* reject)
+{
+  ContactFeatures contact_features(contact_feature_set);
+  return match_reject_predicate(contact_features,
+                                compile_feature_predicate(reject));
+}
+
 // Compares a single term of a feature predicate in the
 // Accept/Reject-Contact header (the matcher) and in the Contact
 // header (the matchee).
 MatchResult match_feature(Feature matcher,
                           Feature matchee)
 {
-  MatchResult rc;
   TRC_DEBUG("Matching parameter '%s' - Accept-Contact/Reject-Contact value '%s', Contact value '%s'",
             matcher.first.c_str(),
             matcher.second.c_str(),
             matchee.second.c_str());
 
-  // Features with no value are boolean terms, equivalent to "TRUE"
-  // according to RFC 3841.
-  if (matcher.second.empty())
+  return match_feature_values(matcher.first,
+                              FeatureValue(matcher.second),
+                              FeatureValue(matchee.second));
+}
+
+// Parses a numeric feature value into the range of numbers it allows.
+// Returns false if the value isn't a valid numeric.
+static bool parse_numeric(const std::string& str,
+                          float& minimum,
+                          float& maximum)
+{
+  if (sscanf(str.c_str(), "#%f:%f", &minimum, &maximum) == 2)
   {
-    matcher.second = "TRUE";
+    if (minimum > maximum)
+    {
+      return false;
+    }
   }
-
-  if (matchee.second.empty())
+  else if (sscanf(str.c_str(), "#>=%f", &minimum) == 1)
   {
-    matchee.second = "TRUE";
+    maximum = std::numeric_limits<float>::max();
   }
-
-  // Unquote the values, as they don't matter.
-  if ((matcher.second.front() == '"') && (matcher.second.back() == '"'))
+  else if (sscanf(str.c_str(), "#<=%f", &maximum) == 1)
   {
-    matcher.second = matcher.second.substr(1, (matcher.second.size() - 2));
+    minimum = std::numeric_limits<float>::min();
   }
-  if ((matchee.second.front() == '"') && (matchee.second.back() == '"'))
+  else if (sscanf(str.c_str(), "#%f", &minimum) == 1)
   {
-    matchee.second = matchee.second.substr(1, (matchee.second.size() - 2));
+    maximum = minimum;
   }
-
-  if (matcher.second[0] == '<')
+  else
   {
-    // Matcher is checking for string literal...
-    if (matchee.second[0] == '<')
-    {
-      // ...as is the matchee...
-      if (matcher.second == matchee.second)
-      {
-        // ...and it's the same string literal
-        rc = YES;
-      }
-      else
-      {
-        // ...but it's a different string literal
-        rc = NO;
-      }
-    }
-    else
-    {
-      // ...but matchee isn't, so no possible feature collection could
-      // match both
-      rc = NO;
-    }
+    // Invalid format for numeric.
+    return false;
   }
-  else if (matcher.second[0] == '#')
+
+  return true;
+}
+
+// Only needed for passing in to "transform" below.
+std::string string_to_lowercase_and_trim(std::string& str)
+{
+  ::boost::algorithm::to_lower(str);
+  return Utils::trim(str);
+}
+
+// Splits a token set into its lower-cased and trimmed tokens.
+static std::vector<std::string> parse_tokens(const std::string& str)
+{
+  std::vector<std::string> tokens;
+  Utils::split_string(str, ',', tokens, 0, true);
+  std::transform(tokens.begin(), tokens.end(),
+                 tokens.begin(), string_to_lowercase_and_trim);
+  return tokens;
+}
+
+FeatureValue::FeatureValue(std::string value) :
+  type(TOKENS),
+  numeric_valid(false),
+  minimum(0),
+  maximum(0)
+{
+  // Features with no value are boolean terms, equivalent to "TRUE"
+  // according to RFC 3841.
+  if (value.empty())
   {
-    // Matcher is looking for a numeric predicate...
-    if (matchee.second[0] == '#')
-    {
-      // ...as is the matchee
-      rc = match_numeric(matcher.second, matchee.second);
-    }
-    else
-    {
-      // The two feature predicates each require a term of different
-      // types, so no feature collection can match both.
-      rc = NO;
-    }
+    value = "TRUE";
   }
-  else
+
+  // Unquote the value, as the quotes don't matter.
+  if ((value.front() == '"') && (value.back() == '"'))
   {
-    // Matcher is a token set...
-    if ((matchee.second[0] == '#') ||
-        (matchee.second[0] == '<'))
-    {
-      // The two feature predicates each require a term of different
-      // types, so no feature collection can match both.
-      rc = NO;
-    }
-    else
-    {
-      rc = match_tokens(matcher.second, matchee.second);
-    }
+    value = value.substr(1, (value.size() - 2));
   }
 
-  if (rc == NO)
+  if (value[0] == '<')
   {
-    TRC_DEBUG("No possible feature collection could match this parameter in both feature predicates");
+    type = STRING;
+    literal = value;
   }
-  else if (rc == YES)
+  else if (value[0] == '#')
   {
-    TRC_DEBUG("A feature collection could match this parameter in both feature predicates");
+    type = NUMERIC;
+    numeric_valid = parse_numeric(value, minimum, maximum);
   }
-
-  return rc;
-}
-
-// Represents a NumericFeature
-struct NumericRange
-{
-  float minimum;
-  float maximum;
-
-  NumericRange(const std::string& str)
+  else
   {
-    if (sscanf(str.c_str(), "#%f:%f", &minimum, &maximum) == 2)
-    {
-      if (minimum > maximum)
-      {
-        throw FeatureParseError();
-      }
-    }
-    else if (sscanf(str.c_str(), "#>=%f", &minimum) == 1)
-    {
-      maximum = std::numeric_limits<float>::max();
-    }
-    else if (sscanf(str.c_str(), "#<=%f", &maximum) == 1)
-    {
-      minimum = std::numeric_limits<float>::min();
-    }
-    else if (sscanf(str.c_str(), "#%f", &minimum) == 1)
-    {
-      maximum = minimum;
-    }
-    else
-    {
-      // Invalid format for numeric.
-      throw FeatureParseError();
-    }
+    type = TOKENS;
+    tokens = parse_tokens(value);
   }
-};
+}
 
-// Compare two numeric features to see if the matcher matches the matchee.
-MatchResult match_numeric(const std::string& matcher,
-                          const std::string& matchee)
+// Compare two numeric ranges to see if the matcher matches the matchee.
+static MatchResult match_ranges(float matcher_minimum,
+                                float matcher_maximum,
+                                float matchee_minimum,
+                                float matchee_maximum)
 {
-  NumericRange matcher_range(matcher);
-  NumericRange matchee_range(matchee);
   MatchResult rc;
 
-  if (matcher_range.minimum <= matchee_range.minimum)
+  if (matcher_minimum <= matchee_minimum)
   {
-    if (matcher_range.maximum >= matchee_range.maximum)
+    if (matcher_maximum >= matchee_maximum)
     {
       rc = YES;
     }
-    else if (matcher_range.maximum >= matchee_range.minimum)
+    else if (matcher_maximum >= matchee_minimum)
     {
       rc = YES;
     }
@@ -574,7 +687,7 @@ MatchResult match_numeric(const std::string& matcher,
       rc = NO;
     }
   }
-  else if (matcher_range.minimum <= matchee_range.maximum)
+  else if (matcher_minimum <= matchee_maximum)
   {
     rc = YES;
   }
@@ -586,28 +699,10 @@ MatchResult match_numeric(const std::string& matcher,
   return rc;
 }
 
-// Only needed for passing in to "transform" below.
-std::string string_to_lowercase_and_trim(std::string& str)
-{
-  ::boost::algorithm::to_lower(str);
-  return Utils::trim(str);
-}
-
-MatchResult match_tokens(const std::string& matcher,
-                         const std::string& matchee)
+// Compare two lists of tokens to see if the matcher matches the matchee.
+static MatchResult match_token_lists(const std::vector<std::string>& matcher_tokens,
+                                     const std::vector<std::string>& matchee_tokens)
 {
-  // Convert both strings to lists of tokens
-  std::vector<std::string> matcher_tokens;
-  Utils::split_string(matcher, ',', matcher_tokens, 0, true);
-  std::vector<std::string> matchee_tokens;
-  Utils::split_string(matchee, ',', matchee_tokens, 0, true);
-
-  // Lower-case everything and strip whitespace so we can safely compare.
-  std::transform(matcher_tokens.begin(), matcher_tokens.end(),
-                 matcher_tokens.begin(), string_to_lowercase_and_trim);
-  std::transform(matchee_tokens.begin(), matchee_tokens.end(),
-                 matchee_tokens.begin(), string_to_lowercase_and_trim);
-
   // Loop over both sets of tokens, to see whether a feature
   // collection (i.e. a single token) could satisfy both predicates.
   // Specifically, we want:
@@ -615,11 +710,11 @@ MatchResult match_tokens(const std::string& matcher,
   // * any negation (i.e. !X, which in this context means "anything
   // but X") and any token in the other list which matches that
   // negation (i.e. anything but X, or any other negation).
-  for (std::vector<std::string>::iterator token1 = matcher_tokens.begin();
+  for (std::vector<std::string>::const_iterator token1 = matcher_tokens.begin();
        token1 != matcher_tokens.end();
        token1++)
   {
-    for (std::vector<std::string>::iterator token2 = matchee_tokens.begin();
+    for (std::vector<std::string>::const_iterator token2 = matchee_tokens.begin();
          token2 != matchee_tokens.end();
          token2++)
     {
@@ -631,24 +726,18 @@ MatchResult match_tokens(const std::string& matcher,
 
       // One token is a negation, ie. !X. If the other token is not
       // equal to X, then that token satisfies both feature predicates.
-      if ((*token1)[0] == '!')
+      if (((*token1)[0] == '!') &&
+          (token1->compare(1, std::string::npos, *token2) != 0))
       {
-        std::string token1_without_negation = token1->substr(1, std::string::npos);
-        TRC_DEBUG("Comparing negation of %s to %s", token1_without_negation.c_str(), token2->c_str());
-        if (token1_without_negation != *token2)
-        {
-          return YES;
-        }
+        TRC_DEBUG("Negation %s matches %s", token1->c_str(), token2->c_str());
+        return YES;
       }
 
-      if ((*token2)[0] == '!')
+      if (((*token2)[0] == '!') &&
+          (token2->compare(1, std::string::npos, *token1) != 0))
       {
-        std::string token2_without_negation = token2->substr(1, std::string::npos);
-        TRC_DEBUG("Comparing negation of %s to %s", token2_without_negation.c_str(), token1->c_str());
-        if (token2_without_negation != *token1)
-        {
-          return YES;
-        }
+        TRC_DEBUG("Negation %s matches %s", token2->c_str(), token1->c_str());
+        return YES;
       }
     }
   }
@@ -656,6 +745,81 @@ MatchResult match_tokens(const std::string& matcher,
   return NO;
 }
 
+// Compares a single parsed term of a feature predicate in the
+// Accept/Reject-Contact header (the matcher) and in the Contact
+// header (the matchee).
+MatchResult match_feature_values(const std::string& name,
+                                 const FeatureValue& matcher,
+                                 const FeatureValue& matchee)
+{
+  MatchResult rc;
+
+  if (matcher.type != matchee.type)
+  {
+    // The two feature predicates each require a term of different
+    // types, so no feature collection can match both.
+    rc = NO;
+  }
+  else if (matcher.type == FeatureValue::STRING)
+  {
+    // Both are string literals, so they only match if they're the same
+    // string literal.
+    rc = (matcher.literal == matchee.literal) ? YES : NO;
+  }
+  else if (matcher.type == FeatureValue::NUMERIC)
+  {
+    if ((!matcher.numeric_valid) || (!matchee.numeric_valid))
+    {
+      throw FeatureParseError();
+    }
+
+    rc = match_ranges(matcher.minimum,
+                      matcher.maximum,
+                      matchee.minimum,
+                      matchee.maximum);
+  }
+  else
+  {
+    rc = match_token_lists(matcher.tokens, matchee.tokens);
+  }
+
+  if (rc == NO)
+  {
+    TRC_DEBUG("No possible feature collection could match parameter %s in both feature predicates", name.c_str());
+  }
+  else if (rc == YES)
+  {
+    TRC_DEBUG("A feature collection could match parameter %s in both feature predicates", name.c_str());
+  }
+
+  return rc;
+}
+
+// Compare two numeric features to see if the matcher matches the matchee.
+MatchResult match_numeric(const std::string& matcher,
+                          const std::string& matchee)
+{
+  float matcher_minimum, matcher_maximum;
+  float matchee_minimum, matchee_maximum;
+
+  if ((!parse_numeric(matcher, matcher_minimum, matcher_maximum)) ||
+      (!parse_numeric(matchee, matchee_minimum, matchee_maximum)))
+  {
+    throw FeatureParseError();
+  }
+
+  return match_ranges(matcher_minimum,
+                      matcher_maximum,
+                      matchee_minimum,
+                      matchee_maximum);
+}
+
+MatchResult match_tokens(const std::string& matcher,
+                         const std::string& matchee)
+{
+  return match_token_lists(parse_tokens(matcher), parse_tokens(matchee));
+}
+
 // Trim a list of targets to contain at most `max_targets`.
 void prune_targets(int max_targets,
                    TargetList& targets)
@@ -674,31 +838,42 @@ void prune_targets(int max_targets,
 }
 
 bool compare_targets(const Target& t1, const Target& t2)
+{
+  return compare_priorities(t1.contact_q1000_value,
+                            t1.deprioritized,
+                            t1.contact_expiry,
+                            t2.contact_q1000_value,
+                            t2.deprioritized,
+                            t2.contact_expiry);
+}
+
+static bool compare_priorities(uint32_t q1, bool deprioritized1, int expiry1,
+                               uint32_t q2, bool deprioritized2, int expiry2)
 {
   // Start by comparing "q-values", higher is better.
-  if (t1.contact_q1000_value > t2.contact_q1000_value)
+  if (q1 > q2)
   {
     return true;
   }
-  else if (t1.contact_q1000_value < t2.contact_q1000_value)
+  else if (q1 < q2)
   {
     return false;
   }
   else
   {
     // Q-values are equal, check deprioritization.
-    if (!t1.deprioritized && t2.deprioritized)
+    if (!deprioritized1 && deprioritized2)
     {
       return true;
     }
-    else if (t1.deprioritized && !t2.deprioritized)
+    else if (deprioritized1 && !deprioritized2)
     {
       return false;
     }
     else
     {
       // Q-values are equal and prioritization is equal, use the tie-breaker.
-      return (t1.contact_expiry > t2.contact_expiry);
+      return (expiry1 > expiry2);
     }
   }
 }
@@ -0,0 +1,87 @@
+/**
+ * @file cpu_affinity.cpp Pinning threads to sets of CPUs.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+
+#include "utils.h"
+#include "cpu_affinity.h"
+
+// Parses a CPU number, which must be all digits and small enough to fit in a
+// cpu_set_t.
+static bool parse_cpu(const std::string& str, int& cpu)
+{
+  if ((str.empty()) ||
+      (str.size() > 5) ||
+      (str.find_first_not_of("0123456789") != std::string::npos))
+  {
+    return false;
+  }
+
+  cpu = std::stoi(str);
+  return (cpu < CPU_SETSIZE);
+}
+
+bool CpuAffinity::parse_cpu_list(const std::string& list,
+                                 std::vector<int>& cpus)
+{
+  std::vector<std::string> ranges;
+  Utils::split_string(list, ',', ranges, 0, true);
+  cpus.clear();
+
+  for (const std::string& range : ranges)
+  {
+    int first;
+    int last;
+    size_t dash = range.find('-');
+
+    if (dash == std::string::npos)
+    {
+      if (!parse_cpu(range, first))
+      {
+        return false;
+      }
+      last = first;
+    }
+    else if ((!parse_cpu(range.substr(0, dash), first)) ||
+             (!parse_cpu(range.substr(dash + 1), last)) ||
+             (last < first))
+    {
+      return false;
+    }
+
+    for (int cpu = first; cpu <= last; ++cpu)
+    {
+      cpus.push_back(cpu);
+    }
+  }
+
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+
+  return !cpus.empty();
+}
+
+// LCOV_EXCL_START - Pinning threads isn't tested in UTs
+bool CpuAffinity::pin_current_thread(const std::vector<int>& cpus)
+{
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+
+  for (int cpu : cpus)
+  {
+    CPU_SET(cpu, &cpu_set);
+  }
+
+  return (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0);
+}
+// LCOV_EXCL_STOP
@@ -1518,42 +1518,300 @@ pjsip_hdr* parse_hdr_resource_priority(pjsip_parse_ctx* ctx)
   return (pjsip_hdr*)hdr;
 }
 
+/*****************************************************************************/
+/* Lazily parsed headers                                                     */
+/*****************************************************************************/
+pjsip_hdr_vptr pjsip_lazy_hdr_vptr = {
+  pjsip_lazy_hdr_clone,
+  pjsip_lazy_hdr_shallow_clone,
+  pjsip_lazy_hdr_print_on
+};
+
+/// Stores the value of a header without parsing it, so that parser can parse
+/// it if it's ever looked up.
+static pjsip_hdr* parse_hdr_lazily(pjsip_parse_ctx* ctx,
+                                   const pj_str_t* name,
+                                   const pj_str_t* sname,
+                                   pjsip_parse_hdr_func* parser)
+{
+  pj_scanner* scanner = ctx->scanner;
+  char* start = scanner->curptr;
+
+  // The scanner skips over folded lines when it skips whitespace, so keep
+  // going until we reach the end of the last line of the header.
+  while ((!pj_scan_is_eof(scanner)) &&
+         (*scanner->curptr != '\r') &&
+         (*scanner->curptr != '\n'))
+  {
+    pj_str_t part;
+    pj_scan_get_until_chr(scanner, "\r\n", &part);
+  }
+
+  char* end = scanner->curptr;
+  while ((end > start) && (pj_isspace(*(end - 1))))
+  {
+    --end;
+  }
+
+  pjsip_parse_end_hdr_imp(scanner);
+
+  pjsip_lazy_hdr* hdr = PJ_POOL_ALLOC_T(ctx->pool, pjsip_lazy_hdr);
+
+  // Based on init_hdr from sip_msg.c
+  hdr->type = PJSIP_H_OTHER;
+  hdr->name = *name;
+  hdr->sname = *sname;
+  hdr->vptr = &pjsip_lazy_hdr_vptr;
+  pj_list_init(hdr);
+  hdr->hvalue.ptr = start;
+  hdr->hvalue.slen = end - start;
+  hdr->pool = ctx->pool;
+  hdr->parser = parser;
+  hdr->is_parsed = PJ_FALSE;
+  hdr->is_dirty = PJ_FALSE;
+  hdr->parsed = NULL;
+
+  return (pjsip_hdr*)hdr;
+}
+
+#define LAZY_PARSER(PARSER, NAME, SNAME)                                      \
+  static pjsip_hdr* lazy_##PARSER(pjsip_parse_ctx* ctx)                       \
+  {                                                                           \
+    return parse_hdr_lazily(ctx, &NAME, &SNAME, &PARSER);                     \
+  }
+
+LAZY_PARSER(parse_hdr_privacy, STR_PRIVACY, STR_PRIVACY)
+LAZY_PARSER(parse_hdr_p_associated_uri, STR_P_ASSOCIATED_URI, STR_P_ASSOCIATED_URI)
+LAZY_PARSER(parse_hdr_p_asserted_identity, STR_P_ASSERTED_IDENTITY, STR_P_ASSERTED_IDENTITY)
+LAZY_PARSER(parse_hdr_p_preferred_identity, STR_P_PREFERRED_IDENTITY, STR_P_PREFERRED_IDENTITY)
+LAZY_PARSER(parse_hdr_p_charging_vector, STR_P_C_V, STR_P_C_V)
+LAZY_PARSER(parse_hdr_p_charging_function_addresses, STR_P_C_F_A, STR_P_C_F_A)
+LAZY_PARSER(parse_hdr_p_served_user, STR_P_SERVED_USER, STR_P_SERVED_USER)
+LAZY_PARSER(parse_hdr_p_profile_key, STR_P_PROFILE_KEY, STR_P_PROFILE_KEY)
+LAZY_PARSER(parse_hdr_service_route, STR_SERVICE_ROUTE, STR_SERVICE_ROUTE)
+LAZY_PARSER(parse_hdr_path, STR_PATH, STR_PATH)
+LAZY_PARSER(parse_hdr_session_expires, STR_SESSION_EXPIRES, STR_SESSION_EXPIRES)
+LAZY_PARSER(parse_hdr_min_se, STR_MIN_SE, STR_MIN_SE)
+LAZY_PARSER(parse_hdr_reject_contact, STR_REJECT_CONTACT, STR_REJECT_CONTACT_SHORT)
+LAZY_PARSER(parse_hdr_accept_contact, STR_ACCEPT_CONTACT, STR_ACCEPT_CONTACT_SHORT)
+
+static void on_lazy_hdr_syntax_error(pj_scanner* scanner)
+{
+  PJ_UNUSED_ARG(scanner);
+  PJ_THROW(PJSIP_SYN_ERR_EXCEPTION);
+}
+
+bool is_lazy_hdr(const pjsip_hdr* hdr)
+{
+  return (hdr->vptr == &pjsip_lazy_hdr_vptr);
+}
+
+/// Parses the value of a lazily parsed header, the first time it's called for
+/// the header, and returns the first of the headers its parser returns, or
+/// NULL if the value isn't valid.
+static pjsip_hdr* parse_lazy_value(pjsip_lazy_hdr* lazy)
+{
+  if (lazy->is_parsed)
+  {
+    return lazy->parsed;
+  }
+
+  PJ_USE_EXCEPTION;
+  pjsip_hdr* volatile parsed = NULL;
+
+  // The parsed header may point into the buffer, so it has to be in the
+  // header's pool.  The scanner needs a null-terminated buffer, and the
+  // parsers expect the header to end with a newline.
+  pj_ssize_t len = lazy->hvalue.slen;
+  char* buf = (char*)pj_pool_alloc(lazy->pool, len + 3);
+  pj_memcpy(buf, lazy->hvalue.ptr, len);
+  buf[len] = '\r';
+  buf[len + 1] = '\n';
+  buf[len + 2] = '\0';
+
+  pj_scanner scanner;
+  pj_scan_init(&scanner, buf, len + 2, PJ_SCAN_AUTOSKIP_WS_HEADER,
+               &on_lazy_hdr_syntax_error);
+
+  pjsip_parse_ctx ctx;
+  ctx.scanner = &scanner;
+  ctx.pool = lazy->pool;
+  ctx.rdata = NULL;
+
+  PJ_TRY
+  {
+    parsed = lazy->parser(&ctx);
+  }
+  PJ_CATCH_ANY
+  {
+    parsed = NULL;
+  }
+  PJ_END;
+
+  pj_scan_fini(&scanner);
+
+  if (parsed == NULL)
+  {
+    TRC_DEBUG("Ignoring invalid %.*s header: %.*s",
+              lazy->name.slen, lazy->name.ptr,
+              lazy->hvalue.slen, lazy->hvalue.ptr);
+  }
+
+  lazy->is_parsed = PJ_TRUE;
+  lazy->parsed = parsed;
+
+  return parsed;
+}
+
+/// Parses a lazily parsed header, replacing it in its list with the headers
+/// its parser returns, and returns the first of those.  If the header isn't
+/// valid, it is left where it is and NULL is returned, so invalid lazy headers
+/// are treated as if they weren't there.  Any other header is just returned.
+///
+/// Once a header has been replaced, this returns the same result for it, even
+/// though it is no longer in the message, so it's safe to hold on to a lazily
+/// parsed header that something else may parse.
+pjsip_hdr* parse_lazy_hdr(pjsip_hdr* hdr)
+{
+  if (!is_lazy_hdr(hdr))
+  {
+    return hdr;
+  }
+
+  pjsip_lazy_hdr* lazy = (pjsip_lazy_hdr*)hdr;
+  pjsip_hdr* parsed = parse_lazy_value(lazy);
+
+  if ((parsed != NULL) && (!lazy->is_dirty))
+  {
+    pj_list_insert_nodes_before(hdr, parsed);
+    pj_list_erase(hdr);
+    lazy->is_dirty = PJ_TRUE;
+  }
+
+  return parsed;
+}
+
+/// Parses a lazily parsed header without replacing it, so it's still printed
+/// as it was received, and returns the first of the headers its parser
+/// returns (or NULL if it isn't valid).  The header returned mustn't be
+/// changed, and if the lazily parsed header is still clean, it isn't in the
+/// message so can't be used to find the headers after it.  Any other header
+/// is just returned.
+const pjsip_hdr* peek_lazy_hdr(pjsip_hdr* hdr)
+{
+  if (!is_lazy_hdr(hdr))
+  {
+    return hdr;
+  }
+
+  return parse_lazy_value((pjsip_lazy_hdr*)hdr);
+}
+
+void* pjsip_lazy_hdr_clone(pj_pool_t* pool, const void* o)
+{
+  void* hdr = pjsip_lazy_hdr_shallow_clone(pool, o);
+  pj_strdup(pool,
+            &((pjsip_lazy_hdr*)hdr)->hvalue,
+            &((const pjsip_lazy_hdr*)o)->hvalue);
+  return hdr;
+}
+
+void* pjsip_lazy_hdr_shallow_clone(pj_pool_t* pool, const void* o)
+{
+  pjsip_lazy_hdr* hdr = PJ_POOL_ALLOC_T(pool, pjsip_lazy_hdr);
+  pj_memcpy(hdr, o, sizeof(pjsip_lazy_hdr));
+  pj_list_init(hdr);
+
+  // The clone is parsed again (into the pool it's cloned into) if it's
+  // needed, as the headers this one was parsed into belong to its message.
+  hdr->pool = pool;
+  hdr->is_parsed = PJ_FALSE;
+  hdr->is_dirty = PJ_FALSE;
+  hdr->parsed = NULL;
+
+  return hdr;
+}
+
+int pjsip_lazy_hdr_print_on(void* h, char* buf, pj_size_t len)
+{
+  pjsip_lazy_hdr* hdr = (pjsip_lazy_hdr*)h;
+  pj_size_t needed = hdr->name.slen + 2 + hdr->hvalue.slen;
+
+  if (needed > len)
+  {
+    return -1;
+  }
+
+  // Lazily parsed headers are always printed with their full names.
+  pj_memcpy(buf, hdr->name.ptr, hdr->name.slen);
+  buf += hdr->name.slen;
+  *buf++ = ':';
+  *buf++ = ' ';
+  pj_memcpy(buf, hdr->hvalue.ptr, hdr->hvalue.slen);
+
+  return needed;
+}
+
 /// Register all of our custom header parsers with pjSIP.  This should be
 // called once during startup.
-pj_status_t register_custom_headers()
+pj_status_t register_custom_headers(bool lazy)
 {
   pj_status_t status;
 
-  status = pjsip_register_hdr_parser("Privacy", NULL, &parse_hdr_privacy);
+// Pick the parser to register for a header which can be parsed lazily, and
+// the one to replace if this has already been called in the other mode.
+#define PARSER(PARSER) (lazy ? &lazy_##PARSER : &PARSER)
+#define OTHER_PARSER(PARSER) (lazy ? &PARSER : &lazy_##PARSER)
+
+  // These fail harmlessly if the parsers aren't registered.
+  pjsip_unregister_hdr_parser("Privacy", NULL, OTHER_PARSER(parse_hdr_privacy));
+  pjsip_unregister_hdr_parser("P-Associated-URI", NULL, OTHER_PARSER(parse_hdr_p_associated_uri));
+  pjsip_unregister_hdr_parser("P-Asserted-Identity", NULL, OTHER_PARSER(parse_hdr_p_asserted_identity));
+  pjsip_unregister_hdr_parser("P-Preferred-Identity", NULL, OTHER_PARSER(parse_hdr_p_preferred_identity));
+  pjsip_unregister_hdr_parser("P-Charging-Vector", NULL, OTHER_PARSER(parse_hdr_p_charging_vector));
+  pjsip_unregister_hdr_parser("P-Charging-Function-Addresses", NULL, OTHER_PARSER(parse_hdr_p_charging_function_addresses));
+  pjsip_unregister_hdr_parser("P-Served-User", NULL, OTHER_PARSER(parse_hdr_p_served_user));
+  pjsip_unregister_hdr_parser("P-Profile-Key", NULL, OTHER_PARSER(parse_hdr_p_profile_key));
+  pjsip_unregister_hdr_parser("Service-Route", NULL, OTHER_PARSER(parse_hdr_service_route));
+  pjsip_unregister_hdr_parser("Path", NULL, OTHER_PARSER(parse_hdr_path));
+  pjsip_unregister_hdr_parser("Session-Expires", NULL, OTHER_PARSER(parse_hdr_session_expires));
+  pjsip_unregister_hdr_parser("Min-SE", NULL, OTHER_PARSER(parse_hdr_min_se));
+  pjsip_unregister_hdr_parser("Reject-Contact", "j", OTHER_PARSER(parse_hdr_reject_contact));
+  pjsip_unregister_hdr_parser("Accept-Contact", "a", OTHER_PARSER(parse_hdr_accept_contact));
+
+  status = pjsip_register_hdr_parser("Privacy", NULL, PARSER(parse_hdr_privacy));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("P-Associated-URI", NULL, &parse_hdr_p_associated_uri);
+  status = pjsip_register_hdr_parser("P-Associated-URI", NULL, PARSER(parse_hdr_p_associated_uri));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("P-Asserted-Identity", NULL, &parse_hdr_p_asserted_identity);
+  status = pjsip_register_hdr_parser("P-Asserted-Identity", NULL, PARSER(parse_hdr_p_asserted_identity));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("P-Preferred-Identity", NULL, &parse_hdr_p_preferred_identity);
+  status = pjsip_register_hdr_parser("P-Preferred-Identity", NULL, PARSER(parse_hdr_p_preferred_identity));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("P-Charging-Vector", NULL, &parse_hdr_p_charging_vector);
+  status = pjsip_register_hdr_parser("P-Charging-Vector", NULL, PARSER(parse_hdr_p_charging_vector));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("P-Charging-Function-Addresses", NULL, &parse_hdr_p_charging_function_addresses);
+  status = pjsip_register_hdr_parser("P-Charging-Function-Addresses", NULL, PARSER(parse_hdr_p_charging_function_addresses));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("P-Served-User", NULL, &parse_hdr_p_served_user);
+  status = pjsip_register_hdr_parser("P-Served-User", NULL, PARSER(parse_hdr_p_served_user));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("P-Profile-Key", NULL, &parse_hdr_p_profile_key);
+  status = pjsip_register_hdr_parser("P-Profile-Key", NULL, PARSER(parse_hdr_p_profile_key));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("Service-Route", NULL, &parse_hdr_service_route);
+  status = pjsip_register_hdr_parser("Service-Route", NULL, PARSER(parse_hdr_service_route));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("Path", NULL, &parse_hdr_path);
+  status = pjsip_register_hdr_parser("Path", NULL, PARSER(parse_hdr_path));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("Session-Expires", NULL, &parse_hdr_session_expires);
+  status = pjsip_register_hdr_parser("Session-Expires", NULL, PARSER(parse_hdr_session_expires));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("Min-SE", NULL, &parse_hdr_min_se);
+  status = pjsip_register_hdr_parser("Min-SE", NULL, PARSER(parse_hdr_min_se));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("Reject-Contact", "j", &parse_hdr_reject_contact);
+  status = pjsip_register_hdr_parser("Reject-Contact", "j", PARSER(parse_hdr_reject_contact));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
-  status = pjsip_register_hdr_parser("Accept-Contact", "a", &parse_hdr_accept_contact);
+  status = pjsip_register_hdr_parser("Accept-Contact", "a", PARSER(parse_hdr_accept_contact));
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
   status = pjsip_register_hdr_parser("Resource-Priority", NULL, &parse_hdr_resource_priority);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
+#undef PARSER
+#undef OTHER_PARSER
+
   return PJ_SUCCESS;
 }
@@ -0,0 +1,158 @@
+/**
+ * @file dependency_monitor.cpp Overload control for each downstream dependency.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+#include "log.h"
+#include "dependency_monitor.h"
+
+static const char* const DEPENDENCY_NAMES[] = {"Homestead",
+                                               "Astaire",
+                                               "ENUM",
+                                               "XDMS"};
+
+// Weight given to each new latency sample.
+static const double SMOOTHING_FACTOR = 0.1;
+
+// How much the shed rate falls by in each period under the target.
+static const int SHED_DECREASE_PER_MILLE = 20;
+
+// The smallest increase in the shed rate in each period over the target.
+static const int MIN_SHED_INCREASE_PER_MILLE = 50;
+
+const int DependencyMonitor::ADJUST_PERIOD;
+const int DependencyMonitor::MAX_SHED_PER_MILLE;
+
+DependencyMonitor::DependencyMonitor(unsigned long target_latency_us) :
+  _target_latency_us(target_latency_us)
+{
+  for (int ii = 0; ii < NUM_DEPENDENCIES; ++ii)
+  {
+    pthread_mutex_init(&_state[ii].lock, NULL);
+    _state[ii].smoothed_latency_us = -1.0;
+    _state[ii].samples = 0;
+    _state[ii].shed_per_mille.store(0);
+  }
+}
+
+DependencyMonitor::~DependencyMonitor()
+{
+  for (int ii = 0; ii < NUM_DEPENDENCIES; ++ii)
+  {
+    pthread_mutex_destroy(&_state[ii].lock);
+  }
+}
+
+void DependencyMonitor::request_complete(Dependency dependency,
+                                         unsigned long latency_us)
+{
+  State& state = _state[dependency];
+
+  pthread_mutex_lock(&state.lock);
+
+  if (state.smoothed_latency_us < 0)
+  {
+    state.smoothed_latency_us = latency_us;
+  }
+  else
+  {
+    state.smoothed_latency_us = (1.0 - SMOOTHING_FACTOR) * state.smoothed_latency_us +
+                                SMOOTHING_FACTOR * latency_us;
+  }
+
+  if (++state.samples >= ADJUST_PERIOD)
+  {
+    state.samples = 0;
+
+    int old_shed = state.shed_per_mille.load(std::memory_order_relaxed);
+    int new_shed = old_shed;
+
+    if (state.smoothed_latency_us > _target_latency_us)
+    {
+      new_shed += std::max(MIN_SHED_INCREASE_PER_MILLE, old_shed / 2);
+      new_shed = std::min(new_shed, (int)MAX_SHED_PER_MILLE);
+    }
+    else
+    {
+      new_shed = std::max(0, new_shed - SHED_DECREASE_PER_MILLE);
+    }
+
+    if (new_shed != old_shed)
+    {
+      state.shed_per_mille.store(new_shed, std::memory_order_relaxed);
+
+      if (old_shed == 0)
+      {
+        TRC_WARNING("%s latency of %.0fus exceeds target of %luus - shedding requests that need it",
+                    DEPENDENCY_NAMES[dependency],
+                    state.smoothed_latency_us,
+                    _target_latency_us);
+      }
+      else if (new_shed == 0)
+      {
+        TRC_STATUS("%s latency of %.0fus is within target of %luus - no longer shedding requests",
+                   DEPENDENCY_NAMES[dependency],
+                   state.smoothed_latency_us,
+                   _target_latency_us);
+      }
+      else
+      {
+        TRC_DEBUG("Shedding %d/1000 requests that need %s (latency %.0fus)",
+                  new_shed,
+                  DEPENDENCY_NAMES[dependency],
+                  state.smoothed_latency_us);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&state.lock);
+}
+
+bool DependencyMonitor::admit(Dependencies dependencies)
+{
+  // Find the most overloaded of the dependencies.
+  int shed = 0;
+  int worst = -1;
+  for (int ii = 0; ii < NUM_DEPENDENCIES; ++ii)
+  {
+    if (dependencies & mask((Dependency)ii))
+    {
+      int dependency_shed = _state[ii].shed_per_mille.load(std::memory_order_relaxed);
+      if (dependency_shed > shed)
+      {
+        shed = dependency_shed;
+        worst = ii;
+      }
+    }
+  }
+
+  if (shed == 0)
+  {
+    return true;
+  }
+
+  static thread_local unsigned int seed = (unsigned int)time(NULL) ^
+                                          (unsigned int)pthread_self();
+  if ((int)(rand_r(&seed) % 1000) >= shed)
+  {
+    return true;
+  }
+
+  TRC_DEBUG("Shed request as %s is overloaded", DEPENDENCY_NAMES[worst]);
+  return false;
+}
+
+int DependencyMonitor::shed_per_mille(Dependency dependency) const
+{
+  return _state[dependency].shed_per_mille.load(std::memory_order_relaxed);
+}
@@ -26,11 +26,14 @@ void DialogTracker::on_uas_tsx_complete(const pjsip_tx_data* original_request,
                                         const pjsip_event* event,
                                         // Transaction event which
                                         // triggered this call to DialogTracker
-                                        bool is_client
+                                        bool is_client,
                                         // true if the endpoint is a
                                         // client, false if it is Sprout,
                                         // an IBCF peer, or if we
                                         // can't tell
+                                        Flow* client_flow
+                                        // The client's flow, if the
+                                        // caller already has it, or NULL
   )
 {
   // Consider a dialog started if we have a 200 OK response to an
@@ -40,24 +43,32 @@ void DialogTracker::on_uas_tsx_complete(const pjsip_tx_data* original_request,
       (tsx->status_code == 200) &&
       (PJSIP_MSG_TO_HDR(original_request->msg)->tag.slen == 0))
   {
-    on_dialog_start(original_request, tsx, event, is_client);
+    on_dialog_start(original_request, tsx, event, is_client, client_flow);
   }
   // Consider a dialog finished whenever we respond to a BYE - any
   // response to a BYE, even an error, is considered to end a dialog.
   else if (tsx->method.id == PJSIP_BYE_METHOD)
   {
-    on_dialog_end(original_request, tsx, event, is_client);
+    on_dialog_end(original_request, tsx, event, is_client, client_flow);
   }
 }
 
 void DialogTracker::on_dialog_start(const pjsip_tx_data* original_request,
                                     const pjsip_transaction* tsx,
                                     const pjsip_event* event,
-                                    bool is_client)
+                                    bool is_client,
+                                    Flow* client_flow)
 {
+  if (client_flow != NULL)
+  {
+    // The caller owns the reference on this flow.
+    client_flow->increment_dialogs();
+    return;
+  }
+
   // Note that getting the flow increments its reference count, so we
   // need to call dec_ref before we return.
-  Flow* client_flow = get_client_flow(original_request, tsx, event, is_client);
+  client_flow = get_client_flow(original_request, tsx, event, is_client);
   if (client_flow != NULL) {
     client_flow->increment_dialogs();
     client_flow->dec_ref();
@@ -67,11 +78,19 @@ void DialogTracker::on_dialog_start(const pjsip_tx_data* original_request,
 void DialogTracker::on_dialog_end(const pjsip_tx_data* original_request,
                                   const pjsip_transaction* tsx,
                                   const pjsip_event* event,
-                                  bool is_client)
+                                  bool is_client,
+                                  Flow* client_flow)
 {
+  if (client_flow != NULL)
+  {
+    // The caller owns the reference on this flow.
+    client_flow->decrement_dialogs();
+    return;
+  }
+
   // Note that getting the flow increments its reference count, so we
   // need to call dec_ref before we return.
-  Flow* client_flow = get_client_flow(original_request, tsx, event, is_client);
+  client_flow = get_client_flow(original_request, tsx, event, is_client);
   if (client_flow != NULL) {
     client_flow->decrement_dialogs();
     client_flow->dec_ref();
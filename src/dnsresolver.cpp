@@ -11,6 +11,7 @@
 
 ///
 
+#include <algorithm>
 #include <fstream>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -29,7 +30,16 @@ DNSResolver::DNSResolver(const std::vector<struct IP46Address>& servers) :
                          _trail(0),
                          _domain(""),
                          _status(ARES_SUCCESS),
-                         _naptr_reply(NULL)
+                         _naptr_reply(NULL),
+                         _ttl(0)
+{
+  init_channel(&_channel, _ares_addrs, servers);
+}
+
+
+void DNSResolver::init_channel(ares_channel* channel,
+                               struct ares_addr_node ares_addrs[MAX_SERVERS],
+                               const std::vector<struct IP46Address>& servers)
 {
   // Set options to ensure we always get a response as quickly as possible -
   // we are on the call path!
@@ -44,7 +54,7 @@ DNSResolver::DNSResolver(const std::vector<struct IP46Address>& servers) :
   options.ndots = 0;
   options.servers = NULL;
   options.nservers = 0;
-  ares_init_options(&_channel,
+  ares_init_options(channel,
                     &options,
                     ARES_OPT_FLAGS |
                     ARES_OPT_TIMEOUTMS |
@@ -57,21 +67,21 @@ DNSResolver::DNSResolver(const std::vector<struct IP46Address>& servers) :
 
   // Convert our vector of IP46Addresses into the linked list of
   // ares_addr_nodes which ares_set_server takes.
-  size_t server_count = std::min((size_t)3u, servers.size());
+  size_t server_count = std::min((size_t)MAX_SERVERS, servers.size());
 
   for (size_t ii = 0;
        ii < server_count;
        ii++)
   {
     IP46Address server = servers[ii];
-    struct ares_addr_node* ares_addr = &_ares_addrs[ii];
+    struct ares_addr_node* ares_addr = &ares_addrs[ii];
     memset(ares_addr, 0, sizeof(struct ares_addr_node));
 
     if (ii > 0)
     {
       // LCOV_EXCL_START
       int prev_idx = ii - 1;
-      _ares_addrs[prev_idx].next = ares_addr;
+      ares_addrs[prev_idx].next = ares_addr;
       // LCOV_EXCL_STOP
     }
 
@@ -88,7 +98,7 @@ DNSResolver::DNSResolver(const std::vector<struct IP46Address>& servers) :
       // LCOV_EXCL_STOP
     }
   }
-  ares_set_servers(_channel, &(_ares_addrs[0]));
+  ares_set_servers(*channel, &(ares_addrs[0]));
 }
 
 
@@ -114,7 +124,7 @@ void DNSResolver::destroy(DNSResolver* resolver)
 
 
 // LCOV_EXCL_START
-int DNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail)
+int DNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail)
 {
   send_naptr_query(domain, trail);
   CW_IO_STARTS("DNS NAPTR query")
@@ -125,12 +135,14 @@ int DNSResolver::perform_naptr_query(const std::string& domain, struct ares_napt
 
   // Save off the results...
   naptr_reply = _naptr_reply;
+  ttl = _ttl;
   int status = _status;
   // ...and then clear out our state.
   _trail = 0;
   _domain = "";
   _naptr_reply = NULL;
   _status = ARES_SUCCESS;
+  _ttl = 0;
 
   return status;
 }
@@ -265,6 +277,7 @@ void DNSResolver::ares_callback(int status,
     event.add_var_param(_domain);
     SAS::report_event(event);
   }
+  _ttl = parse_ttl(_status, abuf, alen);
   _req_pending = false;
 }
 
@@ -274,3 +287,105 @@ DNSResolver* DNSResolverFactory::new_resolver(const std::vector<struct IP46Addre
   return new DNSResolver(servers);
 }
 // LCOV_EXCL_STOP
+
+
+int DNSResolver::parse_ttl(int status, const unsigned char* abuf, int alen)
+{
+  // Sizes of the fixed parts of a DNS message (RFC 1035, section 4.1).
+  const int HEADER_LEN = 12;
+  const int QUESTION_FIXED_LEN = 4;
+  const int RR_FIXED_LEN = 10;
+  const int SOA_FIXED_LEN = 20;
+
+  if ((abuf == NULL) || (alen < HEADER_LEN))
+  {
+    return 0;
+  }
+
+  int qdcount = read_u16(abuf + 4);
+  int ancount = read_u16(abuf + 6);
+  int nscount = read_u16(abuf + 8);
+  const unsigned char* ptr = abuf + HEADER_LEN;
+  const unsigned char* end = abuf + alen;
+
+  // Skip over the questions.
+  for (int ii = 0; ii < qdcount; ++ii)
+  {
+    if ((!skip_name(ptr, abuf, alen)) ||
+        (end - ptr < QUESTION_FIXED_LEN))
+    {
+      return 0;
+    }
+    ptr += QUESTION_FIXED_LEN;
+  }
+
+  // Spin through the answer and authority sections.
+  int ttl = -1;
+
+  for (int ii = 0; ii < ancount + nscount; ++ii)
+  {
+    if ((!skip_name(ptr, abuf, alen)) ||
+        (end - ptr < RR_FIXED_LEN))
+    {
+      return 0;
+    }
+
+    int type = read_u16(ptr);
+    unsigned int rr_ttl = read_u32(ptr + 4);
+    int rdlength = read_u16(ptr + 8);
+    ptr += RR_FIXED_LEN;
+
+    if (end - ptr < rdlength)
+    {
+      return 0;
+    }
+
+    // TTLs with the top bit set must be treated as zero (RFC 2181).
+    int this_ttl = (rr_ttl > 0x7fffffff) ? 0 : (int)rr_ttl;
+
+    if ((status == ARES_SUCCESS) &&
+        (ii < ancount) &&
+        (type == ns_t_naptr))
+    {
+      ttl = (ttl < 0) ? this_ttl : std::min(ttl, this_ttl);
+    }
+    else if (((status == ARES_ENOTFOUND) || (status == ARES_ENODATA)) &&
+             (ii >= ancount) &&
+             (type == ns_t_soa))
+    {
+      // The negative caching TTL is the lower of the TTL of the SOA record and
+      // its MINIMUM field, which is the last field of the record.
+      const unsigned char* rdata = ptr;
+      if ((skip_name(rdata, abuf, alen)) &&
+          (skip_name(rdata, abuf, alen)) &&
+          (ptr + rdlength - rdata >= SOA_FIXED_LEN))
+      {
+        unsigned int minimum = read_u32(rdata + 16);
+        int min_ttl = (minimum > 0x7fffffff) ? 0 : (int)minimum;
+        ttl = std::min(this_ttl, min_ttl);
+      }
+    }
+
+    ptr += rdlength;
+  }
+
+  return (ttl < 0) ? 0 : ttl;
+}
+
+
+bool DNSResolver::skip_name(const unsigned char*& ptr,
+                            const unsigned char* abuf,
+                            int alen)
+{
+  char* name = NULL;
+  long enclen = 0;
+
+  if (ares_expand_name(ptr, abuf, alen, &name, &enclen) != ARES_SUCCESS)
+  {
+    return false;
+  }
+
+  ares_free_string(name);
+  ptr += enclen;
+  return true;
+}
@@ -10,10 +10,12 @@
  */
 
 #include <sys/stat.h>
+#include <time.h>
 #include "rapidjson/document.h"
 #include "rapidjson/error/en.h"
 #include "json_parse_utils.h"
 #include <fstream>
+#include <future>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -28,10 +30,11 @@
 #include "log.h"
 #include "sproutsasevent.h"
 #include "sprout_pd_definitions.h"
+#include "stack.h"
+#include "dependency_monitor.h"
+#include "request_deadline.h"
 
 
-const boost::regex EnumService::CHARS_TO_STRIP_FROM_UAS = boost::regex("([^0-9+]|(?<=.)[^0-9])");
-const boost::regex DNSEnumService::CHARS_TO_STRIP_FROM_DOMAIN = boost::regex("[^0-9]");
 
 std::string DummyEnumService::lookup_uri_from_user(const std::string &user, SAS::TrailId trail) const
 {
@@ -59,6 +62,114 @@ std::string DummyEnumService::lookup_uri_from_user(const std::string &user, SAS:
   return new_uri;
 }
 
+std::string EnumService::memoized_lookup_uri_from_user(const std::string& user,
+                                                       SAS::TrailId trail) const
+{
+  if (trail == 0)
+  {
+    // Nothing to tie the answer to the transaction.
+    return lookup_uri_from_user(user, trail);
+  }
+
+  std::string uri;
+
+  if (!find_memo(user, trail, uri))
+  {
+    // Do the lookup without the lock, as it may block on DNS.
+    uri = lookup_uri_from_user(user, trail);
+    add_memo(user, trail, uri);
+  }
+
+  return uri;
+}
+
+void EnumService::memoized_lookup_uri_from_user_async(const std::string& user,
+                                                      LookupCallback callback,
+                                                      SAS::TrailId trail) const
+{
+  std::string uri;
+
+  if (trail == 0)
+  {
+    // Nothing to tie the answer to the transaction.
+    lookup_uri_from_user_async(user, callback, trail);
+  }
+  else if (find_memo(user, trail, uri))
+  {
+    callback(uri);
+  }
+  else
+  {
+    lookup_uri_from_user_async(user,
+                               [this, user, trail, callback](std::string uri)
+                               {
+                                 add_memo(user, trail, uri);
+                                 callback(uri);
+                               },
+                               trail);
+  }
+}
+
+bool EnumService::find_memo(const std::string& user,
+                            SAS::TrailId trail,
+                            std::string& uri) const
+{
+  std::lock_guard<std::mutex> lock(_memos_lock);
+  Memos::const_iterator memo = _memos.find(Memos::key_type(trail, user));
+
+  if ((memo != _memos.end()) && (memo->second.expiry_ms > now_ms()))
+  {
+    TRC_DEBUG("Reusing earlier ENUM translation of %s to %s",
+              user.c_str(),
+              memo->second.uri.c_str());
+    uri = memo->second.uri;
+    return true;
+  }
+
+  return false;
+}
+
+void EnumService::add_memo(const std::string& user,
+                           SAS::TrailId trail,
+                           const std::string& uri) const
+{
+  std::lock_guard<std::mutex> lock(_memos_lock);
+  unsigned long now = now_ms();
+
+  if (_memos.size() >= MAX_MEMOS)
+  {
+    Memos::iterator memo = _memos.begin();
+
+    while (memo != _memos.end())
+    {
+      if (memo->second.expiry_ms <= now)
+      {
+        memo = _memos.erase(memo);
+      }
+      else
+      {
+        ++memo;
+      }
+    }
+
+    if (_memos.size() >= MAX_MEMOS)
+    {
+      // Everything is still live, so there are too many transactions at once
+      // for this to help.  Start again.
+      _memos.clear();
+    }
+  }
+
+  _memos[Memos::key_type(trail, user)] = Memo{uri, now + MEMO_LIFETIME_MS};
+}
+
+unsigned long EnumService::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::regex& regex, std::string& replace)
 {
   bool success = false;
@@ -117,6 +228,26 @@ void JSONEnumService::update_enum()
 
   TRC_STATUS("Loading ENUM configuration from %s", _configuration.c_str());
 
+  if (CompiledRouteTable::is_compiled(_configuration))
+  {
+    // The configuration has been compiled, so just map it in.
+    CompiledRouteTable* compiled = CompiledRouteTable::load(_configuration);
+
+    if (compiled == NULL)
+    {
+      CL_SPROUT_ENUM_FILE_INVALID.log(_configuration.c_str());
+      return;
+    }
+
+    TRC_STATUS("Loaded %lu number prefixes", compiled->num_numbers());
+    std::shared_ptr<NumberPrefixTable> new_number_prefixes =
+                                        std::make_shared<NumberPrefixTable>();
+    new_number_prefixes->compiled.reset(compiled);
+    new_number_prefixes->compiled_prefixes.resize(compiled->num_numbers());
+    _number_prefixes.set(new_number_prefixes);
+    return;
+  }
+
   // Read from the file
   std::ifstream fs(_configuration.c_str());
   std::string enum_str((std::istreambuf_iterator<char>(fs)),
@@ -147,8 +278,8 @@ void JSONEnumService::update_enum()
 
   try
   {
-    std::vector<NumberPrefix> new_number_prefixes;
-    std::map<std::string, NumberPrefix> new_prefix_regex_map;
+    std::shared_ptr<NumberPrefixTable> new_number_prefixes =
+                                        std::make_shared<NumberPrefixTable>();
 
     JSON_ASSERT_CONTAINS(doc, "number_blocks");
     JSON_ASSERT_ARRAY(doc["number_blocks"]);
@@ -168,16 +299,15 @@ void JSONEnumService::update_enum()
         // Entry is well-formed, so strip off visual separators and add it.
         TRC_DEBUG("Found valid number prefix block %s", prefix.c_str());
         NumberPrefix pfix;
-        prefix = Utils::remove_visual_separators(prefix);
+        prefix = NumberNormalizer::remove_visual_separators(prefix);
         pfix.prefix = prefix;
 
         if (parse_regex_replace(regex, pfix.match, pfix.replace))
         {
-          // Create an array in order of entries in json file, and a map
-          // (automatically sorted in order of key length) so we can later
-          // match numbers to the most specific prefixes
-          new_number_prefixes.push_back(pfix);
-          new_prefix_regex_map.insert(std::make_pair(prefix, pfix));
+          // Create an array in order of entries in json file, and a trie
+          // so we can later match numbers to the most specific prefixes
+          new_number_prefixes->number_prefixes.push_back(pfix);
+          new_number_prefixes->prefix_trie.insert(prefix, pfix);
           TRC_STATUS("  Adding number prefix %s, regex=%s",
                      pfix.prefix.c_str(), regex.c_str());
         }
@@ -196,10 +326,9 @@ void JSONEnumService::update_enum()
       }
     }
 
-    // Take a write lock on the mutex in RAII style
-    boost::lock_guard<boost::shared_mutex> write_lock(_number_prefixes_rw_lock);
-    _number_prefixes = new_number_prefixes;
-    _prefix_regex_map = new_prefix_regex_map;
+    // Publish the new table.  Any lookups still using the old one keep it
+    // alive until they finish.
+    _number_prefixes.set(new_number_prefixes);
   }
   catch (JsonFormatError err)
   {
@@ -230,10 +359,12 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
 
   std::string aus = user_to_aus(user);
 
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_number_prefixes_rw_lock);
+  // Take a reference to the current table, which keeps it valid for the rest
+  // of this function even if the configuration is reloaded.
+  std::shared_ptr<const NumberPrefixTable> number_prefixes =
+                                                        _number_prefixes.get();
 
-  const struct NumberPrefix* pfix = prefix_match(aus);
+  const struct NumberPrefix* pfix = prefix_match(*number_prefixes, aus);
 
   if (pfix == NULL)
   {
@@ -270,42 +401,92 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
 }
 
 
-// This function returns a pointer to a struct that may be destroyed by the
-// updater. Callers must therefore ensure that they have the read lock before
-// calling this function and only release the lock once they no longer need
-// the object.
-const JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(const std::string& number) const
+// This function returns a pointer into the table, so callers must hold a
+// reference to the table for as long as they need the object.
+const JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(
+                                               const NumberPrefixTable& table,
+                                               const std::string& number)
 {
-  // Iterate through map in reverse order (already sorted by key length during
-  // construction) to find the most specific matching prefix
-  for (std::map<std::string, NumberPrefix>::const_reverse_iterator it =
-                                                     _prefix_regex_map.rbegin();
-       it != _prefix_regex_map.rend();
-       it++)
+  // Find the most specific matching prefix.
+  std::string matched_prefix;
+  const NumberPrefix* pfix = NULL;
+
+  if (table.compiled != NULL)
+  {
+    int idx = table.compiled->find_number(
+                                       NumberNormalizer::remove_visual_separators(number),
+                                       &matched_prefix);
+
+    if (idx >= 0)
+    {
+      pfix = compiled_prefix_at(table, idx);
+    }
+  }
+  else
   {
-    int len = std::min(number.size(), (*it).first.size());
+    pfix = table.prefix_trie.longest_prefix_match(
+                                       NumberNormalizer::remove_visual_separators(number),
+                                       &matched_prefix);
+  }
 
-    TRC_DEBUG("Comparing first %d numbers of %s against prefix %s",
-              len, number.c_str(), (*it).first.c_str());
+  if (pfix != NULL)
+  {
+    TRC_DEBUG("Number %s matches prefix %s",
+              number.c_str(), matched_prefix.c_str());
+  }
 
-    if (Utils::remove_visual_separators(number).
-                                      compare(0, len, (*it).first, 0, len) == 0)
+  return pfix;
+}
+
+// Returns the number prefix for an entry in the compiled table, compiling its
+// regular expression if this is the first time it has been used.  Like
+// prefix_match, this returns a pointer into the table.
+const JSONEnumService::NumberPrefix* JSONEnumService::compiled_prefix_at(
+                                               const NumberPrefixTable& table,
+                                               int idx)
+{
+  std::shared_ptr<const NumberPrefix>* slot = &table.compiled_prefixes[idx];
+  std::shared_ptr<const NumberPrefix> pfix = std::atomic_load(slot);
+
+  if (pfix == NULL)
+  {
+    std::shared_ptr<NumberPrefix> new_pfix = std::make_shared<NumberPrefix>();
+    std::vector<std::string> values = table.compiled->number_values_at(idx);
+
+    if ((values.size() != 1) ||
+        (!parse_regex_replace(values[0], new_pfix->match, new_pfix->replace)))
     {
-      // Found a match, so return it.
-      TRC_DEBUG("Match found");
-      return &((*it).second);
+      // LCOV_EXCL_START - the compiler only writes valid regexes
+      TRC_WARNING("Badly formed regular expression in compiled ENUM table");
+      return NULL;
+      // LCOV_EXCL_STOP
+    }
+
+    // If another thread got there first, use its copy, so the slot is never
+    // changed once set.
+    pfix = new_pfix;
+    std::shared_ptr<const NumberPrefix> expected;
+
+    if (!std::atomic_compare_exchange_strong(slot, &expected, pfix))
+    {
+      pfix = expected;
     }
   }
 
-  return NULL;
+  return pfix.get();
 }
 
 DNSEnumService::DNSEnumService(const std::vector<std::string>& dns_servers,
                                const std::string& dns_suffix,
                                const DNSResolverFactory* resolver_factory,
-                               CommunicationMonitor* comm_monitor) :
+                               CommunicationMonitor* comm_monitor,
+                               bool async_resolver,
+                               size_t cache_size,
+                               const ShardedLRUCacheStatsTables& cache_stats_tbls) :
                                _dns_suffix(dns_suffix),
                                _resolver_factory(resolver_factory),
+                               _async_resolver(NULL),
+                               _cache(NULL),
                                _comm_monitor(comm_monitor)
 {
   // Initialize the ares library.  This might have already been done by curl
@@ -352,6 +533,20 @@ DNSEnumService::DNSEnumService(const std::vector<std::string>& dns_servers,
   // We store a DNSResolver in thread-local data, so create the thread-local
   // store.
   pthread_key_create(&_thread_local, (void(*)(void*))DNSResolver::destroy);
+
+  if (async_resolver)
+  {
+    // LCOV_EXCL_START
+    TRC_STATUS("Using a shared asynchronous resolver for ENUM lookups");
+    _async_resolver = new AsyncDNSResolver(_servers);
+    // LCOV_EXCL_STOP
+  }
+
+  if (cache_size > 0)
+  {
+    TRC_STATUS("Caching up to %zu ENUM NAPTR results", cache_size);
+    _cache = new NaptrCache(cache_size, NUM_CACHE_SHARDS, cache_stats_tbls);
+  }
 }
 
 
@@ -367,11 +562,28 @@ DNSEnumService::~DNSEnumService()
     DNSResolver::destroy(resolver);
   }
 
+  delete _async_resolver;
+  _async_resolver = NULL;
+
+  delete _cache;
+  _cache = NULL;
+
   delete _resolver_factory;
   _resolver_factory = NULL;
 }
 
 
+// Reports the latency of queries to the ENUM servers for overload control.
+static void report_enum_latency(Utils::StopWatch& stop_watch)
+{
+  unsigned long latency_us = 0;
+  if ((stack_data.dependency_monitor != NULL) && (stop_watch.read(latency_us)))
+  {
+    stack_data.dependency_monitor->request_complete(DependencyMonitor::ENUM,
+                                                    latency_us);
+  }
+}
+
 std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const
 {
   if (user.empty())
@@ -380,6 +592,118 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
     return std::string();
   }
 
+  if (RequestDeadline::expired())
+  {
+    TRC_INFO("Not doing ENUM lookup for %s as the request's deadline has passed",
+             user.c_str());
+    return std::string();
+  }
+
+  LookupState state;
+  start_lookup(user, trail, state);
+
+  if (_async_resolver != NULL)
+  {
+    // Run the lookup on the shared resolver and wait for the result.  This
+    // still blocks this thread, but shares the resolver's channel and any
+    // in-flight queries with other threads.
+    std::shared_ptr<LookupState> shared_state = std::make_shared<LookupState>(state);
+    std::promise<std::string> result;
+    std::future<std::string> future = result.get_future();
+
+    send_async_query(shared_state,
+                     [&result](std::string uri) { result.set_value(uri); });
+
+    std::string uri;
+    Utils::StopWatch stop_watch;
+    stop_watch.start();
+    CW_IO_STARTS("DNS ENUM lookup")
+    {
+      uri = future.get();
+    }
+    CW_IO_COMPLETES()
+    report_enum_latency(stop_watch);
+
+    return uri;
+  }
+
+  // Get the resolver to use.  This comes from thread-local data.
+  DNSResolver* resolver = get_resolver();
+  // Spin round until we've finished (successfully or otherwise) or we've done
+  // the maximum number of queries.
+  while (state.more_queries())
+  {
+    // Translate the key into a domain and issue a query for it, unless we
+    // already have the result cached.
+    std::string domain = key_to_domain(state.string);
+    std::shared_ptr<const NaptrResult> result;
+
+    if (!find_in_cache(domain, result, trail))
+    {
+      struct ares_naptr_reply* naptr_reply = NULL;
+      int ttl = 0;
+      Utils::StopWatch stop_watch;
+      stop_watch.start();
+      int status = resolver->perform_naptr_query(domain, naptr_reply, ttl, trail);
+      report_enum_latency(stop_watch);
+      result = make_naptr_result(status, naptr_reply);
+      add_to_cache(domain, result, ttl);
+
+      // Free off the NAPTR reply if we have one.
+      if (naptr_reply != NULL)
+      {
+        resolver->free_naptr_reply(naptr_reply);
+        naptr_reply = NULL;
+      }
+    }
+
+    process_naptr_result(*result, state);
+  }
+
+  return finish_lookup(state);
+}
+
+
+void DNSEnumService::lookup_uri_from_user_async(const std::string& user,
+                                                LookupCallback callback,
+                                                SAS::TrailId trail) const
+{
+  if ((_async_resolver == NULL) || (user.empty()))
+  {
+    // No network I/O needed here, so just use the synchronous lookup.
+    EnumService::lookup_uri_from_user_async(user, callback, trail);
+    return;
+  }
+
+  if (RequestDeadline::expired())
+  {
+    TRC_INFO("Not doing ENUM lookup for %s as the request's deadline has passed",
+             user.c_str());
+    callback(std::string());
+    return;
+  }
+
+  std::shared_ptr<LookupState> state = std::make_shared<LookupState>();
+  start_lookup(user, trail, *state);
+
+  // The resolver runs its callbacks on its own thread, so pass the result back
+  // to a worker thread.
+  send_async_query(state,
+                   [callback](std::string uri)
+                   {
+                     PJUtils::run_callback_on_worker_thread([callback, uri]()
+                                                            {
+                                                              callback(uri);
+                                                            },
+                                                            false);
+                   });
+}
+
+
+void DNSEnumService::start_lookup(const std::string& user,
+                                  SAS::TrailId trail,
+                                  LookupState& state)
+{
   // Log starting ENUM processing.
   SAS::Event event(trail, SASEvent::ENUM_START, 0);
   event.add_var_param(user);
@@ -388,108 +712,151 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
   // Determine the Application Unique String (AUS) from the user.  This is
   // used to form the first key, and also as the input into the regular
   // expressions.
-  std::string aus = user_to_aus(user);
-  std::string string = aus;
-  // Get the resolver to use.  This comes from thread-local data.
-  DNSResolver* resolver = get_resolver();
-  // Spin round until we've finished (successfully or otherwise) or we've done
-  // the maximum number of queries.
-  bool complete = false;
-  bool failed = false;
-  bool server_failed = false;
-  int dns_queries = 0;
-  while ((!complete) &&
-         (!failed) &&
-         (dns_queries < MAX_DNS_QUERIES))
-  {
-    // Translate the key into a domain and issue a query for it.
-    std::string domain = key_to_domain(string);
-    struct ares_naptr_reply* naptr_reply = NULL;
-    int status = resolver->perform_naptr_query(domain, naptr_reply, trail);
-    if (status == ARES_SUCCESS)
+  state.user = user;
+  state.aus = user_to_aus(user);
+  state.string = state.aus;
+  state.complete = false;
+  state.failed = false;
+  state.server_failed = false;
+  state.dns_queries = 0;
+  state.trail = trail;
+}
+
+
+std::shared_ptr<const DNSEnumService::NaptrResult>
+  DNSEnumService::make_naptr_result(int status,
+                                    const struct ares_naptr_reply* naptr_reply)
+{
+  std::shared_ptr<NaptrResult> result = std::make_shared<NaptrResult>();
+  result->status = status;
+
+  if (status == ARES_SUCCESS)
+  {
+    // Parse the reply into a sorted list of rules.
+    parse_naptr_reply(naptr_reply, result->rules);
+  }
+
+  return result;
+}
+
+
+void DNSEnumService::process_naptr_result(const NaptrResult& result,
+                                          LookupState& state)
+{
+  if (result.status == ARES_SUCCESS)
+  {
+    // Spin through the rules, looking for the first match.
+    const std::vector<Rule>& rules = result.rules;
+    std::vector<DNSEnumService::Rule>::const_iterator rule;
+    for (rule = rules.begin();
+         rule != rules.end();
+         ++rule)
     {
-      // Parse the reply into a sorted list of rules.
-      std::vector<Rule> rules;
-      parse_naptr_reply(naptr_reply, rules);
-      // Now spin through the rules, looking for the first match.
-      std::vector<DNSEnumService::Rule>::const_iterator rule;
-      for (rule = rules.begin();
-           rule != rules.end();
-           ++rule)
+      if (rule->matches(state.string))
       {
-        if (rule->matches(string))
+        // We found a match, so apply the regular expression to the AUS (not
+        // the previous string - this is what ENUM mandates).  If this was a
+        // terminal rule, we now have a SIP URI and we're finished.
+        // Otherwise, the output of the regular expression is used as the
+        // next key.
+        try
+        {
+          state.string = rule->replace(state.aus, state.trail);
+          state.complete = rule->is_terminal();
+        }
+        catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
         {
-          // We found a match, so apply the regular expression to the AUS (not
-          // the previous string - this is what ENUM mandates).  If this was a
-          // terminal rule, we now have a SIP URI and we're finished.
-          // Otherwise, the output of the regular expression is used as the
-          // next key.
-          try
-          {
-            string = rule->replace(aus, trail);
-            complete = rule->is_terminal();
-          }
-          catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
-          {
-            TRC_ERROR("Failed to translate number with regex");
-            failed = true;
-            // LCOV_EXCL_STOP
-          }
-          break;
+          TRC_ERROR("Failed to translate number with regex");
+          state.failed = true;
+          // LCOV_EXCL_STOP
         }
+        break;
       }
-      // If we didn't find a match (and so hit the end of the list), consider
-      // this a failure.
-      failed = failed || (rule == rules.end());
-    }
-    else if (status == ARES_ENOTFOUND)
-    {
-      // Our DNS query failed, so give up, but this is not an ENUM server issue -
-      // we just tried to look up an unknown name.
-      failed = true;
-    }
-    else
-    {
-      // Our DNS query failed. Give up, and track an ENUM server failure.
-      failed = true;
-      server_failed = true;
     }
+    // If we didn't find a match (and so hit the end of the list), consider
+    // this a failure.
+    state.failed = state.failed || (rule == rules.end());
+  }
+  else if (result.status == ARES_ENOTFOUND)
+  {
+    // Our DNS query failed, so give up, but this is not an ENUM server issue -
+    // we just tried to look up an unknown name.
+    state.failed = true;
+  }
+  else
+  {
+    // Our DNS query failed. Give up, and track an ENUM server failure.
+    state.failed = true;
+    state.server_failed = true;
+  }
 
+  state.dns_queries++;
+}
 
-    // Free off the NAPTR reply if we have one.
-    if (naptr_reply != NULL)
-    {
-      resolver->free_naptr_reply(naptr_reply);
-      naptr_reply = NULL;
-    }
 
-    dns_queries++;
+bool DNSEnumService::find_in_cache(const std::string& domain,
+                                   std::shared_ptr<const NaptrResult>& result,
+                                   SAS::TrailId trail) const
+{
+  if ((_cache == NULL) || (!_cache->get(domain, result)))
+  {
+    return false;
   }
 
+  TRC_DEBUG("Found cached NAPTR result for %s", domain.c_str());
+  SAS::Event event(trail, SASEvent::ENUM_CACHE_HIT, 0);
+  event.add_static_param(result->status);
+  event.add_var_param(domain);
+  SAS::report_event(event);
+
+  return true;
+}
+
+
+void DNSEnumService::add_to_cache(const std::string& domain,
+                                  std::shared_ptr<const NaptrResult> result,
+                                  int ttl) const
+{
+  // Only cache definitive answers from the server - positive responses and
+  // responses saying that there are no records for the domain.  Server
+  // failures and timeouts must be retried.
+  if ((_cache != NULL) &&
+      ((result->status == ARES_SUCCESS) ||
+       (result->status == ARES_ENOTFOUND) ||
+       (result->status == ARES_ENODATA)))
+  {
+    TRC_DEBUG("Caching NAPTR result for %s for %d seconds", domain.c_str(), ttl);
+    _cache->put(domain, result, ttl);
+  }
+}
+
+
+std::string DNSEnumService::finish_lookup(LookupState& state) const
+{
   // Log that we've finished processing (and whether it was successful or not).
-  if (complete)
+  if (state.complete)
   {
-    TRC_DEBUG("Enum lookup completes: %s", string.c_str());
-    SAS::Event event(trail, SASEvent::ENUM_COMPLETE, 0);
-    event.add_var_param(user);
-    event.add_var_param(string);
+    TRC_DEBUG("Enum lookup completes: %s", state.string.c_str());
+    SAS::Event event(state.trail, SASEvent::ENUM_COMPLETE, 0);
+    event.add_var_param(state.user);
+    event.add_var_param(state.string);
     SAS::report_event(event);
   }
   else
   {
-    TRC_WARNING("Enum lookup did not complete for user %s", user.c_str());
-    SAS::Event event(trail, SASEvent::ENUM_INCOMPLETE, 0);
-    event.add_var_param(user);
+    TRC_WARNING("Enum lookup did not complete for user %s", state.user.c_str());
+    SAS::Event event(state.trail, SASEvent::ENUM_INCOMPLETE, 0);
+    event.add_var_param(state.user);
     SAS::report_event(event);
     // On failure, we must return an empty (rather than incomplete) string.
-    string = std::string("");
+    state.string = std::string("");
   }
 
   // Report state of last communication attempt (which may potentially set/clear
   // an associated alarm).
   if (_comm_monitor)
   {
-    if (server_failed)
+    if (state.server_failed)
     {
       _comm_monitor->inform_failure();
     }
@@ -499,28 +866,63 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
     }
   }
 
-  return string;
+  return state.string;
 }
 
 
-std::string DNSEnumService::key_to_domain(const std::string& key) const
+// LCOV_EXCL_START - the asynchronous resolver needs a real DNS server
+void DNSEnumService::send_async_query(std::shared_ptr<LookupState> state,
+                                      LookupCallback callback) const
 {
-  // First strip all non-numeric characters from the key.
-  std::string number = boost::regex_replace(key, CHARS_TO_STRIP_FROM_DOMAIN, std::string(""));
-  // Then spin backwards through the number, adding each digit separated by
-  // dots.
-  std::string domain;
-  for (int ch_idx = number.length() - 1; ch_idx >= 0; ch_idx--)
-  {
-    domain.push_back(number[ch_idx]);
-    if (ch_idx != 0)
+  // Translate the key into a domain and work through any results we have
+  // cached.
+  std::string domain = key_to_domain(state->string);
+  std::shared_ptr<const NaptrResult> result;
+
+  while (find_in_cache(domain, result, state->trail))
+  {
+    process_naptr_result(*result, *state);
+
+    if (!state->more_queries())
     {
-      domain.push_back('.');
+      callback(finish_lookup(*state));
+      return;
     }
+
+    domain = key_to_domain(state->string);
   }
-  // Finally, append the suffix.
-  domain += _dns_suffix;
-  return domain;
+
+  // Issue a query for the domain.  The callback is run on the resolver's
+  // thread, and either issues the next query or finishes the lookup.
+  _async_resolver->perform_naptr_query(
+    domain,
+    [this, state, callback, domain](int status,
+                                    const struct ares_naptr_reply* naptr_reply,
+                                    int ttl)
+    {
+      std::shared_ptr<const NaptrResult> result =
+                                      make_naptr_result(status, naptr_reply);
+      add_to_cache(domain, result, ttl);
+      process_naptr_result(*result, *state);
+
+      if (state->more_queries())
+      {
+        send_async_query(state, callback);
+      }
+      else
+      {
+        callback(finish_lookup(*state));
+      }
+    },
+    state->trail);
+}
+// LCOV_EXCL_STOP
+
+
+std::string DNSEnumService::key_to_domain(const std::string& key) const
+{
+  // The key's digits, backwards and separated by dots, and then the suffix.
+  return NumberNormalizer::enum_domain(key, _dns_suffix);
 }
 
 
@@ -0,0 +1,226 @@
+/**
+ * @file flight_recorder.cpp Per-thread flight recorder of the steps taken to
+ * process each message, dumped when processing is slow or fails.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "log.h"
+#include "flight_recorder.h"
+
+namespace FlightRecorder
+{
+  struct Mark
+  {
+    StageLatency::Ticks ticks;
+    int64_t arg;
+    char label[LABEL_LENGTH];
+  };
+
+  // A thread's ring of marks.  Only the owning thread touches it.
+  struct Ring
+  {
+    Ring() : active(false), failed(false), trail(0), start(0), next(0), first(0) {}
+
+    bool active;
+    bool failed;
+    SAS::TrailId trail;
+    StageLatency::Ticks start;
+
+    // The number of marks ever written, and the number written when the
+    // current transaction began.
+    uint64_t next;
+    uint64_t first;
+
+    Mark marks[RING_SIZE];
+  };
+
+  static std::atomic<uint64_t> threshold(0);
+  static std::atomic<int> max_dumps(MAX_DUMPS_PER_SECOND);
+  static std::atomic<uint64_t> dumps(0);
+  static std::atomic<uint64_t> suppressed_dumps(0);
+
+  // The second in which records were last dumped, and how many were.
+  static std::atomic<int64_t> dump_second(0);
+  static std::atomic<int> dumps_this_second(0);
+
+  // The ring is only allocated on threads that record transactions.
+  static thread_local std::unique_ptr<Ring> tl_ring;
+
+  void set_threshold_us(uint64_t threshold_us, int max_dumps_per_second)
+  {
+    threshold.store(threshold_us, std::memory_order_relaxed);
+    max_dumps.store(max_dumps_per_second, std::memory_order_relaxed);
+  }
+
+  void begin(SAS::TrailId trail)
+  {
+    if (threshold.load(std::memory_order_relaxed) == 0)
+    {
+      if (tl_ring)
+      {
+        tl_ring->active = false;
+      }
+      return;
+    }
+
+    if (!tl_ring)
+    {
+      tl_ring.reset(new Ring());
+    }
+
+    Ring* ring = tl_ring.get();
+    ring->active = true;
+    ring->failed = false;
+    ring->trail = trail;
+    ring->start = StageLatency::now();
+    ring->first = ring->next;
+  }
+
+  bool active()
+  {
+    return (tl_ring) && (tl_ring->active);
+  }
+
+  static Mark* next_mark()
+  {
+    Ring* ring = tl_ring.get();
+    return &ring->marks[ring->next++ % RING_SIZE];
+  }
+
+  void mark(const char* label, int64_t arg)
+  {
+    if (active())
+    {
+      Mark* m = next_mark();
+      m->ticks = StageLatency::now();
+      m->arg = arg;
+      strncpy(m->label, label, LABEL_LENGTH - 1);
+      m->label[LABEL_LENGTH - 1] = '\0';
+    }
+  }
+
+  void mark(const char* label, const std::string& detail, int64_t arg)
+  {
+    if (active())
+    {
+      Mark* m = next_mark();
+      m->ticks = StageLatency::now();
+      m->arg = arg;
+      snprintf(m->label, LABEL_LENGTH, "%s %s", label, detail.c_str());
+    }
+  }
+
+  void error()
+  {
+    if (active())
+    {
+      tl_ring->failed = true;
+    }
+  }
+
+  // Returns whether another record can be dumped this second.
+  static bool dump_allowed()
+  {
+    int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+                 std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t last_second = dump_second.load(std::memory_order_relaxed);
+
+    if ((second != last_second) &&
+        (dump_second.compare_exchange_strong(last_second, second)))
+    {
+      dumps_this_second.store(0, std::memory_order_relaxed);
+    }
+
+    return (dumps_this_second.fetch_add(1, std::memory_order_relaxed) <
+            max_dumps.load(std::memory_order_relaxed));
+  }
+
+  static std::string format(const Ring* ring, uint64_t latency_us)
+  {
+    uint64_t count = ring->next - ring->first;
+    uint64_t first = ring->first;
+    char buf[128];
+
+    snprintf(buf, sizeof(buf),
+             "Flight record for trail %" PRIu64 ": %" PRIu64 "us%s, %" PRIu64 " marks",
+             (uint64_t)ring->trail,
+             latency_us,
+             ring->failed ? ", failed" : "",
+             count);
+    std::string record = buf;
+
+    if (count > (uint64_t)RING_SIZE)
+    {
+      snprintf(buf, sizeof(buf),
+               "\n  (%" PRIu64 " earliest marks lost)", count - RING_SIZE);
+      record += buf;
+      first = ring->next - RING_SIZE;
+    }
+
+    for (uint64_t ii = first; ii < ring->next; ++ii)
+    {
+      const Mark& m = ring->marks[ii % RING_SIZE];
+      uint64_t offset_us = (m.ticks > ring->start) ?
+                             StageLatency::ticks_to_us(m.ticks - ring->start) : 0;
+      snprintf(buf, sizeof(buf),
+               "\n  +%8" PRIu64 "us %s %" PRId64,
+               offset_us,
+               m.label,
+               m.arg);
+      record += buf;
+    }
+
+    return record;
+  }
+
+  std::string end(uint64_t latency_us)
+  {
+    std::string record;
+
+    if (active())
+    {
+      Ring* ring = tl_ring.get();
+      ring->active = false;
+
+      if ((ring->failed) ||
+          (latency_us >= threshold.load(std::memory_order_relaxed)))
+      {
+        if (dump_allowed())
+        {
+          record = format(ring, latency_us);
+          TRC_WARNING("%s", record.c_str());
+          dumps.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+          suppressed_dumps.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    }
+
+    return record;
+  }
+
+  uint64_t dumped()
+  {
+    return dumps.load(std::memory_order_relaxed);
+  }
+
+  uint64_t suppressed()
+  {
+    return suppressed_dumps.load(std::memory_order_relaxed);
+  }
+}
@@ -17,38 +17,69 @@ extern "C" {
 
 // Common STL includes.
 #include <cassert>
-#include <map>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
+#include <vector>
+#include <mutex>
 
 #include "log.h"
 #include "utils.h"
 #include "pjutils.h"
 #include "stack.h"
+#include "random_token.h"
 #include "flowtable.h"
 
-FlowTable::FlowTable(QuiescingManager* qm, SNMP::U32Scalar* connection_count) :
-  _tp2flow_map(),
-  _tk2flow_map(),
+const int FlowTable::NUM_SHARDS;
+const int FlowTable::WHEEL_SLOTS;
+
+FlowTable::FlowTable(QuiescingManager* qm,
+                     SNMP::U32Scalar* connection_count,
+                     SNMP::U32Scalar* memory_per_flow) :
+  _quiesce_lock("flow_table_quiesce"),
+  _wheel_lock("flow_table_wheel"),
+  _wheel_time(monotonic_now()),
+  _now(_wheel_time),
+  _flow_count(0),
+  _flow_memory(0),
   _conn_count(connection_count),
+  _memory_per_flow(memory_per_flow),
+  _memory_account(MemoryAccounting::account("flow_table")),
   _quiescing(false),
   _qm(qm)
 {
-  pthread_mutex_init(&_flow_map_lock, NULL);
+  for (int ii = 0; ii < WHEEL_SLOTS; ++ii)
+  {
+    _wheel[ii] = NULL;
+  }
+
+  // Start the timer that drives the timer wheel.
+  pj_timer_entry_init(&_tick_timer, 0, (void*)this, &on_tick);
+  pj_time_val delay = {1, 0};
+  pjsip_endpt_schedule_timer(stack_data.endpt, &_tick_timer, &delay);
+
   report_flow_count();
 }
 
 
 FlowTable::~FlowTable()
 {
+  pjsip_endpt_cancel_timer(stack_data.endpt, &_tick_timer);
+
   // Delete all the existing flows.
-  for (std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.begin();
-       i != _tp2flow_map.end();
-       ++i)
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
   {
-    delete i->second;
+    for (std::unordered_map<FlowKey, Flow*, FlowKeyHash>::iterator i =
+           _address_shards[ii].flows.begin();
+         i != _address_shards[ii].flows.end();
+         ++i)
+    {
+      delete i->second;
+    }
   }
-
-  pthread_mutex_destroy(&_flow_map_lock);
 }
 
 
@@ -64,35 +95,48 @@ Flow* FlowTable::find_create_flow(pjsip_transport* transport, const pj_sockaddr*
             transport->obj_name, transport->key.type,
             pj_sockaddr_print(raddr, buf, sizeof(buf), 3));
 
-  pthread_mutex_lock(&_flow_map_lock);
+  AddressShard& shard = address_shard(key);
+  shard.lock.lock();
 
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
+  std::unordered_map<FlowKey, Flow*, FlowKeyHash>::iterator i = shard.flows.find(key);
 
-  if (i == _tp2flow_map.end())
+  if ((i != shard.flows.end()) && (i->second->inc_ref()))
+  {
+    // Found a matching flow, so return this one.
+    flow = i->second;
+
+    TRC_DEBUG("Found flow record %p", flow);
+  }
+  else
   {
-    // No matching flow, so create a new one.
+    // No matching flow (or only one that's being removed), so create a new
+    // one.  The flow being removed takes itself out of the maps only if it's
+    // still the one in them, so it's safe to replace it here - and as it
+    // then won't count itself out, the new flow isn't counted in.
+    if (i == shard.flows.end())
+    {
+      ++_flow_count;
+    }
+
     flow = new Flow(this, transport, raddr);
 
     // Add the new flow to the maps.
-    _tp2flow_map.insert(std::make_pair(key, flow));
-    _tk2flow_map.insert(std::make_pair(flow->token(), flow));
+    shard.flows[key] = flow;
+
+    TokenShard& tk_shard = token_shard(flow->token());
+    tk_shard.lock.lock();
+    tk_shard.flows[flow->token()] = flow;
+    tk_shard.lock.unlock();
 
     TRC_DEBUG("Added flow record %p", flow);
 
     report_flow_count();
-  }
-  else
-  {
-    // Found a matching flow, so return this one.
-    flow = i->second;
 
-    TRC_DEBUG("Found flow record %p", flow);
+    // Add a reference to the flow.
+    flow->inc_ref();
   }
 
-  // Add a reference to the flow.
-  flow->inc_ref();
-
-  pthread_mutex_unlock(&_flow_map_lock);
+  shard.lock.unlock();
 
   return flow;
 }
@@ -110,22 +154,21 @@ Flow* FlowTable::find_flow(pjsip_transport* transport, const pj_sockaddr* raddr)
             transport->obj_name, transport->key.type,
             pj_sockaddr_print(raddr, buf, sizeof(buf), 3));
 
-  pthread_mutex_lock(&_flow_map_lock);
+  AddressShard& shard = address_shard(key);
+  shard.lock.lock();
 
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
+  std::unordered_map<FlowKey, Flow*, FlowKeyHash>::iterator i = shard.flows.find(key);
 
-  if (i != _tp2flow_map.end())
+  // Increment the reference count on the flow, unless it's being removed.
+  if ((i != shard.flows.end()) && (i->second->inc_ref()))
   {
     // Found a matching flow, so return this one.
     flow = i->second;
 
-    // Increment the reference count on the flow.
-    flow->inc_ref();
-
     TRC_DEBUG("Found flow record %p", flow);
   }
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  shard.lock.unlock();
 
   return flow;
 }
@@ -138,28 +181,32 @@ Flow* FlowTable::find_flow(const std::string& token)
 
   TRC_DEBUG("Find flow for flow token %s", token.c_str());
 
-  pthread_mutex_lock(&_flow_map_lock);
+  TokenShard& shard = token_shard(token);
+  shard.lock.lock();
 
-  std::map<std::string, Flow*>::iterator i = _tk2flow_map.find(token);
-  if (i != _tk2flow_map.end())
+  std::unordered_map<std::string, Flow*>::iterator i = shard.flows.find(token);
+
+  // Add a reference to the flow, unless it's being removed.
+  if ((i != shard.flows.end()) && (i->second->inc_ref()))
   {
     // Found a flow matching the token.
     flow = i->second;
 
-    // Add a reference to the flow.
-    flow->inc_ref();
-
     TRC_DEBUG("Found flow record %p", flow);
   }
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  shard.lock.unlock();
 
   return flow;
 }
 
 void FlowTable::check_quiescing_state()
 {
-  if (_tp2flow_map.empty() && is_quiescing() && (_qm != NULL))
+  _quiesce_lock.lock();
+
+  bool empty = (_flow_count.load() == 0);
+
+  if (empty && is_quiescing() && (_qm != NULL))
   {
     TRC_DEBUG("Flow map is empty and we are quiescing - start transaction-based quiescing");
     _qm->flows_gone();
@@ -167,58 +214,271 @@ void FlowTable::check_quiescing_state()
   else
   {
     TRC_DEBUG("Checked quiescing state: flow_map is %s, is_quiescing() result is %s, _qm (QuiescingManager reference) is %s",
-              _tp2flow_map.empty() ? "empty" : "not empty",
+              empty ? "empty" : "not empty",
               is_quiescing()? "true" : "false",
               (_qm == NULL) ? "NULL" : "not NULL");
   }
+
+  _quiesce_lock.unlock();
 }
 
 void FlowTable::remove_flow(Flow* flow)
 {
-  pthread_mutex_lock(&_flow_map_lock);
-
   TRC_DEBUG("Remove flow %p", flow);
 
   FlowKey key(flow->transport()->key.type, flow->remote_addr());
+  bool removed = false;
+
+  AddressShard& shard = address_shard(key);
+  shard.lock.lock();
 
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
-  if (i != _tp2flow_map.end())
+  // A new flow may already have replaced this one in the maps, so only
+  // remove the entries if they are still this flow's.
+  std::unordered_map<FlowKey, Flow*, FlowKeyHash>::iterator i = shard.flows.find(key);
+  if ((i != shard.flows.end()) && (i->second == flow))
   {
-    _tp2flow_map.erase(i);
+    shard.flows.erase(i);
+    removed = true;
   }
 
-  std::map<std::string, Flow*>::iterator j = _tk2flow_map.find(flow->token());
-  if (j != _tk2flow_map.end())
+  TokenShard& tk_shard = token_shard(flow->token());
+  tk_shard.lock.lock();
+
+  std::unordered_map<std::string, Flow*>::iterator j = tk_shard.flows.find(flow->token());
+  if ((j != tk_shard.flows.end()) && (j->second == flow))
   {
-    _tk2flow_map.erase(j);
+    tk_shard.flows.erase(j);
+  }
+
+  tk_shard.lock.unlock();
+  shard.lock.unlock();
+
+  if (removed)
+  {
+    --_flow_count;
   }
 
   report_flow_count();
 
   delete flow;
 
-  check_quiescing_state();
-
-  pthread_mutex_unlock(&_flow_map_lock);
+  // Only the removal that empties the table can complete quiescing, so
+  // don't take the quiesce lock for every flow that goes away.
+  if ((removed) && (_quiescing.load()) && (_flow_count.load() == 0))
+  {
+    check_quiescing_state();
+  }
 }
 
 void FlowTable::report_flow_count()
 {
-  TRC_DEBUG("Reporting current flow count: %d", _tp2flow_map.size());
-  _conn_count->value = _tp2flow_map.size();
+  int count = _flow_count.load();
+  TRC_DEBUG("Reporting current flow count: %d", count);
+  _conn_count->value = count;
+  adjust_flow_memory(0);
+}
+
+void FlowTable::adjust_flow_memory(long delta)
+{
+  long memory = (_flow_memory += delta);
+  _memory_account->adjust(delta);
+
+  if (_memory_per_flow != NULL)
+  {
+    int count = _flow_count.load();
+    _memory_per_flow->value = (count > 0) ? (memory / count) : 0;
+  }
+}
+
+std::vector<size_t> FlowTable::shard_occupancy()
+{
+  std::vector<size_t> occupancy;
+  occupancy.reserve(NUM_SHARDS);
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    _address_shards[ii].lock.lock();
+    occupancy.push_back(_address_shards[ii].flows.size());
+    _address_shards[ii].lock.unlock();
+  }
+
+  return occupancy;
+}
+
+/// Returns the current monotonic time in seconds.
+int FlowTable::monotonic_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (int)ts.tv_sec;
+}
+
+/// Called by PJSIP every second to move the timer wheel on.
+void FlowTable::on_tick(pj_timer_heap_t* th, pj_timer_entry* e)
+{
+  FlowTable* ft = (FlowTable*)e->user_data;
+  ft->process_timers(monotonic_now());
+
+  pj_time_val delay = {1, 0};
+  pjsip_endpt_schedule_timer(stack_data.endpt, &ft->_tick_timer, &delay);
+}
+
+void FlowTable::process_timers(int now)
+{
+  std::vector<std::pair<Flow*, int> > popped;
+
+  _wheel_lock.lock();
+
+  if (now > _wheel_time)
+  {
+    // Visit the slot for each second since the last tick (but each slot no
+    // more than once).
+    int ticks = std::min(now - _wheel_time, WHEEL_SLOTS);
+    for (int tt = now - ticks + 1; tt <= now; ++tt)
+    {
+      Flow* flow = _wheel[tt % WHEEL_SLOTS];
+      while (flow != NULL)
+      {
+        Flow* next = flow->_wheel_next;
+
+        if (flow->_timer_deadline <= now)
+        {
+          int id = flow->_timer_id;
+          unlink_timer(flow);
+
+          // Hold a reference while the timer is handled, unless the flow is
+          // already being deleted.
+          if (flow->inc_ref())
+          {
+            popped.push_back(std::make_pair(flow, id));
+          }
+        }
+
+        flow = next;
+      }
+    }
+
+    _wheel_time = now;
+    _now.store(now, std::memory_order_relaxed);
+  }
+
+  _wheel_lock.unlock();
+
+  for (size_t ii = 0; ii < popped.size(); ++ii)
+  {
+    popped[ii].first->timer_pop(popped[ii].second, now);
+    popped[ii].first->dec_ref();
+  }
+}
+
+/// Starts or restarts the timer for the flow.  If earlier_only is set, a
+/// timer of the same type that's due sooner is left alone.
+void FlowTable::schedule_timer(Flow* flow, int id, int timeout, bool earlier_only)
+{
+  _wheel_lock.lock();
+
+  int deadline = _wheel_time + std::max(timeout, 1);
+
+  if ((!earlier_only) ||
+      (flow->_timer_id != id) ||
+      (flow->_timer_deadline > deadline))
+  {
+    link_timer(flow, id, deadline);
+  }
+
+  _wheel_lock.unlock();
+}
+
+void FlowTable::cancel_timer(Flow* flow)
+{
+  _wheel_lock.lock();
+  unlink_timer(flow);
+  _wheel_lock.unlock();
+}
+
+/// Checks whether a popped idle timer means the flow really is idle,
+/// restarting the timer if the flow has been touched since it was started.
+bool FlowTable::idle_timer_expired(Flow* flow, int now)
+{
+  bool expired = false;
+
+  _wheel_lock.lock();
+
+  if (flow->_timer_id == 0)
+  {
+    // No-one has restarted the timer since it popped.
+    int deadline = flow->_last_touch.load(std::memory_order_relaxed) +
+                   Flow::IDLE_TIMEOUT;
+    if (deadline > now)
+    {
+      link_timer(flow, Flow::IDLE_TIMER, deadline);
+    }
+    else
+    {
+      expired = true;
+    }
+  }
+
+  _wheel_lock.unlock();
+
+  return expired;
+}
+
+/// Puts the flow's timer on the wheel, in place of any existing timer.  Must
+/// be called with the wheel lock held.
+void FlowTable::link_timer(Flow* flow, int id, int deadline)
+{
+  unlink_timer(flow);
+
+  int slot = deadline % WHEEL_SLOTS;
+  flow->_wheel_slot = slot;
+  flow->_wheel_prev = NULL;
+  flow->_wheel_next = _wheel[slot];
+  if (_wheel[slot] != NULL)
+  {
+    _wheel[slot]->_wheel_prev = flow;
+  }
+  _wheel[slot] = flow;
+  flow->_timer_id = id;
+  flow->_timer_deadline = deadline;
+}
+
+/// Takes the flow's timer off the wheel.  Must be called with the wheel lock
+/// held.
+void FlowTable::unlink_timer(Flow* flow)
+{
+  if (flow->_wheel_slot >= 0)
+  {
+    if (flow->_wheel_prev != NULL)
+    {
+      flow->_wheel_prev->_wheel_next = flow->_wheel_next;
+    }
+    else
+    {
+      _wheel[flow->_wheel_slot] = flow->_wheel_next;
+    }
+
+    if (flow->_wheel_next != NULL)
+    {
+      flow->_wheel_next->_wheel_prev = flow->_wheel_prev;
+    }
+
+    flow->_wheel_prev = NULL;
+    flow->_wheel_next = NULL;
+    flow->_wheel_slot = -1;
+  }
+
+  flow->_timer_id = 0;
 }
 
 void FlowTable::quiesce()
 {
   TRC_DEBUG("FlowTable was kicked to quiesce");
   _quiescing = true;
-  pthread_mutex_lock(&_flow_map_lock);
 
   // If we have no flows, quiesce now - otherwise we do this in
   // remove_flow when the last flow disappears
   check_quiescing_state();
-
-  pthread_mutex_unlock(&_flow_map_lock);
 }
 
 void FlowTable::unquiesce()
@@ -234,25 +494,36 @@ void FlowTable::unquiesce()
 
 bool FlowTable::is_quiescing()
 {
-  return _quiescing;
+  return _quiescing.load();
 }
 
+// Flows are created often, so look up the statistics for their locks once.
+static LockStats* flow_lock_stats = LockInstrumentation::stats("flow");
+
 Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr* remote_addr) :
   _flow_table(flow_table),
   _transport(transport),
   _tp_state_listener_key(NULL),
   _remote_addr(*remote_addr),
-  _token(),
-  _authorized_ids(),
-  _default_id(),
+  _wheel_prev(NULL),
+  _wheel_next(NULL),
+  _wheel_slot(-1),
+  _timer_id(0),
+  _timer_deadline(0),
+  _last_touch(flow_table->wheel_time()),
+  _flow_lock(flow_lock_stats),
+  _overflow_ids(),
+  _num_ids(0),
+  _default_idx(-1),
+  _memory(0),
   _refs(1),
   _dialogs(0)
 {
-  // Create the lock for protecting the authorized_ids and default_id.
-  pthread_mutex_init(&_flow_lock, NULL);
-
   // Create a random base64 encoded token for the flow.
-  Utils::create_random_token(Flow::TOKEN_LENGTH, _token);
+  std::string token;
+  RandomToken::create(Flow::TOKEN_LENGTH, token);
+  memset(_token, 0, sizeof(_token));
+  strncpy(_token, token.c_str(), TOKEN_LENGTH);
 
   if (PJSIP_TRANSPORT_IS_RELIABLE(_transport))
   {
@@ -268,12 +539,12 @@ Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr*
     TRC_DEBUG("Added transport listener for flow %p", this);
   }
 
-  // Initialize the timer.
-  pj_timer_entry_init(&_timer, PJ_FALSE, (void*)this, &on_timer_expiry);
-  _timer.id = 0;
-
   // Start the timer as an idle timer.
   restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
+
+  _flow_lock.lock();
+  update_memory();
+  _flow_lock.unlock();
 }
 
 
@@ -291,14 +562,10 @@ Flow::~Flow()
     pjsip_transport_dec_ref(_transport);
   }
 
-  if (_timer.id)
-  {
-    // Stop the keepalive timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
-    _timer.id = 0;
-  }
+  // Stop the keepalive timer.
+  _flow_table->cancel_timer(this);
 
-  pthread_mutex_destroy(&_flow_lock);
+  _flow_table->adjust_flow_memory(-(long)_memory);
 }
 
 
@@ -306,11 +573,9 @@ Flow::~Flow()
 /// flow doesn't time out in the middle of processing the REGISTER.
 void Flow::touch()
 {
-  if (_timer.id == IDLE_TIMER)
-  {
-    // Idle timer is running, so restart it.
-    restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
-  }
+  // The idle timer checks this when it pops, and restarts itself if the flow
+  // has been touched.
+  _last_touch.store(_flow_table->wheel_time(), std::memory_order_relaxed);
 }
 
 
@@ -322,17 +587,17 @@ std::string Flow::asserted_identity(pjsip_uri* preferred_identity)
   std::string aor = PJUtils::public_id_from_uri((pjsip_uri*)pjsip_uri_get_uri(preferred_identity));
   std::string id;
 
-  pthread_mutex_lock(&_flow_lock);
+  _flow_lock.lock();
 
-  auth_id_map::const_iterator i = _authorized_ids.find(aor);
+  int index = find_id(aor);
 
-  if (i != _authorized_ids.end())
+  if (index >= 0)
   {
     // Found the corresponding identity.
-    id = i->second.name_addr;
+    id = id_at(index).name_addr;
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  _flow_lock.unlock();
 
   return id;
 }
@@ -343,11 +608,16 @@ std::string Flow::asserted_identity(pjsip_uri* preferred_identity)
 /// identities are authorized on this flow.
 std::string Flow::default_identity()
 {
-  pthread_mutex_lock(&_flow_lock);
+  std::string id;
+
+  _flow_lock.lock();
 
-  std::string id = _default_id;
+  if (_default_idx >= 0)
+  {
+    id = id_at(_default_idx).aor;
+  }
 
-  pthread_mutex_unlock(&_flow_lock);
+  _flow_lock.unlock();
 
   return id;
 }
@@ -358,22 +628,35 @@ std::string Flow::service_route(const std::string& identity)
 {
   std::string route;
 
-  pthread_mutex_lock(&_flow_lock);
+  _flow_lock.lock();
 
-  auth_id_map::const_iterator i = _authorized_ids.find(identity);
+  int index = find_id(identity);
 
-  if (i != _authorized_ids.end())
+  if (index >= 0)
   {
     // Found the corresponding identity.
-    route = i->second.service_route;
+    route = *id_at(index).service_route;
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  _flow_lock.unlock();
 
   return route;
 }
 
 
+/// Returns a shared copy of the specified service route.  Flows only ever
+/// see the handful of service routes handed out by the S-CSCFs, so these
+/// are never freed.
+static const std::string* intern_service_route(const std::string& service_route)
+{
+  static std::mutex lock;
+  static std::unordered_set<std::string> routes;
+
+  std::lock_guard<std::mutex> guard(lock);
+  return &(*routes.insert(service_route).first);
+}
+
+
 /// Sets the specified identities as authorized for this flow.
 void Flow::set_identity(const pjsip_uri* uri,
                         const std::string& service_route,
@@ -382,12 +665,12 @@ void Flow::set_identity(const pjsip_uri* uri,
 {
   int now = time(NULL);
 
-  // Render the URI to an AoR suitable to look up in the map.
+  // Render the URI to an AoR suitable to look up in the store.
   std::string aor = PJUtils::public_id_from_uri((pjsip_uri*)pjsip_uri_get_uri(uri));
 
   TRC_DEBUG("Setting identity %s on flow %p, expires = %d", aor.c_str(), this, expires);
 
-  pthread_mutex_lock(&_flow_lock);
+  _flow_lock.lock();
 
   // Convert the expiry time to an absolute time.
   expires += now;
@@ -400,13 +683,19 @@ void Flow::set_identity(const pjsip_uri* uri,
     expires += EXPIRY_GRACE_INTERVAL;
 
     // Find or create the entry for this aor.
-    AuthId& aid = _authorized_ids[aor];
+    int index = find_id(aor);
+    if (index < 0)
+    {
+      add_id(aor);
+      index = _num_ids - 1;
+    }
+    AuthId& aid = id_at(index);
 
     // Store the name_addr rendered from the received URI.
     aid.name_addr = PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, uri);
 
     // Store the service route for this identity.
-    aid.service_route = service_route;
+    aid.service_route = intern_service_route(service_route);
 
     // Update the expiry time.
     aid.expires = expires;
@@ -414,41 +703,28 @@ void Flow::set_identity(const pjsip_uri* uri,
     // Set the default_id flag
     aid.default_id = is_default;
 
-    if ((aid.default_id) && (_default_id == ""))
+    if ((aid.default_id) && (_default_idx < 0))
     {
       // This is the first default_id to be set.
-      _default_id = aor;
+      _default_idx = index;
     }
 
     // May need to (re)start the timer if either it's not running, or it's
     // running as an idle timer, or the expires time for these identities is
     // earlier than the timer will next pop.
-    if ((_timer.id != EXPIRY_TIMER) ||
-        (_timer._timer_value.sec > expires))
-    {
-      restart_timer(EXPIRY_TIMER, expires - time(NULL));
-    }
+    restart_timer(EXPIRY_TIMER, expires - time(NULL), true);
   }
   else
   {
     TRC_DEBUG("Deleting identity %s", aor.c_str());
-    auth_id_map::iterator i = _authorized_ids.find(aor);
+    int index = find_id(aor);
 
-    if (i != _authorized_ids.end())
+    if (index >= 0)
     {
-      // Check to see whether this was the current default identity we are
-      // using for this flow.  We could do the string comparision in all cases
-      // but it is only necessary if the identity is marked as a default
-      // candidate.
-      if ((i->second.default_id) && (i->first == _default_id))
-      {
-        // This was our default ID, so remove it.
-        _default_id = "";
-      }
-      _authorized_ids.erase(i);
+      erase_id(index);
     }
 
-    if (_default_id == "")
+    if (_default_idx < 0)
     {
       // We've lost our default identity, so scan the list to see if there is
       // another one we can use.
@@ -462,7 +738,9 @@ void Flow::set_identity(const pjsip_uri* uri,
     // so would be no more efficient.
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  update_memory();
+
+  _flow_lock.unlock();
 }
 
 
@@ -475,49 +753,41 @@ void Flow::expiry_timer()
   // a single flow to have a large number of identities.  This may not be
   // a valid assumption if a downstream SBC or AGCF muxes a large number of
   // clients over a single flow.
-  pthread_mutex_lock(&_flow_lock);
+  _flow_lock.lock();
 
   int now = time(NULL);
   int min_expires = 0;
-  for (auth_id_map::const_iterator i = _authorized_ids.begin();
-       i != _authorized_ids.end();
-       )
+  for (int ii = 0; ii < _num_ids; )
   {
-    if (i->second.expires <= now)
+    AuthId& aid = id_at(ii);
+
+    if (aid.expires <= now)
     {
-      TRC_DEBUG("Expiring identity %s", i->first.c_str());
+      TRC_DEBUG("Expiring identity %s", aid.aor.c_str());
 
-      // Check to see whether this was the current default identity we are
-      // using for this flow.  We could do the string comparision in all cases
-      // but it is only necessary if the identity is marked as a default
-      // candidate.
-      if ((i->second.default_id) && (i->first == _default_id))
-      {
-        // This was our default ID, so remove it.
-        _default_id = "";
-      }
-      _authorized_ids.erase(i++);
+      // This moves the last entry into this slot, so look at this slot again.
+      erase_id(ii);
     }
     else
     {
       // This entry hasn't expired yet, so use to to work out when we next
       // need the expiry timer to pop.
-      if ((min_expires == 0) || (i->second.expires < min_expires))
+      if ((min_expires == 0) || (aid.expires < min_expires))
       {
-        min_expires = i->second.expires;
+        min_expires = aid.expires;
       }
-      ++i;
+      ++ii;
     }
   }
 
-  if (_default_id == "")
+  if (_default_idx < 0)
   {
     // We've lost our default identity, so scan the list to see if there is
     // another one we can use.
     select_default_identity();
   }
 
-  if ((_authorized_ids.size() == 0) &&
+  if ((_num_ids == 0) &&
       (!PJSIP_TRANSPORT_IS_RELIABLE(_transport)))
   {
     // No active registrations on a non-reliable transport, so restart the
@@ -531,50 +801,152 @@ void Flow::expiry_timer()
     restart_timer(EXPIRY_TIMER, min_expires - now);
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  update_memory();
+
+  _flow_lock.unlock();
 }
 // LCOV_EXCL_STOP
 
 /// Scan the list of identity for a default candidate.
 void Flow::select_default_identity()
 {
-  for (auth_id_map::const_iterator i = _authorized_ids.begin();
-       i != _authorized_ids.end();
-       ++i)
+  for (int ii = 0; ii < _num_ids; ++ii)
   {
-    if (i->second.default_id)
+    if (id_at(ii).default_id)
     {
       // LCOV_EXCL_START
       // Found a candidate default identity.
-      _default_id = i->first;
+      _default_idx = ii;
       // LCOV_EXCL_STOP
     }
   }
 }
 
 
-/// Restart the timer using the specified id and timeout.
-void Flow::restart_timer(int id, int timeout)
+/// Returns the index of the specified identity, or -1 if it isn't
+/// authorized on this flow.
+int Flow::find_id(const std::string& aor)
+{
+  for (int ii = 0; ii < _num_ids; ++ii)
+  {
+    if (id_at(ii).aor == aor)
+    {
+      return ii;
+    }
+  }
+  return -1;
+}
+
+
+/// Adds an entry for the specified identity at the end of the store.
+Flow::AuthId& Flow::add_id(const std::string& aor)
+{
+  if (_num_ids >= INLINE_IDS)
+  {
+    _overflow_ids.push_back(AuthId());
+  }
+
+  AuthId& aid = id_at(_num_ids++);
+  aid.aor = aor;
+  aid.service_route = NULL;
+  aid.expires = 0;
+  aid.default_id = false;
+  return aid;
+}
+
+
+/// Removes the entry at the specified index by moving the last entry into
+/// its place.
+void Flow::erase_id(int index)
+{
+  int last = _num_ids - 1;
+
+  if (index == _default_idx)
+  {
+    // This was our default ID, so remove it.
+    _default_idx = -1;
+  }
+
+  if (index != last)
+  {
+    std::swap(id_at(index), id_at(last));
+
+    if (_default_idx == last)
+    {
+      _default_idx = index;
+    }
+  }
+
+  if (last >= INLINE_IDS)
+  {
+    _overflow_ids.pop_back();
+  }
+  else
+  {
+    // Release any memory held by the inline entry.
+    std::string().swap(_inline_ids[last].aor);
+    std::string().swap(_inline_ids[last].name_addr);
+  }
+
+  if (_overflow_ids.empty())
+  {
+    std::vector<AuthId>().swap(_overflow_ids);
+  }
+
+  --_num_ids;
+}
+
+
+/// Returns the heap memory held by a string, if it isn't stored inline.
+static size_t heap_size(const std::string& str)
 {
-  if (_timer.id)
+  const char* data = str.data();
+  const char* start = (const char*)&str;
+  bool inline_data = ((data >= start) && (data < start + sizeof(str)));
+  return inline_data ? 0 : str.capacity() + 1;
+}
+
+
+void Flow::update_memory()
+{
+  size_t memory = sizeof(Flow) + _overflow_ids.capacity() * sizeof(AuthId);
+
+  for (int ii = 0; ii < _num_ids; ++ii)
   {
-    // Stop the existing timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
-    _timer.id = 0;
+    AuthId& aid = id_at(ii);
+    memory += heap_size(aid.aor) + heap_size(aid.name_addr);
   }
 
-  pj_time_val delay = {timeout, 0};
-  pjsip_endpt_schedule_timer(stack_data.endpt, &_timer, &delay);
-  _timer.id = id;
+  _flow_table->adjust_flow_memory((long)memory - (long)_memory);
+  _memory = memory;
 }
 
 
-/// Increment the reference count on the flow.  This is always called when
-/// the flowtable lock is held, so no need to lock.
-void Flow::inc_ref()
+/// Restart the timer using the specified id and timeout.  If earlier_only
+/// is set, a timer with the same id that will pop sooner is left running.
+void Flow::restart_timer(int id, int timeout, bool earlier_only)
 {
-  ++_refs;
-  TRC_DEBUG("Dialog count now %d for flow %s", _refs, _default_id.c_str());
+  _flow_table->schedule_timer(this, id, timeout, earlier_only);
+}
+
+
+/// Increment the reference count on the flow, unless it has already fallen
+/// to zero.  This is always called with either the flow's shard lock or the
+/// timer wheel lock held, so the flow can't be deleted underneath us.
+bool Flow::inc_ref()
+{
+  int refs = _refs.load();
+  while ((refs != 0) && (!_refs.compare_exchange_weak(refs, refs + 1)))
+  {
+    // refs has been updated to the current value, so go round again.
+  }
+
+  if (refs != 0)
+  {
+    TRC_DEBUG("Reference count now %d for flow %p", refs + 1, this);
+  }
+
+  return (refs != 0);
 }
 
 
@@ -582,17 +954,15 @@ void Flow::inc_ref()
 /// to zero.
 void Flow::dec_ref()
 {
-  pthread_mutex_lock(&_flow_table->_flow_map_lock);
+  int refs = _refs.fetch_sub(1) - 1;
 
-  if ((--_refs) == 0)
+  if (refs == 0)
   {
-    pthread_mutex_unlock(&_flow_table->_flow_map_lock);
     _flow_table->remove_flow(this);
   }
   else
   {
-    TRC_DEBUG("Dialog count now %d for flow %s", _refs, _default_id.c_str());
-    pthread_mutex_unlock(&_flow_table->_flow_map_lock);
+    TRC_DEBUG("Reference count now %d for flow %p", refs, this);
   }
 }
 
@@ -600,14 +970,14 @@ void Flow::dec_ref()
 void Flow::increment_dialogs()
 {
   ++_dialogs;
-  TRC_DEBUG("Dialog count now %ld for flow %s", _dialogs.load(), _default_id.c_str());
+  TRC_DEBUG("Dialog count now %ld for flow %p", _dialogs.load(), this);
 }
 
 // Decrements the dialog count atomically.
 void Flow::decrement_dialogs()
 {
   --_dialogs;
-  TRC_DEBUG("Dialog count now %ld for flow %s", _dialogs.load(), _default_id.c_str());
+  TRC_DEBUG("Dialog count now %ld for flow %p", _dialogs.load(), this);
 }
 
 // Returns true if we should quiesce the flow by redirecting new
@@ -637,23 +1007,22 @@ void Flow::on_transport_state_changed(pjsip_transport *tp,
 }
 
 
-/// Called by PJSIP when the expiry/idle timer expires.
-// LCOV_EXCL_START
-void Flow::on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e)
+/// Called by the FlowTable when the expiry/idle timer expires.
+void Flow::timer_pop(int id, int now)
 {
   TRC_DEBUG("%s timer expired for flow %p",
-            (e->id == EXPIRY_TIMER) ? "Expiry" : "Idle",
-            e->user_data);
-  if (e->id == EXPIRY_TIMER)
+            (id == EXPIRY_TIMER) ? "Expiry" : "Idle",
+            this);
+  if (id == EXPIRY_TIMER)
   {
     // Timer is an expiry timer.
-    ((Flow*)e->user_data)->expiry_timer();
+    expiry_timer();
   }
-  else
+  else if (_flow_table->idle_timer_expired(this, now))
   {
-    // Timer is an idle timer, so decrement the reference count so the flow
-    // will get deleted when there are no more references.
-    ((Flow*)e->user_data)->dec_ref();
+    // Timer is an idle timer and the flow hasn't been touched since it
+    // started, so decrement the reference count so the flow will get deleted
+    // when there are no more references.
+    dec_ref();
   }
 }
-// LCOV_EXCL_STOP
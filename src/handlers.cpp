@@ -11,6 +11,8 @@
 
 #include "rapidjson/document.h"
 #include "rapidjson/error/en.h"
+#include <algorithm>
+#include <iterator>
 #include "json_parse_utils.h"
 
 extern "C" {
@@ -28,6 +30,14 @@ extern "C" {
 #include "uri_classifier.h"
 #include "sprout_xml_utils.h"
 #include "subscriber_data_utils.h"
+#include "batch_utils.h"
+#include "stage_latency.h"
+#include "sproutlet_cpu.h"
+#include "instrumented_mutex.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "memory_accounting.h"
+#include "as_connection_pools.h"
 
 
 static void report_sip_all_register_marker(SAS::TrailId trail, std::string uri_str)
@@ -154,32 +164,89 @@ HTTPCode DeregistrationTask::handle_request()
   HTTPCode rc = HTTP_OK;
   std::set<std::string> impis_to_delete;
 
-  for (std::pair<std::string, std::string> binding : _bindings)
-  {
-    TRC_DEBUG("Deregister binding %s via subscriber manager", binding.first.c_str());
-    rc = deregister_bindings(binding.first,
-                             binding.second,
-                             impis_to_delete);
+  // Deregister the bindings for each AoR in parallel, as a single request
+  // from the HSS can cover many subscribers.  Each AoR has its own result and
+  // set of IMPIs so that the threads don't share any state.
+  std::vector<std::pair<std::string, std::string>> bindings(_bindings.begin(),
+                                                            _bindings.end());
+  std::vector<HTTPCode> rcs(bindings.size(), HTTP_OK);
+  std::vector<std::set<std::string>> impis(bindings.size());
 
+  BatchUtils::run_in_parallel(bindings.size(),
+                              [this, &bindings, &rcs, &impis](size_t ii)
+  {
+    TRC_DEBUG("Deregister binding %s via subscriber manager",
+              bindings[ii].first.c_str());
+    rcs[ii] = deregister_bindings(bindings[ii].first,
+                                  bindings[ii].second,
+                                  impis[ii]);
+  });
+
+  for (size_t ii = 0; ii < bindings.size(); ++ii)
+  {
+    rc = rcs[ii];
+    impis_to_delete.insert(impis[ii].begin(), impis[ii].end());
   }
 
-  // Delete IMPIs from the store.
-  for(std::string impi : impis_to_delete)
+  // Delete IMPIs from the local and remote stores in parallel.  The remote
+  // deletes may outlive this task if a remote store is slow, so they take
+  // copies of everything they need.
+  if (!impis_to_delete.empty())
   {
-    TRC_DEBUG("Delete %s from the IMPI store(s)", impi.c_str());
+    SAS::TrailId trail = _trail;
+    std::vector<BatchUtils::SiteOperation> remote_ops;
 
-    delete_impi_from_store(_cfg->_local_impi_store, impi);
-    for (ImpiStore* store: _cfg->_remote_impi_stores)
+    for (size_t ii = 0; ii < _cfg->_remote_impi_stores.size(); ++ii)
     {
-      delete_impi_from_store(store, impi);
+      ImpiStore* store = _cfg->_remote_impi_stores[ii];
+      remote_ops.push_back({"remote site " + std::to_string(ii + 1),
+                            [store, impis_to_delete, trail]()
+                            {
+                              delete_impis_from_store(store, impis_to_delete, trail);
+                            }});
     }
+
+    ImpiStore* local_store = _cfg->_local_impi_store;
+    BatchUtils::run_at_sites([local_store, &impis_to_delete, trail]()
+                             {
+                               delete_impis_from_store(local_store,
+                                                       impis_to_delete,
+                                                       trail);
+                             },
+                             remote_ops,
+                             _cfg->_remote_store_timeout_ms);
   }
 
   return rc;
 }
 
+void DeregistrationTask::delete_impis_from_store(ImpiStore* store,
+                                                 const std::set<std::string>& impis,
+                                                 SAS::TrailId trail)
+{
+  // Read all the IMPIs in one batch, then delete each one.  Only an IMPI
+  // whose delete hits contention is read again.
+  std::vector<std::string> impi_ids(impis.begin(), impis.end());
+  std::vector<ImpiStore::Impi*> impi_objs;
+  store->get_impis(impi_ids, impi_objs, trail);
+
+  for (size_t ii = 0; ii < impi_ids.size(); ++ii)
+  {
+    TRC_DEBUG("Delete %s from the IMPI store", impi_ids[ii].c_str());
+
+    if ((impi_objs[ii] != NULL) &&
+        (store->delete_impi(impi_objs[ii], trail) == Store::DATA_CONTENTION))
+    {
+      delete_impi_from_store(store, impi_ids[ii], trail);
+    }
+
+    delete impi_objs[ii]; impi_objs[ii] = NULL;
+  }
+}
+
 void DeregistrationTask::delete_impi_from_store(ImpiStore* store,
-                                                const std::string& impi)
+                                                const std::string& impi,
+                                                SAS::TrailId trail)
 {
   Store::Status store_rc = Store::OK;
   ImpiStore::Impi* impi_obj = NULL;
@@ -189,11 +256,11 @@ void DeregistrationTask::delete_impi_from_store(ImpiStore* store,
     // Free any IMPI we had from the last loop iteration.
     delete impi_obj; impi_obj = NULL;
 
-    impi_obj = store->get_impi(impi, _trail);
+    impi_obj = store->get_impi(impi, trail);
 
     if (impi_obj != NULL)
     {
-      store_rc = store->delete_impi(impi_obj, _trail);
+      store_rc = store->delete_impi(impi_obj, trail);
     }
   }
   while ((impi_obj != NULL) && (store_rc == Store::DATA_CONTENTION));
@@ -344,6 +411,77 @@ std::string extract_impu(HttpStack::Request& request)
   return impu;
 }
 
+// Read the optional "offset" and "limit" query parameters, which let clients
+// page through AoRs with large numbers of bindings or subscriptions.  A limit
+// of zero means no limit.  Returns false if either parameter isn't a number.
+static bool parse_page_params(HttpStack::Request& request,
+                              size_t& offset,
+                              size_t& limit)
+{
+  offset = 0;
+  limit = 0;
+  std::string offset_str = request.param("offset");
+  std::string limit_str = request.param("limit");
+
+  if (((!offset_str.empty()) &&
+       (offset_str.find_first_not_of("0123456789") != std::string::npos)) ||
+      ((!limit_str.empty()) &&
+       (limit_str.find_first_not_of("0123456789") != std::string::npos)))
+  {
+    TRC_DEBUG("Invalid offset (%s) or limit (%s)",
+              offset_str.c_str(),
+              limit_str.c_str());
+    return false;
+  }
+
+  if (!offset_str.empty())
+  {
+    offset = strtoul(offset_str.c_str(), NULL, 10);
+  }
+
+  if (!limit_str.empty())
+  {
+    limit = strtoul(limit_str.c_str(), NULL, 10);
+  }
+
+  return true;
+}
+
+// Write a page of the entries in a map of bindings or subscriptions to JSON.
+// The map is ordered by ID, so the pages are stable while the AoR is
+// unchanged.  If there's a limit and there are more entries after this page,
+// the offset of the next page is written too.
+template <class M>
+static void write_page(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                       const char* name,
+                       const M& entries,
+                       size_t offset,
+                       size_t limit)
+{
+  typename M::const_iterator entry = entries.begin();
+  std::advance(entry, std::min(offset, entries.size()));
+  size_t written = 0;
+
+  writer.String(name);
+  writer.StartObject();
+  {
+    for (;
+         (entry != entries.end()) && ((limit == 0) || (written < limit));
+         ++entry, ++written)
+    {
+      writer.String(entry->first.c_str());
+      entry->second->to_json(writer);
+    }
+  }
+  writer.EndObject();
+
+  if ((limit > 0) && (entry != entries.end()))
+  {
+    writer.String("next_offset");
+    writer.Uint64(offset + written);
+  }
+}
+
 // Get cached bindings.
 void GetBindingsTask::run()
 {
@@ -360,9 +498,18 @@ void GetBindingsTask::run()
 
   std::string impu = extract_impu(_req);
 
+  size_t offset;
+  size_t limit;
+  if (!parse_page_params(_req, offset, limit))
+  {
+    send_http_reply(HTTP_BAD_REQUEST);
+    delete this;
+    return;
+  }
+
   Bindings bindings;
   HTTPCode rc = _cfg->_sm->get_bindings(impu, bindings, trail());
-  std::string content = serialize_data(bindings);
+  std::string content = serialize_data(bindings, offset, limit);
   _req.add_content(content);
 
   send_http_reply(rc);
@@ -377,27 +524,20 @@ void GetBindingsTask::run()
 }
 
 std::string GetBindingsTask::serialize_data(
-                                const Bindings& bindings)
+                                const Bindings& bindings,
+                                size_t offset,
+                                size_t limit)
 {
   rapidjson::StringBuffer sb;
   rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
 
   writer.StartObject();
   {
-    writer.String(JSON_BINDINGS);
-    writer.StartObject();
-    {
-      for (BindingPair b : bindings)
-      {
-        writer.String(b.first.c_str());
-        b.second->to_json(writer);
-      }
-    }
-    writer.EndObject();
+    write_page(writer, JSON_BINDINGS, bindings, offset, limit);
   }
   writer.EndObject();
 
-  return sb.GetString();
+  return std::string(sb.GetString(), sb.GetSize());
 }
 
 // Get cached subscriptions.
@@ -416,9 +556,18 @@ void GetSubscriptionsTask::run()
 
   std::string impu = extract_impu(_req);
 
+  size_t offset;
+  size_t limit;
+  if (!parse_page_params(_req, offset, limit))
+  {
+    send_http_reply(HTTP_BAD_REQUEST);
+    delete this;
+    return;
+  }
+
   Subscriptions subscriptions;
   HTTPCode rc = _cfg->_sm->get_subscriptions(impu, subscriptions, trail());
-  std::string content = serialize_data(subscriptions);
+  std::string content = serialize_data(subscriptions, offset, limit);
   _req.add_content(content);
 
   send_http_reply(rc);
@@ -433,20 +582,401 @@ void GetSubscriptionsTask::run()
 }
 
 std::string GetSubscriptionsTask::serialize_data(
-                      const Subscriptions& subscriptions)
+                      const Subscriptions& subscriptions,
+                      size_t offset,
+                      size_t limit)
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    write_page(writer, JSON_SUBSCRIPTIONS, subscriptions, offset, limit);
+  }
+  writer.EndObject();
+
+  return std::string(sb.GetString(), sb.GetSize());
+}
+
+void GetStageLatenciesTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(serialize_data());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+std::string GetStageLatenciesTask::serialize_data()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("stages");
+    writer.StartObject();
+    {
+      for (const StageLatency::StageSummary& stage : StageLatency::summaries())
+      {
+        writer.String(stage.name.c_str());
+        writer.StartObject();
+        {
+          writer.String("count"); writer.Uint64(stage.summary.count);
+          writer.String("mean_us"); writer.Uint64(stage.summary.mean_us);
+          writer.String("p50_us"); writer.Uint64(stage.summary.p50_us);
+          writer.String("p90_us"); writer.Uint64(stage.summary.p90_us);
+          writer.String("p99_us"); writer.Uint64(stage.summary.p99_us);
+          writer.String("p999_us"); writer.Uint64(stage.summary.p999_us);
+          writer.String("max_us"); writer.Uint64(stage.summary.max_us);
+        }
+        writer.EndObject();
+      }
+    }
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void GetSproutletCpuTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(serialize_data());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+std::string GetSproutletCpuTask::serialize_data()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("sproutlets");
+    writer.StartObject();
+    {
+      for (const SproutletCpu::AccountSummary& account : SproutletCpu::summaries())
+      {
+        writer.String(account.name.c_str());
+        writer.StartObject();
+        {
+          writer.String("snmp_index"); writer.Int(account.index);
+          writer.String("callbacks"); writer.Uint64(account.summary.callbacks);
+          writer.String("total_us"); writer.Uint64(account.summary.total_us);
+          writer.String("mean_us");
+          writer.Uint64((account.summary.callbacks > 0) ?
+                          account.summary.total_us / account.summary.callbacks :
+                          0);
+          writer.String("max_us"); writer.Uint64(account.summary.max_us);
+          writer.String("busy_workers"); writer.Int(account.summary.busy_workers);
+          writer.String("max_busy_workers"); writer.Int(account.summary.max_busy_workers);
+          writer.String("max_workers"); writer.Int(account.summary.max_workers);
+          writer.String("bulkhead_rejected"); writer.Uint64(account.summary.rejected);
+        }
+        writer.EndObject();
+      }
+    }
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void GetLockStatsTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(serialize_data());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+static void write_lock_histogram(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                                 const StageHistogram::Summary& summary)
+{
+  // The lock histograms record nanoseconds.
+  writer.StartObject();
+  {
+    writer.String("count"); writer.Uint64(summary.count);
+    writer.String("mean_ns"); writer.Uint64(summary.mean_us);
+    writer.String("p50_ns"); writer.Uint64(summary.p50_us);
+    writer.String("p90_ns"); writer.Uint64(summary.p90_us);
+    writer.String("p99_ns"); writer.Uint64(summary.p99_us);
+    writer.String("p999_ns"); writer.Uint64(summary.p999_us);
+    writer.String("max_ns"); writer.Uint64(summary.max_us);
+  }
+  writer.EndObject();
+}
+
+std::string GetLockStatsTask::serialize_data()
 {
   rapidjson::StringBuffer sb;
   rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
 
   writer.StartObject();
   {
-    writer.String(JSON_SUBSCRIPTIONS);
+    writer.String("locks");
     writer.StartObject();
     {
-      for (SubscriptionPair s : subscriptions)
+      for (const LockInstrumentation::LockSummary& lock : LockInstrumentation::summaries())
       {
-        writer.String(s.first.c_str());
-        s.second->to_json(writer);
+        writer.String(lock.name.c_str());
+        writer.StartObject();
+        {
+          writer.String("acquisitions"); writer.Uint64(lock.acquisitions);
+          writer.String("contended"); writer.Uint64(lock.contended);
+          writer.String("wait"); write_lock_histogram(writer, lock.wait_ns);
+          writer.String("hold"); write_lock_histogram(writer, lock.hold_ns);
+        }
+        writer.EndObject();
+      }
+    }
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void GetSendQueuesTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(serialize_data());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+std::string GetSendQueuesTask::serialize_data()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("connections");
+    writer.StartArray();
+    {
+      if (_cfg->_monitor != NULL)
+      {
+        for (const SendQueueMonitor::QueueSummary& queue :
+                                                     _cfg->_monitor->queues())
+        {
+          writer.StartObject();
+          {
+            writer.String("remote"); writer.String(queue.remote.c_str());
+            writer.String("messages"); writer.Uint64(queue.messages);
+            writer.String("bytes"); writer.Uint64(queue.bytes);
+          }
+          writer.EndObject();
+        }
+      }
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void GetProfileTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  int seconds = DEFAULT_SECONDS;
+  std::string seconds_str = _req.param("seconds");
+
+  if (!seconds_str.empty())
+  {
+    char* end;
+    long value = strtol(seconds_str.c_str(), &end, 10);
+
+    if ((*end != '\0') || (value < 1) || (value > MAX_SECONDS))
+    {
+      TRC_DEBUG("Invalid profile duration %s", seconds_str.c_str());
+      send_http_reply(HTTP_BAD_REQUEST);
+      delete this;
+      return;
+    }
+
+    seconds = value;
+  }
+
+  std::string format = _req.param("format");
+
+  if ((!format.empty()) && (format != "folded"))
+  {
+    TRC_DEBUG("Invalid profile format %s", format.c_str());
+    send_http_reply(HTTP_BAD_REQUEST);
+    delete this;
+    return;
+  }
+
+  bool folded = (format == "folded");
+  std::string profile;
+  bool taken = (_cfg->_type == CPU) ?
+                 Profiler::profile_cpu(seconds, CPU_FREQUENCY_HZ, folded, profile) :
+                 Profiler::profile_allocs(seconds, folded, profile);
+
+  if (!taken)
+  {
+    // Another profile of the same type is already being taken.
+    send_http_reply(HTTP_SERVER_UNAVAILABLE);
+    delete this;
+    return;
+  }
+
+  _req.add_header("Content-Type",
+                  folded ? "text/plain" : "application/octet-stream");
+  _req.add_content(profile);
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+void GetMetricsTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_header("Content-Type", Metrics::CONTENT_TYPE);
+  _req.add_content(Metrics::render());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+void GetMemoryTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(serialize_data());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+std::string GetMemoryTask::serialize_data()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("accounts");
+    writer.StartObject();
+    {
+      for (const MemoryAccounting::Usage& usage : MemoryAccounting::usage())
+      {
+        writer.String(usage.name.c_str());
+        writer.StartObject();
+        {
+          writer.String("bytes"); writer.Int64(usage.bytes);
+          writer.String("high_water_bytes"); writer.Int64(usage.high_water);
+        }
+        writer.EndObject();
+      }
+    }
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void GetASConnectionsTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  _req.add_content(serialize_data());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+  return;
+}
+
+std::string GetASConnectionsTask::serialize_data()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("targets");
+    writer.StartObject();
+    {
+      for (const ASConnectionPools::Stats& stats : ASConnectionPools::stats())
+      {
+        writer.String(stats.target.c_str());
+        writer.StartObject();
+        {
+          writer.String("connections"); writer.Int(stats.connections);
+          writer.String("in_flight"); writer.Int(stats.in_flight);
+        }
+        writer.EndObject();
       }
     }
     writer.EndObject();
@@ -549,7 +1079,9 @@ HTTPCode PushProfileTask::get_associated_uris(std::string body,
   _default_public_id = full_path.substr(prefix.length(), end_of_impu - prefix.length());
   TRC_DEBUG("Extracted impu %s", _default_public_id.c_str());
 
-  rapidxml::xml_document<>* root = new rapidxml::xml_document<>;
+  // Keep the parsed profile, as the iFCs of any IMPUs that have changed are
+  // parsed from it.
+  std::shared_ptr<rapidxml::xml_document<>> root(new rapidxml::xml_document<>);
 
   try
   {
@@ -559,23 +1091,23 @@ HTTPCode PushProfileTask::get_associated_uris(std::string body,
   {
     // report to the user the failure and their locations in the document.
     TRC_WARNING("Failed to parse XML:\n %s\n %s", body.c_str(), err.what());
-    delete root; root = NULL;
     return HTTP_BAD_REQUEST;
   }
 
-  // Decode service profile from the XML. Create and populate an instance of the
-  // Associated URIs class
+  // Decode service profile from the XML. Populate the Associated URIs, and
+  // the digests that the profile is compared with the cached one by.
   rapidxml::xml_node<>* imss = root->first_node(RegDataXMLUtils::IMS_SUBSCRIPTION);
-  bool rc = SproutXmlUtils::get_uris_from_ims_subscription(imss,
-                                                           _associated_uris,
-                                                           trail);
-  delete root; root = NULL;
+  bool rc = ((SproutXmlUtils::get_uris_from_ims_subscription(imss,
+                                                             _profile.associated_uris,
+                                                             trail)) &&
+             (ProfileDiff::digest(imss, _profile.digests)));
+  _profile.doc = root;
   return rc ? HTTP_OK : HTTP_BAD_REQUEST;
 }
 
 HTTPCode PushProfileTask::update_associated_uris(SAS::TrailId trail)
 {
-  return _cfg->_sm->update_associated_uris(_default_public_id,
-                                           _associated_uris,
+  return _cfg->_sm->update_service_profile(_default_public_id,
+                                           _profile,
                                            trail);
 }
@@ -0,0 +1,158 @@
+/**
+ * @file header_index.cpp Implementation of HeaderIndex
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "constants.h"
+#include "custom_headers.h"
+#include "header_index.h"
+#include "pj_str_index.h"
+#include "pjutils.h"
+
+// The names of the indexed headers.  This covers the headers registered in
+// custom_headers.cpp, and the other headers the ACRs are built from.
+static const pj_str_t* const INDEXED_NAMES[] =
+{
+  &STR_PRIVACY,
+  &STR_P_ASSOCIATED_URI,
+  &STR_P_ASSERTED_IDENTITY,
+  &STR_P_PREFERRED_IDENTITY,
+  &STR_P_C_V,
+  &STR_P_C_F_A,
+  &STR_P_SERVED_USER,
+  &STR_P_PROFILE_KEY,
+  &STR_SERVICE_ROUTE,
+  &STR_PATH,
+  &STR_SESSION_EXPIRES,
+  &STR_MIN_SE,
+  &STR_REJECT_CONTACT,
+  &STR_ACCEPT_CONTACT,
+  &STR_RESOURCE_PRIORITY,
+  &STR_P_A_N_I,
+  &STR_P_V_N_I,
+  &STR_REASON,
+  &STR_EVENT,
+  &STR_CONTENT_DISPOSITION,
+};
+
+static const int NUM_INDEXED = sizeof(INDEXED_NAMES) / sizeof(INDEXED_NAMES[0]);
+static_assert(NUM_INDEXED <= HeaderIndex::MAX_INDEXED,
+              "Too many indexed header names");
+
+// Maps the (case-insensitive) header names onto slots.
+static const PjStrIndex<int>& name_index()
+{
+  static const PjStrIndex<int>* index = []()
+  {
+    PjStrIndex<int>* index = new PjStrIndex<int>(true, -1);
+    for (int ii = 0; ii < NUM_INDEXED; ++ii)
+    {
+      index->insert(PJUtils::pj_str_to_string(INDEXED_NAMES[ii]), ii);
+    }
+    return index;
+  }();
+
+  return *index;
+}
+
+HeaderIndex::HeaderIndex(pjsip_msg* msg) :
+  _msg(msg)
+{
+  for (int ii = 0; ii < MAX_INDEXED; ++ii)
+  {
+    _first[ii] = NULL;
+  }
+
+  // Headers are matched on name alone (not type), as
+  // pjsip_msg_find_hdr_by_name does.
+  for (pjsip_hdr* hdr = msg->hdr.next; hdr != &msg->hdr; hdr = hdr->next)
+  {
+    int index = slot(&hdr->name);
+    if ((index >= 0) && (_first[index] == NULL))
+    {
+      _first[index] = hdr;
+    }
+  }
+}
+
+pjsip_hdr* HeaderIndex::find(const pj_str_t* name) const
+{
+  int index = slot(name);
+
+  if (index < 0)
+  {
+    return (pjsip_hdr*)PJUtils::find_hdr_by_name(_msg, name, NULL);
+  }
+
+  pjsip_hdr* hdr = _first[index];
+
+  if ((hdr != NULL) && (is_lazy_hdr(hdr)))
+  {
+    // Parsing the header replaces it in the message (or skips it if it's
+    // invalid), so the index has to be updated.
+    pjsip_hdr* next = hdr->next;
+    hdr = parse_lazy_hdr(hdr);
+    if (hdr == NULL)
+    {
+      hdr = (pjsip_hdr*)PJUtils::find_hdr_by_name(_msg, name, next);
+    }
+    _first[index] = hdr;
+  }
+
+  return hdr;
+}
+
+pjsip_hdr* HeaderIndex::find_next(const pj_str_t* name,
+                                  const pjsip_hdr* hdr) const
+{
+  return (pjsip_hdr*)PJUtils::find_hdr_by_name(_msg, name, hdr->next);
+}
+
+void HeaderIndex::insert_first(pjsip_hdr* hdr)
+{
+  pjsip_msg_insert_first_hdr(_msg, hdr);
+
+  int index = slot(&hdr->name);
+  if (index >= 0)
+  {
+    _first[index] = hdr;
+  }
+}
+
+void HeaderIndex::add(pjsip_hdr* hdr)
+{
+  pjsip_msg_add_hdr(_msg, hdr);
+
+  int index = slot(&hdr->name);
+  if ((index >= 0) && (_first[index] == NULL))
+  {
+    _first[index] = hdr;
+  }
+}
+
+void HeaderIndex::remove(pjsip_hdr* hdr)
+{
+  int index = slot(&hdr->name);
+  if ((index >= 0) && (_first[index] == hdr))
+  {
+    _first[index] = find_next(&hdr->name, hdr);
+  }
+
+  pj_list_erase(hdr);
+}
+
+bool HeaderIndex::is_indexed(const pj_str_t* name)
+{
+  return (slot(name) >= 0);
+}
+
+int HeaderIndex::slot(const pj_str_t* name)
+{
+  return name_index().find(name);
+}
@@ -13,6 +13,7 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <future>
 
 #include "utils.h"
 #include "wildcard_utils.h"
@@ -26,6 +27,13 @@
 #include "snmp_continuous_accumulator_table.h"
 #include "xml_utils.h"
 #include "sprout_xml_utils.h"
+#include "threadpool.h"
+#include "exception_handler.h"
+#include "stage_latency.h"
+#include "stack.h"
+#include "dependency_monitor.h"
+#include "request_deadline.h"
+#include "memory_accounting.h"
 
 const std::string HSSConnection::REG = "reg";
 const std::string HSSConnection::CALL = "call";
@@ -35,6 +43,43 @@ const std::string HSSConnection::DEREG_TIMEOUT = "dereg-timeout";
 const std::string HSSConnection::AUTH_TIMEOUT = "dereg-auth-timeout";
 const std::string HSSConnection::AUTH_FAIL = "dereg-auth-failed";
 
+/// A request to run on the asynchronous request threads.
+struct AsyncRequest
+{
+  std::function<void()> run;
+  std::function<void()> fail;
+};
+
+/// The pool of threads used to make asynchronous requests.
+class HSSConnection::AsyncPool : public ThreadPool<AsyncRequest*>
+{
+public:
+  AsyncPool(ExceptionHandler* exception_handler, unsigned int num_threads) :
+    ThreadPool<AsyncRequest*>(num_threads,
+                              exception_handler,
+                              &exception_callback,
+                              0)
+  {
+  }
+
+  virtual ~AsyncPool() {}
+
+  static void exception_callback(AsyncRequest* request)
+  {
+    // Make sure the caller hears about the failure rather than waiting for
+    // ever.
+    request->fail();
+    delete request;
+  }
+
+private:
+  virtual void process_work(AsyncRequest*& request)
+  {
+    request->run();
+    delete request; request = NULL;
+  }
+};
+
 HSSConnection::HSSConnection(const std::string& server,
                              HttpResolver* resolver,
                              LoadMonitor *load_monitor,
@@ -46,7 +91,20 @@ HSSConnection::HSSConnection(const std::string& server,
                              SNMP::EventAccumulatorTable* homestead_lir_latency_tbl,
                              CommunicationMonitor* comm_monitor,
                              SIFCService* sifc_service,
-                             long homestead_timeout_ms) :
+                             long homestead_timeout_ms,
+                             int irs_cache_ttl,
+                             size_t irs_cache_size,
+                             const ShardedLRUCacheStatsTables& irs_cache_stats_tbls,
+                             SNMP::CounterTable* coalesced_tbl,
+                             ExceptionHandler* exception_handler,
+                             int async_threads,
+                             int http2_connections,
+                             SNMP::IPCountTable* http2_stream_count_tbl,
+                             SNMP::EventAccumulatorTable* http2_rtt_tbl,
+                             int hedge_percentile,
+                             int hedge_budget_percent,
+                             SNMP::CounterTable* hedged_tbl,
+                             bool compression) :
   _client(new HttpClient(false,
                          resolver,
                          homestead_count_tbl,
@@ -59,20 +117,96 @@ HSSConnection::HSSConnection(const std::string& server,
   _http(new HttpConnection(server,
                            _client,
                            "http")),
+  _http2(NULL),
+  _hedger(NULL),
   _latency_tbl(homestead_overall_latency_tbl),
   _mar_latency_tbl(homestead_mar_latency_tbl),
   _sar_latency_tbl(homestead_sar_latency_tbl),
   _uar_latency_tbl(homestead_uar_latency_tbl),
   _lir_latency_tbl(homestead_lir_latency_tbl),
-  _sifc_service(sifc_service)
+  _latency_stage(StageLatency::stage("homestead")),
+  _latency_metric(Metrics::histogram("sprout_homestead_request_latency_seconds",
+                                     "Latency of requests to Homestead")),
+  _sifc_service(sifc_service),
+  _compression_stats(compression ? new HttpContentDecoder::Stats("homestead") : NULL),
+  _irs_cache_ttl(irs_cache_ttl),
+  _irs_cache(NULL),
+  _in_flight(),
+  _coalesced_tbl(coalesced_tbl),
+  _async_pool(NULL)
 {
+  pthread_mutex_init(&_in_flight_lock, NULL);
+
+  if (http2_connections > 0)
+  {
+    if ((hedge_percentile > 0) && (http2_connections > 1))
+    {
+      TRC_STATUS("Hedging Homestead requests after the %d percentile latency, up to %d%% of requests",
+                 hedge_percentile, hedge_budget_percent);
+      _hedger = new RequestHedger(hedge_percentile,
+                                  hedge_budget_percent,
+                                  RequestHedger::DEFAULT_MIN_DELAY_MS,
+                                  hedged_tbl);
+    }
+    else if (hedge_percentile > 0)
+    {
+      TRC_WARNING("Homestead requests can only be hedged with at least 2 HTTP/2 connections");
+    }
+
+    _http2 = new MultiplexedHttpClient(server,
+                                       "http",
+                                       http2_connections,
+                                       homestead_timeout_ms,
+                                       load_monitor,
+                                       comm_monitor,
+                                       http2_stream_count_tbl,
+                                       http2_rtt_tbl,
+                                       _hedger,
+                                       _compression_stats);
+  }
+
+  if (async_threads > 0)
+  {
+    _async_pool = new AsyncPool(exception_handler, async_threads);
+    _async_pool->start();
+  }
+
+  if ((irs_cache_ttl > 0) && (irs_cache_size > 0))
+  {
+    _irs_cache =
+      new ShardedLRUCache<std::string, std::shared_ptr<const irs_info>>(
+                                                        irs_cache_size,
+                                                        NUM_CACHE_SHARDS,
+                                                        irs_cache_stats_tbls);
+    MemoryAccounting::account("hss_cache")->set_sampler([this]()
+    {
+      return _irs_cache->memory(sizeof(irs_info));
+    });
+  }
 }
 
 
 HSSConnection::~HSSConnection()
 {
+  // Stop the request threads first, as they may be using everything else.
+  if (_async_pool != NULL)
+  {
+    _async_pool->stop();
+    _async_pool->join();
+    delete _async_pool; _async_pool = NULL;
+  }
+
+  if (_irs_cache != NULL)
+  {
+    MemoryAccounting::account("hss_cache")->set_sampler(nullptr);
+  }
+  delete _irs_cache; _irs_cache = NULL;
+  pthread_mutex_destroy(&_in_flight_lock);
+  delete _http2; _http2 = NULL;
+  delete _hedger; _hedger = NULL;
   delete _http; _http = NULL;
   delete _client; _client = NULL;
+  delete _compression_stats; _compression_stats = NULL;
 }
 
 /// Get an Authentication Vector as JSON object. Caller is responsible for deleting.
@@ -129,6 +263,8 @@ HTTPCode HSSConnection::get_auth_vector(const std::string& private_user_identity
       (stopWatch.read(latency_us)))
   {
     _latency_tbl->accumulate(latency_us);
+    _latency_stage->record(latency_us);
+    _latency_metric->observe(latency_us);
     _mar_latency_tbl->accumulate(latency_us);
   }
 
@@ -147,15 +283,16 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
                                         rapidjson::Document*& json_object,
                                         SAS::TrailId trail)
 {
-  HttpResponse response = _http->create_request(HttpClient::RequestType::GET, path)
-                          .set_sas_trail(trail)
-                          .send();
-
-  HTTPCode rc = response.get_rc();
+  std::string json_data;
+  HTTPCode rc = send_request(HttpClient::RequestType::GET,
+                             path,
+                             "",
+                             {},
+                             json_data,
+                             trail);
 
   if (rc == HTTP_OK)
   {
-    std::string json_data = response.get_body();
     json_object = new rapidjson::Document;
     json_object->Parse<0>(json_data.c_str());
 
@@ -177,75 +314,173 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
   return rc;
 }
 
-rapidxml::xml_document<>* HSSConnection::parse_xml(std::string raw_data, const std::string& url = "")
+/// The buffer holding a Homestead response, and the XML document parsed (in
+/// place) from it.  The document's strings point into the buffer, so the two
+/// are allocated and freed together.
+struct XmlResponse
 {
-  rapidxml::xml_document<>* root = new rapidxml::xml_document<>;
+  std::string buffer;
+  rapidxml::xml_document<> doc;
+};
+
+std::shared_ptr<rapidxml::xml_document<>> HSSConnection::parse_xml(std::string&& raw_data,
+                                                                   const std::string& url)
+{
+  std::shared_ptr<XmlResponse> response = std::make_shared<XmlResponse>();
+  response->buffer = std::move(raw_data);
+
   try
   {
-    root->parse<0>(root->allocate_string(raw_data.c_str()));
+    response->doc.parse<0>(&response->buffer[0]);
   }
   catch (rapidxml::parse_error& err)
   {
-    // report to the user the failure and their locations in the document.
-    TRC_DEBUG("Failed to parse Homestead response:\n %s\n %s\n %s", url.c_str(), raw_data.c_str(), err.what());
-    delete root;
-    root = NULL;
+    // report to the user the failure and its location in the document.  The
+    // buffer has been partly modified by the parse, so can't be logged.
+    TRC_DEBUG("Failed to parse Homestead response:\n %s\n %s at offset %d",
+              url.c_str(),
+              err.what(),
+              (int)(err.where<char>() - &response->buffer[0]));
+    return std::shared_ptr<rapidxml::xml_document<>>();
   }
-  return root;
+
+  // Share ownership of the whole response, but point at the document.
+  return std::shared_ptr<rapidxml::xml_document<>>(response, &response->doc);
 }
 
 
-/// Make a PUT to the server and store off the XML response. Caller is
-/// responsible for deleting the filled-in "root" pointer.
+/// Make a PUT to the server and store off the XML response.
 HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
                                            std::string body,
                                            const bool& cache_allowed,
-                                           rapidxml::xml_document<>*& root,
+                                           std::shared_ptr<rapidxml::xml_document<>>& root,
                                            SAS::TrailId trail)
 {
-  HttpRequest req = _http->create_request(HttpClient::RequestType::PUT, path);
-  req.set_body(body)
-     .set_sas_trail(trail);
+  std::vector<std::string> headers;
 
   if (!cache_allowed)
   {
-    req.add_header("Cache-control: no-cache");
+    headers.push_back("Cache-control: no-cache");
   }
 
-  HttpResponse response = req.send();
-  HTTPCode http_code = response.get_rc();
+  std::string raw_data;
+  HTTPCode http_code = send_request(HttpClient::RequestType::PUT,
+                                    path,
+                                    body,
+                                    headers,
+                                    raw_data,
+                                    trail);
 
   if (http_code == HTTP_OK)
   {
-    std::string raw_data = response.get_body();
-    root = parse_xml(raw_data, path);
+    root = parse_xml(std::move(raw_data), path);
   }
 
   return http_code;
 }
 
 
-/// Retrieve an XML object from a path on the server. Caller is responsible for deleting.
+/// Retrieve an XML object from a path on the server.
 HTTPCode HSSConnection::get_xml_object(const std::string& path,
-                                       rapidxml::xml_document<>*& root,
+                                       std::shared_ptr<rapidxml::xml_document<>>& root,
                                        SAS::TrailId trail)
 {
-  HttpResponse response =_http->create_request(HttpClient::RequestType::GET, path)
-                         .set_sas_trail(trail)
-                         .send();
-
-  HTTPCode http_code = response.get_rc();
+  std::string raw_data;
+  HTTPCode http_code = send_request(HttpClient::RequestType::GET,
+                                    path,
+                                    "",
+                                    {},
+                                    raw_data,
+                                    trail);
 
   if (http_code == HTTP_OK)
   {
-    std::string raw_data = response.get_body();
-    root = parse_xml(raw_data, path);
+    root = parse_xml(std::move(raw_data), path);
   }
 
   return http_code;
 }
 
 
+HTTPCode HSSConnection::send_request(HttpClient::RequestType type,
+                                     const std::string& path,
+                                     const std::string& body,
+                                     const std::vector<std::string>& headers,
+                                     std::string& response_body,
+                                     SAS::TrailId trail)
+{
+  if (RequestDeadline::expired())
+  {
+    // The SIP message we're processing has used up its time, so don't make
+    // it (or the other messages queued behind it) wait for Homestead too.
+    TRC_INFO("Not sending request for %s to Homestead as the request's deadline has passed",
+             path.c_str());
+    return HTTP_GATEWAY_TIMEOUT;
+  }
+
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
+  HTTPCode rc;
+
+  if (_http2 != NULL)
+  {
+    rc = _http2->send_request((type == HttpClient::RequestType::PUT) ? "PUT" : "GET",
+                              path,
+                              body,
+                              headers,
+                              response_body,
+                              trail);
+  }
+  else
+  {
+    HttpRequest req = _http->create_request(type, path);
+    req.set_sas_trail(trail);
+
+    if (type == HttpClient::RequestType::PUT)
+    {
+      req.set_body(body);
+    }
+
+    for (const std::string& header : headers)
+    {
+      req.add_header(header);
+    }
+
+    if (_compression_stats != NULL)
+    {
+      req.add_header(HttpContentDecoder::ACCEPT_ENCODING);
+    }
+
+    HttpResponse response = req.send();
+    response_body = response.get_body();
+    rc = response.get_rc();
+
+    // HttpClient doesn't give us the body as it arrives, so it's decoded
+    // all at once.
+    if (!HttpContentDecoder::decode(
+                   HttpContentDecoder::content_encoding(response.get_headers()),
+                   response_body,
+                   _compression_stats))
+    {
+      TRC_WARNING("Failed to decode Homestead response for %s", path.c_str());
+      response_body.clear();
+      rc = HTTP_SERVER_UNAVAILABLE;
+    }
+  }
+
+  // Report the latency for overload control, including timeouts and
+  // failures, which are what overload looks like.
+  unsigned long latency_us = 0;
+  if ((stack_data.dependency_monitor != NULL) && (stopWatch.read(latency_us)))
+  {
+    stack_data.dependency_monitor->request_complete(DependencyMonitor::HSS,
+                                                    latency_us);
+  }
+
+  return rc;
+}
+
+
 bool compare_charging_addrs(const rapidxml::xml_node<>* ca1,
                             const rapidxml::xml_node<>* ca2)
 {
@@ -452,8 +687,6 @@ HTTPCode HSSConnection::put_homestead_xml(const irs_query& irs_query,
 
   TRC_DEBUG("Making Homestead request for %s", path.c_str());
 
-  rapidxml::xml_document<>* root_underlying_ptr = NULL;
-
   std::string json_wildcard = (irs_query._wildcard != "") ?
     ", \"wildcard_identity\": \"" +
     irs_query._wildcard +
@@ -474,12 +707,10 @@ HTTPCode HSSConnection::put_homestead_xml(const irs_query& irs_query,
   HTTPCode http_code = put_for_xml_object(path,
                                           req_body,
                                           irs_query._cache_allowed,
-                                          root_underlying_ptr,
+                                          root,
                                           trail);
   unsigned long latency_us = 0;
 
-  root.reset(root_underlying_ptr);
-
   // Only accumulate the latency if we haven't already applied a
   // penalty
   if ((http_code != HTTP_SERVER_UNAVAILABLE) &&
@@ -487,6 +718,8 @@ HTTPCode HSSConnection::put_homestead_xml(const irs_query& irs_query,
       (stopWatch.read(latency_us)))
   {
     _latency_tbl->accumulate(latency_us);
+    _latency_stage->record(latency_us);
+    _latency_metric->observe(latency_us);
     _sar_latency_tbl->accumulate(latency_us);
   }
 
@@ -503,47 +736,428 @@ HTTPCode HSSConnection::update_registration_state(const irs_query& irs_query,
                                                   irs_info& irs_info,
                                                   SAS::TrailId trail)
 {
-  // Needs to be a shared pointer - multiple Ifcs objects will need a reference
-  // to it, so we want to delete the underlying pointer when they all go out
-  // of scope.
-  std::shared_ptr<rapidxml::xml_document<>> root;
+  // A call doesn't change the state of a subscriber who is already
+  // registered or unregistered, so if we have their data cached we don't
+  // need to go to Homestead.  Requests that mustn't use Homestead's cache
+  // mustn't use ours either.
+  if ((irs_query._req_type == CALL) &&
+      (irs_query._cache_allowed) &&
+      (find_in_cache(irs_query._public_id, irs_info, trail)))
+  {
+    return HTTP_OK;
+  }
 
-  HTTPCode http_code = put_homestead_xml(irs_query, root, trail);
-  if (http_code == HTTP_OK)
+  auto fetch = [this, &irs_query, trail](struct irs_info& irs_info)
   {
-    bool ims_subscription_expected = is_ims_subscription_expected(irs_query._req_type);
-    http_code = decode_homestead_xml(irs_query._public_id,
-                                     irs_info,
-                                     root,
-                                     _sifc_service,
-                                     ims_subscription_expected,
-                                     trail) ? HTTP_OK : HTTP_SERVER_ERROR;
+    // Needs to be a shared pointer - multiple Ifcs objects will need a
+    // reference to it, so we want to delete the underlying pointer when they
+    // all go out of scope.
+    std::shared_ptr<rapidxml::xml_document<>> root;
+
+    HTTPCode http_code = put_homestead_xml(irs_query, root, trail);
+    if (http_code == HTTP_OK)
+    {
+      bool ims_subscription_expected = is_ims_subscription_expected(irs_query._req_type);
+      http_code = decode_homestead_xml(irs_query._public_id,
+                                       irs_info,
+                                       root,
+                                       _sifc_service,
+                                       ims_subscription_expected,
+                                       trail) ? HTTP_OK : HTTP_SERVER_ERROR;
+    }
+
+    if (http_code == HTTP_OK)
+    {
+      // The request may have changed the subscriber's state (for example, if
+      // it was a registration or deregistration), so replace anything we
+      // have cached with the new data.
+      invalidate_cached_registration_data(irs_query._public_id);
+      add_to_cache(irs_query._public_id, irs_info);
+    }
+
+    return http_code;
+  };
+
+  // Only calls are coalesced - any other request may change the subscriber's
+  // state, so each must be seen by Homestead.  The key covers every field
+  // that is sent to Homestead, separated by spaces (which none of them can
+  // contain).
+  if (irs_query._req_type != CALL)
+  {
+    return fetch(irs_info);
   }
-  return http_code;
+
+  std::string key = "PUT " + irs_query._public_id +
+                    " " + irs_query._private_id +
+                    " " + irs_query._server_name +
+                    " " + irs_query._wildcard +
+                    (irs_query._cache_allowed ? " cache" : " no-cache");
+  return coalesce(key, irs_info, trail, fetch);
 }
 
 HTTPCode HSSConnection::get_registration_data(const std::string& public_id,
                                               irs_info& irs_info,
                                               SAS::TrailId trail)
 {
-  // Needs to be a shared pointer - multiple Ifcs objects will need a reference
-  // to it, so we want to delete the underlying pointer when they all go out
-  // of scope.
-  std::shared_ptr<rapidxml::xml_document<>> root;
+  if (find_in_cache(public_id, irs_info, trail))
+  {
+    return HTTP_OK;
+  }
 
-  HTTPCode http_code = get_homestead_xml(public_id, root, trail);
-  if (http_code == HTTP_OK)
+  auto fetch = [this, &public_id, trail](struct irs_info& irs_info)
+  {
+    // Needs to be a shared pointer - multiple Ifcs objects will need a
+    // reference to it, so we want to delete the underlying pointer when they
+    // all go out of scope.
+    std::shared_ptr<rapidxml::xml_document<>> root;
+
+    HTTPCode http_code = get_homestead_xml(public_id, root, trail);
+    if (http_code == HTTP_OK)
+    {
+      http_code = decode_homestead_xml(public_id,
+                                       irs_info,
+                                       root,
+                                       _sifc_service,
+                                       false,
+                                       trail) ? HTTP_OK : HTTP_SERVER_ERROR;
+    }
+
+    if (http_code == HTTP_OK)
+    {
+      add_to_cache(public_id, irs_info);
+    }
+
+    return http_code;
+  };
+
+  return coalesce("GET " + public_id, irs_info, trail, fetch);
+}
+
+// Request coalescing.
+//
+// When a request is made that is identical to one already in progress (for
+// example, when many calls arrive for the same subscriber at once), the new
+// request waits for the one in progress to complete and takes a copy of its
+// result, rather than querying Homestead and parsing the response again.
+// Only requests that don't change the subscriber's state are coalesced.
+//
+// The request in progress is made on the thread that started it, so a
+// request never waits for one that it is itself responsible for completing.
+
+HTTPCode HSSConnection::coalesce(const std::string& key,
+                                 irs_info& irs_info,
+                                 SAS::TrailId trail,
+                                 std::function<HTTPCode(struct irs_info&)> fetch)
+{
+  std::promise<IrsResult> promise;
+  std::shared_future<IrsResult> future;
+  bool in_progress;
+
+  pthread_mutex_lock(&_in_flight_lock);
+  std::map<std::string, std::shared_future<IrsResult>>::iterator it =
+                                                         _in_flight.find(key);
+  in_progress = (it != _in_flight.end());
+
+  if (in_progress)
   {
-    http_code = decode_homestead_xml(public_id,
-                                     irs_info,
-                                     root,
-                                     _sifc_service,
-                                     false,
-                                     trail) ? HTTP_OK : HTTP_SERVER_ERROR;
+    future = it->second;
   }
+  else
+  {
+    future = promise.get_future().share();
+    _in_flight[key] = future;
+  }
+  pthread_mutex_unlock(&_in_flight_lock);
+
+  if (in_progress)
+  {
+    TRC_DEBUG("Waiting for Homestead request in progress: %s", key.c_str());
+    SAS::Event event(trail, SASEvent::HSS_REQUEST_COALESCED, 0);
+    event.add_var_param(key);
+    SAS::report_event(event);
+
+    if (_coalesced_tbl != NULL)
+    {
+      _coalesced_tbl->increment();
+    }
+
+    CW_IO_STARTS("Coalesced Homestead request")
+    {
+      future.wait();
+    }
+    CW_IO_COMPLETES()
+
+    const IrsResult& result = future.get();
+    irs_info = result.second;
+    return result.first;
+  }
+
+  HTTPCode http_code = fetch(irs_info);
+
+  // Remove the request before completing it, so that any later request goes
+  // to Homestead rather than taking this (possibly stale) result.
+  pthread_mutex_lock(&_in_flight_lock);
+  _in_flight.erase(key);
+  pthread_mutex_unlock(&_in_flight_lock);
+
+  promise.set_value(IrsResult(http_code, irs_info));
+
   return http_code;
 }
 
+// Registration data cache.
+//
+// Successful responses from Homestead for subscribers who are registered or
+// unregistered are cached for a short, configured time, under the queried
+// IMPU and every other IMPU in the implicit registration set (as the data
+// is the same for all of them).  Cached data is used for GETs and for PUTs
+// for calls, which are the requests on the path of most INVITEs.  Any other
+// PUT (a registration or deregistration) always goes to Homestead, and
+// replaces the cached data for the whole implicit registration set.
+//
+// The cache is local to this process, so changes made through other Sprout
+// nodes are only picked up once the TTL expires.  The cached Ifcs share the
+// (read-only) XML document that they were parsed from.
+
+bool HSSConnection::find_in_cache(const std::string& public_id,
+                                  irs_info& irs_info,
+                                  SAS::TrailId trail)
+{
+  std::shared_ptr<const struct irs_info> cached;
+
+  if ((_irs_cache == NULL) || (!_irs_cache->get(public_id, cached)))
+  {
+    return false;
+  }
+
+  TRC_DEBUG("Found cached registration data for %s", public_id.c_str());
+  SAS::Event event(trail, SASEvent::HSS_CACHE_HIT, 0);
+  event.add_var_param(public_id);
+  event.add_var_param(cached->_regstate);
+  SAS::report_event(event);
+
+  irs_info = *cached;
+  return true;
+}
+
+void HSSConnection::add_to_cache(const std::string& public_id,
+                                 const irs_info& irs_info)
+{
+  if ((_irs_cache == NULL) ||
+      ((irs_info._regstate != RegDataXMLUtils::STATE_REGISTERED) &&
+       (irs_info._regstate != RegDataXMLUtils::STATE_UNREGISTERED)))
+  {
+    return;
+  }
+
+  std::shared_ptr<const struct irs_info> cached =
+                                 std::make_shared<struct irs_info>(irs_info);
+  _irs_cache->put(public_id, cached, _irs_cache_ttl);
+
+  for (const std::string& uri : irs_info._associated_uris.get_all_uris())
+  {
+    if (uri != public_id)
+    {
+      _irs_cache->put(uri, cached, _irs_cache_ttl);
+    }
+  }
+}
+
+void HSSConnection::invalidate_cached_registration_data(const std::string& public_id)
+{
+  std::shared_ptr<const struct irs_info> cached;
+
+  if ((_irs_cache == NULL) || (!_irs_cache->erase(public_id, &cached)))
+  {
+    return;
+  }
+
+  TRC_DEBUG("Invalidating cached registration data for %s", public_id.c_str());
+
+  for (const std::string& uri : cached->_associated_uris.get_all_uris())
+  {
+    _irs_cache->erase(uri);
+  }
+}
+
+// Profiles pushed by the HSS.
+//
+// A push is compared against the cached data for the implicit registration
+// set, identity by identity, using digests of the XML each was parsed from.
+// When only the iFCs of some IMPUs have changed, the cached data is kept,
+// with just those IMPUs' iFCs parsed from the pushed profile.  Any other
+// change (or a subscriber with nothing cached, or whose cached iFCs were
+// matched through a wildcard) invalidates the cached data as before.
+
+void HSSConnection::update_cached_service_profiles(const std::string& public_id,
+                                                   const PushedProfile& profile,
+                                                   SAS::TrailId trail)
+{
+  std::shared_ptr<const struct irs_info> cached;
+
+  if ((_irs_cache == NULL) || (!_irs_cache->get(public_id, cached)))
+  {
+    // There's nothing cached for this implicit registration set, but any of
+    // its new IMPUs may be cached as part of another.
+    for (const std::pair<const std::string, ProfileDigest>& digest : profile.digests)
+    {
+      invalidate_cached_registration_data(digest.first);
+    }
+
+    return;
+  }
+
+  // Find the IMSSubscription that the cached data was parsed from.
+  rapidxml::xml_node<>* old_imss = NULL;
+
+  if ((!cached->_service_profiles.empty()) &&
+      (cached->_service_profiles.begin()->second.doc()))
+  {
+    rapidxml::xml_node<>* cw = cached->_service_profiles.begin()->second.doc()->
+                                 first_node(RegDataXMLUtils::CLEARWATER_REG_DATA);
+    old_imss = (cw != NULL) ? cw->first_node(RegDataXMLUtils::IMS_SUBSCRIPTION) : NULL;
+  }
+
+  ProfileDigests old_digests;
+  bool can_update = ((old_imss != NULL) &&
+                     (ProfileDiff::digest(old_imss, old_digests)));
+  ProfileDiff diff = ProfileDiff::compare(old_digests, profile.digests);
+
+  if ((can_update) && (diff.empty()))
+  {
+    TRC_DEBUG("Pushed profile for %s is unchanged", public_id.c_str());
+    return;
+  }
+
+  can_update = can_update && (!diff.identities_changed());
+
+  for (const std::pair<const std::string, Ifcs>& ifcs : cached->_service_profiles)
+  {
+    // iFCs cached under an identity that isn't in the XML were found through
+    // a wildcard, so can't be updated individually.
+    can_update = can_update && (old_digests.count(ifcs.first) != 0);
+  }
+
+  for (const std::string& impu : diff.services_changed)
+  {
+    can_update = can_update && (cached->_service_profiles.count(impu) != 0);
+  }
+
+  if (!can_update)
+  {
+    TRC_DEBUG("Pushed profile for %s changes its identities", public_id.c_str());
+    invalidate_cached_registration_data(public_id);
+
+    for (const std::string& impu : diff.added)
+    {
+      invalidate_cached_registration_data(impu);
+    }
+
+    return;
+  }
+
+  TRC_DEBUG("Pushed profile for %s changes the iFCs of %d IMPUs",
+            public_id.c_str(),
+            diff.services_changed.size());
+  irs_info updated = *cached;
+
+  for (const std::string& impu : diff.services_changed)
+  {
+    updated._service_profiles[impu] =
+      Ifcs(profile.doc,
+           profile.digests.at(impu).service_profile,
+           _sifc_service,
+           trail);
+  }
+
+  add_to_cache(public_id, updated);
+}
+
+void HSSConnection::run_async(std::function<void()> run,
+                              std::function<void()> fail)
+{
+  if (_async_pool == NULL)
+  {
+    run();
+  }
+  else
+  {
+    // Take the current deadline with the request to the thread that makes it.
+    RequestDeadline::Clock::time_point deadline;
+    bool has_deadline = RequestDeadline::get(deadline);
+    _async_pool->add_work(new AsyncRequest{[run, has_deadline, deadline]()
+                                           {
+                                             RequestDeadline::Scope scope(has_deadline,
+                                                                          deadline);
+                                             run();
+                                           },
+                                           fail});
+  }
+}
+
+void HSSConnection::get_auth_vector_async(const std::string& private_user_id,
+                                          const std::string& public_user_id,
+                                          const std::string& auth_type,
+                                          const std::string& resync_auth,
+                                          const std::string& server_name,
+                                          AuthVectorCallback callback,
+                                          SAS::TrailId trail)
+{
+  run_async([=]()
+            {
+              rapidjson::Document* object = NULL;
+              HTTPCode rc = get_auth_vector(private_user_id,
+                                            public_user_id,
+                                            auth_type,
+                                            resync_auth,
+                                            server_name,
+                                            object,
+                                            trail);
+              callback(rc, object);
+            },
+            [callback]()
+            {
+              callback(HTTP_SERVER_ERROR, NULL);
+            });
+}
+
+void HSSConnection::update_registration_state_async(const irs_query& irs_query,
+                                                    IrsCallback callback,
+                                                    SAS::TrailId trail)
+{
+  // Take a copy of the query, as the caller's may not outlive the request.
+  struct irs_query query = irs_query;
+
+  run_async([this, query, callback, trail]()
+            {
+              struct irs_info irs_info;
+              HTTPCode rc = update_registration_state(query, irs_info, trail);
+              callback(rc, irs_info);
+            },
+            [callback]()
+            {
+              struct irs_info irs_info;
+              callback(HTTP_SERVER_ERROR, irs_info);
+            });
+}
+
+void HSSConnection::get_registration_data_async(const std::string& public_id,
+                                                IrsCallback callback,
+                                                SAS::TrailId trail)
+{
+  run_async([this, public_id, callback, trail]()
+            {
+              struct irs_info irs_info;
+              HTTPCode rc = get_registration_data(public_id, irs_info, trail);
+              callback(rc, irs_info);
+            },
+            [callback]()
+            {
+              struct irs_info irs_info;
+              callback(HTTP_SERVER_ERROR, irs_info);
+            });
+}
+
 HTTPCode HSSConnection::get_homestead_xml(const std::string& public_id,
                                           std::shared_ptr<rapidxml::xml_document<>>& root,
                                           SAS::TrailId trail)
@@ -558,17 +1172,13 @@ HTTPCode HSSConnection::get_homestead_xml(const std::string& public_id,
 
   TRC_DEBUG("Making Homestead request for %s", path.c_str());
 
-  rapidxml::xml_document<>* root_underlying_ptr = NULL;
-
   Utils::StopWatch stopWatch;
   stopWatch.start();
-  HTTPCode http_code = get_xml_object(path, 
-                                      root_underlying_ptr, 
+  HTTPCode http_code = get_xml_object(path,
+                                      root,
                                       trail);
   unsigned long latency_us = 0;
 
-  root.reset(root_underlying_ptr);
-
   // Only accumulate the latency if we haven't already applied a
   // penalty
   if ((http_code != HTTP_SERVER_UNAVAILABLE) &&
@@ -576,6 +1186,8 @@ HTTPCode HSSConnection::get_homestead_xml(const std::string& public_id,
       (stopWatch.read(latency_us)))
   {
     _latency_tbl->accumulate(latency_us);
+    _latency_stage->record(latency_us);
+    _latency_metric->observe(latency_us);
     _sar_latency_tbl->accumulate(latency_us);
   }
 
@@ -636,6 +1248,8 @@ HTTPCode HSSConnection::get_user_auth_status(const std::string& private_user_ide
       (stopWatch.read(latency_us)))
   {
     _latency_tbl->accumulate(latency_us);
+    _latency_stage->record(latency_us);
+    _latency_metric->observe(latency_us);
     _uar_latency_tbl->accumulate(latency_us);
   }
 
@@ -680,6 +1294,8 @@ HTTPCode HSSConnection::get_location_data(const std::string& public_user_identit
       (stopWatch.read(latency_us)))
   {
     _latency_tbl->accumulate(latency_us);
+    _latency_stage->record(latency_us);
+    _latency_metric->observe(latency_us);
     _lir_latency_tbl->accumulate(latency_us);
   }
 
@@ -0,0 +1,254 @@
+/**
+ * @file http_content_decoder.cpp Decoding of compressed HTTP response bodies.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+
+#include "log.h"
+#include "http_content_decoder.h"
+
+const char* const HttpContentDecoder::ACCEPT_ENCODING = "Accept-Encoding: gzip, deflate";
+
+/// The amount the output buffer is grown by each time it fills.
+static const size_t OUTPUT_CHUNK = 16 * 1024;
+
+/// Decoding a body of tens of KB takes tens to hundreds of microseconds.
+static const std::vector<uint64_t> DECODE_BOUNDS_US = {20, 50, 100, 200, 500, 1000, 5000};
+
+static const char CONTENT_ENCODING[] = "content-encoding:";
+
+HttpContentDecoder::Stats::Stats(const std::string& dependency) :
+  compressed_responses(Metrics::counter("sprout_" + dependency + "_compressed_responses",
+                                        "Compressed responses received from " + dependency)),
+  saved_bytes(Metrics::counter("sprout_" + dependency + "_compression_saved_bytes",
+                               "Bytes saved by compressing responses from " + dependency)),
+  decode_time(Metrics::histogram("sprout_" + dependency + "_decompression_seconds",
+                                 "Time taken to decompress responses from " + dependency,
+                                 DECODE_BOUNDS_US))
+{
+}
+
+HttpContentDecoder::HttpContentDecoder(Stats* stats) :
+  _stats(stats),
+  _compressed(false),
+  _failed(false),
+  _ended(false),
+  _in_bytes(0),
+  _out_bytes(0),
+  _decode_ns(0)
+{
+  memset(&_stream, 0, sizeof(_stream));
+}
+
+HttpContentDecoder::~HttpContentDecoder()
+{
+  if (_compressed)
+  {
+    inflateEnd(&_stream);
+  }
+}
+
+bool HttpContentDecoder::set_encoding(const std::string& content_encoding)
+{
+  std::string encoding = content_encoding;
+  encoding.erase(0, encoding.find_first_not_of(" \t"));
+  encoding.erase(encoding.find_last_not_of(" \t\r\n") + 1);
+  std::transform(encoding.begin(), encoding.end(), encoding.begin(), ::tolower);
+
+  if ((encoding.empty()) || (encoding == "identity"))
+  {
+    return true;
+  }
+
+  if ((encoding != "gzip") && (encoding != "x-gzip") && (encoding != "deflate"))
+  {
+    TRC_DEBUG("Can't decode HTTP body with Content-Encoding %s", encoding.c_str());
+    _failed = true;
+    return false;
+  }
+
+  if (_compressed)
+  {
+    // A second set of headers (after a redirect, say) - start again.
+    inflateReset(&_stream);
+    _ended = false;
+    _in_bytes = 0;
+    _out_bytes = 0;
+    _decode_ns = 0;
+    return true;
+  }
+
+  // Detect a gzip or zlib header.  Some servers send raw deflate data for
+  // "deflate", which isn't what RFC 7230 means by it, and isn't decoded.
+  if (inflateInit2(&_stream, 15 + 32) != Z_OK)
+  {
+    // LCOV_EXCL_START - only fails if out of memory
+    TRC_ERROR("Failed to initialize zlib to decode HTTP body");
+    _failed = true;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _compressed = true;
+  return true;
+}
+
+bool HttpContentDecoder::header(const char* line, size_t length)
+{
+  size_t name_length = sizeof(CONTENT_ENCODING) - 1;
+
+  if ((length <= name_length) ||
+      (strncasecmp(line, CONTENT_ENCODING, name_length) != 0))
+  {
+    return true;
+  }
+
+  return set_encoding(std::string(line + name_length, length - name_length));
+}
+
+bool HttpContentDecoder::write(const char* data, size_t length, std::string& out)
+{
+  if (_failed)
+  {
+    return false;
+  }
+
+  if (!_compressed)
+  {
+    out.append(data, length);
+    return true;
+  }
+
+  if (_ended)
+  {
+    // Anything after the end of the compressed data is ignored.
+    return true;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  _stream.next_in = (Bytef*)data;
+  _stream.avail_in = length;
+  _in_bytes += length;
+
+  // Keep going while there's input left, or the output filled up (in which
+  // case zlib may have more to give).
+  bool more = true;
+
+  while (more)
+  {
+    size_t used = out.size();
+    out.resize(used + OUTPUT_CHUNK);
+    _stream.next_out = (Bytef*)&out[used];
+    _stream.avail_out = OUTPUT_CHUNK;
+
+    int rc = inflate(&_stream, Z_NO_FLUSH);
+    size_t produced = OUTPUT_CHUNK - _stream.avail_out;
+    out.resize(used + produced);
+    _out_bytes += produced;
+
+    if (rc == Z_STREAM_END)
+    {
+      _ended = true;
+      more = false;
+    }
+    else if (rc == Z_OK)
+    {
+      more = (_stream.avail_in > 0) || (_stream.avail_out == 0);
+    }
+    else if (rc == Z_BUF_ERROR)
+    {
+      // No more progress can be made until there's more input.
+      more = false;
+    }
+    else
+    {
+      TRC_DEBUG("Failed to decode HTTP body: %s",
+                (_stream.msg != NULL) ? _stream.msg : "unknown error");
+      _failed = true;
+      more = false;
+    }
+  }
+
+  _decode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start).count();
+  return !_failed;
+}
+
+bool HttpContentDecoder::finish()
+{
+  if (!_compressed)
+  {
+    return !_failed;
+  }
+
+  if ((_failed) || (!_ended))
+  {
+    TRC_DEBUG("Compressed HTTP body was %s", _failed ? "corrupt" : "cut short");
+    return false;
+  }
+
+  TRC_DEBUG("Decoded HTTP body of %lu bytes into %lu bytes",
+            (unsigned long)_in_bytes, (unsigned long)_out_bytes);
+
+  if (_stats != NULL)
+  {
+    _stats->compressed_responses->increment();
+    _stats->saved_bytes->increment((_out_bytes > _in_bytes) ?
+                                     _out_bytes - _in_bytes : 0);
+    _stats->decode_time->observe(_decode_ns / 1000);
+  }
+
+  return true;
+}
+
+std::string HttpContentDecoder::content_encoding(const std::map<std::string, std::string>& headers)
+{
+  for (const std::pair<const std::string, std::string>& header : headers)
+  {
+    if (strcasecmp(header.first.c_str(), "content-encoding") == 0)
+    {
+      return header.second;
+    }
+  }
+
+  return "";
+}
+
+bool HttpContentDecoder::decode(const std::string& content_encoding,
+                                std::string& body,
+                                Stats* stats)
+{
+  HttpContentDecoder decoder(stats);
+
+  if (!decoder.set_encoding(content_encoding))
+  {
+    return false;
+  }
+
+  if (!decoder._compressed)
+  {
+    return true;
+  }
+
+  std::string decoded;
+  decoded.reserve(body.size() * 4);
+
+  if ((!decoder.write(body.data(), body.size(), decoded)) ||
+      (!decoder.finish()))
+  {
+    return false;
+  }
+
+  body.swap(decoded);
+  return true;
+}
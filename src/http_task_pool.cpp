@@ -0,0 +1,92 @@
+/**
+ * @file http_task_pool.cpp Implementation of HttpTaskPool.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include "http_task_pool.h"
+#include "threadpool.h"
+
+/// A task to run on the pool.
+struct HttpPoolTask
+{
+  std::function<void()> run;
+  std::function<void()> fail;
+};
+
+class HttpTaskPool::Pool : public ThreadPool<HttpPoolTask*>
+{
+public:
+  Pool(ExceptionHandler* exception_handler, unsigned int num_threads) :
+    ThreadPool<HttpPoolTask*>(num_threads,
+                              exception_handler,
+                              &exception_callback,
+                              0)
+  {
+  }
+
+  virtual ~Pool() {}
+
+  static void exception_callback(HttpPoolTask* task)
+  {
+    task->fail();
+    delete task;
+  }
+
+private:
+  virtual void process_work(HttpPoolTask*& task)
+  {
+    // Tasks may send SIP messages (for example, NOTIFYs and third-party
+    // deREGISTERs), so the pool's threads must be registered with PJSIP.  The
+    // descriptor must stay in scope for the lifetime of the thread.
+    static thread_local pj_thread_desc desc;
+
+    if (!pj_thread_is_registered())
+    {
+      pj_thread_t* pj_thread = NULL;
+      pj_bzero(desc, sizeof(desc));
+
+      if (pj_thread_register("HttpTaskPool", desc, &pj_thread) != PJ_SUCCESS)
+      {
+        TRC_ERROR("Failed to register HTTP task thread with pjsip"); // LCOV_EXCL_LINE
+      }
+    }
+
+    task->run();
+    delete task; task = NULL;
+  }
+};
+
+HttpTaskPool::HttpTaskPool(const std::string& name,
+                           unsigned int num_threads,
+                           ExceptionHandler* exception_handler) :
+  _name(name),
+  _pool(new Pool(exception_handler, num_threads))
+{
+  TRC_STATUS("Running %s HTTP requests on %u threads",
+             _name.c_str(),
+             num_threads);
+  _pool->start();
+}
+
+HttpTaskPool::~HttpTaskPool()
+{
+  _pool->stop();
+  _pool->join();
+  delete _pool; _pool = NULL;
+}
+
+void HttpTaskPool::add_task(std::function<void()> run,
+                            std::function<void()> fail)
+{
+  _pool->add_work(new HttpPoolTask{run, fail});
+}
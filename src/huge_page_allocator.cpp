@@ -0,0 +1,204 @@
+/**
+ * @file huge_page_allocator.cpp Implementation of HugePageAllocator
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "huge_page_allocator.h"
+#include "log.h"
+
+HugePageAllocator::HugePageAllocator() :
+  _arena_pos(NULL),
+  _arena_end(NULL),
+  _arena_bytes(0),
+  _free_bytes(0),
+  _in_use_bytes(0),
+  _huge_page_arenas(0),
+  _arena_bytes_scalar(NULL),
+  _in_use_bytes_scalar(NULL)
+{
+  for (int ii = 0; ii < NUM_CLASSES; ++ii)
+  {
+    _classes[ii].head = NULL;
+  }
+}
+
+HugePageAllocator::~HugePageAllocator()
+{
+  for (void* arena : _arenas)
+  {
+    munmap(arena, ARENA_SIZE);
+  }
+  _arenas.clear();
+}
+
+void HugePageAllocator::set_stats_scalars(SNMP::U32Scalar* arena_bytes_scalar,
+                                          SNMP::U32Scalar* in_use_bytes_scalar)
+{
+  _arena_bytes_scalar = arena_bytes_scalar;
+  _in_use_bytes_scalar = in_use_bytes_scalar;
+}
+
+void HugePageAllocator::update_stats()
+{
+  if (_arena_bytes_scalar != NULL)
+  {
+    _arena_bytes_scalar->value = arena_bytes();
+  }
+
+  if (_in_use_bytes_scalar != NULL)
+  {
+    _in_use_bytes_scalar->value = in_use_bytes();
+  }
+}
+
+int HugePageAllocator::size_class(size_t size)
+{
+  int size_class = 0;
+
+  while (class_size(size_class) < size)
+  {
+    ++size_class;
+  }
+
+  return size_class;
+}
+
+void* HugePageAllocator::alloc(size_t size)
+{
+  int sc = size_class(size);
+  void* mem = NULL;
+
+  {
+    std::unique_lock<std::mutex> lock(_classes[sc].lock);
+    FreeBlock* block = _classes[sc].head;
+    if (block != NULL)
+    {
+      _classes[sc].head = block->next;
+      mem = block;
+    }
+  }
+
+  if (mem == NULL)
+  {
+    mem = carve(sc);
+    if (mem == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  _free_bytes -= class_size(sc);
+  _in_use_bytes += size;
+
+  return mem;
+}
+
+void HugePageAllocator::free(void* mem, size_t size)
+{
+  int sc = size_class(size);
+  push(sc, mem);
+  _free_bytes += class_size(sc);
+  _in_use_bytes -= size;
+}
+
+void HugePageAllocator::push(int size_class, void* mem)
+{
+  FreeBlock* block = (FreeBlock*)mem;
+  std::unique_lock<std::mutex> lock(_classes[size_class].lock);
+  block->next = _classes[size_class].head;
+  _classes[size_class].head = block;
+}
+
+void* HugePageAllocator::carve(int size_class)
+{
+  size_t size = class_size(size_class);
+  std::unique_lock<std::mutex> lock(_arena_lock);
+
+  if ((size_t)(_arena_end - _arena_pos) < size)
+  {
+    // Put what's left of the current arena on the free lists, in the biggest
+    // blocks that fit.  Every block is a multiple of the smallest size, so
+    // nothing is wasted.
+    while ((size_t)(_arena_end - _arena_pos) >= MIN_BLOCK_SIZE)
+    {
+      int sc = NUM_CLASSES - 1;
+      while (class_size(sc) > (size_t)(_arena_end - _arena_pos))
+      {
+        --sc;
+      }
+
+      push(sc, _arena_pos);
+      _arena_pos += class_size(sc);
+    }
+
+    if (!new_arena())
+    {
+      return NULL;
+    }
+  }
+
+  void* mem = _arena_pos;
+  _arena_pos += size;
+  return mem;
+}
+
+bool HugePageAllocator::new_arena()
+{
+  void* arena = mmap(NULL,
+                     ARENA_SIZE,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                     -1,
+                     0);
+
+  if (arena != MAP_FAILED)
+  {
+    ++_huge_page_arenas;
+  }
+  else
+  {
+    // There are no huge pages reserved, so map twice the size, trim it to an
+    // aligned arena and ask for it to be backed by a transparent huge page.
+    char* region = (char*)mmap(NULL,
+                               2 * ARENA_SIZE,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS,
+                               -1,
+                               0);
+    if (region == MAP_FAILED)
+    {
+      TRC_ERROR("Failed to map a %lu byte pool arena", ARENA_SIZE);  // LCOV_EXCL_LINE
+      return false;                                                    // LCOV_EXCL_LINE
+    }
+
+    char* aligned = (char*)(((uintptr_t)region + ARENA_SIZE - 1) &
+                            ~(uintptr_t)(ARENA_SIZE - 1));
+    if (aligned > region)
+    {
+      munmap(region, aligned - region);
+    }
+    munmap(aligned + ARENA_SIZE, region + ARENA_SIZE - aligned);
+
+    madvise(aligned, ARENA_SIZE, MADV_HUGEPAGE);
+    arena = aligned;
+  }
+
+  TRC_DEBUG("Mapped pool arena %d at %p", (int)_arenas.size(), arena);
+
+  _arenas.push_back(arena);
+  _arena_pos = (char*)arena;
+  _arena_end = _arena_pos + ARENA_SIZE;
+  _arena_bytes += ARENA_SIZE;
+  _free_bytes += ARENA_SIZE;
+
+  return true;
+}
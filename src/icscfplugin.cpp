@@ -31,6 +31,8 @@ private:
   SCSCFSelector* _scscf_selector;
   SNMP::SuccessFailCountByRequestTypeTable* _incoming_sip_transactions_tbl;
   SNMP::SuccessFailCountByRequestTypeTable* _outgoing_sip_transactions_tbl;
+  ShardedLRUCacheStatsTables _query_cache_stats_tbls;
+  ICSCFQueryCache* _query_cache;
 };
 
 /// Export the plug-in using the magic symbol "sproutlet_plugin"
@@ -41,7 +43,9 @@ ICSCFPlugin sproutlet_plugin;
 ICSCFPlugin::ICSCFPlugin() :
   _icscf_sproutlet(NULL),
   _acr_factory(NULL),
-  _scscf_selector(NULL)
+  _scscf_selector(NULL),
+  _query_cache_stats_tbls({NULL, NULL, NULL}),
+  _query_cache(NULL)
 {
 }
 
@@ -69,9 +73,28 @@ bool ICSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
     // Create the S-CSCF selector.
     _scscf_selector = new SCSCFSelector(opt.uri_scscf);
 
+    if (opt.icscf_hss_cache_ttl > 0)
+    {
+      // Create the cache of HSS query results.
+      _query_cache_stats_tbls.hits_tbl =
+        SNMP::CounterTable::create("icscf_hss_cache_hits",
+                                   ".1.2.826.0.1.1578918.9.3.71");
+      _query_cache_stats_tbls.misses_tbl =
+        SNMP::CounterTable::create("icscf_hss_cache_misses",
+                                   ".1.2.826.0.1.1578918.9.3.72");
+      _query_cache_stats_tbls.evictions_tbl =
+        SNMP::CounterTable::create("icscf_hss_cache_evictions",
+                                   ".1.2.826.0.1.1578918.9.3.73");
+      _query_cache = new ICSCFQueryCache(opt.icscf_hss_cache_ttl,
+                                         opt.icscf_hss_cache_size,
+                                         _query_cache_stats_tbls);
+    }
+
     // Create the I-CSCF ACR factory.
     _acr_factory = (ralf_processor != NULL) ?
-                        (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::ICSCF) :
+                        (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                        ACR::ICSCF,
+                                                        acr_policy) :
                         new ACRFactory();
 
     // Create the I-CSCF sproutlet.
@@ -89,7 +112,8 @@ bool ICSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                           _outgoing_sip_transactions_tbl,
                                           opt.override_npdi,
                                           opt.port_icscf,
-                                          opt.blacklisted_scscfs);
+                                          opt.blacklisted_scscfs,
+                                          _query_cache);
     _icscf_sproutlet->init();
 
     sproutlets.push_back(_icscf_sproutlet);
@@ -104,6 +128,10 @@ void ICSCFPlugin::unload()
   delete _icscf_sproutlet;
   delete _acr_factory;
   delete _scscf_selector;
+  delete _query_cache;
+  delete _query_cache_stats_tbls.hits_tbl;
+  delete _query_cache_stats_tbls.misses_tbl;
+  delete _query_cache_stats_tbls.evictions_tbl;
   delete _incoming_sip_transactions_tbl;
   delete _outgoing_sip_transactions_tbl;
 }
@@ -23,19 +23,82 @@ extern "C" {
 #include "pjutils.h"
 #include "uri_classifier.h"
 
+ICSCFQueryCache::ICSCFQueryCache(int ttl,
+                                 size_t size,
+                                 const ShardedLRUCacheStatsTables& stats_tbls) :
+  _ttl(ttl),
+  _cache(size, NUM_CACHE_SHARDS, stats_tbls)
+{
+}
+
+std::string ICSCFQueryCache::uar_key(const std::string& impi,
+                                     const std::string& impu,
+                                     const std::string& visited_network,
+                                     const std::string& auth_type,
+                                     bool emergency)
+{
+  std::string key = "uar";
+  key.push_back('\0');
+  key.append(impi);
+  key.push_back('\0');
+  key.append(impu);
+  key.push_back('\0');
+  key.append(visited_network);
+  key.push_back('\0');
+  key.append(auth_type);
+  key.push_back(emergency ? '1' : '0');
+  return key;
+}
+
+std::string ICSCFQueryCache::lir_key(const std::string& impu,
+                                     bool originating)
+{
+  std::string key = "lir";
+  key.push_back('\0');
+  key.append(impu);
+  key.push_back(originating ? '1' : '0');
+  return key;
+}
+
+bool ICSCFQueryCache::find(const std::string& key, Result& result)
+{
+  std::shared_ptr<const Result> cached;
+
+  if (!_cache.get(key, cached))
+  {
+    return false;
+  }
+
+  result = *cached;
+  return true;
+}
+
+void ICSCFQueryCache::add(const std::string& key, const Result& result)
+{
+  _cache.put(key, std::make_shared<Result>(result), _ttl);
+}
+
+void ICSCFQueryCache::invalidate(const std::string& key)
+{
+  _cache.erase(key);
+}
+
+
 ICSCFRouter::ICSCFRouter(HSSConnection* hss,
                          SCSCFSelector* scscf_selector,
                          SAS::TrailId trail,
                          ACR* acr,
                          int port,
-                         std::set<std::string> blacklisted_scscfs) :
+                         std::set<std::string> blacklisted_scscfs,
+                         ICSCFQueryCache* query_cache) :
+  _query_cache(query_cache),
   _hss(hss),
   _scscf_selector(scscf_selector),
   _trail(trail),
   _acr(acr),
   _port(port),
   _queried_caps(false),
-  _hss_rsp(),
+  _hss_rsp(std::make_shared<ServerCapabilities>()),
   _attempted_scscfs(),
   _blacklisted_scscfs(blacklisted_scscfs)
 {
@@ -80,27 +143,27 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool,
 
   if (status_code == PJSIP_SC_OK)
   {
-    wildcard = _hss_rsp.wildcard;
-    if ((!_hss_rsp.scscf.empty()) && 
-        (_blacklisted_scscfs.find(_hss_rsp.scscf) != _blacklisted_scscfs.end()))
+    wildcard = _hss_rsp->wildcard;
+    if ((!_hss_rsp->scscf.empty()) && 
+        (_blacklisted_scscfs.find(_hss_rsp->scscf) != _blacklisted_scscfs.end()))
     {
       // The HSS returned blacklisted S-CSCF. Query the capabilities.
-      TRC_DEBUG("S-CSCF %s is blacklisted - not routing request to this S-CSCF", _hss_rsp.scscf.c_str());
-      _attempted_scscfs.push_back(_hss_rsp.scscf);
+      TRC_DEBUG("S-CSCF %s is blacklisted - not routing request to this S-CSCF", _hss_rsp->scscf.c_str());
+      _attempted_scscfs.push_back(_hss_rsp->scscf);
       status_code = hss_query();
 
       SAS::Event event(_trail, SASEvent::SCSCF_BLACKLISTED, 0);
-      event.add_var_param(_hss_rsp.scscf);
+      event.add_var_param(_hss_rsp->scscf);
       SAS::report_event(event);
     }
 
-    if ((!_hss_rsp.scscf.empty()) &&
+    if ((!_hss_rsp->scscf.empty()) &&
         (std::find(_attempted_scscfs.begin(), _attempted_scscfs.end(),
-                   _hss_rsp.scscf) == _attempted_scscfs.end()))
+                   _hss_rsp->scscf) == _attempted_scscfs.end()))
     {
       // The HSS returned a S-CSCF name and it's not one we have tried
       // already.
-      scscf = _hss_rsp.scscf;
+      scscf = _hss_rsp->scscf;
       TRC_DEBUG("SCSCF specified by HSS: %s", scscf.c_str());
     }
     else if (_queried_caps)
@@ -111,8 +174,8 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool,
       std::vector<std::string> rejected_scscfs;
       rejected_scscfs.insert(rejected_scscfs.end(), _attempted_scscfs.begin(), _attempted_scscfs.end());
       rejected_scscfs.insert(rejected_scscfs.end(), _blacklisted_scscfs.begin(), _blacklisted_scscfs.end());
-      scscf = _scscf_selector->get_scscf(_hss_rsp.mandatory_caps,
-                                         _hss_rsp.optional_caps,
+      scscf = _scscf_selector->get_scscf(_hss_rsp->mandatory_caps,
+                                         _hss_rsp->optional_caps,
                                          rejected_scscfs,
                                          _trail);
       TRC_DEBUG("SCSCF selected: %s", scscf.c_str());
@@ -184,7 +247,7 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool,
   {
     SAS::Event event(_trail, SASEvent::SCSCF_SELECTION_SUCCESS, 0);
     event.add_var_param(scscf);
-    event.add_var_param(_hss_rsp.scscf);
+    event.add_var_param(_hss_rsp->scscf);
     SAS::report_event(event);
   }
   else
@@ -204,12 +267,11 @@ int ICSCFRouter::parse_hss_response(rapidjson::Document*& rsp, bool queried_caps
 {
   int status_code = PJSIP_SC_OK;
 
-  // Clear out any older response.
+  // Parse into a new set of capabilities rather than clearing out the older
+  // response, as it may be shared with the query cache and the ACR.
   _queried_caps = false;
-  _hss_rsp.mandatory_caps.clear();
-  _hss_rsp.optional_caps.clear();
-  _hss_rsp.scscf = "";
-  _hss_rsp.wildcard = "";
+  std::shared_ptr<ServerCapabilities> hss_rsp =
+                                       std::make_shared<ServerCapabilities>();
 
   if ((!rsp->HasMember("result-code")) ||
       (!(*rsp)["result-code"].IsInt()))
@@ -232,7 +294,7 @@ int ICSCFRouter::parse_hss_response(rapidjson::Document*& rsp, bool queried_caps
       {
         // Response specifies a S-CSCF, so select this as the target.
         TRC_DEBUG("HSS returned S-CSCF %s as target", (*rsp)["scscf"].GetString());
-        _hss_rsp.scscf = (*rsp)["scscf"].GetString();
+        hss_rsp->scscf = (*rsp)["scscf"].GetString();
       }
 
       if ((rsp->HasMember("mandatory-capabilities")) &&
@@ -247,9 +309,9 @@ int ICSCFRouter::parse_hss_response(rapidjson::Document*& rsp, bool queried_caps
         queried_caps = true;
 
         if ((!parse_capabilities((*rsp)["mandatory-capabilities"],
-                                 _hss_rsp.mandatory_caps)) ||
+                                 hss_rsp->mandatory_caps)) ||
             (!parse_capabilities((*rsp)["optional-capabilities"],
-                                 _hss_rsp.optional_caps)))
+                                 hss_rsp->optional_caps)))
         {
           // Failed to parse capabilities, so reject with 480 response.
           TRC_INFO("Malformed required capabilities returned by HSS");
@@ -263,7 +325,7 @@ int ICSCFRouter::parse_hss_response(rapidjson::Document*& rsp, bool queried_caps
         // Response included a wildcard, so save this.
         TRC_DEBUG("HSS returned a wildcarded public user identity %s",
                   (*rsp)["wildcard-identity"].GetString());
-        _hss_rsp.wildcard = (*rsp)["wildcard-identity"].GetString();
+        hss_rsp->wildcard = (*rsp)["wildcard-identity"].GetString();
       }
     }
     else if (rc == 5003)
@@ -285,6 +347,7 @@ int ICSCFRouter::parse_hss_response(rapidjson::Document*& rsp, bool queried_caps
   // capabilities means the HSS doesn't care which S-CSCF we select) or because
   // the HSS decided to return capabilities anyway.
   _queried_caps = (status_code == PJSIP_SC_OK) ? queried_caps : false;
+  _hss_rsp = hss_rsp;
 
   if (_acr != NULL)
   {
@@ -296,6 +359,40 @@ int ICSCFRouter::parse_hss_response(rapidjson::Document*& rsp, bool queried_caps
 }
 
 
+/// Uses the cached result of an HSS query, if there is one.
+bool ICSCFRouter::find_cached_rsp(const std::string& key)
+{
+  ICSCFQueryCache::Result result;
+
+  if ((_query_cache == NULL) || (!_query_cache->find(key, result)))
+  {
+    return false;
+  }
+
+  TRC_DEBUG("Using cached HSS response");
+  _hss_rsp = result.hss_rsp;
+  _queried_caps = result.queried_caps;
+
+  if (_acr != NULL)
+  {
+    // Pass the server capabilities to the ACR for reporting.
+    _acr->server_capabilities(_hss_rsp);
+  }
+
+  return true;
+}
+
+
+/// Caches the result of a successful HSS query.
+void ICSCFRouter::cache_rsp(const std::string& key)
+{
+  if (_query_cache != NULL)
+  {
+    _query_cache->add(key, {_hss_rsp, _queried_caps});
+  }
+}
+
+
 /// Parses a set of capabilities in the HSS response to a vector of integers.
 bool ICSCFRouter::parse_capabilities(rapidjson::Value& caps,
                                      std::vector<int>& parsed_caps)
@@ -325,8 +422,9 @@ ICSCFUARouter::ICSCFUARouter(HSSConnection* hss,
                              const std::string& visited_network,
                              const std::string& auth_type,
                              const bool& emergency,
-                             std::set<std::string> blacklisted_scscfs) :
-  ICSCFRouter(hss, scscf_selector, trail, acr, port, blacklisted_scscfs),
+                             std::set<std::string> blacklisted_scscfs,
+                             ICSCFQueryCache* query_cache) :
+  ICSCFRouter(hss, scscf_selector, trail, acr, port, blacklisted_scscfs, query_cache),
   _impi(impi),
   _impu(impu),
   _visited_network(visited_network),
@@ -347,7 +445,26 @@ int ICSCFUARouter::hss_query()
 
   // If we've already done one query we must force the HSS to return
   // capabilities this time.
-  std::string auth_type = (_hss_rsp.scscf.empty()) ? _auth_type : "CAPAB";
+  std::string auth_type = (_hss_rsp->scscf.empty()) ? _auth_type : "CAPAB";
+
+  // Only the first query is cached.  If we're querying capabilities because
+  // the S-CSCF we were given isn't usable, any cached result is out of date.
+  std::string cache_key = ICSCFQueryCache::uar_key(_impi,
+                                                   _impu,
+                                                   _visited_network,
+                                                   _auth_type,
+                                                   _emergency);
+  if (auth_type == "CAPAB")
+  {
+    if (_query_cache != NULL)
+    {
+      _query_cache->invalidate(cache_key);
+    }
+  }
+  else if (find_cached_rsp(cache_key))
+  {
+    return PJSIP_SC_OK;
+  }
 
   TRC_DEBUG("Perform UAR - impi %s, impu %s, vn %s, auth_type %s",
             _impi.c_str(), _impu.c_str(),
@@ -388,6 +505,10 @@ int ICSCFUARouter::hss_query()
       // REGISTER requests.
       status_code = PJSIP_SC_FORBIDDEN;
     }
+    else if ((status_code == PJSIP_SC_OK) && (auth_type != "CAPAB"))
+    {
+      cache_rsp(cache_key);
+    }
   }
 
   delete rsp;
@@ -403,8 +524,9 @@ ICSCFLIRouter::ICSCFLIRouter(HSSConnection* hss,
                              int port,
                              const std::string& impu,
                              bool originating,
-                             std::set<std::string> blacklisted_scscfs) :
-  ICSCFRouter(hss, scscf_selector, trail, acr, port, blacklisted_scscfs),
+                             std::set<std::string> blacklisted_scscfs,
+                             ICSCFQueryCache* query_cache) :
+  ICSCFRouter(hss, scscf_selector, trail, acr, port, blacklisted_scscfs, query_cache),
   _impu(impu),
   _originating(originating)
 {
@@ -423,7 +545,23 @@ int ICSCFLIRouter::hss_query()
 
   // If we've already done one query we must force the HSS to return
   // capabilities this time.
-  std::string auth_type = (_hss_rsp.scscf.empty()) ? "" : "CAPAB";
+  std::string auth_type = (_hss_rsp->scscf.empty()) ? "" : "CAPAB";
+
+  // Only the first query is cached.  If we're querying capabilities because
+  // the S-CSCF we were given isn't usable, any cached result is out of date.
+  std::string cache_key = ICSCFQueryCache::lir_key(_impu, _originating);
+
+  if (auth_type == "CAPAB")
+  {
+    if (_query_cache != NULL)
+    {
+      _query_cache->invalidate(cache_key);
+    }
+  }
+  else if (find_cached_rsp(cache_key))
+  {
+    return PJSIP_SC_OK;
+  }
 
   TRC_DEBUG("Perform LIR - impu %s, originating %s, auth_type %s",
             _impu.c_str(),
@@ -454,6 +592,11 @@ int ICSCFLIRouter::hss_query()
   {
     // HSS returned a well-formed response, so parse it.
     status_code = parse_hss_response(rsp, auth_type == "CAPAB");
+
+    if ((status_code == PJSIP_SC_OK) && (auth_type != "CAPAB"))
+    {
+      cache_rsp(cache_key);
+    }
   }
 
   delete rsp;
@@ -48,7 +48,8 @@ ICSCFSproutlet::ICSCFSproutlet(const std::string& icscf_name,
                                SNMP::SuccessFailCountByRequestTypeTable* outgoing_sip_transactions_tbl,
                                bool override_npdi,
                                int network_function_port,
-                               std::set<std::string> blacklisted_scscfs) :
+                               std::set<std::string> blacklisted_scscfs,
+                               ICSCFQueryCache* query_cache) :
   Sproutlet(icscf_name,
             port,
             uri,
@@ -66,7 +67,8 @@ ICSCFSproutlet::ICSCFSproutlet(const std::string& icscf_name,
   _override_npdi(override_npdi),
   _bgcf_uri_str(bgcf_uri),
   _network_function_port(network_function_port),
-  _blacklisted_scscfs(blacklisted_scscfs)
+  _blacklisted_scscfs(blacklisted_scscfs),
+  _query_cache(query_cache)
 {
   _session_establishment_tbl = SNMP::SuccessFailCountTable::create("icscf_session_establishment",
                                                                    "1.2.826.0.1.1578918.9.3.36");
@@ -196,7 +198,7 @@ void ICSCFSproutletRegTsx::on_rx_initial_request(pjsip_msg* req)
   {
     // We're unable to get the IMPU from the message - reject it now
     SAS::Event event(trail(), SASEvent::ICSCF_INVALID_IMPU, 0);
-    event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, to_uri));
+    PJUtils::add_uri_param(event, PJSIP_URI_IN_FROMTO_HDR, to_uri);
     SAS::report_event(event);
 
     pjsip_msg* rsp = create_response(req, PJSIP_SC_BAD_REQUEST);
@@ -290,7 +292,8 @@ void ICSCFSproutletRegTsx::on_rx_initial_request(pjsip_msg* req)
                                             visited_network,
                                             auth_type,
                                             emergency,
-                                            _icscf->_blacklisted_scscfs);
+                                            _icscf->_blacklisted_scscfs,
+                                            _icscf->_query_cache);
 
   // We have a router, query it for an S-CSCF to use.
   pjsip_sip_uri* scscf_sip_uri = NULL;
@@ -531,7 +534,7 @@ void ICSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
     {
       // We're unable to get the IMPU from the message - reject it now
       SAS::Event event(trail(), SASEvent::ICSCF_INVALID_IMPU, 1);
-      event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, orig_uri));
+      PJUtils::add_uri_param(event, PJSIP_URI_IN_FROMTO_HDR, orig_uri);
       SAS::report_event(event);
 
       pjsip_msg* rsp = create_response(req, PJSIP_SC_BAD_REQUEST);
@@ -576,7 +579,7 @@ void ICSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
     {
       // We're unable to get the IMPU from the message - reject it now
       SAS::Event event(trail(), SASEvent::ICSCF_INVALID_IMPU, 2);
-      event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, term_uri));
+      PJUtils::add_uri_param(event, PJSIP_URI_IN_FROMTO_HDR, term_uri);
       SAS::report_event(event);
 
       pjsip_msg* rsp = create_response(req, PJSIP_SC_BAD_REQUEST);
@@ -600,7 +603,9 @@ void ICSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
                                             _acr,
                                             _icscf->network_function_port(),
                                             impu,
-                                            _originating);
+                                            _originating,
+                                            std::set<std::string>(),
+                                            _icscf->_query_cache);
 
   pjsip_sip_uri* scscf_sip_uri = NULL;
 
@@ -684,7 +689,7 @@ void ICSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
             {
               // We're unable to get the IMPU from the message - reject it now
               SAS::Event event(trail(), SASEvent::ICSCF_INVALID_IMPU, 3);
-              event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, req->line.req.uri));
+              PJUtils::add_uri_param(event, PJSIP_URI_IN_REQ_URI, req->line.req.uri);
               SAS::report_event(event);
 
               pjsip_msg* rsp = create_response(req, PJSIP_SC_BAD_REQUEST);
@@ -26,6 +26,7 @@ extern "C" {
 #include "ifc.h"
 
 #include "sas.h"
+#include "sas_sampling.h"
 #include "sproutsasevent.h"
 #include "uri_classifier.h"
 
@@ -44,6 +45,22 @@ using namespace rapidxml;
 #define ORIGINATING_UNREGISTERED 3
 #define ORIGINATING_CDIV 4
 
+bool Ifc::sas_log_full_ifcs = false;
+
+Ifc::Ifc(rapidxml::xml_node<>* ifc) :
+  _ifc(ifc),
+  _compiled(compile(ifc))
+{
+}
+
+Ifc::Ifc(rapidxml::xml_node<>* ifc,
+         std::shared_ptr<rapidxml::xml_document<> > owner) :
+  _ifc(ifc),
+  _compiled(compile(ifc)),
+  _owner(owner)
+{
+}
+
 Ifc::Ifc(std::string ifc_str,
          rapidxml::xml_document<>* ifc_doc) :
   _ifc(NULL)
@@ -57,10 +74,25 @@ Ifc::Ifc(std::string ifc_str,
   char* xml_str = ifc_doc->allocate_string(ifc_str.c_str());
   new_document->parse<0>(xml_str);
   _ifc = ifc_doc->clone_node(new_document->first_node());
+  _compiled = compile(_ifc);
 
   delete new_document;
 }
 
+void Ifc::DeferredError::raise(const std::string& server_name,
+                               SAS::TrailId trail) const
+{
+  if (_xml_error)
+  {
+    throw *_xml_error;
+  }
+  else if (!_invalid_reason.empty())
+  {
+    handle_invalid_ifc(_invalid_reason, server_name,
+                       SASEvent::INVALID_IFC_IGNORED, 0, trail);
+  }
+}
+
 void Ifc::handle_invalid_ifc(std::string error,
                              std::string server_name,
                              int sas_event_id,
@@ -92,19 +124,114 @@ void Ifc::handle_unusual_ifc(std::string error,
   SAS::report_event(event);
 }
 
-// Test if the SPT matches. Ignores grouping and negation, and just
-// evaluates the service point trigger in the node.
-// @return true if the SPT matches, false if not
-// @throw xml_error if there is a problem evaluating the trigger.
-bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
-                      const bool is_registered,               //< The registration state
-                      const bool is_initial_registration,
-                      pjsip_msg* msg,                   //< The message being matched
-                      xml_node<>* spt,                  //< The Service Point Trigger node
-                      std::string ifc_str,
-                      std::string server_name,
-                      SAS::TrailId trail)
+// Compiles the iFC XML.  Any errors are recorded in the compiled form to be
+// reported when the iFC is evaluated, and compilation stops at the first
+// error that would stop evaluation.
+std::shared_ptr<Ifc::CompiledIfc> Ifc::compile(xml_node<>* ifc)
+{
+  std::shared_ptr<CompiledIfc> compiled = std::make_shared<CompiledIfc>();
+
+  if (ifc == NULL)
+  {
+    // LCOV_EXCL_START
+    compiled->_as_error._invalid_reason = "iFC missing ApplicationServer element";
+    return compiled;
+    // LCOV_EXCL_STOP
+  }
+
+  rapidxml::print(std::back_inserter(compiled->_ifc_str), *ifc, 0);
+
+  xml_node<>* as = ifc->first_node(RegDataXMLUtils::APPLICATION_SERVER);
+  if (as == NULL)
+  {
+    compiled->_as_error._invalid_reason = "iFC missing ApplicationServer element";
+    return compiled;
+  }
+
+  compiled->_server_name = XMLUtils::get_first_node_value(as, RegDataXMLUtils::SERVER_NAME);
+
+  std::string priority = XMLUtils::get_first_node_value(ifc, RegDataXMLUtils::PRIORITY);
+  compiled->_sas_id = "Priority " + (priority.empty() ? "0" : priority) +
+                      ": " + compiled->_server_name;
+
+  if (compiled->_server_name.empty())
+  {
+    compiled->_as_error._invalid_reason = "iFC has no ServerName";
+    return compiled;
+  }
+
+  xml_node<>* profile_part_indicator = ifc->first_node(RegDataXMLUtils::PROFILE_PART_INDICATOR);
+  if (profile_part_indicator)
+  {
+    try
+    {
+      compiled->_has_ppi = true;
+      compiled->_ppi_reg = XMLUtils::parse_integer(profile_part_indicator,
+                                                   "ProfilePartIndicator",
+                                                   0,
+                                                   1) == 0;
+    }
+    catch (xml_error err)
+    {
+      compiled->_ppi_error._xml_error = std::make_shared<xml_error>(err);
+      return compiled;
+    }
+  }
+
+  xml_node<>* trigger = ifc->first_node(RegDataXMLUtils::TRIGGER_POINT);
+  if (!trigger)
+  {
+    return compiled;
+  }
+
+  compiled->_has_trigger = true;
+
+  try
+  {
+    compiled->_cnf = XMLUtils::parse_bool(trigger->first_node(RegDataXMLUtils::CONDITION_TYPE_CNF),
+                                          RegDataXMLUtils::CONDITION_TYPE_CNF);
+  }
+  catch (xml_error err)
+  {
+    compiled->_cnf_error._xml_error = std::make_shared<xml_error>(err);
+    return compiled;
+  }
+
+  for (xml_node<>* spt = trigger->first_node(RegDataXMLUtils::SPT);
+       spt;
+       spt = spt->next_sibling(RegDataXMLUtils::SPT))
+  {
+    compiled->_spts.push_back(CompiledSpt());
+    CompiledSpt& compiled_spt = compiled->_spts.back();
+    compile_spt(spt, compiled_spt);
+
+    if ((compiled_spt._negated_error.is_set()) ||
+        (compiled_spt._error.is_set()) ||
+        (compiled_spt._group_error.is_set()))
+    {
+      // Evaluation can't get past this SPT.
+      break;
+    }
+  }
+
+  return compiled;
+}
+
+// Compiles a single Service Point Trigger node.
+void Ifc::compile_spt(xml_node<>* spt,
+                      CompiledSpt& compiled)
 {
+  try
+  {
+    xml_node<>* neg_node = spt->first_node(RegDataXMLUtils::CONDITION_NEGATED);
+    compiled._negated = neg_node && XMLUtils::parse_bool(neg_node, RegDataXMLUtils::CONDITION_NEGATED);
+  }
+  catch (xml_error err)
+  {
+    compiled._negated_error._xml_error = std::make_shared<xml_error>(err);
+    return;
+  }
+
   // Find the class node.
   xml_node<>* node = spt->first_node();
   const char* name = NULL;
@@ -118,149 +245,282 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
     {
       if (strcmp(name, RegDataXMLUtils::EXTENSION) == 0)
       {
-        handle_invalid_ifc("Missing class for service point trigger", server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-      }
-      else
-      {
-        break;
+        node = NULL;
       }
+
+      break;
     }
   }
 
   if (!node)
   {
-    handle_invalid_ifc("Missing class for service point trigger", server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
+    compiled._error._invalid_reason = "Missing class for service point trigger";
+    return;
   }
 
-  // Now interpret the node depending on its class.
-  bool ret = false;
+  compiled._class_name = name;
 
-  if (strcmp(RegDataXMLUtils::METHOD, name) == 0)
+  try
   {
-    // If we have a REGISTER we may need to match on RegistrationType.
-    if ((strcmp("REGISTER", node->value()) == 0) &&
-        (pj_strcmp2(&msg->line.req.method.name, node->value()) == 0))
+    if (strcmp(RegDataXMLUtils::METHOD, name) == 0)
     {
-      ret = true;
-      node = node->next_sibling();
-      if (node)
+      compiled._spt_class = CompiledSpt::METHOD;
+      compiled._method = node->value();
+      compiled._is_register = (compiled._method == "REGISTER");
+
+      // If we have a REGISTER we may need to match on RegistrationType.  These
+      // are only parsed when evaluating a REGISTER, so any parse error is only
+      // raised then.
+      xml_node<>* ext = node->next_sibling();
+      if ((compiled._is_register) &&
+          (ext) &&
+          (strcmp(ext->name(), RegDataXMLUtils::EXTENSION) == 0))
       {
-        name = node->name();
-        if (strcmp(name, RegDataXMLUtils::EXTENSION) == 0)
+        try
         {
-          for (xml_node<>* reg_type_node = node->first_node(RegDataXMLUtils::REGISTRATION_TYPE);
+          for (xml_node<>* reg_type_node = ext->first_node(RegDataXMLUtils::REGISTRATION_TYPE);
                reg_type_node;
                reg_type_node = reg_type_node->next_sibling(RegDataXMLUtils::REGISTRATION_TYPE))
           {
-            name = reg_type_node->name();
-            int reg_type = XMLUtils::parse_integer(reg_type_node,
-                                                   "registration type",
-                                                   0,
-                                                   2);
-
-            // Find expiry value from SIP message if it is present to determine
-            // whether we have a de-registration.  Set an arbitrary default value of
-            // an hour.
-            pj_bool_t dereg = PJUtils::is_deregistration(msg);
-
-            switch (reg_type)
-            {
-            case INITIAL_REGISTRATION:
-              ret = (is_initial_registration && !dereg);
-              break;
-            case REREGISTRATION:
-              ret = (!is_initial_registration && !dereg);
-              break;
-            case DEREGISTRATION:
-              ret = dereg;
-              break;
-            default:
-              // LCOV_EXCL_START Unreachable
-              TRC_WARNING("Impossible case %d", reg_type);
-              ret = false;
-              break;
-              // LCOV_EXCL_STOP
-            }
-
-            // If we've found a match, break out of the for loop.
-            if (ret)
-            {
-              break;
-            }
+            compiled._reg_types.push_back(XMLUtils::parse_integer(reg_type_node,
+                                                                  "registration type",
+                                                                  0,
+                                                                  2));
+          }
+        }
+        catch (xml_error err)
+        {
+          compiled._reg_type_error._xml_error = std::make_shared<xml_error>(err);
+        }
+      }
+    }
+    else if (strcmp(RegDataXMLUtils::SIP_HEADER, name) == 0)
+    {
+      compiled._spt_class = CompiledSpt::SIP_HEADER;
+      xml_node<>* spt_header = node->first_node(RegDataXMLUtils::HEADER);
+      xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
+
+      if (!spt_header)
+      {
+        compiled._error._invalid_reason =
+          "Missing Header element for SIPHeader service point trigger";
+      }
+      else
+      {
+        std::string header = XMLUtils::get_text_or_cdata(spt_header);
+        compiled._match_key = "H" + header;
+        compiled._regex = boost::regex(header,
+                                       boost::regex_constants::icase |
+                                       boost::regex_constants::no_except);
+        if (compiled._regex.status())
+        {
+          compiled._error._invalid_reason =
+            "Invalid regular expression in Header element for SIPHeader service point trigger";
+        }
+        else if (spt_content)
+        {
+          // Any error in the content regex is only raised if a header matches.
+          compiled._has_content = true;
+          std::string content = XMLUtils::get_text_or_cdata(spt_content);
+          compiled._match_key.append(1, '\0').append(content);
+          compiled._content_regex = boost::regex(content,
+                                                 boost::regex_constants::no_except);
+          if (compiled._content_regex.status())
+          {
+            compiled._content_error._invalid_reason =
+              "Invalid regular expression in Content element for SIPHeader service point trigger";
+          }
+        }
+      }
+    }
+    else if (strcmp(RegDataXMLUtils::SESSION_CASE, name) == 0)
+    {
+      compiled._spt_class = CompiledSpt::SESSION_CASE;
+      compiled._session_case = XMLUtils::parse_integer(node, "session case", 0, 4);
+    }
+    else if (strcmp(RegDataXMLUtils::REQUEST_URI, name) == 0)
+    {
+      compiled._spt_class = CompiledSpt::REQUEST_URI;
+      std::string req_uri = XMLUtils::get_text_or_cdata(node);
+      compiled._unusual_req_uri = ((req_uri.compare(0, 4, "sip:") == 0) ||
+                                   (req_uri.compare(0, 4, "tel:") == 0));
+      compiled._match_key = "R" + req_uri;
+
+      compiled._regex = boost::regex(req_uri,
+                                     boost::regex_constants::no_except);
+      if (compiled._regex.status())
+      {
+        compiled._error._invalid_reason =
+          "Invalid regular expression in Request URI service point trigger";
+      }
+    }
+    else if (strcmp(RegDataXMLUtils::SESSION_DESCRIPTION, name) == 0)
+    {
+      compiled._spt_class = CompiledSpt::SESSION_DESCRIPTION;
+      xml_node<>* spt_line = node->first_node(RegDataXMLUtils::LINE);
+      xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
+
+      if (!spt_line)
+      {
+        compiled._error._invalid_reason =
+          "Missing Line element for SessionDescription service point trigger";
+      }
+      else
+      {
+        std::string line = XMLUtils::get_text_or_cdata(spt_line);
+        compiled._match_key = "S" + line;
+        compiled._regex = boost::regex(line,
+                                       boost::regex_constants::no_except);
+        if (compiled._regex.status())
+        {
+          compiled._error._invalid_reason =
+            "Invalid regular expression in Line element for Session Description service point trigger";
+        }
+        else if (spt_content)
+        {
+          // Any error in the content regex is only raised if a line matches.
+          compiled._has_content = true;
+          std::string content = XMLUtils::get_text_or_cdata(spt_content);
+          compiled._match_key.append(1, '\0').append(content);
+          compiled._content_regex = boost::regex(content,
+                                                 boost::regex_constants::no_except);
+          if (compiled._content_regex.status())
+          {
+            compiled._content_error._invalid_reason =
+              "Invalid regular expression in Content element for Session Description service point trigger";
           }
         }
       }
     }
     else
     {
-      ret = (pj_strcmp2(&msg->line.req.method.name, node->value()) == 0);
+      compiled._spt_class = CompiledSpt::UNKNOWN;
     }
   }
-  else if (strcmp(RegDataXMLUtils::SIP_HEADER, name) == 0)
+  catch (xml_error err)
   {
-    xml_node<>* spt_header = node->first_node(RegDataXMLUtils::HEADER);
-    xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
-    boost::regex header_regex;
-    boost::regex content_regex;
-    pjsip_hdr* header = NULL;
+    compiled._error._xml_error = std::make_shared<xml_error>(err);
+  }
 
-    if (!spt_header)
-    {
-      handle_invalid_ifc("Missing Header element for SIPHeader service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
+  if (compiled._error.is_set())
+  {
+    return;
+  }
 
-    header_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_header),
-                                boost::regex_constants::icase |
-                                boost::regex_constants::no_except);
-    if (header_regex.status())
+  try
+  {
+    for (xml_node<>* group_node = spt->first_node(RegDataXMLUtils::GROUP);
+         group_node;
+         group_node = group_node->next_sibling(RegDataXMLUtils::GROUP))
     {
-      handle_invalid_ifc("Invalid regular expression in Header element for SIPHeader service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
+      compiled._groups.push_back(XMLUtils::parse_integer(group_node,
+                                                         "Group ID",
+                                                         0,
+                                                         std::numeric_limits<int32_t>::max()));
     }
+  }
+  catch (xml_error err)
+  {
+    compiled._group_error._xml_error = std::make_shared<xml_error>(err);
+  }
+}
 
-    for (header = msg->hdr.next; header != &msg->hdr; header = header->next)
+// Test if the SPT matches. Ignores grouping and negation, and just
+// evaluates the service point trigger.
+// @return true if the SPT matches, false if not
+// @throw xml_error if there is a problem evaluating the trigger.
+bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
+                      const bool is_registered,         //< The registration state
+                      const bool is_initial_registration,
+                      pjsip_msg* msg,                   //< The message being matched
+                      const CompiledSpt& spt,           //< The Service Point Trigger
+                      const std::string& server_name,
+                      MatchCache& cache,                //< Results for this message
+                      SAS::TrailId trail)
+{
+  if (spt._spt_class == CompiledSpt::REQUEST_URI && spt._unusual_req_uri)
+  {
+    handle_unusual_ifc("Request URI should be a regex that matches either on "
+                       "the hostport of a SIP URI or a telephone number.",
+                       server_name, SASEvent::IFC_UNUSUAL, 0, trail);
+  }
+
+  spt._error.raise(server_name, trail);
+
+  bool ret = false;
+
+  switch (spt._spt_class)
+  {
+  case CompiledSpt::METHOD:
+    if ((spt._is_register) &&
+        (pj_strcmp2(&msg->line.req.method.name, spt._method.c_str()) == 0))
     {
-      if (boost::regex_search(PJUtils::pj_str_to_string(&(header->name)), header_regex))
+      ret = true;
+
+      if ((!spt._reg_types.empty()) || (spt._reg_type_error.is_set()))
       {
-        if (!spt_content)
-        {
-          // We've found a matching header, and don't have to match on content
-          ret = true;
-        }
-        else
+        // Find expiry value from SIP message if it is present to determine
+        // whether we have a de-registration.
+        pj_bool_t dereg = PJUtils::is_deregistration(msg);
+        ret = false;
+
+        for (int reg_type : spt._reg_types)
         {
-          std::string header_value = PJUtils::get_header_value(header);
-          // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once
-          if (content_regex.status())
+          switch (reg_type)
           {
-            content_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_content),
-                                         boost::regex_constants::no_except);
-            if (content_regex.status())
-            {
-              handle_invalid_ifc("Invalid regular expression in Content element for SIPHeader service point trigger",
-                                 server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-            }
+          case INITIAL_REGISTRATION:
+            ret = (is_initial_registration && !dereg);
+            break;
+          case REREGISTRATION:
+            ret = (!is_initial_registration && !dereg);
+            break;
+          case DEREGISTRATION:
+            ret = dereg;
+            break;
+          default:
+            // LCOV_EXCL_START Unreachable
+            TRC_WARNING("Impossible case %d", reg_type);
+            ret = false;
+            break;
+            // LCOV_EXCL_STOP
           }
 
-          if (boost::regex_search(header_value, content_regex))
+          // If we've found a match, stop checking registration types.
+          if (ret)
           {
-            // We've found a matching header, and have matching content in one field
-            ret = true;
+            break;
           }
         }
+
+        if (!ret)
+        {
+          // We didn't find a match before reaching any registration type that
+          // couldn't be parsed.
+          spt._reg_type_error.raise(server_name, trail);
+        }
       }
-      if (ret)
+    }
+    else
+    {
+      ret = (pj_strcmp2(&msg->line.req.method.name, spt._method.c_str()) == 0);
+    }
+    break;
+
+  case CompiledSpt::SIP_HEADER:
+    {
+      MatchCache::Result result = cache.sip_header(msg, spt);
+
+      if ((spt._has_content) && (result.type_matched))
       {
-        // Stop processing other headers once we have a match
-        break;
+        spt._content_error.raise(server_name, trail);
       }
+
+      ret = result.matched;
     }
-  }
-  else if (strcmp(RegDataXMLUtils::SESSION_CASE, name) == 0)
-  {
-    int direction = XMLUtils::parse_integer(node, "session case", 0, 4);
-    switch (direction)
+    break;
+
+  case CompiledSpt::SESSION_CASE:
+    switch (spt._session_case)
     {
     case ORIGINATING_REGISTERED:
       ret = (session_case == SessionCase::Originating) && is_registered;
@@ -279,24 +539,128 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
       break;
     default:
       // LCOV_EXCL_START Unreachable
-      TRC_WARNING("Impossible case %d", direction);
+      TRC_WARNING("Impossible case %d", spt._session_case);
       ret = false;
       break;
     // LCOV_EXCL_STOP
     }
+    break;
+
+  case CompiledSpt::REQUEST_URI:
+    ret = cache.request_uri(msg, spt);
+    break;
+
+  case CompiledSpt::SESSION_DESCRIPTION:
+    {
+      MatchCache::Result result = cache.session_description(msg, spt);
+
+      if ((spt._has_content) && (result.type_matched))
+      {
+        spt._content_error.raise(server_name, trail);
+      }
+
+      ret = result.matched;
+    }
+    break;
+
+  default:
+    TRC_WARNING("Unimplemented iFC service point trigger class: %s",
+                spt._class_name.c_str());
+    ret = false;
+    break;
+  }
+
+  TRC_DEBUG("SPT class %s: result %s", spt._class_name.c_str(), ret ? "true" : "false");
+  return ret;
+}
+
+// Matches a SIPHeader SPT against the message's headers.  The content regex
+// is only matched if there's no error in it.
+Ifc::MatchCache::Result Ifc::MatchCache::sip_header(pjsip_msg* msg,
+                                                    const CompiledSpt& spt)
+{
+  std::unordered_map<std::string, Result>::const_iterator it =
+                                                  _results.find(spt._match_key);
+  if (it != _results.end())
+  {
+    return it->second;
+  }
+
+  if (!_headers_found)
+  {
+    for (pjsip_hdr* hdr = msg->hdr.next; hdr != &msg->hdr; hdr = hdr->next)
+    {
+      _headers.push_back({hdr, PJUtils::pj_str_to_string(&hdr->name), false, ""});
+    }
+
+    _headers_found = true;
   }
-  else if (strcmp(RegDataXMLUtils::REQUEST_URI, name) == 0)
+
+  Result result = {false, false};
+
+  for (Header& header : _headers)
   {
-    boost::regex req_uri_regex;
-    std::string test_string;
+    if (boost::regex_search(header.name, spt._regex))
+    {
+      result.type_matched = true;
 
+      if (!spt._has_content)
+      {
+        // We've found a matching header, and don't have to match on content
+        result.matched = true;
+      }
+      else if (spt._content_error.is_set())
+      {
+        // The error is raised by the caller.
+        break;
+      }
+      else
+      {
+        if (!header.value_found)
+        {
+          header.value = PJUtils::get_header_value(header.hdr);
+          header.value_found = true;
+        }
+
+        if (boost::regex_search(header.value, spt._content_regex))
+        {
+          // We've found a matching header, and have matching content in one field
+          result.matched = true;
+        }
+      }
+    }
+
+    if (result.matched)
+    {
+      // Stop processing other headers once we have a match
+      break;
+    }
+  }
+
+  _results[spt._match_key] = result;
+  return result;
+}
+
+// Matches a RequestURI SPT against the message's Request-URI.
+bool Ifc::MatchCache::request_uri(pjsip_msg* msg,
+                                  const CompiledSpt& spt)
+{
+  std::unordered_map<std::string, Result>::const_iterator it =
+                                                  _results.find(spt._match_key);
+  if (it != _results.end())
+  {
+    return it->second.matched;
+  }
+
+  if (!_req_uri_found)
+  {
     if (PJSIP_URI_SCHEME_IS_TEL(msg->line.req.uri))
     {
       pjsip_tel_uri* req_uri =  (pjsip_tel_uri*)pjsip_uri_get_uri(msg->line.req.uri);
 
       // Match against the telephone-subscriber part of the Req URI, as per Table F.1
       // of 3GPP TS 29.228.
-      test_string = PJUtils::pj_str_to_string(&req_uri->number);
+      _req_uri = PJUtils::pj_str_to_string(&req_uri->number);
     }
     else if (PJSIP_URI_SCHEME_IS_URN(msg->line.req.uri))
     {
@@ -305,7 +669,7 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
       // There is nothing in TS 29.228 about what to match against in the case
       // of a urn URI. So just pull out the entire content (which is everything
       // after "urn:").
-      test_string = PJUtils::pj_str_to_string(&req_uri->content);
+      _req_uri = PJUtils::pj_str_to_string(&req_uri->content);
     }
     else
     {
@@ -313,120 +677,104 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
 
       // Compare against the hostport part of the Req URI, as per Table F.1
       // of 3GPP TS 29.228.
-      std::string hostport = PJUtils::pj_str_to_string(&req_uri->host);
+      _req_uri = PJUtils::pj_str_to_string(&req_uri->host);
 
       if (req_uri->port != 0)
       {
-        hostport += ":" + std::to_string(req_uri->port);
+        _req_uri += ":" + std::to_string(req_uri->port);
       }
-
-      test_string = hostport;
-    }
-
-    std::string req_uri = XMLUtils::get_text_or_cdata(node);
-    if ((req_uri.compare(0, 4, "sip:") == 0) ||
-        (req_uri.compare(0, 4, "tel:") == 0))
-    {
-      handle_unusual_ifc("Request URI should be a regex that matches either on "
-                         "the hostport of a SIP URI or a telephone number.",
-                         server_name, SASEvent::IFC_UNUSUAL, 0, trail);
     }
 
-    req_uri_regex = boost::regex(req_uri,
-                                 boost::regex_constants::no_except);
-    if (req_uri_regex.status())
-    {
-      handle_invalid_ifc("Invalid regular expression in Request URI service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
-      ret = boost::regex_search(test_string, req_uri_regex);
+    _req_uri_found = true;
   }
-  else if (strcmp(RegDataXMLUtils::SESSION_DESCRIPTION, name) == 0)
-  {
-    xml_node<>* spt_line = node->first_node(RegDataXMLUtils::LINE);
-    xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
-    boost::regex line_regex;
-    boost::regex content_regex;
-    char newline = '\n';
 
-    if (!spt_line)
-    {
-      handle_invalid_ifc("Missing Line element for SessionDescription service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
+  bool matched = boost::regex_search(_req_uri, spt._regex);
+  _results[spt._match_key] = {matched, matched};
+  return matched;
+}
 
-    line_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_line),
-                              boost::regex_constants::no_except);
-    if (line_regex.status())
-    {
-      handle_invalid_ifc("Invalid regular expression in Line element for Session Description service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
+// Matches a SessionDescription SPT against the lines of the message's SDP
+// body.  The content regex is only matched if there's no error in it.
+Ifc::MatchCache::Result Ifc::MatchCache::session_description(pjsip_msg* msg,
+                                                             const CompiledSpt& spt)
+{
+  std::unordered_map<std::string, Result>::const_iterator it =
+                                                  _results.find(spt._match_key);
+  if (it != _results.end())
+  {
+    return it->second;
+  }
 
+  if (!_sdp_found)
+  {
     // Check if the message body is SDP.
     if (msg->body &&
         (!pj_stricmp2(&msg->body->content_type.type, "application")) &&
-        (!pj_stricmp2(&msg->body->content_type.subtype, "sdp")))
+        (!pj_stricmp2(&msg->body->content_type.subtype, "sdp")) &&
+        (msg->body->data != NULL))
     {
-      if (msg->body->data != NULL)
+      // Split the message body into each SDP line.
+      std::stringstream sdp((char *)msg->body->data);
+      std::string sdp_line;
+      char newline = '\n';
+      while (std::getline(sdp, sdp_line, newline))
       {
-        // Split the message body into each SDP line.
-        std::stringstream sdp((char *)msg->body->data);
-        std::string sdp_line;
-        while((std::getline(sdp, sdp_line, newline)) && (ret == false))
+        _sdp_lines.push_back(sdp_line);
+      }
+    }
+
+    _sdp_found = true;
+  }
+
+  Result result = {false, false};
+
+  for (const std::string& sdp_line : _sdp_lines)
+  {
+    // Match the line regex on the first character of the SDP line.
+    std::string sdp_identifier(1, sdp_line[0]);
+    if (boost::regex_search(sdp_identifier, spt._regex))
+    {
+      result.type_matched = true;
+
+      if (!spt._has_content)
+      {
+        // We've found a matching line type, and don't have to match on content.
+        result.matched = true;
+      }
+      else if (spt._content_error.is_set())
+      {
+        // The error is raised by the caller.
+        break;
+      }
+      else
+      {
+        // Check the second character of the line is an equals sign, and then
+        // consider the content of the SDP line.
+        if (sdp_line.find_first_of("=") == 1)
         {
-          // Match the line regex on the first character of the SDP line.
-          std::string sdp_identifier(1, sdp_line[0]);
-          if (boost::regex_search(sdp_identifier, line_regex))
+          if (boost::regex_search(sdp_line.begin() + 2,
+                                  sdp_line.end(),
+                                  spt._content_regex))
           {
-            if (!spt_content)
-            {
-              // We've found a matching line type, and don't have to match on content.
-              ret = true;
-            }
-            else
-            {
-              // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once.
-              if (content_regex.status())
-              {
-                content_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_content),
-                                             boost::regex_constants::no_except);
-                if (content_regex.status())
-                {
-                  handle_invalid_ifc("Invalid regular expression in Content element for Session Description service point trigger",
-                                     server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-                }
-              }
-
-              // Check the second character of the line is an equals sign, and then
-              // consider the content of the SDP line.
-              if (sdp_line.find_first_of("=") == 1)
-              {
-                sdp_line.erase(0,2);
-                if (boost::regex_search(sdp_line, content_regex))
-                {
-                  // We've found a matching line.
-                  ret = true;
-                }
-              }
-              else
-              {
-                TRC_WARNING("Found badly formatted SDP line: %s", sdp_line.c_str());
-              }
-            }
+            // We've found a matching line.
+            result.matched = true;
           }
         }
+        else
+        {
+          TRC_WARNING("Found badly formatted SDP line: %s", sdp_line.c_str());
+        }
       }
     }
-  }
-  else
-  {
-    TRC_WARNING("Unimplemented iFC service point trigger class: %s", name);
-    ret = false;
+
+    if (result.matched)
+    {
+      break;
+    }
   }
 
-  TRC_DEBUG("SPT class %s: result %s", name, ret ? "true" : "false");
-  return ret;
+  _results[spt._match_key] = result;
+  return result;
 }
 
 // Check whether the message matches the specified criterion.
@@ -438,39 +786,43 @@ bool Ifc::filter_matches(const SessionCase& session_case,
                          const bool is_registered,
                          const bool is_initial_registration,
                          pjsip_msg* msg,
-                         SAS::TrailId trail) const
+                         SAS::TrailId trail,
+                         MatchCache* cache) const
 {
-  std::string ifc_str;
-  rapidxml::print(std::back_inserter(ifc_str), *_ifc, 0);
+  const CompiledIfc& ifc = *_compiled;
 
-  SAS::Event event(trail, SASEvent::IFC_TESTING, 0);
-  event.add_var_param(ifc_str);
-  SAS::report_event(event);
+  // If the caller isn't sharing a cache between iFCs, SPTs in this iFC can
+  // still share one.
+  MatchCache local_cache;
+  if (cache == NULL)
+  {
+    cache = &local_cache;
+  }
+
+  // The match results are only worth describing if they're going to be
+  // logged to SAS or the trace file.
+  const bool sas_detail = SASSampling::detail_enabled(trail);
+  const bool describe = (sas_detail) || (Log::enabled(Log::DEBUG_LEVEL));
+
+  if (sas_detail)
+  {
+    // Unless full logging is enabled, just log the compact identifier - the
+    // full iFC was logged when it was loaded.
+    SAS::Event event(trail, SASEvent::IFC_TESTING, 0);
+    event.add_var_param(sas_log_full_ifcs ? ifc._ifc_str : ifc._sas_id);
+    SAS::report_event(event);
+  }
   std::string server_name;
 
   try
   {
-    xml_node<>* as = _ifc->first_node(RegDataXMLUtils::APPLICATION_SERVER);
-    if (as == NULL)
-    {
-      handle_invalid_ifc("iFC missing ApplicationServer element", server_name,
-                         SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
+    ifc._as_error.raise(server_name, trail);
+    server_name = ifc._server_name;
 
-    server_name = XMLUtils::get_first_node_value(as, RegDataXMLUtils::SERVER_NAME);
-    if (server_name.empty())
+    ifc._ppi_error.raise(server_name, trail);
+    if (ifc._has_ppi)
     {
-      handle_invalid_ifc("iFC has no ServerName", server_name,
-                         SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
-
-    xml_node<>* profile_part_indicator = _ifc->first_node(RegDataXMLUtils::PROFILE_PART_INDICATOR);
-    if (profile_part_indicator)
-    {
-      bool reg = XMLUtils::parse_integer(profile_part_indicator,
-                                         "ProfilePartIndicator",
-                                         0,
-                                         1) == 0;
+      bool reg = ifc._ppi_reg;
       if (reg != is_registered)
       {
         std::string reg_state = reg ? "reg" : "unreg";
@@ -492,8 +844,7 @@ bool Ifc::filter_matches(const SessionCase& session_case,
     // That means each AsInvocation would have to belong to a pool,
     // though, and that's not easy in the current architecture.
 
-    xml_node<>* trigger = _ifc->first_node(RegDataXMLUtils::TRIGGER_POINT);
-    if (!trigger)
+    if (!ifc._has_trigger)
     {
       TRC_DEBUG("iFC has no trigger point - unconditional match");  // 3GPP TS 29.228 sB.2.2
 
@@ -504,43 +855,37 @@ bool Ifc::filter_matches(const SessionCase& session_case,
       return true;
     }
 
-    bool cnf = XMLUtils::parse_bool(trigger->first_node(RegDataXMLUtils::CONDITION_TYPE_CNF),
-                                    RegDataXMLUtils::CONDITION_TYPE_CNF);
+    ifc._cnf_error.raise(server_name, trail);
+    bool cnf = ifc._cnf;
 
     // In CNF (conjunct-of-disjuncts, i.e., big-AND of ORs), as we
     // work through each SPT we OR it into its group(s). At the end,
     // we AND all the groups together. In DNF we do the converse.
     std::map<int32_t, bool> groups;
 
-    std:: string spt_relation = cnf ? "OR" : "AND";
-    std:: string group_relation = cnf ? "AND" : "OR";
     std:: string ifc_match = "";
-    ifc_match.append(spt_relation).append(" each SPT match result to determine group result.\n");
-    ifc_match.append(group_relation).append(" each group result to determine overall iFC match.\n\n");
+    if (describe)
+    {
+      std:: string spt_relation = cnf ? "OR" : "AND";
+      std:: string group_relation = cnf ? "AND" : "OR";
+      ifc_match.append(spt_relation).append(" each SPT match result to determine group result.\n");
+      ifc_match.append(group_relation).append(" each group result to determine overall iFC match.\n\n");
+    }
 
-    for (xml_node<>* spt = trigger->first_node(RegDataXMLUtils::SPT);
-         spt;
-         spt = spt->next_sibling(RegDataXMLUtils::SPT))
+    for (const CompiledSpt& spt : ifc._spts)
     {
-      xml_node<>* neg_node = spt->first_node(RegDataXMLUtils::CONDITION_NEGATED);
-      bool neg = neg_node && XMLUtils::parse_bool(neg_node, RegDataXMLUtils::CONDITION_NEGATED);
+      spt._negated_error.raise(server_name, trail);
       bool spt_matched = spt_matches(session_case,
                                      is_registered,
                                      is_initial_registration,
                                      msg,
                                      spt,
-                                     ifc_str,
                                      server_name,
-                                     trail) != neg;
+                                     *cache,
+                                     trail) != spt._negated;
 
-      for (xml_node<>* group_node = spt->first_node(RegDataXMLUtils::GROUP);
-           group_node;
-           group_node = group_node->next_sibling(RegDataXMLUtils::GROUP))
+      for (int32_t group_id : spt._groups)
       {
-        int32_t group_id = XMLUtils::parse_integer(group_node,
-                                                   "Group ID",
-                                                   0,
-                                                   std::numeric_limits<int32_t>::max());
         if (groups.find(group_id) == groups.end())
         {
           groups[group_id] = spt_matched;
@@ -551,9 +896,14 @@ bool Ifc::filter_matches(const SessionCase& session_case,
             (groups[group_id] && spt_matched);
         }
 
-        ifc_match.append("SPT in group ").append(std::to_string(group_id))
-          .append(" is ").append(spt_matched ? "matched.\n" : "not matched.\n");
+        if (describe)
+        {
+          ifc_match.append("SPT in group ").append(std::to_string(group_id))
+            .append(" is ").append(spt_matched ? "matched.\n" : "not matched.\n");
+        }
       }
+
+      spt._group_error.raise(server_name, trail);
     }
 
     bool ret = cnf;
@@ -562,30 +912,28 @@ bool Ifc::filter_matches(const SessionCase& session_case,
          group != groups.end();
          ++group)
     {
-      std::string group_result = group->second ? "matched" : "not matched";
-      ifc_match.append("Group ").append(std::to_string(group->first))
-        .append(" is ").append(group_result).append(".\n");
+      if (describe)
+      {
+        std::string group_result = group->second ? "matched" : "not matched";
+        ifc_match.append("Group ").append(std::to_string(group->first))
+          .append(" is ").append(group_result).append(".\n");
+      }
 
       ret = cnf ? (ret && group->second) : (ret || group->second);
     }
 
-    if (ret)
-    {
-      TRC_DEBUG("iFC matches");
-      SAS::Event event(trail, SASEvent::IFC_MATCHED, 0);
-      event.add_var_param(server_name);
-      event.add_var_param(ifc_match);
-      SAS::report_event(event);
-    }
-    else
+    if (sas_detail)
     {
-      TRC_DEBUG("iFC does not match");
-      SAS::Event event(trail, SASEvent::IFC_NOT_MATCHED, 0);
+      SAS::Event event(trail,
+                       ret ? SASEvent::IFC_MATCHED : SASEvent::IFC_NOT_MATCHED,
+                       0);
       event.add_var_param(server_name);
       event.add_var_param(ifc_match);
       SAS::report_event(event);
     }
 
+    TRC_DEBUG(ret ? "iFC matches" : "iFC does not match");
+
     TRC_DEBUG("%s", ifc_match.c_str());
     return ret;
   }
@@ -609,6 +957,14 @@ bool Ifc::filter_matches(const SessionCase& session_case,
   }
 }
 
+void Ifc::report_to_sas(SAS::TrailId trail) const
+{
+  SAS::Event event(trail, SASEvent::IFC_LOADED, 0);
+  event.add_var_param(_compiled->_sas_id);
+  event.add_var_param(_compiled->_ifc_str);
+  SAS::report_event(event);
+}
+
 /// Return the AsInvocation corresponding to this iFC.
 //
 // Only safe to call if filter_matches has returned true (to validate
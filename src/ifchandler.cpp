@@ -124,6 +124,13 @@ Ifcs::Ifcs(std::shared_ptr<xml_document<> > ifc_doc,
          it != ifc_map.end();
          ++it)
     {
+      // Log the full iFC once here, so that only a compact identifier needs
+      // to be logged each time it's evaluated.
+      if (!Ifc::sas_log_full_ifcs)
+      {
+        it->second.report_to_sas(trail);
+      }
+
       _ifcs.push_back(it->second);
     }
   }
@@ -0,0 +1,186 @@
+/**
+ * @file impi_challenge_writer.cpp Implementation of ImpiChallengeWriter
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "impi_challenge_writer.h"
+#include "threadpool.h"
+#include "log.h"
+
+/// The pool of threads used to write challenges.  The work items are the keys
+/// of pending writes.
+class ImpiChallengeWriter::Pool : public ThreadPool<std::string>
+{
+public:
+  Pool(ImpiChallengeWriter* writer,
+       ExceptionHandler* exception_handler,
+       unsigned int num_threads) :
+    ThreadPool<std::string>(num_threads,
+                            exception_handler,
+                            &exception_callback,
+                            0),
+    _writer(writer)
+  {
+  }
+
+  virtual ~Pool() {}
+
+  static void exception_callback(std::string key)
+  {
+    // No recovery behaviour - the request that wrote the challenge has
+    // already completed.
+  }
+
+private:
+  virtual void process_work(std::string& key)
+  {
+    _writer->process_write(key);
+  }
+
+  ImpiChallengeWriter* _writer;
+};
+
+ImpiChallengeWriter::ImpiChallengeWriter(WriteFn write_fn,
+                                         int num_threads,
+                                         int cache_ttl,
+                                         size_t cache_size,
+                                         ExceptionHandler* exception_handler) :
+  _write_fn(write_fn),
+  _cache_ttl(cache_ttl),
+  _pending(),
+  _cache(cache_size, NUM_CACHE_SHARDS, ShardedLRUCacheStatsTables()),
+  _pool(NULL)
+{
+  pthread_mutex_init(&_pending_lock, NULL);
+  _pool = new Pool(this, exception_handler, num_threads);
+  _pool->start();
+}
+
+ImpiChallengeWriter::~ImpiChallengeWriter()
+{
+  _pool->stop();
+  _pool->join();
+  delete _pool; _pool = NULL;
+
+  for (std::map<std::string, PendingWrite>::iterator it = _pending.begin();
+       it != _pending.end();
+       ++it)
+  {
+    delete it->second.auth_challenge;
+  }
+
+  pthread_mutex_destroy(&_pending_lock);
+}
+
+std::string ImpiChallengeWriter::cache_key(const std::string& impi,
+                                           const std::string& nonce)
+{
+  // Neither IMPIs nor nonces can contain spaces.
+  return impi + " " + nonce;
+}
+
+void ImpiChallengeWriter::write(const std::string& impi,
+                                ImpiStore::AuthChallenge* auth_challenge,
+                                SAS::TrailId trail)
+{
+  std::string key = cache_key(impi, auth_challenge->get_nonce());
+
+  if (_cache_ttl > 0)
+  {
+    _cache.put(key,
+               std::shared_ptr<const ImpiStore::AuthChallenge>(auth_challenge->clone()),
+               _cache_ttl);
+  }
+
+  bool queue = false;
+  pthread_mutex_lock(&_pending_lock);
+
+  std::map<std::string, PendingWrite>::iterator it = _pending.find(key);
+
+  if (it == _pending.end())
+  {
+    PendingWrite pending = {impi, auth_challenge->clone(), trail};
+    _pending[key] = pending;
+    queue = true;
+  }
+  else
+  {
+    // There's already a write queued for this challenge that hasn't started,
+    // so just replace the challenge it will write.
+    TRC_DEBUG("Coalescing write of challenge %s for %s",
+              auth_challenge->get_nonce().c_str(), impi.c_str());
+    delete it->second.auth_challenge;
+    it->second.auth_challenge = auth_challenge->clone();
+    it->second.trail = trail;
+  }
+
+  pthread_mutex_unlock(&_pending_lock);
+
+  if (queue)
+  {
+    _pool->add_work(key);
+  }
+}
+
+void ImpiChallengeWriter::process_write(const std::string& key)
+{
+  // Take the write out of the pending map before making it, so that any
+  // later write of the challenge is queued again rather than lost.
+  pthread_mutex_lock(&_pending_lock);
+
+  std::map<std::string, PendingWrite>::iterator it = _pending.find(key);
+
+  if (it == _pending.end())
+  {
+    // LCOV_EXCL_START - each key is only queued once.
+    pthread_mutex_unlock(&_pending_lock);
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  PendingWrite pending = it->second;
+  _pending.erase(it);
+
+  pthread_mutex_unlock(&_pending_lock);
+
+  Store::Status status = _write_fn(pending.impi,
+                                   pending.auth_challenge,
+                                   pending.trail);
+
+  if (status != Store::OK)
+  {
+    TRC_ERROR("Failed to write challenge %s for %s to the IMPI store",
+              pending.auth_challenge->get_nonce().c_str(),
+              pending.impi.c_str());
+  }
+
+  delete pending.auth_challenge;
+}
+
+ImpiStore::AuthChallenge* ImpiChallengeWriter::find(const std::string& impi,
+                                                    const std::string& nonce)
+{
+  std::shared_ptr<const ImpiStore::AuthChallenge> auth_challenge;
+
+  if ((_cache_ttl > 0) && (_cache.get(cache_key(impi, nonce), auth_challenge)))
+  {
+    TRC_DEBUG("Found cached challenge %s for %s", nonce.c_str(), impi.c_str());
+    return auth_challenge->clone();
+  }
+
+  return NULL;
+}
+
+size_t ImpiChallengeWriter::num_pending()
+{
+  pthread_mutex_lock(&_pending_lock);
+  size_t num_pending = _pending.size();
+  pthread_mutex_unlock(&_pending_lock);
+  return num_pending;
+}
@@ -20,6 +20,7 @@
 #include <rapidjson/stringbuffer.h>
 #include "rapidjson/error/en.h"
 #include "json_parse_utils.h"
+#include "batch_utils.h"
 #include <algorithm>
 
 /// Parses a string to a JSON document.
@@ -56,6 +57,20 @@ static const char* const JSON_RESPONSE = "response";
 static const char* const JSON_SCSCF_URI = "scscf-uri";
 static const char* const JSON_TIMER_ID = "timer_id";
 
+// Compact binary field tags.  These must never be reused for a different
+// field.
+static const uint32_t TAG_TYPE = 1;
+static const uint32_t TAG_NONCE = 2;
+static const uint32_t TAG_NONCE_COUNT = 3;
+static const uint32_t TAG_EXPIRES = 4;
+static const uint32_t TAG_CORRELATOR = 5;
+static const uint32_t TAG_SCSCF_URI = 6;
+static const uint32_t TAG_TIMER_ID = 7;
+static const uint32_t TAG_REALM = 8;
+static const uint32_t TAG_QOP = 9;
+static const uint32_t TAG_HA1 = 10;
+static const uint32_t TAG_RESPONSE = 11;
+
 ImpiStore::AuthChallenge* ImpiStore::Impi::get_auth_challenge(const std::string& nonce)
 {
   // Spin through the list of authentication challenges, looking for a
@@ -154,46 +169,182 @@ ImpiStore::AuthChallenge* ImpiStore::AuthChallenge::from_json(rapidjson::Value*
       // LCOV_EXCL_STOP
 
       auth_challenge->_expires = expires;
+      auth_challenge = check_fields(auth_challenge, include_expired);
+    }
+  }
+  else
+  {
+    TRC_WARNING("JSON authentication challenge is not an object - dropping");
+  }
+  return auth_challenge;
+}
 
-      if (auth_challenge->_nonce_count == 0)
-      {
-        // We should always have a nonce_count, but to ease version
-        // forward-compatibility, default it if not found.
-        TRC_WARNING("No \"%s\" field in JSON authentication challenge - defaulting to %u",
-                    JSON_NONCE_COUNT, INITIAL_NONCE_COUNT);
-        auth_challenge->_nonce_count = INITIAL_NONCE_COUNT;
-      }
+ImpiStore::AuthChallenge* ImpiStore::AuthChallenge::check_fields(
+                                      ImpiStore::AuthChallenge* auth_challenge,
+                                      bool include_expired)
+{
+  if (auth_challenge->_nonce_count == 0)
+  {
+    // We should always have a nonce_count, but to ease version
+    // forward-compatibility, default it if not found.
+    TRC_WARNING("No \"%s\" field in authentication challenge - defaulting to %u",
+                JSON_NONCE_COUNT, INITIAL_NONCE_COUNT);
+    auth_challenge->_nonce_count = INITIAL_NONCE_COUNT;
+  }
 
-      if (auth_challenge->_expires == 0)
-      {
-        // We should always have an expires, but to ease version forward-
-        // compatibility, default it if not found.  We use the DEFAULT_EXPIRES
-        // as this should allow at least one authentication to succeed, even
-        // if it won't allow re-authentication later.
-        TRC_WARNING("No \"%s\" field in JSON authentication challenge - defaulting to %d",
-                    JSON_EXPIRES, DEFAULT_EXPIRES);
-        auth_challenge->_expires = time(NULL) + DEFAULT_EXPIRES;
-      }
+  if (auth_challenge->_expires == 0)
+  {
+    // We should always have an expires, but to ease version forward-
+    // compatibility, default it if not found.  We use the DEFAULT_EXPIRES
+    // as this should allow at least one authentication to succeed, even
+    // if it won't allow re-authentication later.
+    TRC_WARNING("No \"%s\" field in authentication challenge - defaulting to %d",
+                JSON_EXPIRES, DEFAULT_EXPIRES);
+    auth_challenge->_expires = time(NULL) + DEFAULT_EXPIRES;
+  }
 
-      // Check we have the nonce and the record hasn't expired - otherwise drop
-      // the record.
-      if (auth_challenge->_nonce == "")
-      {
-        TRC_WARNING("No \"%s\" field in JSON authentication challenge - dropping",
-                    JSON_NONCE);
-        delete auth_challenge; auth_challenge = NULL;
-      }
-      else if ((auth_challenge->_expires < time(NULL)) && (!include_expired))
-      {
-        TRC_DEBUG("Expires in past - dropping");
-        delete auth_challenge; auth_challenge = NULL;
-      }
+  // Check we have the nonce and the record hasn't expired - otherwise drop
+  // the record.
+  if (auth_challenge->_nonce == "")
+  {
+    TRC_WARNING("No \"%s\" field in authentication challenge - dropping",
+                JSON_NONCE);
+    delete auth_challenge; auth_challenge = NULL;
+  }
+  else if ((auth_challenge->_expires < time(NULL)) && (!include_expired))
+  {
+    TRC_DEBUG("Expires in past - dropping");
+    delete auth_challenge; auth_challenge = NULL;
+  }
+
+  return auth_challenge;
+}
+
+void ImpiStore::AuthChallenge::write_binary(CompactEncoding::Writer& writer)
+{
+  // Write all the base AuthChallenge fields, in the IMPI format.  Empty
+  // strings read back the same as missing fields, so aren't written.
+  writer.add_uint(TAG_TYPE, _type);
+  writer.add_bytes(TAG_NONCE, _nonce);
+  writer.add_uint(TAG_NONCE_COUNT, _nonce_count);
+  writer.add_int(TAG_EXPIRES, _expires);
+
+  if (_correlator != "")
+  {
+    writer.add_bytes(TAG_CORRELATOR, _correlator);
+  }
+
+  if (_scscf_uri != "")
+  {
+    writer.add_bytes(TAG_SCSCF_URI, _scscf_uri);
+  }
+
+  if (_timer_id != "")
+  {
+    writer.add_bytes(TAG_TIMER_ID, _timer_id);
+  }
+}
+
+void ImpiStore::AuthChallenge::read_binary_field(uint32_t tag,
+                                                 CompactEncoding::WireType type,
+                                                 uint64_t uint_value,
+                                                 const std::string& bytes_value)
+{
+  if (type == CompactEncoding::VARINT)
+  {
+    switch (tag)
+    {
+      case TAG_NONCE_COUNT:
+        _nonce_count = uint_value;
+        break;
+
+      case TAG_EXPIRES:
+        _expires = CompactEncoding::Reader::to_int(uint_value);
+        break;
+
+      default:
+        break;
     }
   }
   else
   {
-    TRC_WARNING("JSON authentication challenge is not an object - dropping");
+    switch (tag)
+    {
+      case TAG_NONCE:
+        _nonce = bytes_value;
+        break;
+
+      case TAG_CORRELATOR:
+        _correlator = bytes_value;
+        break;
+
+      case TAG_SCSCF_URI:
+        _scscf_uri = bytes_value;
+        break;
+
+      case TAG_TIMER_ID:
+        _timer_id = bytes_value;
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+ImpiStore::AuthChallenge* ImpiStore::AuthChallenge::from_binary(const std::string& data,
+                                                                bool include_expired)
+{
+  // The type is always the first field, so read it and construct the right
+  // type of challenge before reading the other fields into it.
+  ImpiStore::AuthChallenge* auth_challenge = NULL;
+  CompactEncoding::Reader reader(data);
+  uint32_t tag;
+  CompactEncoding::WireType type;
+  uint64_t uint_value;
+  std::string bytes_value;
+
+  if ((!reader.next(tag, type, uint_value, bytes_value)) ||
+      (tag != TAG_TYPE) ||
+      (type != CompactEncoding::VARINT))
+  {
+    TRC_WARNING("Binary authentication challenge has no type - dropping");
+    return NULL;
+  }
+
+  if (uint_value == DIGEST)
+  {
+    auth_challenge = new ImpiStore::DigestAuthChallenge();
+  }
+  else if (uint_value == AKA)
+  {
+    auth_challenge = new ImpiStore::AKAAuthChallenge();
+  }
+  else
+  {
+    TRC_WARNING("Unknown binary authentication challenge type: %lu", uint_value);
+    return NULL;
+  }
+
+  while (reader.next(tag, type, uint_value, bytes_value))
+  {
+    auth_challenge->read_binary_field(tag, type, uint_value, bytes_value);
+  }
+
+  if (reader.error())
+  {
+    TRC_WARNING("Binary authentication challenge is badly formed - dropping");
+    delete auth_challenge; auth_challenge = NULL;
+  }
+  else if (!auth_challenge->has_required_fields())
+  {
+    delete auth_challenge; auth_challenge = NULL;
+  }
+  else
+  {
+    auth_challenge = check_fields(auth_challenge, include_expired);
   }
+
   return auth_challenge;
 }
 
@@ -216,26 +367,66 @@ ImpiStore::DigestAuthChallenge* ImpiStore::DigestAuthChallenge::from_json(rapidj
   JSON_SAFE_GET_STRING_MEMBER(*json, JSON_QOP, auth_challenge->_qop);
   JSON_SAFE_GET_STRING_MEMBER(*json, JSON_HA1, auth_challenge->_ha1);
 
+  if (!auth_challenge->has_required_fields())
+  {
+    delete auth_challenge; auth_challenge = NULL;
+  }
+  return auth_challenge;
+}
+
+void ImpiStore::DigestAuthChallenge::write_binary(CompactEncoding::Writer& writer)
+{
+  ImpiStore::AuthChallenge::write_binary(writer);
+  writer.add_bytes(TAG_REALM, _realm);
+  writer.add_bytes(TAG_QOP, _qop);
+  writer.add_bytes(TAG_HA1, _ha1);
+}
+
+void ImpiStore::DigestAuthChallenge::read_binary_field(uint32_t tag,
+                                                       CompactEncoding::WireType type,
+                                                       uint64_t uint_value,
+                                                       const std::string& bytes_value)
+{
+  if ((type == CompactEncoding::BYTES) && (tag == TAG_REALM))
+  {
+    _realm = bytes_value;
+  }
+  else if ((type == CompactEncoding::BYTES) && (tag == TAG_QOP))
+  {
+    _qop = bytes_value;
+  }
+  else if ((type == CompactEncoding::BYTES) && (tag == TAG_HA1))
+  {
+    _ha1 = bytes_value;
+  }
+  else
+  {
+    ImpiStore::AuthChallenge::read_binary_field(tag, type, uint_value, bytes_value);
+  }
+}
+
+bool ImpiStore::DigestAuthChallenge::has_required_fields()
+{
   // Check we have the realm, qop and ha1 - otherwise drop the record.
-  if (auth_challenge->_realm == "")
+  if (_realm == "")
   {
-    TRC_WARNING("No \"%s\" field in JSON authentication challenge - dropping",
+    TRC_WARNING("No \"%s\" field in authentication challenge - dropping",
                 JSON_REALM);
-    delete auth_challenge; auth_challenge = NULL;
+    return false;
   }
-  else if (auth_challenge->_qop == "")
+  else if (_qop == "")
   {
-    TRC_WARNING("No \"%s\" field in JSON authentication challenge - dropping",
+    TRC_WARNING("No \"%s\" field in authentication challenge - dropping",
                 JSON_QOP);
-    delete auth_challenge; auth_challenge = NULL;
+    return false;
   }
-  else if (auth_challenge->_ha1 == "")
+  else if (_ha1 == "")
   {
-    TRC_WARNING("No \"%s\" field in JSON authentication challenge - dropping",
+    TRC_WARNING("No \"%s\" field in authentication challenge - dropping",
                 JSON_HA1);
-    delete auth_challenge; auth_challenge = NULL;
+    return false;
   }
-  return auth_challenge;
+  return true;
 }
 
 void ImpiStore::AKAAuthChallenge::write_json(rapidjson::Writer<rapidjson::StringBuffer>* writer,
@@ -253,15 +444,45 @@ ImpiStore::AKAAuthChallenge* ImpiStore::AKAAuthChallenge::from_json(rapidjson::V
   ImpiStore::AKAAuthChallenge* auth_challenge = new AKAAuthChallenge();
   JSON_SAFE_GET_STRING_MEMBER(*json, JSON_RESPONSE, auth_challenge->_response);
 
-  // Check we have the response field - otherwise drop the record.
-  if (auth_challenge->_response == "")
+  if (!auth_challenge->has_required_fields())
   {
-    TRC_WARNING("No \"response\" field in JSON authentication challenge - dropping");
     delete auth_challenge; auth_challenge = NULL;
   }
   return auth_challenge;
 }
 
+void ImpiStore::AKAAuthChallenge::write_binary(CompactEncoding::Writer& writer)
+{
+  ImpiStore::AuthChallenge::write_binary(writer);
+  writer.add_bytes(TAG_RESPONSE, _response);
+}
+
+void ImpiStore::AKAAuthChallenge::read_binary_field(uint32_t tag,
+                                                    CompactEncoding::WireType type,
+                                                    uint64_t uint_value,
+                                                    const std::string& bytes_value)
+{
+  if ((type == CompactEncoding::BYTES) && (tag == TAG_RESPONSE))
+  {
+    _response = bytes_value;
+  }
+  else
+  {
+    ImpiStore::AuthChallenge::read_binary_field(tag, type, uint_value, bytes_value);
+  }
+}
+
+bool ImpiStore::AKAAuthChallenge::has_required_fields()
+{
+  // Check we have the response field - otherwise drop the record.
+  if (_response == "")
+  {
+    TRC_WARNING("No \"response\" field in authentication challenge - dropping");
+    return false;
+  }
+  return true;
+}
+
 ImpiStore::Impi::~Impi()
 {
   // Spin through the AuthChallenges, destroying them.
@@ -290,6 +511,24 @@ ImpiStore::~ImpiStore()
 {
 }
 
+void ImpiStore::get_impis(const std::vector<std::string>& impis,
+                          std::vector<Impi*>& impi_objs,
+                          SAS::TrailId trail,
+                          bool include_expired)
+{
+  TRC_DEBUG("Retrieving %lu IMPIs", impis.size());
+
+  // Each result is written by only one thread, so we size the results up
+  // front and don't need to lock them.
+  impi_objs.assign(impis.size(), NULL);
+
+  BatchUtils::run_in_parallel(impis.size(),
+                              [this, &impis, &impi_objs, trail, include_expired](size_t ii)
+  {
+    impi_objs[ii] = get_impi(impis[ii], trail, include_expired);
+  });
+}
+
 void correlate_trail_to_challenge(ImpiStore::AuthChallenge* auth_challenge,
                                   SAS::TrailId trail)
 {
@@ -0,0 +1,122 @@
+/**
+ * @file instrumented_mutex.cpp Mutexes that record how long they are waited
+ * for and held.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+#include <mutex>
+
+#include "instrumented_mutex.h"
+
+namespace LockInstrumentation
+{
+  // The statistics, by name.  These are created on first use, so locks can
+  // be constructed from static initializers.
+  struct Locks
+  {
+    std::mutex lock;
+    std::map<std::string, LockStats*> by_name;
+  };
+
+  static Locks& all_locks()
+  {
+    static Locks* locks = new Locks();
+    return *locks;
+  }
+
+  LockStats* stats(const std::string& name)
+  {
+    Locks& locks = all_locks();
+    std::lock_guard<std::mutex> guard(locks.lock);
+
+    LockStats*& stats = locks.by_name[name];
+    if (stats == NULL)
+    {
+      stats = new LockStats();
+    }
+
+    return stats;
+  }
+
+  std::vector<LockSummary> summaries()
+  {
+    std::vector<std::pair<std::string, LockStats*>> snapshot;
+    {
+      Locks& locks = all_locks();
+      std::lock_guard<std::mutex> guard(locks.lock);
+      snapshot.assign(locks.by_name.begin(), locks.by_name.end());
+    }
+
+    std::vector<LockSummary> summaries;
+    for (const std::pair<std::string, LockStats*>& lock : snapshot)
+    {
+      summaries.push_back({lock.first,
+                           lock.second->acquisitions.load(std::memory_order_relaxed),
+                           lock.second->contended.load(std::memory_order_relaxed),
+                           lock.second->wait_ns.summary(),
+                           lock.second->hold_ns.summary()});
+    }
+
+    return summaries;
+  }
+}
+
+InstrumentedMutex::InstrumentedMutex(const std::string& name, bool recursive) :
+  _stats(LockInstrumentation::stats(name)),
+  _depth(0),
+  _locked_at(0)
+{
+  init(recursive);
+}
+
+InstrumentedMutex::InstrumentedMutex(LockStats* stats, bool recursive) :
+  _stats(stats),
+  _depth(0),
+  _locked_at(0)
+{
+  init(recursive);
+}
+
+InstrumentedMutex::~InstrumentedMutex()
+{
+  pthread_mutex_destroy(&_mutex);
+}
+
+void InstrumentedMutex::init(bool recursive)
+{
+  pthread_mutexattr_t attrs;
+  pthread_mutexattr_init(&attrs);
+
+  if (recursive)
+  {
+    pthread_mutexattr_settype(&attrs, PTHREAD_MUTEX_RECURSIVE);
+  }
+
+  pthread_mutex_init(&_mutex, &attrs);
+  pthread_mutexattr_destroy(&attrs);
+}
+
+void InstrumentedMutex::wait(pthread_cond_t* cond)
+{
+  record_hold();
+  _depth = 0;
+  pthread_cond_wait(cond, &_mutex);
+  locked();
+}
+
+int InstrumentedMutex::timedwait(pthread_cond_t* cond,
+                                 const struct timespec* deadline)
+{
+  record_hold();
+  _depth = 0;
+  int rc = pthread_cond_timedwait(cond, &_mutex, deadline);
+  locked();
+  return rc;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file load_report_queue.cpp Deferring worker threads' latency reports to
+ * the load monitor.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "load_report_queue.h"
+
+const size_t LoadReportQueue::QUEUE_SIZE;
+
+LoadReportQueue::LoadReportQueue(LoadMonitor* load_monitor,
+                                 size_t num_workers) :
+  _load_monitor(load_monitor),
+  _queues(),
+  _flush_lock(),
+  _target_latency_us(load_monitor->get_target_latency_us())
+{
+  for (size_t ii = 0; ii < num_workers; ++ii)
+  {
+    WorkerQueue* queue = new WorkerQueue();
+    queue->head.store(0);
+    queue->tail.store(0);
+    _queues.push_back(queue);
+  }
+}
+
+LoadReportQueue::~LoadReportQueue()
+{
+  for (WorkerQueue* queue : _queues)
+  {
+    delete queue;
+  }
+}
+
+void LoadReportQueue::request_complete(int worker_index,
+                                       unsigned long latency_us,
+                                       SAS::TrailId trail)
+{
+  if ((worker_index >= 0) && ((size_t)worker_index < _queues.size()))
+  {
+    WorkerQueue* queue = _queues[worker_index];
+    size_t head = queue->head.load(std::memory_order_relaxed);
+
+    if (head - queue->tail.load(std::memory_order_acquire) < QUEUE_SIZE)
+    {
+      queue->reports[head % QUEUE_SIZE] = {latency_us, trail};
+      queue->head.store(head + 1, std::memory_order_release);
+      return;
+    }
+  }
+
+  // There's no room on a queue for this report, so pass it on now.
+  _load_monitor->request_complete(latency_us, trail);
+}
+
+void LoadReportQueue::flush()
+{
+  std::unique_lock<std::mutex> lock(_flush_lock, std::try_to_lock);
+  if (!lock.owns_lock())
+  {
+    return;
+  }
+
+  bool reported = false;
+
+  for (WorkerQueue* queue : _queues)
+  {
+    size_t tail = queue->tail.load(std::memory_order_relaxed);
+    size_t head = queue->head.load(std::memory_order_acquire);
+
+    while (tail != head)
+    {
+      const Report& report = queue->reports[tail % QUEUE_SIZE];
+      _load_monitor->request_complete(report.latency_us, report.trail);
+      ++tail;
+      reported = true;
+    }
+
+    queue->tail.store(tail, std::memory_order_release);
+  }
+
+  if (reported)
+  {
+    _target_latency_us.store(_load_monitor->get_target_latency_us(),
+                             std::memory_order_relaxed);
+  }
+}
@@ -59,11 +59,13 @@ extern "C" {
 #include "localstore.h"
 #include "scscfselector.h"
 #include "chronosconnection.h"
+#include "chronos_timer_batcher.h"
 #include "chronoshandlers.h"
 #include "s4_chronoshandlers.h"
 #include "handlers.h"
 #include "s4_handlers.h"
 #include "httpstack.h"
+#include "http_task_pool.h"
 #include "sproutlet.h"
 #include "sproutletproxy.h"
 #include "pluginloader.h"
@@ -74,6 +76,7 @@ extern "C" {
 #include "thread_dispatcher.h"
 #include "exception_handler.h"
 #include "scscfsproutlet.h"
+#include "ifc.h"
 #include "snmp_continuous_accumulator_table.h"
 #include "snmp_continuous_accumulator_by_scope_table.h"
 #include "snmp_event_accumulator_table.h"
@@ -90,6 +93,20 @@ extern "C" {
 #include "astaire_impistore.h"
 #include "updater.h"
 #include "sasservice.h"
+#include "stage_latency.h"
+#include "dependency_monitor.h"
+#include "send_queue_monitor.h"
+#include "profiler.h"
+#include "flight_recorder.h"
+#include "worker_watchdog.h"
+#include "snmp_shards.h"
+#include "warmup.h"
+#include "startup_stages.h"
+#include "sas_sampling.h"
+#include "cpu_affinity.h"
+#include "sproutlet_cpu.h"
+#include "as_connection_pools.h"
+#include "registration_prefetch.h"
 
 enum OptionTypes
 {
@@ -106,13 +123,20 @@ enum OptionTypes
   OPT_MAX_TOKEN_RATE,
   OPT_EXCEPTION_MAX_TTL,
   OPT_SIP_BLACKLIST_DURATION,
+  OPT_SIP_RESOLVER_THREADS,
+  OPT_SIP_HOT_TARGETS,
+  OPT_SIP_MAX_STALE_TARGETS,
+  OPT_SIP_LATENCY_ORDERING,
   OPT_HTTP_BLACKLIST_DURATION,
   OPT_ASTAIRE_BLACKLIST_DURATION,
   OPT_SIP_TCP_CONNECT_TIMEOUT,
   OPT_SIP_TCP_SEND_TIMEOUT,
+  OPT_SIP_TCP_SEND_QUEUE_LIMIT,
   OPT_DNS_TIMEOUT,
   OPT_SESSION_CONTINUED_TIMEOUT_MS,
   OPT_SESSION_TERMINATED_TIMEOUT_MS,
+  OPT_AS_FAILURE_THRESHOLD,
+  OPT_AS_RETRY_INTERVAL_MS,
   OPT_STATELESS_PROXIES,
   OPT_MAX_SPROUTLET_DEPTH,
   OPT_RALF_THREADS,
@@ -120,6 +144,10 @@ enum OptionTypes
   OPT_PBX_SERVICE_ROUTE,
   OPT_NON_REGISTER_AUTHENTICATION,
   OPT_FORCE_THIRD_PARTY_REGISTER_BODY,
+  OPT_THIRD_PARTY_REGISTER_RATE,
+  OPT_INITIAL_REGISTER_RATE,
+  OPT_REGISTER_RETRY_AFTER,
+  OPT_THIRD_PARTY_REFRESH_PERCENT,
   OPT_PIDFILE,
   OPT_SPROUT_HOSTNAME,
   OPT_LISTEN_PORT,
@@ -141,11 +169,81 @@ enum OptionTypes
   OPT_HOMESTEAD_TIMEOUT,
   OPT_ORIG_SIP_TO_TEL_COERCE,
   OPT_REQUEST_ON_QUEUE_TIMEOUT,
+  OPT_REQUEST_DEADLINE,
+  OPT_DEFERRED_LOAD_REPORTS,
   OPT_BLACKLISTED_SCSCFS,
   OPT_LOCAL_ALIASES,
   OPT_REMOTE_ALIASES,
   OPT_ALWAYS_SERVE_REMOTE_ALIASES,
   OPT_RAM_RECORD_EVERYTHING,
+  OPT_WORKER_AFFINITY,
+  OPT_SAS_LOG_FULL_IFCS,
+  OPT_ASYNC_ENUM,
+  OPT_ENUM_CACHE_SIZE,
+  OPT_HSS_CACHE_TTL,
+  OPT_HSS_CACHE_SIZE,
+  OPT_HSS_THREADS,
+  OPT_ICSCF_HSS_CACHE_TTL,
+  OPT_ICSCF_HSS_CACHE_SIZE,
+  OPT_AOR_CACHE_TTL,
+  OPT_AOR_CACHE_SIZE,
+  OPT_SIMSERVS_CACHE_TTL,
+  OPT_SIMSERVS_CACHE_SIZE,
+  OPT_IMPI_STORE_FORMAT,
+  OPT_IMPI_WRITE_THREADS,
+  OPT_IMPI_CACHE_TTL,
+  OPT_IMPI_REMOTE_STORE_TIMEOUT,
+  OPT_AV_PREFETCH_COUNT,
+  OPT_AV_PREFETCH_TTL,
+  OPT_AUTH_CREDENTIAL_CACHE_TTL,
+  OPT_AUTH_TIMEOUT_BATCH_MS,
+  OPT_CHRONOS_TIMER_BATCH_MS,
+  OPT_HTTP_TIMER_THREADS,
+  OPT_HTTP_PROVISIONING_THREADS,
+  OPT_HTTP_MAX_TASKS,
+  OPT_HTTP2_CONNECTIONS,
+  OPT_HOMESTEAD_HEDGE_PERCENTILE,
+  OPT_HOMESTEAD_HEDGE_BUDGET,
+  OPT_TDATA_POOL_CACHE_SIZE,
+  OPT_STATELESS_IN_DIALOG,
+  OPT_COLLAPSE_RECORD_ROUTES,
+  OPT_DEPENDENCY_TARGET_LATENCY_US,
+  OPT_MAX_WORKER_THREADS,
+  OPT_RALF_BATCH_SIZE,
+  OPT_RALF_BATCH_DELAY_MS,
+  OPT_RALF_SPOOL_FILE,
+  OPT_RALF_SPOOL_SIZE_MB,
+  OPT_RALF_MAX_QUEUED_ACRS,
+  OPT_RALF_SPOOL_REPLAY_RATE,
+  OPT_SUPPRESS_EVENT_ACRS,
+  OPT_SAS_DETAIL_PERCENT,
+  OPT_SAS_OVERLOAD_DETAIL_PERCENT,
+  OPT_WEBRTC_THREADS,
+  OPT_UPSTREAM_CONNECTION_SELECTION,
+  OPT_UDP_BATCH_SIZE,
+  OPT_UDP_RX_SOCKETS,
+  OPT_FLIGHT_RECORDER_THRESHOLD_MS,
+  OPT_WARMUP_TARGETS,
+  OPT_WARMUP_IMPUS_FILE,
+  OPT_WARMUP_TIMEOUT_MS,
+  OPT_LAZY_HEADER_PARSING,
+  OPT_RESERVED_WORKER_THREADS,
+  OPT_QUIESCE_DRAIN_RATE,
+  OPT_WORKER_CPUS,
+  OPT_HUGE_PAGE_POOLS,
+  OPT_SAS_MESSAGE_LOGGING_THREAD,
+  OPT_SIP_CAPTURE_DIR,
+  OPT_SIP_CAPTURE_FILE_SIZE,
+  OPT_SIP_CAPTURE_FILES,
+  OPT_SIP_CAPTURE_FILTER,
+  OPT_LOCAL_TERMINATING_SHORTCUT,
+  OPT_CACHE_SERVED_USER_STATE,
+  OPT_SPROUTLET_MAX_WORKERS,
+  OPT_AS_CONNECTIONS,
+  OPT_REGISTRATION_PREFETCH_THREADS,
+  OPT_WORKER_STALL_THRESHOLD_MS,
+  OPT_WORKER_STALL_STACKS,
+  OPT_HTTP_COMPRESSION,
 };
 
 
@@ -204,19 +302,30 @@ const static struct pj_getopt_option long_opt[] =
   { "max-token-rate",               required_argument, 0, OPT_MAX_TOKEN_RATE},
   { "exception-max-ttl",            required_argument, 0, OPT_EXCEPTION_MAX_TTL},
   { "sip-blacklist-duration",       required_argument, 0, OPT_SIP_BLACKLIST_DURATION},
+  { "sip-resolver-threads",         required_argument, 0, OPT_SIP_RESOLVER_THREADS},
+  { "sip-hot-targets",              required_argument, 0, OPT_SIP_HOT_TARGETS},
+  { "sip-max-stale-targets",        required_argument, 0, OPT_SIP_MAX_STALE_TARGETS},
+  { "sip-latency-ordering",         no_argument,       0, OPT_SIP_LATENCY_ORDERING},
   { "http-blacklist-duration",      required_argument, 0, OPT_HTTP_BLACKLIST_DURATION},
   { "astaire-blacklist-duration",   required_argument, 0, OPT_ASTAIRE_BLACKLIST_DURATION},
   { "sip-tcp-connect-timeout",      required_argument, 0, OPT_SIP_TCP_CONNECT_TIMEOUT},
   { "sip-tcp-send-timeout",         required_argument, 0, OPT_SIP_TCP_SEND_TIMEOUT},
+  { "sip-tcp-send-queue-limit",     required_argument, 0, OPT_SIP_TCP_SEND_QUEUE_LIMIT},
   { "dns-timeout",                  required_argument, 0, OPT_DNS_TIMEOUT},
   { "session-continued-timeout",    required_argument, 0, OPT_SESSION_CONTINUED_TIMEOUT_MS},
   { "session-terminated-timeout",   required_argument, 0, OPT_SESSION_TERMINATED_TIMEOUT_MS},
+  { "as-failure-threshold",         required_argument, 0, OPT_AS_FAILURE_THRESHOLD},
+  { "as-retry-interval",            required_argument, 0, OPT_AS_RETRY_INTERVAL_MS},
   { "stateless-proxies",            required_argument, 0, OPT_STATELESS_PROXIES},
   { "non-registering-pbxes",        required_argument, 0, OPT_NON_REGISTERING_PBXES},
   { "ralf-threads",                 required_argument, 0, OPT_RALF_THREADS},
   { "non-register-authentication",  required_argument, 0, OPT_NON_REGISTER_AUTHENTICATION},
   { "pbx-service-route",            required_argument, 0, OPT_PBX_SERVICE_ROUTE},
   { "force-3pr-body",               no_argument,       0, OPT_FORCE_THIRD_PARTY_REGISTER_BODY},
+  { "3pr-rate",                     required_argument, 0, OPT_THIRD_PARTY_REGISTER_RATE},
+  { "3pr-refresh-percent",          required_argument, 0, OPT_THIRD_PARTY_REFRESH_PERCENT},
+  { "initial-register-rate",        required_argument, 0, OPT_INITIAL_REGISTER_RATE},
+  { "register-retry-after",         required_argument, 0, OPT_REGISTER_RETRY_AFTER},
   { "pidfile",                      required_argument, 0, OPT_PIDFILE},
   { "plugin-option",                required_argument, 0, 'N'},
   { "sprout-hostname",              required_argument, 0, OPT_SPROUT_HOSTNAME},
@@ -234,9 +343,79 @@ const static struct pj_getopt_option long_opt[] =
   { "http-acr-logging",             no_argument,       0, OPT_HTTP_ACR_LOGGING},
   { "homestead-timeout",            required_argument, 0, OPT_HOMESTEAD_TIMEOUT},
   { "request-on-queue-timeout",     required_argument, 0, OPT_REQUEST_ON_QUEUE_TIMEOUT},
+  { "request-deadline",             required_argument, 0, OPT_REQUEST_DEADLINE},
+  { "deferred-load-reports",        no_argument,       0, OPT_DEFERRED_LOAD_REPORTS},
   { "blacklisted-scscfs",           required_argument, 0, OPT_BLACKLISTED_SCSCFS},
   { "enable-orig-sip-to-tel-coerce",no_argument,       0, OPT_ORIG_SIP_TO_TEL_COERCE},
   { "ram-record-everything",        no_argument,       0, OPT_RAM_RECORD_EVERYTHING},
+  { "worker-affinity",              no_argument,       0, OPT_WORKER_AFFINITY},
+  { "sas-log-full-ifcs",            no_argument,       0, OPT_SAS_LOG_FULL_IFCS},
+  { "async-enum",                   no_argument,       0, OPT_ASYNC_ENUM},
+  { "enum-cache-size",              required_argument, 0, OPT_ENUM_CACHE_SIZE},
+  { "hss-cache-ttl",                required_argument, 0, OPT_HSS_CACHE_TTL},
+  { "hss-cache-size",               required_argument, 0, OPT_HSS_CACHE_SIZE},
+  { "hss-threads",                  required_argument, 0, OPT_HSS_THREADS},
+  { "icscf-hss-cache-ttl",          required_argument, 0, OPT_ICSCF_HSS_CACHE_TTL},
+  { "icscf-hss-cache-size",         required_argument, 0, OPT_ICSCF_HSS_CACHE_SIZE},
+  { "aor-cache-ttl",                required_argument, 0, OPT_AOR_CACHE_TTL},
+  { "aor-cache-size",               required_argument, 0, OPT_AOR_CACHE_SIZE},
+  { "simservs-cache-ttl",           required_argument, 0, OPT_SIMSERVS_CACHE_TTL},
+  { "simservs-cache-size",          required_argument, 0, OPT_SIMSERVS_CACHE_SIZE},
+  { "impi-store-format",            required_argument, 0, OPT_IMPI_STORE_FORMAT},
+  { "impi-write-threads",           required_argument, 0, OPT_IMPI_WRITE_THREADS},
+  { "impi-cache-ttl",               required_argument, 0, OPT_IMPI_CACHE_TTL},
+  { "impi-remote-store-timeout",    required_argument, 0, OPT_IMPI_REMOTE_STORE_TIMEOUT},
+  { "av-prefetch-count",            required_argument, 0, OPT_AV_PREFETCH_COUNT},
+  { "av-prefetch-ttl",              required_argument, 0, OPT_AV_PREFETCH_TTL},
+  { "auth-credential-cache-ttl",    required_argument, 0, OPT_AUTH_CREDENTIAL_CACHE_TTL},
+  { "auth-timeout-batch-ms",        required_argument, 0, OPT_AUTH_TIMEOUT_BATCH_MS},
+  { "chronos-timer-batch-ms",       required_argument, 0, OPT_CHRONOS_TIMER_BATCH_MS},
+  { "http-timer-threads",           required_argument, 0, OPT_HTTP_TIMER_THREADS},
+  { "http-provisioning-threads",    required_argument, 0, OPT_HTTP_PROVISIONING_THREADS},
+  { "http-max-tasks",               required_argument, 0, OPT_HTTP_MAX_TASKS},
+  { "http2-connections",            required_argument, 0, OPT_HTTP2_CONNECTIONS},
+  { "homestead-hedge-percentile",   required_argument, 0, OPT_HOMESTEAD_HEDGE_PERCENTILE},
+  { "homestead-hedge-budget",       required_argument, 0, OPT_HOMESTEAD_HEDGE_BUDGET},
+  { "tdata-pool-cache-size",        required_argument, 0, OPT_TDATA_POOL_CACHE_SIZE},
+  { "stateless-in-dialog",          no_argument,       0, OPT_STATELESS_IN_DIALOG},
+  { "collapse-record-routes",       no_argument,       0, OPT_COLLAPSE_RECORD_ROUTES},
+  { "dependency-target-latency-us", required_argument, 0, OPT_DEPENDENCY_TARGET_LATENCY_US},
+  { "max-worker-threads",           required_argument, 0, OPT_MAX_WORKER_THREADS},
+  { "ralf-batch-size",              required_argument, 0, OPT_RALF_BATCH_SIZE},
+  { "ralf-batch-delay-ms",          required_argument, 0, OPT_RALF_BATCH_DELAY_MS},
+  { "ralf-spool-file",              required_argument, 0, OPT_RALF_SPOOL_FILE},
+  { "ralf-spool-size-mb",           required_argument, 0, OPT_RALF_SPOOL_SIZE_MB},
+  { "ralf-max-queued-acrs",         required_argument, 0, OPT_RALF_MAX_QUEUED_ACRS},
+  { "ralf-spool-replay-rate",       required_argument, 0, OPT_RALF_SPOOL_REPLAY_RATE},
+  { "suppress-event-acrs",          required_argument, 0, OPT_SUPPRESS_EVENT_ACRS},
+  { "sas-detail-percent",           required_argument, 0, OPT_SAS_DETAIL_PERCENT},
+  { "sas-overload-detail-percent",  required_argument, 0, OPT_SAS_OVERLOAD_DETAIL_PERCENT},
+  { "webrtc-threads",               required_argument, 0, OPT_WEBRTC_THREADS},
+  { "upstream-connection-selection", required_argument, 0, OPT_UPSTREAM_CONNECTION_SELECTION},
+  { "udp-batch-size",               required_argument, 0, OPT_UDP_BATCH_SIZE},
+  { "udp-rx-sockets",               required_argument, 0, OPT_UDP_RX_SOCKETS},
+  { "flight-recorder-threshold-ms", required_argument, 0, OPT_FLIGHT_RECORDER_THRESHOLD_MS},
+  { "warmup-targets",               required_argument, 0, OPT_WARMUP_TARGETS},
+  { "warmup-impus-file",            required_argument, 0, OPT_WARMUP_IMPUS_FILE},
+  { "warmup-timeout-ms",            required_argument, 0, OPT_WARMUP_TIMEOUT_MS},
+  { "lazy-header-parsing",          no_argument,       0, OPT_LAZY_HEADER_PARSING},
+  { "reserved-worker-threads",      required_argument, 0, OPT_RESERVED_WORKER_THREADS},
+  { "quiesce-drain-rate",           required_argument, 0, OPT_QUIESCE_DRAIN_RATE},
+  { "worker-cpus",                  required_argument, 0, OPT_WORKER_CPUS},
+  { "huge-page-pools",              no_argument,       0, OPT_HUGE_PAGE_POOLS},
+  { "sas-message-logging-thread",   no_argument,       0, OPT_SAS_MESSAGE_LOGGING_THREAD},
+  { "sip-capture-dir",              required_argument, 0, OPT_SIP_CAPTURE_DIR},
+  { "sip-capture-file-size",        required_argument, 0, OPT_SIP_CAPTURE_FILE_SIZE},
+  { "sip-capture-files",            required_argument, 0, OPT_SIP_CAPTURE_FILES},
+  { "sip-capture-filter",           required_argument, 0, OPT_SIP_CAPTURE_FILTER},
+  { "local-terminating-shortcut",   no_argument,       0, OPT_LOCAL_TERMINATING_SHORTCUT},
+  { "cache-served-user-state",      no_argument,       0, OPT_CACHE_SERVED_USER_STATE},
+  { "sproutlet-max-workers",        required_argument, 0, OPT_SPROUTLET_MAX_WORKERS},
+  { "as-connections",               required_argument, 0, OPT_AS_CONNECTIONS},
+  { "registration-prefetch-threads", required_argument, 0, OPT_REGISTRATION_PREFETCH_THREADS},
+  { "worker-stall-threshold-ms",    required_argument, 0, OPT_WORKER_STALL_THRESHOLD_MS},
+  { "worker-stall-stacks",          no_argument,       0, OPT_WORKER_STALL_STACKS},
+  { "http-compression",             no_argument,       0, OPT_HTTP_COMPRESSION},
   { NULL,                           0,                 0, 0}
 };
 
@@ -255,6 +434,10 @@ const static int MIN_SESSION_EXPIRES = 90;
 static const std::string SPROUT_HTTP_MGMT_SOCKET_PATH = "/tmp/sprout-http-mgmt-socket";
 static const int NUM_HTTP_MGMT_THREADS = 5;
 
+// The number of registrations that can be waiting to have subscriber data
+// prefetched.  Beyond this, the data is fetched when it is first needed.
+static const int MAX_QUEUED_REGISTRATION_PREFETCHES = 10000;
+
 static void usage(void)
 {
   puts("Options:\n"
@@ -265,6 +448,7 @@ static void usage(void)
        " -s, --scscf <port>         Enable S-CSCF function on the specified port\n"
        " -w, --webrtc-port N        Set local WebRTC listener port to N\n"
        "                            If not specified WebRTC support will be disabled\n"
+       "     --webrtc-threads N     Number of threads handling WebRTC connections (default: 4)\n"
        " -l, --localhost [<hostname>|<private hostname>,<public hostname>]\n"
        "                            Override the local host name with the specified\n"
        "                            hostname(s) or IP address(es).  If one name/address\n"
@@ -279,6 +463,12 @@ static void usage(void)
        "     --always-serve-remote-aliases\n"
        "                            If set to Y, requests for hostnames on the remote alias list will\n"
        "                            always be handled locally.\n"
+       "     --stateless-in-dialog  Forward in-dialog requests that are only record-routed through\n"
+       "                            the S-CSCF, and aren't billed, statelessly without invoking any\n"
+       "                            Sproutlets (default: false)\n"
+       "     --collapse-record-routes\n"
+       "                            Record-route requests that pass through several Sproutlets with\n"
+       "                            a single Record-Route header (default: false)\n"
        " -r, --routing-proxy <name>[,<port>[,<connections>[,<recycle time>]]]\n"
        "                            Operate as an access proxy using the specified node\n"
        "                            as the upstream routing proxy.  Optionally specifies the port,\n"
@@ -286,6 +476,13 @@ static void usage(void)
        "                            often to recycle these connections (by default a\n"
        "                            single connection to the trusted port is used and never\n"
        "                            recycled).\n"
+       "     --upstream-connection-selection <random|least-loaded|affinity>\n"
+       "                            How to pick a connection to the upstream routing proxy for\n"
+       "                            each request - at random, the connection with the fewest\n"
+       "                            transactions in flight weighted by its response latency, or\n"
+       "                            a connection to the node the subscriber's public identity\n"
+       "                            hashes to, so each subscriber is served by the same node\n"
+       "                            while it is available (default: random)\n"
        " -I, --ibcf <IP addresses>  Operate as an IBCF accepting SIP flows from\n"
        "                            the pre-configured list of IP addresses\n"
        " -j, --external-icscf <I-CSCF URI>\n"
@@ -303,6 +500,46 @@ static void usage(void)
        "                            authentication vectors. There is currently no geo-redundant storage\n"
        "                            for authentication vectors. If this option isn't provided, Sprout uses\n"
        "                            the local site registration store.\n"
+       "     --impi-store-format <json|binary>\n"
+       "                            Format in which to write authentication vectors to the\n"
+       "                            IMPI store.  Records in either format are always read, so\n"
+       "                            only switch to binary once every node supports it\n"
+       "                            (default: json)\n"
+       "     --impi-write-threads N Number of threads used to write authentication challenges\n"
+       "                            to the IMPI store in the background.  0 means challenges\n"
+       "                            are written before the request is responded to (default: 0)\n"
+       "     --impi-cache-ttl <secs>\n"
+       "                            Time for which to cache authentication challenges written in\n"
+       "                            the background, so that responses to them can be checked\n"
+       "                            without reading the IMPI store (default: 5)\n"
+       "     --impi-remote-store-timeout <milliseconds>\n"
+       "                            Time to wait for writes and deletes at remote IMPI stores,\n"
+       "                            which are made in parallel with those at the local store.\n"
+       "                            Operations that take longer complete in the background.\n"
+       "                            0 means always wait for them to complete (default: 0)\n"
+       "     --av-prefetch-count N  Number of unused authentication vectors to fetch from\n"
+       "                            Homestead in advance and keep for each recently challenged\n"
+       "                            subscriber, so that challenges can usually be sent without\n"
+       "                            waiting for Homestead.  Requires --hss-threads.  0 means\n"
+       "                            vectors are only fetched when needed (default: 0)\n"
+       "     --av-prefetch-ttl <secs>\n"
+       "                            Time for which to keep unused prefetched authentication\n"
+       "                            vectors (default: 300)\n"
+       "     --auth-credential-cache-ttl <secs>\n"
+       "                            Maximum time for which to cache digest credentials that\n"
+       "                            non-REGISTER requests are authenticated against, so that\n"
+       "                            later requests using the same nonce don't need to read the\n"
+       "                            IMPI store.  0 means don't cache them (default: 0)\n"
+       "     --auth-timeout-batch-ms <milliseconds>\n"
+       "                            Interval over which to collect authentication challenges\n"
+       "                            before setting a single timer to check whether they've\n"
+       "                            timed out (at most 5000).  0 means set a timer for each\n"
+       "                            challenge (default: 0)\n"
+       "     --chronos-timer-batch-ms <milliseconds>\n"
+       "                            Interval over which to collect updates to the Chronos timers\n"
+       "                            of registrations before sending them, sending only the last\n"
+       "                            update to each timer and none that don't change it (at most\n"
+       "                            1000).  0 means send each update as it's made (default: 0)\n"
        " -S, --sas <system name>\n"
        "                            Use specified system name to identify this system to SAS.\n"
        " -H, --hss <server>         Name/IP address of the Homestead cluster\n"
@@ -315,7 +552,37 @@ static void usage(void)
        "                            If 'pcscf,icscf,as', it also Record-Routes between every AS.\n"
        " -G, --ralf <server>        Name/IP address of Ralf (Rf) billing server.\n"
        "     --ralf-threads N       Number of Ralf threads (default: 25)\n"
+       "     --ralf-batch-size N    Hand ACRs to the Ralf threads in batches of up to N, each\n"
+       "                            sent back to back over one connection.  1 hands each ACR\n"
+       "                            over individually (default: 1)\n"
+       "     --ralf-batch-delay-ms <milliseconds>\n"
+       "                            The longest an ACR waits for a batch to fill (default: 10)\n"
+       "     --ralf-spool-file <file>\n"
+       "                            File to spool ACRs to while Ralf is failing or can't keep\n"
+       "                            up.  Spooled ACRs are replayed once Ralf recovers (default:\n"
+       "                            ACRs are not spooled)\n"
+       "     --ralf-spool-size-mb N Size of the Ralf spool file in megabytes (default: 100)\n"
+       "     --ralf-max-queued-acrs N\n"
+       "                            The most ACRs to queue in memory before spooling new ones\n"
+       "                            (default: 10000)\n"
+       "     --ralf-spool-replay-rate N\n"
+       "                            The most spooled ACRs to replay to Ralf each second\n"
+       "                            (default: 100)\n"
+       "     --suppress-event-acrs <rules>\n"
+       "                            Comma separated list of EVENT ACRs not to send to Ralf, each\n"
+       "                            of the form <node>:<method>[:orig|:term], where <node> is\n"
+       "                            scscf, pcscf, icscf, bgcf, ibcf, as or *, and <method> is a\n"
+       "                            SIP method or * (e.g. scscf:REGISTER,*:NOTIFY).  Session\n"
+       "                            ACRs are always sent.  Suppressed ACRs are counted in the\n"
+       "                            sprout_suppressed_event_acrs statistic\n"
        " -X, --xdms <server>        Name/IP address of XDM server\n"
+       "     --simservs-cache-ttl <secs>\n"
+       "                            Time for which the MMTel AS caches users' simservs documents\n"
+       "                            from the XDM server.  Changes on the XDM server may not be\n"
+       "                            seen until the cache expires.  0 disables the cache (default: 0)\n"
+       "     --simservs-cache-size <entries>\n"
+       "                            Maximum number of users to cache simservs documents for\n"
+       "                            (default: 10000)\n"
        "     --dns-server <server>[,<server2>,<server3>]\n"
        "                            IP addresses of the DNS servers to use (defaults to 127.0.0.1)\n"
        " -E, --enum <server>[,<server2>,<server3>]\n"
@@ -324,6 +591,13 @@ static void usage(void)
        " -x, --enum-suffix <suffix> Suffix appended to ENUM domains (default: .e164.arpa)\n"
        " -f, --enum-file <file>     JSON ENUM config file (can't be enabled at same time as\n"
        "                            -E)\n"
+       "     --async-enum           Share a single asynchronous resolver between all threads\n"
+       "                            for ENUM lookups, coalescing concurrent queries for the\n"
+       "                            same domain (default: false)\n"
+       "     --enum-cache-size <entries>\n"
+       "                            Maximum number of ENUM NAPTR results to cache.  Results\n"
+       "                            are cached for the TTL returned by the ENUM server.  0\n"
+       "                            disables the cache (default: 0)\n"
        "     --default-tel-uri-translation\n"
        "                            If no ENUM file or server is configured, always\n"
        "                            convert tel:+1234 to sip:+1234@homedomain\n"
@@ -341,6 +615,10 @@ static void usage(void)
        "                            (in seconds. Min 90. Defaults to 600)\n"
        "     --target-latency-us <usecs>\n"
        "                            Target latency above which throttling applies (default: 100000)\n"
+       "     --dependency-target-latency-us <usecs>\n"
+       "                            Target latency of each of Homestead, Astaire, ENUM and the XDMS,\n"
+       "                            above which requests that need that service are shed.  0 means\n"
+       "                            requests are never shed for a single service (default: 0)\n"
        "     --max-tokens N         Maximum number of tokens allowed in the token bucket (used by\n"
        "                            the throttling code (default: 1000))\n"
        "     --init-token-rate N    Initial token refill rate of tokens in the token bucket (used by\n"
@@ -352,13 +630,91 @@ static void usage(void)
        "     --request-queue-timeout <msecs>\n"
        "                            Maximum time a request can be waiting to be processed before it\n"
        "                            is rejected (used by the throttling code (default: 4000))\n"
+       "     --flight-recorder-threshold-ms <msecs>\n"
+       "                            Log the steps taken to process any message that takes longer\n"
+       "                            than this, or that fails.  0 turns the flight recorder off\n"
+       "                            (default: 1000)\n"
+       "     --worker-stall-threshold-ms <msecs>\n"
+       "                            Log and count worker threads that have been busy on one message\n"
+       "                            for longer than this, with the Sproutlet they are running and\n"
+       "                            the dependency they are waiting on.  0 turns the watchdog off\n"
+       "                            (default: 4000)\n"
+       "     --worker-stall-stacks  Also log the stack of each stuck worker thread (default: false)\n"
+       "     --warmup-targets <uris>\n"
+       "                            Comma-separated list of SIP URIs or host names of next hops\n"
+       "                            to resolve at startup, before taking any SIP traffic\n"
+       "     --warmup-impus-file <file>\n"
+       "                            File of IMPUs, one per line, whose registration data is\n"
+       "                            fetched from the HSS at startup, before taking any SIP traffic\n"
+       "     --warmup-timeout-ms <msecs>\n"
+       "                            Maximum time the startup warmup can take (default: 30000)\n"
        " -T  --http-address <server>\n"
        "                            Specify the HTTP bind address\n"
        " -o  --http-port <port>     Specify the HTTP bind port\n"
        " -q  --http-threads N       Number of HTTP threads (default: 1)\n"
-       " -P, --pjsip-threads N      Number of PJSIP threads (default: 1)\n"
+       "     --http-timer-threads N\n"
+       "                            Number of threads to handle Chronos timer pops on, rather\n"
+       "                            than on the HTTP threads.  0 means handle them on the HTTP\n"
+       "                            threads (default: 0)\n"
+       "     --http-provisioning-threads N\n"
+       "                            Number of threads to handle registration and subscriber\n"
+       "                            management requests on, rather than on the HTTP threads.\n"
+       "                            0 means handle them on the HTTP threads (default: 0)\n"
+       "     --http-max-tasks N\n"
+       "                            Maximum number of requests to each HTTP endpoint that can\n"
+       "                            be waiting for the timer or provisioning threads, beyond\n"
+       "                            which requests are rejected with a 503 (default: 100)\n"
+       " -P, --pjsip-threads N      Number of PJSIP transport threads. Sockets are shared\n"
+       "                            out between the threads (default: 1)\n"
+       "     --tdata-pool-cache-size N\n"
+       "                            Maximum number of released SIP message pools each thread\n"
+       "                            keeps for reuse.  0 means pools are always freed\n"
+       "                            (default: 32)\n"
+       "     --udp-batch-size N     Receive SIP over UDP on a dedicated thread per port, reading\n"
+       "                            up to N datagrams per system call.  0 means PJSIP's own UDP\n"
+       "                            transport is used (default: 0)\n"
+       "     --udp-rx-sockets N     With --udp-batch-size, receive on N sockets sharing each UDP\n"
+       "                            port, each with its own thread (default: 1)\n"
+       "     --lazy-header-parsing  Only parse the IMS headers (P-Asserted-Identity, Path,\n"
+       "                            P-Charging-Vector and so on) of a SIP message when they're\n"
+       "                            used, rather than when the message is received.  Invalid\n"
+       "                            IMS headers are then ignored rather than the message being\n"
+       "                            rejected (default: false)\n"
+       "     --huge-page-pools      Allocate the memory for SIP messages and transactions from\n"
+       "                            2MB huge page arenas rather than the heap, so that it\n"
+       "                            doesn't fragment (default: false)\n"
+       "     --quiesce-drain-rate N\n"
+       "                            When quiescing, shut down at most N client connections each\n"
+       "                            second, so that the clients move to other nodes gradually\n"
+       "                            rather than all reconnecting at once.  0 shuts them all\n"
+       "                            down straight away (default: 0)\n"
        " -B, --billing-cdf <server> Billing CDF server\n"
        " -W, --worker-threads N     Number of worker threads (default: 1)\n"
+       "     --max-worker-threads N\n"
+       "                            If greater than --worker-threads, grow the number of worker\n"
+       "                            threads up to N while messages are queued and the workers\n"
+       "                            are blocked on I/O, and shrink it back when idle.  Not\n"
+       "                            supported with --worker-affinity (default: 0)\n"
+       "     --reserved-worker-threads N\n"
+       "                            Number of worker threads reserved for emergency requests and\n"
+       "                            requests with a Resource-Priority, so that they don't queue\n"
+       "                            behind other traffic.  0 handles them on the normal worker\n"
+       "                            threads (default: 0)\n"
+       "     --worker-affinity      Give each worker thread its own queue, and queue messages\n"
+       "                            to a worker based on their Call-ID. Idle workers steal\n"
+       "                            from busy ones (default: false)\n"
+       "     --worker-cpus <cpus>   Pin the worker threads to the given CPUs, for example\n"
+       "                            0-7,16-23.  Choosing the CPUs of one NUMA node keeps the\n"
+       "                            workers' memory local to them (default: not pinned)\n"
+       "     --request-deadline <milliseconds>\n"
+       "                            Time allowed for processing each SIP message, including the\n"
+       "                            time it spends queued.  Calls to Homestead, the XDMS and\n"
+       "                            ENUM are given no longer than the time left, and aren't made\n"
+       "                            once it has run out.  0 means no deadline (default: 0)\n"
+       "     --deferred-load-reports\n"
+       "                            Have worker threads queue their latency reports to the load\n"
+       "                            monitor for the transport thread to pass on, rather than\n"
+       "                            contending for its lock (default: false)\n"
        " -a, --analytics <directory>\n"
        "                            Generate analytics logs in specified directory\n"
        " -A, --authentication       Enable authentication\n"
@@ -375,11 +731,51 @@ static void usage(void)
        "     --alarms-enabled       Whether SNMP alarms are enabled (default: false)\n"
        "     --override-npdi        Whether the deployment should check for number portability data on \n"
        "                            requests that already have the 'npdi' indicator (default: false)\n"
+       "     --local-terminating-shortcut\n"
+       "                            When originating services complete for a call to a subscriber\n"
+       "                            registered with this S-CSCF, route it straight to terminating\n"
+       "                            processing here rather than through the I-CSCF (default: false)\n"
+       "     --cache-served-user-state\n"
+       "                            Keep the served user's subscriber state from the HSS for the\n"
+       "                            duration of their application server chain, rather than reading\n"
+       "                            it again each time the request comes back from an application\n"
+       "                            server (default: false)\n"
+       "     --sproutlet-max-workers <comma-separated-list>\n"
+       "                            Limits on the number of worker threads each Sproutlet may\n"
+       "                            occupy, as <service name>=N.  New transactions for a Sproutlet\n"
+       "                            at its limit are rejected with a 503, so a Sproutlet that is\n"
+       "                            blocked on a slow backend can't stop the others from running\n"
+       "                            (default: no limits)\n"
+       "     --as-connections <connections>[,<recycle time>]\n"
+       "                            Keep a pool of this many TCP connections open to each\n"
+       "                            application server with a transport=tcp ServerName, and\n"
+       "                            recycle each connection every <recycle time> seconds on\n"
+       "                            average (default: no pools, recycle time 600)\n"
+       "     --registration-prefetch-threads N\n"
+       "                            Number of threads that fetch subscribers' data into the\n"
+       "                            local caches (such as the MMTel simservs cache) when they\n"
+       "                            register, so their first calls don't wait for it\n"
+       "                            (default: 0, no prefetching)\n"
        "     --exception-max-ttl <secs>\n"
        "                            The maximum time before the process exits if it hits an exception.\n"
        "                            The actual time is randomised.\n"
        "     --sip-blacklist-duration <secs>\n"
        "                            The amount of time to blacklist a SIP peer when it is unresponsive.\n"
+       "     --sip-resolver-threads N\n"
+       "                            Number of threads used to resolve the destinations of\n"
+       "                            proxied SIP requests, so that worker threads don't wait\n"
+       "                            for DNS.  0 means destinations are resolved on the worker\n"
+       "                            threads (default: 0)\n"
+       "     --sip-hot-targets N    Number of recently used SIP next hops whose targets are\n"
+       "                            refreshed from DNS, on the SIP resolver threads, when\n"
+       "                            their records expire.  0 disables this (default: 0)\n"
+       "     --sip-max-stale-targets <secs>\n"
+       "                            Time for which a hot next hop's previous targets are used\n"
+       "                            after its DNS records expire, while they are refreshed\n"
+       "                            (default: 5)\n"
+       "     --sip-latency-ordering\n"
+       "                            Prefer SIP SRV targets that have been responding more quickly over\n"
+       "                            others with the same SRV priority\n"
        "     --http-blacklist-duration <secs>\n"
        "                            The amount of time to blacklist an HTTP peer when it is unresponsive.\n"
        "     --astaire-blacklist-duration <secs>\n"
@@ -389,6 +785,10 @@ static void usage(void)
        "     --sip-tcp-send-timeout <milliseconds>\n"
        "                            The amount of time to wait for data sent on a SIP TCP connection to be\n"
        "                            acknowledged by the peer.\n"
+       "     --sip-tcp-send-queue-limit <bytes>\n"
+       "                            The amount of data waiting to be sent on a SIP TCP connection above\n"
+       "                            which new requests are sent to another server or failed, or 0 for no\n"
+       "                            limit (default: 0)\n"
        "     --enable-orig-sip-to-tel-coerce\n"
        "                            Whether to treat originating SIP URIs that correspond to global phone\n"
        "                            numbers as Tel URIs.\n"
@@ -402,6 +802,14 @@ static void usage(void)
        "                            If an Application Server with default handling of 'terminate session'\n"
        "                            is unresponsive, this is the time that sprout will wait (in ms)\n"
        "                            before terminating the session.\n"
+       "     --as-failure-threshold <failures>\n"
+       "                            The number of consecutive failures (timeouts or 5xx responses) after\n"
+       "                            which sprout stops invoking an Application Server, and applies the\n"
+       "                            iFC's default handling straight away instead (default: 0, which means\n"
+       "                            failing Application Servers are always invoked).\n"
+       "     --as-retry-interval <milliseconds>\n"
+       "                            How often sprout sends one request to an Application Server it has\n"
+       "                            stopped invoking, to test whether it has recovered (default: 10000).\n"
        "     --stateless-proxies <comma-separated-list>\n"
        "                            A comma separated list of domain names that are treated as SIP\n"
        "                            stateless proxies. This field should reflect how the servers are\n"
@@ -426,6 +834,26 @@ static void usage(void)
        "     --force-3pr-body       Always include the original REGISTER and 200 OK in the body of\n"
        "                            third-party REGISTER messages to application servers, even if the\n"
        "                            User-Data doesn't specify it\n"
+       "     --3pr-rate N           The most third-party REGISTERs to send to application servers\n"
+       "                            each second.  Any over this rate are queued, so that a burst\n"
+       "                            of registrations doesn't become a burst at the application\n"
+       "                            servers.  0 means no limit (default: 0)\n"
+       "     --3pr-refresh-percent N\n"
+       "                            Only pass a re-registration on to an application server once\n"
+       "                            N% of its last third-party registration's expiry has passed.\n"
+       "                            Application servers that want the REGISTER or 200 OK in the\n"
+       "                            body still see every re-registration.  0 passes on every\n"
+       "                            re-registration (default: 0)\n"
+       "     --initial-register-rate N\n"
+       "                            The most initial registrations to accept each second, so that\n"
+       "                            a registration storm after an outage doesn't overload Sprout.\n"
+       "                            Any over this rate are rejected with a 503 and a Retry-After.\n"
+       "                            Re-registrations are always accepted.  0 means no limit\n"
+       "                            (default: 0)\n"
+       "     --register-retry-after <secs>\n"
+       "                            The longest Retry-After to give initial registrations rejected\n"
+       "                            because of --initial-register-rate.  Each is given a random\n"
+       "                            Retry-After between half of this and this (default: 60)\n"
        "     --nonce-count-supported\n"
        "                            Whether sprout accepts authentication responses with a nonce count\n"
        "                            greater than 1\n"
@@ -435,6 +863,31 @@ static void usage(void)
        "     --sas-use-signaling-interface\n"
        "                            Whether SAS traffic is to be dispatched over the signaling network\n"
        "                            interface rather than the default management interface\n"
+       "     --sas-log-full-ifcs    Log the full XML of each iFC to SAS every time it is evaluated,\n"
+       "                            rather than once when the iFCs are loaded (default: false)\n"
+       "     --sas-message-logging-thread\n"
+       "                            Build and report the SAS events holding SIP messages on a\n"
+       "                            background thread, rather than on the thread sending or\n"
+       "                            receiving the message.  Message events may then appear a\n"
+       "                            little later in their trails (default: false)\n"
+       "     --sip-capture-dir <directory>\n"
+       "                            Capture the SIP messages sent and received to pcapng files\n"
+       "                            in this directory, which Wireshark can read (default: not\n"
+       "                            captured)\n"
+       "     --sip-capture-file-size <MB>\n"
+       "                            The size of each SIP capture file (default: 64)\n"
+       "     --sip-capture-files N  The number of SIP capture files to rotate through\n"
+       "                            (default: 4)\n"
+       "     --sip-capture-filter <comma-separated-list>\n"
+       "                            Only capture messages with these Call-IDs, or that contain\n"
+       "                            these IMPUs (entries starting sip:, sips: or tel:)\n"
+       "                            (default: capture all messages)\n"
+       "     --sas-detail-percent N The percentage of SAS trails that get detailed events about the\n"
+       "                            progress of processing.  Messages, markers and errors are always\n"
+       "                            logged (default: 100)\n"
+       "     --sas-overload-detail-percent N\n"
+       "                            The percentage of SAS trails that get detailed events while\n"
+       "                            Sprout is rejecting requests due to overload (default: 100)\n"
        "     --disable-tcp-switch\n"
        "                            Whether to disable TCP-to-UDP uplift when messages are greater than.\n"
        "                            1300 bytes.\n"
@@ -456,6 +909,47 @@ static void usage(void)
        "     --http-acr-logging     Whether to include the bodies of ACR HTTP requests when they are logged \n"
        "                            to SAS\n"
        "     --homestead-timeout    The timeout in ms to use on HTTP requests to Homestead\n"
+       "     --hss-cache-ttl <secs> Time for which to cache subscriber data from Homestead for\n"
+       "                            calls to registered and unregistered subscribers.  The cache\n"
+       "                            is local to this node, so subscriber changes made through\n"
+       "                            other nodes may not be seen until it expires.  0 disables\n"
+       "                            the cache (default: 0)\n"
+       "     --hss-cache-size <entries>\n"
+       "                            Maximum number of IMPUs to cache subscriber data for\n"
+       "                            (default: 10000)\n"
+       "     --hss-threads N        Number of threads used to make asynchronous requests to\n"
+       "                            Homestead.  0 means asynchronous requests are made on the\n"
+       "                            calling thread (default: 0)\n"
+       "     --icscf-hss-cache-ttl <secs>\n"
+       "                            Time for which the I-CSCF caches the results of its\n"
+       "                            location (LIR) and user authorization (UAR) queries to\n"
+       "                            Homestead.  A cached result is discarded if the I-CSCF\n"
+       "                            has to retry to a different S-CSCF.  0 disables the\n"
+       "                            cache (default: 0)\n"
+       "     --icscf-hss-cache-size <entries>\n"
+       "                            Maximum number of I-CSCF query results to cache\n"
+       "                            (default: 10000)\n"
+       "     --http2-connections N  Number of HTTP/2 connections to keep open to each of\n"
+       "                            Homestead and the XDMS, over which all requests are\n"
+       "                            multiplexed.  The servers must support HTTP/2 without\n"
+       "                            upgrade.  0 means use HTTP/1.1 (default: 0)\n"
+       "     --homestead-hedge-percentile N\n"
+       "                            If a GET to Homestead hasn't been answered within the N\n"
+       "                            percentile of recent latencies, send it again on another\n"
+       "                            HTTP/2 connection and use the first response.  Requires\n"
+       "                            --http2-connections of at least 2.  0 disables hedging\n"
+       "                            (default: 0)\n"
+       "     --homestead-hedge-budget N\n"
+       "                            The most hedged Homestead requests to send, as a\n"
+       "                            percentage of all requests (default: 5)\n"
+       "     --http-compression     Offer gzip and deflate compressed responses to Homestead\n"
+       "                            and the XDMS (default: false)\n"
+       "     --aor-cache-ttl <secs> Time for which to cache registration data read from the\n"
+       "                            store to route calls.  The cache is local to this node,\n"
+       "                            so registration changes made through other nodes may not\n"
+       "                            be seen until it expires.  0 disables the cache (default: 0)\n"
+       "     --aor-cache-size <entries>\n"
+       "                            Maximum number of AoRs to cache (default: 10000)\n"
        "     --blacklisted-scscfs   List of URIs of blacklisted S-CSCFs\n"
        " -N, --plugin-option <plugin>,<name>,<value>\n"
        "                            Provide an option value to a plugin.\n"
@@ -715,6 +1209,16 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("Always serving remote aliases.");
       break;
 
+    case OPT_STATELESS_IN_DIALOG:
+      options->stateless_in_dialog = true;
+      TRC_INFO("Forwarding unbilled in-dialog requests statelessly.");
+      break;
+
+    case OPT_COLLAPSE_RECORD_ROUTES:
+      options->collapse_record_routes = true;
+      TRC_INFO("Collapsing the Sproutlets' Record-Routes.");
+      break;
+
 
     case 'r':
       {
@@ -816,6 +1320,90 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_RALF_BATCH_SIZE:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->ralf_batch_size,
+                                    ralf_batch_size,
+                                    Ralf ACR batch size);
+      }
+      break;
+
+    case OPT_RALF_BATCH_DELAY_MS:
+      {
+        VALIDATE_INT_PARAM(options->ralf_batch_delay_ms,
+                           ralf_batch_delay_ms,
+                           Ralf ACR batch delay (in milliseconds));
+      }
+      break;
+
+    case OPT_RALF_SPOOL_FILE:
+      options->ralf_spool_file = std::string(pj_optarg);
+      TRC_INFO("Ralf spool file set to %s", pj_optarg);
+      break;
+
+    case OPT_UPSTREAM_CONNECTION_SELECTION:
+      if (strcmp(pj_optarg, "least-loaded") == 0)
+      {
+        options->upstream_least_loaded = true;
+        options->upstream_affinity = false;
+        TRC_INFO("Upstream connections selected by load");
+      }
+      else if (strcmp(pj_optarg, "affinity") == 0)
+      {
+        options->upstream_least_loaded = false;
+        options->upstream_affinity = true;
+        TRC_INFO("Upstream connections selected by subscriber affinity");
+      }
+      else if (strcmp(pj_optarg, "random") == 0)
+      {
+        options->upstream_least_loaded = false;
+        options->upstream_affinity = false;
+      }
+      else
+      {
+        TRC_ERROR("Invalid upstream connection selection %s", pj_optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_WEBRTC_THREADS:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->webrtc_threads,
+                                    webrtc_threads,
+                                    Number of WebRTC threads);
+      }
+      break;
+
+    case OPT_RALF_SPOOL_SIZE_MB:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->ralf_spool_size_mb,
+                                    ralf_spool_size_mb,
+                                    Ralf spool file size (in megabytes));
+      }
+      break;
+
+    case OPT_RALF_MAX_QUEUED_ACRS:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->ralf_max_queued_acrs,
+                                    ralf_max_queued_acrs,
+                                    Maximum ACRs queued for Ralf);
+      }
+      break;
+
+    case OPT_RALF_SPOOL_REPLAY_RATE:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->ralf_spool_replay_rate,
+                                    ralf_spool_replay_rate,
+                                    Ralf spool replay rate (in ACRs per second));
+      }
+      break;
+
+    case OPT_SUPPRESS_EVENT_ACRS:
+      options->suppress_event_acrs = std::string(pj_optarg);
+      TRC_INFO("EVENT ACR suppression rules: %s",
+               options->suppress_event_acrs.c_str());
+      break;
+
     case 'E':
       options->enum_servers.clear();
       Utils::split_string(std::string(pj_optarg), ',', options->enum_servers, 0, false);
@@ -872,6 +1460,60 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_DEPENDENCY_TARGET_LATENCY_US:
+      {
+        VALIDATE_INT_PARAM(options->dependency_target_latency_us,
+                           dependency_target_latency_us,
+                           Dependency target latency (in microseconds));
+      }
+      break;
+
+    case OPT_WARMUP_TARGETS:
+      options->warmup_targets.clear();
+      Utils::split_string(std::string(pj_optarg), ',', options->warmup_targets, 0, true);
+      TRC_INFO("%d warmup targets passed on the command line: %s",
+               options->warmup_targets.size(), pj_optarg);
+      break;
+
+    case OPT_WARMUP_IMPUS_FILE:
+      options->warmup_impus_file = std::string(pj_optarg);
+      TRC_INFO("Warmup IMPUs file set to %s", pj_optarg);
+      break;
+
+    case OPT_WARMUP_TIMEOUT_MS:
+      {
+        VALIDATE_INT_PARAM(options->warmup_timeout_ms,
+                           warmup_timeout_ms,
+                           Warmup timeout (in milliseconds));
+      }
+      break;
+
+    case OPT_FLIGHT_RECORDER_THRESHOLD_MS:
+      {
+        VALIDATE_INT_PARAM(options->flight_recorder_threshold_ms,
+                           flight_recorder_threshold_ms,
+                           Flight recorder threshold (in milliseconds));
+      }
+      break;
+
+    case OPT_WORKER_STALL_THRESHOLD_MS:
+      {
+        VALIDATE_INT_PARAM(options->worker_stall_threshold_ms,
+                           worker_stall_threshold_ms,
+                           Worker stall threshold (in milliseconds));
+      }
+      break;
+
+    case OPT_WORKER_STALL_STACKS:
+      options->worker_stall_stacks = true;
+      TRC_INFO("Stacks of stuck worker threads will be logged");
+      break;
+
+    case OPT_HTTP_COMPRESSION:
+      options->http_compression = true;
+      TRC_INFO("Compressed responses will be offered to Homestead and the XDMS");
+      break;
+
     case OPT_MAX_TOKENS:
       {
         VALIDATE_INT_PARAM_NON_ZERO(options->max_tokens,
@@ -903,6 +1545,14 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case 'P':
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->pjsip_threads,
+                                    pjsip_threads,
+                                    Number of PJSIP transport threads);
+      }
+      break;
+
     case 'a':
       options->analytics_enabled = PJ_TRUE;
       options->analytics_directory = std::string(pj_optarg);
@@ -1000,6 +1650,77 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("Number portability lookups will be done on URIs containing the 'npdi' indicator");
       break;
 
+    case OPT_LOCAL_TERMINATING_SHORTCUT:
+      options->local_terminating_shortcut = true;
+      TRC_INFO("Calls to subscribers registered here will bypass the I-CSCF");
+      break;
+
+    case OPT_CACHE_SERVED_USER_STATE:
+      options->cache_served_user_state = true;
+      TRC_INFO("Served user state will be cached for the duration of each AS chain");
+      break;
+
+    case OPT_AS_CONNECTIONS:
+      {
+        std::vector<std::string> as_connection_options;
+        Utils::split_string(std::string(pj_optarg), ',', as_connection_options, 0, false);
+        int connections = 0;
+        int recycle = options->as_connection_recycle;
+
+        if ((as_connection_options.empty()) ||
+            (!validated_atoi(as_connection_options[0].c_str(), connections)) ||
+            (connections < 0) ||
+            ((as_connection_options.size() > 1) &&
+             ((!validated_atoi(as_connection_options[1].c_str(), recycle)) ||
+              (recycle <= 0))))
+        {
+          TRC_ERROR("Invalid application server connection pool %s", pj_optarg);
+          return -1;
+        }
+
+        options->as_connections = connections;
+        options->as_connection_recycle = recycle;
+        TRC_INFO("Application server connection pools:");
+        TRC_INFO("  connections = %d", options->as_connections);
+        TRC_INFO("  recycle time = %d seconds", options->as_connection_recycle);
+      }
+      break;
+
+    case OPT_REGISTRATION_PREFETCH_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->registration_prefetch_threads,
+                           registration_prefetch_threads,
+                           Registration prefetch threads);
+      }
+      break;
+
+    case OPT_SPROUTLET_MAX_WORKERS:
+      {
+        std::vector<std::string> limits;
+        Utils::split_string(std::string(pj_optarg), ',', limits, 0, true);
+        options->sproutlet_max_workers.clear();
+
+        for (const std::string& limit : limits)
+        {
+          std::string::size_type sep = limit.find('=');
+          int max_workers = 0;
+
+          if ((sep == std::string::npos) ||
+              (sep == 0) ||
+              (!validated_atoi(limit.substr(sep + 1).c_str(), max_workers)) ||
+              (max_workers < 0))
+          {
+            TRC_ERROR("Invalid Sproutlet worker limit %s", limit.c_str());
+            return -1;
+          }
+
+          options->sproutlet_max_workers[limit.substr(0, sep)] = max_workers;
+          TRC_INFO("Sproutlet %s may occupy at most %d worker threads",
+                   limit.substr(0, sep).c_str(), max_workers);
+        }
+      }
+      break;
+
     case OPT_EXCEPTION_MAX_TTL:
       {
         VALIDATE_INT_PARAM(options->exception_max_ttl,
@@ -1016,6 +1737,35 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_SIP_RESOLVER_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->sip_resolver_threads,
+                           sip_resolver_threads,
+                           Number of SIP resolver threads);
+      }
+      break;
+
+    case OPT_SIP_HOT_TARGETS:
+      {
+        VALIDATE_INT_PARAM(options->sip_hot_targets,
+                           sip_hot_targets,
+                           Number of SIP hot targets);
+      }
+      break;
+
+    case OPT_SIP_MAX_STALE_TARGETS:
+      {
+        VALIDATE_INT_PARAM(options->sip_max_stale_targets,
+                           sip_max_stale_targets,
+                           SIP maximum stale targets time);
+      }
+      break;
+
+    case OPT_SIP_LATENCY_ORDERING:
+      options->sip_latency_ordering = true;
+      TRC_INFO("SIP targets ordered by latency");
+      break;
+
     case OPT_HTTP_BLACKLIST_DURATION:
       {
         VALIDATE_INT_PARAM(options->http_blacklist_duration,
@@ -1046,6 +1796,14 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_SIP_TCP_SEND_QUEUE_LIMIT:
+      {
+        VALIDATE_INT_PARAM(options->sip_tcp_send_queue_limit,
+                           sip_tcp_send_queue_limit,
+                           SIP TCP send queue limit);
+      }
+      break;
+
     case OPT_DNS_TIMEOUT:
       {
         VALIDATE_INT_PARAM(options->dns_timeout,
@@ -1070,6 +1828,22 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_AS_FAILURE_THRESHOLD:
+      {
+        VALIDATE_INT_PARAM(options->as_failure_threshold,
+                           as_failure_threshold,
+                           AS failure threshold);
+      }
+      break;
+
+    case OPT_AS_RETRY_INTERVAL_MS:
+      {
+        VALIDATE_INT_PARAM(options->as_retry_interval_ms,
+                           as_retry_interval_ms,
+                           AS retry interval (in ms));
+      }
+      break;
+
     case OPT_STATELESS_PROXIES:
       {
         std::vector<std::string> stateless_proxies;
@@ -1142,6 +1916,38 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_THIRD_PARTY_REGISTER_RATE:
+      {
+        VALIDATE_INT_PARAM(options->third_party_register_rate,
+                           third_party_register_rate,
+                           Third-party REGISTER rate);
+      }
+      break;
+
+    case OPT_THIRD_PARTY_REFRESH_PERCENT:
+      {
+        VALIDATE_INT_PARAM(options->third_party_refresh_percent,
+                           third_party_refresh_percent,
+                           Third-party re-REGISTER percentage);
+      }
+      break;
+
+    case OPT_INITIAL_REGISTER_RATE:
+      {
+        VALIDATE_INT_PARAM(options->initial_register_rate,
+                           initial_register_rate,
+                           Initial REGISTER rate);
+      }
+      break;
+
+    case OPT_REGISTER_RETRY_AFTER:
+      {
+        VALIDATE_INT_PARAM(options->register_retry_after,
+                           register_retry_after,
+                           REGISTER Retry-After);
+      }
+      break;
+
     case OPT_PIDFILE:
       options->pidfile = std::string(pj_optarg);
       TRC_INFO("Pidfile set to %s", pj_optarg);
@@ -1157,6 +1963,72 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("SAS connections created in the signaling namespace");
       break;
 
+    case OPT_SAS_LOG_FULL_IFCS:
+      Ifc::sas_log_full_ifcs = true;
+      TRC_INFO("Full iFCs will be logged to SAS on every evaluation");
+      break;
+
+    case OPT_SAS_MESSAGE_LOGGING_THREAD:
+      options->sas_message_logging_thread = true;
+      TRC_INFO("SIP messages will be logged to SAS on a background thread");
+      break;
+
+    case OPT_SIP_CAPTURE_DIR:
+      options->sip_capture_dir = std::string(pj_optarg);
+      TRC_INFO("SIP messages will be captured to %s", pj_optarg);
+      break;
+
+    case OPT_SIP_CAPTURE_FILE_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->sip_capture_file_size,
+                           sip_capture_file_size,
+                           SIP capture file size in MB);
+      }
+      break;
+
+    case OPT_SIP_CAPTURE_FILES:
+      {
+        VALIDATE_INT_PARAM(options->sip_capture_files,
+                           sip_capture_files,
+                           Number of SIP capture files);
+      }
+      break;
+
+    case OPT_SIP_CAPTURE_FILTER:
+      options->sip_capture_filters.clear();
+      Utils::split_string(std::string(pj_optarg), ',', options->sip_capture_filters, 0, true);
+      TRC_INFO("%d SIP capture filters passed on the command line: %s",
+               options->sip_capture_filters.size(), pj_optarg);
+      break;
+
+    case OPT_SAS_DETAIL_PERCENT:
+      {
+        VALIDATE_INT_PARAM(options->sas_detail_percent,
+                           sas_detail_percent,
+                           Percentage of SAS trails with detailed events);
+
+        if (options->sas_detail_percent > 100)
+        {
+          TRC_ERROR("Invalid value for sas_detail_percent: %s", pj_optarg);
+          return -1;
+        }
+      }
+      break;
+
+    case OPT_SAS_OVERLOAD_DETAIL_PERCENT:
+      {
+        VALIDATE_INT_PARAM(options->sas_overload_detail_percent,
+                           sas_overload_detail_percent,
+                           Percentage of SAS trails with detailed events in overload);
+
+        if (options->sas_overload_detail_percent > 100)
+        {
+          TRC_ERROR("Invalid value for sas_overload_detail_percent: %s", pj_optarg);
+          return -1;
+        }
+      }
+      break;
+
     case OPT_DISABLE_TCP_SWITCH:
       options->disable_tcp_switch = true;
       TRC_INFO("Switching to TCP is disabled");
@@ -1167,6 +2039,16 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("Treatment of user=phone orig SIP URIs as Tel URIs enabled");
       break;
 
+    case OPT_LAZY_HEADER_PARSING:
+      options->lazy_header_parsing = true;
+      TRC_INFO("Lazy parsing of IMS headers enabled");
+      break;
+
+    case OPT_HUGE_PAGE_POOLS:
+      options->huge_page_pools = true;
+      TRC_INFO("SIP pools will be allocated from huge page arenas");
+      break;
+
     case 'N':
       {
         std::vector<std::string> fields;
@@ -1240,6 +2122,58 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("Bodies of ACR HTTP messages will be logged to SAS");
       break;
 
+    case OPT_ENUM_CACHE_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->enum_cache_size,
+                           enum_cache_size,
+                           ENUM cache size);
+      }
+      break;
+
+    case OPT_ASYNC_ENUM:
+      options->async_enum = true;
+      TRC_INFO("ENUM lookups will use a shared asynchronous resolver");
+      break;
+
+    case OPT_MAX_WORKER_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->max_worker_threads,
+                           max_worker_threads,
+                           Maximum number of worker threads);
+      }
+      break;
+
+    case OPT_RESERVED_WORKER_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->reserved_worker_threads,
+                           reserved_worker_threads,
+                           Number of reserved worker threads);
+      }
+      break;
+
+    case OPT_QUIESCE_DRAIN_RATE:
+      {
+        VALIDATE_INT_PARAM(options->quiesce_drain_rate,
+                           quiesce_drain_rate,
+                           Connections to shut down per second when quiescing);
+      }
+      break;
+
+    case OPT_WORKER_CPUS:
+      if (!CpuAffinity::parse_cpu_list(std::string(pj_optarg),
+                                       options->worker_cpus))
+      {
+        TRC_ERROR("Invalid list of worker CPUs %s", pj_optarg);
+        return -1;
+      }
+      TRC_INFO("Worker threads will be pinned to CPUs %s", pj_optarg);
+      break;
+
+    case OPT_WORKER_AFFINITY:
+      options->worker_affinity = true;
+      TRC_INFO("Worker threads will have per-worker queues with Call-ID affinity");
+      break;
+
     case OPT_HOMESTEAD_TIMEOUT:
       {
         VALIDATE_INT_PARAM(options->homestead_timeout,
@@ -1248,6 +2182,231 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_HSS_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->hss_cache_ttl,
+                           hss_cache_ttl,
+                           HSS cache TTL);
+      }
+      break;
+
+    case OPT_HSS_CACHE_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->hss_cache_size,
+                           hss_cache_size,
+                           HSS cache size);
+      }
+      break;
+
+    case OPT_HSS_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->hss_threads,
+                           hss_threads,
+                           Number of HSS threads);
+      }
+      break;
+
+    case OPT_ICSCF_HSS_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->icscf_hss_cache_ttl,
+                           icscf_hss_cache_ttl,
+                           I-CSCF HSS cache TTL);
+      }
+      break;
+
+    case OPT_ICSCF_HSS_CACHE_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->icscf_hss_cache_size,
+                           icscf_hss_cache_size,
+                           I-CSCF HSS cache size);
+      }
+      break;
+
+    case OPT_AOR_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->aor_cache_ttl,
+                           aor_cache_ttl,
+                           AoR cache TTL);
+      }
+      break;
+
+    case OPT_AOR_CACHE_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->aor_cache_size,
+                           aor_cache_size,
+                           AoR cache size);
+      }
+      break;
+
+    case OPT_SIMSERVS_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->simservs_cache_ttl,
+                           simservs_cache_ttl,
+                           Simservs cache TTL);
+      }
+      break;
+
+    case OPT_SIMSERVS_CACHE_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->simservs_cache_size,
+                           simservs_cache_size,
+                           Simservs cache size);
+      }
+      break;
+
+    case OPT_IMPI_WRITE_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->impi_write_threads,
+                           impi_write_threads,
+                           IMPI write threads);
+      }
+      break;
+
+    case OPT_IMPI_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->impi_cache_ttl,
+                           impi_cache_ttl,
+                           IMPI cache TTL);
+      }
+      break;
+
+    case OPT_TDATA_POOL_CACHE_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->tdata_pool_cache_size,
+                           tdata_pool_cache_size,
+                           tx_data pool cache size);
+      }
+      break;
+
+    case OPT_UDP_BATCH_SIZE:
+      {
+        VALIDATE_INT_PARAM(options->udp_batch_size,
+                           udp_batch_size,
+                           UDP batch size);
+      }
+      break;
+
+    case OPT_UDP_RX_SOCKETS:
+      {
+        VALIDATE_INT_PARAM(options->udp_rx_sockets,
+                           udp_rx_sockets,
+                           UDP receive sockets);
+      }
+      break;
+
+    case OPT_HTTP2_CONNECTIONS:
+      {
+        VALIDATE_INT_PARAM(options->http2_connections,
+                           http2_connections,
+                           HTTP/2 connections);
+      }
+      break;
+
+    case OPT_HOMESTEAD_HEDGE_PERCENTILE:
+      {
+        VALIDATE_INT_PARAM(options->homestead_hedge_percentile,
+                           homestead_hedge_percentile,
+                           Homestead hedge percentile);
+      }
+      break;
+
+    case OPT_HOMESTEAD_HEDGE_BUDGET:
+      {
+        VALIDATE_INT_PARAM(options->homestead_hedge_budget,
+                           homestead_hedge_budget,
+                           Homestead hedge budget);
+      }
+      break;
+
+    case OPT_IMPI_REMOTE_STORE_TIMEOUT:
+      {
+        VALIDATE_INT_PARAM(options->impi_remote_store_timeout,
+                           impi_remote_store_timeout,
+                           IMPI remote store timeout);
+      }
+      break;
+
+    case OPT_AV_PREFETCH_COUNT:
+      {
+        VALIDATE_INT_PARAM(options->av_prefetch_count,
+                           av_prefetch_count,
+                           AV prefetch count);
+      }
+      break;
+
+    case OPT_AV_PREFETCH_TTL:
+      {
+        VALIDATE_INT_PARAM(options->av_prefetch_ttl,
+                           av_prefetch_ttl,
+                           AV prefetch TTL);
+      }
+      break;
+
+    case OPT_AUTH_CREDENTIAL_CACHE_TTL:
+      {
+        VALIDATE_INT_PARAM(options->auth_credential_cache_ttl,
+                           auth_credential_cache_ttl,
+                           Authentication credential cache TTL);
+      }
+      break;
+
+    case OPT_AUTH_TIMEOUT_BATCH_MS:
+      {
+        VALIDATE_INT_PARAM(options->auth_timeout_batch_ms,
+                           auth_timeout_batch_ms,
+                           Authentication timeout batch interval);
+      }
+      break;
+
+    case OPT_CHRONOS_TIMER_BATCH_MS:
+      {
+        VALIDATE_INT_PARAM(options->chronos_timer_batch_ms,
+                           chronos_timer_batch_ms,
+                           Chronos timer batch interval);
+      }
+      break;
+
+    case OPT_HTTP_TIMER_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->http_timer_threads,
+                           http_timer_threads,
+                           HTTP timer threads);
+      }
+      break;
+
+    case OPT_HTTP_PROVISIONING_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->http_provisioning_threads,
+                           http_provisioning_threads,
+                           HTTP provisioning threads);
+      }
+      break;
+
+    case OPT_HTTP_MAX_TASKS:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->http_max_tasks,
+                                    http_max_tasks,
+                                    HTTP maximum tasks);
+      }
+      break;
+
+    case OPT_IMPI_STORE_FORMAT:
+      if (strcmp(pj_optarg, "json") == 0)
+      {
+        options->impi_store_binary = false;
+      }
+      else if (strcmp(pj_optarg, "binary") == 0)
+      {
+        options->impi_store_binary = true;
+      }
+      else
+      {
+        TRC_ERROR("--impi-store-format must be one of 'json' or 'binary'");
+        return -1;
+      }
+      TRC_INFO("IMPI store format is set to %s", pj_optarg);
+      break;
+
     case OPT_LISTEN_PORT:
       {
         int listen_port;
@@ -1274,6 +2433,18 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_REQUEST_DEADLINE:
+      {
+        VALIDATE_INT_PARAM(options->request_deadline,
+                           request_deadline,
+                           Time (in ms) allowed for processing a SIP message);
+      }
+      break;
+
+    case OPT_DEFERRED_LOAD_REPORTS:
+      options->deferred_load_reports = true;
+      break;
+
     SPROUTLET_MACRO(SPROUTLET_OPTIONS)
 
     case 'h':
@@ -1398,7 +2569,10 @@ std::vector<S4*> remote_s4s;
 SubscriberManager* subscriber_manager = NULL;
 ImpiStore* local_impi_store = NULL;
 std::vector<ImpiStore*> remote_impi_stores;
+SNMP::EventAccumulatorTable* local_impi_store_latency_tbl = NULL;
+std::vector<SNMP::EventAccumulatorTable*> remote_impi_store_latency_tbls;
 RalfProcessor* ralf_processor = NULL;
+ACRPolicy* acr_policy = NULL;
 DnsCachedResolver* dns_resolver = NULL;
 HttpResolver* http_resolver = NULL;
 ACRFactory* scscf_acr_factory = NULL;
@@ -1406,7 +2580,10 @@ EnumService* enum_service = NULL;
 ExceptionHandler* exception_handler = NULL;
 AlarmManager* alarm_manager = NULL;
 AnalyticsLogger* analytics_logger = NULL;
+SasMessageLog* sas_message_log = NULL;
+SipCapture* sip_capture = NULL;
 ChronosConnection* chronos_connection = NULL;
+ChronosTimerBatcher* chronos_timer_batcher = NULL;
 SIFCService* sifc_service = NULL;
 FIFCService* fifc_service = NULL;
 SasService* sas_service = NULL;
@@ -1523,6 +2700,17 @@ int create_astaire_stores(struct options opt,
 
   // Create an AV store using the local store and initialise the authentication
   // sproutlet.
+  AstaireImpiStore::Serialization impi_store_format =
+                                 opt.impi_store_binary ?
+                                   AstaireImpiStore::Serialization::BINARY :
+                                   AstaireImpiStore::Serialization::JSON;
+
+  // Latency of the IMPI store at each site.  The local site is always .1, and
+  // remote sites follow in the order they are configured.
+  local_impi_store_latency_tbl =
+    SNMP::EventAccumulatorTable::create("sprout_impi_store_latency_local",
+                                        ".1.2.826.0.1.1578918.9.3.58.1");
+
   if (impi_store_location != "")
   {
     // Use memcached store.
@@ -1531,7 +2719,9 @@ int create_astaire_stores(struct options opt,
                                                                       astaire_resolver,
                                                                       false,
                                                                       astaire_comm_monitor);
-    local_impi_store = new AstaireImpiStore(local_impi_data_store);
+    local_impi_store = new AstaireImpiStore(local_impi_data_store,
+                                            impi_store_format,
+                                            local_impi_store_latency_tbl);
 
     // Only set up remote IMPI stores if some have been configured, and we need
     // the IMPI store to be GR.
@@ -1550,7 +2740,16 @@ int create_astaire_stores(struct options opt,
                                                                              true,
                                                                              remote_astaire_comm_monitor);
         remote_impi_data_stores.push_back(remote_data_store);
-        remote_impi_stores.push_back(new AstaireImpiStore(remote_data_store));
+
+        std::string site_index = std::to_string(remote_impi_stores.size() + 2);
+        SNMP::EventAccumulatorTable* latency_tbl =
+          SNMP::EventAccumulatorTable::create("sprout_impi_store_latency_remote_" + site_index,
+                                              ".1.2.826.0.1.1578918.9.3.58." + site_index);
+        remote_impi_store_latency_tbls.push_back(latency_tbl);
+
+        remote_impi_stores.push_back(new AstaireImpiStore(remote_data_store,
+                                                          impi_store_format,
+                                                          latency_tbl));
       }
     }
   }
@@ -1559,7 +2758,9 @@ int create_astaire_stores(struct options opt,
     // Use local store.
     TRC_STATUS("Using local store");
     local_impi_data_store = (Store*)new LocalStore();
-    local_impi_store = new AstaireImpiStore(local_data_store);
+    local_impi_store = new AstaireImpiStore(local_data_store,
+                                            impi_store_format,
+                                            local_impi_store_latency_tbl);
   }
   return 0;
 }
@@ -1636,6 +2837,10 @@ int main(int argc, char* argv[])
   SIPResolver* sip_resolver = NULL;
   HttpClient* ralf_client = NULL;
   HttpConnection* ralf_connection = NULL;
+  SNMP::EventAccumulatorTable* ralf_batch_size_tbl = NULL;
+  SNMP::U32Scalar* ralf_queue_depth = NULL;
+  SNMP::U32Scalar* ralf_spooled_acrs = NULL;
+  SNMP::CounterTable* suppressed_event_acrs_tbl = NULL;
   ACRFactory* pcscf_acr_factory = NULL;
   pj_bool_t websockets_enabled = PJ_FALSE;
   AccessLogger* access_logger = NULL;
@@ -1659,15 +2864,24 @@ int main(int argc, char* argv[])
   sem_init(&term_sem, 0, 0);
   signal(SIGTERM, terminate_handler);
 
+  // PJSIP's pool allocations are sampled by the allocation profiler, which
+  // must be hooked in before the stack creates its caching pool.
+  Profiler::install_pool_hook();
+
   opt.pcscf_enabled = false;
   opt.pcscf_trusted_port = 0;
   opt.pcscf_untrusted_port = 0;
   opt.upstream_proxy_port = 0;
   opt.webrtc_port = 0;
+  opt.webrtc_threads = 4;
+  opt.upstream_least_loaded = false;
+  opt.upstream_affinity = false;
   opt.ibcf = PJ_FALSE;
   opt.external_icscf_uri = "";
   opt.auth_enabled = PJ_FALSE;
   opt.enum_suffix = ".e164.arpa";
+  opt.async_enum = false;
+  opt.enum_cache_size = 0;
   opt.default_tel_uri_translation = false;
 
   // If changing this default for reg_max_expires, note that
@@ -1680,6 +2894,11 @@ int main(int argc, char* argv[])
   opt.record_routing_model = 1;
   opt.default_session_expires = 10 * 60;
   opt.worker_threads = 1;
+  opt.max_worker_threads = 0;
+  opt.reserved_worker_threads = 0;
+  opt.quiesce_drain_rate = 0;
+  opt.pjsip_threads = 1;
+  opt.worker_affinity = false;
   opt.analytics_enabled = PJ_FALSE;
   opt.http_address = "127.0.0.1";
   opt.http_port = 9888;
@@ -1688,6 +2907,12 @@ int main(int argc, char* argv[])
   opt.billing_cdf = "";
   opt.emerg_reg_accepted = PJ_FALSE;
   opt.target_latency_us = 10000;
+  opt.dependency_target_latency_us = 0;
+  opt.flight_recorder_threshold_ms = 1000;
+  opt.worker_stall_threshold_ms = 4000;
+  opt.worker_stall_stacks = false;
+  opt.warmup_impus_file = "";
+  opt.warmup_timeout_ms = 30000;
   opt.max_tokens = 1000;
   opt.init_token_rate = 2000.0;
   opt.min_token_rate = 10.0;
@@ -1697,35 +2922,100 @@ int main(int argc, char* argv[])
   opt.daemon = PJ_FALSE;
   opt.interactive = PJ_FALSE;
   opt.override_npdi = PJ_FALSE;
+  opt.local_terminating_shortcut = false;
+  opt.cache_served_user_state = false;
+  opt.sproutlet_max_workers.clear();
+  opt.as_connections = 0;
+  opt.as_connection_recycle = 600;
+  opt.registration_prefetch_threads = 0;
   opt.exception_max_ttl = 600;
   opt.sip_blacklist_duration = SIPResolver::DEFAULT_BLACKLIST_DURATION;
+  opt.sip_resolver_threads = 0;
+  opt.sip_hot_targets = 0;
+  opt.sip_max_stale_targets = 5;
+  opt.sip_latency_ordering = false;
   opt.http_blacklist_duration = HttpResolver::DEFAULT_BLACKLIST_DURATION;
   opt.astaire_blacklist_duration = AstaireResolver::DEFAULT_BLACKLIST_DURATION;
   opt.sip_tcp_connect_timeout = 1800;
   opt.sip_tcp_send_timeout = 1800;
+  opt.sip_tcp_send_queue_limit = 0;
   opt.dns_timeout = DnsCachedResolver::DEFAULT_TIMEOUT;
   opt.session_continued_timeout_ms = SCSCFSproutlet::DEFAULT_SESSION_CONTINUED_TIMEOUT;
   opt.session_terminated_timeout_ms = SCSCFSproutlet::DEFAULT_SESSION_TERMINATED_TIMEOUT;
+  opt.as_failure_threshold = 0;
+  opt.as_retry_interval_ms = AsCommunicationTracker::DEFAULT_RETRY_INTERVAL_MS;
   opt.stateless_proxies.clear();
   opt.max_sproutlet_depth = SproutletProxy::DEFAULT_MAX_SPROUTLET_DEPTH;
   opt.ralf_threads = 25;
+  opt.ralf_batch_size = 1;
+  opt.ralf_batch_delay_ms = 10;
+  opt.ralf_spool_file = "";
+  opt.ralf_spool_size_mb = 100;
+  opt.ralf_max_queued_acrs = 10000;
+  opt.ralf_spool_replay_rate = 100;
+  opt.suppress_event_acrs = "";
   opt.non_register_auth_mode = NonRegisterAuthentication::NEVER;
   opt.force_third_party_register_body = false;
+  opt.third_party_register_rate = 0;
+  opt.initial_register_rate = 0;
+  opt.register_retry_after = 60;
+  opt.third_party_refresh_percent = 0;
   opt.listen_port = 0;
   SPROUTLET_MACRO(SPROUTLET_CFG_OPTIONS_DEFAULT_VALUES)
   opt.nonce_count_supported = false;
   opt.scscf_node_uri = "";
   opt.sas_signaling_if = false;
+  opt.sas_detail_percent = 100;
+  opt.sas_overload_detail_percent = 100;
   opt.disable_tcp_switch = false;
   opt.apply_fallback_ifcs = false;
   opt.reject_if_no_matching_ifcs = false;
   opt.dummy_app_server = "";
   opt.http_acr_logging = false;
   opt.homestead_timeout = 750;
+  opt.hss_cache_ttl = 0;
+  opt.hss_cache_size = 10000;
+  opt.icscf_hss_cache_ttl = 0;
+  opt.icscf_hss_cache_size = 10000;
+  opt.hss_threads = 0;
+  opt.aor_cache_ttl = 0;
+  opt.aor_cache_size = 10000;
+  opt.simservs_cache_ttl = 0;
+  opt.simservs_cache_size = 10000;
+  opt.impi_store_binary = false;
+  opt.impi_write_threads = 0;
+  opt.impi_cache_ttl = 5;
+  opt.impi_remote_store_timeout = 0;
+  opt.av_prefetch_count = 0;
+  opt.av_prefetch_ttl = 300;
+  opt.auth_credential_cache_ttl = 0;
+  opt.auth_timeout_batch_ms = 0;
+  opt.chronos_timer_batch_ms = 0;
+  opt.http_timer_threads = 0;
+  opt.http_provisioning_threads = 0;
+  opt.http_max_tasks = 100;
+  opt.http2_connections = 0;
+  opt.homestead_hedge_percentile = 0;
+  opt.homestead_hedge_budget = 5;
+  opt.http_compression = false;
+  opt.tdata_pool_cache_size = RecyclingPoolFactory::DEFAULT_CACHE_SIZE;
+  opt.udp_batch_size = 0;
+  opt.udp_rx_sockets = 1;
   opt.enable_orig_sip_to_tel_coerce = false;
+  opt.lazy_header_parsing = false;
+  opt.huge_page_pools = false;
+  opt.sas_message_logging_thread = false;
+  opt.sip_capture_dir = "";
+  opt.sip_capture_file_size = 64;
+  opt.sip_capture_files = 4;
+  opt.sip_capture_filters.clear();
   opt.request_on_queue_timeout = 4000;
+  opt.request_deadline = 0;
+  opt.deferred_load_reports = false;
   opt.ram_record_everything = false;
   opt.always_serve_remote_aliases = false;
+  opt.stateless_in_dialog = false;
+  opt.collapse_record_routes = false;
 
   status = init_logging_options(argc, argv, &opt);
 
@@ -1765,6 +3055,10 @@ int main(int argc, char* argv[])
 
   init_pjsip_logging(opt.log_level, opt.log_to_file, opt.log_directory);
 
+  // Calibrate the clock used for per-stage latency tracing before anything
+  // is timed.
+  StageLatency::init();
+
   std::stringstream options_ss;
   for (int ii = 0; ii < argc; ii++)
   {
@@ -1869,6 +3163,14 @@ int main(int argc, char* argv[])
     TRC_WARNING("Use multiple threads for good performance when using memstore and/or authentication");
   }
 
+  if ((opt.av_prefetch_count > 0) && (opt.hss_threads == 0))
+  {
+    // Prefetching on the request threads would make challenges slower, not
+    // faster.
+    TRC_WARNING("Authentication vector prefetching requires --hss-threads, ignoring");
+    opt.av_prefetch_count = 0;
+  }
+
   if ((opt.pcscf_enabled) && (opt.reg_max_expires != 0))
   {
     TRC_WARNING("A registration expiry period should not be specified for P-CSCF");
@@ -1905,6 +3207,9 @@ int main(int argc, char* argv[])
   SNMP::CounterByScopeTable* overload_counter;
 
   SNMP::IPCountTable* homestead_cxn_count = NULL;
+  SNMP::IPCountTable* homestead_http2_stream_count = NULL;
+  SNMP::EventAccumulatorTable* homestead_http2_rtt_table = NULL;
+  SNMP::CounterTable* homestead_hedged_tbl = NULL;
 
   SNMP::EventAccumulatorTable* homestead_latency_table = NULL;
   SNMP::EventAccumulatorTable* homestead_mar_latency_table = NULL;
@@ -1919,12 +3224,30 @@ int main(int argc, char* argv[])
   SNMP::ScalarByScopeTable* penalties_scalar = NULL;
   SNMP::ScalarByScopeTable* token_rate_scalar = NULL;
 
+  std::vector<SNMP::CounterTable*> transport_thread_rx_tbls;
+  SNMP::CounterTable* worker_steals_tbl = NULL;
+  ShardedLRUCacheStatsTables enum_cache_stats_tbls = {NULL, NULL, NULL};
+  ShardedLRUCacheStatsTables hss_cache_stats_tbls = {NULL, NULL, NULL};
+  SNMP::CounterTable* hss_coalesced_tbl = NULL;
+  ShardedLRUCacheStatsTables aor_cache_stats_tbls = {NULL, NULL, NULL};
+
   SNMP::RegistrationStatsTables third_party_reg_stats_tbls = {nullptr, nullptr, nullptr};
   SNMP::CounterTable* no_matching_ifcs_tbl = NULL;
   SNMP::CounterTable* no_matching_fallback_ifcs_tbl = NULL;
 
   SNMP::CounterTable* route_to_remote_alias_tbl = NULL;
   SNMP::CounterTable* accept_for_remote_alias_tbl = NULL;
+  SNMP::EventAccumulatorTable* bytes_cloned_tbl = NULL;
+  SNMP::SuccessFailCountTable* tdata_pool_reuse_tbl = NULL;
+  SNMP::U32Scalar* tdata_pool_retained_bytes = NULL;
+  SNMP::U32Scalar* pool_arena_bytes = NULL;
+  SNMP::U32Scalar* pool_arena_in_use_bytes = NULL;
+  SNMP::U32Scalar* sip_hot_targets_scalar = NULL;
+  SNMP::CounterTable* sip_target_refreshes_tbl = NULL;
+  SNMP::CounterTable* sip_stale_targets_tbl = NULL;
+  SNMP::CounterTable* sip_saturated_connections_tbl = NULL;
+  SNMP::U32Scalar* worker_threads_scalar = NULL;
+  SNMP::U32Scalar* blocked_workers_scalar = NULL;
 
   if (opt.pcscf_enabled)
   {
@@ -1938,6 +3261,17 @@ int main(int argc, char* argv[])
                                                          ".1.2.826.0.1.1578918.9.2.4");
     overload_counter = SNMP::CounterByScopeTable::create("bono_rejected_overload",
                                                          ".1.2.826.0.1.1578918.9.2.5");
+
+    for (int ii = 0; ii < opt.pjsip_threads; ++ii)
+    {
+      std::string index = std::to_string(ii + 1);
+      transport_thread_rx_tbls.push_back(
+        SNMP::CounterTable::create("bono_transport_thread_rx_" + index,
+                                   ".1.2.826.0.1.1578918.9.2.8." + index));
+    }
+
+    worker_steals_tbl = SNMP::CounterTable::create("bono_worker_steals",
+                                                   ".1.2.826.0.1.1578918.9.2.9");
   }
   else
   {
@@ -1964,6 +3298,20 @@ int main(int argc, char* argv[])
                                                                  ".1.2.826.0.1.1578918.9.3.3.5");
     homestead_lir_latency_table = SNMP::EventAccumulatorTable::create("sprout_homestead_lir_latency",
                                                                  ".1.2.826.0.1.1578918.9.3.3.6");
+
+    if (opt.http2_connections > 0)
+    {
+      homestead_http2_stream_count = SNMP::IPCountTable::create("sprout_homestead_http2_stream_count",
+                                                                ".1.2.826.0.1.1578918.9.3.3.7");
+      homestead_http2_rtt_table = SNMP::EventAccumulatorTable::create("sprout_homestead_http2_rtt",
+                                                                      ".1.2.826.0.1.1578918.9.3.3.8");
+
+      if (opt.homestead_hedge_percentile > 0)
+      {
+        homestead_hedged_tbl = SNMP::CounterTable::create("sprout_homestead_hedged_requests",
+                                                          ".1.2.826.0.1.1578918.9.3.3.9");
+      }
+    }
     no_shared_ifcs_set_table = SNMP::CounterTable::create("no_shared_ifcs_set",
                                                           ".1.2.826.0.1.1578918.9.3.40");
     token_rate_table = SNMP::ContinuousAccumulatorByScopeTable::create("sprout_token_rate",
@@ -1992,6 +3340,53 @@ int main(int argc, char* argv[])
                                                            "1.2.826.0.1.1578918.9.3.44");
     accept_for_remote_alias_tbl = SNMP::CounterTable::create("accept_for_remote_alias",
                                                            "1.2.826.0.1.1578918.9.3.45");
+    bytes_cloned_tbl = SNMP::EventAccumulatorTable::create("sprout_sip_bytes_cloned_per_tsx",
+                                                           ".1.2.826.0.1.1578918.9.3.59");
+
+    for (int ii = 0; ii < opt.pjsip_threads; ++ii)
+    {
+      std::string index = std::to_string(ii + 1);
+      transport_thread_rx_tbls.push_back(
+        SNMP::CounterTable::create("sprout_transport_thread_rx_" + index,
+                                   ".1.2.826.0.1.1578918.9.3.46." + index));
+    }
+
+    worker_steals_tbl = SNMP::CounterTable::create("sprout_worker_steals",
+                                                   ".1.2.826.0.1.1578918.9.3.47");
+
+    enum_cache_stats_tbls.hits_tbl =
+      SNMP::CounterTable::create("sprout_enum_cache_hits",
+                                 ".1.2.826.0.1.1578918.9.3.48");
+    enum_cache_stats_tbls.misses_tbl =
+      SNMP::CounterTable::create("sprout_enum_cache_misses",
+                                 ".1.2.826.0.1.1578918.9.3.49");
+    enum_cache_stats_tbls.evictions_tbl =
+      SNMP::CounterTable::create("sprout_enum_cache_evictions",
+                                 ".1.2.826.0.1.1578918.9.3.50");
+
+    hss_cache_stats_tbls.hits_tbl =
+      SNMP::CounterTable::create("sprout_hss_cache_hits",
+                                 ".1.2.826.0.1.1578918.9.3.51");
+    hss_cache_stats_tbls.misses_tbl =
+      SNMP::CounterTable::create("sprout_hss_cache_misses",
+                                 ".1.2.826.0.1.1578918.9.3.52");
+    hss_cache_stats_tbls.evictions_tbl =
+      SNMP::CounterTable::create("sprout_hss_cache_evictions",
+                                 ".1.2.826.0.1.1578918.9.3.53");
+
+    hss_coalesced_tbl =
+      SNMP::CounterTable::create("sprout_hss_coalesced_requests",
+                                 ".1.2.826.0.1.1578918.9.3.54");
+
+    aor_cache_stats_tbls.hits_tbl =
+      SNMP::CounterTable::create("sprout_aor_cache_hits",
+                                 ".1.2.826.0.1.1578918.9.3.55");
+    aor_cache_stats_tbls.misses_tbl =
+      SNMP::CounterTable::create("sprout_aor_cache_misses",
+                                 ".1.2.826.0.1.1578918.9.3.56");
+    aor_cache_stats_tbls.evictions_tbl =
+      SNMP::CounterTable::create("sprout_aor_cache_evictions",
+                                 ".1.2.826.0.1.1578918.9.3.57");
   }
 
   // Create Sprout's alarm objects.
@@ -2030,6 +3425,24 @@ int main(int argc, char* argv[])
                                  penalties_scalar,        // Statistics scalar for number of penalties.
                                  token_rate_scalar);      // Statistics scalar for current token rate.
 
+  // Start overload control for individual dependencies, if enabled.
+  if (opt.dependency_target_latency_us > 0)
+  {
+    stack_data.dependency_monitor =
+      new DependencyMonitor(opt.dependency_target_latency_us);
+  }
+
+  // Limit the data queued to each SIP connection, if enabled.
+  if (opt.sip_tcp_send_queue_limit > 0)
+  {
+    sip_saturated_connections_tbl =
+      SNMP::CounterTable::create("sprout_sip_saturated_connections",
+                                 ".1.2.826.0.1.1578918.9.3.77");
+    stack_data.send_queue_monitor =
+      new SendQueueMonitor(opt.sip_tcp_send_queue_limit,
+                           sip_saturated_connections_tbl);
+  }
+
   // Start the health checker
   HealthChecker* hc = new HealthChecker();
   hc->start_thread();
@@ -2059,6 +3472,34 @@ int main(int argc, char* argv[])
     sip_resolver = new SIPResolver(dns_resolver, opt.sip_blacklist_duration);
   }
 
+  sip_resolver->start_async_resolution(opt.sip_resolver_threads,
+                                       exception_handler);
+
+  if (opt.sip_hot_targets > 0)
+  {
+    if (opt.sip_resolver_threads == 0)
+    {
+      TRC_WARNING("Hot SIP targets are refreshed on the worker threads unless --sip-resolver-threads is set");
+    }
+
+    sip_hot_targets_scalar = new SNMP::U32Scalar("sprout_sip_hot_targets",
+                                                 ".1.2.826.0.1.1578918.9.3.74");
+    sip_target_refreshes_tbl = SNMP::CounterTable::create("sprout_sip_target_refreshes",
+                                                          ".1.2.826.0.1.1578918.9.3.75");
+    sip_stale_targets_tbl = SNMP::CounterTable::create("sprout_sip_stale_targets",
+                                                       ".1.2.826.0.1.1578918.9.3.76");
+    sip_resolver->enable_hot_targets(opt.sip_hot_targets,
+                                     opt.sip_max_stale_targets,
+                                     sip_hot_targets_scalar,
+                                     sip_target_refreshes_tbl,
+                                     sip_stale_targets_tbl);
+  }
+
+  if (opt.sip_latency_ordering)
+  {
+    sip_resolver->enable_latency_ordering();
+  }
+
   // Create a new quiescing manager instance and register our completion handler
   // with it.
   quiescing_mgr = new QuiescingManager();
@@ -2066,6 +3507,12 @@ int main(int argc, char* argv[])
 
   std::string system_type_sas = (opt.pcscf_trusted_port != 0) ? "bono" : "sprout";
 
+  if ((opt.sas_detail_percent < 100) || (opt.sas_overload_detail_percent < 100))
+  {
+    SASSampling::configure(opt.sas_detail_percent,
+                           opt.sas_overload_detail_percent);
+  }
+
   // Initialise the SasService, to read the SAS config to pass into SAS::Init
   SasService* sas_service = new SasService(opt.sas_system_name, system_type_sas, opt.sas_signaling_if);
 
@@ -2091,7 +3538,13 @@ int main(int argc, char* argv[])
                       quiescing_mgr,
                       opt.billing_cdf,
                       sproutlet_uris,
-                      opt.enable_orig_sip_to_tel_coerce);
+                      opt.enable_orig_sip_to_tel_coerce,
+                      opt.tdata_pool_cache_size,
+                      opt.udp_batch_size,
+                      opt.lazy_header_parsing,
+                      opt.quiesce_drain_rate,
+                      opt.huge_page_pools,
+                      opt.udp_rx_sockets);
 
   if (status != PJ_SUCCESS)
   {
@@ -2100,6 +3553,26 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  if (opt.tdata_pool_cache_size > 0)
+  {
+    tdata_pool_reuse_tbl = SNMP::SuccessFailCountTable::create("sprout_tdata_pool_reuse",
+                                                               ".1.2.826.0.1.1578918.9.3.60");
+    tdata_pool_retained_bytes = new SNMP::U32Scalar("sprout_tdata_pool_retained_bytes",
+                                                    ".1.2.826.0.1.1578918.9.3.61");
+    stack_data.endpt_pool_factory->set_stats_tables(tdata_pool_reuse_tbl,
+                                                    tdata_pool_retained_bytes);
+  }
+
+  if (stack_data.endpt_pool_allocator != NULL)
+  {
+    pool_arena_bytes = new SNMP::U32Scalar("sprout_pool_arena_bytes",
+                                           ".1.2.826.0.1.1578918.9.3.79");
+    pool_arena_in_use_bytes = new SNMP::U32Scalar("sprout_pool_arena_in_use_bytes",
+                                                  ".1.2.826.0.1.1578918.9.3.80");
+    stack_data.endpt_pool_allocator->set_stats_scalars(pool_arena_bytes,
+                                                       pool_arena_in_use_bytes);
+  }
+
   //If the flag is set, disable UDP-to-TCP uplift.
   if (opt.disable_tcp_switch)
   {
@@ -2132,9 +3605,59 @@ int main(int argc, char* argv[])
                                          ralf_client,
                                          "http");
 
+    if (opt.ralf_batch_size > 1)
+    {
+      ralf_batch_size_tbl = SNMP::EventAccumulatorTable::create("sprout_ralf_batch_size",
+                                                                ".1.2.826.0.1.1578918.9.3.64");
+    }
+
+    ralf_queue_depth = new SNMP::U32Scalar("sprout_ralf_queue_depth",
+                                           ".1.2.826.0.1.1578918.9.3.65");
+
+    AcrSpool* ralf_spool = NULL;
+    if (opt.ralf_spool_file != "")
+    {
+      ralf_spool = new AcrSpool(opt.ralf_spool_file,
+                                (size_t)opt.ralf_spool_size_mb * 1024 * 1024);
+      if (ralf_spool->init())
+      {
+        ralf_spooled_acrs = new SNMP::U32Scalar("sprout_ralf_spooled_acrs",
+                                                ".1.2.826.0.1.1578918.9.3.66");
+      }
+      else
+      {
+        TRC_ERROR("Failed to open Ralf spool file %s - ACRs will not be spooled",
+                  opt.ralf_spool_file.c_str());
+        delete ralf_spool; ralf_spool = NULL;
+      }
+    }
+
     ralf_processor = new RalfProcessor(ralf_connection,
                                        exception_handler,
-                                       opt.ralf_threads);
+                                       opt.ralf_threads,
+                                       opt.ralf_batch_size,
+                                       opt.ralf_batch_delay_ms,
+                                       ralf_batch_size_tbl,
+                                       ralf_queue_depth,
+                                       ralf_spool,
+                                       opt.ralf_max_queued_acrs,
+                                       opt.ralf_spool_replay_rate,
+                                       ralf_spooled_acrs);
+
+    if (opt.suppress_event_acrs != "")
+    {
+      suppressed_event_acrs_tbl =
+        SNMP::CounterTable::create("sprout_suppressed_event_acrs",
+                                   ".1.2.826.0.1.1578918.9.3.81");
+      acr_policy = new ACRPolicy(suppressed_event_acrs_tbl);
+
+      if (!acr_policy->add_rules(opt.suppress_event_acrs))
+      {
+        TRC_ERROR("Invalid --suppress-event-acrs rules %s. Aborting startup",
+                  opt.suppress_event_acrs.c_str());
+        return 1;
+      }
+    }
   }
   else
   {
@@ -2144,36 +3667,6 @@ int main(int argc, char* argv[])
   // Initialise the OPTIONS handling module.
   init_options();
 
-  if (opt.hss_server != "")
-  {
-    // Create a connection to the HSS.
-    TRC_STATUS("Creating connection to HSS %s with HTTP timeout %d",
-               opt.hss_server.c_str(), opt.homestead_timeout);
-    sifc_service = new SIFCService(new Alarm(alarm_manager,
-                                             "sprout",
-                                             AlarmDef::SPROUT_SIFC_STATUS,
-                                             AlarmDef::CRITICAL),
-                                   no_shared_ifcs_set_table);
-    hss_connection = new HSSConnection(opt.hss_server,
-                                       http_resolver,
-                                       load_monitor,
-                                       homestead_cxn_count,
-                                       homestead_latency_table,
-                                       homestead_mar_latency_table,
-                                       homestead_sar_latency_table,
-                                       homestead_uar_latency_table,
-                                       homestead_lir_latency_table,
-                                       hss_comm_monitor,
-                                       sifc_service,
-                                       opt.homestead_timeout);
-  }
-
-  // Create FIFC service
-  fifc_service = new FIFCService(new Alarm(alarm_manager,
-                                           "sprout",
-                                           AlarmDef::SPROUT_FIFC_STATUS,
-                                           AlarmDef::CRITICAL));
-
   // Create the IFC Configuration
   ifc_configuration = IFCConfiguration(opt.apply_fallback_ifcs,
                                        opt.reject_if_no_matching_ifcs,
@@ -2181,38 +3674,139 @@ int main(int argc, char* argv[])
                                        no_matching_ifcs_tbl,
                                        no_matching_fallback_ifcs_tbl);
 
-  // Create ENUM service.
-  if (!opt.enum_servers.empty())
+  // Load the configuration services and connect to the HSS, Chronos and the
+  // stores.  These don't depend on each other (other than the HSS connection
+  // on the shared iFC service), so are done in parallel.
+  StartupStages startup_stages;
+  int astaire_rc = 0;
+
+  if (opt.hss_server != "")
   {
-    TRC_STATUS("Setting up the ENUM server(s)");
-    enum_service = new DNSEnumService(opt.enum_servers,
-                                      opt.enum_suffix,
-                                      new DNSResolverFactory(),
-                                      enum_comm_monitor);
+    startup_stages.add("sifc", [&]()
+    {
+      sifc_service = new SIFCService(new Alarm(alarm_manager,
+                                               "sprout",
+                                               AlarmDef::SPROUT_SIFC_STATUS,
+                                               AlarmDef::CRITICAL),
+                                     no_shared_ifcs_set_table);
+      return true;
+    });
+
+    startup_stages.add("hss", [&]()
+    {
+      // Create a connection to the HSS.
+      TRC_STATUS("Creating connection to HSS %s with HTTP timeout %d",
+                 opt.hss_server.c_str(), opt.homestead_timeout);
+      hss_connection = new HSSConnection(opt.hss_server,
+                                         http_resolver,
+                                         load_monitor,
+                                         homestead_cxn_count,
+                                         homestead_latency_table,
+                                         homestead_mar_latency_table,
+                                         homestead_sar_latency_table,
+                                         homestead_uar_latency_table,
+                                         homestead_lir_latency_table,
+                                         hss_comm_monitor,
+                                         sifc_service,
+                                         opt.homestead_timeout,
+                                         opt.hss_cache_ttl,
+                                         opt.hss_cache_size,
+                                         hss_cache_stats_tbls,
+                                         hss_coalesced_tbl,
+                                         exception_handler,
+                                         opt.hss_threads,
+                                         opt.http2_connections,
+                                         homestead_http2_stream_count,
+                                         homestead_http2_rtt_table,
+                                         opt.homestead_hedge_percentile,
+                                         opt.homestead_hedge_budget,
+                                         homestead_hedged_tbl,
+                                         opt.http_compression);
+      return true;
+    },
+    {"sifc"});
   }
-  else if (!opt.enum_file.empty())
+
+  startup_stages.add("fifc", [&]()
   {
-    TRC_STATUS("Reading from an ENUM file");
-    enum_service = new JSONEnumService(opt.enum_file);
-  }
-  else if (opt.default_tel_uri_translation)
+    // Create FIFC service
+    fifc_service = new FIFCService(new Alarm(alarm_manager,
+                                             "sprout",
+                                             AlarmDef::SPROUT_FIFC_STATUS,
+                                             AlarmDef::CRITICAL));
+    return true;
+  });
+
+  startup_stages.add("enum", [&]()
   {
-    TRC_STATUS("Setting up ENUM service to do default TEL->SIP URI translation");
-    enum_service = new DummyEnumService(opt.home_domain);
-  }
+    // Create ENUM service.
+    if (!opt.enum_servers.empty())
+    {
+      TRC_STATUS("Setting up the ENUM server(s)");
+      enum_service = new DNSEnumService(opt.enum_servers,
+                                        opt.enum_suffix,
+                                        new DNSResolverFactory(),
+                                        enum_comm_monitor,
+                                        opt.async_enum,
+                                        opt.enum_cache_size,
+                                        enum_cache_stats_tbls);
+    }
+    else if (!opt.enum_file.empty())
+    {
+      TRC_STATUS("Reading from an ENUM file");
+      enum_service = new JSONEnumService(opt.enum_file);
+    }
+    else if (opt.default_tel_uri_translation)
+    {
+      TRC_STATUS("Setting up ENUM service to do default TEL->SIP URI translation");
+      enum_service = new DummyEnumService(opt.home_domain);
+    }
+    return true;
+  });
 
-  // Create RPH service.
-  TRC_STATUS("Setting up RPH service");
-  rph_service = new RPHService(new Alarm(alarm_manager,
-                                         "sprout",
-                                         AlarmDef::SPROUT_RPH_STATUS,
-                                         AlarmDef::CRITICAL));
+  startup_stages.add("rph", [&]()
+  {
+    // Create RPH service.
+    TRC_STATUS("Setting up RPH service");
+    rph_service = new RPHService(new Alarm(alarm_manager,
+                                           "sprout",
+                                           AlarmDef::SPROUT_RPH_STATUS,
+                                           AlarmDef::CRITICAL));
+    return true;
+  });
+
+  startup_stages.add("chronos", [&]()
+  {
+    create_chronos_connection(opt,
+                              chronos_http_client,
+                              chronos_http_conn,
+                              chronos_comm_monitor);
+    return true;
+  });
+
+  startup_stages.add("astaire", [&]()
+  {
+    // Create the IMPI stores
+    astaire_rc = create_astaire_stores(opt,
+                                       astaire_resolver,
+                                       astaire_comm_monitor,
+                                       remote_astaire_comm_monitor);
+    return (astaire_rc == 0);
+  });
+
+  if (!startup_stages.run())
+  {
+    TRC_ERROR("Failed to initialize Sprout. Aborting startup");
+    return (astaire_rc != 0) ? astaire_rc : 1;
+  }
 
   if (opt.pcscf_enabled)
   {
     // Create an ACR factory for the P-CSCF.
     pcscf_acr_factory = (ralf_processor != NULL) ?
-                (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::PCSCF) :
+                (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                ACR::PCSCF,
+                                                acr_policy) :
                 new ACRFactory();
 
     // Launch stateful proxy as P-CSCF.
@@ -2231,7 +3825,9 @@ int main(int argc, char* argv[])
                                  quiescing_mgr,
                                  opt.enabled_icscf,
                                  opt.enabled_scscf,
-                                 opt.emerg_reg_accepted);
+                                 opt.emerg_reg_accepted,
+                                 opt.upstream_least_loaded,
+                                 opt.upstream_affinity);
     if (status != PJ_SUCCESS)
     {
       TRC_ERROR("Failed to enable P-CSCF edge proxy. Aborting startup");
@@ -2241,7 +3837,8 @@ int main(int argc, char* argv[])
     pj_bool_t websockets_enabled = (opt.webrtc_port != 0);
     if (websockets_enabled)
     {
-      status = init_websockets((unsigned short)opt.webrtc_port);
+      status = init_websockets((unsigned short)opt.webrtc_port,
+                               (unsigned int)opt.webrtc_threads);
       if (status != PJ_SUCCESS)
       {
         TRC_ERROR("Error initializing websockets, %s",
@@ -2252,25 +3849,12 @@ int main(int argc, char* argv[])
     }
   }
 
-  create_chronos_connection(opt,
-                            chronos_http_client,
-                            chronos_http_conn,
-                            chronos_comm_monitor);
-
   scscf_acr_factory = (ralf_processor != NULL) ?
-                    (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::SCSCF) :
+                    (ACRFactory*)new RalfACRFactory(ralf_processor,
+                                                    ACR::SCSCF,
+                                                    acr_policy) :
                     new ACRFactory();
 
-  // Create the IMPI stores
-  int rc = create_astaire_stores(opt,
-                                 astaire_resolver,
-                                 astaire_comm_monitor,
-                                 remote_astaire_comm_monitor);
-  if (rc != 0)
-  {
-    return rc;
-  }
-
   // Set up the SM and S4s
   for (AoRStore* store : remote_aor_stores)
   {
@@ -2278,8 +3862,16 @@ int main(int argc, char* argv[])
     remote_s4s.push_back(remote_s4);
   }
 
+  // S4 updates the AoRs' Chronos timers through the batcher, if there is one.
+  if ((opt.chronos_timer_batch_ms > 0) && (chronos_connection != NULL))
+  {
+    chronos_timer_batcher = new ChronosTimerBatcher(chronos_connection,
+                                                    opt.chronos_timer_batch_ms);
+  }
+
   s4 = new S4("Local S4",
-              chronos_connection,
+              (chronos_timer_batcher != NULL) ?
+                chronos_timer_batcher : chronos_connection,
               "/timers",
               local_aor_store,
               remote_s4s);
@@ -2289,12 +3881,17 @@ int main(int argc, char* argv[])
     new RegistrationSender(ifc_configuration,
                            fifc_service,
                            &third_party_reg_stats_tbls,
-                           opt.force_third_party_register_body);
+                           opt.force_third_party_register_body,
+                           opt.third_party_register_rate,
+                           opt.third_party_refresh_percent);
   subscriber_manager = new SubscriberManager(s4,
                                              hss_connection,
                                              analytics_logger,
                                              notify_sender,
-                                             registration_sender);
+                                             registration_sender,
+                                             opt.aor_cache_ttl,
+                                             opt.aor_cache_size,
+                                             aor_cache_stats_tbls);
 
   // Start the HTTP stack early as plugins might need to register handlers
   // with it.
@@ -2351,6 +3948,19 @@ int main(int argc, char* argv[])
     init_snmp_handler_threads("sprout");
   }
 
+  for (const std::pair<const std::string, int>& limit : opt.sproutlet_max_workers)
+  {
+    SproutletCpu::set_max_workers(limit.first, limit.second);
+  }
+
+  RegistrationPrefetch::start(exception_handler,
+                              opt.registration_prefetch_threads,
+                              MAX_QUEUED_REGISTRATION_PREFETCHES);
+
+  ASConnectionPools::configure(opt.as_connections,
+                               opt.as_connection_recycle,
+                               stack_data.scscf_trusted_tcp_factory);
+
   if (!sproutlets.empty())
   {
     // There are Sproutlets loaded, so start the Sproutlet proxy.
@@ -2377,7 +3987,10 @@ int main(int argc, char* argv[])
                                          opt.stateless_proxies,
                                          route_to_remote_alias_tbl,
                                          accept_for_remote_alias_tbl,
-                                         opt.max_sproutlet_depth);
+                                         opt.max_sproutlet_depth,
+                                         bytes_cloned_tbl,
+                                         opt.stateless_in_dialog,
+                                         opt.collapse_record_routes);
     if (sproutlet_proxy == NULL)
     {
       TRC_ERROR("Failed to create SproutletProxy. Aborting startup");
@@ -2385,8 +3998,42 @@ int main(int argc, char* argv[])
     }
   }
 
+  if (opt.sas_message_logging_thread)
+  {
+    sas_message_log = new SasMessageLog();
+  }
+
+  if (opt.sip_capture_dir != "")
+  {
+    sip_capture = new SipCapture(opt.sip_capture_dir,
+                                 (size_t)opt.sip_capture_file_size * 1024 * 1024,
+                                 opt.sip_capture_files,
+                                 opt.sip_capture_filters);
+    if (!sip_capture->ok())
+    {
+      TRC_ERROR("Failed to start capturing SIP messages to %s",
+                opt.sip_capture_dir.c_str());
+      delete sip_capture; sip_capture = NULL;
+    }
+  }
+
+  // Start passing the statistics collected per thread to the SNMP tables.
+  SNMPShards::start();
+
   init_common_sip_processing(requests_counter,
-                             hc);
+                             hc,
+                             sas_message_log,
+                             sip_capture);
+
+  if (opt.max_worker_threads > opt.worker_threads)
+  {
+    worker_threads_scalar = new SNMP::U32Scalar("sprout_worker_threads",
+                                                ".1.2.826.0.1.1578918.9.3.62");
+    blocked_workers_scalar = new SNMP::U32Scalar("sprout_blocked_worker_threads",
+                                                 ".1.2.826.0.1.1578918.9.3.63");
+  }
+
+  FlightRecorder::set_threshold_us((uint64_t)opt.flight_recorder_threshold_ms * 1000);
 
   init_thread_dispatcher(opt.worker_threads,
                          latency_table,
@@ -2396,7 +4043,16 @@ int main(int argc, char* argv[])
                          load_monitor,
                          rph_service,
                          exception_handler,
-                         opt.request_on_queue_timeout);
+                         opt.request_on_queue_timeout,
+                         opt.worker_affinity,
+                         worker_steals_tbl,
+                         opt.max_worker_threads,
+                         worker_threads_scalar,
+                         blocked_workers_scalar,
+                         opt.reserved_worker_threads,
+                         opt.worker_cpus,
+                         opt.request_deadline,
+                         opt.deferred_load_reports);
 
   // Create worker threads first as they take work from the PJSIP threads so
   // need to be ready.
@@ -2407,7 +4063,23 @@ int main(int argc, char* argv[])
     return 1;
   }
 
-  status = start_pjsip_thread();
+  WorkerWatchdog::start(opt.worker_stall_threshold_ms, opt.worker_stall_stacks);
+
+  // Warm up the DNS and registration data caches before starting the PJSIP
+  // threads, so no SIP messages are processed until the caches are full.
+  if ((!opt.warmup_targets.empty()) || (opt.warmup_impus_file != ""))
+  {
+    std::vector<std::string> warmup_impus;
+    if (opt.warmup_impus_file != "")
+    {
+      Warmup::read_impus(opt.warmup_impus_file, warmup_impus);
+    }
+
+    Warmup warmup(sip_resolver, hss_connection, stack_data.addr_family);
+    warmup.run(opt.warmup_targets, warmup_impus, opt.warmup_timeout_ms);
+  }
+
+  status = start_pjsip_threads(opt.pjsip_threads, transport_thread_rx_tbls);
   if (status != PJ_SUCCESS)
   {
     CL_SPROUT_SIP_STACK_INIT_FAIL.log(PJUtils::pj_status_to_string(status).c_str());
@@ -2423,7 +4095,8 @@ int main(int argc, char* argv[])
   DeregistrationTask::Config deregistration_config(subscriber_manager,
                                                    sip_resolver,
                                                    local_impi_store,
-                                                   remote_impi_stores);
+                                                   remote_impi_stores,
+                                                   opt.impi_remote_store_timeout);
 
   PushProfileTask::Config push_profile_config(subscriber_manager);
   DeleteImpuTask::Config delete_impu_config(subscriber_manager);
@@ -2435,17 +4108,62 @@ int main(int argc, char* argv[])
 
   GetBindingsTask::Config get_bindings_config(subscriber_manager);
   GetSubscriptionsTask::Config get_subscriptions_config(subscriber_manager);
+  GetStageLatenciesTask::Config get_stage_latencies_config;
+  GetSproutletCpuTask::Config get_sproutlet_cpu_config;
+  GetLockStatsTask::Config get_lock_stats_config;
+  GetSendQueuesTask::Config get_send_queues_config(stack_data.send_queue_monitor);
+  GetProfileTask::Config get_cpu_profile_config(GetProfileTask::CPU);
+  GetProfileTask::Config get_alloc_profile_config(GetProfileTask::ALLOCS);
+  GetMetricsTask::Config get_metrics_config;
+  GetMemoryTask::Config get_memory_config;
+  GetASConnectionsTask::Config get_as_connections_config;
+
+  // Chronos timer pops and provisioning requests (from Homestead and the
+  // management interface) can be handled on their own pools of threads, so
+  // that a burst of one can't hold up the other.  If there's no pool, they are
+  // handled on the HTTP threads.
+  HttpTaskPool* http_timer_pool = NULL;
+  HttpTaskPool* http_provisioning_pool = NULL;
+
+  if (opt.http_timer_threads > 0)
+  {
+    http_timer_pool = new HttpTaskPool("timer",
+                                       opt.http_timer_threads,
+                                       exception_handler);
+  }
+
+  if (opt.http_provisioning_threads > 0)
+  {
+    http_provisioning_pool = new HttpTaskPool("provisioning",
+                                              opt.http_provisioning_threads,
+                                              exception_handler);
+  }
 
-  HttpStackUtils::TimerHandler<ChronosAoRTimeoutTask, AoRTimeoutTask::Config> aor_timeout_handler(&aor_timeout_config);
-  HttpStackUtils::TimerHandler<ChronosAuthTimeoutTask, AuthTimeoutTask::Config> auth_timeout_handler(&auth_timeout_config);
-  HttpStackUtils::SpawningHandler<DeregistrationTask, DeregistrationTask::Config> deregistration_handler(&deregistration_config);
-  HttpStackUtils::SpawningHandler<PushProfileTask, PushProfileTask::Config> push_profile_handler(&push_profile_config);
+  PooledHandler<ChronosAoRTimeoutTask,
+                AoRTimeoutTask::Config,
+                HttpStackUtils::TimerHandler<ChronosAoRTimeoutTask, AoRTimeoutTask::Config>>
+    aor_timeout_handler(&aor_timeout_config, http_timer_pool, opt.http_max_tasks);
+  PooledHandler<ChronosAuthTimeoutTask,
+                AuthTimeoutTask::Config,
+                HttpStackUtils::TimerHandler<ChronosAuthTimeoutTask, AuthTimeoutTask::Config>>
+    auth_timeout_handler(&auth_timeout_config, http_timer_pool, opt.http_max_tasks);
+  PooledHandler<DeregistrationTask, DeregistrationTask::Config> deregistration_handler(&deregistration_config, http_provisioning_pool, opt.http_max_tasks);
+  PooledHandler<PushProfileTask, PushProfileTask::Config> push_profile_handler(&push_profile_config, http_provisioning_pool, opt.http_max_tasks);
   HttpStackUtils::PingHandler ping_handler;
 
-  HttpStackUtils::SpawningHandler<GetBindingsTask, GetBindingsTask::Config> get_bindings_handler(&get_bindings_config);
-  HttpStackUtils::SpawningHandler<GetSubscriptionsTask, GetSubscriptionsTask::Config> get_subscriptions_handler(&get_subscriptions_config);
+  PooledHandler<GetBindingsTask, GetBindingsTask::Config> get_bindings_handler(&get_bindings_config, http_provisioning_pool, opt.http_max_tasks);
+  PooledHandler<GetSubscriptionsTask, GetSubscriptionsTask::Config> get_subscriptions_handler(&get_subscriptions_config, http_provisioning_pool, opt.http_max_tasks);
+  HttpStackUtils::SpawningHandler<GetStageLatenciesTask, GetStageLatenciesTask::Config> get_stage_latencies_handler(&get_stage_latencies_config);
+  HttpStackUtils::SpawningHandler<GetSproutletCpuTask, GetSproutletCpuTask::Config> get_sproutlet_cpu_handler(&get_sproutlet_cpu_config);
+  HttpStackUtils::SpawningHandler<GetLockStatsTask, GetLockStatsTask::Config> get_lock_stats_handler(&get_lock_stats_config);
+  HttpStackUtils::SpawningHandler<GetSendQueuesTask, GetSendQueuesTask::Config> get_send_queues_handler(&get_send_queues_config);
+  HttpStackUtils::SpawningHandler<GetProfileTask, GetProfileTask::Config> get_cpu_profile_handler(&get_cpu_profile_config);
+  HttpStackUtils::SpawningHandler<GetProfileTask, GetProfileTask::Config> get_alloc_profile_handler(&get_alloc_profile_config);
+  HttpStackUtils::SpawningHandler<GetMetricsTask, GetMetricsTask::Config> get_metrics_handler(&get_metrics_config);
+  HttpStackUtils::SpawningHandler<GetMemoryTask, GetMemoryTask::Config> get_memory_handler(&get_memory_config);
+  HttpStackUtils::SpawningHandler<GetASConnectionsTask, GetASConnectionsTask::Config> get_as_connections_handler(&get_as_connections_config);
 
-  HttpStackUtils::SpawningHandler<DeleteImpuTask, DeleteImpuTask::Config> delete_impu_handler(&delete_impu_config);
+  PooledHandler<DeleteImpuTask, DeleteImpuTask::Config> delete_impu_handler(&delete_impu_config, http_provisioning_pool, opt.http_max_tasks);
 
   if (opt.enabled_scscf)
   {
@@ -2481,6 +4199,24 @@ int main(int argc, char* argv[])
                                         &get_subscriptions_handler);
       http_stack_mgmt->register_handler("^/impu/[^/]+$",
                                         &delete_impu_handler);
+      http_stack_mgmt->register_handler("^/latency-stages$",
+                                        &get_stage_latencies_handler);
+      http_stack_mgmt->register_handler("^/sproutlet-cpu$",
+                                        &get_sproutlet_cpu_handler);
+      http_stack_mgmt->register_handler("^/lock-stats$",
+                                        &get_lock_stats_handler);
+      http_stack_mgmt->register_handler("^/send-queues$",
+                                        &get_send_queues_handler);
+      http_stack_mgmt->register_handler("^/debug/pprof/profile$",
+                                        &get_cpu_profile_handler);
+      http_stack_mgmt->register_handler("^/debug/pprof/allocs$",
+                                        &get_alloc_profile_handler);
+      http_stack_mgmt->register_handler("^/metrics$",
+                                        &get_metrics_handler);
+      http_stack_mgmt->register_handler("^/memory$",
+                                        &get_memory_handler);
+      http_stack_mgmt->register_handler("^/as-connections$",
+                                        &get_as_connections_handler);
       http_stack_mgmt->bind_unix_socket(SPROUT_HTTP_MGMT_SOCKET_PATH);
       http_stack_mgmt->start(&reg_httpthread_with_pjsip);
     }
@@ -2531,11 +4267,17 @@ int main(int argc, char* argv[])
     }
   }
 
-  // Terminate the PJSIP thread and the worker threads to exit.  We kill
-  // the PJSIP thread first - if we killed the worker threads first the
+  // Stop the HTTP task pools now that no more requests can arrive, and before
+  // anything that their tasks use is destroyed.
+  delete http_timer_pool; http_timer_pool = NULL;
+  delete http_provisioning_pool; http_provisioning_pool = NULL;
+
+  // Terminate the PJSIP threads and the worker threads to exit.  We kill
+  // the PJSIP threads first - if we killed the worker threads first the
   // rx_msg_q will stop getting serviced so could fill up blocking
   // the PJSIP thread, causing a deadlock.
-  stop_pjsip_thread();
+  stop_pjsip_threads();
+  WorkerWatchdog::stop();
   stop_worker_threads();
 
   // We must call stop_stack here because this terminates the
@@ -2543,11 +4285,21 @@ int main(int argc, char* argv[])
   // after they have unregistered.
   stop_stack();
 
+  SNMPShards::stop();
   unregister_thread_dispatcher();
   unregister_common_processing_module();
+  delete sas_message_log; sas_message_log = NULL;
+  delete sip_capture; sip_capture = NULL;
+
+  // This holds on to messages, so must be deleted before the stack is.
+  delete stack_data.send_queue_monitor; stack_data.send_queue_monitor = NULL;
 
-  // Destroy the Sproutlet Proxy.
+  // Stop prefetching before the services it fills are destroyed.
+  RegistrationPrefetch::stop();
+
+  // Destroy the Sproutlet Proxy, and the connection pools it used.
   delete sproutlet_proxy;
+  ASConnectionPools::terminate();
 
   // Unload any dynamically loaded sproutlets and delete the loader.
   loader->unload();
@@ -2568,6 +4320,7 @@ int main(int argc, char* argv[])
 
   delete http_stack_sig; http_stack_sig = NULL;
   delete http_stack_mgmt; http_stack_mgmt = NULL;
+  delete chronos_timer_batcher; chronos_timer_batcher = NULL;
   delete chronos_connection;
   delete hss_connection;
   delete fifc_service;
@@ -2577,6 +4330,7 @@ int main(int argc, char* argv[])
   delete quiescing_mgr;
   delete exception_handler;
   delete load_monitor;
+  delete stack_data.dependency_monitor; stack_data.dependency_monitor = NULL;
   delete subscriber_manager;
   delete notify_sender;
   delete s4;
@@ -2613,8 +4367,16 @@ int main(int argc, char* argv[])
   remote_impi_stores.clear();
   for (Store* store: remote_impi_data_stores) { delete store; }
   remote_impi_data_stores.clear();
+  delete local_impi_store_latency_tbl;
+  for (SNMP::EventAccumulatorTable* tbl: remote_impi_store_latency_tbls) { delete tbl; }
+  remote_impi_store_latency_tbls.clear();
 
   delete ralf_processor;
+  delete ralf_batch_size_tbl;
+  delete ralf_queue_depth;
+  delete ralf_spooled_acrs;
+  delete acr_policy;
+  delete suppressed_event_acrs_tbl;
   delete ralf_connection;
   delete ralf_client;
   delete enum_service;
@@ -2646,6 +4408,9 @@ int main(int argc, char* argv[])
   delete overload_counter;
 
   delete homestead_cxn_count;
+  delete homestead_http2_stream_count;
+  delete homestead_http2_rtt_table;
+  delete homestead_hedged_tbl;
 
   delete homestead_latency_table;
   delete homestead_mar_latency_table;
@@ -2668,6 +4433,34 @@ int main(int argc, char* argv[])
 
   delete route_to_remote_alias_tbl;
   delete accept_for_remote_alias_tbl;
+  delete bytes_cloned_tbl;
+  delete tdata_pool_reuse_tbl;
+  delete tdata_pool_retained_bytes;
+  delete pool_arena_bytes;
+  delete pool_arena_in_use_bytes;
+  delete sip_hot_targets_scalar;
+  delete sip_target_refreshes_tbl;
+  delete sip_stale_targets_tbl;
+  delete sip_saturated_connections_tbl;
+  delete worker_threads_scalar;
+  delete blocked_workers_scalar;
+
+  for (SNMP::CounterTable* tbl : transport_thread_rx_tbls)
+  {
+    delete tbl;
+  }
+  transport_thread_rx_tbls.clear();
+  delete worker_steals_tbl;
+  delete enum_cache_stats_tbls.hits_tbl;
+  delete enum_cache_stats_tbls.misses_tbl;
+  delete enum_cache_stats_tbls.evictions_tbl;
+  delete hss_cache_stats_tbls.hits_tbl;
+  delete hss_cache_stats_tbls.misses_tbl;
+  delete hss_cache_stats_tbls.evictions_tbl;
+  delete hss_coalesced_tbl;
+  delete aor_cache_stats_tbls.hits_tbl;
+  delete aor_cache_stats_tbls.misses_tbl;
+  delete aor_cache_stats_tbls.evictions_tbl;
 
   hc->stop_thread();
   delete hc;
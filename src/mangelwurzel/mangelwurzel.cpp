@@ -87,19 +87,18 @@ SproutletTsx* Mangelwurzel::get_tsx(SproutletHelper* helper,
                      &MANGALGORITHM_PARAM);
   if (mangalgorithm_param != NULL)
   {
-    std::string mangalgorithm =
-      PJUtils::pj_str_to_string(&mangalgorithm_param->value);
+    const pj_str_t* mangalgorithm = &mangalgorithm_param->value;
 
-    if (mangalgorithm == REVERSE_MANGALGORITHM)
+    if (pj_strcmp2(mangalgorithm, REVERSE_MANGALGORITHM) == 0)
     {
       config.mangalgorithm = MangelwurzelTsx::REVERSE;
     }
-    else if (mangalgorithm != ROT_13_MANGALGORITHM)
+    else if (pj_strcmp2(mangalgorithm, ROT_13_MANGALGORITHM) != 0)
     {
-      TRC_ERROR("Invalid mangalgorithm specified: %s",
-                mangalgorithm.c_str());
+      TRC_ERROR("Invalid mangalgorithm specified: %.*s",
+                mangalgorithm->slen, mangalgorithm->ptr);
       SAS::Event event(trail, SASEvent::INVALID_MANGALGORITHM, 0);
-      event.add_var_param(mangalgorithm);
+      event.add_var_param(mangalgorithm->slen, mangalgorithm->ptr);
       SAS::report_event(event);
     }
   }
@@ -122,7 +121,7 @@ SproutletTsx* Mangelwurzel::get_tsx(SproutletHelper* helper,
 void MangelwurzelTsx::on_rx_initial_request(pjsip_msg* req)
 {
   // Store off the unmodified request.
-  _unmodified_request = original_request();
+  _unmodified_request = original_request_view();
 
   // If Mangelwurzel receives a REGISTER, we need to respond with a 200 OK
   // rather than mangling the request and forwarding it on.
@@ -144,8 +143,7 @@ void MangelwurzelTsx::on_rx_initial_request(pjsip_msg* req)
     (pjsip_uri*)pjsip_uri_clone(pool, mangelwurzel_route_hdr->name_addr.uri);
 
   SAS::Event event(trail(), SASEvent::MANGELWURZEL_INITIAL_REQ, 0);
-  event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                             mangelwurzel_uri));
+  PJUtils::add_uri_param(event, PJSIP_URI_IN_ROUTING_HDR, mangelwurzel_uri);
   SAS::report_event(event);
 
   if (_config.dialog)
@@ -224,7 +222,7 @@ void MangelwurzelTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
 void MangelwurzelTsx::on_rx_in_dialog_request(pjsip_msg* req)
 {
   // Store off the unmodified request.
-  _unmodified_request = original_request();
+  _unmodified_request = original_request_view();
 
   pj_pool_t* pool = get_pool(req);
 
@@ -234,8 +232,7 @@ void MangelwurzelTsx::on_rx_in_dialog_request(pjsip_msg* req)
   pjsip_uri* mangelwurzel_uri = mangelwurzel_route_hdr->name_addr.uri;
 
   SAS::Event event(trail(), SASEvent::MANGELWURZEL_IN_DIALOG_REQ, 0);
-  event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                             mangelwurzel_uri));
+  PJUtils::add_uri_param(event, PJSIP_URI_IN_ROUTING_HDR, mangelwurzel_uri);
   SAS::report_event(event);
 
   if (_config.dialog)
@@ -274,20 +271,16 @@ void MangelwurzelTsx::mangle_dialog_identifiers(pjsip_msg* req, pj_pool_t* pool)
 
   if (from_hdr != NULL)
   {
-    std::string from_tag = PJUtils::pj_str_to_string(&from_hdr->tag);
-    mangle_string(from_tag);
-    TRC_DEBUG("From tag mangled to %s", from_tag.c_str());
-    from_hdr->tag = pj_strdup3(pool, from_tag.c_str());
+    mangle_string(from_hdr->tag, pool);
+    TRC_DEBUG("From tag mangled to %.*s", from_hdr->tag.slen, from_hdr->tag.ptr);
   }
 
   pjsip_to_hdr* to_hdr = PJSIP_MSG_TO_HDR(req);
 
   if (to_hdr != NULL)
   {
-    std::string to_tag = PJUtils::pj_str_to_string(&to_hdr->tag);
-    mangle_string(to_tag);
-    TRC_DEBUG("To tag mangled to %s", to_tag.c_str());
-    to_hdr->tag = pj_strdup3(pool, to_tag.c_str());
+    mangle_string(to_hdr->tag, pool);
+    TRC_DEBUG("To tag mangled to %.*s", to_hdr->tag.slen, to_hdr->tag.ptr);
   }
 
   pjsip_cid_hdr* cid_hdr = (pjsip_cid_hdr*)pjsip_msg_find_hdr(req,
@@ -295,10 +288,7 @@ void MangelwurzelTsx::mangle_dialog_identifiers(pjsip_msg* req, pj_pool_t* pool)
                                                               NULL);
   if (cid_hdr != NULL)
   {
-    std::string call_id = PJUtils::pj_str_to_string(&cid_hdr->id);
-    mangle_string(call_id);
-    TRC_DEBUG("Call ID manged to %s", call_id.c_str());
-    cid_hdr->id = pj_strdup3(pool, call_id.c_str());
+    mangle_string(cid_hdr->id, pool);
 
     // Report a SAS marker for the new call ID so that the two dialogs can be
     // correlated in SAS.
@@ -354,37 +344,43 @@ void MangelwurzelTsx::mangle_uri(pjsip_uri* uri,
   if (PJSIP_URI_SCHEME_IS_SIP(uri))
   {
     pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)uri;
-    std::string user = PJUtils::pj_str_to_string(&sip_uri->user);
-    mangle_string(user);
-    sip_uri->user = pj_strdup3(pool, user.c_str());
+    mangle_string(sip_uri->user, pool);
 
     if ((force_mangle_domain) || (_config.change_domain))
     {
-      std::string host = PJUtils::pj_str_to_string(&sip_uri->host);
-      mangle_string(host);
-      sip_uri->host = pj_strdup3(pool, host.c_str());
+      mangle_string(sip_uri->host, pool);
     }
   }
   else if (PJSIP_URI_SCHEME_IS_TEL(uri))
   {
     pjsip_tel_uri* tel_uri = (pjsip_tel_uri*)uri;
-    std::string number = PJUtils::pj_str_to_string(&tel_uri->number);
-    mangle_string(number);
-    tel_uri->number = pj_strdup3(pool, number.c_str());
+    mangle_string(tel_uri->number, pool);
   }
 }
 
-/// Decide which mangalgorithm to use.
-void MangelwurzelTsx::mangle_string(std::string& str)
+/// Apply the mangalgorithm to a string in a message.  The string is copied
+/// into the message's pool and mangled there, as it may point into a buffer
+/// that is shared with the original request.
+void MangelwurzelTsx::mangle_string(pj_str_t& str, pj_pool_t* pool)
 {
+  if (str.slen == 0)
+  {
+    return;
+  }
+
+  pj_str_t mangled;
+  pj_strdup(pool, &mangled, &str);
+
   if (_config.mangalgorithm == REVERSE)
   {
-    reverse(str);
+    reverse(mangled.ptr, mangled.slen);
   }
   else
   {
-    rot13(str);
+    rot13(mangled.ptr, mangled.slen);
   }
+
+  str = mangled;
 }
 
 /// Implementation of the rot13 mangalgorithm. Alphabet characters are rotated
@@ -392,7 +388,12 @@ void MangelwurzelTsx::mangle_string(std::string& str)
 /// single digit numbers by 5.
 void MangelwurzelTsx::rot13(std::string& str)
 {
-  for (std::string::iterator it = str.begin(); it != str.end(); it++)
+  rot13(&str[0], str.size());
+}
+
+void MangelwurzelTsx::rot13(char* str, size_t len)
+{
+  for (char* it = str; it != str + len; it++)
   {
     if (((*it >= 'a') && (*it <= 'm')) || ((*it >= 'A') && (*it <= 'M')))
     {
@@ -416,7 +417,12 @@ void MangelwurzelTsx::rot13(std::string& str)
 /// Implementation of the reverse mangalgorithm. Reverse the string.
 void MangelwurzelTsx::reverse(std::string& str)
 {
-  std::reverse(str.begin(), str.end());
+  reverse(&str[0], str.size());
+}
+
+void MangelwurzelTsx::reverse(char* str, size_t len)
+{
+  std::reverse(str, str + len);
 }
 
 /// Remove all the Via headers from the request. We do this on all requests,
@@ -338,7 +338,6 @@ TEST_F(MangelwurzelTest, InitialReq)
 
   // Save off the original request. We expect mangelwurzel to request it later.
   pjsip_msg* original_req = parse_msg(msg.get_request());
-  EXPECT_CALL(*_helper, free_msg(original_req));
 
   // Set up the mangelwurzel transaction's config. Turn everything on.
   MangelwurzelTsx::Config config;
@@ -366,7 +365,7 @@ TEST_F(MangelwurzelTest, InitialReq)
 
   // Trigger initial request processing in mangelwurzel and catch the request
   // again when mangelwurzel sends it on.
-  EXPECT_CALL(*_helper, original_request()).WillOnce(Return(original_req));
+  EXPECT_CALL(*_helper, original_request_view()).WillOnce(Return(original_req));
   EXPECT_CALL(*_helper, get_pool(req)).WillOnce(Return(stack_data.pool));
   EXPECT_CALL(*_helper, send_request(req, BaseResolver::ALL_LISTS));
   mangelwurzel_tsx.on_rx_initial_request(req);
@@ -398,7 +397,6 @@ TEST_F(MangelwurzelTest, Response)
 
   // Save off the original request. We expect mangelwurzel to request it later.
   pjsip_msg* original_req = parse_msg(msg.get_request());
-  EXPECT_CALL(*_helper, free_msg(original_req));
 
   // Set up the mangelwurzel transaction's config. Turn everything on.
   MangelwurzelTsx::Config config;
@@ -469,8 +467,7 @@ TEST_F(MangelwurzelTest, InDialogReq)
 
   // Trigger initial request processing in mangelwurzel and catch the request
   // again when mangelwurzel sends it on.
-  EXPECT_CALL(*_helper, original_request()).WillOnce(Return(req));
-  EXPECT_CALL(*_helper, free_msg(req));
+  EXPECT_CALL(*_helper, original_request_view()).WillOnce(Return(req));
 
   // Trigger in dialog request processing in mangelwurzel and catch the request
   // again when mangelwurzel sends it on.
@@ -504,7 +501,6 @@ TEST_F(MangelwurzelTest, REGISTER)
 
   // Save off the original request. We expect mangelwurzel to request it later.
   pjsip_msg* original_req = parse_msg(msg.get_request());
-  EXPECT_CALL(*_helper, free_msg(original_req));
 
   // Set up the mangelwurzel transaction's config. This is different to the
   // mainline case in order to test more code paths.
@@ -522,7 +518,7 @@ TEST_F(MangelwurzelTest, REGISTER)
 
   // Trigger in dialog request processing in mangelwurzel and catch the request
   // again when mangelwurzel sends it on.
-  EXPECT_CALL(*_helper, original_request()).WillOnce(Return(original_req));
+  EXPECT_CALL(*_helper, original_request_view()).WillOnce(Return(original_req));
   EXPECT_CALL(*_helper, create_response(_, PJSIP_SC_OK, ""));
   EXPECT_CALL(*_helper, send_response(_));
   EXPECT_CALL(*_helper, free_msg(req));
@@ -0,0 +1,118 @@
+/**
+ * @file memory_accounting.cpp Accounting of memory use by subsystem.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+
+#include "memory_accounting.h"
+#include "metrics.h"
+
+namespace MemoryAccounting
+{
+  Account::Account(const std::string& name) :
+    _name(name),
+    _bytes(0),
+    _high_water(0),
+    _sampler_lock(),
+    _sampler()
+  {
+  }
+
+  void Account::set_sampler(std::function<size_t()> sampler)
+  {
+    std::lock_guard<std::mutex> guard(_sampler_lock);
+    _sampler = sampler;
+
+    if (!_sampler)
+    {
+      _bytes.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  int64_t Account::bytes()
+  {
+    {
+      std::lock_guard<std::mutex> guard(_sampler_lock);
+
+      if (_sampler)
+      {
+        int64_t bytes = (int64_t)_sampler();
+        _bytes.store(bytes, std::memory_order_relaxed);
+        update_high_water(bytes);
+        return bytes;
+      }
+    }
+
+    return _bytes.load(std::memory_order_relaxed);
+  }
+
+  // The accounts, by name.  These are created on first use, so accounts can
+  // be looked up from static initializers.
+  struct Registry
+  {
+    std::mutex lock;
+    std::map<std::string, Account*> accounts;
+  };
+
+  static Registry& registry()
+  {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  Account* account(const std::string& name)
+  {
+    Registry& accounts = registry();
+    std::lock_guard<std::mutex> guard(accounts.lock);
+
+    Account*& account = accounts.accounts[name];
+    if (account == NULL)
+    {
+      account = new Account(name);
+
+      Account* gauged = account;
+      Metrics::gauge("sprout_memory_" + name + "_bytes",
+                     "Memory used by " + name,
+                     [gauged]() { return (double)gauged->bytes(); });
+      Metrics::gauge("sprout_memory_" + name + "_high_water_bytes",
+                     "Highest memory used by " + name,
+                     [gauged]() { return (double)gauged->high_water(); });
+    }
+
+    return account;
+  }
+
+  std::vector<Usage> usage()
+  {
+    std::vector<Account*> accounts;
+    {
+      Registry& registered = registry();
+      std::lock_guard<std::mutex> guard(registered.lock);
+
+      for (const auto& account : registered.accounts)
+      {
+        accounts.push_back(account.second);
+      }
+    }
+
+    // The accounts are read without the lock held, as samplers may take
+    // other locks.
+    std::vector<Usage> usage;
+    usage.reserve(accounts.size());
+
+    for (Account* account : accounts)
+    {
+      int64_t bytes = account->bytes();
+      usage.push_back({account->name(), bytes, account->high_water()});
+    }
+
+    return usage;
+  }
+}
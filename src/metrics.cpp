@@ -0,0 +1,258 @@
+/**
+ * @file metrics.cpp Metrics exported in OpenMetrics format.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include "metrics.h"
+
+namespace Metrics
+{
+  const std::vector<uint64_t> LATENCY_BOUNDS_US = {500,
+                                                   1000,
+                                                   2500,
+                                                   5000,
+                                                   10000,
+                                                   25000,
+                                                   50000,
+                                                   100000,
+                                                   250000,
+                                                   500000,
+                                                   1000000,
+                                                   2500000,
+                                                   5000000,
+                                                   10000000};
+
+  const char* const CONTENT_TYPE =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+  static thread_local int tl_shard = -1;
+  static std::atomic<int> next_shard(0);
+
+  int shard()
+  {
+    if (tl_shard < 0)
+    {
+      tl_shard = next_shard.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS;
+    }
+
+    return tl_shard;
+  }
+
+  Counter::Counter()
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      _shards[ii].value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t Counter::value() const
+  {
+    uint64_t value = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      value += _shards[ii].value.load(std::memory_order_relaxed);
+    }
+
+    return value;
+  }
+
+  Histogram::Histogram(const std::vector<uint64_t>& bounds_us) :
+    _bounds_us(bounds_us)
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      _shards[ii].sum_us.store(0, std::memory_order_relaxed);
+      _shards[ii].buckets = new std::atomic<uint64_t>[_bounds_us.size() + 1];
+
+      for (size_t jj = 0; jj <= _bounds_us.size(); ++jj)
+      {
+        _shards[ii].buckets[jj].store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  Histogram::~Histogram()
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      delete[] _shards[ii].buckets;
+    }
+  }
+
+  void Histogram::observe(uint64_t us)
+  {
+    // The first bucket whose bound the value is within.  If there isn't one
+    // this is the unbounded bucket, which is last.
+    size_t bucket = std::lower_bound(_bounds_us.begin(), _bounds_us.end(), us) -
+                    _bounds_us.begin();
+
+    Shard& shard = _shards[Metrics::shard()];
+    shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    shard.sum_us.fetch_add(us, std::memory_order_relaxed);
+  }
+
+  void Histogram::totals(std::vector<uint64_t>& counts, uint64_t& sum_us) const
+  {
+    counts.assign(_bounds_us.size() + 1, 0);
+    sum_us = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      for (size_t jj = 0; jj <= _bounds_us.size(); ++jj)
+      {
+        counts[jj] += _shards[ii].buckets[jj].load(std::memory_order_relaxed);
+      }
+
+      sum_us += _shards[ii].sum_us.load(std::memory_order_relaxed);
+    }
+  }
+
+  // The metrics, by name.  These are created on first use, so metrics can be
+  // looked up from static initializers.
+  struct Registry
+  {
+    std::mutex lock;
+    std::map<std::string, std::pair<std::string, Counter*>> counters;
+    std::map<std::string, std::pair<std::string, Histogram*>> histograms;
+    std::map<std::string, std::pair<std::string, std::function<double()>>> gauges;
+  };
+
+  static Registry& registry()
+  {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  Counter* counter(const std::string& name, const std::string& help)
+  {
+    Registry& metrics = registry();
+    std::lock_guard<std::mutex> guard(metrics.lock);
+
+    std::pair<std::string, Counter*>& entry = metrics.counters[name];
+    if (entry.second == NULL)
+    {
+      entry.first = help;
+      entry.second = new Counter();
+    }
+
+    return entry.second;
+  }
+
+  Histogram* histogram(const std::string& name,
+                       const std::string& help,
+                       const std::vector<uint64_t>& bounds_us)
+  {
+    Registry& metrics = registry();
+    std::lock_guard<std::mutex> guard(metrics.lock);
+
+    std::pair<std::string, Histogram*>& entry = metrics.histograms[name];
+    if (entry.second == NULL)
+    {
+      entry.first = help;
+      entry.second = new Histogram(bounds_us);
+    }
+
+    return entry.second;
+  }
+
+  void gauge(const std::string& name,
+             const std::string& help,
+             std::function<double()> value)
+  {
+    Registry& metrics = registry();
+    std::lock_guard<std::mutex> guard(metrics.lock);
+    metrics.gauges[name] = std::make_pair(help, value);
+  }
+
+  static void render_header(std::string& out,
+                            const std::string& name,
+                            const char* type,
+                            const std::string& help)
+  {
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+  }
+
+  std::string render()
+  {
+    std::vector<std::pair<std::string, std::pair<std::string, Counter*>>> counters;
+    std::vector<std::pair<std::string, std::pair<std::string, Histogram*>>> histograms;
+    std::vector<std::pair<std::string, std::pair<std::string, std::function<double()>>>> gauges;
+    {
+      Registry& metrics = registry();
+      std::lock_guard<std::mutex> guard(metrics.lock);
+      counters.assign(metrics.counters.begin(), metrics.counters.end());
+      histograms.assign(metrics.histograms.begin(), metrics.histograms.end());
+      gauges.assign(metrics.gauges.begin(), metrics.gauges.end());
+    }
+
+    std::string out;
+    char buf[64];
+
+    for (const auto& counter : counters)
+    {
+      render_header(out, counter.first, "counter", counter.second.first);
+      snprintf(buf, sizeof(buf), " %lu\n", counter.second.second->value());
+      out.append(counter.first).append("_total").append(buf);
+    }
+
+    for (const auto& histogram : histograms)
+    {
+      const std::string& name = histogram.first;
+      const Histogram* values = histogram.second.second;
+      std::vector<uint64_t> counts;
+      uint64_t sum_us;
+      values->totals(counts, sum_us);
+
+      render_header(out, name, "histogram", histogram.second.first);
+
+      // Bucket counts are cumulative.
+      uint64_t count = 0;
+      for (size_t ii = 0; ii < counts.size(); ++ii)
+      {
+        count += counts[ii];
+
+        if (ii < values->bounds_us().size())
+        {
+          snprintf(buf, sizeof(buf), "_bucket{le=\"%g\"} %lu\n",
+                   values->bounds_us()[ii] / 1000000.0, count);
+        }
+        else
+        {
+          snprintf(buf, sizeof(buf), "_bucket{le=\"+Inf\"} %lu\n", count);
+        }
+        out.append(name).append(buf);
+      }
+
+      snprintf(buf, sizeof(buf), "_sum %.6f\n", sum_us / 1000000.0);
+      out.append(name).append(buf);
+      snprintf(buf, sizeof(buf), "_count %lu\n", count);
+      out.append(name).append(buf);
+    }
+
+    // The gauges are read without the lock held, as reading them may take
+    // other locks.
+    for (const auto& gauge : gauges)
+    {
+      render_header(out, gauge.first, "gauge", gauge.second.first);
+      snprintf(buf, sizeof(buf), " %.17g\n", gauge.second.second());
+      out.append(gauge.first).append(buf);
+    }
+
+    out.append("# EOF\n");
+    return out;
+  }
+}
@@ -14,6 +14,7 @@
 #include <boost/algorithm/string/predicate.hpp>
 
 #include "log.h"
+#include "utils.h"
 #include "stack.h"
 #include "pjutils.h"
 #include "pjmedia.h"
@@ -21,6 +22,8 @@
 #include "mmtel.h"
 #include "constants.h"
 #include "custom_headers.h"
+#include "memory_accounting.h"
+#include "registration_prefetch.h"
 
 using namespace rapidxml;
 
@@ -34,6 +37,55 @@ using namespace rapidxml;
 #define PRIVACY_H_CRITICAL 0x00000020
 
 
+const int Mmtel::NUM_CACHE_SHARDS;
+const unsigned int MmtelTsx::CB_CONDITIONS;
+
+Mmtel::Mmtel(const std::string& service_name,
+             XDMConnection* xdm_client,
+             int simservs_cache_ttl,
+             size_t simservs_cache_size,
+             const ShardedLRUCacheStatsTables& simservs_cache_stats_tbls,
+             SNMP::EventAccumulatorTable* latency_saved_tbl) :
+  AppServer(service_name),
+  _xdmc(xdm_client),
+  _simservs_cache_ttl(simservs_cache_ttl),
+  _simservs_cache(NULL),
+  _prefetch_handler(-1),
+  _avg_xdm_latency_us(0),
+  _latency_saved_tbl(latency_saved_tbl)
+{
+  if ((simservs_cache_ttl > 0) && (simservs_cache_size > 0))
+  {
+    _simservs_cache =
+      new ShardedLRUCache<std::string, std::shared_ptr<const simservs>>(
+                                                  simservs_cache_size,
+                                                  NUM_CACHE_SHARDS,
+                                                  simservs_cache_stats_tbls);
+    MemoryAccounting::account("simservs_cache")->set_sampler([this]()
+    {
+      return _simservs_cache->memory(sizeof(simservs));
+    });
+
+    // Fetch users' simservs when they register, so their first calls find
+    // them cached.
+    _prefetch_handler = RegistrationPrefetch::add_handler(
+      [this](const std::string& impu, SAS::TrailId trail)
+      {
+        prefetch_user_services(impu, trail);
+      });
+  }
+}
+
+Mmtel::~Mmtel()
+{
+  if (_simservs_cache != NULL)
+  {
+    RegistrationPrefetch::remove_handler(_prefetch_handler);
+    MemoryAccounting::account("simservs_cache")->set_sampler(nullptr);
+  }
+  delete _simservs_cache; _simservs_cache = NULL;
+}
+
 /// Get a new MmtelTsx from the Mmtel AS.
 AppServerTsx* Mmtel::get_app_tsx(SproutletHelper* helper,
                                  pjsip_msg* req,
@@ -45,7 +97,7 @@ AppServerTsx* Mmtel::get_app_tsx(SproutletHelper* helper,
 
   // Find the P-Served-User header, look up simservs and construct an MmtelTsx.
   pjsip_routing_hdr* psu_hdr = (pjsip_routing_hdr*)
-                     pjsip_msg_find_hdr_by_name(req, &STR_P_SERVED_USER, NULL);
+                     PJUtils::peek_hdr_by_name(req, &STR_P_SERVED_USER);
   if (psu_hdr != NULL)
   {
     TRC_DEBUG("Found P-Served-User header: %s",
@@ -53,7 +105,8 @@ AppServerTsx* Mmtel::get_app_tsx(SproutletHelper* helper,
     pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(&psu_hdr->name_addr);
     std::string served_user = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri);
 
-    simservs* user_services = get_user_services(served_user, trail);
+    std::shared_ptr<const simservs> user_services =
+                                        get_user_services(served_user, trail);
     mmtel_tsx = new MmtelTsx(req, user_services, trail);
   }
   else
@@ -72,8 +125,42 @@ AppServerTsx* Mmtel::get_app_tsx(SproutletHelper* helper,
 // @returns The simservs object if it is relevant and present.  If there is
 // no simservs configuration for the user, returns a default simservs object
 // with all services disabled.
-simservs* Mmtel::get_user_services(std::string public_id, SAS::TrailId trail)
+//
+// Parsed simservs are cached (if the cache is enabled) for a configured
+// time, and shared by all the transactions for the user.  Changes made on
+// the XDMS during that time aren't seen until the entry expires.  Failures
+// to fetch the simservs aren't cached.
+std::shared_ptr<const simservs> Mmtel::get_user_services(std::string public_id,
+                                                         SAS::TrailId trail)
 {
+  std::shared_ptr<const simservs> user_services;
+
+  if ((_simservs_cache != NULL) &&
+      (_simservs_cache->get(public_id, user_services)))
+  {
+    TRC_DEBUG("Found cached simservs configuration for %s", public_id.c_str());
+    SAS::Event event(trail, SASEvent::SIMSERVS_CACHE_HIT, 0);
+    event.add_var_param(public_id);
+    SAS::report_event(event);
+
+    if (_latency_saved_tbl != NULL)
+    {
+      _latency_saved_tbl->accumulate(_avg_xdm_latency_us.load());
+    }
+
+    return user_services;
+  }
+
+  return fetch_user_services(public_id, trail);
+}
+
+// Fetch the user services configuration from the XDMS, and cache it if the
+// cache is enabled.
+std::shared_ptr<const simservs> Mmtel::fetch_user_services(const std::string& public_id,
+                                                           SAS::TrailId trail)
+{
+  std::shared_ptr<const simservs> user_services;
+
   // Fetch the user's simservs configuration from the XDMS
   TRC_DEBUG("Fetching simservs configuration for %s", public_id.c_str());
   {
@@ -82,20 +169,50 @@ simservs* Mmtel::get_user_services(std::string public_id, SAS::TrailId trail)
     SAS::report_event(event);
   }
   std::string simservs_xml;
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
   if (!_xdmc->get_simservs(public_id, simservs_xml, "", trail))
   {
     TRC_DEBUG("Failed to fetch simservs configuration for %s, no MMTel services enabled", public_id.c_str());
     SAS::Event event(trail, SASEvent::FAILED_RETRIEVE_SIMSERVS, 0);
     SAS::report_event(event);
-    return new simservs("");
+    return std::make_shared<simservs>("");
   }
 
   // Parse the retrieved XDMS information
-  simservs *user_services = new simservs(simservs_xml);
+  user_services = std::make_shared<simservs>(std::move(simservs_xml));
+
+  if (_simservs_cache != NULL)
+  {
+    unsigned long latency_us = 0;
+    if (stopWatch.read(latency_us))
+    {
+      // Weight the latest fetch at 1/8.  This races with other threads
+      // updating the average, but losing the odd sample doesn't matter.
+      unsigned long avg_us = _avg_xdm_latency_us.load();
+      _avg_xdm_latency_us = (avg_us == 0) ?
+                            latency_us :
+                            ((avg_us * 7) + latency_us) / 8;
+    }
+
+    _simservs_cache->put(public_id, user_services, _simservs_cache_ttl);
+  }
 
   return user_services;
 }
 
+// Fetch the user services configuration for a user who has just registered,
+// if it isn't already cached.
+void Mmtel::prefetch_user_services(const std::string& public_id,
+                                   SAS::TrailId trail)
+{
+  if (!_simservs_cache->contains(public_id))
+  {
+    TRC_DEBUG("Prefetching simservs configuration for %s", public_id.c_str());
+    fetch_user_services(public_id, trail);
+  }
+}
+
 /// Constructor.
 CallDiversionAS::CallDiversionAS(const std::string& service_name) :
   AppServer(service_name),
@@ -155,7 +272,7 @@ AppServerTsx* CallDiversionAS::get_app_tsx(SproutletHelper* helper,
 
     {
       SAS::Event event(trail, SASEvent::CALL_DIVERSION_INVOKED, 0);
-      event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, (pjsip_uri*)uri));
+      PJUtils::add_uri_param(event, PJSIP_URI_IN_CONTACT_HDR, (pjsip_uri*)uri);
       SAS::report_event(event);
     }
 
@@ -231,7 +348,8 @@ AppServerTsx* CallDiversionAS::get_app_tsx(SproutletHelper* helper,
         }
       }
 
-      simservs* user_services = new simservs(target, conditions, no_reply_timer);
+      std::shared_ptr<const simservs> user_services =
+                   std::make_shared<simservs>(target, conditions, no_reply_timer);
       mmtel_tsx = new MmtelTsx(req, user_services, trail, this);
 
       {
@@ -259,7 +377,7 @@ AppServerTsx* CallDiversionAS::get_app_tsx(SproutletHelper* helper,
 
 /// Constructor for the MmtelTsx.
 MmtelTsx::MmtelTsx(pjsip_msg* req,
-                   simservs* user_services,
+                   std::shared_ptr<const simservs> user_services,
                    SAS::TrailId trail,
                    CDivCallback* cdiv_callback) :
   AppServerTsx(),
@@ -271,7 +389,7 @@ MmtelTsx::MmtelTsx(pjsip_msg* req,
   _country_code = "1";
 
   pjsip_routing_hdr* psu_hdr = (pjsip_routing_hdr*)
-                     pjsip_msg_find_hdr_by_name(req, &STR_P_SERVED_USER, NULL);
+                     PJUtils::peek_hdr_by_name(req, &STR_P_SERVED_USER);
   if (psu_hdr != NULL)
   {
     // Inspect the `sescase` parameter to see if it indicates origination.
@@ -330,7 +448,12 @@ MmtelTsx::MmtelTsx(pjsip_msg* req,
   {
     _ringing = false;
     // Determine the media type conditions, in case they're needed later.
-    if (req->line.req.method.id == PJSIP_INVITE_METHOD)
+    // This means parsing the SDP, so we only do it if one of the user's
+    // call-diversion rules depends on the media type.
+    if ((req->line.req.method.id == PJSIP_INVITE_METHOD) &&
+        (_user_services != NULL) &&
+        (_user_services->cdiv_enabled()) &&
+        (_user_services->cdiv_rule_conditions() & simservs::Rule::CONDITION_MEDIA))
     {
       _media_conditions = get_media_type_conditions(req);
     }
@@ -365,10 +488,6 @@ MmtelTsx::~MmtelTsx()
     _no_reply_timer = 0;
   }
 
-  if (_user_services != NULL)
-  {
-    delete _user_services;
-  }
 }
 
 // Apply Mmtel processing on initial invite.
@@ -644,10 +763,16 @@ unsigned int MmtelTsx::get_media_type_conditions(pjsip_msg *msg)
 
 // Apply call barring, using the supplied rules (as defined in 3GPP TS 24.611 v11.2.0)
 //
+// @param rule_conditions The union of the conditions used by the rules.
 // @returns true if the call may still proceed, false otherwise.
 pjsip_status_code MmtelTsx::apply_call_barring(const std::vector<simservs::CBRule>* ruleset,
+                                               unsigned int rule_conditions,
                                                pjsip_msg* req)
 {
+  // Work out which of the conditions the rules depend on hold for this call,
+  // so that each rule can then be tested with a mask.
+  unsigned int call_conditions = get_cb_conditions(rule_conditions, req);
+
   // If one of the matching rules evaluates to allow=true then the resulting value shall be allow=true
   // and the call continues normally, otherwise the result shall be allow=false and the call will be barred.
   //   -- 3GPP TS 24.611 v11.2.0
@@ -657,7 +782,13 @@ pjsip_status_code MmtelTsx::apply_call_barring(const std::vector<simservs::CBRul
        rule != ruleset->end();
        rule++)
   {
-    if (check_cb_rule(*rule, req))
+    // Only the roaming and international conditions apply to call barring -
+    // any others are ignored.
+    unsigned int conditions = rule->conditions() & CB_CONDITIONS;
+    TRC_DEBUG("Testing call (0x%X) against conditions (0x%X)",
+              call_conditions, conditions);
+
+    if ((conditions & ~call_conditions) == 0)
     {
       rule_matched = true;
       if (rule->allow_call())
@@ -688,77 +819,76 @@ pjsip_status_code MmtelTsx::apply_call_barring(const std::vector<simservs::CBRul
   return rc;
 }
 
-// Determine if an arbitary rule's conditions apply to a call.
+// Determine which of the call barring conditions used by a set of rules hold
+// for a call.
 //
-// @return true if the rule should be applied (i.e. the conditions hold)
-bool MmtelTsx::check_cb_rule(const simservs::CBRule& rule, pjsip_msg* req)
+// @return The conditions that hold.
+unsigned int MmtelTsx::get_cb_conditions(unsigned int rule_conditions,
+                                         pjsip_msg* req)
 {
-  bool rule_matches = true;
-  int conditions = rule.conditions();
-  TRC_DEBUG("Testing call against conditions (0x%X)", conditions);
+  unsigned int call_conditions = 0;
+
+  // Clearwater doesn't support roaming calls yet, so neither the roaming nor
+  // the international excluding home country conditions ever hold.
+  if ((rule_conditions & simservs::Rule::CONDITION_INTERNATIONAL) &&
+      (is_international_call(req)))
+  {
+    call_conditions |= simservs::Rule::CONDITION_INTERNATIONAL;
+  }
+
+  return call_conditions;
+}
 
-  if (conditions & simservs::Rule::CONDITION_ROAMING)
+// Determine if a call is to an international number.
+bool MmtelTsx::is_international_call(pjsip_msg* req)
+{
+  // Detect international calls, this requires the request URI to be a TEL URI or a SIP URI with a 'phone'
+  // parameter set.  Then we need to look at the country code to determine if we're going international.
+  std::string dialed_number;
+  pjsip_uri *uri = req->line.req.uri;
+  if (PJSIP_URI_SCHEME_IS_TEL(uri))
   {
-    // Clearwater doesn't support roaming calls yet, this never applies
-    TRC_DEBUG("Roaming condition fails");
-    rule_matches = false;
+    TRC_DEBUG("TEL: Number dialed");
+    pj_str_t* tel_number = &((pjsip_tel_uri *)uri)->number;
+    dialed_number.assign(pj_strbuf(tel_number), pj_strlen(tel_number));
   }
-  if (conditions & simservs::Rule::CONDITION_INTERNATIONAL)
+  else if (PJSIP_URI_SCHEME_IS_SIP(uri))
   {
-    // Detect international calls, this requires the request URI to be a TEL URI or a SIP URI with a 'phone'
-    // parameter set.  Then we need to look at the country code to determine if we're going international.
-    std::string dialed_number;
-    pjsip_uri *uri = req->line.req.uri;
-    if (PJSIP_URI_SCHEME_IS_TEL(uri))
+    TRC_DEBUG("SIP/SIPS: Number dialed");
+    pjsip_sip_uri *sip_uri = (pjsip_sip_uri *)uri;
+
+    // According to 3GPP TS 24.611 v11.2.0, only SIP UIRs with user=phone may be treated as international
+    // unfortunately neither X-Lite nor Accession ever set this parameter.  Therefore we will look at any SIP username
+    // as a potential international number.
+    //
+    // To restore the specced behaviour, uncomment the below:
+    //
+    // if (pj_stricmp2(&sip_uri->user_param, "phone") == 0)
     {
-      TRC_DEBUG("TEL: Number dialed");
-      pj_str_t* tel_number = &((pjsip_tel_uri *)uri)->number;
-      dialed_number.assign(pj_strbuf(tel_number), pj_strlen(tel_number));
-    }
-    else if (PJSIP_URI_SCHEME_IS_SIP(uri))
-    {
-      TRC_DEBUG("SIP/SIPS: Number dialed");
-      pjsip_sip_uri *sip_uri = (pjsip_sip_uri *)uri;
-
-      // According to 3GPP TS 24.611 v11.2.0, only SIP UIRs with user=phone may be treated as international
-      // unfortunately neither X-Lite nor Accession ever set this parameter.  Therefore we will look at any SIP username
-      // as a potential international number.
-      //
-      // To restore the specced behaviour, uncomment the below:
-      //
-      // if (pj_stricmp2(&sip_uri->user_param, "phone") == 0)
-      {
-        pj_str_t *sip_number = &sip_uri->user;
-        dialed_number.assign(pj_strbuf(sip_number), pj_strlen(sip_number));
-      }
+      pj_str_t *sip_number = &sip_uri->user;
+      dialed_number.assign(pj_strbuf(sip_number), pj_strlen(sip_number));
     }
+  }
 
-    // If we have no number or it starts with our country code or doesn't start with '+', '00' or '011' it's
-    // non-international.
-    if (dialed_number == "")
-    {
-      TRC_DEBUG("SIP username requested, international number detection not possible");
-      rule_matches = false;
-    }
-    else if (!(boost::starts_with(dialed_number, "+") ||
-               boost::starts_with(dialed_number, "00") ||
-               boost::starts_with(dialed_number, "011")) ||
-             boost::starts_with(dialed_number, "+" + _country_code) ||
-             boost::starts_with(dialed_number, "00" + _country_code) ||
-             boost::starts_with(dialed_number, "011" + _country_code))
-    {
-      TRC_DEBUG("International condition fails, dialed number is '%s'", dialed_number.c_str());
-      rule_matches = false;
-    }
+  // If we have no number or it starts with our country code or doesn't start with '+', '00' or '011' it's
+  // non-international.
+  if (dialed_number == "")
+  {
+    TRC_DEBUG("SIP username requested, international number detection not possible");
+    return false;
   }
-  if (conditions & simservs::Rule::CONDITION_INTERNATIONAL_EXHC)
+  else if (!(boost::starts_with(dialed_number, "+") ||
+             boost::starts_with(dialed_number, "00") ||
+             boost::starts_with(dialed_number, "011")) ||
+           boost::starts_with(dialed_number, "+" + _country_code) ||
+           boost::starts_with(dialed_number, "00" + _country_code) ||
+           boost::starts_with(dialed_number, "011" + _country_code))
   {
-    // Clearwater does not support roaming calls yet, this never applies
-    TRC_DEBUG("International Excluding Home Country rule fails");
-    rule_matches = false;
+    TRC_DEBUG("International condition fails, dialed number is '%s'", dialed_number.c_str());
+    return false;
   }
 
-  return rule_matches;
+  return true;
 }
 
 
@@ -781,7 +911,7 @@ pjsip_status_code MmtelTsx::apply_ob_privacy(pjsip_msg* req, pj_pool_t* pool)
     TRC_DEBUG("Originating Identification Presentation Restriction enabled");
 
     // Extract the privacy header
-    privacy_hdr_array = (pjsip_generic_array_hdr *)pjsip_msg_find_hdr_by_name(req, &privacy_hdr_name, NULL);
+    privacy_hdr_array = (pjsip_generic_array_hdr *)PJUtils::find_hdr_by_name(req, &privacy_hdr_name, NULL);
 
     int privacy_hdrs = 0;
     if (privacy_hdr_array)
@@ -838,7 +968,9 @@ pjsip_status_code MmtelTsx::apply_ob_call_barring(pjsip_msg* req)
     return PJSIP_SC_OK;
   }
 
-  return apply_call_barring(_user_services->outbound_cb_rules(), req);
+  return apply_call_barring(_user_services->outbound_cb_rules(),
+                            _user_services->outbound_cb_rule_conditions(),
+                            req);
 }
 
 // Apply privacy services as a terminating AS.
@@ -858,7 +990,7 @@ pjsip_status_code MmtelTsx::apply_ib_privacy(pjsip_msg* req, pj_pool_t* pool)
   pjsip_generic_array_hdr *privacy_hdr_array = NULL;
 
   int privacy_hdrs = 0;
-  privacy_hdr_array = (pjsip_generic_array_hdr *)pjsip_msg_find_hdr_by_name(req, &privacy_hdr_name, NULL);
+  privacy_hdr_array = (pjsip_generic_array_hdr *)PJUtils::find_hdr_by_name(req, &privacy_hdr_name, NULL);
   if (privacy_hdr_array)
   {
     privacy_hdrs = MmtelTsx::parse_privacy_headers(privacy_hdr_array);
@@ -889,7 +1021,7 @@ pjsip_status_code MmtelTsx::apply_ib_privacy(pjsip_msg* req, pj_pool_t* pool)
                                             &organization_hdr_name };
     for (unsigned int ii = 0; ii < sizeof(headers_to_remove) / sizeof(pj_str_t *); ii++)
     {
-      pjsip_hdr *hdr = (pjsip_hdr *)pjsip_msg_find_hdr_by_name(req, headers_to_remove[ii], NULL);
+      pjsip_hdr *hdr = (pjsip_hdr *)PJUtils::find_hdr_by_name(req, headers_to_remove[ii], NULL);
       if (hdr)
       {
         pj_list_erase(hdr);
@@ -926,7 +1058,7 @@ pjsip_status_code MmtelTsx::apply_ib_privacy(pjsip_msg* req, pj_pool_t* pool)
                                             &in_reply_to_hdr_name };
     for (unsigned int ii = 0; ii < sizeof(headers_to_remove) / sizeof(pj_str_t *); ii++)
     {
-      pjsip_hdr *hdr = (pjsip_hdr *)pjsip_msg_find_hdr_by_name(req, headers_to_remove[ii], NULL);
+      pjsip_hdr *hdr = (pjsip_hdr *)PJUtils::find_hdr_by_name(req, headers_to_remove[ii], NULL);
       if (hdr)
       {
         pj_list_erase(hdr);
@@ -948,7 +1080,7 @@ pjsip_status_code MmtelTsx::apply_ib_privacy(pjsip_msg* req, pj_pool_t* pool)
   if (privacy_hdrs & PRIVACY_H_ID)
   {
     TRC_DEBUG("Applying 'id' privacy");
-    pjsip_hdr *p_asserted_identity_hdr = (pjsip_hdr *)pjsip_msg_find_hdr_by_name(req, &p_asserted_identity_hdr_name, NULL);
+    pjsip_hdr *p_asserted_identity_hdr = (pjsip_hdr *)PJUtils::find_hdr_by_name(req, &p_asserted_identity_hdr_name, NULL);
     if (p_asserted_identity_hdr)
     {
       pj_list_erase(p_asserted_identity_hdr);
@@ -1171,7 +1303,9 @@ pjsip_status_code MmtelTsx::apply_ib_call_barring(pjsip_msg* req)
     return PJSIP_SC_OK;
   }
 
-  return apply_call_barring(_user_services->inbound_cb_rules(), req);
+  return apply_call_barring(_user_services->inbound_cb_rules(),
+                            _user_services->inbound_cb_rule_conditions(),
+                            req);
 }
 
 // LCOV_EXCL_STOP
@@ -29,6 +29,10 @@ private:
   Mmtel* _mmtel;
   SNMP::IPCountTable* _xdm_cxn_count_tbl;
   SNMP::EventAccumulatorTable* _xdm_latency_tbl;
+  SNMP::IPCountTable* _xdm_http2_stream_count_tbl;
+  SNMP::EventAccumulatorTable* _xdm_http2_rtt_tbl;
+  ShardedLRUCacheStatsTables _simservs_cache_stats_tbls;
+  SNMP::EventAccumulatorTable* _simservs_cache_latency_saved_tbl;
   XDMConnection* _xdm_connection;
 };
 
@@ -41,6 +45,12 @@ MMTELASPlugin sproutlet_plugin;
 MMTELASPlugin::MMTELASPlugin() :
   _mmtel_sproutlet(NULL),
   _mmtel(NULL),
+  _xdm_cxn_count_tbl(NULL),
+  _xdm_latency_tbl(NULL),
+  _xdm_http2_stream_count_tbl(NULL),
+  _xdm_http2_rtt_tbl(NULL),
+  _simservs_cache_stats_tbls({NULL, NULL, NULL}),
+  _simservs_cache_latency_saved_tbl(NULL),
   _xdm_connection(NULL)
 {
 }
@@ -70,14 +80,48 @@ bool MMTELASPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                                           ".1.2.826.0.1.1578918.9.3.2.1");
       _xdm_latency_tbl = SNMP::EventAccumulatorTable::create("homer-latency",
                                                           ".1.2.826.0.1.1578918.9.3.2.2");
+
+      if (opt.http2_connections > 0)
+      {
+        _xdm_http2_stream_count_tbl = SNMP::IPCountTable::create("homer-http2-stream-count",
+                                                                 ".1.2.826.0.1.1578918.9.3.2.3");
+        _xdm_http2_rtt_tbl = SNMP::EventAccumulatorTable::create("homer-http2-rtt",
+                                                                 ".1.2.826.0.1.1578918.9.3.2.4");
+      }
+
       _xdm_connection = new XDMConnection(opt.xdm_server,
                                           http_resolver,
                                           load_monitor,
                                           _xdm_cxn_count_tbl,
-                                          _xdm_latency_tbl);
+                                          _xdm_latency_tbl,
+                                          opt.http2_connections,
+                                          _xdm_http2_stream_count_tbl,
+                                          _xdm_http2_rtt_tbl,
+                                          opt.http_compression);
+
+      if (opt.simservs_cache_ttl > 0)
+      {
+        _simservs_cache_stats_tbls.hits_tbl =
+          SNMP::CounterTable::create("mmtel_simservs_cache_hits",
+                                     ".1.2.826.0.1.1578918.9.3.67");
+        _simservs_cache_stats_tbls.misses_tbl =
+          SNMP::CounterTable::create("mmtel_simservs_cache_misses",
+                                     ".1.2.826.0.1.1578918.9.3.68");
+        _simservs_cache_stats_tbls.evictions_tbl =
+          SNMP::CounterTable::create("mmtel_simservs_cache_evictions",
+                                     ".1.2.826.0.1.1578918.9.3.69");
+        _simservs_cache_latency_saved_tbl =
+          SNMP::EventAccumulatorTable::create("mmtel_simservs_cache_latency_saved",
+                                              ".1.2.826.0.1.1578918.9.3.70");
+      }
 
       // Load the MMTEL AppServer
-      _mmtel = new Mmtel(opt.prefix_mmtel, _xdm_connection);
+      _mmtel = new Mmtel(opt.prefix_mmtel,
+                         _xdm_connection,
+                         opt.simservs_cache_ttl,
+                         opt.simservs_cache_size,
+                         _simservs_cache_stats_tbls,
+                         _simservs_cache_latency_saved_tbl);
       _mmtel_sproutlet = new SproutletAppServerShim(_mmtel,
                                                     opt.port_mmtel,
                                                     opt.uri_mmtel,
@@ -98,4 +142,10 @@ void MMTELASPlugin::unload()
   delete _xdm_connection;
   delete _xdm_cxn_count_tbl;
   delete _xdm_latency_tbl;
+  delete _xdm_http2_stream_count_tbl;
+  delete _xdm_http2_rtt_tbl;
+  delete _simservs_cache_stats_tbls.hits_tbl;
+  delete _simservs_cache_stats_tbls.misses_tbl;
+  delete _simservs_cache_stats_tbls.evictions_tbl;
+  delete _simservs_cache_latency_saved_tbl;
 }
@@ -0,0 +1,597 @@
+/**
+ * @file multiplexed_httpclient.cpp Implementation of MultiplexedHttpClient.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <set>
+
+#include "multiplexed_httpclient.h"
+#include "log.h"
+#include "request_deadline.h"
+
+MultiplexedHttpClient::MultiplexedHttpClient(const std::string& server,
+                                             const std::string& scheme,
+                                             int num_connections,
+                                             long timeout_ms,
+                                             LoadMonitor* load_monitor,
+                                             CommunicationMonitor* comm_monitor,
+                                             SNMP::IPCountTable* stream_count_tbl,
+                                             SNMP::EventAccumulatorTable* rtt_tbl,
+                                             RequestHedger* hedger,
+                                             HttpContentDecoder::Stats* compression_stats) :
+  _base_url(scheme + "://" + server),
+  _timeout_ms(timeout_ms),
+  _load_monitor(load_monitor),
+  _comm_monitor(comm_monitor),
+  _stream_count_tbl(stream_count_tbl),
+  _rtt_tbl(rtt_tbl),
+  _hedger((num_connections > 1) ? hedger : NULL),
+  _compression_stats(compression_stats),
+  _terminated(false),
+  _connections()
+{
+  TRC_STATUS("Using %d HTTP/2 connections to %s",
+             num_connections, _base_url.c_str());
+
+  for (int ii = 0; ii < std::max(num_connections, 1); ++ii)
+  {
+    Connection* connection = new Connection();
+    connection->streams = 0;
+
+    // Each connection has its own multi handle, limited to a single
+    // connection to the server, so every request on it is multiplexed.
+    connection->multi = curl_multi_init();
+    curl_multi_setopt(connection->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(connection->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, 1L);
+
+    if (pipe2(connection->wake_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+      // LCOV_EXCL_START - Don't test resource exhaustion in UT
+      TRC_ERROR("Failed to create pipe for HTTP/2 connection (%d)", errno);
+      connection->wake_fds[0] = -1;
+      connection->wake_fds[1] = -1;
+      // LCOV_EXCL_STOP
+    }
+
+    connection->thread = std::thread(&MultiplexedHttpClient::run, this, connection);
+    _connections.push_back(connection);
+  }
+}
+
+MultiplexedHttpClient::~MultiplexedHttpClient()
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _terminated = true;
+  }
+
+  for (Connection* connection : _connections)
+  {
+    if (write(connection->wake_fds[1], "x", 1) < 0)
+    {
+      // LCOV_EXCL_START - the thread will still notice within a second.
+      TRC_DEBUG("Failed to wake HTTP/2 connection thread (%d)", errno);
+      // LCOV_EXCL_STOP
+    }
+
+    connection->thread.join();
+    curl_multi_cleanup(connection->multi);
+    close(connection->wake_fds[0]);
+    close(connection->wake_fds[1]);
+    delete connection;
+  }
+
+  _connections.clear();
+}
+
+HTTPCode MultiplexedHttpClient::send_request(const std::string& method,
+                                             const std::string& path,
+                                             const std::string& body,
+                                             const std::vector<std::string>& headers,
+                                             std::string& response_body,
+                                             SAS::TrailId trail)
+{
+  TRC_DEBUG("Sending HTTP/2 %s request for %s%s",
+            method.c_str(), _base_url.c_str(), path.c_str());
+
+  std::condition_variable cond;
+  Transfer transfer;
+  prepare_transfer(&transfer, &cond, method, path, body, headers);
+
+  if (!queue_transfer(&transfer, NULL))
+  {
+    // LCOV_EXCL_START - only hit during shutdown
+    cleanup_transfer(&transfer);
+    return HTTP_SERVER_UNAVAILABLE;
+    // LCOV_EXCL_STOP
+  }
+
+  // Only GETs are hedged, as the other requests we make to Homestead change
+  // its state.
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  long hedge_delay_ms = ((_hedger != NULL) && (method == "GET")) ?
+                          _hedger->start_request() : -1;
+  std::unique_ptr<Transfer> hedge;
+
+  if (hedge_delay_ms >= 0)
+  {
+    bool done;
+
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      done = cond.wait_for(lock,
+                           std::chrono::milliseconds(hedge_delay_ms),
+                           [&transfer]() { return transfer.done; });
+    }
+
+    if ((!done) && (_hedger->take_hedge()))
+    {
+      TRC_DEBUG("No response to HTTP/2 request for %s%s after %ldms - hedging",
+                _base_url.c_str(), path.c_str(), hedge_delay_ms);
+      hedge.reset(new Transfer());
+      prepare_transfer(hedge.get(), &cond, method, path, body, headers);
+
+      if (!queue_transfer(hedge.get(), _connections[transfer.connection]))
+      {
+        // LCOV_EXCL_START - only hit during shutdown
+        cleanup_transfer(hedge.get());
+        hedge.reset();
+        // LCOV_EXCL_STOP
+      }
+    }
+  }
+
+  // Wait for the first successful response, or for all the requests to fail.
+  Transfer* winner;
+
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    Transfer* other = hedge.get();
+    cond.wait(lock, [&transfer, other]()
+    {
+      return (transfer.done && ((transfer.result == CURLE_OK) ||
+                                (other == NULL) ||
+                                (other->done))) ||
+             ((other != NULL) && other->done && (other->result == CURLE_OK));
+    });
+
+    winner = ((transfer.done) &&
+              ((transfer.result == CURLE_OK) || (other == NULL))) ?
+               &transfer : other;
+    Transfer* loser = (winner == &transfer) ? other : &transfer;
+
+    if ((loser != NULL) && (!loser->done))
+    {
+      cancel_transfer(loser, lock);
+    }
+  }
+
+  if ((hedge != NULL) && (winner == hedge.get()))
+  {
+    TRC_DEBUG("Hedged HTTP/2 request for %s%s answered first",
+              _base_url.c_str(), path.c_str());
+  }
+
+  HTTPCode rc;
+
+  if (winner->result == CURLE_OK)
+  {
+    long response_code = 0;
+    curl_easy_getinfo(winner->easy, CURLINFO_RESPONSE_CODE, &response_code);
+    rc = response_code;
+    response_body.swap(winner->response_body);
+
+    // The round trip for this stream is the time from sending the request to
+    // receiving the first byte of the response.
+    double pretransfer_secs = 0;
+    double starttransfer_secs = 0;
+    curl_easy_getinfo(winner->easy, CURLINFO_PRETRANSFER_TIME, &pretransfer_secs);
+    curl_easy_getinfo(winner->easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer_secs);
+
+    if ((_rtt_tbl != NULL) && (starttransfer_secs >= pretransfer_secs))
+    {
+      _rtt_tbl->accumulate((unsigned long)((starttransfer_secs - pretransfer_secs) * 1000000));
+    }
+
+    if (_hedger != NULL)
+    {
+      // Record the latency the caller saw, including any hedge delay.
+      _hedger->record_latency(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+    }
+
+    if (_comm_monitor != NULL)
+    {
+      _comm_monitor->inform_success();
+    }
+  }
+  else
+  {
+    TRC_WARNING("HTTP/2 %s request for %s%s on connection %lu failed: %s",
+                method.c_str(),
+                _base_url.c_str(),
+                path.c_str(),
+                winner->connection,
+                curl_easy_strerror(winner->result));
+    rc = curl_code_to_http_code(winner->result);
+
+    if (_comm_monitor != NULL)
+    {
+      _comm_monitor->inform_failure();
+    }
+  }
+
+  if ((_load_monitor != NULL) &&
+      ((rc == HTTP_SERVER_UNAVAILABLE) || (rc == HTTP_GATEWAY_TIMEOUT)))
+  {
+    _load_monitor->incr_penalties();
+  }
+
+  cleanup_transfer(&transfer);
+  if (hedge != NULL)
+  {
+    cleanup_transfer(hedge.get());
+  }
+
+  TRC_DEBUG("HTTP/2 request for %s%s returned %ld",
+            _base_url.c_str(), path.c_str(), rc);
+
+  return rc;
+}
+
+void MultiplexedHttpClient::prepare_transfer(Transfer* transfer,
+                                             std::condition_variable* cond,
+                                             const std::string& method,
+                                             const std::string& path,
+                                             const std::string& body,
+                                             const std::vector<std::string>& headers)
+{
+  transfer->headers = NULL;
+  transfer->connection = 0;
+  transfer->result = CURLE_OK;
+  transfer->done = false;
+  transfer->cond = cond;
+  transfer->decoder.reset(new HttpContentDecoder(_compression_stats));
+
+  // Stop curl waiting for a 100 Continue before sending bodies.
+  transfer->headers = curl_slist_append(transfer->headers, "Expect:");
+
+  for (const std::string& header : headers)
+  {
+    transfer->headers = curl_slist_append(transfer->headers, header.c_str());
+  }
+
+  if (_compression_stats != NULL)
+  {
+    transfer->headers = curl_slist_append(transfer->headers,
+                                          HttpContentDecoder::ACCEPT_ENCODING);
+  }
+
+  transfer->easy = create_easy(method, path, body, transfer->headers, transfer);
+}
+
+void MultiplexedHttpClient::cleanup_transfer(Transfer* transfer)
+{
+  curl_easy_cleanup(transfer->easy);
+  curl_slist_free_all(transfer->headers);
+}
+
+bool MultiplexedHttpClient::queue_transfer(Transfer* transfer,
+                                           const Connection* avoid)
+{
+  Connection* connection = NULL;
+
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+
+    if (_terminated)
+    {
+      // LCOV_EXCL_START - only hit during shutdown
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    // Use the connection with the fewest streams in flight.
+    for (size_t ii = 0; ii < _connections.size(); ++ii)
+    {
+      if ((_connections[ii] != avoid) &&
+          ((connection == NULL) ||
+           (_connections[ii]->streams < connection->streams)))
+      {
+        connection = _connections[ii];
+        transfer->connection = ii;
+      }
+    }
+
+    if (connection == NULL)
+    {
+      // LCOV_EXCL_START - hedges are only sent with several connections
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    connection->streams++;
+    connection->queue.push_back(transfer);
+    transfer->remote_ip = connection->remote_ip;
+
+    if ((_stream_count_tbl != NULL) && (!transfer->remote_ip.empty()))
+    {
+      _stream_count_tbl->increment(transfer->remote_ip);
+    }
+  }
+
+  if (write(connection->wake_fds[1], "x", 1) < 0)
+  {
+    // LCOV_EXCL_START - the thread will still notice within a second.
+    TRC_DEBUG("Failed to wake HTTP/2 connection thread (%d)", errno);
+    // LCOV_EXCL_STOP
+  }
+
+  return true;
+}
+
+void MultiplexedHttpClient::cancel_transfer(Transfer* transfer,
+                                            std::unique_lock<std::mutex>& lock)
+{
+  Connection* connection = _connections[transfer->connection];
+  connection->cancels.push_back(transfer);
+
+  if (write(connection->wake_fds[1], "x", 1) < 0)
+  {
+    // LCOV_EXCL_START - the thread will still notice within a second.
+    TRC_DEBUG("Failed to wake HTTP/2 connection thread (%d)", errno);
+    // LCOV_EXCL_STOP
+  }
+
+  transfer->cond->wait(lock, [transfer]() { return transfer->done; });
+}
+
+std::vector<int> MultiplexedHttpClient::stream_counts()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  std::vector<int> counts;
+
+  for (Connection* connection : _connections)
+  {
+    counts.push_back(connection->streams);
+  }
+
+  return counts;
+}
+
+CURL* MultiplexedHttpClient::create_easy(const std::string& method,
+                                         const std::string& path,
+                                         const std::string& body,
+                                         curl_slist* headers,
+                                         Transfer* transfer)
+{
+  CURL* easy = curl_easy_init();
+  std::string url = _base_url + path;
+
+  curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+
+  // Use HTTP/2 over TLS if the server supports it, and assume plain HTTP
+  // servers support it, rather than upgrading each connection.
+  curl_easy_setopt(easy,
+                   CURLOPT_HTTP_VERSION,
+                   (_base_url.compare(0, 6, "https:") == 0) ?
+                     CURL_HTTP_VERSION_2TLS :
+                     CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+
+  // Wait for the existing connection rather than opening another.
+  curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+
+  // Don't wait any longer than the request being processed has left.
+  long timeout_ms = RequestDeadline::cap_timeout_ms(_timeout_ms);
+  if (timeout_ms > 0)
+  {
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, timeout_ms);
+  }
+
+  if ((!body.empty()) || (method == "PUT") || (method == "POST"))
+  {
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)body.length());
+    curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, body.c_str());
+  }
+
+  if (method != "GET")
+  {
+    curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, method.c_str());
+  }
+
+  curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &MultiplexedHttpClient::write_callback);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer);
+  curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, &MultiplexedHttpClient::header_callback);
+  curl_easy_setopt(easy, CURLOPT_HEADERDATA, transfer);
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+
+  return easy;
+}
+
+size_t MultiplexedHttpClient::write_callback(char* ptr,
+                                             size_t size,
+                                             size_t nmemb,
+                                             void* userdata)
+{
+  Transfer* transfer = (Transfer*)userdata;
+
+  // Returning less than we were given fails the transfer.
+  return transfer->decoder->write(ptr, size * nmemb, transfer->response_body) ?
+           size * nmemb : 0;
+}
+
+size_t MultiplexedHttpClient::header_callback(char* ptr,
+                                              size_t size,
+                                              size_t nmemb,
+                                              void* userdata)
+{
+  Transfer* transfer = (Transfer*)userdata;
+  return transfer->decoder->header(ptr, size * nmemb) ? size * nmemb : 0;
+}
+
+void MultiplexedHttpClient::run(Connection* connection)
+{
+  std::set<Transfer*> active;
+
+  while (true)
+  {
+    std::deque<Transfer*> queued;
+    std::deque<Transfer*> cancels;
+
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+
+      if (_terminated)
+      {
+        queued.swap(connection->queue);
+        break;
+      }
+
+      queued.swap(connection->queue);
+      cancels.swap(connection->cancels);
+    }
+
+    for (Transfer* transfer : queued)
+    {
+      curl_multi_add_handle(connection->multi, transfer->easy);
+      active.insert(transfer);
+    }
+
+    // Cancel requests that have been hedged and answered elsewhere.  A
+    // request that completes first is removed from the cancel queue, so
+    // these are all still active.
+    for (Transfer* transfer : cancels)
+    {
+      if (active.erase(transfer) > 0)
+      {
+        curl_multi_remove_handle(connection->multi, transfer->easy);
+        complete(transfer, CURLE_ABORTED_BY_CALLBACK);
+      }
+    }
+
+    int running = 0;
+    curl_multi_perform(connection->multi, &running);
+
+    CURLMsg* msg;
+    int msgs_left;
+
+    while ((msg = curl_multi_info_read(connection->multi, &msgs_left)) != NULL)
+    {
+      if (msg->msg == CURLMSG_DONE)
+      {
+        Transfer* transfer = NULL;
+        CURLcode result = msg->data.result;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+        curl_multi_remove_handle(connection->multi, msg->easy_handle);
+        active.erase(transfer);
+        complete(transfer, result);
+      }
+    }
+
+    // Wait for activity on the connection or for more requests.
+    struct curl_waitfd wake;
+    wake.fd = connection->wake_fds[0];
+    wake.events = CURL_WAIT_POLLIN;
+    wake.revents = 0;
+    curl_multi_wait(connection->multi, &wake, 1, 1000, NULL);
+
+    if (wake.revents != 0)
+    {
+      char buf[64];
+      while (read(connection->wake_fds[0], buf, sizeof(buf)) > 0)
+      {
+      }
+    }
+  }
+
+  // We're shutting down, so fail any requests that haven't completed.
+  for (Transfer* transfer : active)
+  {
+    curl_multi_remove_handle(connection->multi, transfer->easy);
+    complete(transfer, CURLE_ABORTED_BY_CALLBACK);
+  }
+
+  std::deque<Transfer*> queued;
+
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    queued.swap(connection->queue);
+  }
+
+  for (Transfer* transfer : queued)
+  {
+    complete(transfer, CURLE_ABORTED_BY_CALLBACK);
+  }
+}
+
+void MultiplexedHttpClient::complete(Transfer* transfer, CURLcode result)
+{
+  char* remote_ip = NULL;
+  curl_easy_getinfo(transfer->easy, CURLINFO_PRIMARY_IP, &remote_ip);
+
+  // A body that couldn't be decoded, or was cut short, is a failure.
+  if (((result == CURLE_OK) || (result == CURLE_WRITE_ERROR)) &&
+      (!transfer->decoder->finish()))
+  {
+    result = CURLE_BAD_CONTENT_ENCODING;
+  }
+
+  std::lock_guard<std::mutex> guard(_lock);
+  Connection* connection = _connections[transfer->connection];
+  connection->streams--;
+
+  if (!connection->cancels.empty())
+  {
+    // The caller may be about to free the transfer, so make sure it isn't
+    // cancelled afterwards.
+    connection->cancels.erase(std::remove(connection->cancels.begin(),
+                                          connection->cancels.end(),
+                                          transfer),
+                              connection->cancels.end());
+  }
+
+  if ((_stream_count_tbl != NULL) && (!transfer->remote_ip.empty()))
+  {
+    _stream_count_tbl->decrement(transfer->remote_ip);
+  }
+
+  if ((remote_ip != NULL) && (*remote_ip != '\0'))
+  {
+    connection->remote_ip = remote_ip;
+  }
+
+  // The caller owns the transfer, and may free it as soon as we release the
+  // lock.
+  transfer->result = result;
+  transfer->done = true;
+  transfer->cond->notify_all();
+}
+
+HTTPCode MultiplexedHttpClient::curl_code_to_http_code(CURLcode code)
+{
+  switch (code)
+  {
+    case CURLE_OPERATION_TIMEDOUT:
+      return HTTP_GATEWAY_TIMEOUT;
+
+    default:
+      // We couldn't get a response from the server, e.g. because we couldn't
+      // connect to it.
+      return HTTP_SERVER_UNAVAILABLE;
+  }
+}
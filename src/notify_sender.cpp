@@ -21,17 +21,6 @@
 #include "sproutsasevent.h"
 #include "aor_utils.h"
 
-// Print XML message body.
-static int xml_print_body(struct pjsip_msg_body *msg_body,
-                          char *buf,
-                          pj_size_t size)
-{
-  return pj_xml_print((const pj_xml_node*)msg_body->data,
-                      buf,
-                      size,
-                      PJ_TRUE);
-}
-
 NotifySender::NotifySender()
 {
 }
@@ -117,11 +106,27 @@ void NotifySender::send_notifys(const std::string& aor_id,
     }
   }
 
+  // Everything in the reg-info body apart from the registration IDs is the
+  // same for every subscription, so we only work it out once (and only if
+  // there's a NOTIFY to send).
+  RegInfo reg_info;
+  bool reg_info_built = false;
+
   for (SubscriberDataUtils::ClassifiedSubscription* classified_subscription :
                                                        classified_subscriptions)
   {
     if (classified_subscription->_notify_required)
     {
+      if (!reg_info_built)
+      {
+        build_reg_info(associated_uris,
+                       classified_bindings,
+                       reg_state,
+                       reg_info,
+                       trail);
+        reg_info_built = true;
+      }
+
       TRC_DEBUG("Sending NOTIFY for subscription %s: %s",
                 classified_subscription->_id.c_str(),
                 classified_subscription->_reasons.c_str());
@@ -137,13 +142,9 @@ void NotifySender::send_notifys(const std::string& aor_id,
       pj_status_t status = create_subscription_notify(
                                          &tdata_notify,
                                          classified_subscription->_subscription,
-                                         aor_id,
-                                         associated_uris,
                                          cseq,
-                                         classified_bindings,
-                                         reg_state,
-                                         now,
-                                         trail);
+                                         reg_info,
+                                         now);
 
       if (status == PJ_SUCCESS)
       {
@@ -194,13 +195,9 @@ void NotifySender::send_notifys(const std::string& aor_id,
 pj_status_t NotifySender::create_subscription_notify(
                                   pjsip_tx_data** tdata_notify,
                                   Subscription* s,
-                                  const std::string& aor,
-                                  const AssociatedURIs& associated_uris,
                                   int cseq,
-                                  const ClassifiedBindings& classified_bindings,
-                                  const RegistrationState& reg_state,
-                                  int now,
-                                  SAS::TrailId trail)
+                                  const RegInfo& reg_info,
+                                  int now)
 {
   // Set the correct subscription state header
   SubscriptionState state = SubscriptionState::ACTIVE;
@@ -214,14 +211,10 @@ pj_status_t NotifySender::create_subscription_notify(
 
   pj_status_t status = create_notify(tdata_notify,
                                      s,
-                                     aor,
-                                     associated_uris,
                                      cseq,
-                                     classified_bindings,
-                                     reg_state,
+                                     reg_info,
                                      state,
-                                     expiry,
-                                     trail);
+                                     expiry);
   return status;
 }
 
@@ -230,14 +223,10 @@ pj_status_t NotifySender::create_subscription_notify(
 pj_status_t NotifySender::create_notify(
                                     pjsip_tx_data** tdata_notify,
                                     Subscription* subscription,
-                                    const std::string& aor,
-                                    const AssociatedURIs& associated_uris,
                                     int cseq,
-                                    const ClassifiedBindings& classified_bindings,
-                                    const RegistrationState& reg_state,
+                                    const RegInfo& reg_info,
                                     const SubscriptionState& subscription_state,
-                                    int expiry,
-                                    SAS::TrailId trail)
+                                    int expiry)
 {
   pj_status_t status = create_request_from_subscription(tdata_notify,
                                                         subscription,
@@ -291,7 +280,7 @@ pj_status_t NotifySender::create_notify(
       // terminated) set the reason to timeout. Otherwise set it to deactivated
       sub_state_hdr->sub_state = STR_TERMINATED;
 
-      if (reg_state == RegistrationState::TERMINATED)
+      if (reg_info.reg_state == RegistrationState::TERMINATED)
       {
         sub_state_hdr->reason_param = STR_DEACTIVATED;
       }
@@ -314,12 +303,8 @@ pj_status_t NotifySender::create_notify(
     body2 = PJ_POOL_ZALLOC_T((*tdata_notify)->pool, pjsip_msg_body);
     status = notify_create_body(body2,
                                (*tdata_notify)->pool,
-                                aor,
-                                associated_uris,
                                 subscription,
-                                classified_bindings,
-                                reg_state,
-                                trail);
+                                reg_info);
     (*tdata_notify)->msg->body = body2;
   }
   else
@@ -366,75 +351,112 @@ pj_status_t NotifySender::create_request_from_subscription(
 pj_status_t NotifySender::notify_create_body(
                                   pjsip_msg_body* body,
                                   pj_pool_t *pool,
-                                  const std::string& aor,
-                                  const AssociatedURIs& associated_uris,
                                   Subscription* subscription,
-                                  const ClassifiedBindings& classified_bindings,
-                                  const RegistrationState& reg_state,
-                                  SAS::TrailId trail)
+                                  const RegInfo& reg_info)
 {
   TRC_DEBUG("Create body of a SIP NOTIFY");
 
-  pj_xml_node* doc = notify_create_reg_state_xml(pool,
-                                                 aor,
-                                                 associated_uris,
-                                                 subscription,
-                                                 classified_bindings,
-                                                 reg_state,
-                                                 trail);
+  // The registration ID is the only part of the body that depends on the
+  // subscription, so write it between each of the template's chunks.
+  std::string id_attr;
+  append_xml_attr(id_attr, STR_ID, Utils::xml_escape(subscription->_to_tag));
+
+  size_t len = (reg_info.chunks.size() - 1) * id_attr.size();
+  for (const std::string& chunk : reg_info.chunks)
+  {
+    len += chunk.size();
+  }
 
-  if (doc == NULL)
+  char* buf = (char*)pj_pool_alloc(pool, len);
+  char* p = buf;
+
+  for (std::vector<std::string>::const_iterator chunk = reg_info.chunks.begin();
+       chunk != reg_info.chunks.end();
+       ++chunk)
   {
-    // LCOV_EXCL_START
-    TRC_DEBUG("Failed to create body");
-    return PJ_FALSE;
-    // LCOV_EXCL_STOP
+    if (chunk != reg_info.chunks.begin())
+    {
+      pj_memcpy(p, id_attr.data(), id_attr.size());
+      p += id_attr.size();
+    }
+
+    pj_memcpy(p, chunk->data(), chunk->size());
+    p += chunk->size();
   }
 
   body->content_type.type = STR_MIME_TYPE;
   body->content_type.subtype = STR_MIME_SUBTYPE;
 
-  body->data = doc;
-  body->len = 0;
+  body->data = buf;
+  body->len = len;
 
-  body->print_body = &xml_print_body;
+  body->print_body = &pjsip_print_text_body;
+  body->clone_data = &pjsip_clone_text_data;
 
   return PJ_SUCCESS;
 }
 
-// Create complete XML body for a NOTIFY
-pj_xml_node* NotifySender::notify_create_reg_state_xml(
-                                  pj_pool_t* pool,
-                                  const std::string& aor,
-                                  const AssociatedURIs& associated_uris,
-                                  Subscription* subscription,
+// Append an XML attribute in the same format as pj_xml_print.  Note that
+// pj_xml_print leaves out the value entirely if it is empty.
+void NotifySender::append_xml_attr(std::string& xml,
+                                   const pj_str_t& name,
+                                   const std::string& value)
+{
+  xml.push_back(' ');
+  xml.append(name.ptr, name.slen);
+
+  if (!value.empty())
+  {
+    xml.append("=\"");
+    xml.append(value);
+    xml.push_back('"');
+  }
+}
+
+// Append an XML element that has no child elements, in the same format as
+// pj_xml_print.
+void NotifySender::append_xml_leaf(std::string& xml,
+                                   int indent,
+                                   const pj_str_t& name,
+                                   const std::string& attr_xml,
+                                   const std::string& content)
+{
+  xml.push_back('\n');
+  xml.append(indent, ' ');
+  xml.push_back('<');
+  xml.append(name.ptr, name.slen);
+  xml.append(attr_xml);
+
+  if (content.empty())
+  {
+    xml.append(" />");
+  }
+  else
+  {
+    xml.push_back('>');
+    xml.append(content);
+    xml.append("</");
+    xml.append(name.ptr, name.slen);
+    xml.push_back('>');
+  }
+}
+
+// Work out the reg-info body that is the same for every subscription, and
+// compile it into a template.
+//
+// The template is laid out exactly as pj_xml_print would lay out the
+// equivalent pj_xml_node tree (which is how we used to build these bodies),
+// so that subscribers see the same bytes.
+void NotifySender::build_reg_info(const AssociatedURIs& associated_uris,
                                   const ClassifiedBindings& classified_bindings,
                                   const RegistrationState& reg_state,
+                                  RegInfo& reg_info,
                                   SAS::TrailId trail)
 {
-  TRC_DEBUG("Create the XML body for a SIP NOTIFY");
-
-  // Create the root document
-  pj_xml_node* doc = pj_xml_node_new(pool, &STR_REGINFO);
-
-  // Add attributes to the doc
-  pj_xml_attr* attr = pj_xml_attr_new(pool, &STR_XMLNS_NAME, &STR_XMLNS_VAL);
-  pj_xml_add_attr(doc, attr);
-  attr = pj_xml_attr_new(pool, &STR_XMLNS_GRUU_NAME, &STR_XMLNS_GRUU_VAL);
-  pj_xml_add_attr(doc, attr);
-  attr = pj_xml_attr_new(pool, &STR_XMLNS_XSI_NAME, &STR_XMLNS_XSI_VAL);
-  pj_xml_add_attr(doc, attr);
-  attr = pj_xml_attr_new(pool, &STR_XMLNS_ERE_NAME, &STR_XMLNS_ERE_VAL);
-  pj_xml_add_attr(doc, attr);
-  attr = pj_xml_attr_new(pool, &STR_VERSION, &STR_VERSION_VAL);
-  pj_xml_add_attr(doc, attr);
+  TRC_DEBUG("Build the reg-info for the NOTIFYs");
 
-  // Add the state - this will always be FULL (the subscription RFC says it
-  // should be partial except on an initial subscriptions, but the TS specs
-  // say it should always be full).
-  const pj_str_t* state_str = &STR_FULL;
-  attr = pj_xml_attr_new(pool, &STR_STATE, state_str);
-  pj_xml_add_attr(doc, attr);
+  reg_info.reg_state = reg_state;
+  reg_info.chunks.clear();
 
   // Create the registration nodes.  We need one per IMPU in the Implicit
   // Registration Set, with the same binding/contact information in each.
@@ -466,17 +488,158 @@ pj_xml_node* NotifySender::notify_create_reg_state_xml(
     SAS::report_event(event);
   }
 
-  // Iterate over the unbarred IMPUs in the IRS, inserting a registration
-  // element for each one
+  // The contact elements are the same in each registration element, so
+  // render them first.  Working out the GRUUs needs a pool, which we only need
+  // for the duration of this function.
+  pj_pool_t* tmp_pool = pj_pool_create(&stack_data.cp.factory,
+                                       "NotifySender",
+                                       1024,
+                                       512,
+                                       NULL);
+  std::vector<std::string> contacts;
+
+  for (SubscriberDataUtils::ClassifiedBinding* classified_binding :
+                                                            classified_bindings)
+  {
+    const pj_str_t* c_state = &STR_ACTIVE;
+    const pj_str_t* c_event = &STR_REGISTERED;
+    switch (classified_binding->_contact_event)
+    {
+      case SubscriberDataUtils::ContactEvent::REGISTERED:
+        c_event = &STR_REGISTERED;
+        c_state = &STR_ACTIVE;
+        break;
+      case SubscriberDataUtils::ContactEvent::CREATED:
+        c_event = &STR_CREATED;
+        c_state = &STR_ACTIVE;
+        break;
+      case SubscriberDataUtils::ContactEvent::REFRESHED:
+        c_event = &STR_REFRESHED;
+        c_state = &STR_ACTIVE;
+        break;
+      case SubscriberDataUtils::ContactEvent::SHORTENED:
+        c_event = &STR_SHORTENED;
+        c_state = &STR_ACTIVE;
+        break;
+      case SubscriberDataUtils::ContactEvent::EXPIRED:
+        c_event = &STR_EXPIRED;
+        c_state = &STR_TERMINATED;
+        break;
+      case SubscriberDataUtils::ContactEvent::UNREGISTERED:
+        c_event = &STR_UNREGISTERED;
+        c_state = &STR_TERMINATED;
+        break;
+      case SubscriberDataUtils::ContactEvent::DEACTIVATED:
+        c_event = &STR_DEACTIVATED;
+        c_state = &STR_TERMINATED;
+        break;
+    }
+
+    // Contact element, which requires an id, state and event.
+    std::string contact = "\n  <";
+    contact.append(STR_CONTACT.ptr, STR_CONTACT.slen);
+    append_xml_attr(contact, STR_ID, Utils::xml_escape(classified_binding->_id));
+    append_xml_attr(contact, STR_STATE, PJUtils::pj_str_to_string(c_state));
+    append_xml_attr(contact, STR_EVENT_LOWER, PJUtils::pj_str_to_string(c_event));
+    contact.push_back('>');
+
+    // URI element.
+    append_xml_leaf(contact,
+                    3,
+                    STR_URI,
+                    "",
+                    Utils::xml_escape(classified_binding->_binding->_uri));
+
+    // Add all 'unknown parameters' from the contact header into the contact
+    // element as <unknown-param> elements. For example, a contact header that
+    // looks like this:
+    //
+    //     Contact: <sip:alice@example.com;p1=v1>;expires=3600;p2;p3=v3
+    //
+    // Would result in the following unknown param elements being added.
+    //
+    //     <unknown-param name="p2" />
+    //     <unknown-param name="p3">v3<unknown-param>
+    //
+    // Note that p1 is not included (as it's a URI parameter) and expires is
+    // not included (as it is defined in RFC 3261 so is a 'known' parameter).
+    for (const std::pair<std::string, std::string>& param :
+                                          classified_binding->_binding->_params)
+    {
+      // RFC 3680 defines unknown parameters as any parameter not defined in
+      // RFC 3261. RFC 3261 defines 'q' and 'expires' so don't add these.
+      if ((param.first != "q") && (param.first != "expires"))
+      {
+        // Add the parameter value as the element content, and the parameter
+        // name as the 'name' attribute.
+        std::string name_attr;
+        append_xml_attr(name_attr, STR_NAME, param.first);
+        append_xml_leaf(contact,
+                        3,
+                        STR_UNKNOWN_PARAM,
+                        name_attr,
+                        Utils::xml_check_escape(param.second));
+      }
+    }
+
+    std::string gruu = Utils::xml_escape(
+                  AoRUtils::pub_gruu_str(classified_binding->_binding, tmp_pool));
+
+    if (!gruu.empty())
+    {
+      TRC_DEBUG("Create pub-gruu node");
+      std::string uri_attr;
+      append_xml_attr(uri_attr, STR_URI, gruu);
+      append_xml_leaf(contact, 3, STR_XML_PUB_GRUU, uri_attr, "");
+    }
+
+    contact.append("\n  </");
+    contact.append(STR_CONTACT.ptr, STR_CONTACT.slen);
+    contact.push_back('>');
+
+    contacts.push_back(contact);
+  }
+
+  pj_pool_release(tmp_pool);
+
+  // Now build the document.  Start with the root element and its attributes.
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<";
+  xml.append(STR_REGINFO.ptr, STR_REGINFO.slen);
+  append_xml_attr(xml, STR_XMLNS_NAME, PJUtils::pj_str_to_string(&STR_XMLNS_VAL));
+  append_xml_attr(xml, STR_XMLNS_GRUU_NAME, PJUtils::pj_str_to_string(&STR_XMLNS_GRUU_VAL));
+  append_xml_attr(xml, STR_XMLNS_XSI_NAME, PJUtils::pj_str_to_string(&STR_XMLNS_XSI_VAL));
+  append_xml_attr(xml, STR_XMLNS_ERE_NAME, PJUtils::pj_str_to_string(&STR_XMLNS_ERE_VAL));
+  append_xml_attr(xml, STR_VERSION, PJUtils::pj_str_to_string(&STR_VERSION_VAL));
+
+  // Add the state - this will always be FULL (the subscription RFC says it
+  // should be partial except on an initial subscriptions, but the TS specs
+  // say it should always be full).
+  append_xml_attr(xml, STR_STATE, PJUtils::pj_str_to_string(&STR_FULL));
+
   std::vector<std::string> irs_impus = associated_uris.get_unbarred_uris();
-  for (std::vector<std::string>::const_iterator impu = irs_impus.begin();
-       impu != irs_impus.end();
-       ++impu)
+
+  if (irs_impus.empty())
+  {
+    xml.append(" />\n");
+    reg_info.chunks.push_back(xml);
+    return;
+  }
+
+  xml.push_back('>');
+
+  std::string reg_state_attr;
+  append_xml_attr(reg_state_attr,
+                  STR_STATE,
+                  (reg_state == RegistrationState::ACTIVE) ? "active" :
+                                                             "terminated");
+
+  // There is a registration element for each unbarred IMPU in the IRS.
+  for (const std::string& impu : irs_impus)
   {
     TRC_DEBUG("Insert registration element for one IRS");
 
-    bool is_wildcard_impu = WildcardUtils::is_wildcard_uri(*impu);
-    std::string unescaped_aor = *impu;
+    bool is_wildcard_impu = WildcardUtils::is_wildcard_uri(impu);
+    std::string unescaped_aor = impu;
 
     // For each wildcarded identity, the TS specs (24.229) say that the aor
     // should be set to an arbitrary IMPU that matches the wildcard identity.
@@ -498,193 +661,42 @@ pj_xml_node* NotifySender::notify_create_reg_state_xml(
       unescaped_aor = "sip:wildcardimpu@wildcard";
     }
 
-    pj_str_t reg_aor;
-    pj_strdup2(pool, &reg_aor, Utils::xml_escape(unescaped_aor).c_str());
-    std::string unescaped_reg_id = subscription->_to_tag;
-    pj_str_t reg_id;
-    pj_strdup2(pool, &reg_id, Utils::xml_escape(unescaped_reg_id).c_str());
-    pj_str_t reg_state_str;
-    reg_state_str = (reg_state == RegistrationState::ACTIVE) ? STR_ACTIVE :
-                                                               STR_TERMINATED;
-    pj_xml_node* reg_node = create_reg_node(pool,
-                                            &reg_aor,
-                                            &reg_id,
-                                            &reg_state_str);
-
-    // Create the contact nodes
-    // For each binding, add a contact node to the registration node
-    for (SubscriberDataUtils::ClassifiedBinding* classified_binding :
-                                                            classified_bindings)
-    {
-      std::string unescaped_c_id = classified_binding->_id;
-      pj_str_t c_id;
-      pj_strdup2(pool, &c_id, Utils::xml_escape(unescaped_c_id).c_str());
-
-      pj_str_t c_state;
-      pj_str_t c_event;
-      switch (classified_binding->_contact_event)
-      {
-        case SubscriberDataUtils::ContactEvent::REGISTERED:
-          c_event = STR_REGISTERED;
-          c_state = STR_ACTIVE;
-          break;
-        case SubscriberDataUtils::ContactEvent::CREATED:
-          c_event = STR_CREATED;
-          c_state = STR_ACTIVE;
-          break;
-        case SubscriberDataUtils::ContactEvent::REFRESHED:
-          c_event = STR_REFRESHED;
-          c_state = STR_ACTIVE;
-          break;
-        case SubscriberDataUtils::ContactEvent::SHORTENED:
-          c_event = STR_SHORTENED;
-          c_state = STR_ACTIVE;
-          break;
-        case SubscriberDataUtils::ContactEvent::EXPIRED:
-          c_event = STR_EXPIRED;
-          c_state = STR_TERMINATED;
-          break;
-        case SubscriberDataUtils::ContactEvent::UNREGISTERED:
-          c_event = STR_UNREGISTERED;
-          c_state = STR_TERMINATED;
-          break;
-        case SubscriberDataUtils::ContactEvent::DEACTIVATED:
-          c_event = STR_DEACTIVATED;
-          c_state = STR_TERMINATED;
-          break;
-      }
-
-      pj_xml_node* contact_node = create_contact_node(pool,
-                                                      &c_id,
-                                                      &c_state,
-                                                      &c_event);
-
-      // Create and add the URI element.
-      pj_str_t c_uri;
+    // Registration element, which requires an aor, id and state.  The id goes
+    // between this chunk and the next one.
+    xml.append("\n <");
+    xml.append(STR_REGISTRATION.ptr, STR_REGISTRATION.slen);
+    append_xml_attr(xml, STR_AOR, Utils::xml_escape(unescaped_aor));
+    reg_info.chunks.push_back(xml);
+    xml = reg_state_attr;
 
-      if (classified_binding->_binding->_uri.size() > 0)
-      {
-        std::string unescaped_c_uri = classified_binding->_binding->_uri;
-        pj_strdup2(pool, &c_uri, Utils::xml_escape(unescaped_c_uri).c_str());
-      }
-
-      pj_xml_node* uri_node = pj_xml_node_new(pool, &STR_URI);
-      pj_strdup(pool, &uri_node->content, &c_uri);
-      pj_xml_add_node(contact_node, uri_node);
-
-      // Add all 'unknown parameters' from the contact header into the contact
-      // element as <unknown-param> elements. For example, a contact header that
-      // looks like this:
-      //
-      //     Contact: <sip:alice@example.com;p1=v1>;expires=3600;p2;p3=v3
-      //
-      // Would result in the following unknown param elements being added.
-      //
-      //     <unknown-param name="p2" />
-      //     <unknown-param name="p3">v3<unknown-param>
-      //
-      // Note that p1 is not included (as it's a URI parameter) and expires is
-      // not included (as it is defined in RFC 3261 so is a 'known' parameter).
-      for (const std::pair<std::string, std::string>& param :
-                                          classified_binding->_binding->_params)
-      {
-        // RFC 3680 defines unknown parameters as any parameter not defined in
-        // RFC 3261. RFC 3261 defines 'q' and 'expires' so don't add these.
-        if ((param.first != "q") && (param.first != "expires"))
-        {
-          // Add the parameter value as the element content, and the parameter
-          // name as the 'name' attribute.
-          pj_xml_node* unknown_param_node =
-                                      pj_xml_node_new(pool, &STR_UNKNOWN_PARAM);
-          std::string escaped_value = Utils::xml_check_escape(param.second);
-          pj_strdup2(pool, &unknown_param_node->content, escaped_value.c_str());
-
-          pj_str_t param_name;
-          pj_strdup2(pool, &param_name, param.first.c_str());
-          pj_xml_attr* name_attr =
-                                  pj_xml_attr_new(pool, &STR_NAME, &param_name);
-          pj_xml_add_attr(unknown_param_node, name_attr);
-
-          pj_xml_add_node(contact_node, unknown_param_node);
-        }
-      }
-
-      pj_str_t gruu;
-      pj_strdup2(pool,
-                 &gruu,
-                 Utils::xml_escape(AoRUtils::pub_gruu_str(classified_binding->_binding,
-                                                          pool))
-                                  .c_str());
-
-      if (gruu.slen != 0)
-      {
-        TRC_DEBUG("Create pub-gruu node");
-        pj_xml_node* gruu_node = pj_xml_node_new(pool, &STR_XML_PUB_GRUU);
-        attr = pj_xml_attr_new(pool, &STR_URI, &gruu);
-        pj_xml_add_attr(gruu_node, attr);
-        pj_xml_add_node(contact_node, gruu_node);
-      }
+    if (contacts.empty())
+    {
+      xml.append(" />");
+      continue;
+    }
 
-      if (is_wildcard_impu)
-      {
-        // Add the wildcard node to the registration node
-        TRC_DEBUG("Add wildcard registration node");
-        pj_str_t c_wildcard;
-        pj_strdup2(pool, &c_wildcard, Utils::xml_escape(*impu).c_str());
-        pj_xml_node* wildcard_node = pj_xml_node_new(pool, &STR_WILDCARD);
-        pj_strdup(pool, &wildcard_node->content, &c_wildcard);
-        pj_xml_add_node(reg_node, wildcard_node);
-      }
+    xml.push_back('>');
 
-      // Add the contact node to the registration node
-      pj_xml_add_node(reg_node, contact_node);
+    std::string wildcard;
+    if (is_wildcard_impu)
+    {
+      append_xml_leaf(wildcard, 2, STR_WILDCARD, "", Utils::xml_escape(impu));
     }
 
-    pj_xml_add_node(doc, reg_node);
+    for (const std::string& contact : contacts)
+    {
+      // Add the wildcard node (if any) in front of each contact.
+      xml.append(wildcard);
+      xml.append(contact);
+    }
 
+    xml.append("\n </");
+    xml.append(STR_REGISTRATION.ptr, STR_REGISTRATION.slen);
+    xml.push_back('>');
   }
 
-  return doc;
-}
-
-// Return a XML registration node with the attributes populated
-pj_xml_node* NotifySender::create_reg_node(pj_pool_t* pool,
-                                           pj_str_t* aor,
-                                           pj_str_t* id,
-                                           pj_str_t* state)
-{
-  TRC_DEBUG("Create registration node");
-
-  pj_xml_node* reg_node = pj_xml_node_new(pool, &STR_REGISTRATION);
-
-  // Registration node requires a aor, id and state
-  pj_xml_attr* aor_attr = pj_xml_attr_new(pool, &STR_AOR, aor);
-  pj_xml_add_attr(reg_node, aor_attr);
-  pj_xml_attr* id_attr = pj_xml_attr_new(pool, &STR_ID, id);
-  pj_xml_add_attr(reg_node, id_attr);
-  pj_xml_attr* state_attr = pj_xml_attr_new(pool, &STR_STATE, state);
-  pj_xml_add_attr(reg_node, state_attr);
-
-  return reg_node;
-}
-
-// Return a XML contact node with the attributes populated
-pj_xml_node* NotifySender::create_contact_node(pj_pool_t* pool,
-                                               pj_str_t* id,
-                                               pj_str_t* state,
-                                               pj_str_t* event)
-{
-  TRC_DEBUG("Create contact node");
-
-  pj_xml_node* contact_node = pj_xml_node_new(pool, &STR_CONTACT);
-
-  // Contact node requires an id, state and event
-  pj_xml_attr* id_attr = pj_xml_attr_new(pool, &STR_ID, id);
-  pj_xml_add_attr(contact_node, id_attr);
-  pj_xml_attr* state_attr = pj_xml_attr_new(pool, &STR_STATE, state);
-  pj_xml_add_attr(contact_node, state_attr);
-  pj_xml_attr* event_attr = pj_xml_attr_new(pool, &STR_EVENT_LOWER, event);
-  pj_xml_add_attr(contact_node, event_attr);
-
-  return contact_node;
+  xml.append("\n</");
+  xml.append(STR_REGINFO.ptr, STR_REGINFO.slen);
+  xml.append(">\n");
+  reg_info.chunks.push_back(xml);
 }
@@ -0,0 +1,105 @@
+/**
+ * @file number_normalizer.cpp Normalization of telephone numbers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+
+#include "number_normalizer.h"
+
+namespace NumberNormalizer
+{
+  // Character classes.
+  static const uint8_t DIGIT = 0x1;
+  static const uint8_t PLUS = 0x2;
+  static const uint8_t VISUAL_SEPARATOR = 0x4;
+
+  struct CharClasses
+  {
+    CharClasses() : classes()
+    {
+      for (char ch = '0'; ch <= '9'; ++ch)
+      {
+        classes[(uint8_t)ch] = DIGIT;
+      }
+
+      classes[(uint8_t)'+'] = PLUS;
+      classes[(uint8_t)'-'] = VISUAL_SEPARATOR;
+      classes[(uint8_t)'.'] = VISUAL_SEPARATOR;
+      classes[(uint8_t)'('] = VISUAL_SEPARATOR;
+      classes[(uint8_t)')'] = VISUAL_SEPARATOR;
+    }
+
+    uint8_t operator[](char ch) const { return classes[(uint8_t)ch]; }
+
+    uint8_t classes[256];
+  };
+
+  static const CharClasses CLASSES;
+
+  std::string remove_visual_separators(const char* number, size_t length)
+  {
+    std::string result;
+    result.reserve(length);
+
+    for (size_t ii = 0; ii < length; ++ii)
+    {
+      if (!(CLASSES[number[ii]] & VISUAL_SEPARATOR))
+      {
+        result.push_back(number[ii]);
+      }
+    }
+
+    return result;
+  }
+
+  std::string to_aus(const std::string& user)
+  {
+    std::string aus;
+    aus.reserve(user.length());
+
+    if ((!user.empty()) && (CLASSES[user[0]] & (DIGIT | PLUS)))
+    {
+      aus.push_back(user[0]);
+    }
+
+    for (size_t ii = 1; ii < user.length(); ++ii)
+    {
+      if (CLASSES[user[ii]] & DIGIT)
+      {
+        aus.push_back(user[ii]);
+      }
+    }
+
+    return aus;
+  }
+
+  std::string enum_domain(const std::string& key, const std::string& suffix)
+  {
+    // Each digit and its dot, and the suffix.
+    std::string domain;
+    domain.reserve(key.length() * 2 + suffix.length());
+
+    for (size_t ii = key.length(); ii > 0; --ii)
+    {
+      if (CLASSES[key[ii - 1]] & DIGIT)
+      {
+        if (!domain.empty())
+        {
+          domain.push_back('.');
+        }
+
+        domain.push_back(key[ii - 1]);
+      }
+    }
+
+    domain += suffix;
+    return domain;
+  }
+}
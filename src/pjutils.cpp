@@ -30,7 +30,9 @@ extern "C" {
 #include "sproutsasevent.h"
 #include "enumservice.h"
 #include "uri_classifier.h"
+#include "number_normalizer.h"
 #include "thread_dispatcher.h"
+#include "sdp_scanner.h"
 
 
 static void on_tsx_state(pjsip_transaction*, pjsip_event*);
@@ -81,17 +83,48 @@ pj_str_t PJUtils::uri_to_pj_str(pjsip_uri_context_e context,
 }
 
 
-std::string PJUtils::uri_to_string(pjsip_uri_context_e context,
-                                   const pjsip_uri* uri)
+/// Prints a URI into the supplied buffer, without allocating anything, and
+/// returns a string pointing into the buffer.  The string is empty if the URI
+/// is NULL or doesn't fit in the buffer.
+pj_str_t PJUtils::uri_to_pj_str(pjsip_uri_context_e context,
+                                const pjsip_uri* uri,
+                                char* buf,
+                                size_t size)
 {
-  int uri_clen = 0;
-  char uri_cstr[500];
+  pj_str_t s;
+  s.ptr = buf;
+  s.slen = 0;
   if (uri != NULL)
   {
-    uri_clen = pjsip_uri_print(context, uri, uri_cstr, sizeof(uri_cstr));
+    s.slen = pjsip_uri_print(context, uri, buf, size);
+    if (s.slen < 0)
+    {
+      s.slen = 0;
+    }
   }
 
-  return std::string(uri_cstr, uri_clen);
+  return s;
+}
+
+
+std::string PJUtils::uri_to_string(pjsip_uri_context_e context,
+                                   const pjsip_uri* uri)
+{
+  char uri_cstr[500];
+  pj_str_t s = uri_to_pj_str(context, uri, uri_cstr, sizeof(uri_cstr));
+  return std::string(s.ptr, s.slen);
+}
+
+
+/// Adds a URI to a SAS event as a variable length parameter, printing it
+/// straight into the event rather than building a string first.
+void PJUtils::add_uri_param(SAS::Event& event,
+                            pjsip_uri_context_e context,
+                            const pjsip_uri* uri)
+{
+  char uri_cstr[500];
+  pj_str_t s = uri_to_pj_str(context, uri, uri_cstr, sizeof(uri_cstr));
+  event.add_var_param(s.slen, s.ptr);
 }
 
 
@@ -177,9 +210,12 @@ std::string PJUtils::body_to_string(pjsip_msg_body* body)
 }
 
 
-/// Returns a canonical IMS public user identity from a URI as per TS 23.003
-/// 13.4.
-std::string PJUtils::public_id_from_uri(const pjsip_uri* uri)
+/// Prints the canonical IMS public user identity from a URI as per TS 23.003
+/// 13.4 into the supplied buffer, without allocating anything.  The string is
+/// empty if the URI isn't a SIP or Tel URI.
+pj_str_t PJUtils::public_id_to_pj_str(const pjsip_uri* uri,
+                                      char* buf,
+                                      size_t size)
 {
   if (PJSIP_URI_SCHEME_IS_SIP(uri))
   {
@@ -196,7 +232,10 @@ std::string PJUtils::public_id_from_uri(const pjsip_uri* uri)
     public_id.other_param.next = NULL;
     public_id.header_param.next = NULL;
     public_id.userinfo_param.next = NULL;
-    return uri_to_string(PJSIP_URI_IN_FROMTO_HDR, (pjsip_uri*)&public_id);
+    return uri_to_pj_str(PJSIP_URI_IN_FROMTO_HDR,
+                         (pjsip_uri*)&public_id,
+                         buf,
+                         size);
   }
   else if (PJSIP_URI_SCHEME_IS_TEL(uri))
   {
@@ -206,14 +245,29 @@ std::string PJUtils::public_id_from_uri(const pjsip_uri* uri)
     public_id.ext_param.slen = 0;
     public_id.isub_param.slen = 0;
     public_id.other_param.next = NULL;
-    return uri_to_string(PJSIP_URI_IN_FROMTO_HDR, (pjsip_uri*)&public_id);
+    return uri_to_pj_str(PJSIP_URI_IN_FROMTO_HDR,
+                         (pjsip_uri*)&public_id,
+                         buf,
+                         size);
   }
   else
   {
-    return std::string();
+    pj_str_t s;
+    s.ptr = buf;
+    s.slen = 0;
+    return s;
   }
 }
 
+/// Returns a canonical IMS public user identity from a URI as per TS 23.003
+/// 13.4.
+std::string PJUtils::public_id_from_uri(const pjsip_uri* uri)
+{
+  char buf[500];
+  pj_str_t s = public_id_to_pj_str(uri, buf, sizeof(buf));
+  return std::string(s.ptr, s.slen);
+}
+
 pj_bool_t PJUtils::valid_public_id_from_uri(const pjsip_uri* uri, std::string& impu)
 {
   impu = public_id_from_uri(uri);
@@ -280,8 +334,8 @@ pjsip_uri* PJUtils::orig_served_user(const pjsip_msg* msg,
   // we will also look at the From header if neither of the IMS headers is
   // present.
   pjsip_uri* uri = NULL;
-  pjsip_routing_hdr* served_user = (pjsip_routing_hdr*)
-                     pjsip_msg_find_hdr_by_name(msg, &STR_P_SERVED_USER, NULL);
+  const pjsip_routing_hdr* served_user = (const pjsip_routing_hdr*)
+                     PJUtils::peek_hdr_by_name(msg, &STR_P_SERVED_USER);
 
   if (served_user != NULL)
   {
@@ -293,8 +347,8 @@ pjsip_uri* PJUtils::orig_served_user(const pjsip_msg* msg,
   {
     // No P-Served-User header present, so check for P-Asserted-Identity
     // header.
-    pjsip_routing_hdr* asserted_id = (pjsip_routing_hdr*)
-               pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL);
+    const pjsip_routing_hdr* asserted_id = (const pjsip_routing_hdr*)
+               PJUtils::peek_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY);
 
     if (asserted_id != NULL)
     {
@@ -553,7 +607,8 @@ pj_bool_t PJUtils::is_next_route_local(const pjsip_msg* msg, pjsip_route_hdr* st
 /// Adds a Record-Route header to the message with the specified user name,
 /// host, port and transport.  If the user parameter is NULL the user field is
 /// left blank. If the top Record-Route header already matches the
-/// added one, does nothing.
+/// added one, does nothing.  The transport name isn't copied, so must be a
+/// static string (such as a literal or a transport's type name).
 void PJUtils::add_record_route(pjsip_tx_data* tdata,
                                const char* transport,
                                int port,
@@ -564,7 +619,7 @@ void PJUtils::add_record_route(pjsip_tx_data* tdata,
   pjsip_sip_uri* uri = pjsip_sip_uri_create(tdata->pool, PJ_FALSE);
   uri->host = host;
   uri->port = port;
-  pj_strdup2(tdata->pool, &uri->transport_param, transport);
+  uri->transport_param = pj_str((char*)transport);
   uri->lr_param = PJ_TRUE;
 
   if (user != NULL)
@@ -612,6 +667,62 @@ void PJUtils::remove_hdr(pjsip_msg* msg,
 }
 
 
+void* PJUtils::find_hdr_by_name(const pjsip_msg* msg,
+                                const pj_str_t* name,
+                                const void* start)
+{
+  pjsip_hdr* hdr = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, name, start);
+
+  while ((hdr != NULL) && (is_lazy_hdr(hdr)))
+  {
+    // If the header is invalid, carry on looking from the header after it.
+    pjsip_hdr* next = hdr->next;
+    hdr = parse_lazy_hdr(hdr);
+    if (hdr == NULL)
+    {
+      hdr = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, name, next);
+    }
+  }
+
+  return hdr;
+}
+
+const void* PJUtils::peek_hdr_by_name(const pjsip_msg* msg,
+                                     const pj_str_t* name)
+{
+  pjsip_hdr* hdr = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, name, NULL);
+  const pjsip_hdr* parsed = NULL;
+
+  while ((hdr != NULL) && ((parsed = peek_lazy_hdr(hdr)) == NULL))
+  {
+    // The header is invalid, so carry on looking from the header after it.
+    hdr = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, name, hdr->next);
+  }
+
+  return parsed;
+}
+
+void* PJUtils::find_hdr_by_names(const pjsip_msg* msg,
+                                 const pj_str_t* name,
+                                 const pj_str_t* sname,
+                                 const void* start)
+{
+  pjsip_hdr* hdr =
+    (pjsip_hdr*)pjsip_msg_find_hdr_by_names(msg, name, sname, start);
+
+  while ((hdr != NULL) && (is_lazy_hdr(hdr)))
+  {
+    pjsip_hdr* next = hdr->next;
+    hdr = parse_lazy_hdr(hdr);
+    if (hdr == NULL)
+    {
+      hdr = (pjsip_hdr*)pjsip_msg_find_hdr_by_names(msg, name, sname, next);
+    }
+  }
+
+  return hdr;
+}
+
 /// Delete all existing copies of a header and replace with a new one.
 /// The header to delete must not be one that has an abbreviation.
 void PJUtils::set_generic_header(pjsip_tx_data* tdata,
@@ -718,6 +829,8 @@ pjsip_tx_data* PJUtils::clone_msg(pjsip_endpoint* endpt,
                                   pjsip_rx_data* rdata)
 {
   pjsip_tx_data* clone = NULL;
+  RecyclingPoolFactory::SizeHint size_hint(rdata->msg_info.msg,
+                                           (rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG));
   pj_status_t status = pjsip_endpt_create_tdata(endpt, &clone);
   if (status == PJ_SUCCESS)
   {
@@ -735,6 +848,8 @@ pjsip_tx_data* PJUtils::clone_msg(pjsip_endpoint* endpt,
                                   pjsip_tx_data* tdata)
 {
   pjsip_tx_data* clone = NULL;
+  RecyclingPoolFactory::SizeHint size_hint(tdata->msg,
+                                           (tdata->msg->type == PJSIP_RESPONSE_MSG));
   pj_status_t status = pjsip_endpt_create_tdata(endpt, &clone);
   if (status == PJ_SUCCESS)
   {
@@ -747,12 +862,72 @@ pjsip_tx_data* PJUtils::clone_msg(pjsip_endpoint* endpt,
 }
 
 
+/// The clone_data function of bodies shared by clone_msg_sharing_body.  It
+/// copies the data just as pjsip_clone_text_data does - it's only used to mark
+/// bodies whose data belongs to another message.
+static void* clone_shared_text_data(pj_pool_t* pool,
+                                    const void* data,
+                                    unsigned len)
+{
+  return pjsip_clone_text_data(pool, data, len);
+}
+
+
+pjsip_tx_data* PJUtils::clone_msg_sharing_body(pjsip_endpoint* endpt,
+                                               pjsip_tx_data* tdata)
+{
+  pjsip_msg_body* body = tdata->msg->body;
+
+  if ((body == NULL) ||
+      ((body->clone_data != &pjsip_clone_text_data) &&
+       (body->clone_data != &clone_shared_text_data)))
+  {
+    // No body, or a multipart body whose parts could be modified.
+    return clone_msg(endpt, tdata);
+  }
+
+  // Clone the message without its body, then point the clone at the original
+  // body data.
+  tdata->msg->body = NULL;
+  pjsip_tx_data* clone = clone_msg(endpt, tdata);
+  tdata->msg->body = body;
+
+  if (clone != NULL)
+  {
+    pjsip_msg_body* shared_body = PJ_POOL_ALLOC_T(clone->pool, pjsip_msg_body);
+    *shared_body = *body;
+    pjsip_media_type_cp(clone->pool, &shared_body->content_type, &body->content_type);
+    shared_body->clone_data = &clone_shared_text_data;
+    clone->msg->body = shared_body;
+  }
+
+  return clone;
+}
+
+
+size_t PJUtils::unshare_body(pjsip_tx_data* tdata)
+{
+  pjsip_msg_body* body = tdata->msg->body;
+
+  if ((body == NULL) || (body->clone_data != &clone_shared_text_data))
+  {
+    return 0;
+  }
+
+  TRC_DEBUG("Copy shared body into %s", tdata->obj_name);
+  tdata->msg->body = pjsip_msg_body_clone(tdata->pool, body);
+  tdata->msg->body->clone_data = &pjsip_clone_text_data;
+  return body->len;
+}
+
+
 pj_status_t PJUtils::create_response(pjsip_endpoint* endpt,
                                      const pjsip_rx_data* rdata,
                                      int st_code,
                                      const pj_str_t* st_text,
                                      pjsip_tx_data** p_tdata)
 {
+  RecyclingPoolFactory::SizeHint size_hint(rdata->msg_info.msg, true);
   pj_status_t status = pjsip_endpt_create_response(endpt,
                                                    rdata,
                                                    st_code,
@@ -785,6 +960,7 @@ pj_status_t PJUtils::create_response(pjsip_endpoint *endpt,
 
   // Create a new transmit buffer.
   pjsip_tx_data *tdata;
+  RecyclingPoolFactory::SizeHint size_hint(req_msg, true);
   pj_status_t status = pjsip_endpt_create_tdata(endpt, &tdata);
   if (status != PJ_SUCCESS)
   {
@@ -885,6 +1061,7 @@ pj_status_t PJUtils::create_request_fwd(pjsip_endpoint* endpt,
                                         unsigned options,
                                         pjsip_tx_data** p_tdata)
 {
+  RecyclingPoolFactory::SizeHint size_hint(rdata->msg_info.msg, false);
   pj_status_t status = pjsip_endpt_create_request_fwd(endpt,
                                                       rdata,
                                                       uri,
@@ -905,6 +1082,7 @@ pj_status_t PJUtils::create_response_fwd(pjsip_endpoint* endpt,
                                          unsigned options,
                                          pjsip_tx_data** p_tdata)
 {
+  RecyclingPoolFactory::SizeHint size_hint(rdata->msg_info.msg, true);
   pj_status_t status = pjsip_endpt_create_response_fwd(endpt,
                                                        rdata,
                                                        options,
@@ -938,6 +1116,31 @@ pjsip_tx_data* PJUtils::create_cancel(pjsip_endpoint* endpt,
   return cancel;
 }
 
+
+/// Creates a CANCEL with a copy of the supplied Reason header (if it isn't
+/// NULL).  This is used when cancelling all the forks of a request, so that
+/// the Reason header is only built once.
+pjsip_tx_data* PJUtils::create_cancel(pjsip_endpoint* endpt,
+                                      pjsip_tx_data* tdata,
+                                      const pjsip_hdr* reason_hdr)
+{
+  pjsip_tx_data* cancel;
+  pj_status_t status = pjsip_endpt_create_cancel(endpt, tdata, &cancel);
+
+  if (status != PJ_SUCCESS)
+  {
+    return NULL;
+  }
+
+  if (reason_hdr != NULL)
+  {
+    pjsip_msg_add_hdr(cancel->msg,
+                      (pjsip_hdr*)pjsip_hdr_clone(cancel->pool, reason_hdr));
+  }
+
+  return cancel;
+}
+
 /// Resolves a destination and returns an iterator.
 BaseAddrIterator* PJUtils::resolve_iter(const std::string& name,
                            int port,
@@ -969,17 +1172,17 @@ void PJUtils::resolve(const std::string& name,
 }
 
 
-/// Resolves the next hop target of the SIP message.
-BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
-                                                 int allowed_host_state,
-                                                 SAS::TrailId trail)
+/// Parses the destination, port and transport out of the next hop URI of the
+/// SIP message.
+static pjsip_sip_uri* parse_next_hop(pjsip_tx_data* tdata,
+                                     std::string& name,
+                                     int& port,
+                                     int& transport)
 {
-  // Get the next hop URI from the message and parse out the destination, port
-  // and transport.
   pjsip_sip_uri* next_hop = (pjsip_sip_uri*)PJUtils::next_hop(tdata->msg);
-  std::string name = std::string(next_hop->host.ptr, next_hop->host.slen);
-  int port = next_hop->port;
-  int transport = -1;
+  name = std::string(next_hop->host.ptr, next_hop->host.slen);
+  port = next_hop->port;
+  transport = -1;
   if (pj_stricmp2(&next_hop->transport_param, "TCP") == 0)
   {
     transport = IPPROTO_TCP;
@@ -989,6 +1192,22 @@ BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
     transport = IPPROTO_UDP;
   }
 
+  return next_hop;
+}
+
+
+/// Resolves the next hop target of the SIP message.
+BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
+                                                 int allowed_host_state,
+                                                 SAS::TrailId trail)
+{
+  // Get the next hop URI from the message and parse out the destination, port
+  // and transport.
+  std::string name;
+  int port;
+  int transport;
+  pjsip_sip_uri* next_hop = parse_next_hop(tdata, name, port, transport);
+
   BaseAddrIterator* targets_iter = stack_data.sipresolver->resolve_iter(name,
                                                                         stack_data.addr_family,
                                                                         port,
@@ -1004,6 +1223,31 @@ BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
 }
 
 
+/// Resolves the next hop target of the SIP message without blocking the
+/// calling thread on DNS if possible.  Returns the targets if they were found
+/// straight away, and otherwise returns NULL and calls the callback (on a
+/// resolver thread) once they have been found.
+BaseAddrIterator* PJUtils::resolve_next_hop_iter_async(pjsip_tx_data* tdata,
+                                                       int allowed_host_state,
+                                                       SIPResolver::ResolveCallback callback,
+                                                       SAS::TrailId trail)
+{
+  std::string name;
+  int port;
+  int transport;
+  parse_next_hop(tdata, name, port, transport);
+
+  TRC_DEBUG("Resolve destination %s", name.c_str());
+  return stack_data.sipresolver->resolve_iter_async(name,
+                                                    stack_data.addr_family,
+                                                    port,
+                                                    transport,
+                                                    allowed_host_state,
+                                                    callback,
+                                                    trail);
+}
+
+
 /// Resolves the next hop target of the SIP message.
 void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
                                int retries,
@@ -1034,6 +1278,30 @@ void PJUtils::success(AddrInfo& server)
 }
 
 
+/// Reports how long a server took to respond to a request, so that quicker
+/// servers can be preferred.
+void PJUtils::record_latency(const AddrInfo& server, unsigned long latency_us)
+{
+  stack_data.sipresolver->record_latency(server, latency_us);
+}
+
+
+/// Records that the specified server is shedding load, so that subsequent
+/// requests prefer other servers for a while.
+void PJUtils::record_overload(const AddrInfo& server, int retry_after_s)
+{
+  stack_data.sipresolver->record_overload(server, retry_after_s);
+}
+
+
+/// Moves a server that is shedding load behind the next one, if that isn't.
+/// Takes ownership of servers_iter.
+BaseAddrIterator* PJUtils::avoid_overloaded(BaseAddrIterator* servers_iter)
+{
+  return stack_data.sipresolver->avoid_overloaded(servers_iter);
+}
+
+
 /// Blacklists the specified server so it will not be preferred in subsequent
 /// resolve calls.
 void PJUtils::blacklist(AddrInfo& server)
@@ -1710,6 +1978,8 @@ pjsip_tx_data* PJUtils::clone_tdata(pjsip_tx_data* tdata)
   pjsip_tx_data* cloned_tdata;
   pj_status_t status;
 
+  RecyclingPoolFactory::SizeHint size_hint(tdata->msg,
+                                           (tdata->msg->type == PJSIP_RESPONSE_MSG));
   status = pjsip_endpt_create_tdata(stack_data.endpt, &cloned_tdata);
   if (status != PJ_SUCCESS)
   {
@@ -1777,26 +2047,47 @@ static std::string build_reason_value(int code)
   return value_builder.str();
 }
 
-void PJUtils::add_reason(pjsip_tx_data* tdata, int reason_code)
+pjsip_hdr* PJUtils::create_reason_hdr(pj_pool_t* pool, int reason_code)
 {
   pj_str_t reason_name = pj_str("Reason");
   pj_str_t reason_val;
 
   std::string reason_value_string = build_reason_value(reason_code);
-  pj_strdup2(tdata->pool,
+  pj_strdup2(pool,
              &reason_val,
              reason_value_string.c_str());
 
-  pjsip_hdr* reason_hdr =
-                      (pjsip_hdr*)pjsip_generic_string_hdr_create(tdata->pool,
-                                                                  &reason_name,
-                                                                  &reason_val);
-  pjsip_msg_add_hdr(tdata->msg, reason_hdr);
+  return (pjsip_hdr*)pjsip_generic_string_hdr_create(pool,
+                                                     &reason_name,
+                                                     &reason_val);
+}
+
+void PJUtils::add_reason(pjsip_tx_data* tdata, int reason_code)
+{
+  pjsip_msg_add_hdr(tdata->msg, create_reason_hdr(tdata->pool, reason_code));
+}
+
+size_t PJUtils::SockaddrHostHash::operator()(const pj_sockaddr& addr) const
+{
+  const unsigned char* bytes = (const unsigned char*)pj_sockaddr_get_addr(&addr);
+  unsigned len = pj_sockaddr_get_addr_len(&addr);
+  size_t hash = addr.addr.sa_family;
+
+  for (unsigned ii = 0; ii < len; ++ii)
+  {
+    hash = (hash * 31) + bytes[ii];
+  }
+
+  return hash;
 }
 
-bool PJUtils::compare_pj_sockaddr(const pj_sockaddr& lhs, const pj_sockaddr& rhs)
+bool PJUtils::SockaddrHostEqual::operator()(const pj_sockaddr& lhs,
+                                            const pj_sockaddr& rhs) const
 {
-  return (pj_sockaddr_cmp(&lhs, &rhs) < 0);
+  return ((lhs.addr.sa_family == rhs.addr.sa_family) &&
+          (memcmp(pj_sockaddr_get_addr(&lhs),
+                  pj_sockaddr_get_addr(&rhs),
+                  pj_sockaddr_get_addr_len(&lhs)) == 0));
 }
 
 
@@ -1837,9 +2128,9 @@ std::string PJUtils::get_header_value(pjsip_hdr* header)
 // for B2BUA AS correlation.
 void PJUtils::mark_icid(const SAS::TrailId trail, pjsip_msg* msg)
 {
-  pjsip_p_c_v_hdr* pcv = (pjsip_p_c_v_hdr*)pjsip_msg_find_hdr_by_name(msg,
-                                                                      &STR_P_C_V,
-                                                                      NULL);
+  pjsip_p_c_v_hdr* pcv = (pjsip_p_c_v_hdr*)PJUtils::find_hdr_by_name(msg,
+                                                                     &STR_P_C_V,
+                                                                     NULL);
 
   if (pcv)
   {
@@ -2254,7 +2545,7 @@ void PJUtils::add_pcfa_header(pjsip_msg* msg,
                               const bool replace)
 {
   pjsip_p_c_f_a_hdr* pcfa_hdr =
-    (pjsip_p_c_f_a_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_P_C_F_A, NULL);
+    (pjsip_p_c_f_a_hdr*)PJUtils::find_hdr_by_name(msg, &STR_P_C_F_A, NULL);
 
   if (((pcfa_hdr == NULL) || (replace)) &&
       ((!ccfs.empty()) || (!ecfs.empty())))
@@ -2418,8 +2709,7 @@ void PJUtils::add_parameter_to_sip_uri(pjsip_sip_uri* sip_uri,
 // Strip any visual separators from the number
 std::string PJUtils::remove_visual_separators(const pj_str_t& number)
 {
-  std::string s = pj_str_to_string(&number);
-  return Utils::remove_visual_separators(s);
+  return NumberNormalizer::remove_visual_separators(number.ptr, number.slen);
 };
 
 bool PJUtils::get_npdi(pjsip_uri* uri)
@@ -2500,7 +2790,7 @@ static std::string query_enum(pjsip_msg* req,
     pj_str_t pj_user = PJUtils::user_from_uri(uri);
     user = PJUtils::pj_str_to_string(&pj_user);
     TRC_DEBUG("Performing ENUM translation for user %s", user.c_str());
-    new_uri = enum_service->lookup_uri_from_user(user, trail);
+    new_uri = enum_service->memoized_lookup_uri_from_user(user, trail);
   }
   else
   {
@@ -2516,6 +2806,21 @@ void PJUtils::translate_request_uri(pjsip_msg* req,
                                     EnumService* enum_service,
                                     bool should_override_npdi,
                                     SAS::TrailId trail)
+{
+  std::string user;
+
+  if (enum_user_to_translate(req, user, trail))
+  {
+    std::string new_uri_str = query_enum(req,
+                                         enum_service,
+                                         trail);
+    apply_enum_translation(req, pool, new_uri_str, should_override_npdi, trail);
+  }
+}
+
+bool PJUtils::enum_user_to_translate(pjsip_msg* req,
+                                     std::string& user,
+                                     SAS::TrailId trail)
 {
   pjsip_uri* uri = req->line.req.uri;
   URIClass uri_class = URIClassifier::classify_uri(uri, false, true);
@@ -2524,73 +2829,85 @@ void PJUtils::translate_request_uri(pjsip_msg* req,
       (uri_class == NP_DATA) ||
       (uri_class == FINAL_NP_DATA))
   {
-
     // Request is either to a URI in this domain, or a Tel URI, so attempt
     // to translate it according to 5.4.3.2 section 10.
     TRC_DEBUG("Translating URI");
-    std::string new_uri_str = query_enum(req,
-                                         enum_service,
-                                         trail);
+    pj_str_t pj_user = PJUtils::user_from_uri(uri);
+    user = PJUtils::pj_str_to_string(&pj_user);
+    return true;
+  }
+  else if (uri_class == LOCAL_PHONE_NUMBER)
+  {
+    TRC_DEBUG("Not doing ENUM lookup as URI was classified as local DN");
+    SAS::Event event(trail, SASEvent::NO_ENUM_LOOKUP_LOCAL_DN, 0);
+    PJUtils::add_uri_param(event, PJSIP_URI_IN_REQ_URI, uri);
+    SAS::report_event(event);
+  }
 
-    if (!new_uri_str.empty())
-    {
-      pjsip_uri* new_uri = (pjsip_uri*)PJUtils::uri_from_string(new_uri_str,
-                                                                pool);
+  return false;
+}
 
-      if (new_uri == NULL)
-      {
-        // The ENUM lookup has returned an invalid URI. Reject the
-        // request.
-        TRC_WARNING("Invalid ENUM response: %s", new_uri_str.c_str());
-        SAS::Event event(trail, SASEvent::ENUM_INVALID, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-        return;
-      }
+void PJUtils::apply_enum_translation(pjsip_msg* req,
+                                     pj_pool_t* pool,
+                                     const std::string& translated_uri,
+                                     bool should_override_npdi,
+                                     SAS::TrailId trail)
+{
+  pjsip_uri* uri = req->line.req.uri;
+  URIClass uri_class = URIClassifier::classify_uri(uri, false, true);
+  std::string new_uri_str = translated_uri;
 
-      // The URI was successfully translated, so see what it is.
-      URIClass new_uri_class = URIClassifier::classify_uri(new_uri, false, true);
-      std::string rn;
-      get_rn(new_uri, rn);
+  if (!new_uri_str.empty())
+  {
+    pjsip_uri* new_uri = (pjsip_uri*)PJUtils::uri_from_string(new_uri_str,
+                                                              pool);
 
-      if ((new_uri_class == HOME_DOMAIN_SIP_URI) ||
-          (new_uri_class == NODE_LOCAL_SIP_URI) ||
-          (new_uri_class == OFFNET_SIP_URI))
-      {
-        // Translation to a real SIP URI - this always takes priority.
-        TRC_DEBUG("Translated URI %s is a real SIP URI - replacing Request-URI",
-                  new_uri_str.c_str());
-        req->line.req.uri = new_uri;
-        SAS::Event event(trail, SASEvent::SIP_URI_FROM_ENUM, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
-      }
-      else if ((new_uri_class == NP_DATA) || (new_uri_class == FINAL_NP_DATA))
-      {
-        if (should_update_np_data(uri_class, new_uri_class, new_uri_str, rn, should_override_npdi, trail))
-        {
-          req->line.req.uri = new_uri;
-        }
-      }
-      else
+    if (new_uri == NULL)
+    {
+      // The ENUM lookup has returned an invalid URI. Reject the
+      // request.
+      TRC_WARNING("Invalid ENUM response: %s", new_uri_str.c_str());
+      SAS::Event event(trail, SASEvent::ENUM_INVALID, 0);
+      event.add_var_param(new_uri_str);
+      SAS::report_event(event);
+      return;
+    }
+
+    // The URI was successfully translated, so see what it is.
+    URIClass new_uri_class = URIClassifier::classify_uri(new_uri, false, true);
+    std::string rn;
+    get_rn(new_uri, rn);
+
+    if ((new_uri_class == HOME_DOMAIN_SIP_URI) ||
+        (new_uri_class == NODE_LOCAL_SIP_URI) ||
+        (new_uri_class == OFFNET_SIP_URI))
+    {
+      // Translation to a real SIP URI - this always takes priority.
+      TRC_DEBUG("Translated URI %s is a real SIP URI - replacing Request-URI",
+                new_uri_str.c_str());
+      req->line.req.uri = new_uri;
+      SAS::Event event(trail, SASEvent::SIP_URI_FROM_ENUM, 0);
+      event.add_var_param(new_uri_str);
+      SAS::report_event(event);
+    }
+    else if ((new_uri_class == NP_DATA) || (new_uri_class == FINAL_NP_DATA))
+    {
+      if (should_update_np_data(uri_class, new_uri_class, new_uri_str, rn, should_override_npdi, trail))
       {
-        // We got a TEL URI of some description - update the Request-URI anyway and expect a
-        // downstream MGCF to sort it out.
-        TRC_DEBUG("Translated URI %s is not a SIP URI - replacing Request-URI anyway",
-                  new_uri_str.c_str());
         req->line.req.uri = new_uri;
-        SAS::Event event(trail, SASEvent::NON_SIP_URI_FROM_ENUM, 0);
-        event.add_var_param(new_uri_str);
-        SAS::report_event(event);
       }
     }
-  }
-  else if (uri_class == LOCAL_PHONE_NUMBER)
-  {
-    TRC_DEBUG("Not doing ENUM lookup as URI was classified as local DN");
-    SAS::Event event(trail, SASEvent::NO_ENUM_LOOKUP_LOCAL_DN, 0);
-    event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, uri));
-    SAS::report_event(event);
+    else
+    {
+      // We got a TEL URI of some description - update the Request-URI anyway and expect a
+      // downstream MGCF to sort it out.
+      TRC_DEBUG("Translated URI %s is not a SIP URI - replacing Request-URI anyway",
+                new_uri_str.c_str());
+      req->line.req.uri = new_uri;
+      SAS::Event event(trail, SASEvent::NON_SIP_URI_FROM_ENUM, 0);
+      event.add_var_param(new_uri_str);
+      SAS::report_event(event);
+    }
   }
 }
 
@@ -2649,7 +2966,7 @@ void PJUtils::update_request_uri_np_data(pjsip_msg* req,
   {
     TRC_DEBUG("Not doing ENUM lookup as URI was classified as local DN");
     SAS::Event event(trail, SASEvent::NO_ENUM_LOOKUP_LOCAL_DN, 1);
-    event.add_var_param(PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, uri));
+    PJUtils::add_uri_param(event, PJSIP_URI_IN_REQ_URI, uri);
     SAS::report_event(event);
   }
   else
@@ -2758,30 +3075,24 @@ std::set<pjmedia_type> PJUtils::get_media_types(const pjsip_msg *msg)
       (!pj_stricmp2(&msg->body->content_type.type, "application")) &&
       (!pj_stricmp2(&msg->body->content_type.subtype, "sdp")))
   {
-    // Parse the SDP, using a temporary pool.
-    pj_pool_t* tmp_pool = pj_pool_create(&stack_data.cp.factory, "Mmtel", 1024, 512, NULL);
-    pjmedia_sdp_session *sdp_sess;
-    if (pjmedia_sdp_parse(tmp_pool, (char *)msg->body->data, msg->body->len, &sdp_sess) == PJ_SUCCESS)
+    // Spin through the media types, looking for those we're interested in.
+    // Only the m= lines are needed, so scan the SDP rather than parsing it.
+    SdpScanner scanner((const char*)msg->body->data, msg->body->len);
+    SdpScanner::Media media;
+    while (scanner.next_media(media))
     {
-      // Spin through the media types, looking for those we're interested in.
-      for (unsigned int media_idx = 0; media_idx < sdp_sess->media_count; media_idx++)
+      TRC_DEBUG("Examining media type \"%.*s\"",
+                media.media.slen,
+                media.media.ptr);
+      if (pj_strcmp2(&media.media, "audio") == 0)
       {
-        TRC_DEBUG("Examining media type \"%.*s\"",
-                  sdp_sess->media[media_idx]->desc.media.slen,
-                  sdp_sess->media[media_idx]->desc.media.ptr);
-        if (pj_strcmp2(&sdp_sess->media[media_idx]->desc.media, "audio") == 0)
-        {
-          media_types.insert(PJMEDIA_TYPE_AUDIO);
-        }
-        else if (pj_strcmp2(&sdp_sess->media[media_idx]->desc.media, "video") == 0)
-        {
-          media_types.insert(PJMEDIA_TYPE_VIDEO);
-        }
+        media_types.insert(PJMEDIA_TYPE_AUDIO);
+      }
+      else if (pj_strcmp2(&media.media, "video") == 0)
+      {
+        media_types.insert(PJMEDIA_TYPE_VIDEO);
       }
     }
-
-    // Tidy up.
-    pj_pool_release(tmp_pool);
   }
 
   return media_types;
@@ -2878,9 +3189,9 @@ bool PJUtils::is_param_in_generic_array_hdr(pjsip_msg* msg, pjsip_hdr_e htype, c
 pjsip_routing_hdr* PJUtils::msg_get_last_routing_hdr_by_name(pjsip_msg* msg, const pj_str_t* name)
 {
   pjsip_routing_hdr* hdr = NULL;
-  for (pjsip_routing_hdr* h = (pjsip_routing_hdr*)pjsip_msg_find_hdr_by_name(msg, name, NULL);
+  for (pjsip_routing_hdr* h = (pjsip_routing_hdr*)PJUtils::find_hdr_by_name(msg, name, NULL);
        h != NULL;
-      h = (pjsip_routing_hdr*)pjsip_msg_find_hdr_by_name(msg, name, h->next))
+      h = (pjsip_routing_hdr*)PJUtils::find_hdr_by_name(msg, name, h->next))
   {
     hdr = h;
   }
@@ -2893,58 +3204,63 @@ SIPEventPriorityLevel PJUtils::get_priority_of_message(const pjsip_msg* msg,
 {
   SIPEventPriorityLevel priority = SIPEventPriorityLevel::NORMAL_PRIORITY;
 
-  // Pull out all the Resource-Priority headers, and all the values within the
-  // headers. For each value, get the priority of that value. The final
-  // prioritisation of the message is the priority of the highest value.
-  std::vector<pjsip_generic_array_hdr*> resource_priority_headers;
-  pjsip_generic_array_hdr* resource_priority_header =
-   (pjsip_generic_array_hdr*)pjsip_msg_find_hdr_by_name(
-     msg,
-     &STR_RESOURCE_PRIORITY,
-     NULL);
-
-  while (resource_priority_header != NULL)
-  {
-    resource_priority_headers.push_back(resource_priority_header);
-    resource_priority_header =
-     (pjsip_generic_array_hdr*)pjsip_msg_find_hdr_by_name(
-       msg,
-       &STR_RESOURCE_PRIORITY,
-       resource_priority_header->next);
-  }
-
-  std::vector<std::string> rph_values;
-  std::string chosen_rph_value;
-  for (pjsip_generic_array_hdr* hdr : resource_priority_headers)
+  // Look at all the values in all the Resource-Priority headers. For each
+  // value, get the priority of that value. The final prioritisation of the
+  // message is the priority of the highest value.  This runs on the transport
+  // thread for every message, so the values aren't copied.
+  pj_str_t chosen_rph_value = {NULL, 0};
+  for (pjsip_generic_array_hdr* hdr =
+         (pjsip_generic_array_hdr*)pjsip_msg_find_hdr_by_name(
+           msg,
+           &STR_RESOURCE_PRIORITY,
+           NULL);
+       hdr != NULL;
+       hdr = (pjsip_generic_array_hdr*)pjsip_msg_find_hdr_by_name(
+               msg,
+               &STR_RESOURCE_PRIORITY,
+               hdr->next))
   {
     for (unsigned ii = 0; ii < hdr->count; ++ii)
     {
-      std::string rph_value = pj_str_to_string(&hdr->values[ii]);
-      rph_values.push_back(rph_value);
-      SIPEventPriorityLevel temp_pri = rph_service->lookup_priority(rph_value, trail);
+      SIPEventPriorityLevel temp_pri =
+                        rph_service->lookup_priority(hdr->values[ii], trail);
 
       if (temp_pri > priority)
       {
         priority = temp_pri;
-        chosen_rph_value = rph_value;
+        chosen_rph_value = hdr->values[ii];
       }
     }
   }
 
   if (priority > 0)
   {
-    std::stringstream ss;
-    std::copy(rph_values.begin(), rph_values.end(), std::ostream_iterator<std::string>(ss, ","));
-    std::string list = ss.str();
-    if (!list.empty())
+    // The message is prioritized, so list all its values for SAS.
+    std::string list;
+    for (pjsip_generic_array_hdr* hdr =
+           (pjsip_generic_array_hdr*)pjsip_msg_find_hdr_by_name(
+             msg,
+             &STR_RESOURCE_PRIORITY,
+             NULL);
+         hdr != NULL;
+         hdr = (pjsip_generic_array_hdr*)pjsip_msg_find_hdr_by_name(
+                 msg,
+                 &STR_RESOURCE_PRIORITY,
+                 hdr->next))
     {
-      // Strip the trailing comma.
-      list = list.substr(0, list.length() - 1);
+      for (unsigned ii = 0; ii < hdr->count; ++ii)
+      {
+        if (!list.empty())
+        {
+          list.append(",");
+        }
+        list.append(hdr->values[ii].ptr, hdr->values[ii].slen);
+      }
     }
 
     SAS::Event event(trail, SASEvent::RPH_SELECTED_MESSAGE_PRIORITY, 0);
     event.add_var_param(list);
-    event.add_var_param(chosen_rph_value);
+    event.add_var_param(chosen_rph_value.slen, chosen_rph_value.ptr);
     event.add_static_param(priority);
     SAS::report_event(event);
   }
@@ -168,9 +168,10 @@ void PluginLoader::unload()
 /// Check whether the specified API version is supported.
 bool PluginLoader::api_supported(int version)
 {
-  if (version == 1)
+  if ((version == 1) || (version == 2) || (version == 3))
   {
-    // Only version 1 of the API is currently supported.
+    // Versions 2 and 3 only added methods after those in earlier versions, so
+    // Sproutlets built against any of them are supported.
     return true;
   }
   return false;
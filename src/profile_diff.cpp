@@ -0,0 +1,117 @@
+/**
+ * @file profile_diff.cpp Comparison of two versions of a subscriber's service
+ * profiles.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <functional>
+#include <iterator>
+#include <string.h>
+
+#include "log.h"
+#include "rapidxml/rapidxml_print.hpp"
+#include "xml_utils.h"
+#include "profile_diff.h"
+
+// Adds the printed form of an element to a hash.  Elements are printed
+// without indenting, so only changes to their content change the hash.
+static void hash_node(const rapidxml::xml_node<>* node, size_t& hash)
+{
+  std::string printed;
+  rapidxml::print(std::back_inserter(printed),
+                  *node,
+                  rapidxml::print_no_indenting);
+  hash ^= std::hash<std::string>()(printed) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+}
+
+bool ProfileDiff::digest(rapidxml::xml_node<>* imss, ProfileDigests& digests)
+{
+  digests.clear();
+
+  for (rapidxml::xml_node<>* sp = imss->first_node(RegDataXMLUtils::SERVICE_PROFILE);
+       sp != NULL;
+       sp = sp->next_sibling(RegDataXMLUtils::SERVICE_PROFILE))
+  {
+    // Everything in the ServiceProfile other than its PublicIdentities
+    // applies to all of them.
+    size_t services = 0;
+
+    for (rapidxml::xml_node<>* child = sp->first_node();
+         child != NULL;
+         child = child->next_sibling())
+    {
+      if (strcmp(child->name(), RegDataXMLUtils::PUBLIC_IDENTITY) != 0)
+      {
+        hash_node(child, services);
+      }
+    }
+
+    for (rapidxml::xml_node<>* public_id = sp->first_node(RegDataXMLUtils::PUBLIC_IDENTITY);
+         public_id != NULL;
+         public_id = public_id->next_sibling(RegDataXMLUtils::PUBLIC_IDENTITY))
+    {
+      rapidxml::xml_node<>* identity = public_id->first_node(RegDataXMLUtils::IDENTITY);
+
+      if (identity == NULL)
+      {
+        TRC_WARNING("Malformed PublicIdentity XML - no Identity");
+        return false;
+      }
+
+      ProfileDigest& digest = digests[identity->value()];
+      digest.identity = 0;
+      hash_node(public_id, digest.identity);
+      digest.services = services;
+      digest.service_profile = sp;
+    }
+  }
+
+  return true;
+}
+
+ProfileDiff ProfileDiff::compare(const ProfileDigests& old_digests,
+                                 const ProfileDigests& new_digests)
+{
+  ProfileDiff diff;
+  ProfileDigests::const_iterator old_it = old_digests.begin();
+  ProfileDigests::const_iterator new_it = new_digests.begin();
+
+  while ((old_it != old_digests.end()) || (new_it != new_digests.end()))
+  {
+    if ((new_it == new_digests.end()) ||
+        ((old_it != old_digests.end()) && (old_it->first < new_it->first)))
+    {
+      diff.removed.push_back(old_it->first);
+      ++old_it;
+    }
+    else if ((old_it == old_digests.end()) ||
+             (new_it->first < old_it->first))
+    {
+      diff.added.push_back(new_it->first);
+      ++new_it;
+    }
+    else
+    {
+      if (old_it->second.identity != new_it->second.identity)
+      {
+        diff.identity_changed.push_back(new_it->first);
+      }
+
+      if (old_it->second.services != new_it->second.services)
+      {
+        diff.services_changed.push_back(new_it->first);
+      }
+
+      ++old_it;
+      ++new_it;
+    }
+  }
+
+  return diff;
+}
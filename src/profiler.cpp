@@ -0,0 +1,480 @@
+/**
+ * @file profiler.cpp On-demand CPU and allocation profiling.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "profiler.h"
+
+/// The deepest stack that is recorded.
+static const int MAX_DEPTH = 32;
+
+/// The number of frames at the top of each stack that belong to the profiler
+/// itself rather than the code being profiled.
+static const int CPU_SKIP_FRAMES = 2;
+static const int ALLOC_SKIP_FRAMES = 1;
+
+/// The most CPU samples a profile records.  This is enough for a 300s profile
+/// of a few busy threads at 100Hz; any more are counted and dropped.
+static const size_t MAX_CPU_SAMPLES = 100000;
+
+typedef std::vector<void*> Stack;
+
+struct CpuSample
+{
+  pid_t tid;
+  int depth;
+  void* pcs[MAX_DEPTH];
+};
+
+/// Only one CPU profile can be taken at a time.
+static std::mutex cpu_profile_lock;
+
+/// The samples are written to a buffer that is allocated before the profile
+/// starts, since the signal handler mustn't allocate.
+static CpuSample* cpu_samples = NULL;
+static std::atomic<bool> cpu_active(false);
+static std::atomic<size_t> cpu_next_sample(0);
+static std::atomic<size_t> cpu_dropped(0);
+static std::atomic<int> cpu_in_handler(0);
+
+/// Only one allocation profile can be taken at a time.
+static std::mutex alloc_profile_lock;
+
+struct AllocTotal
+{
+  uint64_t count;
+  uint64_t bytes;
+};
+
+/// The sampled allocations, by stack.
+static std::mutex alloc_lock;
+static std::map<Stack, AllocTotal> alloc_totals;
+
+std::atomic<bool> Profiler::allocs_active(false);
+
+/// Each thread counts down the bytes it allocates to its next sample.
+/// Allocations made while a thread is recording a sample (by the sampler
+/// itself) aren't sampled.
+static thread_local bool alloc_countdown_started = false;
+static thread_local size_t alloc_bytes_until_sample = 0;
+static thread_local uint64_t alloc_random = 0;
+static thread_local bool alloc_in_sampler = false;
+
+static void* (*original_block_alloc)(pj_pool_factory*, pj_size_t) = NULL;
+
+static pid_t current_tid()
+{
+  return (pid_t)syscall(SYS_gettid);
+}
+
+static void sigprof_handler(int sig)
+{
+  // Count the handler in before checking whether a profile is being taken, so
+  // that the profile isn't collected while a sample is being written.
+  cpu_in_handler++;
+
+  if (!cpu_active)
+  {
+    cpu_in_handler--;
+    return;
+  }
+
+  int saved_errno = errno;
+  size_t index = cpu_next_sample++;
+
+  if (index < MAX_CPU_SAMPLES)
+  {
+    // backtrace isn't guaranteed to be async-signal-safe, but it is once it
+    // has been called outside a signal handler (which loads libgcc).
+    void* pcs[MAX_DEPTH + CPU_SKIP_FRAMES];
+    int depth = backtrace(pcs, MAX_DEPTH + CPU_SKIP_FRAMES) - CPU_SKIP_FRAMES;
+    CpuSample& sample = cpu_samples[index];
+    sample.tid = current_tid();
+    sample.depth = (depth > 0) ? depth : 0;
+    memcpy(sample.pcs, pcs + CPU_SKIP_FRAMES, sample.depth * sizeof(void*));
+  }
+  else
+  {
+    cpu_dropped++;
+  }
+
+  cpu_in_handler--;
+  errno = saved_errno;
+}
+
+/// Installs the SIGPROF handler, once.  It is left installed, and ignores
+/// signals while no profile is being taken.
+static void install_sigprof_handler()
+{
+  static std::once_flag installed;
+  std::call_once(installed, []()
+  {
+    void* pcs[MAX_DEPTH];
+    backtrace(pcs, MAX_DEPTH);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigprof_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+  });
+}
+
+static std::string read_maps()
+{
+  std::ifstream maps("/proc/self/maps");
+  std::stringstream ss;
+  ss << maps.rdbuf();
+  return ss.str();
+}
+
+static std::string thread_name(pid_t tid)
+{
+  std::ifstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+  std::string name;
+  std::getline(comm, name);
+  return name.empty() ? std::to_string(tid) : name;
+}
+
+/// Returns the name of the function containing a return address, or the
+/// address itself if it can't be found.
+static std::string symbolize(void* pc)
+{
+  Dl_info info;
+
+  if ((dladdr(pc, &info) != 0) && (info.dli_sname != NULL))
+  {
+    int status;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+    std::string name = (status == 0) ? demangled : info.dli_sname;
+    free(demangled);
+    return name;
+  }
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%p", pc);
+  return buf;
+}
+
+/// Writes a stack in folded form - outermost frame first, separated by semi-
+/// colons.  Semi-colons in names (which the flame graph tools can't cope with)
+/// are replaced.
+static void write_folded(std::ostringstream& out,
+                         const std::string& root,
+                         const Stack& stack,
+                         std::map<void*, std::string>& names)
+{
+  out << root;
+
+  for (Stack::const_reverse_iterator pc = stack.rbegin();
+       pc != stack.rend();
+       ++pc)
+  {
+    std::map<void*, std::string>::iterator name = names.find(*pc);
+
+    if (name == names.end())
+    {
+      std::string symbol = symbolize(*pc);
+      std::replace(symbol.begin(), symbol.end(), ';', ':');
+      name = names.insert(std::make_pair(*pc, symbol)).first;
+    }
+
+    out << ';' << name->second;
+  }
+}
+
+static void write_words(std::string& out, const uintptr_t* words, size_t num)
+{
+  out.append((const char*)words, num * sizeof(uintptr_t));
+}
+
+bool Profiler::profile_cpu(int seconds,
+                           int frequency_hz,
+                           bool folded,
+                           std::string& profile)
+{
+  std::unique_lock<std::mutex> lock(cpu_profile_lock, std::try_to_lock);
+
+  if (!lock.owns_lock())
+  {
+    return false;
+  }
+
+  install_sigprof_handler();
+
+  TRC_STATUS("Taking a %ds CPU profile at %dHz", seconds, frequency_hz);
+
+  std::vector<CpuSample> samples(MAX_CPU_SAMPLES);
+  cpu_samples = samples.data();
+  cpu_next_sample = 0;
+  cpu_dropped = 0;
+  cpu_active = true;
+
+  // ITIMER_PROF counts the CPU time used by the whole process, and the signal
+  // is delivered to whichever thread is running when it fires, so busy
+  // threads are sampled in proportion to the CPU they use.
+  int period_us = 1000000 / frequency_hz;
+  struct itimerval timer;
+  timer.it_interval.tv_sec = period_us / 1000000;
+  timer.it_interval.tv_usec = period_us % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  cpu_active = false;
+
+  while (cpu_in_handler > 0)
+  {
+    std::this_thread::yield();
+  }
+
+  size_t num_samples = std::min(cpu_next_sample.load(), MAX_CPU_SAMPLES);
+  cpu_samples = NULL;
+
+  if (cpu_dropped > 0)
+  {
+    TRC_WARNING("Dropped %lu CPU samples", cpu_dropped.load());
+  }
+
+  std::map<std::pair<pid_t, Stack>, uint64_t> counts;
+
+  for (size_t ii = 0; ii < num_samples; ++ii)
+  {
+    const CpuSample& sample = samples[ii];
+    Stack stack(sample.pcs, sample.pcs + sample.depth);
+    counts[std::make_pair(folded ? sample.tid : 0, stack)]++;
+  }
+
+  if (folded)
+  {
+    std::ostringstream out;
+    std::map<void*, std::string> names;
+    std::map<pid_t, std::string> threads;
+
+    for (const std::pair<const std::pair<pid_t, Stack>, uint64_t>& count : counts)
+    {
+      pid_t tid = count.first.first;
+
+      if (threads.find(tid) == threads.end())
+      {
+        threads[tid] = thread_name(tid);
+      }
+
+      write_folded(out, threads[tid], count.first.second, names);
+      out << ' ' << count.second << '\n';
+    }
+
+    profile = out.str();
+  }
+  else
+  {
+    // The legacy pprof CPU profile: a header, a record for each stack with
+    // its count, a trailer, and then the memory map for symbolizing.
+    profile.clear();
+    const uintptr_t header[] = {0, 3, 0, (uintptr_t)period_us, 0};
+    write_words(profile, header, 5);
+
+    for (const std::pair<const std::pair<pid_t, Stack>, uint64_t>& count : counts)
+    {
+      const Stack& stack = count.first.second;
+      const uintptr_t record[] = {(uintptr_t)count.second, stack.size()};
+      write_words(profile, record, 2);
+      write_words(profile, (const uintptr_t*)stack.data(), stack.size());
+    }
+
+    const uintptr_t trailer[] = {0, 1, 0};
+    write_words(profile, trailer, 3);
+    profile += read_maps();
+  }
+
+  TRC_STATUS("Finished CPU profile with %lu samples", num_samples);
+
+  return true;
+}
+
+/// Returns the number of bytes to allocate before the next sample.  This is
+/// exponentially distributed so that samples aren't biased towards
+/// allocations that happen at a regular interval.
+static size_t next_sample_interval()
+{
+  if (alloc_random == 0)
+  {
+    alloc_random = ((uint64_t)current_tid() << 32) ^ (uint64_t)time(NULL) ^ 1;
+  }
+
+  // xorshift64
+  alloc_random ^= alloc_random << 13;
+  alloc_random ^= alloc_random >> 7;
+  alloc_random ^= alloc_random << 17;
+
+  // A uniform value in (0, 1].
+  double uniform = ((alloc_random >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (size_t)(-log(uniform) * Profiler::SAMPLE_BYTES) + 1;
+}
+
+void Profiler::sample_allocation(size_t bytes)
+{
+  if (alloc_in_sampler)
+  {
+    return;
+  }
+
+  if (!alloc_countdown_started)
+  {
+    alloc_countdown_started = true;
+    alloc_bytes_until_sample = next_sample_interval();
+  }
+
+  if (alloc_bytes_until_sample > bytes)
+  {
+    alloc_bytes_until_sample -= bytes;
+    return;
+  }
+
+  alloc_in_sampler = true;
+  alloc_bytes_until_sample = next_sample_interval();
+
+  void* pcs[MAX_DEPTH + ALLOC_SKIP_FRAMES];
+  int depth = backtrace(pcs, MAX_DEPTH + ALLOC_SKIP_FRAMES);
+  int skip = std::min(depth, ALLOC_SKIP_FRAMES);
+  Stack stack(pcs + skip, pcs + depth);
+
+  {
+    std::unique_lock<std::mutex> lock(alloc_lock);
+    AllocTotal& total = alloc_totals[stack];
+    total.count++;
+    total.bytes += bytes;
+  }
+
+  alloc_in_sampler = false;
+}
+
+bool Profiler::profile_allocs(int seconds, bool folded, std::string& profile)
+{
+  std::unique_lock<std::mutex> lock(alloc_profile_lock, std::try_to_lock);
+
+  if (!lock.owns_lock())
+  {
+    return false;
+  }
+
+  TRC_STATUS("Taking a %ds allocation profile", seconds);
+
+  {
+    std::unique_lock<std::mutex> totals_lock(alloc_lock);
+    alloc_totals.clear();
+  }
+
+  allocs_active = true;
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  allocs_active = false;
+
+  std::map<Stack, AllocTotal> totals;
+
+  {
+    std::unique_lock<std::mutex> totals_lock(alloc_lock);
+    totals.swap(alloc_totals);
+  }
+
+  AllocTotal sum = {0, 0};
+
+  for (const std::pair<const Stack, AllocTotal>& total : totals)
+  {
+    sum.count += total.second.count;
+    sum.bytes += total.second.bytes;
+  }
+
+  std::ostringstream out;
+
+  if (folded)
+  {
+    std::map<void*, std::string> names;
+
+    for (const std::pair<const Stack, AllocTotal>& total : totals)
+    {
+      write_folded(out, "sprout", total.first, names);
+      out << ' ' << total.second.bytes << '\n';
+    }
+  }
+  else
+  {
+    // The heap_v2 profile.  Frees aren't tracked, so only the bytes allocated
+    // are reported (pprof's alloc_space), not those in use.  pprof scales the
+    // sampled figures up using the sampling interval in the header.
+    out << "heap profile: 0: 0 [" << sum.count << ": " << sum.bytes << "]"
+        << " @ heap_v2/" << SAMPLE_BYTES << '\n';
+
+    for (const std::pair<const Stack, AllocTotal>& total : totals)
+    {
+      out << "0: 0 [" << total.second.count << ": " << total.second.bytes << "] @";
+
+      for (void* pc : total.first)
+      {
+        out << ' ' << pc;
+      }
+
+      out << '\n';
+    }
+
+    out << "\nMAPPED_LIBRARIES:\n" << read_maps();
+  }
+
+  profile = out.str();
+
+  TRC_STATUS("Finished allocation profile with %lu samples", sum.count);
+
+  return true;
+}
+
+static void* profiled_block_alloc(pj_pool_factory* factory, pj_size_t size)
+{
+  Profiler::record_allocation(size);
+  return original_block_alloc(factory, size);
+}
+
+void Profiler::install_pool_hook()
+{
+  if (original_block_alloc == NULL)
+  {
+    original_block_alloc = pj_pool_factory_default_policy.block_alloc;
+    pj_pool_factory_default_policy.block_alloc = profiled_block_alloc;
+  }
+}
@@ -0,0 +1,109 @@
+/**
+ * @file profiler_new.cpp Global operator new, hooked for allocation profiling.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+// This is only built into the sprout binary (not the unit tests, which have
+// their own allocation checking).  The operators behave like the standard
+// library's, apart from telling the profiler about each allocation.
+
+#include <stdlib.h>
+#include <new>
+
+#include "profiler.h"
+
+static void* profiled_new(size_t size)
+{
+  Profiler::record_allocation(size);
+
+  if (size == 0)
+  {
+    size = 1;
+  }
+
+  void* p;
+
+  while ((p = malloc(size)) == NULL)
+  {
+    std::new_handler handler = std::get_new_handler();
+
+    if (handler == NULL)
+    {
+      throw std::bad_alloc();
+    }
+
+    handler();
+  }
+
+  return p;
+}
+
+void* operator new(size_t size)
+{
+  return profiled_new(size);
+}
+
+void* operator new[](size_t size)
+{
+  return profiled_new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return profiled_new(size);
+  }
+  catch (...)
+  {
+    return NULL;
+  }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return profiled_new(size);
+  }
+  catch (...)
+  {
+    return NULL;
+  }
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+  free(p);
+}
@@ -8,59 +8,335 @@
  * Otherwise no rights are granted except for those provided to you by
  * Metaswitch Networks in a separate written agreement.
  */
+#include <algorithm>
+
 #include "ralf_processor.h"
 #include "exception_handler.h"
+#include "log.h"
+
+// How often spooled ACRs are replayed.
+static const int REPLAY_INTERVAL_MS = 100;
+
+// How long Ralf must go without a failed request before spooled ACRs are
+// replayed.
+static const int RECOVERY_DELAY_MS = 5000;
+
+static int64_t steady_clock_ms()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 /// Constructor.
 RalfProcessor::RalfProcessor(HttpConnection* ralf_connection,
                              ExceptionHandler* exception_handler,
-                             const int ralf_threads) :
-  _thread_pool(new Pool(ralf_connection,
+                             const int ralf_threads,
+                             const int batch_size,
+                             const int batch_delay_ms,
+                             SNMP::EventAccumulatorTable* batch_size_tbl,
+                             SNMP::U32Scalar* queue_depth_scalar,
+                             AcrSpool* spool,
+                             const int max_queued,
+                             const int replay_rate,
+                             SNMP::U32Scalar* spooled_scalar) :
+  _thread_pool(new Pool(this,
+                        ralf_connection,
                         exception_handler,
                         &exception_callback,
-                        ralf_threads))
+                        ralf_threads)),
+  _batch_size((batch_size > 1) ? batch_size : 1),
+  _batch_delay_ms(batch_delay_ms),
+  _batch_size_tbl(batch_size_tbl),
+  _queue_depth_scalar(queue_depth_scalar),
+  _queue_depth(0),
+  _memory_account(MemoryAccounting::account("ralf_queue")),
+  _pending(NULL),
+  _terminated(false),
+  _spool(spool),
+  _max_queued(max_queued),
+  _replay_rate(std::max(1, replay_rate)),
+  _spooled_scalar(spooled_scalar),
+  _last_failure_ms(steady_clock_ms() - RECOVERY_DELAY_MS)
 {
   _thread_pool->start();
+
+  if (_batch_size > 1)
+  {
+    TRC_STATUS("Sending ACRs to Ralf in batches of up to %d, delayed by up to %dms",
+               (int)_batch_size,
+               _batch_delay_ms);
+    _batcher = std::thread(&RalfProcessor::batcher, this);
+  }
+
+  if (_spool != NULL)
+  {
+    TRC_STATUS("Spooling ACRs to disk when more than %d are queued, replaying up to %d/s",
+               _max_queued,
+               _replay_rate);
+    _replayer = std::thread(&RalfProcessor::replayer, this);
+  }
 }
 
 /// Destructor.
 RalfProcessor::~RalfProcessor()
 {
+  {
+    // Hand over anything still waiting, so it's sent before the pool stops.
+    std::unique_lock<std::mutex> lock(_lock);
+    _terminated = true;
+    flush_batch();
+    _cond.notify_all();
+  }
+
+  if (_batcher.joinable())
+  {
+    _batcher.join();
+  }
+
+  if (_replayer.joinable())
+  {
+    _replayer.join();
+  }
+
   if (_thread_pool != NULL)
   {
     _thread_pool->stop();
     _thread_pool->join();
     delete _thread_pool; _thread_pool = NULL;
   }
+
+  // The pool threads may have spooled ACRs, so this is deleted last.
+  delete _spool; _spool = NULL;
 }
 
 /// Adds a ralf request to the queue
 void RalfProcessor::send_request_to_ralf(RalfRequest* rr)
 {
-  _thread_pool->add_work(rr);
+  if ((_spool != NULL) &&
+      (_max_queued > 0) &&
+      (_queue_depth.load(std::memory_order_relaxed) >= _max_queued))
+  {
+    // Ralf isn't keeping up, so rather than queue more ACRs in memory, write
+    // this one to disk to be replayed later.
+    spool_request(rr);
+    return;
+  }
+
+  adjust_queue_depth(1, rr);
+
+  if (_batch_size == 1)
+  {
+    _thread_pool->add_work(new RalfBatch(1, rr));
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(_lock);
+
+  if (_pending == NULL)
+  {
+    _pending = new RalfBatch();
+    _pending->reserve(_batch_size);
+    _pending_since = std::chrono::steady_clock::now();
+
+    // Wake the batcher so it waits for this batch's deadline.
+    _cond.notify_all();
+  }
+
+  _pending->push_back(rr);
+
+  if (_pending->size() >= _batch_size)
+  {
+    flush_batch();
+  }
+}
+
+void RalfProcessor::flush_batch()
+{
+  if (_pending != NULL)
+  {
+    if (_batch_size_tbl != NULL)
+    {
+      _batch_size_tbl->accumulate(_pending->size()); // LCOV_EXCL_LINE
+    }
+
+    _thread_pool->add_work(_pending);
+    _pending = NULL;
+  }
+}
+
+void RalfProcessor::batcher()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+
+  while (!_terminated)
+  {
+    if (_pending == NULL)
+    {
+      _cond.wait(lock);
+    }
+    else
+    {
+      std::chrono::steady_clock::time_point deadline =
+        _pending_since + std::chrono::milliseconds(_batch_delay_ms);
+
+      if (std::chrono::steady_clock::now() >= deadline)
+      {
+        flush_batch();
+      }
+      else
+      {
+        _cond.wait_until(lock, deadline);
+      }
+    }
+  }
+}
+
+void RalfProcessor::adjust_queue_depth(int change, const RalfRequest* rr)
+{
+  int depth = (_queue_depth += change);
+  _memory_account->adjust(change * (int64_t)request_bytes(rr));
+
+  if (_queue_depth_scalar != NULL)
+  {
+    _queue_depth_scalar->value = depth; // LCOV_EXCL_LINE
+  }
 }
 
-// Send the ACR to Ralf
-void RalfProcessor::Pool::process_work(RalfProcessor::RalfRequest*& rr)
+size_t RalfProcessor::request_bytes(const RalfRequest* rr)
 {
-  // Send the request. Penalties are set via the load monitor if the
-  // request fails in the HttpClient
-  _ralf_connection->create_request(HttpClient::RequestType::POST, rr->path)
-  .set_sas_trail(rr->trail)
-  .set_body(rr->message)
-  .send();
+  return sizeof(RalfRequest) + rr->path.capacity() + rr->message.capacity();
+}
 
+bool RalfProcessor::spool_request(RalfRequest* rr)
+{
+  bool spooled = ((_spool != NULL) &&
+                  (_spool->append(rr->path, rr->message, rr->trail)));
   delete rr; rr = NULL;
+
+  if ((spooled) && (_spooled_scalar != NULL))
+  {
+    _spooled_scalar->value = _spool->count(); // LCOV_EXCL_LINE
+  }
+
+  return spooled;
+}
+
+void RalfProcessor::send_failed(RalfRequest* rr)
+{
+  _last_failure_ms.store(steady_clock_ms(), std::memory_order_relaxed);
+
+  if (_spool != NULL)
+  {
+    TRC_DEBUG("Failed to send ACR to Ralf - spooling it");
+    spool_request(rr);
+  }
+  else
+  {
+    delete rr; rr = NULL;
+  }
+}
+
+void RalfProcessor::replayer()
+{
+  // Spread the replay rate over each second.
+  const int replay_per_interval =
+    std::max(1, _replay_rate * REPLAY_INTERVAL_MS / 1000);
+
+  std::unique_lock<std::mutex> lock(_lock);
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+  while (!_terminated)
+  {
+    next += std::chrono::milliseconds(REPLAY_INTERVAL_MS);
+    while ((!_terminated) && (std::chrono::steady_clock::now() < next))
+    {
+      _cond.wait_until(lock, next);
+    }
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    lock.unlock();
+
+    if (steady_clock_ms() - _last_failure_ms.load(std::memory_order_relaxed) >=
+        RECOVERY_DELAY_MS)
+    {
+      int replayed = 0;
+      while ((replayed < replay_per_interval) &&
+             ((_max_queued <= 0) ||
+              (_queue_depth.load(std::memory_order_relaxed) < _max_queued)))
+      {
+        RalfRequest* rr = new RalfRequest();
+        if (!_spool->take(rr->path, rr->message, rr->trail))
+        {
+          delete rr; rr = NULL;
+          break;
+        }
+
+        adjust_queue_depth(1, rr);
+        _thread_pool->add_work(new RalfBatch(1, rr));
+        ++replayed;
+      }
+
+      if (replayed > 0)
+      {
+        TRC_DEBUG("Replayed %d spooled ACRs", replayed);
+
+        if (_spooled_scalar != NULL)
+        {
+          _spooled_scalar->value = _spool->count(); // LCOV_EXCL_LINE
+        }
+      }
+    }
+
+    lock.lock();
+  }
+}
+
+// Send the ACRs to Ralf.  The ACRs in a batch are sent back to back from
+// this thread, so they all go over this thread's connection to Ralf.
+void RalfProcessor::Pool::process_work(RalfProcessor::RalfBatch*& batch)
+{
+  for (RalfProcessor::RalfRequest* rr : *batch)
+  {
+    // Send the request. Penalties are set via the load monitor if the
+    // request fails in the HttpClient
+    HttpResponse response =
+      _ralf_connection->create_request(HttpClient::RequestType::POST, rr->path)
+      .set_sas_trail(rr->trail)
+      .set_body(rr->message)
+      .send();
+
+    // Ralf rejecting the ACR won't be fixed by sending it again, but it
+    // failing or being unreachable might be.
+    _processor->adjust_queue_depth(-1, rr);
+
+    long rc = response.get_rc();
+    if ((rc < 200) || (rc >= 500))
+    {
+      _processor->send_failed(rr);
+    }
+    else
+    {
+      delete rr; rr = NULL;
+    }
+  }
+
+  delete batch; batch = NULL;
 }
 
-RalfProcessor::Pool::Pool(HttpConnection* ralf_connection,
-                          ExceptionHandler* exception_handler, 
-                          void (*callback)(RalfProcessor::RalfRequest*),
+RalfProcessor::Pool::Pool(RalfProcessor* processor,
+                          HttpConnection* ralf_connection,
+                          ExceptionHandler* exception_handler,
+                          void (*callback)(RalfProcessor::RalfBatch*),
                           unsigned int num_threads) :
-  ThreadPool<RalfProcessor::RalfRequest*>(num_threads, 
-                                          exception_handler, 
-                                          callback, 
-                                          100),
+  ThreadPool<RalfProcessor::RalfBatch*>(num_threads,
+                                        exception_handler,
+                                        callback,
+                                        100),
+  _processor(processor),
   _ralf_connection(ralf_connection)
 {}
 
@@ -0,0 +1,225 @@
+/**
+ * @file random_token.cpp Fast generation of random tokens.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <fcntl.h>
+#include <algorithm>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "random_token.h"
+
+namespace RandomToken
+{
+  static const char BASE64_CHARS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  static const char HEX_CHARS[] = "0123456789abcdef";
+
+  static inline uint32_t rotl(uint32_t v, int c)
+  {
+    return (v << c) | (v >> (32 - c));
+  }
+
+  static inline void quarter_round(uint32_t* x, int a, int b, int c, int d)
+  {
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = rotl(x[d], 16);
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = rotl(x[b], 12);
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = rotl(x[d], 8);
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = rotl(x[b], 7);
+  }
+
+  void chacha20_block(const uint32_t key[8],
+                      uint32_t counter,
+                      const uint32_t nonce[3],
+                      uint8_t out[64])
+  {
+    uint32_t state[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                          key[0], key[1], key[2], key[3],
+                          key[4], key[5], key[6], key[7],
+                          counter, nonce[0], nonce[1], nonce[2]};
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int ii = 0; ii < 10; ++ii)
+    {
+      quarter_round(x, 0, 4, 8, 12);
+      quarter_round(x, 1, 5, 9, 13);
+      quarter_round(x, 2, 6, 10, 14);
+      quarter_round(x, 3, 7, 11, 15);
+      quarter_round(x, 0, 5, 10, 15);
+      quarter_round(x, 1, 6, 11, 12);
+      quarter_round(x, 2, 7, 8, 13);
+      quarter_round(x, 3, 4, 9, 14);
+    }
+
+    for (int ii = 0; ii < 16; ++ii)
+    {
+      uint32_t word = x[ii] + state[ii];
+      out[ii * 4] = (uint8_t)word;
+      out[ii * 4 + 1] = (uint8_t)(word >> 8);
+      out[ii * 4 + 2] = (uint8_t)(word >> 16);
+      out[ii * 4 + 3] = (uint8_t)(word >> 24);
+    }
+  }
+
+  /// A thread's generator.
+  class Generator
+  {
+  public:
+    Generator() :
+      _used(sizeof(_buffer))
+    {
+      seed();
+    }
+
+    void fill(uint8_t* buf, size_t length)
+    {
+      while (length > 0)
+      {
+        if (_used == sizeof(_buffer))
+        {
+          refill();
+        }
+
+        size_t count = std::min(length, sizeof(_buffer) - _used);
+        memcpy(buf, _buffer + _used, count);
+
+        // Don't leave used output in the buffer.
+        memset(_buffer + _used, 0, count);
+        _used += count;
+        buf += count;
+        length -= count;
+      }
+    }
+
+  private:
+    static const size_t BLOCKS = 16;
+    static const size_t KEY_BYTES = 32;
+
+    void seed()
+    {
+      bool seeded = false;
+      int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+      if (fd >= 0)
+      {
+        seeded = (read(fd, _key, sizeof(_key)) == (ssize_t)sizeof(_key));
+        close(fd);
+      }
+
+      if (!seeded)
+      {
+        // LCOV_EXCL_START - /dev/urandom is always readable in UT.
+        // Fall back to seeding from the time and the thread.  This is
+        // unpredictable enough for tokens to be unique, if not secret.
+        TRC_ERROR("Failed to read /dev/urandom to seed token generator");
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        _key[0] = (uint32_t)ts.tv_sec;
+        _key[1] = (uint32_t)ts.tv_nsec;
+        _key[2] = (uint32_t)(uintptr_t)pthread_self();
+        _key[3] = (uint32_t)getpid();
+        _key[4] = (uint32_t)((uintptr_t)this >> 32);
+        _key[5] = (uint32_t)(uintptr_t)this;
+        _key[6] = (uint32_t)clock();
+        _key[7] = 0;
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    /// Generates the next batch of output.  The first bytes of each batch
+    /// become the key for the next, and are never handed out.
+    void refill()
+    {
+      static const uint32_t NONCE[3] = {0, 0, 0};
+
+      for (size_t ii = 0; ii < BLOCKS; ++ii)
+      {
+        chacha20_block(_key, (uint32_t)ii, NONCE, _buffer + ii * 64);
+      }
+
+      memcpy(_key, _buffer, KEY_BYTES);
+      memset(_buffer, 0, KEY_BYTES);
+      _used = KEY_BYTES;
+    }
+
+    uint32_t _key[8];
+    uint8_t _buffer[BLOCKS * 64];
+    size_t _used;
+  };
+
+  static Generator& generator()
+  {
+    static thread_local Generator generator;
+    return generator;
+  }
+
+  void fill(uint8_t* buf, size_t length)
+  {
+    generator().fill(buf, length);
+  }
+
+  void create(size_t length, std::string& token)
+  {
+    uint8_t random[64];
+    token.resize(length);
+
+    for (size_t done = 0; done < length; done += sizeof(random))
+    {
+      size_t count = std::min(length - done, sizeof(random));
+      fill(random, count);
+
+      // 64 divides 256, so taking the bottom six bits of each byte picks
+      // each character with equal probability.
+      for (size_t ii = 0; ii < count; ++ii)
+      {
+        token[done + ii] = BASE64_CHARS[random[ii] & 0x3f];
+      }
+    }
+  }
+
+  void create(size_t count, size_t length, std::vector<std::string>& tokens)
+  {
+    std::vector<uint8_t> random(count * length);
+    fill(random.data(), random.size());
+    tokens.reserve(tokens.size() + count);
+
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+      std::string token(length, '\0');
+
+      for (size_t jj = 0; jj < length; ++jj)
+      {
+        token[jj] = BASE64_CHARS[random[ii * length + jj] & 0x3f];
+      }
+
+      tokens.push_back(token);
+    }
+  }
+
+  void create_hex(char* buf, size_t length)
+  {
+    uint8_t random[64];
+
+    for (size_t done = 0; done < length; done += sizeof(random))
+    {
+      size_t count = std::min(length - done, sizeof(random));
+      fill(random, count);
+
+      for (size_t ii = 0; ii < count; ++ii)
+      {
+        buf[done + ii] = HEX_CHARS[random[ii] & 0x0f];
+      }
+    }
+  }
+}
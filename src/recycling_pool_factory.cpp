@@ -0,0 +1,648 @@
+/**
+ * @file recycling_pool_factory.cpp Implementation of RecyclingPoolFactory
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <string>
+
+#include "recycling_pool_factory.h"
+#include "log.h"
+
+std::atomic<uint64_t> RecyclingPoolFactory::_next_id(1);
+
+// The calling thread's free list, and the factory it belongs to.  The factory
+// is identified by ID rather than by pointer, so a stale free list belonging
+// to a destroyed factory is never used.
+static thread_local uint64_t tl_factory_id = 0;
+static thread_local void* tl_local_cache = NULL;
+
+// The size class of the next tx_data pool the calling thread creates, or -1
+// if it isn't known, and the number of tx_data pools the thread has
+// released (to pick which to measure).
+static thread_local int tl_size_class = -1;
+static thread_local int tl_released = 0;
+
+// The names of PJSIP's methods, indexed by pjsip_method_e, in size class
+// names.
+static const char* const METHOD_NAMES[] =
+  {"invite", "cancel", "ack", "bye", "register", "options", "other"};
+
+// The names of the accounts for each owner of pools.
+static const char* const POOL_OWNER_ACCOUNTS[] =
+  {"pool_transaction", "pool_tx_data", "pool_rx_data", "pool_dialog", "pool_other", "pool_cached"};
+
+RecyclingPoolFactory::RecyclingPoolFactory(int cache_size,
+                                           int trim_interval_ms,
+                                           HugePageAllocator* block_allocator) :
+  _cache_size((cache_size > 0) ? cache_size : 0),
+  _trim_interval_ms(trim_interval_ms),
+  _block_allocator(block_allocator),
+  _id(_next_id++),
+  _pool_capacity(0),
+  _depot(),
+  _local_caches(),
+  _depot_low_water(0),
+  _num_cached(0),
+  _num_reused(0),
+  _num_allocated(0),
+  _reuse_tbl(NULL),
+  _retained_bytes_scalar(NULL),
+  _terminated(false)
+{
+  for (int ii = 0; ii < NUM_POOL_OWNERS; ++ii)
+  {
+    Factory& factory = _factories[ii];
+    pj_bzero(&factory, sizeof(factory));
+    factory.base.policy = pj_pool_factory_default_policy;
+    factory.base.policy.block_alloc = &block_alloc_cb;
+    factory.base.policy.block_free = &block_free_cb;
+    factory.base.create_pool = &create_pool_cb;
+    factory.base.release_pool = &release_pool_cb;
+    factory.base.dump_status = &dump_status_cb;
+    factory.owner = this;
+    factory.account = MemoryAccounting::account(POOL_OWNER_ACCOUNTS[ii]);
+  }
+
+  for (int ii = 0; ii < NUM_SIZE_CLASSES; ++ii)
+  {
+    std::string kind = (ii == UNCLASSIFIED) ?
+                       "unclassified_message" :
+                       std::string(METHOD_NAMES[ii % NUM_METHODS]) +
+                         ((ii < NUM_METHODS) ? "_request" : "_response");
+    std::string description = kind + "s";
+    std::replace(description.begin(), description.end(), '_', ' ');
+
+    SizeClass& size_class = _size_classes[ii];
+    size_class.increment = PJSIP_POOL_INC_TDATA;
+    for (int jj = 0; jj < NUM_SIZE_BUCKETS; ++jj)
+    {
+      size_class.sizes[jj] = 0;
+    }
+    size_class.pools = Metrics::counter("sprout_tdata_pools_" + kind,
+                                        "tx_data pools created for " + description);
+    size_class.growths = Metrics::counter("sprout_tdata_pool_growths_" + kind,
+                                          "Blocks added to tx_data pools for " +
+                                            description + " beyond their first");
+  }
+
+  // The trim thread also learns tx_data pool sizes and updates the block
+  // allocator's statistics, so is always run.
+  _trim_thread = std::thread(&RecyclingPoolFactory::trim_thread, this);
+}
+
+RecyclingPoolFactory::~RecyclingPoolFactory()
+{
+  {
+    std::unique_lock<std::mutex> lock(_depot_lock);
+    _terminated = true;
+    _trim_cond.notify_all();
+  }
+
+  if (_trim_thread.joinable())
+  {
+    _trim_thread.join();
+  }
+
+  for (pj_pool_t* pool : _depot)
+  {
+    pj_pool_destroy_int(pool);
+  }
+  _depot.clear();
+
+  for (LocalCache* cache : _local_caches)
+  {
+    for (pj_pool_t* pool : cache->pools)
+    {
+      pj_pool_destroy_int(pool);
+    }
+    delete cache;
+  }
+  _local_caches.clear();
+}
+
+void RecyclingPoolFactory::set_stats_tables(SNMP::SuccessFailCountTable* reuse_tbl,
+                                            SNMP::U32Scalar* retained_bytes_scalar)
+{
+  _reuse_tbl = reuse_tbl;
+  _retained_bytes_scalar = retained_bytes_scalar;
+}
+
+size_t RecyclingPoolFactory::retained_bytes() const
+{
+  return _num_cached.load() * _pool_capacity.load();
+}
+
+pj_pool_t* RecyclingPoolFactory::create_pool_cb(pj_pool_factory* factory,
+                                                const char* name,
+                                                pj_size_t initial_size,
+                                                pj_size_t increment_size,
+                                                pj_pool_callback* callback)
+{
+  return ((Factory*)factory)->owner->create_pool(name,
+                                                 initial_size,
+                                                 increment_size,
+                                                 callback);
+}
+
+void RecyclingPoolFactory::release_pool_cb(pj_pool_factory* factory,
+                                           pj_pool_t* pool)
+{
+  ((Factory*)factory)->owner->release_pool(pool);
+}
+
+void RecyclingPoolFactory::dump_status_cb(pj_pool_factory* factory,
+                                          pj_bool_t detail)
+{
+  RecyclingPoolFactory* owner = ((Factory*)factory)->owner;
+  TRC_STATUS("Recycling pool factory: %lu pools cached, %lu reused, %lu allocated",
+             owner->num_cached(), owner->num_reused(), owner->num_allocated());
+
+  HugePageAllocator* allocator = owner->_block_allocator;
+  if (allocator != NULL)
+  {
+    TRC_STATUS("Pool arenas: %lu bytes in %d huge pages and %d other arenas, %lu bytes free, %lu bytes in use",
+               allocator->arena_bytes(),
+               allocator->huge_page_arenas(),
+               (int)(allocator->arena_bytes() / HugePageAllocator::ARENA_SIZE) -
+                 allocator->huge_page_arenas(),
+               allocator->free_bytes(),
+               allocator->in_use_bytes());
+  }
+
+  for (int ii = 0; ii < NUM_SIZE_CLASSES; ++ii)
+  {
+    const SizeClass& size_class = owner->_size_classes[ii];
+    TRC_STATUS("tx_data pools for size class %d: %lu created, %lu grown, increment %lu",
+               ii,
+               size_class.pools->value(),
+               size_class.growths->value(),
+               size_class.increment.load());
+  }
+}
+
+void* RecyclingPoolFactory::block_alloc_cb(pj_pool_factory* factory,
+                                           pj_size_t size)
+{
+  Factory* owner_factory = (Factory*)factory;
+  HugePageAllocator* allocator = owner_factory->owner->_block_allocator;
+  void* mem;
+
+  if ((allocator != NULL) && (HugePageAllocator::handles(size)))
+  {
+    mem = allocator->alloc(size);
+  }
+  else
+  {
+    mem = pj_pool_factory_default_policy.block_alloc(factory, size);
+  }
+
+  if (mem != NULL)
+  {
+    owner_factory->account->add(size);
+  }
+
+  return mem;
+}
+
+void RecyclingPoolFactory::block_free_cb(pj_pool_factory* factory,
+                                         void* mem,
+                                         pj_size_t size)
+{
+  Factory* owner_factory = (Factory*)factory;
+  HugePageAllocator* allocator = owner_factory->owner->_block_allocator;
+  owner_factory->account->remove(size);
+
+  if ((allocator != NULL) && (HugePageAllocator::handles(size)))
+  {
+    allocator->free(mem, size);
+  }
+  else
+  {
+    pj_pool_factory_default_policy.block_free(factory, mem, size);
+  }
+}
+
+RecyclingPoolFactory::PoolOwner RecyclingPoolFactory::pool_owner(const char* name)
+{
+  // These are the names PJSIP gives the pools.
+  if (name == NULL)
+  {
+    return OTHER;
+  }
+  else if (strncmp(name, "tsx", 3) == 0)
+  {
+    return TRANSACTION;
+  }
+  else if (strncmp(name, "tdta", 4) == 0)
+  {
+    return TX_DATA;
+  }
+  else if (strncmp(name, "rtd", 3) == 0)
+  {
+    return RX_DATA;
+  }
+  else if (strncmp(name, "dlg", 3) == 0)
+  {
+    return DIALOG;
+  }
+
+  return OTHER;
+}
+
+void RecyclingPoolFactory::move_pool(pj_pool_t* pool, Factory* to)
+{
+  Factory* from = (Factory*)pool->factory;
+
+  if (from != to)
+  {
+    size_t capacity = pj_pool_get_capacity(pool);
+    from->account->remove(capacity);
+    to->account->add(capacity);
+    pool->factory = &to->base;
+  }
+}
+
+pj_pool_t* RecyclingPoolFactory::create_pool(const char* name,
+                                             pj_size_t initial_size,
+                                             pj_size_t increment_size,
+                                             pj_pool_callback* callback)
+{
+  Factory* owner_factory = &_factories[pool_owner(name)];
+
+  if ((initial_size != PJSIP_POOL_LEN_TDATA) ||
+      (increment_size != PJSIP_POOL_INC_TDATA))
+  {
+    return pj_pool_create_int(&owner_factory->base,
+                              name,
+                              initial_size,
+                              increment_size,
+                              callback);
+  }
+
+  // This is a tx_data pool.  Take the kind of message it's for from the
+  // thread's hint, and grow it by that kind's increment.
+  SizeClass* size_class =
+    &_size_classes[(tl_size_class >= 0) ? tl_size_class : UNCLASSIFIED];
+  tl_size_class = -1;
+  increment_size = size_class->increment.load(std::memory_order_relaxed);
+  size_class->pools->increment();
+
+  pj_pool_t* pool = NULL;
+
+  if (_cache_size > 0)
+  {
+    LocalCache* cache = local_cache();
+
+    if (cache->pools.empty())
+    {
+      // Restock from the depot.
+      std::unique_lock<std::mutex> lock(_depot_lock);
+      size_t count = std::min(_depot.size(), (_cache_size + 1) / 2);
+      cache->pools.insert(cache->pools.end(), _depot.end() - count, _depot.end());
+      _depot.resize(_depot.size() - count);
+      _depot_low_water = std::min(_depot_low_water, _depot.size());
+    }
+
+    if (!cache->pools.empty())
+    {
+      pool = cache->pools.back();
+      cache->pools.pop_back();
+      --_num_cached;
+      ++_num_reused;
+
+      if (callback == NULL)
+      {
+        callback = owner_factory->base.policy.callback;
+      }
+
+      pj_pool_init_int(pool, name, increment_size, callback);
+      move_pool(pool, owner_factory);
+
+      if (_reuse_tbl != NULL)
+      {
+        _reuse_tbl->increment_attempts();
+        _reuse_tbl->increment_successes();
+      }
+    }
+    else
+    {
+      ++_num_allocated;
+
+      if (_reuse_tbl != NULL)
+      {
+        _reuse_tbl->increment_attempts();
+        _reuse_tbl->increment_failures();
+      }
+    }
+  }
+
+  if (pool == NULL)
+  {
+    pool = pj_pool_create_int(&owner_factory->base,
+                              name,
+                              initial_size,
+                              increment_size,
+                              callback);
+
+    if (pool != NULL)
+    {
+      // Record the capacity of a fresh pool, so that released pools whose
+      // first block is this size can be recognised.
+      size_t zero = 0;
+      _pool_capacity.compare_exchange_strong(zero, pj_pool_get_capacity(pool));
+    }
+  }
+
+  if (pool != NULL)
+  {
+    pool->factory_data = size_class;
+  }
+
+  return pool;
+}
+
+void RecyclingPoolFactory::release_pool(pj_pool_t* pool)
+{
+  SizeClass* size_class = (SizeClass*)pool->factory_data;
+
+  if (size_class == NULL)
+  {
+    // Not a tx_data pool.
+    destroy_pool(pool);
+    return;
+  }
+
+  record_size(size_class, pool);
+  pool->factory_data = NULL;
+
+  if (_cache_size == 0)
+  {
+    destroy_pool(pool);
+    return;
+  }
+
+  // Free all but the first block, and check that what's left is the size of
+  // a new tx_data pool.
+  pj_pool_reset(pool);
+
+  if (pj_pool_get_capacity(pool) != _pool_capacity)
+  {
+    destroy_pool(pool);
+    return;
+  }
+
+  move_pool(pool, &_factories[CACHED]);
+
+  LocalCache* cache = local_cache();
+  cache->pools.push_back(pool);
+  ++_num_cached;
+
+  if (cache->pools.size() > _cache_size)
+  {
+    // This thread releases more pools than it creates, so pass half of them
+    // to the depot for other threads.  If even the depot is full, free them.
+    size_t count = cache->pools.size() / 2;
+
+    {
+      std::unique_lock<std::mutex> lock(_depot_lock);
+      size_t max_depot = _cache_size * MAX_DEPOT_CACHES;
+      size_t to_depot = std::min(count, max_depot - std::min(max_depot, _depot.size()));
+      _depot.insert(_depot.end(), cache->pools.end() - to_depot, cache->pools.end());
+      cache->pools.resize(cache->pools.size() - to_depot);
+      count -= to_depot;
+    }
+
+    for (; count > 0; --count)
+    {
+      destroy_pool(cache->pools.back());
+      cache->pools.pop_back();
+      --_num_cached;
+    }
+  }
+}
+
+RecyclingPoolFactory::SizeHint::SizeHint(const pjsip_msg* msg, bool response)
+{
+  tl_size_class = size_class(msg, response);
+}
+
+RecyclingPoolFactory::SizeHint::~SizeHint()
+{
+  tl_size_class = -1;
+}
+
+int RecyclingPoolFactory::size_class(const pjsip_msg* msg, bool response)
+{
+  int method = PJSIP_OTHER_METHOD;
+
+  if (msg != NULL)
+  {
+    if (msg->type == PJSIP_REQUEST_MSG)
+    {
+      method = msg->line.req.method.id;
+    }
+    else
+    {
+      pjsip_cseq_hdr* cseq =
+        (pjsip_cseq_hdr*)pjsip_msg_find_hdr((pjsip_msg*)msg, PJSIP_H_CSEQ, NULL);
+
+      if (cseq != NULL)
+      {
+        method = cseq->method.id;
+      }
+    }
+  }
+
+  method = std::min(std::max(method, 0), (int)PJSIP_OTHER_METHOD);
+  return (response ? NUM_METHODS : 0) + method;
+}
+
+size_t RecyclingPoolFactory::tdata_increment(const pjsip_msg* msg,
+                                             bool response) const
+{
+  return _size_classes[size_class(msg, response)].increment.load();
+}
+
+void RecyclingPoolFactory::record_size(SizeClass* size_class, pj_pool_t* pool)
+{
+  int blocks = 0;
+
+  for (pj_pool_block* block = pool->block_list.next;
+       block != &pool->block_list;
+       block = block->next)
+  {
+    ++blocks;
+  }
+
+  if (blocks > 1)
+  {
+    size_class->growths->increment(blocks - 1);
+  }
+
+  if (++tl_released % SIZE_SAMPLE_INTERVAL == 0)
+  {
+    size_t bucket = std::min(pj_pool_get_used_size(pool) / SIZE_BUCKET_BYTES,
+                             (size_t)(NUM_SIZE_BUCKETS - 1));
+    size_class->sizes[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void RecyclingPoolFactory::learn_increment(SizeClass* size_class)
+{
+  uint32_t counts[NUM_SIZE_BUCKETS];
+  uint32_t total = 0;
+
+  for (int ii = 0; ii < NUM_SIZE_BUCKETS; ++ii)
+  {
+    counts[ii] = size_class->sizes[ii].load(std::memory_order_relaxed);
+    total += counts[ii];
+  }
+
+  size_t capacity = _pool_capacity.load();
+
+  if ((total >= MIN_SIZE_SAMPLES) && (capacity > 0))
+  {
+    // Find the bucket holding the percentile, and grow pools by enough to
+    // hold messages up to the top of it in one step.
+    uint32_t target = (total * SIZE_PERCENTILE + 99) / 100;
+    uint32_t seen = 0;
+    int bucket = 0;
+
+    for (; bucket < NUM_SIZE_BUCKETS - 1; ++bucket)
+    {
+      seen += counts[bucket];
+
+      if (seen >= target)
+      {
+        break;
+      }
+    }
+
+    size_t bytes = (bucket + 1) * SIZE_BUCKET_BYTES;
+    size_t increment = PJSIP_POOL_INC_TDATA;
+
+    if (bytes > capacity)
+    {
+      size_t shortfall = bytes - capacity;
+      shortfall = ((shortfall + SIZE_BUCKET_BYTES - 1) / SIZE_BUCKET_BYTES) *
+                  SIZE_BUCKET_BYTES;
+      increment = std::max(increment, shortfall);
+    }
+
+    if (increment != size_class->increment.load())
+    {
+      TRC_DEBUG("tx_data pools for size class %d now grow by %lu bytes",
+                (int)(size_class - _size_classes),
+                increment);
+      size_class->increment = increment;
+    }
+  }
+
+  // Halve the samples, so that the sizes follow changes in traffic.
+  for (int ii = 0; ii < NUM_SIZE_BUCKETS; ++ii)
+  {
+    size_class->sizes[ii].fetch_sub(counts[ii] - (counts[ii] / 2),
+                                    std::memory_order_relaxed);
+  }
+}
+
+RecyclingPoolFactory::LocalCache* RecyclingPoolFactory::local_cache()
+{
+  if (tl_factory_id != _id)
+  {
+    LocalCache* cache = new LocalCache();
+    cache->pools.reserve(_cache_size + 1);
+
+    {
+      std::unique_lock<std::mutex> lock(_depot_lock);
+      _local_caches.push_back(cache);
+    }
+
+    tl_factory_id = _id;
+    tl_local_cache = cache;
+  }
+
+  return (LocalCache*)tl_local_cache;
+}
+
+void RecyclingPoolFactory::destroy_pool(pj_pool_t* pool)
+{
+  pj_pool_destroy_int(pool);
+}
+
+void RecyclingPoolFactory::trim()
+{
+  std::vector<pj_pool_t*> unused;
+
+  {
+    std::unique_lock<std::mutex> lock(_depot_lock);
+    size_t count = std::min(_depot_low_water, _depot.size());
+    unused.assign(_depot.begin(), _depot.begin() + count);
+    _depot.erase(_depot.begin(), _depot.begin() + count);
+    _depot_low_water = _depot.size();
+  }
+
+  if (!unused.empty())
+  {
+    TRC_DEBUG("Freeing %lu unused tx_data pools", unused.size());
+  }
+
+  for (pj_pool_t* pool : unused)
+  {
+    destroy_pool(pool);
+    --_num_cached;
+  }
+
+  if (_retained_bytes_scalar != NULL)
+  {
+    _retained_bytes_scalar->value = retained_bytes();
+  }
+
+  if (_block_allocator != NULL)
+  {
+    _block_allocator->update_stats();
+  }
+
+  for (int ii = 0; ii < NUM_SIZE_CLASSES; ++ii)
+  {
+    learn_increment(&_size_classes[ii]);
+  }
+}
+
+void RecyclingPoolFactory::trim_thread()
+{
+  // Register the thread with PJLIB, as freeing pools may log.
+  pj_thread_desc desc;
+  pj_bzero(desc, sizeof(desc));
+  pj_thread_t* pj_thread = NULL;
+
+  if (pj_thread_register("SproutPoolTrim", desc, &pj_thread) != PJ_SUCCESS)
+  {
+    TRC_ERROR("Failed to register pool trim thread with pjsip");
+  }
+
+  std::unique_lock<std::mutex> lock(_depot_lock);
+
+  while (!_terminated)
+  {
+    std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(_trim_interval_ms);
+    _trim_cond.wait_until(lock, deadline, [this]() { return _terminated; });
+
+    if (!_terminated)
+    {
+      lock.unlock();
+      trim();
+      lock.lock();
+    }
+  }
+}
@@ -0,0 +1,80 @@
+/**
+ * @file register_admission.cpp Implementation of RegisterAdmission.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+#include "register_admission.h"
+#include "log.h"
+
+RegisterAdmission::RegisterAdmission(int initial_register_rate,
+                                     int max_retry_after) :
+  _rate(initial_register_rate),
+  _max_retry_after(std::max(1, max_retry_after)),
+  _tokens((long)initial_register_rate * 1000),
+  _last_refill_ms(now_ms()),
+  _in_storm(false),
+  _last_rejected_ms(0)
+{
+}
+
+bool RegisterAdmission::admit_initial_register()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  unsigned long now = now_ms();
+
+  // Top up the bucket for the time since we last looked, up to a second's
+  // worth of registrations.
+  _tokens = std::min((long)_rate * 1000,
+                     _tokens + (long)(now - _last_refill_ms) * _rate);
+  _last_refill_ms = now;
+
+  if (_tokens >= 1000)
+  {
+    _tokens -= 1000;
+
+    if ((_in_storm) && (now - _last_rejected_ms >= STORM_HOLD_MS))
+    {
+      TRC_STATUS("Registration storm over - admitting all initial registrations");
+      _in_storm = false;
+    }
+
+    return true;
+  }
+
+  if (!_in_storm)
+  {
+    TRC_WARNING("Registration storm - limiting initial registrations to %d per second",
+                _rate);
+    _in_storm = true;
+  }
+
+  _last_rejected_ms = now;
+  return false;
+}
+
+int RegisterAdmission::retry_after()
+{
+  static thread_local unsigned int seed = (unsigned int)time(NULL) ^
+                                          (unsigned int)pthread_self();
+  int min_retry_after = (_max_retry_after + 1) / 2;
+  return min_retry_after +
+         (int)(rand_r(&seed) % (_max_retry_after - min_retry_after + 1));
+}
+
+unsigned long RegisterAdmission::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -42,6 +42,7 @@ extern "C" {
 #include "scscf_utils.h"
 #include "aor_utils.h"
 #include "subscriber_data_utils.h"
+#include "registration_prefetch.h"
 
 // RegistrarSproutlet constructor.
 RegistrarSproutlet::RegistrarSproutlet(const std::string& name,
@@ -53,19 +54,30 @@ RegistrarSproutlet::RegistrarSproutlet(const std::string& name,
                                        SubscriberManager* sm,
                                        ACRFactory* rfacr_factory,
                                        int cfg_max_expires,
-                                       SNMP::RegistrationStatsTables* reg_stats_tbls) :
+                                       SNMP::RegistrationStatsTables* reg_stats_tbls,
+                                       int initial_register_rate,
+                                       int register_retry_after) :
   Sproutlet(name, port, uri, "", aliases, NULL, NULL, network_function),
   _sm(sm),
   _acr_factory(rfacr_factory),
   _max_expires(cfg_max_expires),
   _reg_stats_tbls(reg_stats_tbls),
+  _register_admission(NULL),
   _next_hop_service(next_hop_service)
 {
+  if (initial_register_rate > 0)
+  {
+    TRC_STATUS("Admitting up to %d initial registrations per second",
+               initial_register_rate);
+    _register_admission = new RegisterAdmission(initial_register_rate,
+                                                register_retry_after);
+  }
 }
 
 //RegistrarSproutlet destructor.
 RegistrarSproutlet::~RegistrarSproutlet()
 {
+  delete _register_admission; _register_admission = NULL;
 }
 
 bool RegistrarSproutlet::init()
@@ -416,6 +428,42 @@ void RegistrarSproutletTsx::process_register_request(pjsip_msg *req)
                                       binding_ids_to_remove);
   track_register_attempts_statistics(rt);
 
+  // If there's a registration storm, only admit as many initial registrations
+  // as we've been configured to.  The rest are asked to retry later, so that
+  // re-registrations of existing subscribers aren't held up behind them.
+  if ((rt == RegisterType::INITIAL) &&
+      (_registrar->_register_admission != NULL) &&
+      (!_registrar->_register_admission->admit_initial_register()))
+  {
+    int retry_after = _registrar->_register_admission->retry_after();
+    TRC_DEBUG("Rejecting initial register for %s - retry after %ds",
+              default_impu.c_str(), retry_after);
+
+    SAS::Event event(trail(), SASEvent::REGISTER_STORM_REJECTED, 0);
+    event.add_var_param(default_impu);
+    event.add_static_param(retry_after);
+    SAS::report_event(event);
+
+    track_register_failures_statistics(rt);
+
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_SERVICE_UNAVAILABLE);
+    pjsip_retry_after_hdr* retry_after_hdr =
+                         pjsip_retry_after_hdr_create(get_pool(rsp), retry_after);
+    pjsip_msg_add_hdr(rsp, (pjsip_hdr*)retry_after_hdr);
+
+    acr->tx_response(rsp);
+    acr->send();
+    delete acr;
+
+    send_response(rsp);
+
+    SubscriberDataUtils::delete_bindings(current_bindings);
+    SubscriberDataUtils::delete_bindings(update_bindings);
+    free_msg(req);
+
+    return;
+  }
+
   // 5. We know what changes we want to make - contact the SM to do so.
   Bindings all_bindings;
 
@@ -512,6 +560,25 @@ void RegistrarSproutletTsx::process_register_request(pjsip_msg *req)
 
     // Add a PCFA header.
     PJUtils::add_pcfa_header(rsp, get_pool(rsp), irs_info._ccfs, irs_info._ecfs, true);
+
+    // If the subscriber is still registered, have the services that cache
+    // subscriber data fetch it now, so the first call doesn't wait for it.
+    if ((RegistrationPrefetch::enabled()) &&
+        (!all_bindings.empty()) &&
+        (rt != RegisterType::FETCH))
+    {
+      std::vector<std::string> impus;
+
+      for (const std::string& uri : irs_info._associated_uris.get_unbarred_uris())
+      {
+        if (!WildcardUtils::is_wildcard_uri(uri))
+        {
+          impus.push_back(uri);
+        }
+      }
+
+      RegistrationPrefetch::registered(impus, trail());
+    }
   }
 
   // Send the register request/response to the register sender, in case there's
@@ -775,7 +842,7 @@ void RegistrarSproutletTsx::get_bindings_from_req(
         // We store the full path header in the _path_headers field.
         binding->_path_headers.clear();
         pjsip_routing_hdr* path_hdr = (pjsip_routing_hdr*)
-                            pjsip_msg_find_hdr_by_name(req, &STR_PATH, NULL);
+                            PJUtils::find_hdr_by_name(req, &STR_PATH, NULL);
 
         while (path_hdr)
         {
@@ -787,7 +854,7 @@ void RegistrarSproutletTsx::get_bindings_from_req(
 
           // Look for the next header.
           path_hdr = (pjsip_routing_hdr*)
-                  pjsip_msg_find_hdr_by_name(req, &STR_PATH, path_hdr->next);
+                  PJUtils::find_hdr_by_name(req, &STR_PATH, path_hdr->next);
         }
 
         binding->_cid = cid;
@@ -1004,50 +1071,54 @@ void RegistrarSproutletTsx::add_contact_headers(pjsip_msg* rsp,
                                                 const std::string& public_id,
                                                 SAS::TrailId trail)
 {
+  pj_pool_t* pool = get_pool(rsp);
+
+  // GRUUs are only added if the UE supports them.
+  bool supports_gruu = PJUtils::msg_supports_extension(req, "gruu");
+
   // Add contact headers for all active bindings.
-  for (BindingPair b : all_bindings)
+  for (const BindingPair& b : all_bindings)
   {
     Binding* binding = b.second;
 
     // Parse the Contact URI from the store, making sure it is formatted as a
     // name-address.
     pjsip_uri* uri = PJUtils::uri_from_string(binding->_uri,
-                                              get_pool(rsp),
+                                              pool,
                                               PJ_TRUE);
 
     if (uri != NULL)
     {
       // Contact URI is well formed, so include this in the response.
-      pjsip_contact_hdr* contact = pjsip_contact_hdr_create(get_pool(rsp));
+      pjsip_contact_hdr* contact = pjsip_contact_hdr_create(pool);
       contact->star = 0;
       contact->uri = uri;
       contact->q1000 = binding->_priority;
       contact->expires = binding->_expires - now;
       pj_list_init(&contact->other_param);
 
-      for (std::pair<std::string, std::string> param : binding->_params)
+      for (const std::pair<const std::string, std::string>& param : binding->_params)
       {
-        pjsip_param *new_param = PJ_POOL_ALLOC_T(get_pool(rsp), pjsip_param);
-        pj_strdup2(get_pool(rsp), &new_param->name, param.first.c_str());
-        pj_strdup2(get_pool(rsp), &new_param->value, param.second.c_str());
+        pjsip_param *new_param = PJ_POOL_ALLOC_T(pool, pjsip_param);
+        pj_strdup2(pool, &new_param->name, param.first.c_str());
+        pj_strdup2(pool, &new_param->value, param.second.c_str());
         pj_list_insert_before(&contact->other_param, new_param);
       }
 
       // Add a GRUU if the UE supports GRUUs and the contact header contains
       // a +sip.instance parameter.
-      if (PJUtils::msg_supports_extension(req, "gruu"))
+      if (supports_gruu)
       {
         // The pub-gruu parameter on the Contact header is calculated
         // from the instance-id, to avoid unnecessary storage in
         // memcached.
-        std::string gruu = AoRUtils::pub_gruu_quoted_string(binding,
-                                                            get_pool(rsp));
+        pj_str_t gruu;
 
-        if (!gruu.empty())
+        if (AoRUtils::pub_gruu_quoted_pj_str(binding, pool, gruu))
         {
-          pjsip_param *new_param = PJ_POOL_ALLOC_T(get_pool(rsp), pjsip_param);
-          pj_strdup2(get_pool(rsp), &new_param->name, "pub-gruu");
-          pj_strdup2(get_pool(rsp), &new_param->value, gruu.c_str());
+          pjsip_param *new_param = PJ_POOL_ALLOC_T(pool, pjsip_param);
+          new_param->name = pj_str((char*)"pub-gruu");
+          new_param->value = gruu;
           pj_list_insert_before(&contact->other_param, new_param);
         }
       }
@@ -1124,25 +1195,26 @@ void RegistrarSproutletTsx::handle_path_headers(
   // from the request as they may not exist in the bindings anymore if the
   // bindings have expired.
   pjsip_routing_hdr* path_hdr =
-           (pjsip_routing_hdr*)pjsip_msg_find_hdr_by_name(req, &STR_PATH, NULL);
+           (pjsip_routing_hdr*)PJUtils::find_hdr_by_name(req, &STR_PATH, NULL);
 
   while (path_hdr)
   {
     pjsip_msg_add_hdr(rsp,
                       (pjsip_hdr*)pjsip_hdr_clone(get_pool(rsp), path_hdr));
     path_hdr = (pjsip_routing_hdr*)
-                    pjsip_msg_find_hdr_by_name(req, &STR_PATH, path_hdr->next);
+                    PJUtils::find_hdr_by_name(req, &STR_PATH, path_hdr->next);
   }
 }
 
 void RegistrarSproutletTsx::add_service_route_header(pjsip_msg* rsp,
                                                      pjsip_msg* req)
 {
-  // Add the Service-Route header. We may modify this so need to do a full clone
-  // of the header. Annoyingly this overwrites the custom name we set during
-  // module initialization, so reset it.
+  // Add the Service-Route header.  This is a shallow clone of the header
+  // built at start of day, so shares its URI unless we need to modify it
+  // below - anything else that modifies the URI must clone it first.  Set the
+  // custom name in case the clone doesn't preserve it.
   pjsip_routing_hdr* sr_hdr = (pjsip_routing_hdr*)
-    pjsip_hdr_clone(get_pool(rsp), _registrar->_service_route);
+    pjsip_hdr_shallow_clone(get_pool(rsp), _registrar->_service_route);
   sr_hdr->name = STR_SERVICE_ROUTE;
   sr_hdr->sname = pj_str((char*)"");
 
@@ -1152,13 +1224,22 @@ void RegistrarSproutletTsx::add_service_route_header(pjsip_msg* rsp,
   pjsip_sip_uri* routing_uri = get_routing_uri(req);
 
   // If the URI that routed to this Sproutlet isn't reflexive, just ignore it
-  // and use the configured scscf uri
+  // and use the configured scscf uri.  Likewise if it has the same local
+  // hostname as the configured URI, as then the URI is unchanged.
   if ((routing_uri != nullptr) && is_uri_reflexive((pjsip_uri*)routing_uri))
   {
-    SCSCFUtils::get_scscf_uri(get_pool(rsp),
-                              get_local_hostname(routing_uri),
-                              get_local_hostname(sr_uri),
-                              sr_uri);
+    std::string received_local_hostname = get_local_hostname(routing_uri);
+    std::string sr_local_hostname = get_local_hostname(sr_uri);
+
+    if (received_local_hostname != sr_local_hostname)
+    {
+      sr_uri = (pjsip_sip_uri*)pjsip_uri_clone(get_pool(rsp), sr_uri);
+      SCSCFUtils::get_scscf_uri(get_pool(rsp),
+                                received_local_hostname,
+                                sr_local_hostname,
+                                sr_uri);
+      sr_hdr->name_addr.uri = (pjsip_uri*)sr_uri;
+    }
   }
 
   pjsip_msg_insert_first_hdr(rsp, (pjsip_hdr*)sr_hdr);
@@ -1202,7 +1283,7 @@ void RegistrarSproutletTsx::add_p_associated_uri_headers(
 
   if (!unbarred_uris.empty())
   {
-    for (std::string uri : unbarred_uris)
+    for (const std::string& uri : unbarred_uris)
     {
       if (!WildcardUtils::is_wildcard_uri(uri))
       {
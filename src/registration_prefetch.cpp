@@ -0,0 +1,186 @@
+/**
+ * @file registration_prefetch.cpp Prefetching subscriber data when
+ * subscribers register.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include "log.h"
+#include "threadpool.h"
+#include "registration_prefetch.h"
+
+namespace RegistrationPrefetch
+{
+  /// A registration to prefetch data for.
+  struct Registration
+  {
+    std::vector<std::string> impus;
+    SAS::TrailId trail;
+  };
+
+  static void prefetch(Registration* registration);
+  static void dequeued();
+
+  /// The pool of prefetch threads.
+  class Pool : public ThreadPool<Registration*>
+  {
+  public:
+    Pool(ExceptionHandler* exception_handler, unsigned int num_threads) :
+      ThreadPool<Registration*>(num_threads,
+                                exception_handler,
+                                &exception_callback,
+                                0)
+    {
+    }
+
+    virtual ~Pool() {}
+
+    static void exception_callback(Registration* registration)
+    {
+      // LCOV_EXCL_START - Only hit if a handler crashes.
+      delete registration;
+      // LCOV_EXCL_STOP
+    }
+
+  private:
+    virtual void process_work(Registration*& registration)
+    {
+      dequeued();
+      prefetch(registration);
+      delete registration; registration = NULL;
+    }
+  };
+
+  struct Registry
+  {
+    Registry() :
+      pool(NULL),
+      max_queued(0),
+      queued(0),
+      next_id(0)
+    {
+    }
+
+    Pool* pool;
+    int max_queued;
+    std::atomic<int> queued;
+
+    std::mutex lock;
+    std::map<int, Handler> handlers;
+    int next_id;
+  };
+
+  static Registry& registry()
+  {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  static void dequeued()
+  {
+    registry().queued--;
+  }
+
+  static void prefetch(Registration* registration)
+  {
+    std::vector<Handler> handlers;
+    {
+      Registry& prefetch = registry();
+      std::lock_guard<std::mutex> guard(prefetch.lock);
+
+      for (const std::pair<const int, Handler>& handler : prefetch.handlers)
+      {
+        handlers.push_back(handler.second);
+      }
+    }
+
+    for (const std::string& impu : registration->impus)
+    {
+      TRC_DEBUG("Prefetching data for registered IMPU %s", impu.c_str());
+
+      for (const Handler& handler : handlers)
+      {
+        handler(impu, registration->trail);
+      }
+    }
+  }
+
+  void start(ExceptionHandler* exception_handler,
+             int num_threads,
+             int max_queued)
+  {
+    Registry& prefetch = registry();
+
+    if ((num_threads > 0) && (prefetch.pool == NULL))
+    {
+      TRC_STATUS("Starting %d registration prefetch threads", num_threads);
+      prefetch.max_queued = max_queued;
+      prefetch.pool = new Pool(exception_handler, num_threads);
+      prefetch.pool->start();
+    }
+  }
+
+  void stop()
+  {
+    Registry& prefetch = registry();
+
+    if (prefetch.pool != NULL)
+    {
+      prefetch.pool->stop();
+      prefetch.pool->join();
+      delete prefetch.pool; prefetch.pool = NULL;
+    }
+  }
+
+  int add_handler(Handler handler)
+  {
+    Registry& prefetch = registry();
+    std::lock_guard<std::mutex> guard(prefetch.lock);
+    int id = prefetch.next_id++;
+    prefetch.handlers[id] = handler;
+    return id;
+  }
+
+  void remove_handler(int id)
+  {
+    Registry& prefetch = registry();
+    std::lock_guard<std::mutex> guard(prefetch.lock);
+    prefetch.handlers.erase(id);
+  }
+
+  bool enabled()
+  {
+    return (registry().pool != NULL);
+  }
+
+  void registered(const std::vector<std::string>& impus, SAS::TrailId trail)
+  {
+    Registry& prefetch = registry();
+
+    if ((prefetch.pool == NULL) || (impus.empty()))
+    {
+      return;
+    }
+
+    if (prefetch.queued.fetch_add(1) >= prefetch.max_queued)
+    {
+      // The prefetch threads are behind, so leave this subscriber's data to
+      // be fetched when it is needed.
+      prefetch.queued--;
+      TRC_DEBUG("Registration prefetch queue is full, not prefetching for %s",
+                impus[0].c_str());
+      return;
+    }
+
+    prefetch.pool->add_work(new Registration{impus, trail});
+  }
+}
@@ -9,6 +9,8 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <chrono>
+
 #include "constants.h"
 #include "sproutsasevent.h"
 #include "subscriber_data_utils.h"
@@ -17,19 +19,58 @@
 
 #define MAX_SIP_MSG_SIZE 65535
 
+const int RegistrationSender::PACING_INTERVAL_MS;
+
+// Print a message for inclusion in the body of 3rd party registers.
+static std::string print_msg(pjsip_msg* msg)
+{
+  char buf[MAX_SIP_MSG_SIZE];
+  pj_ssize_t size = pjsip_msg_print(msg, buf, sizeof(buf));
+  return std::string(buf, std::max(0L, size));
+}
+
 RegistrationSender::RegistrationSender(IFCConfiguration ifc_configuration,
                                        FIFCService* fifc_service,
                                        SNMP::RegistrationStatsTables* third_party_reg_stats_tbls,
-                                       bool force_third_party_register_body) :
+                                       bool force_third_party_register_body,
+                                       int third_party_register_rate,
+                                       int third_party_refresh_percent) :
   _ifc_configuration(ifc_configuration),
   _fifc_service(fifc_service),
   _third_party_reg_stats_tbls(third_party_reg_stats_tbls),
-  _force_third_party_register_body(force_third_party_register_body)
+  _force_third_party_register_body(force_third_party_register_body),
+  _third_party_register_rate(third_party_register_rate),
+  _terminated(false),
+  _third_party_refresh_percent(third_party_refresh_percent)
 {
+  if (_third_party_register_rate > 0)
+  {
+    TRC_STATUS("Sending up to %d third-party REGISTERs per second",
+               _third_party_register_rate);
+    _pacer = std::thread(&RegistrationSender::pacer, this);
+  }
 }
 
 RegistrationSender::~RegistrationSender()
 {
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _terminated = true;
+    _cond.notify_all();
+  }
+
+  if (_pacer.joinable())
+  {
+    _pacer.join();
+  }
+
+  // Throw away anything that the pacer didn't get round to sending.
+  for (std::pair<pjsip_tx_data*, ThirdPartyRegData*>& queued : _queue)
+  {
+    pjsip_tx_data_dec_ref(queued.first);
+    delete queued.second;
+  }
+  _queue.clear();
 }
 
 void RegistrationSender::register_dereg_event_consumer(DeregistrationEventConsumer* dereg_event_consumer)
@@ -70,9 +111,49 @@ void RegistrationSender::register_with_application_servers(pjsip_msg* received_r
                             matched_dummy_as,
                             trail);
 
+  // Print the received REGISTER and its response once for all the
+  // application servers, rather than once for each one that wants them in
+  // the body of its register.
+  std::string received_register_str;
+  std::string ok_response_str;
+
+  if (received_register_message && ok_response_msg)
+  {
+    bool include_request = _force_third_party_register_body;
+    bool include_response = _force_third_party_register_body;
+
+    for (const AsInvocation& as : as_list)
+    {
+      include_request = include_request || as.include_register_request;
+      include_response = include_response || as.include_register_response;
+    }
+
+    if (include_request)
+    {
+      received_register_str = print_msg(received_register_message);
+    }
+
+    if (include_response)
+    {
+      ok_response_str = print_msg(ok_response_msg);
+    }
+  }
+
   // Loop through the application servers and send the registers.
-  for (AsInvocation as : as_list)
+  for (const AsInvocation& as : as_list)
   {
+    if (suppress_refresh(served_user, as, expires, is_initial_registration))
+    {
+      TRC_DEBUG("Not re-registering %s with %s as its registration there is still current",
+                served_user.c_str(),
+                as.server_name.c_str());
+      SAS::Event event(trail, SASEvent::AS_REGISTER_SUPPRESSED, 0);
+      event.add_var_param(served_user);
+      event.add_var_param(as.server_name);
+      SAS::report_event(event);
+      continue;
+    }
+
     if (_third_party_reg_stats_tbls != NULL)
     {
       if (expires == 0)
@@ -91,6 +172,8 @@ void RegistrationSender::register_with_application_servers(pjsip_msg* received_r
 
     send_register_to_as(received_register_message,
                         ok_response_msg,
+                        received_register_str,
+                        ok_response_str,
                         served_user,
                         as,
                         expires,
@@ -193,19 +276,25 @@ void RegistrationSender::match_application_servers(pjsip_msg* received_register_
 {
   matched_dummy_as = false;
 
+  // The standard and fallback iFCs are all evaluated against the same
+  // REGISTER, so share the results of matching their SPTs.
+  Ifc::MatchCache cache;
+
   // Go through the list of iFCs and find which application servers should be
   // invoked for this request. Save off any application servers that don't
   // match a dummy AS.
-  for (Ifc ifc : ifcs.ifcs_list())
+  for (const Ifc& ifc : ifcs.ifcs_list())
   {
     if (ifc.filter_matches(SessionCase::Originating,
                            true,
                            is_initial_registration,
                            received_register_msg,
-                           trail))
+                           trail,
+                           &cache))
     {
-      if ((ifc.as_invocation().server_name) ==
-          (_ifc_configuration._dummy_as))
+      AsInvocation as_invocation = ifc.as_invocation();
+
+      if (as_invocation.server_name == _ifc_configuration._dummy_as)
       {
         TRC_DEBUG("Ignoring this iFC as it matches a dummy AS (%s)",
                   _ifc_configuration._dummy_as.c_str());
@@ -216,7 +305,7 @@ void RegistrationSender::match_application_servers(pjsip_msg* received_register_
       }
       else
       {
-        application_servers.push_back(ifc.as_invocation());
+        application_servers.push_back(as_invocation);
       }
     }
   }
@@ -235,15 +324,18 @@ void RegistrationSender::match_application_servers(pjsip_msg* received_register_
     // Go though the list of fallback iFCs and find which application servers
     // should be invoked for this request. Save off any application servers that
     // don't match a dummy AS.
-    for (Ifc ifc : fallback_ifcs)
+    for (const Ifc& ifc : fallback_ifcs)
     {
       if (ifc.filter_matches(SessionCase::Originating,
                              true,
                              is_initial_registration,
                              received_register_msg,
-                             trail))
+                             trail,
+                             &cache))
       {
-        if (ifc.as_invocation().server_name == _ifc_configuration._dummy_as)
+        AsInvocation as_invocation = ifc.as_invocation();
+
+        if (as_invocation.server_name == _ifc_configuration._dummy_as)
         {
           TRC_DEBUG("Ignoring this fallback iFC as it matches a dummy AS (%s)",
                     _ifc_configuration._dummy_as.c_str());
@@ -263,7 +355,7 @@ void RegistrationSender::match_application_servers(pjsip_msg* received_register_
             SAS::report_event(event);
           }
 
-          application_servers.push_back(ifc.as_invocation());
+          application_servers.push_back(as_invocation);
         }
       }
     }
@@ -287,6 +379,8 @@ void RegistrationSender::match_application_servers(pjsip_msg* received_register_
 
 void RegistrationSender::send_register_to_as(pjsip_msg* received_register_msg,
                                              pjsip_msg* ok_response_msg,
+                                             const std::string& received_register_str,
+                                             const std::string& ok_response_str,
                                              const std::string& served_user,
                                              const AsInvocation& as,
                                              int expires,
@@ -343,7 +437,6 @@ void RegistrationSender::send_register_to_as(pjsip_msg* received_register_msg,
 
     // Build up this multipart body incrementally, based on the ServiceInfo,
     // IncludeRegisterRequest and IncludeRegisterResponse fields.
-    char buf[MAX_SIP_MSG_SIZE];
     pjsip_msg_body *final_body = pjsip_multipart_create(tdata->pool, NULL, NULL);
 
     // If we only have one part, we don't want a multipart MIME body - store the reference to each one here to use instead
@@ -367,8 +460,10 @@ void RegistrationSender::send_register_to_as(pjsip_msg* received_register_msg,
     if (as.include_register_request || _force_third_party_register_body)
     {
       pjsip_multipart_part *request_part = pjsip_multipart_create_part(tdata->pool);
-      pjsip_msg_print(received_register_msg, buf, sizeof(buf));
-      pj_str_t request_str = pj_str(buf);
+      pj_str_t request_str;
+      pj_strset(&request_str,
+                (char*)received_register_str.data(),
+                received_register_str.size());
       request_part->body = pjsip_msg_body_create(tdata->pool, &STR_MESSAGE, &STR_SIP, &request_str),
       possible_final_body = request_part->body;
       multipart_parts++;
@@ -380,8 +475,10 @@ void RegistrationSender::send_register_to_as(pjsip_msg* received_register_msg,
     if (as.include_register_response || _force_third_party_register_body)
     {
       pjsip_multipart_part *response_part = pjsip_multipart_create_part(tdata->pool);
-      pjsip_msg_print(ok_response_msg, buf, sizeof(buf));
-      pj_str_t response_str = pj_str(buf);
+      pj_str_t response_str;
+      pj_strset(&response_str,
+                (char*)ok_response_str.data(),
+                ok_response_str.size());
       response_part->body = pjsip_msg_body_create(tdata->pool, &STR_MESSAGE, &STR_SIP, &response_str),
       possible_final_body = response_part->body;
       multipart_parts++;
@@ -444,11 +541,25 @@ void RegistrationSender::send_register_to_as(pjsip_msg* received_register_msg,
   tsxdata->default_handling = as.default_handling;
   tsxdata->trail = trail;
   tsxdata->served_user = served_user;
+  tsxdata->server_name = as.server_name;
   tsxdata->expires = expires;
   tsxdata->is_initial_registration = is_initial_registration;
 
+  send_or_queue(tdata, tsxdata);
+}
+
+void RegistrationSender::send_or_queue(pjsip_tx_data* tdata,
+                                       ThirdPartyRegData* tsxdata)
+{
+  if (_third_party_register_rate > 0)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _queue.push_back(std::make_pair(tdata, tsxdata));
+    return;
+  }
+
   // Build the register callback and send the request statefully.
-  status = PJUtils::send_request(tdata, 0, tsxdata, &build_register_cb);
+  pj_status_t status = PJUtils::send_request(tdata, 0, tsxdata, &build_register_cb);
 
   if (status != PJ_SUCCESS)
   {
@@ -456,6 +567,148 @@ void RegistrationSender::send_register_to_as(pjsip_msg* received_register_msg,
   }
 }
 
+void RegistrationSender::pacer()
+{
+  pj_thread_desc desc;
+  pj_bzero(desc, sizeof(desc));
+  pj_thread_t* pj_thread = NULL;
+
+  if (pj_thread_register("3PRPacer", desc, &pj_thread) != PJ_SUCCESS)
+  {
+    TRC_ERROR("Failed to register third-party REGISTER pacer with pjsip"); // LCOV_EXCL_LINE
+  }
+
+  // Spread the rate over each second.
+  const int per_interval =
+    std::max(1, _third_party_register_rate * PACING_INTERVAL_MS / 1000);
+
+  std::unique_lock<std::mutex> lock(_lock);
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+  while (!_terminated)
+  {
+    next += std::chrono::milliseconds(PACING_INTERVAL_MS);
+    while ((!_terminated) && (std::chrono::steady_clock::now() < next))
+    {
+      _cond.wait_until(lock, next);
+    }
+
+    // Take this interval's registers off the queue, and send them without
+    // the lock held.
+    std::vector<std::pair<pjsip_tx_data*, ThirdPartyRegData*>> to_send;
+    while ((!_terminated) &&
+           (!_queue.empty()) &&
+           ((int)to_send.size() < per_interval))
+    {
+      to_send.push_back(_queue.front());
+      _queue.pop_front();
+    }
+
+    if (to_send.empty())
+    {
+      continue;
+    }
+
+    lock.unlock();
+
+    TRC_DEBUG("Sending %lu queued third-party REGISTERs", to_send.size());
+    for (std::pair<pjsip_tx_data*, ThirdPartyRegData*>& queued : to_send)
+    {
+      pj_status_t status = PJUtils::send_request(queued.first,
+                                                 0,
+                                                 queued.second,
+                                                 &build_register_cb);
+
+      if (status != PJ_SUCCESS)
+      {
+        delete queued.second; queued.second = NULL; // LCOV_EXCL_LINE
+      }
+    }
+
+    lock.lock();
+  }
+}
+
+bool RegistrationSender::suppress_refresh(const std::string& served_user,
+                                          const AsInvocation& as,
+                                          int expires,
+                                          bool is_initial_registration)
+{
+  if (_third_party_refresh_percent <= 0)
+  {
+    return false;
+  }
+
+  std::pair<std::string, std::string> key(served_user, as.server_name);
+  std::unique_lock<std::mutex> lock(_as_registrations_lock);
+
+  // Initial registrations and deregistrations always go to the AS, as do
+  // re-registrations that the AS wants to see the contents of.  Forget what
+  // we knew about the AS's registration, so that the next re-registration
+  // does too.
+  if ((expires <= 0) ||
+      (is_initial_registration) ||
+      (as.include_register_request) ||
+      (as.include_register_response) ||
+      (_force_third_party_register_body))
+  {
+    _as_registrations.erase(key);
+    return false;
+  }
+
+  std::map<std::pair<std::string, std::string>, AsRegistration>::iterator it =
+                                                   _as_registrations.find(key);
+  if (it == _as_registrations.end())
+  {
+    return false;
+  }
+
+  uint64_t now_ms = current_time_ms();
+  uint64_t age_ms = now_ms - it->second.sent_ms;
+  uint64_t expires_ms = (uint64_t)it->second.expires * 1000;
+
+  if (age_ms >= expires_ms)
+  {
+    // The AS's registration has expired, so this entry is no use any more.
+    _as_registrations.erase(it);
+    return false;
+  }
+
+  return (age_ms * 100 < expires_ms * _third_party_refresh_percent);
+}
+
+void RegistrationSender::record_as_registration(const std::string& served_user,
+                                                const std::string& server_name,
+                                                int expires,
+                                                bool success)
+{
+  if (_third_party_refresh_percent <= 0)
+  {
+    return;
+  }
+
+  std::pair<std::string, std::string> key(served_user, server_name);
+  std::unique_lock<std::mutex> lock(_as_registrations_lock);
+
+  if ((success) && (expires > 0))
+  {
+    AsRegistration& registration = _as_registrations[key];
+    registration.sent_ms = current_time_ms();
+    registration.expires = expires;
+  }
+  else
+  {
+    _as_registrations.erase(key);
+  }
+}
+
+uint64_t RegistrationSender::current_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+}
+
 PJUtils::Callback* RegistrationSender::build_register_cb(void* token,
                                                          pjsip_event* event)
 {
@@ -483,6 +736,11 @@ void RegistrationSender::RegisterCallback::run()
 {
   TRC_DEBUG("Handling 3rd party register callback for %s", _reg_data->served_user.c_str());
 
+  _reg_data->registration_sender->record_as_registration(_reg_data->served_user,
+                                                         _reg_data->server_name,
+                                                         _reg_data->expires,
+                                                         (_status_code == 200));
+
   if ((_reg_data->default_handling == SESSION_TERMINATED) &&
       ((_status_code == 408) ||
        (PJSIP_IS_STATUS_IN_CLASS(_status_code, 500))))
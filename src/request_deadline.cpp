@@ -0,0 +1,78 @@
+/**
+ * @file request_deadline.cpp Deadlines for the dependency calls made while
+ * processing a SIP message.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "request_deadline.h"
+
+namespace RequestDeadline
+{
+  static thread_local bool tl_has_deadline = false;
+  static thread_local Clock::time_point tl_deadline;
+
+  Scope::Scope(unsigned long budget_us, unsigned long elapsed_us) :
+    _prev_has_deadline(tl_has_deadline),
+    _prev_deadline(tl_deadline)
+  {
+    if (budget_us > 0)
+    {
+      tl_has_deadline = true;
+      tl_deadline = Clock::now() +
+                    std::chrono::microseconds((long)budget_us - (long)elapsed_us);
+    }
+    else
+    {
+      tl_has_deadline = false;
+    }
+  }
+
+  Scope::Scope(bool has_deadline, Clock::time_point deadline) :
+    _prev_has_deadline(tl_has_deadline),
+    _prev_deadline(tl_deadline)
+  {
+    tl_has_deadline = has_deadline;
+    tl_deadline = deadline;
+  }
+
+  Scope::~Scope()
+  {
+    tl_has_deadline = _prev_has_deadline;
+    tl_deadline = _prev_deadline;
+  }
+
+  bool get(Clock::time_point& deadline)
+  {
+    deadline = tl_deadline;
+    return tl_has_deadline;
+  }
+
+  bool expired()
+  {
+    return (tl_has_deadline) && (Clock::now() >= tl_deadline);
+  }
+
+  long cap_timeout_ms(long timeout_ms)
+  {
+    if (!tl_has_deadline)
+    {
+      return timeout_ms;
+    }
+
+    long remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                           tl_deadline - Clock::now()).count();
+    if (remaining_ms < 1)
+    {
+      remaining_ms = 1;
+    }
+
+    return ((timeout_ms <= 0) || (remaining_ms < timeout_ms)) ?
+             remaining_ms : timeout_ms;
+  }
+}
@@ -0,0 +1,112 @@
+/**
+ * @file request_hedger.cpp Deciding when to hedge slow requests.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "log.h"
+#include "request_hedger.h"
+
+const long RequestHedger::DEFAULT_MIN_DELAY_MS;
+const size_t RequestHedger::NUM_SAMPLES;
+const size_t RequestHedger::RECALCULATE_INTERVAL;
+
+RequestHedger::RequestHedger(int percentile,
+                             int budget_percent,
+                             long min_delay_ms,
+                             SNMP::CounterTable* hedged_tbl) :
+  _percentile(std::min(std::max(percentile, 1), 99)),
+  _budget_percent(std::max(budget_percent, 0)),
+  _min_delay_ms(min_delay_ms),
+  _hedged_tbl(hedged_tbl),
+  _delay_ms(-1),
+  _tokens(0),
+  _samples_us(),
+  _next_sample(0),
+  _new_samples(0)
+{
+  _samples_us.reserve(NUM_SAMPLES);
+}
+
+long RequestHedger::start_request()
+{
+  // Accrue some budget for this request.
+  int tokens = _tokens.load();
+  while ((tokens < MAX_TOKENS) &&
+         (!_tokens.compare_exchange_weak(tokens,
+                                         (tokens + _budget_percent < MAX_TOKENS) ?
+                                           tokens + _budget_percent :
+                                           MAX_TOKENS)))
+  {
+  }
+
+  return _delay_ms.load();
+}
+
+bool RequestHedger::take_hedge()
+{
+  int tokens = _tokens.load();
+  do
+  {
+    if (tokens < TOKENS_PER_HEDGE)
+    {
+      TRC_DEBUG("No budget left to hedge request");
+      return false;
+    }
+  }
+  while (!_tokens.compare_exchange_weak(tokens, tokens - TOKENS_PER_HEDGE));
+
+  if (_hedged_tbl != NULL)
+  {
+    _hedged_tbl->increment();
+  }
+
+  return true;
+}
+
+void RequestHedger::record_latency(unsigned long latency_us)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  if (_samples_us.size() < NUM_SAMPLES)
+  {
+    _samples_us.push_back(latency_us);
+  }
+  else
+  {
+    _samples_us[_next_sample] = latency_us;
+  }
+
+  _next_sample = (_next_sample + 1) % NUM_SAMPLES;
+
+  if ((++_new_samples >= RECALCULATE_INTERVAL) &&
+      (_samples_us.size() >= NUM_SAMPLES / 2))
+  {
+    _new_samples = 0;
+    recalculate();
+  }
+}
+
+void RequestHedger::recalculate()
+{
+  // Called with the lock held.  Work on a copy, as nth_element reorders the
+  // elements and the ring relies on their order.
+  std::vector<unsigned long> samples_us(_samples_us);
+  size_t index = (samples_us.size() * _percentile) / 100;
+  std::nth_element(samples_us.begin(), samples_us.begin() + index, samples_us.end());
+
+  long delay_ms = std::max((long)(samples_us[index] / 1000), _min_delay_ms);
+
+  if (delay_ms != _delay_ms.load())
+  {
+    TRC_DEBUG("Hedge delay (%d percentile) is now %ldms", _percentile, delay_ms);
+    _delay_ms.store(delay_ms);
+  }
+}
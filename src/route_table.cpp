@@ -0,0 +1,408 @@
+/**
+ * @file route_table.cpp Implementation of CompiledRouteTable
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+
+#include "route_table.h"
+#include "log.h"
+
+const char CompiledRouteTable::MAGIC[8] = {'C', 'W', 'R', 'T', 'B', 'L', '\0', '\0'};
+
+CompiledRouteTable::CompiledRouteTable(void* base, size_t length) :
+  _base(base),
+  _length(length),
+  _header((const Header*)base),
+  _domains(NULL),
+  _numbers(NULL),
+  _values(NULL),
+  _string_pool(NULL)
+{
+}
+
+CompiledRouteTable::~CompiledRouteTable()
+{
+  munmap(_base, _length);
+}
+
+bool CompiledRouteTable::is_compiled(const std::string& path)
+{
+  char magic[sizeof(MAGIC)];
+  std::ifstream fs(path.c_str(), std::ios::binary);
+  fs.read(magic, sizeof(magic));
+
+  return ((fs.gcount() == (std::streamsize)sizeof(magic)) &&
+          (memcmp(magic, MAGIC, sizeof(magic)) == 0));
+}
+
+CompiledRouteTable* CompiledRouteTable::load(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    TRC_ERROR("Failed to open compiled route table %s: %s",
+              path.c_str(), strerror(errno));
+    return NULL;
+  }
+
+  struct stat s;
+
+  if ((fstat(fd, &s) != 0) || ((size_t)s.st_size < sizeof(Header)))
+  {
+    TRC_ERROR("Compiled route table %s is truncated", path.c_str());
+    close(fd);
+    return NULL;
+  }
+
+  // The mapping stays valid once the file is closed.
+  void* base = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to map compiled route table %s: %s",
+              path.c_str(), strerror(errno));
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  CompiledRouteTable* table = new CompiledRouteTable(base, s.st_size);
+
+  if (!table->validate())
+  {
+    TRC_ERROR("Compiled route table %s is badly formed", path.c_str());
+    delete table; table = NULL;
+  }
+
+  return table;
+}
+
+bool CompiledRouteTable::validate_section(uint32_t count, uint32_t offset) const
+{
+  // All sections after the header hold uint32_t-aligned structures.
+  return ((offset % sizeof(uint32_t) == 0) &&
+          ((uint64_t)offset + ((uint64_t)count * sizeof(Entry)) <= _length));
+}
+
+bool CompiledRouteTable::validate()
+{
+  if ((memcmp(_header->magic, MAGIC, sizeof(MAGIC)) != 0) ||
+      (_header->version != VERSION))
+  {
+    TRC_DEBUG("Unrecognised compiled route table version");
+    return false;
+  }
+
+  if ((!validate_section(_header->domain_count, _header->domain_offset)) ||
+      (!validate_section(_header->number_count, _header->number_offset)) ||
+      (_header->value_offset % sizeof(uint32_t) != 0) ||
+      ((uint64_t)_header->value_offset +
+       ((uint64_t)_header->value_count * sizeof(StringRef)) > _length) ||
+      ((uint64_t)_header->string_pool_offset +
+       _header->string_pool_length > _length))
+  {
+    TRC_DEBUG("Compiled route table section lies outside the file");
+    return false;
+  }
+
+  const char* base = (const char*)_base;
+  _domains = (const Entry*)(base + _header->domain_offset);
+  _numbers = (const Entry*)(base + _header->number_offset);
+  _values = (const StringRef*)(base + _header->value_offset);
+  _string_pool = base + _header->string_pool_offset;
+
+  for (uint32_t ii = 0; ii < _header->value_count; ++ii)
+  {
+    if ((uint64_t)_values[ii].offset + _values[ii].length >
+        _header->string_pool_length)
+    {
+      TRC_DEBUG("Compiled route table value lies outside the string pool");
+      return false;
+    }
+  }
+
+  const Entry* sections[] = {_domains, _numbers};
+  uint32_t counts[] = {_header->domain_count, _header->number_count};
+
+  for (int section = 0; section < 2; ++section)
+  {
+    for (uint32_t ii = 0; ii < counts[section]; ++ii)
+    {
+      const Entry& entry = sections[section][ii];
+
+      if (((uint64_t)entry.key.offset + entry.key.length >
+           _header->string_pool_length) ||
+          ((uint64_t)entry.first_value + entry.num_values >
+           _header->value_count))
+      {
+        TRC_DEBUG("Compiled route table entry lies outside the file");
+        return false;
+      }
+
+      // Lookups rely on the keys being sorted and unique.
+      if ((ii > 0) &&
+          (compare_key(sections[section][ii - 1],
+                       _string_pool + entry.key.offset,
+                       entry.key.length) >= 0))
+      {
+        TRC_DEBUG("Compiled route table keys are not sorted");
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+int CompiledRouteTable::compare_key(const Entry& entry,
+                                    const char* str,
+                                    size_t len) const
+{
+  const char* key = _string_pool + entry.key.offset;
+  size_t key_len = entry.key.length;
+  int rc = memcmp(key, str, std::min(key_len, len));
+
+  if (rc == 0)
+  {
+    rc = (key_len < len) ? -1 : ((key_len > len) ? 1 : 0);
+  }
+
+  return rc;
+}
+
+int CompiledRouteTable::find_exact(const Entry* entries,
+                                   uint32_t count,
+                                   const char* str,
+                                   size_t len) const
+{
+  uint32_t lo = 0;
+  uint32_t hi = count;
+
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int rc = compare_key(entries[mid], str, len);
+
+    if (rc == 0)
+    {
+      return mid;
+    }
+    else if (rc < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  return -1;
+}
+
+bool CompiledRouteTable::find_domain(const std::string& domain,
+                                     std::vector<std::string>& values) const
+{
+  int idx = find_exact(_domains,
+                       _header->domain_count,
+                       domain.data(),
+                       domain.length());
+
+  if (idx < 0)
+  {
+    return false;
+  }
+
+  values = get_values(_domains[idx]);
+  return true;
+}
+
+int CompiledRouteTable::find_number(const std::string& number,
+                                    std::string* matched_key) const
+{
+  const char* str = number.data();
+  size_t len = number.length();
+  int idx = -1;
+
+  // A number which is itself a prefix of one or more keys matches the
+  // greatest of those keys.  These keys are contiguous, so find the first key
+  // that sorts after all of them - ignoring the parts of keys beyond the
+  // length of the number - and check whether the key before it matches.
+  uint32_t lo = 0;
+  uint32_t hi = _header->number_count;
+
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const Entry& entry = _numbers[mid];
+    uint32_t key_len = entry.key.length;
+    int rc = compare_key(entry, str, len);
+
+    if ((rc <= 0) || ((key_len > len) &&
+                      (memcmp(_string_pool + entry.key.offset, str, len) == 0)))
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  if ((lo > 0) &&
+      (_numbers[lo - 1].key.length >= len) &&
+      (memcmp(_string_pool + _numbers[lo - 1].key.offset, str, len) == 0))
+  {
+    idx = lo - 1;
+  }
+
+  // Otherwise try each prefix of the number in turn, longest first.
+  for (size_t prefix_len = len; (idx < 0) && (prefix_len > 0); --prefix_len)
+  {
+    idx = find_exact(_numbers, _header->number_count, str, prefix_len - 1);
+  }
+
+  if ((idx >= 0) && (matched_key != NULL))
+  {
+    *matched_key = get_string(_numbers[idx].key);
+  }
+
+  return idx;
+}
+
+std::vector<std::string> CompiledRouteTable::number_values_at(int idx) const
+{
+  return get_values(_numbers[idx]);
+}
+
+std::string CompiledRouteTable::get_string(const StringRef& ref) const
+{
+  return std::string(_string_pool + ref.offset, ref.length);
+}
+
+std::vector<std::string> CompiledRouteTable::get_values(const Entry& entry) const
+{
+  std::vector<std::string> values;
+  values.reserve(entry.num_values);
+
+  for (uint32_t ii = 0; ii < entry.num_values; ++ii)
+  {
+    values.push_back(get_string(_values[entry.first_value + ii]));
+  }
+
+  return values;
+}
+
+void CompiledRouteTable::Builder::add_domain(const std::string& domain,
+                                             const std::vector<std::string>& values)
+{
+  _domains.insert(std::make_pair(domain, values));
+}
+
+void CompiledRouteTable::Builder::add_number(const std::string& number,
+                                             const std::vector<std::string>& values)
+{
+  _numbers.insert(std::make_pair(number, values));
+}
+
+bool CompiledRouteTable::Builder::write(const std::string& path,
+                                        std::string& error) const
+{
+  // Lay out the entries, values and string pool.
+  std::vector<Entry> domain_entries;
+  std::vector<Entry> number_entries;
+  std::vector<StringRef> values;
+  std::string string_pool;
+  const Entries* sections[] = {&_domains, &_numbers};
+  std::vector<Entry>* section_entries[] = {&domain_entries, &number_entries};
+
+  for (int section = 0; section < 2; ++section)
+  {
+    for (Entries::const_iterator it = sections[section]->begin();
+         it != sections[section]->end();
+         ++it)
+    {
+      Entry entry;
+      entry.key.offset = string_pool.length();
+      entry.key.length = it->first.length();
+      string_pool += it->first;
+      entry.first_value = values.size();
+      entry.num_values = it->second.size();
+
+      for (const std::string& value : it->second)
+      {
+        StringRef ref = {(uint32_t)string_pool.length(), (uint32_t)value.length()};
+        string_pool += value;
+        values.push_back(ref);
+      }
+
+      section_entries[section]->push_back(entry);
+    }
+  }
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.domain_count = domain_entries.size();
+  header.domain_offset = sizeof(Header);
+  header.number_count = number_entries.size();
+  header.number_offset = header.domain_offset +
+                         domain_entries.size() * sizeof(Entry);
+  header.value_count = values.size();
+  header.value_offset = header.number_offset +
+                        number_entries.size() * sizeof(Entry);
+  header.string_pool_length = string_pool.length();
+  header.string_pool_offset = header.value_offset +
+                              values.size() * sizeof(StringRef);
+
+  if ((uint64_t)header.string_pool_offset + string_pool.length() > UINT32_MAX)
+  {
+    error = "Route table is too large";
+    return false;
+  }
+
+  // Write to a temporary file and then rename it, so that processes that have
+  // the old file mapped are unaffected.
+  std::string tmp_path = path + ".tmp";
+  std::ofstream fs(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+  fs.write((const char*)&header, sizeof(header));
+  fs.write((const char*)domain_entries.data(), domain_entries.size() * sizeof(Entry));
+  fs.write((const char*)number_entries.data(), number_entries.size() * sizeof(Entry));
+  fs.write((const char*)values.data(), values.size() * sizeof(StringRef));
+  fs.write(string_pool.data(), string_pool.length());
+  fs.close();
+
+  if (!fs)
+  {
+    error = "Failed to write " + tmp_path + ": " + strerror(errno);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  if (rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    error = "Failed to rename " + tmp_path + " to " + path + ": " + strerror(errno);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,193 @@
+/**
+ * @file route_table_compiler.cpp Offline tool to compile BGCF and ENUM JSON
+ * configuration into compiled route tables.
+ *
+ * Usage: sprout-route-compiler bgcf|enum <input JSON file> <output file>
+ *
+ * The output file can then be configured in place of the JSON file (for
+ * example as the --enum-file option), and is memory-mapped on reload rather
+ * than parsed.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <iterator>
+#include <boost/regex.hpp>
+#include "rapidjson/document.h"
+#include "rapidjson/error/en.h"
+
+#include "route_table.h"
+#include "utils.h"
+
+// Add the routes from a BGCF configuration document, following the same rules
+// as BgcfService::update_routes.
+static bool compile_bgcf(const rapidjson::Document& doc,
+                         CompiledRouteTable::Builder& builder)
+{
+  if ((!doc.HasMember("routes")) || (!doc["routes"].IsArray()))
+  {
+    fprintf(stderr, "Badly formed BGCF configuration - missing routes array\n");
+    return false;
+  }
+
+  const rapidjson::Value& routes_arr = doc["routes"];
+
+  for (rapidjson::Value::ConstValueIterator routes_it = routes_arr.Begin();
+       routes_it != routes_arr.End();
+       ++routes_it)
+  {
+    const rapidjson::Value& route = *routes_it;
+    bool has_domain = route.HasMember("domain") && route["domain"].IsString();
+    bool has_number = route.HasMember("number") && route["number"].IsString();
+
+    // An entry is valid if it has either a domain OR a number AND an array of
+    // routes.
+    if (!(((has_domain && !route.HasMember("number")) ||
+           (has_number && !route.HasMember("domain"))) &&
+          route.HasMember("route") &&
+          route["route"].IsArray()))
+    {
+      fprintf(stderr, "Skipping badly formed BGCF route entry\n");
+      continue;
+    }
+
+    std::vector<std::string> route_vec;
+    const rapidjson::Value& route_arr = route["route"];
+
+    for (rapidjson::Value::ConstValueIterator route_it = route_arr.Begin();
+         route_it != route_arr.End();
+         ++route_it)
+    {
+      route_vec.push_back((*route_it).GetString());
+    }
+
+    if (has_domain)
+    {
+      builder.add_domain(route["domain"].GetString(), route_vec);
+    }
+    else
+    {
+      builder.add_number(
+             Utils::remove_visual_separators(route["number"].GetString()),
+             route_vec);
+    }
+  }
+
+  return true;
+}
+
+// Add the number blocks from an ENUM configuration document, following the
+// same rules as JSONEnumService::update_enum.  The regular expressions are
+// stored as strings and compiled by Sprout when first used, but are checked
+// here so that badly formed ones are dropped just as they would be from the
+// JSON file.
+static bool compile_enum(const rapidjson::Document& doc,
+                         CompiledRouteTable::Builder& builder)
+{
+  if ((!doc.HasMember("number_blocks")) || (!doc["number_blocks"].IsArray()))
+  {
+    fprintf(stderr, "Badly formed ENUM configuration - missing number_blocks array\n");
+    return false;
+  }
+
+  const rapidjson::Value& nb_arr = doc["number_blocks"];
+
+  for (rapidjson::Value::ConstValueIterator nb_it = nb_arr.Begin();
+       nb_it != nb_arr.End();
+       ++nb_it)
+  {
+    const rapidjson::Value& nb = *nb_it;
+
+    if ((!nb.HasMember("prefix")) || (!nb["prefix"].IsString()) ||
+        (!nb.HasMember("regex")) || (!nb["regex"].IsString()))
+    {
+      fprintf(stderr, "Skipping badly formed ENUM number block\n");
+      continue;
+    }
+
+    std::string regex = nb["regex"].GetString();
+    std::vector<std::string> match_replace;
+    Utils::split_string(regex, regex[0], match_replace);
+    bool valid = (match_replace.size() == 2);
+
+    if (valid)
+    {
+      try
+      {
+        boost::regex match(match_replace[0], boost::regex::extended);
+      }
+      catch (...)
+      {
+        valid = false;
+      }
+    }
+
+    if (!valid)
+    {
+      fprintf(stderr, "Skipping badly formed regular expression %s\n", regex.c_str());
+      continue;
+    }
+
+    builder.add_number(Utils::remove_visual_separators(nb["prefix"].GetString()),
+                       std::vector<std::string>(1, regex));
+  }
+
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  if ((argc != 4) ||
+      ((strcmp(argv[1], "bgcf") != 0) && (strcmp(argv[1], "enum") != 0)))
+  {
+    fprintf(stderr, "Usage: %s bgcf|enum <input JSON file> <output file>\n", argv[0]);
+    return 1;
+  }
+
+  std::ifstream fs(argv[2]);
+  std::string json_str((std::istreambuf_iterator<char>(fs)),
+                        std::istreambuf_iterator<char>());
+
+  if (json_str == "")
+  {
+    fprintf(stderr, "Failed to read configuration from %s\n", argv[2]);
+    return 1;
+  }
+
+  rapidjson::Document doc;
+  doc.Parse<0>(json_str.c_str());
+
+  if (doc.HasParseError())
+  {
+    fprintf(stderr, "Failed to parse %s: %s\n",
+            argv[2], rapidjson::GetParseError_En(doc.GetParseError()));
+    return 1;
+  }
+
+  CompiledRouteTable::Builder builder;
+  bool success = (strcmp(argv[1], "bgcf") == 0) ?
+                   compile_bgcf(doc, builder) :
+                   compile_enum(doc, builder);
+  std::string error;
+
+  if (!success)
+  {
+    return 1;
+  }
+
+  if (!builder.write(argv[3], error))
+  {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  return 0;
+}
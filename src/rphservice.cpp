@@ -10,10 +10,13 @@
  */
 
 #include <sys/stat.h>
+#include <ctype.h>
+#include <strings.h>
 #include "rapidjson/document.h"
 #include "rapidjson/error/en.h"
 #include "json_parse_utils.h"
 #include <fstream>
+#include <algorithm>
 
 #include "rphservice.h"
 #include "log.h"
@@ -41,7 +44,6 @@ RPHService::RPHService(Alarm* alarm,
 RPHService::~RPHService()
 {
   delete _updater; _updater = NULL;
-  _rph_map.clear();
   delete _alarm; _alarm = NULL;
 }
 
@@ -185,10 +187,9 @@ void RPHService::update_rph()
     }
   }
 
-  // At this point, we're definitely going to override the RPH map we currently have so
-  // take the lock and update the map.
-  boost::lock_guard<boost::shared_mutex> write_lock(_sets_rw_lock);
-  _rph_map = new_rph_map;
+  // At this point, we're definitely going to override the RPH configuration
+  // we currently have, so publish the new one.
+  _rph_table.set(std::make_shared<RPHTable>(new_rph_map));
 
   // We've successfully uploaded RPH configuration so log and clear the alarm.
   TRC_STATUS("RPH configuration successfully updated");
@@ -197,22 +198,32 @@ void RPHService::update_rph()
 
 SIPEventPriorityLevel RPHService::lookup_priority(std::string rph_value,
                                                   SAS::TrailId trail)
+{
+  pj_str_t value;
+  value.ptr = (char*)rph_value.data();
+  value.slen = rph_value.size();
+  return lookup_priority(value, trail);
+}
+
+SIPEventPriorityLevel RPHService::lookup_priority(const pj_str_t& rph_value,
+                                                  SAS::TrailId trail)
 {
   SIPEventPriorityLevel priority = SIPEventPriorityLevel::NORMAL_PRIORITY;
 
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_sets_rw_lock);
+  // Take a reference to the current table, which keeps it valid for the rest
+  // of this function even if the configuration is reloaded.
+  std::shared_ptr<const RPHTable> rph_table = _rph_table.get();
 
-  // Lookup the key in the map. If it doesn't exist, we will return the default
-  // priority of 0.
-  TRC_DEBUG("Looking up priority of RPH value \"%s\"", rph_value.c_str());
-  std::map<std::string, SIPEventPriorityLevel, str_cmp_ci>::iterator result = _rph_map.find(rph_value);
-  if (result != _rph_map.end())
+  // Lookup the value in the table. If it doesn't exist, we will return the
+  // default priority of 0.
+  TRC_DEBUG("Looking up priority of RPH value \"%.*s\"",
+            (int)rph_value.slen, rph_value.ptr);
+  if (rph_table->find(rph_value, priority))
   {
-    priority = result->second;
-    TRC_DEBUG("Priority of RPH value \"%s\" is %d", rph_value.c_str(), priority);
+    TRC_DEBUG("Priority of RPH value \"%.*s\" is %d",
+              (int)rph_value.slen, rph_value.ptr, priority);
     SAS::Event event(trail, SASEvent::RPH_LOOKUP_SUCCESSFUL, 0);
-    event.add_var_param(rph_value);
+    event.add_var_param(rph_value.slen, rph_value.ptr);
     event.add_static_param(priority);
     SAS::report_event(event);
   }
@@ -221,17 +232,121 @@ SIPEventPriorityLevel RPHService::lookup_priority(std::string rph_value,
     // We received a message with an unknown RPH value. This could be because:
     //  - It is not defined in the IANA namespace.
     //  - It is not assigned a priority value in the rph.json file.
-    TRC_DEBUG("An unknown RPH value \"%s\" was received on an incoming message."
+    TRC_DEBUG("An unknown RPH value \"%.*s\" was received on an incoming message."
               " This message will be handled, but will not be prioritized.",
-              rph_value.c_str());
+              (int)rph_value.slen, rph_value.ptr);
     SAS::Event event(trail, SASEvent::RPH_VALUE_UNKNOWN, 0);
-    event.add_var_param(rph_value);
+    event.add_var_param(rph_value.slen, rph_value.ptr);
     SAS::report_event(event);
   }
 
   return priority;
 }
 
+RPHService::RPHTable::RPHTable() :
+  RPHTable(RPHMap())
+{
+}
+
+RPHService::RPHTable::RPHTable(const RPHMap& rph_map) :
+  _seed(0)
+{
+  // Start with a table at least twice the size of the configuration, and
+  // double it each time a run of seeds fails to separate the values.  There
+  // are only a few dozen RPH values, so this finishes quickly.
+  size_t num_slots = 4;
+  while (num_slots < rph_map.size() * 2)
+  {
+    num_slots *= 2;
+  }
+
+  for (;;)
+  {
+    _slots.assign(num_slots, Slot{0, 0, SIPEventPriorityLevel::NORMAL_PRIORITY});
+
+    for (uint32_t seed = 1; seed <= 64; ++seed)
+    {
+      if (place(rph_map, seed))
+      {
+        _seed = seed;
+        return;
+      }
+    }
+
+    num_slots *= 2;
+  }
+}
+
+bool RPHService::RPHTable::place(const RPHMap& rph_map, uint32_t seed)
+{
+  _values.clear();
+  std::fill(_slots.begin(),
+            _slots.end(),
+            Slot{0, 0, SIPEventPriorityLevel::NORMAL_PRIORITY});
+
+  for (RPHMap::const_iterator it = rph_map.begin(); it != rph_map.end(); ++it)
+  {
+    if (it->first.empty())
+    {
+      // An empty value can't be in a Resource-Priority header.
+      continue;
+    }
+
+    Slot& slot = _slots[hash(it->first.data(), it->first.size(), seed) &
+                        (_slots.size() - 1)];
+    if (slot.length != 0)
+    {
+      return false;
+    }
+
+    slot.offset = _values.size();
+    slot.length = it->first.size();
+    slot.priority = it->second;
+    _values.append(boost::algorithm::to_lower_copy(it->first));
+  }
+
+  return true;
+}
+
+bool RPHService::RPHTable::find(const pj_str_t& rph_value,
+                                SIPEventPriorityLevel& priority) const
+{
+  if (rph_value.slen <= 0)
+  {
+    return false;
+  }
+
+  const Slot& slot = _slots[hash(rph_value.ptr, rph_value.slen, _seed) &
+                            (_slots.size() - 1)];
+  if ((slot.length == (uint32_t)rph_value.slen) &&
+      (strncasecmp(_values.data() + slot.offset, rph_value.ptr, slot.length) == 0))
+  {
+    priority = slot.priority;
+    return true;
+  }
+
+  return false;
+}
+
+/// Case-insensitive FNV-1a hash.
+uint32_t RPHService::RPHTable::hash(const char* value,
+                                    size_t length,
+                                    uint32_t seed)
+{
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t ii = 0; ii < length; ++ii)
+  {
+    h ^= (unsigned char)tolower((unsigned char)value[ii]);
+    h *= 16777619u;
+  }
+
+  // Mix the bits, as only the low bits pick the slot.
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
 void RPHService::set_alarm()
 {
   if (_alarm)
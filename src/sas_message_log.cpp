@@ -0,0 +1,183 @@
+/**
+ * @file sas_message_log.cpp Logging SIP messages to SAS on a background thread.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "sas_message_log.h"
+#include "sproutsasevent.h"
+#include "log.h"
+
+// How long the logging thread waits for more events once the ring is empty.
+// This is short, as it delays the message events in their trails.
+static const int WRITER_INTERVAL_US = 500;
+
+const uint64_t SasMessageLog::RING_SIZE;
+
+SasMessageLog::SasMessageLog() :
+  _ring(new Slot[RING_SIZE]),
+  _head(0),
+  _tail(0),
+  _overflowed(0),
+  _stopping(false)
+{
+  for (uint64_t ii = 0; ii < RING_SIZE; ++ii)
+  {
+    _ring[ii].seq.store(ii, std::memory_order_relaxed);
+    _ring[ii].msg = NULL;
+  }
+
+  _writer = std::thread(&SasMessageLog::writer, this);
+}
+
+SasMessageLog::~SasMessageLog()
+{
+  _stopping.store(true);
+
+  if (_writer.joinable())
+  {
+    _writer.join();
+  }
+
+  delete[] _ring; _ring = NULL;
+}
+
+void SasMessageLog::report(SAS::TrailId trail,
+                           uint32_t event_id,
+                           uint32_t transport_type,
+                           uint32_t port,
+                           const char* name,
+                           int len,
+                           const char* msg)
+{
+  SAS::Event event(trail, event_id, 0);
+  event.add_static_param(transport_type);
+  event.add_static_param(port);
+  event.add_var_param(name);
+  event.add_var_param(len, msg);
+  SAS::report_event(event);
+}
+
+void SasMessageLog::log(SAS::TrailId trail,
+                        uint32_t event_id,
+                        uint32_t transport_type,
+                        uint32_t port,
+                        const char* name,
+                        int len,
+                        const char* msg)
+{
+  // Claim a slot on the ring.
+  uint64_t pos = _head.load(std::memory_order_relaxed);
+  Slot* slot;
+
+  while (true)
+  {
+    slot = &_ring[pos % RING_SIZE];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+
+    if (seq == pos)
+    {
+      if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (seq < pos)
+    {
+      // The logging thread hasn't reported the event that was in this slot,
+      // so the ring is full.  Report this event here rather than wait.
+      _overflowed.fetch_add(1, std::memory_order_relaxed);
+      report(trail, event_id, transport_type, port, name, len, msg);
+      return;
+    }
+    else
+    {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->trail = trail;
+  slot->event_id = event_id;
+  slot->transport_type = transport_type;
+  slot->port = port;
+  strncpy(slot->name, name, sizeof(slot->name) - 1);
+  slot->name[sizeof(slot->name) - 1] = '\0';
+  slot->len = len;
+  slot->msg = new char[len];
+  memcpy(slot->msg, msg, len);
+
+  // Hand the slot to the logging thread.
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+int SasMessageLog::drain()
+{
+  int reported = 0;
+
+  while (true)
+  {
+    Slot* slot = &_ring[_tail % RING_SIZE];
+    if (slot->seq.load(std::memory_order_acquire) != _tail + 1)
+    {
+      break;
+    }
+
+    report(slot->trail,
+           slot->event_id,
+           slot->transport_type,
+           slot->port,
+           slot->name,
+           slot->len,
+           slot->msg);
+    delete[] slot->msg; slot->msg = NULL;
+
+    // Free the slot for the producer that next comes round the ring to it.
+    slot->seq.store(_tail + RING_SIZE, std::memory_order_release);
+    ++_tail;
+    ++reported;
+  }
+
+  return reported;
+}
+
+void SasMessageLog::writer()
+{
+  uint64_t reported_overflowed = 0;
+  time_t last_warning = 0;
+
+  while (true)
+  {
+    bool stopping = _stopping.load();
+    int reported = drain();
+
+    // Warn about overflows at most once a second.
+    uint64_t overflowed = _overflowed.load(std::memory_order_relaxed);
+    time_t now = time(NULL);
+    if ((overflowed != reported_overflowed) && (now != last_warning))
+    {
+      TRC_WARNING("Logged %lu SAS message events inline as the SAS logging thread isn't keeping up",
+                  overflowed - reported_overflowed);
+      reported_overflowed = overflowed;
+      last_warning = now;
+    }
+
+    if (reported == 0)
+    {
+      if (stopping)
+      {
+        break;
+      }
+
+      struct timespec delay = {0, WRITER_INTERVAL_US * 1000};
+      nanosleep(&delay, NULL);
+    }
+  }
+}
@@ -0,0 +1,74 @@
+/**
+ * @file sas_sampling.cpp Sampling of detailed SAS events.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+
+#include "log.h"
+#include "sas_sampling.h"
+
+namespace SASSampling
+{
+  // How long after rejecting a request Sprout counts as overloaded.
+  static const int64_t OVERLOAD_PERIOD_MS = 1000;
+
+  std::atomic<bool> sampling(false);
+
+  static std::atomic<int> detail_percent(100);
+  static std::atomic<int> overload_detail_percent(100);
+  static std::atomic<int64_t> last_overload_ms(-OVERLOAD_PERIOD_MS);
+
+  static int64_t monotonic_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  void configure(int detail, int overload_detail)
+  {
+    detail_percent.store(detail, std::memory_order_relaxed);
+    overload_detail_percent.store(overload_detail, std::memory_order_relaxed);
+    sampling.store((detail < 100) || (overload_detail < 100),
+                   std::memory_order_relaxed);
+
+    TRC_STATUS("Logging detailed SAS events on %d%% of trails (%d%% when overloaded)",
+               detail, overload_detail);
+  }
+
+  void report_overload()
+  {
+    if (sampling.load(std::memory_order_relaxed))
+    {
+      last_overload_ms.store(monotonic_ms(), std::memory_order_relaxed);
+    }
+  }
+
+  bool sample(SAS::TrailId trail)
+  {
+    int percent = detail_percent.load(std::memory_order_relaxed);
+
+    if (monotonic_ms() - last_overload_ms.load(std::memory_order_relaxed) <
+        OVERLOAD_PERIOD_MS)
+    {
+      percent = overload_detail_percent.load(std::memory_order_relaxed);
+    }
+
+    if (percent >= 100)
+    {
+      return true;
+    }
+
+    // Trail IDs are allocated sequentially, so scramble them before picking
+    // which to sample.
+    uint64_t hash = (uint64_t)trail * 0x9E3779B97F4A7C15ull;
+    return (int)((hash >> 32) % 100) < percent;
+  }
+}
@@ -126,7 +126,9 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
     AsCommunicationTracker* sess_term_as_tracker =
         new AsCommunicationTracker(_sess_term_as_alarm,
                                    &CL_SPROUT_SESS_TERM_AS_COMM_FAILURE,
-                                   &CL_SPROUT_SESS_TERM_AS_COMM_SUCCESS);
+                                   &CL_SPROUT_SESS_TERM_AS_COMM_SUCCESS,
+                                   opt.as_failure_threshold,
+                                   opt.as_retry_interval_ms);
 
     _sess_cont_as_alarm =  new Alarm(alarm_manager,
                                      "sprout",
@@ -135,7 +137,9 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
     AsCommunicationTracker* sess_cont_as_tracker =
         new AsCommunicationTracker(_sess_cont_as_alarm,
                                    &CL_SPROUT_SESS_CONT_AS_COMM_FAILURE,
-                                   &CL_SPROUT_SESS_CONT_AS_COMM_SUCCESS);
+                                   &CL_SPROUT_SESS_CONT_AS_COMM_SUCCESS,
+                                   opt.as_failure_threshold,
+                                   opt.as_retry_interval_ms);
 
     _scscf_sproutlet = new SCSCFSproutlet(PROXY_SERVICE_NAME,
                                           opt.prefix_scscf,
@@ -158,7 +162,9 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                           opt.session_continued_timeout_ms,
                                           opt.session_terminated_timeout_ms,
                                           sess_term_as_tracker,
-                                          sess_cont_as_tracker);
+                                          sess_cont_as_tracker,
+                                          opt.local_terminating_shortcut,
+                                          opt.cache_served_user_state);
     ok = ok && _scscf_sproutlet->init();
     sproutlets.push_front(_scscf_sproutlet);
 
@@ -189,7 +195,9 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                                   subscriber_manager,
                                                   scscf_acr_factory,
                                                   opt.reg_max_expires,
-                                                  &reg_stats_tbls);
+                                                  &reg_stats_tbls,
+                                                  opt.initial_register_rate,
+                                                  opt.register_retry_after);
 
     ok = ok && _registrar_sproutlet->init();
     sproutlets.push_front(_registrar_sproutlet);
@@ -223,7 +231,15 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                     analytics_logger,
                                     &auth_stats_tbls,
                                     opt.nonce_count_supported,
-                                    opt.sub_max_expires);
+                                    opt.sub_max_expires,
+                                    exception_handler,
+                                    opt.impi_write_threads,
+                                    opt.impi_cache_ttl,
+                                    opt.impi_remote_store_timeout,
+                                    opt.av_prefetch_count,
+                                    opt.av_prefetch_ttl,
+                                    opt.auth_credential_cache_ttl,
+                                    opt.auth_timeout_batch_ms);
       ok = ok && _auth_sproutlet->init();
       sproutlets.push_front(_auth_sproutlet);
     }
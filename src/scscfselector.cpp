@@ -35,7 +35,13 @@ SCSCFSelector::SCSCFSelector(const std::string& fallback_scscf_uri,
 
 void SCSCFSelector::update_scscf()
 {
-  std::vector<scscf_t> new_scscfs;
+  std::shared_ptr<scscf_config_t> new_config_ptr =
+                                       std::make_shared<scscf_config_t>();
+  std::vector<scscf_t>& new_scscfs = new_config_ptr->scscfs;
+
+  // The capabilities of each S-CSCF, which are converted to bitsets once
+  // we know all the capabilities.
+  std::vector<std::vector<int>> new_capabilities;
 
   struct stat s;
   if ((stat(_configuration.c_str(), &s) != 0) &&
@@ -108,14 +114,8 @@ void SCSCFSelector::update_scscf()
                 capabilities_vec.push_back((*cap_it).GetInt());
               }
 
-              // Sort the capabilities and remove duplicates
-              std::sort(capabilities_vec.begin(), capabilities_vec.end());
-              capabilities_vec.erase(unique(capabilities_vec.begin(),
-                                            capabilities_vec.end()),
-                                     capabilities_vec.end() );
-              new_scscf.capabilities = capabilities_vec;
               new_scscfs.push_back(new_scscf);
-              capabilities_vec.clear();
+              new_capabilities.push_back(capabilities_vec);
             }
             catch (JsonFormatError err)
             {
@@ -144,11 +144,31 @@ void SCSCFSelector::update_scscf()
     new_scscf.priority = 0;
     new_scscf.weight = 100;
     new_scscfs.push_back(new_scscf);
+    new_capabilities.push_back(std::vector<int>());
+  }
+
+  // Give each capability a bit, and work out each S-CSCF's capabilities.
+  std::map<int, size_t>& cap_bit = new_config_ptr->cap_bit;
+
+  for (const std::vector<int>& capabilities : new_capabilities)
+  {
+    for (int capability : capabilities)
+    {
+      cap_bit.insert(std::make_pair(capability, cap_bit.size()));
+    }
+  }
+
+  new_config_ptr->cap_words = (cap_bit.size() + 63) / 64;
+
+  for (size_t ii = 0; ii < new_scscfs.size(); ++ii)
+  {
+    to_cap_bits(*new_config_ptr,
+                new_capabilities[ii],
+                new_scscfs[ii].capabilities);
   }
 
-  // Take a write lock on the mutex in RAII style
-  boost::lock_guard<boost::shared_mutex> write_lock(_scscfs_rw_lock);
-  _scscfs = new_scscfs;
+  // Publish the new S-CSCFs.
+  _scscfs.set(new_config_ptr);
 }
 
 SCSCFSelector::~SCSCFSelector()
@@ -158,87 +178,147 @@ SCSCFSelector::~SCSCFSelector()
   _updater = NULL;
 }
 
-std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
-                                     const std::vector<int> &optional,
-                                     const std::vector<std::string> &rejects,
-                                     SAS::TrailId trail)
+bool SCSCFSelector::to_cap_bits(const scscf_config_t& config,
+                                const std::vector<int>& capabilities,
+                                cap_bits_t& cap_bits)
 {
-  // Take a read lock on the mutex in RAII style. See
-  // http://www.boost.org/doc/libs/1_41_0/doc/html/thread/synchronization.html
-  // for documentation.
-  boost::shared_lock<boost::shared_mutex> read_lock(_scscfs_rw_lock);
+  bool all_known = true;
+  cap_bits.assign(config.cap_words, 0);
 
-  // There's at least one S-CSCF, so check if any match the capabilities requested
-  std::string reject_str;
-  for (std::vector<std::string>::const_iterator ii = rejects.begin(); ii != rejects.end(); ++ii)
+  for (int capability : capabilities)
   {
-    reject_str = reject_str + *ii + ";";
+    std::map<int, size_t>::const_iterator bit = config.cap_bit.find(capability);
+
+    if (bit != config.cap_bit.end())
+    {
+      cap_bits[bit->second / 64] |= ((uint64_t)1 << (bit->second % 64));
+    }
+    else
+    {
+      all_known = false;
+    }
   }
 
-  // Sort the mandatory capabilities, and remove duplicates.
-  std::vector<int> mandatory_cap = mandatory;
-  std::sort(mandatory_cap.begin(), mandatory_cap.end());
-  mandatory_cap.erase(unique(mandatory_cap.begin(), mandatory_cap.end()), mandatory_cap.end());
-  std::string mandatory_str;
-  for (std::vector<int>::const_iterator ii = mandatory_cap.begin(); ii != mandatory_cap.end(); ++ii)
+  return all_known;
+}
+
+std::string SCSCFSelector::caps_str(const std::vector<int>& capabilities)
+{
+  // Sort the capabilities, and remove duplicates.
+  std::vector<int> sorted_caps = capabilities;
+  std::sort(sorted_caps.begin(), sorted_caps.end());
+  sorted_caps.erase(unique(sorted_caps.begin(), sorted_caps.end()),
+                    sorted_caps.end());
+
+  std::string str;
+  for (int capability : sorted_caps)
   {
-    mandatory_str = mandatory_str + std::to_string(*ii) + ";";
+    str.append(std::to_string(capability)).append(";");
   }
 
-  // Sort the optional capabilities, and remove duplicates.
-  std::vector<int> optional_cap = optional;
-  std::sort(optional_cap.begin(), optional_cap.end());
-  optional_cap.erase(unique(optional_cap.begin(), optional_cap.end()), optional_cap.end());
-  std::string optional_str;
-  for (std::vector<int>::const_iterator ii = optional_cap.begin(); ii != optional_cap.end(); ++ii)
+  return str;
+}
+
+void SCSCFSelector::report_selected(const scscf_t& scscf,
+                                    const std::vector<int>& mandatory,
+                                    const std::vector<int>& optional,
+                                    const std::vector<std::string>& rejects,
+                                    SAS::TrailId trail)
+{
+  TRC_DEBUG("Selected S-CSCF is %s",  scscf.server.c_str());
+
+  std::string reject_str;
+  for (const std::string& reject : rejects)
   {
-    optional_str = optional_str + std::to_string(*ii) + ";";
+    reject_str.append(reject).append(";");
   }
 
+  SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
+  event.add_var_param(scscf.server);
+  event.add_var_param(caps_str(mandatory));
+  event.add_var_param(caps_str(optional));
+  std::string priority_str = std::to_string(scscf.priority);
+  std::string weight_str = std::to_string(scscf.weight);
+  event.add_var_param(priority_str);
+  event.add_var_param(weight_str);
+  event.add_var_param(reject_str);
+  SAS::report_event(event);
+}
+
+std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
+                                     const std::vector<int> &optional,
+                                     const std::vector<std::string> &rejects,
+                                     SAS::TrailId trail)
+{
+  // Take a reference to the current S-CSCFs, which keeps them valid for the
+  // rest of this function even if the configuration is reloaded.
+  std::shared_ptr<const scscf_config_t> config = _scscfs.get();
+
+  // Convert the requested capabilities to bitsets.  No S-CSCF can match if
+  // any of the mandatory capabilities aren't known, and optional capabilities
+  // that aren't known can't be matched so are ignored.
+  cap_bits_t mandatory_cap;
+  cap_bits_t optional_cap;
+  bool mandatory_known = to_cap_bits(*config, mandatory, mandatory_cap);
+  to_cap_bits(*config, optional, optional_cap);
+
   // Find all S-CSCFs that have all the mandatory capabilities, the highest possible number
   // of optional capabilities, and the highest priority (closest to 0).
   // Also sum up the weights of the valid S-CSCFs as part of the iteration
-  std::vector<scscf> matches;
-  u_int max_size = 0;
+  std::vector<const scscf_t*> matches;
+  int max_size = 0;
   int priority = 0;
   int sum = 0;
 
-  for (std::vector<scscf>::iterator it=_scscfs.begin(); it!=_scscfs.end(); ++it)
+  for (std::vector<scscf_t>::const_iterator it = config->scscfs.begin();
+       (mandatory_known) && (it != config->scscfs.end());
+       ++it)
   {
-    // Only include the S-CSCF if its name isn't in the list of S-CSCFs to reject and it has all of
-    // the mandatory capabilities
-    if ((std::find(rejects.begin(), rejects.end(), it->server) == rejects.end()) &&
-        (std::includes(it->capabilities.begin(), it->capabilities.end(), mandatory_cap.begin(), mandatory_cap.end())))
+    // Only include the S-CSCF if it has all of the mandatory capabilities and
+    // its name isn't in the list of S-CSCFs to reject.
+    bool has_mandatory = true;
+    int num_optional = 0;
+
+    for (size_t ii = 0; ii < config->cap_words; ++ii)
     {
-      std::vector<int> intersection;
-      std::set_intersection(it->capabilities.begin(), it->capabilities.end(),
-                            optional_cap.begin(), optional_cap.end(),
-                            std::back_inserter(intersection));
+      if ((mandatory_cap[ii] & ~it->capabilities[ii]) != 0)
+      {
+        has_mandatory = false;
+        break;
+      }
 
-      if (intersection.size() > max_size ||
-          matches.size() == 0)
+      num_optional += __builtin_popcountll(optional_cap[ii] & it->capabilities[ii]);
+    }
+
+    if ((!has_mandatory) ||
+        (std::find(rejects.begin(), rejects.end(), it->server) != rejects.end()))
+    {
+      continue;
+    }
+
+    if (num_optional > max_size ||
+        matches.size() == 0)
+    {
+      matches.clear();
+      matches.push_back(&(*it));
+      max_size = num_optional;
+      priority = it->priority;
+      sum = it->weight;
+    }
+    else if (num_optional == max_size)
+    {
+      if (it->priority == priority)
+      {
+        matches.push_back(&(*it));
+        sum += it->weight;
+      }
+      else if (it->priority < priority)
       {
         matches.clear();
-        matches.push_back(*it);
-        max_size = intersection.size();
+        matches.push_back(&(*it));
         priority = it->priority;
         sum = it->weight;
       }
-      else if (intersection.size() == max_size)
-      {
-        if (it->priority == priority)
-        {
-          matches.push_back(*it);
-          sum += it->weight;
-        }
-        else if (it->priority < priority)
-        {
-          matches.clear();
-          matches.push_back(*it);
-          priority = it->priority;
-          sum = it->weight;
-        }
-      }
     }
   }
 
@@ -247,12 +327,19 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
   // If there's only one match, then return its name.
   if (matches.empty())
   {
+    std::string mandatory_str = caps_str(mandatory);
     TRC_WARNING("There are no configured S-CSCFs that have the requested mandatory capabilities (%s)",
                 mandatory_str.c_str());
 
+    std::string reject_str;
+    for (const std::string& reject : rejects)
+    {
+      reject_str.append(reject).append(";");
+    }
+
     SAS::Event event(trail, SASEvent::SCSCF_NONE_VALID, 0);
     event.add_var_param(mandatory_str);
-    event.add_var_param(optional_str);
+    event.add_var_param(caps_str(optional));
     event.add_var_param(reject_str);
     SAS::report_event(event);
 
@@ -260,20 +347,8 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
   }
   else if (matches.size() == 1)
   {
-    TRC_DEBUG("Selected S-CSCF is %s",  matches[0].server.c_str());
-
-    SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-    event.add_var_param(matches[0].server);
-    event.add_var_param(mandatory_str);
-    event.add_var_param(optional_str);
-    std::string priority_str = std::to_string(matches[0].priority);
-    std::string weight_str = std::to_string(matches[0].weight);
-    event.add_var_param(priority_str);
-    event.add_var_param(weight_str);
-    event.add_var_param(reject_str);
-    SAS::report_event(event);
-
-    return matches[0].server.c_str();
+    report_selected(*matches[0], mandatory, optional, rejects, trail);
+    return matches[0]->server;
   }
 
   // There are multiple S-CSCFs that match on all mandatory capabilities, the highest number of optional
@@ -282,26 +357,14 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
   int random = (sum != 0) ? rand() % sum : 0;
 
   int index = 0;
-  int accumulator = matches[index].weight;
+  int accumulator = matches[index]->weight;
 
   while (accumulator <= random)
   {
     index++;
-    accumulator +=  matches[index].weight;
+    accumulator +=  matches[index]->weight;
   }
 
-  TRC_DEBUG("Selected S-CSCF is %s",  matches[index].server.c_str());
-
-  SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-  event.add_var_param(matches[index].server);
-  event.add_var_param(mandatory_str);
-  event.add_var_param(optional_str);
-  std::string priority_str = std::to_string(matches[index].priority);
-  std::string weight_str = std::to_string(matches[index].weight);
-  event.add_var_param(priority_str);
-  event.add_var_param(weight_str);
-  event.add_var_param(reject_str);
-  SAS::report_event(event);
-
-  return matches[index].server;
+  report_selected(*matches[index], mandatory, optional, rejects, trail);
+  return matches[index]->server;
 }
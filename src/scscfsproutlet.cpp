@@ -22,6 +22,7 @@
 #include "wildcard_utils.h"
 #include "associated_uris.h"
 #include "scscf_utils.h"
+#include "as_connection_pools.h"
 
 // Constant indicating there is no served user for a request.
 const char* NO_SERVED_USER = "";
@@ -48,7 +49,9 @@ SCSCFSproutlet::SCSCFSproutlet(const std::string& name,
                                int session_continued_timeout_ms,
                                int session_terminated_timeout_ms,
                                AsCommunicationTracker* sess_term_as_tracker,
-                               AsCommunicationTracker* sess_cont_as_tracker) :
+                               AsCommunicationTracker* sess_cont_as_tracker,
+                               bool local_terminating_shortcut,
+                               bool cache_served_user_state) :
   Sproutlet(name,
             port,
             uri,
@@ -67,6 +70,8 @@ SCSCFSproutlet::SCSCFSproutlet(const std::string& name,
   _enum_service(enum_service),
   _acr_factory(acr_factory),
   _override_npdi(override_npdi),
+  _local_terminating_shortcut(local_terminating_shortcut),
+  _cache_served_user_state(cache_served_user_state),
   _fifcservice(fifcservice),
   _ifc_configuration(ifc_configuration),
   _session_continued_timeout_ms(session_continued_timeout_ms),
@@ -128,6 +133,13 @@ bool SCSCFSproutlet::init()
     init_success = false;
     // LCOV_EXCL_STOP
   }
+  else
+  {
+    // Most transactions use the cluster URI unchanged as their S-CSCF URI, so
+    // print it once here.
+    _scscf_cluster_uri_routing_str =
+      PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, _scscf_cluster_uri);
+  }
 
   _scscf_node_uri = PJUtils::uri_from_string(_scscf_node_uri_str, stack_data.pool, false);
 
@@ -257,6 +269,29 @@ void SCSCFSproutlet::get_bindings(const std::string& aor,
   // TODO - Log bindings to SAS
 }
 
+bool SCSCFSproutlet::is_registered_locally(const std::string& public_id,
+                                           SAS::TrailId trail)
+{
+  HSSConnection::irs_info irs_info;
+  std::string aor_id;
+
+  if ((_sm->get_cached_subscriber_state(public_id,
+                                        irs_info,
+                                        trail) != HTTP_OK) ||
+      (irs_info._regstate != RegDataXMLUtils::STATE_REGISTERED) ||
+      (!irs_info._associated_uris.get_default_impu(aor_id, false)))
+  {
+    return false;
+  }
+
+  Bindings bindings;
+  get_bindings(aor_id, bindings, trail);
+  bool registered = !bindings.empty();
+  free_bindings(bindings);
+
+  return registered;
+}
+
 
 // Frees the bindings object returned by the SM, as this is owned by the S-CSCF
 // sproutlet.
@@ -315,32 +350,61 @@ ACR* SCSCFSproutlet::get_acr(SAS::TrailId trail,
 }
 
 
-void SCSCFSproutlet::track_app_serv_comm_failure(const std::string& uri,
-                                                 const std::string& reason,
-                                                 DefaultHandling default_handling)
+AsCommunicationTracker* SCSCFSproutlet::app_serv_tracker(AsChainLink& as_chain_link,
+                                                         AsCommunicationTracker::AsSlot*& slot)
+{
+  AsCommunicationTracker* as_tracker =
+                  (as_chain_link.default_handling() == SESSION_CONTINUED) ?
+                  _sess_cont_as_tracker :
+                  _sess_term_as_tracker;
+
+  if (as_tracker != NULL)
+  {
+    slot = as_chain_link.tracker_slot();
+
+    if (slot == NULL)
+    {
+      slot = as_tracker->slot(as_chain_link.uri());
+      as_chain_link.set_tracker_slot(slot);
+    }
+  }
+
+  return as_tracker;
+}
+
+
+void SCSCFSproutlet::track_app_serv_comm_failure(AsChainLink& as_chain_link,
+                                                 const std::string& reason)
 {
-  AsCommunicationTracker* as_tracker = (default_handling == SESSION_CONTINUED) ?
-                                       _sess_cont_as_tracker :
-                                       _sess_term_as_tracker;
+  AsCommunicationTracker::AsSlot* slot;
+  AsCommunicationTracker* as_tracker = app_serv_tracker(as_chain_link, slot);
+
   if (as_tracker != NULL)
   {
-    as_tracker->on_failure(uri, reason);
+    as_tracker->on_failure(slot, reason);
   }
 }
 
 
-void SCSCFSproutlet::track_app_serv_comm_success(const std::string& uri,
-                                                 DefaultHandling default_handling)
+void SCSCFSproutlet::track_app_serv_comm_success(AsChainLink& as_chain_link)
 {
-  AsCommunicationTracker* as_tracker = (default_handling == SESSION_CONTINUED) ?
-                                       _sess_cont_as_tracker :
-                                       _sess_term_as_tracker;
+  AsCommunicationTracker::AsSlot* slot;
+  AsCommunicationTracker* as_tracker = app_serv_tracker(as_chain_link, slot);
+
   if (as_tracker != NULL)
   {
-    as_tracker->on_success(uri);
+    as_tracker->on_success(slot);
   }
 }
 
+bool SCSCFSproutlet::app_serv_circuit_open(AsChainLink& as_chain_link)
+{
+  AsCommunicationTracker::AsSlot* slot;
+  AsCommunicationTracker* as_tracker = app_serv_tracker(as_chain_link, slot);
+
+  return ((as_tracker != NULL) && (as_tracker->is_circuit_open(slot)));
+}
+
 uint64_t SCSCFSproutlet::track_session_setup_time(uint64_t tsx_start_time_usec,
                                               bool video_call)
 {
@@ -468,10 +532,8 @@ void SCSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 
   // Pull out the P-Profile-Key header if it exists. We must do this before
   // sending any requests to the HSS.
-  pjsip_routing_hdr* ppk_hdr = (pjsip_routing_hdr*)pjsip_msg_find_hdr_by_name(
-                                                   req,
-                                                   &STR_P_PROFILE_KEY,
-                                                   NULL);
+  const pjsip_routing_hdr* ppk_hdr = (const pjsip_routing_hdr*)
+                       PJUtils::peek_hdr_by_name(req, &STR_P_PROFILE_KEY);
 
   if (ppk_hdr != NULL)
   {
@@ -703,14 +765,13 @@ void SCSCFSproutletTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
     _se_helper.process_response(rsp, get_pool(rsp), trail());
   }
 
-  // Pass the received response to the ACR.
+  // Pass the received response to the ACR.  This doesn't need the ACR lock,
+  // so responses on different forks don't contend for it.
   // @TODO - timestamp from response???
   ACR* acr = get_acr();
   if (acr != NULL)
   {
-    acr->lock();
     acr->rx_response(rsp);
-    acr->unlock();
   }
 
   if (_liveness_timer != 0)
@@ -782,9 +843,8 @@ void SCSCFSproutletTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
       {
         // Default handling will be triggered. Track this as a failed
         // communication.
-        _scscf->track_app_serv_comm_failure(_as_chain_link.uri(),
-                                            fork_failure_reason_as_string(fork_id, st_code),
-                                            _as_chain_link.default_handling());
+        _scscf->track_app_serv_comm_failure(_as_chain_link,
+                                            fork_failure_reason_as_string(fork_id, st_code));
 
         if (_as_chain_link.default_handling() == SESSION_CONTINUED)
         {
@@ -837,8 +897,7 @@ void SCSCFSproutletTsx::on_rx_response(pjsip_msg* rsp, int fork_id)
         // receive we only track one success.
         if ((st_code > PJSIP_SC_TRYING) && (!_seen_1xx))
         {
-          _scscf->track_app_serv_comm_success(_as_chain_link.uri(),
-                                              _as_chain_link.default_handling());
+          _scscf->track_app_serv_comm_success(_as_chain_link);
         }
       }
     }
@@ -1060,6 +1119,18 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
     // Set the S-CSCF URI to the one we stored in the AsChain
     _scscf_uri = _as_chain_link.scscf_uri();
 
+    // Use the served user's subscriber state stored in the AsChain, rather
+    // than reading it from the HSS again every time the request comes back
+    // from an AS.
+    const HSSConnection::irs_info* irs_info = _as_chain_link.irs_info();
+    if ((irs_info != NULL) && (!_hss_data_cached))
+    {
+      TRC_DEBUG("Using subscriber state for %s stored in AsChain",
+                _as_chain_link.served_user().c_str());
+      _irs_info = *irs_info;
+      store_hss_data(_as_chain_link.served_user());
+    }
+
     bool retargeted = false;
     std::string served_user = served_user_from_msg(req);
 
@@ -1098,7 +1169,7 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
         // Note that there's no need to change orig_ioi - we don't
         // actually become the originating server when we do this redirect.
         pjsip_p_c_v_hdr* pcv = (pjsip_p_c_v_hdr*)
-                               pjsip_msg_find_hdr_by_name(req, &STR_P_C_V, NULL);
+                               PJUtils::find_hdr_by_name(req, &STR_P_C_V, NULL);
         if (pcv)
         {
           TRC_DEBUG("Blanking out term_ioi parameter due to redirect");
@@ -1232,22 +1303,30 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
 
       // Before looking up the iFCs, calculate the S-CSCF URI to use for this
       // transaction, using the configured S-CSCF URI as a starting point.
-      pjsip_sip_uri* scscf_uri = (pjsip_sip_uri*)pjsip_uri_clone(get_pool(req),
-                                                                 _scscf->_scscf_cluster_uri);
+      _scscf_uri = _scscf->_scscf_cluster_uri_routing_str;
       pjsip_sip_uri* routing_uri = get_routing_uri(req);
 
       // If the URI that routed to this Sproutlet isn't reflexive, just ignore it
-      // and use the configured scscf uri
+      // and use the configured scscf uri.  Likewise if it has the same local
+      // hostname as the configured URI, as then the configured URI is
+      // unchanged.
       if ((routing_uri != nullptr) && is_uri_reflexive((pjsip_uri*)routing_uri))
       {
-        SCSCFUtils::get_scscf_uri(get_pool(req),
-                                  get_local_hostname(routing_uri),
-                                  get_local_hostname(scscf_uri),
-                                  scscf_uri);
-      }
+        pjsip_sip_uri* scscf_uri = (pjsip_sip_uri*)_scscf->_scscf_cluster_uri;
+        std::string received_local_hostname = get_local_hostname(routing_uri);
+        std::string scscf_local_hostname = get_local_hostname(scscf_uri);
 
-      _scscf_uri = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                          (pjsip_uri*)scscf_uri);
+        if (received_local_hostname != scscf_local_hostname)
+        {
+          scscf_uri = (pjsip_sip_uri*)pjsip_uri_clone(get_pool(req), scscf_uri);
+          SCSCFUtils::get_scscf_uri(get_pool(req),
+                                    received_local_hostname,
+                                    scscf_local_hostname,
+                                    scscf_uri);
+          _scscf_uri = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
+                                              (pjsip_uri*)scscf_uri);
+        }
+      }
 
       TRC_DEBUG("Looking up iFCs for %s for new AS chain", served_user.c_str());
       Ifcs ifcs;
@@ -1397,7 +1476,10 @@ AsChainLink SCSCFSproutletTsx::create_as_chain(Ifcs ifcs,
                                                  acr,
                                                  _scscf->fifcservice(),
                                                  _scscf->ifc_configuration(),
-                                                 _scscf_uri);
+                                                 _scscf_uri,
+                                                 ((_scscf->_cache_served_user_state) &&
+                                                  (_hss_data_cached)) ?
+                                                   &_irs_info : NULL);
   acr = NULL;
   TRC_DEBUG("S-CSCF sproutlet transaction %p linked to AsChain %s",
             this, ret.to_string().c_str());
@@ -1412,7 +1494,7 @@ void SCSCFSproutletTsx::apply_originating_services(pjsip_msg* req)
 
   // Add ourselves as orig-IOI.
   pjsip_p_c_v_hdr* pcv = (pjsip_p_c_v_hdr*)
-                             pjsip_msg_find_hdr_by_name(req, &STR_P_C_V, NULL);
+                             PJUtils::find_hdr_by_name(req, &STR_P_C_V, NULL);
   if (pcv)
   {
     pcv->orig_ioi = PJUtils::domain_from_uri(_as_chain_link.served_user(),
@@ -1436,9 +1518,17 @@ void SCSCFSproutletTsx::apply_originating_services(pjsip_msg* req)
   }
   else if (!server_name.empty())
   {
-    // We've should have identified an application server to be invoked, so
-    // encode the app server hop and the return hop in Route headers.
-    route_to_as(req, server_name);
+    if (_scscf->app_serv_circuit_open(_as_chain_link))
+    {
+      // The AS has been failing, so don't wait for it to time out.
+      bypass_failed_as(req);
+    }
+    else
+    {
+      // We've should have identified an application server to be invoked, so
+      // encode the app server hop and the return hop in Route headers.
+      route_to_as(req, server_name);
+    }
   }
   else
   {
@@ -1455,31 +1545,22 @@ void SCSCFSproutletTsx::apply_originating_services(pjsip_msg* req)
     if (_scscf->_enum_service)
     {
       // Attempt to translate the RequestURI using ENUM or an alternative
-      // database.
-      _scscf->translate_request_uri(req, get_pool(req), trail());
-
-      URIClass uri_class = URIClassifier::classify_uri(req->line.req.uri, true, true);
-      if ((uri_class == LOCAL_PHONE_NUMBER) ||
-          (uri_class == GLOBAL_PHONE_NUMBER) ||
-          (uri_class == NP_DATA) ||
-          (uri_class == FINAL_NP_DATA))
-      {
-        route_to_bgcf(req, SASEvent::PHONE_ROUTING_TO_BGCF);
-      }
-      else if (uri_class == OFFNET_SIP_URI)
+      // database.  If the lookup needs network I/O, wait for it without
+      // blocking this thread.
+      std::string user;
+
+      if (!_scscf->_enum_service->has_async_lookup())
       {
-        // Destination is off-net, so route to the BGCF.
-        route_to_bgcf(req, SASEvent::OFFNET_ROUTING_TO_BGCF);
+        _scscf->translate_request_uri(req, get_pool(req), trail());
+        route_translated_request(req);
       }
-      else if (uri_class != UNKNOWN)
+      else if (PJUtils::enum_user_to_translate(req, user, trail()))
       {
-        // Destination is on-net so route to the I-CSCF.
-        route_to_icscf(req);
+        translate_and_route_async(req, user);
       }
       else
       {
-        // Non-sip: or -tel: URI is invalid at this point, so just reject the request
-        reject_invalid_uri(req);
+        route_translated_request(req);
       }
     }
     else
@@ -1515,7 +1596,7 @@ void SCSCFSproutletTsx::apply_terminating_services(pjsip_msg* req)
 {
   // Include ourselves as the terminating operator for billing.
   pjsip_p_c_v_hdr* pcv = (pjsip_p_c_v_hdr*)
-                             pjsip_msg_find_hdr_by_name(req, &STR_P_C_V, NULL);
+                             PJUtils::find_hdr_by_name(req, &STR_P_C_V, NULL);
   if (pcv)
   {
     pcv->term_ioi = PJUtils::domain_from_uri(_as_chain_link.served_user(),
@@ -1539,9 +1620,17 @@ void SCSCFSproutletTsx::apply_terminating_services(pjsip_msg* req)
   }
   else if (!server_name.empty())
   {
-    // We've should have identified an application server to be invoked, so
-    // encode the app server hop and the return hop in Route headers.
-    route_to_as(req, server_name);
+    if (_scscf->app_serv_circuit_open(_as_chain_link))
+    {
+      // The AS has been failing, so don't wait for it to time out.
+      bypass_failed_as(req);
+    }
+    else
+    {
+      // We've should have identified an application server to be invoked, so
+      // encode the app server hop and the return hop in Route headers.
+      route_to_as(req, server_name);
+    }
   }
   else
   {
@@ -1577,6 +1666,44 @@ void SCSCFSproutletTsx::apply_terminating_services(pjsip_msg* req)
 }
 
 
+// Apply the default handling for an AS whose circuit breaker is open, without
+// sending it the request.
+void SCSCFSproutletTsx::bypass_failed_as(pjsip_msg* req)
+{
+  TRC_INFO("Not invoking Application Server %s as it is failing",
+           _as_chain_link.uri().c_str());
+
+  if (_as_chain_link.default_handling() == SESSION_CONTINUED)
+  {
+    TRC_DEBUG("Trigger default_handling=CONTINUED processing");
+    SAS::Event bypass_as(trail(), SASEvent::BYPASS_AS, 2);
+    bypass_as.add_var_param("AS is failing so was not invoked");
+    bypass_as.add_static_param(_as_chain_link.complete());
+    SAS::report_event(bypass_as);
+
+    _as_chain_link = _as_chain_link.next();
+    if (_session_case->is_originating())
+    {
+      apply_originating_services(req);
+    }
+    else
+    {
+      apply_terminating_services(req);
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Trigger default_handling=TERMINATED processing");
+    SAS::Event as_failed(trail(), SASEvent::AS_FAILED, 1);
+    SAS::report_event(as_failed);
+
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_REQUEST_TIMEOUT);
+    free_msg(req);
+    send_response(rsp);
+  }
+}
+
+
 // Attempt to route the request to an application server.
 void SCSCFSproutletTsx::route_to_as(pjsip_msg* req, const std::string& server_name)
 {
@@ -1591,6 +1718,9 @@ void SCSCFSproutletTsx::route_to_as(pjsip_msg* req, const std::string& server_na
   if ((as_uri != NULL) &&
       (PJSIP_URI_SCHEME_IS_SIP(as_uri)))
   {
+    // Note the AS as a target for connection pooling.
+    ASConnectionPools::add_target(as_uri);
+
     // AS URI is valid, so encode the AS hop and the return hop in Route headers.
     std::string odi_value = PJUtils::pj_str_to_string(&STR_ODI_PREFIX) +
                             _as_chain_link.next_odi_token();
@@ -1709,6 +1839,17 @@ void SCSCFSproutletTsx::route_to_icscf(pjsip_msg* req)
 {
   const pjsip_uri* icscf_uri = _scscf->icscf_uri();
 
+  if ((icscf_uri != NULL) &&
+      (_scscf->_local_terminating_shortcut) &&
+      (_scscf->is_registered_locally(PJUtils::public_id_from_uri(req->line.req.uri),
+                                     trail())))
+  {
+    // The target is registered with this S-CSCF, so there's no need for the
+    // I-CSCF to look up where it is.  Route straight to the local S-CSCF,
+    // which applies the target's terminating services as normal.
+    icscf_uri = NULL;
+  }
+
   if (icscf_uri != NULL)
   {
     // I-CSCF is enabled, so route to it.
@@ -1720,7 +1861,8 @@ void SCSCFSproutletTsx::route_to_icscf(pjsip_msg* req)
   }
   else
   {
-    // I-CSCF is disabled, so route directly to the local S-CSCF.
+    // I-CSCF is disabled (or isn't needed for this target), so route
+    // directly to the local S-CSCF.
     const pjsip_uri* scscf_uri = _scscf->scscf_cluster_uri();
     TRC_INFO("Routing directly to S-CSCF %s",
              PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, scscf_uri).c_str());
@@ -1732,6 +1874,61 @@ void SCSCFSproutletTsx::route_to_icscf(pjsip_msg* req)
 }
 
 
+// Translate the RequestURI using ENUM asynchronously, and then route the
+// request.
+void SCSCFSproutletTsx::translate_and_route_async(pjsip_msg* req,
+                                                  const std::string& user)
+{
+  SproutletTsxHelper::Resumer resume = defer_processing();
+  _scscf->_enum_service->memoized_lookup_uri_from_user_async(
+    user,
+    [this, req, resume](std::string uri)
+    {
+      // This can be called on any thread, so don't touch the request until
+      // the processing has been resumed.
+      resume([this, req, uri]()
+      {
+        PJUtils::apply_enum_translation(req,
+                                        get_pool(req),
+                                        uri,
+                                        _scscf->should_override_npdi(),
+                                        trail());
+        route_translated_request(req);
+      });
+    },
+    trail());
+}
+
+
+// Route a request once its RequestURI has been translated using ENUM.
+void SCSCFSproutletTsx::route_translated_request(pjsip_msg* req)
+{
+  URIClass uri_class = URIClassifier::classify_uri(req->line.req.uri, true, true);
+  if ((uri_class == LOCAL_PHONE_NUMBER) ||
+      (uri_class == GLOBAL_PHONE_NUMBER) ||
+      (uri_class == NP_DATA) ||
+      (uri_class == FINAL_NP_DATA))
+  {
+    route_to_bgcf(req, SASEvent::PHONE_ROUTING_TO_BGCF);
+  }
+  else if (uri_class == OFFNET_SIP_URI)
+  {
+    // Destination is off-net, so route to the BGCF.
+    route_to_bgcf(req, SASEvent::OFFNET_ROUTING_TO_BGCF);
+  }
+  else if (uri_class != UNKNOWN)
+  {
+    // Destination is on-net so route to the I-CSCF.
+    route_to_icscf(req);
+  }
+  else
+  {
+    // Non-sip: or -tel: URI is invalid at this point, so just reject the request
+    reject_invalid_uri(req);
+  }
+}
+
+
 // Route the request to the BGCF.
 void SCSCFSproutletTsx::route_to_bgcf(pjsip_msg* req, int reason)
 {
@@ -1993,11 +2190,6 @@ HTTPCode SCSCFSproutletTsx::get_data_from_hss(std::string public_id)
     irs_query._cache_allowed = !_auto_reg;
 
     http_code = read_hss_data(public_id, irs_query);
-
-    if (http_code == HTTP_OK)
-    {
-      _hss_data_cached = true;
-    }
   }
 
   return http_code;
@@ -2013,21 +2205,29 @@ HTTPCode SCSCFSproutletTsx::read_hss_data(std::string public_id,
 
   if (http_code == HTTP_OK)
   {
-    _ifcs = _irs_info._service_profiles[irs_query._public_id];
-
-    // Get the default URI. This should always succeed.
-    _irs_info._associated_uris.get_default_impu(_default_uri, true);
-
-    // We may want to route to bindings that are barred (in case of an
-    // emergency), so get all the URIs.
-    _registered = (_irs_info._regstate == RegDataXMLUtils::STATE_REGISTERED);
-    _barred = _irs_info._associated_uris.is_impu_barred(irs_query._public_id);
+    store_hss_data(irs_query._public_id);
   }
 
   return http_code;
 }
 
 
+void SCSCFSproutletTsx::store_hss_data(const std::string& public_id)
+{
+  _ifcs = _irs_info._service_profiles[public_id];
+
+  // Get the default URI. This should always succeed.
+  _irs_info._associated_uris.get_default_impu(_default_uri, true);
+
+  // We may want to route to bindings that are barred (in case of an
+  // emergency), so get all the URIs.
+  _registered = (_irs_info._regstate == RegDataXMLUtils::STATE_REGISTERED);
+  _barred = _irs_info._associated_uris.is_impu_barred(public_id);
+
+  _hss_data_cached = true;
+}
+
+
 void SCSCFSproutletTsx::add_to_dialog(pjsip_msg* msg,
                                       bool bill_this_hop,
                                       ACR::NodeRole acr_billing_role)
@@ -2180,9 +2380,8 @@ void SCSCFSproutletTsx::on_timer_expiry(void* context)
   if (_as_chain_link.is_set())
   {
     // The AS has timed out so track this as a communication failure.
-    _scscf->track_app_serv_comm_failure(_as_chain_link.uri(),
-                                        "Default handling timeout",
-                                        _as_chain_link.default_handling());
+    _scscf->track_app_serv_comm_failure(_as_chain_link,
+                                        "Default handling timeout");
 
     // The request was routed to a downstream AS, so cancel any outstanding
     // forks.
@@ -2260,16 +2459,16 @@ void SCSCFSproutletTsx::add_second_p_a_i_hdr(pjsip_msg* msg)
 
   // Look for P-Asserted-Identity header.
   pjsip_routing_hdr* asserted_id =
-    (pjsip_routing_hdr*)pjsip_msg_find_hdr_by_name(msg,
-                                                   &STR_P_ASSERTED_IDENTITY,
-                                                   NULL);
+    (pjsip_routing_hdr*)PJUtils::find_hdr_by_name(msg,
+                                                  &STR_P_ASSERTED_IDENTITY,
+                                                  NULL);
 
   // If we have one and only one P-Asserted-Identity header we may need to add
   // a second one.
   if ((asserted_id != NULL) &&
-      (pjsip_msg_find_hdr_by_name(msg,
-                                  &STR_P_ASSERTED_IDENTITY,
-                                  asserted_id->next) == NULL))
+      (PJUtils::find_hdr_by_name(msg,
+                                 &STR_P_ASSERTED_IDENTITY,
+                                 asserted_id->next) == NULL))
   {
     std::string new_p_a_i_str;
     pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(&asserted_id->name_addr);
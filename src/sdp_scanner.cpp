@@ -0,0 +1,161 @@
+/**
+ * @file sdp_scanner.cpp Lightweight scanning of SDP bodies.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "sdp_scanner.h"
+
+SdpScanner::SdpScanner(const char* data, size_t len) :
+  _pos(data),
+  _end(data + len)
+{
+  _session_connection.ptr = NULL;
+  _session_connection.slen = 0;
+}
+
+bool SdpScanner::next_line(Line& line)
+{
+  while (_pos < _end)
+  {
+    const char* start = _pos;
+    const char* end = (const char*)memchr(start, '\n', _end - start);
+
+    if (end == NULL)
+    {
+      // Reached the end of the SDP.
+      end = _end;
+      _pos = _end;
+    }
+    else
+    {
+      _pos = end + 1;
+    }
+
+    if ((end > start) && (*(end - 1) == '\r'))
+    {
+      // Line ends in carriage return, so strip it.
+      --end;
+    }
+
+    if (end > start)
+    {
+      // Non-blank line.
+      line.line.ptr = (char*)start;
+      line.line.slen = end - start;
+      line.type = *start;
+
+      if ((end - start >= 2) && (start[1] == '='))
+      {
+        line.value.ptr = (char*)start + 2;
+        line.value.slen = end - start - 2;
+      }
+      else
+      {
+        line.value.ptr = (char*)end;
+        line.value.slen = 0;
+      }
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool SdpScanner::next_media(Media& media)
+{
+  Line line;
+
+  // Find the next m= line, picking up the session's connection information
+  // on the way if this is the first one.
+  do
+  {
+    if (!next_line(line))
+    {
+      return false;
+    }
+
+    if (line.type == 'c')
+    {
+      _session_connection = line.value;
+    }
+  }
+  while (line.type != 'm');
+
+  // The m= line is <media> <port>[/<number of ports>] <proto> <fmt> ...
+  media.line = line.line;
+  pj_str_t fields = line.value;
+  pj_str_t port;
+  next_token(fields, media.media);
+  next_token(fields, port);
+  next_token(fields, media.proto);
+  media.fmts = fields;
+  while ((media.fmts.slen > 0) && (*media.fmts.ptr == ' '))
+  {
+    ++media.fmts.ptr;
+    --media.fmts.slen;
+  }
+
+  media.port = 0;
+  for (pj_ssize_t ii = 0;
+       (ii < port.slen) && (port.ptr[ii] >= '0') && (port.ptr[ii] <= '9');
+       ++ii)
+  {
+    media.port = (media.port * 10) + (port.ptr[ii] - '0');
+  }
+
+  // Look through the rest of the media description for a c= line, stopping
+  // (without consuming it) at the next m= line.
+  media.connection = _session_connection;
+  const char* pos = _pos;
+  while (next_line(line))
+  {
+    if (line.type == 'm')
+    {
+      _pos = pos;
+      break;
+    }
+    else if (line.type == 'c')
+    {
+      media.connection = line.value;
+    }
+
+    pos = _pos;
+  }
+
+  return true;
+}
+
+bool SdpScanner::next_token(pj_str_t& list, pj_str_t& token)
+{
+  while ((list.slen > 0) && (*list.ptr == ' '))
+  {
+    ++list.ptr;
+    --list.slen;
+  }
+
+  if (list.slen == 0)
+  {
+    token.ptr = list.ptr;
+    token.slen = 0;
+    return false;
+  }
+
+  const char* space = (const char*)memchr(list.ptr, ' ', list.slen);
+  pj_ssize_t len = (space != NULL) ? (space - list.ptr) : list.slen;
+
+  token.ptr = list.ptr;
+  token.slen = len;
+  list.ptr += len;
+  list.slen -= len;
+
+  return true;
+}
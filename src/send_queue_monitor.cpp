@@ -0,0 +1,253 @@
+/**
+ * @file send_queue_monitor.cpp Implementation of SendQueueMonitor.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "send_queue_monitor.h"
+#include "pjutils.h"
+#include "log.h"
+
+SendQueueMonitor::SendQueueMonitor(size_t max_queued_bytes,
+                                   SNMP::CounterTable* saturated_tbl) :
+  _max_queued_bytes(max_queued_bytes),
+  _saturated_tbl(saturated_tbl),
+  _lock(),
+  _queues(PJUtils::compare_pj_sockaddr),
+  _last_sweep_ms(now_ms())
+{
+}
+
+SendQueueMonitor::~SendQueueMonitor()
+{
+  for (Queues::iterator queue = _queues.begin();
+       queue != _queues.end();
+       ++queue)
+  {
+    for (Queued& queued : queue->second.msgs)
+    {
+      pjsip_tx_data_dec_ref(queued.tdata);
+    }
+  }
+
+  _queues.clear();
+}
+
+void SendQueueMonitor::on_tx_msg(pjsip_tx_data* tdata)
+{
+  pjsip_transport* tp = tdata->tp_info.transport;
+
+  if ((tp == NULL) || (!(tp->flag & PJSIP_TRANSPORT_RELIABLE)))
+  {
+    // Datagram transports don't queue.
+    return;
+  }
+
+  std::vector<pjsip_tx_data*> sent;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    unsigned long now = now_ms();
+
+    if (now - _last_sweep_ms >= SWEEP_INTERVAL_MS)
+    {
+      release_all_sent(sent);
+      _last_sweep_ms = now;
+    }
+
+    Queues::iterator queue = _queues.find(tp->key.rem_addr);
+
+    if (queue == _queues.end())
+    {
+      char buf[PJ_INET6_ADDRSTRLEN + 10];
+      queue = _queues.emplace(tp->key.rem_addr, Queue()).first;
+      queue->second.remote = pj_sockaddr_print(&tp->key.rem_addr,
+                                               buf,
+                                               sizeof(buf),
+                                               3);
+      queue->second.bytes = 0;
+    }
+    else
+    {
+      // Do this before queuing the new message, as PJSIP doesn't mark it as
+      // being sent until after we've seen it.
+      release_sent(queue->second, sent);
+    }
+
+    size_t bytes = tdata->buf.cur - tdata->buf.start;
+    pjsip_tx_data_add_ref(tdata);
+    queue->second.msgs.push_back(Queued{tdata, bytes});
+    queue->second.bytes += bytes;
+  }
+
+  // Release the messages that have been sent without the lock, as this may
+  // destroy them.
+  for (pjsip_tx_data* sent_tdata : sent)
+  {
+    pjsip_tx_data_dec_ref(sent_tdata);
+  }
+}
+
+bool SendQueueMonitor::is_saturated(const AddrInfo& server)
+{
+  if (server.transport != IPPROTO_TCP)
+  {
+    return false;
+  }
+
+  pj_sockaddr remote;
+  pj_bzero(&remote, sizeof(remote));
+
+  if (server.address.af == AF_INET)
+  {
+    remote.ipv4.sin_family = pj_AF_INET();
+    remote.ipv4.sin_addr.s_addr = server.address.addr.ipv4.s_addr;
+  }
+  else
+  {
+    remote.ipv6.sin6_family = pj_AF_INET6();
+    memcpy((char*)&remote.ipv6.sin6_addr,
+           (char*)&server.address.addr.ipv6,
+           sizeof(pj_in6_addr));
+  }
+
+  pj_sockaddr_set_port(&remote, (pj_uint16_t)server.port);
+
+  return queue_saturated(remote);
+}
+
+bool SendQueueMonitor::is_saturated(pjsip_transport* tp)
+{
+  if (!(tp->flag & PJSIP_TRANSPORT_RELIABLE))
+  {
+    return false;
+  }
+
+  return queue_saturated(tp->key.rem_addr);
+}
+
+bool SendQueueMonitor::queue_saturated(const pj_sockaddr& remote)
+{
+  std::vector<pjsip_tx_data*> sent;
+  bool saturated = false;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    Queues::iterator queue = _queues.find(remote);
+
+    if (queue != _queues.end())
+    {
+      release_sent(queue->second, sent);
+      saturated = (queue->second.bytes >= _max_queued_bytes);
+
+      if (saturated)
+      {
+        TRC_DEBUG("Connection to %s is saturated (%ld messages, %ld bytes queued)",
+                  queue->second.remote.c_str(),
+                  queue->second.msgs.size(),
+                  queue->second.bytes);
+      }
+    }
+  }
+
+  for (pjsip_tx_data* sent_tdata : sent)
+  {
+    pjsip_tx_data_dec_ref(sent_tdata);
+  }
+
+  if ((saturated) && (_saturated_tbl != NULL))
+  {
+    _saturated_tbl->increment();
+  }
+
+  return saturated;
+}
+
+std::vector<SendQueueMonitor::QueueSummary> SendQueueMonitor::queues()
+{
+  std::vector<QueueSummary> summaries;
+
+  // Messages at the front of a queue that have been sent aren't counted.
+  // They're released the next time the queue is used.
+  std::lock_guard<std::mutex> lock(_lock);
+
+  for (Queues::const_iterator queue = _queues.begin();
+       queue != _queues.end();
+       ++queue)
+  {
+    QueueSummary summary{queue->second.remote,
+                         queue->second.msgs.size(),
+                         queue->second.bytes};
+
+    for (const Queued& queued : queue->second.msgs)
+    {
+      if (queued.tdata->is_pending)
+      {
+        break;
+      }
+
+      summary.messages--;
+      summary.bytes -= queued.bytes;
+    }
+
+    if (summary.messages > 0)
+    {
+      summaries.push_back(summary);
+    }
+  }
+
+  std::sort(summaries.begin(),
+            summaries.end(),
+            [](const QueueSummary& lhs, const QueueSummary& rhs)
+            {
+              return lhs.remote < rhs.remote;
+            });
+
+  return summaries;
+}
+
+void SendQueueMonitor::release_sent(Queue& queue,
+                                    std::vector<pjsip_tx_data*>& sent)
+{
+  while ((!queue.msgs.empty()) && (!queue.msgs.front().tdata->is_pending))
+  {
+    sent.push_back(queue.msgs.front().tdata);
+    queue.bytes -= queue.msgs.front().bytes;
+    queue.msgs.pop_front();
+  }
+}
+
+void SendQueueMonitor::release_all_sent(std::vector<pjsip_tx_data*>& sent)
+{
+  Queues::iterator queue = _queues.begin();
+
+  while (queue != _queues.end())
+  {
+    release_sent(queue->second, sent);
+
+    if (queue->second.msgs.empty())
+    {
+      queue = _queues.erase(queue);
+    }
+    else
+    {
+      ++queue;
+    }
+  }
+}
+
+unsigned long SendQueueMonitor::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -13,6 +13,7 @@
 #include "log.h"
 #include "constants.h"
 #include "custom_headers.h"
+#include "pjutils.h"
 #include "sproutsasevent.h"
 #include "session_expires_helper.h"
 
@@ -66,12 +67,15 @@ void SessionExpiresHelper::process_request(pjsip_msg* req,
   _uac_supports_timer = timer_supported(req);
 
   // Find the session-expires header (if present) and the minimum
-  // session-expires. Note that the latter has a default value.
-  pjsip_session_expires_hdr* se_hdr = (pjsip_session_expires_hdr*)
-    pjsip_msg_find_hdr_by_name(req, &STR_SESSION_EXPIRES, NULL);
+  // session-expires. Note that the latter has a default value. These are only
+  // read here, so are peeked at rather than found to be changed - that way a
+  // request whose session expires we don't change is forwarded without its
+  // headers being reprinted.
+  const pjsip_session_expires_hdr* se_hdr = (const pjsip_session_expires_hdr*)
+    PJUtils::peek_hdr_by_name(req, &STR_SESSION_EXPIRES);
 
-  pjsip_min_se_hdr* min_se_hdr = (pjsip_min_se_hdr*)
-    pjsip_msg_find_hdr_by_name(req, &STR_MIN_SE, NULL);
+  const pjsip_min_se_hdr* min_se_hdr = (const pjsip_min_se_hdr*)
+    PJUtils::peek_hdr_by_name(req, &STR_MIN_SE);
 
   SessionInterval min_se = (min_se_hdr != NULL) ?
                             min_se_hdr->expires :
@@ -82,26 +86,38 @@ void SessionExpiresHelper::process_request(pjsip_msg* req,
     // The request already has a session expires that is below our target. We
     // don't need to change the value.
     TRC_DEBUG("Session expires already set to %d", se_hdr->expires);
+    _se_on_req = se_hdr->expires;
   }
   else
   {
     // No pre-existing session expires, or the current value is greater than
     // our target. Set it to as close to our target as possible, but don't set
     // it below the min-SE.
+    _se_on_req = std::max(_target_se, min_se);
+
     if (se_hdr == NULL)
     {
-      se_hdr = pjsip_session_expires_hdr_create(pool);
-      pjsip_msg_add_hdr(req, (pjsip_hdr*)se_hdr);
+      pjsip_session_expires_hdr* new_se_hdr =
+                                       pjsip_session_expires_hdr_create(pool);
+      new_se_hdr->expires = _se_on_req;
+      pjsip_msg_add_hdr(req, (pjsip_hdr*)new_se_hdr);
+      TRC_DEBUG("Set session expires to %d", _se_on_req);
+    }
+    else if (se_hdr->expires != _se_on_req)
+    {
+      // Only look the header up to change it if its value is actually
+      // changing (typically an upstream hop has already made the same
+      // decision).
+      pjsip_session_expires_hdr* mutable_se_hdr = (pjsip_session_expires_hdr*)
+        PJUtils::find_hdr_by_name(req, &STR_SESSION_EXPIRES, NULL);
+      mutable_se_hdr->expires = _se_on_req;
+      TRC_DEBUG("Set session expires to %d", _se_on_req);
+    }
+    else
+    {
+      TRC_DEBUG("Session expires already set to %d", _se_on_req);
     }
-
-    se_hdr->expires = std::max(_target_se, min_se);
-
-    TRC_DEBUG("Set session expires to %d", se_hdr->expires);
   }
-
-  // Make a note of the session expires (we may need it when processing the
-  // response)
-  _se_on_req = se_hdr->expires;
 }
 
 
@@ -124,8 +140,9 @@ void SessionExpiresHelper::process_response(pjsip_msg* rsp,
     return;
   }
 
-  pjsip_session_expires_hdr* se_hdr = (pjsip_session_expires_hdr*)
-    pjsip_msg_find_hdr_by_name(rsp, &STR_SESSION_EXPIRES, NULL);
+  // The session expires header is only read, unless we need to add one.
+  const pjsip_session_expires_hdr* se_hdr = (const pjsip_session_expires_hdr*)
+    PJUtils::peek_hdr_by_name(rsp, &STR_SESSION_EXPIRES);
 
   if (se_hdr == NULL)
   {
@@ -140,10 +157,12 @@ void SessionExpiresHelper::process_response(pjsip_msg* rsp,
     // that instructs the UAC to be the refresher.
     if (_uac_supports_timer)
     {
-      se_hdr = pjsip_session_expires_hdr_create(pool);
-      pjsip_msg_add_hdr(rsp, (pjsip_hdr*)se_hdr);
-      se_hdr->expires = _se_on_req;
-      se_hdr->refresher = SESSION_REFRESHER_UAC;
+      pjsip_session_expires_hdr* new_se_hdr =
+                                       pjsip_session_expires_hdr_create(pool);
+      pjsip_msg_add_hdr(rsp, (pjsip_hdr*)new_se_hdr);
+      new_se_hdr->expires = _se_on_req;
+      new_se_hdr->refresher = SESSION_REFRESHER_UAC;
+      se_hdr = new_se_hdr;
 
       // Also update (or add) the require header to force the UAC to do session
       // refreshes.
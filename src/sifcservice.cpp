@@ -19,7 +19,6 @@
 #include "sproutsasevent.h"
 #include "sprout_pd_definitions.h"
 #include "utils.h"
-#include "rapidxml/rapidxml_print.hpp"
 
 SIFCService::SIFCService(Alarm* alarm,
                          SNMP::CounterTable* no_shared_ifcs_set_tbl,
@@ -65,8 +64,10 @@ void SIFCService::update_sets()
     return;
   }
 
-  // Now parse the document
-  rapidxml::xml_document<>* root = new rapidxml::xml_document<>;
+  // Now parse the document.  This is kept for as long as any of the iFCs
+  // compiled from it are in use.
+  std::shared_ptr<rapidxml::xml_document<> > root =
+                                   std::make_shared<rapidxml::xml_document<> >();
 
   try
   {
@@ -79,7 +80,6 @@ void SIFCService::update_sets()
               err.what());
     CL_SPROUT_SIFC_FILE_INVALID_XML.log();
     set_alarm();
-    delete root; root = NULL;
     return;
   }
 
@@ -88,14 +88,12 @@ void SIFCService::update_sets()
     TRC_ERROR("Invalid shared iFCs configuration file - missing SharedIFCsSets block");
     CL_SPROUT_SIFC_FILE_MISSING_SHARED_IFCS_SETS.log();
     set_alarm();
-    delete root; root = NULL;
     return;
   }
 
   // At this point, we're definitely going to override the iFCs we've got.
-  // Update our map, taking a lock while we do so.
-  boost::lock_guard<boost::shared_mutex> write_lock(_sets_rw_lock);
-  _shared_ifc_sets.clear();
+  // Build up a new map, and publish it once it's complete.
+  std::shared_ptr<SetMap> new_shared_ifc_sets = std::make_shared<SetMap>();
   bool any_errors = false;
 
   rapidxml::xml_node<>* sets = root->first_node(SIFCService::SHARED_IFCS_SETS);
@@ -128,7 +126,7 @@ void SIFCService::update_sets()
       continue;
     }
 
-    if (_shared_ifc_sets.count(set_id) != 0)
+    if (new_shared_ifc_sets->count(set_id) != 0)
     {
       TRC_ERROR("Invalid shared iFC block - SetID (%d) is repeated. Skipping this entry",
                 set_id);
@@ -137,7 +135,7 @@ void SIFCService::update_sets()
       continue;
     }
 
-    std::vector<std::pair<int32_t, std::string>> ifc_set;
+    std::vector<std::pair<int32_t, Ifc>> ifc_set;
 
     for (rapidxml::xml_node<>* ifc = set->first_node(RegDataXMLUtils::IFC);
          ifc != NULL;
@@ -164,16 +162,17 @@ void SIFCService::update_sets()
 
       // Creating the iFC always passes; we don't validate the iFC any further
       // at this stage. We've validated this against a schema before allowing
-      // any upload though.
-      std::string ifc_str;
-      rapidxml::print(std::back_inserter(ifc_str), *ifc, 0);
-      ifc_set.push_back(std::make_pair(priority, ifc_str));
+      // any upload though.  The iFC is compiled now, so that requests that use
+      // it don't have to parse or compile it again.
+      ifc_set.push_back(std::make_pair(priority, Ifc(ifc, root)));
     }
 
     TRC_STATUS("Adding %lu iFCs for ID %d", ifc_set.size(), set_id);
-    _shared_ifc_sets.insert(std::make_pair(set_id, ifc_set));
+    new_shared_ifc_sets->insert(std::make_pair(set_id, ifc_set));
   }
 
+  _shared_ifc_sets.set(new_shared_ifc_sets);
+
   if (any_errors)
   {
     set_alarm();
@@ -182,14 +181,11 @@ void SIFCService::update_sets()
   {
     clear_alarm();
   }
-
-  delete root; root = NULL;
 }
 
 SIFCService::~SIFCService()
 {
   delete _updater; _updater = NULL;
-  _shared_ifc_sets.clear();
   delete _alarm; _alarm = NULL;
 }
 
@@ -198,22 +194,22 @@ void SIFCService::get_ifcs_from_id(std::multimap<int32_t, Ifc>& ifc_map,
                                    std::shared_ptr<xml_document<> > ifc_doc,
                                    SAS::TrailId trail) const
 {
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_sets_rw_lock);
+  // Take a reference to the current sets, which keeps them valid for the rest
+  // of this function even if the configuration is reloaded.
+  std::shared_ptr<const SetMap> shared_ifc_sets = _shared_ifc_sets.get();
 
   for (int id : ids)
   {
     TRC_DEBUG("Getting the shared iFCs for ID %d", id);
-    std::map<int, std::vector<std::pair<int32_t, std::string>>>::const_iterator i =
-                                                      _shared_ifc_sets.find(id);
+    SetMap::const_iterator i = shared_ifc_sets->find(id);
 
-    if (i != _shared_ifc_sets.end())
+    if (i != shared_ifc_sets->end())
     {
       TRC_DEBUG("Found iFC set for ID %d", id);
 
-      for (std::pair<int32_t, std::string> ifc : i->second)
+      for (const std::pair<int32_t, Ifc>& ifc : i->second)
       {
-        ifc_map.insert(std::make_pair(ifc.first, Ifc(ifc.second, ifc_doc.get())));
+        ifc_map.insert(ifc);
       }
     }
     else
@@ -34,20 +34,28 @@ simservs::simservs(std::string xml) : _oip_enabled(false),
                                       _cdiv_enabled(false),
                                       _cdiv_no_reply_timer(20),
                                       _inbound_cb_enabled(false),
-                                      _outbound_cb_enabled(false)
+                                      _outbound_cb_enabled(false),
+                                      _cdiv_rule_conditions(0),
+                                      _inbound_cb_rule_conditions(0),
+                                      _outbound_cb_rule_conditions(0)
 {
-  // Parse the XML document, saving off the passed in string first (as parsing
-  // is destructive)
+  // Parse the XML document in place.  We have our own copy of the string, so
+  // there's no need to copy it again before the (destructive) parse.  We
+  // don't need the data nodes either, as the values we're interested in are
+  // all element values, so we don't have rapidxml allocate them.
   xml_document<> doc;
-  char* xml_str = doc.allocate_string(xml.c_str());
+  char* xml_str = &xml[0];
 
   try
   {
-    doc.parse<parse_strip_xml_namespaces>(xml_str);
+    doc.parse<parse_strip_xml_namespaces | parse_no_data_nodes>(xml_str);
   }
   catch (parse_error err)
   {
-    TRC_ERROR("Parse error in simservs document: %s\n\n%s", err.what(), xml.c_str());
+    // The parse has already modified the document, so just report where the
+    // error was found.
+    TRC_ERROR("Parse error in simservs document: %s at offset %ld",
+              err.what(), (long)(err.where<char>() - xml_str));
     doc.clear();
   }
 
@@ -173,6 +181,10 @@ simservs::simservs(std::string xml) : _oip_enabled(false),
     // Check the next service node
     current_node = current_node->next_sibling();
   }
+
+  _cdiv_rule_conditions = rule_conditions(_cdiv_rules);
+  _inbound_cb_rule_conditions = rule_conditions(_inbound_cb_rules);
+  _outbound_cb_rule_conditions = rule_conditions(_outbound_cb_rules);
 }
 
 /// Constructor: Build configuration representing call diversion to the
@@ -186,7 +198,9 @@ simservs::simservs(const std::string forward_target,
                    _cdiv_enabled(true),
                    _cdiv_no_reply_timer(no_reply_timer),
                    _inbound_cb_enabled(false),
-                   _outbound_cb_enabled(false)
+                   _outbound_cb_enabled(false),
+                   _inbound_cb_rule_conditions(0),
+                   _outbound_cb_rule_conditions(0)
 {
   if (conditions == 0)
   {
@@ -206,6 +220,8 @@ simservs::simservs(const std::string forward_target,
       _cdiv_rules.push_back(simservs::CDIVRule(forward_target, condition));
     }
   }
+
+  _cdiv_rule_conditions = rule_conditions(_cdiv_rules);
 }
 
 simservs::~simservs()
@@ -213,19 +229,19 @@ simservs::~simservs()
 }
 
 /// Is OIP (originating identity presentation) enabled?
-bool simservs::oip_enabled()
+bool simservs::oip_enabled() const
 {
   return _oip_enabled;
 }
 
 /// Is OIR (originating identity presentation restriction) enabled?
-bool simservs::oir_enabled()
+bool simservs::oir_enabled() const
 {
   return _oir_enabled;
 }
 
 /// Is originating identity presentation restricted?  Only valid if oir_enabled().
-bool simservs::oir_presentation_restricted()
+bool simservs::oir_presentation_restricted() const
 {
   return _oir_presentation_restricted;
 }
@@ -248,6 +264,12 @@ const std::vector<simservs::CDIVRule>* simservs::cdiv_rules() const
   return &_cdiv_rules;
 }
 
+/// Which conditions are used by any of the call-diversion rules?
+unsigned int simservs::cdiv_rule_conditions() const
+{
+  return _cdiv_rule_conditions;
+}
+
 bool simservs::inbound_cb_enabled() const
 {
   return _inbound_cb_enabled;
@@ -268,6 +290,18 @@ const std::vector<simservs::CBRule>* simservs::outbound_cb_rules() const
   return &_outbound_cb_rules;
 }
 
+/// Which conditions are used by any of the inbound call-barring rules?
+unsigned int simservs::inbound_cb_rule_conditions() const
+{
+  return _inbound_cb_rule_conditions;
+}
+
+/// Which conditions are used by any of the outbound call-barring rules?
+unsigned int simservs::outbound_cb_rule_conditions() const
+{
+  return _outbound_cb_rule_conditions;
+}
+
 /// Helper: Given a service node, is it active?
 bool simservs::check_active(xml_node<> *service)
 {
@@ -282,6 +316,27 @@ bool simservs::check_active(xml_node<> *service)
   return result;
 }
 
+/// Helper: The union of the conditions of a set of rules.
+unsigned int simservs::rule_conditions(const std::vector<CDIVRule>& rules)
+{
+  unsigned int conditions = 0;
+  for (const CDIVRule& rule : rules)
+  {
+    conditions |= rule.conditions();
+  }
+  return conditions;
+}
+
+unsigned int simservs::rule_conditions(const std::vector<CBRule>& rules)
+{
+  unsigned int conditions = 0;
+  for (const CBRule& rule : rules)
+  {
+    conditions |= rule.conditions();
+  }
+  return conditions;
+}
+
 /// @class simservs::Rule
 ///
 /// Abstract base class encapsulating the condition (i.e., diversion-reason)
@@ -0,0 +1,499 @@
+/**
+ * @file sip_capture.cpp Capturing sent and received SIP messages to pcapng
+ * files.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sip_capture.h"
+#include "log.h"
+
+// How long the writing thread waits for more messages once the ring is
+// empty.
+static const int WRITER_INTERVAL_US = 1000;
+
+// pcapng block types.
+static const uint32_t SECTION_HEADER_BLOCK = 0x0A0D0D0A;
+static const uint32_t INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+static const uint32_t ENHANCED_PACKET_BLOCK = 0x00000006;
+static const uint32_t BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+
+// pcapng options.
+static const uint16_t OPT_ENDOFOPT = 0;
+static const uint16_t OPT_COMMENT = 1;
+static const uint16_t IF_TSRESOL = 9;
+
+// The link type of Wireshark's exported PDUs, and the tags that describe
+// each PDU.  Unlike the rest of the file, the tags are big-endian.
+static const uint16_t LINKTYPE_WIRESHARK_UPPER_PDU = 252;
+static const uint16_t EXP_PDU_TAG_END_OF_OPT = 0;
+static const uint16_t EXP_PDU_TAG_PROTO_NAME = 12;
+static const uint16_t EXP_PDU_TAG_IPV4_SRC = 20;
+static const uint16_t EXP_PDU_TAG_IPV4_DST = 21;
+static const uint16_t EXP_PDU_TAG_IPV6_SRC = 22;
+static const uint16_t EXP_PDU_TAG_IPV6_DST = 23;
+static const uint16_t EXP_PDU_TAG_PORT_TYPE = 24;
+static const uint16_t EXP_PDU_TAG_SRC_PORT = 25;
+static const uint16_t EXP_PDU_TAG_DST_PORT = 26;
+static const uint32_t PT_TCP = 2;
+static const uint32_t PT_UDP = 3;
+
+const uint64_t SipCapture::RING_SIZE;
+
+static void append(std::vector<char>& block, const void* data, size_t len)
+{
+  const char* bytes = (const char*)data;
+  block.insert(block.end(), bytes, bytes + len);
+
+  // Everything in a pcapng file is padded to a multiple of 4 bytes.
+  block.resize((block.size() + 3) & ~(size_t)3, '\0');
+}
+
+static void append_u32(std::vector<char>& block, uint32_t value)
+{
+  append(block, &value, sizeof(value));
+}
+
+static void append_option(std::vector<char>& block,
+                          uint16_t code,
+                          const void* data,
+                          uint16_t len)
+{
+  uint16_t header[2] = {code, len};
+  append(block, header, sizeof(header));
+  if (len > 0)
+  {
+    append(block, data, len);
+  }
+}
+
+static void append_tag(std::vector<char>& block,
+                       uint16_t tag,
+                       const void* data,
+                       uint16_t len)
+{
+  uint16_t padded_len = (len + 3) & ~3;
+  uint16_t header[2] = {htons(tag), htons(padded_len)};
+  append(block, header, sizeof(header));
+  if (len > 0)
+  {
+    append(block, data, len);
+  }
+}
+
+static void append_tag_u32(std::vector<char>& block, uint16_t tag, uint32_t value)
+{
+  value = htonl(value);
+  append_tag(block, tag, &value, sizeof(value));
+}
+
+static void append_tag_addr(std::vector<char>& block,
+                            bool src,
+                            const pj_sockaddr* addr)
+{
+  if (addr->addr.sa_family == pj_AF_INET6())
+  {
+    append_tag(block,
+               src ? EXP_PDU_TAG_IPV6_SRC : EXP_PDU_TAG_IPV6_DST,
+               &addr->ipv6.sin6_addr,
+               sizeof(addr->ipv6.sin6_addr));
+  }
+  else
+  {
+    append_tag(block,
+               src ? EXP_PDU_TAG_IPV4_SRC : EXP_PDU_TAG_IPV4_DST,
+               &addr->ipv4.sin_addr,
+               sizeof(addr->ipv4.sin_addr));
+  }
+
+  append_tag_u32(block,
+                 src ? EXP_PDU_TAG_SRC_PORT : EXP_PDU_TAG_DST_PORT,
+                 pj_sockaddr_get_port(addr));
+}
+
+// Fills in the total length at both ends of a block, which must start with
+// its type and a placeholder for the length.
+static void finish_block(std::vector<char>& block)
+{
+  uint32_t total_len = block.size() + sizeof(uint32_t);
+  append_u32(block, total_len);
+  memcpy(&block[sizeof(uint32_t)], &total_len, sizeof(total_len));
+}
+
+SipCapture::SipCapture(const std::string& directory,
+                       size_t file_size,
+                       int num_files,
+                       const std::vector<std::string>& filters) :
+  _directory(directory),
+  _file_size(file_size),
+  _num_files((num_files > 0) ? num_files : 1),
+  _call_ids(),
+  _impus(),
+  _file_index(0),
+  _fd(-1),
+  _map(NULL),
+  _used(0),
+  _block(),
+  _ok(false),
+  _ring(new Slot[RING_SIZE]),
+  _head(0),
+  _tail(0),
+  _dropped(0),
+  _stopping(false)
+{
+  for (const std::string& filter : filters)
+  {
+    if ((strncasecmp(filter.c_str(), "sip:", 4) == 0) ||
+        (strncasecmp(filter.c_str(), "sips:", 5) == 0) ||
+        (strncasecmp(filter.c_str(), "tel:", 4) == 0))
+    {
+      _impus.push_back(filter);
+    }
+    else
+    {
+      _call_ids.insert(filter);
+    }
+  }
+
+  for (uint64_t ii = 0; ii < RING_SIZE; ++ii)
+  {
+    _ring[ii].seq.store(ii, std::memory_order_relaxed);
+    _ring[ii].msg = NULL;
+  }
+
+  _ok = open_file();
+  if (_ok)
+  {
+    _writer = std::thread(&SipCapture::writer, this);
+  }
+}
+
+SipCapture::~SipCapture()
+{
+  _stopping.store(true);
+
+  if (_writer.joinable())
+  {
+    _writer.join();
+  }
+
+  close_file();
+
+  for (uint64_t ii = 0; ii < RING_SIZE; ++ii)
+  {
+    delete[] _ring[ii].msg;
+  }
+  delete[] _ring; _ring = NULL;
+}
+
+bool SipCapture::matches(const pj_str_t* call_id, int len, const char* msg) const
+{
+  if (_call_ids.empty() && _impus.empty())
+  {
+    return true;
+  }
+
+  if ((call_id != NULL) &&
+      (!_call_ids.empty()) &&
+      (_call_ids.find(std::string(call_id->ptr, call_id->slen)) != _call_ids.end()))
+  {
+    return true;
+  }
+
+  for (const std::string& impu : _impus)
+  {
+    if (memmem(msg, len, impu.data(), impu.length()) != NULL)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void SipCapture::capture(bool tx,
+                         bool reliable,
+                         const pj_sockaddr* local_addr,
+                         const pj_sockaddr* remote_addr,
+                         SAS::TrailId trail,
+                         const pj_str_t* call_id,
+                         int len,
+                         const char* msg)
+{
+  if ((!_ok) || (!matches(call_id, len, msg)))
+  {
+    return;
+  }
+
+  // Claim a slot on the ring.
+  uint64_t pos = _head.load(std::memory_order_relaxed);
+  Slot* slot;
+
+  while (true)
+  {
+    slot = &_ring[pos % RING_SIZE];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+
+    if (seq == pos)
+    {
+      if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (seq < pos)
+    {
+      // The writing thread hasn't written the message that was in this
+      // slot, so the ring is full.
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  slot->timestamp_ns = ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+  slot->tx = tx;
+  slot->reliable = reliable;
+  pj_sockaddr_cp(&slot->local_addr, local_addr);
+  pj_sockaddr_cp(&slot->remote_addr, remote_addr);
+  slot->trail = trail;
+  slot->len = len;
+  slot->msg = new char[len];
+  memcpy(slot->msg, msg, len);
+
+  // Hand the slot to the writing thread.
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+int SipCapture::drain()
+{
+  int written = 0;
+
+  while (true)
+  {
+    Slot* slot = &_ring[_tail % RING_SIZE];
+    if (slot->seq.load(std::memory_order_acquire) != _tail + 1)
+    {
+      break;
+    }
+
+    build_packet_block(*slot);
+    write_block();
+    delete[] slot->msg; slot->msg = NULL;
+
+    // Free the slot for the producer that next comes round the ring to it.
+    slot->seq.store(_tail + RING_SIZE, std::memory_order_release);
+    ++_tail;
+    ++written;
+  }
+
+  return written;
+}
+
+void SipCapture::writer()
+{
+  uint64_t reported_dropped = 0;
+  time_t last_warning = 0;
+
+  while (true)
+  {
+    bool stopping = _stopping.load();
+    int written = drain();
+
+    // Warn about dropped messages at most once a second.
+    uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+    time_t now = time(NULL);
+    if ((dropped != reported_dropped) && (now != last_warning))
+    {
+      TRC_WARNING("Failed to capture %lu SIP messages as the capture thread isn't keeping up",
+                  dropped - reported_dropped);
+      reported_dropped = dropped;
+      last_warning = now;
+    }
+
+    if (written == 0)
+    {
+      if (stopping)
+      {
+        break;
+      }
+
+      struct timespec delay = {0, WRITER_INTERVAL_US * 1000};
+      nanosleep(&delay, NULL);
+    }
+  }
+}
+
+void SipCapture::build_packet_block(const Slot& slot)
+{
+  _block.clear();
+  append_u32(_block, ENHANCED_PACKET_BLOCK);
+  append_u32(_block, 0);
+  append_u32(_block, 0);
+  append_u32(_block, (uint32_t)(slot.timestamp_ns >> 32));
+  append_u32(_block, (uint32_t)slot.timestamp_ns);
+
+  // Build the exported PDU after the fixed fields, then fill in its length.
+  size_t lengths_pos = _block.size();
+  append_u32(_block, 0);
+  append_u32(_block, 0);
+  size_t pdu_pos = _block.size();
+
+  const pj_sockaddr* src = slot.tx ? &slot.local_addr : &slot.remote_addr;
+  const pj_sockaddr* dst = slot.tx ? &slot.remote_addr : &slot.local_addr;
+  append_tag(_block, EXP_PDU_TAG_PROTO_NAME, "sip", 3);
+  append_tag_addr(_block, true, src);
+  append_tag_addr(_block, false, dst);
+  append_tag_u32(_block, EXP_PDU_TAG_PORT_TYPE, slot.reliable ? PT_TCP : PT_UDP);
+  append_tag(_block, EXP_PDU_TAG_END_OF_OPT, NULL, 0);
+
+  uint32_t pdu_len = (_block.size() - pdu_pos) + slot.len;
+  append(_block, slot.msg, slot.len);
+  memcpy(&_block[lengths_pos], &pdu_len, sizeof(pdu_len));
+  memcpy(&_block[lengths_pos + sizeof(pdu_len)], &pdu_len, sizeof(pdu_len));
+
+  char comment[32];
+  int comment_len = snprintf(comment, sizeof(comment), "trail=%lu", (unsigned long)slot.trail);
+  append_option(_block, OPT_COMMENT, comment, comment_len);
+  append_option(_block, OPT_ENDOFOPT, NULL, 0);
+
+  finish_block(_block);
+}
+
+void SipCapture::write_block()
+{
+  if ((_map != NULL) && (_used + _block.size() > _file_size))
+  {
+    close_file();
+    _file_index = (_file_index + 1) % _num_files;
+    open_file();
+  }
+
+  if (!copy_block())
+  {
+    // Either the file couldn't be opened, or the message doesn't fit in a
+    // whole file.
+    _dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool SipCapture::copy_block()
+{
+  if ((_map == NULL) || (_used + _block.size() > _file_size))
+  {
+    return false;
+  }
+
+  memcpy(_map + _used, _block.data(), _block.size());
+  _used += _block.size();
+  return true;
+}
+
+bool SipCapture::open_file()
+{
+  std::string filename = _directory + "/sip_capture_" +
+                         std::to_string(_file_index) + ".pcapng";
+
+  _fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (_fd < 0)
+  {
+    TRC_ERROR("Failed to create SIP capture file %s: %s",
+              filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  if (ftruncate(_fd, _file_size) != 0)
+  {
+    TRC_ERROR("Failed to size SIP capture file %s: %s",
+              filename.c_str(), strerror(errno));
+    close(_fd); _fd = -1;
+    return false;
+  }
+
+  void* map = mmap(NULL, _file_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED)
+  {
+    TRC_ERROR("Failed to map SIP capture file %s: %s",
+              filename.c_str(), strerror(errno));
+    close(_fd); _fd = -1;
+    return false;
+  }
+
+  _map = (char*)map;
+  _used = 0;
+
+  TRC_STATUS("Capturing SIP messages to %s", filename.c_str());
+
+  // Each file is a section of its own, with a single interface for all the
+  // messages, whose timestamps are in nanoseconds.
+  _block.clear();
+  append_u32(_block, SECTION_HEADER_BLOCK);
+  append_u32(_block, 0);
+  append_u32(_block, BYTE_ORDER_MAGIC);
+  uint16_t version[2] = {1, 0};
+  append(_block, version, sizeof(version));
+  int64_t section_len = -1;
+  append(_block, &section_len, sizeof(section_len));
+  finish_block(_block);
+  bool ok = copy_block();
+
+  _block.clear();
+  append_u32(_block, INTERFACE_DESCRIPTION_BLOCK);
+  append_u32(_block, 0);
+  uint16_t link_type[2] = {LINKTYPE_WIRESHARK_UPPER_PDU, 0};
+  append(_block, link_type, sizeof(link_type));
+  append_u32(_block, 0);
+  uint8_t resolution = 9;
+  append_option(_block, IF_TSRESOL, &resolution, sizeof(resolution));
+  append_option(_block, OPT_ENDOFOPT, NULL, 0);
+  finish_block(_block);
+  ok = ok && copy_block();
+
+  if (!ok)
+  {
+    TRC_ERROR("SIP capture file size of %lu bytes is too small", _file_size);
+    close_file();
+  }
+
+  return ok;
+}
+
+void SipCapture::close_file()
+{
+  if (_map != NULL)
+  {
+    munmap(_map, _file_size);
+    _map = NULL;
+  }
+
+  if (_fd >= 0)
+  {
+    // Trim the unused end of the file.
+    if (ftruncate(_fd, _used) != 0)
+    {
+      TRC_WARNING("Failed to trim SIP capture file: %s", strerror(errno));
+    }
+    close(_fd);
+    _fd = -1;
+  }
+}
@@ -14,6 +14,8 @@ extern "C" {
 #include <pjlib-util.h>
 #include <pjlib.h>
 }
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 // Common STL includes.
@@ -31,7 +33,9 @@ SIPConnectionPool::SIPConnectionPool(pjsip_host_port* target,
                                pj_pool_t* pool,
                                pjsip_endpoint* endpt,
                                pjsip_tpfactory* tp_factory,
-                               SNMP::IPCountTable* sprout_count_tbl) :
+                               SNMP::IPCountTable* sprout_count_tbl,
+                               Selection selection,
+                               SNMP::IPCountTable* sprout_load_tbl) :
   _target(*target),
   _num_connections(num_connections),
   _recycle_period(recycle_period),
@@ -41,14 +45,25 @@ SIPConnectionPool::SIPConnectionPool(pjsip_host_port* target,
   _tpfactory(tp_factory),
   _recycler(NULL),
   _terminated(false),
-  _active_connections(0),
-  _sprout_count_tbl(sprout_count_tbl)
+  _selection(selection),
+  _tp_hash_lock("sip_connection_pool"),
+  _connected(std::make_shared<const ConnectionList>()),
+  _sprout_count_tbl(sprout_count_tbl),
+  _sprout_load_tbl(sprout_load_tbl)
 {
   TRC_STATUS("Creating connection pool to %.*s:%d", _target.host.slen, _target.host.ptr, _target.port);
   TRC_STATUS("  connections = %d, recycle time = %d +/- %d seconds", _num_connections, _recycle_period, _recycle_margin);
+  TRC_STATUS("  selection = %s",
+             (_selection == LEAST_LOADED) ? "least loaded" :
+             (_selection == AFFINITY) ? "affinity" : "random");
 
-  pthread_mutex_init(&_tp_hash_lock, NULL);
   _tp_hash.resize(_num_connections);
+  for (int ii = 0; ii < _num_connections; ++ii)
+  {
+    _tp_hash[ii].listener_key = NULL;
+    _tp_hash[ii].connected = PJ_FALSE;
+    _tp_hash[ii].recycle_time = 0;
+  }
 }
 
 
@@ -76,9 +91,9 @@ void SIPConnectionPool::init()
     create_connection(ii);
   }
 
-  if (_recycle_period != 0)
+  if ((_recycle_period != 0) || (_sprout_load_tbl != NULL))
   {
-    // Spawn a thread to recycle connections
+    // Spawn a thread to recycle connections, and report their load
     pj_status_t status = pj_thread_create(_pool, "recycler",
                                           &recycle_thread,
                                           (void*)this, 0, 0, &_recycler);
@@ -93,41 +108,335 @@ void SIPConnectionPool::init()
 }
 
 
+SIPConnectionPool::Connection::Connection(pjsip_transport* tp) :
+  tp(tp),
+  host(PJUtils::pj_str_to_string(&tp->remote_name.host)),
+  host_hash(hash(host.data(), host.size())),
+  in_flight(0),
+  latency_us(0.0),
+  samples(0)
+{
+}
+
+
+SIPConnectionPool::Connection::~Connection()
+{
+  // Remove the pool's reference to the transport.  Nothing can pick this
+  // connection any more, so PJSIP can destroy the transport once any
+  // transactions using it are done.
+  pjsip_transport_dec_ref(tp);
+}
+
+
+std::shared_ptr<const SIPConnectionPool::ConnectionList>
+                                       SIPConnectionPool::connections() const
+{
+  return std::atomic_load(&_connected);
+}
+
+
+/// Publishes a new list of the connected connections.  Must be called with
+/// the hash lock held.
+void SIPConnectionPool::publish_connections()
+{
+  std::shared_ptr<ConnectionList> connected = std::make_shared<ConnectionList>();
+
+  for (int ii = 0; ii < _num_connections; ++ii)
+  {
+    if (_tp_hash[ii].connected)
+    {
+      connected->push_back(_tp_hash[ii].connection);
+    }
+  }
+
+  std::atomic_store(&_connected,
+                    std::shared_ptr<const ConnectionList>(connected));
+}
+
+
+SIPConnectionPool::Connection*
+  SIPConnectionPool::find_connection(const ConnectionList& connections,
+                                     pjsip_transport* tp)
+{
+  for (size_t ii = 0; ii < connections.size(); ++ii)
+  {
+    if (connections[ii]->tp == tp)
+    {
+      return connections[ii].get();
+    }
+  }
+
+  return NULL;
+}
+
+
 pjsip_transport* SIPConnectionPool::get_connection()
+{
+  return get_connection(NULL);
+}
+
+
+pjsip_transport* SIPConnectionPool::get_connection(const pj_str_t* affinity_key)
 {
   pjsip_transport* tp = NULL;
 
-  pthread_mutex_lock(&_tp_hash_lock);
+  // The list holds a reference to each of its connections, and so to their
+  // transports, for as long as we hold it - even if some of them are
+  // removed from the pool in the meantime.
+  std::shared_ptr<const ConnectionList> connected = connections();
+  int num_connected = connected->size();
 
-  if (_active_connections > 0)
+  if (num_connected > 0)
   {
-    // Select a transport by starting at a random point in the hash and
-    // stepping through the hash until a connected entry is found.
-    int start_slot = rand() % _num_connections;
-    int ii = start_slot;
-    while (!_tp_hash[ii].connected)
+    static thread_local unsigned int seed = (unsigned int)time(NULL) ^
+                                            (unsigned int)pthread_self();
+    int start = rand_r(&seed) % num_connected;
+    const Connection* selected = (*connected)[start].get();
+
+    if (_selection == LEAST_LOADED)
+    {
+      // Connections that don't have a latency yet are assumed to be as fast
+      // as the average of those that do.
+      double total_latency_us = 0.0;
+      int timed = 0;
+      for (int ii = 0; ii < num_connected; ++ii)
+      {
+        if ((*connected)[ii]->samples > 0)
+        {
+          total_latency_us += (*connected)[ii]->latency_us;
+          ++timed;
+        }
+      }
+      double default_latency_us = (timed > 0) ? (total_latency_us / timed) : 1.0;
+
+      // Pick the connection with the lowest expected wait for the
+      // transactions already in flight, starting at a random point in the
+      // list to break ties.
+      double best_score = 0.0;
+      for (int jj = 0; jj < num_connected; ++jj)
+      {
+        const Connection* connection = (*connected)[(start + jj) % num_connected].get();
+        double latency_us = (connection->samples > 0) ?
+                              connection->latency_us.load() : default_latency_us;
+        double score = (connection->in_flight + 1) * latency_us;
+        if ((jj == 0) || (score < best_score))
+        {
+          selected = connection;
+          best_score = score;
+        }
+      }
+    }
+    else if ((_selection == AFFINITY) &&
+             (affinity_key != NULL) &&
+             (affinity_key->slen > 0))
     {
-      ii = (ii + 1) % _num_connections;
-      if (ii == start_slot)
+      // Pick the host with the highest weight for this key.  Every
+      // connection to a host has the same weight, so starting at a random
+      // point in the list spreads the requests across that host's
+      // connections.
+      uint64_t key_hash = hash(affinity_key->ptr, affinity_key->slen);
+      uint64_t best_weight = 0;
+      for (int jj = 0; jj < num_connected; ++jj)
       {
-        break;
+        const Connection* connection = (*connected)[(start + jj) % num_connected].get();
+        uint64_t weight = affinity_weight(connection->host_hash, key_hash);
+        if ((jj == 0) || (weight > best_weight))
+        {
+          selected = connection;
+          best_weight = weight;
+        }
       }
     }
 
-    tp = _tp_hash[ii].tp;
+    // Add a reference to the transport to make sure it is not destroyed.
+    // The reference must be decremented once again when the transport is set
+    // on the message.
+    tp = selected->tp;
+    pjsip_transport_add_ref(tp);
+  }
+
+  return tp;
+}
 
-    if (tp != NULL)
+
+void SIPConnectionPool::request_started(pjsip_transport* tp)
+{
+  std::shared_ptr<const ConnectionList> connected = connections();
+  Connection* connection = find_connection(*connected, tp);
+
+  if (connection != NULL)
+  {
+    ++connection->in_flight;
+  }
+}
+
+
+void SIPConnectionPool::request_complete(pjsip_transport* tp, long latency_us)
+{
+  // Weight given to each new latency sample.
+  static const double SMOOTHING_FACTOR = 0.1;
+
+  std::shared_ptr<const ConnectionList> connected = connections();
+  Connection* connection = find_connection(*connected, tp);
+
+  // If the transport is no longer in the pool its load no longer matters.
+  if (connection != NULL)
+  {
+    // The transport may have been removed from the pool and a new one
+    // created at the same address, so don't let the count go negative.
+    int in_flight = connection->in_flight.load();
+    while ((in_flight > 0) &&
+           (!connection->in_flight.compare_exchange_weak(in_flight,
+                                                         in_flight - 1)))
     {
-      // Add a reference to the transport to make sure it is not destroyed.
-      // The reference must be decremented once again when the transport is set
-      // on the message.
-      pjsip_transport_add_ref(tp);
+    }
+
+    if (latency_us >= 0)
+    {
+      double old_latency_us = connection->latency_us.load();
+      double new_latency_us;
+      do
+      {
+        new_latency_us = (connection->samples == 0) ?
+                           latency_us :
+                           ((1.0 - SMOOTHING_FACTOR) * old_latency_us +
+                            SMOOTHING_FACTOR * latency_us);
+      }
+      while (!connection->latency_us.compare_exchange_weak(old_latency_us,
+                                                           new_latency_us));
+      ++connection->samples;
     }
   }
+}
 
-  pthread_mutex_unlock(&_tp_hash_lock);
 
-  return tp;
+int SIPConnectionPool::num_connected() const
+{
+  return connections()->size();
+}
+
+
+int SIPConnectionPool::in_flight() const
+{
+  std::shared_ptr<const ConnectionList> connected = connections();
+  int in_flight = 0;
+
+  for (size_t ii = 0; ii < connected->size(); ++ii)
+  {
+    in_flight += (*connected)[ii]->in_flight;
+  }
+
+  return in_flight;
+}
+
+
+/// Updates the statistics of the transactions in flight to each host.  The
+/// request path only updates the counts on each connection, and this rolls
+/// them up.  Only called on the recycler thread.
+void SIPConnectionPool::report_load()
+{
+  std::map<std::string, int> load;
+
+  std::shared_ptr<const ConnectionList> connected = connections();
+  for (size_t ii = 0; ii < connected->size(); ++ii)
+  {
+    load[(*connected)[ii]->host] += (*connected)[ii]->in_flight;
+  }
+
+  // Pick up hosts we've reported before but that no longer have any
+  // connections, so their rows are removed.
+  for (std::map<std::string, int>::const_iterator i = _reported_load.begin();
+       i != _reported_load.end();
+       ++i)
+  {
+    load[i->first];
+  }
+
+  for (std::map<std::string, int>::const_iterator i = load.begin();
+       i != load.end();
+       ++i)
+  {
+    int reported = _reported_load[i->first];
+
+    for (int jj = reported; jj < i->second; ++jj)
+    {
+      _sprout_load_tbl->get(i->first)->increment();
+    }
+
+    for (int jj = i->second; jj < reported; ++jj)
+    {
+      _sprout_load_tbl->get(i->first)->decrement();
+    }
+
+    if (i->second == 0)
+    {
+      if (reported != 0)
+      {
+        _sprout_load_tbl->remove(i->first);
+      }
+      _reported_load.erase(i->first);
+    }
+    else
+    {
+      _reported_load[i->first] = i->second;
+    }
+  }
+}
+
+
+/// FNV-1a hash of a string.
+uint64_t SIPConnectionPool::hash(const char* data, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t ii = 0; ii < len; ++ii)
+  {
+    h ^= (unsigned char)data[ii];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+/// The rendezvous hashing weight of a host for a key.  The two hashes are
+/// mixed (with the SplitMix64 finalizer) so that the order of the hosts
+/// differs from key to key.
+uint64_t SIPConnectionPool::affinity_weight(uint64_t host_hash,
+                                            uint64_t key_hash)
+{
+  uint64_t w = host_hash ^ (key_hash * 0x9e3779b97f4a7c15ULL);
+  w = (w ^ (w >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  w = (w ^ (w >> 27)) * 0x94d049bb133111ebULL;
+  return w ^ (w >> 31);
+}
+
+
+/// Returns whether a connection is responding much more slowly than the rest
+/// of the pool.
+bool SIPConnectionPool::is_slow(const Connection* connection)
+{
+  bool slow = false;
+
+  if (connection->samples >= SLOW_MIN_SAMPLES)
+  {
+    std::shared_ptr<const ConnectionList> connected = connections();
+    double total_latency_us = 0.0;
+    int others = 0;
+    for (size_t ii = 0; ii < connected->size(); ++ii)
+    {
+      const Connection* other = (*connected)[ii].get();
+      if ((other != connection) && (other->samples >= SLOW_MIN_SAMPLES))
+      {
+        total_latency_us += other->latency_us;
+        ++others;
+      }
+    }
+
+    slow = ((others > 0) &&
+            (connection->latency_us >
+               SLOW_LATENCY_FACTOR * (total_latency_us / others)));
+  }
+
+  return slow;
 }
 
 
@@ -233,8 +542,9 @@ pj_status_t SIPConnectionPool::create_connection(int hash_slot)
   }
 
   // Store the new transport in the hash slot, but marked as disconnected.
-  pthread_mutex_lock(&_tp_hash_lock);
-  _tp_hash[hash_slot].tp = tp;
+  // It isn't published until it has connected.
+  _tp_hash_lock.lock();
+  _tp_hash[hash_slot].connection = std::make_shared<Connection>(tp);
   _tp_hash[hash_slot].listener_key = key;
   _tp_hash[hash_slot].connected = PJ_FALSE;
   _tp_map[tp] = hash_slot;
@@ -242,7 +552,7 @@ pj_status_t SIPConnectionPool::create_connection(int hash_slot)
   // Don't increment the connection count here, wait until we get confirmation
   // that the transport is connected.
 
-  pthread_mutex_unlock(&_tp_hash_lock);
+  _tp_hash_lock.unlock();
 
   return PJ_SUCCESS;
 }
@@ -250,15 +560,17 @@ pj_status_t SIPConnectionPool::create_connection(int hash_slot)
 
 void SIPConnectionPool::quiesce_connection(int hash_slot)
 {
-  pthread_mutex_lock(&_tp_hash_lock);
-  pjsip_transport* tp = _tp_hash[hash_slot].tp;
+  _tp_hash_lock.lock();
+  std::shared_ptr<Connection> connection;
+  connection.swap(_tp_hash[hash_slot].connection);
 
-  if (tp != NULL)
+  if (connection != NULL)
   {
+    pjsip_transport* tp = connection->tp;
+
     if (_tp_hash[hash_slot].connected)
     {
       // Connection was established, so update statistics.
-      --_active_connections;
       decrement_connection_count(tp);
     }
 
@@ -267,26 +579,29 @@ void SIPConnectionPool::quiesce_connection(int hash_slot)
                                           _tp_hash[hash_slot].listener_key,
                                           (void *)this);
 
-    // Remove the transport from the hash and the map.
-    _tp_hash[hash_slot].tp = NULL;
+    // Remove the transport from the hash and the map, and stop it being
+    // picked.
     _tp_hash[hash_slot].listener_key = NULL;
     _tp_hash[hash_slot].connected = PJ_FALSE;
     _tp_map.erase(tp);
+    publish_connections();
 
     // Release the lock now so we don't have a deadlock if pjsip_transport_shutdown
     // calls the transport state listener.
-    pthread_mutex_unlock(&_tp_hash_lock);
+    _tp_hash_lock.unlock();
 
     // Quiesce the transport.  PJSIP will destroy the transport when there
     // are no further references to it.
     pjsip_transport_shutdown(tp);
 
-    // Remove our reference to the transport.
-    pjsip_transport_dec_ref(tp);
+    // Our reference to the transport is removed when we, and any threads
+    // that picked the connection just before it was removed, are done with
+    // it.
+    connection.reset();
   }
   else
   {
-    pthread_mutex_unlock(&_tp_hash_lock);
+    _tp_hash_lock.unlock();
   }
 }
 
@@ -303,7 +618,8 @@ void SIPConnectionPool::quiesce_connections()
 void SIPConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transport_state state)
 {
   // Transport state has changed.
-  pthread_mutex_lock(&_tp_hash_lock);
+  std::shared_ptr<Connection> connection;
+  _tp_hash_lock.lock();
 
   std::map<pjsip_transport*, int>::const_iterator i = _tp_map.find(tp);
 
@@ -316,7 +632,6 @@ void SIPConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transp
       // New connection has connected successfully, so update the statistics.
       TRC_DEBUG("Transport %s in slot %d has connected", tp->obj_name, hash_slot);
       _tp_hash[hash_slot].connected = PJ_TRUE;
-      ++_active_connections;
       increment_connection_count(tp);
 
       if (_recycle_period > 0)
@@ -332,6 +647,8 @@ void SIPConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transp
         // Connection recycling is disabled.
         _tp_hash[hash_slot].recycle_time = 0;
       }
+
+      publish_connections();
     }
     else if ((state == PJSIP_TP_STATE_DISCONNECTED) ||
              (state == PJSIP_TP_STATE_DESTROYED))
@@ -343,7 +660,6 @@ void SIPConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transp
       if (_tp_hash[hash_slot].connected)
       {
         // A connection has failed, so update the statistics.
-        --_active_connections;
         decrement_connection_count(tp);
       }
       else
@@ -379,18 +695,21 @@ void SIPConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transp
                                               (void *)this);
       }
 
-      // Remove the transport from the hash and the map.
-      _tp_hash[hash_slot].tp = NULL;
+      // Remove the transport from the hash and the map, and stop it being
+      // picked.
+      connection.swap(_tp_hash[hash_slot].connection);
       _tp_hash[hash_slot].listener_key = NULL;
       _tp_hash[hash_slot].connected = PJ_FALSE;
       _tp_map.erase(tp);
-
-      // Remove our reference to the transport.
-      pjsip_transport_dec_ref(tp);
+      publish_connections();
     }
   }
 
-  pthread_mutex_unlock(&_tp_hash_lock);
+  _tp_hash_lock.unlock();
+
+  // Our reference to the transport is removed (if this was the last
+  // reference to the connection) here, outside the lock.
+  connection.reset();
 }
 
 
@@ -410,26 +729,54 @@ void SIPConnectionPool::recycle_connections()
 
     int now = time(NULL);
 
-    // Walk the vector of connections.  This is safe to do without the lock
-    // because the vector is immutable.
+    // Walk the vector of connections.  The vector itself is immutable, but
+    // its slots need the lock.
     for (size_t ii = 0; ii < _tp_hash.size(); ++ii)
     {
-      if (_tp_hash[ii].tp == NULL)
+      _tp_hash_lock.lock();
+      std::shared_ptr<Connection> connection = _tp_hash[ii].connection;
+      bool connected = _tp_hash[ii].connected;
+      int recycle_time = _tp_hash[ii].recycle_time;
+      _tp_hash_lock.unlock();
+
+      if (_recycle_period == 0)
+      {
+        // Connection recycling is disabled - we're only here to report the
+        // load.
+      }
+      else if (connection == NULL)
       {
         // This slot is empty, so try to populate it now.
         create_connection(ii);
       }
-      else if ((_tp_hash[ii].connected) &&
-               (_tp_hash[ii].recycle_time != 0) &&
-               (now >= _tp_hash[ii].recycle_time))
+      else if ((connected) &&
+               (recycle_time != 0) &&
+               (now >= recycle_time))
       {
         // This slot is due to be recycled, so quiesce the existing
         // connection and create a new one.
         TRC_STATUS("Recycle TCP connection slot %d", ii);
+        connection.reset();
+        quiesce_connection(ii);
+        create_connection(ii);
+      }
+      else if ((connected) &&
+               (_selection == LEAST_LOADED) &&
+               (is_slow(connection.get())))
+      {
+        // This connection is much slower than the others, so recycle it
+        // early in the hope of connecting to a healthier server.
+        TRC_STATUS("Recycle slow TCP connection slot %d", ii);
+        connection.reset();
         quiesce_connection(ii);
         create_connection(ii);
       }
     }
+
+    if (_sprout_load_tbl != NULL)
+    {
+      report_load();
+    }
   }
 }
 
@@ -448,6 +795,11 @@ int SIPConnectionPool::recycle_thread(void* p)
 
 void SIPConnectionPool::decrement_connection_count(pjsip_transport *trans)
 {
+  if (_sprout_count_tbl == NULL)
+  {
+    return;
+  }
+
   std::string host = PJUtils::pj_str_to_string(&trans->remote_name.host);
   if (_sprout_count_tbl->get(host)->decrement() == 0)
   {
@@ -458,6 +810,11 @@ void SIPConnectionPool::decrement_connection_count(pjsip_transport *trans)
 
 void SIPConnectionPool::increment_connection_count(pjsip_transport *trans)
 {
+  if (_sprout_count_tbl == NULL)
+  {
+    return;
+  }
+
   std::string host = PJUtils::pj_str_to_string(&trans->remote_name.host);
   _sprout_count_tbl->get(host)->increment();
 }
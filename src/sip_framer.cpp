@@ -0,0 +1,195 @@
+/**
+ * @file sip_framer.cpp Locates SIP message boundaries in a stream.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sip_framer.h"
+
+static const int BLOCK_SIZE = 16;
+
+// Returns a mask of the line feeds in the BLOCK_SIZE bytes at p (or the bytes
+// up to end, if that's nearer).
+static inline uint32_t newline_mask(const char* p, const char* end)
+{
+#ifdef __SSE2__
+  if (end - p >= BLOCK_SIZE)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i*)p);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block,
+                                                      _mm_set1_epi8('\n')));
+  }
+#endif
+
+  uint32_t mask = 0;
+  int len = (end - p < BLOCK_SIZE) ? (int)(end - p) : BLOCK_SIZE;
+  for (int ii = 0; ii < len; ++ii)
+  {
+    if (p[ii] == '\n')
+    {
+      mask |= (1u << ii);
+    }
+  }
+  return mask;
+}
+
+static inline bool is_ws(char c)
+{
+  return (c == ' ') || (c == '\t');
+}
+
+// Skips whitespace, including line folding, as the PJSIP scanner does in
+// headers.
+static const char* skip_ws(const char* p, const char* end)
+{
+  while (p < end)
+  {
+    if (is_ws(*p))
+    {
+      ++p;
+    }
+    else if ((*p == '\r') && (end - p >= 3) && (p[1] == '\n') && is_ws(p[2]))
+    {
+      p += 3;
+    }
+    else if ((*p == '\n') && (end - p >= 2) && is_ws(p[1]))
+    {
+      p += 2;
+    }
+    else
+    {
+      break;
+    }
+  }
+  return p;
+}
+
+// Parses a header line as Content-Length, in the same way as pjsip_find_msg.
+// Returns the length, or -1 if this isn't a valid Content-Length header.
+static int parse_content_length(const char* p, const char* end)
+{
+  static const char NAME[] = "CONTENT-LENGTH";
+  static const int NAME_LEN = sizeof(NAME) - 1;
+
+  if ((end - p > NAME_LEN) && ((*p & 0xDF) == 'C'))
+  {
+    for (int ii = 1; ii < NAME_LEN; ++ii)
+    {
+      if ((p[ii] & 0xDF) != (NAME[ii] & 0xDF))
+      {
+        return -1;
+      }
+    }
+    p += NAME_LEN;
+  }
+  else if ((end - p > 1) &&
+           ((*p & 0xDF) == 'L') &&
+           (is_ws(p[1]) || (p[1] == ':')))
+  {
+    p += 1;
+  }
+  else
+  {
+    return -1;
+  }
+
+  p = skip_ws(p, end);
+  if ((p == end) || (*p != ':'))
+  {
+    return -1;
+  }
+  p = skip_ws(p + 1, end);
+
+  const char* digits = p;
+  int64_t length = 0;
+  while ((p < end) && (*p >= '0') && (*p <= '9'))
+  {
+    length = length * 10 + (*p - '0');
+    if (length > INT32_MAX)
+    {
+      return -1;
+    }
+    ++p;
+  }
+
+  if (p == digits)
+  {
+    return -1;
+  }
+
+  p = skip_ws(p, end);
+  if ((p == end) || ((*p != '\r') && (*p != '\n')))
+  {
+    return -1;
+  }
+
+  return (int)length;
+}
+
+pj_status_t SipFramer::find_msg(const char* buf,
+                                pj_size_t size,
+                                pj_bool_t is_datagram,
+                                pj_size_t* msg_size)
+{
+  *msg_size = size;
+
+  // For datagrams, the whole datagram is the message.
+  if (is_datagram)
+  {
+    return PJ_SUCCESS;
+  }
+
+  // Walk the line feeds a block at a time.  The headers end at the first
+  // "\n\r\n", and the first valid Content-Length header before that gives
+  // the body length.  As in pjsip_find_msg, the start line isn't checked.
+  const char* end = buf + size;
+  const char* body_start = NULL;
+  int content_length = -1;
+
+  for (const char* block = buf;
+       (block < end) && (body_start == NULL);
+       block += BLOCK_SIZE)
+  {
+    uint32_t mask = newline_mask(block, end);
+
+    while (mask != 0)
+    {
+      const char* nl = block + __builtin_ctz(mask);
+      mask &= (mask - 1);
+
+      if ((end - nl >= 3) && (nl[1] == '\r') && (nl[2] == '\n'))
+      {
+        body_start = nl + 3;
+        break;
+      }
+
+      if (content_length == -1)
+      {
+        content_length = parse_content_length(nl + 1, end);
+      }
+    }
+  }
+
+  if (body_start == NULL)
+  {
+    return PJSIP_EPARTIALMSG;
+  }
+
+  if (content_length == -1)
+  {
+    return PJSIP_EMISSINGHDR;
+  }
+
+  *msg_size = (body_start - buf) + content_length;
+  return (*msg_size <= size) ? PJ_SUCCESS : PJSIP_EPARTIALMSG;
+}
@@ -9,15 +9,66 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <climits>
+
 #include "log.h"
 #include "sipresolver.h"
 #include "sas.h"
 #include "sproutsasevent.h"
+#include "threadpool.h"
+
+/// A resolution to do on the resolver threads.
+struct ResolveRequest
+{
+  std::function<BaseAddrIterator*()> resolve;
+  SIPResolver::ResolveCallback callback;
+};
+
+/// The pool of threads used to do asynchronous resolutions.
+class SIPResolver::AsyncPool : public ThreadPool<ResolveRequest*>
+{
+public:
+  AsyncPool(ExceptionHandler* exception_handler, unsigned int num_threads) :
+    ThreadPool<ResolveRequest*>(num_threads,
+                                exception_handler,
+                                &exception_callback,
+                                0)
+  {
+  }
+
+  virtual ~AsyncPool() {}
+
+  static void exception_callback(ResolveRequest* request)
+  {
+    // Pass back an empty set of targets so that the caller fails the request
+    // rather than waiting for ever.
+    request->callback(new SimpleAddrIterator(std::vector<AddrInfo>()));
+    delete request;
+  }
+
+private:
+  virtual void process_work(ResolveRequest*& request)
+  {
+    request->callback(request->resolve());
+    delete request; request = NULL;
+  }
+};
 
 SIPResolver::SIPResolver(DnsCachedResolver* dns_client,
                          int blacklist_duration,
                          int graylist_duration) :
-  BaseResolver(dns_client)
+  BaseResolver(dns_client),
+  _async_pool(NULL),
+  _max_hot_targets(0),
+  _max_stale_ms(0),
+  _hot_targets_scalar(NULL),
+  _refreshes_tbl(NULL),
+  _stale_tbl(NULL),
+  _latency_ordering(false),
+  _overloaded_until_ms(0)
 {
   TRC_DEBUG("Creating SIP resolver");
 
@@ -38,6 +89,13 @@ SIPResolver::SIPResolver(DnsCachedResolver* dns_client,
 
 SIPResolver::~SIPResolver()
 {
+  if (_async_pool != NULL)
+  {
+    _async_pool->stop();
+    _async_pool->join();
+    delete _async_pool; _async_pool = NULL;
+  }
+
   destroy_blacklist();
   destroy_srv_cache();
   destroy_naptr_cache();
@@ -71,7 +129,154 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
                                             int allowed_host_state,
                                             SAS::TrailId trail)
 {
-  int dummy_ttl = 0;
+  IP46Address dummy_address;
+
+  if ((_max_hot_targets == 0) || (Utils::parse_ip_target(name, dummy_address)))
+  {
+    return resolve_targets(name,
+                           af,
+                           port,
+                           transport,
+                           allowed_host_state,
+                           NULL,
+                           trail);
+  }
+
+  std::string key = target_key(name, af, port, transport);
+  unsigned long now = now_ms();
+  bool refresh = false;
+  bool stale = false;
+  std::vector<AddrInfo> stale_targets;
+
+  {
+    std::lock_guard<std::mutex> lock(_hot_targets_lock);
+    std::map<std::string, HotTarget>::iterator hot = _hot_targets.find(key);
+
+    if (hot == _hot_targets.end())
+    {
+      if ((_hot_targets.size() >= _max_hot_targets) &&
+          (!_hot_targets_lru.empty()))
+      {
+        _hot_targets.erase(_hot_targets_lru.back());
+        _hot_targets_lru.pop_back();
+      }
+
+      // Fetch this next hop's targets in the background, so that they are
+      // available if its records expire.
+      hot = _hot_targets.emplace(key, HotTarget()).first;
+      hot->second.name = name;
+      hot->second.af = af;
+      hot->second.port = port;
+      hot->second.transport = transport;
+      hot->second.expiry_ms = 0;
+      hot->second.refreshing = true;
+      hot->second.lru = _hot_targets_lru.insert(_hot_targets_lru.begin(), key);
+      refresh = true;
+
+      if (_hot_targets_scalar != NULL)
+      {
+        _hot_targets_scalar->value = _hot_targets.size();
+      }
+    }
+    else
+    {
+      _hot_targets_lru.splice(_hot_targets_lru.begin(),
+                              _hot_targets_lru,
+                              hot->second.lru);
+
+      if ((hot->second.expiry_ms != 0) && (now >= hot->second.expiry_ms))
+      {
+        // The records for this next hop have expired, so refresh them (unless
+        // that's already in progress).  Until that completes, use the previous
+        // targets if they aren't too old.
+        if (!hot->second.refreshing)
+        {
+          hot->second.refreshing = true;
+          refresh = true;
+        }
+
+        if ((now < hot->second.expiry_ms + _max_stale_ms) &&
+            (!hot->second.targets.empty()))
+        {
+          stale = true;
+          stale_targets = hot->second.targets;
+        }
+      }
+    }
+  }
+
+  if (refresh)
+  {
+    TRC_DEBUG("Refresh targets for %s", name.c_str());
+
+    if (_async_pool != NULL)
+    {
+      _async_pool->add_work(new ResolveRequest{
+        [this, key, name, af, port, transport]()
+        {
+          refresh_hot_target(key, name, af, port, transport);
+          return (BaseAddrIterator*)NULL;
+        },
+        [this, key](BaseAddrIterator* targets_iter)
+        {
+          if (targets_iter != NULL)
+          {
+            // The refresh failed, so allow it to be tried again.
+            delete targets_iter;
+            std::lock_guard<std::mutex> lock(_hot_targets_lock);
+            std::map<std::string, HotTarget>::iterator hot =
+                                                       _hot_targets.find(key);
+
+            if (hot != _hot_targets.end())
+            {
+              hot->second.refreshing = false;
+            }
+          }
+        }});
+    }
+    else
+    {
+      refresh_hot_target(key, name, af, port, transport);
+    }
+  }
+
+  if (stale)
+  {
+    TRC_DEBUG("Use previous targets for %s while they are refreshed",
+              name.c_str());
+
+    if (_stale_tbl != NULL)
+    {
+      _stale_tbl->increment();
+    }
+
+    std::vector<AddrInfo> targets;
+
+    for (AddrInfo& ai : stale_targets)
+    {
+      if (select_address(ai, trail, allowed_host_state))
+      {
+        targets.push_back(ai);
+      }
+    }
+
+    return new SimpleAddrIterator(targets);
+  }
+
+  return resolve_targets(name, af, port, transport, allowed_host_state, NULL, trail);
+}
+
+/// Resolves the next hop following the process in RFC 3263.
+BaseAddrIterator* SIPResolver::resolve_targets(const std::string& name,
+                                               int af,
+                                               int port,
+                                               int transport,
+                                               int allowed_host_state,
+                                               int* ttl,
+                                               SAS::TrailId trail)
+{
+  int record_ttl = 0;
+  int min_ttl = INT_MAX;
 
   // First determine the transport following the process in RFC3263 section
   // 4.1.
@@ -94,6 +299,28 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
     SAS::report_event(event);
   }
 
+  if (ttl != NULL)
+  {
+    *ttl = 0;
+  }
+
+  // An IP address next hop always resolves to the same target if hosts in
+  // any state are allowed, so check whether we already have it.
+  std::string ip_key;
+
+  if (allowed_host_state == BaseResolver::ALL_LISTS)
+  {
+    ip_key = target_key(name, 0, port, transport);
+    std::lock_guard<std::mutex> lock(_ip_targets_lock);
+    std::map<std::string, std::shared_ptr<const std::vector<AddrInfo>>>::iterator
+                                              cached = _ip_targets.find(ip_key);
+
+    if (cached != _ip_targets.end())
+    {
+      return new SharedAddrIterator(cached->second);
+    }
+  }
+
   if (Utils::parse_ip_target(name, ai.address))
   {
     // The name is already an IP address, so no DNS resolution is possible.
@@ -103,7 +330,8 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
     // Creates an empty vector to contain the targets, which will contain only
     // this address if the address' host state is allowed, and be empty
     // otherwise. An iterator to this vector will be returned.
-    std::vector<AddrInfo> targets;
+    std::shared_ptr<std::vector<AddrInfo>> targets =
+                                     std::make_shared<std::vector<AddrInfo>>();
 
     // Check with the resolver if this host is allowed based on its current
     // blacklist state.
@@ -112,11 +340,25 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
 
     if (select_address(ai, trail, allowed_host_state))
     {
-      targets.push_back(ai);
+      targets->push_back(ai);
+    }
+
+    if ((!ip_key.empty()) && (!targets->empty()))
+    {
+      std::lock_guard<std::mutex> lock(_ip_targets_lock);
+
+      if (_ip_targets.size() >= MAX_IP_TARGETS)
+      {
+        // LCOV_EXCL_START - we don't expect this many IP address next hops.
+        _ip_targets.clear();
+        // LCOV_EXCL_STOP
+      }
+
+      _ip_targets[ip_key] = targets;
     }
 
     // Creates an iterator to the vector of targets.
-    targets_iter = new SimpleAddrIterator(targets);
+    targets_iter = new SharedAddrIterator(targets);
   }
   else
   {
@@ -153,7 +395,8 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
         SAS::report_event(event);
       }
 
-      std::shared_ptr<NAPTRReplacement> naptr = _naptr_cache->get(name, dummy_ttl, trail);
+      std::shared_ptr<NAPTRReplacement> naptr = _naptr_cache->get(name, record_ttl, trail);
+      min_ttl = std::min(min_ttl, record_ttl);
 
       if (naptr != NULL)
       {
@@ -217,6 +460,7 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
         DnsResult& tcp_result = results[1];
         TRC_DEBUG("TCP SRV record %s returned %d records",
                   tcp_result.domain().c_str(), tcp_result.records().size());
+        min_ttl = std::min(min_ttl, std::min(udp_result.ttl(), tcp_result.ttl()));
 
         if (!udp_result.records().empty())
         {
@@ -254,6 +498,7 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
       }
 
       DnsResult result = _dns_client->dns_query("_sip._udp." + name, ns_t_srv, trail);
+      min_ttl = std::min(min_ttl, result.ttl());
 
       if (!result.records().empty())
       {
@@ -275,6 +520,7 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
       }
 
       DnsResult result = _dns_client->dns_query("_sip._tcp." + name, ns_t_srv, trail);
+      min_ttl = std::min(min_ttl, result.ttl());
 
       if (!result.records().empty())
       {
@@ -296,6 +542,16 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
       }
 
       targets_iter = srv_resolve_iter(srv_name, af, transport, trail, allowed_host_state);
+      targets_iter = order_by_latency(targets_iter, srv_name);
+
+      if (ttl != NULL)
+      {
+        // The SRV resolution doesn't tell us when its records expire, so get
+        // the SRV record's TTL from the cache it has just filled.  The A/AAAA
+        // records of the SRV targets usually have at least the same TTL.
+        DnsResult result = _dns_client->dns_query(srv_name, ns_t_srv, 0);
+        min_ttl = std::min(min_ttl, result.ttl());
+      }
     }
     else
     {
@@ -313,13 +569,399 @@ BaseAddrIterator* SIPResolver::resolve_iter(const std::string& name,
         SAS::report_event(event);
       }
 
-      targets_iter = a_resolve_iter(a_name, af, port, transport, dummy_ttl, trail, allowed_host_state);
+      targets_iter = a_resolve_iter(a_name, af, port, transport, record_ttl, trail, allowed_host_state);
+      min_ttl = std::min(min_ttl, record_ttl);
     }
   }
 
+  if (ttl != NULL)
+  {
+    *ttl = (min_ttl != INT_MAX) ? min_ttl : 0;
+  }
+
   return targets_iter;
 }
 
+void SIPResolver::start_async_resolution(int num_threads,
+                                         ExceptionHandler* exception_handler)
+{
+  if ((num_threads > 0) && (_async_pool == NULL))
+  {
+    TRC_STATUS("Starting %d SIP resolver threads", num_threads);
+    _async_pool = new AsyncPool(exception_handler, num_threads);
+    _async_pool->start();
+  }
+}
+
+BaseAddrIterator* SIPResolver::resolve_iter_async(const std::string& name,
+                                                  int af,
+                                                  int port,
+                                                  int transport,
+                                                  int allowed_host_state,
+                                                  ResolveCallback callback,
+                                                  SAS::TrailId trail)
+{
+  IP46Address dummy_address;
+
+  if ((_async_pool == NULL) || (Utils::parse_ip_target(name, dummy_address)))
+  {
+    // Either there are no resolver threads, or no DNS lookup is needed, so
+    // resolve on this thread.
+    return resolve_iter(name, af, port, transport, allowed_host_state, trail);
+  }
+
+  TRC_DEBUG("Queue resolution of %s", name.c_str());
+  _async_pool->add_work(new ResolveRequest{
+    [this, name, af, port, transport, allowed_host_state, trail]()
+    {
+      return resolve_iter(name, af, port, transport, allowed_host_state, trail);
+    },
+    callback});
+
+  return NULL;
+}
+
+void SIPResolver::enable_hot_targets(size_t max_hot_targets,
+                                     int max_stale,
+                                     SNMP::U32Scalar* hot_targets_scalar,
+                                     SNMP::CounterTable* refreshes_tbl,
+                                     SNMP::CounterTable* stale_tbl)
+{
+  std::lock_guard<std::mutex> lock(_hot_targets_lock);
+  _max_hot_targets = max_hot_targets;
+  _max_stale_ms = (unsigned long)std::max(0, max_stale) * 1000;
+  _hot_targets_scalar = hot_targets_scalar;
+  _refreshes_tbl = refreshes_tbl;
+  _stale_tbl = stale_tbl;
+}
+
+void SIPResolver::refresh_hot_target(const std::string& key,
+                                     const std::string& name,
+                                     int af,
+                                     int port,
+                                     int transport)
+{
+  int ttl = 0;
+  BaseAddrIterator* targets_iter = resolve_targets(name,
+                                                   af,
+                                                   port,
+                                                   transport,
+                                                   BaseResolver::ALL_LISTS,
+                                                   &ttl,
+                                                   0);
+  std::vector<AddrInfo> targets = targets_iter->take(MAX_HOT_TARGET_ADDRS);
+  delete targets_iter; targets_iter = nullptr;
+
+  TRC_DEBUG("Refreshed %d targets for %s, TTL %d",
+            targets.size(), name.c_str(), ttl);
+
+  if (_refreshes_tbl != NULL)
+  {
+    _refreshes_tbl->increment();
+  }
+
+  std::lock_guard<std::mutex> lock(_hot_targets_lock);
+  std::map<std::string, HotTarget>::iterator hot = _hot_targets.find(key);
+
+  if (hot != _hot_targets.end())
+  {
+    // Don't refresh more than once a second, even if the records have a
+    // shorter TTL.
+    hot->second.targets.swap(targets);
+    hot->second.expiry_ms = now_ms() + std::max(ttl, 1) * 1000;
+    hot->second.refreshing = false;
+  }
+}
+
+std::vector<AddrInfo> SharedAddrIterator::take(int num_requested_targets)
+{
+  size_t end = std::min(_targets->size(), _next + num_requested_targets);
+  std::vector<AddrInfo> targets(_targets->begin() + _next,
+                                _targets->begin() + end);
+  _next = end;
+  return targets;
+}
+
+bool SharedAddrIterator::next(AddrInfo& target)
+{
+  if (_next < _targets->size())
+  {
+    target = (*_targets)[_next++];
+    return true;
+  }
+
+  return false;
+}
+
+std::vector<AddrInfo> PrefixedAddrIterator::take(int num_requested_targets)
+{
+  size_t end = std::min(_prefix.size(), _next + num_requested_targets);
+  std::vector<AddrInfo> targets(_prefix.begin() + _next,
+                                _prefix.begin() + end);
+  _next = end;
+
+  if ((int)targets.size() < num_requested_targets)
+  {
+    std::vector<AddrInfo> rest =
+                    _rest->take(num_requested_targets - (int)targets.size());
+    targets.insert(targets.end(), rest.begin(), rest.end());
+  }
+
+  return targets;
+}
+
+bool PrefixedAddrIterator::next(AddrInfo& target)
+{
+  if (_next < _prefix.size())
+  {
+    target = _prefix[_next++];
+    return true;
+  }
+
+  return _rest->next(target);
+}
+
+void SIPResolver::enable_latency_ordering()
+{
+  _latency_ordering = true;
+}
+
+void SIPResolver::record_latency(const AddrInfo& target,
+                                 unsigned long latency_us)
+{
+  if (!_latency_ordering)
+  {
+    return;
+  }
+
+  std::string key = target.to_string();
+  unsigned long now = now_ms();
+  std::lock_guard<std::mutex> lock(_latencies_lock);
+  std::map<std::string, LatencyEstimate>::iterator estimate =
+                                                        _latencies.find(key);
+
+  if (estimate == _latencies.end())
+  {
+    if (_latencies.size() >= MAX_LATENCIES)
+    {
+      // Most of these are probably out of date, so start again.
+      _latencies.clear();
+    }
+
+    _latencies[key] = LatencyEstimate{latency_us, now};
+  }
+  else if (now - estimate->second.updated_ms >= LATENCY_DECAY_MS)
+  {
+    // The previous estimate is too old to be worth keeping.
+    estimate->second = LatencyEstimate{latency_us, now};
+  }
+  else
+  {
+    long delta = (long)latency_us - (long)estimate->second.latency_us;
+    estimate->second.latency_us += delta / (long)LATENCY_GAIN;
+    estimate->second.updated_ms = now;
+  }
+}
+
+bool SIPResolver::latency_estimate(const AddrInfo& target,
+                                   unsigned long& latency_us)
+{
+  std::string key = target.to_string();
+  std::lock_guard<std::mutex> lock(_latencies_lock);
+  std::map<std::string, LatencyEstimate>::const_iterator estimate =
+                                                        _latencies.find(key);
+
+  if ((estimate == _latencies.end()) ||
+      (now_ms() - estimate->second.updated_ms >= LATENCY_DECAY_MS))
+  {
+    return false;
+  }
+
+  latency_us = estimate->second.latency_us;
+  return true;
+}
+
+BaseAddrIterator* SIPResolver::order_by_latency(BaseAddrIterator* targets_iter,
+                                                const std::string& srv_name)
+{
+  if (!_latency_ordering)
+  {
+    return targets_iter;
+  }
+
+  // The SRV targets come out in a random order weighted by their SRV
+  // weights, so the first two are two random choices.  Try the quicker of
+  // them first, as long as it's clearly quicker (so that we don't flap
+  // between similar targets) and we know that the SRV records allow it.
+  // Targets that haven't responded recently are left where they are, so
+  // they still get some traffic.
+  std::vector<AddrInfo> first_two = targets_iter->take(2);
+  unsigned long first_us = 0;
+  unsigned long second_us = 0;
+
+  if ((first_two.size() == 2) &&
+      (latency_estimate(first_two[0], first_us)) &&
+      (latency_estimate(first_two[1], second_us)) &&
+      (first_us * 2 > second_us * 3))
+  {
+    DnsResult srv_result = _dns_client->dns_query(srv_name, ns_t_srv, 0);
+    int first_priority = srv_priority(srv_result, first_two[0]);
+
+    if ((first_priority != -1) &&
+        (first_priority == srv_priority(srv_result, first_two[1])))
+    {
+      TRC_DEBUG("Try %s (%ldus) before %s (%ldus)",
+                first_two[1].to_string().c_str(), second_us,
+                first_two[0].to_string().c_str(), first_us);
+      std::swap(first_two[0], first_two[1]);
+    }
+  }
+
+  return new PrefixedAddrIterator(first_two, targets_iter);
+}
+
+void SIPResolver::record_overload(const AddrInfo& target, int retry_after_s)
+{
+  unsigned long duration_ms = (retry_after_s > 0) ?
+                                (unsigned long)retry_after_s * 1000 : 0;
+  if (duration_ms < OVERLOAD_DURATION_MS)
+  {
+    duration_ms = OVERLOAD_DURATION_MS;
+  }
+  unsigned long until_ms = now_ms() + duration_ms;
+
+  TRC_DEBUG("%s is overloaded, avoid it for %lums",
+            target.to_string().c_str(), duration_ms);
+
+  std::lock_guard<std::mutex> lock(_overloaded_lock);
+  if ((_overloaded.size() >= MAX_OVERLOADED) &&
+      (_overloaded.find(target.to_string()) == _overloaded.end()))
+  {
+    // Most of these have probably expired, so start again.
+    _overloaded.clear();
+  }
+
+  _overloaded[target.to_string()] = until_ms;
+
+  if (until_ms > _overloaded_until_ms)
+  {
+    _overloaded_until_ms = until_ms;
+  }
+}
+
+bool SIPResolver::is_overloaded(const AddrInfo& target, unsigned long now)
+{
+  std::lock_guard<std::mutex> lock(_overloaded_lock);
+  std::map<std::string, unsigned long>::iterator overloaded =
+                                          _overloaded.find(target.to_string());
+
+  if (overloaded == _overloaded.end())
+  {
+    return false;
+  }
+  else if (now >= overloaded->second)
+  {
+    _overloaded.erase(overloaded);
+    return false;
+  }
+
+  return true;
+}
+
+BaseAddrIterator* SIPResolver::avoid_overloaded(BaseAddrIterator* targets_iter)
+{
+  unsigned long now = now_ms();
+
+  if ((targets_iter == NULL) || (now >= _overloaded_until_ms))
+  {
+    // No targets have said they're overloaded recently.
+    return targets_iter;
+  }
+
+  // Only the first target is moved, so that if every target is overloaded
+  // the order is unchanged, and the request still goes somewhere.
+  std::vector<AddrInfo> first_two = targets_iter->take(2);
+
+  if ((first_two.size() == 2) &&
+      (is_overloaded(first_two[0], now)) &&
+      (!is_overloaded(first_two[1], now)))
+  {
+    TRC_DEBUG("Try %s before overloaded %s",
+              first_two[1].to_string().c_str(),
+              first_two[0].to_string().c_str());
+    std::swap(first_two[0], first_two[1]);
+  }
+
+  return new PrefixedAddrIterator(first_two, targets_iter);
+}
+
+int SIPResolver::srv_priority(DnsResult& srv_result, const AddrInfo& target)
+{
+  int dnstype = (target.address.af == AF_INET) ? ns_t_a : ns_t_aaaa;
+
+  for (DnsRRecord* rr : srv_result.records())
+  {
+    if (rr->rrtype() != ns_t_srv)
+    {
+      continue;
+    }
+
+    DnsSrvRecord* srv = (DnsSrvRecord*)rr;
+
+    if (srv->port() != target.port)
+    {
+      continue;
+    }
+
+    // The SRV resolution has just looked up the targets' addresses, so these
+    // come from the cache.
+    DnsResult a_result = _dns_client->dns_query(srv->target(), dnstype, 0);
+
+    for (DnsRRecord* a_rr : a_result.records())
+    {
+      if ((a_rr->rrtype() == ns_t_a) &&
+          (target.address.af == AF_INET) &&
+          (((DnsARecord*)a_rr)->address().s_addr ==
+                                      target.address.addr.ipv4.s_addr))
+      {
+        return srv->priority();
+      }
+      else if ((a_rr->rrtype() == ns_t_aaaa) &&
+               (target.address.af == AF_INET6) &&
+               (memcmp(&((DnsAAAARecord*)a_rr)->address(),
+                       &target.address.addr.ipv6,
+                       sizeof(struct in6_addr)) == 0))
+      {
+        return srv->priority();
+      }
+    }
+  }
+
+  return -1;
+}
+
+std::string SIPResolver::target_key(const std::string& name,
+                                        int af,
+                                        int port,
+                                        int transport)
+{
+  std::string key = name;
+  key.push_back('\0');
+  key.append(std::to_string(af));
+  key.push_back(':');
+  key.append(std::to_string(port));
+  key.push_back(':');
+  key.append(std::to_string(transport));
+  return key;
+}
+
+unsigned long SIPResolver::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 std::string SIPResolver::get_transport_str(int transport)
 {
   if (transport == IPPROTO_UDP)
@@ -0,0 +1,116 @@
+/**
+ * @file snmp_shards.cpp Per-thread aggregation of SNMP statistics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <set>
+#include <thread>
+
+#include "log.h"
+#include "snmp_shards.h"
+
+namespace SNMPShards
+{
+  struct Registry
+  {
+    Registry() :
+      stopping(false)
+    {
+    }
+
+    /// Held while the aggregators are flushed, so an aggregator can't be
+    /// destroyed while it's being flushed.
+    std::mutex lock;
+    std::set<Aggregator*> aggregators;
+
+    std::condition_variable cond;
+    bool stopping;
+    std::thread ticker;
+  };
+
+  static Registry& registry()
+  {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  void Aggregator::register_aggregator()
+  {
+    Registry& shards = registry();
+    std::lock_guard<std::mutex> guard(shards.lock);
+    shards.aggregators.insert(this);
+  }
+
+  void Aggregator::unregister_aggregator()
+  {
+    Registry& shards = registry();
+    std::lock_guard<std::mutex> guard(shards.lock);
+    shards.aggregators.erase(this);
+  }
+
+  static void flush_locked(Registry& shards)
+  {
+    for (Aggregator* aggregator : shards.aggregators)
+    {
+      aggregator->flush();
+    }
+  }
+
+  void flush_all()
+  {
+    Registry& shards = registry();
+    std::lock_guard<std::mutex> guard(shards.lock);
+    flush_locked(shards);
+  }
+
+  // LCOV_EXCL_START - the tick thread isn't run in UT.
+  static void tick_thread()
+  {
+    Registry& shards = registry();
+    std::unique_lock<std::mutex> lock(shards.lock);
+
+    while (!shards.cond.wait_for(lock,
+                                 std::chrono::milliseconds(FLUSH_INTERVAL_MS),
+                                 [&shards]() { return shards.stopping; }))
+    {
+      flush_locked(shards);
+    }
+  }
+
+  void start()
+  {
+    Registry& shards = registry();
+    std::lock_guard<std::mutex> guard(shards.lock);
+    TRC_STATUS("Flushing SNMP statistics from per-thread shards every %dms",
+               FLUSH_INTERVAL_MS);
+    shards.stopping = false;
+    shards.ticker = std::thread(tick_thread);
+  }
+
+  void stop()
+  {
+    Registry& shards = registry();
+
+    {
+      std::lock_guard<std::mutex> guard(shards.lock);
+      shards.stopping = true;
+      shards.cond.notify_all();
+    }
+
+    if (shards.ticker.joinable())
+    {
+      shards.ticker.join();
+    }
+
+    flush_all();
+  }
+  // LCOV_EXCL_STOP
+}
@@ -0,0 +1,280 @@
+/**
+ * @file sproutlet_cpu.cpp Accounting of the CPU time each Sproutlet uses.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <ctype.h>
+#include <time.h>
+#include <map>
+#include <mutex>
+
+#include "log.h"
+#include "sproutlet_cpu.h"
+#include "metrics.h"
+#include "worker_watchdog.h"
+
+SproutletCpuAccount::SproutletCpuAccount(SNMP::EventAccumulatorTable* tbl,
+                                         const std::string& name) :
+  _tbl(tbl),
+  _name(name),
+  _callbacks(0),
+  _total_ns(0),
+  _max_ns(0),
+  _busy_workers(0),
+  _max_busy_workers(0),
+  _max_workers(0),
+  _rejected(0)
+{
+}
+
+SproutletCpuAccount::~SproutletCpuAccount()
+{
+  delete _tbl; _tbl = NULL;
+}
+
+void SproutletCpuAccount::record(uint64_t ns)
+{
+  _callbacks.fetch_add(1, std::memory_order_relaxed);
+  _total_ns.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t max = _max_ns.load(std::memory_order_relaxed);
+  while ((ns > max) &&
+         (!_max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)))
+  {
+  }
+
+  if (_tbl != NULL)
+  {
+    _tbl->accumulate(ns / 1000);
+  }
+}
+
+void SproutletCpuAccount::enter()
+{
+  int busy = _busy_workers.fetch_add(1, std::memory_order_relaxed) + 1;
+
+  int max = _max_busy_workers.load(std::memory_order_relaxed);
+  while ((busy > max) &&
+         (!_max_busy_workers.compare_exchange_weak(max, busy, std::memory_order_relaxed)))
+  {
+  }
+}
+
+void SproutletCpuAccount::leave()
+{
+  _busy_workers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool SproutletCpuAccount::admit()
+{
+  int max_workers = _max_workers.load(std::memory_order_relaxed);
+
+  if ((max_workers > 0) &&
+      (_busy_workers.load(std::memory_order_relaxed) >= max_workers))
+  {
+    _rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  return true;
+}
+
+SproutletCpuAccount::Summary SproutletCpuAccount::summary() const
+{
+  Summary summary;
+  summary.callbacks = _callbacks.load(std::memory_order_relaxed);
+  summary.total_us = _total_ns.load(std::memory_order_relaxed) / 1000;
+  summary.max_us = _max_ns.load(std::memory_order_relaxed) / 1000;
+  summary.busy_workers = _busy_workers.load(std::memory_order_relaxed);
+  summary.max_busy_workers = _max_busy_workers.load(std::memory_order_relaxed);
+  summary.max_workers = _max_workers.load(std::memory_order_relaxed);
+  summary.rejected = _rejected.load(std::memory_order_relaxed);
+  return summary;
+}
+
+namespace SproutletCpu
+{
+  static const std::string BASE_OID = ".1.2.826.0.1.1578918.9.3.78";
+
+  struct Account
+  {
+    int index;
+    SproutletCpuAccount* account;
+  };
+
+  struct Accounts
+  {
+    std::mutex lock;
+    std::map<std::string, Account> by_name;
+
+    // The worker limits set for each Sproutlet, including those that don't
+    // have accounts yet.
+    std::map<std::string, int> max_workers;
+  };
+
+  // The accounts are never destroyed, so that Sproutlets being torn down at
+  // shutdown can still use them.
+  static Accounts& all_accounts()
+  {
+    static Accounts* accounts = new Accounts();
+    return *accounts;
+  }
+
+  static thread_local Timer* tl_current_timer = NULL;
+
+  uint64_t thread_cpu_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  SproutletCpuAccount* account(const std::string& name)
+  {
+    Accounts& accounts = all_accounts();
+    std::lock_guard<std::mutex> guard(accounts.lock);
+
+    std::map<std::string, Account>::iterator it = accounts.by_name.find(name);
+    if (it == accounts.by_name.end())
+    {
+      int index = accounts.by_name.size() + 1;
+      std::string oid = BASE_OID + "." + std::to_string(index);
+      TRC_DEBUG("Accounting CPU time of Sproutlet %s at %s",
+                name.c_str(), oid.c_str());
+
+      SNMP::EventAccumulatorTable* tbl =
+        SNMP::EventAccumulatorTable::create("sproutlet_cpu_time_" + name, oid);
+      SproutletCpuAccount* account = new SproutletCpuAccount(tbl, name);
+      it = accounts.by_name.insert(
+             std::make_pair(name, Account{index, account})).first;
+
+      std::map<std::string, int>::const_iterator max_workers =
+                                                  accounts.max_workers.find(name);
+      if (max_workers != accounts.max_workers.end())
+      {
+        account->set_max_workers(max_workers->second);
+      }
+
+      // Metric names may only contain letters, digits and underscores.
+      std::string metric = "sprout_sproutlet_" + name;
+      for (char& c : metric)
+      {
+        if (!isalnum((unsigned char)c))
+        {
+          c = '_';
+        }
+      }
+
+      Metrics::gauge(metric + "_busy_workers",
+                     "Worker threads running callbacks for Sproutlet " + name,
+                     [account]() { return (double)account->summary().busy_workers; });
+      Metrics::gauge(metric + "_bulkhead_rejected",
+                     "New transactions for Sproutlet " + name +
+                       " rejected because it occupied too many worker threads",
+                     [account]() { return (double)account->summary().rejected; });
+    }
+
+    return it->second.account;
+  }
+
+  void set_max_workers(const std::string& name, int max_workers)
+  {
+    Accounts& accounts = all_accounts();
+    std::lock_guard<std::mutex> guard(accounts.lock);
+
+    accounts.max_workers[name] = max_workers;
+
+    std::map<std::string, Account>::iterator it = accounts.by_name.find(name);
+    if (it != accounts.by_name.end())
+    {
+      it->second.account->set_max_workers(max_workers);
+    }
+  }
+
+  Timer::Timer(SproutletCpuAccount* account) :
+    _account(account),
+    _occupies((account != NULL) && (!running(tl_current_timer, account))),
+    _outer(tl_current_timer),
+    _outer_activity(NULL),
+    _start_ns(thread_cpu_ns()),
+    _inner_ns(0)
+  {
+    tl_current_timer = this;
+
+    if (_account != NULL)
+    {
+      // Tell the watchdog which Sproutlet the thread is running.
+      _outer_activity = WorkerWatchdog::set_activity(_account->name());
+    }
+
+    if (_occupies)
+    {
+      _account->enter();
+    }
+  }
+
+  Timer::~Timer()
+  {
+    uint64_t elapsed_ns = thread_cpu_ns() - _start_ns;
+    tl_current_timer = _outer;
+
+    if (_outer != NULL)
+    {
+      _outer->_inner_ns += elapsed_ns;
+    }
+
+    if (_account != NULL)
+    {
+      _account->record((elapsed_ns > _inner_ns) ? elapsed_ns - _inner_ns : 0);
+    }
+
+    if (_occupies)
+    {
+      _account->leave();
+    }
+
+    if (_account != NULL)
+    {
+      WorkerWatchdog::set_activity(_outer_activity);
+    }
+  }
+
+  bool Timer::running(const Timer* timer, const SproutletCpuAccount* account)
+  {
+    for (; timer != NULL; timer = timer->_outer)
+    {
+      if (timer->_account == account)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  std::vector<AccountSummary> summaries()
+  {
+    std::vector<std::pair<std::string, Account>> snapshot;
+    {
+      Accounts& accounts = all_accounts();
+      std::lock_guard<std::mutex> guard(accounts.lock);
+      snapshot.assign(accounts.by_name.begin(), accounts.by_name.end());
+    }
+
+    std::vector<AccountSummary> summaries;
+    for (const std::pair<std::string, Account>& account : snapshot)
+    {
+      summaries.push_back({account.first,
+                           account.second.index,
+                           account.second.account->summary()});
+    }
+
+    return summaries;
+  }
+}
@@ -20,18 +20,15 @@ SproutletAppServerTsxHelper::SproutletAppServerTsxHelper(SproutletTsxHelper* hel
   _record_routed(false),
   _rr_param_value("")
 {
-  // Create a small pool to hold the onward Route for the request.
-  _pool = pj_pool_create(&stack_data.cp.factory,
-                         "app-route",
-                         1000,
-                         1000,
-                         NULL);
   pj_list_init(&_route_set);
 }
 
 SproutletAppServerTsxHelper::~SproutletAppServerTsxHelper()
 {
-  pj_pool_release(_pool);
+  if (_pool != NULL)
+  {
+    pj_pool_release(_pool);
+  }
 }
 
 /// Stores the onward route for this transaction ready to apply to requests
@@ -45,6 +42,17 @@ void SproutletAppServerTsxHelper::store_onward_route(pjsip_msg* req)
   {
     TRC_DEBUG("Store header: %s",
               PJUtils::hdr_to_string((pjsip_hdr*)hroute).c_str());
+
+    if (_pool == NULL)
+    {
+      // Create a small pool to hold the onward Route for the request.
+      _pool = pj_pool_create(&stack_data.cp.factory,
+                             "app-route",
+                             1000,
+                             1000,
+                             NULL);
+    }
+
     pj_list_push_back(&_route_set, pjsip_hdr_clone(_pool, hroute));
     hroute = (pjsip_route_hdr*)
                         pjsip_msg_find_hdr(req, PJSIP_H_ROUTE, hroute->next);
@@ -200,7 +208,7 @@ int SproutletAppServerTsxHelper::send_request(pjsip_msg*& req)
   if (_record_routed)
   {
     pjsip_param *param = PJ_POOL_ALLOC_T(pool, pjsip_param);
-    pj_strdup(pool, &param->name, &STR_DIALOG_ID);
+    param->name = STR_DIALOG_ID;
     pj_strdup2(pool, &param->value, _rr_param_value.c_str());
 
     pjsip_sip_uri* uri = get_reflexive_uri(pool);
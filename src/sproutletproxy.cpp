@@ -17,15 +17,24 @@ extern "C" {
 #include <pjsip-simple/evsub.h>
 }
 
+#include <algorithm>
+#include <memory>
 #include <sstream>
+#include <vector>
 
+#include "constants.h"
 #include "log.h"
 #include "pjutils.h"
 #include "sproutsasevent.h"
 #include "sproutletproxy.h"
 #include "snmp_sip_request_types.h"
+#include "thread_dispatcher.h"
+#include "flight_recorder.h"
+#include "as_connection_pools.h"
 
 const pj_str_t SproutletProxy::STR_SERVICE = {"service", 7};
+const pj_str_t SproutletProxy::STR_STATELESS_BRANCH_PREFIX = {PJSIP_RFC3261_BRANCH_ID "sl-",
+                                                              PJSIP_RFC3261_BRANCH_LEN + 3};
 
 const ForkState NULL_FORK_STATE = {PJSIP_TSX_STATE_NULL, NONE};
 
@@ -40,7 +49,10 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
                                const std::set<std::string>& stateless_proxies,
                                SNMP::CounterTable* route_to_remote_alias_tbl,
                                SNMP::CounterTable* accept_for_remote_alias_tbl,
-                               int max_sproutlet_depth) :
+                               int max_sproutlet_depth,
+                               SNMP::EventAccumulatorTable* bytes_cloned_tbl,
+                               bool stateless_in_dialog,
+                               bool collapse_record_routes) :
   BasicProxy(endpt,
              "mod-sproutlet-controller",
              priority,
@@ -50,10 +62,15 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
   _host_local_aliases(host_local_aliases),
   _host_remote_aliases(host_remote_aliases),
   _always_serve_remote_aliases(always_serve_remote_aliases),
+  _service_index(false, NULL),
+  _host_index(true, AliasMatchLocality::NO_MATCH),
   _sproutlets(sproutlets),
   _route_to_remote_alias_tbl(route_to_remote_alias_tbl),
   _accept_for_remote_alias_tbl(accept_for_remote_alias_tbl),
-  _max_sproutlet_depth(max_sproutlet_depth)
+  _max_sproutlet_depth(max_sproutlet_depth),
+  _bytes_cloned_tbl(bytes_cloned_tbl),
+  _stateless_in_dialog(stateless_in_dialog),
+  _collapse_record_routes(collapse_record_routes)
 {
   /// Store the URI of this SproutletProxy - this is used for Record-Routing.
   TRC_DEBUG("Root Record-Route URI = %s", root_uri.c_str());
@@ -61,6 +78,23 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
                                                        stack_data.pool,
                                                        false);
 
+  // Index the local hosts.  Hosts that are both local and remote are local.
+  if (_root_uri != NULL)
+  {
+    _host_index.insert(PJUtils::pj_str_to_string(&_root_uri->host),
+                       AliasMatchLocality::LOCAL);
+  }
+
+  for (const std::string& host : _host_local_aliases)
+  {
+    _host_index.insert(host, AliasMatchLocality::LOCAL);
+  }
+
+  for (const std::string& host : _host_remote_aliases)
+  {
+    _host_index.insert(host, AliasMatchLocality::REMOTE);
+  }
+
   for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
        it != _sproutlets.end();
        ++it)
@@ -85,6 +119,16 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
   {
     TRC_DEBUG("SproutletProxy not set to always serve remote aliases");
   }
+
+  if (stateless_in_dialog)
+  {
+    TRC_DEBUG("SproutletProxy set to forward unbilled in-dialog requests statelessly");
+  }
+
+  if (collapse_record_routes)
+  {
+    TRC_DEBUG("SproutletProxy set to collapse Sproutlets' Record-Routes");
+  }
 }
 
 
@@ -123,6 +167,10 @@ bool SproutletProxy::register_sproutlet(Sproutlet* sproutlet)
   else
   {
     _services.insert(std::make_pair(sproutlet->service_name(), sproutlet));
+    _service_index.insert(sproutlet->service_name(), sproutlet);
+    _initial_request_stages[sproutlet] =
+                             StageLatency::stage("sproutlet:" + service_name);
+    _cpu_accounts[sproutlet] = SproutletCpu::account(service_name);
   }
 
   std::list<std::string> aliases = sproutlet->aliases();
@@ -145,6 +193,7 @@ bool SproutletProxy::register_sproutlet(Sproutlet* sproutlet)
     else
     {
       _services.insert(std::make_pair(*j, sproutlet));
+      _service_index.insert(*j, sproutlet);
     }
   }
 
@@ -187,6 +236,11 @@ SproutletProxy::SproutletMatch
   SproutletMatch sproutlet_match(NULL, AliasMatchLocality::NO_MATCH);
   std::string id;
 
+  // The routing URI is formatted (once) for SAS logging, into a buffer on the
+  // stack as this is done on every hop.
+  char uri_buf[500];
+  pj_str_t uri_str = {uri_buf, 0};
+
   // Find and parse the top Route header.
   pjsip_route_hdr* route = (pjsip_route_hdr*)
                                   pjsip_msg_find_hdr(req, PJSIP_H_ROUTE, NULL);
@@ -211,28 +265,33 @@ SproutletProxy::SproutletMatch
   if (uri != NULL)
   {
     // Try to find a Sproutlet based on the given URI
-    std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                                 (pjsip_uri*)uri);
+    uri_str = PJUtils::uri_to_pj_str(PJSIP_URI_IN_ROUTING_HDR,
+                                     (pjsip_uri*)uri,
+                                     uri_buf,
+                                     sizeof(uri_buf));
     SAS::Event event(trail, SASEvent::STARTING_SPROUTLET_SELECTION_URI, 0);
-    event.add_var_param(uri_str);
+    event.add_var_param(uri_str.slen, uri_str.ptr);
     SAS::report_event(event);
 
-    TRC_DEBUG("Found next routable URI: %s", uri_str.c_str());
+    TRC_DEBUG("Found next routable URI: %.*s", uri_str.slen, uri_str.ptr);
 
-    std::string local_hostname_unused;
+    pj_str_t alias_str = {NULL, 0};
+    pj_str_t local_hostname_unused = {NULL, 0};
     SPROUTLET_SELECTION_TYPES selection_type = NONE_SELECTED;
     sproutlet_match = match_sproutlet_from_uri((pjsip_uri*)uri,
-                                               alias,
+                                               alias_str,
                                                local_hostname_unused,
                                                selection_type);
 
     if (selection_type != NONE_SELECTED)
     {
+      alias = PJUtils::pj_str_to_string(&alias_str);
+
       SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_URI, 0);
       event.add_static_param(selection_type);
       event.add_var_param(sproutlet_match.sproutlet->service_name());
       event.add_var_param(alias);
-      event.add_var_param(uri_str);
+      event.add_var_param(uri_str.slen, uri_str.ptr);
       SAS::report_event(event);
     }
 
@@ -288,11 +347,10 @@ SproutletProxy::SproutletMatch
       {
         sproutlet_match = SproutletMatch(it->second, match_locality);
         alias = sproutlet_match.sproutlet->service_name();
-        std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, (pjsip_uri*)uri);
         SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_PORT, 0);
         event.add_var_param(alias);
         event.add_static_param(port);
-        event.add_var_param(uri_str);
+        event.add_var_param(uri_str.slen, uri_str.ptr);
         SAS::report_event(event);
       }
     }
@@ -313,6 +371,29 @@ SproutletProxy::SproutletMatch
                                            std::string& alias,
                                            std::string& local_hostname,
                                            SPROUTLET_SELECTION_TYPES& selection_type) const
+{
+  pj_str_t alias_str = {NULL, 0};
+  pj_str_t local_hostname_str = {NULL, 0};
+  SproutletMatch sproutlet_match = match_sproutlet_from_uri(uri,
+                                                            alias_str,
+                                                            local_hostname_str,
+                                                            selection_type);
+
+  if (sproutlet_match.sproutlet != NULL)
+  {
+    alias = PJUtils::pj_str_to_string(&alias_str);
+    local_hostname = PJUtils::pj_str_to_string(&local_hostname_str);
+  }
+
+  return sproutlet_match;
+}
+
+
+SproutletProxy::SproutletMatch
+  SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
+                                           pj_str_t& alias,
+                                           pj_str_t& local_hostname,
+                                           SPROUTLET_SELECTION_TYPES& selection_type) const
 {
   SproutletMatch sproutlet_match(NULL, AliasMatchLocality::NO_MATCH);
 
@@ -327,8 +408,7 @@ SproutletProxy::SproutletMatch
   // Now we know we have a SIP URI, cast to one.
   pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)uri;
 
-  std::string service_name;
-  std::map<std::string, Sproutlet*>::const_iterator it;
+  Sproutlet* sproutlet;
 
   // First check if there is a services parameter, and if it matches a
   // sproutlet.
@@ -343,13 +423,12 @@ SproutletProxy::SproutletMatch
     if (is_alias_match(match))
     {
       // Check if this service matches a sproutlet.
-      service_name = PJUtils::pj_str_to_string(&services_param->value);
-      it = _services.find(service_name);
-      if (it != _services.end())
+      sproutlet = _service_index.find(&services_param->value);
+      if (sproutlet != NULL)
       {
-        sproutlet_match = SproutletMatch(it->second, match);
-        alias = service_name;
-        local_hostname = PJUtils::pj_str_to_string(&sip_uri->host);
+        sproutlet_match = SproutletMatch(sproutlet, match);
+        alias = services_param->value;
+        local_hostname = sip_uri->host;
         selection_type = SERVICE_NAME;
       }
     }
@@ -369,14 +448,17 @@ SproutletProxy::SproutletMatch
     if (sep != NULL)
     {
       // Extract the possible service name
-      service_name = std::string(hostname.ptr, sep - hostname.ptr);
+      pj_str_t service_name;
+      service_name.ptr = hostname.ptr;
+      service_name.slen = sep - hostname.ptr;
 
       // Remove the service name part and the period from the hostname.
       hostname.slen -= (sep - hostname.ptr + 1);
       hostname.ptr = sep + 1;
 
-      TRC_DEBUG("Possible service name %s will be used if %.*s is a local hostname",
-                service_name.c_str(),
+      TRC_DEBUG("Possible service name %.*s will be used if %.*s is a local hostname",
+                service_name.slen,
+                service_name.ptr,
                 hostname.slen,
                 hostname.ptr);
 
@@ -385,12 +467,12 @@ SproutletProxy::SproutletMatch
       {
         // Check if the part of the hostname before the first '.' matches
         // a sproutlet.
-        it = _services.find(service_name);
-        if (it != _services.end())
+        sproutlet = _service_index.find(&service_name);
+        if (sproutlet != NULL)
         {
-          sproutlet_match = SproutletMatch(it->second, match);
+          sproutlet_match = SproutletMatch(sproutlet, match);
           alias = service_name;
-          local_hostname = PJUtils::pj_str_to_string(&hostname);
+          local_hostname = hostname;
           selection_type = DOMAIN_PART;
         }
       }
@@ -408,13 +490,12 @@ SproutletProxy::SproutletMatch
     if (is_alias_match(match))
     {
       // Check if the user part matches a sproutlet.
-      service_name = PJUtils::pj_str_to_string(&sip_uri->user);
-      it = _services.find(service_name);
-      if (it != _services.end())
+      sproutlet = _service_index.find(&sip_uri->user);
+      if (sproutlet != NULL)
       {
-        sproutlet_match = SproutletMatch(it->second, match);
-        alias = service_name;
-        local_hostname = PJUtils::pj_str_to_string(&sip_uri->host);
+        sproutlet_match = SproutletMatch(sproutlet, match);
+        alias = sip_uri->user;
+        local_hostname = sip_uri->host;
         selection_type = USER_PART;
       }
     }
@@ -423,6 +504,12 @@ SproutletProxy::SproutletMatch
   return sproutlet_match;
 }
 
+SproutletCpuAccount* SproutletProxy::cpu_account(const Sproutlet* sproutlet) const
+{
+  std::map<const Sproutlet*, SproutletCpuAccount*>::const_iterator account =
+                                                  _cpu_accounts.find(sproutlet);
+  return (account != _cpu_accounts.end()) ? account->second : NULL;
+}
 
 pjsip_sip_uri* SproutletProxy::next_hop_uri(const std::string& service,
                                             const pjsip_sip_uri* base_uri,
@@ -435,10 +522,357 @@ pjsip_sip_uri* SproutletProxy::next_hop_uri(const std::string& service,
 }
 
 
+void SproutletProxy::on_tsx_request(pjsip_rx_data* rdata)
+{
+  if ((_stateless_in_dialog) && (forward_in_dialog_statelessly(rdata)))
+  {
+    return;
+  }
+
+  BasicProxy::on_tsx_request(rdata);
+}
+
+
+bool SproutletProxy::forward_in_dialog_statelessly(pjsip_rx_data* rdata)
+{
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  // The S-CSCF may change session timer headers on INVITEs and UPDATEs, so
+  // they always go through the Sproutlets.
+  if ((msg->line.req.method.id == PJSIP_INVITE_METHOD) ||
+      (pjsip_method_cmp(&msg->line.req.method, &METHOD_UPDATE) == 0))
+  {
+    return false;
+  }
+
+  // The request must be in-dialog, and have an RFC 3261 branch so we can
+  // derive the branch to forward it with.
+  if ((rdata->msg_info.to == NULL) ||
+      (rdata->msg_info.to->tag.slen == 0) ||
+      (rdata->msg_info.via == NULL) ||
+      (pj_strnicmp2(&rdata->msg_info.via->branch_param,
+                    PJSIP_RFC3261_BRANCH_ID,
+                    PJSIP_RFC3261_BRANCH_LEN) != 0))
+  {
+    return false;
+  }
+
+  // The top Route must be one we Record-Routed that doesn't need billing.
+  // Only the S-CSCF adds a billing role, and it does nothing else with these
+  // requests.  A user part means it's an ODI, so the request is part of an AS
+  // chain.
+  pjsip_route_hdr* route = (pjsip_route_hdr*)
+                             pjsip_msg_find_hdr(msg, PJSIP_H_ROUTE, NULL);
+
+  if ((route == NULL) ||
+      (!PJSIP_URI_SCHEME_IS_SIP(route->name_addr.uri)))
+  {
+    return false;
+  }
+
+  pjsip_sip_uri* route_uri = (pjsip_sip_uri*)route->name_addr.uri;
+  pjsip_param* billing_role = pjsip_param_find(&route_uri->other_param,
+                                               &STR_BILLING_ROLE);
+
+  // A collapsed Record-Route stands for several Routes, so the next hop
+  // isn't known until it's expanded.
+  if ((route_uri->user.slen != 0) ||
+      (pjsip_param_find(&route_uri->other_param, &STR_COLLAPSED_RR) != NULL) ||
+      (billing_role == NULL) ||
+      (pj_strcmp(&billing_role->value, &STR_CHARGE_NONE) != 0))
+  {
+    return false;
+  }
+
+  pj_str_t alias_unused = {NULL, 0};
+  pj_str_t local_hostname_unused = {NULL, 0};
+  SPROUTLET_SELECTION_TYPES selection_type_unused = NONE_SELECTED;
+
+  if (match_sproutlet_from_uri((pjsip_uri*)route_uri,
+                               alias_unused,
+                               local_hostname_unused,
+                               selection_type_unused).sproutlet == NULL)
+  {
+    return false;
+  }
+
+  // The next hop must not be us, or the request would need to go through
+  // another Sproutlet.
+  pjsip_route_hdr* next_route = (pjsip_route_hdr*)
+                                  pjsip_msg_find_hdr(msg, PJSIP_H_ROUTE, route->next);
+  pjsip_uri* next_uri = (next_route != NULL) ?
+                          (pjsip_uri*)next_route->name_addr.uri :
+                          msg->line.req.uri;
+
+  if ((!PJSIP_URI_SCHEME_IS_SIP(next_uri)) ||
+      (is_alias_match(get_host_locality(&((pjsip_sip_uri*)next_uri)->host))) ||
+      (match_sproutlet_from_uri(next_uri,
+                                alias_unused,
+                                local_hostname_unused,
+                                selection_type_unused).sproutlet != NULL))
+  {
+    return false;
+  }
+
+  if (verify_request(rdata) != PJSIP_SC_OK)
+  {
+    // Let the normal processing reject the request.
+    return false;
+  }
+
+  // Derive the branch from the received one, so retransmissions are
+  // forwarded with the same branch, as a stateless proxy must (RFC 3261
+  // section 16.11).
+  const pj_str_t* rx_branch = &rdata->msg_info.via->branch_param;
+  std::string branch = PJUtils::pj_str_to_string(&STR_STATELESS_BRANCH_PREFIX) +
+                       std::string(rx_branch->ptr + PJSIP_RFC3261_BRANCH_LEN,
+                                   rx_branch->slen - PJSIP_RFC3261_BRANCH_LEN);
+  pj_str_t branch_str = {(char*)branch.c_str(), (pj_ssize_t)branch.length()};
+
+  pjsip_tx_data* tdata;
+  pj_status_t status = PJUtils::create_request_fwd(stack_data.endpt,
+                                                   rdata,
+                                                   msg->line.req.uri,
+                                                   &branch_str,
+                                                   0,
+                                                   &tdata);
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Error creating stateless request, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  // Remove our Route header.
+  pjsip_msg_find_remove_hdr(tdata->msg, PJSIP_H_ROUTE, NULL);
+
+  TRC_DEBUG("Forwarding in-dialog %.*s request statelessly",
+            msg->line.req.method.name.slen,
+            msg->line.req.method.name.ptr);
+
+  status = PJUtils::send_request_stateless(tdata);
+
+  if (status != PJ_SUCCESS)
+  {
+    // We couldn't find anywhere to send the request (and it has been freed).
+    reject_request(rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
+  }
+
+  return true;
+}
+
+
+bool SproutletProxy::is_stateless_branch(const pj_str_t* branch)
+{
+  return ((branch->slen >= STR_STATELESS_BRANCH_PREFIX.slen) &&
+          (pj_strncmp(branch,
+                      &STR_STATELESS_BRANCH_PREFIX,
+                      STR_STATELESS_BRANCH_PREFIX.slen) == 0));
+}
+
+
+void SproutletProxy::collapse_record_routes(pjsip_tx_data* tdata,
+                                            const pjsip_msg* original_req) const
+{
+  pjsip_msg* msg = tdata->msg;
+
+  if (PJSIP_MSG_TO_HDR(msg)->tag.slen != 0)
+  {
+    // Only dialog-creating requests are record-routed.
+    return;
+  }
+
+  // A B2BUA Sproutlet starts a new dialog, and the Record-Routes added before
+  // it belong to the old one, so they can't be collapsed together.
+  if ((pj_strcmp(&PJSIP_MSG_CID_HDR(msg)->id,
+                 &PJSIP_MSG_CID_HDR(original_req)->id) != 0) ||
+      (pj_strcmp(&PJSIP_MSG_FROM_HDR(msg)->tag,
+                 &PJSIP_MSG_FROM_HDR(original_req)->tag) != 0))
+  {
+    return;
+  }
+
+  // The Record-Routes added by the Sproutlets are the ones at the top that
+  // weren't on the original request.
+  int added = 0;
+  for (pjsip_hdr* hdr = (pjsip_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_RECORD_ROUTE, NULL);
+       hdr != NULL;
+       hdr = (pjsip_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_RECORD_ROUTE, hdr->next))
+  {
+    ++added;
+  }
+
+  for (pjsip_hdr* hdr = (pjsip_hdr*)pjsip_msg_find_hdr(original_req, PJSIP_H_RECORD_ROUTE, NULL);
+       hdr != NULL;
+       hdr = (pjsip_hdr*)pjsip_msg_find_hdr(original_req, PJSIP_H_RECORD_ROUTE, hdr->next))
+  {
+    --added;
+  }
+
+  std::vector<pjsip_rr_hdr*> rrs;
+  for (pjsip_rr_hdr* rr = (pjsip_rr_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_RECORD_ROUTE, NULL);
+       (rr != NULL) && ((int)rrs.size() < added);
+       rr = (pjsip_rr_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_RECORD_ROUTE, rr->next))
+  {
+    if ((!PJSIP_URI_SCHEME_IS_SIP(rr->name_addr.uri)) ||
+        (get_uri_locality(rr->name_addr.uri) != AliasMatchLocality::LOCAL))
+    {
+      break;
+    }
+
+    rrs.push_back(rr);
+  }
+
+  if (rrs.size() < 2)
+  {
+    return;
+  }
+
+  // Keep the top Record-Route, listing the others in a parameter.  The URIs
+  // are escaped when the parameter is written to the wire, and
+  // expand_collapsed_route unescapes them.
+  std::string collapsed;
+  for (size_t ii = 1; ii < rrs.size(); ++ii)
+  {
+    if (ii > 1)
+    {
+      collapsed += ' ';
+    }
+
+    collapsed += PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
+                                        rrs[ii]->name_addr.uri);
+    pj_list_erase(rrs[ii]);
+  }
+
+  pjsip_sip_uri* uri = (pjsip_sip_uri*)pjsip_uri_clone(tdata->pool,
+                                                       rrs[0]->name_addr.uri);
+  rrs[0]->name_addr.uri = (pjsip_uri*)uri;
+
+  pjsip_param* param = PJ_POOL_ALLOC_T(tdata->pool, pjsip_param);
+  param->name = STR_COLLAPSED_RR;
+  pj_strdup2(tdata->pool, &param->value, collapsed.c_str());
+  pj_list_insert_before(&uri->other_param, param);
+
+  param = PJ_POOL_ALLOC_T(tdata->pool, pjsip_param);
+  param->name = STR_COLLAPSED_RR_FTAG;
+  pj_strdup(tdata->pool, &param->value, &PJSIP_MSG_FROM_HDR(msg)->tag);
+  pj_list_insert_before(&uri->other_param, param);
+
+  TRC_DEBUG("Collapsed %lu Record-Routes into %s",
+            rrs.size(),
+            PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, (pjsip_uri*)uri).c_str());
+}
+
+
+void SproutletProxy::expand_collapsed_route(pjsip_msg* req, pj_pool_t* pool) const
+{
+  pjsip_route_hdr* route = (pjsip_route_hdr*)
+                             pjsip_msg_find_hdr(req, PJSIP_H_ROUTE, NULL);
+
+  if ((route == NULL) ||
+      (!PJSIP_URI_SCHEME_IS_SIP(route->name_addr.uri)) ||
+      (get_uri_locality(route->name_addr.uri) != AliasMatchLocality::LOCAL))
+  {
+    return;
+  }
+
+  pjsip_sip_uri* route_uri = (pjsip_sip_uri*)route->name_addr.uri;
+  pjsip_param* collapsed = pjsip_param_find(&route_uri->other_param,
+                                            &STR_COLLAPSED_RR);
+
+  if (collapsed == NULL)
+  {
+    return;
+  }
+
+  pjsip_param* ftag = pjsip_param_find(&route_uri->other_param,
+                                       &STR_COLLAPSED_RR_FTAG);
+
+  // The top Route is the top Record-Route, without the parameters listing
+  // the others.
+  pjsip_sip_uri* top_uri = (pjsip_sip_uri*)pjsip_uri_clone(pool, route_uri);
+  pj_list_erase(pjsip_param_find(&top_uri->other_param, &STR_COLLAPSED_RR));
+  if (ftag != NULL)
+  {
+    pj_list_erase(pjsip_param_find(&top_uri->other_param, &STR_COLLAPSED_RR_FTAG));
+  }
+
+  // PJSIP doesn't unescape parameters when it parses them, so the separators
+  // (and the URIs' own parameters) are still escaped.
+  std::vector<pjsip_uri*> uris(1, (pjsip_uri*)top_uri);
+  std::string value = PJUtils::unescape_string_for_uri(
+                                PJUtils::pj_str_to_string(&collapsed->value),
+                                pool);
+  size_t start = 0;
+
+  while (start < value.length())
+  {
+    size_t end = value.find(' ', start);
+    if (end == std::string::npos)
+    {
+      end = value.length();
+    }
+
+    pjsip_uri* uri = PJUtils::uri_from_string(value.substr(start, end - start),
+                                              pool);
+    if (uri == NULL)
+    {
+      TRC_WARNING("Invalid URI in collapsed Record-Route: %s", value.c_str());
+      return;
+    }
+
+    uris.push_back(uri);
+    start = end + 1;
+  }
+
+  // Requests from the end of the dialog that created it route through the
+  // Record-Routes in reverse.
+  if ((ftag != NULL) &&
+      (PJUtils::pj_str_to_string(&PJSIP_MSG_FROM_HDR(req)->tag) ==
+       PJUtils::unescape_string_for_uri(PJUtils::pj_str_to_string(&ftag->value),
+                                        pool)))
+  {
+    std::reverse(uris.begin(), uris.end());
+  }
+
+  for (pjsip_uri* uri : uris)
+  {
+    pjsip_route_hdr* hdr = pjsip_route_hdr_create(pool);
+    hdr->name_addr.uri = uri;
+    pj_list_insert_before(route, hdr);
+  }
+
+  pj_list_erase(route);
+  TRC_DEBUG("Expanded collapsed Record-Route into %lu Routes", uris.size());
+}
+
+
 pj_bool_t SproutletProxy::on_rx_response(pjsip_rx_data *rdata)
 {
   TRC_DEBUG("Received response (%p) after transaction completed.", rdata);
 
+  if ((rdata->msg_info.via != NULL) &&
+      (is_stateless_branch(&rdata->msg_info.via->branch_param)))
+  {
+    // This is a response to a request we forwarded statelessly, so just
+    // strip our Via and forward it upstream.
+    pjsip_tx_data *tdata;
+    pj_status_t status = PJUtils::create_response_fwd(stack_data.endpt, rdata, 0, &tdata);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Error creating response, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      return PJ_TRUE;
+      // LCOV_EXCL_STOP
+    }
+
+    BasicProxy::route_rx_response(tdata);
+    return PJ_TRUE;
+  }
+
   // Only forward responses to INVITES (see RFC 3261 - 18.2.1)
   if (rdata->msg_info.cseq->method.id == PJSIP_INVITE_METHOD)
   {
@@ -533,8 +967,8 @@ pjsip_sip_uri* SproutletProxy::create_internal_sproutlet_uri(pj_pool_t* pool,
   // Replace the hostname part of the base URI with the local hostname part of
   // the URI that routed to us. If this doesn't work, then fall back to using
   // the root URI.
-  std::string local_hostname = get_local_hostname(uri, true);
-  pj_strdup2(pool, &uri->host, local_hostname.c_str());
+  pj_str_t local_hostname = get_local_hostname_str(uri, true);
+  pj_strdup(pool, &uri->host, &local_hostname);
 
   uri->port = 0;
   uri->lr_param = 1;
@@ -618,7 +1052,15 @@ pjsip_sip_uri* SproutletProxy::get_routing_uri(const pjsip_msg* req,
 std::string SproutletProxy::get_local_hostname(const pjsip_sip_uri* uri,
                                                bool default_to_root) const
 {
-  std::string unused_alias, local_hostname;
+  pj_str_t local_hostname = get_local_hostname_str(uri, default_to_root);
+  return PJUtils::pj_str_to_string(&local_hostname);
+}
+
+pj_str_t SproutletProxy::get_local_hostname_str(const pjsip_sip_uri* uri,
+                                                bool default_to_root) const
+{
+  pj_str_t unused_alias = {NULL, 0};
+  pj_str_t local_hostname = {NULL, 0};
   SPROUTLET_SELECTION_TYPES unused_selection_type = NONE_SELECTED;
 
   // If this URI matches a sproutlet, the local_hostname will be filled in with
@@ -628,7 +1070,7 @@ std::string SproutletProxy::get_local_hostname(const pjsip_sip_uri* uri,
                                   local_hostname,
                                   unused_selection_type).sproutlet;
 
-  if (local_hostname.empty())
+  if (local_hostname.slen == 0)
   {
     // This URI did not match a sproutlet
 
@@ -637,12 +1079,12 @@ std::string SproutletProxy::get_local_hostname(const pjsip_sip_uri* uri,
       // We assume that the URI passed to this function will route back to a
       // Sproutlet, so if we have not found a Sproutlet, default the local
       // hostname to the hostname part of the URI's host.
-      local_hostname = PJUtils::pj_str_to_string(&uri->host);
+      local_hostname = uri->host;
     }
     else
     {
       // We can't assume the URI passed in was local, so use the root URI's host
-      local_hostname = PJUtils::pj_str_to_string(&_root_uri->host);
+      local_hostname = _root_uri->host;
     }
   }
 
@@ -652,39 +1094,14 @@ std::string SproutletProxy::get_local_hostname(const pjsip_sip_uri* uri,
 SproutletProxy::AliasMatchLocality
   SproutletProxy::get_host_locality(const pj_str_t* host) const
 {
-  if (!pj_stricmp(host, &_root_uri->host))
-  {
-    return AliasMatchLocality::LOCAL;
-  }
-
-  for (std::unordered_set<std::string>::const_iterator it = _host_local_aliases.begin();
-       it != _host_local_aliases.end();
-       ++it)
-  {
-    if (!pj_stricmp2(host, it->c_str()))
-    {
-      return AliasMatchLocality::LOCAL;
-    }
-  }
-
-  for (std::unordered_set<std::string>::const_iterator it = _host_remote_aliases.begin();
-     it != _host_remote_aliases.end();
-     ++it)
-  {
-    if (!pj_stricmp2(host, it->c_str()))
-    {
-      return AliasMatchLocality::REMOTE;
-    }
-  }
-
-  return AliasMatchLocality::NO_MATCH;
+  return _host_index.find(host);
 }
 
 bool SproutletProxy::is_uri_reflexive(const pjsip_uri* uri,
                                       const Sproutlet* sproutlet) const
 {
-  std::string alias_unused;
-  std::string local_hostname_unused;
+  pj_str_t alias_unused = {NULL, 0};
+  pj_str_t local_hostname_unused = {NULL, 0};
   SPROUTLET_SELECTION_TYPES selection_type_unused = NONE_SELECTED;
   Sproutlet* matched_sproutlet = match_sproutlet_from_uri(uri,
                                                           alias_unused,
@@ -775,10 +1192,14 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   _dmap_sproutlet(),
   _dmap_uac(),
   _umap(),
+  _pooled_requests(),
   _pending_req_q(),
   _sproutlet_proxy(proxy),
   _timers(),
-  _pending_timers()
+  _pending_timers(),
+  _body_sources(),
+  _bytes_cloned(0),
+  _arena(new TsxArena())
 {
   int instances = ++_num_instances;
   TRC_DEBUG("Sproutlet Proxy transaction (%p) created. There are now %d instances",
@@ -788,6 +1209,15 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
 
 SproutletProxy::UASTsx::~UASTsx()
 {
+  // Any requests still being tracked by a pool got no response.
+  for (PooledRequests::const_iterator i = _pooled_requests.begin();
+       i != _pooled_requests.end();
+       ++i)
+  {
+    i->second.pool->request_complete(i->second.tp, -1);
+  }
+  _pooled_requests.clear();
+
   for (std::set<pj_timer_entry*>::const_iterator timer = _timers.begin();
        timer != _timers.end();
        ++timer)
@@ -798,6 +1228,29 @@ SproutletProxy::UASTsx::~UASTsx()
   }
   _timers.clear();
 
+  // Release the requests whose bodies were shared.  Every clone sharing them
+  // has been freed or has had its body copied by now.
+  for (std::set<pjsip_tx_data*>::const_iterator source = _body_sources.begin();
+       source != _body_sources.end();
+       ++source)
+  {
+    pjsip_tx_data_dec_ref(*source);
+  }
+  _body_sources.clear();
+
+  // Release the arena.  Its memory is freed once any objects allocated from
+  // it that are still in use have been deleted too.
+  TRC_DEBUG("Sproutlet Proxy transaction (%p) allocated %lu bytes from its arena",
+            this, _arena->bytes_allocated());
+  _arena->release();
+  _arena = NULL;
+
+  TRC_DEBUG("Sproutlet Proxy transaction (%p) cloned %lu bytes", this, _bytes_cloned);
+  if (_sproutlet_proxy->_bytes_cloned_tbl != NULL)
+  {
+    _sproutlet_proxy->_bytes_cloned_tbl->accumulate(_bytes_cloned);
+  }
+
   if (_trail != 0)
   {
     // Flush the trail so it appears promptly in SAS. Note that we also log an
@@ -836,6 +1289,11 @@ pj_status_t SproutletProxy::UASTsx::init(pjsip_rx_data* rdata)
     pjsip_route_hdr* route = (pjsip_route_hdr*)
                 pjsip_msg_find_hdr(rdata->msg_info.msg, PJSIP_H_ROUTE, NULL);
 
+    // Restore the Routes of a collapsed Record-Route, whether or not this
+    // node is collapsing them now, so dialogs set up before a change of
+    // configuration still work.
+    _sproutlet_proxy->expand_collapsed_route(_req->msg, _req->pool);
+
     // Requests for remote aliases are always accepted off the wire, regardless
     // of the value of always_serve_remote_aliases. In the case that the remote
     // host is down, we should handle requests to maintain service - in order to
@@ -868,6 +1326,7 @@ pj_status_t SproutletProxy::UASTsx::init(pjsip_rx_data* rdata)
 
     if (status == PJ_SUCCESS)
     {
+      TsxArena::Scope arena_scope(_arena);
       _root = new SproutletWrapper(_sproutlet_proxy,
                                    this,
                                    sproutlet,
@@ -918,6 +1377,22 @@ void SproutletProxy::UASTsx::process_cancel_request(pjsip_rx_data* rdata,
 }
 
 
+void SproutletProxy::UASTsx::pooled_request_complete(UACTsx* uac_tsx,
+                                                     bool got_response)
+{
+  PooledRequests::iterator i = _pooled_requests.find(uac_tsx);
+
+  if (i != _pooled_requests.end())
+  {
+    long latency_us = got_response ?
+      (long)StageLatency::ticks_to_us(StageLatency::now() - i->second.start) :
+      -1;
+    i->second.pool->request_complete(i->second.tp, latency_us);
+    _pooled_requests.erase(i);
+  }
+}
+
+
 /// Handles a response to an associated UACTsx.
 void SproutletProxy::UASTsx::on_new_client_response(UACTsx* uac_tsx,
                                                     pjsip_tx_data *rsp)
@@ -927,6 +1402,7 @@ void SproutletProxy::UASTsx::on_new_client_response(UACTsx* uac_tsx,
   if (rsp->msg->line.status.code >= PJSIP_SC_OK)
   {
     // This is a final response, so dissociate the UAC transaction.
+    pooled_request_complete(uac_tsx, true);
     dissociate(uac_tsx);
   }
 
@@ -979,6 +1455,7 @@ void SproutletProxy::UASTsx::on_client_not_responding(UACTsx* uac_tsx,
   SAS::report_event(client_not_responding);
 
   // This is equivalent to a final response, so dissociate the UAC transaction.
+  pooled_request_complete(uac_tsx, false);
   dissociate(uac_tsx);
 
   UMap::iterator i = _umap.find((void*)uac_tsx);
@@ -1081,6 +1558,9 @@ void SproutletProxy::UASTsx::tx_request(SproutletWrapper* upstream,
 
 void SproutletProxy::UASTsx::schedule_requests()
 {
+  // Time each request forwarded to the network from now.
+  _forward_start = StageLatency::now();
+
   while (!_pending_req_q.empty())
   {
     PendingRequest req = _pending_req_q.front();
@@ -1144,6 +1624,7 @@ void SproutletProxy::UASTsx::schedule_requests()
         // Found a local Sproutlet and SproutletTsx to handle the request, so
         // create a SproutletWrapper. Since the Tsx is non-NULL, there is
         // guaranteed to be a sproutlet to handle the request.
+        TsxArena::Scope arena_scope(_arena);
         SproutletWrapper* downstream =
           new SproutletWrapper(_sproutlet_proxy,
                                this,
@@ -1189,6 +1670,21 @@ void SproutletProxy::UASTsx::schedule_requests()
         TRC_DEBUG("No local sproutlet matches request");
         size_t index;
 
+        // The request may outlive this transaction, so it needs its own copy
+        // of any body it shares with other requests.
+        _bytes_cloned += PJUtils::unshare_body(req.req);
+
+        if (_sproutlet_proxy->_collapse_record_routes)
+        {
+          _sproutlet_proxy->collapse_record_routes(req.req, _req->msg);
+        }
+
+        // If the request is going to an application server with a
+        // connection pool, send it on one of the pool's connections.
+        SIPConnectionPool* as_pool = ASConnectionPools::select(req.req);
+        pjsip_transport* as_tp = (as_pool != NULL) ?
+                                 req.req->tp_sel.u.transport : NULL;
+
         pj_status_t status = allocate_uac(req.req, index, req.allowed_host_state);
 
         if (status == PJ_SUCCESS)
@@ -1199,6 +1695,14 @@ void SproutletProxy::UASTsx::schedule_requests()
           {
             _dmap_uac[req.upstream] = _uac_tsx[index];
             _umap[(void*)_uac_tsx[index]] = req.upstream;
+
+            if (as_pool != NULL)
+            {
+              as_pool->request_started(as_tp);
+              _pooled_requests[_uac_tsx[index]] = {as_pool,
+                                                   as_tp,
+                                                   StageLatency::now()};
+            }
           }
 
           // Send the request.
@@ -1216,6 +1720,20 @@ void SproutletProxy::UASTsx::schedule_requests()
   check_destroy();
 }
 
+void SproutletProxy::UASTsx::record_clone(pjsip_tx_data* clone)
+{
+  _bytes_cloned += pj_pool_get_used_size(clone->pool);
+}
+
+void SproutletProxy::UASTsx::hold_body_source(pjsip_tx_data* source)
+{
+  if ((source->msg->body != NULL) &&
+      (_body_sources.insert(source).second))
+  {
+    pjsip_tx_data_add_ref(source);
+  }
+}
+
 bool SproutletProxy::UASTsx::schedule_timer(SproutletWrapper* tsx,
                                             void* context,
                                             TimerID& id,
@@ -1228,12 +1746,30 @@ bool SproutletProxy::UASTsx::schedule_timer(SproutletWrapper* tsx,
 
   pj_timer_entry* tentry = new pj_timer_entry();
   pj_timer_entry_init(tentry, 0, tdata, &SproutletProxy::UASTsx::on_timer_pop);
+  TimerWheel::init_entry(&tdata->wheel_entry,
+                         &SproutletProxy::UASTsx::on_wheel_timer_pop,
+                         tentry);
 
   _timers.insert(tentry);
 
   id = (TimerID)tentry;
 
-  bool scheduled = _sproutlet_proxy->schedule_timer(tentry, duration);
+  // Prefer this worker's timer wheel, which pops the timer on this worker
+  // without going through the PJSIP timer heap (and its global lock) or the
+  // worker queues.  The PJSIP heap is used if this isn't a worker thread or
+  // worker affinity is disabled.  The pj_timer_entry is still created, as its
+  // address is the timer ID.
+  bool scheduled = schedule_worker_timer(&tdata->wheel_entry, duration);
+  if (scheduled)
+  {
+    TRC_DEBUG("Started Sproutlet timer on worker %d, id = %ld, duration = %d",
+              tdata->wheel_entry.owner, id, duration);
+  }
+  else
+  {
+    scheduled = _sproutlet_proxy->schedule_timer(tentry, duration);
+  }
+
   if (scheduled)
   {
     _pending_timers.insert(tentry);
@@ -1261,9 +1797,15 @@ bool SproutletProxy::UASTsx::schedule_timer(SproutletWrapper* tsx,
 bool SproutletProxy::UASTsx::cancel_timer(TimerID id)
 {
   pj_timer_entry* tentry = (pj_timer_entry*)id;
+  TimerCallbackData* tdata = (TimerCallbackData*)tentry->user_data;
 
-  // Cancel the timer at PJSIP
-  if (_sproutlet_proxy->cancel_timer(tentry))
+  // Cancel the timer on the worker's wheel or at PJSIP, whichever it was
+  // scheduled on.
+  bool cancelled_timer = (tdata->wheel_entry.owner >= 0) ?
+                           cancel_worker_timer(&tdata->wheel_entry) :
+                           _sproutlet_proxy->cancel_timer(tentry);
+
+  if (cancelled_timer)
   {
     // Successfully cancelled.  Decrement the pending callbacks count
     // incremented in SproutletProxy::UASTsx::schedule_timer.  Note that
@@ -1289,6 +1831,13 @@ bool SproutletProxy::UASTsx::cancel_timer(TimerID id)
 bool SproutletProxy::UASTsx::timer_running(TimerID id)
 {
   pj_timer_entry* tentry = (pj_timer_entry*)id;
+  TimerCallbackData* tdata = (TimerCallbackData*)tentry->user_data;
+
+  if (tdata->wheel_entry.owner >= 0)
+  {
+    return TimerWheel::is_scheduled(&tdata->wheel_entry);
+  }
+
   return _sproutlet_proxy->timer_running(tentry);
 }
 
@@ -1306,6 +1855,15 @@ void SproutletProxy::UASTsx::on_timer_pop(pj_timer_heap_t* th,
 }
 
 
+void SproutletProxy::UASTsx::on_wheel_timer_pop(TimerWheel::Entry* entry)
+{
+  // Timers on a worker's wheel pop on that worker, so there's no need to
+  // queue a callback.
+  pj_timer_entry* tentry = (pj_timer_entry*)entry->user_data;
+  ((TimerCallbackData*)tentry->user_data)->uas_tsx->process_timer_pop(tentry);
+}
+
+
 void SproutletProxy::UASTsx::process_timer_pop(pj_timer_entry* tentry)
 {
   enter_context();
@@ -1549,6 +2107,9 @@ SproutletTsx*
   SproutletTsx* sproutlet_tsx = NULL;
   Sproutlet* sproutlet = NULL;
 
+  // Sproutlets that opt in allocate their transactions from the arena.
+  TsxArena::Scope arena_scope(_arena);
+
   // Do an initial lookup for the target sproutlet.
   SproutletMatch match = _sproutlet_proxy->target_sproutlet(req->msg,
                                                             port,
@@ -1570,12 +2131,15 @@ SproutletTsx*
     // Found a local Sproutlet, so offer the sproutlet a chance to handle
     // the request.
     pjsip_sip_uri* next_hop = NULL;
-    sproutlet_tsx = sproutlet->get_tsx(_sproutlet_proxy,
-                                       alias,
-                                       req->msg,
-                                       next_hop,
-                                       req->pool,
-                                       trail());
+    {
+      SproutletCpu::Timer cpu_timer(_sproutlet_proxy->cpu_account(sproutlet));
+      sproutlet_tsx = sproutlet->get_tsx(_sproutlet_proxy,
+                                         alias,
+                                         req->msg,
+                                         next_hop,
+                                         req->pool,
+                                         trail());
+    }
 
     if (sproutlet_tsx != NULL)
     {
@@ -1645,6 +2209,7 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _proxy_tsx(proxy_tsx),
   _sproutlet(sproutlet),
   _sproutlet_tsx(sproutlet_tsx),
+  _cpu_account(proxy->cpu_account(sproutlet)),
   _service_name(""),
   _id(""),
   _req(req),
@@ -1660,6 +2225,7 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _best_rsp(NULL),
   _complete(false),
   _process_actions_entered(0),
+  _pending_deferrals(0),
   _forks(),
   _pending_timers(),
   _allowed_host_state(BaseResolver::ALL_LISTS),
@@ -1723,6 +2289,7 @@ SproutletWrapper::~SproutletWrapper()
   TRC_DEBUG("Destroying SproutletWrapper %p", this);
   if (_sproutlet_tsx != NULL)
   {
+    SproutletCpu::Timer cpu_timer(_cpu_account);
     delete _sproutlet_tsx;
   }
 
@@ -1762,7 +2329,10 @@ const std::string& SproutletWrapper::service_name() const
 /// or as the basis for constructing a response.
 pjsip_msg* SproutletWrapper::original_request()
 {
-  pjsip_tx_data* clone = PJUtils::clone_msg(stack_data.endpt, _req);
+  // The body is shared with the original request rather than copied, as
+  // Sproutlets only ever replace bodies.  Headers are copied as Sproutlets
+  // modify them (and the URIs in them) in place.
+  pjsip_tx_data* clone = PJUtils::clone_msg_sharing_body(stack_data.endpt, _req);
 
   if (clone == NULL)
   {
@@ -1772,6 +2342,9 @@ pjsip_msg* SproutletWrapper::original_request()
     //LCOV_EXCL_STOP
   }
 
+  _proxy_tsx->hold_body_source(_req);
+  _proxy_tsx->record_clone(clone);
+
   // Remove the top Route header from the request if it refers to this node or
   // this Sproutlet.  The Sproutlet can inspect the route_hdr API if required
   // using the route_hdr() API, but cannot manipulate it.
@@ -1789,6 +2362,13 @@ pjsip_msg* SproutletWrapper::original_request()
   return clone->msg;
 }
 
+/// Returns the original request without cloning it.  The original request is
+/// never changed, and is held until the Sproutlet's transaction is destroyed.
+const pjsip_msg* SproutletWrapper::original_request_view() const
+{
+  return _req->msg;
+}
+
 // Sets the transport on this request to be the same as on the original.
 void SproutletWrapper::copy_original_transport(pjsip_msg* req)
 {
@@ -1899,8 +2479,19 @@ pjsip_msg* SproutletWrapper::clone_msg(pjsip_msg* msg)
     return NULL;
   }
 
-  // Clone the tdata and put it back into the map
-  pjsip_tx_data* new_tdata = PJUtils::clone_msg(stack_data.endpt, it->second);
+  // Clone the tdata and put it back into the map.  Request bodies are shared
+  // as in original_request, but responses may be passed to the UAS
+  // transaction after this tree of Sproutlets has gone, so are copied in full.
+  pjsip_tx_data* new_tdata;
+
+  if (msg->type == PJSIP_REQUEST_MSG)
+  {
+    new_tdata = PJUtils::clone_msg_sharing_body(stack_data.endpt, it->second);
+  }
+  else
+  {
+    new_tdata = PJUtils::clone_msg(stack_data.endpt, it->second);
+  }
 
   if (new_tdata == NULL)
   {
@@ -1910,6 +2501,12 @@ pjsip_msg* SproutletWrapper::clone_msg(pjsip_msg* msg)
     //LCOV_EXCL_STOP
   }
 
+  if (msg->type == PJSIP_REQUEST_MSG)
+  {
+    _proxy_tsx->hold_body_source(it->second);
+  }
+  _proxy_tsx->record_clone(new_tdata);
+
   register_tdata(new_tdata);
 
   return new_tdata->msg;
@@ -1985,6 +2582,7 @@ int SproutletWrapper::send_request(pjsip_msg*& req, int allowed_host_state)
   _forks[fork_id].state.tsx_state = PJSIP_TSX_STATE_NULL;
   _forks[fork_id].state.error_state = NONE;
   _forks[fork_id].pending_cancel = false;
+  _forks[fork_id].cancelled = false;
 
   _send_requests[fork_id] = {
     .tx_data = it->second,
@@ -2063,8 +2661,11 @@ void SproutletWrapper::cancel_pending_forks(int st_code, std::string reason)
 {
   for (size_t ii = 0; ii < _forks.size(); ++ii)
   {
+    // A fork that has already been cancelled (for example, after a 6xx
+    // response on another fork) isn't cancelled again.
     if ((_forks[ii].state.tsx_state != PJSIP_TSX_STATE_NULL) &&
-        (_forks[ii].state.tsx_state != PJSIP_TSX_STATE_TERMINATED))
+        (_forks[ii].state.tsx_state != PJSIP_TSX_STATE_TERMINATED) &&
+        (!_forks[ii].cancelled))
     {
       if (_forks[ii].req->msg->line.req.method.id == PJSIP_INVITE_METHOD)
       {
@@ -2167,6 +2768,53 @@ SAS::TrailId SproutletWrapper::trail() const
   return _trail_id;
 }
 
+SproutletTsxHelper::Resumer SproutletWrapper::defer_processing()
+{
+  // The processing is filled in when the Sproutlet's work completes.  The
+  // Callback is created now, while we're in the UASTsx's context, as that
+  // stops the UASTsx being destroyed before it runs.
+  std::shared_ptr<std::function<void()>> processing =
+                                     std::make_shared<std::function<void()>>();
+  SproutletProxy::UASTsx* proxy_tsx = _proxy_tsx;
+  ++_pending_deferrals;
+  TRC_DEBUG("%s deferring processing, %d deferrals pending",
+            _id.c_str(), _pending_deferrals);
+
+  PJUtils::Callback* cb = new SproutletProxy::UASTsx::Callback(proxy_tsx,
+    [this, proxy_tsx, processing]() -> void
+    {
+      --_pending_deferrals;
+
+      if (_complete)
+      {
+        // The transaction has ended while the Sproutlet was waiting (for
+        // example, it was cancelled), so there's nothing left to do.
+        TRC_DEBUG("%s dropping deferred processing - transaction complete",
+                  _id.c_str());
+      }
+      else
+      {
+        TRC_DEBUG("%s running deferred processing", _id.c_str());
+        SproutletCpu::Timer cpu_timer(_cpu_account);
+        (*processing)();
+      }
+
+      // This may destroy the SproutletWrapper, so schedule the requests it
+      // generated through the UASTsx.
+      process_actions(false);
+      proxy_tsx->schedule_requests();
+    });
+
+  return [cb, processing](std::function<void()> fn)
+  {
+    *processing = fn;
+
+    // Always queue the Callback, even if this is a worker thread, as that
+    // thread may not be in the UASTsx's context.
+    PJUtils::run_callback_on_worker_thread(cb, false);
+  };
+}
+
 bool SproutletWrapper::is_uri_reflexive(const pjsip_uri* uri) const
 {
   return _proxy->is_uri_reflexive(uri, _sproutlet);
@@ -2278,16 +2926,44 @@ void SproutletWrapper::rx_request(pjsip_tx_data* req, int allowed_host_state)
     // @TODO
   }
 
-  if (PJSIP_MSG_TO_HDR(clone)->tag.slen == 0)
+  if ((PJSIP_MSG_TO_HDR(clone)->tag.slen == 0) &&
+      (_cpu_account != NULL) &&
+      (clone->line.req.method.id != PJSIP_ACK_METHOD) &&
+      (!_cpu_account->admit()))
+  {
+    // The Sproutlet is occupying as many worker threads as it is allowed, so
+    // reject the request rather than give it another.  There's no
+    // Retry-After, as it's only this Sproutlet that is overloaded.
+    TRC_WARNING("%s rejecting initial request - Sproutlet is occupying too many worker threads",
+                _id.c_str());
+    pjsip_msg* rsp = create_response(clone, PJSIP_SC_SERVICE_UNAVAILABLE);
+    send_response(rsp);
+    free_msg(clone);
+  }
+  else if (PJSIP_MSG_TO_HDR(clone)->tag.slen == 0)
   {
     TRC_VERBOSE("%s pass initial request %s to Sproutlet",
                 _id.c_str(), msg_info(clone));
-    _sproutlet_tsx->on_rx_initial_request(clone);
+    FlightRecorder::mark("sproutlet-request", _service_name);
+    StageLatency::Ticks start = StageLatency::now();
+    {
+      SproutletCpu::Timer cpu_timer(_cpu_account);
+      _sproutlet_tsx->on_rx_initial_request(clone);
+    }
+
+    std::map<const Sproutlet*, StageHistogram*>::const_iterator stage =
+                                 _proxy->_initial_request_stages.find(_sproutlet);
+    if (stage != _proxy->_initial_request_stages.end())
+    {
+      StageLatency::record_since(stage->second, start);
+    }
   }
   else
   {
     TRC_VERBOSE("%s pass in dialog request %s to Sproutlet",
                 _id.c_str(), msg_info(clone));
+    FlightRecorder::mark("sproutlet-request", _service_name);
+    SproutletCpu::Timer cpu_timer(_cpu_account);
     _sproutlet_tsx->on_rx_in_dialog_request(clone);
   }
 
@@ -2355,7 +3031,12 @@ void SproutletWrapper::rx_response(pjsip_tx_data* rsp,
       }
     }
   }
-  _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+
+  FlightRecorder::mark("sproutlet-response", _service_name, fork_id);
+  {
+    SproutletCpu::Timer cpu_timer(_cpu_account);
+    _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+  }
 
   process_actions(false);
 }
@@ -2363,8 +3044,11 @@ void SproutletWrapper::rx_response(pjsip_tx_data* rsp,
 void SproutletWrapper::rx_cancel(pjsip_tx_data* cancel, const std::string& reason)
 {
   TRC_VERBOSE("%s received CANCEL request", _id.c_str());
-  _sproutlet_tsx->on_rx_cancel(PJSIP_SC_REQUEST_TERMINATED,
-                           cancel->msg);
+  {
+    SproutletCpu::Timer cpu_timer(_cpu_account);
+    _sproutlet_tsx->on_rx_cancel(PJSIP_SC_REQUEST_TERMINATED,
+                                 cancel->msg);
+  }
   pjsip_tx_data_dec_ref(cancel);
   cancel_pending_forks(PJSIP_SC_REQUEST_TERMINATED, reason);
   process_actions(false);
@@ -2376,7 +3060,10 @@ void SproutletWrapper::rx_error(int status_code, const std::string& reason)
               _id.c_str(),
               status_code,
               reason.c_str());
-  _sproutlet_tsx->on_rx_cancel(status_code, NULL);
+  {
+    SproutletCpu::Timer cpu_timer(_cpu_account);
+    _sproutlet_tsx->on_rx_cancel(status_code, NULL);
+  }
   cancel_pending_forks(status_code, reason);
 
   // Consider the transaction to be complete as no final response should be
@@ -2433,7 +3120,10 @@ void SproutletWrapper::rx_fork_error(ForkErrorState fork_error, int fork_id)
 
       // Pass the response to the application.
       register_tdata(rsp);
-      _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+      {
+        SproutletCpu::Timer cpu_timer(_cpu_account);
+        _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+      }
       process_actions(false);
     }
   }
@@ -2443,7 +3133,10 @@ void SproutletWrapper::on_timer_pop(TimerID id, void* context)
 {
   TRC_DEBUG("Processing timer pop, id = %ld", id);
   _pending_timers.erase(id);
-  _sproutlet_tsx->on_timer_expiry(context);
+  {
+    SproutletCpu::Timer cpu_timer(_cpu_account);
+    _sproutlet_tsx->on_timer_expiry(context);
+  }
   process_actions(false);
 }
 
@@ -2481,10 +3174,38 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   while (!_send_responses.empty())
   {
     pjsip_tx_data* tdata = _send_responses.front();
-    _send_responses.pop_front();
+    _send_responses.erase(_send_responses.begin());
     aggregate_response(tdata);
   }
 
+  if (holding_global_failure())
+  {
+    // Once a 6xx has been received no new forks are started (RFC 3261
+    // section 16.7), so discard any requests the Sproutlet has just sent,
+    // other than ACKs.
+    Requests::iterator i = _send_requests.begin();
+    while (i != _send_requests.end())
+    {
+      pjsip_tx_data* tdata = i->second.tx_data;
+      if (tdata->msg->line.req.method.id != PJSIP_ACK_METHOD)
+      {
+        TRC_DEBUG("Discard request %s (%s) - already have a 6xx response",
+                  pjsip_tx_data_get_info(tdata), tdata->obj_name);
+        deregister_tdata(tdata);
+        pjsip_tx_data_dec_ref(tdata);
+        --_pending_sends;
+
+        // Erasing an entry invalidates the later iterators, so start again.
+        _send_requests.erase(i);
+        i = _send_requests.begin();
+      }
+      else
+      {
+        ++i;
+      }
+    }
+  }
+
   if ((!_complete) &&
       (_best_rsp != NULL) &&
       (_pending_sends + count_pending_actionable_responses() == 0))
@@ -2500,7 +3221,7 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   // forwarded/generated by the Sproutlet.
   while (!_send_requests.empty())
   {
-    std::map<int, SproutletProxy::SendRequest>::iterator i = _send_requests.begin();
+    Requests::iterator i = _send_requests.begin();
     int fork_id = i->first;
     SproutletProxy::SendRequest req = i->second;
     _send_requests.erase(i);
@@ -2539,10 +3260,12 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   if ((_complete) &&
       (count_pending_responses() == 0) &&
       (_pending_timers.empty()) &&
+      (_pending_deferrals == 0) &&
       (_process_actions_entered == 0))
   {
     // Sproutlet has sent a final response, has no downstream forks waiting
-    // a response, and has no pending timers, so should destroy itself.
+    // a response, and has no pending timers or deferred processing, so should
+    // destroy itself.
     TRC_VERBOSE("%s suiciding", _id.c_str());
     delete this;
   }
@@ -2595,35 +3318,43 @@ void SproutletWrapper::aggregate_response(pjsip_tx_data* rsp)
     TRC_DEBUG("Forward 2xx response");
 
     // Send this response immediately as a final response.
-    if (_best_rsp != NULL)
+    set_best_response(rsp);
+    tx_response(_best_rsp);
+  }
+  else if (PJSIP_IS_STATUS_IN_CLASS(status_code, 600))
+  {
+    // 6xx response.  RFC 3261 section 16.7 says this is chosen over any other
+    // non-2xx response, but isn't forwarded straight away - the other forks
+    // are cancelled, and a 2xx that any of them sends before they complete
+    // is still forwarded instead.  The 6xx is sent when the last fork
+    // completes.
+    TRC_DEBUG("6xx response");
+    if (!holding_global_failure())
     {
-      TRC_DEBUG("Discard previous best response %s (%s)",
-                pjsip_tx_data_get_info(_best_rsp), _best_rsp->obj_name);
-      deregister_tdata(_best_rsp);
-      pjsip_tx_data_dec_ref(_best_rsp);
+      TRC_DEBUG("First 6xx response - cancel other forks");
+      set_best_response(rsp);
+      cancel_pending_forks();
+    }
+    else
+    {
+      TRC_DEBUG("Discard response %s (%s) - we already have a 6xx",
+                pjsip_tx_data_get_info(rsp), rsp->obj_name);
+      deregister_tdata(rsp);
+      pjsip_tx_data_dec_ref(rsp);
     }
-    _best_rsp = rsp;
-
-    tx_response(_best_rsp);
   }
   else
   {
     // Final, non-OK response.  Is this the "best" response received so far?
-    TRC_DEBUG("3xx/4xx/5xx/6xx response");
+    // Only the best response is kept, so each fork's response is either sent
+    // or freed as soon as it arrives.  A 6xx is better than any of them.
+    TRC_DEBUG("3xx/4xx/5xx response");
     if ((_best_rsp == NULL) ||
-        (compare_sip_sc(status_code, _best_rsp->msg->line.status.code) > 0))
+        ((!holding_global_failure()) &&
+         (compare_sip_sc(status_code, _best_rsp->msg->line.status.code) > 0)))
     {
-      TRC_DEBUG("Best 3xx/4xx/5xx/6xx response so far");
-
-      if (_best_rsp != NULL)
-      {
-        TRC_DEBUG("Discard previous best response %s (%s)",
-                  pjsip_tx_data_get_info(_best_rsp), _best_rsp->obj_name);
-        deregister_tdata(_best_rsp);
-        pjsip_tx_data_dec_ref(_best_rsp);
-      }
-
-      _best_rsp = rsp;
+      TRC_DEBUG("Best 3xx/4xx/5xx response so far");
+      set_best_response(rsp);
     }
     else
     {
@@ -2635,6 +3366,28 @@ void SproutletWrapper::aggregate_response(pjsip_tx_data* rsp)
   }
 }
 
+// Makes a response the best response, freeing the previous best response.
+void SproutletWrapper::set_best_response(pjsip_tx_data* rsp)
+{
+  if (_best_rsp != NULL)
+  {
+    TRC_DEBUG("Discard previous best response %s (%s)",
+              pjsip_tx_data_get_info(_best_rsp), _best_rsp->obj_name);
+    deregister_tdata(_best_rsp);
+    pjsip_tx_data_dec_ref(_best_rsp);
+  }
+
+  _best_rsp = rsp;
+}
+
+// Whether the best response is a 6xx, so the transaction is waiting for the
+// cancelled forks to complete.
+bool SproutletWrapper::holding_global_failure() const
+{
+  return ((_best_rsp != NULL) &&
+          (PJSIP_IS_STATUS_IN_CLASS(_best_rsp->msg->line.status.code, 600)));
+}
+
 // Counts the number of forks that are pending a response.
 int SproutletWrapper::count_pending_responses()
 {
@@ -2695,7 +3448,10 @@ void SproutletWrapper::tx_request(SproutletProxy::SendRequest req,
   }
 
   // Notify the sproutlet that the request is being sent downstream.
-  _sproutlet_tsx->on_tx_request(tdata->msg, fork_id);
+  {
+    SproutletCpu::Timer cpu_timer(_cpu_account);
+    _sproutlet_tsx->on_tx_request(tdata->msg, fork_id);
+  }
 
   // Forward the request downstream.
   deregister_tdata(tdata);
@@ -2705,7 +3461,10 @@ void SproutletWrapper::tx_request(SproutletProxy::SendRequest req,
 void SproutletWrapper::tx_response(pjsip_tx_data* rsp)
 {
   // Notify the sproutlet that the response is being sent upstream.
-  _sproutlet_tsx->on_tx_response(rsp->msg);
+  {
+    SproutletCpu::Timer cpu_timer(_cpu_account);
+    _sproutlet_tsx->on_tx_response(rsp->msg);
+  }
 
   if (rsp->msg->line.status.code >= PJSIP_SC_OK)
   {
@@ -2745,11 +3504,12 @@ void SproutletWrapper::tx_cancel(int fork_id)
                         _forks[fork_id].cancel_st_code,
                         _forks[fork_id].cancel_reason);
   _forks[fork_id].pending_cancel = false;
+  _forks[fork_id].cancelled = true;
 }
 
 /// Compare two status codes from the perspective of which is the best to
 /// return to the originator of a forked transaction.  This will only ever
-/// be called for 3xx/4xx/5xx/6xx response codes.
+/// be called for 3xx/4xx/5xx response codes (a 6xx beats all of them).
 ///
 /// @returns +1 if sc1 is better than sc2
 ///          0 if sc1 and sc2 are identical (or equally as good)
@@ -2757,7 +3517,7 @@ void SproutletWrapper::tx_cancel(int fork_id)
 ///
 int SproutletWrapper::compare_sip_sc(int sc1, int sc2)
 {
-  // Order is: (best) 487, 300, 301, ..., 698, 699, 408 (worst).
+  // Order is: (best) 487, 300, 301, ..., 598, 599, 408 (worst).
   TRC_DEBUG("Compare new status code %d with stored status code %d", sc1, sc2);
   if (sc1 == sc2)
   {
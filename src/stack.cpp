@@ -51,6 +51,8 @@ extern "C" {
 #include "sprout_pd_definitions.h"
 #include "uri_classifier.h"
 #include "namespace_hop.h"
+#include "udp_batch_transport.h"
+#include "memory_accounting.h"
 
 class StackQuiesceHandler;
 
@@ -62,6 +64,12 @@ static ConnectionTracker *connection_tracker = NULL;
 
 static volatile pj_bool_t quit_flag;
 static pj_bool_t on_rx_msg(pjsip_rx_data* rdata);
+static pj_bool_t transport_thread_stats_on_rx_msg(pjsip_rx_data* rdata);
+
+// Per transport thread counters of received messages, and the index of the
+// transport thread we are running on (-1 on any other thread).
+static std::vector<SNMP::CounterTable*> transport_thread_rx_tbls;
+__thread int transport_thread_index = -1;
 
 // Handles updating the connection tracker when requests are received,
 // for quiescing processing.
@@ -82,6 +90,25 @@ static pjsip_module mod_connection_tracking =
   NULL,                                 /* on_tsx_state()       */
 };
 
+// Counts the messages received by each transport thread, so that imbalance
+// between the threads is visible.  This runs before every other module.
+static pjsip_module mod_transport_thread_stats =
+{
+  NULL, NULL,                           /* prev, next.          */
+  pj_str("mod-transport-thread-stats"), /* Name.                */
+  -1,                                   /* Id                   */
+  PJSIP_MOD_PRIORITY_TRANSPORT_LAYER-4, /* Priority             */
+  NULL,                                 /* load()               */
+  NULL,                                 /* start()              */
+  NULL,                                 /* stop()               */
+  NULL,                                 /* unload()             */
+  &transport_thread_stats_on_rx_msg,    /* on_rx_request()      */
+  &transport_thread_stats_on_rx_msg,    /* on_rx_response()     */
+  NULL,                                 /* on_tx_request()      */
+  NULL,                                 /* on_tx_response()     */
+  NULL,                                 /* on_tsx_state()       */
+};
+
 // LCOV_EXCL_START - Stack not tested by UTs
 
 static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
@@ -91,6 +118,16 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
   return PJ_FALSE;
 }
 
+static pj_bool_t transport_thread_stats_on_rx_msg(pjsip_rx_data* rdata)
+{
+  if ((transport_thread_index >= 0) &&
+      (transport_thread_index < (int)transport_thread_rx_tbls.size()))
+  {
+    transport_thread_rx_tbls[transport_thread_index]->increment();
+  }
+  return PJ_FALSE;
+}
+
 const static std::string _known_statnames[] = {
   "client_count",
   "connected_homers",
@@ -157,13 +194,18 @@ static int pjsip_thread_func(void *p)
 {
   pj_time_val delay = {0, 10};
 
-  PJ_UNUSED_ARG(p);
+  // Each transport thread is passed its index.  The first thread is also
+  // responsible for acting on changes to the quiescing state.
+  transport_thread_index = (int)(intptr_t)p;
+  bool handles_quiescing = (transport_thread_index == 0);
 
   // Get the Kernel's ID for this thread so we can log it out.
   pid_t tid;
   tid = syscall(SYS_gettid);
 
-  TRC_STATUS("PJSIP transport thread started with kernel thread ID %d", tid);
+  TRC_STATUS("PJSIP transport thread %d started with kernel thread ID %d",
+             transport_thread_index,
+             tid);
 
   // Increase the priority of the transport thread (by giving it a real-time
   // scheduling policy and a non-zero priority). This means that the transport
@@ -183,8 +225,8 @@ static int pjsip_thread_func(void *p)
 
   pj_bool_t curr_quiescing = PJ_FALSE;
 
-  // Log whenever we do any I/O on this thread. There is only one transport
-  // thread so blocking on it is a really bad idea!
+  // Log whenever we do any I/O on this thread. There are only a handful of
+  // transport threads so blocking on one is a really bad idea!
   Utils::IOHook io_hook(&on_io_started,
                         Utils::IOHook::NOOP_ON_COMPLETE);
 
@@ -192,6 +234,11 @@ static int pjsip_thread_func(void *p)
   {
     pjsip_endpt_handle_events(stack_data.endpt, &delay);
 
+    if (!handles_quiescing)
+    {
+      continue;
+    }
+
     // Check if our quiescing state has changed, and act appropriately
     pj_bool_t new_quiescing = quiescing;
     if (curr_quiescing != new_quiescing)
@@ -211,7 +258,7 @@ static int pjsip_thread_func(void *p)
 
   }
 
-  TRC_STATUS("PJSIP thread ended");
+  TRC_STATUS("PJSIP transport thread %d ended", transport_thread_index);
 
   return 0;
 }
@@ -317,7 +364,18 @@ pj_status_t create_udp_transport(int port, pj_str_t& host)
 
   // The UDP function call depends on the address type, which should be IPv4
   // or IPv6, otherwise something has gone wrong so don't try to start transport.
-  if (addr.addr.sa_family == PJ_AF_INET)
+  if ((stack_data.udp_batch_size > 0) &&
+      ((addr.addr.sa_family == PJ_AF_INET) ||
+       (addr.addr.sa_family == PJ_AF_INET6)))
+  {
+    status = create_udp_batch_transport(stack_data.endpt,
+                                        &addr,
+                                        &published_name,
+                                        stack_data.udp_batch_size,
+                                        stack_data.udp_rx_sockets,
+                                        NULL);
+  }
+  else if (addr.addr.sa_family == PJ_AF_INET)
   {
     status = pjsip_udp_transport_start(stack_data.endpt,
                                        &addr.ipv4,
@@ -539,7 +597,7 @@ public:
 };
 
 
-pj_status_t init_pjsip()
+pj_status_t init_pjsip(int tdata_pool_cache_size, bool huge_page_pools)
 {
   pj_status_t status;
 
@@ -556,8 +614,27 @@ pj_status_t init_pjsip()
 
   // Must create a pool factory before we can allocate any memory.
   pj_caching_pool_init(&stack_data.cp, &pj_pool_factory_default_policy, 0);
+  MemoryAccounting::account("pool_stack")->set_sampler([]()
+  {
+    pj_lock_acquire(stack_data.cp.lock);
+    size_t used = stack_data.cp.used_size;
+    pj_lock_release(stack_data.cp.lock);
+    return used;
+  });
+
+  // The endpoint has its own pool factory, which reuses the pools of released
+  // tx_data rather than freeing them.  If enabled, the blocks of the pools
+  // come from huge page arenas rather than the heap.
+  stack_data.endpt_pool_allocator = huge_page_pools ? new HugePageAllocator() : NULL;
+  stack_data.endpt_pool_factory =
+    new RecyclingPoolFactory(tdata_pool_cache_size,
+                             RecyclingPoolFactory::DEFAULT_TRIM_INTERVAL_MS,
+                             stack_data.endpt_pool_allocator);
+
   // Create the endpoint.
-  status = pjsip_endpt_create(&stack_data.cp.factory, NULL, &stack_data.endpt);
+  status = pjsip_endpt_create(stack_data.endpt_pool_factory->factory(),
+                              NULL,
+                              &stack_data.endpt);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
   // Increase the limit on the number of timers that PJSIP processes each time
@@ -571,6 +648,14 @@ pj_status_t init_pjsip()
                                    pjsip_endpt_get_timer_heap(stack_data.endpt),
                                    4096);
 
+  // Only allow one transport thread at a time to process events on a given
+  // socket.  This has no effect with a single transport thread, but with
+  // several it keeps messages on each TCP connection in order, while still
+  // letting different sockets be serviced in parallel.  This must be set
+  // before any transports are created.
+  pj_ioqueue_set_default_concurrency(pjsip_endpt_get_ioqueue(stack_data.endpt),
+                                     PJ_FALSE);
+
   // Init transaction layer.
   status = pjsip_tsx_layer_init_module(stack_data.endpt);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
@@ -582,25 +667,52 @@ pj_status_t init_pjsip()
                                    4000,
                                    NULL);
 
-  status = register_custom_headers();
+  status = register_custom_headers(stack_data.lazy_header_parsing);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
   return PJ_SUCCESS;
 }
 
-pj_status_t start_pjsip_thread()
+pj_status_t start_pjsip_threads(int num_pjsip_threads,
+                                std::vector<SNMP::CounterTable*> rx_count_tbls)
 {
   pj_status_t status = PJ_SUCCESS;
 
-  status = pj_thread_create(stack_data.pool, "pjsip", &pjsip_thread_func,
-                            NULL, 0, 0, &stack_data.pjsip_transport_thread);
-  if (status != PJ_SUCCESS)
+  if (num_pjsip_threads < 1)
   {
-    TRC_ERROR("Error creating PJSIP thread, %s",
-              PJUtils::pj_status_to_string(status).c_str());
-    return 1;
+    num_pjsip_threads = 1;
+  }
+
+  if (!rx_count_tbls.empty())
+  {
+    transport_thread_rx_tbls = rx_count_tbls;
+    pjsip_endpt_register_module(stack_data.endpt, &mod_transport_thread_stats);
+  }
+
+  // The threads are only recorded so they can be joined - the threads
+  // themselves use transport_thread_index to tell that they are transport
+  // threads, as it is set before they start polling.
+  stack_data.pjsip_transport_threads.resize(num_pjsip_threads, NULL);
+
+  for (int ii = 0; ii < num_pjsip_threads; ++ii)
+  {
+    pj_thread_t* thread;
+    status = pj_thread_create(stack_data.pool, "pjsip", &pjsip_thread_func,
+                              (void*)(intptr_t)ii, 0, 0, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Error creating PJSIP thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      return 1;
+    }
+
+    stack_data.pjsip_transport_threads[ii] = thread;
   }
 
+  stack_data.pjsip_transport_thread = stack_data.pjsip_transport_threads[0];
+
+  TRC_STATUS("Started %d PJSIP transport threads", num_pjsip_threads);
+
   return PJ_SUCCESS;
 }
 
@@ -625,7 +737,13 @@ pj_status_t init_stack(int pcscf_trusted_port,
                        QuiescingManager *quiescing_mgr_arg,
                        const std::string& cdf_domain,
                        std::vector<std::string> sproutlet_uris,
-                       bool enable_orig_sip_to_tel_coerce)
+                       bool enable_orig_sip_to_tel_coerce,
+                       int tdata_pool_cache_size,
+                       int udp_batch_size,
+                       bool lazy_header_parsing,
+                       int quiesce_drain_rate,
+                       bool huge_page_pools,
+                       int udp_rx_sockets)
 {
   pj_status_t status;
   pj_sockaddr pri_addr;
@@ -655,6 +773,9 @@ pj_status_t init_stack(int pcscf_trusted_port,
   stack_data.sip_tcp_connect_timeout = sip_tcp_connect_timeout;
   stack_data.sip_tcp_send_timeout = sip_tcp_send_timeout;
   stack_data.enable_orig_sip_to_tel_coerce = enable_orig_sip_to_tel_coerce;
+  stack_data.udp_batch_size = udp_batch_size;
+  stack_data.udp_rx_sockets = udp_rx_sockets;
+  stack_data.lazy_header_parsing = lazy_header_parsing;
 
   // Work out local and public hostnames and cluster domain names.
   stack_data.local_host = (local_host != "") ? pj_str(local_host_cstr) : *pj_gethostname();
@@ -738,7 +859,7 @@ pj_status_t init_stack(int pcscf_trusted_port,
   }
 
   // Initialise PJSIP and all the associated resources.
-  status = init_pjsip();
+  status = init_pjsip(tdata_pool_cache_size, huge_page_pools);
 
   // Initialize the PJUtils module.
   PJUtils::init();
@@ -902,6 +1023,8 @@ pj_status_t init_stack(int pcscf_trusted_port,
     stack_data.name.push_back(alias_pj_str);
   }
 
+  URIClassifier::index_hosts();
+
   // Set up the Last Value Cache, accumulators and counters.
   std::string process_name;
   if ((stack_data.pcscf_trusted_port != 0) &&
@@ -929,7 +1052,8 @@ pj_status_t init_stack(int pcscf_trusted_port,
 
     // Create a new connection tracker, and register the quiesce handler with
     // it.
-    connection_tracker = new ConnectionTracker(stack_quiesce_handler);
+    connection_tracker = new ConnectionTracker(stack_quiesce_handler,
+                                               quiesce_drain_rate);
 
     // Register the quiesce handler with the quiescing manager (the former
     // implements the connection handling interface).
@@ -942,23 +1066,39 @@ pj_status_t init_stack(int pcscf_trusted_port,
 }
 
 
-pj_status_t stop_pjsip_thread()
+pj_status_t stop_pjsip_threads()
 {
-  // Set the quit flag to signal the PJSIP thread to exit, then wait
+  // Set the quit flag to signal the PJSIP threads to exit, then wait
   // for them to exit.
   quit_flag = PJ_TRUE;
 
-  pj_thread_join(stack_data.pjsip_transport_thread);
+  for (pj_thread_t* thread : stack_data.pjsip_transport_threads)
+  {
+    if (thread != NULL)
+    {
+      pj_thread_join(thread);
+    }
+  }
 
+  stack_data.pjsip_transport_threads.clear();
   stack_data.pjsip_transport_thread = NULL;
 
+  if (!transport_thread_rx_tbls.empty())
+  {
+    pjsip_endpt_unregister_module(stack_data.endpt, &mod_transport_thread_stats);
+    transport_thread_rx_tbls.clear();
+  }
+
   return PJ_SUCCESS;
 }
 
 void term_pjsip()
 {
   pjsip_endpt_destroy(stack_data.endpt);
+  delete stack_data.endpt_pool_factory; stack_data.endpt_pool_factory = NULL;
+  delete stack_data.endpt_pool_allocator; stack_data.endpt_pool_allocator = NULL;
   pj_pool_release(stack_data.pool);
+  MemoryAccounting::account("pool_stack")->set_sampler(nullptr);
   pj_caching_pool_destroy(&stack_data.cp);
   pj_shutdown();
 }
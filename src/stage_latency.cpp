@@ -0,0 +1,228 @@
+/**
+ * @file stage_latency.cpp Per-stage latency tracing of SIP processing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+#include <mutex>
+
+#include "log.h"
+#include "stage_latency.h"
+
+StageHistogram::StageHistogram() :
+  _sum_us(0),
+  _max_us(0)
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii].store(0, std::memory_order_relaxed);
+  }
+}
+
+int StageHistogram::bucket(uint64_t us)
+{
+  // Values below 2 * 16 get a bucket each.  Above that, each power of two
+  // is split into 16 buckets.
+  static const uint64_t LINEAR_LIMIT = 2ull << SUB_BUCKET_BITS;
+
+  if (us < LINEAR_LIMIT)
+  {
+    return (int)us;
+  }
+
+  if (us >= (1ull << MAX_VALUE_BITS))
+  {
+    return NUM_BUCKETS - 1;
+  }
+
+  int msb = 63 - __builtin_clzll(us);
+  int shift = msb - SUB_BUCKET_BITS;
+  return (shift << SUB_BUCKET_BITS) + (int)(us >> shift);
+}
+
+uint64_t StageHistogram::bucket_upper_bound(int bucket)
+{
+  static const int LINEAR_LIMIT = 2 << SUB_BUCKET_BITS;
+
+  if (bucket < LINEAR_LIMIT)
+  {
+    return bucket;
+  }
+
+  int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+  uint64_t sub = (bucket & ((1 << SUB_BUCKET_BITS) - 1)) | (1 << SUB_BUCKET_BITS);
+  return ((sub + 1) << shift) - 1;
+}
+
+void StageHistogram::record(uint64_t us)
+{
+  _buckets[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+  _sum_us.fetch_add(us, std::memory_order_relaxed);
+
+  uint64_t max_us = _max_us.load(std::memory_order_relaxed);
+  while ((us > max_us) &&
+         (!_max_us.compare_exchange_weak(max_us, us, std::memory_order_relaxed)))
+  {
+  }
+}
+
+StageHistogram::Summary StageHistogram::summary() const
+{
+  Summary summary = {};
+
+  uint64_t counts[NUM_BUCKETS];
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    counts[ii] = _buckets[ii].load(std::memory_order_relaxed);
+    summary.count += counts[ii];
+  }
+
+  if (summary.count == 0)
+  {
+    return summary;
+  }
+
+  summary.max_us = _max_us.load(std::memory_order_relaxed);
+  summary.mean_us = _sum_us.load(std::memory_order_relaxed) / summary.count;
+
+  // Each percentile is the upper bound of the bucket that contains it (but
+  // no more than the maximum).
+  struct
+  {
+    uint64_t per_mille;
+    uint64_t* value;
+  } percentiles[] = {{500, &summary.p50_us},
+                     {900, &summary.p90_us},
+                     {990, &summary.p99_us},
+                     {999, &summary.p999_us}};
+
+  uint64_t seen = 0;
+  size_t next = 0;
+  for (int ii = 0;
+       (ii < NUM_BUCKETS) && (next < sizeof(percentiles) / sizeof(percentiles[0]));
+       ++ii)
+  {
+    seen += counts[ii];
+
+    while ((next < sizeof(percentiles) / sizeof(percentiles[0])) &&
+           (seen * 1000 >= percentiles[next].per_mille * summary.count))
+    {
+      uint64_t bound = bucket_upper_bound(ii);
+      *percentiles[next].value = (bound < summary.max_us) ? bound : summary.max_us;
+      ++next;
+    }
+  }
+
+  return summary;
+}
+
+namespace StageLatency
+{
+  // Microseconds per tick.  This starts off assuming nanosecond ticks, and
+  // is calibrated by init().
+  static double us_per_tick = 0.001;
+
+  // The stages, by name.  These are created on first use, so stages can be
+  // looked up from static initializers.
+  struct Stages
+  {
+    std::mutex lock;
+    std::map<std::string, StageHistogram*> by_name;
+  };
+
+  static Stages& all_stages()
+  {
+    static Stages* stages = new Stages();
+    return *stages;
+  }
+
+  static thread_local Ticks tl_event_start = 0;
+
+  static uint64_t monotonic_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  void init()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    // Time the TSC against the monotonic clock over a short interval.
+    uint64_t start_ns = monotonic_ns();
+    Ticks start_ticks = now();
+
+    struct timespec delay = {0, 20 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    Ticks elapsed_ticks = now() - start_ticks;
+
+    if (elapsed_ticks > 0)
+    {
+      us_per_tick = (elapsed_ns / 1000.0) / elapsed_ticks;
+    }
+
+    TRC_STATUS("Stage latency clock runs at %.0f ticks per microsecond",
+               1.0 / us_per_tick);
+#endif
+  }
+
+  uint64_t ticks_to_us(Ticks ticks)
+  {
+    return (uint64_t)(ticks * us_per_tick);
+  }
+
+  uint64_t ticks_to_ns(Ticks ticks)
+  {
+    return (uint64_t)(ticks * us_per_tick * 1000.0);
+  }
+
+  StageHistogram* stage(const std::string& name)
+  {
+    Stages& stages = all_stages();
+    std::lock_guard<std::mutex> guard(stages.lock);
+
+    StageHistogram*& stage = stages.by_name[name];
+    if (stage == NULL)
+    {
+      stage = new StageHistogram();
+    }
+
+    return stage;
+  }
+
+  void set_event_start(Ticks start)
+  {
+    tl_event_start = start;
+  }
+
+  Ticks event_start()
+  {
+    return tl_event_start;
+  }
+
+  std::vector<StageSummary> summaries()
+  {
+    std::vector<std::pair<std::string, StageHistogram*>> snapshot;
+    {
+      Stages& stages = all_stages();
+      std::lock_guard<std::mutex> guard(stages.lock);
+      snapshot.assign(stages.by_name.begin(), stages.by_name.end());
+    }
+
+    std::vector<StageSummary> summaries;
+    for (const std::pair<std::string, StageHistogram*>& stage : snapshot)
+    {
+      summaries.push_back({stage.first, stage.second->summary()});
+    }
+
+    return summaries;
+  }
+}
@@ -0,0 +1,143 @@
+/**
+ * @file startup_stages.cpp Running Sprout's startup stages in parallel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+#include "startup_stages.h"
+
+StartupStages::StartupStages() :
+  _valid(true)
+{
+}
+
+void StartupStages::add(const std::string& name,
+                        Stage stage,
+                        const std::vector<std::string>& depends_on)
+{
+  Entry entry;
+  entry.name = name;
+  entry.stage = stage;
+
+  for (const std::string& dependency : depends_on)
+  {
+    std::map<std::string, int>::const_iterator it = _index.find(dependency);
+    if (it == _index.end())
+    {
+      TRC_ERROR("Startup stage %s depends on unknown stage %s",
+                name.c_str(), dependency.c_str());
+      _valid = false;
+    }
+    else
+    {
+      entry.depends_on.push_back(it->second);
+    }
+  }
+
+  _index[name] = _stages.size();
+  _stages.push_back(entry);
+}
+
+bool StartupStages::run()
+{
+  if (!_valid)
+  {
+    return false;
+  }
+
+  enum State { PENDING, RUNNING, SUCCEEDED, FAILED };
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::vector<State> states(_stages.size(), PENDING);
+  std::vector<long> durations(_stages.size(), 0);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (size_t ii = 0; ii < _stages.size(); ++ii)
+  {
+    threads.push_back(std::thread([this, ii, &lock, &cond, &states, &durations]()
+    {
+      const Entry& entry = _stages[ii];
+      bool dependencies_ok = true;
+
+      // Wait for the stages this one depends on.
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        for (int dependency : entry.depends_on)
+        {
+          cond.wait(guard, [&states, dependency]()
+                    { return (states[dependency] == SUCCEEDED) ||
+                             (states[dependency] == FAILED); });
+          if (states[dependency] == FAILED)
+          {
+            dependencies_ok = false;
+          }
+        }
+
+        states[ii] = dependencies_ok ? RUNNING : FAILED;
+      }
+
+      if (!dependencies_ok)
+      {
+        TRC_ERROR("Skipping startup stage %s as a stage it depends on failed",
+                  entry.name.c_str());
+        cond.notify_all();
+        return;
+      }
+
+      std::chrono::steady_clock::time_point stage_start =
+                                               std::chrono::steady_clock::now();
+      bool ok = entry.stage();
+      long duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - stage_start).count();
+
+      TRC_STATUS("Startup stage %s %s in %ldms",
+                 entry.name.c_str(), ok ? "completed" : "failed", duration_ms);
+
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        states[ii] = ok ? SUCCEEDED : FAILED;
+        durations[ii] = duration_ms;
+      }
+      cond.notify_all();
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  bool ok = true;
+  for (size_t ii = 0; ii < _stages.size(); ++ii)
+  {
+    if (states[ii] == SUCCEEDED)
+    {
+      _durations_ms[_stages[ii].name] = durations[ii];
+    }
+    else
+    {
+      ok = false;
+    }
+  }
+
+  TRC_STATUS("%d startup stages finished in %ldms",
+             (int)_stages.size(),
+             (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                           std::chrono::steady_clock::now() - start).count());
+
+  return ok;
+}
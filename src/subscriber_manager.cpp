@@ -13,18 +13,34 @@
 #include "sproutsasevent.h"
 #include "aor_utils.h"
 #include "pjutils.h"
+#include "batch_utils.h"
 
 SubscriberManager::SubscriberManager(S4* s4,
                                      HSSConnection* hss_connection,
                                      AnalyticsLogger* analytics_logger,
                                      NotifySender* notify_sender,
-                                     RegistrationSender* registration_sender) :
+                                     RegistrationSender* registration_sender,
+                                     int aor_cache_ttl,
+                                     size_t aor_cache_size,
+                                     const ShardedLRUCacheStatsTables& aor_cache_stats_tbls) :
   _s4(s4),
   _hss_connection(hss_connection),
   _analytics(analytics_logger),
   _notify_sender(notify_sender),
-  _registration_sender(registration_sender)
+  _registration_sender(registration_sender),
+  _aor_cache_ttl(aor_cache_ttl),
+  _aor_cache(NULL),
+  _timer_pop_jobs(0)
 {
+  if ((aor_cache_ttl > 0) && (aor_cache_size > 0))
+  {
+    _aor_cache =
+      new ShardedLRUCache<std::string, std::shared_ptr<const AoR>>(
+                                                        aor_cache_size,
+                                                        NUM_CACHE_SHARDS,
+                                                        aor_cache_stats_tbls);
+  }
+
   if (_s4 != NULL)
   {
     _s4->register_timer_pop_consumer(this);
@@ -38,6 +54,7 @@ SubscriberManager::SubscriberManager(S4* s4,
 
 SubscriberManager::~SubscriberManager()
 {
+  delete _aor_cache; _aor_cache = NULL;
 }
 
 HTTPCode SubscriberManager::register_subscriber(const std::string& aor_id,
@@ -83,7 +100,9 @@ HTTPCode SubscriberManager::register_subscriber_internal(const std::string& aor_
   if (!add_bindings.empty())
   {
     PatchObject patch_object;
+    SubscriberDataUtils::AoRChanges changes;
     build_patch(patch_object,
+                changes,
                 add_bindings,
                 associated_uris);
 
@@ -95,6 +114,7 @@ HTTPCode SubscriberManager::register_subscriber_internal(const std::string& aor_
     HTTPCode rc = _s4->handle_put(aor_id,
                                   *updated_aor,
                                   trail);
+    invalidate_cached_aor(aor_id);
 
     // If the PUT resulted in precondition failed (which happens if there is
     // already an AoR in the store), we retry with a reregister.
@@ -123,7 +143,7 @@ HTTPCode SubscriberManager::register_subscriber_internal(const std::string& aor_
       return rc;
     }
 
-    log_updated_bindings(*updated_aor, add_bindings, now);
+    log_updated_bindings(*updated_aor, changes, now);
 
     // Get all bindings to return to the caller
     all_bindings = SubscriberDataUtils::copy_active_bindings(updated_aor->bindings(),
@@ -193,12 +213,30 @@ HTTPCode SubscriberManager::reregister_subscriber_internal(const std::string& ao
 
   int now = time(NULL);
 
+  // Most reregisters just refresh existing bindings.  These don't need an
+  // up to date copy of the AoR to work out what to remove, so we can use the
+  // cached AoR (which has usually just been read to get the current bindings)
+  // rather than reading it again.
   AoR* orig_aor = NULL;
-  uint64_t unused_version;
-  HTTPCode rc = _s4->handle_get(aor_id,
-                                &orig_aor,
-                                unused_version,
-                                trail);
+  HTTPCode rc = HTTP_OK;
+  std::shared_ptr<const AoR> cached_aor;
+
+  if ((find_cached_aor(aor_id, cached_aor, trail)) &&
+      (is_refresh(*cached_aor, updated_bindings, binding_ids_to_remove)))
+  {
+    TRC_DEBUG("Reregister only refreshes bindings for AoR %s", aor_id.c_str());
+    orig_aor = new AoR(aor_id);
+    orig_aor->copy_aor(*cached_aor);
+  }
+  else
+  {
+    cached_aor.reset();
+    uint64_t unused_version;
+    rc = _s4->handle_get(aor_id,
+                         &orig_aor,
+                         unused_version,
+                         trail);
+  }
 
   // We are reregistering a subscriber, so there must be an existing AoR in the
   // store.
@@ -233,24 +271,38 @@ HTTPCode SubscriberManager::reregister_subscriber_internal(const std::string& ao
                                                      updated_bindings,
                                                      binding_ids_to_remove);
 
+  PatchObject patch_object;
+  SubscriberDataUtils::AoRChanges changes;
+
+  if ((cached_aor) &&
+      (cached_aor->_associated_uris == associated_uris))
+  {
+    // This is a refresh that doesn't change the associated URIs, so only send
+    // the refreshed bindings.
+    build_patch(patch_object, changes, updated_bindings);
+  }
+  else
+  {
+    build_patch(patch_object,
+                changes,
+                updated_bindings,
+                binding_ids_to_remove,
+                subscription_ids_to_remove,
+                associated_uris);
+  }
+
   // We log removed bindings before writing to the store so that in the case
   // that the write fails, our estimate of how many active bindings we have will
   // be an underestimate, not an overestimate.
   log_removed_bindings(*orig_aor,
-                       binding_ids_to_remove);
-
-  PatchObject patch_object;
-  build_patch(patch_object,
-              updated_bindings,
-              binding_ids_to_remove,
-              subscription_ids_to_remove,
-              associated_uris);
+                       changes.removed_binding_ids);
 
   // PATCH the existing AoR.
   rc = _s4->handle_patch(aor_id,
                          patch_object,
                          &updated_aor,
                          trail);
+  invalidate_cached_aor(aor_id);
 
   // If we didn't find an existing AoR, that means the subscriber does not
   // currently exist. We might want to retry by registering the subscriber
@@ -279,12 +331,12 @@ HTTPCode SubscriberManager::reregister_subscriber_internal(const std::string& ao
     return rc;
   }
 
-  log_updated_bindings(*updated_aor, updated_bindings, now);
+  log_updated_bindings(*updated_aor, changes, now);
 
   log_subscriptions(aor_id,
                     *orig_aor,
                     *updated_aor,
-                    subscription_ids_to_remove,
+                    changes.removed_subscription_ids,
                     now);
 
   // Get all bindings to return to the caller
@@ -370,12 +422,6 @@ HTTPCode SubscriberManager::remove_bindings(const std::string& public_id,
     return rc;
   }
 
-  // We log removed bindings before writing to the store so that in the case
-  // that the write fails, our estimate of how many active bindings we have will
-  // be an underestimate, not an overestimate.
-  log_removed_bindings(*orig_aor,
-                       binding_ids);
-
   // Check if there are any subscriptions that share the same contact as
   // the removed bindings, and delete them too.
   std::vector<std::string> subscription_ids_to_remove =
@@ -385,17 +431,26 @@ HTTPCode SubscriberManager::remove_bindings(const std::string& public_id,
                                                      binding_ids);
 
   PatchObject patch_object;
+  SubscriberDataUtils::AoRChanges changes;
   build_patch(patch_object,
+              changes,
               binding_ids,
               subscription_ids_to_remove,
               irs_info._associated_uris);
 
+  // We log removed bindings before writing to the store so that in the case
+  // that the write fails, our estimate of how many active bindings we have will
+  // be an underestimate, not an overestimate.
+  log_removed_bindings(*orig_aor,
+                       changes.removed_binding_ids);
+
   // PATCH the existing AoR.
   AoR* updated_aor = NULL;
   rc = _s4->handle_patch(aor_id,
                          patch_object,
                          &updated_aor,
                          trail);
+  invalidate_cached_aor(aor_id);
 
   if (rc != HTTP_OK)
   {
@@ -410,7 +465,7 @@ HTTPCode SubscriberManager::remove_bindings(const std::string& public_id,
   log_subscriptions(aor_id,
                     *orig_aor,
                     *updated_aor,
-                    subscription_ids_to_remove,
+                    changes.removed_subscription_ids,
                     now);
 
   // Get all bindings to return to the caller
@@ -514,12 +569,31 @@ HTTPCode SubscriberManager::modify_subscriptions(
     return rc;
   }
 
+  // Most SUBSCRIBEs just refresh an existing subscription.  As for
+  // reregisters, these can use the cached AoR (the subscription sproutlet has
+  // usually just read it) rather than reading it again.
   AoR* orig_aor = NULL;
-  uint64_t unused_version;
-  rc = _s4->handle_get(aor_id,
-                       &orig_aor,
-                       unused_version,
-                       trail);
+  std::shared_ptr<const AoR> cached_aor;
+
+  if ((find_cached_aor(aor_id, cached_aor, trail)) &&
+      (is_subscription_refresh(*cached_aor,
+                               update_subscriptions,
+                               remove_subscriptions)))
+  {
+    TRC_DEBUG("Subscribe only refreshes subscriptions for AoR %s",
+              aor_id.c_str());
+    orig_aor = new AoR(aor_id);
+    orig_aor->copy_aor(*cached_aor);
+  }
+  else
+  {
+    cached_aor.reset();
+    uint64_t unused_version;
+    rc = _s4->handle_get(aor_id,
+                         &orig_aor,
+                         unused_version,
+                         trail);
+  }
 
   // There must be an existing AoR since there must be bindings to subscribe to.
   if (rc != HTTP_OK)
@@ -532,10 +606,23 @@ HTTPCode SubscriberManager::modify_subscriptions(
   }
 
   PatchObject patch_object;
-  build_patch(patch_object,
-              update_subscriptions,
-              remove_subscriptions,
-              irs_info._associated_uris);
+  SubscriberDataUtils::AoRChanges changes;
+
+  if ((cached_aor) &&
+      (cached_aor->_associated_uris == irs_info._associated_uris))
+  {
+    // This is a refresh that doesn't change the associated URIs, so only send
+    // the refreshed subscriptions.
+    build_patch(patch_object, changes, update_subscriptions);
+  }
+  else
+  {
+    build_patch(patch_object,
+                changes,
+                update_subscriptions,
+                remove_subscriptions,
+                irs_info._associated_uris);
+  }
 
   // PATCH the existing AoR.
   AoR* updated_aor = NULL;
@@ -543,6 +630,7 @@ HTTPCode SubscriberManager::modify_subscriptions(
                          patch_object,
                          &updated_aor,
                          trail);
+  invalidate_cached_aor(aor_id);
 
   if (rc != HTTP_OK)
   {
@@ -557,9 +645,9 @@ HTTPCode SubscriberManager::modify_subscriptions(
     // OK to the client.
 
     // Write an analytics log for the modified subscription.
-    std::string subscription_id = (remove_subscriptions.empty()) ?
-                                    update_subscriptions.begin()->first :
-                                    remove_subscriptions[0];
+    std::string subscription_id = (changes.removed_subscription_ids.empty()) ?
+                                    changes.updated_subscription_ids[0] :
+                                    changes.removed_subscription_ids[0];
     log_subscriptions(aor_id,
                       *orig_aor,
                       *updated_aor,
@@ -587,6 +675,9 @@ HTTPCode SubscriberManager::deregister_subscriber(const std::string& public_id,
 {
   TRC_DEBUG("Deregistering subscriber with IMPU %s", public_id.c_str());
 
+  // Make sure we're working from Homestead's view of the subscriber.
+  _hss_connection->invalidate_cached_registration_data(public_id);
+
   // Get cached subscriber information from the HSS.
   std::string aor_id;
   HSSConnection::irs_info irs_info;
@@ -643,6 +734,7 @@ HTTPCode SubscriberManager::deregister_subscriber(const std::string& public_id,
     rc = _s4->handle_delete(aor_id,
                             version,
                             trail);
+    invalidate_cached_aor(aor_id);
   } while (rc == HTTP_PRECONDITION_FAILED);
 
   if ((rc != HTTP_OK) && (rc != HTTP_NO_CONTENT))
@@ -693,18 +785,26 @@ HTTPCode SubscriberManager::get_bindings(const std::string& aor_id,
   TRC_DEBUG("Retrieving bindings for AoR %s",
             aor_id.c_str());
 
-  AoR* aor = NULL;
-  uint64_t unused_version;
-  HTTPCode rc = _s4->handle_get(aor_id,
-                                &aor,
-                                unused_version,
-                                trail);
-  if (rc != HTTP_OK)
+  std::shared_ptr<const AoR> aor;
+
+  if (!find_cached_aor(aor_id, aor, trail))
   {
-    TRC_DEBUG("Retrieving bindings for AoR %s failed during GET with return code %d",
-              aor_id.c_str(),
-              rc);
-    return rc;
+    AoR* stored_aor = NULL;
+    uint64_t unused_version;
+    HTTPCode rc = _s4->handle_get(aor_id,
+                                  &stored_aor,
+                                  unused_version,
+                                  trail);
+    if (rc != HTTP_OK)
+    {
+      TRC_DEBUG("Retrieving bindings for AoR %s failed during GET with return code %d",
+                aor_id.c_str(),
+                rc);
+      return rc;
+    }
+
+    aor.reset(stored_aor);
+    add_cached_aor(aor_id, aor);
   }
 
   // Set the bindings to return to the caller.
@@ -712,10 +812,99 @@ HTTPCode SubscriberManager::get_bindings(const std::string& aor_id,
                                                        time(NULL),
                                                        trail);
 
-  delete aor; aor = NULL;
   return HTTP_OK;
 }
 
+void SubscriberManager::get_bindings_multi(const std::vector<std::string>& aor_ids,
+                                           std::vector<Bindings>& bindings,
+                                           std::vector<HTTPCode>& rcs,
+                                           SAS::TrailId trail)
+{
+  TRC_DEBUG("Retrieving bindings for %lu AoRs", aor_ids.size());
+
+  // Each result is written by only one thread, so we size the results up
+  // front and don't need to lock them.
+  bindings.assign(aor_ids.size(), Bindings());
+  rcs.assign(aor_ids.size(), HTTP_OK);
+
+  BatchUtils::run_in_parallel(aor_ids.size(),
+                              [this, &aor_ids, &bindings, &rcs, trail](size_t ii)
+  {
+    rcs[ii] = get_bindings(aor_ids[ii], bindings[ii], trail);
+  });
+}
+
+HTTPCode SubscriberManager::deregister_subscribers(const std::vector<std::string>& public_ids,
+                                                   SAS::TrailId trail)
+{
+  TRC_DEBUG("Deregistering %lu subscribers", public_ids.size());
+
+  std::vector<HTTPCode> rcs(public_ids.size(), HTTP_OK);
+
+  BatchUtils::run_in_parallel(public_ids.size(),
+                              [this, &public_ids, &rcs, trail](size_t ii)
+  {
+    rcs[ii] = deregister_subscriber(public_ids[ii], trail);
+  });
+
+  for (HTTPCode rc : rcs)
+  {
+    if (rc != HTTP_OK)
+    {
+      return rc;
+    }
+  }
+
+  return HTTP_OK;
+}
+
+// AoR cache.
+//
+// AoRs read from S4 to look up bindings (which happens on every terminating
+// call) are cached for a short, configured time, so that repeated calls to
+// the same subscriber don't each read and deserialize the AoR.  Every write
+// to S4 for an AoR - whether it succeeds or fails, for example because the
+// AoR was changed by another node and the CAS failed - removes the AoR from
+// the cache, so a write made through this node is seen immediately.
+//
+// Writes made through other nodes are only seen once the cached AoR expires,
+// as is a write that races with a read that populates the cache.  Expired
+// bindings are filtered out of the cached AoR as they are for a stored one.
+
+bool SubscriberManager::find_cached_aor(const std::string& aor_id,
+                                        std::shared_ptr<const AoR>& aor,
+                                        SAS::TrailId trail)
+{
+  if ((_aor_cache == NULL) || (!_aor_cache->get(aor_id, aor)))
+  {
+    return false;
+  }
+
+  TRC_DEBUG("Found cached AoR for %s", aor_id.c_str());
+  SAS::Event event(trail, SASEvent::AOR_CACHE_HIT, 0);
+  event.add_var_param(aor_id);
+  SAS::report_event(event);
+
+  return true;
+}
+
+void SubscriberManager::add_cached_aor(const std::string& aor_id,
+                                       const std::shared_ptr<const AoR>& aor)
+{
+  if (_aor_cache != NULL)
+  {
+    _aor_cache->put(aor_id, aor, _aor_cache_ttl);
+  }
+}
+
+void SubscriberManager::invalidate_cached_aor(const std::string& aor_id)
+{
+  if (_aor_cache != NULL)
+  {
+    _aor_cache->erase(aor_id);
+  }
+}
+
 HTTPCode SubscriberManager::get_subscriptions(const std::string& aor_id,
                                               Subscriptions& subscriptions,
                                               SAS::TrailId trail)
@@ -777,6 +966,35 @@ HTTPCode SubscriberManager::update_associated_uris(const std::string& aor_id,
 {
   TRC_DEBUG("Updating associted URIs for AoR %s", aor_id.c_str());
 
+  // The HSS has pushed a new profile, so any registration data we have cached
+  // for the old or new implicit registration set is out of date.
+  _hss_connection->invalidate_cached_registration_data(aor_id);
+
+  for (const std::string& uri : associated_uris.get_all_uris())
+  {
+    _hss_connection->invalidate_cached_registration_data(uri);
+  }
+
+  return update_aor_associated_uris(aor_id, associated_uris, trail);
+}
+
+HTTPCode SubscriberManager::update_service_profile(const std::string& aor_id,
+                                                   const PushedProfile& profile,
+                                                   SAS::TrailId trail)
+{
+  TRC_DEBUG("Updating service profile for AoR %s", aor_id.c_str());
+
+  // Only the cached registration data for the IMPUs that the push changes
+  // needs to be invalidated or parsed again.
+  _hss_connection->update_cached_service_profiles(aor_id, profile, trail);
+
+  return update_aor_associated_uris(aor_id, profile.associated_uris, trail);
+}
+
+HTTPCode SubscriberManager::update_aor_associated_uris(const std::string& aor_id,
+                                                       const AssociatedURIs& associated_uris,
+                                                       SAS::TrailId trail)
+{
   // Get the original AoR from S4.
   AoR* orig_aor = NULL;
   uint64_t unused_version;
@@ -793,6 +1011,15 @@ HTTPCode SubscriberManager::update_associated_uris(const std::string& aor_id,
     return rc;
   }
 
+  if (orig_aor->_associated_uris == associated_uris)
+  {
+    // The push doesn't change any of the IMPUs or their barring, so there's
+    // nothing to write or to notify subscribers of.
+    TRC_DEBUG("Associated URIs for AoR %s are unchanged", aor_id.c_str());
+    delete orig_aor; orig_aor = NULL;
+    return HTTP_OK;
+  }
+
   PatchObject patch_object;
   build_patch(patch_object,
               associated_uris);
@@ -803,6 +1030,7 @@ HTTPCode SubscriberManager::update_associated_uris(const std::string& aor_id,
                          patch_object,
                          &updated_aor,
                          trail);
+  invalidate_cached_aor(aor_id);
 
   if (rc != HTTP_OK)
   {
@@ -830,9 +1058,68 @@ HTTPCode SubscriberManager::update_associated_uris(const std::string& aor_id,
 void SubscriberManager::handle_timer_pop(const std::string& aor_id,
                                          SAS::TrailId trail)
 {
-  PJUtils::run_callback_on_worker_thread([this, aor_id, trail]() {
-    return handle_timer_pop_internal(aor_id, trail);
-  });
+  handle_timer_pops(std::vector<std::string>(1, aor_id), trail);
+}
+
+void SubscriberManager::handle_timer_pops(const std::vector<std::string>& aor_ids,
+                                          SAS::TrailId trail)
+{
+  // Timer pops tend to arrive in floods (for example, an hour after a large
+  // number of subscribers registered at once), so rather than starting a
+  // worker thread job for each pop, queue them up and start enough jobs to
+  // handle them in batches.  A pop for an AoR that is already queued is
+  // dropped - the queued pop removes everything that has expired by the time
+  // it is handled.
+  size_t jobs_to_start = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(_timer_pop_lock);
+
+    for (const std::string& aor_id : aor_ids)
+    {
+      _pending_timer_pops.emplace(aor_id, trail);
+    }
+
+    size_t jobs_needed = (_pending_timer_pops.size() + TIMER_POP_BATCH_SIZE - 1) /
+                         TIMER_POP_BATCH_SIZE;
+
+    if (jobs_needed > _timer_pop_jobs)
+    {
+      jobs_to_start = jobs_needed - _timer_pop_jobs;
+      _timer_pop_jobs = jobs_needed;
+    }
+  }
+
+  for (size_t ii = 0; ii < jobs_to_start; ++ii)
+  {
+    PJUtils::run_callback_on_worker_thread([this]() {
+      return handle_pending_timer_pops();
+    });
+  }
+}
+
+void SubscriberManager::handle_pending_timer_pops()
+{
+  std::vector<std::pair<std::string, SAS::TrailId>> batch;
+
+  {
+    std::lock_guard<std::mutex> lock(_timer_pop_lock);
+    _timer_pop_jobs--;
+
+    while ((!_pending_timer_pops.empty()) &&
+           (batch.size() < TIMER_POP_BATCH_SIZE))
+    {
+      batch.push_back(*_pending_timer_pops.begin());
+      _pending_timer_pops.erase(_pending_timer_pops.begin());
+    }
+  }
+
+  TRC_DEBUG("Handling a batch of %d timer pops", batch.size());
+
+  for (const std::pair<std::string, SAS::TrailId>& pop : batch)
+  {
+    handle_timer_pop_internal(pop.first, pop.second);
+  }
 }
 
 void SubscriberManager::handle_timer_pop_internal(const std::string& aor_id,
@@ -877,28 +1164,31 @@ void SubscriberManager::handle_timer_pop_internal(const std::string& aor_id,
     }
   }
 
-  // We log removed bindings before writing to the store so that in the case
-  // that the write fails, our estimate of how many active bindings we have will
-  // be an underestimate, not an overestimate.
-  log_removed_bindings(*orig_aor,
-                       binding_ids_to_remove);
-
   // Send a PATCH to remove any expired bindings and subscriptions. We only do
   // this if there any bindings or subscriptions to remove.
   AoR* updated_aor = NULL;
+  SubscriberDataUtils::AoRChanges changes;
   if ((!binding_ids_to_remove.empty()) ||
       (!subscription_ids_to_remove.empty()))
   {
     PatchObject patch_object;
     build_patch(patch_object,
+                changes,
                 binding_ids_to_remove,
                 subscription_ids_to_remove);
 
+    // We log removed bindings before writing to the store so that in the case
+    // that the write fails, our estimate of how many active bindings we have
+    // will be an underestimate, not an overestimate.
+    log_removed_bindings(*orig_aor,
+                         changes.removed_binding_ids);
+
     // PATCH the existing AoR.
     rc = _s4->handle_patch(aor_id,
                            patch_object,
                            &updated_aor,
                            trail);
+    invalidate_cached_aor(aor_id);
 
     if (rc != HTTP_OK)
     {
@@ -920,7 +1210,7 @@ void SubscriberManager::handle_timer_pop_internal(const std::string& aor_id,
   log_subscriptions(aor_id,
                     *orig_aor,
                     *updated_aor,
-                    subscription_ids_to_remove,
+                    changes.removed_subscription_ids,
                     now);
 
   send_notifys(aor_id,
@@ -1063,6 +1353,54 @@ std::vector<std::string> SubscriberManager::subscriptions_to_remove(const Bindin
   return subscription_ids_to_remove;
 }
 
+bool SubscriberManager::is_refresh(const AoR& orig_aor,
+                                   const Bindings& bindings_to_update,
+                                   const std::vector<std::string>& binding_ids_to_remove)
+{
+  if (!binding_ids_to_remove.empty())
+  {
+    return false;
+  }
+
+  // Every binding must already exist with the same contact URI (otherwise
+  // subscriptions might need to be removed).
+  for (BindingPair bp : bindings_to_update)
+  {
+    Bindings::const_iterator b = orig_aor.bindings().find(bp.first);
+    if ((b == orig_aor.bindings().end()) ||
+        (b->second->_uri != bp.second->_uri))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool SubscriberManager::is_subscription_refresh(
+                          const AoR& orig_aor,
+                          const Subscriptions& subscriptions_to_update,
+                          const std::vector<std::string>& subscription_ids_to_remove)
+{
+  if (!subscription_ids_to_remove.empty())
+  {
+    return false;
+  }
+
+  // Every subscription must already exist (otherwise we need an up to date
+  // copy of the AoR to send the right NOTIFY for the new subscription).
+  for (SubscriptionPair sp : subscriptions_to_update)
+  {
+    if (orig_aor.subscriptions().find(sp.first) ==
+        orig_aor.subscriptions().end())
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 void SubscriberManager::send_notifys(
                          const std::string& aor_id,
                          AoR* orig_aor,
@@ -1073,22 +1411,14 @@ void SubscriberManager::send_notifys(
 {
   TRC_DEBUG("Sending NOTIFYs for %s", aor_id.c_str());
 
-  AoR orig = AoR("");
-  AoR current = AoR("");
-
-  if (orig_aor != NULL)
-  {
-    orig.copy_aor(*orig_aor);
-  }
-
-  if (updated_aor != NULL)
-  {
-    current.copy_aor(*updated_aor);
-  }
+  // The AoRs are passed straight through rather than copied - the callers
+  // are finished with them, and copying every binding and subscription of a
+  // large AoR costs more than working out the NOTIFYs.
+  AoR empty_aor("");
 
   _notify_sender->send_notifys(aor_id,
-                               orig,
-                               current,
+                               (orig_aor != NULL) ? *orig_aor : empty_aor,
+                               (updated_aor != NULL) ? *updated_aor : empty_aor,
                                event_trigger,
                                now,
                                trail);
@@ -1117,39 +1447,38 @@ void SubscriberManager::log_removed_bindings(
 {
   if (_analytics != NULL)
   {
-    for (std::string binding_id : binding_ids)
+    for (const std::string& binding_id : binding_ids)
     {
-      for (BindingPair binding_pair : orig_aor.bindings())
-      {
-        if (binding_pair.first == binding_id)
-        {
-          _analytics->registration(binding_pair.second->_address_of_record,
-                                   binding_id,
-                                   binding_pair.second->_uri,
-                                   0);
+      Bindings::const_iterator binding = orig_aor.bindings().find(binding_id);
 
-          break;
-        }
+      if (binding != orig_aor.bindings().end())
+      {
+        _analytics->registration(binding->second->_address_of_record,
+                                 binding_id,
+                                 binding->second->_uri,
+                                 0);
       }
     }
   }
 }
 
-void SubscriberManager::log_updated_bindings(const AoR& updated_aor,
-                                             const Bindings& binding_pairs,
-                                             int now)
+void SubscriberManager::log_updated_bindings(
+                                 const AoR& updated_aor,
+                                 const SubscriberDataUtils::AoRChanges& changes,
+                                 int now)
 {
   if (_analytics != NULL)
   {
-    for (BindingPair binding_pair : binding_pairs)
+    for (const std::string& binding_id : changes.updated_binding_ids)
     {
-      if (updated_aor._bindings.find(binding_pair.first) !=
-          updated_aor._bindings.end())
+      Bindings::const_iterator binding = updated_aor._bindings.find(binding_id);
+
+      if (binding != updated_aor._bindings.end())
       {
-        _analytics->registration(binding_pair.second->_address_of_record,
-                                 binding_pair.first,
-                                 binding_pair.second->_uri,
-                                 binding_pair.second->_expires - now);
+        _analytics->registration(binding->second->_address_of_record,
+                                 binding_id,
+                                 binding->second->_uri,
+                                 binding->second->_expires - now);
       }
     }
   }
@@ -1195,55 +1524,91 @@ void SubscriberManager::log_subscriptions(std::string default_impu,
 }
 
 void SubscriberManager::build_patch(PatchObject& po,
+                                    SubscriberDataUtils::AoRChanges& changes,
                                     const Bindings& update_bindings,
                                     const std::vector<std::string>& remove_bindings,
                                     const std::vector<std::string>& remove_subscriptions,
                                     const AssociatedURIs& associated_uris)
 {
-  po.set_update_bindings(SubscriberDataUtils::copy_bindings(update_bindings));
-  po.set_remove_bindings(remove_bindings);
-  po.set_remove_subscriptions(remove_subscriptions);
+  build_patch(po, changes, update_bindings);
+  build_patch(po, changes, remove_bindings, remove_subscriptions);
   po.set_associated_uris(associated_uris);
-  po.set_increment_cseq(true);
 }
 
 void SubscriberManager::build_patch(PatchObject& po,
+                                    SubscriberDataUtils::AoRChanges& changes,
                                     const Bindings& update_bindings,
                                     const AssociatedURIs& associated_uris)
 {
   po.set_update_bindings(SubscriberDataUtils::copy_bindings(update_bindings));
   po.set_associated_uris(associated_uris);
+
+  for (BindingPair bp : update_bindings)
+  {
+    changes.updated_binding_ids.push_back(bp.first);
+  }
 }
 
 void SubscriberManager::build_patch(PatchObject& po,
+                                    SubscriberDataUtils::AoRChanges& changes,
+                                    const Bindings& update_bindings)
+{
+  po.set_update_bindings(SubscriberDataUtils::copy_bindings(update_bindings));
+  po.set_increment_cseq(true);
+
+  for (BindingPair bp : update_bindings)
+  {
+    changes.updated_binding_ids.push_back(bp.first);
+  }
+}
+
+void SubscriberManager::build_patch(PatchObject& po,
+                                    SubscriberDataUtils::AoRChanges& changes,
                                     const Subscriptions& update_subscriptions,
                                     const std::vector<std::string>& remove_subscriptions,
                                     const AssociatedURIs& associated_uris)
 {
-  po.set_update_subscriptions(SubscriberDataUtils::copy_subscriptions(update_subscriptions));
+  build_patch(po, changes, update_subscriptions);
   po.set_remove_subscriptions(remove_subscriptions);
   po.set_associated_uris(associated_uris);
+
+  changes.removed_subscription_ids = remove_subscriptions;
+}
+
+void SubscriberManager::build_patch(PatchObject& po,
+                                    SubscriberDataUtils::AoRChanges& changes,
+                                    const Subscriptions& update_subscriptions)
+{
+  po.set_update_subscriptions(SubscriberDataUtils::copy_subscriptions(update_subscriptions));
   po.set_increment_cseq(true);
+
+  for (SubscriptionPair sp : update_subscriptions)
+  {
+    changes.updated_subscription_ids.push_back(sp.first);
+  }
 }
 
 void SubscriberManager::build_patch(PatchObject& po,
+                                    SubscriberDataUtils::AoRChanges& changes,
                                     const std::vector<std::string>& remove_bindings,
                                     const std::vector<std::string>& remove_subscriptions,
                                     const AssociatedURIs& associated_uris)
 {
-  po.set_remove_bindings(remove_bindings);
-  po.set_remove_subscriptions(remove_subscriptions);
+  build_patch(po, changes, remove_bindings, remove_subscriptions);
   po.set_associated_uris(associated_uris);
-  po.set_increment_cseq(true);
 }
 
 void SubscriberManager::build_patch(PatchObject& po,
+                                    SubscriberDataUtils::AoRChanges& changes,
                                     const std::vector<std::string>& remove_bindings,
                                     const std::vector<std::string>& remove_subscriptions)
 {
   po.set_remove_bindings(remove_bindings);
   po.set_remove_subscriptions(remove_subscriptions);
   po.set_increment_cseq(true);
+
+  changes.removed_binding_ids = remove_bindings;
+  changes.removed_subscription_ids = remove_subscriptions;
 }
 
 void SubscriberManager::build_patch(PatchObject& po,
@@ -117,7 +117,7 @@ bool SubscriptionSproutlet::handle_request(pjsip_msg* req,
   pjsip_event_hdr* event =
            (pjsip_event_hdr*)pjsip_msg_find_hdr_by_name(req, &event_name, NULL);
 
-  if (!event || (PJUtils::pj_str_to_string(&event->event_type) != "reg"))
+  if (!event || (pj_strcmp2(&event->event_type, "reg") != 0))
   {
     // The Event header is missing or doesn't match "reg"
     TRC_DEBUG("Not processing subscribe that's not for the 'reg' package");
@@ -16,8 +16,17 @@ extern "C" {
 #include "pjsip-simple/evsub.h"
 }
 #include <arpa/inet.h>
+#include <limits.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <vector>
 #include <map>
 #include <set>
@@ -25,13 +34,12 @@ extern "C" {
 #include <queue>
 #include <string>
 
-#include <boost/regex.hpp>
-
 #include "constants.h"
 #include "eventq.h"
 #include "pjutils.h"
 #include "log.h"
 #include "sas.h"
+#include "sas_sampling.h"
 #include "saslogger.h"
 #include "sproutsasevent.h"
 #include "stack.h"
@@ -42,24 +50,108 @@ extern "C" {
 #include "connection_tracker.h"
 #include "quiescing_manager.h"
 #include "load_monitor.h"
+#include "load_report_queue.h"
 #include "counter.h"
 #include "sprout_pd_definitions.h"
 #include "exception_handler.h"
 #include "snmp_event_accumulator_table.h"
 #include "snmp_event_accumulator_by_scope_table.h"
 #include "thread_dispatcher.h"
-
-static const boost::regex EMERGENCY_SERVICES_URI = boost::regex("service.*:sos.*", boost::regex::icase);
+#include "worker_affinity_queue.h"
+#include "timer_wheel.h"
+#include "stage_latency.h"
+#include "instrumented_mutex.h"
+#include "flight_recorder.h"
+#include "dependency_monitor.h"
+#include "worker_pool_sizer.h"
+#include "udp_batch_transport.h"
+#include "cpu_affinity.h"
+#include "request_deadline.h"
+#include "metrics.h"
+#include "memory_accounting.h"
+#include "worker_watchdog.h"
+#include "snmp_shards.h"
 
 static std::vector<pj_thread_t*> worker_threads;
 
-// Queue for incoming events.
-static PriorityEventQueueBackend* sip_event_queue_backend =
-  new PriorityEventQueueBackend(); // LCOV_EXCL_LINE
+// The reserved lane, if enabled.  Emergency requests and requests with a
+// Resource-Priority are queued here rather than on the main queue, and
+// handled by their own worker threads, so they don't wait behind other
+// traffic when the main workers are saturated.
+static MultiQueueEventQueueBackend* reserved_event_queue_backend =
+  new MultiQueueEventQueueBackend(); // LCOV_EXCL_LINE
+static eventq<struct SipEvent> reserved_event_queue(0,
+                                                    true,
+                                                    reserved_event_queue_backend);
+static std::vector<pj_thread_t*> reserved_worker_threads;
+static int num_reserved_worker_threads = 0;
+
+// The worker index passed to process_queue_element by the reserved workers.
+// These don't have timer wheels, even with worker affinity.
+static const int RESERVED_WORKER_INDEX = -2;
+
+// The adaptive worker pool, if enabled.  The pool manager thread samples the
+// pool periodically, and starts workers or asks them to exit as the sizer
+// decides.  worker_pool_lock protects worker_threads and the pool manager's
+// state once the workers have started.
+static WorkerPoolSizer* worker_pool_sizer = NULL;
+static pj_pool_t* worker_pool_mem = NULL;
+static pj_thread_t* worker_pool_manager = NULL;
+static std::mutex worker_pool_lock;
+static std::condition_variable worker_pool_cond;
+static bool worker_pool_stopping = false;
+static SNMP::U32Scalar* worker_threads_scalar = NULL;
+static SNMP::U32Scalar* blocked_workers_scalar = NULL;
+
+// The CPUs the worker threads are pinned to.  Empty if they aren't pinned.
+static std::vector<int> worker_cpus;
+
+// How often the pool manager samples the pool (in milliseconds).
+static const int WORKER_POOL_SAMPLE_MS = 100;
+
+// The number of workers that are running (less any that have been asked to
+// exit), and the number that are blocked on I/O.
+static std::atomic<int> active_workers(0);
+static std::atomic<int> blocked_workers(0);
+
+// Set on a worker thread when it has been asked to exit.
+static thread_local bool tl_retire_worker = false;
+
+// Queue for incoming events.  This has one FIFO per priority level, which
+// avoids heap operations and stopwatch reads while holding the queue lock.
+static MultiQueueEventQueueBackend* sip_event_queue_backend =
+  new MultiQueueEventQueueBackend(); // LCOV_EXCL_LINE
 static eventq<struct SipEvent> sip_event_queue(0,
                                                true,
                                                sip_event_queue_backend);
 
+// Per-worker queues, used instead of sip_event_queue when worker affinity is
+// enabled.  Messages are queued to a home worker based on their Call-ID, so
+// all the transactions in a dialog are normally handled on the same worker
+// (and the same core), with idle workers stealing from busy ones.
+static WorkerAffinityQueue* worker_affinity_queue = NULL;
+
+// The worker that the next callback is queued to when worker affinity is
+// enabled.  Callbacks have no Call-ID, so are spread round-robin.
+static std::atomic<unsigned int> next_callback_worker(0);
+
+// Per-worker timer wheels, used when worker affinity is enabled.  A timer
+// scheduled on a worker pops on that worker, which waits on its queue only
+// until its next timer is due.  Each wheel has its own lock, as a timer may be
+// cancelled by a different worker (one that has stolen some work).
+struct WorkerTimers
+{
+  WorkerTimers(uint64_t now_ms) : lock("worker_timers"), wheel(now_ms) {}
+
+  InstrumentedMutex lock;
+  TimerWheel wheel;
+};
+
+static std::vector<WorkerTimers*> worker_timers;
+
+// The index of the calling worker thread, or -1 if it isn't a worker.
+static thread_local int tl_worker_index = -1;
+
 // Deadlock detection threshold for the message queue (in milliseconds).  This
 // is set to roughly twice the expected maximum service time for each message
 // (currently four seconds, allowing for four Homestead/Homer interactions
@@ -68,20 +160,72 @@ static const int MSG_Q_DEADLOCK_TIME = 4000;
 
 static int num_worker_threads = 1;
 
-static SNMP::EventAccumulatorByScopeTable* latency_table = NULL;
-static SNMP::EventAccumulatorByScopeTable* queue_size_table = NULL;
+// The statistics updated for every message are collected per thread, and
+// passed to the SNMP tables periodically.
+static SNMPShards::Accumulator<SNMP::EventAccumulatorByScopeTable>* latency_table = NULL;
+static SNMPShards::Accumulator<SNMP::EventAccumulatorByScopeTable>* queue_size_table = NULL;
 static SNMP::SuccessFailCountByPriorityAndScopeTable* queue_success_fail_table = NULL;
+static SNMPShards::Counter<SNMP::CounterTable>* worker_steals_table = NULL;
+
+// Per-stage latency tracing of the messages the dispatcher handles.  The
+// transport dispatch stage is the time the transport thread spends on each
+// message it receives, from classifying it to queuing (or rejecting) it.
+static StageHistogram* transport_receive_stage = NULL;
+static StageHistogram* transport_dispatch_stage = NULL;
+static StageHistogram* dispatcher_queue_stage = NULL;
+static StageHistogram* worker_cpu_stage = NULL;
+
+// The dispatcher queue delay broken down by what was queued and at which
+// priority, so we can see which traffic is waiting when the queue backs up.
+// Requests are classed by method, with the less common methods grouped
+// together.  The stages are created on first use, so only the combinations
+// that are actually seen are reported.
+static const char* const QUEUE_CLASS_METHODS[] =
+{
+  "INVITE", "ACK", "BYE", "CANCEL", "REGISTER", "SUBSCRIBE", "NOTIFY",
+  "OPTIONS", "PRACK", "UPDATE", "MESSAGE", "PUBLISH", "INFO", "REFER"
+};
+static const int NUM_QUEUE_CLASS_METHODS =
+  sizeof(QUEUE_CLASS_METHODS) / sizeof(QUEUE_CLASS_METHODS[0]);
+static const int QUEUE_CLASS_OTHER = NUM_QUEUE_CLASS_METHODS;
+static const int QUEUE_CLASS_RESPONSE = NUM_QUEUE_CLASS_METHODS + 1;
+static const int QUEUE_CLASS_CALLBACK = NUM_QUEUE_CLASS_METHODS + 2;
+static const int NUM_QUEUE_CLASSES = NUM_QUEUE_CLASS_METHODS + 3;
+
+static std::atomic<StageHistogram*>
+  queue_class_stages[NUM_QUEUE_CLASSES]
+                    [MultiQueueEventQueueBackend::NUM_PRIORITY_LEVELS];
+
+// When the calling worker thread last blocked on I/O, and how long it has
+// spent blocked while processing the current message.
+static thread_local StageLatency::Ticks tl_io_start = 0;
+static thread_local StageLatency::Ticks tl_io_ticks = 0;
 
 static LoadMonitor* load_monitor = NULL;
 
+// If set, worker threads queue their latency reports here rather than
+// passing them straight to the load monitor, and the transport thread passes
+// them on before each admission check.
+static LoadReportQueue* load_report_queue = NULL;
+
 static RPHService* rph_service = NULL;
 
-static SNMP::CounterByScopeTable* overload_counter = NULL;
+static SNMPShards::Counter<SNMP::CounterByScopeTable>* overload_counter = NULL;
+
+// The same statistics as latency_table and overload_counter, for scraping.
+static Metrics::Histogram* latency_metric = NULL;
+static Metrics::Counter* overload_metric = NULL;
 
 static ExceptionHandler* exception_handler = NULL;
 static unsigned long request_on_queue_timeout_us = 1;
 
+// The time allowed for processing each message, including its time on the
+// queue, or 0 for no limit.  The dependency calls made while processing the
+// message are limited to what is left.
+static unsigned long request_deadline_us = 0;
+
 static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata);
+static pj_bool_t dispatch_rx_msg(pjsip_rx_data* rdata);
 
 static pjsip_process_rdata_param pjsip_entry_point;
 
@@ -114,17 +258,100 @@ static pjsip_module mod_thread_dispatcher =
   NULL,                                 /* on_tsx_state()       */
 };
 
+static int get_queue_class(const SipEvent& qe)
+{
+  if (qe.type == CALLBACK)
+  {
+    return QUEUE_CLASS_CALLBACK;
+  }
+
+  pjsip_msg* msg = qe.event_data.rdata->msg_info.msg;
+  if (msg->type == PJSIP_RESPONSE_MSG)
+  {
+    return QUEUE_CLASS_RESPONSE;
+  }
+
+  for (int ii = 0; ii < NUM_QUEUE_CLASS_METHODS; ++ii)
+  {
+    if (pj_strcmp2(&msg->line.req.method.name, QUEUE_CLASS_METHODS[ii]) == 0)
+    {
+      return ii;
+    }
+  }
+
+  return QUEUE_CLASS_OTHER;
+}
+
+static std::string queue_class_name(int queue_class)
+{
+  if (queue_class < NUM_QUEUE_CLASS_METHODS)
+  {
+    return QUEUE_CLASS_METHODS[queue_class];
+  }
+  else if (queue_class == QUEUE_CLASS_OTHER)
+  {
+    return "other";
+  }
+  else if (queue_class == QUEUE_CLASS_RESPONSE)
+  {
+    return "response";
+  }
+
+  return "callback";
+}
+
+// Records how long an event spent on the dispatcher queue, against the
+// stage for its class and priority.
+static void record_queue_class_delay(const SipEvent& qe)
+{
+  int queue_class = get_queue_class(qe);
+  int level = std::min(std::max((int)qe.priority, 0),
+                       MultiQueueEventQueueBackend::NUM_PRIORITY_LEVELS - 1);
+
+  std::atomic<StageHistogram*>& slot = queue_class_stages[queue_class][level];
+  StageHistogram* stage = slot.load(std::memory_order_acquire);
+
+  if (stage == NULL)
+  {
+    // Threads racing to create the stage get the same histogram back, so it
+    // doesn't matter which of them stores it.
+    stage = StageLatency::stage("dispatcher_queue:" +
+                                queue_class_name(queue_class) + ":" +
+                                std::to_string(level));
+    slot.store(stage, std::memory_order_release);
+  }
+
+  StageLatency::record_since(stage, qe.queued_ticks);
+}
+
 // LCOV_EXCL_START
 static void pause_stopwatch(Utils::StopWatch& s, const std::string& reason)
 {
   TRC_DEBUG("Pausing stopwatch due to %s", reason.c_str());
   s.stop();
+  FlightRecorder::mark("io-start", reason);
+  WorkerWatchdog::set_waiting(reason);
+  tl_io_start = StageLatency::now();
+  ++blocked_workers;
 }
 
 static void resume_stopwatch(Utils::StopWatch& s, const std::string& reason)
 {
   TRC_DEBUG("Resuming stopwatch after %s", reason.c_str());
   s.start();
+  FlightRecorder::mark("io-end", reason);
+  WorkerWatchdog::clear_waiting();
+  --blocked_workers;
+
+  // Record the time blocked against a stage for this type of I/O.  Blocking
+  // I/O is slow anyway, so looking the stage up each time is fine.
+  StageLatency::Ticks io_end = StageLatency::now();
+  if (io_end > tl_io_start)
+  {
+    tl_io_ticks += io_end - tl_io_start;
+    StageLatency::stage("io:" + reason)->record(
+                           StageLatency::ticks_to_us(io_end - tl_io_start));
+  }
 }
 // LCOV_EXCL_STOP
 
@@ -156,18 +383,277 @@ static void dump_message_details(pjsip_rx_data* rdata)
   }
 }
 
-bool process_queue_element()
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+bool schedule_worker_timer(TimerWheel::Entry* entry, int duration_ms)
+{
+  if ((tl_worker_index < 0) ||
+      ((size_t)tl_worker_index >= worker_timers.size()))
+  {
+    return false;
+  }
+
+  WorkerTimers* timers = worker_timers[tl_worker_index];
+  entry->owner = tl_worker_index;
+
+  timers->lock.lock();
+  timers->wheel.schedule(entry, monotonic_ms(), duration_ms);
+  timers->lock.unlock();
+
+  return true;
+}
+
+bool cancel_worker_timer(TimerWheel::Entry* entry)
+{
+  if ((entry->owner < 0) ||
+      ((size_t)entry->owner >= worker_timers.size()))
+  {
+    return false; // LCOV_EXCL_LINE
+  }
+
+  WorkerTimers* timers = worker_timers[entry->owner];
+
+  timers->lock.lock();
+  bool cancelled = timers->wheel.cancel(entry);
+  timers->lock.unlock();
+
+  return cancelled;
+}
+
+// Pops the timers that are due on the given worker's wheel, calling their
+// callbacks on this thread.  Returns the number of milliseconds until the
+// worker next needs to check its timers, or -1 if it has none.
+static int run_worker_timers(int worker_index)
+{
+  if ((size_t)worker_index >= worker_timers.size())
+  {
+    return -1;
+  }
+
+  WorkerTimers* timers = worker_timers[worker_index];
+  std::vector<TimerWheel::Entry*> expired;
+
+  timers->lock.lock();
+  timers->wheel.advance(monotonic_ms(), expired);
+  timers->lock.unlock();
+
+  for (TimerWheel::Entry* entry : expired)
+  {
+    entry->cb(entry);
+  }
+
+  // The callbacks may have scheduled more timers.
+  timers->lock.lock();
+  uint64_t next_ms = timers->wheel.next_event_ms();
+  timers->lock.unlock();
+
+  if (next_ms == UINT64_MAX)
+  {
+    return -1;
+  }
+
+  uint64_t now_ms = monotonic_ms();
+  return (next_ms > now_ms) ? (int)std::min(next_ms - now_ms, (uint64_t)INT_MAX) : 0;
+}
+
+// Pops the next SipEvent for the given worker, blocking until one is
+// available or for at most timeout_ms milliseconds (if it isn't negative).
+// Returns false if the queue has been terminated or the pop timed out.
+static bool pop_queue_element(int worker_index,
+                              SipEvent& qe,
+                              int timeout_ms,
+                              bool& timed_out)
+{
+  bool rc;
+  timed_out = false;
+
+  if (worker_index == RESERVED_WORKER_INDEX)
+  {
+    rc = reserved_event_queue.pop(qe);
+  }
+  else if (worker_affinity_queue != NULL)
+  {
+    bool stolen = false;
+    rc = worker_affinity_queue->pop(worker_index, qe, stolen, timeout_ms, timed_out);
+
+    if ((rc) && (stolen))
+    {
+      TRC_DEBUG("Worker thread %d stole queue element", worker_index);
+
+      if (worker_steals_table)
+      {
+        worker_steals_table->increment(); // LCOV_EXCL_LINE
+      }
+    }
+  }
+  else
+  {
+    rc = sip_event_queue.pop(qe);
+  }
+
+  return rc;
+}
+
+// Pushes a SipEvent onto the queue.  If worker affinity is enabled the event
+// is queued to the given home worker.
+static void push_queue_element(const SipEvent& qe, int home_worker)
+{
+  if (worker_affinity_queue != NULL)
+  {
+    worker_affinity_queue->push(home_worker, qe);
+  }
+  else
+  {
+    sip_event_queue.push(qe);
+  }
+}
+
+// Returns an estimate of the memory used by queued SipEvents.  The messages
+// they hold are in their own pools, which are accounted separately.
+static size_t queued_event_memory()
+{
+  size_t queued = sip_event_queue.size() + reserved_event_queue.size();
+
+  if (worker_affinity_queue != NULL)
+  {
+    queued += worker_affinity_queue->size();
+  }
+
+  return queued * sizeof(SipEvent);
+}
+
+// Returns the worker that should process the given message when worker
+// affinity is enabled.  This is chosen by hashing the Call-ID, falling back to
+// the top Via branch if there is no Call-ID.
+static int get_home_worker(pjsip_rx_data* rdata)
+{
+  const pj_str_t* key = NULL;
+
+  if (rdata->msg_info.cid != NULL)
+  {
+    key = &rdata->msg_info.cid->id;
+  }
+  else if (rdata->msg_info.via != NULL)
+  {
+    key = &rdata->msg_info.via->branch_param;
+  }
+
+  pj_uint32_t hash = 0;
+
+  if (key != NULL)
+  {
+    hash = pj_hash_calc(0, key->ptr, key->slen);
+  }
+
+  return (hash % num_worker_threads);
+}
+
+// Drops a request that has been on the queue for longer than the
+// request_on_queue_timeout, rejecting it with a 503 unless it is an ACK.
+static void reject_expired_request(SipEvent& qe, unsigned long latency_us)
+{
+  pjsip_rx_data* rdata = qe.event_data.rdata;
+  SAS::TrailId trail = get_trail(rdata);
+
+  // This request is about to be dropped so increment the number of
+  // failures for items put on the queue for a worker thread.
+  if (queue_success_fail_table)
+  {
+    queue_success_fail_table->increment_failures(qe.priority); // LCOV_EXCL_LINE
+  }
+
+  if (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD)
+  {
+    // Discard non-ACK requests if the request has been on the queue for
+    // too long.
+    // Respond statelessly with a 503 Service Unavailable, including a
+    // Retry-After header with a zero length timeout.
+    TRC_DEBUG("Request has been on the queue too long (%ldus, max is %ldus)",
+              latency_us,
+              request_on_queue_timeout_us);
+
+    SAS::Marker start_marker(trail, MARKER_ID_START, 2u);
+    SAS::report_marker(start_marker);
+
+    SAS::Event event(trail, SASEvent::SIP_TOO_LONG_IN_QUEUE, 0);
+    event.add_static_param(qe.priority);
+    event.add_static_param(latency_us/1000);
+    event.add_static_param(request_on_queue_timeout_us/1000);
+    SAS::report_event(event);
+
+    SAS::Marker end_marker(trail, MARKER_ID_END, 2u);
+    SAS::report_marker(end_marker);
+
+    reject_with_retry_header(rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
+  }
+
+  pjsip_rx_data_free_cloned(rdata);
+}
+
+// Rejects the requests that have been swept off the queue because they have
+// been queued for too long.  This is called on the transport thread after
+// pushing, so that when the queue is deep the workers don't spend time
+// dequeuing requests that have already timed out.
+static void reject_swept_queue_elements()
+{
+  std::vector<SipEvent> expired;
+
+  if (worker_affinity_queue != NULL)
+  {
+    worker_affinity_queue->take_expired(expired);
+  }
+  else
+  {
+    sip_event_queue_backend->take_expired(expired);
+  }
+
+  if (!expired.empty())
+  {
+    TRC_INFO("Swept %d requests that have been queued for longer than %ldus",
+             (int)expired.size(),
+             request_on_queue_timeout_us);
+  }
+
+  for (SipEvent& qe : expired)
+  {
+    unsigned long latency_us = 0;
+    qe.stop_watch.read(latency_us);
+    reject_expired_request(qe, latency_us);
+  }
+}
+
+bool process_queue_element(int worker_index)
 {
   TRC_DEBUG("Attempting to process queue element");
   bool rc;
   SipEvent qe;
 
-  unsigned long target_latency_us = load_monitor->get_target_latency_us();
+  unsigned long target_latency_us = (load_report_queue != NULL) ?
+                                       load_report_queue->get_target_latency_us() :
+                                       load_monitor->get_target_latency_us();
+
+  // Pop any of this worker's timers that are due, and wait for the next
+  // event only until the next timer is due.
+  int timeout_ms = run_worker_timers(worker_index);
+  bool timed_out = false;
 
-  rc = sip_event_queue.pop(qe);
+  rc = pop_queue_element(worker_index, qe, timeout_ms, timed_out);
+
+  if ((!rc) && (timed_out))
+  {
+    // There was no event before a timer was due, which isn't an error.
+    return true;
+  }
 
   if (rc)
   {
+    WorkerWatchdog::busy();
+
     if (qe.type == MESSAGE)
     {
       pjsip_rx_data* rdata = qe.event_data.rdata;
@@ -179,6 +665,8 @@ bool process_queue_element()
       if (rdata)
       {
         TRC_DEBUG("Worker thread dequeue message %p", rdata);
+        StageLatency::record_since(dispatcher_queue_stage, qe.queued_ticks);
+        record_queue_class_delay(qe);
 
         unsigned long latency_us = 0;
         if (qe.stop_watch.read(latency_us))
@@ -192,39 +680,16 @@ bool process_queue_element()
 
         SAS::TrailId trail = get_trail(rdata);
 
+        // Record the steps taken to process this message, in case it is slow.
+        FlightRecorder::begin(trail);
+        FlightRecorder::mark("dequeued", latency_us);
+
         if ((latency_us > (request_on_queue_timeout_us)) &&
             (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG))
         {
-          // This request is about to be dropped so increment the number of
-          // failures for items put on the queue for a worker thread.
-          if (queue_success_fail_table)
-          {
-            queue_success_fail_table->increment_failures(qe.priority); // LCOV_EXCL_LINE
-          }
-
-          if (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD)
-          {
-            // Discard non-ACK requests if the request has been on the queue for
-            // too long.
-            // Respond statelessly with a 503 Service Unavailable, including a
-            // Retry-After header with a zero length timeout.
-            TRC_DEBUG("Request has been on the queue too long (%dus, max is %dus)");
-
-            SAS::Marker start_marker(trail, MARKER_ID_START, 2u);
-            SAS::report_marker(start_marker);
-
-            SAS::Event event(trail, SASEvent::SIP_TOO_LONG_IN_QUEUE, 0);
-            event.add_static_param(qe.priority);
-            event.add_static_param(latency_us/1000);
-            event.add_static_param(request_on_queue_timeout_us/1000);
-            SAS::report_event(event);
-
-            SAS::Marker end_marker(trail, MARKER_ID_END, 2u);
-            SAS::report_marker(end_marker);
-
-            reject_with_retry_header(rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
-            pjsip_rx_data_free_cloned(rdata);
-          }
+          FlightRecorder::mark("expired");
+          reject_expired_request(qe, latency_us);
+          FlightRecorder::end(latency_us);
         }
         else
         {
@@ -237,6 +702,13 @@ bool process_queue_element()
             queue_success_fail_table->increment_successes(qe.priority); // LCOV_EXCL_LINE
           }
 
+          // Time the processing, less any time spent blocked on I/O.  Also
+          // note when the message was queued, to time the messages sent.
+          StageLatency::Ticks worker_start = StageLatency::now();
+          tl_io_ticks = 0;
+          StageLatency::set_event_start(qe.queued_ticks);
+          RequestDeadline::Scope deadline(request_deadline_us, latency_us);
+
           CW_TRY
           {
             pjsip_endpt_process_rx_data(stack_data.endpt,
@@ -250,6 +722,7 @@ bool process_queue_element()
             // Dump details about the exception.  Be defensive about reading these
             // as we don't know much about the state we're in.
             TRC_ERROR("Hit exception handling message in worker thread. Details of probable cause follow");
+            FlightRecorder::error();
             dump_message_details(rdata);
 
             // Make a 500 response to the rdata with a retry-after header of
@@ -271,6 +744,10 @@ bool process_queue_element()
           // LCOV_EXCL_STOP
 
           TRC_DEBUG("Worker thread completed processing message %p", rdata);
+          FlightRecorder::mark("processed");
+
+          StageLatency::set_event_start(0);
+          StageLatency::record_since(worker_cpu_stage, worker_start + tl_io_ticks);
 
           unsigned long latency_us = 0;
           if (qe.stop_watch.read(latency_us))
@@ -291,11 +768,21 @@ bool process_queue_element()
             {
               latency_table->accumulate(latency_us); // LCOV_EXCL_LINE
             }
-            load_monitor->request_complete(latency_us, trail);
+            latency_metric->observe(latency_us);
+            if (load_report_queue != NULL)
+            {
+              load_report_queue->request_complete(worker_index, latency_us, trail);
+            }
+            else
+            {
+              load_monitor->request_complete(latency_us, trail);
+            }
+            FlightRecorder::end(latency_us);
           }
           else
           {
             TRC_ERROR("Failed to get done timestamp: %s", strerror(errno)); // LCOV_EXCL_LINE
+            FlightRecorder::end(0); // LCOV_EXCL_LINE
           }
 
           pjsip_rx_data_free_cloned(rdata);
@@ -318,6 +805,7 @@ bool process_queue_element()
     else
     {
       // If this is a Callback, we just run it and then delete it.
+      record_queue_class_delay(qe);
       PJUtils::Callback* cb = qe.event_data.callback;
       cb->run();
       delete cb; cb = nullptr;
@@ -330,6 +818,8 @@ bool process_queue_element()
         queue_success_fail_table->increment_successes(qe.priority); // LCOV_EXCL_LINE
       }
     }
+
+    WorkerWatchdog::idle();
   }
   else
   {
@@ -352,9 +842,25 @@ bool process_queue_element()
 // Difficult to verify threading in unit tests
 
 /// Worker threads handle most SIP message processing.
+// Pins a worker thread to the configured CPUs, if there are any.  This is
+// done before the thread allocates anything, so that its memory is local to
+// the CPUs it runs on.
+static void pin_worker_thread()
+{
+  if ((!worker_cpus.empty()) &&
+      (!CpuAffinity::pin_current_thread(worker_cpus)))
+  {
+    TRC_WARNING("Unable to pin worker thread to the configured CPUs");  // LCOV_EXCL_LINE
+  }
+}
+
 int worker_thread(void* p)
 {
-  TRC_DEBUG("Worker thread started");
+  int worker_index = (int)(intptr_t)p;
+  TRC_DEBUG("Worker thread %d started", worker_index);
+  tl_worker_index = worker_index;
+  pin_worker_thread();
+  WorkerWatchdog::register_thread("worker-" + std::to_string(worker_index));
 
   // This thread is not allowed to do IO without using the CW_IO_START and
   // CW_IO_COMPLETES macros. Doing so means that sprout's overload algorithms
@@ -363,14 +869,125 @@ int worker_thread(void* p)
 
   bool rc = true;
 
-  while (rc) {
-    rc = process_queue_element();
+  while ((rc) && (!tl_retire_worker)) {
+    rc = process_queue_element(worker_index);
   }
 
+  WorkerWatchdog::unregister_thread();
   TRC_DEBUG("Worker thread ended");
 
   return 0;
 }
+
+/// Reserved worker threads only handle requests queued on the reserved lane.
+int reserved_worker_thread(void* p)
+{
+  TRC_DEBUG("Reserved worker thread %d started", (int)(intptr_t)p);
+  pin_worker_thread();
+  WorkerWatchdog::register_thread("reserved-worker-" +
+                                  std::to_string((int)(intptr_t)p));
+
+  CW_IO_CALLS_REQUIRED();
+
+  bool rc = true;
+
+  while (rc)
+  {
+    rc = process_queue_element(RESERVED_WORKER_INDEX);
+  }
+
+  WorkerWatchdog::unregister_thread();
+  TRC_DEBUG("Reserved worker thread ended");
+
+  return 0;
+}
+
+// Callback queued to ask whichever worker runs it to exit, to shrink the
+// adaptive worker pool.
+class RetireWorkerCallback : public PJUtils::Callback
+{
+public:
+  void run()
+  {
+    tl_retire_worker = true;
+  }
+};
+
+// Starts another worker thread.  Must be called with worker_pool_lock held.
+static pj_status_t start_worker_thread()
+{
+  pj_thread_t* thread;
+  pj_status_t status = pj_thread_create(worker_pool_mem, "worker", &worker_thread,
+                                        (void*)(intptr_t)worker_threads.size(),
+                                        0, 0, &thread);
+  if (status != PJ_SUCCESS)
+  {
+    TRC_ERROR("Error creating worker thread, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    return status;
+  }
+
+  worker_threads.push_back(thread);
+  ++active_workers;
+
+  return status;
+}
+
+// Periodically resizes the adaptive worker pool.  Workers that are asked to
+// exit do so once they reach the request on the queue, so their threads are
+// only joined when all the workers are stopped.
+static int worker_pool_manager_thread(void* p)
+{
+  std::unique_lock<std::mutex> lock(worker_pool_lock);
+
+  while (!worker_pool_stopping)
+  {
+    worker_pool_cond.wait_for(lock,
+                              std::chrono::milliseconds(WORKER_POOL_SAMPLE_MS));
+    if (worker_pool_stopping)
+    {
+      break;
+    }
+
+    int workers = active_workers.load();
+    int blocked = std::max(0, blocked_workers.load());
+    int depth = sip_event_queue.size();
+    int target = worker_pool_sizer->target(workers, blocked, depth);
+
+    if (target > workers)
+    {
+      TRC_STATUS("Growing worker pool from %d to %d threads (%d blocked, %d queued)",
+                 workers, target, blocked, depth);
+
+      while ((active_workers < target) &&
+             (start_worker_thread() == PJ_SUCCESS))
+      {
+      }
+    }
+    else if (target < workers)
+    {
+      TRC_STATUS("Shrinking worker pool from %d to %d threads", workers, target);
+
+      for (int ii = target; ii < workers; ++ii)
+      {
+        add_callback_to_queue(new RetireWorkerCallback());
+        --active_workers;
+      }
+    }
+
+    if (worker_threads_scalar != NULL)
+    {
+      worker_threads_scalar->value = active_workers.load();
+    }
+
+    if (blocked_workers_scalar != NULL)
+    {
+      blocked_workers_scalar->value = blocked;
+    }
+  }
+
+  return 0;
+}
 // LCOV_EXCL_STOP
 
 enum IGNORE_LOAD_MONITOR_REASON
@@ -396,6 +1013,48 @@ static void log_ignore_load_monitor(SAS::TrailId trail,
 
 // Returns true if the SIP message should always be processed, regardless of
 // overload, and false otherwise.
+// Determines whether a request is for emergency services.  These are
+// addressed to URNs that have the format urn:service:sos[.ambulance|.fire|...].
+// We also accept 'services' rather than 'service', as this appears to be a
+// common mistake - in fact we accept anything that starts with 'service' and
+// has ':sos' after that (ignoring case), as the dispatcher always has.  This
+// runs on the transport thread for every request, so doesn't use a regex.
+static bool is_emergency_request(const pjsip_msg* msg)
+{
+  if (msg->type != PJSIP_REQUEST_MSG)
+  {
+    return false;
+  }
+
+  const pjsip_uri* req_uri = msg->line.req.uri;
+  if (!PJSIP_URI_SCHEME_IS_URN(req_uri))
+  {
+    return false;
+  }
+
+  static const char SERVICE_PREFIX[] = "service";
+  static const char SOS[] = ":sos";
+  const pj_str_t* content = &((pjsip_other_uri*)req_uri)->content;
+  const pj_ssize_t prefix_len = sizeof(SERVICE_PREFIX) - 1;
+  const pj_ssize_t sos_len = sizeof(SOS) - 1;
+
+  if ((content->slen < prefix_len + sos_len) ||
+      (strncasecmp(content->ptr, SERVICE_PREFIX, prefix_len) != 0))
+  {
+    return false;
+  }
+
+  for (pj_ssize_t ii = prefix_len; ii + sos_len <= content->slen; ++ii)
+  {
+    if (strncasecmp(content->ptr + ii, SOS, sos_len) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 static bool ignore_load_monitor(pjsip_rx_data* rdata,
                                 SIPEventPriorityLevel priority,
                                 SAS::TrailId trail)
@@ -475,24 +1134,39 @@ static bool ignore_load_monitor(pjsip_rx_data* rdata,
     return true;
   }
 
-  // Always accept messages that represent emergency services. These are URNs
-  // that have the format urn:service:sos[.ambulance|.fire|...]. We also accept
-  // 'services' rather than 'service', as this appears to be a common mistake.
-  pjsip_uri* req_uri = rdata->msg_info.msg->line.req.uri;
-  if (PJSIP_URI_SCHEME_IS_URN(req_uri))
+  // Always accept messages that represent emergency services.
+  if (is_emergency_request(rdata->msg_info.msg))
   {
-    std::string uri_str = PJUtils::pj_str_to_string(&((pjsip_other_uri*)req_uri)->content);
-    boost::match_results<std::string::const_iterator> results;
-    if (boost::regex_match(uri_str, results, EMERGENCY_SERVICES_URI))
-    {
-      log_ignore_load_monitor(trail, URN_SERVICE_SOS);
-      return true;
-    }
+    log_ignore_load_monitor(trail, URN_SERVICE_SOS);
+    return true;
   }
 
   return false;
 }
 
+// Determines whether a request should be queued on the reserved lane, that
+// is whether it is an emergency request or has a Resource-Priority that
+// gives it more than normal priority.  OPTIONS polls are also given high
+// priority, but don't need the reserved lane.
+static bool use_reserved_lane(pjsip_rx_data* rdata,
+                              SIPEventPriorityLevel priority)
+{
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  if (msg->type != PJSIP_REQUEST_MSG)
+  {
+    return false;
+  }
+
+  if (is_emergency_request(msg))
+  {
+    return true;
+  }
+
+  return ((priority > SIPEventPriorityLevel::NORMAL_PRIORITY) &&
+          (msg->line.req.method.id != PJSIP_OPTIONS_METHOD));
+}
+
 // Determines the priority value of a SIP message based on its method.
 static SIPEventPriorityLevel get_rx_msg_priority(pjsip_rx_data* rdata,
                                                  SAS::TrailId trail)
@@ -511,6 +1185,55 @@ static SIPEventPriorityLevel get_rx_msg_priority(pjsip_rx_data* rdata,
   return PJUtils::get_priority_of_message(rdata->msg_info.msg, rph_service, trail);
 }
 
+// Determines which downstream dependencies processing a SIP message is
+// likely to need.  This is a cheap estimate from the request line and top
+// Route header - it doesn't need to be exact, just good enough that requests
+// which don't need an overloaded dependency aren't shed on its behalf.
+static DependencyMonitor::Dependencies get_rx_msg_dependencies(pjsip_rx_data* rdata)
+{
+  DependencyMonitor::Dependencies dependencies = 0;
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  // Responses and in-dialog requests are routed on state we already hold.
+  if ((msg->type != PJSIP_REQUEST_MSG) ||
+      (rdata->msg_info.to->tag.slen != 0))
+  {
+    return dependencies;
+  }
+
+  // Initial requests need the subscriber's service profile from Homestead.
+  dependencies |= DependencyMonitor::mask(DependencyMonitor::HSS);
+
+  // Terminating requests look up the target's bindings in the store.
+  pjsip_route_hdr* top_route =
+    (pjsip_route_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_ROUTE, NULL);
+  if ((top_route == NULL) ||
+      (!PJSIP_URI_SCHEME_IS_SIP(top_route->name_addr.uri)) ||
+      (pjsip_param_find(&((pjsip_sip_uri*)top_route->name_addr.uri)->other_param,
+                        &STR_ORIG) == NULL))
+  {
+    dependencies |= DependencyMonitor::mask(DependencyMonitor::STORE);
+  }
+
+  // Telephone numbers are translated with ENUM.
+  pjsip_uri* req_uri = msg->line.req.uri;
+  if ((PJSIP_URI_SCHEME_IS_TEL(req_uri)) ||
+      ((PJSIP_URI_SCHEME_IS_SIP(req_uri)) &&
+       (!pj_strcmp(&((pjsip_sip_uri*)req_uri)->user_param, &STR_USER_PHONE))))
+  {
+    dependencies |= DependencyMonitor::mask(DependencyMonitor::ENUM);
+  }
+
+  // Calls and messages run MMTEL services, which need the XDMS.
+  if ((msg->line.req.method.id == PJSIP_INVITE_METHOD) ||
+      (pj_strcmp2(&msg->line.req.method.name, "MESSAGE") == 0))
+  {
+    dependencies |= DependencyMonitor::mask(DependencyMonitor::XDMS);
+  }
+
+  return dependencies;
+}
+
 static pj_status_t reject_with_retry_header(pjsip_rx_data* rdata,
                                             pjsip_status_code code)
 {
@@ -530,6 +1253,9 @@ static void reject_rx_msg_overload(pjsip_rx_data* rdata, SAS::TrailId trail)
   // Retry-After header with a zero length timeout.
   TRC_VERBOSE("Rejected request due to overload");
 
+  // Cut back on detailed SAS logging while overloaded.
+  SASSampling::report_overload();
+
   SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
   SAS::report_marker(start_marker);
 
@@ -561,31 +1287,65 @@ static void reject_rx_msg_overload(pjsip_rx_data* rdata, SAS::TrailId trail)
   {
     overload_counter->increment(); // LCOV_EXCL_LINE
   }
+  overload_metric->increment();
 }
 
 static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
+{
+  // Time the work done on the transport thread for this message.  Every
+  // message the transport thread reads waits behind this, so it's the budget
+  // to watch for.
+  StageLatency::Ticks start = StageLatency::now();
+  pj_bool_t rc = dispatch_rx_msg(rdata);
+  StageLatency::record_since(transport_dispatch_stage, start);
+  return rc;
+}
+
+static pj_bool_t dispatch_rx_msg(pjsip_rx_data* rdata)
 {
   TRC_DEBUG("Received message %p", rdata);
   SAS::TrailId trail = get_trail(rdata);
 
   // SAS log the start of processing by this module
-  SAS::Event event(trail, SASEvent::BEGIN_THREAD_DISPATCHER, 0);
-  SAS::report_event(event);
+  if (SASSampling::detail_enabled(trail))
+  {
+    SAS::Event event(trail, SASEvent::BEGIN_THREAD_DISPATCHER, 0);
+    SAS::report_event(event);
+  }
 
   SIPEventPriorityLevel priority = get_rx_msg_priority(rdata, trail);
 
   // Check whether the request should be rejected due to overload
   bool admit_anyway = ignore_load_monitor(rdata, priority, trail);
+  if (load_report_queue != NULL)
+  {
+    load_report_queue->flush();
+  }
+
   if (!(load_monitor->admit_request(trail, admit_anyway)))
   {
     reject_rx_msg_overload(rdata, trail);
     return PJ_TRUE;
   }
 
+  // Check whether the request needs a dependency that is overloaded.
+  if ((!admit_anyway) &&
+      (stack_data.dependency_monitor != NULL) &&
+      (!stack_data.dependency_monitor->admit(get_rx_msg_dependencies(rdata))))
+  {
+    reject_rx_msg_overload(rdata, trail);
+    return PJ_TRUE;
+  }
+
   TRC_DEBUG("Admitted request %p", rdata);
 
   // Check that the worker threads are not all deadlocked.
-  if (sip_event_queue.is_deadlocked())
+  bool deadlocked = ((worker_affinity_queue != NULL) ?
+                       worker_affinity_queue->is_deadlocked() :
+                       sip_event_queue.is_deadlocked()) ||
+                    ((num_reserved_worker_threads > 0) &&
+                     (reserved_event_queue.is_deadlocked()));
+  if (deadlocked)
   {
     // LCOV_EXCL_START
     // The queue has not been serviced for sufficiently long to imply that
@@ -601,23 +1361,46 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
   // receiving a message to forwarding it on (or rejecting it).
   SipEvent qe;
   qe.stop_watch.start();
+  qe.queued_ticks = StageLatency::now();
+
+  if (transport_receive_stage != NULL)
+  {
+    // PJSIP timestamps messages as it reads them, though only to the
+    // millisecond.
+    pj_time_val now;
+    pj_gettimeofday(&now);
+    PJ_TIME_VAL_SUB(now, rdata->pkt_info.timestamp);
+    long receive_ms = PJ_TIME_VAL_MSEC(now);
+    transport_receive_stage->record((receive_ms > 0) ? receive_ms * 1000 : 0);
+  }
 
-  // Clone the message and queue it to a scheduler thread.
-  pjsip_rx_data* clone_rdata;
-  pj_status_t status = pjsip_rx_data_clone(rdata, 0, &clone_rdata);
+  // Take the message from the transport if it was received by a batched UDP
+  // transport, which saves copying it.  Otherwise clone it.  Either way, the
+  // result is freed as a clone once the message has been processed, and is
+  // queued to a scheduler thread.
+  pjsip_rx_data* clone_rdata = udp_batch_take_rdata(rdata);
 
-  if (status != PJ_SUCCESS)
+  if (clone_rdata != NULL)
   {
-    // LCOV_EXCL_START
-    // Failed to clone the message, so drop it.
-    TRC_ERROR("Failed to clone incoming message (%s)",
-              PJUtils::pj_status_to_string(status).c_str());
-    return PJ_TRUE;
-    // LCOV_EXCL_STOP
+    TRC_DEBUG("Incoming message %p taken from transport as %p", rdata, clone_rdata);
   }
   else
   {
-    TRC_DEBUG("Incoming message %p cloned to %p", rdata, clone_rdata);
+    pj_status_t status = pjsip_rx_data_clone(rdata, 0, &clone_rdata);
+
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      // Failed to clone the message, so drop it.
+      TRC_ERROR("Failed to clone incoming message (%s)",
+                PJUtils::pj_status_to_string(status).c_str());
+      return PJ_TRUE;
+      // LCOV_EXCL_STOP
+    }
+    else
+    {
+      TRC_DEBUG("Incoming message %p cloned to %p", rdata, clone_rdata);
+    }
   }
 
   // Make sure the trail identifier is passed across.
@@ -637,21 +1420,49 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
   qe.priority = priority;
   TRC_DEBUG("Queuing cloned received message %p for worker threads with priority %d",
             clone_rdata, qe.priority);
-  SAS::Event priority_event(trail, SASEvent::THREAD_DISPATCHER_SET_PRIORITY_LEVEL, 0);
-  priority_event.add_static_param(qe.priority);
-  SAS::report_event(priority_event);
+  if (SASSampling::detail_enabled(trail))
+  {
+    SAS::Event priority_event(trail, SASEvent::THREAD_DISPATCHER_SET_PRIORITY_LEVEL, 0);
+    priority_event.add_static_param(qe.priority);
+    SAS::report_event(priority_event);
+  }
+
+  // Track the current queue size.  If worker affinity is enabled this is the
+  // depth of the home worker's queue.
+  int home_worker = 0;
+
+  if (worker_affinity_queue != NULL)
+  {
+    home_worker = get_home_worker(clone_rdata);
+    TRC_DEBUG("Home worker for message %p is %d", clone_rdata, home_worker);
+  }
 
-  // Track the current queue size
   if (queue_size_table)
   {
-    queue_size_table->accumulate(sip_event_queue.size()); // LCOV_EXCL_LINE
+    // LCOV_EXCL_START
+    int queue_size = (worker_affinity_queue != NULL) ?
+                       worker_affinity_queue->size(home_worker) :
+                       sip_event_queue.size();
+    queue_size_table->accumulate(queue_size);
+    // LCOV_EXCL_STOP
   }
   // Increment the number of items put on the queue for a worker thread.
   if (queue_success_fail_table)
   {
     queue_success_fail_table->increment_attempts(qe.priority); // LCOV_EXCL_LINE
   }
-  sip_event_queue.push(qe);
+
+  if ((num_reserved_worker_threads > 0) &&
+      (use_reserved_lane(clone_rdata, priority)))
+  {
+    TRC_DEBUG("Queuing message %p on the reserved lane", clone_rdata);
+    reserved_event_queue.push(qe);
+  }
+  else
+  {
+    push_queue_element(qe, home_worker);
+  }
+  reject_swept_queue_elements();
 
   // return TRUE to flag that we have absorbed the incoming message.
   return PJ_TRUE;
@@ -665,24 +1476,150 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    LoadMonitor* load_monitor_arg,
                                    RPHService* rph_service_arg,
                                    ExceptionHandler* exception_handler_arg,
-                                   unsigned long request_on_queue_timeout_ms_arg)
+                                   unsigned long request_on_queue_timeout_ms_arg,
+                                   bool worker_affinity_arg,
+                                   SNMP::CounterTable* worker_steals_table_arg,
+                                   int max_worker_threads_arg,
+                                   SNMP::U32Scalar* worker_threads_scalar_arg,
+                                   SNMP::U32Scalar* blocked_workers_scalar_arg,
+                                   int reserved_worker_threads_arg,
+                                   const std::vector<int>& worker_cpus_arg,
+                                   unsigned long request_deadline_ms_arg,
+                                   bool defer_load_reports_arg)
 {
-  // Set up the vectors of threads.  The threads don't get created until
-  // start_worker_threads is called.
-  worker_threads.resize(num_worker_threads_arg);
+  // The threads don't get created until start_worker_threads is called.
+  worker_threads.clear();
+  reserved_worker_threads.clear();
+
+  num_reserved_worker_threads = std::max(reserved_worker_threads_arg, 0);
+  if (num_reserved_worker_threads > 0)
+  {
+    TRC_STATUS("%d worker threads reserved for emergency and priority requests",
+               num_reserved_worker_threads);
+    reserved_event_queue.set_deadlock_threshold(MSG_Q_DEADLOCK_TIME);
+  }
+
+  worker_cpus = worker_cpus_arg;
+  if (!worker_cpus.empty())
+  {
+    TRC_STATUS("Worker threads pinned to %d CPUs", (int)worker_cpus.size());
+  }
+
+  delete worker_pool_sizer; worker_pool_sizer = NULL;
+
+  if (max_worker_threads_arg > num_worker_threads_arg)
+  {
+    if (worker_affinity_arg)
+    {
+      // Each worker has its own queue, so the number of workers is fixed.
+      TRC_WARNING("Adaptive worker pool isn't supported with worker affinity - using %d worker threads",
+                  num_worker_threads_arg);
+    }
+    else
+    {
+      TRC_STATUS("Adaptive worker pool enabled with %d to %d worker threads",
+                 num_worker_threads_arg,
+                 max_worker_threads_arg);
+      worker_pool_sizer = new WorkerPoolSizer(num_worker_threads_arg,
+                                              max_worker_threads_arg,
+                                              worker_cpus.empty() ?
+                                                (int)sysconf(_SC_NPROCESSORS_ONLN) :
+                                                (int)worker_cpus.size());
+    }
+  }
+
+  worker_threads_scalar = worker_threads_scalar_arg;
+  blocked_workers_scalar = blocked_workers_scalar_arg;
 
   // Enable deadlock detection on the message queue.
   sip_event_queue.set_deadlock_threshold(MSG_Q_DEADLOCK_TIME);
 
+  // The queue memory sampler uses worker_affinity_queue, so is replaced
+  // once it has been recreated.
+  MemoryAccounting::Account* queue_memory_account =
+    MemoryAccounting::account("dispatcher_queue");
+  queue_memory_account->set_sampler(nullptr);
+  delete worker_affinity_queue; worker_affinity_queue = NULL;
+
+  for (WorkerTimers* timers : worker_timers)
+  {
+    delete timers;
+  }
+  worker_timers.clear();
+
+  if (worker_affinity_arg)
+  {
+    TRC_STATUS("Worker affinity enabled for %d worker threads",
+               num_worker_threads_arg);
+    worker_affinity_queue = new WorkerAffinityQueue(num_worker_threads_arg);
+    worker_affinity_queue->set_deadlock_threshold(MSG_Q_DEADLOCK_TIME);
+
+    for (int ii = 0; ii < num_worker_threads_arg; ++ii)
+    {
+      worker_timers.push_back(new WorkerTimers(monotonic_ms()));
+    }
+  }
+
+  queue_memory_account->set_sampler(&queued_event_memory);
+
   num_worker_threads = num_worker_threads_arg;
-  latency_table = latency_table_arg;
-  queue_size_table = queue_size_table_arg;
+  delete latency_table;
+  latency_table = (latency_table_arg != NULL) ?
+    new SNMPShards::Accumulator<SNMP::EventAccumulatorByScopeTable>(latency_table_arg) :
+    NULL;
+  delete queue_size_table;
+  queue_size_table = (queue_size_table_arg != NULL) ?
+    new SNMPShards::Accumulator<SNMP::EventAccumulatorByScopeTable>(queue_size_table_arg) :
+    NULL;
   queue_success_fail_table = queue_success_fail_table_arg;
+  delete worker_steals_table;
+  worker_steals_table = (worker_steals_table_arg != NULL) ?
+    new SNMPShards::Counter<SNMP::CounterTable>(worker_steals_table_arg) :
+    NULL;
   load_monitor = load_monitor_arg;
+
+  delete load_report_queue; load_report_queue = NULL;
+
+  if (defer_load_reports_arg)
+  {
+    // Each worker thread that could exist gets its own queue.
+    TRC_STATUS("Deferring worker threads' latency reports to the load monitor");
+    load_report_queue = new LoadReportQueue(load_monitor_arg,
+                                            std::max(num_worker_threads_arg,
+                                                     max_worker_threads_arg));
+  }
+
   rph_service = rph_service_arg;
-  overload_counter = overload_counter_arg;
+  delete overload_counter;
+  overload_counter = (overload_counter_arg != NULL) ?
+    new SNMPShards::Counter<SNMP::CounterByScopeTable>(overload_counter_arg) :
+    NULL;
   exception_handler = exception_handler_arg;
   request_on_queue_timeout_us = request_on_queue_timeout_ms_arg * 1000;
+  request_deadline_us = request_deadline_ms_arg * 1000;
+
+  // Sweep requests that have already been queued for too long off the queue
+  // when it gets deep.
+  if (worker_affinity_queue != NULL)
+  {
+    worker_affinity_queue->set_expiry_sweep(EXPIRY_SWEEP_QUEUE_DEPTH,
+                                            request_on_queue_timeout_us);
+  }
+  else
+  {
+    sip_event_queue_backend->set_expiry_sweep(EXPIRY_SWEEP_QUEUE_DEPTH,
+                                              request_on_queue_timeout_us);
+  }
+
+  transport_receive_stage = StageLatency::stage("transport_receive");
+  transport_dispatch_stage = StageLatency::stage("transport_dispatch");
+  dispatcher_queue_stage = StageLatency::stage("dispatcher_queue");
+  worker_cpu_stage = StageLatency::stage("worker_cpu");
+
+  latency_metric = Metrics::histogram("sprout_sip_request_latency_seconds",
+                                      "Time from receiving a SIP request to finishing processing it");
+  overload_metric = Metrics::counter("sprout_sip_requests_rejected_overload",
+                                     "SIP requests rejected because of overload");
 
   // Register the PJSIP module.
   pjsip_endpt_register_module(stack_data.endpt, &mod_thread_dispatcher);
@@ -694,6 +1631,52 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
   return PJ_SUCCESS;
 }
 
+int MultiQueueEventQueueBackend::remove_expired(unsigned long max_age_us,
+                                                std::vector<SipEvent>& expired)
+{
+  int removed = 0;
+  int top = std::min(priority_to_level(SIPEventPriorityLevel::NORMAL_PRIORITY),
+                     _highest);
+
+  for (int level = 0; level <= top; ++level)
+  {
+    std::deque<SipEvent>& queue = _queues[level];
+
+    // Find the end of the run of expired events at the front of the queue.
+    std::deque<SipEvent>::iterator end = queue.begin();
+    unsigned long age_us = 0;
+    while ((end != queue.end()) &&
+           (end->stop_watch.read(age_us)) &&
+           (age_us > max_age_us))
+    {
+      ++end;
+    }
+
+    // Keep any callbacks and responses in the run, in order, and remove the
+    // requests.
+    std::deque<SipEvent>::iterator keep_end =
+      std::stable_partition(queue.begin(), end, [](const SipEvent& event)
+      {
+        return ((event.type != MESSAGE) ||
+                (event.event_data.rdata == NULL) ||
+                (event.event_data.rdata->msg_info.msg->type != PJSIP_REQUEST_MSG));
+      });
+
+    expired.insert(expired.end(), keep_end, end);
+    removed += (end - keep_end);
+    queue.erase(keep_end, end);
+  }
+
+  _size -= removed;
+
+  while ((_highest > 0) && (_queues[_highest].empty()))
+  {
+    --_highest;
+  }
+
+  return removed;
+}
+
 pjsip_module* get_mod_thread_dispatcher()
 {
   return &mod_thread_dispatcher;
@@ -705,18 +1688,49 @@ pj_status_t start_worker_threads()
 {
   pj_status_t status = PJ_SUCCESS;
 
-  for (size_t ii = 0; ii < worker_threads.size(); ++ii)
+  std::unique_lock<std::mutex> lock(worker_pool_lock);
+
+  // Worker threads may be started later on by the pool manager, so they
+  // are allocated from their own pool rather than the shared stack pool.
+  worker_pool_mem = pj_pool_create(&stack_data.cp.factory, "workers", 1024, 1024, NULL);
+  worker_pool_stopping = false;
+
+  for (int ii = 0; ii < num_worker_threads; ++ii)
+  {
+    status = start_worker_thread();
+    if (status != PJ_SUCCESS)
+    {
+      return 1;
+    }
+  }
+
+  for (int ii = 0; ii < num_reserved_worker_threads; ++ii)
   {
     pj_thread_t* thread;
-    status = pj_thread_create(stack_data.pool, "worker", &worker_thread,
-                              NULL, 0, 0, &thread);
+    status = pj_thread_create(worker_pool_mem, "reserved",
+                              &reserved_worker_thread, (void*)(intptr_t)ii,
+                              0, 0, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Error creating reserved worker thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      return 1;
+    }
+
+    reserved_worker_threads.push_back(thread);
+  }
+
+  if (worker_pool_sizer != NULL)
+  {
+    status = pj_thread_create(worker_pool_mem, "workerpool",
+                              &worker_pool_manager_thread, NULL, 0, 0,
+                              &worker_pool_manager);
     if (status != PJ_SUCCESS)
     {
-      TRC_ERROR("Error creating worker thread, %s",
+      TRC_ERROR("Error creating worker pool manager thread, %s",
                 PJUtils::pj_status_to_string(status).c_str());
       return 1;
     }
-    worker_threads[ii] = thread;
   }
 
   TRC_DEBUG("Worker threads started");
@@ -728,12 +1742,39 @@ pj_status_t start_worker_threads()
 // Difficult to verify threading in unit tests
 void stop_worker_threads()
 {
+  // Stop the pool manager first, so that it doesn't start any more workers.
+  if (worker_pool_manager != NULL)
+  {
+    {
+      std::unique_lock<std::mutex> lock(worker_pool_lock);
+      worker_pool_stopping = true;
+      worker_pool_cond.notify_all();
+    }
+
+    pj_thread_join(worker_pool_manager);
+    worker_pool_manager = NULL;
+  }
+
   // Now it is safe to signal the worker threads to exit via the queue and to
   // wait for them to terminate.
 
   // Terminate the queue and delete all elements remaining on it
   std::vector<SipEvent> remaining_elts;
-  sip_event_queue.terminate(remaining_elts);
+  if (worker_affinity_queue != NULL)
+  {
+    worker_affinity_queue->terminate(remaining_elts);
+  }
+  else
+  {
+    sip_event_queue.terminate(remaining_elts);
+    sip_event_queue_backend->take_expired(remaining_elts);
+  }
+
+  std::vector<SipEvent> remaining_reserved_elts;
+  reserved_event_queue.terminate(remaining_reserved_elts);
+  remaining_elts.insert(remaining_elts.end(),
+                        remaining_reserved_elts.begin(),
+                        remaining_reserved_elts.end());
   for (std::vector<SipEvent>::iterator qe = remaining_elts.begin();
        qe != remaining_elts.end();
        ++qe)
@@ -763,6 +1804,31 @@ void stop_worker_threads()
     pj_thread_join(*i);
   }
   worker_threads.clear();
+
+  for (pj_thread_t* thread : reserved_worker_threads)
+  {
+    pj_thread_join(thread);
+  }
+  reserved_worker_threads.clear();
+  active_workers = 0;
+
+  if (worker_pool_mem != NULL)
+  {
+    pj_pool_release(worker_pool_mem);
+    worker_pool_mem = NULL;
+  }
+
+  MemoryAccounting::account("dispatcher_queue")->set_sampler(nullptr);
+  delete worker_affinity_queue; worker_affinity_queue = NULL;
+
+  // Any timers still scheduled are owned by transactions that are never going
+  // to complete now, so are just dropped.
+  for (WorkerTimers* timers : worker_timers)
+  {
+    delete timers;
+  }
+  worker_timers.clear();
+
   TRC_DEBUG("Worker threads stopped");
 }
 //LCOV_EXCL_STOP
@@ -770,6 +1836,13 @@ void stop_worker_threads()
 void unregister_thread_dispatcher(void)
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_thread_dispatcher);
+
+  // Pass any statistics not yet flushed to the tables, which the caller
+  // is about to delete.
+  delete latency_table; latency_table = NULL;
+  delete queue_size_table; queue_size_table = NULL;
+  delete worker_steals_table; worker_steals_table = NULL;
+  delete overload_counter; overload_counter = NULL;
 }
 
 void add_callback_to_queue(PJUtils::Callback* cb)
@@ -781,6 +1854,7 @@ void add_callback_to_queue(PJUtils::Callback* cb)
   // This maintains the previous behaviour with respect to callbacks, but in
   // future we may want to look at prioritizing them
   qe.priority = SIPEventPriorityLevel::NORMAL_PRIORITY;
+  qe.queued_ticks = StageLatency::now();
 
   // We don't bother tracking the queue size in queue_size_table here, because
   // the size is tracked whenever the transport thread adds an item to the
@@ -798,5 +1872,10 @@ void add_callback_to_queue(PJUtils::Callback* cb)
   TRC_DEBUG("Queuing callback %p for worker threads with priority %d",
             cb,
             qe.priority);
-  sip_event_queue.push(qe);
+  int home_worker = 0;
+  if (worker_affinity_queue != NULL)
+  {
+    home_worker = next_callback_worker++ % worker_affinity_queue->num_workers();
+  }
+  push_queue_element(qe, home_worker);
 }
@@ -0,0 +1,210 @@
+/**
+ * @file timer_wheel.cpp Implementation of TimerWheel
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+void TimerWheel::init_entry(Entry* entry, void (*cb)(Entry*), void* user_data)
+{
+  memset(entry, 0, sizeof(*entry));
+  entry->cb = cb;
+  entry->user_data = user_data;
+  entry->owner = -1;
+}
+
+TimerWheel::TimerWheel(uint64_t now_ms) :
+  _now_ms(now_ms),
+  _size(0)
+{
+  memset(_slots, 0, sizeof(_slots));
+  memset(_occupied, 0, sizeof(_occupied));
+}
+
+void TimerWheel::schedule(Entry* entry, uint64_t now_ms, uint64_t duration_ms)
+{
+  // The slot for the current time has already been processed, so a timer
+  // can pop on the next millisecond at the earliest.
+  entry->expiry_ms = now_ms + duration_ms;
+  if (entry->expiry_ms <= _now_ms)
+  {
+    entry->expiry_ms = _now_ms + 1;
+  }
+
+  insert(entry);
+  entry->scheduled = true;
+  ++_size;
+}
+
+bool TimerWheel::cancel(Entry* entry)
+{
+  if (!entry->scheduled)
+  {
+    return false;
+  }
+
+  unlink(entry);
+  entry->scheduled = false;
+  --_size;
+  return true;
+}
+
+void TimerWheel::advance(uint64_t now_ms, std::vector<Entry*>& expired)
+{
+  while (_size > 0)
+  {
+    uint64_t next_ms = next_event_ms();
+    if (next_ms > now_ms)
+    {
+      break;
+    }
+
+    // Nothing happens between the current time and the next event, so jump
+    // straight to it.  First move down the timers in any higher level slot
+    // that starts now, then pop the timers in the lowest level slot.
+    _now_ms = next_ms;
+
+    for (int level = 1; level < LEVELS; ++level)
+    {
+      int shift = level * SLOT_BITS;
+      if ((_now_ms & ((1ull << shift) - 1)) != 0)
+      {
+        break;
+      }
+
+      cascade(level, (_now_ms >> shift) & SLOT_MASK);
+    }
+
+    int slot = _now_ms & SLOT_MASK;
+    Entry* entry = _slots[0][slot];
+    _slots[0][slot] = NULL;
+    _occupied[0] &= ~(1ull << slot);
+
+    while (entry != NULL)
+    {
+      Entry* next = entry->next;
+      entry->prev = NULL;
+      entry->next = NULL;
+      entry->scheduled = false;
+      --_size;
+      expired.push_back(entry);
+      entry = next;
+    }
+  }
+
+  if (now_ms > _now_ms)
+  {
+    _now_ms = now_ms;
+  }
+}
+
+uint64_t TimerWheel::next_event_ms() const
+{
+  uint64_t next_ms = UINT64_MAX;
+
+  for (int level = 0; level < LEVELS; ++level)
+  {
+    uint64_t occupied = _occupied[level];
+    if (occupied == 0)
+    {
+      continue;
+    }
+
+    // Find the first occupied slot after the current one, wrapping round to
+    // the next rotation of the level if there isn't one.
+    int shift = level * SLOT_BITS;
+    uint64_t base = _now_ms >> shift;
+    uint64_t index = base & SLOT_MASK;
+    uint64_t later = (index == SLOT_MASK) ? 0 : (occupied & (~0ull << (index + 1)));
+    uint64_t block = (later != 0) ?
+                       (base - index + __builtin_ctzll(later)) :
+                       (base - index + SLOTS + __builtin_ctzll(occupied));
+
+    if ((block << shift) < next_ms)
+    {
+      next_ms = block << shift;
+    }
+  }
+
+  return next_ms;
+}
+
+void TimerWheel::insert(Entry* entry)
+{
+  uint64_t expiry_ms = (entry->expiry_ms > _now_ms) ? entry->expiry_ms : _now_ms;
+  uint64_t delta = expiry_ms - _now_ms;
+
+  if (delta > MAX_DELTA)
+  {
+    // Park the timer in the furthest slot.  It will be put back in the right
+    // place when that slot is reached.
+    expiry_ms = _now_ms + MAX_DELTA;
+    delta = MAX_DELTA;
+  }
+
+  int level = 0;
+  while ((level < LEVELS - 1) &&
+         (delta >= (1ull << ((level + 1) * SLOT_BITS))))
+  {
+    ++level;
+  }
+
+  int slot = (expiry_ms >> (level * SLOT_BITS)) & SLOT_MASK;
+
+  entry->level = level;
+  entry->slot = slot;
+  entry->prev = NULL;
+  entry->next = _slots[level][slot];
+  if (entry->next != NULL)
+  {
+    entry->next->prev = entry;
+  }
+  _slots[level][slot] = entry;
+  _occupied[level] |= (1ull << slot);
+}
+
+void TimerWheel::unlink(Entry* entry)
+{
+  if (entry->prev != NULL)
+  {
+    entry->prev->next = entry->next;
+  }
+  else
+  {
+    _slots[entry->level][entry->slot] = entry->next;
+    if (entry->next == NULL)
+    {
+      _occupied[entry->level] &= ~(1ull << entry->slot);
+    }
+  }
+
+  if (entry->next != NULL)
+  {
+    entry->next->prev = entry->prev;
+  }
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+  Entry* entry = _slots[level][slot];
+  _slots[level][slot] = NULL;
+  _occupied[level] &= ~(1ull << slot);
+
+  while (entry != NULL)
+  {
+    Entry* next = entry->next;
+    insert(entry);
+    entry = next;
+  }
+}
@@ -0,0 +1,157 @@
+/**
+ * @file tsx_arena.cpp Implementation of TsxArena
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+#include "tsx_arena.h"
+
+static thread_local TsxArena* tl_current_arena = NULL;
+
+// Each object allocated by TsxArenaAllocated is preceded by a header recording
+// the arena it came from, or NULL if it came from the heap.  The header is a
+// whole alignment unit so the object stays aligned.
+static const size_t HEADER_SIZE = TsxArena::ALIGNMENT;
+
+static size_t round_up(size_t size)
+{
+  return (size + TsxArena::ALIGNMENT - 1) & ~(TsxArena::ALIGNMENT - 1);
+}
+
+TsxArena::TsxArena() :
+  _blocks(),
+  _next(_first_block),
+  _end(_first_block + BLOCK_SIZE),
+  _bytes_allocated(0),
+  _allocations(0),
+  _refs(OWNER_REFS)
+{
+}
+
+TsxArena::~TsxArena()
+{
+  for (char* block : _blocks)
+  {
+    free(block);
+  }
+}
+
+void TsxArena::release()
+{
+  // Swap the owner's references for one per allocation.
+  drop_refs(OWNER_REFS - _allocations);
+}
+
+void* TsxArena::allocate(size_t size)
+{
+  size = round_up(size);
+  char* ptr;
+
+  if (size >= MAX_SHARED_ALLOCATION)
+  {
+    ptr = (char*)aligned_alloc(ALIGNMENT, size);
+    if (ptr == NULL)
+    {
+      throw std::bad_alloc(); // LCOV_EXCL_LINE
+    }
+    _blocks.push_back(ptr);
+  }
+  else
+  {
+    if (_next + size > _end)
+    {
+      // Start a new block.  Whatever is left of the old one is wasted, but
+      // that's always less than the largest shared allocation.
+      char* block = (char*)aligned_alloc(ALIGNMENT, BLOCK_SIZE);
+      if (block == NULL)
+      {
+        throw std::bad_alloc(); // LCOV_EXCL_LINE
+      }
+      _blocks.push_back(block);
+      _next = block;
+      _end = block + BLOCK_SIZE;
+    }
+
+    ptr = _next;
+    _next += size;
+  }
+
+  _bytes_allocated += size;
+  ++_allocations;
+  return ptr;
+}
+
+void TsxArena::drop_refs(long refs)
+{
+  if (_refs.fetch_sub(refs) == refs)
+  {
+    delete this;
+  }
+}
+
+TsxArena* TsxArena::current()
+{
+  return tl_current_arena;
+}
+
+TsxArena::Scope::Scope(TsxArena* arena) :
+  _prev(tl_current_arena)
+{
+  tl_current_arena = arena;
+}
+
+TsxArena::Scope::~Scope()
+{
+  tl_current_arena = _prev;
+}
+
+void* TsxArenaAllocated::operator new(size_t size)
+{
+  TsxArena* arena = TsxArena::current();
+  char* ptr;
+
+  if (arena != NULL)
+  {
+    ptr = (char*)arena->allocate(HEADER_SIZE + size);
+  }
+  else
+  {
+    ptr = (char*)malloc(HEADER_SIZE + size);
+    if (ptr == NULL)
+    {
+      throw std::bad_alloc(); // LCOV_EXCL_LINE
+    }
+  }
+
+  *(TsxArena**)ptr = arena;
+  return ptr + HEADER_SIZE;
+}
+
+void TsxArenaAllocated::operator delete(void* ptr)
+{
+  if (ptr == NULL)
+  {
+    return;
+  }
+
+  char* start = (char*)ptr - HEADER_SIZE;
+  TsxArena* arena = *(TsxArena**)start;
+
+  if (arena != NULL)
+  {
+    arena->deallocate();
+  }
+  else
+  {
+    free(start);
+  }
+}
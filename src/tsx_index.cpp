@@ -0,0 +1,134 @@
+/**
+ * @file tsx_index.cpp Sharded index of the proxies' PJSIP transactions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <ctype.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "tsx_index.h"
+
+namespace TsxIndex
+{
+  // Padded so that each shard's lock is on its own cache line.
+  struct Shard
+  {
+    std::mutex lock;
+    std::unordered_map<std::string, pjsip_transaction*> tsxs;
+    char pad[64];
+  };
+
+  // The shards last for the life of the process, so that transactions can be
+  // unbound during shutdown.
+  static Shard* shards()
+  {
+    static Shard* shards = new Shard[NUM_SHARDS];
+    return shards;
+  }
+
+  // PJSIP matches transaction keys case-insensitively, so they're indexed in
+  // lower case.  The key is built in a buffer for the thread, which keeps
+  // its capacity, so that lookups don't allocate.
+  static const std::string& lower_key(const pj_str_t* key)
+  {
+    static thread_local std::string lower;
+    lower.assign(key->ptr, key->slen);
+
+    for (std::string::iterator it = lower.begin(); it != lower.end(); ++it)
+    {
+      *it = tolower((unsigned char)*it);
+    }
+
+    return lower;
+  }
+
+  static Shard& shard(const std::string& key)
+  {
+    return shards()[(std::hash<std::string>()(key) >> 32) % NUM_SHARDS];
+  }
+
+  void add(pjsip_transaction* tsx)
+  {
+    const std::string& key = lower_key(&tsx->transaction_key);
+    Shard& s = shard(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    s.tsxs[key] = tsx;
+  }
+
+  void remove(pjsip_transaction* tsx)
+  {
+    const std::string& key = lower_key(&tsx->transaction_key);
+    Shard& s = shard(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    std::unordered_map<std::string, pjsip_transaction*>::iterator it =
+                                                               s.tsxs.find(key);
+
+    // Only remove the entry if it's for this transaction.
+    if ((it != s.tsxs.end()) && (it->second == tsx))
+    {
+      s.tsxs.erase(it);
+    }
+  }
+
+  pjsip_transaction* find(const pj_str_t* key, bool lock)
+  {
+    const std::string& lower = lower_key(key);
+    Shard& s = shard(lower);
+    pjsip_transaction* tsx = NULL;
+
+    {
+      std::lock_guard<std::mutex> guard(s.lock);
+      std::unordered_map<std::string, pjsip_transaction*>::const_iterator it =
+                                                             s.tsxs.find(lower);
+
+      if (it != s.tsxs.end())
+      {
+        tsx = it->second;
+
+        // As in PJSIP, stop the transaction being destroyed before we've had
+        // the chance to lock it.
+        if (lock)
+        {
+          pj_grp_lock_add_ref(tsx->grp_lock);
+        }
+      }
+    }
+
+    if (tsx == NULL)
+    {
+      // The transaction wasn't created by one of the proxies, or doesn't
+      // exist.
+      return pjsip_tsx_layer_find_tsx(key, lock ? PJ_TRUE : PJ_FALSE);
+    }
+
+    if (lock)
+    {
+      pj_grp_lock_acquire(tsx->grp_lock);
+      pj_grp_lock_dec_ref(tsx->grp_lock);
+    }
+
+    return tsx;
+  }
+
+  size_t size()
+  {
+    size_t total = 0;
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      std::lock_guard<std::mutex> guard(shards()[ii].lock);
+      total += shards()[ii].tsxs.size();
+    }
+
+    return total;
+  }
+}
@@ -0,0 +1,567 @@
+/**
+ * @file udp_batch_transport.cpp UDP transport that receives in batches.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib-util.h>
+#include <pjlib.h>
+}
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "log.h"
+#include "pjutils.h"
+#include "udp_batch_transport.h"
+
+// Datagrams this short are keep-alives rather than SIP messages, so are
+// dropped without being parsed (as PJSIP's own UDP transport does).
+static const pj_ssize_t MIN_PACKET_LEN = 32;
+
+// How long the receive thread blocks waiting for datagrams before checking
+// whether the transport is being destroyed.
+static const long RX_TIMEOUT_US = 100000;
+
+/// One of the receive buffers in the ring.  Each has its own pool for the
+/// received packet and the message parsed from it, which is reset after each
+/// message (or replaced, if the message has been taken by
+/// udp_batch_take_rdata).
+struct udp_batch_slot
+{
+  pj_pool_t* pool;
+  pjsip_rx_data* rdata;
+  char* buffer;
+  pj_sockaddr src_addr;
+  struct iovec iov;
+};
+
+struct udp_batch_transport;
+
+/// One of the transport's sockets, and the thread that receives on it.  If
+/// the transport has more than one, they share the port with SO_REUSEPORT,
+/// so the kernel spreads the datagrams across them (keeping each source
+/// address on one socket).
+struct udp_batch_receiver
+{
+  udp_batch_transport* tp;
+  int fd;
+  pj_thread_t* thread;
+
+  /* This receiver's slots are first_slot onwards in the transport's ring. */
+  unsigned first_slot;
+
+  /* Counts of the datagrams received, and the recvmmsg calls that returned
+   * them.  Only updated on the receive thread. */
+  uint64_t rx_msgs;
+  uint64_t rx_batches;
+};
+
+/* Struct udp_batch_transport "inherits" struct pjsip_transport */
+struct udp_batch_transport
+{
+  pjsip_transport base;
+  volatile bool is_closing;
+
+  /* Messages are sent on the first receiver's socket. */
+  unsigned num_receivers;
+  udp_batch_receiver* receivers;
+
+  /* batch_size slots (and message headers) per receiver. */
+  unsigned batch_size;
+  udp_batch_slot* slots;
+  struct mmsghdr* msgs;
+};
+
+// LCOV_EXCL_START - No UDP transport UTs
+
+/*
+ * (Re)initialises a slot's rdata after its pool has been reset or replaced.
+ * The rdata itself belongs to the transport, but the receive buffer comes
+ * from the slot's pool, so that it can be handed off with the message.
+ */
+static void init_rdata(udp_batch_transport* tp, unsigned index)
+{
+  udp_batch_slot* slot = &tp->slots[index];
+  pjsip_rx_data* rdata = slot->rdata;
+
+  // Leave room for the terminating null.  The slot's pool is created big
+  // enough for this to come from its first block.
+  slot->buffer = (char*)pj_pool_alloc(slot->pool, PJSIP_MAX_PKT_LEN + 1);
+  slot->iov.iov_base = slot->buffer;
+  slot->iov.iov_len = PJSIP_MAX_PKT_LEN;
+
+  pj_bzero(rdata, sizeof(pjsip_rx_data));
+  rdata->tp_info.pool = slot->pool;
+  rdata->tp_info.transport = &tp->base;
+  rdata->tp_info.tp_data = (void*)(pj_ssize_t)index;
+  rdata->tp_info.op_key.rdata = rdata;
+  rdata->pkt_info.packet = slot->buffer;
+}
+
+/*
+ * Creates a pool for a slot, with room in its first block for the receive
+ * buffer as well as the parsed message.
+ */
+static pj_pool_t* create_slot_pool(pjsip_endpoint* endpt)
+{
+  return pjsip_endpt_create_pool(endpt, "rtd%p",
+                                 PJSIP_POOL_RDATA_LEN + PJSIP_MAX_PKT_LEN + 1,
+                                 PJSIP_POOL_RDATA_INC);
+}
+
+/*
+ * Passes a received datagram to the transport manager.
+ */
+static void on_rx_datagram(udp_batch_transport* tp,
+                           unsigned index,
+                           pj_ssize_t len,
+                           int addr_len)
+{
+  udp_batch_slot* slot = &tp->slots[index];
+  pjsip_rx_data* rdata = slot->rdata;
+
+  if (len > MIN_PACKET_LEN)
+  {
+    // The parser needs the message to be null-terminated.  The buffer has
+    // room for this beyond the length we receive into.
+    slot->buffer[len] = '\0';
+
+    rdata->pkt_info.len = len;
+    rdata->pkt_info.zero = 0;
+    pj_gettimeofday(&rdata->pkt_info.timestamp);
+
+    pj_sockaddr_cp(&rdata->pkt_info.src_addr, &slot->src_addr);
+    rdata->pkt_info.src_addr_len = addr_len;
+    pj_sockaddr_print(&rdata->pkt_info.src_addr,
+                      rdata->pkt_info.src_name,
+                      sizeof(rdata->pkt_info.src_name),
+                      0);
+    rdata->pkt_info.src_port = pj_sockaddr_get_port(&rdata->pkt_info.src_addr);
+
+    // Anything that keeps the message beyond this call (such as the thread
+    // dispatcher) either takes it from the slot or clones the rdata, so the
+    // slot can be reused straight away.  The transport manager reports any
+    // message it can't parse.
+    pjsip_tpmgr_receive_packet(tp->base.tpmgr, rdata);
+  }
+
+  pj_pool_reset(slot->pool);
+  init_rdata(tp, index);
+}
+
+/*
+ * A receive thread.  This reads as many datagrams as are waiting on its
+ * socket (up to the batch size) per recvmmsg call.
+ */
+static int udp_batch_rx_thread(void* p)
+{
+  udp_batch_receiver* receiver = (udp_batch_receiver*)p;
+  udp_batch_transport* tp = receiver->tp;
+  struct mmsghdr* msgs = &tp->msgs[receiver->first_slot];
+
+  TRC_STATUS("UDP receive thread %u started for %.*s:%d, batch size %u",
+             (unsigned)(receiver - tp->receivers),
+             (int)tp->base.local_name.host.slen,
+             tp->base.local_name.host.ptr,
+             tp->base.local_name.port,
+             tp->batch_size);
+
+  // Give the thread the same scheduling as the PJSIP transport threads, so
+  // that messages are read from the network promptly even in overload.
+  struct sched_param params;
+  params.sched_priority = sched_get_priority_min(SCHED_FIFO);
+
+  if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &params) != 0)
+  {
+    TRC_WARNING("Unable to set SCHED_FIFO scheduling policy on the UDP receive thread. "
+                "Overload may not be handled gracefully");
+  }
+
+  while (!tp->is_closing)
+  {
+    for (unsigned ii = 0; ii < tp->batch_size; ++ii)
+    {
+      msgs[ii].msg_hdr.msg_namelen = sizeof(pj_sockaddr);
+    }
+
+    // Block until at least one datagram arrives (or the receive timeout
+    // fires), then take whatever else is already waiting.
+    int count = recvmmsg(receiver->fd, msgs, tp->batch_size, MSG_WAITFORONE, NULL);
+
+    if (count < 0)
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+      {
+        TRC_WARNING("Failed to receive from UDP socket: %s", strerror(errno));
+      }
+      continue;
+    }
+
+    ++receiver->rx_batches;
+    receiver->rx_msgs += count;
+
+    for (int ii = 0; ii < count; ++ii)
+    {
+      on_rx_datagram(tp,
+                     receiver->first_slot + ii,
+                     msgs[ii].msg_len,
+                     msgs[ii].msg_hdr.msg_namelen);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * This callback is called by transport manager to send SIP message.  UDP
+ * sends don't block for long, so are made synchronously on the calling
+ * thread rather than being queued.
+ */
+static pj_status_t udp_batch_send_msg(pjsip_transport* transport,
+                                      pjsip_tx_data* tdata,
+                                      const pj_sockaddr_t* rem_addr,
+                                      int addr_len,
+                                      void* token,
+                                      pjsip_transport_callback callback)
+{
+  udp_batch_transport* tp = (udp_batch_transport*)transport;
+  pj_ssize_t len = tdata->buf.cur - tdata->buf.start;
+
+  if (sendto(tp->receivers[0].fd,
+             tdata->buf.start,
+             len,
+             0,
+             (const struct sockaddr*)rem_addr,
+             addr_len) < 0)
+  {
+    return PJ_RETURN_OS_ERROR(errno);
+  }
+
+  return PJ_SUCCESS;
+}
+
+static pj_status_t udp_batch_shutdown_transport(pjsip_transport* transport)
+{
+  return PJ_SUCCESS;
+}
+
+static pj_status_t udp_batch_destroy_transport(pjsip_transport* transport)
+{
+  udp_batch_transport* tp = (udp_batch_transport*)transport;
+
+  tp->is_closing = true;
+
+  for (unsigned ii = 0; (tp->receivers) && (ii < tp->num_receivers); ++ii)
+  {
+    udp_batch_receiver* receiver = &tp->receivers[ii];
+
+    if (receiver->thread)
+    {
+      pj_thread_join(receiver->thread);
+      pj_thread_destroy(receiver->thread);
+      receiver->thread = NULL;
+
+      TRC_STATUS("UDP transport on %.*s:%d socket %u received %lu messages in %lu batches",
+                 (int)tp->base.local_name.host.slen,
+                 tp->base.local_name.host.ptr,
+                 tp->base.local_name.port,
+                 ii,
+                 receiver->rx_msgs,
+                 receiver->rx_batches);
+    }
+
+    if (receiver->fd >= 0)
+    {
+      close(receiver->fd);
+      receiver->fd = -1;
+    }
+  }
+
+  if (tp->slots)
+  {
+    for (unsigned ii = 0; ii < tp->num_receivers * tp->batch_size; ++ii)
+    {
+      if (tp->slots[ii].pool)
+      {
+        pj_pool_release(tp->slots[ii].pool);
+        tp->slots[ii].pool = NULL;
+      }
+    }
+  }
+
+  if (tp->base.lock)
+  {
+    pj_lock_destroy(tp->base.lock);
+    tp->base.lock = NULL;
+  }
+
+  if (tp->base.ref_cnt)
+  {
+    pj_atomic_destroy(tp->base.ref_cnt);
+    tp->base.ref_cnt = NULL;
+  }
+
+  if (tp->base.pool)
+  {
+    pj_pool_t* pool = tp->base.pool;
+    tp->base.pool = NULL;
+    pj_pool_release(pool);
+  }
+
+  return PJ_SUCCESS;
+}
+
+pjsip_rx_data* udp_batch_take_rdata(pjsip_rx_data* rdata)
+{
+  pjsip_transport* transport = rdata->tp_info.transport;
+
+  if ((transport == NULL) ||
+      (transport->destroy != &udp_batch_destroy_transport))
+  {
+    return NULL;
+  }
+
+  udp_batch_transport* tp = (udp_batch_transport*)transport;
+  unsigned index = (unsigned)(pj_ssize_t)rdata->tp_info.tp_data;
+
+  if ((index >= tp->num_receivers * tp->batch_size) ||
+      (tp->slots[index].rdata != rdata) ||
+      (!pj_list_empty(&rdata->msg_info.parse_err)))
+  {
+    // Either this isn't the rdata the slot is receiving into, or it has a
+    // list of parse errors that would need relinking, so leave it to be
+    // cloned.
+    return NULL;
+  }
+
+  udp_batch_slot* slot = &tp->slots[index];
+  pj_pool_t* new_pool = create_slot_pool(tp->base.endpt);
+
+  if (!new_pool)
+  {
+    return NULL;
+  }
+
+  // The endpoint clears the rdata once the modules have finished with it, so
+  // the caller gets a copy of the rdata itself, in the pool that holds the
+  // packet and the message parsed from it.  The slot gets a fresh pool, and
+  // is reinitialised with it once the transport manager returns.
+  pj_pool_t* pool = slot->pool;
+  pjsip_rx_data* taken = PJ_POOL_ALLOC_T(pool, pjsip_rx_data);
+  pj_memcpy(taken, rdata, sizeof(pjsip_rx_data));
+  taken->tp_info.pool = pool;
+  taken->tp_info.op_key.rdata = taken;
+  pj_list_init(&taken->msg_info.parse_err);
+
+  slot->pool = new_pool;
+
+  // Hold a reference to the transport, as pjsip_rx_data_clone does.
+  pjsip_transport_add_ref(&tp->base);
+
+  return taken;
+}
+
+pj_status_t create_udp_batch_transport(pjsip_endpoint* endpt,
+                                       const pj_sockaddr* addr,
+                                       const pjsip_host_port* published_name,
+                                       unsigned batch_size,
+                                       unsigned num_sockets,
+                                       pjsip_transport** p_transport)
+{
+  pj_pool_t* pool;
+  udp_batch_transport* tp;
+  pj_status_t status;
+  int af = addr->addr.sa_family;
+  pjsip_transport_type_e type = (af == pj_AF_INET6()) ? PJSIP_TRANSPORT_UDP6 :
+                                                        PJSIP_TRANSPORT_UDP;
+  socklen_t local_addr_len = sizeof(pj_sockaddr);
+  struct timeval rx_timeout = {0, RX_TIMEOUT_US};
+  char info[PJ_MAX_HOSTNAME + 16];
+
+  int reuse_port = 1;
+
+  if (batch_size < 1)
+  {
+    batch_size = 1;
+  }
+
+  if (num_sockets < 1)
+  {
+    num_sockets = 1;
+  }
+
+  /* Create pool. */
+  pool = pjsip_endpt_create_pool(endpt, "udpb%p", PJSIP_POOL_LEN_TRANSPORT,
+                                 PJSIP_POOL_INC_TRANSPORT);
+  if (!pool)
+  {
+    return PJ_ENOMEM;
+  }
+
+  /* Create the transport object. */
+  tp = PJ_POOL_ZALLOC_T(pool, udp_batch_transport);
+  tp->base.pool = pool;
+  tp->batch_size = batch_size;
+  pj_memcpy(tp->base.obj_name, pool->obj_name, PJ_MAX_OBJ_NAME);
+
+  /* Init reference counter. */
+  status = pj_atomic_create(pool, 0, &tp->base.ref_cnt);
+  if (status != PJ_SUCCESS)
+  {
+    goto on_error;
+  }
+
+  /* Init lock. */
+  status = pj_lock_create_recursive_mutex(pool, pool->obj_name,
+                                          &tp->base.lock);
+  if (status != PJ_SUCCESS)
+  {
+    goto on_error;
+  }
+
+  /* Open and bind the sockets.  The first is bound to the requested
+   * address, and the rest to the address it ends up with, so that they
+   * share the same port. */
+  tp->receivers = (udp_batch_receiver*)pj_pool_zalloc(pool, num_sockets * sizeof(udp_batch_receiver));
+
+  for (unsigned ii = 0; ii < num_sockets; ++ii)
+  {
+    udp_batch_receiver* receiver = &tp->receivers[ii];
+    receiver->tp = tp;
+    receiver->fd = -1;
+    receiver->first_slot = ii * batch_size;
+    tp->num_receivers++;
+  }
+
+  for (unsigned ii = 0; ii < num_sockets; ++ii)
+  {
+    udp_batch_receiver* receiver = &tp->receivers[ii];
+    const pj_sockaddr* bind_addr = (ii == 0) ? addr : &tp->base.local_addr;
+
+    receiver->fd = socket(af, SOCK_DGRAM, 0);
+    if (receiver->fd < 0)
+    {
+      status = PJ_RETURN_OS_ERROR(errno);
+      goto on_error;
+    }
+
+    if (((num_sockets > 1) &&
+         (setsockopt(receiver->fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port)) != 0)) ||
+        (bind(receiver->fd, &bind_addr->addr, pj_sockaddr_get_len(bind_addr)) != 0) ||
+        (setsockopt(receiver->fd, SOL_SOCKET, SO_RCVTIMEO, &rx_timeout, sizeof(rx_timeout)) != 0) ||
+        ((ii == 0) &&
+         (getsockname(receiver->fd, (struct sockaddr*)&tp->base.local_addr, &local_addr_len) != 0)))
+    {
+      status = PJ_RETURN_OS_ERROR(errno);
+      goto on_error;
+    }
+  }
+
+  /* Set up the ring of receive buffers. */
+  tp->slots = (udp_batch_slot*)pj_pool_zalloc(pool, num_sockets * batch_size * sizeof(udp_batch_slot));
+  tp->msgs = (struct mmsghdr*)pj_pool_zalloc(pool, num_sockets * batch_size * sizeof(struct mmsghdr));
+
+  for (unsigned ii = 0; ii < num_sockets * batch_size; ++ii)
+  {
+    udp_batch_slot* slot = &tp->slots[ii];
+
+    slot->pool = create_slot_pool(endpt);
+    if (!slot->pool)
+    {
+      status = PJ_ENOMEM;
+      goto on_error;
+    }
+
+    slot->rdata = PJ_POOL_ALLOC_T(pool, pjsip_rx_data);
+
+    tp->msgs[ii].msg_hdr.msg_name = &slot->src_addr;
+    tp->msgs[ii].msg_hdr.msg_iov = &slot->iov;
+    tp->msgs[ii].msg_hdr.msg_iovlen = 1;
+
+    init_rdata(tp, ii);
+  }
+
+  /* Fill in the rest of the transport. */
+  tp->base.key.type = type;
+  tp->base.key.rem_addr.addr.sa_family = (pj_uint16_t)af;
+  tp->base.type_name = (char*)pjsip_transport_get_type_name(type);
+  tp->base.flag = pjsip_transport_get_flag_from_type(type);
+  tp->base.addr_len = pj_sockaddr_get_len(addr);
+  tp->base.dir = PJSIP_TP_DIR_NONE;
+  tp->base.endpt = endpt;
+
+  pj_strdup(pool, &tp->base.local_name.host, &published_name->host);
+  tp->base.local_name.port = published_name->port;
+
+  snprintf(info, sizeof(info), "udp %.*s:%d",
+           (int)published_name->host.slen,
+           published_name->host.ptr,
+           published_name->port);
+  tp->base.info = (char*)pj_pool_alloc(pool, strlen(info) + 1);
+  strcpy(tp->base.info, info);
+
+  tp->base.send_msg = &udp_batch_send_msg;
+  tp->base.do_shutdown = &udp_batch_shutdown_transport;
+  tp->base.destroy = &udp_batch_destroy_transport;
+
+  /* This is a permanent transport, so we initialize the ref count
+   * to one so that transport manager don't destroy this transport
+   * when there's no user!
+   */
+  pj_atomic_inc(tp->base.ref_cnt);
+
+  /* Register to transport manager. */
+  tp->base.tpmgr = pjsip_endpt_get_tpmgr(endpt);
+  status = pjsip_transport_register(tp->base.tpmgr, (pjsip_transport*)tp);
+  if (status != PJ_SUCCESS)
+  {
+    goto on_error;
+  }
+
+  /* Start receiving.  From here on the transport manager owns the transport,
+   * and destroys it (stopping the threads) along with the others. */
+  for (unsigned ii = 0; ii < num_sockets; ++ii)
+  {
+    udp_batch_receiver* receiver = &tp->receivers[ii];
+
+    status = pj_thread_create(pool, "udp-rx", &udp_batch_rx_thread,
+                              receiver, 0, 0, &receiver->thread);
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Error creating UDP receive thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      receiver->thread = NULL;
+      pjsip_transport_destroy(&tp->base);
+      return status;
+    }
+  }
+
+  if (p_transport)
+  {
+    *p_transport = &tp->base;
+  }
+
+  TRC_STATUS("Started batched UDP transport %s with %u sockets",
+             tp->base.info, num_sockets);
+
+  return PJ_SUCCESS;
+
+on_error:
+  udp_batch_destroy_transport((pjsip_transport*)tp);
+  return status;
+}
+
+// LCOV_EXCL_STOP
@@ -7,11 +7,15 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <algorithm>
+#include <map>
 #include <vector>
 #include <boost/regex.hpp>
 #include "uri_classifier.h"
 #include "stack.h"
 #include "constants.h"
+#include "pj_str_index.h"
+#include "log.h"
 
 // Regexes that match global and local numbers:
 // - A global number starts with "+" followed by a combination of digits "0-9"
@@ -25,13 +29,59 @@ std::vector<pj_str_t*> URIClassifier::home_domains;
 bool URIClassifier::enforce_global;
 bool URIClassifier::enforce_user_phone;
 
+// What an indexed host is.
+static const int HOST_HOME_DOMAIN = 0x1;
+static const int HOST_LOCAL_NAME = 0x2;
+
+// Index of the home domains and local names, or NULL if index_hosts hasn't
+// been called.
+static PjStrIndex<int>* host_index = NULL;
+
 bool URIClassifier::is_user_numeric(pj_str_t user)
 {
   return Utils::is_user_numeric(user.ptr, user.slen);
 }
 
+void URIClassifier::index_hosts()
+{
+  // Hosts can be both home domains and local names, so work out all the
+  // flags for each host before indexing it.
+  std::map<std::string, int> hosts;
+
+  for (pj_str_t* domain : home_domains)
+  {
+    std::string host = PJUtils::pj_str_to_string(domain);
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    hosts[host] |= HOST_HOME_DOMAIN;
+  }
+
+  for (pj_str_t& name : stack_data.name)
+  {
+    std::string host = PJUtils::pj_str_to_string(&name);
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    hosts[host] |= HOST_LOCAL_NAME;
+  }
+
+  PjStrIndex<int>* index = new PjStrIndex<int>(true, 0);
+
+  for (std::map<std::string, int>::const_iterator host = hosts.begin();
+       host != hosts.end();
+       ++host)
+  {
+    index->insert(host->first, host->second);
+  }
+
+  delete host_index;
+  host_index = index;
+}
+
 static bool is_home_domain(pj_str_t host)
 {
+  if (host_index != NULL)
+  {
+    return (host_index->find(&host) & HOST_HOME_DOMAIN);
+  }
+
     for (unsigned int i = 0; i < URIClassifier::home_domains.size(); ++i)
     {
       if (pj_stricmp(&host, URIClassifier::home_domains[i]) == 0)
@@ -46,6 +96,11 @@ static bool is_home_domain(pj_str_t host)
 
 static bool is_local_name(pj_str_t host)
 {
+  if (host_index != NULL)
+  {
+    return (host_index->find(&host) & HOST_LOCAL_NAME);
+  }
+
   for (std::vector<pj_str_t>::iterator it = stack_data.name.begin();
        it != stack_data.name.end();
        ++it)
@@ -169,7 +224,11 @@ URIClass URIClassifier::classify_uri(const pjsip_uri* uri, bool prefer_sip, bool
     }
   }
 
-  std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_OTHER, uri);
-  TRC_DEBUG("Classified URI %s as %d", uri_str.c_str(), (int)ret);
+  if (Log::enabled(Log::DEBUG_LEVEL))
+  {
+    std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_OTHER, uri);
+    TRC_DEBUG("Classified URI %s as %d", uri_str.c_str(), (int)ret);
+  }
+
   return ret;
 }
@@ -0,0 +1,120 @@
+/**
+ * @file acr_spool_test.cpp UT for AcrSpool.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <unistd.h>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "acr_spool.h"
+
+static const std::string SPOOL_FILE = "/tmp/acr_spool_test.spool";
+
+class AcrSpoolTest : public ::testing::Test
+{
+public:
+  AcrSpoolTest()
+  {
+    unlink(SPOOL_FILE.c_str());
+  }
+
+  virtual ~AcrSpoolTest()
+  {
+    unlink(SPOOL_FILE.c_str());
+  }
+};
+
+// Test that ACRs come out of the spool in the order they went in.
+TEST_F(AcrSpoolTest, AppendAndTake)
+{
+  AcrSpool spool(SPOOL_FILE, 4096);
+  ASSERT_TRUE(spool.init());
+
+  std::string path;
+  std::string message;
+  SAS::TrailId trail;
+  EXPECT_FALSE(spool.take(path, message, trail));
+
+  EXPECT_TRUE(spool.append("/call-id/1", "first", 1));
+  EXPECT_TRUE(spool.append("/call-id/2", "second", 2));
+  EXPECT_EQ(2u, spool.count());
+
+  EXPECT_TRUE(spool.take(path, message, trail));
+  EXPECT_EQ("/call-id/1", path);
+  EXPECT_EQ("first", message);
+  EXPECT_EQ(1u, trail);
+
+  EXPECT_TRUE(spool.take(path, message, trail));
+  EXPECT_EQ("/call-id/2", path);
+  EXPECT_EQ("second", message);
+  EXPECT_EQ(2u, trail);
+
+  EXPECT_FALSE(spool.take(path, message, trail));
+  EXPECT_EQ(0u, spool.count());
+}
+
+// Test that a full spool rejects ACRs, and has room again once it's drained.
+TEST_F(AcrSpoolTest, Full)
+{
+  AcrSpool spool(SPOOL_FILE, 256);
+  ASSERT_TRUE(spool.init());
+
+  std::string acr(100, 'x');
+  EXPECT_TRUE(spool.append("/call-id/1", acr, 1));
+  EXPECT_FALSE(spool.append("/call-id/2", acr, 2));
+  EXPECT_FALSE(spool.append("/call-id/2", acr + acr, 2));
+
+  std::string path;
+  std::string message;
+  SAS::TrailId trail;
+  EXPECT_TRUE(spool.take(path, message, trail));
+  EXPECT_EQ(acr, message);
+
+  EXPECT_TRUE(spool.append("/call-id/2", acr, 2));
+  EXPECT_EQ(1u, spool.count());
+}
+
+// Test that spooled ACRs survive the spool being closed and reopened.
+TEST_F(AcrSpoolTest, Reopen)
+{
+  {
+    AcrSpool spool(SPOOL_FILE, 4096);
+    ASSERT_TRUE(spool.init());
+    EXPECT_TRUE(spool.append("/call-id/1", "first", 1));
+    EXPECT_TRUE(spool.append("/call-id/2", "second", 2));
+
+    std::string path;
+    std::string message;
+    SAS::TrailId trail;
+    EXPECT_TRUE(spool.take(path, message, trail));
+  }
+
+  AcrSpool spool(SPOOL_FILE, 4096);
+  ASSERT_TRUE(spool.init());
+  EXPECT_EQ(1u, spool.count());
+
+  std::string path;
+  std::string message;
+  SAS::TrailId trail;
+  EXPECT_TRUE(spool.take(path, message, trail));
+  EXPECT_EQ("/call-id/2", path);
+  EXPECT_EQ("second", message);
+  EXPECT_FALSE(spool.take(path, message, trail));
+}
+
+// Test that a spool file that can't be created is reported.
+TEST_F(AcrSpoolTest, BadFile)
+{
+  AcrSpool spool("/nonexistent/acr_spool_test.spool", 4096);
+  EXPECT_FALSE(spool.init());
+
+  AcrSpool tiny(SPOOL_FILE, 8);
+  EXPECT_FALSE(tiny.init());
+}
@@ -17,6 +17,7 @@ extern "C" {
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <thread>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -1603,3 +1604,117 @@ TEST_F(ACRTest, BGCFOrigCallStart)
   EXPECT_TRUE(compare_acr(acr_message, "acr_bgcforigcall_start.json"));
   delete acr;
 }
+
+// Tests that responses received on several forks in parallel are all
+// reflected in the ACR, without the caller taking the ACR lock.
+TEST_F(ACRTest, SCSCFParallelForkResponses)
+{
+  pj_time_val ts;
+  ACR* acr;
+  std::string acr_message;
+
+  // Create a Ralf ACR factory for S-CSCF ACRs and get an ACR instance.
+  RalfACRFactory f(NULL, ACR::SCSCF);
+  acr = f.get_acr(0, ACR::CALLING_PARTY, ACR::NODE_ROLE_ORIGINATING);
+
+  SIPRequest invite = invite_msg();
+  ts.sec = 1;
+  ts.msec = 0;
+  acr->rx_request(parse_msg(invite.get()), ts);
+  ts.msec = 5;
+  acr->tx_request(parse_msg(invite.get()), ts);
+
+  // Each fork returns a 180 Ringing carrying new charging function
+  // addresses.  The messages are parsed up front, as parsing needs a
+  // registered PJSIP thread.
+  SIPResponse r180ringing(180, "INVITE");
+  r180ringing._extra_hdrs = "P-Charging-Function-Addresses: ccf=192.1.1.9;ecf=192.1.1.10\r\n";
+
+  const int NUM_FORKS = 4;
+  const int RESPONSES_PER_FORK = 50;
+  std::vector<pjsip_msg*> responses;
+  for (int ii = 0; ii < NUM_FORKS * RESPONSES_PER_FORK; ++ii)
+  {
+    responses.push_back(parse_msg(r180ringing.get()));
+  }
+
+  std::vector<std::thread> forks;
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    forks.push_back(std::thread([acr, &responses, ii, RESPONSES_PER_FORK, ts]()
+    {
+      for (int jj = 0; jj < RESPONSES_PER_FORK; ++jj)
+      {
+        acr->rx_response(responses[ii * RESPONSES_PER_FORK + jj], ts);
+      }
+    }));
+  }
+
+  for (std::thread& fork : forks)
+  {
+    fork.join();
+  }
+
+  // The call fails, so this becomes an EVENT record with the final status
+  // code and the charging function addresses from the forks.
+  SIPResponse r486busy(486, "INVITE");
+  ts.msec = 20;
+  acr->tx_response(parse_msg(r486busy.get()), ts);
+
+  acr_message = acr->get_message(ts);
+  EXPECT_THAT(acr_message, HasSubstr("\"Cause-Code\":486"));
+  EXPECT_THAT(acr_message, HasSubstr("192.1.1.9"));
+  EXPECT_THAT(acr_message, HasSubstr("192.1.1.10"));
+  EXPECT_THAT(acr_message, Not(HasSubstr("192.1.1.1\"")));
+  delete acr;
+}
+
+// Tests parsing of EVENT ACR suppression rules.
+TEST_F(ACRTest, ACRPolicyRules)
+{
+  ACRPolicy policy;
+  EXPECT_TRUE(policy.empty());
+
+  // Invalid rules are rejected without changing the policy.
+  EXPECT_FALSE(policy.add_rules("scscf:REGISTER,xcscf:NOTIFY"));
+  EXPECT_FALSE(policy.add_rules("scscf"));
+  EXPECT_FALSE(policy.add_rules("scscf:REGISTER:both"));
+  EXPECT_TRUE(policy.empty());
+
+  EXPECT_TRUE(policy.add_rules("scscf:REGISTER, *:NOTIFY:term, bgcf:*"));
+  EXPECT_FALSE(policy.empty());
+
+  EXPECT_TRUE(policy.suppress_event(ACR::SCSCF, ACR::NODE_ROLE_ORIGINATING, "REGISTER"));
+  EXPECT_TRUE(policy.suppress_event(ACR::SCSCF, ACR::NODE_ROLE_TERMINATING, "REGISTER"));
+  EXPECT_FALSE(policy.suppress_event(ACR::PCSCF, ACR::NODE_ROLE_ORIGINATING, "REGISTER"));
+  EXPECT_TRUE(policy.suppress_event(ACR::PCSCF, ACR::NODE_ROLE_TERMINATING, "NOTIFY"));
+  EXPECT_FALSE(policy.suppress_event(ACR::PCSCF, ACR::NODE_ROLE_ORIGINATING, "NOTIFY"));
+  EXPECT_TRUE(policy.suppress_event(ACR::BGCF, ACR::NODE_ROLE_ORIGINATING, "INVITE"));
+  EXPECT_FALSE(policy.suppress_event(ACR::SCSCF, ACR::NODE_ROLE_ORIGINATING, "MESSAGE"));
+  EXPECT_EQ(4u, policy.suppressed_count());
+}
+
+// Tests that a suppressed EVENT ACR is dropped before it is sent.  (The
+// factory doesn't have a Ralf connection, so sending it would crash.)
+TEST_F(ACRTest, ACRPolicySuppressesRegister)
+{
+  pj_time_val ts;
+  ACRPolicy policy;
+  EXPECT_TRUE(policy.add_rules("scscf:REGISTER"));
+
+  RalfACRFactory f(NULL, ACR::SCSCF, &policy);
+  ACR* acr = f.get_acr(0, ACR::CALLING_PARTY, ACR::NODE_ROLE_ORIGINATING);
+
+  SIPRequest reg = register_msg();
+  ts.sec = 1;
+  ts.msec = 0;
+  acr->rx_request(parse_msg(reg.get()), ts);
+
+  SIPResponse reg200ok(200, "REGISTER");
+  ts.msec = 25;
+  acr->tx_response(parse_msg(reg200ok.get()), ts);
+
+  acr->send(ts);
+  EXPECT_EQ(1u, policy.suppressed_count());
+  delete acr;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file analyticslogger_test.cpp UT for AnalyticsLogger.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "analyticslogger.h"
+
+using ::testing::MatchesRegex;
+
+/// AnalyticsLogger that records the logs it writes instead of sending them
+/// to syslog, and can be made to stall like a slow syslog.
+class TestAnalyticsLogger : public AnalyticsLogger
+{
+public:
+  TestAnalyticsLogger() : _stalled(false) {}
+
+  virtual ~TestAnalyticsLogger()
+  {
+    unstall();
+    stop();
+  }
+
+  void stall()
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _stalled = true;
+  }
+
+  void unstall()
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _stalled = false;
+    _cond.notify_all();
+  }
+
+  std::vector<std::string> logs()
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    return _logs;
+  }
+
+protected:
+  virtual void write(const char* log)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    while (_stalled)
+    {
+      _cond.wait(lock);
+    }
+    _logs.push_back(log);
+  }
+
+private:
+  std::mutex _lock;
+  std::condition_variable _cond;
+  bool _stalled;
+  std::vector<std::string> _logs;
+};
+
+// Test that logs are written out in order, with timestamps.
+TEST(AnalyticsLoggerTest, Logs)
+{
+  TestAnalyticsLogger logger;
+  logger.registration("sip:6505550000@homedomain", "binding", "sip:contact", 300);
+  logger.call_disconnected("call-id", 200);
+  logger.stop();
+
+  std::vector<std::string> logs = logger.logs();
+  ASSERT_EQ(2u, logs.size());
+  EXPECT_THAT(logs[0],
+              MatchesRegex("[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}\\.[0-9]{3}\\+00:00 "
+                           "Registration: USER_URI=sip:6505550000@homedomain "
+                           "BINDING_ID=binding CONTACT_URI=sip:contact EXPIRES=300"));
+  EXPECT_THAT(logs[1], MatchesRegex(".* Call-Disconnected: CALL_ID=call-id REASON=200"));
+  EXPECT_EQ(0u, logger.dropped());
+}
+
+// Test that logs are dropped rather than waiting when the writer has
+// stalled, and are written out again once it recovers.
+TEST(AnalyticsLoggerTest, Stalled)
+{
+  TestAnalyticsLogger logger;
+  logger.stall();
+
+  for (uint64_t ii = 0; ii < AnalyticsLogger::RING_SIZE + 10; ++ii)
+  {
+    logger.call_disconnected("call-id", 200);
+  }
+
+  // The writer may have taken one log off the ring before stalling on it.
+  EXPECT_GE(logger.dropped(), 9u);
+  EXPECT_LE(logger.dropped(), 10u);
+
+  logger.unstall();
+  logger.stop();
+  EXPECT_EQ(AnalyticsLogger::RING_SIZE + 10 - logger.dropped(),
+            logger.logs().size());
+}
@@ -0,0 +1,84 @@
+/**
+ * @file aor_microbench.cpp Microbenchmarks for AoR serialization.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+#include <string>
+
+#include "microbench.hpp"
+#include "aor.h"
+#include "astaire_aor_store.h"
+
+/// The JSON for an AoR with the given number of bindings and one
+/// subscription, as stored in memcached.
+static std::string aor_json(int num_bindings)
+{
+  std::string expires = std::to_string(time(NULL) + 300);
+  std::string json = "{\"bindings\":{";
+
+  for (int ii = 0; ii < num_bindings; ++ii)
+  {
+    std::string ip = "192.91.191." + std::to_string(ii + 1);
+    json += (ii == 0) ? "" : ",";
+    json += "\"<urn:uuid:00000000-0000-0000-0000-b4dd3281762" + std::to_string(ii) + ">:1\":"
+            "{\"uri\":\"<sip:6505550231@" + ip + ":59934;transport=tcp;ob>\","
+            "\"cid\":\"gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq\",\"cseq\":17038,"
+            "\"expires\":" + expires + ",\"priority\":0,"
+            "\"params\":{\"+sip.ice\":\"\","
+            "\"+sip.instance\":\"\\\"<urn:uuid:00000000-0000-0000-0000-b4dd3281762" + std::to_string(ii) + ">\\\"\","
+            "\"reg-id\":\"1\"},"
+            "\"path_headers\":[\"<sip:abcdefgh@bono1.homedomain;lr>\"],"
+            "\"private_id\":\"6505550231\",\"emergency_reg\":false}";
+  }
+
+  json += "},\"subscriptions\":{\"1234\":"
+          "{\"req_uri\":\"<sip:6505550231@192.91.191.1:59934;transport=tcp;ob>\","
+          "\"from_uri\":\"<sip:6505550231@homedomain>\",\"from_tag\":\"4321\","
+          "\"to_uri\":\"<sip:6505550231@homedomain>\",\"to_tag\":\"1234\","
+          "\"cid\":\"xyzabc@192.91.191.1\","
+          "\"routes\":[\"sip:abcdefgh@bono1.homedomain;lr\"],"
+          "\"expires\":" + expires + "}},"
+          "\"associated-uris\":{\"uris\":["
+          "{\"uri\":\"sip:6505550231@homedomain\",\"barring\":false},"
+          "{\"uri\":\"tel:6505550231\",\"barring\":false}]},"
+          "\"notify_cseq\":20,\"timer_id\":\"timer1\","
+          "\"scscf-uri\":\"sip:scscf.sprout.homedomain:5058;transport=TCP\"}";
+
+  return json;
+}
+
+static void BM_AoR_deserialize(MicroBench::State& state)
+{
+  AstaireAoRStore::JsonSerializerDeserializer serializer;
+  std::string json = aor_json(4);
+
+  while (state.keep_running())
+  {
+    AoR* aor = serializer.deserialize_aor("sip:6505550231@homedomain", json);
+    MicroBench::do_not_optimize(aor);
+    delete aor;
+  }
+}
+MICROBENCH(BM_AoR_deserialize);
+
+static void BM_AoR_serialize(MicroBench::State& state)
+{
+  AstaireAoRStore::JsonSerializerDeserializer serializer;
+  AoR* aor = serializer.deserialize_aor("sip:6505550231@homedomain",
+                                        aor_json(4));
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(serializer.serialize_aor(aor));
+  }
+
+  delete aor;
+}
+MICROBENCH(BM_AoR_serialize);
@@ -303,3 +303,95 @@ TEST_F(AsCommunicationTrackerTest, MultipleFailureReasons)
   advance_time();
   _comm_tracker->on_failure(AS1, "Another failure reason");
 }
+
+
+// Test that circuit breakers are off unless a failure threshold is configured.
+TEST_F(AsCommunicationTrackerTest, CircuitBreakerDisabled)
+{
+  EXPECT_CALL(*_mock_alarm, set());
+  EXPECT_CALL(*_mock_error_log, log(StrEq(AS1), StrEq("Some failure reason")));
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    _comm_tracker->on_failure(AS1, "Some failure reason");
+  }
+
+  EXPECT_FALSE(_comm_tracker->is_circuit_open(AS1));
+}
+
+
+// Test that an AS's circuit breaker opens after consecutive failures, lets a
+// probe through each retry interval, and closes when the AS succeeds.
+TEST_F(AsCommunicationTrackerTest, CircuitBreaker)
+{
+  EXPECT_CALL(*_mock_alarm, clear());
+  AsCommunicationTracker tracker(_mock_alarm,
+                                 _mock_error_log,
+                                 _mock_ok_log,
+                                 2,
+                                 1000);
+
+  EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
+  EXPECT_CALL(*_mock_error_log, log(StrEq(AS1), StrEq("Some failure reason")));
+
+  // One failure doesn't open the circuit, but a second in a row does.  Other
+  // ASs aren't affected.
+  tracker.on_failure(AS1, "Some failure reason");
+  EXPECT_FALSE(tracker.is_circuit_open(AS1));
+  tracker.on_failure(AS1, "Some failure reason");
+  EXPECT_TRUE(tracker.is_circuit_open(AS1));
+  EXPECT_FALSE(tracker.is_circuit_open(AS2));
+
+  // After the retry interval one request probes the AS, and the rest still
+  // skip it.
+  cwtest_advance_time_ms(1001);
+  EXPECT_FALSE(tracker.is_circuit_open(AS1));
+  EXPECT_TRUE(tracker.is_circuit_open(AS1));
+
+  // The probe fails, so the circuit stays open for another retry interval.
+  tracker.on_failure(AS1, "Some failure reason");
+  cwtest_advance_time_ms(500);
+  EXPECT_TRUE(tracker.is_circuit_open(AS1));
+  cwtest_advance_time_ms(501);
+  EXPECT_FALSE(tracker.is_circuit_open(AS1));
+
+  // The probe succeeds, which closes the circuit.
+  tracker.on_success(AS1);
+  EXPECT_FALSE(tracker.is_circuit_open(AS1));
+  EXPECT_FALSE(tracker.is_circuit_open(AS1));
+
+  // A success in between failures means they aren't consecutive.
+  tracker.on_failure(AS1, "Some failure reason");
+  tracker.on_success(AS1);
+  tracker.on_failure(AS1, "Some failure reason");
+  EXPECT_FALSE(tracker.is_circuit_open(AS1));
+}
+
+
+// Test that an AS's slot is looked up once, and that reporting through the
+// slot is the same as reporting by URI.
+TEST_F(AsCommunicationTrackerTest, Slots)
+{
+  AsCommunicationTracker::AsSlot* slot = _comm_tracker->slot(AS1);
+  EXPECT_EQ(slot, _comm_tracker->slot(AS1));
+  EXPECT_NE(slot, _comm_tracker->slot(AS2));
+  EXPECT_EQ(AS1, slot->uri);
+
+  // The AS fails, through its slot and by URI, but is only logged once.
+  EXPECT_CALL(*_mock_alarm, set());
+  EXPECT_CALL(*_mock_error_log, log(StrEq(AS1), StrEq("Some failure reason")));
+  advance_time();
+  _comm_tracker->on_failure(slot, "Some failure reason");
+  _comm_tracker->on_failure(AS1, "Some failure reason");
+  EXPECT_FALSE(_comm_tracker->is_circuit_open(slot));
+
+  // The AS starts succeeding again.
+  EXPECT_CALL(*_mock_alarm, clear()).Times(AtLeast(1));
+  EXPECT_CALL(*_mock_ok_log, log(StrEq(AS1)));
+
+  advance_time();
+  _comm_tracker->on_success(slot);
+
+  advance_time();
+  _comm_tracker->on_success(slot);
+}
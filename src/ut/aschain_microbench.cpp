@@ -0,0 +1,104 @@
+/**
+ * @file aschain_microbench.cpp Microbenchmarks for AsChainTable.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "microbench.hpp"
+#include "aschain.h"
+#include "fakesnmp.hpp"
+
+/// iFCs that invoke each of the given ASs unconditionally.
+static Ifcs unconditional_ifcs(const std::vector<std::string>& as_uris)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription><ServiceProfile><PublicIdentity><Identity>sip:5755550011@homedomain</Identity></PublicIdentity>";
+  for (const std::string& as_uri : as_uris)
+  {
+    xml += "<InitialFilterCriteria><Priority>1</Priority><ApplicationServer>"
+           "<ServerName>" + as_uri + "</ServerName>"
+           "<DefaultHandling>0</DefaultHandling>"
+           "</ApplicationServer></InitialFilterCriteria>";
+  }
+  xml += "</ServiceProfile></IMSSubscription>";
+
+  std::shared_ptr<rapidxml::xml_document<> > ifc_doc(new rapidxml::xml_document<>);
+  ifc_doc->parse<0>(ifc_doc->allocate_string(xml.c_str()));
+  return Ifcs(ifc_doc, ifc_doc->first_node("IMSSubscription")->first_node("ServiceProfile"), NULL, 0);
+}
+
+// Each iteration creates an AS chain with three ASs and looks up each of its
+// ODI tokens, as the S-CSCF does as the request comes back from each AS.  The
+// iterations are spread across the threads, so that they contend for the
+// table.
+static void run_chains(MicroBench::State& state, int num_threads)
+{
+  AsChainTable table;
+  IFCConfiguration ifc_configuration(false, false, "", &SNMP::FAKE_COUNTER_TABLE, &SNMP::FAKE_COUNTER_TABLE);
+  Ifcs ifcs = unconditional_ifcs({"sip:as1", "sip:as2", "sip:as3"});
+  uint64_t per_thread = state.iterations() / num_threads + 1;
+  std::vector<std::thread> threads;
+
+  // Start the timer, and then run the iterations spread across the threads.
+  state.keep_running();
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    threads.push_back(std::thread([&table, &ifc_configuration, &ifcs, per_thread]()
+    {
+      for (uint64_t jj = 0; jj < per_thread; ++jj)
+      {
+        AsChainLink as_chain_link =
+          AsChainLink::create_as_chain(&table,
+                                       SessionCase::Originating,
+                                       "sip:5755550011@homedomain",
+                                       true,
+                                       0,
+                                       ifcs,
+                                       NULL,
+                                       NULL,
+                                       ifc_configuration,
+                                       "sip:scscf.homedomain");
+
+        for (AsChainLink link = as_chain_link; !link.complete(); link = link.next())
+        {
+          AsChainLink found = table.lookup(link.next_odi_token());
+          MicroBench::do_not_optimize(found.as_chain());
+          found.release();
+        }
+
+        as_chain_link.release();
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  while (state.keep_running())
+  {
+  }
+}
+
+#define AS_CHAIN_BENCHMARK(THREADS)                                          \
+  static void BM_AsChain_odi_tokens_##THREADS##_threads(MicroBench::State& state) \
+  {                                                                          \
+    run_chains(state, THREADS);                                              \
+  }                                                                          \
+  MICROBENCH(BM_AsChain_odi_tokens_##THREADS##_threads);
+
+AS_CHAIN_BENCHMARK(1)
+AS_CHAIN_BENCHMARK(4)
+AS_CHAIN_BENCHMARK(16)
+AS_CHAIN_BENCHMARK(64)
@@ -162,6 +162,33 @@ TEST_F(AsChainTest, Basics)
   EXPECT_TRUE(res.complete());
 }
 
+// Test that a chain's ODI tokens stop working once the chain is destroyed.
+TEST_F(AsChainTest, TokensRemovedWithChain)
+{
+  IFCConfiguration ifc_configuration(false, false, "", &SNMP::FAKE_COUNTER_TABLE, &SNMP::FAKE_COUNTER_TABLE);
+  Ifcs ifcs = matching_ifcs(2, "sip:as1", "sip:as2");
+  std::vector<std::string> tokens;
+
+  {
+    AsChain as_chain(_as_chain_table, SessionCase::Originating, "sip:5755550011@homedomain", true, 0, ifcs, NULL, NULL, ifc_configuration, "sip:scscf.homedomain");
+    tokens = as_chain._odi_tokens;
+    ASSERT_EQ(3u, tokens.size());
+
+    for (size_t ii = 1; ii < tokens.size(); ++ii)
+    {
+      AsChainLink res = _as_chain_table->lookup(tokens[ii]);
+      EXPECT_EQ(&as_chain, res._as_chain);
+      EXPECT_EQ(ii, res._index);
+    }
+  }
+
+  for (size_t ii = 1; ii < tokens.size(); ++ii)
+  {
+    EXPECT_FALSE(_as_chain_table->lookup(tokens[ii]).is_set());
+  }
+  EXPECT_FALSE(_as_chain_table->lookup("unknown").is_set());
+}
+
 // We have matching standard iFCs - we should select the ASs from
 // those iFCs and no more.
 TEST_F(AsChainTest, MatchingStandardiFCs)
@@ -151,6 +151,28 @@ TEST_F(AstaireImpiStoreTest, SetGetFailure)
   delete impi1;
 }
 
+TEST_F(AstaireImpiStoreTest, GetMultiple)
+{
+  ImpiStore::Impi* impi1 = example_impi_digest();
+  Store::Status status = this->impi_store->set_impi(impi1, 0L);
+  ASSERT_EQ(Store::Status::OK, status);
+
+  // Look up the stored IMPI alongside one that isn't in the store, which
+  // comes back as an empty IMPI.
+  std::vector<std::string> impis = {"unknown@example.com", IMPI};
+  std::vector<ImpiStore::Impi*> impi_objs;
+  this->impi_store->get_impis(impis, impi_objs, 0L);
+  ASSERT_EQ(2u, impi_objs.size());
+  ASSERT_TRUE(impi_objs[0] != NULL);
+  EXPECT_EQ("unknown@example.com", impi_objs[0]->impi);
+  EXPECT_TRUE(impi_objs[0]->auth_challenges.empty());
+  expect_impis_equal(impi1, impi_objs[1]);
+
+  delete impi_objs[0];
+  delete impi_objs[1];
+  delete impi1;
+}
+
 TEST_F(AstaireImpiStoreTest, SetDelete)
 {
   ImpiStore::Impi* impi1 = example_impi_digest();
@@ -260,3 +282,115 @@ TEST_F(AstaireImpiStoreTest, ChallengeAKAMissingResponse)
   EXPECT_EQ(0, impi->auth_challenges.size());
   delete impi;
 }
+
+/// Fixture for IMPI store tests that write the compact binary format.
+class AstaireImpiStoreBinaryTest : public AstaireImpiStoreTest
+{
+public:
+  AstaireImpiStoreBinaryTest()
+  {
+    delete impi_store;
+    impi_store = new AstaireImpiStore(local_store,
+                                      AstaireImpiStore::Serialization::BINARY);
+  }
+};
+
+TEST_F(AstaireImpiStoreBinaryTest, SetGet)
+{
+  ImpiStore::Impi* impi1 = example_impi_digest_aka();
+  impi1->auth_challenges[0]->_scscf_uri = "sip:scscf.example.com";
+  impi1->auth_challenges[0]->_timer_id = "timer";
+  Store::Status status = this->impi_store->set_impi(impi1, 0L);
+  ASSERT_EQ(Store::Status::OK, status);
+
+  // Check that the record was written in the binary format.
+  std::string data;
+  uint64_t cas;
+  ASSERT_EQ(Store::Status::OK, local_store->get_data("impi", IMPI, data, cas, 0L));
+  EXPECT_TRUE(AstaireImpiStore::is_binary(data));
+
+  ImpiStore::Impi* impi2 = this->impi_store->get_impi(IMPI, 0L);
+  expect_impis_equal(impi1, impi2);
+  ImpiStore::AuthChallenge* auth_challenge = impi2->get_auth_challenge(NONCE1);
+  ASSERT_TRUE(auth_challenge != NULL);
+  EXPECT_EQ("sip:scscf.example.com", auth_challenge->_scscf_uri);
+  EXPECT_EQ("timer", auth_challenge->_timer_id);
+  EXPECT_EQ(impi1->auth_challenges[0]->_expires, auth_challenge->_expires);
+  delete impi2;
+  delete impi1;
+}
+
+// Test that a store writing one format reads records in the other.
+TEST_F(AstaireImpiStoreBinaryTest, ReadEitherFormat)
+{
+  AstaireImpiStore json_store(local_store);
+
+  ImpiStore::Impi* impi1 = example_impi_digest();
+  ASSERT_EQ(Store::Status::OK, json_store.set_impi(impi1, 0L));
+  ImpiStore::Impi* impi2 = this->impi_store->get_impi(IMPI, 0L);
+  expect_impis_equal(impi1, impi2);
+
+  // Write it back in the binary format (which needs the CAS just read), and
+  // read it through the JSON store.
+  ASSERT_EQ(Store::Status::OK, this->impi_store->set_impi(impi2, 0L));
+  ImpiStore::Impi* impi3 = json_store.get_impi(IMPI, 0L);
+  expect_impis_equal(impi1, impi3);
+
+  delete impi3;
+  delete impi2;
+  delete impi1;
+}
+
+TEST_F(AstaireImpiStoreBinaryTest, IMPICorrupt)
+{
+  // A truncated challenge record.
+  local_store->set_data("impi", IMPI, std::string("\x00\x01\x0A\x05\x08", 5), 0, 30, 0L);
+  ImpiStore::Impi* impi = impi_store->get_impi(IMPI, 0L);
+  ASSERT_TRUE(impi != NULL);
+  EXPECT_TRUE(impi->auth_challenges.empty());
+  delete impi;
+}
+
+TEST_F(AstaireImpiStoreBinaryTest, IMPIUnknownVersion)
+{
+  local_store->set_data("impi", IMPI, std::string("\x00\x02", 2), 0, 30, 0L);
+  ImpiStore::Impi* impi = impi_store->get_impi(IMPI, 0L);
+  ASSERT_TRUE(impi != NULL);
+  EXPECT_TRUE(impi->auth_challenges.empty());
+  delete impi;
+}
+
+// Test that fields that aren't recognised are skipped, and that challenges
+// missing required fields are dropped.
+TEST_F(AstaireImpiStoreBinaryTest, ChallengeFields)
+{
+  CompactEncoding::Writer aka;
+  aka.add_uint(1, ImpiStore::AuthChallenge::Type::AKA);
+  aka.add_bytes(2, NONCE1);
+  aka.add_uint(100, 1);
+  aka.add_bytes(101, "unknown");
+  aka.add_bytes(11, "response");
+  aka.add_int(4, time(NULL) + 30);
+
+  CompactEncoding::Writer digest;
+  digest.add_uint(1, ImpiStore::AuthChallenge::Type::DIGEST);
+  digest.add_bytes(2, NONCE2);
+  digest.add_bytes(8, "example.com");
+  digest.add_int(4, time(NULL) + 30);
+
+  CompactEncoding::Writer record;
+  record.add_raw_byte(0);
+  record.add_raw_byte(1);
+  record.add_record(1, aka);
+  record.add_record(1, digest);
+  record.add_uint(2, 0);
+
+  local_store->set_data("impi", IMPI, record.data(), 0, 30, 0L);
+  ImpiStore::Impi* impi = impi_store->get_impi(IMPI, 0L);
+  ASSERT_TRUE(impi != NULL);
+  ASSERT_EQ(1, impi->auth_challenges.size());
+  EXPECT_EQ(ImpiStore::AuthChallenge::Type::AKA, impi->auth_challenges[0]->_type);
+  EXPECT_EQ(NONCE1, impi->auth_challenges[0]->_nonce);
+  EXPECT_EQ(1u, impi->auth_challenges[0]->_nonce_count);
+  delete impi;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file auth_timeout_batcher_test.cpp UT for AuthTimeoutBatcher.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "auth_timeout_batcher.h"
+#include "basetest.hpp"
+
+using ::testing::_;
+using ::testing::Return;
+using ::testing::SaveArg;
+
+class MockChronosConnection : public ChronosConnection
+{
+public:
+  MockChronosConnection() : ChronosConnection("localhost", "localhost:9888", NULL, NULL) {}
+
+  MOCK_METHOD6(send_post, HTTPCode(std::string& post_identity,
+                                   uint32_t timer_interval,
+                                   const std::string& callback_uri,
+                                   const std::string& opaque_data,
+                                   SAS::TrailId trail,
+                                   const std::map<std::string, uint32_t>& tags));
+};
+
+/// Fixture for AuthTimeoutBatcherTest.  The batcher's interval is long enough
+/// that batches are only sent when the test flushes them.
+class AuthTimeoutBatcherTest : public BaseTest
+{
+public:
+  AuthTimeoutBatcherTest()
+  {
+    _batcher = new AuthTimeoutBatcher(&_chronos, AuthTimeoutBatcher::MAX_INTERVAL_MS);
+  }
+
+  virtual ~AuthTimeoutBatcherTest()
+  {
+    delete _batcher; _batcher = NULL;
+  }
+
+  MockChronosConnection _chronos;
+  AuthTimeoutBatcher* _batcher;
+};
+
+// One timer is set for all the challenges in a batch.
+TEST_F(AuthTimeoutBatcherTest, OneTimerPerBatch)
+{
+  std::string body;
+  EXPECT_CALL(_chronos, send_post(_, AuthTimeoutBatcher::TIMEOUT_S, "/authentication-timeout", _, 1, _))
+    .WillOnce(DoAll(SaveArg<3>(&body), Return(HTTP_OK)));
+
+  _batcher->add_challenge("6505550001@homedomain", "sip:6505550001@homedomain", "nonce1", 1);
+  _batcher->add_challenge("6505550002@homedomain", "sip:6505550002@homedomain", "nonce2", 2);
+  _batcher->flush();
+
+  EXPECT_EQ("{\"challenges\":["
+            "{\"impi\":\"6505550001@homedomain\",\"impu\":\"sip:6505550001@homedomain\",\"nonce\":\"nonce1\"},"
+            "{\"impi\":\"6505550002@homedomain\",\"impu\":\"sip:6505550002@homedomain\",\"nonce\":\"nonce2\"}]}",
+            body);
+
+  // The batch has been sent, so flushing again does nothing.
+  _batcher->flush();
+}
+
+// Challenges that are answered before the batch is sent are dropped from it,
+// and no timer is set for an empty batch.
+TEST_F(AuthTimeoutBatcherTest, AnsweredChallengesRemoved)
+{
+  EXPECT_CALL(_chronos, send_post(_, _, _, _, _, _)).Times(0);
+
+  _batcher->add_challenge("6505550001@homedomain", "sip:6505550001@homedomain", "nonce1", 1);
+  _batcher->remove_challenge("6505550001@homedomain", "nonce1");
+  _batcher->flush();
+}
@@ -4059,3 +4059,118 @@ TYPED_TEST(AuthenticationDigestUEsNonceCountSupportedTest, NonRegChalNotStored)
   // The authentication module lets the request through.
   this->auth_sproutlet_allows_request(true);
 }
+
+//
+// Tests for authenticating non-REGISTER messages against cached credentials.
+//
+
+class AuthenticationCredentialCacheTest :
+  public AuthenticationDigestUEsTest<
+    AuthenticationTestConfig<NonRegisterAuthentication::INITIAL_REQ_FROM_REG_DIGEST_ENDPOINT, true>>
+{
+public:
+  AuthenticationSproutlet* create_auth_sproutlet()
+  {
+    AuthenticationSproutlet* auth_sproutlet =
+      new AuthenticationSproutlet("authentication",
+                                  stack_data.scscf_port,
+                                  "sip:authentication.homedomain",
+                                  { "scscf" },
+                                  "scscf",
+                                  "registrar",
+                                  "homedomain",
+                                  _impi_store,
+                                  _remote_impi_stores,
+                                  _hss_connection,
+                                  FakeChronosConnectionHelper::get_chronos_connection(),
+                                  _acr_factory,
+                                  NonRegisterAuthentication::INITIAL_REQ_FROM_REG_DIGEST_ENDPOINT,
+                                  _analytics,
+                                  &SNMP::FAKE_AUTHENTICATION_STATS_TABLES,
+                                  true,
+                                  300,
+                                  NULL,
+                                  0,
+                                  0,
+                                  0,
+                                  0,
+                                  0,
+                                  300);
+    EXPECT_TRUE(auth_sproutlet->init());
+    return auth_sproutlet;
+  }
+
+  // Flush all the IMPI stores, so that requests can only be authenticated
+  // against the credential cache.
+  void flush_stores()
+  {
+    _local_data_store->flush_all();
+    _remote_data_stores[0]->flush_all();
+  }
+
+  // Send an INVITE responding to a challenge with the specified nonce count.
+  void send_auth_response(std::map<std::string, std::string>& auth_params,
+                          const std::string& nc)
+  {
+    AuthenticationMessage msg("INVITE");
+    msg._auth_hdr = false;
+    msg._proxy_auth_hdr = true;
+    msg._algorithm = "MD5";
+    msg._key = "12345678123456781234567812345678";
+    msg._nonce = auth_params["nonce"];
+    msg._opaque = auth_params["opaque"];
+    msg._nc = nc;
+    msg._cnonce = "8765432187654321";
+    msg._qop = "auth";
+    msg._integ_prot = "ip-assoc-pending";
+    msg._route_uri += ";username=6505550001%40homedomain;nonce=" + _reg_auth_params["nonce"];
+    inject_msg(msg.get());
+  }
+};
+
+// Check that non-REGISTER requests are authenticated against the cached
+// credentials when the challenge is no longer in the store, and that a
+// response with a nonce count that has already been used is rechallenged.
+TEST_F(AuthenticationCredentialCacheTest, AuthAgainstCachedCredentials)
+{
+  pjsip_tx_data* tdata;
+  std::map<std::string, std::string> auth_params;
+
+  // Send in a request with no Proxy-Authorization header, which is challenged.
+  AuthenticationMessage msg3("INVITE");
+  msg3._auth_hdr = false;
+  msg3._proxy_auth_hdr = false;
+  msg3._route_uri += ";username=6505550001%40homedomain;nonce=" + _reg_auth_params["nonce"];
+  inject_msg(msg3.get());
+
+  ASSERT_EQ(2, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+  tdata = current_txdata();
+  RespMatcher(407).matches(tdata->msg);
+  parse_www_authenticate(get_headers(tdata->msg, "Proxy-Authenticate"), auth_params);
+  EXPECT_NE("", auth_params["nonce"]);
+  free_txdata();
+
+  AuthenticationMessage ack("ACK");
+  ack._cseq = msg3._cseq;
+  inject_msg(ack.get());
+
+  // Respond to the challenge, and then send a second request with the next
+  // nonce count.  Both are authenticated against the cached credentials.
+  flush_stores();
+  send_auth_response(auth_params, "00000001");
+  auth_sproutlet_allows_request(true);
+
+  flush_stores();
+  send_auth_response(auth_params, "00000002");
+  auth_sproutlet_allows_request(true);
+
+  // Replay the second request, which is challenged.
+  send_auth_response(auth_params, "00000002");
+  ASSERT_EQ(2, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+  RespMatcher(407).matches(current_txdata()->msg);
+  free_txdata();
+}
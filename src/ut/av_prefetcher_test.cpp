@@ -0,0 +1,121 @@
+/**
+ * @file av_prefetcher_test.cpp UT for AvPrefetcher.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "av_prefetcher.h"
+#include "basetest.hpp"
+#include "fakehssconnection.hpp"
+#include "test_interposer.hpp"
+
+static const std::string IMPI = "6505550001@homedomain";
+static const std::string IMPU = "sip:6505550001@homedomain";
+static const std::string AV_URL = "/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain";
+static const std::string RESYNC_AV_URL = AV_URL + "&resync-auth=auts";
+static const std::string AV = "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}";
+
+/// Fixture for AvPrefetcherTest.  The fake HSS connection has no request
+/// threads, so AVs are prefetched before get_auth_vector returns.
+class AvPrefetcherTest : public BaseTest
+{
+public:
+  AvPrefetcherTest()
+  {
+    _hss = new FakeHSSConnection();
+    _prefetcher = new AvPrefetcher(_hss, 2, 300, 100);
+  }
+
+  virtual ~AvPrefetcherTest()
+  {
+    delete _prefetcher; _prefetcher = NULL;
+    delete _hss; _hss = NULL;
+  }
+
+  HTTPCode get_av(const std::string& resync = "")
+  {
+    rapidjson::Document* av = NULL;
+    HTTPCode rc = _prefetcher->get_auth_vector(IMPI, IMPU, "", resync, "", av, 0);
+    EXPECT_EQ((rc == HTTP_OK), (av != NULL));
+    delete av;
+    return rc;
+  }
+
+  FakeHSSConnection* _hss;
+  AvPrefetcher* _prefetcher;
+};
+
+// The first challenge gets its AV from the HSS and fills the pool, and later
+// challenges are served from the pool.
+TEST_F(AvPrefetcherTest, ServesPrefetchedAvs)
+{
+  _hss->set_result(AV_URL, AV);
+  EXPECT_EQ(HTTP_OK, get_av());
+  EXPECT_EQ(2u, _prefetcher->num_avs(IMPI));
+
+  // Stop the HSS returning AVs.  The pooled AVs are still handed out (and the
+  // failed attempts to top the pool up are discarded).
+  _hss->delete_result(AV_URL);
+  EXPECT_EQ(HTTP_OK, get_av());
+  EXPECT_EQ(HTTP_OK, get_av());
+  EXPECT_EQ(0u, _prefetcher->num_avs(IMPI));
+  EXPECT_EQ(HTTP_NOT_FOUND, get_av());
+}
+
+// Nothing is prefetched if the HSS can't give us an AV.
+TEST_F(AvPrefetcherTest, NoPrefetchOnFailure)
+{
+  EXPECT_EQ(HTTP_NOT_FOUND, get_av());
+  EXPECT_EQ(0u, _prefetcher->num_avs(IMPI));
+}
+
+// A resync discards the pool, and gets the AV from the HSS.
+TEST_F(AvPrefetcherTest, ResyncDiscardsAvs)
+{
+  _hss->set_result(AV_URL, AV);
+  EXPECT_EQ(HTTP_OK, get_av());
+  EXPECT_EQ(2u, _prefetcher->num_avs(IMPI));
+
+  _hss->delete_result(AV_URL);
+  _hss->set_result(RESYNC_AV_URL, AV);
+  EXPECT_EQ(HTTP_OK, get_av("auts"));
+  EXPECT_TRUE(_hss->url_was_requested(RESYNC_AV_URL, ""));
+  EXPECT_EQ(0u, _prefetcher->num_avs(IMPI));
+  EXPECT_EQ(HTTP_NOT_FOUND, get_av());
+}
+
+// AVs are discarded once they have been in the pool for too long.
+TEST_F(AvPrefetcherTest, ExpiredAvsDiscarded)
+{
+  _hss->set_result(AV_URL, AV);
+  EXPECT_EQ(HTTP_OK, get_av());
+  _hss->delete_result(AV_URL);
+
+  cwtest_advance_time_ms(301000);
+  EXPECT_EQ(HTTP_NOT_FOUND, get_av());
+}
+
+// The least recently challenged subscribers' AVs are discarded when the
+// prefetcher is full.
+TEST_F(AvPrefetcherTest, EvictsLeastRecentlyUsed)
+{
+  delete _prefetcher;
+  _prefetcher = new AvPrefetcher(_hss, 1, 300, 1);
+
+  _hss->set_result(AV_URL, AV);
+  EXPECT_EQ(HTTP_OK, get_av());
+  EXPECT_EQ(1u, _prefetcher->num_avs(IMPI));
+
+  rapidjson::Document* av = NULL;
+  _prefetcher->get_auth_vector("other@homedomain", "", "", "", "", av, 0);
+  delete av;
+  EXPECT_EQ(0u, _prefetcher->num_avs(IMPI));
+}
@@ -0,0 +1,162 @@
+/**
+ * @file batch_utils_test.cpp UT for BatchUtils.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "batch_utils.h"
+
+// Test that every item in a batch is processed exactly once.
+TEST(BatchUtilsTest, ProcessesEveryItem)
+{
+  std::vector<std::atomic<int>> calls(1000);
+
+  for (std::atomic<int>& count : calls)
+  {
+    count = 0;
+  }
+
+  BatchUtils::run_in_parallel(calls.size(), [&calls](size_t ii)
+  {
+    calls[ii]++;
+  });
+
+  for (size_t ii = 0; ii < calls.size(); ++ii)
+  {
+    EXPECT_EQ(1, calls[ii]) << "Item: " << ii;
+  }
+}
+
+// Test that empty batches and single item batches are handled, the latter on
+// the calling thread.
+TEST(BatchUtilsTest, SmallBatches)
+{
+  BatchUtils::run_in_parallel(0, [](size_t ii)
+  {
+    ADD_FAILURE() << "Unexpected item: " << ii;
+  });
+
+  std::thread::id thread_id;
+  BatchUtils::run_in_parallel(1, [&thread_id](size_t ii)
+  {
+    thread_id = std::this_thread::get_id();
+  });
+  EXPECT_EQ(std::this_thread::get_id(), thread_id);
+}
+
+// Test that the batch is processed by at most the specified number of
+// threads.
+TEST(BatchUtilsTest, MaxThreads)
+{
+  std::mutex lock;
+  std::set<std::thread::id> thread_ids;
+
+  BatchUtils::run_in_parallel(100, [&lock, &thread_ids](size_t ii)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    thread_ids.insert(std::this_thread::get_id());
+  },
+  2);
+
+  EXPECT_GE(2u, thread_ids.size());
+}
+
+// Test that the local and remote operations run concurrently, and that
+// run_at_sites waits for them all when there's no deadline.
+TEST(BatchUtilsTest, RunAtSites)
+{
+  std::atomic<int> calls(0);
+  std::vector<BatchUtils::SiteOperation> remote_ops;
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    remote_ops.push_back({"site" + std::to_string(ii), [&calls]()
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      calls++;
+    }});
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  bool completed = BatchUtils::run_at_sites([&calls]()
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    calls++;
+  },
+  remote_ops,
+  0);
+  std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+
+  EXPECT_TRUE(completed);
+  EXPECT_EQ(4, calls);
+
+  // The operations overlap, so take much less than the 200ms they would take
+  // one after another.
+  EXPECT_GT(std::chrono::milliseconds(150), elapsed);
+}
+
+// Test that run_at_sites returns at the deadline if a remote operation is
+// slow, and that the operation completes in the background.
+TEST(BatchUtilsTest, RunAtSitesDeadline)
+{
+  std::shared_ptr<std::atomic<bool>> release =
+    std::make_shared<std::atomic<bool>>(false);
+  std::shared_ptr<std::atomic<bool>> slow_done =
+    std::make_shared<std::atomic<bool>>(false);
+  std::atomic<bool> local_done(false);
+  std::vector<BatchUtils::SiteOperation> remote_ops;
+
+  remote_ops.push_back({"fast", []() {}});
+  remote_ops.push_back({"slow", [release, slow_done]()
+  {
+    while (!*release)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    *slow_done = true;
+  }});
+
+  bool completed = BatchUtils::run_at_sites([&local_done]() { local_done = true; },
+                                            remote_ops,
+                                            20);
+
+  EXPECT_FALSE(completed);
+  EXPECT_TRUE(local_done);
+  EXPECT_FALSE(*slow_done);
+
+  *release = true;
+
+  while (!*slow_done)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// Test that run_at_sites just runs the local operation if there are no remote
+// sites.
+TEST(BatchUtilsTest, RunAtSitesLocalOnly)
+{
+  std::thread::id thread_id;
+  EXPECT_TRUE(BatchUtils::run_at_sites([&thread_id]()
+  {
+    thread_id = std::this_thread::get_id();
+  },
+  std::vector<BatchUtils::SiteOperation>(),
+  100));
+  EXPECT_EQ(std::this_thread::get_id(), thread_id);
+}
@@ -11,6 +11,7 @@
 
 #include <string>
 #include <vector>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -161,3 +162,32 @@ TEST_F(BgcfServiceTest, NumberRouteTests)
   ET("+654-(3.21)", "sip3.example.com").test(bgcf_, RoutingType::NUMBER_ROUTE);
   ET("+654!-(321)", "").test(bgcf_, RoutingType::NUMBER_ROUTE);
 }
+
+TEST_F(BgcfServiceTest, CompiledRoutes)
+{
+  // Compile some routes equivalent to those in test_bgcf.json.
+  std::string path = "/tmp/test_bgcf_compiled." + std::to_string(getpid());
+  CompiledRouteTable::Builder builder;
+  builder.add_domain("foreign-domain.example.com",
+                     vector<string>(1, "sip.example.com"));
+  vector<string> multiple_nodes;
+  multiple_nodes.push_back("sip2.example.com");
+  multiple_nodes.push_back("sip3.example.com");
+  builder.add_domain("multiple-nodes.example.com", multiple_nodes);
+  builder.add_number("+123123", vector<string>(1, "sip.example.com"));
+  builder.add_number("+123124", vector<string>(1, "sip2.example.com"));
+  builder.add_number("+654321", vector<string>(1, "sip3.example.com"));
+  std::string error;
+  ASSERT_TRUE(builder.write(path, error)) << error;
+
+  BgcfService bgcf_(path);
+  unlink(path.c_str());
+
+  ET("foreign-domain.example.com", "sip.example.com").test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("multiple-nodes.example.com", "sip2.example.com,sip3.example.com").test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("example.com", "").test(bgcf_, RoutingType::DOMAIN_ROUTE);
+  ET("+123-123", "sip.example.com").test(bgcf_, RoutingType::NUMBER_ROUTE);
+  ET("+123", "sip2.example.com").test(bgcf_, RoutingType::NUMBER_ROUTE);
+  ET("+654-(3.21)", "sip3.example.com").test(bgcf_, RoutingType::NUMBER_ROUTE);
+  ET("123123", "").test(bgcf_, RoutingType::NUMBER_ROUTE);
+}
@@ -0,0 +1,130 @@
+/**
+ * @file chronos_timer_batcher_test.cpp UT for ChronosTimerBatcher.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "chronos_timer_batcher.h"
+#include "mock_chronos_connection.h"
+#include "basetest.hpp"
+
+using ::testing::_;
+using ::testing::Return;
+using ::testing::SetArgReferee;
+using ::testing::DoAll;
+
+/// Fixture for ChronosTimerBatcherTest.  The batcher's interval is long
+/// enough that updates are only sent when the test flushes them.
+class ChronosTimerBatcherTest : public BaseTest
+{
+public:
+  ChronosTimerBatcherTest()
+  {
+    _batcher = new ChronosTimerBatcher(&_chronos, ChronosTimerBatcher::MAX_INTERVAL_MS);
+  }
+
+  virtual ~ChronosTimerBatcherTest()
+  {
+    delete _batcher; _batcher = NULL;
+  }
+
+  HTTPCode put(std::string timer_id, uint32_t interval, const std::string& body)
+  {
+    return _batcher->send_put(timer_id, interval, "/timers", body, 0, _tags);
+  }
+
+  MockChronosConnection _chronos;
+  ChronosTimerBatcher* _batcher;
+  std::map<std::string, uint32_t> _tags;
+};
+
+// Only the last update to each timer in an interval is sent.
+TEST_F(ChronosTimerBatcherTest, UpdatesCoalesced)
+{
+  EXPECT_CALL(_chronos, send_put(_, 300, "/timers", "{\"aor_id\":\"sip:1\",\"n\":2}", _, _))
+    .WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(_chronos, send_put(_, 600, "/timers", "{\"aor_id\":\"sip:2\"}", _, _))
+    .WillOnce(Return(HTTP_OK));
+
+  EXPECT_EQ(HTTP_OK, put("timer1", 300, "{\"aor_id\":\"sip:1\",\"n\":1}"));
+  EXPECT_EQ(HTTP_OK, put("timer2", 600, "{\"aor_id\":\"sip:2\"}"));
+  EXPECT_EQ(HTTP_OK, put("timer1", 300, "{\"aor_id\":\"sip:1\",\"n\":2}"));
+  _batcher->flush();
+
+  // Everything has been sent, so flushing again does nothing.
+  _batcher->flush();
+}
+
+// An update that doesn't change a timer isn't sent, but one that does is.
+TEST_F(ChronosTimerBatcherTest, UnchangedTimerSkipped)
+{
+  EXPECT_CALL(_chronos, send_put(_, 300, _, "{\"aor_id\":\"sip:1\"}", _, _))
+    .WillOnce(Return(HTTP_OK));
+  put("timer1", 300, "{\"aor_id\":\"sip:1\"}");
+  _batcher->flush();
+
+  put("timer1", 300, "{\"aor_id\":\"sip:1\"}");
+  _batcher->flush();
+
+  EXPECT_CALL(_chronos, send_put(_, 3600, _, "{\"aor_id\":\"sip:1\"}", _, _))
+    .WillOnce(Return(HTTP_OK));
+  put("timer1", 3600, "{\"aor_id\":\"sip:1\"}");
+  _batcher->flush();
+}
+
+// An update that fails to send isn't skipped the next time.
+TEST_F(ChronosTimerBatcherTest, FailedUpdateResent)
+{
+  EXPECT_CALL(_chronos, send_put(_, 300, _, _, _, _))
+    .WillOnce(Return(HTTP_SERVER_ERROR))
+    .WillOnce(Return(HTTP_OK));
+  put("timer1", 300, "{\"aor_id\":\"sip:1\"}");
+  _batcher->flush();
+  put("timer1", 300, "{\"aor_id\":\"sip:1\"}");
+  _batcher->flush();
+}
+
+// Deleting a timer replaces any update to it, and the timer isn't
+// remembered.
+TEST_F(ChronosTimerBatcherTest, DeleteReplacesUpdate)
+{
+  EXPECT_CALL(_chronos, send_put(_, _, _, _, _, _)).Times(0);
+  EXPECT_CALL(_chronos, send_delete("timer1", _)).WillOnce(Return(HTTP_OK));
+  put("timer1", 300, "{\"aor_id\":\"sip:1\"}");
+  EXPECT_EQ(HTTP_OK, _batcher->send_delete("timer1", 0));
+  _batcher->flush();
+}
+
+// New timers are created straight away, and an update that doesn't change
+// one isn't sent.
+TEST_F(ChronosTimerBatcherTest, PostSentImmediately)
+{
+  EXPECT_CALL(_chronos, send_post(_, 300, "/timers", "{\"aor_id\":\"sip:1\"}", _, _))
+    .WillOnce(DoAll(SetArgReferee<0>("timer1"), Return(HTTP_OK)));
+
+  std::string timer_id;
+  EXPECT_EQ(HTTP_OK, _batcher->send_post(timer_id, 300, "/timers", "{\"aor_id\":\"sip:1\"}", 0, _tags));
+  EXPECT_EQ("timer1", timer_id);
+
+  EXPECT_CALL(_chronos, send_put(_, _, _, _, _, _)).Times(0);
+  put("timer1", 300, "{\"aor_id\":\"sip:1\"}");
+  _batcher->flush();
+}
+
+// Updates collected since the last flush are sent when the batcher is
+// destroyed.
+TEST_F(ChronosTimerBatcherTest, FlushOnDestroy)
+{
+  EXPECT_CALL(_chronos, send_delete("timer1", _)).WillOnce(Return(HTTP_OK));
+  _batcher->send_delete("timer1", 0);
+  delete _batcher; _batcher = NULL;
+}
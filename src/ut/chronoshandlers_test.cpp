@@ -167,3 +167,52 @@ TEST_F(ChronosAuthTimeoutTest, BadJSON)
   EXPECT_CALL(stack, send_reply(_, 400, _));
   handler->run();
 }
+
+// A timer set for a batch of challenges checks each of them.
+TEST_F(ChronosAuthTimeoutTest, BatchOfChallenges)
+{
+  fake_hss->set_impu_result("sip:6505550231@homedomain", "dereg-auth-timeout", RegDataXMLUtils::STATE_REGISTERED, "", "?private_id=6505550231%40homedomain");
+  ImpiStore::Impi* timed_out_impi = new ImpiStore::Impi("6505550231@homedomain");
+  ImpiStore::DigestAuthChallenge* auth_challenge = new ImpiStore::DigestAuthChallenge("abcdef", "example.com", "auth", "ha1", time(NULL) + 30);
+  auth_challenge->_correlator = "abcde";
+  auth_challenge->_scscf_uri = "sip:scscf.sprout.homedomain:5058;transport=TCP";
+  timed_out_impi->auth_challenges.push_back(auth_challenge);
+
+  ImpiStore::Impi* answered_impi = new ImpiStore::Impi("test@example.com");
+  auth_challenge = new ImpiStore::DigestAuthChallenge("ghijkl", "example.com", "auth", "ha1", time(NULL) + 30);
+  auth_challenge->_nonce_count++;
+  answered_impi->auth_challenges.push_back(auth_challenge);
+
+  EXPECT_CALL(*store, get_impi("6505550231@homedomain", _, true)).WillOnce(Return(timed_out_impi));
+  EXPECT_CALL(*store, get_impi("test@example.com", _, true)).WillOnce(Return(answered_impi));
+
+  std::string body = "{\"challenges\": ["
+                     "{\"impu\": \"sip:6505550231@homedomain\", \"impi\": \"6505550231@homedomain\", \"nonce\": \"abcdef\"},"
+                     "{\"impu\": \"sip:test@example.com\", \"impi\": \"test@example.com\", \"nonce\": \"ghijkl\"}]}";
+  build_timeout_request(body, htp_method_POST);
+
+  EXPECT_CALL(stack, send_reply(_, 200, _));
+  handler->run();
+
+  ASSERT_TRUE(fake_hss->url_was_requested("/impu/sip%3A6505550231%40homedomain/reg-data?private_id=6505550231%40homedomain", "{\"reqtype\": \"dereg-auth-timeout\", \"server_name\": \"sip:scscf.sprout.homedomain:5058;transport=TCP\"}"));
+}
+
+// A batch that includes a badly formed challenge is rejected, though the
+// other challenges are still checked.
+TEST_F(ChronosAuthTimeoutTest, BatchWithBadChallenge)
+{
+  ImpiStore::Impi* impi = new ImpiStore::Impi("test@example.com");
+  ImpiStore::DigestAuthChallenge* auth_challenge = new ImpiStore::DigestAuthChallenge("abcdef", "example.com", "auth", "ha1", time(NULL) + 30);
+  auth_challenge->_nonce_count++;
+  impi->auth_challenges.push_back(auth_challenge);
+
+  EXPECT_CALL(*store, get_impi("test@example.com", _, true)).WillOnce(Return(impi));
+
+  std::string body = "{\"challenges\": ["
+                     "{\"impi\": \"test@example.com\", \"nonce\": \"abcdef\"},"
+                     "{\"impu\": \"sip:test@example.com\", \"impi\": \"test@example.com\", \"nonce\": \"abcdef\"}]}";
+  build_timeout_request(body, htp_method_POST);
+
+  EXPECT_CALL(stack, send_reply(_, 400, _));
+  handler->run();
+}
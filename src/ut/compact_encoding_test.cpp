@@ -0,0 +1,134 @@
+/**
+ * @file compact_encoding_test.cpp UT for the compact binary encoding.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "compact_encoding.h"
+
+using namespace CompactEncoding;
+
+// Test that fields of each type are read back as written.
+TEST(CompactEncodingTest, RoundTrip)
+{
+  Writer nested;
+  nested.add_uint(1, 7);
+
+  Writer writer;
+  writer.add_raw_byte(0xAB);
+  writer.add_uint(1, 0);
+  writer.add_uint(2, 300);
+  writer.add_uint(3, UINT64_MAX);
+  writer.add_int(4, -1);
+  writer.add_int(5, INT64_MIN);
+  writer.add_bytes(6, "hello");
+  writer.add_bytes(1000, "");
+  writer.add_record(7, nested);
+
+  Reader reader(writer.data());
+  uint8_t raw;
+  uint32_t tag;
+  WireType type;
+  uint64_t uint_value;
+  std::string bytes_value;
+
+  ASSERT_TRUE(reader.read_raw_byte(raw));
+  EXPECT_EQ(0xAB, raw);
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(1u, tag);
+  EXPECT_EQ(VARINT, type);
+  EXPECT_EQ(0u, uint_value);
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(2u, tag);
+  EXPECT_EQ(300u, uint_value);
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(3u, tag);
+  EXPECT_EQ(UINT64_MAX, uint_value);
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(4u, tag);
+  EXPECT_EQ(-1, Reader::to_int(uint_value));
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(5u, tag);
+  EXPECT_EQ(INT64_MIN, Reader::to_int(uint_value));
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(6u, tag);
+  EXPECT_EQ(BYTES, type);
+  EXPECT_EQ("hello", bytes_value);
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(1000u, tag);
+  EXPECT_EQ("", bytes_value);
+
+  ASSERT_TRUE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_EQ(7u, tag);
+  EXPECT_EQ(nested.data(), bytes_value);
+
+  EXPECT_FALSE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_FALSE(reader.error());
+}
+
+// Test that small values are encoded in a single byte.
+TEST(CompactEncodingTest, Size)
+{
+  Writer writer;
+  writer.add_uint(15, 127);
+  EXPECT_EQ(2u, writer.data().length());
+  writer.add_int(15, -64);
+  EXPECT_EQ(4u, writer.data().length());
+}
+
+// Test that truncated records are reported as errors.
+TEST(CompactEncodingTest, Truncated)
+{
+  Writer writer;
+  writer.add_uint(1, 300);
+  writer.add_bytes(2, "hello");
+
+  for (size_t length = 1; length < writer.data().length(); ++length)
+  {
+    if (length == 3)
+    {
+      // The first field ends here, so this is a valid record.
+      continue;
+    }
+
+    Reader reader(writer.data().data(), length);
+    uint32_t tag;
+    WireType type;
+    uint64_t uint_value;
+    std::string bytes_value;
+
+    while (reader.next(tag, type, uint_value, bytes_value))
+    {
+    }
+
+    EXPECT_TRUE(reader.error()) << "Length: " << length;
+  }
+}
+
+// Test that fields of an unknown wire type are reported as errors.
+TEST(CompactEncodingTest, UnknownWireType)
+{
+  Reader reader(std::string("\x0D\x01", 2));
+  uint32_t tag;
+  WireType type;
+  uint64_t uint_value;
+  std::string bytes_value;
+
+  EXPECT_FALSE(reader.next(tag, type, uint_value, bytes_value));
+  EXPECT_TRUE(reader.error());
+}
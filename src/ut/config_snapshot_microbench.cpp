@@ -0,0 +1,114 @@
+/**
+ * @file config_snapshot_microbench.cpp Microbenchmarks for ConfigSnapshot.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include "microbench.hpp"
+#include "config_snapshot.h"
+
+typedef std::map<std::string, int> Config;
+
+static std::shared_ptr<Config> make_config()
+{
+  std::shared_ptr<Config> config = std::make_shared<Config>();
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    (*config)[std::to_string(ii)] = ii;
+  }
+  return config;
+}
+
+struct SnapshotConfig
+{
+  SnapshotConfig() { _snapshot.set(make_config()); }
+
+  int lookup(const std::string& key)
+  {
+    std::shared_ptr<const Config> config = _snapshot.get();
+    return config->find(key)->second;
+  }
+
+  ConfigSnapshot<Config> _snapshot;
+};
+
+// Config protected by a reader-writer lock, which is what ConfigSnapshot
+// replaced.
+struct LockedConfig
+{
+  LockedConfig() : _config(*make_config()) {}
+
+  int lookup(const std::string& key)
+  {
+    boost::shared_lock<boost::shared_mutex> read_lock(_lock);
+    return _config.find(key)->second;
+  }
+
+  Config _config;
+  boost::shared_mutex _lock;
+};
+
+// Each iteration looks up one config entry, with the iterations spread
+// across the threads.
+template <class Table>
+static void run_lookups(MicroBench::State& state, Table& table, int num_threads)
+{
+  const std::string key = "50";
+  uint64_t per_thread = state.iterations() / num_threads + 1;
+  std::vector<std::thread> threads;
+
+  // Start the timer, and then run the iterations spread across the threads.
+  state.keep_running();
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    threads.push_back(std::thread([&table, &key, per_thread]()
+    {
+      for (uint64_t jj = 0; jj < per_thread; ++jj)
+      {
+        MicroBench::do_not_optimize(table.lookup(key));
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  while (state.keep_running())
+  {
+  }
+}
+
+#define CONFIG_BENCHMARKS(THREADS)                                             \
+  static void BM_Config_shared_mutex_##THREADS##_threads(MicroBench::State& state) \
+  {                                                                            \
+    LockedConfig table;                                                        \
+    run_lookups(state, table, THREADS);                                        \
+  }                                                                            \
+  MICROBENCH(BM_Config_shared_mutex_##THREADS##_threads);                      \
+                                                                               \
+  static void BM_Config_snapshot_##THREADS##_threads(MicroBench::State& state) \
+  {                                                                            \
+    SnapshotConfig table;                                                      \
+    run_lookups(state, table, THREADS);                                        \
+  }                                                                            \
+  MICROBENCH(BM_Config_snapshot_##THREADS##_threads);
+
+CONFIG_BENCHMARKS(1)
+CONFIG_BENCHMARKS(4)
+CONFIG_BENCHMARKS(16)
+CONFIG_BENCHMARKS(64)
@@ -0,0 +1,70 @@
+/**
+ * @file config_snapshot_test.cpp UT for ConfigSnapshot.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+#include <string>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "config_snapshot.h"
+
+typedef std::map<std::string, int> Config;
+
+// Test that the initial snapshot is empty, and that readers see a new
+// snapshot once it has been published.
+TEST(ConfigSnapshotTest, GetAndSet)
+{
+  ConfigSnapshot<Config> config;
+  EXPECT_TRUE(config.get()->empty());
+
+  std::shared_ptr<Config> new_config = std::make_shared<Config>();
+  (*new_config)["a"] = 1;
+  config.set(new_config);
+
+  EXPECT_EQ(1, config.get()->at("a"));
+}
+
+// Test that a reader holding a snapshot keeps it valid after a new snapshot
+// is published.
+TEST(ConfigSnapshotTest, OldSnapshotStaysValid)
+{
+  ConfigSnapshot<Config> config;
+
+  std::shared_ptr<Config> config1 = std::make_shared<Config>();
+  (*config1)["a"] = 1;
+  config.set(config1);
+  config1.reset();
+
+  std::shared_ptr<const Config> snapshot = config.get();
+
+  std::shared_ptr<Config> config2 = std::make_shared<Config>();
+  (*config2)["a"] = 2;
+  config.set(config2);
+
+  EXPECT_EQ(1, snapshot->at("a"));
+  EXPECT_EQ(2, config.get()->at("a"));
+}
+
+// Test that a snapshot published on one thread is seen by other threads.
+TEST(ConfigSnapshotTest, MultipleThreads)
+{
+  ConfigSnapshot<Config> config;
+  std::shared_ptr<Config> new_config = std::make_shared<Config>();
+  (*new_config)["a"] = 1;
+
+  std::thread reader1([&config]() { EXPECT_TRUE(config.get()->empty()); });
+  reader1.join();
+
+  config.set(new_config);
+
+  std::thread reader2([&config]() { EXPECT_EQ(1, config.get()->at("a")); });
+  reader2.join();
+}
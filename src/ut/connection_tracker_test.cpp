@@ -22,6 +22,7 @@
 #include "faketransport_udp.hpp"
 #include "faketransport_tcp.hpp"
 #include "siptest.hpp"
+#include "test_interposer.hpp"
 
 using namespace std;
 
@@ -172,6 +173,69 @@ TEST_F(ConnectionTrackerTest, QuiesceNewConnections)
 }
 
 
+// With a drain rate, the connection tracker shuts down that many connections
+// each second.
+TEST_F(ConnectionTrackerTest, QuiesceWithDrainRate)
+{
+  ConnectionTracker* conn_tracker = new ConnectionTracker(_conns_quiesced_handler, 1);
+
+  pjsip_transport *tp1 = create_new_tcp_conn();
+  pjsip_transport *tp2 = create_new_tcp_conn();
+  pjsip_transport_add_ref(tp1);
+  pjsip_transport_add_ref(tp2);
+  conn_tracker->connection_active(tp1);
+  conn_tracker->connection_active(tp2);
+
+  // Only one connection is shut down when quiescing starts.
+  conn_tracker->quiesce();
+  EXPECT_NE(tp1->is_shutdown, tp2->is_shutdown);
+  EXPECT_FALSE(_conns_quiesced_handler->quiesced);
+
+  // The other is shut down a second later.
+  cwtest_advance_time_ms(1001); poll();
+  EXPECT_TRUE(tp1->is_shutdown);
+  EXPECT_TRUE(tp2->is_shutdown);
+  EXPECT_FALSE(_conns_quiesced_handler->quiesced);
+
+  pjsip_transport_dec_ref(tp1); poll();
+  pjsip_transport_dec_ref(tp2); poll();
+  EXPECT_TRUE(_conns_quiesced_handler->quiesced);
+
+  delete conn_tracker;
+}
+
+// Unquiescing stops draining, leaving the connections that haven't been shut
+// down yet alone.
+TEST_F(ConnectionTrackerTest, UnquiesceStopsDraining)
+{
+  ConnectionTracker* conn_tracker = new ConnectionTracker(_conns_quiesced_handler, 1);
+
+  pjsip_transport *tp1 = create_new_tcp_conn();
+  pjsip_transport *tp2 = create_new_tcp_conn();
+  pjsip_transport_add_ref(tp1);
+  pjsip_transport_add_ref(tp2);
+  conn_tracker->connection_active(tp1);
+  conn_tracker->connection_active(tp2);
+
+  conn_tracker->quiesce();
+  pjsip_transport* drained = tp1->is_shutdown ? tp1 : tp2;
+  pjsip_transport* remaining = tp1->is_shutdown ? tp2 : tp1;
+  EXPECT_TRUE(drained->is_shutdown);
+  EXPECT_FALSE(remaining->is_shutdown);
+
+  conn_tracker->unquiesce();
+  cwtest_advance_time_ms(1001); poll();
+  EXPECT_FALSE(remaining->is_shutdown);
+
+  // Clean up.
+  pjsip_transport_dec_ref(drained); poll();
+  fake_tcp_init_shutdown((fake_tcp_transport *)remaining, 1);
+  pjsip_transport_dec_ref(remaining); poll();
+  EXPECT_FALSE(_conns_quiesced_handler->quiesced);
+
+  delete conn_tracker;
+}
+
 // Mainline unquiesce testcase involving one connection.
 TEST_F(ConnectionTrackerTest, UnquiesceWithOneConnection)
 {
@@ -493,6 +493,58 @@ TEST_F(ContactFilteringMatchFeatureSetTest, NonMatchingNormalReject)
 
   EXPECT_EQ(NO, match_feature_sets(contact_feature_set, reject_hdr));
 }
+TEST_F(ContactFilteringMatchFeatureSetTest, CompiledPredicateReused)
+{
+  // A compiled predicate gives the same answers however many Contacts it's
+  // matched against.
+  FeaturePredicate accept = compile_feature_predicate(accept_hdr);
+  FeaturePredicate reject = compile_feature_predicate(reject_hdr);
+
+  FeatureSet matching_feature_set;
+  matching_feature_set["+sip.string"] = "<hello>";
+  matching_feature_set["+sip.numeric"] = "#4";
+  matching_feature_set["+sip.boolean"] = "";
+  matching_feature_set["+sip.token"] = "hello";
+  matching_feature_set["+sip.negated"] = "!world";
+
+  FeatureSet non_matching_feature_set;
+  non_matching_feature_set["+sip.numeric"] = "#5";
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    ContactFeatures matching_features(matching_feature_set);
+    EXPECT_EQ(YES, match_accept_predicate(matching_features, accept));
+    EXPECT_EQ(YES, match_reject_predicate(matching_features, reject));
+
+    ContactFeatures non_matching_features(non_matching_feature_set);
+    EXPECT_EQ(NO, match_accept_predicate(non_matching_features, accept));
+    EXPECT_EQ(NO, match_reject_predicate(non_matching_features, reject));
+  }
+}
+TEST_F(ContactFilteringMatchFeatureSetTest, CompiledPredicateInvalidNumeric)
+{
+  // An invalid numeric is only reported when it's matched against.
+  pj_str_t header_name = pj_str((char*)"Accept-Contact");
+  char* header_value = (char*)"*;+sip.numeric=\"#banana\"";
+  pjsip_accept_contact_hdr* hdr = (pjsip_accept_contact_hdr*)
+    pjsip_parse_hdr(pool,
+                    &header_name,
+                    header_value,
+                    strlen(header_value),
+                    NULL);
+  ASSERT_NE((pjsip_accept_contact_hdr*)NULL, hdr);
+  FeaturePredicate accept = compile_feature_predicate(hdr);
+
+  FeatureSet token_feature_set;
+  token_feature_set["+sip.numeric"] = "hello";
+  ContactFeatures token_features(token_feature_set);
+  EXPECT_EQ(NO, match_accept_predicate(token_features, accept));
+
+  FeatureSet numeric_feature_set;
+  numeric_feature_set["+sip.numeric"] = "#4";
+  ContactFeatures numeric_features(numeric_feature_set);
+  EXPECT_THROW(match_accept_predicate(numeric_features, accept), FeatureParseError);
+}
 
 typedef ContactFilteringPrebuiltHeadersFixture ContactFilteringImplicitFiltersTest;
 TEST_F(ContactFilteringImplicitFiltersTest, AddImplicitFilter)
@@ -1043,6 +1095,48 @@ TEST_F(ContactFilteringFullStackTest, LotsOfBindings)
   delete aor_data;
 }
 
+// When there are more bindings than targets, the best ones are picked, and
+// invalid ones among them are replaced by the next best.
+TEST_F(ContactFilteringFullStackTest, PicksBestValidBindings)
+{
+  AoR* aor_data = new AoR(aor);
+
+  for (int ii = 0; ii < 10; ii++)
+  {
+    std::string binding_id = "sip:user" + std::to_string(ii) + "@domain.com";
+    Binding* binding = aor_data->get_binding(binding_id);
+    create_binding(*binding);
+    binding->_priority = ii * 100;
+
+    // The best binding is invalid.
+    if (ii == 9)
+    {
+      binding->_uri = "banana";
+    }
+  }
+
+  msg->line.req.method.name = pj_str((char*)"INVITE");
+
+  TargetList targets;
+
+  Bindings bindings = aor_data->bindings();
+  filter_bindings_to_targets(aor,
+                             bindings,
+                             msg,
+                             pool,
+                             3,
+                             targets,
+                             false,
+                             1);
+
+  ASSERT_EQ((unsigned)3, targets.size());
+  EXPECT_EQ("sip:user8@domain.com", targets[0].binding_id);
+  EXPECT_EQ("sip:user7@domain.com", targets[1].binding_id);
+  EXPECT_EQ("sip:user6@domain.com", targets[2].binding_id);
+
+  delete aor_data;
+}
+
 TEST_F(ContactFilteringFullStackTest, GRUUNoMatch)
 {
   AoR* aor_data = new AoR(aor);
@@ -0,0 +1,44 @@
+/**
+ * @file cpu_affinity_test.cpp UT for CpuAffinity.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "cpu_affinity.h"
+
+// Test parsing lists of single CPUs and ranges.
+TEST(CpuAffinityTest, ParseCpuList)
+{
+  std::vector<int> cpus;
+
+  EXPECT_TRUE(CpuAffinity::parse_cpu_list("3", cpus));
+  EXPECT_EQ(std::vector<int>({3}), cpus);
+
+  EXPECT_TRUE(CpuAffinity::parse_cpu_list("0-3,8,10-11", cpus));
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 8, 10, 11}), cpus);
+
+  // The CPUs are sorted, and duplicates removed.
+  EXPECT_TRUE(CpuAffinity::parse_cpu_list("6-7,2,5-6", cpus));
+  EXPECT_EQ(std::vector<int>({2, 5, 6, 7}), cpus);
+}
+
+// Test that invalid lists are rejected.
+TEST(CpuAffinityTest, ParseInvalidCpuList)
+{
+  std::vector<int> cpus;
+
+  EXPECT_FALSE(CpuAffinity::parse_cpu_list("", cpus));
+  EXPECT_FALSE(CpuAffinity::parse_cpu_list("a", cpus));
+  EXPECT_FALSE(CpuAffinity::parse_cpu_list("1-", cpus));
+  EXPECT_FALSE(CpuAffinity::parse_cpu_list("-1", cpus));
+  EXPECT_FALSE(CpuAffinity::parse_cpu_list("4-2", cpus));
+  EXPECT_FALSE(CpuAffinity::parse_cpu_list("1,2x", cpus));
+  EXPECT_FALSE(CpuAffinity::parse_cpu_list("100000", cpus));
+}
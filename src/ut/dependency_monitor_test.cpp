@@ -0,0 +1,84 @@
+/**
+ * @file dependency_monitor_test.cpp UT for DependencyMonitor.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "dependency_monitor.h"
+
+// Counts how many of 10000 requests needing the dependencies are admitted.
+static int count_admitted(DependencyMonitor& monitor,
+                          DependencyMonitor::Dependencies dependencies)
+{
+  int admitted = 0;
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    if (monitor.admit(dependencies))
+    {
+      ++admitted;
+    }
+  }
+  return admitted;
+}
+
+// Feeds the monitor a number of adjustment periods of samples.
+static void feed(DependencyMonitor& monitor,
+                 DependencyMonitor::Dependency dependency,
+                 unsigned long latency_us,
+                 int periods)
+{
+  for (int ii = 0; ii < periods * DependencyMonitor::ADJUST_PERIOD; ++ii)
+  {
+    monitor.request_complete(dependency, latency_us);
+  }
+}
+
+// Test that nothing is shed while the dependencies are within target.
+TEST(DependencyMonitorTest, WithinTarget)
+{
+  DependencyMonitor monitor(100000);
+  feed(monitor, DependencyMonitor::HSS, 50000, 10);
+
+  EXPECT_EQ(0, monitor.shed_per_mille(DependencyMonitor::HSS));
+  EXPECT_EQ(10000, count_admitted(monitor, DependencyMonitor::mask(DependencyMonitor::HSS)));
+}
+
+// Test that only requests needing a slow dependency are shed, and that
+// shedding stops once it recovers.
+TEST(DependencyMonitorTest, SlowDependency)
+{
+  DependencyMonitor monitor(100000);
+  feed(monitor, DependencyMonitor::HSS, 500000, 1);
+  EXPECT_EQ(50, monitor.shed_per_mille(DependencyMonitor::HSS));
+
+  // The shed rate rises while latency is over the target, up to a limit.
+  feed(monitor, DependencyMonitor::HSS, 500000, 10);
+  EXPECT_EQ(DependencyMonitor::MAX_SHED_PER_MILLE,
+            monitor.shed_per_mille(DependencyMonitor::HSS));
+
+  int admitted = count_admitted(monitor, DependencyMonitor::mask(DependencyMonitor::HSS));
+  EXPECT_GT(admitted, 700);
+  EXPECT_LT(admitted, 1300);
+
+  admitted = count_admitted(monitor,
+                            DependencyMonitor::mask(DependencyMonitor::HSS) |
+                            DependencyMonitor::mask(DependencyMonitor::ENUM));
+  EXPECT_LT(admitted, 1300);
+
+  // Requests that don't need Homestead are not affected.
+  EXPECT_EQ(10000, count_admitted(monitor, DependencyMonitor::mask(DependencyMonitor::ENUM)));
+  EXPECT_EQ(10000, count_admitted(monitor, 0));
+  EXPECT_EQ(0, monitor.shed_per_mille(DependencyMonitor::ENUM));
+
+  // Once the latency recovers the shed rate falls away.
+  feed(monitor, DependencyMonitor::HSS, 1000, 100);
+  EXPECT_EQ(0, monitor.shed_per_mille(DependencyMonitor::HSS));
+  EXPECT_EQ(10000, count_admitted(monitor, DependencyMonitor::mask(DependencyMonitor::HSS)));
+}
@@ -159,3 +159,37 @@ TEST_F(DialogTrackerTest, DialogTrackingWithErrorOnBYE)
   dialog_tracker->on_uas_tsx_complete(&tdata, &tsx, &event, true);
   EXPECT_TRUE(flow->should_quiesce());
 }
+
+TEST_F(DialogTrackerTest, CachedFlowDialogTracking)
+{
+  pjsip_tx_data tdata;
+  pjsip_transaction tsx;
+  tsx.transport = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+
+  // Use a different remote address on the transaction, so the flow can only
+  // be found if it's the one passed in.
+  tsx.addr = addr;
+  pj_sockaddr_set_port(&tsx.addr, 5099);
+  pjsip_msg* msg = pjsip_msg_create(stack_data.pool, PJSIP_REQUEST_MSG);
+  pjsip_to_hdr* to = pjsip_to_hdr_create(stack_data.pool);
+  to->tag = pj_str("");
+  pjsip_msg_insert_first_hdr(msg, (pjsip_hdr*)to);
+  pjsip_event event;
+  tdata.msg = msg;
+
+  tsx.method.id = PJSIP_INVITE_METHOD;
+  tsx.status_code = 200;
+
+  ft->quiesce();
+  EXPECT_TRUE(flow->should_quiesce());
+
+  // Track the start of a dialog on the cached flow, and check that we keep
+  // the flow alive
+  dialog_tracker->on_uas_tsx_complete(&tdata, &tsx, &event, true, flow);
+  EXPECT_FALSE(flow->should_quiesce());
+
+  // Track the end of the dialog, and check that the flow can now be quiesced
+  tsx.method.id = PJSIP_BYE_METHOD;
+  dialog_tracker->on_uas_tsx_complete(&tdata, &tsx, &event, true, flow);
+  EXPECT_TRUE(flow->should_quiesce());
+}
@@ -10,6 +10,7 @@
  */
 
 #include <string>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -200,6 +201,30 @@ TEST_F(JSONEnumServiceTest, StripSeparators)
   ET("+22228899", "tel:+22228899;four-digits-prefix-match;npdi").test(enum_);
 }
 
+// Test that a compiled route table is loaded in place of JSON, and that its
+// regular expressions are compiled and applied on use.
+TEST_F(JSONEnumServiceTest, CompiledPrefixMatching)
+{
+  // Compile number blocks equivalent to test_enum_prefix_matching.json.
+  std::string path = "/tmp/test_enum_compiled." + std::to_string(getpid());
+  CompiledRouteTable::Builder builder;
+  builder.add_number("+22", vector<string>(1, "!(^.*$)!tel:\\1;two-digits-prefix-match;npdi!"));
+  builder.add_number("+2222", vector<string>(1, "!(^.*$)!tel:\\1;four-digits-prefix-match;npdi!"));
+  builder.add_number("+222", vector<string>(1, "!(^.*$)!tel:\\1;three-digits-prefix-match;npdi!"));
+  std::string error;
+  ASSERT_TRUE(builder.write(path, error)) << error;
+
+  JSONEnumService enum_(path);
+  unlink(path.c_str());
+
+  ET("+22238899", "tel:+22238899;three-digits-prefix-match;npdi").test(enum_);
+  ET("+22338899", "tel:+22338899;two-digits-prefix-match;npdi").test(enum_);
+  ET("+22228899", "tel:+22228899;four-digits-prefix-match;npdi").test(enum_);
+  // Look up the same prefix again, to use the already-compiled regex.
+  ET("+22228800", "tel:+22228800;four-digits-prefix-match;npdi").test(enum_);
+  ET("+3", "").test(enum_);
+}
+
 struct ares_naptr_reply basic_naptr_reply[] = {
   {NULL, (unsigned char*)"u", (unsigned char*)"e2u+sip", 
                     (unsigned char*)"!(^.*$)!sip:\\1@ut.cw-ngv.com!", ".", 1, 1}
@@ -440,3 +465,149 @@ TEST_F(DNSEnumServiceTest, PosixRegexTest)
   ET("1234", "").test(enum_);
 }
 
+
+TEST_F(DNSEnumServiceTest, CacheHitTest)
+{
+  // Once we've looked up a number, a second lookup within the TTL is answered
+  // from the cache.
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  FakeDNSResolver::_ttl = 300;
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory(), NULL, false, 100);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 1);
+
+  // Once the TTL has passed we query the server again.
+  cwtest_advance_time_ms(301 * 1000);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+  cwtest_reset_time();
+}
+
+TEST_F(DNSEnumServiceTest, NegativeCacheTest)
+{
+  // Not found responses are cached too.
+  FakeDNSResolver::_ttl = 60;
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory(), NULL, false, 100);
+  ET("1234", "").test(enum_);
+  ET("1234", "").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 1);
+}
+
+TEST_F(DNSEnumServiceTest, NonTerminalRuleCacheTest)
+{
+  // Each step of a lookup with a non-terminal rule is cached separately.
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  struct ares_naptr_reply non_terminal_naptr_reply[] = {
+    {NULL, (unsigned char*)"", (unsigned char*)"e2u+sip", (unsigned char*)"!(^.*$)!1234!", ".", 1, 1}
+  };
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("8.7.6.5.e164.arpa"), (struct ares_naptr_reply*)non_terminal_naptr_reply));
+  FakeDNSResolver::_ttl = 300;
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory(), NULL, false, 100);
+  ET("5678", "sip:5678@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("5678", "sip:5678@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+}
+
+TEST_F(DNSEnumServiceTest, ZeroTTLNotCachedTest)
+{
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  FakeDNSResolver::_ttl = 0;
+  DNSEnumService enum_(_servers, ".e164.arpa", new FakeDNSResolverFactory(), NULL, false, 100);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+}
+
+TEST_F(DNSEnumServiceTest, ServerFailureNotCachedTest)
+{
+  // Server failures must not be cached, so every lookup is reported to the
+  // communication monitor as a failure.
+  AlarmManager am;
+  MockCommunicationMonitor cm_(&am);
+  EXPECT_CALL(cm_, inform_failure(_)).Times(2);
+  DNSEnumService enum_(_servers, ".e164.arpa", new BrokenDNSResolverFactory(), &cm_, false, 100);
+  ET("1234", "").test(enum_);
+  ET("1234", "").test(enum_);
+}
+
+TEST(DNSResolverTest, ParsePositiveTTL)
+{
+  // A response with a question about "a" and two NAPTR records with TTLs of
+  // 300 and 100 (RDATA contents are irrelevant).
+  unsigned char response[] = {
+    0x00, 0x01, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x01, 'a', 0x00, 0x00, 0x23, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x23, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x02, 0xaa, 0xbb,
+    0xc0, 0x0c, 0x00, 0x23, 0x00, 0x01, 0x00, 0x00, 0x00, 0x64, 0x00, 0x02, 0xaa, 0xbb
+  };
+  EXPECT_EQ(100, DNSResolver::parse_ttl(ARES_SUCCESS, response, sizeof(response)));
+
+  // A truncated response can't be cached.
+  EXPECT_EQ(0, DNSResolver::parse_ttl(ARES_SUCCESS, response, sizeof(response) - 1));
+  EXPECT_EQ(0, DNSResolver::parse_ttl(ARES_SUCCESS, NULL, 0));
+}
+
+TEST(DNSResolverTest, ParseNegativeTTL)
+{
+  // An NXDOMAIN response with an SOA record in the authority section with a
+  // TTL of 3600 and a MINIMUM of 60.
+  unsigned char response[] = {
+    0x00, 0x01, 0x81, 0x83, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+    0x01, 'a', 0x00, 0x00, 0x23, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x16,
+    0x00, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x03,
+    0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x3c
+  };
+  EXPECT_EQ(60, DNSResolver::parse_ttl(ARES_ENOTFOUND, response, sizeof(response)));
+
+  // Server failures are never cached.
+  EXPECT_EQ(0, DNSResolver::parse_ttl(ARES_ESERVFAIL, response, sizeof(response)));
+}
+
+/// ENUM service that counts its lookups.
+class CountingEnumService : public EnumService
+{
+public:
+  CountingEnumService() : lookups(0) {}
+
+  std::string lookup_uri_from_user(const std::string& user,
+                                   SAS::TrailId trail) const
+  {
+    lookups++;
+    return "sip:" + user + "@homedomain";
+  }
+
+  mutable int lookups;
+};
+
+class MemoizedEnumServiceTest : public EnumServiceTest {};
+
+// Lookups of the same number on the same trail reuse the first answer, until
+// it expires.
+TEST_F(MemoizedEnumServiceTest, ReusesAnswerOnTrail)
+{
+  CountingEnumService enum_;
+
+  EXPECT_EQ("sip:+1234@homedomain", enum_.memoized_lookup_uri_from_user("+1234", 1));
+  EXPECT_EQ("sip:+1234@homedomain", enum_.memoized_lookup_uri_from_user("+1234", 1));
+  EXPECT_EQ(1, enum_.lookups);
+
+  // Other numbers and other trails are looked up.
+  enum_.memoized_lookup_uri_from_user("+5678", 1);
+  enum_.memoized_lookup_uri_from_user("+1234", 2);
+  EXPECT_EQ(3, enum_.lookups);
+
+  // Lookups without a trail aren't remembered.
+  enum_.memoized_lookup_uri_from_user("+1234", 0);
+  enum_.memoized_lookup_uri_from_user("+1234", 0);
+  EXPECT_EQ(5, enum_.lookups);
+
+  cwtest_advance_time_ms(3000);
+  enum_.memoized_lookup_uri_from_user("+1234", 1);
+  EXPECT_EQ(6, enum_.lookups);
+  cwtest_reset_time();
+}
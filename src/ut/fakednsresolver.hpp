@@ -21,15 +21,17 @@ class FakeDNSResolver : public DNSResolver
 {
 public:
   inline FakeDNSResolver(const std::vector<struct IP46Address>& servers) : DNSResolver(servers) {};
-  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail);
+  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail);
   virtual void free_naptr_reply(struct ares_naptr_reply* naptr_reply) const;
   // Reset the static data.
-  static inline void reset() { _num_calls = 0; _database.clear(); };
+  static inline void reset() { _num_calls = 0; _database.clear(); _ttl = 0; };
 
   // Number of calls that have been made so far.
   static int _num_calls;
   // Database mapping domain names to NAPTR responses.
   static std::map<std::string,struct ares_naptr_reply*> _database;
+  // TTL returned with every response (both positive and negative).
+  static int _ttl;
 
 };
 
@@ -50,7 +52,7 @@ class BrokenDNSResolver : public DNSResolver
 {
 public:
   inline BrokenDNSResolver(const std::vector<struct IP46Address>& servers) : DNSResolver(servers) {};
-  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail);
+  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail);
   virtual void free_naptr_reply(struct ares_naptr_reply* naptr_reply) const;
 };
 
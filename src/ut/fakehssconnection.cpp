@@ -141,7 +141,7 @@ void FakeHSSConnection::delete_result(const std::string& url)
 long FakeHSSConnection::put_for_xml_object(const std::string& path,
                                            std::string body,
                                            const bool& cache_allowed,
-                                           rapidxml::xml_document<>*& root,
+                                           std::shared_ptr<rapidxml::xml_document<>>& root,
                                            SAS::TrailId trail)
 {
   return FakeHSSConnection::get_xml_object(path,
@@ -209,7 +209,7 @@ long FakeHSSConnection::get_json_object(const std::string& path,
 }
 
 long FakeHSSConnection::get_xml_object(const std::string& path,
-                                       rapidxml::xml_document<>*& root,
+                                       std::shared_ptr<rapidxml::xml_document<>>& root,
                                        SAS::TrailId trail)
 {
   return get_xml_object(path, "", root, trail);
@@ -217,7 +217,7 @@ long FakeHSSConnection::get_xml_object(const std::string& path,
 
 long FakeHSSConnection::get_xml_object(const std::string& path,
                                        std::string body,
-                                       rapidxml::xml_document<>*& root,
+                                       std::shared_ptr<rapidxml::xml_document<>>& root,
                                        SAS::TrailId trail)
 {
   _calls.insert(UrlBody(path, body));
@@ -227,21 +227,17 @@ long FakeHSSConnection::get_xml_object(const std::string& path,
 
   if (i != _results.end())
   {
-    root = new rapidxml::xml_document<>;
-    try
+    root = parse_xml(std::string(i->second), path);
+
+    if (root != NULL)
     {
-      root->parse<0>(root->allocate_string(i->second.c_str()));
       http_code = HTTP_OK;
     }
-    catch (rapidxml::parse_error& err)
+    else
     {
-      // report to the user the failure and their locations in the document.
-      TRC_ERROR("Failed to parse Homestead response:\n %s\n %s\n %s",
+      TRC_ERROR("Failed to parse Homestead response:\n %s\n %s",
                 path.c_str(),
-                i->second.c_str(),
-                err.what());
-      delete root;
-      root = NULL;
+                i->second.c_str());
     }
   }
   else
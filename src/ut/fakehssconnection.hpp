@@ -72,9 +72,9 @@ private:
                                 std::string chargingaddrsxml);
 
   long get_json_object(const std::string& path, rapidjson::Document*& object, SAS::TrailId trail);
-  long get_xml_object(const std::string& path, rapidxml::xml_document<>*& root, SAS::TrailId trail);
-  long get_xml_object(const std::string& path, std::string body, rapidxml::xml_document<>*& root, SAS::TrailId trail);
-  long put_for_xml_object(const std::string& path, std::string body, const bool& cache_allowed, rapidxml::xml_document<>*& root, SAS::TrailId trail);
+  long get_xml_object(const std::string& path, std::shared_ptr<rapidxml::xml_document<>>& root, SAS::TrailId trail);
+  long get_xml_object(const std::string& path, std::string body, std::shared_ptr<rapidxml::xml_document<>>& root, SAS::TrailId trail);
+  long put_for_xml_object(const std::string& path, std::string body, const bool& cache_allowed, std::shared_ptr<rapidxml::xml_document<>>& root, SAS::TrailId trail);
 
   // Map of URL/body pair to result
   typedef std::pair<std::string, std::string> UrlBody;
@@ -0,0 +1,152 @@
+/**
+ * @file flight_recorder_test.cpp UT for FlightRecorder.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <limits.h>
+#include <string>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "flight_recorder.h"
+
+class FlightRecorderTest : public ::testing::Test
+{
+public:
+  // Don't limit the records dumped, so the tests don't depend on how many
+  // were dumped earlier in the same second.
+  FlightRecorderTest()
+  {
+    FlightRecorder::set_threshold_us(1000, INT_MAX);
+  }
+
+  virtual ~FlightRecorderTest()
+  {
+    FlightRecorder::set_threshold_us(0);
+  }
+};
+
+// Test that a transaction under the threshold isn't dumped.
+TEST_F(FlightRecorderTest, Fast)
+{
+  FlightRecorder::begin(1);
+  EXPECT_TRUE(FlightRecorder::active());
+  FlightRecorder::mark("dequeued", 10);
+
+  EXPECT_EQ("", FlightRecorder::end(999));
+  EXPECT_FALSE(FlightRecorder::active());
+}
+
+// Test that a slow transaction is dumped with its marks in order.
+TEST_F(FlightRecorderTest, Slow)
+{
+  FlightRecorder::begin(1234);
+  FlightRecorder::mark("dequeued", 10);
+  FlightRecorder::mark("io-start", std::string("hss"));
+  FlightRecorder::mark("tx-response", 200);
+
+  std::string record = FlightRecorder::end(1000);
+  EXPECT_NE(std::string::npos, record.find("trail 1234: 1000us, 3 marks"));
+
+  size_t dequeued = record.find("dequeued 10");
+  size_t io = record.find("io-start hss 0");
+  size_t tx = record.find("tx-response 200");
+  EXPECT_NE(std::string::npos, dequeued);
+  EXPECT_LT(dequeued, io);
+  EXPECT_LT(io, tx);
+}
+
+// Test that a failed transaction is dumped whatever its latency.
+TEST_F(FlightRecorderTest, Failed)
+{
+  FlightRecorder::begin(1);
+  FlightRecorder::error();
+
+  std::string record = FlightRecorder::end(0);
+  EXPECT_NE(std::string::npos, record.find("failed"));
+}
+
+// Test that only the marks of the current transaction are dumped.
+TEST_F(FlightRecorderTest, OnlyCurrentTransaction)
+{
+  FlightRecorder::begin(1);
+  FlightRecorder::mark("first");
+  FlightRecorder::end(0);
+
+  FlightRecorder::begin(2);
+  FlightRecorder::mark("second");
+
+  std::string record = FlightRecorder::end(2000);
+  EXPECT_EQ(std::string::npos, record.find("first"));
+  EXPECT_NE(std::string::npos, record.find("second"));
+}
+
+// Test that a transaction with more marks than fit in the ring keeps the
+// most recent ones.
+TEST_F(FlightRecorderTest, Wrap)
+{
+  FlightRecorder::begin(1);
+  FlightRecorder::mark("earliest");
+  for (int ii = 0; ii < FlightRecorder::RING_SIZE; ++ii)
+  {
+    FlightRecorder::mark("step", ii);
+  }
+
+  std::string record = FlightRecorder::end(2000);
+  EXPECT_NE(std::string::npos, record.find("(1 earliest marks lost)"));
+  EXPECT_EQ(std::string::npos, record.find("earliest 0"));
+  EXPECT_NE(std::string::npos,
+            record.find("step " + std::to_string(FlightRecorder::RING_SIZE - 1)));
+}
+
+// Test that long labels are truncated.
+TEST_F(FlightRecorderTest, LongLabel)
+{
+  FlightRecorder::begin(1);
+  FlightRecorder::mark("sproutlet-request", std::string(100, 'x'));
+
+  std::string record = FlightRecorder::end(2000);
+  EXPECT_NE(std::string::npos,
+            record.find("sproutlet-request " +
+                        std::string(FlightRecorder::LABEL_LENGTH - 19, 'x') + " 0"));
+}
+
+// Test that nothing is recorded when the recorder is off, or on a thread
+// that hasn't begun a transaction.
+TEST_F(FlightRecorderTest, Inactive)
+{
+  std::thread other([]()
+  {
+    EXPECT_FALSE(FlightRecorder::active());
+    FlightRecorder::mark("ignored");
+    FlightRecorder::error();
+    EXPECT_EQ("", FlightRecorder::end(2000));
+  });
+  other.join();
+
+  FlightRecorder::set_threshold_us(0);
+  FlightRecorder::begin(1);
+  EXPECT_FALSE(FlightRecorder::active());
+  EXPECT_EQ("", FlightRecorder::end(2000));
+}
+
+// Test that the number of records dumped each second is limited.
+TEST_F(FlightRecorderTest, RateLimited)
+{
+  FlightRecorder::set_threshold_us(1000);
+  uint64_t suppressed = FlightRecorder::suppressed();
+
+  for (int ii = 0; ii <= 2 * FlightRecorder::MAX_DUMPS_PER_SECOND; ++ii)
+  {
+    FlightRecorder::begin(1);
+    FlightRecorder::end(2000);
+  }
+
+  EXPECT_LT(suppressed, FlightRecorder::suppressed());
+}
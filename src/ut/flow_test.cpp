@@ -17,6 +17,7 @@
 
 #include "stack.h"
 #include "utils.h"
+#include "pjutils.h"
 #include "siptest.hpp"
 #include "dialog_tracker.hpp"
 #include "snmp_scalar.h"
@@ -131,3 +132,78 @@ TEST_F(FlowTest, FlowUnQuiesceMidDialog)
   EXPECT_FALSE(flow->should_quiesce());
 }
 
+
+TEST_F(FlowTest, FindFlowByAddressAndToken)
+{
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+  EXPECT_EQ(flow, ft->find_flow(tp, &addr));
+  EXPECT_EQ(flow, ft->find_flow(flow->token()));
+  EXPECT_EQ(flow, ft->find_create_flow(tp, &addr));
+  EXPECT_TRUE(ft->find_flow("not-a-token") == NULL);
+
+  // The flow is in exactly one shard.
+  std::vector<size_t> occupancy = ft->shard_occupancy();
+  EXPECT_EQ((size_t)FlowTable::NUM_SHARDS, occupancy.size());
+  size_t total = 0;
+  for (size_t ii = 0; ii < occupancy.size(); ++ii)
+  {
+    total += occupancy[ii];
+  }
+  EXPECT_EQ(1u, total);
+}
+
+TEST_F(FlowTest, Identities)
+{
+  pjsip_uri* alice = PJUtils::uri_from_string("sip:alice@example.com", stack_data.pool);
+  pjsip_uri* bob = PJUtils::uri_from_string("sip:bob@example.com", stack_data.pool);
+  pjsip_uri* carol = PJUtils::uri_from_string("sip:carol@example.com", stack_data.pool);
+
+  EXPECT_EQ("", flow->default_identity());
+
+  // Add more identities than are held inline.
+  flow->set_identity(alice, "sip:scscf1.example.com;lr", false, 300);
+  flow->set_identity(bob, "sip:scscf1.example.com;lr", true, 300);
+  flow->set_identity(carol, "sip:scscf2.example.com;lr", true, 300);
+
+  EXPECT_EQ("sip:bob@example.com", flow->default_identity());
+  EXPECT_NE("", flow->asserted_identity(carol));
+  EXPECT_EQ("sip:scscf1.example.com;lr", flow->service_route("sip:alice@example.com"));
+  EXPECT_EQ("sip:scscf2.example.com;lr", flow->service_route("sip:carol@example.com"));
+
+  // Removing the default identity picks another.
+  flow->set_identity(bob, "", true, 0);
+  EXPECT_EQ("sip:carol@example.com", flow->default_identity());
+  EXPECT_EQ("", flow->asserted_identity(bob));
+  EXPECT_EQ("sip:scscf2.example.com;lr", flow->service_route("sip:carol@example.com"));
+
+  flow->set_identity(carol, "", true, 0);
+  EXPECT_EQ("", flow->default_identity());
+  EXPECT_NE("", flow->asserted_identity(alice));
+
+  flow->set_identity(alice, "", false, 0);
+  EXPECT_EQ("", flow->asserted_identity(alice));
+}
+
+TEST_F(FlowTest, IdleTimer)
+{
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+  pj_sockaddr addr2 = addr;
+  addr2.ipv4.sin_port = pj_htons(5061);
+
+  // Leave only the idle timer's reference on the new flow.
+  Flow* flow2 = ft->find_create_flow(tp, &addr2);
+  flow2->dec_ref();
+
+  // Touching the flow part way through the idle timeout (600s) keeps it
+  // alive past the original expiry.
+  int start = ft->wheel_time();
+  ft->process_timers(start + 300);
+  flow2->touch();
+  ft->process_timers(start + 700);
+  EXPECT_EQ(flow2, ft->find_flow(tp, &addr2));
+  flow2->dec_ref();
+
+  // Once it's been idle for the whole timeout, it goes.
+  ft->process_timers(start + 1000);
+  EXPECT_TRUE(ft->find_flow(tp, &addr2) == NULL);
+}
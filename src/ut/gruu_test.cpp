@@ -113,3 +113,22 @@ TEST_F(GRUUTest, NoInstanceIDQuoted)
   create_binding(binding, "");
   ASSERT_EQ("", AoRUtils::pub_gruu_quoted_string(&binding, pool));
 }
+
+TEST_F(GRUUTest, NeedsEscapingQuotedPjStr)
+{
+  std::string aor = "sip:user@domain.com";
+  Binding binding(aor);
+  create_binding(binding, "hel;lo");
+  pj_str_t gruu;
+  ASSERT_TRUE(AoRUtils::pub_gruu_quoted_pj_str(&binding, pool, gruu));
+  ASSERT_EQ("\"sip:user@domain.com;gr=hel%3blo\"", PJUtils::pj_str_to_string(&gruu));
+}
+
+TEST_F(GRUUTest, NoInstanceIDQuotedPjStr)
+{
+  std::string aor = "sip:user@domain.com";
+  Binding binding(aor);
+  create_binding(binding, "");
+  pj_str_t gruu;
+  ASSERT_FALSE(AoRUtils::pub_gruu_quoted_pj_str(&binding, pool, gruu));
+}
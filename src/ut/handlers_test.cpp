@@ -27,6 +27,8 @@
 #include "rapidjson/document.h"
 #include "handlers_test.h"
 #include "aor_test_utils.h"
+#include "stage_latency.h"
+#include "sproutlet_cpu.h"
 
 using namespace std;
 using ::testing::_;
@@ -545,6 +547,79 @@ TEST_F(GetBindingsTest, TwoBindings)
   EXPECT_TRUE(document["bindings"].HasMember("456"));
 }
 
+// Test paging through an IMPU's bindings.
+TEST_F(GetBindingsTest, PagedBindings)
+{
+  std::string aor_id = "sip:6505550231@homedomain";
+  Bindings bindings;
+  bindings["123"] = AoRTestUtils::build_binding(aor_id, time(NULL), "123");
+  bindings["456"] = AoRTestUtils::build_binding(aor_id, time(NULL), "456");
+  bindings["789"] = AoRTestUtils::build_binding(aor_id, time(NULL), "789");
+
+  // Each task deletes the bindings it gets, so take a copy for the second
+  // request.
+  Bindings bindings_copy;
+  for (BindingPair b : bindings)
+  {
+    bindings_copy[b.first] = new Binding(*b.second);
+  }
+
+  // The first page has the first two bindings, and the offset of the next
+  // page.
+  MockHttpStack::Request req(stack,
+                             "/impu/sip%3A6505550231%40homedomain/bindings",
+                             "",
+                             "limit=2");
+  GetBindingsTask::Config config(sm);
+  GetBindingsTask* task = new GetBindingsTask(req, &config, 0);
+
+  EXPECT_CALL(*sm, get_bindings(aor_id, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(bindings),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*stack, send_reply(_, 200, _));
+  task->run();
+
+  rapidjson::Document document;
+  document.Parse(req.content().c_str());
+  EXPECT_EQ(2, document["bindings"].MemberCount());
+  EXPECT_TRUE(document["bindings"].HasMember("123"));
+  EXPECT_TRUE(document["bindings"].HasMember("456"));
+  EXPECT_EQ(2, document["next_offset"].GetInt());
+
+  // The last page has the last binding, and no next page.
+  MockHttpStack::Request last_req(stack,
+                                  "/impu/sip%3A6505550231%40homedomain/bindings",
+                                  "",
+                                  "offset=2&limit=2");
+  task = new GetBindingsTask(last_req, &config, 0);
+
+  EXPECT_CALL(*sm, get_bindings(aor_id, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(bindings_copy),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*stack, send_reply(_, 200, _));
+  task->run();
+
+  rapidjson::Document last_document;
+  last_document.Parse(last_req.content().c_str());
+  EXPECT_EQ(1, last_document["bindings"].MemberCount());
+  EXPECT_TRUE(last_document["bindings"].HasMember("789"));
+  EXPECT_FALSE(last_document.HasMember("next_offset"));
+}
+
+// Test that a request with an invalid page parameter is rejected.
+TEST_F(GetBindingsTest, BadPageParams)
+{
+  MockHttpStack::Request req(stack,
+                             "/impu/sip%3A6505550231%40homedomain/bindings",
+                             "",
+                             "limit=lots");
+  GetBindingsTask::Config config(sm);
+  GetBindingsTask* task = new GetBindingsTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 400, _));
+  task->run();
+}
+
 // Test the flow when subscriber manager returns a server error.
 TEST_F(GetBindingsTest, SubscriberManagerFail)
 {
@@ -898,7 +973,7 @@ TEST_F(PushProfileTaskTest, MainlineTest)
 
   build_pushprofile_request(body, default_uri);
 
-  EXPECT_CALL(*sm, update_associated_uris(default_uri, _, _)).WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(*sm, update_service_profile(default_uri, _, _)).WillOnce(Return(HTTP_OK));
   EXPECT_CALL(*stack, send_reply(_, 200, _));
   task->run();
 }
@@ -1007,9 +1082,109 @@ TEST_F(PushProfileTaskTest, SubscriberManagerFails)
 
   build_pushprofile_request(body, default_uri);
 
-  EXPECT_CALL(*sm, update_associated_uris(default_uri, _, _))
+  EXPECT_CALL(*sm, update_service_profile(default_uri, _, _))
     .WillOnce(Return(HTTP_SERVER_ERROR));
   EXPECT_CALL(*stack, send_reply(_, 500, _));
   task->run();
 }
 
+
+//
+// Test reporting the per-stage latencies.
+//
+
+class GetStageLatenciesTest : public TestWithMockSM
+{
+};
+
+// Test that the latencies of each stage are reported.
+TEST_F(GetStageLatenciesTest, Stages)
+{
+  StageLatency::stage("ut:handler")->record(100);
+
+  MockHttpStack::Request req(stack, "/latency-stages", "");
+  GetStageLatenciesTask::Config config;
+  GetStageLatenciesTask* task = new GetStageLatenciesTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 200, _));
+  task->run();
+
+  // The document should be of the form {"stages":{"<name>":{...}, ...}}
+  rapidjson::Document document;
+  document.Parse(req.content().c_str());
+  ASSERT_TRUE(document.IsObject());
+  ASSERT_TRUE(document.HasMember("stages"));
+  ASSERT_TRUE(document["stages"].HasMember("ut:handler"));
+
+  const rapidjson::Value& stage = document["stages"]["ut:handler"];
+  EXPECT_EQ(1u, stage["count"].GetUint64());
+  EXPECT_EQ(100u, stage["mean_us"].GetUint64());
+  EXPECT_EQ(100u, stage["p99_us"].GetUint64());
+  EXPECT_EQ(100u, stage["max_us"].GetUint64());
+}
+
+// Test that a request with PUT method gets rejected.
+TEST_F(GetStageLatenciesTest, BadMethod)
+{
+  MockHttpStack::Request req(stack,
+                             "/latency-stages",
+                             "",
+                             "",
+                             "",
+                             htp_method_PUT);
+  GetStageLatenciesTask::Config config;
+  GetStageLatenciesTask* task = new GetStageLatenciesTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 405, _));
+  task->run();
+}
+
+class GetSproutletCpuTest : public TestWithMockSM
+{
+};
+
+// Test that the CPU time of each Sproutlet is reported.
+TEST_F(GetSproutletCpuTest, Sproutlets)
+{
+  SproutletCpu::account("ut-handler")->record(3000000);
+  SproutletCpu::account("ut-handler")->record(1000000);
+
+  MockHttpStack::Request req(stack, "/sproutlet-cpu", "");
+  GetSproutletCpuTask::Config config;
+  GetSproutletCpuTask* task = new GetSproutletCpuTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 200, _));
+  task->run();
+
+  // The document should be of the form {"sproutlets":{"<name>":{...}, ...}}
+  rapidjson::Document document;
+  document.Parse(req.content().c_str());
+  ASSERT_TRUE(document.IsObject());
+  ASSERT_TRUE(document.HasMember("sproutlets"));
+  ASSERT_TRUE(document["sproutlets"].HasMember("ut-handler"));
+
+  const rapidjson::Value& sproutlet = document["sproutlets"]["ut-handler"];
+  EXPECT_GE(sproutlet["snmp_index"].GetInt(), 1);
+  EXPECT_EQ(2u, sproutlet["callbacks"].GetUint64());
+  EXPECT_EQ(4000u, sproutlet["total_us"].GetUint64());
+  EXPECT_EQ(2000u, sproutlet["mean_us"].GetUint64());
+  EXPECT_EQ(3000u, sproutlet["max_us"].GetUint64());
+  EXPECT_EQ(0, sproutlet["busy_workers"].GetInt());
+  EXPECT_EQ(0u, sproutlet["bulkhead_rejected"].GetUint64());
+}
+
+// Test that a request with PUT method gets rejected.
+TEST_F(GetSproutletCpuTest, BadMethod)
+{
+  MockHttpStack::Request req(stack,
+                             "/sproutlet-cpu",
+                             "",
+                             "",
+                             "",
+                             htp_method_PUT);
+  GetSproutletCpuTask::Config config;
+  GetSproutletCpuTask* task = new GetSproutletCpuTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 405, _));
+  task->run();
+}
@@ -0,0 +1,72 @@
+/**
+ * @file header_index_microbench.cpp Microbenchmarks for HeaderIndex.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "microbench.hpp"
+#include "constants.h"
+#include "header_index.h"
+
+static const std::string INVITE =
+  "INVITE sip:6505550001@homedomain SIP/2.0\r\n"
+  "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+  "Max-Forwards: 68\r\n"
+  "To: <sip:6505550001@homedomain>\r\n"
+  "From: <sip:6505550000@homedomain>;tag=12345678\r\n"
+  "Call-ID: 0123456789abcdef-10.83.18.38\r\n"
+  "CSeq: 1 INVITE\r\n"
+  "P-Asserted-Identity: <sip:6505550000@homedomain>\r\n"
+  "p-access-network-info: 3GPP-UTRAN-TDD; utran-cell-id-3gpp=0123\r\n"
+  "P-Asserted-Identity: <tel:6505550000>\r\n"
+  "P-Charging-Vector: icid-value=1234bc9876e;orig-ioi=homedomain\r\n"
+  "User-Agent: Clearwater UT\r\n"
+  "Content-Length: 0\r\n"
+  "\r\n";
+
+// The headers the S-CSCF looks for in a request, some present and some not.
+static const pj_str_t* HEADER_NAMES[] = {&STR_P_ASSERTED_IDENTITY,
+                                         &STR_P_SERVED_USER,
+                                         &STR_P_C_V,
+                                         &STR_P_C_F_A,
+                                         &STR_SESSION_EXPIRES,
+                                         &STR_P_A_N_I};
+
+// Each iteration looks for each header in the message.
+static void BM_FindHeaders_pjsip(MicroBench::State& state)
+{
+  pjsip_msg* msg = MicroBench::parse_msg(INVITE, MicroBench::pool());
+
+  while (state.keep_running())
+  {
+    for (const pj_str_t* name : HEADER_NAMES)
+    {
+      MicroBench::do_not_optimize(pjsip_msg_find_hdr_by_name(msg, name, NULL));
+    }
+  }
+}
+MICROBENCH(BM_FindHeaders_pjsip);
+
+// As above, but building an index of the message first, so this includes the
+// cost of the index.
+static void BM_FindHeaders_index(MicroBench::State& state)
+{
+  pjsip_msg* msg = MicroBench::parse_msg(INVITE, MicroBench::pool());
+
+  while (state.keep_running())
+  {
+    HeaderIndex hdrs(msg);
+    for (const pj_str_t* name : HEADER_NAMES)
+    {
+      MicroBench::do_not_optimize(hdrs.find(name));
+    }
+  }
+}
+MICROBENCH(BM_FindHeaders_index);
@@ -0,0 +1,148 @@
+/**
+ * @file header_index_test.cpp UT for HeaderIndex.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "constants.h"
+#include "custom_headers.h"
+#include "header_index.h"
+#include "pjutils.h"
+
+using namespace std;
+
+static const pj_str_t STR_USER_AGENT = pj_str((char*)"User-Agent");
+
+class HeaderIndexTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  HeaderIndexTest() : SipTest(NULL)
+  {
+  }
+
+  pjsip_msg* parse_test_msg()
+  {
+    string msg =
+      "INVITE sip:6505550001@homedomain SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+      "Max-Forwards: 68\r\n"
+      "To: <sip:6505550001@homedomain>\r\n"
+      "From: <sip:6505550000@homedomain>;tag=12345678\r\n"
+      "Call-ID: 0123456789abcdef-10.83.18.38\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "P-Asserted-Identity: <sip:6505550000@homedomain>\r\n"
+      "p-access-network-info: 3GPP-UTRAN-TDD; utran-cell-id-3gpp=0123\r\n"
+      "P-Asserted-Identity: <tel:6505550000>\r\n"
+      "P-Charging-Vector: icid-value=1234bc9876e;orig-ioi=homedomain\r\n"
+      "User-Agent: Clearwater UT\r\n"
+      "Content-Length: 0\r\n"
+      "\r\n";
+    return parse_msg(msg);
+  }
+};
+
+// Test that the index finds the same headers as PJSIP.
+TEST_F(HeaderIndexTest, Find)
+{
+  pjsip_msg* msg = parse_test_msg();
+  HeaderIndex hdrs(msg);
+
+  EXPECT_EQ(msg, hdrs.msg());
+
+  const pj_str_t* names[] = {&STR_P_ASSERTED_IDENTITY,
+                             &STR_P_A_N_I,
+                             &STR_P_C_V,
+                             &STR_P_SERVED_USER,
+                             &STR_USER_AGENT};
+  for (const pj_str_t* name : names)
+  {
+    EXPECT_EQ(pjsip_msg_find_hdr_by_name(msg, name, NULL), hdrs.find(name));
+  }
+
+  EXPECT_TRUE(hdrs.find(&STR_P_A_N_I) != NULL);
+  EXPECT_TRUE(hdrs.find(&STR_P_SERVED_USER) == NULL);
+  EXPECT_TRUE(HeaderIndex::is_indexed(&STR_P_ASSERTED_IDENTITY));
+  EXPECT_FALSE(HeaderIndex::is_indexed(&STR_USER_AGENT));
+
+  // Both P-Asserted-Identity headers are found.
+  pjsip_hdr* pai = hdrs.find(&STR_P_ASSERTED_IDENTITY);
+  ASSERT_TRUE(pai != NULL);
+  pjsip_hdr* pai2 = hdrs.find_next(&STR_P_ASSERTED_IDENTITY, pai);
+  ASSERT_TRUE(pai2 != NULL);
+  EXPECT_TRUE(hdrs.find_next(&STR_P_ASSERTED_IDENTITY, pai2) == NULL);
+}
+
+// Test that changing the headers through the index keeps it consistent.
+TEST_F(HeaderIndexTest, Mutate)
+{
+  pjsip_msg* msg = parse_test_msg();
+  HeaderIndex hdrs(msg);
+
+  // Removing the first P-Asserted-Identity makes the second one the first.
+  pjsip_hdr* pai = hdrs.find(&STR_P_ASSERTED_IDENTITY);
+  pjsip_hdr* pai2 = hdrs.find_next(&STR_P_ASSERTED_IDENTITY, pai);
+  hdrs.remove(pai);
+  EXPECT_EQ(pai2, hdrs.find(&STR_P_ASSERTED_IDENTITY));
+  hdrs.remove(pai2);
+  EXPECT_TRUE(hdrs.find(&STR_P_ASSERTED_IDENTITY) == NULL);
+  EXPECT_TRUE(pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL) == NULL);
+
+  // Adding headers.
+  pjsip_hdr* psu = (pjsip_hdr*)identity_hdr_create(stack_data.pool, STR_P_SERVED_USER);
+  hdrs.add(psu);
+  EXPECT_EQ(psu, hdrs.find(&STR_P_SERVED_USER));
+
+  pjsip_hdr* psu2 = (pjsip_hdr*)identity_hdr_create(stack_data.pool, STR_P_SERVED_USER);
+  hdrs.add(psu2);
+  EXPECT_EQ(psu, hdrs.find(&STR_P_SERVED_USER));
+
+  pjsip_hdr* psu3 = (pjsip_hdr*)identity_hdr_create(stack_data.pool, STR_P_SERVED_USER);
+  hdrs.insert_first(psu3);
+  EXPECT_EQ(psu3, hdrs.find(&STR_P_SERVED_USER));
+  EXPECT_EQ(pjsip_msg_find_hdr_by_name(msg, &STR_P_SERVED_USER, NULL),
+            hdrs.find(&STR_P_SERVED_USER));
+}
+
+// Test that the index parses lazily parsed headers when they're found.
+TEST_F(HeaderIndexTest, LazyHeaders)
+{
+  register_custom_headers(true);
+  pjsip_msg* msg = parse_test_msg();
+  register_custom_headers(false);
+
+  HeaderIndex hdrs(msg);
+  EXPECT_TRUE(is_lazy_hdr((pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_P_C_V, NULL)));
+
+  pjsip_p_c_v_hdr* pcv = (pjsip_p_c_v_hdr*)hdrs.find(&STR_P_C_V);
+  ASSERT_TRUE(pcv != NULL);
+  EXPECT_FALSE(is_lazy_hdr((pjsip_hdr*)pcv));
+  EXPECT_EQ("1234bc9876e", PJUtils::pj_str_to_string(&pcv->icid));
+  EXPECT_EQ(pcv, pjsip_msg_find_hdr_by_name(msg, &STR_P_C_V, NULL));
+  EXPECT_EQ(pcv, hdrs.find(&STR_P_C_V));
+
+  // Finding the second P-Asserted-Identity parses it.
+  pjsip_hdr* pai = hdrs.find(&STR_P_ASSERTED_IDENTITY);
+  ASSERT_TRUE(pai != NULL);
+  pjsip_hdr* pai2 = hdrs.find_next(&STR_P_ASSERTED_IDENTITY, pai);
+  ASSERT_TRUE(pai2 != NULL);
+  EXPECT_FALSE(is_lazy_hdr(pai2));
+}
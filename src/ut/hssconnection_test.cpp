@@ -14,17 +14,24 @@
 
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
 #include "gtest/gtest.h"
 
 #include "utils.h"
 #include "sas.h"
 #include "fakehttpresolver.hpp"
 #include "hssconnection.h"
+#include "sprout_xml_utils.h"
 #include "basetest.hpp"
 #include "fakecurl.hpp"
 #include "fakesnmp.hpp"
 #include "sprout_alarmdefinition.h"
 #include "mock_sifc_parser.h"
+#include "test_interposer.hpp"
 
 using namespace std;
 using testing::SetArgReferee;
@@ -1437,3 +1444,407 @@ TEST_F(HssWithSifcTest, ComplexSifcIfcMix)
   EXPECT_THAT(expected_priorities, UnorderedElementsAreArray(priorities));
 }
 
+
+/// Builds registration data for an implicit registration set containing
+/// pubid60 and pubid61, in the specified state.
+static std::string irs_reg_data(const std::string& state)
+{
+  return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+         "<ClearwaterRegData>"
+           "<RegistrationState>" + state + "</RegistrationState>"
+           "<IMSSubscription>"
+             "<ServiceProfile>"
+               "<PublicIdentity>"
+                 "<Identity>pubid60</Identity>"
+               "</PublicIdentity>"
+               "<PublicIdentity>"
+                 "<Identity>pubid61</Identity>"
+               "</PublicIdentity>"
+             "</ServiceProfile>"
+           "</IMSSubscription>"
+         "</ClearwaterRegData>";
+}
+
+/// Fixture for HssConnectionCacheTest - an HSS connection with the
+/// registration data cache enabled.
+class HssConnectionCacheTest : public BaseTest
+{
+  FakeHttpResolver _resolver;
+  AlarmManager _am;
+  CommunicationMonitor _cm;
+  HSSConnection _hss;
+
+  HssConnectionCacheTest() :
+    _resolver("10.42.42.42"),
+    _cm(new Alarm(&_am, "sprout", AlarmDef::SPROUT_HOMESTEAD_COMM_ERROR, AlarmDef::CRITICAL), "sprout", "homestead"),
+    _hss("narcissus",
+         &_resolver,
+         NULL,
+         &SNMP::FAKE_IP_COUNT_TABLE,
+         &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+         &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+         &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+         &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+         &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+         &_cm,
+         NULL,
+         500,
+         300,
+         100)
+  {
+    fakecurl_responses.clear();
+    fakecurl_responses_with_body.clear();
+    set_response("pubid60", "call", irs_reg_data("REGISTERED"));
+  }
+
+  virtual ~HssConnectionCacheTest()
+  {
+    fakecurl_responses.clear();
+    fakecurl_responses_with_body.clear();
+    cwtest_reset_time();
+  }
+
+  // Sets Homestead's response to a PUT (or, if req_type is empty, a GET) for
+  // the IMPU.
+  void set_response(const std::string& impu,
+                    const std::string& req_type,
+                    const std::string& response)
+  {
+    std::string body = req_type.empty() ? "" :
+      "{\"reqtype\": \"" + req_type + "\", \"server_name\": \"server_name\"}";
+    fakecurl_responses_with_body[std::make_pair(
+                      "http://10.42.42.42:80/impu/" + impu + "/reg-data",
+                      body)] = response;
+  }
+
+  // Makes a request of the specified type, returning the registration state.
+  std::string update(const std::string& impu,
+                     const std::string& req_type,
+                     bool cache_allowed = true)
+  {
+    HSSConnection::irs_query irs_query;
+    irs_query._public_id = impu;
+    irs_query._req_type = req_type;
+    irs_query._server_name = "server_name";
+    irs_query._cache_allowed = cache_allowed;
+    HSSConnection::irs_info irs_info;
+
+    EXPECT_EQ(HTTP_OK, _hss.update_registration_state(irs_query, irs_info, 0));
+    return irs_info._regstate;
+  }
+
+  // Pushes a profile for pubid60's implicit registration set.
+  void push(const std::string& service_profiles)
+  {
+    std::string xml = "<IMSSubscription>" + service_profiles + "</IMSSubscription>";
+    PushedProfile profile;
+    profile.doc.reset(new rapidxml::xml_document<>);
+    profile.doc->parse<0>(profile.doc->allocate_string(xml.c_str()));
+    rapidxml::xml_node<>* imss =
+                 profile.doc->first_node(RegDataXMLUtils::IMS_SUBSCRIPTION);
+    EXPECT_TRUE(SproutXmlUtils::get_uris_from_ims_subscription(imss,
+                                                               profile.associated_uris,
+                                                               0));
+    EXPECT_TRUE(ProfileDiff::digest(imss, profile.digests));
+    _hss.update_cached_service_profiles("pubid60", profile, 0);
+  }
+};
+
+// Test that calls use cached data, for any IMPU in the implicit registration
+// set, until it expires.
+TEST_F(HssConnectionCacheTest, CallUsesCache)
+{
+  EXPECT_EQ("REGISTERED", update("pubid60", HSSConnection::CALL));
+
+  // Change Homestead's responses - the cached data is still used.
+  set_response("pubid60", "call", irs_reg_data("UNREGISTERED"));
+  set_response("pubid61", "call", irs_reg_data("UNREGISTERED"));
+  set_response("pubid61", "", irs_reg_data("UNREGISTERED"));
+  EXPECT_EQ("REGISTERED", update("pubid60", HSSConnection::CALL));
+  EXPECT_EQ("REGISTERED", update("pubid61", HSSConnection::CALL));
+
+  HSSConnection::irs_info irs_info;
+  EXPECT_EQ(HTTP_OK, _hss.get_registration_data("pubid61", irs_info, 0));
+  EXPECT_EQ("REGISTERED", irs_info._regstate);
+  EXPECT_EQ(2u, irs_info._associated_uris.get_all_uris().size());
+
+  // Requests that mustn't use Homestead's cache don't use ours either.
+  EXPECT_EQ("UNREGISTERED", update("pubid61", HSSConnection::CALL, false));
+
+  // Once the data expires, Homestead is queried again.
+  set_response("pubid60", "call", irs_reg_data("UNREGISTERED"));
+  cwtest_advance_time_ms(300000);
+  EXPECT_EQ("UNREGISTERED", update("pubid60", HSSConnection::CALL));
+}
+
+// Test that registrations and deregistrations always go to Homestead, and
+// replace the cached data.
+TEST_F(HssConnectionCacheTest, RegistrationReplacesCache)
+{
+  EXPECT_EQ("REGISTERED", update("pubid60", HSSConnection::CALL));
+
+  // Deregistering removes the cached data.
+  set_response("pubid60", "dereg-admin", irs_reg_data("NOT_REGISTERED"));
+  set_response("pubid60", "call", irs_reg_data("UNREGISTERED"));
+  EXPECT_EQ("NOT_REGISTERED", update("pubid60", HSSConnection::DEREG_ADMIN));
+  EXPECT_EQ("UNREGISTERED", update("pubid60", HSSConnection::CALL));
+
+  // Registering replaces the cached data.
+  set_response("pubid61", "reg", irs_reg_data("REGISTERED"));
+  EXPECT_EQ("REGISTERED", update("pubid61", HSSConnection::REG));
+  EXPECT_EQ("REGISTERED", update("pubid60", HSSConnection::CALL));
+}
+
+// Test that invalidating the cached data for any IMPU in the implicit
+// registration set invalidates it for all of them.
+TEST_F(HssConnectionCacheTest, Invalidate)
+{
+  EXPECT_EQ("REGISTERED", update("pubid60", HSSConnection::CALL));
+
+  set_response("pubid60", "call", irs_reg_data("UNREGISTERED"));
+  _hss.invalidate_cached_registration_data("pubid61");
+  EXPECT_EQ("UNREGISTERED", update("pubid60", HSSConnection::CALL));
+
+  // Invalidating an IMPU with no cached data does nothing.
+  _hss.invalidate_cached_registration_data("pubid62");
+}
+
+// Test that a pushed profile that only changes iFCs updates the cached data
+// in place, and one that changes the IMPUs invalidates it.
+TEST_F(HssConnectionCacheTest, PushedProfile)
+{
+  std::string ifc = "<InitialFilterCriteria>"
+                      "<Priority>1</Priority>"
+                      "<TriggerPoint>"
+                        "<ConditionTypeCNF>0</ConditionTypeCNF>"
+                        "<SPT>"
+                          "<ConditionNegated>0</ConditionNegated>"
+                          "<Group>0</Group>"
+                          "<Method>INVITE</Method>"
+                        "</SPT>"
+                      "</TriggerPoint>"
+                      "<ApplicationServer>"
+                        "<ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>"
+                        "<DefaultHandling>0</DefaultHandling>"
+                      "</ApplicationServer>"
+                    "</InitialFilterCriteria>";
+  EXPECT_EQ("REGISTERED", update("pubid60", HSSConnection::CALL));
+  set_response("pubid60", "call", irs_reg_data("UNREGISTERED"));
+
+  // Pushing the same profile, or one that adds an iFC, keeps the cached
+  // data.
+  push("<ServiceProfile>"
+         "<PublicIdentity><Identity>pubid60</Identity></PublicIdentity>"
+         "<PublicIdentity><Identity>pubid61</Identity></PublicIdentity>"
+       "</ServiceProfile>");
+  push("<ServiceProfile>"
+         "<PublicIdentity><Identity>pubid60</Identity></PublicIdentity>"
+         "<PublicIdentity><Identity>pubid61</Identity></PublicIdentity>" +
+         ifc +
+       "</ServiceProfile>");
+
+  HSSConnection::irs_info irs_info;
+  EXPECT_EQ(HTTP_OK, _hss.get_registration_data("pubid61", irs_info, 0));
+  EXPECT_EQ("REGISTERED", irs_info._regstate);
+  EXPECT_EQ(1u, irs_info._service_profiles["pubid60"].size());
+  EXPECT_EQ(1u, irs_info._service_profiles["pubid61"].size());
+
+  // Barring an IMPU invalidates the cached data.
+  push("<ServiceProfile>"
+         "<PublicIdentity><Identity>pubid60</Identity></PublicIdentity>"
+         "<PublicIdentity>"
+           "<Identity>pubid61</Identity>"
+           "<BarringIndication>1</BarringIndication>"
+         "</PublicIdentity>" +
+         ifc +
+       "</ServiceProfile>");
+  EXPECT_EQ("UNREGISTERED", update("pubid60", HSSConnection::CALL));
+}
+
+/// Counter table that can safely be read while other threads increment it.
+class AtomicCounterTable : public SNMP::CounterTable
+{
+public:
+  AtomicCounterTable() : _count(0) {}
+  void increment() { _count++; }
+  std::atomic<int> _count;
+};
+
+/// HSS connection whose GETs block until released, so that tests can make
+/// concurrent requests.
+class BlockingHSSConnection : public HSSConnection
+{
+public:
+  BlockingHSSConnection(HttpResolver* resolver,
+                        CommunicationMonitor* comm_monitor,
+                        SNMP::CounterTable* coalesced_tbl) :
+    HSSConnection("narcissus",
+                  resolver,
+                  NULL,
+                  &SNMP::FAKE_IP_COUNT_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  comm_monitor,
+                  NULL,
+                  500,
+                  0,
+                  0,
+                  ShardedLRUCacheStatsTables(),
+                  coalesced_tbl),
+    _requests(0),
+    _released(false)
+  {
+  }
+
+  // Allow any blocked and future requests to complete.
+  void release()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _released = true;
+    _cond.notify_all();
+  }
+
+  std::atomic<int> _requests;
+
+private:
+  long get_xml_object(const std::string& path,
+                      std::shared_ptr<rapidxml::xml_document<>>& root,
+                      SAS::TrailId trail)
+  {
+    _requests++;
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait(lock, [this]() { return _released; });
+    root = parse_xml(irs_reg_data("REGISTERED"), path);
+    return HTTP_OK;
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  bool _released;
+};
+
+// Test that concurrent identical GETs share a single Homestead request.
+TEST_F(HssConnectionTest, CoalesceConcurrentRequests)
+{
+  AtomicCounterTable coalesced_tbl;
+  BlockingHSSConnection hss(&_resolver, &_cm, &coalesced_tbl);
+  HTTPCode rc[2];
+  HSSConnection::irs_info irs_info[2];
+
+  std::thread first([&]()
+  {
+    rc[0] = hss.get_registration_data("pubid60", irs_info[0], 0);
+  });
+
+  while (hss._requests == 0)
+  {
+    std::this_thread::yield();
+  }
+
+  std::thread second([&]()
+  {
+    rc[1] = hss.get_registration_data("pubid60", irs_info[1], 0);
+  });
+
+  while (coalesced_tbl._count == 0)
+  {
+    std::this_thread::yield();
+  }
+
+  hss.release();
+  first.join();
+  second.join();
+
+  EXPECT_EQ(1, hss._requests);
+  EXPECT_EQ(1, coalesced_tbl._count);
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    EXPECT_EQ(HTTP_OK, rc[ii]);
+    EXPECT_EQ("REGISTERED", irs_info[ii]._regstate);
+    EXPECT_EQ(2u, irs_info[ii]._associated_uris.get_all_uris().size());
+  }
+
+  // Once the request has completed, a new one goes to Homestead.
+  HSSConnection::irs_info irs_info2;
+  EXPECT_EQ(HTTP_OK, hss.get_registration_data("pubid60", irs_info2, 0));
+  EXPECT_EQ(2, hss._requests);
+  EXPECT_EQ(1, coalesced_tbl._count);
+}
+
+// Test that asynchronous requests complete on the calling thread when there
+// are no request threads.
+TEST_F(HssConnectionTest, AsyncRequestInline)
+{
+  bool called = false;
+
+  _hss.get_registration_data_async("pubid42",
+                                   [&called](HTTPCode rc,
+                                             HSSConnection::irs_info& irs_info)
+                                   {
+                                     called = true;
+                                     EXPECT_EQ(HTTP_OK, rc);
+                                     EXPECT_EQ("REGISTERED", irs_info._regstate);
+                                   },
+                                   0);
+
+  EXPECT_TRUE(called);
+}
+
+// Test that asynchronous requests complete on a request thread.
+TEST_F(HssConnectionTest, AsyncRequestThreads)
+{
+  HSSConnection hss("narcissus",
+                    &_resolver,
+                    NULL,
+                    &SNMP::FAKE_IP_COUNT_TABLE,
+                    &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                    &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                    &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                    &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                    &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                    &_cm,
+                    NULL,
+                    500,
+                    0,
+                    0,
+                    ShardedLRUCacheStatsTables(),
+                    NULL,
+                    NULL,
+                    2);
+  std::promise<std::thread::id> thread_id;
+  HSSConnection::irs_query irs_query;
+  irs_query._public_id = "pubid42";
+  irs_query._req_type = HSSConnection::REG;
+  irs_query._server_name = "server_name";
+
+  hss.update_registration_state_async(irs_query,
+                                      [&thread_id](HTTPCode rc,
+                                                   HSSConnection::irs_info& irs_info)
+                                      {
+                                        EXPECT_EQ(HTTP_OK, rc);
+                                        EXPECT_EQ("REGISTERED", irs_info._regstate);
+                                        thread_id.set_value(std::this_thread::get_id());
+                                      },
+                                      0);
+
+  EXPECT_NE(std::this_thread::get_id(), thread_id.get_future().get());
+}
+
+// Test that parsed documents own the buffer they were parsed from, and that
+// invalid XML is rejected.
+TEST_F(HssConnectionTest, ParseXml)
+{
+  std::shared_ptr<rapidxml::xml_document<>> root =
+       _hss.parse_xml(irs_reg_data("REGISTERED"), "test");
+  ASSERT_TRUE(root != NULL);
+
+  rapidxml::xml_node<>* cw = root->first_node("ClearwaterRegData");
+  ASSERT_TRUE(cw != NULL);
+  EXPECT_STREQ("REGISTERED", cw->first_node("RegistrationState")->value());
+
+  EXPECT_TRUE(_hss.parse_xml("<ClearwaterRegData>", "test") == NULL);
+}
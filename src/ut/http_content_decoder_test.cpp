@@ -0,0 +1,152 @@
+/**
+ * @file http_content_decoder_test.cpp UT for HttpContentDecoder.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <string>
+#include <zlib.h>
+#include "gtest/gtest.h"
+
+#include "http_content_decoder.h"
+
+class HttpContentDecoderTest : public ::testing::Test
+{
+public:
+  HttpContentDecoderTest() :
+    _stats("test_dependency")
+  {
+    // A service profile-like body, long enough to need several output
+    // chunks.
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      _body += "<PublicIdentity><Identity>sip:" + std::to_string(ii) +
+               "@homedomain</Identity></PublicIdentity>";
+    }
+  }
+
+  // Compresses a body, in gzip format or (for deflate) zlib format.
+  static std::string compress(const std::string& body, bool gzip)
+  {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream,
+                 Z_DEFAULT_COMPRESSION,
+                 Z_DEFLATED,
+                 gzip ? 15 + 16 : 15,
+                 8,
+                 Z_DEFAULT_STRATEGY);
+
+    std::string compressed(deflateBound(&stream, body.size()), '\0');
+    stream.next_in = (Bytef*)body.data();
+    stream.avail_in = body.size();
+    stream.next_out = (Bytef*)&compressed[0];
+    stream.avail_out = compressed.size();
+    deflate(&stream, Z_FINISH);
+    compressed.resize(compressed.size() - stream.avail_out);
+    deflateEnd(&stream);
+    return compressed;
+  }
+
+  HttpContentDecoder::Stats _stats;
+  std::string _body;
+};
+
+// Test that a gzip body is decoded as it arrives in pieces, and the decoding
+// is reported.
+TEST_F(HttpContentDecoderTest, GzipInPieces)
+{
+  std::string compressed = compress(_body, true);
+  ASSERT_LT(compressed.size(), _body.size() / 4);
+  uint64_t responses = _stats.compressed_responses->value();
+  uint64_t saved = _stats.saved_bytes->value();
+
+  HttpContentDecoder decoder(&_stats);
+  std::string line = "Content-Type: application/xml\r\n";
+  EXPECT_TRUE(decoder.header(line.data(), line.size()));
+  line = "content-encoding: GZIP\r\n";
+  EXPECT_TRUE(decoder.header(line.data(), line.size()));
+
+  std::string out;
+  for (size_t ii = 0; ii < compressed.size(); ii += 100)
+  {
+    ASSERT_TRUE(decoder.write(compressed.data() + ii,
+                              std::min((size_t)100, compressed.size() - ii),
+                              out));
+  }
+
+  EXPECT_TRUE(decoder.finish());
+  EXPECT_EQ(_body, out);
+  EXPECT_EQ(responses + 1, _stats.compressed_responses->value());
+  EXPECT_EQ(saved + _body.size() - compressed.size(), _stats.saved_bytes->value());
+}
+
+// Test that a deflate body is decoded in place.
+TEST_F(HttpContentDecoderTest, Deflate)
+{
+  std::string body = compress(_body, false);
+  EXPECT_TRUE(HttpContentDecoder::decode(" deflate", body, &_stats));
+  EXPECT_EQ(_body, body);
+}
+
+// Test that a body that isn't encoded is passed through as it is, and isn't
+// reported.
+TEST_F(HttpContentDecoderTest, Identity)
+{
+  uint64_t responses = _stats.compressed_responses->value();
+  std::string body = _body;
+  EXPECT_TRUE(HttpContentDecoder::decode("", body, &_stats));
+  EXPECT_EQ(_body, body);
+  EXPECT_TRUE(HttpContentDecoder::decode("identity", body, &_stats));
+  EXPECT_EQ(_body, body);
+
+  HttpContentDecoder decoder;
+  std::string out;
+  EXPECT_TRUE(decoder.write(_body.data(), _body.size(), out));
+  EXPECT_TRUE(decoder.finish());
+  EXPECT_EQ(_body, out);
+  EXPECT_EQ(responses, _stats.compressed_responses->value());
+}
+
+// Test that bodies that are corrupt, cut short or in an unknown encoding fail
+// to decode.
+TEST_F(HttpContentDecoderTest, Failures)
+{
+  std::string compressed = compress(_body, true);
+
+  std::string body = compressed;
+  body[20] ^= 0xff;
+  body[21] ^= 0xff;
+  EXPECT_FALSE(HttpContentDecoder::decode("gzip", body));
+
+  body = compressed.substr(0, compressed.size() / 2);
+  EXPECT_FALSE(HttpContentDecoder::decode("gzip", body));
+
+  body = compressed;
+  EXPECT_FALSE(HttpContentDecoder::decode("br", body));
+
+  HttpContentDecoder decoder;
+  std::string line = "Content-Encoding: compress\r\n";
+  EXPECT_FALSE(decoder.header(line.data(), line.size()));
+  std::string out;
+  EXPECT_FALSE(decoder.write(compressed.data(), compressed.size(), out));
+  EXPECT_FALSE(decoder.finish());
+}
+
+// Test that the Content-Encoding is found in a set of headers whatever its
+// case.
+TEST_F(HttpContentDecoderTest, ContentEncodingHeader)
+{
+  EXPECT_EQ("gzip",
+            HttpContentDecoder::content_encoding({{"Content-Type", "application/xml"},
+                                                  {"Content-Encoding", "gzip"}}));
+  EXPECT_EQ("deflate",
+            HttpContentDecoder::content_encoding({{"content-encoding", "deflate"}}));
+  EXPECT_EQ("", HttpContentDecoder::content_encoding({{"Content-Length", "10"}}));
+}
@@ -0,0 +1,98 @@
+/**
+ * @file http_task_pool_test.cpp UT for HttpTaskPool and PooledHandler.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <condition_variable>
+#include <mutex>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "http_task_pool.h"
+#include "mockhttpstack.hpp"
+
+using ::testing::_;
+
+/// A task that blocks until the test releases it, then replies 200 OK.
+class BlockingTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config() : released(false), completed(0) {}
+    std::mutex lock;
+    std::condition_variable cond;
+    bool released;
+    int completed;
+  };
+
+  BlockingTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail), _cfg(const_cast<Config*>(cfg))
+  {}
+
+  void run()
+  {
+    {
+      std::unique_lock<std::mutex> lock(_cfg->lock);
+      _cfg->cond.wait(lock, [this]() { return _cfg->released; });
+    }
+
+    send_http_reply(HTTP_OK);
+
+    {
+      std::unique_lock<std::mutex> lock(_cfg->lock);
+      _cfg->completed++;
+      _cfg->cond.notify_all();
+    }
+
+    delete this;
+  }
+
+private:
+  Config* _cfg;
+};
+
+class HttpTaskPoolTest : public ::testing::Test
+{
+public:
+  MockHttpStack _httpstack;
+  BlockingTask::Config _cfg;
+};
+
+// Requests are handled on the pool, and requests over the handler's limit are
+// rejected straight away.
+TEST_F(HttpTaskPoolTest, RejectsOverLimit)
+{
+  HttpTaskPool pool("test", 1, NULL);
+  PooledHandler<BlockingTask, BlockingTask::Config> handler(&_cfg, &pool, 2);
+  MockHttpStack::Request req(&_httpstack, "/", "test", "", "", htp_method_GET);
+
+  EXPECT_CALL(_httpstack, send_reply(_, 503, _));
+  handler.process_request(req, 0);
+  handler.process_request(req, 0);
+  handler.process_request(req, 0);
+
+  EXPECT_CALL(_httpstack, send_reply(_, 200, _)).Times(2);
+  std::unique_lock<std::mutex> lock(_cfg.lock);
+  _cfg.released = true;
+  _cfg.cond.notify_all();
+  _cfg.cond.wait(lock, [this]() { return _cfg.completed == 2; });
+}
+
+// Without a pool, requests are handled on the calling thread.
+TEST_F(HttpTaskPoolTest, NoPool)
+{
+  PooledHandler<BlockingTask, BlockingTask::Config> handler(&_cfg, NULL, 2);
+  MockHttpStack::Request req(&_httpstack, "/", "test", "", "", htp_method_GET);
+  _cfg.released = true;
+
+  EXPECT_CALL(_httpstack, send_reply(_, 200, _));
+  handler.process_request(req, 0);
+  EXPECT_EQ(1, _cfg.completed);
+}
@@ -0,0 +1,135 @@
+/**
+ * @file huge_page_allocator_test.cpp UT for HugePageAllocator.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "huge_page_allocator.h"
+#include "recycling_pool_factory.h"
+
+static const size_t ARENA_SIZE = HugePageAllocator::ARENA_SIZE;
+static const size_t MIN_BLOCK_SIZE = HugePageAllocator::MIN_BLOCK_SIZE;
+static const size_t MAX_BLOCK_SIZE = HugePageAllocator::MAX_BLOCK_SIZE;
+
+// Test that freed blocks are reused for blocks of the same size class, and
+// that the statistics track the arenas and the blocks in use.
+TEST(HugePageAllocatorTest, Reuse)
+{
+  HugePageAllocator allocator;
+
+  void* block = allocator.alloc(4000);
+  ASSERT_TRUE(block != NULL);
+  EXPECT_EQ(ARENA_SIZE, allocator.arena_bytes());
+  EXPECT_EQ(ARENA_SIZE - 4096, allocator.free_bytes());
+  EXPECT_EQ(4000u, allocator.in_use_bytes());
+
+  // The block is writable.
+  memset(block, 0, 4000);
+
+  allocator.free(block, 4000);
+  EXPECT_EQ(ARENA_SIZE, allocator.free_bytes());
+  EXPECT_EQ(0u, allocator.in_use_bytes());
+
+  // Any size that rounds to the same size class gets the freed block back.
+  void* block2 = allocator.alloc(3000);
+  EXPECT_EQ(block, block2);
+
+  // A different size class doesn't.
+  void* block3 = allocator.alloc(8000);
+  EXPECT_NE(block, block3);
+
+  allocator.free(block2, 3000);
+  allocator.free(block3, 8000);
+}
+
+// Test that only blocks up to the largest size class are handled.
+TEST(HugePageAllocatorTest, Handles)
+{
+  EXPECT_TRUE(HugePageAllocator::handles(1));
+  EXPECT_TRUE(HugePageAllocator::handles(MAX_BLOCK_SIZE));
+  EXPECT_FALSE(HugePageAllocator::handles(MAX_BLOCK_SIZE + 1));
+}
+
+// Test that a new arena is mapped when the current one is used up, and that
+// what was left of the old one goes on the free lists rather than being
+// wasted.
+TEST(HugePageAllocatorTest, NewArena)
+{
+  HugePageAllocator allocator;
+  std::vector<void*> blocks;
+
+  // A small block and seven of the largest leave just under one of the
+  // largest blocks free in the first arena.
+  char* first = (char*)allocator.alloc(MIN_BLOCK_SIZE);
+  for (int ii = 0; ii < 7; ++ii)
+  {
+    blocks.push_back(allocator.alloc(MAX_BLOCK_SIZE));
+  }
+  EXPECT_EQ(ARENA_SIZE, allocator.arena_bytes());
+
+  // Another needs a second arena, which is aligned, and the rest of the first
+  // goes on the free lists.
+  void* next = allocator.alloc(MAX_BLOCK_SIZE);
+  EXPECT_EQ(2 * ARENA_SIZE, allocator.arena_bytes());
+  EXPECT_EQ(0u, (uintptr_t)next % ARENA_SIZE);
+  EXPECT_EQ(2 * ARENA_SIZE -
+              MIN_BLOCK_SIZE -
+              8 * MAX_BLOCK_SIZE,
+            allocator.free_bytes());
+  blocks.push_back(next);
+
+  // Blocks smaller than the largest now come from the end of the first
+  // arena.
+  char* small = (char*)allocator.alloc(MAX_BLOCK_SIZE / 2);
+  EXPECT_GE(small, first);
+  EXPECT_LT(small, first + ARENA_SIZE);
+  EXPECT_EQ(2 * ARENA_SIZE, allocator.arena_bytes());
+
+  allocator.free(small, MAX_BLOCK_SIZE / 2);
+  allocator.free(first, MIN_BLOCK_SIZE);
+  for (void* block : blocks)
+  {
+    allocator.free(block, MAX_BLOCK_SIZE);
+  }
+  EXPECT_EQ(2 * ARENA_SIZE, allocator.free_bytes());
+}
+
+// Test that a pool factory given an allocator allocates pools' blocks from
+// it, and that large blocks still come from the heap.
+TEST(HugePageAllocatorTest, PoolFactory)
+{
+  pj_init();
+
+  {
+    HugePageAllocator allocator;
+    RecyclingPoolFactory factory(0,
+                                 RecyclingPoolFactory::DEFAULT_TRIM_INTERVAL_MS,
+                                 &allocator);
+
+    pj_pool_t* pool = pj_pool_create(factory.factory(), "test", 4000, 4000, NULL);
+    ASSERT_TRUE(pool != NULL);
+    EXPECT_EQ(4000u, allocator.in_use_bytes());
+
+    // This doesn't fit in the first block, so another is allocated.
+    pj_pool_alloc(pool, 3900);
+    EXPECT_EQ(8000u, allocator.in_use_bytes());
+
+    pj_pool_alloc(pool, MAX_BLOCK_SIZE * 2);
+    EXPECT_EQ(8000u, allocator.in_use_bytes());
+
+    pj_pool_release(pool);
+    EXPECT_EQ(0u, allocator.in_use_bytes());
+  }
+
+  pj_shutdown();
+}
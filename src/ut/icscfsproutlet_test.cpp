@@ -982,6 +982,102 @@ TEST_F(ICSCFSproutletTest, RouteRegisterHSSRetry)
 }
 
 
+TEST_F(ICSCFSproutletTest, RouteRegisterHSSCached)
+{
+  // Tests that the result of a UAR is cached, and that the cached result is
+  // discarded when the S-CSCF it returned responds with a retryable error.
+  ICSCFQueryCache query_cache(300, 100, {NULL, NULL, NULL});
+  _icscf_sproutlet->_query_cache = &query_cache;
+
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the I-CSCF listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        ICSCF_PORT,
+                                        "1.2.3.4",
+                                        49152);
+
+  _hss_connection->set_result("/impi/6505551000%40homedomain/registration-status?impu=sip%3A6505551000%40homedomain&visited-network=homedomain&auth-type=REG",
+                              "{\"result-code\": 2001,"
+                              " \"scscf\": \"sip:scscf1.homedomain:5058;transport=TCP\"}");
+  _hss_connection->set_result("/impi/6505551000%40homedomain/registration-status?impu=sip%3A6505551000%40homedomain&visited-network=homedomain&auth-type=CAPAB",
+                              "{\"result-code\": 2001,"
+                              " \"mandatory-capabilities\": [123],"
+                              " \"optional-capabilities\": [345]}");
+
+  // Inject a REGISTER request, which is routed to the S-CSCF returned by the
+  // HSS.
+  Message msg1;
+  msg1._first_hop = true;
+  msg1._method = "REGISTER";
+  msg1._requri = "sip:homedomain";
+  msg1._to = msg1._from;        // To header contains AoR in REGISTER requests.
+  msg1._via = tp->to_string(false);
+  msg1._extra = "Contact: sip:6505551000@" +
+                tp->to_string(true) +
+                ";ob;expires=300;+sip.ice;reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\"";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.10.1", 5058, tdata);
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+
+  // Remove the HSS response.  The next REGISTER is still routed to scscf1,
+  // using the cached result.
+  _hss_connection->delete_result("/impi/6505551000%40homedomain/registration-status?impu=sip%3A6505551000%40homedomain&visited-network=homedomain&auth-type=REG");
+
+  Message msg2;
+  msg2._first_hop = true;
+  msg2._method = "REGISTER";
+  msg2._requri = "sip:homedomain";
+  msg2._to = msg2._from;
+  msg2._via = tp->to_string(false);
+  msg2._extra = msg1._extra;
+  inject_msg(msg2.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.10.1", 5058, tdata);
+
+  // scscf1 responds with a retryable error, so the I-CSCF queries the
+  // capabilities and retries to scscf2.
+  inject_msg(respond_to_current_txdata(480));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.10.2", 5058, tdata);
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+
+  // The cached result was discarded, so the next REGISTER queries the HSS,
+  // which no longer knows the subscriber.
+  Message msg3;
+  msg3._first_hop = true;
+  msg3._method = "REGISTER";
+  msg3._requri = "sip:homedomain";
+  msg3._to = msg3._from;
+  msg3._via = tp->to_string(false);
+  msg3._extra = msg1._extra;
+  inject_msg(msg3.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "1.2.3.4", 49152, tdata);
+  RespMatcher(403).matches(tdata->msg);
+  free_txdata();
+
+  _hss_connection->delete_result("/impi/6505551000%40homedomain/registration-status?impu=sip%3A6505551000%40homedomain&visited-network=homedomain&auth-type=CAPAB");
+  _icscf_sproutlet->_query_cache = NULL;
+
+  delete tp;
+}
+
+
 TEST_F(ICSCFSproutletTest, RouteRegisterHSSNoRetry)
 {
   // Tests routing of REGISTER requests when the S-CSCF returned by the HSS
@@ -19,6 +19,8 @@
 #include "siptest.hpp"
 #include "fakehssconnection.hpp"
 #include "fakechronosconnection.hpp"
+#include "mock_sas.h"
+#include "sproutsasevent.h"
 
 #include "ifchandler.h"
 
@@ -206,13 +208,16 @@ void IfcHandlerTest::interpret_ifcs(Ifcs& ifcs,
                                     pjsip_msg* msg,
                                     std::vector<AsInvocation>& application_servers)
 {
+  Ifc::MatchCache cache;
+
   for (Ifc ifc : ifcs.ifcs_list())
   {
     if (ifc.filter_matches(session_case,
                            is_registered,
                            is_initial_registration,
                            msg,
-                           0))
+                           0,
+                           &cache))
     {
       application_servers.push_back(ifc.as_invocation());
     }
@@ -2358,3 +2363,157 @@ TEST_F(IfcHandlerTest, SDPNoEqualsSign)
 // @@@ lookup_ifcs gets no served user
 // @@@ lookup_ifcs finds empty iFCs
 // ++@@@ served_user_from_msg: URI is not home domain, but is local; URI is not home domain or local
+
+// Test that an iFC is compiled once and can then be evaluated repeatedly
+// against different requests and session cases, including through copies of
+// the Ifc.
+TEST_F(IfcHandlerTest, CompiledIfcEvaluatedRepeatedly)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<ServiceProfile>\n"
+                    "  <InitialFilterCriteria>\n"
+                    "    <Priority>1</Priority>\n"
+                    "    <TriggerPoint>\n"
+                    "    <ConditionTypeCNF>1</ConditionTypeCNF>\n"
+                    "    <SPT>\n"
+                    "      <ConditionNegated>0</ConditionNegated>\n"
+                    "      <Group>0</Group>\n"
+                    "      <SessionCase>0</SessionCase>\n"
+                    "    </SPT>\n"
+                    "    <SPT>\n"
+                    "      <ConditionNegated>0</ConditionNegated>\n"
+                    "      <Group>1</Group>\n"
+                    "      <SIPHeader><Header>Accept</Header><Content>qu+x</Content></SIPHeader>\n"
+                    "    </SPT>\n"
+                    "  </TriggerPoint>\n"
+                    "  <ApplicationServer>\n"
+                    "    <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                    "    <DefaultHandling>0</DefaultHandling>\n"
+                    "  </ApplicationServer>\n"
+                    "  </InitialFilterCriteria>\n"
+                    "</ServiceProfile>";
+  std::shared_ptr<rapidxml::xml_document<> > root (new rapidxml::xml_document<>);
+  char* cstr_ifc = strdup(xml.c_str());
+  root->parse<0>(cstr_ifc);
+  Ifcs* ifcs = new Ifcs(root, root->first_node("ServiceProfile"), NULL, 0);
+  ASSERT_EQ(1u, ifcs->size());
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    Ifc ifc = (*ifcs)[0];
+    EXPECT_TRUE(ifc.filter_matches(SessionCase::Originating, true, false, TEST_MSG, 0));
+    EXPECT_FALSE(ifc.filter_matches(SessionCase::Terminating, true, false, TEST_MSG, 0));
+    EXPECT_FALSE(ifc.filter_matches(SessionCase::Originating, false, false, TEST_MSG, 0));
+  }
+
+  delete ifcs;
+  free(cstr_ifc);
+}
+
+// Test that by default the full iFC is logged to SAS once when the iFCs are
+// loaded, and only a compact identifier is logged when it's evaluated.
+TEST_F(IfcHandlerTest, CompactSasLogging)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<ServiceProfile>\n"
+                    "  <InitialFilterCriteria>\n"
+                    "    <Priority>2</Priority>\n"
+                    "  <ApplicationServer>\n"
+                    "    <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                    "    <DefaultHandling>0</DefaultHandling>\n"
+                    "  </ApplicationServer>\n"
+                    "  </InitialFilterCriteria>\n"
+                    "</ServiceProfile>";
+  std::shared_ptr<rapidxml::xml_document<> > root (new rapidxml::xml_document<>);
+  char* cstr_ifc = strdup(xml.c_str());
+  root->parse<0>(cstr_ifc);
+
+  mock_sas_collect_messages(true);
+  Ifcs* ifcs = new Ifcs(root, root->first_node("ServiceProfile"), NULL, 0);
+
+  MockSASMessage* loaded = mock_sas_find_event(SASEvent::IFC_LOADED);
+  ASSERT_TRUE(loaded != NULL);
+  EXPECT_EQ("Priority 2: sip:1.2.3.4:56789;transport=UDP", loaded->var_params[0]);
+  EXPECT_NE(std::string::npos, loaded->var_params[1].find("<InitialFilterCriteria>"));
+  mock_sas_discard_messages();
+
+  EXPECT_TRUE((*ifcs)[0].filter_matches(SessionCase::Originating, true, false, TEST_MSG, 0));
+  MockSASMessage* testing = mock_sas_find_event(SASEvent::IFC_TESTING);
+  ASSERT_TRUE(testing != NULL);
+  EXPECT_EQ("Priority 2: sip:1.2.3.4:56789;transport=UDP", testing->var_params[0]);
+  mock_sas_discard_messages();
+
+  // With full logging enabled, the full iFC is logged on evaluation instead.
+  Ifc::sas_log_full_ifcs = true;
+  EXPECT_TRUE((*ifcs)[0].filter_matches(SessionCase::Originating, true, false, TEST_MSG, 0));
+  testing = mock_sas_find_event(SASEvent::IFC_TESTING);
+  ASSERT_TRUE(testing != NULL);
+  EXPECT_NE(std::string::npos, testing->var_params[0].find("<InitialFilterCriteria>"));
+  Ifc::sas_log_full_ifcs = false;
+
+  mock_sas_discard_messages();
+  mock_sas_collect_messages(false);
+
+  delete ifcs;
+  free(cstr_ifc);
+}
+
+// Test that iFCs sharing a MatchCache get the same results as they do
+// evaluated on their own, when SPTs are repeated between them.
+TEST_F(IfcHandlerTest, SharedMatchCache)
+{
+  std::string spts[] = {
+    "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+      "<SIPHeader><Header>Contact</Header><Content>.*5755550018.*</Content></SIPHeader></SPT>",
+    "<SPT><ConditionNegated>1</ConditionNegated><Group>0</Group>"
+      "<SIPHeader><Header>Contact</Header><Content>.*5755550018.*</Content></SIPHeader></SPT>",
+    "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+      "<SIPHeader><Header>Contact</Header></SIPHeader></SPT>",
+    "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+      "<SessionDescription><Line>m</Line><Content>video</Content></SessionDescription></SPT>",
+    "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+      "<SessionDescription><Line>m</Line><Content>text</Content></SessionDescription></SPT>",
+    "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+      "<RequestURI>homedomain</RequestURI></SPT>",
+    "<SPT><ConditionNegated>1</ConditionNegated><Group>0</Group>"
+      "<RequestURI>homedomain</RequestURI></SPT>",
+  };
+  bool expected[] = {true, false, true, true, false, true, false};
+
+  std::string xml = "<ServiceProfile>\n";
+  for (size_t ii = 0; ii < sizeof(expected) / sizeof(expected[0]); ++ii)
+  {
+    xml += "<InitialFilterCriteria>\n"
+           "  <Priority>" + std::to_string(ii) + "</Priority>\n"
+           "  <TriggerPoint>\n"
+           "  <ConditionTypeCNF>0</ConditionTypeCNF>\n" +
+           spts[ii] + "\n"
+           "  </TriggerPoint>\n"
+           "  <ApplicationServer>\n"
+           "    <ServerName>sip:as" + std::to_string(ii) + "</ServerName>\n"
+           "    <DefaultHandling>0</DefaultHandling>\n"
+           "  </ApplicationServer>\n"
+           "</InitialFilterCriteria>\n";
+  }
+  xml += "</ServiceProfile>";
+
+  std::shared_ptr<rapidxml::xml_document<> > root (new rapidxml::xml_document<>);
+  char* cstr_ifc = strdup(xml.c_str());
+  root->parse<0>(cstr_ifc);
+  Ifcs* ifcs = new Ifcs(root, root->first_node("ServiceProfile"), NULL, 0);
+  ASSERT_EQ(sizeof(expected) / sizeof(expected[0]), ifcs->size());
+
+  Ifc::MatchCache cache;
+
+  for (size_t ii = 0; ii < ifcs->size(); ++ii)
+  {
+    SCOPED_TRACE(ii);
+    EXPECT_EQ(expected[ii],
+              (*ifcs)[ii].filter_matches(SessionCase::Originating, true, false, TEST_MSG, 0));
+    EXPECT_EQ(expected[ii],
+              (*ifcs)[ii].filter_matches(SessionCase::Originating, true, false, TEST_MSG, 0, &cache));
+  }
+
+  delete ifcs;
+  free(cstr_ifc);
+}
@@ -0,0 +1,163 @@
+/**
+ * @file impi_challenge_writer_test.cpp UT for ImpiChallengeWriter.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "impi_challenge_writer.h"
+
+static const std::string IMPI = "private@example.com";
+
+/// Fixture for ImpiChallengeWriterTest.  The write function records the
+/// nonce count of each challenge written, and can be made to block until
+/// released.
+class ImpiChallengeWriterTest : public ::testing::Test
+{
+public:
+  ImpiChallengeWriterTest() : _blocked(false), _writing(false) {}
+
+  ImpiChallengeWriter* create_writer(int cache_ttl)
+  {
+    return new ImpiChallengeWriter([this](const std::string& impi,
+                                          ImpiStore::AuthChallenge* auth_challenge,
+                                          SAS::TrailId trail)
+                                   {
+                                     std::unique_lock<std::mutex> lock(_lock);
+                                     _writing = true;
+                                     _cond.notify_all();
+                                     _cond.wait(lock, [this]() { return !_blocked; });
+                                     _nonce_counts.push_back(auth_challenge->get_nonce_count());
+                                     _writing = false;
+                                     _cond.notify_all();
+                                     return Store::OK;
+                                   },
+                                   1,
+                                   cache_ttl,
+                                   100,
+                                   NULL);
+  }
+
+  static ImpiStore::AuthChallenge* challenge(const std::string& nonce,
+                                             uint32_t nonce_count)
+  {
+    ImpiStore::AuthChallenge* auth_challenge =
+      new ImpiStore::DigestAuthChallenge(nonce,
+                                         "example.com",
+                                         "auth",
+                                         "ha1",
+                                         time(NULL) + 30);
+    auth_challenge->set_nonce_count(nonce_count);
+    return auth_challenge;
+  }
+
+  // Write a challenge, deleting the caller's copy.
+  static void write(ImpiChallengeWriter* writer,
+                    const std::string& nonce,
+                    uint32_t nonce_count)
+  {
+    ImpiStore::AuthChallenge* auth_challenge = challenge(nonce, nonce_count);
+    writer->write(IMPI, auth_challenge, 0);
+    delete auth_challenge;
+  }
+
+  // Wait until the specified number of writes have been made.
+  void wait_for_writes(size_t num_writes)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _cond.wait(lock, [this, num_writes]() { return _nonce_counts.size() >= num_writes; });
+  }
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  bool _blocked;
+  bool _writing;
+  std::vector<uint32_t> _nonce_counts;
+};
+
+// Test that challenges are written, and can then be found in the cache.
+TEST_F(ImpiChallengeWriterTest, WriteAndFind)
+{
+  ImpiChallengeWriter* writer = create_writer(5);
+
+  write(writer, "nonce1", 1);
+  wait_for_writes(1);
+  EXPECT_EQ(std::vector<uint32_t>({1}), _nonce_counts);
+
+  ImpiStore::AuthChallenge* auth_challenge = writer->find(IMPI, "nonce1");
+  ASSERT_TRUE(auth_challenge != NULL);
+  EXPECT_EQ(ImpiStore::AuthChallenge::Type::DIGEST, auth_challenge->get_type());
+  EXPECT_EQ("ha1", ((ImpiStore::DigestAuthChallenge*)auth_challenge)->get_ha1());
+  delete auth_challenge;
+
+  EXPECT_TRUE(writer->find(IMPI, "nonce2") == NULL);
+  EXPECT_TRUE(writer->find("other@example.com", "nonce1") == NULL);
+
+  delete writer;
+}
+
+// Test that challenges aren't cached if the cache TTL is zero.
+TEST_F(ImpiChallengeWriterTest, NoCache)
+{
+  ImpiChallengeWriter* writer = create_writer(0);
+
+  write(writer, "nonce1", 1);
+  wait_for_writes(1);
+  EXPECT_TRUE(writer->find(IMPI, "nonce1") == NULL);
+
+  delete writer;
+}
+
+// Test that writes of a challenge that is waiting to be written are
+// coalesced, and that the cache holds the latest version.
+TEST_F(ImpiChallengeWriterTest, Coalesce)
+{
+  ImpiChallengeWriter* writer = create_writer(5);
+
+  // Block the first write of nonce1 once it has started.
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _blocked = true;
+  }
+
+  write(writer, "nonce1", 1);
+
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _cond.wait(lock, [this]() { return _writing; });
+  }
+
+  // These writes are queued behind the first.  The writes of nonce1 are
+  // coalesced, but the write of nonce2 is separate.
+  write(writer, "nonce1", 2);
+  write(writer, "nonce2", 1);
+  write(writer, "nonce1", 3);
+  EXPECT_EQ(2u, writer->num_pending());
+
+  ImpiStore::AuthChallenge* auth_challenge = writer->find(IMPI, "nonce1");
+  ASSERT_TRUE(auth_challenge != NULL);
+  EXPECT_EQ(3u, auth_challenge->get_nonce_count());
+  delete auth_challenge;
+
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _blocked = false;
+    _cond.notify_all();
+  }
+
+  wait_for_writes(3);
+  EXPECT_EQ(std::vector<uint32_t>({1, 3, 1}), _nonce_counts);
+  EXPECT_EQ(0u, writer->num_pending());
+
+  delete writer;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file impistore_microbench.cpp Microbenchmarks for IMPI serialization.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+#include <string>
+
+#include "microbench.hpp"
+#include "localstore.h"
+#include "astaire_impistore.h"
+
+static const std::string IMPI = "private@example.com";
+
+/// An IMPI with both a digest and an AKA authentication challenge.
+static ImpiStore::Impi* example_impi()
+{
+  ImpiStore::Impi* impi = new AstaireImpiStore::Impi(IMPI);
+  ImpiStore::AuthChallenge* auth_challenge = new ImpiStore::DigestAuthChallenge("nonce1", "example.com", "auth", "ha1", time(NULL) + 300);
+  auth_challenge->_correlator = "correlator";
+  impi->auth_challenges.push_back(auth_challenge);
+  auth_challenge = new ImpiStore::AKAAuthChallenge("nonce2", "response", time(NULL) + 300);
+  auth_challenge->_correlator = "correlator";
+  impi->auth_challenges.push_back(auth_challenge);
+  return impi;
+}
+
+/// Writes the example IMPI in the given format, and returns the record.
+static std::string impi_record(AstaireImpiStore::Serialization serialization)
+{
+  LocalStore local_store;
+  AstaireImpiStore impi_store(&local_store, serialization);
+  ImpiStore::Impi* impi = example_impi();
+  impi_store.set_impi(impi, 0L);
+  delete impi;
+
+  std::string data;
+  uint64_t cas;
+  local_store.get_data("impi", IMPI, data, cas, 0L);
+  return data;
+}
+
+static void BM_Impi_json_deserialize(MicroBench::State& state)
+{
+  std::string data = impi_record(AstaireImpiStore::Serialization::JSON);
+
+  while (state.keep_running())
+  {
+    AstaireImpiStore::Impi* impi = AstaireImpiStore::from_json(IMPI, data);
+    MicroBench::do_not_optimize(impi);
+    delete impi;
+  }
+}
+MICROBENCH(BM_Impi_json_deserialize);
+
+static void BM_Impi_binary_deserialize(MicroBench::State& state)
+{
+  std::string data = impi_record(AstaireImpiStore::Serialization::BINARY);
+
+  while (state.keep_running())
+  {
+    AstaireImpiStore::Impi* impi = AstaireImpiStore::from_binary(IMPI, data);
+    MicroBench::do_not_optimize(impi);
+    delete impi;
+  }
+}
+MICROBENCH(BM_Impi_binary_deserialize);
+
+// Reads the IMPI and writes it back, as the authentication module does for
+// each challenge, so each iteration deserializes and serializes the record
+// once.
+static void run_get_set(MicroBench::State& state,
+                        AstaireImpiStore::Serialization serialization)
+{
+  LocalStore local_store;
+  AstaireImpiStore impi_store(&local_store, serialization);
+  ImpiStore::Impi* impi = example_impi();
+  impi_store.set_impi(impi, 0L);
+  delete impi;
+
+  while (state.keep_running())
+  {
+    impi = impi_store.get_impi(IMPI, 0L);
+    MicroBench::do_not_optimize(impi_store.set_impi(impi, 0L));
+    delete impi;
+  }
+}
+
+static void BM_Impi_json_get_set(MicroBench::State& state)
+{
+  run_get_set(state, AstaireImpiStore::Serialization::JSON);
+}
+MICROBENCH(BM_Impi_json_get_set);
+
+static void BM_Impi_binary_get_set(MicroBench::State& state)
+{
+  run_get_set(state, AstaireImpiStore::Serialization::BINARY);
+}
+MICROBENCH(BM_Impi_binary_get_set);
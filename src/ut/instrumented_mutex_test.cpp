@@ -0,0 +1,154 @@
+/**
+ * @file instrumented_mutex_test.cpp UT for InstrumentedMutex.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "instrumented_mutex.h"
+
+// Test that uncontended locks count acquisitions and hold times, but no
+// waits.
+TEST(InstrumentedMutexTest, Uncontended)
+{
+  LockStats stats;
+  InstrumentedMutex lock(&stats);
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    std::lock_guard<InstrumentedMutex> guard(lock);
+  }
+
+  EXPECT_EQ(10u, stats.acquisitions.load());
+  EXPECT_EQ(0u, stats.contended.load());
+  EXPECT_EQ(10u, stats.hold_ns.summary().count);
+  EXPECT_EQ(0u, stats.wait_ns.summary().count);
+}
+
+// Test that a thread waiting for a held lock records how long it waited.
+TEST(InstrumentedMutexTest, Contended)
+{
+  LockStats stats;
+  InstrumentedMutex lock(&stats);
+
+  lock.lock();
+  std::thread waiter([&lock]()
+  {
+    std::lock_guard<InstrumentedMutex> guard(lock);
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  lock.unlock();
+  waiter.join();
+
+  EXPECT_EQ(2u, stats.acquisitions.load());
+  EXPECT_EQ(1u, stats.contended.load());
+  EXPECT_EQ(1u, stats.wait_ns.summary().count);
+  EXPECT_GE(stats.wait_ns.summary().max_us, 10000000u);
+  EXPECT_GE(stats.hold_ns.summary().max_us, 10000000u);
+}
+
+// Test try_lock.
+TEST(InstrumentedMutexTest, TryLock)
+{
+  LockStats stats;
+  InstrumentedMutex lock(&stats);
+
+  EXPECT_TRUE(lock.try_lock());
+
+  bool locked = true;
+  std::thread other([&lock, &locked]() { locked = lock.try_lock(); });
+  other.join();
+  EXPECT_FALSE(locked);
+
+  lock.unlock();
+
+  EXPECT_EQ(1u, stats.acquisitions.load());
+  EXPECT_EQ(0u, stats.contended.load());
+}
+
+// Test that a recursive lock is counted as held from the outermost lock to
+// the matching unlock.
+TEST(InstrumentedMutexTest, Recursive)
+{
+  LockStats stats;
+  InstrumentedMutex lock(&stats, true);
+
+  lock.lock();
+  lock.lock();
+  lock.unlock();
+  EXPECT_EQ(0u, stats.hold_ns.summary().count);
+  lock.unlock();
+
+  EXPECT_EQ(1u, stats.acquisitions.load());
+  EXPECT_EQ(1u, stats.hold_ns.summary().count);
+}
+
+// Test that time spent waiting on a condition variable isn't counted as
+// holding the lock.
+TEST(InstrumentedMutexTest, ConditionWait)
+{
+  LockStats stats;
+  InstrumentedMutex lock(&stats);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_t cond;
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += 50 * 1000 * 1000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  lock.lock();
+  EXPECT_EQ(ETIMEDOUT, lock.timedwait(&cond, &deadline));
+  lock.unlock();
+
+  pthread_cond_destroy(&cond);
+
+  EXPECT_EQ(2u, stats.hold_ns.summary().count);
+  EXPECT_LT(stats.hold_ns.summary().max_us, 10000000u);
+}
+
+// Test that locks with the same name share their statistics.
+TEST(InstrumentedMutexTest, Named)
+{
+  InstrumentedMutex lock1("ut_named");
+  InstrumentedMutex lock2("ut_named");
+
+  lock1.lock();
+  lock1.unlock();
+  lock2.lock();
+  lock2.unlock();
+
+  bool found = false;
+  for (const LockInstrumentation::LockSummary& summary :
+                                             LockInstrumentation::summaries())
+  {
+    if (summary.name == "ut_named")
+    {
+      found = true;
+      EXPECT_EQ(2u, summary.acquisitions);
+      EXPECT_EQ(2u, summary.hold_ns.count);
+    }
+  }
+
+  EXPECT_TRUE(found);
+}
@@ -0,0 +1,98 @@
+/**
+ * @file load_report_queue_test.cpp UT for LoadReportQueue.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "mockloadmonitor.hpp"
+#include "load_report_queue.h"
+
+using ::testing::_;
+using ::testing::InSequence;
+using ::testing::Return;
+using ::testing::StrictMock;
+
+class LoadReportQueueTest : public ::testing::Test
+{
+public:
+  LoadReportQueueTest()
+  {
+    EXPECT_CALL(_load_monitor, get_target_latency_us()).WillOnce(Return(100000));
+    _queue = new LoadReportQueue(&_load_monitor, 2);
+  }
+
+  virtual ~LoadReportQueueTest()
+  {
+    delete _queue; _queue = NULL;
+  }
+
+  StrictMock<MockLoadMonitor> _load_monitor;
+  LoadReportQueue* _queue;
+};
+
+// Reports are held until the queue is flushed, then passed on in order, and
+// the target latency is refreshed.
+TEST_F(LoadReportQueueTest, FlushPassesReportsOn)
+{
+  EXPECT_EQ(100000UL, _queue->get_target_latency_us());
+
+  _queue->request_complete(0, 1000, 1);
+  _queue->request_complete(1, 2000, 2);
+  _queue->request_complete(0, 3000, 3);
+
+  {
+    InSequence seq;
+    EXPECT_CALL(_load_monitor, request_complete(1000, 1));
+    EXPECT_CALL(_load_monitor, request_complete(3000, 3));
+    EXPECT_CALL(_load_monitor, request_complete(2000, 2));
+    EXPECT_CALL(_load_monitor, get_target_latency_us()).WillOnce(Return(50000));
+  }
+  _queue->flush();
+  EXPECT_EQ(50000UL, _queue->get_target_latency_us());
+
+  // Nothing more to pass on, so the load monitor isn't touched.
+  _queue->flush();
+}
+
+// Reports from workers without a queue go straight to the load monitor.
+TEST_F(LoadReportQueueTest, NoQueue)
+{
+  EXPECT_CALL(_load_monitor, request_complete(1000, 1));
+  _queue->request_complete(-2, 1000, 1);
+
+  EXPECT_CALL(_load_monitor, request_complete(2000, 2));
+  _queue->request_complete(2, 2000, 2);
+
+  _queue->flush();
+}
+
+// Once a worker's queue is full, its reports go straight to the load monitor.
+TEST_F(LoadReportQueueTest, QueueFull)
+{
+  for (size_t ii = 0; ii < LoadReportQueue::QUEUE_SIZE; ++ii)
+  {
+    _queue->request_complete(0, 1000, 1);
+  }
+
+  EXPECT_CALL(_load_monitor, request_complete(2000, 2));
+  _queue->request_complete(0, 2000, 2);
+
+  EXPECT_CALL(_load_monitor, request_complete(1000, 1))
+    .Times(LoadReportQueue::QUEUE_SIZE);
+  EXPECT_CALL(_load_monitor, get_target_latency_us()).WillOnce(Return(100000));
+  _queue->flush();
+
+  // The queue has room again.
+  _queue->request_complete(0, 3000, 3);
+  EXPECT_CALL(_load_monitor, request_complete(3000, 3));
+  EXPECT_CALL(_load_monitor, get_target_latency_us()).WillOnce(Return(100000));
+  _queue->flush();
+}
@@ -0,0 +1,69 @@
+/**
+ * @file memory_accounting_test.cpp UT for MemoryAccounting.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "memory_accounting.h"
+#include "metrics.h"
+
+// Adjustments are summed, and the high-water mark is kept.
+TEST(MemoryAccountingTest, Adjust)
+{
+  MemoryAccounting::Account* account = MemoryAccounting::account("test_adjust");
+  EXPECT_EQ(account, MemoryAccounting::account("test_adjust"));
+
+  account->add(1000);
+  account->add(500);
+  account->remove(1200);
+  EXPECT_EQ(300, account->bytes());
+  EXPECT_EQ(1500, account->high_water());
+}
+
+// An account with a sampler reports what the sampler returns.
+TEST(MemoryAccountingTest, Sampler)
+{
+  MemoryAccounting::Account* account = MemoryAccounting::account("test_sampler");
+  size_t sampled = 2000;
+  account->set_sampler([&sampled]() { return sampled; });
+
+  EXPECT_EQ(2000, account->bytes());
+  sampled = 100;
+  EXPECT_EQ(100, account->bytes());
+  EXPECT_EQ(2000, account->high_water());
+
+  account->set_sampler(nullptr);
+  EXPECT_EQ(0, account->bytes());
+}
+
+// Every account is reported, and exported as gauges.
+TEST(MemoryAccountingTest, Usage)
+{
+  MemoryAccounting::account("test_usage")->add(4096);
+
+  bool found = false;
+  for (const MemoryAccounting::Usage& usage : MemoryAccounting::usage())
+  {
+    if (usage.name == "test_usage")
+    {
+      found = true;
+      EXPECT_EQ(4096, usage.bytes);
+      EXPECT_EQ(4096, usage.high_water);
+    }
+  }
+  EXPECT_TRUE(found);
+
+  std::string text = Metrics::render();
+  EXPECT_NE(std::string::npos, text.find("# TYPE sprout_memory_test_usage_bytes gauge\n"));
+  EXPECT_NE(std::string::npos, text.find("sprout_memory_test_usage_bytes 4096\n"));
+  EXPECT_NE(std::string::npos, text.find("sprout_memory_test_usage_high_water_bytes 4096\n"));
+}
@@ -0,0 +1,92 @@
+/**
+ * @file metrics_test.cpp UT for Metrics.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "metrics.h"
+
+// Increments from many threads are all counted.
+TEST(MetricsTest, CounterSumsShards)
+{
+  Metrics::Counter* counter = Metrics::counter("test_counter", "A counter");
+  EXPECT_EQ(counter, Metrics::counter("test_counter", "A counter"));
+
+  std::vector<std::thread> threads;
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    threads.emplace_back([counter]()
+    {
+      for (int jj = 0; jj < 1000; ++jj)
+      {
+        counter->increment();
+      }
+    });
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  EXPECT_EQ(8000u, counter->value());
+}
+
+// Values go into the first bucket whose bound they are within.
+TEST(MetricsTest, HistogramBuckets)
+{
+  Metrics::Histogram histogram({100, 1000});
+  histogram.observe(50);
+  histogram.observe(100);
+  histogram.observe(500);
+  histogram.observe(5000);
+
+  std::vector<uint64_t> counts;
+  uint64_t sum_us;
+  histogram.totals(counts, sum_us);
+
+  ASSERT_EQ(3u, counts.size());
+  EXPECT_EQ(2u, counts[0]);
+  EXPECT_EQ(1u, counts[1]);
+  EXPECT_EQ(1u, counts[2]);
+  EXPECT_EQ(5650u, sum_us);
+}
+
+// Metrics are rendered in OpenMetrics text format, with cumulative buckets
+// and times in seconds.
+TEST(MetricsTest, Render)
+{
+  Metrics::counter("test_render_counter", "Things counted")->increment(3);
+  Metrics::Histogram* histogram =
+    Metrics::histogram("test_render_seconds", "Time taken", {500, 2000});
+  histogram->observe(400);
+  histogram->observe(1500);
+  histogram->observe(3000);
+
+  std::string text = Metrics::render();
+
+  EXPECT_NE(std::string::npos, text.find("# TYPE test_render_counter counter\n"
+                                         "# HELP test_render_counter Things counted\n"
+                                         "test_render_counter_total 3\n"));
+  EXPECT_NE(std::string::npos, text.find("# TYPE test_render_seconds histogram\n"
+                                         "# HELP test_render_seconds Time taken\n"
+                                         "test_render_seconds_bucket{le=\"0.0005\"} 1\n"
+                                         "test_render_seconds_bucket{le=\"0.002\"} 2\n"
+                                         "test_render_seconds_bucket{le=\"+Inf\"} 3\n"
+                                         "test_render_seconds_sum 0.004900\n"
+                                         "test_render_seconds_count 3\n"));
+
+  // The exposition must end with the EOF marker.
+  ASSERT_GE(text.size(), 6u);
+  EXPECT_EQ("# EOF\n", text.substr(text.size() - 6));
+}
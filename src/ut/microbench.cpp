@@ -0,0 +1,315 @@
+/**
+ * @file microbench.cpp Microbenchmark harness and main.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "microbench.hpp"
+#include "stack.h"
+#include "custom_headers.h"
+#include "log.h"
+
+static pj_caching_pool caching_pool;
+static pjsip_endpoint* bench_endpt = NULL;
+static pj_pool_t* bench_pool = NULL;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+MicroBench::State::State(uint64_t iterations) :
+  _iterations(iterations),
+  _remaining(iterations),
+  _running(false),
+  _real_start_ns(0),
+  _cpu_start_ns(0),
+  _real_ns(0),
+  _cpu_ns(0)
+{
+}
+
+void MicroBench::State::start()
+{
+  _real_ns = 0;
+  _cpu_ns = 0;
+  resume_timing();
+}
+
+void MicroBench::State::stop()
+{
+  pause_timing();
+}
+
+void MicroBench::State::pause_timing()
+{
+  if (_running)
+  {
+    _real_ns += clock_ns(CLOCK_MONOTONIC) - _real_start_ns;
+    _cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - _cpu_start_ns;
+    _running = false;
+  }
+}
+
+void MicroBench::State::resume_timing()
+{
+  if (!_running)
+  {
+    _real_start_ns = clock_ns(CLOCK_MONOTONIC);
+    _cpu_start_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    _running = true;
+  }
+}
+
+struct Registered
+{
+  std::string name;
+  MicroBench::Benchmark benchmark;
+};
+
+// The registered benchmarks.  This is a function-level static so that it is
+// constructed before the registrars in other files use it.
+static std::vector<Registered>& registered()
+{
+  static std::vector<Registered> benchmarks;
+  return benchmarks;
+}
+
+MicroBench::Registrar::Registrar(const char* name, Benchmark benchmark)
+{
+  registered().push_back(Registered{name, benchmark});
+}
+
+pjsip_endpoint* MicroBench::endpt()
+{
+  return bench_endpt;
+}
+
+pj_pool_t* MicroBench::pool()
+{
+  return bench_pool;
+}
+
+pjsip_msg* MicroBench::parse_msg(const std::string& msg, pj_pool_t* pool)
+{
+  // The parser needs a writable buffer that lasts as long as the message.
+  char* buf = (char*)pj_pool_alloc(pool, msg.length() + 1);
+  memcpy(buf, msg.data(), msg.length());
+  buf[msg.length()] = '\0';
+  return pjsip_parse_msg(pool, buf, msg.length(), NULL);
+}
+
+/// The result of running one benchmark.
+struct Result
+{
+  std::string name;
+  uint64_t iterations;
+  double real_ns;
+  double cpu_ns;
+};
+
+/// Runs a benchmark for at least min_time_s, working up to the number of
+/// iterations that takes.
+static Result run(const Registered& bench, double min_time_s)
+{
+  const uint64_t MAX_ITERATIONS = 1000000000;
+  const double min_time_ns = min_time_s * 1e9;
+  uint64_t iterations = 1;
+
+  while (true)
+  {
+    MicroBench::State state(iterations);
+    bench.benchmark(state);
+
+    if ((state.real_ns() >= min_time_ns) || (iterations >= MAX_ITERATIONS))
+    {
+      return Result{bench.name,
+                    iterations,
+                    (double)state.real_ns() / iterations,
+                    (double)state.cpu_ns() / iterations};
+    }
+
+    // Aim a bit past the minimum time, but grow by at most 10x at a time in
+    // case the short runs were unrepresentative.
+    double multiplier = 10.0;
+
+    if (state.real_ns() > 0)
+    {
+      multiplier = std::min(10.0, min_time_ns * 1.4 / state.real_ns());
+    }
+
+    iterations = std::min(MAX_ITERATIONS,
+                          std::max(iterations + 1,
+                                   (uint64_t)(iterations * multiplier)));
+  }
+}
+
+static std::string results_to_json(const std::vector<Result>& results,
+                                   const char* executable)
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  char date[64];
+  time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+  writer.StartObject();
+  {
+    writer.String("context");
+    writer.StartObject();
+    {
+      writer.String("date");
+      writer.String(date);
+      writer.String("executable");
+      writer.String(executable);
+      writer.String("num_cpus");
+      writer.Int(sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    writer.EndObject();
+
+    writer.String("benchmarks");
+    writer.StartArray();
+    for (const Result& result : results)
+    {
+      writer.StartObject();
+      writer.String("name");
+      writer.String(result.name.c_str());
+      writer.String("iterations");
+      writer.Uint64(result.iterations);
+      writer.String("real_time");
+      writer.Double(result.real_ns);
+      writer.String("cpu_time");
+      writer.Double(result.cpu_ns);
+      writer.String("time_unit");
+      writer.String("ns");
+      writer.EndObject();
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+static void usage(const char* executable)
+{
+  printf("Usage: %s [options]\n"
+         "\n"
+         " --filter=<string>     Only run benchmarks whose names contain this\n"
+         " --min-time=<seconds>  How long to run each benchmark for (default 0.5)\n"
+         " --json=<file>         Also write the results to this file as JSON\n"
+         " --help                Show this help\n",
+         executable);
+}
+
+int main(int argc, char** argv)
+{
+  std::string filter;
+  std::string json_file;
+  double min_time_s = 0.5;
+
+  for (int ii = 1; ii < argc; ++ii)
+  {
+    if (strncmp(argv[ii], "--filter=", 9) == 0)
+    {
+      filter = argv[ii] + 9;
+    }
+    else if (strncmp(argv[ii], "--min-time=", 11) == 0)
+    {
+      min_time_s = atof(argv[ii] + 11);
+    }
+    else if (strncmp(argv[ii], "--json=", 7) == 0)
+    {
+      json_file = argv[ii] + 7;
+    }
+    else
+    {
+      usage(argv[0]);
+      return (strcmp(argv[ii], "--help") == 0) ? 0 : 1;
+    }
+  }
+
+  // Only log errors, so that logging doesn't swamp what is being measured.
+  Log::setLoggingLevel(Log::ERROR_LEVEL);
+
+  pj_init();
+  pjlib_util_init();
+  pj_caching_pool_init(&caching_pool, &pj_pool_factory_default_policy, 0);
+  pjsip_endpt_create(&caching_pool.factory, NULL, &bench_endpt);
+  bench_pool = pj_pool_create(&caching_pool.factory, "microbench", 4000, 4000, NULL);
+  init_pjsip_logging(0, false, "");
+  register_custom_headers();
+  stack_data.endpt = bench_endpt;
+  stack_data.pool = bench_pool;
+
+  std::vector<Registered> benchmarks = registered();
+  std::sort(benchmarks.begin(),
+            benchmarks.end(),
+            [](const Registered& lhs, const Registered& rhs)
+            {
+              return lhs.name < rhs.name;
+            });
+
+  std::vector<Result> results;
+  printf("%-50s %15s %15s %12s\n", "Benchmark", "Time (ns)", "CPU (ns)", "Iterations");
+
+  for (const Registered& bench : benchmarks)
+  {
+    if (bench.name.find(filter) == std::string::npos)
+    {
+      continue;
+    }
+
+    Result result = run(bench, min_time_s);
+    printf("%-50s %15.1f %15.1f %12lu\n",
+           result.name.c_str(),
+           result.real_ns,
+           result.cpu_ns,
+           (unsigned long)result.iterations);
+    fflush(stdout);
+    results.push_back(result);
+  }
+
+  int rc = 0;
+
+  if (!json_file.empty())
+  {
+    std::ofstream out(json_file.c_str());
+    out << results_to_json(results, argv[0]) << std::endl;
+
+    if (!out)
+    {
+      fprintf(stderr, "Failed to write results to %s\n", json_file.c_str());
+      rc = 1;
+    }
+  }
+
+  stack_data.endpt = NULL;
+  stack_data.pool = NULL;
+  pj_pool_release(bench_pool);
+  pjsip_endpt_destroy(bench_endpt);
+  pj_caching_pool_destroy(&caching_pool);
+  pj_shutdown();
+
+  return rc;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file microbench.hpp Microbenchmark harness for sprout's hot paths.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MICROBENCH_HPP__
+#define MICROBENCH_HPP__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib-util.h>
+#include <pjlib.h>
+}
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+/// A small harness in the style of Google Benchmark.  Each benchmark is a
+/// function that does its setup, and then repeats the code being measured
+/// while state.keep_running() returns true - only that loop is timed.  The
+/// harness picks the number of iterations so that each benchmark runs for
+/// long enough to give a stable figure.
+///
+///   static void BM_Something(MicroBench::State& state)
+///   {
+///     Something thing;
+///     while (state.keep_running())
+///     {
+///       MicroBench::do_not_optimize(thing.do_it());
+///     }
+///   }
+///   MICROBENCH(BM_Something);
+namespace MicroBench
+{
+  class State
+  {
+  public:
+    State(uint64_t iterations);
+
+    /// Returns true until the benchmark has run the required number of
+    /// iterations.  The timer starts on the first call and stops on the last.
+    bool keep_running()
+    {
+      if (_remaining == _iterations)
+      {
+        start();
+      }
+
+      if (_remaining == 0)
+      {
+        stop();
+        return false;
+      }
+
+      --_remaining;
+      return true;
+    }
+
+    uint64_t iterations() const { return _iterations; }
+
+    /// Pauses the timer, for per-iteration work that shouldn't be measured.
+    void pause_timing();
+    void resume_timing();
+
+    uint64_t real_ns() const { return _real_ns; }
+    uint64_t cpu_ns() const { return _cpu_ns; }
+
+  private:
+    void start();
+    void stop();
+
+    const uint64_t _iterations;
+    uint64_t _remaining;
+    bool _running;
+    uint64_t _real_start_ns;
+    uint64_t _cpu_start_ns;
+    uint64_t _real_ns;
+    uint64_t _cpu_ns;
+  };
+
+  typedef std::function<void(State&)> Benchmark;
+
+  /// Registers a benchmark.  Use MICROBENCH rather than this directly.
+  struct Registrar
+  {
+    Registrar(const char* name, Benchmark benchmark);
+  };
+
+  /// Stops the compiler optimizing away a value the benchmark computes.
+  template <class T> inline void do_not_optimize(T const& value)
+  {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+
+  /// The PJSIP endpoint and a pool for benchmarks to use.  The pool lasts for
+  /// the whole run, so benchmarks that allocate on every iteration must use
+  /// their own.
+  pjsip_endpoint* endpt();
+  pj_pool_t* pool();
+
+  /// Parses a SIP message.  Returns NULL if it isn't valid.
+  pjsip_msg* parse_msg(const std::string& msg, pj_pool_t* pool);
+}
+
+#define MICROBENCH(FN) \
+  static MicroBench::Registrar FN##_registrar(#FN, FN)
+
+#endif
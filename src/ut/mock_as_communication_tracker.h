@@ -22,6 +22,12 @@ public:
 
   MOCK_METHOD1(on_success, void(const std::string&));
   MOCK_METHOD2(on_failure, void(const std::string&, const std::string&));
+  MOCK_METHOD1(is_circuit_open, bool(const std::string&));
+
+  // Calls for a slot are checked as calls for its URI.
+  void on_success(AsSlot* slot) { on_success(slot->uri); }
+  void on_failure(AsSlot* slot, const std::string& reason) { on_failure(slot->uri, reason); }
+  bool is_circuit_open(AsSlot* slot) { return is_circuit_open(slot->uri); }
 };
 
 #endif
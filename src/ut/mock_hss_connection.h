@@ -33,6 +33,13 @@ public:
                         HSSConnection::irs_info& irs_info,
                         SAS::TrailId trail));
 
+  MOCK_METHOD1(invalidate_cached_registration_data,
+               void(const std::string& public_id));
+
+  MOCK_METHOD3(update_cached_service_profiles,
+               void(const std::string& public_id,
+                    const PushedProfile& profile,
+                    SAS::TrailId trail));
 };
 
 #endif
@@ -24,6 +24,14 @@ public:
 
   MOCK_METHOD2(lookup_priority, SIPEventPriorityLevel(std::string rph_value,
                                                       SAS::TrailId trail));
+
+  // Pass lookups of header values to the mocked method, so tests can set
+  // expectations on the value as a string.
+  virtual SIPEventPriorityLevel lookup_priority(const pj_str_t& rph_value,
+                                                SAS::TrailId trail) override
+  {
+    return lookup_priority(std::string(rph_value.ptr, rph_value.slen), trail);
+  }
 };
 
 #endif
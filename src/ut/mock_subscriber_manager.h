@@ -61,6 +61,14 @@ public:
                                       Bindings& bindings,
                                       SAS::TrailId trail));
 
+  MOCK_METHOD4(get_bindings_multi, void(const std::vector<std::string>& aor_ids,
+                                        std::vector<Bindings>& bindings,
+                                        std::vector<HTTPCode>& rcs,
+                                        SAS::TrailId trail));
+
+  MOCK_METHOD2(deregister_subscribers, HTTPCode(const std::vector<std::string>& public_ids,
+                                                SAS::TrailId trail));
+
   MOCK_METHOD3(get_subscriptions, HTTPCode(const std::string& public_id,
                                            Subscriptions& subscriptions,
                                            SAS::TrailId trail));
@@ -77,9 +85,16 @@ public:
                                                 const AssociatedURIs& associated_uris,
                                                 SAS::TrailId trail));
 
+  MOCK_METHOD3(update_service_profile, HTTPCode(const std::string& aor_id,
+                                                const PushedProfile& profile,
+                                                SAS::TrailId trail));
+
   MOCK_METHOD2(handle_timer_pop, void(const std::string& aor_id,
                                       SAS::TrailId trail));
 
+  MOCK_METHOD2(handle_timer_pops, void(const std::vector<std::string>& aor_ids,
+                                       SAS::TrailId trail));
+
   MOCK_METHOD7(register_with_application_servers, void(pjsip_msg* received_register_message,
                                                        pjsip_msg* ok_response_msg,
                                                        const std::string& served_user,
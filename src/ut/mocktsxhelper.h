@@ -28,6 +28,7 @@ public:
   SAS::TrailId _trail;
 
   MOCK_METHOD0(original_request, pjsip_msg*());
+  MOCK_CONST_METHOD0(original_request_view, const pjsip_msg*());
   MOCK_METHOD1(copy_original_transport, void(pjsip_msg*));
   MOCK_CONST_METHOD0(route_hdr, const pjsip_route_hdr*());
   MOCK_CONST_METHOD1(get_reflexive_uri, pjsip_sip_uri*(pj_pool_t*));
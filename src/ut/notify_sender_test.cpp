@@ -304,6 +304,64 @@ TEST_F(NotifySenderTest, NotifyCheckInDetail)
   delete updated_aor; updated_aor = NULL;
 }
 
+// Check the exact bytes of a NOTIFY body, with a wildcarded IMPU and unknown
+// parameters both with and without values.  This pins down the layout of the
+// body (which matches what pj_xml_print produces).
+TEST_F(NotifySenderTest, NotifyBodyExactBytes)
+{
+  AoR* orig_aor = new AoR();
+  std::string aor_id = "sip:1234567890@homedomain";
+  AoR* updated_aor = AoRTestUtils::create_simple_aor(aor_id);
+  updated_aor->_associated_uris.add_uri("sip:!.*!", false);
+  updated_aor->_associated_uris.add_wildcard_mapping("sip:!.*!", "sip:1234567893@homedomain");
+
+  // Use simple unknown parameters (and no instance ID, so no GRUU) so the
+  // body doesn't depend on how values are escaped.
+  Binding* b = updated_aor->get_binding(AoRTestUtils::BINDING_ID);
+  b->_params.clear();
+  b->_params["p1"] = "";
+  b->_params["p2"] = "v2";
+  b->_params["expires"] = "300";
+
+  _notify_sender->send_notifys(aor_id,
+                               *orig_aor,
+                               *updated_aor,
+                               SubscriberDataUtils::EventTrigger::USER,
+                               time(NULL),
+                               0);
+
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+
+  char buf[16384];
+  int n = out->body->print_body(out->body, buf, sizeof(buf));
+  ASSERT_GT(n, 0);
+
+  std::string contact =
+    "  <contact id=\"&lt;urn:uuid:00000000-0000-0000-0000-b4dd32817622&gt;:1\" state=\"active\" event=\"created\">\n"
+    "   <uri>sip:6505550231@192.91.191.29:59934;transport=tcp;ob</uri>\n"
+    "   <unknown-param name=\"p1\" />\n"
+    "   <unknown-param name=\"p2\">v2</unknown-param>\n"
+    "  </contact>\n";
+  std::string expected =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<reginfo xmlns=\"urn:ietf:params:xml:ns:reginfo\" xmlns:gr=\"urn:ietf:params:xml:ns:gruuinfo\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xmlns:ere=\"urn:3gpp:ns:extRegExp:1.0\" version=\"0\" state=\"full\">\n"
+    " <registration aor=\"sip:1234567890@homedomain\" id=\"1234\" state=\"active\">\n" +
+    contact +
+    " </registration>\n"
+    " <registration aor=\"sip:wildcardimpu@wildcard\" id=\"1234\" state=\"active\">\n"
+    "  <ere:wildcardedIdentity>sip:!.*!</ere:wildcardedIdentity>\n" +
+    contact +
+    " </registration>\n"
+    "</reginfo>\n";
+  EXPECT_EQ(expected, std::string(buf, n));
+
+  // Tidy up
+  inject_msg(respond_to_current_txdata(200));
+  delete orig_aor; orig_aor = NULL;
+  delete updated_aor; updated_aor = NULL;
+}
+
 // Remove a subscription when we've removed a binding that has the same contact
 // URI. In this test this is triggered by an admin action, so we should send
 // NOTIFYs.
@@ -0,0 +1,103 @@
+/**
+ * @file number_microbench.cpp Microbenchmarks for number normalization.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <boost/regex.hpp>
+
+#include "microbench.hpp"
+#include "number_normalizer.h"
+
+// The regular expressions that ENUM and the BGCF used to normalize numbers,
+// for comparison.
+static const boost::regex CHARS_TO_STRIP_FROM_UAS("([^0-9+]|(?<=.)[^0-9])");
+static const boost::regex CHARS_TO_STRIP_FROM_DOMAIN("[^0-9]");
+static const boost::regex VISUAL_SEPARATORS("[.)(-]");
+
+// A dialled number with visual separators.
+static const std::string NUMBER = "+1 (650) 555-1234";
+
+static void BM_Number_aus_regex(MicroBench::State& state)
+{
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(
+      boost::regex_replace(NUMBER, CHARS_TO_STRIP_FROM_UAS, std::string("")));
+  }
+}
+MICROBENCH(BM_Number_aus_regex);
+
+static void BM_Number_aus(MicroBench::State& state)
+{
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(NumberNormalizer::to_aus(NUMBER));
+  }
+}
+MICROBENCH(BM_Number_aus);
+
+static void BM_Number_visual_separators_regex(MicroBench::State& state)
+{
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(
+      boost::regex_replace(NUMBER, VISUAL_SEPARATORS, std::string("")));
+  }
+}
+MICROBENCH(BM_Number_visual_separators_regex);
+
+static void BM_Number_visual_separators(MicroBench::State& state)
+{
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(NumberNormalizer::remove_visual_separators(NUMBER));
+  }
+}
+MICROBENCH(BM_Number_visual_separators);
+
+// Building the domain as DNSEnumService did - stripping the number with a
+// regex, and then reversing it.
+static void BM_Number_enum_domain_regex(MicroBench::State& state)
+{
+  const std::string suffix = ".e164.arpa";
+
+  while (state.keep_running())
+  {
+    std::string number = boost::regex_replace(NUMBER,
+                                              CHARS_TO_STRIP_FROM_DOMAIN,
+                                              std::string(""));
+    std::string domain;
+
+    for (int ch_idx = number.length() - 1; ch_idx >= 0; ch_idx--)
+    {
+      domain.push_back(number[ch_idx]);
+
+      if (ch_idx != 0)
+      {
+        domain.push_back('.');
+      }
+    }
+
+    domain += suffix;
+    MicroBench::do_not_optimize(domain);
+  }
+}
+MICROBENCH(BM_Number_enum_domain_regex);
+
+static void BM_Number_enum_domain(MicroBench::State& state)
+{
+  const std::string suffix = ".e164.arpa";
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(NumberNormalizer::enum_domain(NUMBER, suffix));
+  }
+}
+MICROBENCH(BM_Number_enum_domain);
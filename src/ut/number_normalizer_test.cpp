@@ -0,0 +1,92 @@
+/**
+ * @file number_normalizer_test.cpp UT for NumberNormalizer.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include <boost/regex.hpp>
+#include "gtest/gtest.h"
+
+#include "number_normalizer.h"
+
+// The regular expressions the normalizer replaces.
+static const boost::regex CHARS_TO_STRIP_FROM_UAS("([^0-9+]|(?<=.)[^0-9])");
+static const boost::regex CHARS_TO_STRIP_FROM_DOMAIN("[^0-9]");
+static const boost::regex VISUAL_SEPARATORS("[.)(-]");
+
+static const std::vector<std::string> NUMBERS =
+{
+  "",
+  "+",
+  "+16505551234",
+  "+1 (650) 555-1234",
+  "1-650-555.1234",
+  "tel:+1234;npdi",
+  "a+1b2c",
+  "++12+3",
+  "#31#*67",
+  "(((",
+  "0123456789abcdefABCDEF",
+  "+44\xc2\xa3" "20\xff" "7946"
+};
+
+// Test that the visual separators are stripped as the regex strips them.
+TEST(NumberNormalizerTest, VisualSeparators)
+{
+  for (const std::string& number : NUMBERS)
+  {
+    EXPECT_EQ(boost::regex_replace(number, VISUAL_SEPARATORS, std::string("")),
+              NumberNormalizer::remove_visual_separators(number)) << number;
+  }
+
+  EXPECT_EQ("+16505551234",
+            NumberNormalizer::remove_visual_separators("+1-650-(555).1234"));
+}
+
+// Test that users are converted to AUSs as the regex converts them.
+TEST(NumberNormalizerTest, Aus)
+{
+  for (const std::string& number : NUMBERS)
+  {
+    EXPECT_EQ(boost::regex_replace(number, CHARS_TO_STRIP_FROM_UAS, std::string("")),
+              NumberNormalizer::to_aus(number)) << number;
+  }
+
+  EXPECT_EQ("+16505551234", NumberNormalizer::to_aus("+1 (650) 555-1234"));
+  EXPECT_EQ("12", NumberNormalizer::to_aus("a+1b2c"));
+}
+
+// Test that ENUM domains are built as they were from the regex.
+TEST(NumberNormalizerTest, EnumDomain)
+{
+  for (const std::string& number : NUMBERS)
+  {
+    std::string digits = boost::regex_replace(number,
+                                              CHARS_TO_STRIP_FROM_DOMAIN,
+                                              std::string(""));
+    std::string domain;
+
+    for (int ii = digits.length() - 1; ii >= 0; --ii)
+    {
+      domain.push_back(digits[ii]);
+
+      if (ii != 0)
+      {
+        domain.push_back('.');
+      }
+    }
+
+    EXPECT_EQ(domain + ".e164.arpa",
+              NumberNormalizer::enum_domain(number, ".e164.arpa")) << number;
+  }
+
+  EXPECT_EQ("4.3.2.1.e164.arpa", NumberNormalizer::enum_domain("+1-234", ".e164.arpa"));
+  EXPECT_EQ(".e164.arpa", NumberNormalizer::enum_domain("+", ".e164.arpa"));
+}
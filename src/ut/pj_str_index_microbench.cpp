@@ -0,0 +1,142 @@
+/**
+ * @file pj_str_index_microbench.cpp Microbenchmarks for PjStrIndex.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "microbench.hpp"
+#include "pj_str_index.h"
+
+static const char* SERVICE_NAMES[] = {"scscf", "icscf", "bgcf", "mmtel",
+                                      "registrar", "authentication",
+                                      "subscription", "mangelwurzel"};
+static const int NUM_SERVICE_NAMES = sizeof(SERVICE_NAMES) / sizeof(SERVICE_NAMES[0]);
+
+/// Each service name, and a user part that doesn't match, as they would
+/// appear in a URI.
+static std::vector<pj_str_t> service_keys()
+{
+  std::vector<pj_str_t> keys;
+  for (int ii = 0; ii < NUM_SERVICE_NAMES; ++ii)
+  {
+    keys.push_back(pj_str((char*)SERVICE_NAMES[ii]));
+  }
+  keys.push_back(pj_str((char*)"6505551234"));
+  return keys;
+}
+
+static void BM_ServiceLookup_map(MicroBench::State& state)
+{
+  std::map<std::string, int> map;
+  for (int ii = 0; ii < NUM_SERVICE_NAMES; ++ii)
+  {
+    map[SERVICE_NAMES[ii]] = ii + 1;
+  }
+  std::vector<pj_str_t> keys = service_keys();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    const pj_str_t& key = keys[ii++ % keys.size()];
+    std::map<std::string, int>::const_iterator it =
+                                          map.find(std::string(key.ptr, key.slen));
+    MicroBench::do_not_optimize((it != map.end()) ? it->second : 0);
+  }
+}
+MICROBENCH(BM_ServiceLookup_map);
+
+static void BM_ServiceLookup_index(MicroBench::State& state)
+{
+  PjStrIndex<int> index(false, 0);
+  for (int ii = 0; ii < NUM_SERVICE_NAMES; ++ii)
+  {
+    index.insert(SERVICE_NAMES[ii], ii + 1);
+  }
+  std::vector<pj_str_t> keys = service_keys();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(index.find(&keys[ii++ % keys.size()]));
+  }
+}
+MICROBENCH(BM_ServiceLookup_index);
+
+static const int NUM_ALIASES = 10;
+
+static std::string alias(int ii)
+{
+  return "sprout-" + std::to_string(ii) + ".site1.example.com";
+}
+
+/// A host that matches an alias, and one that doesn't match at all.
+static std::vector<pj_str_t> host_keys()
+{
+  std::vector<pj_str_t> keys;
+  keys.push_back(pj_str((char*)"Sprout-9.site1.example.com"));
+  keys.push_back(pj_str((char*)"scscf.example.com"));
+  return keys;
+}
+
+// A linear scan of the aliases, as SproutletProxy used to do to find the
+// locality of a host.
+static void BM_HostLookup_scan(MicroBench::State& state)
+{
+  std::unordered_set<std::string> aliases;
+  for (int ii = 0; ii < NUM_ALIASES; ++ii)
+  {
+    aliases.insert(alias(ii));
+  }
+  std::vector<pj_str_t> keys = host_keys();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    const pj_str_t& key = keys[ii++ % keys.size()];
+    bool found = false;
+
+    // This is what pj_stricmp2 does for each alias.
+    for (const std::string& alias : aliases)
+    {
+      size_t alias_len = strlen(alias.c_str());
+      if ((strncasecmp(alias.c_str(), key.ptr, std::min(alias_len, (size_t)key.slen)) == 0) &&
+          (alias_len == (size_t)key.slen))
+      {
+        found = true;
+        break;
+      }
+    }
+
+    MicroBench::do_not_optimize(found);
+  }
+}
+MICROBENCH(BM_HostLookup_scan);
+
+static void BM_HostLookup_index(MicroBench::State& state)
+{
+  PjStrIndex<int> index(true, 0);
+  for (int ii = 0; ii < NUM_ALIASES; ++ii)
+  {
+    index.insert(alias(ii), 1);
+  }
+  std::vector<pj_str_t> keys = host_keys();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(index.find(&keys[ii++ % keys.size()]));
+  }
+}
+MICROBENCH(BM_HostLookup_index);
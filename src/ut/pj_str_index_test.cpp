@@ -0,0 +1,82 @@
+/**
+ * @file pj_str_index_test.cpp UT for PjStrIndex.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "pj_str_index.h"
+
+static pj_str_t to_pj_str(const char* str)
+{
+  pj_str_t pj_str;
+  pj_str.ptr = (char*)str;
+  pj_str.slen = strlen(str);
+  return pj_str;
+}
+
+// Test inserting and finding entries.
+TEST(PjStrIndexTest, InsertAndFind)
+{
+  PjStrIndex<int> index(false, -1);
+
+  EXPECT_TRUE(index.insert("scscf", 1));
+  EXPECT_TRUE(index.insert("icscf", 2));
+  EXPECT_FALSE(index.insert("scscf", 3));
+  EXPECT_EQ(2u, index.size());
+
+  pj_str_t key = to_pj_str("scscf");
+  EXPECT_EQ(1, index.find(&key));
+  key = to_pj_str("icscf");
+  EXPECT_EQ(2, index.find(&key));
+  key = to_pj_str("bgcf");
+  EXPECT_EQ(-1, index.find(&key));
+
+  // Keys are compared case-sensitively, and must match in full.
+  key = to_pj_str("SCSCF");
+  EXPECT_EQ(-1, index.find(&key));
+  EXPECT_EQ(-1, index.find("scscf", 4));
+  EXPECT_EQ(1, index.find("scscf.sprout.example.com", 5));
+  EXPECT_EQ(-1, index.find("", 0));
+}
+
+// Test case-insensitive keys.
+TEST(PjStrIndexTest, CaseInsensitive)
+{
+  PjStrIndex<int> index(true, 0);
+
+  EXPECT_TRUE(index.insert("sprout.Example.com", 1));
+  EXPECT_FALSE(index.insert("SPROUT.example.COM", 2));
+
+  pj_str_t key = to_pj_str("Sprout.example.com");
+  EXPECT_EQ(1, index.find(&key));
+  key = to_pj_str("sprout.example.co");
+  EXPECT_EQ(0, index.find(&key));
+}
+
+// Test that the index grows to hold many entries.
+TEST(PjStrIndexTest, Grow)
+{
+  PjStrIndex<int> index(false, -1);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    EXPECT_TRUE(index.insert("service" + std::to_string(ii), ii));
+  }
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    std::string name = "service" + std::to_string(ii);
+    EXPECT_EQ(ii, index.find(name.data(), name.length()));
+  }
+
+  EXPECT_EQ(-1, index.find("service1000", 11));
+}
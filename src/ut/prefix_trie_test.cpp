@@ -0,0 +1,85 @@
+/**
+ * @file prefix_trie_test.cpp UT for PrefixTrie.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "prefix_trie.h"
+
+class PrefixTrieTest : public ::testing::Test
+{
+public:
+  PrefixTrieTest()
+  {
+    trie.insert("+1", 1);
+    trie.insert("+123", 123);
+    trie.insert("+1234", 1234);
+    trie.insert("+1239", 1239);
+    trie.insert("+44", 44);
+  }
+
+  // Returns the value for the number, or -1 if there is no match.
+  int match(const std::string& number)
+  {
+    const int* value = trie.longest_prefix_match(number);
+    return (value != NULL) ? *value : -1;
+  }
+
+  PrefixTrie<int> trie;
+};
+
+// Test that the longest matching prefix wins.
+TEST_F(PrefixTrieTest, LongestPrefix)
+{
+  EXPECT_EQ(1234, match("+12345678"));
+  EXPECT_EQ(123, match("+1235678"));
+  EXPECT_EQ(1, match("+1555"));
+  EXPECT_EQ(44, match("+4420"));
+  EXPECT_EQ(-1, match("+33123"));
+  EXPECT_EQ(-1, match("123"));
+}
+
+// Test that a number that is a prefix of some keys matches the greatest of
+// them, as the previous prefix tables did.
+TEST_F(PrefixTrieTest, NumberShorterThanPrefix)
+{
+  EXPECT_EQ(1239, match("+12"));
+  EXPECT_EQ(1239, match("+123"));
+  EXPECT_EQ(44, match("+4"));
+  EXPECT_EQ(44, match(""));
+}
+
+// Test that duplicate keys keep the first value, and that the matched key is
+// returned.
+TEST_F(PrefixTrieTest, DuplicatesAndMatchedKey)
+{
+  trie.insert("+123", 999);
+  EXPECT_EQ(5u, trie.size());
+
+  std::string key;
+  const int* value = trie.longest_prefix_match("+1238", &key);
+  ASSERT_TRUE(value != NULL);
+  EXPECT_EQ(123, *value);
+  EXPECT_EQ("+123", key);
+}
+
+// Test that an empty key matches everything.
+TEST(PrefixTrieDefaultTest, EmptyKey)
+{
+  PrefixTrie<int> trie;
+  EXPECT_TRUE(trie.longest_prefix_match("123") == NULL);
+
+  trie.insert("", 0);
+  trie.insert("9", 9);
+  ASSERT_TRUE(trie.longest_prefix_match("123") != NULL);
+  EXPECT_EQ(0, *trie.longest_prefix_match("123"));
+  EXPECT_EQ(9, *trie.longest_prefix_match("98"));
+}
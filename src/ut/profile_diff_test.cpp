@@ -0,0 +1,159 @@
+/**
+ * @file profile_diff_test.cpp UT for ProfileDiff.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "xml_utils.h"
+#include "profile_diff.h"
+
+static const std::string IFC =
+  "<InitialFilterCriteria>"
+    "<Priority>1</Priority>"
+    "<TriggerPoint>"
+      "<ConditionTypeCNF>0</ConditionTypeCNF>"
+      "<SPT>"
+        "<ConditionNegated>0</ConditionNegated>"
+        "<Group>0</Group>"
+        "<Method>INVITE</Method>"
+      "</SPT>"
+    "</TriggerPoint>"
+    "<ApplicationServer>"
+      "<ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>"
+      "<DefaultHandling>0</DefaultHandling>"
+    "</ApplicationServer>"
+  "</InitialFilterCriteria>";
+
+class ProfileDiffTest : public ::testing::Test
+{
+public:
+  virtual ~ProfileDiffTest()
+  {
+    for (rapidxml::xml_document<>* doc : _docs)
+    {
+      delete doc;
+    }
+  }
+
+  // Returns the digests of an IMSSubscription made up of the specified
+  // ServiceProfiles.
+  ProfileDigests digests(const std::string& service_profiles)
+  {
+    std::string xml = "<IMSSubscription>" + service_profiles + "</IMSSubscription>";
+    rapidxml::xml_document<>* doc = new rapidxml::xml_document<>;
+    _docs.push_back(doc);
+    doc->parse<0>(doc->allocate_string(xml.c_str()));
+
+    ProfileDigests digests;
+    EXPECT_TRUE(ProfileDiff::digest(doc->first_node(RegDataXMLUtils::IMS_SUBSCRIPTION),
+                                    digests));
+    return digests;
+  }
+
+  static std::string identity(const std::string& impu, bool barred = false)
+  {
+    return "<PublicIdentity><Identity>" + impu + "</Identity>" +
+           (barred ? "<BarringIndication>1</BarringIndication>" : "") +
+           "</PublicIdentity>";
+  }
+
+private:
+  std::vector<rapidxml::xml_document<>*> _docs;
+};
+
+// Test that the same profile has no differences, however it's indented.
+TEST_F(ProfileDiffTest, Unchanged)
+{
+  ProfileDigests old_digests = digests("<ServiceProfile>" +
+                                       identity("sip:a@home") +
+                                       identity("sip:b@home") +
+                                       IFC +
+                                       "</ServiceProfile>");
+  ProfileDigests new_digests = digests("\n  <ServiceProfile>\n    " +
+                                       identity("sip:a@home") + "\n    " +
+                                       identity("sip:b@home") + "\n    " +
+                                       IFC +
+                                       "\n  </ServiceProfile>\n");
+  EXPECT_EQ(2u, new_digests.size());
+
+  ProfileDiff diff = ProfileDiff::compare(old_digests, new_digests);
+  EXPECT_TRUE(diff.empty());
+  EXPECT_FALSE(diff.identities_changed());
+}
+
+// Test that changing the iFCs of one service profile only changes the IMPUs
+// in that profile.
+TEST_F(ProfileDiffTest, ServicesChanged)
+{
+  ProfileDigests old_digests = digests("<ServiceProfile>" +
+                                       identity("sip:a@home") +
+                                       "</ServiceProfile>"
+                                       "<ServiceProfile>" +
+                                       identity("sip:b@home") +
+                                       identity("sip:c@home") +
+                                       "</ServiceProfile>");
+  ProfileDigests new_digests = digests("<ServiceProfile>" +
+                                       identity("sip:a@home") +
+                                       "</ServiceProfile>"
+                                       "<ServiceProfile>" +
+                                       identity("sip:b@home") +
+                                       identity("sip:c@home") +
+                                       IFC +
+                                       "</ServiceProfile>");
+
+  ProfileDiff diff = ProfileDiff::compare(old_digests, new_digests);
+  EXPECT_FALSE(diff.empty());
+  EXPECT_FALSE(diff.identities_changed());
+  EXPECT_EQ(std::vector<std::string>({"sip:b@home", "sip:c@home"}),
+            diff.services_changed);
+
+  // The digests refer to the ServiceProfile each IMPU is in.
+  EXPECT_EQ(new_digests["sip:b@home"].service_profile,
+            new_digests["sip:c@home"].service_profile);
+  EXPECT_NE(new_digests["sip:a@home"].service_profile,
+            new_digests["sip:b@home"].service_profile);
+}
+
+// Test that adding, removing and barring IMPUs are all identity changes.
+TEST_F(ProfileDiffTest, IdentitiesChanged)
+{
+  ProfileDigests old_digests = digests("<ServiceProfile>" +
+                                       identity("sip:a@home") +
+                                       identity("sip:b@home") +
+                                       identity("sip:c@home") +
+                                       "</ServiceProfile>");
+  ProfileDigests new_digests = digests("<ServiceProfile>" +
+                                       identity("sip:b@home", true) +
+                                       identity("sip:c@home") +
+                                       identity("sip:d@home") +
+                                       "</ServiceProfile>");
+
+  ProfileDiff diff = ProfileDiff::compare(old_digests, new_digests);
+  EXPECT_TRUE(diff.identities_changed());
+  EXPECT_EQ(std::vector<std::string>({"sip:d@home"}), diff.added);
+  EXPECT_EQ(std::vector<std::string>({"sip:a@home"}), diff.removed);
+  EXPECT_EQ(std::vector<std::string>({"sip:b@home"}), diff.identity_changed);
+  EXPECT_TRUE(diff.services_changed.empty());
+}
+
+// Test that a PublicIdentity without an Identity is rejected.
+TEST_F(ProfileDiffTest, MissingIdentity)
+{
+  std::string xml = "<IMSSubscription><ServiceProfile>"
+                    "<PublicIdentity></PublicIdentity>"
+                    "</ServiceProfile></IMSSubscription>";
+  rapidxml::xml_document<> doc;
+  doc.parse<0>(doc.allocate_string(xml.c_str()));
+
+  ProfileDigests digests;
+  EXPECT_FALSE(ProfileDiff::digest(doc.first_node(RegDataXMLUtils::IMS_SUBSCRIPTION),
+                                   digests));
+}
@@ -0,0 +1,135 @@
+/**
+ * @file profiler_test.cpp UT for the CPU and allocation profilers.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "profiler.h"
+
+/// Burns CPU until told to stop.
+static void spin(std::atomic<bool>* stop)
+{
+  volatile uint64_t count = 0;
+
+  while (!*stop)
+  {
+    count++;
+  }
+}
+
+/// Allocates until told to stop.
+static void allocate(std::atomic<bool>* stop)
+{
+  while (!*stop)
+  {
+    Profiler::record_allocation(1024);
+  }
+}
+
+TEST(ProfilerTest, CpuProfile)
+{
+  std::atomic<bool> stop(false);
+  std::thread spinner(spin, &stop);
+
+  std::string profile;
+  EXPECT_TRUE(Profiler::profile_cpu(1, 100, false, profile));
+
+  stop = true;
+  spinner.join();
+
+  // The profile starts with the legacy pprof header, and should have samples
+  // of the spinning thread.
+  ASSERT_GT(profile.size(), 5 * sizeof(uintptr_t));
+  const uintptr_t* words = (const uintptr_t*)profile.data();
+  EXPECT_EQ(0u, words[0]);
+  EXPECT_EQ(3u, words[1]);
+  EXPECT_EQ(0u, words[2]);
+  EXPECT_EQ(10000u, words[3]);
+  EXPECT_EQ(0u, words[4]);
+  EXPECT_GT(words[5], 0u);
+
+  // It ends with the memory map.
+  EXPECT_NE(std::string::npos, profile.find("[stack]"));
+}
+
+TEST(ProfilerTest, CpuProfileFolded)
+{
+  std::atomic<bool> stop(false);
+  std::thread spinner(spin, &stop);
+
+  std::string profile;
+  EXPECT_TRUE(Profiler::profile_cpu(1, 100, true, profile));
+
+  stop = true;
+  spinner.join();
+
+  // Each line is a stack, starting with the thread name, and its count.
+  ASSERT_FALSE(profile.empty());
+  EXPECT_EQ('\n', profile[profile.size() - 1]);
+  EXPECT_NE(std::string::npos, profile.find(';'));
+}
+
+TEST(ProfilerTest, OneCpuProfileAtATime)
+{
+  std::string profile;
+  std::thread first([&profile]() { Profiler::profile_cpu(1, 100, false, profile); });
+
+  // Give the first profile time to start.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  std::string second;
+  EXPECT_FALSE(Profiler::profile_cpu(1, 100, false, second));
+
+  first.join();
+}
+
+TEST(ProfilerTest, AllocProfile)
+{
+  // Allocations aren't sampled while no profile is being taken.
+  EXPECT_FALSE(Profiler::allocs_active);
+
+  std::atomic<bool> stop(false);
+  std::thread allocator(allocate, &stop);
+
+  std::string profile;
+  EXPECT_TRUE(Profiler::profile_allocs(1, false, profile));
+
+  stop = true;
+  allocator.join();
+  EXPECT_FALSE(Profiler::allocs_active);
+
+  // The thread allocated far more than the sampling interval in a second, so
+  // there should be samples.
+  EXPECT_EQ(0u, profile.find("heap profile: 0: 0 ["));
+  EXPECT_NE(std::string::npos, profile.find("@ heap_v2/524288\n"));
+  EXPECT_EQ(std::string::npos, profile.find("heap profile: 0: 0 [0: 0]"));
+  EXPECT_NE(std::string::npos, profile.find("\n0: 0 ["));
+  EXPECT_NE(std::string::npos, profile.find("\nMAPPED_LIBRARIES:\n"));
+}
+
+TEST(ProfilerTest, AllocProfileFolded)
+{
+  std::atomic<bool> stop(false);
+  std::thread allocator(allocate, &stop);
+
+  std::string profile;
+  EXPECT_TRUE(Profiler::profile_allocs(1, true, profile));
+
+  stop = true;
+  allocator.join();
+
+  ASSERT_FALSE(profile.empty());
+  EXPECT_EQ(0u, profile.find("sprout;"));
+}
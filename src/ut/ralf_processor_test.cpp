@@ -67,3 +67,128 @@ TEST_F(RalfProcessorTest, RequestComplete)
   _ralf_processor->send_request_to_ralf(rr);
   sleep(1);
 }
+
+class RalfProcessorBatchTest : public BaseTest
+{
+  MockHttpClient* _mock_client;
+  HttpConnection* _ralf_connection;
+  RalfProcessor* _ralf_processor;
+
+  RalfProcessorBatchTest()
+  {
+    _mock_client = new MockHttpClient();
+    _ralf_connection = new HttpConnection("ralf", _mock_client, "http");
+    _ralf_processor = new RalfProcessor(_ralf_connection, NULL, 1, 3, 100);
+
+    ON_CALL(*_mock_client, send_request(_))
+            .WillByDefault(Return(HttpResponse(HTTP_OK, "", {})));
+  }
+
+  virtual ~RalfProcessorBatchTest()
+  {
+    delete _ralf_processor;
+    delete _ralf_connection;
+    delete _mock_client;
+  }
+
+  RalfProcessor::RalfRequest* make_request(const std::string& path)
+  {
+    RalfProcessor::RalfRequest* rr = new RalfProcessor::RalfRequest();
+    rr->path = path;
+    rr->message = "message";
+    rr->trail = 0;
+    return rr;
+  }
+};
+
+// Test that a full batch is sent straight away, in order.
+TEST_F(RalfProcessorBatchTest, FullBatch)
+{
+  ::testing::InSequence seq;
+  EXPECT_CALL(*_mock_client, send_request(HasPath("path1")));
+  EXPECT_CALL(*_mock_client, send_request(HasPath("path2")));
+  EXPECT_CALL(*_mock_client, send_request(HasPath("path3")));
+
+  _ralf_processor->send_request_to_ralf(make_request("path1"));
+  _ralf_processor->send_request_to_ralf(make_request("path2"));
+  _ralf_processor->send_request_to_ralf(make_request("path3"));
+  sleep(1);
+}
+
+// Test that a partial batch is sent once it has waited for the batch delay.
+TEST_F(RalfProcessorBatchTest, PartialBatch)
+{
+  EXPECT_CALL(*_mock_client, send_request(HasPath("path1")));
+
+  _ralf_processor->send_request_to_ralf(make_request("path1"));
+  sleep(1);
+}
+
+
+class RalfProcessorSpoolTest : public BaseTest
+{
+  MockHttpClient* _mock_client;
+  HttpConnection* _ralf_connection;
+  AcrSpool* _spool;
+  RalfProcessor* _ralf_processor;
+
+  RalfProcessorSpoolTest()
+  {
+    unlink("/tmp/ralf_processor_test.spool");
+    _mock_client = new MockHttpClient();
+    _ralf_connection = new HttpConnection("ralf", _mock_client, "http");
+    _spool = new AcrSpool("/tmp/ralf_processor_test.spool", 65536);
+    _spool->init();
+    _ralf_processor = new RalfProcessor(_ralf_connection,
+                                        NULL,
+                                        1,
+                                        1,
+                                        0,
+                                        NULL,
+                                        NULL,
+                                        _spool,
+                                        10,
+                                        100);
+  }
+
+  virtual ~RalfProcessorSpoolTest()
+  {
+    delete _ralf_processor;
+    delete _ralf_connection;
+    delete _mock_client;
+    unlink("/tmp/ralf_processor_test.spool");
+  }
+};
+
+// Test that an ACR that Ralf fails to accept is spooled rather than lost.
+TEST_F(RalfProcessorSpoolTest, SpoolOnFailure)
+{
+  EXPECT_CALL(*_mock_client, send_request(HasPath("path")))
+    .WillOnce(Return(HttpResponse(HTTP_SERVER_UNAVAILABLE, "", {})));
+
+  RalfProcessor::RalfRequest* rr = new RalfProcessor::RalfRequest();
+  rr->path = "path";
+  rr->message = "message";
+  rr->trail = 0;
+  _ralf_processor->send_request_to_ralf(rr);
+  sleep(1);
+
+  EXPECT_EQ(1u, _spool->count());
+}
+
+// Test that an ACR that Ralf rejects isn't spooled, as resending it won't
+// help.
+TEST_F(RalfProcessorSpoolTest, NoSpoolOnReject)
+{
+  EXPECT_CALL(*_mock_client, send_request(HasPath("path")))
+    .WillOnce(Return(HttpResponse(HTTP_BAD_REQUEST, "", {})));
+
+  RalfProcessor::RalfRequest* rr = new RalfProcessor::RalfRequest();
+  rr->path = "path";
+  rr->message = "message";
+  rr->trail = 0;
+  _ralf_processor->send_request_to_ralf(rr);
+  sleep(1);
+
+  EXPECT_EQ(0u, _spool->count());
+}
@@ -0,0 +1,54 @@
+/**
+ * @file random_token_microbench.cpp Microbenchmarks for token generation.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+
+#include "microbench.hpp"
+#include "random_token.h"
+
+// A flow token.
+static void BM_RandomToken_create(MicroBench::State& state)
+{
+  std::string token;
+
+  while (state.keep_running())
+  {
+    RandomToken::create(10, token);
+    MicroBench::do_not_optimize(token);
+  }
+}
+MICROBENCH(BM_RandomToken_create);
+
+// The ODI tokens for a chain of four application servers.
+static void BM_RandomToken_batch(MicroBench::State& state)
+{
+  while (state.keep_running())
+  {
+    std::vector<std::string> tokens;
+    RandomToken::create(5, 10, tokens);
+    MicroBench::do_not_optimize(tokens);
+  }
+}
+MICROBENCH(BM_RandomToken_batch);
+
+// A digest nonce.
+static void BM_RandomToken_hex(MicroBench::State& state)
+{
+  char buf[16];
+
+  while (state.keep_running())
+  {
+    RandomToken::create_hex(buf, sizeof(buf));
+    MicroBench::do_not_optimize(buf);
+  }
+}
+MICROBENCH(BM_RandomToken_hex);
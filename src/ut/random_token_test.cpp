@@ -0,0 +1,123 @@
+/**
+ * @file random_token_test.cpp UT for RandomToken.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "random_token.h"
+
+static const std::string BASE64_CHARS =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The block function matches the test vector in RFC 7539 section 2.3.2.
+TEST(RandomTokenTest, ChaCha20Block)
+{
+  uint32_t key[8];
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    key[ii] = (4 * ii) | ((4 * ii + 1) << 8) | ((4 * ii + 2) << 16) | ((4 * ii + 3) << 24);
+  }
+  const uint32_t nonce[3] = {0x09000000, 0x4a000000, 0x00000000};
+
+  uint8_t out[64];
+  RandomToken::chacha20_block(key, 1, nonce, out);
+
+  const uint8_t expected[64] = {
+    0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+    0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+    0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+    0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+    0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09,
+    0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+    0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9,
+    0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e};
+  EXPECT_EQ(0, memcmp(expected, out, sizeof(out)));
+}
+
+// Tokens have the requested length, use the base64 alphabet, and don't
+// repeat, including across the generator's batches.
+TEST(RandomTokenTest, Create)
+{
+  std::set<std::string> seen;
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    std::string token;
+    RandomToken::create(10, token);
+    EXPECT_EQ(10u, token.length());
+    EXPECT_EQ(std::string::npos, token.find_first_not_of(BASE64_CHARS));
+    EXPECT_TRUE(seen.insert(token).second);
+  }
+
+  std::string long_token;
+  RandomToken::create(200, long_token);
+  EXPECT_EQ(200u, long_token.length());
+  EXPECT_EQ(std::string::npos, long_token.find_first_not_of(BASE64_CHARS));
+}
+
+// Batches are appended to the vector.
+TEST(RandomTokenTest, CreateBatch)
+{
+  std::vector<std::string> tokens = {"existing"};
+  RandomToken::create(5, 10, tokens);
+
+  ASSERT_EQ(6u, tokens.size());
+  EXPECT_EQ("existing", tokens[0]);
+
+  std::set<std::string> seen(tokens.begin(), tokens.end());
+  EXPECT_EQ(6u, seen.size());
+
+  for (size_t ii = 1; ii < tokens.size(); ++ii)
+  {
+    EXPECT_EQ(10u, tokens[ii].length());
+    EXPECT_EQ(std::string::npos, tokens[ii].find_first_not_of(BASE64_CHARS));
+  }
+}
+
+// Hex tokens fill exactly the buffer given.
+TEST(RandomTokenTest, CreateHex)
+{
+  char buf[17];
+  memset(buf, 'X', sizeof(buf));
+  RandomToken::create_hex(buf, 16);
+
+  std::string hex(buf, 16);
+  EXPECT_EQ(std::string::npos, hex.find_first_not_of("0123456789abcdef"));
+  EXPECT_EQ('X', buf[16]);
+}
+
+// Each thread has its own generator, and they don't produce the same tokens.
+TEST(RandomTokenTest, Threads)
+{
+  std::vector<std::string> tokens[4];
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&tokens, ii]()
+    {
+      RandomToken::create(100, 10, tokens[ii]);
+    }));
+  }
+
+  std::set<std::string> seen;
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads[ii].join();
+    seen.insert(tokens[ii].begin(), tokens[ii].end());
+  }
+
+  EXPECT_EQ(400u, seen.size());
+}
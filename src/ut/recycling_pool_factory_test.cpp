@@ -0,0 +1,231 @@
+/**
+ * @file recycling_pool_factory_test.cpp UT for RecyclingPoolFactory.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <functional>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "recycling_pool_factory.h"
+
+/// Fixture for RecyclingPoolFactoryTest.
+class RecyclingPoolFactoryTest : public ::testing::Test
+{
+public:
+  static void SetUpTestCase()
+  {
+    pj_init();
+  }
+
+  static void TearDownTestCase()
+  {
+    pj_shutdown();
+  }
+
+  static pj_pool_t* create_tdata_pool(RecyclingPoolFactory& factory)
+  {
+    return pj_pool_create(factory.factory(),
+                          "tdta%p",
+                          PJSIP_POOL_LEN_TDATA,
+                          PJSIP_POOL_INC_TDATA,
+                          NULL);
+  }
+
+  // Runs a function on a new thread registered with PJLIB, and waits for it
+  // to finish.
+  static void run_on_thread(std::function<void()> fn)
+  {
+    std::thread thread([fn]()
+    {
+      pj_thread_desc desc;
+      pj_bzero(desc, sizeof(desc));
+      pj_thread_t* pj_thread = NULL;
+      pj_thread_register("ut", desc, &pj_thread);
+      fn();
+    });
+    thread.join();
+  }
+};
+
+// Test that a released tx_data pool is reused, reset to its original size.
+TEST_F(RecyclingPoolFactoryTest, Reuse)
+{
+  RecyclingPoolFactory factory(4);
+
+  pj_pool_t* pool = create_tdata_pool(factory);
+  ASSERT_TRUE(pool != NULL);
+  size_t capacity = pj_pool_get_capacity(pool);
+
+  // Grow the pool beyond its first block.
+  pj_pool_alloc(pool, PJSIP_POOL_LEN_TDATA * 2);
+  EXPECT_GT(pj_pool_get_capacity(pool), capacity);
+
+  pj_pool_release(pool);
+  EXPECT_EQ(1u, factory.num_cached());
+  EXPECT_EQ(capacity, factory.retained_bytes());
+
+  pj_pool_t* pool2 = create_tdata_pool(factory);
+  EXPECT_EQ(pool, pool2);
+  EXPECT_EQ(capacity, pj_pool_get_capacity(pool2));
+  EXPECT_LT(pj_pool_get_used_size(pool2), capacity);
+  EXPECT_EQ(0u, factory.num_cached());
+  EXPECT_EQ(1u, factory.num_reused());
+  EXPECT_EQ(1u, factory.num_allocated());
+
+  pj_pool_release(pool2);
+}
+
+// Test that pools of other sizes aren't kept.
+TEST_F(RecyclingPoolFactoryTest, OtherSizes)
+{
+  RecyclingPoolFactory factory(4);
+
+  pj_pool_t* pool = pj_pool_create(factory.factory(), "other", 1024, 512, NULL);
+  ASSERT_TRUE(pool != NULL);
+  pj_pool_release(pool);
+  EXPECT_EQ(0u, factory.num_cached());
+  EXPECT_EQ(0u, factory.num_allocated());
+}
+
+// Test that reuse can be disabled.
+TEST_F(RecyclingPoolFactoryTest, Disabled)
+{
+  RecyclingPoolFactory factory(0);
+
+  pj_pool_t* pool = create_tdata_pool(factory);
+  ASSERT_TRUE(pool != NULL);
+  pj_pool_release(pool);
+  EXPECT_EQ(0u, factory.num_cached());
+}
+
+// Test that pools released on one thread are passed through the depot to a
+// thread that creates them, and that unused pools in the depot are trimmed.
+TEST_F(RecyclingPoolFactoryTest, DepotAndTrim)
+{
+  RecyclingPoolFactory factory(4, 3600000);
+
+  // Create pools on this thread and release them on another.  The releasing
+  // thread keeps 4, and passes the rest to the depot.
+  std::vector<pj_pool_t*> pools;
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    pools.push_back(create_tdata_pool(factory));
+  }
+
+  run_on_thread([&pools]()
+  {
+    for (pj_pool_t* pool : pools)
+    {
+      pj_pool_release(pool);
+    }
+  });
+  EXPECT_EQ(10u, factory.num_cached());
+
+  // This thread's free list is empty, so restocks from the depot.
+  pj_pool_t* pool = create_tdata_pool(factory);
+  EXPECT_EQ(1u, factory.num_reused());
+  EXPECT_EQ(9u, factory.num_cached());
+  pj_pool_release(pool);
+
+  // The first trim frees nothing, as the depot has been emptier since it
+  // was created.  The second frees the 4 pools left in the depot, which
+  // haven't been used since the first trim, but not the pools on the
+  // threads' free lists.
+  factory.trim();
+  EXPECT_EQ(10u, factory.num_cached());
+  factory.trim();
+  EXPECT_EQ(6u, factory.num_cached());
+
+  // Pools on free lists are freed when the factory is destroyed.
+}
+
+// Test that pool memory is accounted to the pool's owner, and to the free
+// list while the pool is cached.
+TEST_F(RecyclingPoolFactoryTest, Accounting)
+{
+  MemoryAccounting::Account* tx_data = MemoryAccounting::account("pool_tx_data");
+  MemoryAccounting::Account* cached = MemoryAccounting::account("pool_cached");
+  MemoryAccounting::Account* other = MemoryAccounting::account("pool_other");
+  int64_t tx_data_base = tx_data->bytes();
+  int64_t cached_base = cached->bytes();
+  int64_t other_base = other->bytes();
+
+  {
+    RecyclingPoolFactory factory(4);
+
+    pj_pool_t* pool = create_tdata_pool(factory);
+    ASSERT_TRUE(pool != NULL);
+    int64_t capacity = pj_pool_get_capacity(pool);
+    EXPECT_EQ(tx_data_base + capacity, tx_data->bytes());
+
+    pj_pool_alloc(pool, PJSIP_POOL_LEN_TDATA * 2);
+    EXPECT_EQ(tx_data_base + (int64_t)pj_pool_get_capacity(pool), tx_data->bytes());
+
+    pj_pool_release(pool);
+    EXPECT_EQ(tx_data_base, tx_data->bytes());
+    EXPECT_EQ(cached_base + capacity, cached->bytes());
+
+    pool = pj_pool_create(factory.factory(), "other", 1024, 512, NULL);
+    EXPECT_EQ(other_base + 1024, other->bytes());
+    pj_pool_release(pool);
+    EXPECT_EQ(other_base, other->bytes());
+  }
+
+  EXPECT_EQ(cached_base, cached->bytes());
+}
+
+// Test that tx_data pools for a kind of message learn an increment that lets
+// them grow to the size those messages usually reach in one step.
+TEST_F(RecyclingPoolFactoryTest, LearnIncrement)
+{
+  RecyclingPoolFactory factory(4, 3600000);
+  Metrics::Counter* growths =
+    Metrics::counter("sprout_tdata_pool_growths_invite_request", "");
+
+  pj_pool_t* msg_pool = pj_pool_create(factory.factory(), "msg", 1024, 1024, NULL);
+  pjsip_msg* invite = pjsip_msg_create(msg_pool, PJSIP_REQUEST_MSG);
+  pjsip_method_set(&invite->line.req.method, PJSIP_INVITE_METHOD);
+  EXPECT_EQ((size_t)PJSIP_POOL_INC_TDATA, factory.tdata_increment(invite, false));
+
+  // Fill pools for INVITEs with 20KB of small allocations, as building a
+  // large message does.
+  std::function<void()> build_invite = [&factory, invite]()
+  {
+    RecyclingPoolFactory::SizeHint size_hint(invite, false);
+    pj_pool_t* pool = create_tdata_pool(factory);
+    for (int ii = 0; ii < 200; ++ii)
+    {
+      pj_pool_alloc(pool, 100);
+    }
+    pj_pool_release(pool);
+  };
+
+  uint64_t before = growths->value();
+  build_invite();
+  EXPECT_GT(growths->value() - before, 1u);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    build_invite();
+  }
+  factory.trim();
+
+  // INVITEs now grow their pools once.  Nothing has been learned about
+  // responses to them.
+  EXPECT_GT(factory.tdata_increment(invite, false), (size_t)PJSIP_POOL_INC_TDATA);
+  EXPECT_EQ((size_t)PJSIP_POOL_INC_TDATA, factory.tdata_increment(invite, true));
+
+  before = growths->value();
+  build_invite();
+  EXPECT_EQ(1u, growths->value() - before);
+
+  pj_pool_release(msg_pool);
+}
@@ -0,0 +1,58 @@
+/**
+ * @file register_admission_test.cpp UT for RegisterAdmission.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "register_admission.h"
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+
+class RegisterAdmissionTest : public BaseTest
+{
+};
+
+// Up to a second's worth of initial registrations are admitted at once, and
+// then they are admitted at the configured rate.
+TEST_F(RegisterAdmissionTest, AdmitsAtRate)
+{
+  RegisterAdmission admission(2, 60);
+
+  EXPECT_TRUE(admission.admit_initial_register());
+  EXPECT_TRUE(admission.admit_initial_register());
+  EXPECT_FALSE(admission.admit_initial_register());
+
+  cwtest_advance_time_ms(500);
+  EXPECT_TRUE(admission.admit_initial_register());
+  EXPECT_FALSE(admission.admit_initial_register());
+
+  // Waiting a long time only builds up a second's worth.
+  cwtest_advance_time_ms(10000);
+  EXPECT_TRUE(admission.admit_initial_register());
+  EXPECT_TRUE(admission.admit_initial_register());
+  EXPECT_FALSE(admission.admit_initial_register());
+}
+
+// Rejected registrations are told to retry after between half the configured
+// Retry-After and all of it.
+TEST_F(RegisterAdmissionTest, RetryAfterRange)
+{
+  RegisterAdmission admission(1, 10);
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    int retry_after = admission.retry_after();
+    EXPECT_LE(5, retry_after);
+    EXPECT_GE(10, retry_after);
+  }
+
+  RegisterAdmission short_admission(1, 1);
+  EXPECT_EQ(1, short_admission.retry_after());
+}
@@ -1555,3 +1555,103 @@ TEST_F(RegistrarTest, GetTsxParamsPreservedOnNextHopPortMatch)
   bool has_param = (pjsip_param_find(&next_hop->other_param, &STR_ORIG) != nullptr);
   EXPECT_TRUE(has_param);
 }
+
+/// Fixture for RegistrarAdmissionTest - a registrar that only admits one
+/// initial registration each second.
+class RegistrarAdmissionTest : public RegistrarTest
+{
+public:
+  RegistrarAdmissionTest()
+  {
+    delete _registrar_proxy; _registrar_proxy = NULL;
+    delete _registrar_sproutlet; _registrar_sproutlet = NULL;
+
+    _registrar_sproutlet = new RegistrarSproutlet("registrar",
+                                                  5058,
+                                                  "sip:registrar.homedomain:5058;transport=tcp",
+                                                  { "scscf" },
+                                                  "scscf",
+                                                  "subscription",
+                                                  _sm,
+                                                  _acr_factory,
+                                                  300,
+                                                  &SNMP::FAKE_REGISTRATION_STATS_TABLES,
+                                                  1,
+                                                  10);
+
+    EXPECT_TRUE(_registrar_sproutlet->init());
+
+    std::list<Sproutlet*> sproutlets;
+    sproutlets.push_back(_registrar_sproutlet);
+
+    std::unordered_set<std::string> additional_home_domains;
+    additional_home_domains.insert("sprout.homedomain");
+    additional_home_domains.insert("sprout-site2.homedomain");
+
+    _registrar_proxy = new SproutletProxy(stack_data.endpt,
+                                          PJSIP_MOD_PRIORITY_UA_PROXY_LAYER,
+                                          "homedomain",
+                                          additional_home_domains,
+                                          std::unordered_set<std::string>(),
+                                          true,
+                                          sproutlets,
+                                          std::set<std::string>(),
+                                          nullptr,
+                                          nullptr);
+  }
+};
+
+// Test that initial registrations over the admitted rate are rejected with a
+// Retry-After, but re-registrations are still accepted.
+TEST_F(RegistrarAdmissionTest, InitialRegistersOverRateRejected)
+{
+  Message msg;
+  HSSConnection::irs_info irs_info;
+
+  // The first initial registration is admitted.
+  expectations_for_successful_get_subscriber_state(irs_info);
+  expectations_for_not_found_get_bindings();
+  EXPECT_CALL(*_sm, register_subscriber(_, _, _, _, _, _, _))
+    .WillOnce(Return(HTTP_OK));
+  expectations_for_registration_sender();
+
+  inject_msg(msg.get());
+
+  pjsip_msg* out = pop_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  free_txdata();
+
+  // The second is rejected before it is written to the SM, and is told to
+  // retry later.
+  expectations_for_successful_get_subscriber_state(irs_info);
+  expectations_for_not_found_get_bindings();
+  EXPECT_CALL(*_sm, register_subscriber(_, _, _, _, _, _, _)).Times(0);
+  EXPECT_CALL(*_sm, register_with_application_servers(_, _, _, _, _, _, _)).Times(0);
+
+  inject_msg(msg.get());
+
+  out = pop_txdata()->msg;
+  EXPECT_EQ(503, out->line.status.code);
+  std::string retry_after = get_headers(out, "Retry-After");
+  EXPECT_NE("", retry_after);
+  int retry_secs = atoi(retry_after.substr(strlen("Retry-After: ")).c_str());
+  EXPECT_LE(5, retry_secs);
+  EXPECT_GE(10, retry_secs);
+  free_txdata();
+
+  EXPECT_EQ(2,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_REGISTRATION_STATS_TABLES.init_reg_tbl)->_attempts);
+  EXPECT_EQ(1,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_REGISTRATION_STATS_TABLES.init_reg_tbl)->_failures);
+
+  // A re-registration is still accepted.
+  expectations_for_successful_get_subscriber_state(irs_info);
+  expectations_for_get_single_binding();
+  EXPECT_CALL(*_sm, reregister_subscriber(_, _, _, _, _, _, _, _))
+    .WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(*_sm, register_with_application_servers(_, _, _, _, _, false, _));
+
+  inject_msg(msg.get());
+
+  out = pop_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  free_txdata();
+}
@@ -0,0 +1,113 @@
+/**
+ * @file registration_prefetch_test.cpp UT for RegistrationPrefetch.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "registration_prefetch.h"
+
+/// Fixture for RegistrationPrefetchTest.  The handler records the IMPUs it
+/// is called for, and can be made to block until released.
+class RegistrationPrefetchTest : public ::testing::Test
+{
+public:
+  RegistrationPrefetchTest() : _blocked(false)
+  {
+    _handler = RegistrationPrefetch::add_handler(
+      [this](const std::string& impu, SAS::TrailId trail)
+      {
+        std::unique_lock<std::mutex> lock(_lock);
+        _cond.wait(lock, [this]() { return !_blocked; });
+        _impus.push_back(impu);
+        _cond.notify_all();
+      });
+  }
+
+  virtual ~RegistrationPrefetchTest()
+  {
+    RegistrationPrefetch::stop();
+    RegistrationPrefetch::remove_handler(_handler);
+  }
+
+  // Waits for the handler to have been called the given number of times.
+  bool wait_for(size_t count)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    return _cond.wait_for(lock,
+                          std::chrono::seconds(5),
+                          [this, count]() { return _impus.size() >= count; });
+  }
+
+  void release()
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _blocked = false;
+    _cond.notify_all();
+  }
+
+  int _handler;
+  std::mutex _lock;
+  std::condition_variable _cond;
+  bool _blocked;
+  std::vector<std::string> _impus;
+};
+
+// Nothing is prefetched unless prefetching has been started.
+TEST_F(RegistrationPrefetchTest, Disabled)
+{
+  EXPECT_FALSE(RegistrationPrefetch::enabled());
+  RegistrationPrefetch::registered({"sip:6505550231@homedomain"}, 0);
+
+  std::unique_lock<std::mutex> lock(_lock);
+  EXPECT_TRUE(_impus.empty());
+}
+
+// The handlers are called for each registered IMPU.
+TEST_F(RegistrationPrefetchTest, Prefetch)
+{
+  RegistrationPrefetch::start(NULL, 1, 10);
+  EXPECT_TRUE(RegistrationPrefetch::enabled());
+
+  RegistrationPrefetch::registered({"sip:6505550231@homedomain",
+                                    "tel:6505550231"}, 0);
+  ASSERT_TRUE(wait_for(2));
+
+  std::unique_lock<std::mutex> lock(_lock);
+  EXPECT_EQ("sip:6505550231@homedomain", _impus[0]);
+  EXPECT_EQ("tel:6505550231", _impus[1]);
+}
+
+// Registrations beyond the queue limit are dropped.
+TEST_F(RegistrationPrefetchTest, QueueFull)
+{
+  _blocked = true;
+  RegistrationPrefetch::start(NULL, 1, 2);
+
+  RegistrationPrefetch::registered({"sip:1@homedomain"}, 0);
+  RegistrationPrefetch::registered({"sip:2@homedomain"}, 0);
+  RegistrationPrefetch::registered({"sip:3@homedomain"}, 0);
+  RegistrationPrefetch::registered({"sip:4@homedomain"}, 0);
+
+  // The first registration may already be with the thread, in which case
+  // one more fits in the queue.
+  release();
+  ASSERT_TRUE(wait_for(2));
+  RegistrationPrefetch::stop();
+
+  std::unique_lock<std::mutex> lock(_lock);
+  EXPECT_LE(_impus.size(), 3u);
+  EXPECT_EQ("sip:1@homedomain", _impus[0]);
+  EXPECT_EQ("sip:2@homedomain", _impus[1]);
+}
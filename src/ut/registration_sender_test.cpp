@@ -376,6 +376,128 @@ TEST_F(RegistrationSenderTest, 3rdPartyRegisterMultipleAS)
   EXPECT_EQ(2,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES.init_reg_tbl)->_successes);
 }
 
+// Set up two iFCs that both want the REGISTER and 200 OK in the body, and
+// check that both 3rd party registers carry them.
+TEST_F(RegistrationSenderTest, 3rdPartyRegisterMultipleASWithBody)
+{
+  RegisterMessage msg;
+  pjsip_msg* received_register = parse_msg(msg.get_request());
+  pjsip_msg* sent_response = parse_msg(msg.get_response());
+
+  Ifcs ifcs = build_ifcs({"sip:1.2.3.4:56789;transport=TCP", "sip:9.8.7.6:54321;transport=TCP"},
+                         "",
+                         true);
+  bool unused_deregister_subscriber;
+  _registration_sender->register_with_application_servers(received_register,
+                                                          sent_response,
+                                                          "sip:6505551000@homedomain",
+                                                          ifcs,
+                                                          300,
+                                                          true,
+                                                          unused_deregister_subscriber,
+                                                          0);
+
+  // Expect two 3rd party registers, each with the REGISTER and 200 OK in its
+  // body.
+  ASSERT_EQ(2, txdata_count());
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    pjsip_msg* out = current_txdata()->msg;
+    ASSERT_TRUE(out->body != NULL);
+    pjsip_multipart_part multipart = ((struct multipart_data*)out->body->data)->part_head;
+    std::string body_req = PJUtils::body_to_string(multipart.next->body);
+    EXPECT_THAT(body_req, HasSubstr("REGISTER sip:"));
+    std::string body_rsp = PJUtils::body_to_string(multipart.next->next->body);
+    EXPECT_THAT(body_rsp, HasSubstr("200 OK"));
+    inject_msg(respond_to_current_txdata(200));
+  }
+
+  // Check statistics.
+  EXPECT_EQ(2,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES.init_reg_tbl)->_attempts);
+  EXPECT_EQ(2,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES.init_reg_tbl)->_successes);
+}
+
+// Check that re-registrations aren't passed on to an AS until the configured
+// fraction of its registration has elapsed.
+TEST_F(RegistrationSenderTest, 3rdPartyReregisterSuppressed)
+{
+  IFCConfiguration ifc_configuration(false, false, "dummy-as", NULL, NULL);
+  RegistrationSender registration_sender(ifc_configuration,
+                                         NULL,
+                                         NULL,
+                                         false,
+                                         0,
+                                         50);
+  registration_sender.register_dereg_event_consumer(_subscriber_manager);
+
+  RegisterMessage msg;
+  pjsip_msg* received_register = parse_msg(msg.get_request());
+  pjsip_msg* sent_response = parse_msg(msg.get_response());
+  Ifcs ifcs = build_ifcs();
+  bool unused_deregister_subscriber;
+
+  // The initial registration is always sent.
+  registration_sender.register_with_application_servers(received_register,
+                                                        sent_response,
+                                                        "sip:6505551000@homedomain",
+                                                        ifcs,
+                                                        300,
+                                                        true,
+                                                        unused_deregister_subscriber,
+                                                        0);
+  ASSERT_EQ(1, txdata_count());
+  inject_msg(respond_to_current_txdata(200));
+
+  // A re-registration straight away is suppressed.
+  registration_sender.register_with_application_servers(received_register,
+                                                        sent_response,
+                                                        "sip:6505551000@homedomain",
+                                                        ifcs,
+                                                        300,
+                                                        false,
+                                                        unused_deregister_subscriber,
+                                                        0);
+  ASSERT_EQ(0, txdata_count());
+
+  // Once half the expiry has passed, the re-registration is sent.  Fail it,
+  // and check that the next re-registration is sent too.
+  cwtest_advance_time_ms(151000);
+  registration_sender.register_with_application_servers(received_register,
+                                                        sent_response,
+                                                        "sip:6505551000@homedomain",
+                                                        ifcs,
+                                                        300,
+                                                        false,
+                                                        unused_deregister_subscriber,
+                                                        0);
+  ASSERT_EQ(1, txdata_count());
+  inject_msg(respond_to_current_txdata(480));
+
+  registration_sender.register_with_application_servers(received_register,
+                                                        sent_response,
+                                                        "sip:6505551000@homedomain",
+                                                        ifcs,
+                                                        300,
+                                                        false,
+                                                        unused_deregister_subscriber,
+                                                        0);
+  ASSERT_EQ(1, txdata_count());
+  inject_msg(respond_to_current_txdata(200));
+
+  // Deregistrations are always sent.
+  registration_sender.register_with_application_servers(received_register,
+                                                        sent_response,
+                                                        "sip:6505551000@homedomain",
+                                                        ifcs,
+                                                        0,
+                                                        false,
+                                                        unused_deregister_subscriber,
+                                                        0);
+  ASSERT_EQ(1, txdata_count());
+  inject_msg(respond_to_current_txdata(200));
+}
+
 // Set up a two iFCs and check that two 3rd party registers are sent to the
 // application servers. Return an error from one of the application servers and
 // check that the subscriber is deregistered.
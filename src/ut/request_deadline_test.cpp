@@ -0,0 +1,91 @@
+/**
+ * @file request_deadline_test.cpp UT for RequestDeadline.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <thread>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "request_deadline.h"
+
+class RequestDeadlineTest : public ::testing::Test
+{
+};
+
+// With no deadline, nothing expires and timeouts are unchanged.
+TEST_F(RequestDeadlineTest, NoDeadline)
+{
+  RequestDeadline::Clock::time_point deadline;
+  EXPECT_FALSE(RequestDeadline::get(deadline));
+  EXPECT_FALSE(RequestDeadline::expired());
+  EXPECT_EQ(500, RequestDeadline::cap_timeout_ms(500));
+  EXPECT_EQ(0, RequestDeadline::cap_timeout_ms(0));
+
+  // A zero budget also means no deadline.
+  RequestDeadline::Scope scope(0, 1000);
+  EXPECT_FALSE(RequestDeadline::expired());
+  EXPECT_EQ(500, RequestDeadline::cap_timeout_ms(500));
+}
+
+// Timeouts are capped to the time left.
+TEST_F(RequestDeadlineTest, CapsTimeouts)
+{
+  // 1s budget, of which 200ms has already been spent on the queue.
+  RequestDeadline::Scope scope(1000000, 200000);
+  EXPECT_FALSE(RequestDeadline::expired());
+
+  long timeout_ms = RequestDeadline::cap_timeout_ms(2000);
+  EXPECT_LE(timeout_ms, 800);
+  EXPECT_GT(timeout_ms, 700);
+  EXPECT_EQ(100, RequestDeadline::cap_timeout_ms(100));
+  EXPECT_LE(RequestDeadline::cap_timeout_ms(0), 800);
+}
+
+// A message that has used up its budget has expired, and any call made
+// anyway gets the shortest timeout.
+TEST_F(RequestDeadlineTest, Expired)
+{
+  RequestDeadline::Scope scope(1000000, 1500000);
+  EXPECT_TRUE(RequestDeadline::expired());
+  EXPECT_EQ(1, RequestDeadline::cap_timeout_ms(2000));
+}
+
+// Scopes nest, and the deadline can be carried to another thread.
+TEST_F(RequestDeadlineTest, NestingAndOtherThreads)
+{
+  RequestDeadline::Clock::time_point deadline;
+
+  {
+    RequestDeadline::Scope outer(1000000, 1500000);
+    EXPECT_TRUE(RequestDeadline::expired());
+
+    {
+      RequestDeadline::Scope inner(0, 0);
+      EXPECT_FALSE(RequestDeadline::expired());
+    }
+
+    EXPECT_TRUE(RequestDeadline::expired());
+    EXPECT_TRUE(RequestDeadline::get(deadline));
+
+    bool other_thread_expired = true;
+    std::thread([&other_thread_expired]()
+                { other_thread_expired = RequestDeadline::expired(); }).join();
+    EXPECT_FALSE(other_thread_expired);
+
+    std::thread([&other_thread_expired, deadline]()
+                {
+                  RequestDeadline::Scope scope(true, deadline);
+                  other_thread_expired = RequestDeadline::expired();
+                }).join();
+    EXPECT_TRUE(other_thread_expired);
+  }
+
+  EXPECT_FALSE(RequestDeadline::get(deadline));
+}
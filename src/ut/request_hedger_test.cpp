@@ -0,0 +1,106 @@
+/**
+ * @file request_hedger_test.cpp UT for RequestHedger.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "request_hedger.h"
+
+class RequestHedgerTest : public ::testing::Test
+{
+};
+
+// Requests aren't hedged until enough latencies have been recorded.
+TEST_F(RequestHedgerTest, NoHedgingUntilWarm)
+{
+  RequestHedger hedger(95, 100);
+  EXPECT_EQ(-1, hedger.start_request());
+
+  for (size_t ii = 0; ii < RequestHedger::NUM_SAMPLES / 2 - 1; ++ii)
+  {
+    hedger.record_latency(10000);
+  }
+  EXPECT_EQ(-1, hedger.start_request());
+
+  for (size_t ii = 0; ii < RequestHedger::RECALCULATE_INTERVAL; ++ii)
+  {
+    hedger.record_latency(10000);
+  }
+  EXPECT_EQ(10, hedger.start_request());
+}
+
+// The hedge delay is the configured percentile of recent latencies, and
+// follows them as they change.
+TEST_F(RequestHedgerTest, DelayIsPercentile)
+{
+  RequestHedger hedger(90, 100);
+
+  // Latencies of 1ms to 100ms (many times over), so the 90th percentile is
+  // about 90ms.
+  for (size_t ii = 0; ii < RequestHedger::NUM_SAMPLES; ++ii)
+  {
+    hedger.record_latency(((ii % 100) + 1) * 1000);
+  }
+  EXPECT_NEAR(90, hedger.delay_ms(), 3);
+
+  // The server speeds up.
+  for (size_t ii = 0; ii < RequestHedger::NUM_SAMPLES; ++ii)
+  {
+    hedger.record_latency(5000);
+  }
+  EXPECT_EQ(5, hedger.delay_ms());
+
+  // The delay doesn't go below the minimum.
+  for (size_t ii = 0; ii < RequestHedger::NUM_SAMPLES; ++ii)
+  {
+    hedger.record_latency(100);
+  }
+  EXPECT_EQ(RequestHedger::DEFAULT_MIN_DELAY_MS, hedger.delay_ms());
+}
+
+// Hedges are limited to the budget.
+TEST_F(RequestHedgerTest, Budget)
+{
+  RequestHedger hedger(95, 10);
+
+  // 10% of 20 requests is 2 hedges.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    hedger.start_request();
+  }
+  EXPECT_TRUE(hedger.take_hedge());
+  EXPECT_TRUE(hedger.take_hedge());
+  EXPECT_FALSE(hedger.take_hedge());
+
+  // The budget can't build up indefinitely.
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    hedger.start_request();
+  }
+  int hedges = 0;
+  while (hedger.take_hedge())
+  {
+    hedges++;
+  }
+  EXPECT_EQ(10, hedges);
+}
+
+// A zero budget means no hedges.
+TEST_F(RequestHedgerTest, ZeroBudget)
+{
+  RequestHedger hedger(95, 0);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    hedger.start_request();
+  }
+  EXPECT_FALSE(hedger.take_hedge());
+}
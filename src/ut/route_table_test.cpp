@@ -0,0 +1,205 @@
+/**
+ * @file route_table_test.cpp UT for CompiledRouteTable.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "route_table.h"
+#include "prefix_trie.h"
+
+class CompiledRouteTableTest : public ::testing::Test
+{
+public:
+  CompiledRouteTableTest() :
+    _path("/tmp/route_table_test." + std::to_string(getpid()))
+  {
+  }
+
+  virtual ~CompiledRouteTableTest()
+  {
+    unlink(_path.c_str());
+  }
+
+  // Writes the builder's table to the test file and loads it.
+  CompiledRouteTable* build(const CompiledRouteTable::Builder& builder)
+  {
+    std::string error;
+    EXPECT_TRUE(builder.write(_path, error)) << error;
+    return CompiledRouteTable::load(_path);
+  }
+
+  // Returns the single value for the number, or "" if there is no match.
+  static std::string match(const CompiledRouteTable& table,
+                           const std::string& number)
+  {
+    int idx = table.find_number(number);
+    return (idx >= 0) ? table.number_values_at(idx)[0] : "";
+  }
+
+  static std::vector<std::string> values(const std::string& value)
+  {
+    return std::vector<std::string>(1, value);
+  }
+
+  std::string _path;
+};
+
+// Test looking up domain entries.
+TEST_F(CompiledRouteTableTest, Domains)
+{
+  CompiledRouteTable::Builder builder;
+  std::vector<std::string> route;
+  route.push_back("sip1.example.com");
+  route.push_back("sip2.example.com");
+  builder.add_domain("example.com", route);
+  builder.add_domain("example.net", values("sip3.example.com"));
+  builder.add_domain("example.net", values("ignored.example.com"));
+  builder.add_domain("*", std::vector<std::string>());
+
+  std::unique_ptr<CompiledRouteTable> table(build(builder));
+  ASSERT_TRUE(table != NULL);
+  EXPECT_EQ(3u, table->num_domains());
+  EXPECT_EQ(0u, table->num_numbers());
+
+  std::vector<std::string> found;
+  EXPECT_TRUE(table->find_domain("example.com", found));
+  EXPECT_EQ(route, found);
+  EXPECT_TRUE(table->find_domain("example.net", found));
+  EXPECT_EQ(values("sip3.example.com"), found);
+  EXPECT_TRUE(table->find_domain("*", found));
+  EXPECT_TRUE(found.empty());
+  EXPECT_FALSE(table->find_domain("example.org", found));
+  EXPECT_FALSE(table->find_domain("example", found));
+  EXPECT_FALSE(table->find_domain("", found));
+}
+
+// Test longest prefix matching on number entries, including the case where
+// the number is a prefix of some keys.
+TEST_F(CompiledRouteTableTest, Numbers)
+{
+  CompiledRouteTable::Builder builder;
+  builder.add_number("+1", values("1"));
+  builder.add_number("+123", values("123"));
+  builder.add_number("+1234", values("1234"));
+  builder.add_number("+1239", values("1239"));
+  builder.add_number("+44", values("44"));
+  builder.add_number("+44", values("ignored"));
+
+  std::unique_ptr<CompiledRouteTable> table(build(builder));
+  ASSERT_TRUE(table != NULL);
+  EXPECT_EQ(5u, table->num_numbers());
+
+  EXPECT_EQ("1234", match(*table, "+12345678"));
+  EXPECT_EQ("123", match(*table, "+1235678"));
+  EXPECT_EQ("1", match(*table, "+1555"));
+  EXPECT_EQ("44", match(*table, "+4420"));
+  EXPECT_EQ("", match(*table, "+33123"));
+  EXPECT_EQ("", match(*table, "123"));
+  EXPECT_EQ("1239", match(*table, "+12"));
+  EXPECT_EQ("1239", match(*table, "+123"));
+  EXPECT_EQ("44", match(*table, "+4"));
+  EXPECT_EQ("44", match(*table, ""));
+
+  std::string matched_key;
+  EXPECT_EQ(1, table->find_number("+1235678", &matched_key));
+  EXPECT_EQ("+123", matched_key);
+}
+
+// Test that number lookups match PrefixTrie over random keys and numbers.
+TEST_F(CompiledRouteTableTest, MatchesPrefixTrie)
+{
+  srand(1);
+  PrefixTrie<std::string> trie;
+  CompiledRouteTable::Builder builder;
+
+  for (int ii = 0; ii < 200; ++ii)
+  {
+    std::string key;
+
+    for (int jj = rand() % 5; jj >= 0; --jj)
+    {
+      key += (char)('1' + rand() % 3);
+    }
+
+    trie.insert(key, std::to_string(ii));
+    builder.add_number(key, values(std::to_string(ii)));
+  }
+
+  std::unique_ptr<CompiledRouteTable> table(build(builder));
+  ASSERT_TRUE(table != NULL);
+  EXPECT_EQ(trie.size(), table->num_numbers());
+
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    std::string number;
+
+    for (int jj = rand() % 7; jj > 0; --jj)
+    {
+      number += (char)('0' + rand() % 4);
+    }
+
+    const std::string* expected = trie.longest_prefix_match(number);
+    EXPECT_EQ((expected != NULL) ? *expected : "", match(*table, number))
+      << "Number: " << number;
+  }
+}
+
+// Test that files that aren't compiled route tables are rejected.
+TEST_F(CompiledRouteTableTest, BadFiles)
+{
+  EXPECT_FALSE(CompiledRouteTable::is_compiled(_path));
+  EXPECT_TRUE(CompiledRouteTable::load(_path) == NULL);
+
+  {
+    std::ofstream fs(_path.c_str());
+    fs << "{\"routes\": []}";
+  }
+
+  EXPECT_FALSE(CompiledRouteTable::is_compiled(_path));
+  EXPECT_TRUE(CompiledRouteTable::load(_path) == NULL);
+}
+
+// Test that a truncated compiled route table is rejected.
+TEST_F(CompiledRouteTableTest, Truncated)
+{
+  CompiledRouteTable::Builder builder;
+  builder.add_domain("example.com", values("sip.example.com"));
+  builder.add_number("+1", values("sip.example.com"));
+
+  std::unique_ptr<CompiledRouteTable> table(build(builder));
+  ASSERT_TRUE(table != NULL);
+  EXPECT_TRUE(CompiledRouteTable::is_compiled(_path));
+
+  std::string contents;
+  {
+    std::ifstream fs(_path.c_str(), std::ios::binary);
+    contents.assign((std::istreambuf_iterator<char>(fs)),
+                    std::istreambuf_iterator<char>());
+  }
+
+  for (size_t length = 16; length < contents.length(); length += 8)
+  {
+    {
+      std::ofstream fs((_path + ".short").c_str(), std::ios::binary);
+      fs.write(contents.data(), length);
+    }
+
+    EXPECT_TRUE(CompiledRouteTable::load(_path + ".short") == NULL)
+      << "Length: " << length;
+  }
+
+  unlink((_path + ".short").c_str());
+}
@@ -0,0 +1,173 @@
+/**
+ * @file routing_microbench.cpp Microbenchmarks for iFC, ENUM and BGCF routing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "microbench.hpp"
+#include "ifc.h"
+#include "sessioncase.h"
+#include "enumservice.h"
+#include "bgcfservice.h"
+
+/// The number of number blocks in the generated ENUM and BGCF configuration.
+/// This is on the large side of a real deployment, to show up lookups that
+/// scale with the size of the configuration.
+static const int NUM_BLOCKS = 1000;
+
+/// Writes configuration to a temporary file, returning its name.
+static std::string write_config(const std::string& config)
+{
+  char name[] = "/tmp/microbench-XXXXXX";
+  int fd = mkstemp(name);
+  FILE* file = fdopen(fd, "w");
+  fputs(config.c_str(), file);
+  fclose(file);
+  return name;
+}
+
+/// The number in the given block that the benchmarks look up.
+static std::string number(int block)
+{
+  return "+1650" + std::to_string(1000 + block) + "123";
+}
+
+/// Numbers spread across the blocks to look up.  These are built up front so
+/// that building them isn't measured.
+static std::vector<std::string> some_numbers()
+{
+  std::vector<std::string> numbers;
+
+  for (int ii = 0; ii < NUM_BLOCKS; ii += 7)
+  {
+    numbers.push_back(number(ii));
+  }
+
+  return numbers;
+}
+
+static void BM_Ifc_filter_matches(MicroBench::State& state)
+{
+  // An iFC that checks the session case, the method and a header with a
+  // regular expression, which is typical of an MMTel AS trigger.
+  rapidxml::xml_document<> doc;
+  Ifc ifc("<InitialFilterCriteria>"
+          "  <Priority>1</Priority>"
+          "  <TriggerPoint>"
+          "    <ConditionTypeCNF>0</ConditionTypeCNF>"
+          "    <SPT>"
+          "      <ConditionNegated>0</ConditionNegated>"
+          "      <Group>0</Group>"
+          "      <SessionCase>0</SessionCase>"
+          "    </SPT>"
+          "    <SPT>"
+          "      <ConditionNegated>0</ConditionNegated>"
+          "      <Group>1</Group>"
+          "      <Method>INVITE</Method>"
+          "    </SPT>"
+          "    <SPT>"
+          "      <ConditionNegated>1</ConditionNegated>"
+          "      <Group>2</Group>"
+          "      <SIPHeader><Header>Accept-Contact</Header><Content>.*g.3gpp.icsi-ref.*</Content></SIPHeader>"
+          "    </SPT>"
+          "  </TriggerPoint>"
+          "  <ApplicationServer>"
+          "    <ServerName>sip:mmtel.homedomain;transport=TCP</ServerName>"
+          "    <DefaultHandling>0</DefaultHandling>"
+          "  </ApplicationServer>"
+          "</InitialFilterCriteria>",
+          &doc);
+
+  pjsip_msg* msg = MicroBench::parse_msg(
+    "INVITE sip:6505554321@homedomain SIP/2.0\r\n"
+    "Via: SIP/2.0/TCP 10.0.0.1:5060;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf\r\n"
+    "Max-Forwards: 68\r\n"
+    "From: <sip:6505551234@homedomain>;tag=1234\r\n"
+    "To: <sip:6505554321@homedomain>\r\n"
+    "Contact: <sip:6505551234@10.0.0.1:5060;transport=TCP;ob>\r\n"
+    "Call-ID: 1-13919@10.151.20.48\r\n"
+    "CSeq: 1 INVITE\r\n"
+    "Accept-Contact: *;+g.3gpp.iari-ref=\"urn%3Aurn-7%3A3gpp-application.ims.iari.rcse.im\"\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n",
+    MicroBench::pool());
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(ifc.filter_matches(SessionCase::Originating,
+                                                   true,
+                                                   false,
+                                                   msg,
+                                                   0));
+  }
+}
+MICROBENCH(BM_Ifc_filter_matches);
+
+static void BM_JSONEnumService_lookup_uri_from_user(MicroBench::State& state)
+{
+  std::string config = "{\"number_blocks\":[";
+
+  for (int ii = 0; ii < NUM_BLOCKS; ++ii)
+  {
+    config += "{\"name\":\"Block " + std::to_string(ii) + "\","
+              "\"prefix\":\"" + number(ii).substr(0, 9) + "\","
+              "\"regex\":\"!(^.*$)!sip:\\\\1@homedomain!\"},";
+  }
+
+  config += "{\"name\":\"Default\",\"prefix\":\"\",\"regex\":\"!(^.*$)!sip:\\\\1@pstn.homedomain!\"}]}";
+
+  std::string file = write_config(config);
+  JSONEnumService enum_service(file);
+  unlink(file.c_str());
+
+  std::vector<std::string> numbers = some_numbers();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(
+      enum_service.lookup_uri_from_user(numbers[ii], 0));
+    ii = (ii + 1) % numbers.size();
+  }
+}
+MICROBENCH(BM_JSONEnumService_lookup_uri_from_user);
+
+static void BM_BgcfService_get_route_from_number(MicroBench::State& state)
+{
+  std::string config = "{\"routes\":[";
+
+  for (int ii = 0; ii < NUM_BLOCKS; ++ii)
+  {
+    config += "{\"name\":\"Block " + std::to_string(ii) + "\","
+              "\"number\":\"" + number(ii).substr(0, 9) + "\","
+              "\"route\":[\"sip:mgcf" + std::to_string(ii % 10) + ".homedomain;lr\"]},";
+  }
+
+  config += "{\"name\":\"Default\",\"domain\":\"*\",\"route\":[\"sip:ibcf.homedomain;lr\"]}]}";
+
+  std::string file = write_config(config);
+  BgcfService bgcf_service(file);
+  unlink(file.c_str());
+
+  std::vector<std::string> numbers = some_numbers();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(
+      bgcf_service.get_route_from_number(numbers[ii], 0));
+    ii = (ii + 1) % numbers.size();
+  }
+}
+MICROBENCH(BM_BgcfService_get_route_from_number);
@@ -0,0 +1,44 @@
+/**
+ * @file sas_message_log_test.cpp UT for SasMessageLog.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "sas_message_log.h"
+#include "sproutsasevent.h"
+#include "mock_sas.h"
+
+// Test that a queued message event is reported by the logging thread with
+// a copy of the message, which needn't outlive the call.
+TEST(SasMessageLogTest, LogMessage)
+{
+  mock_sas_collect_messages(true);
+
+  {
+    SasMessageLog log;
+    std::string msg = "OPTIONS sip:homedomain SIP/2.0\r\n\r\n";
+    log.log(1234, SASEvent::RX_SIP_MSG, 1, 5060, "1.2.3.4", msg.size(), msg.data());
+    msg.assign(msg.size(), 'x');
+
+    // Destroying the log reports everything queued.
+  }
+
+  MockSASMessage* event = mock_sas_find_event(SASEvent::RX_SIP_MSG);
+  ASSERT_TRUE(event != NULL);
+  ASSERT_EQ(2u, event->static_params.size());
+  EXPECT_EQ(1u, event->static_params[0]);
+  EXPECT_EQ(5060u, event->static_params[1]);
+  ASSERT_EQ(2u, event->var_params.size());
+  EXPECT_EQ("1.2.3.4", event->var_params[0]);
+  EXPECT_EQ("OPTIONS sip:homedomain SIP/2.0\r\n\r\n", event->var_params[1]);
+
+  mock_sas_collect_messages(false);
+}
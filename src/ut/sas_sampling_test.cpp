@@ -0,0 +1,78 @@
+/**
+ * @file sas_sampling_test.cpp UT for SASSampling.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "sas_sampling.h"
+
+// Counts how many of 10000 trails get detailed events.
+static int count_detailed()
+{
+  int detailed = 0;
+  for (SAS::TrailId trail = 1; trail <= 10000; ++trail)
+  {
+    if (SASSampling::detail_enabled(trail))
+    {
+      ++detailed;
+    }
+  }
+  return detailed;
+}
+
+class SASSamplingTest : public ::testing::Test
+{
+public:
+  virtual ~SASSamplingTest()
+  {
+    SASSampling::configure(100, 100);
+  }
+};
+
+// Test that every trail gets detailed events by default.
+TEST_F(SASSamplingTest, Default)
+{
+  EXPECT_EQ(10000, count_detailed());
+
+  SASSampling::report_overload();
+  EXPECT_EQ(10000, count_detailed());
+}
+
+// Test that the configured proportion of trails get detailed events, and
+// that the decision is the same for every event on a trail.
+TEST_F(SASSamplingTest, Sampled)
+{
+  SASSampling::configure(20, 100);
+
+  int detailed = count_detailed();
+  EXPECT_GT(detailed, 1500);
+  EXPECT_LT(detailed, 2500);
+
+  for (SAS::TrailId trail = 1; trail <= 100; ++trail)
+  {
+    EXPECT_EQ(SASSampling::detail_enabled(trail),
+              SASSampling::detail_enabled(trail));
+  }
+
+  SASSampling::configure(0, 0);
+  EXPECT_EQ(0, count_detailed());
+}
+
+// Test that fewer trails get detailed events while overloaded.
+TEST_F(SASSamplingTest, Overload)
+{
+  SASSampling::configure(100, 10);
+  EXPECT_EQ(10000, count_detailed());
+
+  SASSampling::report_overload();
+  int detailed = count_detailed();
+  EXPECT_GT(detailed, 500);
+  EXPECT_LT(detailed, 1500);
+}
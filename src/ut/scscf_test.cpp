@@ -1854,6 +1854,55 @@ TEST_F(SCSCFTest, TestNoEnumWhenGRUU)
 }
 
 
+// Test that, with the local terminating shortcut enabled, a call to a
+// subscriber registered with this S-CSCF is routed straight to terminating
+// processing without the I-CSCF doing a location lookup.
+TEST_F(SCSCFTest, TestLocalTerminatingShortcut)
+{
+  SCOPED_TRACE("");
+  _scscf_sproutlet->set_local_terminating_shortcut(true);
+
+  // Set up caller info.
+  HSSConnection::irs_info irs_info_1;
+  setup_irs_info(irs_info_1, "6505551000", "homedomain");
+  expect_get_subscriber_state(irs_info_1, "sip:6505551000@homedomain");
+
+  // The callee is found to be registered here from Homestead's cached data
+  // and the bindings, and then terminating processing looks up its iFCs and
+  // bindings as usual.  Each lookup returns its own bindings, as the S-CSCF
+  // frees them.
+  HSSConnection::irs_info irs_info_2;
+  Bindings bindings_1;
+  setup_callee_info(irs_info_2, bindings_1);
+  HSSConnection::irs_info irs_info_3;
+  Bindings bindings_2;
+  setup_callee_info(irs_info_3, bindings_2);
+
+  EXPECT_CALL(*_sm, get_cached_subscriber_state("sip:6505551234@homedomain", _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(irs_info_2),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_sm, get_bindings("sip:6505551234@homedomain", _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(bindings_1),
+                    Return(HTTP_OK)))
+    .WillOnce(DoAll(SetArgReferee<1>(bindings_2),
+                    Return(HTTP_OK)));
+  expect_get_subscriber_state(irs_info_3, "sip:6505551234@homedomain");
+
+  // No location result is set up for the callee, so the call would fail if it
+  // went through the I-CSCF.
+  SCSCFMessage msg;
+  msg._to = "6505551234@homedomain";
+  msg._todomain = "";
+  msg._route = "Route: <sip:sprout.homedomain;orig>";
+  msg._requri = "sip:6505551234@homedomain";
+  msg._extra = "P-Asserted-Identity: <sip:6505551000@homedomain>";
+  list<HeaderMatcher> hdrs;
+  doSuccessfulFlow(msg, testing::MatchesRegex(".*wuntootreefower.*"), hdrs);
+
+  _scscf_sproutlet->set_local_terminating_shortcut(false);
+}
+
+
 TEST_F(SCSCFTest, TestGRUUFailure)
 {
   // Identical to TestNoEnumWhenGRUU, except that the registered binding in this
@@ -3150,6 +3199,79 @@ TEST_F(SCSCFTest, ISCRetargetWithoutCdiv)
 }
 
 
+// Test that, with served user state caching enabled, the callee's subscriber
+// state is only read once even though the request comes back from an AS.
+TEST_F(SCSCFTest, ISCCachedServedUserState)
+{
+  _scscf_sproutlet->set_cache_served_user_state(true);
+
+  HSSConnection::irs_info irs_info;
+  Bindings bindings;
+  setup_callee_info(irs_info, bindings);
+  set_ifc(irs_info, "sip:6505551234@homedomain", 1, {"<Method>INVITE</Method>"}, "sip:1.2.3.4:56789;transport=UDP");
+  expect_get_callee_info(irs_info, bindings, "sip:6505551234@homedomain", 1);
+
+  TransportFlow tpBono(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.99.88.11", 12345);
+  TransportFlow tpAS1(TransportFlow::Protocol::UDP, stack_data.scscf_port, "1.2.3.4", 56789);
+  TransportFlow tpCalleeBono(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.6.6.200", 5060);
+
+  // ---------- Send INVITE
+  SCSCFMessage msg;
+  msg._via = "10.99.88.11:12345;transport=TCP";
+  msg._to = "6505551234@homedomain";
+  msg._route = "Route: <sip:sprout.homedomain>";
+  msg._todomain = "";
+  msg._requri = "sip:6505551234@homedomain";
+
+  msg._method = "INVITE";
+  inject_msg(msg.get_request(), &tpBono);
+  poll();
+  ASSERT_EQ(2, txdata_count());
+
+  // 100 Trying goes back to bono
+  pjsip_msg* out = current_txdata()->msg;
+  RespMatcher(100).matches(out);
+  msg.convert_routeset(out);
+  free_txdata();
+
+  // INVITE passed on to AS1
+  SCOPED_TRACE("INVITE (S)");
+  out = current_txdata()->msg;
+  ReqMatcher r1("INVITE");
+  ASSERT_NO_FATAL_FAILURE(r1.matches(out));
+  tpAS1.expect_target(current_txdata(), false);
+
+  // ---------- AS1 turns it around (acting as proxy)
+  const pj_str_t STR_ROUTE = pj_str("Route");
+  pjsip_hdr* hdr = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(out, &STR_ROUTE, NULL);
+  if (hdr)
+  {
+    pj_list_erase(hdr);
+  }
+  inject_msg(out, &tpAS1);
+  free_txdata();
+
+  // 100 Trying goes back to AS1
+  out = current_txdata()->msg;
+  RespMatcher(100).matches(out);
+  msg.convert_routeset(out);
+  free_txdata();
+
+  // INVITE passed to final destination, without another lookup of the
+  // callee's subscriber state.
+  SCOPED_TRACE("INVITE (2)");
+  out = current_txdata()->msg;
+  ReqMatcher r2("INVITE");
+  ASSERT_NO_FATAL_FAILURE(r2.matches(out));
+  tpCalleeBono.expect_target(current_txdata(), false);
+  EXPECT_EQ("sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob", r2.uri());
+
+  free_txdata();
+
+  _scscf_sproutlet->set_cache_served_user_state(false);
+}
+
+
 // Test basic ISC (AS) flow.
 TEST_F(SCSCFTest, SimpleISCTwoRouteHeaders)
 {
@@ -4481,6 +4603,99 @@ TEST_F(SCSCFTest, DefaultHandlingContinueNonExistent)
 }
 
 
+// Test DefaultHandling=CONTINUE for an AS whose circuit breaker is open - the
+// AS is skipped without being sent the request.
+TEST_F(SCSCFTest, DefaultHandlingContinueCircuitOpen)
+{
+  HSSConnection::irs_info irs_info;
+  Bindings bindings;
+  setup_callee_info(irs_info, bindings);
+  set_ifc(irs_info, "sip:6505551234@homedomain", 1, {"<Method>INVITE</Method>"}, "sip:1.2.3.4:56789;transport=UDP");
+  expect_get_callee_info(irs_info, bindings);
+
+  EXPECT_CALL(*_sess_cont_comm_tracker, is_circuit_open(StrEq("sip:1.2.3.4:56789;transport=UDP")))
+    .WillOnce(Return(true));
+  EXPECT_CALL(*_sess_cont_comm_tracker, on_failure(_, _)).Times(0);
+
+  TransportFlow tpBono(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.99.88.11", 12345);
+  TransportFlow tpCalleeBono(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.6.6.200", 5060);
+
+  // ---------- Send INVITE
+  SCSCFMessage msg;
+  msg._via = "10.99.88.11:12345;transport=TCP";
+  msg._requri = "sip:6505551234@homedomain";
+
+  msg._method = "INVITE";
+  inject_msg(msg.get_request(), &tpBono);
+  poll();
+  ASSERT_EQ(2, txdata_count());
+
+  // 100 Trying goes back to bono
+  pjsip_msg* out = current_txdata()->msg;
+  RespMatcher(100).matches(out);
+  tpBono.expect_target(current_txdata(), true);  // Requests always come back on same transport
+  msg.convert_routeset(out);
+  free_txdata();
+
+  // The AS is bypassed, so INVITE passed on to final destination (to bono
+  // set up in callee's bindings)
+  SCOPED_TRACE("INVITE (2)");
+  out = current_txdata()->msg;
+  ReqMatcher r2("INVITE");
+  ASSERT_NO_FATAL_FAILURE(r2.matches(out));
+  tpCalleeBono.expect_target(current_txdata(), false);
+  EXPECT_EQ("sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob", r2.uri());
+  free_txdata();
+}
+
+
+// Test DefaultHandling=TERMINATE for an AS whose circuit breaker is open - the
+// request is rejected straight away.
+TEST_F(SCSCFTest, DefaultHandlingTerminateCircuitOpen)
+{
+  HSSConnection::irs_info irs_info;
+  setup_irs_info(irs_info, "6505551234", "homedomain");
+  set_ifc(irs_info, "sip:6505551234@homedomain", 1, {"<Method>INVITE</Method>"}, "sip:1.2.3.4:56789;transport=UDP", 0, "1");
+  expect_get_subscriber_state(irs_info, "sip:6505551234@homedomain");
+
+  EXPECT_CALL(*_sess_term_comm_tracker, is_circuit_open(StrEq("sip:1.2.3.4:56789;transport=UDP")))
+    .WillOnce(Return(true));
+  EXPECT_CALL(*_sess_term_comm_tracker, on_failure(_, _)).Times(0);
+
+  TransportFlow tpBono(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.99.88.11", 12345);
+
+  // ---------- Send INVITE
+  SCSCFMessage msg;
+  msg._via = "10.99.88.11:12345;transport=TCP";
+  msg._fromdomain = "remote-base.mars.int";
+  msg._requri = "sip:6505551234@homedomain";
+  msg._route = "Route: <sip:sprout.homedomain>";
+
+  msg._method = "INVITE";
+  inject_msg(msg.get_request(), &tpBono);
+  poll();
+  ASSERT_EQ(2, txdata_count());
+
+  // 100 Trying goes back to bono
+  pjsip_msg* out = current_txdata()->msg;
+  RespMatcher(100).matches(out);
+  free_txdata();
+
+  // 408 response goes back to bono without the AS being tried
+  SCOPED_TRACE("408");
+  out = current_txdata()->msg;
+  RespMatcher(408).matches(out);
+  tpBono.expect_target(current_txdata(), true);
+  msg.convert_routeset(out);
+  msg._cseq++;
+  free_txdata();
+
+  // ---------- Send ACK from bono
+  SCOPED_TRACE("ACK");
+  msg._method = "ACK";
+  inject_msg(msg.get_request(), &tpBono);
+}
+
 // Test DefaultHandling=CONTINUE for non-responsive AS.
 TEST_F(SCSCFTest, DefaultHandlingContinueNonResponsive)
 {
@@ -93,6 +93,17 @@ TEST_F(SCSCFSelectorTest, SelectOptionalCapabilities)
   ST({123, 432}, {654}, {}, "cw-scscf2.cw-ngv.com").test(scscf_);
 }
 
+TEST_F(SCSCFSelectorTest, SelectDuplicateAndUnknownCapabilities)
+{
+  // Parse a valid file.
+  SCSCFSelector scscf_("scscf_uri", string(UT_DIR).append("/test_scscf.json"));
+
+  // Duplicated capabilities are only counted once, and optional capabilities
+  // that no S-CSCF has are ignored.
+  ST({123, 432, 123}, {654, 654, 9999}, {}, "cw-scscf2.cw-ngv.com").test(scscf_);
+  ST({123, 432}, {345, 9999}, {}, "cw-scscf1.cw-ngv.com").test(scscf_);
+}
+
 TEST_F(SCSCFSelectorTest, SelectPriorities)
 {
   // Parse a valid file.
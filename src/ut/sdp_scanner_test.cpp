@@ -0,0 +1,103 @@
+/**
+ * @file sdp_scanner_test.cpp UT for SdpScanner.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "sdp_scanner.h"
+
+using namespace std;
+
+static string to_string(const pj_str_t& str)
+{
+  return string(str.ptr, str.slen);
+}
+
+static const string SDP =
+  "v=0\r\n"
+  "o=- 2728 2728 IN IP4 10.0.0.1\r\n"
+  "s=-\r\n"
+  "c=IN IP4 10.0.0.1\r\n"
+  "t=0 0\r\n"
+  "\r\n"
+  "m=audio 49170 RTP/AVP 0 8 97\r\n"
+  "a=rtpmap:97 iLBC/8000\r\n"
+  "m=video 51372/2 RTP/AVP 31  32\n"
+  "c=IN IP6 2001:db8::1\n"
+  "a=sendonly";
+
+// Test scanning SDP line by line.
+TEST(SdpScannerTest, Lines)
+{
+  SdpScanner scanner(SDP.data(), SDP.length());
+  SdpScanner::Line line;
+
+  ASSERT_TRUE(scanner.next_line(line));
+  EXPECT_EQ('v', line.type);
+  EXPECT_EQ("v=0", to_string(line.line));
+  EXPECT_EQ("0", to_string(line.value));
+
+  int lines = 1;
+  string last;
+  while (scanner.next_line(line))
+  {
+    ++lines;
+    last = to_string(line.line);
+  }
+
+  // The blank line is skipped, and the last line needn't end in a newline.
+  EXPECT_EQ(10, lines);
+  EXPECT_EQ("a=sendonly", last);
+  EXPECT_FALSE(scanner.next_line(line));
+}
+
+// Test scanning the media descriptions.
+TEST(SdpScannerTest, Media)
+{
+  SdpScanner scanner(SDP.data(), SDP.length());
+  SdpScanner::Media media;
+
+  ASSERT_TRUE(scanner.next_media(media));
+  EXPECT_EQ("m=audio 49170 RTP/AVP 0 8 97", to_string(media.line));
+  EXPECT_EQ("audio", to_string(media.media));
+  EXPECT_EQ(49170, media.port);
+  EXPECT_EQ("RTP/AVP", to_string(media.proto));
+  EXPECT_EQ("0 8 97", to_string(media.fmts));
+  EXPECT_EQ("IN IP4 10.0.0.1", to_string(media.connection));
+
+  ASSERT_TRUE(scanner.next_media(media));
+  EXPECT_EQ("video", to_string(media.media));
+  EXPECT_EQ(51372, media.port);
+  EXPECT_EQ("IN IP6 2001:db8::1", to_string(media.connection));
+
+  pj_str_t fmts = media.fmts;
+  pj_str_t fmt;
+  ASSERT_TRUE(SdpScanner::next_token(fmts, fmt));
+  EXPECT_EQ("31", to_string(fmt));
+  ASSERT_TRUE(SdpScanner::next_token(fmts, fmt));
+  EXPECT_EQ("32", to_string(fmt));
+  EXPECT_FALSE(SdpScanner::next_token(fmts, fmt));
+
+  EXPECT_FALSE(scanner.next_media(media));
+}
+
+// Test scanning SDP with no media descriptions, and no SDP at all.
+TEST(SdpScannerTest, NoMedia)
+{
+  string sdp = "v=0\r\ns=-\r\n";
+  SdpScanner scanner(sdp.data(), sdp.length());
+  SdpScanner::Media media;
+  EXPECT_FALSE(scanner.next_media(media));
+
+  SdpScanner empty(NULL, 0);
+  SdpScanner::Line line;
+  EXPECT_FALSE(empty.next_line(line));
+}
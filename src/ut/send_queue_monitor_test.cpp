@@ -0,0 +1,147 @@
+/**
+ * @file send_queue_monitor_test.cpp UT for SendQueueMonitor.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "send_queue_monitor.h"
+#include "siptest.hpp"
+
+/// Fixture for SendQueueMonitorTest.  Messages are "sent" on a fake TCP
+/// transport, and are marked as being sent until the test says otherwise.
+class SendQueueMonitorTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  SendQueueMonitorTest() :
+    _monitor(new SendQueueMonitor(1000, NULL))
+  {
+    pj_bzero(&_tp, sizeof(_tp));
+    _tp.flag = PJSIP_TRANSPORT_RELIABLE;
+    pj_str_t addr = pj_str("1.2.3.4");
+    pj_sockaddr_init(pj_AF_INET(), &_tp.key.rem_addr, &addr, 5060);
+
+    _server.address.af = AF_INET;
+    inet_pton(AF_INET, "1.2.3.4", &_server.address.addr.ipv4);
+    _server.port = 5060;
+    _server.transport = IPPROTO_TCP;
+  }
+
+  virtual ~SendQueueMonitorTest()
+  {
+    for (pjsip_tx_data* tdata : _tdatas)
+    {
+      tdata->is_pending = 0;
+    }
+
+    delete _monitor; _monitor = NULL;
+
+    for (pjsip_tx_data* tdata : _tdatas)
+    {
+      pjsip_tx_data_dec_ref(tdata);
+    }
+  }
+
+  /// Sends a message of the given size on the transport, and leaves it
+  /// waiting to be sent.
+  pjsip_tx_data* send(pjsip_transport* tp, size_t bytes)
+  {
+    pjsip_tx_data* tdata;
+    pjsip_endpt_create_tdata(stack_data.endpt, &tdata);
+    tdata->buf.start = (char*)pj_pool_alloc(tdata->pool, bytes);
+    tdata->buf.cur = tdata->buf.start + bytes;
+    tdata->buf.end = tdata->buf.cur;
+    tdata->tp_info.transport = tp;
+    _monitor->on_tx_msg(tdata);
+    tdata->tp_info.transport = NULL;
+    tdata->is_pending = 1;
+    _tdatas.push_back(tdata);
+    return tdata;
+  }
+
+  SendQueueMonitor* _monitor;
+  pjsip_transport _tp;
+  AddrInfo _server;
+  std::vector<pjsip_tx_data*> _tdatas;
+};
+
+// A connection is saturated while the data waiting to be sent on it is over
+// the limit.
+TEST_F(SendQueueMonitorTest, Saturates)
+{
+  pjsip_tx_data* first = send(&_tp, 600);
+  EXPECT_FALSE(_monitor->is_saturated(_server));
+  EXPECT_FALSE(_monitor->is_saturated(&_tp));
+
+  send(&_tp, 600);
+  EXPECT_TRUE(_monitor->is_saturated(_server));
+  EXPECT_TRUE(_monitor->is_saturated(&_tp));
+
+  // Once the first message has been sent, the connection is no longer
+  // saturated.
+  first->is_pending = 0;
+  EXPECT_FALSE(_monitor->is_saturated(_server));
+
+  // Servers we don't have a connection to, and UDP servers, are never
+  // saturated.
+  AddrInfo other = _server;
+  other.port = 5061;
+  EXPECT_FALSE(_monitor->is_saturated(other));
+  other = _server;
+  other.transport = IPPROTO_UDP;
+  EXPECT_FALSE(_monitor->is_saturated(other));
+}
+
+// Datagram transports aren't tracked.
+TEST_F(SendQueueMonitorTest, IgnoresDatagramTransports)
+{
+  _tp.flag = 0;
+  send(&_tp, 2000);
+  EXPECT_FALSE(_monitor->is_saturated(&_tp));
+  EXPECT_EQ(0u, _monitor->queues().size());
+}
+
+// The queues report the messages waiting to be sent on each connection.
+TEST_F(SendQueueMonitorTest, ReportsQueues)
+{
+  pjsip_tx_data* first = send(&_tp, 100);
+  send(&_tp, 200);
+
+  std::vector<SendQueueMonitor::QueueSummary> queues = _monitor->queues();
+  ASSERT_EQ(1u, queues.size());
+  EXPECT_EQ("1.2.3.4:5060", queues[0].remote);
+  EXPECT_EQ(2u, queues[0].messages);
+  EXPECT_EQ(300u, queues[0].bytes);
+
+  first->is_pending = 0;
+  queues = _monitor->queues();
+  ASSERT_EQ(1u, queues.size());
+  EXPECT_EQ(1u, queues[0].messages);
+  EXPECT_EQ(200u, queues[0].bytes);
+
+  // Connections with nothing waiting to be sent aren't reported.
+  for (pjsip_tx_data* tdata : _tdatas)
+  {
+    tdata->is_pending = 0;
+  }
+
+  EXPECT_EQ(0u, _monitor->queues().size());
+}
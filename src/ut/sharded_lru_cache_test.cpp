@@ -0,0 +1,119 @@
+/**
+ * @file sharded_lru_cache_test.cpp UT for ShardedLRUCache.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "test_interposer.hpp"
+#include "sharded_lru_cache.h"
+
+class ShardedLRUCacheTest : public ::testing::Test
+{
+public:
+  ShardedLRUCacheTest()
+  {
+    // Use a single shard so that the eviction order is predictable.
+    ShardedLRUCacheStatsTables stats_tbls = {NULL, NULL, NULL};
+    cache = new ShardedLRUCache<std::string, int>(2, 1, stats_tbls);
+  }
+
+  virtual ~ShardedLRUCacheTest()
+  {
+    delete cache; cache = NULL;
+    cwtest_reset_time();
+  }
+
+  ShardedLRUCache<std::string, int>* cache;
+};
+
+TEST_F(ShardedLRUCacheTest, GetAndPut)
+{
+  int value = 0;
+  EXPECT_FALSE(cache->get("a", value));
+
+  cache->put("a", 1, 10);
+  EXPECT_TRUE(cache->get("a", value));
+  EXPECT_EQ(1, value);
+
+  // Replacing an entry doesn't add a new one.
+  cache->put("a", 2, 10);
+  EXPECT_TRUE(cache->get("a", value));
+  EXPECT_EQ(2, value);
+  EXPECT_EQ(1u, cache->size());
+}
+
+TEST_F(ShardedLRUCacheTest, Expiry)
+{
+  int value = 0;
+  cache->put("a", 1, 10);
+  cache->put("b", 2, 0);
+
+  // Entries with no TTL are never cached.
+  EXPECT_FALSE(cache->get("b", value));
+
+  cwtest_advance_time_ms(9999);
+  EXPECT_TRUE(cache->get("a", value));
+
+  cwtest_advance_time_ms(1);
+  EXPECT_FALSE(cache->get("a", value));
+  EXPECT_EQ(0u, cache->size());
+}
+
+// Checking for an entry doesn't make it more recently used.
+TEST_F(ShardedLRUCacheTest, Contains)
+{
+  int value = 0;
+  EXPECT_FALSE(cache->contains("a"));
+
+  cache->put("a", 1, 10);
+  cache->put("b", 2, 10);
+  EXPECT_TRUE(cache->contains("a"));
+
+  // "a" is still the least recently used entry, so is evicted.
+  cache->put("c", 3, 10);
+  EXPECT_FALSE(cache->contains("a"));
+  EXPECT_TRUE(cache->get("b", value));
+
+  cwtest_advance_time_ms(10000);
+  EXPECT_FALSE(cache->contains("b"));
+}
+
+TEST_F(ShardedLRUCacheTest, EvictLeastRecentlyUsed)
+{
+  int value = 0;
+  cache->put("a", 1, 10);
+  cache->put("b", 2, 10);
+
+  // Looking up "a" makes "b" the least recently used entry.
+  EXPECT_TRUE(cache->get("a", value));
+  cache->put("c", 3, 10);
+
+  EXPECT_EQ(2u, cache->size());
+  EXPECT_TRUE(cache->get("a", value));
+  EXPECT_FALSE(cache->get("b", value));
+  EXPECT_TRUE(cache->get("c", value));
+}
+
+TEST_F(ShardedLRUCacheTest, Erase)
+{
+  int value = 0;
+  cache->put("a", 1, 10);
+  cache->put("b", 2, 10);
+
+  EXPECT_TRUE(cache->erase("a", &value));
+  EXPECT_EQ(1, value);
+  EXPECT_FALSE(cache->get("a", value));
+  EXPECT_FALSE(cache->erase("a"));
+
+  // Erasing an expired entry removes it, but doesn't return it.
+  cwtest_advance_time_ms(10000);
+  EXPECT_FALSE(cache->erase("b"));
+  EXPECT_EQ(0u, cache->size());
+}
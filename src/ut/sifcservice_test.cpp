@@ -160,6 +160,24 @@ TEST_F(SIFCServiceTest, SIFCReloadDifferentFile)
   EXPECT_EQ(get_server_name(ifc_map.find(0)->second), "publish.example.com");
 }
 
+// Test that the iFCs returned by the service stay valid after the service
+// (and so the configuration they were compiled from) has gone away.
+TEST_F(SIFCServiceTest, IfcsOutliveService)
+{
+  std::set<int> id; id.insert(2);
+  std::multimap<int32_t, Ifc> ifc_map;
+  std::shared_ptr<rapidxml::xml_document<> > root(new rapidxml::xml_document<>);
+
+  {
+    EXPECT_CALL(*_mock_alarm, clear()).Times(AtLeast(1));
+    SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc.xml"));
+    sifc.get_ifcs_from_id(ifc_map, id, root, 0);
+  }
+
+  EXPECT_EQ(ifc_map.size(), 1);
+  EXPECT_EQ(get_server_name(ifc_map.find(0)->second), "publish.example.com");
+}
+
 // In the following tests we have various invalid/unexpected SiFC xml files.
 // These tests check that the correct logs are made in each case; this isn't
 // ideal as it means the tests are quite fragile, but it's the best we can do.
@@ -174,7 +192,7 @@ TEST_F(SIFCServiceTest, MissingFile)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/non_existent_file.xml"));
   EXPECT_TRUE(log.contains("No shared iFCs configuration"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get()->empty());
 }
 
 // Test that we log appropriately if the shared iFC file is empty.
@@ -184,7 +202,7 @@ TEST_F(SIFCServiceTest, EmptyFile)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_empty_file.xml"));
   EXPECT_TRUE(log.contains("Failed to read shared iFCs configuration"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get()->empty());
 }
 
 // Test that we log appropriately if the shared iFC file is unparseable.
@@ -194,7 +212,7 @@ TEST_F(SIFCServiceTest, ParseError)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_parse_error.xml"));
   EXPECT_TRUE(log.contains("Failed to parse the shared iFCs configuration data"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get()->empty());
 }
 
 // Test that we log appropriately if the shared iFC file has the wrong syntax.
@@ -204,7 +222,7 @@ TEST_F(SIFCServiceTest, MissingSetBlock)
   EXPECT_CALL(*_mock_alarm, set()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_missing_set.xml"));
   EXPECT_TRUE(log.contains("Invalid shared iFCs configuration file - missing SharedIFCsSets block"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get()->empty());
 }
 
 // Test that we cope with the case that the shared iFC file is valid but empty
@@ -214,7 +232,7 @@ TEST_F(SIFCServiceTest, NoEntries)
   EXPECT_CALL(*_mock_alarm, clear()).Times(AtLeast(1));
   SIFCService sifc(_mock_alarm, &SNMP::FAKE_COUNTER_TABLE, string(UT_DIR).append("/test_sifc_no_entries.xml"));
   EXPECT_FALSE(log.contains("Failed"));
-  EXPECT_TRUE(sifc._shared_ifc_sets.empty());
+  EXPECT_TRUE(sifc._shared_ifc_sets.get()->empty());
 }
 
 // In the following tests we have various SiFC xml files that have invalid
@@ -0,0 +1,64 @@
+/**
+ * @file simservs_microbench.cpp Microbenchmarks for simservs parsing.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "microbench.hpp"
+#include "simservs.h"
+
+/// A simservs document with the given number of call diversion and call
+/// barring rules.
+static std::string simservs_xml(int num_rules)
+{
+  std::string xml = "<simservs xmlns=\"http://uri.etsi.org/ngn/params/xml/simservs/xcap\" xmlns:cp=\"urn:ietf:params:xml:ns:common-policy\">\n"
+                    "  <originating-identity-presentation active=\"true\" />"
+                    "  <originating-identity-presentation-restriction active=\"true\">"
+                    "    <default-behaviour>presentation-not-restricted</default-behaviour>"
+                    "  </originating-identity-presentation-restriction>"
+                    "  <communication-diversion active=\"true\">"
+                    "    <NoReplyTimer>19</NoReplyTimer>"
+                    "    <cp:ruleset>";
+  for (int ii = 0; ii < num_rules; ii++)
+  {
+    xml += "      <cp:rule id=\"rule" + std::to_string(ii) + "\">"
+           "        <cp:conditions><busy /><media>audio</media></cp:conditions>"
+           "        <cp:actions><forward-to><target>sip:44131650" + std::to_string(ii) + "@cw-ngv.com</target></forward-to></cp:actions>"
+           "      </cp:rule>";
+  }
+  xml += "    </cp:ruleset>"
+         "  </communication-diversion>"
+         "  <incoming-communication-barring active=\"true\">"
+         "    <cp:ruleset>";
+  for (int ii = 0; ii < num_rules; ii++)
+  {
+    xml += "      <cp:rule id=\"rule" + std::to_string(ii) + "\">"
+           "        <cp:conditions><international /></cp:conditions>"
+           "        <cp:actions><allow>false</allow></cp:actions>"
+           "      </cp:rule>";
+  }
+  xml += "    </cp:ruleset>"
+         "  </incoming-communication-barring>"
+         "</simservs>\n";
+
+  return xml;
+}
+
+static void BM_Simservs_parse_large(MicroBench::State& state)
+{
+  std::string xml = simservs_xml(100);
+
+  while (state.keep_running())
+  {
+    simservs ss(xml);
+    MicroBench::do_not_optimize(ss.cdiv_rules()->size());
+  }
+}
+MICROBENCH(BM_Simservs_parse_large);
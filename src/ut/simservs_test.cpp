@@ -124,6 +124,20 @@ void expect_cb_rule(const ss_cb_rule& expected, const simservs::CBRule& actual)
   EXPECT_EQ(expected.allow_call, actual.allow_call());
 }
 
+/// The union of the conditions of a list of expected rules.
+template <class E>
+unsigned int union_conditions(const list<E>& expected)
+{
+  unsigned int conditions = 0u;
+  for (typename list<E>::const_iterator exp = expected.begin();
+       exp != expected.end();
+       ++exp)
+  {
+    conditions |= exp->conditions;
+  }
+  return conditions;
+}
+
 /// Check the expectation of simserv values
 void expect_ss(ss_values& expected, simservs& actual)
 {
@@ -141,6 +155,7 @@ void expect_ss(ss_values& expected, simservs& actual)
   {
     EXPECT_EQ(expected.cdiv_no_reply_timer, actual.cdiv_no_reply_timer());
     expect_eq(expected.cdiv_rules, *actual.cdiv_rules(), expect_cdiv_rule);
+    EXPECT_EQ(union_conditions(expected.cdiv_rules), actual.cdiv_rule_conditions());
   }
 
   SCOPED_TRACE("inbound");
@@ -148,6 +163,7 @@ void expect_ss(ss_values& expected, simservs& actual)
   if (expected.inbound_cb_enabled && actual.inbound_cb_enabled())
   {
     expect_eq(expected.inbound_cb_rules, *actual.inbound_cb_rules(), expect_cb_rule);
+    EXPECT_EQ(union_conditions(expected.inbound_cb_rules), actual.inbound_cb_rule_conditions());
   }
 
   SCOPED_TRACE("outbound");
@@ -155,6 +171,7 @@ void expect_ss(ss_values& expected, simservs& actual)
   if (expected.outbound_cb_enabled && actual.outbound_cb_enabled())
   {
     expect_eq(expected.outbound_cb_rules, *actual.outbound_cb_rules(), expect_cb_rule);
+    EXPECT_EQ(union_conditions(expected.outbound_cb_rules), actual.outbound_cb_rule_conditions());
   }
 }
 
@@ -0,0 +1,127 @@
+/**
+ * @file sip_capture_test.cpp UT for SipCapture.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "sip_capture.h"
+
+static const std::string INVITE =
+  "INVITE sip:6505550001@homedomain SIP/2.0\r\n"
+  "From: <sip:6505550000@homedomain>;tag=1234\r\n"
+  "To: <sip:6505550001@homedomain>\r\n"
+  "Call-ID: callid1\r\n"
+  "Content-Length: 0\r\n\r\n";
+
+class SipCaptureTest : public ::testing::Test
+{
+public:
+  SipCaptureTest()
+  {
+    char dir[] = "/tmp/sip_capture_testXXXXXX";
+    _dir = mkdtemp(dir);
+
+    pj_str_t host = pj_str((char*)"10.0.0.1");
+    pj_sockaddr_init(pj_AF_INET(), &_local, &host, 5054);
+    host = pj_str((char*)"10.0.0.2");
+    pj_sockaddr_init(pj_AF_INET(), &_remote, &host, 5060);
+  }
+
+  virtual ~SipCaptureTest()
+  {
+    std::string cmd = "rm -rf " + _dir;
+    EXPECT_EQ(0, system(cmd.c_str()));
+  }
+
+  std::string read_file(int index)
+  {
+    std::ifstream file(_dir + "/sip_capture_" + std::to_string(index) + ".pcapng");
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+  }
+
+  void capture(SipCapture& capture, const std::string& msg, const char* call_id)
+  {
+    pj_str_t cid = pj_str((char*)call_id);
+    capture.capture(false, false, &_local, &_remote, 1234, &cid, msg.size(), msg.data());
+  }
+
+  std::string _dir;
+  pj_sockaddr _local;
+  pj_sockaddr _remote;
+};
+
+// Messages are written to the file after the section header and interface
+// description, and the file is trimmed to what was written.
+TEST_F(SipCaptureTest, CapturesMessages)
+{
+  {
+    SipCapture sip_capture(_dir, 1024 * 1024, 2, {});
+    ASSERT_TRUE(sip_capture.ok());
+    capture(sip_capture, INVITE, "callid1");
+  }
+
+  std::string contents = read_file(0);
+  ASSERT_GT(contents.size(), 60u);
+  EXPECT_LT(contents.size(), 1024u);
+  EXPECT_EQ(0u, contents.size() % 4);
+
+  // Section header block.
+  EXPECT_EQ(std::string("\x0a\x0d\x0d\x0a", 4), contents.substr(0, 4));
+
+  // The message, its protocol and its trail are all in the packet block.
+  EXPECT_NE(std::string::npos, contents.find(INVITE));
+  EXPECT_NE(std::string::npos, contents.find("sip"));
+  EXPECT_NE(std::string::npos, contents.find("trail=1234"));
+}
+
+// Only messages matching a filter are captured.
+TEST_F(SipCaptureTest, Filters)
+{
+  {
+    SipCapture sip_capture(_dir, 1024 * 1024, 2, {"callid2", "sip:6505550002@homedomain"});
+    ASSERT_TRUE(sip_capture.ok());
+    capture(sip_capture, INVITE, "callid1");
+  }
+  EXPECT_EQ(std::string::npos, read_file(0).find(INVITE));
+
+  {
+    SipCapture sip_capture(_dir, 1024 * 1024, 2, {"callid1"});
+    capture(sip_capture, INVITE, "callid1");
+  }
+  EXPECT_NE(std::string::npos, read_file(0).find(INVITE));
+
+  {
+    SipCapture sip_capture(_dir, 1024 * 1024, 2, {"sip:6505550001@homedomain"});
+    capture(sip_capture, INVITE, "callid3");
+  }
+  EXPECT_NE(std::string::npos, read_file(0).find(INVITE));
+}
+
+// Once a file is full, the next one is started.
+TEST_F(SipCaptureTest, Rotates)
+{
+  {
+    SipCapture sip_capture(_dir, 512, 2, {});
+    ASSERT_TRUE(sip_capture.ok());
+    capture(sip_capture, INVITE, "callid1");
+    capture(sip_capture, INVITE, "callid1");
+    capture(sip_capture, INVITE, "callid1");
+  }
+
+  EXPECT_NE(std::string::npos, read_file(0).find(INVITE));
+  EXPECT_NE(std::string::npos, read_file(1).find(INVITE));
+}
@@ -0,0 +1,78 @@
+/**
+ * @file sip_framer_microbench.cpp Microbenchmarks for SipFramer.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+
+#include "microbench.hpp"
+#include "sip_framer.h"
+
+static std::string message(const std::string& content_length_hdr,
+                           const std::string& body)
+{
+  return "INVITE sip:6505550001@homedomain SIP/2.0\r\n"
+         "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+         "Max-Forwards: 68\r\n"
+         "To: <sip:6505550001@homedomain>\r\n"
+         "From: <sip:6505550000@homedomain>;tag=12345678\r\n"
+         "Call-ID: 0123456789abcdef-10.83.18.38\r\n"
+         "CSeq: 1 INVITE\r\n"
+         "Contact: <sip:6505550000@10.83.18.38:36530;transport=TCP>\r\n"
+         "Content-Type: application/sdp\r\n" +
+         content_length_hdr +
+         "\r\n" +
+         body;
+}
+
+/// The buffers a TCP transport might see: whole messages with each form of
+/// the Content-Length header, and a message whose headers haven't all
+/// arrived yet.
+static std::vector<std::string> stream_buffers()
+{
+  std::string body = "v=0\r\no=- 1 1 IN IP4 10.83.18.38\r\ns=-\r\nc=IN IP4 10.83.18.38\r\nt=0 0\r\n";
+  std::string length = std::to_string(body.size());
+  std::string msg = message("Content-Length: " + length + "\r\n", body);
+
+  return {msg,
+          message("l: " + length + "\r\n", body),
+          msg + msg,
+          msg.substr(0, msg.size() / 2)};
+}
+
+static void BM_FindMsg_pjsip(MicroBench::State& state)
+{
+  std::vector<std::string> bufs = stream_buffers();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    const std::string& buf = bufs[ii++ % bufs.size()];
+    pj_size_t size = 0;
+    pjsip_find_msg(buf.data(), buf.size(), PJ_FALSE, &size);
+    MicroBench::do_not_optimize(size);
+  }
+}
+MICROBENCH(BM_FindMsg_pjsip);
+
+static void BM_FindMsg_framer(MicroBench::State& state)
+{
+  std::vector<std::string> bufs = stream_buffers();
+  size_t ii = 0;
+
+  while (state.keep_running())
+  {
+    const std::string& buf = bufs[ii++ % bufs.size()];
+    pj_size_t size = 0;
+    SipFramer::find_msg(buf.data(), buf.size(), PJ_FALSE, &size);
+    MicroBench::do_not_optimize(size);
+  }
+}
+MICROBENCH(BM_FindMsg_framer);
@@ -0,0 +1,126 @@
+/**
+ * @file sip_framer_test.cpp UT for SipFramer.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "sip_framer.h"
+
+using namespace std;
+
+class SipFramerTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  SipFramerTest() : SipTest(NULL)
+  {
+  }
+
+  static string message(const string& content_length_hdr,
+                        const string& body)
+  {
+    return "INVITE sip:6505550001@homedomain SIP/2.0\r\n"
+           "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+           "Max-Forwards: 68\r\n"
+           "To: <sip:6505550001@homedomain>\r\n"
+           "From: <sip:6505550000@homedomain>;tag=12345678\r\n"
+           "Call-ID: 0123456789abcdef-10.83.18.38\r\n"
+           "CSeq: 1 INVITE\r\n"
+           "Contact: <sip:6505550000@10.83.18.38:36530;transport=TCP>\r\n"
+           "Content-Type: application/sdp\r\n" +
+           content_length_hdr +
+           "\r\n" +
+           body;
+  }
+
+  // Checks that SipFramer gives the same results as PJSIP for a buffer.
+  static void expect_same(const string& buf, pj_bool_t is_datagram)
+  {
+    pj_size_t pjsip_size = 0;
+    pj_status_t pjsip_status = pjsip_find_msg(buf.data(),
+                                              buf.size(),
+                                              is_datagram,
+                                              &pjsip_size);
+    pj_size_t size = 0;
+    pj_status_t status = SipFramer::find_msg(buf.data(),
+                                             buf.size(),
+                                             is_datagram,
+                                             &size);
+    EXPECT_EQ(pjsip_status, status) << buf;
+    EXPECT_EQ(pjsip_size, size) << buf;
+  }
+
+  static vector<string> corpus()
+  {
+    string body = "v=0\r\no=- 1 1 IN IP4 10.83.18.38\r\ns=-\r\nc=IN IP4 10.83.18.38\r\nt=0 0\r\n";
+    string length = to_string(body.size());
+
+    return {message("Content-Length: " + length + "\r\n", body),
+            message("content-length:" + length + "\r\n", body),
+            message("l: " + length + "\r\n", body),
+            message("L:" + length + "  \r\n", body),
+            message("Content-Length : " + length + "\r\n", body),
+            message("Content-Length:\r\n " + length + "\r\n", body),
+            message("Content-Length: 0\r\n", ""),
+            message("Content-Length: 0\r\nContent-Length: 5\r\n", ""),
+            message("Content-Length: x\r\nl: 0\r\n", ""),
+            message("Content-Length: 5x\r\n", "hello"),
+            message("Content-Lengthy: 5\r\n", "hello"),
+            message("Lorem: 5\r\n", "hello"),
+            message("Content-Length: 99999999999\r\n", ""),
+            message("", body),
+            "\r\n\r\n",
+            ""};
+  }
+};
+
+// Test that complete and truncated messages are framed in the same way as
+// PJSIP does.
+TEST_F(SipFramerTest, MatchesPjsip)
+{
+  for (const string& msg : corpus())
+  {
+    for (size_t len = 0; len <= msg.size(); ++len)
+    {
+      expect_same(msg.substr(0, len), PJ_FALSE);
+    }
+
+    expect_same(msg, PJ_TRUE);
+
+    // A second message following the first doesn't change the result.
+    expect_same(msg + msg, PJ_FALSE);
+  }
+}
+
+// Test the results for a simple message.
+TEST_F(SipFramerTest, Simple)
+{
+  string msg = message("Content-Length: 5\r\n", "hello");
+  pj_size_t size = 0;
+
+  EXPECT_EQ(PJ_SUCCESS, SipFramer::find_msg(msg.data(), msg.size(), PJ_FALSE, &size));
+  EXPECT_EQ(msg.size(), size);
+  EXPECT_EQ(PJSIP_EPARTIALMSG, SipFramer::find_msg(msg.data(), msg.size() - 1, PJ_FALSE, &size));
+
+  msg = message("", "hello");
+  EXPECT_EQ(PJSIP_EMISSINGHDR, SipFramer::find_msg(msg.data(), msg.size(), PJ_FALSE, &size));
+}
@@ -0,0 +1,214 @@
+/**
+ * @file sip_microbench.cpp Microbenchmarks for SIP message handling.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+#include "microbench.hpp"
+#include "pjutils.h"
+#include "flowtable.h"
+#include "snmp_scalar.h"
+#include "thread_dispatcher.h"
+#include "contact_filtering.h"
+#include "aor.h"
+
+/// A typical initial INVITE, as received by the S-CSCF.
+static const std::string INVITE =
+  "INVITE sip:6505554321@homedomain SIP/2.0\r\n"
+  "Via: SIP/2.0/TCP 10.0.0.1:5060;rport;branch=z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo.cOzf;alias\r\n"
+  "Via: SIP/2.0/TCP 10.83.18.38:36530;rport=36530;received=10.83.18.38;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+  "Record-Route: <sip:10.0.0.1:5060;transport=TCP;lr>\r\n"
+  "Route: <sip:sprout.homedomain:5054;transport=TCP;lr;orig>\r\n"
+  "Max-Forwards: 68\r\n"
+  "From: <sip:6505551234@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+  "To: <sip:6505554321@homedomain>\r\n"
+  "Contact: <sip:6505551234@10.83.18.38:36530;transport=TCP;ob>\r\n"
+  "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC\r\n"
+  "CSeq: 16567 INVITE\r\n"
+  "User-Agent: Accession 2.0.0.0\r\n"
+  "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, SUBSCRIBE, NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+  "Supported: replaces, 100rel, timer\r\n"
+  "P-Asserted-Identity: <sip:6505551234@homedomain>\r\n"
+  "P-Charging-Vector: icid-value=4815162542;orig-ioi=homedomain\r\n"
+  "Session-Expires: 600\r\n"
+  "Accept: application/sdp\r\n"
+  "Content-Type: application/sdp\r\n"
+  "Content-Length: 242\r\n"
+  "\r\n"
+  "v=0\r\n"
+  "o=- 2728311987 2728311987 IN IP4 10.83.18.38\r\n"
+  "s=-\r\n"
+  "c=IN IP4 10.83.18.38\r\n"
+  "t=0 0\r\n"
+  "m=audio 9000 RTP/AVP 8 0 101\r\n"
+  "a=rtpmap:8 PCMA/8000\r\n"
+  "a=rtpmap:0 PCMU/8000\r\n"
+  "a=rtpmap:101 telephone-event/8000\r\n"
+  "a=fmtp:101 0-11,16\r\n"
+  "a=sendrecv\r\n"
+  "a=ptime:20\r\n";
+
+/// Creates a transmit buffer holding the INVITE.
+static pjsip_tx_data* create_invite_tdata()
+{
+  pjsip_tx_data* tdata;
+  pjsip_endpt_create_tdata(MicroBench::endpt(), &tdata);
+  tdata->msg = MicroBench::parse_msg(INVITE, tdata->pool);
+  return tdata;
+}
+
+static void BM_PJUtils_clone_msg(MicroBench::State& state)
+{
+  pjsip_tx_data* tdata = create_invite_tdata();
+
+  while (state.keep_running())
+  {
+    pjsip_tx_data* clone = PJUtils::clone_msg(MicroBench::endpt(), tdata);
+    MicroBench::do_not_optimize(clone->msg);
+    pjsip_tx_data_dec_ref(clone);
+  }
+
+  pjsip_tx_data_dec_ref(tdata);
+}
+MICROBENCH(BM_PJUtils_clone_msg);
+
+static void BM_PJUtils_clone_msg_sharing_body(MicroBench::State& state)
+{
+  pjsip_tx_data* tdata = create_invite_tdata();
+
+  while (state.keep_running())
+  {
+    pjsip_tx_data* clone = PJUtils::clone_msg_sharing_body(MicroBench::endpt(),
+                                                           tdata);
+    MicroBench::do_not_optimize(clone->msg);
+    pjsip_tx_data_dec_ref(clone);
+  }
+
+  pjsip_tx_data_dec_ref(tdata);
+}
+MICROBENCH(BM_PJUtils_clone_msg_sharing_body);
+
+static void BM_SipEvent_compare(MicroBench::State& state)
+{
+  // Events at the same priority are ordered by age, which reads both stop
+  // watches, so that's the expensive case.
+  SipEvent older;
+  older.stop_watch.start();
+  SipEvent newer;
+  newer.stop_watch.start();
+  SipEvent urgent;
+  urgent.priority = SIPEventPriorityLevel::HIGH_PRIORITY_1;
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(SipEvent::compare(older, newer));
+    MicroBench::do_not_optimize(SipEvent::compare(newer, urgent));
+  }
+}
+MICROBENCH(BM_SipEvent_compare);
+
+static void BM_FlowTable_find_flow(MicroBench::State& state)
+{
+  const int NUM_FLOWS = 10000;
+
+  // A datagram transport, so that the flows don't need a real transport to
+  // hold references to.
+  pjsip_transport tp;
+  pj_bzero(&tp, sizeof(tp));
+  tp.key.type = PJSIP_TRANSPORT_UDP;
+
+  SNMP::U32Scalar connection_count("", "");
+  FlowTable* flow_table = new FlowTable(NULL, &connection_count);
+  std::vector<pj_sockaddr> addrs(NUM_FLOWS);
+  std::vector<std::string> tokens;
+
+  for (int ii = 0; ii < NUM_FLOWS; ++ii)
+  {
+    pj_sockaddr_init(pj_AF_INET(), &addrs[ii], NULL, 5060 + (ii % 1000));
+    addrs[ii].ipv4.sin_addr.s_addr = htonl(0x0a000000 + ii / 1000);
+    Flow* flow = flow_table->find_create_flow(&tp, &addrs[ii]);
+    tokens.push_back(flow->token());
+    flow->dec_ref();
+  }
+
+  int ii = 0;
+
+  while (state.keep_running())
+  {
+    Flow* flow = flow_table->find_flow(&tp, &addrs[ii]);
+    flow->dec_ref();
+
+    flow = flow_table->find_flow(tokens[ii]);
+    flow->dec_ref();
+
+    ii = (ii + 1) % NUM_FLOWS;
+  }
+
+  delete flow_table;
+}
+MICROBENCH(BM_FlowTable_find_flow);
+
+static void BM_filter_bindings_to_targets(MicroBench::State& state)
+{
+  const int NUM_BINDINGS = 5;
+  std::string aor_id = "sip:6505554321@homedomain";
+  AoR* aor = new AoR(aor_id);
+
+  for (int ii = 0; ii < NUM_BINDINGS; ++ii)
+  {
+    std::string ip = "10.0.0." + std::to_string(ii + 1);
+    Binding* binding = aor->get_binding("<sip:6505554321@" + ip + ">");
+    binding->_uri = "sip:6505554321@" + ip + ":5060;transport=TCP;ob";
+    binding->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    binding->_path_headers.push_back("<sip:abcdefgh@bono1.homedomain;lr>");
+    binding->_cseq = 3;
+    binding->_expires = time(NULL) + 300;
+    binding->_priority = 1000;
+    binding->_params["+sip.instance"] = "\"<urn:uuid:00000000-0000-0000-0000-b4dd3281762" + std::to_string(ii) + ">\"";
+    binding->_params["reg-id"] = "1";
+    binding->_params["+sip.ice"] = "";
+    binding->_params["methods"] = "invite,options,bye,cancel,ack";
+    binding->_private_id = "6505554321@homedomain";
+    binding->_emergency_registration = false;
+  }
+
+  pj_pool_t* pool = pjsip_endpt_create_pool(MicroBench::endpt(),
+                                            "filter-bindings",
+                                            4000,
+                                            4000);
+  pjsip_msg* msg = MicroBench::parse_msg(INVITE, MicroBench::pool());
+  Bindings bindings = aor->bindings();
+
+  while (state.keep_running())
+  {
+    TargetList targets;
+    filter_bindings_to_targets(aor_id,
+                               bindings,
+                               msg,
+                               pool,
+                               NUM_BINDINGS,
+                               targets,
+                               false,
+                               0);
+    MicroBench::do_not_optimize(targets.size());
+
+    // The targets are allocated from the pool, so recycle it.
+    state.pause_timing();
+    targets.clear();
+    pj_pool_reset(pool);
+    state.resume_timing();
+  }
+
+  pj_pool_release(pool);
+  delete aor;
+}
+MICROBENCH(BM_filter_bindings_to_targets);
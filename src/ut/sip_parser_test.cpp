@@ -1425,3 +1425,165 @@ TEST_F(SipParserTest, ResourcePriority)
 
   pj_pool_release(clone_pool);
 }
+
+/// Fixture for testing the custom headers with lazy parsing enabled.
+class LazyHeaderParserTest : public SipParserTest
+{
+public:
+  LazyHeaderParserTest()
+  {
+    register_custom_headers(true);
+  }
+
+  virtual ~LazyHeaderParserTest()
+  {
+    register_custom_headers(false);
+  }
+
+  pjsip_rx_data* parse_lazy_test_msg(const string& extra_hdrs)
+  {
+    string str("INVITE sip:6505554321@homedomain SIP/2.0\n"
+               "Via: SIP/2.0/TCP 10.0.0.1:5060;rport;branch=z9hG4bKPjPtVFjqo;alias\n"
+               "Max-Forwards: 63\n"
+               "From: <sip:6505551234@homedomain>;tag=1234\n"
+               "To: <sip:6505554321@homedomain>\n"
+               "Contact: <sip:6505551234@10.0.0.1:5060;transport=TCP;ob>\n"
+               "Call-ID: 1-13919@10.151.20.48\n"
+               "CSeq: 1 INVITE\n" +
+               extra_hdrs +
+               "Content-Length: 0\n\n");
+
+    pjsip_rx_data* rdata = build_rxdata(str);
+    parse_rxdata(rdata);
+    return rdata;
+  }
+
+  static std::string print_hdr(pjsip_hdr* hdr)
+  {
+    char buf[1024];
+    int written = pjsip_hdr_print_on(hdr, buf, sizeof(buf));
+    return (written >= 0) ? std::string(buf, written) : "";
+  }
+};
+
+// Test that lazily parsed headers are printed exactly as they were received
+// until they're looked up.
+TEST_F(LazyHeaderParserTest, PrintUnchanged)
+{
+  pjsip_rx_data* rdata = parse_lazy_test_msg(
+    "P-Charging-Vector: icid-value=4815162542 ;orig-ioi=\"home;domain\"\n"
+    "P-Asserted-Identity: <sip:6505551234@homedomain>,  <tel:6505551234>\n");
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  pjsip_hdr* pcv = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_P_C_V, NULL);
+  ASSERT_TRUE(pcv != NULL);
+  EXPECT_TRUE(is_lazy_hdr(pcv));
+  EXPECT_EQ("P-Charging-Vector: icid-value=4815162542 ;orig-ioi=\"home;domain\"",
+            print_hdr(pcv));
+
+  pjsip_hdr* pai = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL);
+  ASSERT_TRUE(pai != NULL);
+  EXPECT_TRUE(is_lazy_hdr(pai));
+  EXPECT_EQ("P-Asserted-Identity: <sip:6505551234@homedomain>,  <tel:6505551234>",
+            print_hdr(pai));
+
+  // Printing fails if the buffer is too small.
+  char buf[10];
+  EXPECT_EQ(-1, pjsip_hdr_print_on(pai, buf, sizeof(buf)));
+
+  // Clones are lazily parsed too.
+  pjsip_hdr* clone = (pjsip_hdr*)pjsip_hdr_clone(stack_data.pool, pcv);
+  EXPECT_TRUE(is_lazy_hdr(clone));
+  EXPECT_EQ(print_hdr(pcv), print_hdr(clone));
+}
+
+// Test that lazily parsed headers are parsed when they're looked up.
+TEST_F(LazyHeaderParserTest, ParseOnLookup)
+{
+  pjsip_rx_data* rdata = parse_lazy_test_msg(
+    "P-Charging-Vector: icid-value=4815162542;orig-ioi=homedomain\n"
+    "P-Asserted-Identity: <sip:6505551234@homedomain>, <tel:6505551234>\n"
+    "a: *;+sip.instance=\"<urn:uuid:1>\"\n");
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  pjsip_p_c_v_hdr* pcv = (pjsip_p_c_v_hdr*)
+    PJUtils::find_hdr_by_name(msg, &STR_P_C_V, NULL);
+  ASSERT_TRUE(pcv != NULL);
+  EXPECT_FALSE(is_lazy_hdr((pjsip_hdr*)pcv));
+  EXPECT_PJEQ(pcv->icid, "4815162542");
+  EXPECT_PJEQ(pcv->orig_ioi, "homedomain");
+
+  // The parsed header has replaced the lazily parsed one in the message.
+  EXPECT_EQ(pcv, pjsip_msg_find_hdr_by_name(msg, &STR_P_C_V, NULL));
+  EXPECT_EQ(pcv, PJUtils::find_hdr_by_name(msg, &STR_P_C_V, NULL));
+
+  // A header with several values is replaced by one header for each.
+  pjsip_routing_hdr* pai = (pjsip_routing_hdr*)
+    PJUtils::find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, NULL);
+  ASSERT_TRUE(pai != NULL);
+  EXPECT_EQ("sip:6505551234@homedomain",
+            PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, pai->name_addr.uri));
+  pjsip_routing_hdr* pai2 = (pjsip_routing_hdr*)
+    PJUtils::find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, pai->next);
+  ASSERT_TRUE(pai2 != NULL);
+  EXPECT_EQ("tel:6505551234",
+            PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, pai2->name_addr.uri));
+  EXPECT_TRUE(PJUtils::find_hdr_by_name(msg, &STR_P_ASSERTED_IDENTITY, pai2->next) == NULL);
+
+  // Headers received with their compact names are found too.
+  pjsip_accept_contact_hdr* ac = (pjsip_accept_contact_hdr*)
+    PJUtils::find_hdr_by_names(msg, &STR_ACCEPT_CONTACT, &STR_ACCEPT_CONTACT_SHORT, NULL);
+  ASSERT_TRUE(ac != NULL);
+  EXPECT_FALSE(is_lazy_hdr((pjsip_hdr*)ac));
+  EXPECT_EQ(1u, pj_list_size(&ac->feature_set));
+}
+
+// Test that invalid lazily parsed headers are ignored when they're looked up,
+// rather than the message being rejected.
+TEST_F(LazyHeaderParserTest, Invalid)
+{
+  pjsip_rx_data* rdata = parse_lazy_test_msg(
+    "Session-Expires: soon\n"
+    "Session-Expires: 600;refresher=uac\n");
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  pjsip_session_expires_hdr* se = (pjsip_session_expires_hdr*)
+    PJUtils::find_hdr_by_name(msg, &STR_SESSION_EXPIRES, NULL);
+  ASSERT_TRUE(se != NULL);
+  EXPECT_EQ(600, se->expires);
+  EXPECT_EQ(SESSION_REFRESHER_UAC, se->refresher);
+
+  // The invalid header is still forwarded unchanged.
+  pjsip_hdr* invalid =
+    (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_SESSION_EXPIRES, NULL);
+  ASSERT_TRUE(invalid != NULL);
+  EXPECT_TRUE(is_lazy_hdr(invalid));
+  EXPECT_EQ("Session-Expires: soon", print_hdr(invalid));
+  EXPECT_TRUE(parse_lazy_hdr(invalid) == NULL);
+}
+
+// Test that headers that are only read stay clean, so are still printed as
+// they were received, until they're looked up to be changed.
+TEST_F(LazyHeaderParserTest, PeekLeavesClean)
+{
+  pjsip_rx_data* rdata = parse_lazy_test_msg(
+    "P-Served-User: <sip:6505551234@homedomain> ; sescase=orig\n");
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  const pjsip_routing_hdr* psu = (const pjsip_routing_hdr*)
+    PJUtils::peek_hdr_by_name(msg, &STR_P_SERVED_USER);
+  ASSERT_TRUE(psu != NULL);
+  EXPECT_EQ("sip:6505551234@homedomain",
+            PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, psu->name_addr.uri));
+
+  // The header in the message is still the lazily parsed one.
+  pjsip_hdr* hdr = (pjsip_hdr*)pjsip_msg_find_hdr_by_name(msg, &STR_P_SERVED_USER, NULL);
+  ASSERT_TRUE(hdr != NULL);
+  EXPECT_TRUE(is_lazy_hdr(hdr));
+  EXPECT_EQ("P-Served-User: <sip:6505551234@homedomain> ; sescase=orig",
+            print_hdr(hdr));
+
+  // Looking it up to change it replaces it with the header that was peeked.
+  EXPECT_EQ(psu, PJUtils::find_hdr_by_name(msg, &STR_P_SERVED_USER, NULL));
+  EXPECT_EQ(psu, pjsip_msg_find_hdr_by_name(msg, &STR_P_SERVED_USER, NULL));
+}
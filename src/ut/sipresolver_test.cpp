@@ -10,6 +10,8 @@
  */
 
 #include <string>
+#include <mutex>
+#include <condition_variable>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -719,3 +721,234 @@ TEST_F(SIPResolverTest, TestResolveMethod)
   // Verifies that the same target wasn't returned twice.
   EXPECT_NE(result_str_1, result_str_2);
 }
+
+// Names that need a DNS lookup are resolved on the resolver threads once they
+// have been started, but IP addresses are still resolved straight away.
+TEST_F(SIPResolverTest, AsyncResolution)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  BaseAddrIterator* async_iter = NULL;
+  bool called = false;
+  SIPResolver::ResolveCallback callback =
+    [&](BaseAddrIterator* targets_iter)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      async_iter = targets_iter;
+      called = true;
+      cond.notify_all();
+    };
+
+  // Without any resolver threads, names are resolved on this thread.
+  BaseAddrIterator* targets_iter =
+    _sipresolver.resolve_iter_async("sprout.cw-ngv.com", AF_INET, 0, -1,
+                                    BaseResolver::ALL_LISTS, callback, 0);
+  ASSERT_TRUE(targets_iter != NULL);
+  delete targets_iter; targets_iter = nullptr;
+
+  _sipresolver.start_async_resolution(1, NULL);
+
+  targets_iter =
+    _sipresolver.resolve_iter_async("3.0.0.2", AF_INET, 0, -1,
+                                    BaseResolver::ALL_LISTS, callback, 0);
+  ASSERT_TRUE(targets_iter != NULL);
+  AddrInfo record;
+  EXPECT_TRUE(targets_iter->next(record));
+  EXPECT_EQ("3.0.0.2:5060;transport=UDP", record.to_string());
+  delete targets_iter; targets_iter = nullptr;
+
+  targets_iter =
+    _sipresolver.resolve_iter_async("sprout.cw-ngv.com", AF_INET, 0, -1,
+                                    BaseResolver::ALL_LISTS, callback, 0);
+  EXPECT_TRUE(targets_iter == NULL);
+
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [&]{ return called; });
+  }
+
+  ASSERT_TRUE(async_iter != NULL);
+  EXPECT_TRUE(async_iter->next(record));
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP", record.to_string());
+  delete async_iter; async_iter = nullptr;
+}
+
+// Once a hot next hop's records have expired, its previous targets are used
+// while they are refreshed.
+TEST_F(SIPResolverTest, StaleHotTargets)
+{
+  cwtest_completely_control_time();
+  _sipresolver.enable_hot_targets(10, 5, NULL, NULL, NULL);
+
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve_iter());
+
+  // The records change once they have expired.  There are no resolver threads,
+  // so the refresh completes straight away, but the first request is still
+  // given the previous targets.
+  cwtest_advance_time_ms(11000);
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve_iter());
+  EXPECT_EQ("3.0.0.2:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve_iter());
+
+  // Previous targets are only used for the configured time.
+  cwtest_advance_time_ms(16000);
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.3"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.3:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve_iter());
+
+  cwtest_reset_time();
+}
+
+// The targets of IP address next hops are reused if hosts in any state are
+// allowed, but the host state is still checked if they aren't.
+TEST_F(SIPResolverTest, CachedIPAddrTargets)
+{
+  EXPECT_TRUE(resolve_ip_port("3.0.0.1", 5054, BaseResolver::ALL_LISTS));
+  add_ip_to_blacklist("3.0.0.1", 5054);
+
+  EXPECT_TRUE(resolve_ip_port("3.0.0.1", 5054, BaseResolver::ALL_LISTS));
+  EXPECT_FALSE(resolve_ip_port("3.0.0.1", 5054, BaseResolver::WHITELISTED));
+
+  BaseAddrIterator* targets_iter =
+    _sipresolver.resolve_iter("3.0.0.1", AF_INET, 5054, IPPROTO_TCP,
+                              BaseResolver::ALL_LISTS, 0);
+  std::vector<AddrInfo> targets = targets_iter->take(5);
+  EXPECT_EQ(1u, targets.size());
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP", targets[0].to_string());
+  EXPECT_TRUE(targets_iter->take(5).empty());
+  delete targets_iter; targets_iter = nullptr;
+}
+
+// With latency ordering, the quicker of two SRV targets with the same
+// priority is tried first.
+TEST_F(SIPResolverTest, LatencyOrdering)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 0, 100, 5054, "sprout-1.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 0, 100, 5054, "sprout-2.cw-ngv.com"));
+  _dnsresolver.add_to_cache("_sip._tcp.sprout.cw-ngv.com", ns_t_srv, records);
+
+  records.push_back(a("sprout-1.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout-1.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-2.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout-2.cw-ngv.com", ns_t_a, records);
+
+  _sipresolver.enable_latency_ordering();
+  _sipresolver.record_latency(ip_port_to_addrinfo("3.0.0.1", 5054), 100000);
+  _sipresolver.record_latency(ip_port_to_addrinfo("3.0.0.2", 5054), 10000);
+
+  std::map<std::string, int> counts;
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    counts[RT(_sipresolver, "sprout.cw-ngv.com").resolve_iter()]++;
+  }
+
+  EXPECT_EQ(100, counts["3.0.0.2:5054;transport=TCP"]);
+
+  // Once the slow target speeds up, both are used again.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _sipresolver.record_latency(ip_port_to_addrinfo("3.0.0.1", 5054), 10000);
+  }
+
+  counts.clear();
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    counts[RT(_sipresolver, "sprout.cw-ngv.com").resolve_iter()]++;
+  }
+
+  EXPECT_LT(0, counts["3.0.0.1:5054;transport=TCP"]);
+  EXPECT_LT(0, counts["3.0.0.2:5054;transport=TCP"]);
+}
+
+// Latency ordering doesn't override SRV priority.
+TEST_F(SIPResolverTest, LatencyOrderingKeepsPriority)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 1, 0, 5054, "sprout-1.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 3600, 2, 0, 5054, "sprout-2.cw-ngv.com"));
+  _dnsresolver.add_to_cache("_sip._tcp.sprout.cw-ngv.com", ns_t_srv, records);
+
+  records.push_back(a("sprout-1.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout-1.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-2.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout-2.cw-ngv.com", ns_t_a, records);
+
+  _sipresolver.enable_latency_ordering();
+  _sipresolver.record_latency(ip_port_to_addrinfo("3.0.0.1", 5054), 100000);
+  _sipresolver.record_latency(ip_port_to_addrinfo("3.0.0.2", 5054), 10000);
+
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve_iter());
+}
+
+// A target that has said it is overloaded is tried after the next target,
+// until the overload duration has passed.
+TEST_F(SIPResolverTest, AvoidOverloaded)
+{
+  std::shared_ptr<std::vector<AddrInfo>> targets =
+                                    std::make_shared<std::vector<AddrInfo>>();
+  targets->push_back(ip_port_to_addrinfo("3.0.0.1", 5054));
+  targets->push_back(ip_port_to_addrinfo("3.0.0.2", 5054));
+
+  // Nothing is overloaded, so the order is unchanged.
+  BaseAddrIterator* targets_iter =
+               _sipresolver.avoid_overloaded(new SharedAddrIterator(targets));
+  std::vector<AddrInfo> ordered = targets_iter->take(2);
+  ASSERT_EQ(2u, ordered.size());
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP", ordered[0].to_string());
+  delete targets_iter; targets_iter = nullptr;
+
+  // The first target sheds load with a zero Retry-After, so the second is
+  // tried first for a couple of seconds.
+  _sipresolver.record_overload(ip_port_to_addrinfo("3.0.0.1", 5054), 0);
+  targets_iter = _sipresolver.avoid_overloaded(new SharedAddrIterator(targets));
+  ordered = targets_iter->take(2);
+  ASSERT_EQ(2u, ordered.size());
+  EXPECT_EQ("3.0.0.2:5054;transport=TCP", ordered[0].to_string());
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP", ordered[1].to_string());
+  delete targets_iter; targets_iter = nullptr;
+
+  cwtest_advance_time_ms(2001);
+  targets_iter = _sipresolver.avoid_overloaded(new SharedAddrIterator(targets));
+  ordered = targets_iter->take(2);
+  ASSERT_EQ(2u, ordered.size());
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP", ordered[0].to_string());
+  delete targets_iter; targets_iter = nullptr;
+}
+
+// If every target is overloaded, the order is unchanged.
+TEST_F(SIPResolverTest, AvoidOverloadedAllOverloaded)
+{
+  std::shared_ptr<std::vector<AddrInfo>> targets =
+                                    std::make_shared<std::vector<AddrInfo>>();
+  targets->push_back(ip_port_to_addrinfo("3.0.0.1", 5054));
+  targets->push_back(ip_port_to_addrinfo("3.0.0.2", 5054));
+
+  _sipresolver.record_overload(ip_port_to_addrinfo("3.0.0.1", 5054), 10);
+  _sipresolver.record_overload(ip_port_to_addrinfo("3.0.0.2", 5054), 10);
+
+  BaseAddrIterator* targets_iter =
+               _sipresolver.avoid_overloaded(new SharedAddrIterator(targets));
+  std::vector<AddrInfo> ordered = targets_iter->take(2);
+  ASSERT_EQ(2u, ordered.size());
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP", ordered[0].to_string());
+  delete targets_iter; targets_iter = nullptr;
+}
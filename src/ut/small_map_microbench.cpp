@@ -0,0 +1,106 @@
+/**
+ * @file small_map_microbench.cpp Microbenchmarks for SmallVector and SmallMap.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <list>
+#include <map>
+#include <unordered_map>
+
+#include "microbench.hpp"
+#include "small_map.h"
+
+// Runs the bookkeeping for one transaction, as the Sproutlet proxy does for a
+// request forked to two targets: the messages a Sproutlet has in flight, the
+// requests and response it sends, and the mappings between forks.
+template <class PacketMap, class RequestMap, class ResponseList, class ForkMap, class UpstreamMap>
+static long run_transaction(long base)
+{
+  PacketMap packets;
+  RequestMap requests;
+  ResponseList responses;
+  ForkMap forks;
+  UpstreamMap upstream;
+  long total = 0;
+
+  // The original request and two clones of it.
+  for (long ii = 0; ii < 3; ++ii)
+  {
+    packets[(const void*)(base + ii)] = (void*)(base + ii);
+  }
+
+  // Send the clones, and map the forks to their downstream transactions.
+  for (int fork_id = 0; fork_id < 2; ++fork_id)
+  {
+    const void* msg = (const void*)(base + fork_id + 1);
+    requests[fork_id] = packets.find(msg)->second;
+    packets.erase(msg);
+  }
+
+  while (!requests.empty())
+  {
+    typename RequestMap::iterator it = requests.begin();
+    std::pair<void*, int> fork((void*)base, it->first);
+    forks[fork] = it->second;
+    upstream[it->second] = fork;
+    requests.erase(it);
+  }
+
+  // A final response comes back on each fork.
+  for (long ii = 1; ii <= 2; ++ii)
+  {
+    typename UpstreamMap::iterator it = upstream.find((void*)(base + ii));
+    total += it->second.second;
+    forks.erase(it->second);
+    upstream.erase(it);
+    responses.push_back((void*)(base + ii));
+  }
+
+  while (!responses.empty())
+  {
+    total += (long)responses.front();
+    responses.erase(responses.begin());
+  }
+
+  packets.erase((const void*)base);
+  return total;
+}
+
+// The containers the Sproutlet proxy used to use.
+static void BM_TsxBookkeeping_std(MicroBench::State& state)
+{
+  long ii = 0;
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(
+      run_transaction<std::unordered_map<const void*, void*>,
+                      std::map<int, void*>,
+                      std::list<void*>,
+                      std::map<std::pair<void*, int>, void*>,
+                      std::map<void*, std::pair<void*, int> > >(++ii * 16));
+  }
+}
+MICROBENCH(BM_TsxBookkeeping_std);
+
+static void BM_TsxBookkeeping_small_map(MicroBench::State& state)
+{
+  long ii = 0;
+
+  while (state.keep_running())
+  {
+    MicroBench::do_not_optimize(
+      run_transaction<SmallMap<const void*, void*, 8>,
+                      SmallMap<int, void*, 4>,
+                      SmallVector<void*, 4>,
+                      SmallMap<std::pair<void*, int>, void*, 4>,
+                      SmallMap<void*, std::pair<void*, int>, 4> >(++ii * 16));
+  }
+}
+MICROBENCH(BM_TsxBookkeeping_small_map);
@@ -0,0 +1,70 @@
+/**
+ * @file small_map_test.cpp UT for SmallVector and SmallMap.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "small_map.h"
+
+// Test adding and erasing entries in a SmallVector, both within and beyond
+// its inline capacity.
+TEST(SmallMapTest, Vector)
+{
+  SmallVector<int, 2> vec;
+  EXPECT_TRUE(vec.empty());
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    vec.push_back(ii);
+  }
+  EXPECT_EQ(5u, vec.size());
+
+  // Entries stay in order when an entry is erased.
+  vec.erase(vec.begin() + 1);
+  EXPECT_EQ(4u, vec.size());
+  EXPECT_EQ(0, vec.front());
+  EXPECT_EQ(2, vec[1]);
+  EXPECT_EQ(4, vec[3]);
+
+  vec.clear();
+  EXPECT_TRUE(vec.empty());
+  vec.push_back(7);
+  EXPECT_EQ(7, vec.front());
+}
+
+// Test the map operations used by the Sproutlet proxy.
+TEST(SmallMapTest, Map)
+{
+  SmallMap<std::pair<int*, int>, int, 2> map;
+  int a;
+  int b;
+
+  map[std::make_pair(&a, 0)] = 1;
+  map[std::make_pair(&a, 1)] = 2;
+  map[std::make_pair(&b, 0)] = 3;
+  map[std::make_pair(&a, 0)] = 4;
+  EXPECT_EQ(3u, map.size());
+
+  EXPECT_EQ(4, map.find(std::make_pair(&a, 0))->second);
+  EXPECT_EQ(3, map.find(std::make_pair(&b, 0))->second);
+  EXPECT_TRUE(map.find(std::make_pair(&b, 1)) == map.end());
+
+  EXPECT_EQ(1u, map.erase(std::make_pair(&a, 1)));
+  EXPECT_EQ(0u, map.erase(std::make_pair(&a, 1)));
+  EXPECT_TRUE(map.find(std::make_pair(&a, 1)) == map.end());
+
+  // Entries are iterated in the order they were added.
+  SmallMap<std::pair<int*, int>, int, 2>::iterator it = map.begin();
+  EXPECT_EQ(4, it->second);
+  map.erase(it);
+  EXPECT_EQ(3, map.begin()->second);
+  map.erase(map.begin());
+  EXPECT_TRUE(map.empty());
+}
@@ -0,0 +1,135 @@
+/**
+ * @file snmp_shards_test.cpp UT for SNMPShards.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "snmp_shards.h"
+
+// Tables that record what they're given.
+struct TestCounterTable
+{
+  TestCounterTable() : count(0) {}
+  void increment() { ++count; }
+  int count;
+};
+
+struct TestAccumulatorTable
+{
+  void accumulate(uint32_t sample)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    samples.push_back(sample);
+  }
+
+  std::mutex lock;
+  std::vector<uint32_t> samples;
+};
+
+// Test that counts from several threads all reach the table when flushed, and
+// not before.
+TEST(SNMPShardsTest, Counter)
+{
+  TestCounterTable tbl;
+  SNMPShards::Counter<TestCounterTable> counter(&tbl);
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&counter]()
+    {
+      for (int jj = 0; jj < 1000; ++jj)
+      {
+        counter.increment();
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  EXPECT_EQ(0, tbl.count);
+  SNMPShards::flush_all();
+  EXPECT_EQ(4000, tbl.count);
+  SNMPShards::flush_all();
+  EXPECT_EQ(4000, tbl.count);
+}
+
+// Test that every sample reaches the table, once.
+TEST(SNMPShardsTest, Accumulator)
+{
+  TestAccumulatorTable tbl;
+  SNMPShards::Accumulator<TestAccumulatorTable> accumulator(&tbl);
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&accumulator, ii]()
+    {
+      for (int jj = 0; jj < 100; ++jj)
+      {
+        accumulator.accumulate(ii * 100 + jj);
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  SNMPShards::flush_all();
+  std::sort(tbl.samples.begin(), tbl.samples.end());
+  ASSERT_EQ(400u, tbl.samples.size());
+
+  for (uint32_t ii = 0; ii < 400; ++ii)
+  {
+    EXPECT_EQ(ii, tbl.samples[ii]);
+  }
+}
+
+// Test that a shard that fills up is passed to the table without waiting for
+// a flush.
+TEST(SNMPShardsTest, AccumulatorFull)
+{
+  TestAccumulatorTable tbl;
+  SNMPShards::Accumulator<TestAccumulatorTable> accumulator(&tbl);
+
+  for (size_t ii = 0; ii < SNMPShards::MAX_SAMPLES - 1; ++ii)
+  {
+    accumulator.accumulate(1);
+  }
+
+  EXPECT_TRUE(tbl.samples.empty());
+  accumulator.accumulate(1);
+  EXPECT_EQ(SNMPShards::MAX_SAMPLES, tbl.samples.size());
+}
+
+// Test that destroying a wrapper passes on what it has collected.
+TEST(SNMPShardsTest, FlushOnDestroy)
+{
+  TestCounterTable counter_tbl;
+  TestAccumulatorTable accumulator_tbl;
+
+  {
+    SNMPShards::Counter<TestCounterTable> counter(&counter_tbl);
+    SNMPShards::Accumulator<TestAccumulatorTable> accumulator(&accumulator_tbl);
+    counter.increment();
+    accumulator.accumulate(7);
+  }
+
+  EXPECT_EQ(1, counter_tbl.count);
+  EXPECT_EQ(std::vector<uint32_t>({7}), accumulator_tbl.samples);
+}
@@ -0,0 +1,827 @@
+/**
+ * @file sprout_load_test.cpp In-process load harness for the SproutletProxy.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "pjutils.h"
+#include "siptest.hpp"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+#include "analyticslogger.h"
+#include "fakehssconnection.hpp"
+#include "fakechronosconnection.hpp"
+#include "scscfsproutlet.h"
+#include "icscfsproutlet.h"
+#include "bgcfsproutlet.h"
+#include "registrarsproutlet.h"
+#include "sproutletappserver.h"
+#include "scscfselector.h"
+#include "mmtel.h"
+#include "sproutletproxy.h"
+#include "fakesnmp.hpp"
+#include "mock_as_communication_tracker.h"
+#include "acr.h"
+#include "testingcommon.h"
+#include "registration_sender.h"
+
+using namespace std;
+using namespace TestingCommon;
+using testing::NiceMock;
+
+/// This is a load harness rather than a test.  It drives a mix of REGISTERs
+/// and INVITE/ACK/BYE calls through a real SproutletProxy and the real
+/// S-CSCF, I-CSCF, BGCF and MMTel sproutlets, with only Homestead and the
+/// subscriber store faked out, and reports how many calls each core can
+/// handle and the latency of each request type.
+///
+/// It is disabled so that it doesn't slow down the UTs.  Run it with
+///
+///   make load
+///
+/// or by running sprout_test with --gtest_also_run_disabled_tests and
+/// --gtest_filter=SproutLoadTest.*.  It is configured through these
+/// environment variables.
+///
+/// - SPROUT_LOAD_REGISTERS - the number of REGISTERs (default 1000).
+/// - SPROUT_LOAD_ONNET_CALLS - the number of calls between two subscribers
+///   (default 1000).
+/// - SPROUT_LOAD_OFFNET_CALLS - the number of calls routed off-net through
+///   the BGCF (default 1000).
+/// - SPROUT_LOAD_HSS_LATENCY_US - how long Homestead takes to answer each
+///   request, in microseconds (default 0).
+/// - SPROUT_LOAD_STORE_LATENCY_US - how long each read or write of the
+///   subscriber store takes, in microseconds (default 0).
+/// - SPROUT_LOAD_CHAIN - a comma-separated list of the optional sproutlets to
+///   route through, out of icscf, bgcf and mmtel (default all of them).  The
+///   S-CSCF is always in the chain.  Without the I-CSCF, the S-CSCF routes
+///   terminating requests straight to its terminating half; without the BGCF
+///   no off-net calls are made; and without MMTel the subscribers have no
+///   application servers.
+///
+/// Everything runs on the test's thread, so the calls per second per core is
+/// the number of calls divided by the CPU time that thread used.  The
+/// Homestead and store latencies are modelled by sleeping, so they add to
+/// the request latencies but not the CPU time.
+
+/// A Homestead connection that takes a configurable time to answer.
+class LatentHSSConnection : public FakeHSSConnection
+{
+public:
+  LatentHSSConnection(int latency_us) :
+    FakeHSSConnection(),
+    _latency_us(latency_us)
+  {
+  }
+
+  HTTPCode update_registration_state(const HSSConnection::irs_query& irs_query,
+                                     HSSConnection::irs_info& irs_info,
+                                     SAS::TrailId trail)
+  {
+    wait();
+    return FakeHSSConnection::update_registration_state(irs_query,
+                                                         irs_info,
+                                                         trail);
+  }
+
+  HTTPCode get_registration_data(const std::string& public_id,
+                                 HSSConnection::irs_info& irs_info,
+                                 SAS::TrailId trail)
+  {
+    wait();
+    return FakeHSSConnection::get_registration_data(public_id, irs_info, trail);
+  }
+
+private:
+  void wait()
+  {
+    if (_latency_us > 0)
+    {
+      usleep(_latency_us);
+    }
+  }
+
+  int _latency_us;
+};
+
+/// A local store that takes a configurable time to read and write, standing
+/// in for the remote store behind S4.
+class LatentStore : public LocalStore
+{
+public:
+  LatentStore(int latency_us) :
+    LocalStore(),
+    _latency_us(latency_us)
+  {
+  }
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         Store::Format data_format)
+  {
+    wait();
+    return LocalStore::get_data(table, key, data, cas, trail, data_format);
+  }
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         Store::Format data_format)
+  {
+    wait();
+    return LocalStore::set_data(table, key, data, cas, expiry, trail, data_format);
+  }
+
+private:
+  void wait()
+  {
+    if (_latency_us > 0)
+    {
+      usleep(_latency_us);
+    }
+  }
+
+  int _latency_us;
+};
+
+/// The configuration of a load run, read from the environment.
+struct LoadOptions
+{
+  int registers;
+  int onnet_calls;
+  int offnet_calls;
+  int hss_latency_us;
+  int store_latency_us;
+  std::set<std::string> chain;
+
+  LoadOptions() :
+    registers(env_int("SPROUT_LOAD_REGISTERS", 1000)),
+    onnet_calls(env_int("SPROUT_LOAD_ONNET_CALLS", 1000)),
+    offnet_calls(env_int("SPROUT_LOAD_OFFNET_CALLS", 1000)),
+    hss_latency_us(env_int("SPROUT_LOAD_HSS_LATENCY_US", 0)),
+    store_latency_us(env_int("SPROUT_LOAD_STORE_LATENCY_US", 0)),
+    chain({"icscf", "bgcf", "mmtel"})
+  {
+    const char* chain_str = getenv("SPROUT_LOAD_CHAIN");
+
+    if (chain_str != NULL)
+    {
+      chain.clear();
+      std::stringstream ss(chain_str);
+      std::string sproutlet;
+
+      while (std::getline(ss, sproutlet, ','))
+      {
+        chain.insert(sproutlet);
+      }
+    }
+
+    if (!in_chain("bgcf"))
+    {
+      // Off-net calls can't be routed without the BGCF.
+      offnet_calls = 0;
+    }
+  }
+
+  bool in_chain(const std::string& sproutlet) const
+  {
+    return (chain.find(sproutlet) != chain.end());
+  }
+
+  static int env_int(const char* name, int default_value)
+  {
+    const char* value = getenv(name);
+    return (value != NULL) ? atoi(value) : default_value;
+  }
+};
+
+/// The latencies of one type of request.
+class LatencyStats
+{
+public:
+  LatencyStats() : _failures(0) {}
+
+  void add(uint64_t latency_us, bool success)
+  {
+    _latencies_us.push_back(latency_us);
+
+    if (!success)
+    {
+      ++_failures;
+    }
+  }
+
+  void print(const char* name)
+  {
+    if (_latencies_us.empty())
+    {
+      return;
+    }
+
+    std::sort(_latencies_us.begin(), _latencies_us.end());
+    printf("%-10s %8lu %10lu %10lu %10lu %10lu %8d\n",
+           name,
+           (unsigned long)_latencies_us.size(),
+           (unsigned long)percentile(50),
+           (unsigned long)percentile(90),
+           (unsigned long)percentile(99),
+           (unsigned long)_latencies_us.back(),
+           _failures);
+  }
+
+private:
+  uint64_t percentile(int pc) const
+  {
+    size_t index = (_latencies_us.size() - 1) * pc / 100;
+    return _latencies_us[index];
+  }
+
+  std::vector<uint64_t> _latencies_us;
+  int _failures;
+};
+
+static uint64_t wall_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t thread_cpu_us()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return ((uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+          usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+class SproutLoadTest : public SipTest
+{
+public:
+  // The subscribers that make and take the calls, and the number of
+  // subscribers that register.
+  static const char* CALLER;
+  static const char* CALLEE;
+  static const char* CALLEE_CONTACT;
+  static const char* OFFNET_NUMBER;
+  static const int NUM_REGISTERING_USERS = 100;
+
+  // How many requests to send between polls for timers.  Polling waits for a
+  // millisecond, so it isn't included in the results.
+  static const int POLL_INTERVAL = 100;
+
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+    SipTest::SetScscfUri("sip:scscf.sprout.homedomain:5058;transport=TCP");
+  }
+
+  static void TearDownTestCase()
+  {
+    // Shut down the transaction module first, before we destroy the
+    // objects that might handle any callbacks!
+    pjsip_tsx_layer_destroy();
+    SipTest::TearDownTestCase();
+  }
+
+  SproutLoadTest() :
+    _tp_bono(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.99.88.11", 12345),
+    _tp_callee(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.114.61.213", 5061),
+    _tp_mgcf(TransportFlow::Protocol::TCP, stack_data.scscf_port, "10.0.0.1", 5060),
+    _register_cseq(1),
+    _branch(1)
+  {
+  }
+
+  void SetUp()
+  {
+    _hss_connection = new LatentHSSConnection(_options.hss_latency_us);
+    _chronos_connection = new FakeChronosConnection();
+    _local_data_store = new LatentStore(_options.store_latency_us);
+    _local_aor_store = new AstaireAoRStore(_local_data_store);
+    _s4 = new S4("load", _chronos_connection, "/timers/", (AoRStore*)_local_aor_store, {});
+    _analytics = new AnalyticsLogger();
+    _notify_sender = new NotifySender();
+    IFCConfiguration ifc_configuration(false, false, "sip:DUMMY_AS", NULL, NULL);
+    _fifc_service = new FIFCService(NULL, string(UT_DIR).append("/test_scscf_fifc.xml"));
+    _registration_sender = new RegistrationSender(ifc_configuration,
+                                                  _fifc_service,
+                                                  &SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES,
+                                                  true);
+    _sm = new SubscriberManager(_s4, _hss_connection, _analytics, _notify_sender, _registration_sender);
+    _registration_sender->register_dereg_event_consumer(_sm);
+    _bgcf_service = new BgcfService(string(UT_DIR).append("/test_stateful_proxy_bgcf.json"));
+    _sess_term_comm_tracker = new NiceMock<MockAsCommunicationTracker>();
+    _sess_cont_comm_tracker = new NiceMock<MockAsCommunicationTracker>();
+    _enum_service = new JSONEnumService(string(UT_DIR).append("/test_stateful_proxy_enum.json"));
+    _acr_factory = new ACRFactory();
+
+    std::list<Sproutlet*> sproutlets;
+
+    _registrar_sproutlet = new RegistrarSproutlet("registrar",
+                                                  0,
+                                                  "sip:registrar.homedomain:5058;transport=tcp",
+                                                  {},
+                                                  "scscf",
+                                                  "subscription",
+                                                  _sm,
+                                                  _acr_factory,
+                                                  300,
+                                                  &SNMP::FAKE_REGISTRATION_STATS_TABLES);
+    _registrar_sproutlet->init();
+    sproutlets.push_back(_registrar_sproutlet);
+
+    // The S-CSCF only routes terminating requests through the I-CSCF if it
+    // has been given its URI.
+    _scscf_sproutlet = new SCSCFSproutlet("scscf",
+                                          "scscf",
+                                          "sip:scscf.sprout.homedomain:5058;transport=TCP",
+                                          "sip:127.0.0.1:5058",
+                                          _options.in_chain("icscf") ?
+                                            "sip:icscf.sprout.homedomain:5059;transport=TCP" :
+                                            "",
+                                          "sip:bgcf@homedomain:5058",
+                                          5058,
+                                          "sip:scscf.sprout.homedomain:5058;transport=TCP",
+                                          "scscf",
+                                          "",
+                                          _sm,
+                                          _enum_service,
+                                          _acr_factory,
+                                          &SNMP::FAKE_INCOMING_SIP_TRANSACTIONS_TABLE,
+                                          &SNMP::FAKE_OUTGOING_SIP_TRANSACTIONS_TABLE,
+                                          false,
+                                          _fifc_service,
+                                          ifc_configuration,
+                                          3000,
+                                          6000,
+                                          _sess_term_comm_tracker,
+                                          _sess_cont_comm_tracker);
+    _scscf_sproutlet->init();
+    sproutlets.push_back(_scscf_sproutlet);
+
+    _scscf_selector = NULL;
+    _icscf_sproutlet = NULL;
+
+    if (_options.in_chain("icscf"))
+    {
+      _scscf_selector = new SCSCFSelector("sip:scscf.sprout.homedomain",
+                                          string(UT_DIR).append("/test_icscf.json"));
+      _icscf_sproutlet = new ICSCFSproutlet("icscf",
+                                            "sip:bgcf@homedomain:5058",
+                                            5059,
+                                            "sip:icscf.sprout.homedomain:5059;transport=TCP",
+                                            "icscf",
+                                            "",
+                                            _hss_connection,
+                                            _acr_factory,
+                                            _scscf_selector,
+                                            _enum_service,
+                                            &SNMP::FAKE_INCOMING_SIP_TRANSACTIONS_TABLE,
+                                            &SNMP::FAKE_OUTGOING_SIP_TRANSACTIONS_TABLE,
+                                            false,
+                                            5059);
+      _icscf_sproutlet->init();
+      sproutlets.push_back(_icscf_sproutlet);
+    }
+
+    _bgcf_sproutlet = NULL;
+
+    if (_options.in_chain("bgcf"))
+    {
+      _bgcf_sproutlet = new BGCFSproutlet("bgcf",
+                                          5054,
+                                          "sip:bgcf.homedomain:5054;transport=tcp",
+                                          _bgcf_service,
+                                          _enum_service,
+                                          _acr_factory,
+                                          nullptr,
+                                          nullptr,
+                                          false);
+      sproutlets.push_back(_bgcf_sproutlet);
+    }
+
+    _mmtel = NULL;
+    _mmtel_sproutlet = NULL;
+
+    if (_options.in_chain("mmtel"))
+    {
+      _mmtel = new Mmtel("mmtel", nullptr);
+      _mmtel_sproutlet = new SproutletAppServerShim(_mmtel,
+                                                    5055,
+                                                    "sip:mmtel.homedomain:5058;transport=tcp",
+                                                    &SNMP::FAKE_INCOMING_SIP_TRANSACTIONS_TABLE,
+                                                    &SNMP::FAKE_OUTGOING_SIP_TRANSACTIONS_TABLE,
+                                                    "mmtel.homedomain");
+      sproutlets.push_back(_mmtel_sproutlet);
+    }
+
+    std::unordered_set<std::string> additional_home_domains;
+    additional_home_domains.insert("sprout.homedomain");
+    additional_home_domains.insert("127.0.0.1");
+
+    _proxy = new SproutletProxy(stack_data.endpt,
+                                PJSIP_MOD_PRIORITY_UA_PROXY_LAYER+1,
+                                "homedomain",
+                                additional_home_domains,
+                                std::unordered_set<std::string>(),
+                                true,
+                                sproutlets,
+                                std::set<std::string>(),
+                                nullptr,
+                                nullptr);
+
+    provision_subscribers();
+
+    SipTest::poll();
+  }
+
+  void TearDown()
+  {
+    delete _fifc_service; _fifc_service = NULL;
+    delete _acr_factory; _acr_factory = NULL;
+    delete _sm; _sm = NULL;
+    delete _s4, _s4 = NULL;
+    delete _registration_sender; _registration_sender = NULL;
+    delete _notify_sender, _notify_sender = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+    delete _local_aor_store; _local_aor_store = NULL;
+    delete _local_data_store; _local_data_store = NULL;
+    delete _analytics; _analytics = NULL;
+    delete _enum_service; _enum_service = NULL;
+    delete _bgcf_service; _bgcf_service = NULL;
+    delete _hss_connection; _hss_connection = NULL;
+    delete _sess_cont_comm_tracker; _sess_cont_comm_tracker = NULL;
+    delete _sess_term_comm_tracker; _sess_term_comm_tracker = NULL;
+  }
+
+  ~SproutLoadTest()
+  {
+    // Terminate all transactions, and let PJSIP destroy them.
+    std::list<pjsip_transaction*> tsxs = get_all_tsxs();
+    for (std::list<pjsip_transaction*>::iterator it = tsxs.begin();
+         it != tsxs.end();
+         ++it)
+    {
+      pjsip_tsx_terminate(*it, PJSIP_SC_SERVICE_UNAVAILABLE);
+    }
+
+    cwtest_advance_time_ms(33000L);
+    poll();
+
+    pjsip_tsx_layer_instance()->stop();
+    pjsip_tsx_layer_instance()->start();
+
+    delete _proxy; _proxy = NULL;
+    delete _mmtel_sproutlet; _mmtel_sproutlet = NULL;
+    delete _mmtel; _mmtel = NULL;
+    delete _bgcf_sproutlet; _bgcf_sproutlet = NULL;
+    delete _scscf_sproutlet; _scscf_sproutlet = NULL;
+    delete _icscf_sproutlet; _icscf_sproutlet = NULL;
+    delete _scscf_selector; _scscf_selector = NULL;
+    delete _registrar_sproutlet; _registrar_sproutlet = NULL;
+  }
+
+  /// Sets up Homestead and the store with the subscribers.
+  void provision_subscribers()
+  {
+    register_uri(_sm, _hss_connection, "6505551000", "homedomain", CALLEE_CONTACT, false);
+    register_uri(_sm, _hss_connection, "6505551234", "homedomain", CALLEE_CONTACT, false);
+
+    if (_options.in_chain("mmtel"))
+    {
+      // Invoke MMTel on both halves of every call.
+      for (const char* user : {CALLER, CALLEE})
+      {
+        ServiceProfileBuilder service_profile = ServiceProfileBuilder()
+          .addIdentity(user)
+          .addIfc(1, {"<Method>INVITE</Method>"}, "sip:mmtel.homedomain");
+        SubscriptionBuilder subscription = SubscriptionBuilder()
+          .addServiceProfile(service_profile);
+        _hss_connection->set_impu_result(user,
+                                         "call",
+                                         RegDataXMLUtils::STATE_REGISTERED,
+                                         subscription.return_sub());
+      }
+    }
+
+    if (_options.in_chain("icscf"))
+    {
+      _hss_connection->set_result("/impu/sip%3A6505551234%40homedomain/location",
+                                  "{\"result-code\": 2001,"
+                                  " \"scscf\": \"sip:scscf.sprout.homedomain:5058;transport=TCP\"}");
+    }
+
+    for (int ii = 0; ii < NUM_REGISTERING_USERS; ++ii)
+    {
+      _hss_connection->set_impu_result("sip:" + registering_user(ii) + "@homedomain",
+                                       "reg",
+                                       RegDataXMLUtils::STATE_REGISTERED,
+                                       "");
+    }
+  }
+
+  static std::string registering_user(int index)
+  {
+    return std::to_string(6505552000 + index);
+  }
+
+  std::string next_branch()
+  {
+    return "z9hG4bKload" + std::to_string(_branch++);
+  }
+
+  /// Builds a REGISTER (or re-REGISTER) for one of the registering
+  /// subscribers.
+  std::string register_request(int index)
+  {
+    std::string user = registering_user(index);
+    std::string aor = "sip:" + user + "@homedomain";
+    std::string cseq = std::to_string(_register_cseq++);
+
+    return "REGISTER sip:homedomain SIP/2.0\r\n"
+           "Via: SIP/2.0/TCP 10.99.88.11:12345;rport;branch=" + next_branch() + "\r\n"
+           "Route: <sip:sprout.homedomain;transport=tcp;lr;service=registrar>\r\n"
+           "From: <" + aor + ">;tag=" + user + "\r\n"
+           "To: <" + aor + ">\r\n"
+           "Max-Forwards: 68\r\n"
+           "Call-ID: load-register-" + user + "@10.99.88.11\r\n"
+           "CSeq: " + cseq + " REGISTER\r\n"
+           "Supported: path\r\n"
+           "Contact: <sip:" + user + "@10.114.61.214:5061;transport=tcp>;expires=300\r\n"
+           "P-Charging-Vector: icid-value=100\r\n"
+           "Content-Length: 0\r\n"
+           "\r\n";
+  }
+
+  /// Injects a request and runs its transaction to completion.  Every
+  /// request that sprout sends on is answered with a 200 OK, until the final
+  /// response reaches the sender.  Returns the status code of the final
+  /// response, or 0 if there wasn't one.  If the final response is a 2xx and
+  /// a dialog is passed in, the dialog's route set is taken from it.
+  int run_transaction(const std::string& request,
+                      TransportFlow* tp,
+                      Message* dialog = NULL)
+  {
+    inject_msg(request, tp);
+    int status = 0;
+    bool polled = false;
+
+    while (status == 0)
+    {
+      if (txdata_count() == 0)
+      {
+        // Some processing may be waiting on a timer, so poll once before
+        // giving up.
+        if (polled)
+        {
+          break;
+        }
+
+        poll();
+        polled = true;
+        continue;
+      }
+
+      pjsip_tx_data* tdata = pop_txdata();
+      pjsip_msg* msg = tdata->msg;
+
+      if (msg->type == PJSIP_RESPONSE_MSG)
+      {
+        // Responses only ever go back to the sender.
+        if (msg->line.status.code >= 200)
+        {
+          status = msg->line.status.code;
+
+          if ((dialog != NULL) && (status < 300))
+          {
+            dialog->convert_routeset(msg);
+          }
+        }
+      }
+      else if (msg->line.req.method.id == PJSIP_ACK_METHOD)
+      {
+        // The ACK has reached the callee, which is the end of it.
+        status = 200;
+      }
+      else
+      {
+        inject_msg(respond_to_txdata(tdata, 200), &_tp_callee);
+      }
+
+      pjsip_tx_data_dec_ref(tdata);
+    }
+
+    // Throw away anything else, such as NOTIFYs, so that it doesn't get
+    // mistaken for part of the next transaction.
+    while (txdata_count() > 0)
+    {
+      pjsip_tx_data_dec_ref(pop_txdata());
+    }
+
+    return status;
+  }
+
+  /// Times a transaction, recording its latency against the request type.
+  bool timed_transaction(const std::string& request,
+                         TransportFlow* tp,
+                         Message* dialog,
+                         LatencyStats& stats)
+  {
+    uint64_t start_us = wall_us();
+    int status = run_transaction(request, tp, dialog);
+    bool success = ((status >= 200) && (status < 300));
+    stats.add(wall_us() - start_us, success);
+    return success;
+  }
+
+  /// Makes a call, and hangs it up.  Returns whether the call succeeded.
+  bool call(bool offnet)
+  {
+    Message invite;
+    invite._via = "10.99.88.11:12345;transport=TCP";
+    invite._route = "Route: <sip:sprout.homedomain;orig>";
+    invite._branch = next_branch();
+
+    if (offnet)
+    {
+      invite._toscheme = "tel";
+      invite._to = OFFNET_NUMBER;
+      invite._todomain = "";
+    }
+
+    if (!timed_transaction(invite.get_request(), &_tp_bono, &invite, _invite_stats))
+    {
+      return false;
+    }
+
+    Message ack = invite;
+    ack._method = "ACK";
+    ack._in_dialog = true;
+    ack._requri = offnet ? "sip:mgcf@10.0.0.1:5060;transport=tcp" : CALLEE_CONTACT;
+    ack._branch = next_branch();
+    ack._body = "";
+    run_transaction(ack.get_request(), &_tp_bono);
+
+    Message bye = ack;
+    bye._method = "BYE";
+    bye._cseq++;
+    bye._branch = next_branch();
+    return timed_transaction(bye.get_request(), &_tp_bono, NULL, _bye_stats);
+  }
+
+protected:
+  LoadOptions _options;
+  TransportFlow _tp_bono;
+  TransportFlow _tp_callee;
+  TransportFlow _tp_mgcf;
+  int _register_cseq;
+  uint64_t _branch;
+
+  LatencyStats _register_stats;
+  LatencyStats _invite_stats;
+  LatencyStats _bye_stats;
+
+  LatentStore* _local_data_store;
+  FakeChronosConnection* _chronos_connection;
+  AstaireAoRStore* _local_aor_store;
+  RegistrationSender* _registration_sender;
+  SubscriberManager* _sm;
+  S4* _s4;
+  NotifySender* _notify_sender;
+  AnalyticsLogger* _analytics;
+  LatentHSSConnection* _hss_connection;
+  BgcfService* _bgcf_service;
+  EnumService* _enum_service;
+  ACRFactory* _acr_factory;
+  FIFCService* _fifc_service;
+  RegistrarSproutlet* _registrar_sproutlet;
+  BGCFSproutlet* _bgcf_sproutlet;
+  SCSCFSproutlet* _scscf_sproutlet;
+  Mmtel* _mmtel;
+  SproutletAppServerShim* _mmtel_sproutlet;
+  SCSCFSelector* _scscf_selector;
+  ICSCFSproutlet* _icscf_sproutlet;
+  SproutletProxy* _proxy;
+  MockAsCommunicationTracker* _sess_term_comm_tracker;
+  MockAsCommunicationTracker* _sess_cont_comm_tracker;
+};
+
+const char* SproutLoadTest::CALLER = "sip:6505551000@homedomain";
+const char* SproutLoadTest::CALLEE = "sip:6505551234@homedomain";
+const char* SproutLoadTest::CALLEE_CONTACT = "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob";
+const char* SproutLoadTest::OFFNET_NUMBER = "+16505559999";
+
+TEST_F(SproutLoadTest, DISABLED_Run)
+{
+  enum Operation { REGISTER, ONNET_CALL, OFFNET_CALL };
+
+  // Shuffle the operations (with a fixed seed, so that runs are comparable)
+  // so that the mix is spread through the run.
+  std::vector<Operation> operations;
+  operations.insert(operations.end(), _options.registers, REGISTER);
+  operations.insert(operations.end(), _options.onnet_calls, ONNET_CALL);
+  operations.insert(operations.end(), _options.offnet_calls, OFFNET_CALL);
+  std::shuffle(operations.begin(), operations.end(), std::mt19937(1));
+
+  // Measure in real time, rather than the frozen time the other tests use.
+  cwtest_reset_time();
+
+  int calls = 0;
+  int failed_calls = 0;
+  int registers = 0;
+  uint64_t wall_elapsed_us = 0;
+  uint64_t cpu_elapsed_us = 0;
+
+  for (size_t ii = 0; ii < operations.size(); ++ii)
+  {
+    uint64_t wall_start_us = wall_us();
+    uint64_t cpu_start_us = thread_cpu_us();
+
+    if (operations[ii] == REGISTER)
+    {
+      timed_transaction(register_request(registers++ % NUM_REGISTERING_USERS),
+                        &_tp_bono,
+                        NULL,
+                        _register_stats);
+    }
+    else
+    {
+      ++calls;
+
+      if (!call(operations[ii] == OFFNET_CALL))
+      {
+        ++failed_calls;
+      }
+    }
+
+    wall_elapsed_us += wall_us() - wall_start_us;
+    cpu_elapsed_us += thread_cpu_us() - cpu_start_us;
+
+    if (ii % POLL_INTERVAL == 0)
+    {
+      poll();
+    }
+  }
+
+  cwtest_completely_control_time();
+
+  std::string chain = "scscf";
+  for (const std::string& sproutlet : _options.chain)
+  {
+    chain += "," + sproutlet;
+  }
+
+  printf("\nSproutletProxy load: chain %s, Homestead latency %dus, store latency %dus\n\n",
+         chain.c_str(),
+         _options.hss_latency_us,
+         _options.store_latency_us);
+  printf("%-10s %8s %10s %10s %10s %10s %8s\n",
+         "Request", "Count", "p50 (us)", "p90 (us)", "p99 (us)", "Max (us)", "Failed");
+  _register_stats.print("REGISTER");
+  _invite_stats.print("INVITE");
+  _bye_stats.print("BYE");
+
+  double wall_s = wall_elapsed_us / 1e6;
+  double cpu_s = cpu_elapsed_us / 1e6;
+  printf("\n%d calls (%d failed) and %d REGISTERs in %.2fs, using %.2fs of CPU\n",
+         calls, failed_calls, registers, wall_s, cpu_s);
+
+  if (cpu_s > 0)
+  {
+    printf("Calls per second per core: %.0f\n", calls / cpu_s);
+  }
+
+  if (wall_s > 0)
+  {
+    printf("Calls per second: %.0f\n", calls / wall_s);
+  }
+
+  EXPECT_EQ(0, failed_calls);
+}
@@ -0,0 +1,181 @@
+/**
+ * @file sproutlet_cpu_test.cpp UT for SproutletCpuAccount and SproutletCpu.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <chrono>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "sproutlet_cpu.h"
+
+/// Uses at least the given amount of CPU time.
+static void burn_cpu(uint64_t ns)
+{
+  uint64_t end_ns = SproutletCpu::thread_cpu_ns() + ns;
+  while (SproutletCpu::thread_cpu_ns() < end_ns)
+  {
+  }
+}
+
+// Test that an account adds up the time of its callbacks.
+TEST(SproutletCpuTest, Account)
+{
+  SproutletCpuAccount account(NULL);
+
+  SproutletCpuAccount::Summary summary = account.summary();
+  EXPECT_EQ(0u, summary.callbacks);
+  EXPECT_EQ(0u, summary.total_us);
+  EXPECT_EQ(0u, summary.max_us);
+
+  account.record(2000);
+  account.record(5000);
+  account.record(1000);
+
+  summary = account.summary();
+  EXPECT_EQ(3u, summary.callbacks);
+  EXPECT_EQ(8u, summary.total_us);
+  EXPECT_EQ(5u, summary.max_us);
+}
+
+// Test that accounts are looked up by name, and given an SNMP index each.
+TEST(SproutletCpuTest, AccountByName)
+{
+  SproutletCpuAccount* account = SproutletCpu::account("ut-by-name");
+  EXPECT_EQ(account, SproutletCpu::account("ut-by-name"));
+  EXPECT_NE(account, SproutletCpu::account("ut-by-name-2"));
+
+  int index = 0;
+  int index_2 = 0;
+  for (const SproutletCpu::AccountSummary& summary : SproutletCpu::summaries())
+  {
+    if (summary.name == "ut-by-name")
+    {
+      index = summary.index;
+    }
+    else if (summary.name == "ut-by-name-2")
+    {
+      index_2 = summary.index;
+    }
+  }
+
+  EXPECT_GE(index, 1);
+  EXPECT_GE(index_2, 1);
+  EXPECT_NE(index, index_2);
+}
+
+// Test that a timer records the CPU time the thread uses, and not time it
+// spends blocked.
+TEST(SproutletCpuTest, Timer)
+{
+  SproutletCpuAccount account(NULL);
+
+  {
+    SproutletCpu::Timer timer(&account);
+    burn_cpu(5000000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+
+  SproutletCpuAccount::Summary summary = account.summary();
+  EXPECT_EQ(1u, summary.callbacks);
+  EXPECT_GE(summary.total_us, 5000u);
+  EXPECT_LT(summary.total_us, 40000u);
+}
+
+// Test that the time of a callback timed inside another is only counted
+// against the inner account.
+TEST(SproutletCpuTest, NestedTimers)
+{
+  SproutletCpuAccount outer(NULL);
+  SproutletCpuAccount inner(NULL);
+
+  {
+    SproutletCpu::Timer outer_timer(&outer);
+    burn_cpu(2000000);
+
+    {
+      SproutletCpu::Timer inner_timer(&inner);
+      burn_cpu(20000000);
+    }
+  }
+
+  EXPECT_EQ(1u, outer.summary().callbacks);
+  EXPECT_EQ(1u, inner.summary().callbacks);
+  EXPECT_GE(inner.summary().total_us, 20000u);
+  EXPECT_GE(outer.summary().total_us, 2000u);
+  EXPECT_LT(outer.summary().total_us, 20000u);
+}
+
+// Test that a timer without an account doesn't record anything, but still
+// takes its time out of the callback it is inside.
+TEST(SproutletCpuTest, TimerWithoutAccount)
+{
+  SproutletCpuAccount outer(NULL);
+
+  {
+    SproutletCpu::Timer outer_timer(&outer);
+
+    {
+      SproutletCpu::Timer timer(NULL);
+      burn_cpu(20000000);
+    }
+  }
+
+  EXPECT_EQ(1u, outer.summary().callbacks);
+  EXPECT_LT(outer.summary().total_us, 20000u);
+}
+
+// Test that a timer counts the thread as occupied by its account, once
+// however deeply its timers are nested.
+TEST(SproutletCpuTest, BusyWorkers)
+{
+  SproutletCpuAccount account(NULL);
+
+  {
+    SproutletCpu::Timer timer(&account);
+    EXPECT_EQ(1, account.summary().busy_workers);
+
+    {
+      SproutletCpu::Timer inner_timer(&account);
+      EXPECT_EQ(1, account.summary().busy_workers);
+    }
+  }
+
+  EXPECT_EQ(0, account.summary().busy_workers);
+  EXPECT_EQ(1, account.summary().max_busy_workers);
+}
+
+// Test that new transactions are rejected while a Sproutlet occupies as
+// many workers as it is allowed.
+TEST(SproutletCpuTest, Bulkhead)
+{
+  SproutletCpuAccount account(NULL);
+  EXPECT_TRUE(account.admit());
+
+  account.set_max_workers(1);
+  EXPECT_TRUE(account.admit());
+
+  {
+    SproutletCpu::Timer timer(&account);
+    EXPECT_FALSE(account.admit());
+  }
+
+  EXPECT_TRUE(account.admit());
+  EXPECT_EQ(1u, account.summary().rejected);
+}
+
+// Test that a limit set before the account is created is applied to it.
+TEST(SproutletCpuTest, MaxWorkersByName)
+{
+  SproutletCpu::set_max_workers("ut-max-workers", 3);
+  EXPECT_EQ(3, SproutletCpu::account("ut-max-workers")->summary().max_workers);
+
+  SproutletCpu::set_max_workers("ut-max-workers", 5);
+  EXPECT_EQ(5, SproutletCpu::account("ut-max-workers")->summary().max_workers);
+}
@@ -246,6 +246,57 @@ public:
   }
 };
 
+// A record-routing forwarder that adds an X-Trace header, naming the host of
+// its Route, to each in-dialog request it forwards.
+class FakeSproutletTsxRRTracer : public FakeSproutletTsxForwarder<true>
+{
+public:
+  FakeSproutletTsxRRTracer(Sproutlet* sproutlet) :
+    FakeSproutletTsxForwarder<true>(sproutlet)
+  {
+  }
+
+  void on_rx_in_dialog_request(pjsip_msg* req)
+  {
+    pj_pool_t* pool = get_pool(req);
+    pj_str_t name = pj_str((char*)"X-Trace");
+    pj_str_t host = ((pjsip_sip_uri*)route_hdr()->name_addr.uri)->host;
+    pjsip_msg_add_hdr(req,
+                      (pjsip_hdr*)pjsip_generic_string_hdr_create(pool,
+                                                                  &name,
+                                                                  &host));
+    FakeSproutletTsxForwarder<true>::on_rx_in_dialog_request(req);
+  }
+};
+
+// A SproutletTsx that defers its processing of an initial request until the
+// test resumes it, and then forwards the request.
+class FakeSproutletTsxDeferrer : public SproutletTsx
+{
+public:
+  FakeSproutletTsxDeferrer(Sproutlet* sproutlet) :
+    SproutletTsx(sproutlet)
+  {
+  }
+
+  void on_rx_initial_request(pjsip_msg* req)
+  {
+    SproutletTsxHelper::Resumer resume = defer_processing();
+    _resume = [this, req, resume]()
+    {
+      resume([this, req]()
+      {
+        pjsip_msg* fwd = req;
+        send_request(fwd);
+      });
+    };
+  }
+
+  static std::function<void()> _resume;
+};
+
+std::function<void()> FakeSproutletTsxDeferrer::_resume;
+
 class FakeSproutletTsxDownstreamRequest : public SproutletTsx
 {
 public:
@@ -896,8 +947,12 @@ public:
     // Create the Test Sproutlets.
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForwarder<false> >("fwd", 0, "sip:fwd.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForwarder<true> >("fwdrr", 0, "sip:fwdrr.proxy1.homedomain;transport=tcp", "", "alias"));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxRRTracer>("crr1", 0, "sip:crr1.proxy1.homedomain;transport=tcp", ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxRRTracer>("crr2", 0, "sip:crr2.proxy1.homedomain;transport=tcp", ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxRRTracer>("crr3", 0, "sip:crr3.proxy1.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDownstreamRequest>("dsreq", 0, "sip:dsreq.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForker<NUM_FORKS> >("forker", 0, "sip:forker.homedomain;transport=tcp", ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDeferrer>("deferrer", 0, "sip:deferrer.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDelayRedirect<1> >("delayredirect", 0, "sip:delayredirect.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxBad >("bad", 0, "sip:bad.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxB2BUA >("b2bua", 0, "sip:b2bua.homedomain;transport=tcp", ""));
@@ -954,7 +1009,8 @@ public:
     _mock_route_to_remote_alias_counter = new MockSnmpCounterTable();
     _mock_accept_for_remote_alias_counter = new MockSnmpCounterTable();
 
-    // Create the Sproutlet proxy.
+    // Create the Sproutlet proxy, forwarding unbilled in-dialog requests
+    // statelessly and collapsing the Sproutlets' Record-Routes.
     _proxy = new SproutletProxy(stack_data.endpt,
                                 PJSIP_MOD_PRIORITY_UA_PROXY_LAYER+1,
                                 "proxy1.homedomain",
@@ -964,7 +1020,11 @@ public:
                                 _sproutlets,
                                 std::set<std::string>(),
                                 _mock_route_to_remote_alias_counter,
-                                _mock_accept_for_remote_alias_counter);
+                                _mock_accept_for_remote_alias_counter,
+                                SproutletProxy::DEFAULT_MAX_SPROUTLET_DEPTH,
+                                NULL,
+                                true,
+                                true);
 
     // Schedule timers.
     SipTest::poll();
@@ -1443,6 +1503,59 @@ TEST_F(SproutletProxyTest, SimpleSproutletForwarder)
   delete tp;
 }
 
+TEST_F(SproutletProxyTest, SimpleSproutletForwarderBody)
+{
+  // Tests that the body of a request forwarded through a Sproutlet (which is
+  // shared between the clones of the request made within the Sproutlet tree)
+  // is sent intact, and is owned by the forwarded request.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject an INVITE with an SDP body.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  msg1._body = "v=0\r\no=- 1 1 IN IP4 1.2.3.4\r\ns=-\r\nc=IN IP4 1.2.3.4\r\nt=0 0\r\nm=audio 4000 RTP/AVP 0\r\n";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Check the forwarded INVITE has the original body, in its own copy.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+  ASSERT_TRUE(tdata->msg->body != NULL);
+  EXPECT_EQ(msg1._body,
+            std::string((char*)tdata->msg->body->data, tdata->msg->body->len));
+  EXPECT_TRUE(tdata->msg->body->clone_data == &pjsip_clone_text_data);
+
+  // Send a 200 OK response.
+  inject_msg(respond_to_current_txdata(200));
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
 TEST_F(SproutletProxyTest, SimpleSproutletForwarderRR)
 {
   // Tests standard routing of a request through a Sproutlet that simply
@@ -1566,6 +1679,257 @@ TEST_F(SproutletProxyTest, SimpleSproutletForwarderRR)
   delete tp;
 }
 
+TEST_F(SproutletProxyTest, DeferredProcessing)
+{
+  // Tests that a Sproutlet can defer its processing of a request, and that
+  // the requests it sends when the processing is resumed are forwarded.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with two Route headers - the first referencing the
+  // deferring Sproutlet and the second referencing an external node.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:deferrer.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting only the 100 Trying while the processing is deferred.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+  ASSERT_EQ(0, txdata_count());
+
+  // Resume the processing, and check the request is forwarded to the node in
+  // the second Route header.
+  FakeSproutletTsxDeferrer::_resume();
+  FakeSproutletTsxDeferrer::_resume = nullptr;
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(tdata->msg, "Route"));
+
+  // Send a 200 OK response, and check it is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, CollapsedRecordRoutes)
+{
+  // Tests that the Record-Routes added by three Sproutlets are collapsed into
+  // one, and that in-dialog requests from each end of the dialog are routed
+  // through all three Sproutlets, in the right order.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request routed through the record-routing Sproutlets, and then
+  // an external node.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false) + "1";
+  msg1._route = "Route: <sip:crr1.proxy1.homedomain;transport=TCP;lr>\r\n"
+                "Route: <sip:crr2.proxy1.homedomain;transport=TCP;lr>\r\n"
+                "Route: <sip:crr3.proxy1.homedomain;transport=TCP;lr>\r\n"
+                "Route: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // The INVITE has a single Record-Route, for the last Sproutlet, listing
+  // the other Sproutlets' Record-Routes (escaped, and separated by escaped
+  // spaces) and the From tag.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(tdata->msg, "Route"));
+
+  std::string rr = get_headers(tdata->msg, "Record-Route");
+  EXPECT_EQ(std::string::npos, rr.find("\r\n"));
+  EXPECT_EQ(0u, rr.find("Record-Route: <sip:crr3.proxy1.homedomain;transport=tcp;lr;hello=world;crr=sip:crr2.proxy1.homedomain"));
+  EXPECT_NE(std::string::npos, rr.find("%20sip:crr1.proxy1.homedomain"));
+  EXPECT_NE(std::string::npos, rr.find(";crr-ftag=" + msg1._from_tag + ">"));
+  std::string collapsed_route = "Route: " + rr.substr(rr.find("<"));
+
+  // Send a 200 OK response, which is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // Send an ACK from the caller, which routes through the Sproutlets in the
+  // order they record-routed, and on to the external node.
+  Message msg2;
+  msg2._method = "ACK";
+  msg2._requri = "sip:bob@awaydomain";
+  msg2._from = "sip:alice@homedomain";
+  msg2._to = "sip:bob@awaydomain";
+  msg2._to_tag = "abcdefg";
+  msg2._via = tp->to_string(false) + "2";
+  msg2._route = collapsed_route + "\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg2.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("ACK").matches(tdata->msg);
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(tdata->msg, "Route"));
+  EXPECT_EQ("X-Trace: crr1.proxy1.homedomain\r\n"
+            "X-Trace: crr2.proxy1.homedomain\r\n"
+            "X-Trace: crr3.proxy1.homedomain",
+            get_headers(tdata->msg, "X-Trace"));
+  free_txdata();
+
+  // Send a BYE from the callee, which routes through the Sproutlets in
+  // reverse.
+  Message msg3;
+  msg3._method = "BYE";
+  msg3._requri = "sip:alice@awaydomain";
+  msg3._from = "sip:bob@awaydomain";
+  msg3._from_tag = "abcdefg";
+  msg3._to = "sip:alice@homedomain";
+  msg3._to_tag = msg1._from_tag;
+  msg3._via = tp->to_string(false) + "3";
+  msg3._route = collapsed_route + "\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg3.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("BYE").matches(tdata->msg);
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(tdata->msg, "Route"));
+  EXPECT_EQ("", get_headers(tdata->msg, "Record-Route"));
+  EXPECT_EQ("X-Trace: crr3.proxy1.homedomain\r\n"
+            "X-Trace: crr2.proxy1.homedomain\r\n"
+            "X-Trace: crr1.proxy1.homedomain",
+            get_headers(tdata->msg, "X-Trace"));
+
+  // Send a 200 OK response, which is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, StatelessInDialog)
+{
+  // Tests that in-dialog requests whose top Route is an unbilled hop are
+  // forwarded statelessly, apart from re-INVITEs.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Send a BYE routed through an unbilled hop.
+  Message msg1;
+  msg1._method = "BYE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._to_tag = "abcdefg";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:proxy1.homedomain;lr;service=fwdrr;billing-role=charge-none>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Check the BYE is forwarded with our Route removed, and a Via whose branch
+  // is derived from the received one.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("BYE").matches(tdata->msg);
+  EXPECT_EQ("sip:bob@awaydomain", str_uri(tdata->msg->line.req.uri));
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(tdata->msg, "Route"));
+  pjsip_via_hdr* via = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
+  EXPECT_EQ("z9hG4bKsl-Pjmo1aimuq33BAI4rjhgQgBr4sY" + std::to_string(msg1._unique) + "SPI",
+            PJUtils::pj_str_to_string(&via->branch_param));
+
+  // Send a 200 OK response, which is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // A re-INVITE on the same route goes through the Sproutlet, so gets a
+  // 100 Trying.
+  Message msg2;
+  msg2._method = "INVITE";
+  msg2._requri = "sip:bob@awaydomain";
+  msg2._from = "sip:alice@homedomain";
+  msg2._to = "sip:bob@awaydomain";
+  msg2._to_tag = "abcdefg";
+  msg2._via = tp->to_string(false);
+  msg2._route = msg1._route;
+  inject_msg(msg2.get_request(), tp);
+
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
 TEST_F(SproutletProxyTest, SimpleSproutletForker)
 {
   // Tests standard routing of a request through a Sproutlet that simply
@@ -1858,6 +2222,202 @@ TEST_F(SproutletProxyTest, CancelForking)
   delete tp;
 }
 
+TEST_F(SproutletProxyTest, ForkingGlobalFailure)
+{
+  // Tests that a 6xx response on one fork of a forking Sproutlet cancels the
+  // other forks, and is sent upstream once they have all completed.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with a Route header referencing the forking Sproutlet.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:forker.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITEs.
+  ASSERT_EQ(NUM_FORKS + 1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Send 100 Trying responses on each fork.
+  std::vector<pjsip_tx_data*> req;
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    req.push_back(pop_txdata());
+    ReqMatcher("INVITE").matches(req[ii]->msg);
+    inject_msg(respond_to_txdata(req[ii], 100));
+  }
+  ASSERT_EQ(0, txdata_count());
+
+  // Send a 486 Busy Here response on the first fork, and check it is
+  // absorbed.
+  inject_msg(respond_to_txdata(req[0], 486));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+
+  // Send a 603 Decline response on the second fork.  This is ACKed and the
+  // remaining forks are cancelled, but it isn't sent upstream yet.
+  inject_msg(respond_to_txdata(req[1], 603));
+  ASSERT_EQ(NUM_FORKS - 1, txdata_count());
+
+  int acks = 0;
+  int cancels = 0;
+  while (txdata_count() > 0)
+  {
+    tdata = current_txdata();
+    ASSERT_EQ(PJSIP_REQUEST_MSG, tdata->msg->type);
+    if (tdata->msg->line.req.method.id == PJSIP_ACK_METHOD)
+    {
+      ++acks;
+    }
+    else
+    {
+      ReqMatcher("CANCEL").matches(tdata->msg);
+      inject_msg(respond_to_txdata(tdata, 200));
+      ++cancels;
+    }
+    free_txdata();
+  }
+  EXPECT_EQ(1, acks);
+  EXPECT_EQ(NUM_FORKS - 2, cancels);
+
+  // Send 487 responses on the cancelled forks.  Each is ACKed, and the 603 is
+  // sent upstream when the last fork completes.
+  for (int ii = 2; ii < NUM_FORKS - 1; ++ii)
+  {
+    inject_msg(respond_to_txdata(req[ii], 487));
+    ASSERT_EQ(1, txdata_count());
+    tdata = current_txdata();
+    ReqMatcher("ACK").matches(tdata->msg);
+    free_txdata();
+  }
+
+  inject_msg(respond_to_txdata(req[NUM_FORKS - 1], 487));
+  ASSERT_EQ(2, txdata_count());
+
+  acks = 0;
+  int declines = 0;
+  while (txdata_count() > 0)
+  {
+    tdata = current_txdata();
+    if (tdata->msg->type == PJSIP_RESPONSE_MSG)
+    {
+      RespMatcher(603).matches(tdata->msg);
+      tp->expect_target(tdata);
+      ++declines;
+    }
+    else
+    {
+      ReqMatcher("ACK").matches(tdata->msg);
+      ++acks;
+    }
+    free_txdata();
+  }
+  EXPECT_EQ(1, acks);
+  EXPECT_EQ(1, declines);
+
+  // All done!
+  req.clear();
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, ForkingGlobalFailureThenSuccess)
+{
+  // Tests that a 2xx response on a fork that is being cancelled after a 6xx
+  // response on another fork is sent upstream in place of the 6xx.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with a Route header referencing the forking Sproutlet.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:forker.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITEs.
+  ASSERT_EQ(NUM_FORKS + 1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Send 100 Trying responses on each fork.
+  std::vector<pjsip_tx_data*> req;
+  for (int ii = 0; ii < NUM_FORKS; ++ii)
+  {
+    req.push_back(pop_txdata());
+    ReqMatcher("INVITE").matches(req[ii]->msg);
+    inject_msg(respond_to_txdata(req[ii], 100));
+  }
+  ASSERT_EQ(0, txdata_count());
+
+  // Send a 603 Decline response on the first fork.  This is ACKed and the
+  // other forks are cancelled.
+  inject_msg(respond_to_txdata(req[0], 603));
+  ASSERT_EQ(NUM_FORKS, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+
+  for (int ii = 1; ii < NUM_FORKS; ++ii)
+  {
+    tdata = current_txdata();
+    ReqMatcher("CANCEL").matches(tdata->msg);
+    inject_msg(respond_to_txdata(tdata, 200));
+    free_txdata();
+  }
+  ASSERT_EQ(0, txdata_count());
+
+  // The second fork answers before the CANCEL reaches it.  Its 200 OK is
+  // sent upstream, and the other forks aren't cancelled again.
+  inject_msg(respond_to_txdata(req[1], 200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  // The 487 responses on the remaining forks are ACKed, but not sent
+  // upstream.
+  for (int ii = 2; ii < NUM_FORKS; ++ii)
+  {
+    inject_msg(respond_to_txdata(req[ii], 487));
+    ASSERT_EQ(1, txdata_count());
+    tdata = current_txdata();
+    ReqMatcher("ACK").matches(tdata->msg);
+    free_txdata();
+  }
+
+  // All done!
+  req.clear();
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
 TEST_F(SproutletProxyTest, ForkErrorTimeout)
 {
   // Tests handling of a request timeout.
@@ -0,0 +1,26 @@
+/**
+ * @file stage_latency_microbench.cpp Microbenchmarks for StageLatency.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "microbench.hpp"
+#include "stage_latency.h"
+
+// The cost of timing one stage of processing, which is paid several times for
+// every message.
+static void BM_StageLatency_record(MicroBench::State& state)
+{
+  StageHistogram* stage = StageLatency::stage("bench:record");
+
+  while (state.keep_running())
+  {
+    StageLatency::record_since(stage, StageLatency::now());
+  }
+}
+MICROBENCH(BM_StageLatency_record);
@@ -0,0 +1,128 @@
+/**
+ * @file stage_latency_test.cpp UT for StageHistogram and StageLatency.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "stage_latency.h"
+
+// Test that every value falls in a bucket that covers it, and that the
+// buckets are contiguous and accurate to within 1/16.
+TEST(StageHistogramTest, Buckets)
+{
+  int last_bucket = 0;
+  for (uint64_t us = 0; us < (1ull << 20); us += 1 + us / 1000)
+  {
+    int bucket = StageHistogram::bucket(us);
+    ASSERT_GE(bucket, last_bucket);
+    ASSERT_LE(bucket, last_bucket + 1);
+    EXPECT_GE(StageHistogram::bucket_upper_bound(bucket), us);
+    EXPECT_LE(StageHistogram::bucket_upper_bound(bucket), us + us / 16 + 1);
+    last_bucket = bucket;
+  }
+
+  for (int bucket = 1; bucket < StageHistogram::NUM_BUCKETS; ++bucket)
+  {
+    EXPECT_EQ(bucket,
+              StageHistogram::bucket(StageHistogram::bucket_upper_bound(bucket - 1) + 1));
+  }
+
+  EXPECT_EQ(StageHistogram::NUM_BUCKETS - 1,
+            StageHistogram::bucket((1ull << 32) - 1));
+  EXPECT_EQ(StageHistogram::NUM_BUCKETS - 1, StageHistogram::bucket(UINT64_MAX));
+}
+
+// Test the summary of a histogram.
+TEST(StageHistogramTest, Summary)
+{
+  StageHistogram histogram;
+
+  StageHistogram::Summary summary = histogram.summary();
+  EXPECT_EQ(0u, summary.count);
+  EXPECT_EQ(0u, summary.p99_us);
+
+  for (uint64_t us = 1; us <= 1000; ++us)
+  {
+    histogram.record(us);
+  }
+
+  summary = histogram.summary();
+  EXPECT_EQ(1000u, summary.count);
+  EXPECT_EQ(500u, summary.mean_us);
+  EXPECT_EQ(1000u, summary.max_us);
+  EXPECT_NEAR(500, summary.p50_us, 500 / 16);
+  EXPECT_NEAR(900, summary.p90_us, 900 / 16);
+  EXPECT_NEAR(990, summary.p99_us, 990 / 16);
+  EXPECT_GE(summary.p99_us, summary.p90_us);
+  EXPECT_LE(summary.p999_us, 1000u);
+}
+
+// Test that histograms can be shared between threads.
+TEST(StageHistogramTest, Threads)
+{
+  StageHistogram histogram;
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    threads.push_back(std::thread([&histogram, ii]()
+    {
+      for (int jj = 0; jj < 10000; ++jj)
+      {
+        histogram.record(ii * 10000 + jj);
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  StageHistogram::Summary summary = histogram.summary();
+  EXPECT_EQ(40000u, summary.count);
+  EXPECT_EQ(39999u, summary.max_us);
+}
+
+// Test looking up stages and timing them.
+TEST(StageLatencyTest, Stages)
+{
+  StageLatency::init();
+
+  StageHistogram* stage = StageLatency::stage("ut:stages");
+  EXPECT_EQ(stage, StageLatency::stage("ut:stages"));
+  EXPECT_NE(stage, StageLatency::stage("ut:other"));
+
+  StageLatency::Ticks start = StageLatency::now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  StageLatency::record_since(stage, start);
+  StageLatency::record_since(NULL, start);
+
+  bool found = false;
+  for (const StageLatency::StageSummary& s : StageLatency::summaries())
+  {
+    if (s.name == "ut:stages")
+    {
+      found = true;
+      EXPECT_EQ(1u, s.summary.count);
+      EXPECT_GE(s.summary.max_us, 10000u);
+      EXPECT_LT(s.summary.max_us, 1000000u);
+    }
+  }
+  EXPECT_TRUE(found);
+
+  EXPECT_EQ(0u, StageLatency::event_start());
+  StageLatency::set_event_start(start);
+  EXPECT_EQ(start, StageLatency::event_start());
+  StageLatency::set_event_start(0);
+}
@@ -0,0 +1,110 @@
+/**
+ * @file startup_stages_test.cpp UT for StartupStages.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "gtest/gtest.h"
+
+#include "startup_stages.h"
+
+// Test that independent stages run in parallel.
+TEST(StartupStagesTest, Parallel)
+{
+  StartupStages stages;
+  std::atomic<int> running(0);
+  std::atomic<int> max_running(0);
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    stages.add("stage" + std::to_string(ii), [&]()
+    {
+      int now_running = ++running;
+      int max = max_running.load();
+      while ((now_running > max) &&
+             (!max_running.compare_exchange_weak(max, now_running)))
+      {
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      --running;
+      return true;
+    });
+  }
+
+  EXPECT_TRUE(stages.run());
+  EXPECT_GT(max_running.load(), 1);
+  EXPECT_EQ(4u, stages.durations_ms().size());
+}
+
+// Test that a stage only runs once the stages it depends on have finished.
+TEST(StartupStagesTest, Dependencies)
+{
+  StartupStages stages;
+  std::mutex lock;
+  std::vector<std::string> order;
+
+  auto stage = [&](const std::string& name, int sleep_ms)
+  {
+    return [&, name, sleep_ms]()
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+      std::lock_guard<std::mutex> guard(lock);
+      order.push_back(name);
+      return true;
+    };
+  };
+
+  stages.add("a", stage("a", 100));
+  stages.add("b", stage("b", 0), {"a"});
+  stages.add("c", stage("c", 0));
+  stages.add("d", stage("d", 0), {"b", "c"});
+
+  EXPECT_TRUE(stages.run());
+
+  ASSERT_EQ(4u, order.size());
+  EXPECT_EQ("c", order[0]);
+  EXPECT_EQ("a", order[1]);
+  EXPECT_EQ("b", order[2]);
+  EXPECT_EQ("d", order[3]);
+}
+
+// Test that a failed stage fails the run, and that the stages that depend on
+// it are skipped.
+TEST(StartupStagesTest, Failure)
+{
+  StartupStages stages;
+  bool dependent_ran = false;
+  bool independent_ran = false;
+
+  stages.add("fails", []() { return false; });
+  stages.add("dependent", [&]() { dependent_ran = true; return true; }, {"fails"});
+  stages.add("independent", [&]() { independent_ran = true; return true; });
+
+  EXPECT_FALSE(stages.run());
+  EXPECT_FALSE(dependent_ran);
+  EXPECT_TRUE(independent_ran);
+  EXPECT_EQ(1u, stages.durations_ms().count("independent"));
+  EXPECT_EQ(0u, stages.durations_ms().count("fails"));
+}
+
+// Test that a stage can't depend on a stage that hasn't been added.
+TEST(StartupStagesTest, UnknownDependency)
+{
+  StartupStages stages;
+  bool ran = false;
+
+  stages.add("stage", [&]() { ran = true; return true; }, {"unknown"});
+
+  EXPECT_FALSE(stages.run());
+  EXPECT_FALSE(ran);
+}
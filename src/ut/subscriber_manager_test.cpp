@@ -1303,6 +1303,7 @@ TEST_F(SubscriberManagerTest, TestDeregisterSubscriber)
   AoR* empty_aor = new AoR();
 
   int version = 12;
+  EXPECT_CALL(*_hss_connection, invalidate_cached_registration_data(DEFAULT_ID));
   EXPECT_CALL(*_hss_connection, get_registration_data(DEFAULT_ID, _, _))
     .WillOnce(DoAll(SetArgReferee<1>(irs_info),
                     Return(HTTP_OK)));
@@ -1492,6 +1493,369 @@ TEST_F(SubscriberManagerTest, TestGetBindingsFail)
   EXPECT_EQ(rc, HTTP_NOT_FOUND);
 }
 
+// Tests getting bindings for multiple AoRs from SM.
+TEST_F(SubscriberManagerTest, TestGetBindingsMulti)
+{
+  // Set up AoRs to be returned by S4 - these are deleted by the handler
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_get(OTHER_ID, _, _, _))
+    .WillOnce(Return(HTTP_NOT_FOUND));
+
+  // Call get bindings multi on SM.
+  std::vector<std::string> aor_ids = {DEFAULT_ID, OTHER_ID};
+  std::vector<Bindings> all_bindings;
+  std::vector<HTTPCode> rcs;
+  _subscriber_manager->get_bindings_multi(aor_ids,
+                                          all_bindings,
+                                          rcs,
+                                          DUMMY_TRAIL_ID);
+
+  // Check the results are in the same order as the AoR IDs.
+  ASSERT_EQ(2u, rcs.size());
+  ASSERT_EQ(2u, all_bindings.size());
+  EXPECT_EQ(HTTP_OK, rcs[0]);
+  EXPECT_EQ(1u, all_bindings[0].size());
+  EXPECT_TRUE(all_bindings[0].find(AoRTestUtils::BINDING_ID) != all_bindings[0].end());
+  EXPECT_EQ(HTTP_NOT_FOUND, rcs[1]);
+  EXPECT_TRUE(all_bindings[1].empty());
+
+  // Delete the bindings passed out.
+  SubscriberDataUtils::delete_bindings(all_bindings[0]);
+}
+
+// Tests that deregistering multiple subscribers reports a failure for any of
+// them.
+TEST_F(SubscriberManagerTest, TestDeregisterSubscribers)
+{
+  HSSConnection::irs_info irs_info;
+  irs_info._associated_uris.add_uri(DEFAULT_ID, false);
+
+  // The first subscriber has no AoR, so is deregistered successfully, but the
+  // HSS lookup for the second fails.
+  EXPECT_CALL(*_hss_connection, invalidate_cached_registration_data(DEFAULT_ID));
+  EXPECT_CALL(*_hss_connection, invalidate_cached_registration_data(OTHER_ID));
+  EXPECT_CALL(*_hss_connection, get_registration_data(DEFAULT_ID, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(irs_info),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(Return(HTTP_NOT_FOUND));
+  EXPECT_CALL(*_hss_connection, get_registration_data(OTHER_ID, _, _))
+    .WillOnce(Return(HTTP_NOT_FOUND));
+
+  std::vector<std::string> public_ids = {DEFAULT_ID, OTHER_ID};
+  HTTPCode rc = _subscriber_manager->deregister_subscribers(public_ids,
+                                                            DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_NOT_FOUND);
+}
+
+/// Fixture for tests of SubscriberManager with the AoR cache enabled.
+class SubscriberManagerAoRCacheTest : public SubscriberManagerTest
+{
+public:
+  SubscriberManagerAoRCacheTest()
+  {
+    delete _subscriber_manager;
+    _subscriber_manager = new SubscriberManager(_s4,
+                                                _hss_connection,
+                                                _analytics_logger,
+                                                _notify_sender,
+                                                _registration_sender,
+                                                300,
+                                                100);
+  }
+};
+
+// Tests that repeated lookups of bindings only read the AoR from S4 once.
+TEST_F(SubscriberManagerAoRCacheTest, TestGetBindingsCached)
+{
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    Bindings all_bindings;
+    HTTPCode rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                                    all_bindings,
+                                                    DUMMY_TRAIL_ID);
+    EXPECT_EQ(rc, HTTP_OK);
+    EXPECT_EQ(all_bindings.size(), 1);
+    EXPECT_TRUE(all_bindings.find(AoRTestUtils::BINDING_ID) != all_bindings.end());
+    SubscriberDataUtils::delete_bindings(all_bindings);
+  }
+
+  // Once the cached AoR expires, it is read from S4 again.
+  cwtest_advance_time_ms(301000);
+  get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  Bindings all_bindings;
+  HTTPCode rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                                  all_bindings,
+                                                  DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+}
+
+// Tests that failed lookups aren't cached.
+TEST_F(SubscriberManagerAoRCacheTest, TestGetBindingsFailNotCached)
+{
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(HTTP_NOT_FOUND));
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    Bindings all_bindings;
+    HTTPCode rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                                    all_bindings,
+                                                    DUMMY_TRAIL_ID);
+    EXPECT_EQ(rc, HTTP_NOT_FOUND);
+  }
+}
+
+// Tests that writing an AoR removes it from the cache.
+TEST_F(SubscriberManagerAoRCacheTest, TestWriteInvalidatesCache)
+{
+  AoR* cached_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* patch_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* reread_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  patch_aor->_associated_uris.add_uri(OTHER_ID, false);
+
+  EXPECT_CALL(*_hss_connection, invalidate_cached_registration_data(_))
+    .Times(3);
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(cached_aor),
+                    Return(HTTP_OK)))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)))
+    .WillOnce(DoAll(SetArgPointee<1>(reread_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_patch(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<2>(patch_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_notify_sender, send_notifys(DEFAULT_ID, _, _, _, _, _));
+
+  // Populate the cache.
+  Bindings all_bindings;
+  HTTPCode rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                                  all_bindings,
+                                                  DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+
+  // Update the AoR.
+  AssociatedURIs associated_uris = {};
+  associated_uris.add_uri(DEFAULT_ID, false);
+  associated_uris.add_uri(OTHER_ID, false);
+  rc = _subscriber_manager->update_associated_uris(DEFAULT_ID,
+                                                   associated_uris,
+                                                   DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+
+  // The next lookup reads the AoR from S4 again.
+  rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                         all_bindings,
+                                         DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+}
+
+// Tests that a reregister that only refreshes a binding uses the cached AoR
+// rather than reading it again, and only sends the refreshed binding to S4.
+TEST_F(SubscriberManagerAoRCacheTest, TestReregisterRefreshUsesCachedAoR)
+{
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* patch_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  PatchObject patch_object;
+
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_patch(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SaveArg<1>(&patch_object),
+                    SetArgPointee<2>(patch_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_analytics_logger, registration(DEFAULT_ID,
+                                               AoRTestUtils::BINDING_ID,
+                                               AoRTestUtils::CONTACT_URI,
+                                               300));
+  EXPECT_CALL(*_notify_sender, send_notifys(DEFAULT_ID,
+                                            AoRsMatch(*get_aor),
+                                            AoRsMatch(*patch_aor),
+                                            SubscriberDataUtils::EventTrigger::USER,
+                                            _,
+                                            _));
+
+  // Populate the cache, as the registrar does when it looks up the current
+  // bindings.
+  Bindings all_bindings;
+  HTTPCode rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                                  all_bindings,
+                                                  DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+
+  // Refresh the binding.
+  AssociatedURIs associated_uris;
+  associated_uris.add_uri(DEFAULT_ID, false);
+  Binding* binding = AoRTestUtils::build_binding(DEFAULT_ID, time(NULL));
+  Bindings updated_bindings;
+  updated_bindings.insert(std::make_pair(AoRTestUtils::BINDING_ID, binding));
+  HSSConnection::irs_info irs_info;
+
+  rc = _subscriber_manager->reregister_subscriber(DEFAULT_ID,
+                                                  "sip:scscf.sprout.homedomain:5058;transport=TCP",
+                                                  associated_uris,
+                                                  updated_bindings,
+                                                  {},
+                                                  all_bindings,
+                                                  irs_info,
+                                                  DUMMY_TRAIL_ID);
+
+  // The patch only contains the refreshed binding.
+  EXPECT_EQ(rc, HTTP_OK);
+  ASSERT_NE(patch_object._update_bindings.find(AoRTestUtils::BINDING_ID),
+            patch_object._update_bindings.end());
+  EXPECT_TRUE(*(patch_object._update_bindings[AoRTestUtils::BINDING_ID]) ==
+              *(binding));
+  EXPECT_TRUE(patch_object._remove_bindings.empty());
+  EXPECT_TRUE(patch_object._remove_subscriptions.empty());
+  EXPECT_FALSE(patch_object.get_associated_uris());
+  EXPECT_TRUE(patch_object._increment_cseq);
+
+  SubscriberDataUtils::delete_bindings(updated_bindings);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+}
+
+// Tests that a reregister that changes a binding's contact reads the AoR
+// again, even if it is cached.
+TEST_F(SubscriberManagerAoRCacheTest, TestReregisterContactChangedRereadsAoR)
+{
+  AoR* cached_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* patch_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, false);
+  patch_aor->get_binding(AoRTestUtils::BINDING_ID)->_uri = AoRTestUtils::CONTACT_URI + "2";
+  PatchObject patch_object;
+
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(cached_aor),
+                    Return(HTTP_OK)))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_patch(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SaveArg<1>(&patch_object),
+                    SetArgPointee<2>(patch_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_analytics_logger, registration(_, _, _, _));
+  EXPECT_CALL(*_analytics_logger, subscription(_, _, _, _));
+  EXPECT_CALL(*_notify_sender, send_notifys(DEFAULT_ID, _, _, _, _, _));
+
+  Bindings all_bindings;
+  HTTPCode rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                                  all_bindings,
+                                                  DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+
+  AssociatedURIs associated_uris;
+  associated_uris.add_uri(DEFAULT_ID, false);
+  Binding* binding = AoRTestUtils::build_binding(DEFAULT_ID, time(NULL), AoRTestUtils::CONTACT_URI + "2", 300);
+  Bindings updated_bindings;
+  updated_bindings.insert(std::make_pair(AoRTestUtils::BINDING_ID, binding));
+  HSSConnection::irs_info irs_info;
+
+  rc = _subscriber_manager->reregister_subscriber(DEFAULT_ID,
+                                                  "sip:scscf.sprout.homedomain:5058;transport=TCP",
+                                                  associated_uris,
+                                                  updated_bindings,
+                                                  {},
+                                                  all_bindings,
+                                                  irs_info,
+                                                  DUMMY_TRAIL_ID);
+
+  // The subscription that shared the old contact is removed, and the full
+  // patch is sent.
+  EXPECT_EQ(rc, HTTP_OK);
+  ASSERT_FALSE(patch_object._remove_subscriptions.empty());
+  EXPECT_EQ(patch_object._remove_subscriptions[0], AoRTestUtils::SUBSCRIPTION_ID);
+  EXPECT_TRUE(patch_object.get_associated_uris());
+
+  SubscriberDataUtils::delete_bindings(updated_bindings);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+}
+
+// Tests that a SUBSCRIBE that only refreshes a subscription uses the cached
+// AoR rather than reading it again, only sends the refreshed subscription to
+// S4, and still sends a NOTIFY.
+TEST_F(SubscriberManagerAoRCacheTest, TestSubscriptionRefreshUsesCachedAoR)
+{
+  HSSConnection::irs_info irs_info;
+  irs_info._associated_uris.add_uri(DEFAULT_ID, false);
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* patch_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  PatchObject patch_object;
+
+  EXPECT_CALL(*_hss_connection, get_registration_data(DEFAULT_ID, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(irs_info),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_patch(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SaveArg<1>(&patch_object),
+                    SetArgPointee<2>(patch_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_analytics_logger, subscription(DEFAULT_ID,
+                                               AoRTestUtils::SUBSCRIPTION_ID,
+                                               AoRTestUtils::CONTACT_URI,
+                                               300));
+  EXPECT_CALL(*_notify_sender, send_notifys(DEFAULT_ID,
+                                            AoRsMatch(*get_aor),
+                                            AoRsMatch(*patch_aor),
+                                            SubscriberDataUtils::EventTrigger::USER,
+                                            _,
+                                            _));
+
+  // Populate the cache, as the subscription sproutlet does when it checks
+  // the subscriber has bindings.
+  Bindings all_bindings;
+  HTTPCode rc = _subscriber_manager->get_bindings(DEFAULT_ID,
+                                                  all_bindings,
+                                                  DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+  SubscriberDataUtils::delete_bindings(all_bindings);
+
+  // Refresh the subscription.
+  Subscription* subscription = AoRTestUtils::build_subscription(AoRTestUtils::SUBSCRIPTION_ID, time(NULL));
+  Subscriptions updated_subscriptions;
+  updated_subscriptions.insert(std::make_pair(AoRTestUtils::SUBSCRIPTION_ID, subscription));
+
+  rc = _subscriber_manager->update_subscriptions(DEFAULT_ID,
+                                                 updated_subscriptions,
+                                                 irs_info,
+                                                 DUMMY_TRAIL_ID);
+
+  // The patch only contains the refreshed subscription.
+  EXPECT_EQ(rc, HTTP_OK);
+  ASSERT_NE(patch_object._update_subscriptions.find(AoRTestUtils::SUBSCRIPTION_ID),
+            patch_object._update_subscriptions.end());
+  EXPECT_TRUE(*(patch_object._update_subscriptions[AoRTestUtils::SUBSCRIPTION_ID]) ==
+              *(subscription));
+  EXPECT_TRUE(patch_object._remove_subscriptions.empty());
+  EXPECT_FALSE(patch_object.get_associated_uris());
+  EXPECT_TRUE(patch_object._increment_cseq);
+
+  delete subscription; subscription = NULL;
+}
+
 // Tests getting subscriptions from SM.
 TEST_F(SubscriberManagerTest, TestGetSubscriptions)
 {
@@ -1563,6 +1927,12 @@ TEST_F(SubscriberManagerTest, TestUpdateAssociatedURIs)
   AoR* patch_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
   patch_aor->_associated_uris.add_uri(OTHER_ID, false);
   PatchObject patch_object;
+
+  // Cached registration data for the old and new associated URIs is
+  // invalidated.
+  EXPECT_CALL(*_hss_connection, invalidate_cached_registration_data(DEFAULT_ID))
+    .Times(2);
+  EXPECT_CALL(*_hss_connection, invalidate_cached_registration_data(OTHER_ID));
   EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
     .WillOnce(DoAll(SetArgPointee<1>(get_aor),
                     Return(HTTP_OK)));
@@ -1594,6 +1964,55 @@ TEST_F(SubscriberManagerTest, TestUpdateAssociatedURIs)
   EXPECT_TRUE(((AssociatedURIs)(patch_object.get_associated_uris().get())) == associated_uris);
 }
 
+// Test that a pushed service profile updates the cached registration data and
+// the associated URIs.
+TEST_F(SubscriberManagerTest, TestUpdateServiceProfile)
+{
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  AoR* patch_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+  patch_aor->_associated_uris.add_uri(OTHER_ID, false);
+
+  PushedProfile profile;
+  profile.associated_uris.add_uri(DEFAULT_ID, false);
+  profile.associated_uris.add_uri(OTHER_ID, false);
+
+  EXPECT_CALL(*_hss_connection, update_cached_service_profiles(DEFAULT_ID, _, _));
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_patch(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<2>(patch_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_notify_sender, send_notifys(DEFAULT_ID, _, _, _, _, _));
+
+  HTTPCode rc = _subscriber_manager->update_service_profile(DEFAULT_ID,
+                                                            profile,
+                                                            DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+}
+
+// Test that a pushed service profile that doesn't change the associated URIs
+// doesn't rewrite the AoR or send NOTIFYs.
+TEST_F(SubscriberManagerTest, TestUpdateServiceProfileURIsUnchanged)
+{
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID, true);
+
+  PushedProfile profile;
+  profile.associated_uris = get_aor->_associated_uris;
+
+  EXPECT_CALL(*_hss_connection, update_cached_service_profiles(DEFAULT_ID, _, _));
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_patch(_, _, _, _)).Times(0);
+  EXPECT_CALL(*_notify_sender, send_notifys(_, _, _, _, _, _)).Times(0);
+
+  HTTPCode rc = _subscriber_manager->update_service_profile(DEFAULT_ID,
+                                                            profile,
+                                                            DUMMY_TRAIL_ID);
+  EXPECT_EQ(rc, HTTP_OK);
+}
+
 // Test that updating the associated URIs fails if the S4 lookup fails.
 TEST_F(SubscriberManagerTest, TestUpdateAssociatedURIsS4LookupFail)
 {
@@ -1746,6 +2165,24 @@ TEST_F(SubscriberManagerTest, TestHandleTimerPopNoExpire)
   _subscriber_manager->handle_timer_pop(DEFAULT_ID, DUMMY_TRAIL_ID);
 }
 
+// Test that a batch of timer pops handles each AoR once, even if it appears
+// more than once in the batch.
+TEST_F(SubscriberManagerTest, TestHandleTimerPopsBatch)
+{
+  std::string other_id = "sip:6505550002@homedomain";
+  AoR* get_aor = AoRTestUtils::create_simple_aor(DEFAULT_ID);
+  AoR* other_get_aor = AoRTestUtils::create_simple_aor(other_id);
+  EXPECT_CALL(*_s4, handle_get(DEFAULT_ID, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(get_aor),
+                    Return(HTTP_OK)));
+  EXPECT_CALL(*_s4, handle_get(other_id, _, _, _))
+    .WillOnce(DoAll(SetArgPointee<1>(other_get_aor),
+                    Return(HTTP_OK)));
+
+  std::vector<std::string> aor_ids = {DEFAULT_ID, other_id, DEFAULT_ID};
+  _subscriber_manager->handle_timer_pops(aor_ids, DUMMY_TRAIL_ID);
+}
+
 // Test that SM registers with an application server when called. SM doesn't
 // touch most of the variables passed to it so don't bother checking them or
 // creating realistic e.g. SIP messages.
@@ -20,6 +20,7 @@
 #include "stack.h"
 
 #include "thread_dispatcher.h"
+#include "stage_latency.h"
 
 using ::testing::Return;
 using ::testing::StrictMock;
@@ -141,6 +142,24 @@ TEST_F(ThreadDispatcherTest, StandardInviteTest)
   test_load_monitor_checks_on_requests(msg, false);
 }
 
+// The time requests spend queued should be recorded against their method and
+// priority.
+TEST_F(ThreadDispatcherTest, QueueDelayByMethodTest)
+{
+  StageHistogram* invite_stage = StageLatency::stage("dispatcher_queue:INVITE:0");
+  StageHistogram* register_stage = StageLatency::stage("dispatcher_queue:REGISTER:0");
+  uint64_t invites = invite_stage->summary().count;
+  uint64_t registers = register_stage->summary().count;
+
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+
+  test_load_monitor_checks_on_requests(msg, false);
+
+  EXPECT_EQ(invites + 1, invite_stage->summary().count);
+  EXPECT_EQ(registers, register_stage->summary().count);
+}
+
 TEST_F(ThreadDispatcherTest, SlowInviteTest)
 {
   TestingCommon::Message msg;
@@ -191,6 +210,38 @@ TEST_F(ThreadDispatcherTest, RejectOldInviteTest)
   process_queue_element();
 }
 
+// When the queue is deep, requests that have already been queued for longer
+// than the request_on_queue_timeout should be swept off it and rejected with
+// a 503 as soon as the next message arrives.
+TEST_F(ThreadDispatcherTest, SweepOldInvitesTest)
+{
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, admit_request(_, _))
+    .Times(EXPIRY_SWEEP_QUEUE_DEPTH)
+    .WillRepeatedly(Return(true));
+
+  for (int ii = 0; ii < EXPIRY_SWEEP_QUEUE_DEPTH - 1; ++ii)
+  {
+    inject_msg_thread(msg.get_request());
+  }
+
+  cwtest_advance_time_ms(REQUEST_ON_QUEUE_TIMEOUT_MS + 5);
+
+  // Pushing the next message sweeps the old ones without any worker
+  // dequeuing them.
+  EXPECT_CALL(*mod_mock, on_tx_response(ResultOf(get_tx_status_code, 503)))
+    .Times(EXPIRY_SWEEP_QUEUE_DEPTH - 1);
+  inject_msg_thread(msg.get_request());
+
+  // Only the new message is left for the worker.
+  EXPECT_CALL(*mod_mock, on_rx_request(_)).WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillOnce(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _));
+  process_queue_element();
+}
+
 // On recieving an OPTIONS message, the thread dispatcher should not call into
 // the load monitor - it should process the request regardless of load.
 TEST_F(ThreadDispatcherTest, NeverRejectOptionsTest)
@@ -389,7 +440,12 @@ TEST_F(ThreadDispatcherTest, CallbackTest)
   EXPECT_CALL(*cb, run());
   EXPECT_CALL(*cb, destruct());
 
+  StageHistogram* callback_stage = StageLatency::stage("dispatcher_queue:callback:0");
+  uint64_t callbacks = callback_stage->summary().count;
+
   process_queue_element();
+
+  EXPECT_EQ(callbacks + 1, callback_stage->summary().count);
 }
 
 // OPTIONS messages should be prioritised over other message types.
@@ -641,3 +697,168 @@ TEST_F(SipEventQueueTest, QueuePriorityAndTimeOrdering)
   q->pop(e);
   EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
 }
+
+class MultiQueueEventQueueTest : public SipEventQueueTest
+{
+public:
+  MultiQueueEventQueueTest()
+  {
+    delete q;
+    q_backend = new MultiQueueEventQueueBackend();
+    q = new eventq<struct SipEvent>(0, true, q_backend);
+
+    msg_1.type = PJSIP_REQUEST_MSG;
+    rdata_1.msg_info.msg = &msg_1;
+    msg_2.type = PJSIP_REQUEST_MSG;
+    rdata_2.msg_info.msg = &msg_2;
+  }
+
+  MultiQueueEventQueueBackend* q_backend;
+  pjsip_msg msg_1;
+  pjsip_msg msg_2;
+};
+
+// Test that higher priority SipEvents are returned before lower priority ones.
+TEST_F(MultiQueueEventQueueTest, QueuePriorityOrdering)
+{
+  // Raise the priority of e2
+  e2.priority = SIPEventPriorityLevel::HIGH_PRIORITY_10;
+
+  q->push(e1);
+  q->push(e2);
+
+  SipEvent e;
+
+  // e2 is higher priority, so should be returned first
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+}
+
+// Test that SipEvents at the same priority level are returned in the order in
+// which they were queued.
+TEST_F(MultiQueueEventQueueTest, QueueFifoOrdering)
+{
+  q->push(e1);
+  q->push(e2);
+  q->push(e1);
+
+  SipEvent e;
+
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+}
+
+// Test that the queue drains every level in strict priority order, including
+// when higher priority events arrive after lower priority levels have been
+// partially drained.
+TEST_F(MultiQueueEventQueueTest, QueueStrictPriorityDraining)
+{
+  SipEvent e3 = e1;
+  e3.priority = SIPEventPriorityLevel::HIGH_PRIORITY_15;
+  e2.priority = SIPEventPriorityLevel::HIGH_PRIORITY_1;
+
+  q->push(e1);
+  q->push(e2);
+  q->push(e1);
+  EXPECT_EQ(3, q->size());
+
+  SipEvent e;
+
+  q->pop(e);
+  EXPECT_EQ(SIPEventPriorityLevel::HIGH_PRIORITY_1, e.priority);
+
+  q->push(e3);
+
+  q->pop(e);
+  EXPECT_EQ(SIPEventPriorityLevel::HIGH_PRIORITY_15, e.priority);
+  q->pop(e);
+  EXPECT_EQ(SIPEventPriorityLevel::NORMAL_PRIORITY, e.priority);
+  q->pop(e);
+  EXPECT_EQ(SIPEventPriorityLevel::NORMAL_PRIORITY, e.priority);
+
+  EXPECT_EQ(0, q->size());
+}
+
+// Test that only expired requests at normal priority are removed from the
+// queue, and that callbacks, responses and high priority requests are kept in
+// order.
+TEST_F(MultiQueueEventQueueTest, RemoveExpired)
+{
+  SipEvent callback;
+  callback.type = CALLBACK;
+  callback.event_data.callback = NULL;
+
+  SipEvent response = e2;
+  msg_2.type = PJSIP_RESPONSE_MSG;
+
+  SipEvent high = e1;
+  high.priority = SIPEventPriorityLevel::HIGH_PRIORITY_1;
+
+  e1.stop_watch.start();
+  callback.stop_watch.start();
+  response.stop_watch.start();
+  high.stop_watch.start();
+  SipEvent old_request = e1;
+  cwtest_advance_time_ms(20);
+  e1.stop_watch.start();
+
+  q->push(old_request);
+  q->push(callback);
+  q->push(response);
+  q->push(high);
+  q->push(e1);
+  EXPECT_EQ(5, q->size());
+
+  std::vector<SipEvent> expired;
+  EXPECT_EQ(1, q_backend->remove_expired(10000, expired));
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ(&rdata_1, expired[0].event_data.rdata);
+  EXPECT_EQ(4, q->size());
+
+  SipEvent e;
+  q->pop(e);
+  EXPECT_EQ(SIPEventPriorityLevel::HIGH_PRIORITY_1, e.priority);
+  q->pop(e);
+  EXPECT_EQ(CALLBACK, e.type);
+  q->pop(e);
+  EXPECT_EQ(&rdata_2, e.event_data.rdata);
+  q->pop(e);
+  EXPECT_EQ(&rdata_1, e.event_data.rdata);
+  EXPECT_EQ(0, q->size());
+}
+
+// Test that pushes sweep expired requests once the queue is deep enough, and
+// hold them until they are taken.
+TEST_F(MultiQueueEventQueueTest, SweepOnPush)
+{
+  q_backend->set_expiry_sweep(3, 10000);
+
+  e1.stop_watch.start();
+  q->push(e1);
+  q->push(e1);
+  cwtest_advance_time_ms(20);
+  e2.stop_watch.start();
+
+  std::vector<SipEvent> expired;
+  q_backend->take_expired(expired);
+  EXPECT_TRUE(expired.empty());
+
+  q->push(e2);
+  EXPECT_EQ(1, q->size());
+
+  q_backend->take_expired(expired);
+  EXPECT_EQ(2u, expired.size());
+  q_backend->take_expired(expired);
+  EXPECT_EQ(2u, expired.size());
+
+  SipEvent e;
+  q->pop(e);
+  EXPECT_EQ(&rdata_2, e.event_data.rdata);
+}
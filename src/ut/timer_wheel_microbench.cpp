@@ -0,0 +1,78 @@
+/**
+ * @file timer_wheel_microbench.cpp Microbenchmarks for TimerWheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+#include <vector>
+
+#include "microbench.hpp"
+#include "timer_wheel.h"
+
+static void null_cb(TimerWheel::Entry* entry)
+{
+}
+
+// The number of timers running at once, and the range of their durations.
+static const int RUNNING = 10000;
+static const uint64_t MAX_DURATION_MS = 32000;
+
+// Each iteration cancels a running timer and reschedules it, as transactions
+// do as they progress.
+static void BM_Timers_multimap(MicroBench::State& state)
+{
+  typedef std::multimap<uint64_t, TimerWheel::Entry*> TimerMap;
+  std::vector<TimerWheel::Entry> entries(RUNNING);
+  std::vector<TimerMap::iterator> its(RUNNING);
+  TimerMap map;
+
+  for (int ii = 0; ii < RUNNING; ++ii)
+  {
+    TimerWheel::init_entry(&entries[ii], &null_cb, NULL);
+    its[ii] = map.insert(std::make_pair((ii * 7919) % MAX_DURATION_MS, &entries[ii]));
+  }
+
+  uint64_t ii = 0;
+  while (state.keep_running())
+  {
+    int index = (ii * 31) % RUNNING;
+    uint64_t duration = (ii * 7919) % MAX_DURATION_MS;
+    ++ii;
+
+    map.erase(its[index]);
+    its[index] = map.insert(std::make_pair(duration, &entries[index]));
+  }
+}
+MICROBENCH(BM_Timers_multimap);
+
+static void BM_Timers_wheel(MicroBench::State& state)
+{
+  std::vector<TimerWheel::Entry> entries(RUNNING);
+  TimerWheel wheel(0);
+
+  for (int ii = 0; ii < RUNNING; ++ii)
+  {
+    TimerWheel::init_entry(&entries[ii], &null_cb, NULL);
+    wheel.schedule(&entries[ii], 0, (ii * 7919) % MAX_DURATION_MS);
+  }
+
+  uint64_t ii = 0;
+  while (state.keep_running())
+  {
+    int index = (ii * 31) % RUNNING;
+    uint64_t duration = (ii * 7919) % MAX_DURATION_MS;
+    ++ii;
+
+    wheel.cancel(&entries[index]);
+    wheel.schedule(&entries[index], 0, duration);
+  }
+
+  MicroBench::do_not_optimize(wheel.size());
+}
+MICROBENCH(BM_Timers_wheel);
@@ -0,0 +1,168 @@
+/**
+ * @file timer_wheel_test.cpp UT for TimerWheel.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "timer_wheel.h"
+
+static void null_cb(TimerWheel::Entry* entry)
+{
+}
+
+// Test that timers pop at the right time.
+TEST(TimerWheelTest, Pop)
+{
+  TimerWheel wheel(1000);
+  TimerWheel::Entry entries[3];
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    TimerWheel::init_entry(&entries[ii], &null_cb, NULL);
+  }
+
+  wheel.schedule(&entries[0], 1000, 10);
+  wheel.schedule(&entries[1], 1000, 100);
+  wheel.schedule(&entries[2], 1000, 0);
+  EXPECT_EQ(3u, wheel.size());
+  EXPECT_EQ(1001u, wheel.next_event_ms());
+
+  // A timer with no duration pops on the next millisecond.
+  std::vector<TimerWheel::Entry*> expired;
+  wheel.advance(1000, expired);
+  EXPECT_TRUE(expired.empty());
+  wheel.advance(1001, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ(&entries[2], expired[0]);
+  EXPECT_FALSE(TimerWheel::is_scheduled(&entries[2]));
+
+  expired.clear();
+  wheel.advance(1009, expired);
+  EXPECT_TRUE(expired.empty());
+  wheel.advance(1050, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ(&entries[0], expired[0]);
+
+  expired.clear();
+  wheel.advance(1100, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ(&entries[1], expired[0]);
+  EXPECT_EQ(0u, wheel.size());
+  EXPECT_EQ(UINT64_MAX, wheel.next_event_ms());
+}
+
+// Test cancelling timers.
+TEST(TimerWheelTest, Cancel)
+{
+  TimerWheel wheel(0);
+  TimerWheel::Entry entries[2];
+  TimerWheel::init_entry(&entries[0], &null_cb, NULL);
+  TimerWheel::init_entry(&entries[1], &null_cb, NULL);
+
+  wheel.schedule(&entries[0], 0, 5000);
+  wheel.schedule(&entries[1], 0, 5000);
+  EXPECT_TRUE(wheel.cancel(&entries[0]));
+  EXPECT_FALSE(wheel.cancel(&entries[0]));
+  EXPECT_EQ(1u, wheel.size());
+
+  std::vector<TimerWheel::Entry*> expired;
+  wheel.advance(10000, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ(&entries[1], expired[0]);
+  EXPECT_FALSE(wheel.cancel(&entries[1]));
+}
+
+// Test a timer further away than the wheel covers.
+TEST(TimerWheelTest, LongTimer)
+{
+  TimerWheel wheel(12345);
+  TimerWheel::Entry entry;
+  TimerWheel::init_entry(&entry, &null_cb, NULL);
+
+  const uint64_t DURATION = 24 * 3600 * 1000ull;
+  wheel.schedule(&entry, 12345, DURATION);
+
+  std::vector<TimerWheel::Entry*> expired;
+  for (uint64_t now = 12345; now < 12345 + DURATION; now += 60000)
+  {
+    wheel.advance(now, expired);
+    EXPECT_TRUE(expired.empty());
+    EXPECT_GT(wheel.next_event_ms(), now);
+  }
+
+  wheel.advance(12345 + DURATION - 1, expired);
+  EXPECT_TRUE(expired.empty());
+  wheel.advance(12345 + DURATION, expired);
+  EXPECT_EQ(1u, expired.size());
+}
+
+// Test many random timers against a simple model, checking each pops in the
+// first advance that reaches its expiry time.
+TEST(TimerWheelTest, Random)
+{
+  const int NUM_TIMERS = 2000;
+  srand(1);
+
+  uint64_t now = 1000000;
+  TimerWheel wheel(now);
+  std::vector<TimerWheel::Entry> entries(NUM_TIMERS);
+  std::vector<uint64_t> expiries(NUM_TIMERS, 0);
+
+  for (int ii = 0; ii < NUM_TIMERS; ++ii)
+  {
+    TimerWheel::init_entry(&entries[ii], &null_cb, (void*)(intptr_t)ii);
+  }
+
+  for (int round = 0; round < 20000; ++round)
+  {
+    int ii = rand() % NUM_TIMERS;
+
+    if (TimerWheel::is_scheduled(&entries[ii]))
+    {
+      if (rand() % 4 == 0)
+      {
+        EXPECT_TRUE(wheel.cancel(&entries[ii]));
+      }
+    }
+    else
+    {
+      // Mostly short timers, with some of hours.
+      uint64_t duration = (rand() % 10 == 0) ?
+                            ((uint64_t)rand() % 20000000) :
+                            ((uint64_t)rand() % 5000);
+      wheel.schedule(&entries[ii], now, duration);
+      expiries[ii] = std::max(now + duration, now + 1);
+    }
+
+    uint64_t new_now = now + rand() % 50;
+    std::vector<TimerWheel::Entry*> expired;
+    wheel.advance(new_now, expired);
+
+    for (TimerWheel::Entry* entry : expired)
+    {
+      int index = (int)(intptr_t)entry->user_data;
+      EXPECT_GT(expiries[index], now);
+      EXPECT_LE(expiries[index], new_now);
+    }
+
+    now = new_now;
+
+    for (int jj = 0; jj < NUM_TIMERS; ++jj)
+    {
+      if (TimerWheel::is_scheduled(&entries[jj]))
+      {
+        EXPECT_GT(expiries[jj], now);
+        EXPECT_LE(wheel.next_event_ms(), expiries[jj]);
+      }
+    }
+  }
+}
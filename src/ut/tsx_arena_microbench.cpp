@@ -0,0 +1,98 @@
+/**
+ * @file tsx_arena_microbench.cpp Microbenchmarks for TsxArena.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <thread>
+#include <vector>
+
+#include "microbench.hpp"
+#include "tsx_arena.h"
+
+// Roughly the size of the objects the Sproutlet proxy creates for a
+// transaction.
+class ArenaObject : public TsxArenaAllocated
+{
+public:
+  virtual ~ArenaObject() {}
+
+  char _data[100];
+};
+
+static const int OBJECTS_PER_TSX = 6;
+
+// Each iteration creates and deletes a transaction's worth of objects, with
+// the iterations spread across the threads so that the threads contend for
+// the heap.
+static void run_tsxs(MicroBench::State& state, bool use_arena, int num_threads)
+{
+  uint64_t per_thread = state.iterations() / num_threads + 1;
+  std::vector<std::thread> threads;
+
+  // Start the timer, and then run the iterations spread across the threads.
+  state.keep_running();
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    threads.push_back(std::thread([use_arena, per_thread]()
+    {
+      for (uint64_t jj = 0; jj < per_thread; ++jj)
+      {
+        TsxArena* arena = use_arena ? new TsxArena() : NULL;
+        ArenaObject* objs[OBJECTS_PER_TSX];
+
+        {
+          TsxArena::Scope scope(arena);
+          for (int kk = 0; kk < OBJECTS_PER_TSX; ++kk)
+          {
+            objs[kk] = new ArenaObject();
+          }
+        }
+
+        MicroBench::do_not_optimize(objs);
+
+        for (int kk = 0; kk < OBJECTS_PER_TSX; ++kk)
+        {
+          delete objs[kk];
+        }
+
+        if (arena != NULL)
+        {
+          arena->release();
+        }
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  while (state.keep_running())
+  {
+  }
+}
+
+#define ARENA_BENCHMARKS(THREADS)                                            \
+  static void BM_TsxAlloc_heap_##THREADS##_threads(MicroBench::State& state) \
+  {                                                                          \
+    run_tsxs(state, false, THREADS);                                         \
+  }                                                                          \
+  MICROBENCH(BM_TsxAlloc_heap_##THREADS##_threads);                          \
+                                                                             \
+  static void BM_TsxAlloc_arena_##THREADS##_threads(MicroBench::State& state) \
+  {                                                                          \
+    run_tsxs(state, true, THREADS);                                          \
+  }                                                                          \
+  MICROBENCH(BM_TsxAlloc_arena_##THREADS##_threads);
+
+ARENA_BENCHMARKS(1)
+ARENA_BENCHMARKS(16)
+ARENA_BENCHMARKS(64)
@@ -0,0 +1,116 @@
+/**
+ * @file tsx_arena_test.cpp UT for TsxArena.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "tsx_arena.h"
+
+// Counts live instances, so the tests can check destructors are run.
+class ArenaObject : public TsxArenaAllocated
+{
+public:
+  ArenaObject() { ++_instances; }
+  virtual ~ArenaObject() { --_instances; }
+
+  static int _instances;
+  char _data[100];
+};
+
+int ArenaObject::_instances = 0;
+
+class LargeArenaObject : public ArenaObject
+{
+public:
+  char _more_data[TsxArena::BLOCK_SIZE];
+};
+
+// Test that objects created in an arena's scope are allocated from it, and
+// objects created outside it from the heap.
+TEST(TsxArenaTest, Scope)
+{
+  TsxArena* arena = new TsxArena();
+  EXPECT_TRUE(TsxArena::current() == NULL);
+
+  ArenaObject* heap_obj = new ArenaObject();
+  EXPECT_EQ(0u, arena->bytes_allocated());
+
+  ArenaObject* arena_obj;
+  {
+    TsxArena::Scope scope(arena);
+    EXPECT_EQ(arena, TsxArena::current());
+    arena_obj = new ArenaObject();
+  }
+
+  EXPECT_TRUE(TsxArena::current() == NULL);
+  EXPECT_GT(arena->bytes_allocated(), sizeof(ArenaObject));
+  EXPECT_EQ(0u, (uintptr_t)arena_obj % TsxArena::ALIGNMENT);
+  EXPECT_EQ(2, ArenaObject::_instances);
+
+  delete heap_obj;
+  delete arena_obj;
+  EXPECT_EQ(0, ArenaObject::_instances);
+  arena->release();
+}
+
+// Test that scopes nest.
+TEST(TsxArenaTest, NestedScope)
+{
+  TsxArena* arena1 = new TsxArena();
+  TsxArena* arena2 = new TsxArena();
+
+  {
+    TsxArena::Scope scope1(arena1);
+    {
+      TsxArena::Scope scope2(arena2);
+      EXPECT_EQ(arena2, TsxArena::current());
+    }
+    EXPECT_EQ(arena1, TsxArena::current());
+  }
+  EXPECT_TRUE(TsxArena::current() == NULL);
+
+  arena1->release();
+  arena2->release();
+}
+
+// Test that many objects, including ones too big to share a block, can be
+// allocated, and that objects can outlive the owner's reference to the
+// arena and be freed on another thread.
+TEST(TsxArenaTest, OutliveOwner)
+{
+  TsxArena* arena = new TsxArena();
+  std::vector<ArenaObject*> objs;
+
+  {
+    TsxArena::Scope scope(arena);
+    for (int ii = 0; ii < 100; ++ii)
+    {
+      objs.push_back(new ArenaObject());
+    }
+    objs.push_back(new LargeArenaObject());
+  }
+
+  EXPECT_EQ(101, ArenaObject::_instances);
+  arena->release();
+
+  std::thread thread([&objs]()
+  {
+    for (ArenaObject* obj : objs)
+    {
+      delete obj;
+    }
+  });
+  thread.join();
+
+  EXPECT_EQ(0, ArenaObject::_instances);
+}
@@ -0,0 +1,135 @@
+/**
+ * @file tsx_index_microbench.cpp Microbenchmarks for the transaction index.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "microbench.hpp"
+#include "tsx_index.h"
+
+// A model of PJSIP's transaction layer - one table behind one lock - for
+// comparison.
+class GlobalTsxTable
+{
+public:
+  void add(pjsip_transaction* tsx)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _tsxs[std::string(tsx->transaction_key.ptr, tsx->transaction_key.slen)] = tsx;
+  }
+
+  void remove(pjsip_transaction* tsx)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _tsxs.erase(std::string(tsx->transaction_key.ptr, tsx->transaction_key.slen));
+  }
+
+  pjsip_transaction* find(const pj_str_t* key, bool lock)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    std::unordered_map<std::string, pjsip_transaction*>::const_iterator it =
+                                       _tsxs.find(std::string(key->ptr, key->slen));
+    return (it != _tsxs.end()) ? it->second : NULL;
+  }
+
+private:
+  std::mutex _lock;
+  std::unordered_map<std::string, pjsip_transaction*> _tsxs;
+};
+
+struct TsxIndexTable
+{
+  void add(pjsip_transaction* tsx) { TsxIndex::add(tsx); }
+  void remove(pjsip_transaction* tsx) { TsxIndex::remove(tsx); }
+  pjsip_transaction* find(const pj_str_t* key, bool lock) { return TsxIndex::find(key, lock); }
+};
+
+// The transactions each thread works through.  Each iteration creates a
+// transaction, looks it up three times (as for a request retransmission, a
+// response and an ACK), and destroys it.
+static const int TSXS_PER_THREAD = 256;
+
+template <class Table>
+static void run_tsxs(MicroBench::State& state, Table& table, int num_threads)
+{
+  std::vector<std::vector<pjsip_transaction> > tsxs(num_threads);
+  std::vector<std::vector<std::string> > keys(num_threads);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    tsxs[ii].resize(TSXS_PER_THREAD);
+    keys[ii].resize(TSXS_PER_THREAD);
+
+    for (int jj = 0; jj < TSXS_PER_THREAD; ++jj)
+    {
+      keys[ii][jj] = "s$INVITE$z9hG4bKPj" + std::to_string(ii) + "." + std::to_string(jj);
+      memset(&tsxs[ii][jj], 0, sizeof(pjsip_transaction));
+      tsxs[ii][jj].transaction_key = pj_str((char*)keys[ii][jj].c_str());
+    }
+  }
+
+  uint64_t per_thread = state.iterations() / num_threads + 1;
+  std::vector<std::thread> threads;
+
+  // Start the timer, and then run the iterations spread across the threads.
+  state.keep_running();
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    threads.push_back(std::thread([&table, &tsxs, ii, per_thread]()
+    {
+      for (uint64_t jj = 0; jj < per_thread; ++jj)
+      {
+        pjsip_transaction* tsx = &tsxs[ii][jj % TSXS_PER_THREAD];
+        table.add(tsx);
+
+        for (int kk = 0; kk < 3; ++kk)
+        {
+          MicroBench::do_not_optimize(table.find(&tsx->transaction_key, false));
+        }
+
+        table.remove(tsx);
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  while (state.keep_running())
+  {
+  }
+}
+
+#define TSX_BENCHMARKS(THREADS)                                              \
+  static void BM_TsxTable_global_lock_##THREADS##_threads(MicroBench::State& state) \
+  {                                                                          \
+    GlobalTsxTable table;                                                    \
+    run_tsxs(state, table, THREADS);                                         \
+  }                                                                          \
+  MICROBENCH(BM_TsxTable_global_lock_##THREADS##_threads);                   \
+                                                                             \
+  static void BM_TsxTable_index_##THREADS##_threads(MicroBench::State& state) \
+  {                                                                          \
+    TsxIndexTable table;                                                     \
+    run_tsxs(state, table, THREADS);                                         \
+  }                                                                          \
+  MICROBENCH(BM_TsxTable_index_##THREADS##_threads);
+
+TSX_BENCHMARKS(1)
+TSX_BENCHMARKS(4)
+TSX_BENCHMARKS(16)
@@ -0,0 +1,169 @@
+/**
+ * @file tsx_index_test.cpp UT for TsxIndex.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "stack.h"
+#include "tsx_index.h"
+
+class TsxIndexTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  TsxIndexTest() : SipTest(NULL)
+  {
+  }
+
+  // Sets up a transaction with just the fields the index uses.
+  static void init_tsx(pjsip_transaction* tsx,
+                       const std::string& key,
+                       pj_grp_lock_t* lock = NULL)
+  {
+    memset(tsx, 0, sizeof(*tsx));
+    pj_strdup2(stack_data.pool, &tsx->transaction_key, key.c_str());
+    tsx->grp_lock = lock;
+  }
+};
+
+// Test that transactions are found by their key, whatever its case, until
+// they're removed.
+TEST_F(TsxIndexTest, AddFindRemove)
+{
+  pjsip_transaction tsx1;
+  pjsip_transaction tsx2;
+  init_tsx(&tsx1, "s$INVITE$z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo");
+  init_tsx(&tsx2, "c$INVITE$z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo");
+  size_t size = TsxIndex::size();
+
+  TsxIndex::add(&tsx1);
+  TsxIndex::add(&tsx2);
+  TsxIndex::add(&tsx2);
+  EXPECT_EQ(size + 2, TsxIndex::size());
+
+  pj_str_t key = pj_str((char*)"S$INVITE$Z9HG4BKPJPTKQXHKZNVVKI2LUEWOZVFJFAQO");
+  EXPECT_EQ(&tsx1, TsxIndex::find(&key, false));
+  key = pj_str((char*)"c$INVITE$z9hG4bKPjPtKqxhkZnvVKI2LUEWoZVFjFaqo");
+  EXPECT_EQ(&tsx2, TsxIndex::find(&key, false));
+
+  TsxIndex::remove(&tsx2);
+  EXPECT_EQ(NULL, TsxIndex::find(&key, false));
+  TsxIndex::remove(&tsx2);
+  TsxIndex::remove(&tsx1);
+  EXPECT_EQ(size, TsxIndex::size());
+}
+
+// Test that removing a transaction doesn't remove another with the same key.
+TEST_F(TsxIndexTest, RemoveOther)
+{
+  pjsip_transaction tsx1;
+  pjsip_transaction tsx2;
+  init_tsx(&tsx1, "s$BYE$z9hG4bK1234");
+  init_tsx(&tsx2, "s$BYE$z9hG4bK1234");
+
+  TsxIndex::add(&tsx1);
+  TsxIndex::remove(&tsx2);
+
+  pj_str_t key = pj_str((char*)"s$BYE$z9hG4bK1234");
+  EXPECT_EQ(&tsx1, TsxIndex::find(&key, false));
+  TsxIndex::remove(&tsx1);
+}
+
+// Test that finding a transaction with the lock flag returns it locked.
+TEST_F(TsxIndexTest, FindLocked)
+{
+  pj_grp_lock_t* lock;
+  pj_grp_lock_create(stack_data.pool, NULL, &lock);
+  pj_grp_lock_add_ref(lock);
+
+  pjsip_transaction tsx;
+  init_tsx(&tsx, "s$INVITE$z9hG4bK5678", lock);
+  TsxIndex::add(&tsx);
+
+  pj_str_t key = pj_str((char*)"s$INVITE$z9hG4bK5678");
+  EXPECT_EQ(&tsx, TsxIndex::find(&key, true));
+  EXPECT_EQ(1, pj_grp_lock_get_ref(lock));
+  pj_grp_lock_release(lock);
+
+  TsxIndex::remove(&tsx);
+  pj_grp_lock_dec_ref(lock);
+}
+
+// Test that transactions which aren't in the index are looked up in PJSIP's
+// transaction layer.
+TEST_F(TsxIndexTest, NotIndexed)
+{
+  pj_str_t key = pj_str((char*)"s$INVITE$z9hG4bKnotthere");
+  EXPECT_EQ(NULL, TsxIndex::find(&key, false));
+  EXPECT_EQ(NULL, TsxIndex::find(&key, true));
+}
+
+// Test that transactions can be added, found and removed from several
+// threads at once.
+TEST_F(TsxIndexTest, Threads)
+{
+  const int NUM_THREADS = 4;
+  const int NUM_TSXS = 1000;
+  std::vector<pjsip_transaction> tsxs(NUM_THREADS * NUM_TSXS);
+
+  for (size_t ii = 0; ii < tsxs.size(); ++ii)
+  {
+    init_tsx(&tsxs[ii], "s$INVITE$z9hG4bK" + std::to_string(ii));
+  }
+
+  size_t size = TsxIndex::size();
+  std::vector<std::thread> threads;
+  bool all_found[NUM_THREADS];
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([&tsxs, &all_found, ii]()
+    {
+      all_found[ii] = true;
+
+      for (int jj = ii * NUM_TSXS; jj < (ii + 1) * NUM_TSXS; ++jj)
+      {
+        TsxIndex::add(&tsxs[jj]);
+        all_found[ii] &= (TsxIndex::find(&tsxs[jj].transaction_key, false) == &tsxs[jj]);
+      }
+
+      for (int jj = ii * NUM_TSXS; jj < (ii + 1) * NUM_TSXS; ++jj)
+      {
+        TsxIndex::remove(&tsxs[jj]);
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    EXPECT_TRUE(all_found[ii]);
+  }
+
+  EXPECT_EQ(size, TsxIndex::size());
+}
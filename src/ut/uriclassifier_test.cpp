@@ -42,6 +42,7 @@ public:
     stack_data.home_domains.insert("homedomain");
     stack_data.default_home_domain = pj_str("homedomain");
     URIClassifier::home_domains.push_back(&stack_data.default_home_domain);
+    URIClassifier::index_hosts();
   }
 
 
@@ -155,3 +156,13 @@ TEST_F(URIClassiferTest, NoUserSIPURI)
   EXPECT_EQ(URIClass::HOME_DOMAIN_SIP_URI,
             classify_uri_helper("sip:homedomain", false));
 }
+
+// Home domains are matched case-insensitively once they've been indexed.
+TEST_F(URIClassiferTest, IndexedHomeDomainIgnoresCase)
+{
+  URIClassifier::enforce_user_phone = false;
+  EXPECT_EQ(URIClass::HOME_DOMAIN_SIP_URI,
+            classify_uri_helper("sip:alice@HomeDomain", false));
+  EXPECT_EQ(URIClass::OFFNET_SIP_URI,
+            classify_uri_helper("sip:alice@homedomain.example", false));
+}
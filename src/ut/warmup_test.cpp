@@ -0,0 +1,147 @@
+/**
+ * @file warmup_test.cpp UT for Warmup.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fstream>
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "warmup.h"
+#include "mock_hss_connection.h"
+
+using ::testing::_;
+using ::testing::Return;
+
+// Test parsing host names and IP addresses, with and without ports.
+TEST(WarmupTest, ParseHost)
+{
+  Warmup::Target target;
+
+  EXPECT_TRUE(Warmup::parse_target("scscf.example.com", target));
+  EXPECT_EQ("scscf.example.com", target.host);
+  EXPECT_EQ(0, target.port);
+  EXPECT_EQ(-1, target.transport);
+
+  EXPECT_TRUE(Warmup::parse_target("10.0.0.1:5054", target));
+  EXPECT_EQ("10.0.0.1", target.host);
+  EXPECT_EQ(5054, target.port);
+
+  EXPECT_TRUE(Warmup::parse_target("[2001:db8::1]:5060", target));
+  EXPECT_EQ("2001:db8::1", target.host);
+  EXPECT_EQ(5060, target.port);
+
+  EXPECT_TRUE(Warmup::parse_target("[2001:db8::1]", target));
+  EXPECT_EQ("2001:db8::1", target.host);
+  EXPECT_EQ(0, target.port);
+}
+
+// Test parsing SIP URIs.
+TEST(WarmupTest, ParseUri)
+{
+  Warmup::Target target;
+
+  EXPECT_TRUE(Warmup::parse_target("sip:icscf.example.com:5052;transport=TCP", target));
+  EXPECT_EQ("icscf.example.com", target.host);
+  EXPECT_EQ(5052, target.port);
+  EXPECT_EQ(IPPROTO_TCP, target.transport);
+
+  EXPECT_TRUE(Warmup::parse_target("sip:bgcf@example.com;lr;transport=udp", target));
+  EXPECT_EQ("example.com", target.host);
+  EXPECT_EQ(0, target.port);
+  EXPECT_EQ(IPPROTO_UDP, target.transport);
+
+  EXPECT_TRUE(Warmup::parse_target("SIP:example.com;lr", target));
+  EXPECT_EQ("example.com", target.host);
+  EXPECT_EQ(-1, target.transport);
+}
+
+// Test that invalid targets are rejected.
+TEST(WarmupTest, ParseInvalid)
+{
+  Warmup::Target target;
+
+  EXPECT_FALSE(Warmup::parse_target("", target));
+  EXPECT_FALSE(Warmup::parse_target("sip:", target));
+  EXPECT_FALSE(Warmup::parse_target(":5060", target));
+  EXPECT_FALSE(Warmup::parse_target("example.com:", target));
+  EXPECT_FALSE(Warmup::parse_target("example.com:50x", target));
+  EXPECT_FALSE(Warmup::parse_target("example.com:70000", target));
+  EXPECT_FALSE(Warmup::parse_target("[2001:db8::1", target));
+}
+
+// Test reading a file of IMPUs.
+TEST(WarmupTest, ReadImpus)
+{
+  char filename[] = "/tmp/warmup_test_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT_NE(-1, fd);
+  close(fd);
+
+  {
+    std::ofstream file(filename);
+    file << "# Hot IMPUs\n"
+         << "sip:6505550001@homedomain\n"
+         << "\n"
+         << "  tel:+16505550002 \r\n";
+  }
+
+  std::vector<std::string> impus;
+  EXPECT_TRUE(Warmup::read_impus(filename, impus));
+  unlink(filename);
+
+  ASSERT_EQ(2u, impus.size());
+  EXPECT_EQ("sip:6505550001@homedomain", impus[0]);
+  EXPECT_EQ("tel:+16505550002", impus[1]);
+
+  EXPECT_FALSE(Warmup::read_impus("/tmp/warmup_test_does_not_exist", impus));
+}
+
+// Test that the warmup fetches the registration data of each IMPU.
+TEST(WarmupTest, FetchImpus)
+{
+  MockHSSConnection hss;
+  Warmup warmup(NULL, &hss, AF_INET);
+
+  EXPECT_CALL(hss, get_registration_data("sip:6505550001@homedomain", _, _))
+    .WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(hss, get_registration_data("sip:6505550002@homedomain", _, _))
+    .WillOnce(Return(HTTP_NOT_FOUND));
+  EXPECT_CALL(hss, get_registration_data("sip:6505550003@homedomain", _, _))
+    .WillOnce(Return(HTTP_OK));
+
+  Warmup::Result result = warmup.run({"scscf.example.com"},
+                                     {"sip:6505550001@homedomain",
+                                      "sip:6505550002@homedomain",
+                                      "sip:6505550003@homedomain"},
+                                     1000);
+
+  EXPECT_TRUE(result.complete);
+  EXPECT_EQ(2, result.impus_fetched);
+  EXPECT_EQ(1, result.impus_failed);
+
+  // There's no resolver, so the targets are skipped.
+  EXPECT_EQ(0, result.targets_resolved);
+  EXPECT_EQ(0, result.targets_failed);
+}
+
+// Test that the warmup gives up when it runs out of time.
+TEST(WarmupTest, Timeout)
+{
+  MockHSSConnection hss;
+  Warmup warmup(NULL, &hss, AF_INET);
+
+  EXPECT_CALL(hss, get_registration_data(_, _, _)).Times(0);
+
+  Warmup::Result result = warmup.run({}, {"sip:6505550001@homedomain"}, 0);
+  EXPECT_FALSE(result.complete);
+}
@@ -0,0 +1,193 @@
+/**
+ * @file worker_affinity_queue_test.cpp UT for WorkerAffinityQueue.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+#include "test_interposer.hpp"
+
+#include "worker_affinity_queue.h"
+
+class WorkerAffinityQueueTest : public ::testing::Test
+{
+public:
+  WorkerAffinityQueueTest()
+  {
+    q = new WorkerAffinityQueue(3);
+
+    // The data pointers are only used to tell events apart.
+    e1.event_data.rdata = (pjsip_rx_data*)1;
+    e2.event_data.rdata = (pjsip_rx_data*)2;
+    e3.event_data.rdata = (pjsip_rx_data*)3;
+  }
+
+  virtual ~WorkerAffinityQueueTest()
+  {
+    delete q; q = NULL;
+  }
+
+  WorkerAffinityQueue* q;
+  SipEvent e1;
+  SipEvent e2;
+  SipEvent e3;
+};
+
+// Test that a worker processes the events on its own queue without stealing.
+TEST_F(WorkerAffinityQueueTest, PopFromOwnQueue)
+{
+  EXPECT_EQ(1, q->push(1, e1));
+  EXPECT_EQ(2, q->push(1, e2));
+  EXPECT_EQ(2, q->size(1));
+  EXPECT_EQ(0, q->size(0));
+  EXPECT_EQ(2, q->size());
+
+  SipEvent e;
+  bool stolen = true;
+
+  EXPECT_TRUE(q->pop(1, e, stolen));
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+  EXPECT_FALSE(stolen);
+
+  EXPECT_TRUE(q->pop(1, e, stolen));
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+  EXPECT_FALSE(stolen);
+
+  EXPECT_EQ(0, q->size());
+}
+
+// Test that a worker with an empty queue steals from the worker with the
+// deepest queue.
+TEST_F(WorkerAffinityQueueTest, StealFromDeepestQueue)
+{
+  q->push(0, e1);
+  q->push(2, e2);
+  q->push(2, e3);
+
+  SipEvent e;
+  bool stolen = false;
+
+  EXPECT_TRUE(q->pop(1, e, stolen));
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+  EXPECT_TRUE(stolen);
+  EXPECT_EQ(1, q->size(2));
+
+  // Worker 0 still processes its own queue first.
+  EXPECT_TRUE(q->pop(0, e, stolen));
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+  EXPECT_FALSE(stolen);
+}
+
+// Test that each worker's queue is still processed in priority order.
+TEST_F(WorkerAffinityQueueTest, PriorityOrderingPerWorker)
+{
+  e2.priority = SIPEventPriorityLevel::HIGH_PRIORITY_15;
+
+  q->push(0, e1);
+  q->push(0, e2);
+
+  SipEvent e;
+  bool stolen = false;
+
+  EXPECT_TRUE(q->pop(0, e, stolen));
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+  EXPECT_TRUE(q->pop(0, e, stolen));
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+}
+
+// Test that terminating the queue returns the remaining events, and that
+// subsequent pops fail.
+TEST_F(WorkerAffinityQueueTest, Terminate)
+{
+  q->push(0, e1);
+  q->push(2, e2);
+
+  std::vector<SipEvent> remaining;
+  q->terminate(remaining);
+  EXPECT_EQ(2u, remaining.size());
+  EXPECT_EQ(0, q->size());
+
+  SipEvent e;
+  bool stolen = false;
+  EXPECT_FALSE(q->pop(0, e, stolen));
+}
+
+// Test that deadlock detection is disabled by default, and that a queue with
+// nothing on it is never deadlocked.
+TEST_F(WorkerAffinityQueueTest, DeadlockDetection)
+{
+  q->push(0, e1);
+  EXPECT_FALSE(q->is_deadlocked());
+
+  SipEvent e;
+  bool stolen = false;
+  q->pop(0, e, stolen);
+
+  q->set_deadlock_threshold(1);
+  EXPECT_FALSE(q->is_deadlocked());
+}
+
+// Test that a timed pop returns an event if there is one, and times out if
+// there isn't.
+TEST_F(WorkerAffinityQueueTest, TimedPop)
+{
+  SipEvent e;
+  bool stolen = false;
+  bool timed_out = false;
+
+  EXPECT_FALSE(q->pop(0, e, stolen, 10, timed_out));
+  EXPECT_TRUE(timed_out);
+
+  q->push(0, e1);
+  EXPECT_TRUE(q->pop(0, e, stolen, 10, timed_out));
+  EXPECT_FALSE(timed_out);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+
+  EXPECT_FALSE(q->pop(0, e, stolen, 0, timed_out));
+  EXPECT_TRUE(timed_out);
+}
+
+// Test that pushes onto a deep worker queue sweep the requests on it that
+// have expired, and that other workers' queues are left alone.
+TEST_F(WorkerAffinityQueueTest, SweepOnPush)
+{
+  cwtest_completely_control_time();
+
+  pjsip_msg msg;
+  msg.type = PJSIP_REQUEST_MSG;
+  pjsip_rx_data rdata_1;
+  rdata_1.msg_info.msg = &msg;
+  pjsip_rx_data rdata_2;
+  rdata_2.msg_info.msg = &msg;
+  e1.event_data.rdata = &rdata_1;
+  e2.event_data.rdata = &rdata_2;
+
+  q->set_expiry_sweep(2, 10000);
+
+  e1.stop_watch.start();
+  q->push(0, e1);
+  q->push(1, e1);
+  cwtest_advance_time_ms(20);
+  e2.stop_watch.start();
+  EXPECT_EQ(1, q->push(0, e2));
+  EXPECT_EQ(2, q->size());
+
+  std::vector<SipEvent> expired;
+  q->take_expired(expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ(&rdata_1, expired[0].event_data.rdata);
+
+  SipEvent e;
+  bool stolen = false;
+  q->pop(0, e, stolen);
+  EXPECT_EQ(&rdata_2, e.event_data.rdata);
+  q->pop(1, e, stolen);
+  EXPECT_EQ(&rdata_1, e.event_data.rdata);
+
+  cwtest_reset_time();
+}
@@ -0,0 +1,74 @@
+/**
+ * @file worker_pool_sizer_test.cpp UT for WorkerPoolSizer.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "worker_pool_sizer.h"
+
+// Test that the pool grows when messages are queued and the workers are
+// blocked, up to the maximum.
+TEST(WorkerPoolSizerTest, GrowWhenBlocked)
+{
+  WorkerPoolSizer sizer(10, 20, 4);
+
+  EXPECT_EQ(12, sizer.target(10, 9, 50));
+  EXPECT_EQ(15, sizer.target(12, 10, 50));
+  EXPECT_EQ(18, sizer.target(15, 14, 50));
+  EXPECT_EQ(20, sizer.target(18, 17, 50));
+  EXPECT_EQ(20, sizer.target(20, 20, 50));
+}
+
+// Test that the pool doesn't grow if the CPUs are busy, or if there is
+// nothing queued.
+TEST(WorkerPoolSizerTest, NoGrowthWhenBusy)
+{
+  WorkerPoolSizer sizer(10, 20, 4);
+
+  // The workers are running, so more wouldn't help.
+  EXPECT_EQ(10, sizer.target(10, 2, 50));
+
+  // The workers are blocked, but keeping up.
+  EXPECT_EQ(10, sizer.target(10, 9, 2));
+}
+
+// Test that the pool only shrinks after being idle for a while, and never
+// below the minimum.
+TEST(WorkerPoolSizerTest, ShrinkWhenIdle)
+{
+  WorkerPoolSizer sizer(4, 40, 4);
+
+  for (int ii = 1; ii < WorkerPoolSizer::SHRINK_DELAY_SAMPLES; ++ii)
+  {
+    EXPECT_EQ(40, sizer.target(40, 0, 0));
+  }
+
+  EXPECT_EQ(35, sizer.target(40, 0, 0));
+  EXPECT_EQ(31, sizer.target(35, 0, 0));
+
+  // Any work resets the delay.
+  EXPECT_EQ(31, sizer.target(31, 0, 1));
+  EXPECT_EQ(31, sizer.target(31, 0, 0));
+
+  for (int ii = 0; ii < WorkerPoolSizer::SHRINK_DELAY_SAMPLES * 10; ++ii)
+  {
+    sizer.target(4, 0, 0);
+  }
+  EXPECT_EQ(4, sizer.target(4, 0, 0));
+  EXPECT_EQ(4, sizer.target(5, 0, 0));
+}
+
+// Test that a maximum below the minimum is treated as the minimum.
+TEST(WorkerPoolSizerTest, MaxBelowMin)
+{
+  WorkerPoolSizer sizer(10, 5, 4);
+  EXPECT_EQ(10, sizer.max_workers());
+  EXPECT_EQ(10, sizer.target(10, 10, 100));
+}
@@ -0,0 +1,111 @@
+/**
+ * @file worker_watchdog_test.cpp UT for WorkerWatchdog.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "test_interposer.hpp"
+#include "sproutlet_cpu.h"
+#include "worker_watchdog.h"
+
+class WorkerWatchdogTest : public ::testing::Test
+{
+public:
+  WorkerWatchdogTest()
+  {
+    WorkerWatchdog::register_thread("worker-test");
+  }
+
+  virtual ~WorkerWatchdogTest()
+  {
+    WorkerWatchdog::idle();
+    WorkerWatchdog::check(1000);
+    WorkerWatchdog::unregister_thread();
+    cwtest_reset_time();
+  }
+};
+
+// Test that a thread that is busy for too long is reported once, with what
+// it is doing.
+TEST_F(WorkerWatchdogTest, Stuck)
+{
+  uint64_t stalls = WorkerWatchdog::stalls();
+  WorkerWatchdog::busy();
+  EXPECT_EQ(NULL, WorkerWatchdog::set_activity("scscf"));
+  WorkerWatchdog::set_waiting("homestead");
+  EXPECT_TRUE(WorkerWatchdog::check(1000).empty());
+  EXPECT_EQ(0, WorkerWatchdog::stuck());
+
+  cwtest_advance_time_ms(1500);
+  std::vector<WorkerWatchdog::Stall> stuck = WorkerWatchdog::check(1000);
+  ASSERT_EQ(1u, stuck.size());
+  EXPECT_EQ("worker-test", stuck[0].thread);
+  EXPECT_LE(1500u, stuck[0].busy_ms);
+  EXPECT_EQ("scscf", stuck[0].activity);
+  EXPECT_EQ("homestead", stuck[0].waiting);
+  EXPECT_EQ(1, WorkerWatchdog::stuck());
+  EXPECT_EQ(stalls + 1, WorkerWatchdog::stalls());
+
+  // The thread is still stuck, but isn't reported again.
+  cwtest_advance_time_ms(1500);
+  EXPECT_TRUE(WorkerWatchdog::check(1000).empty());
+  EXPECT_EQ(1, WorkerWatchdog::stuck());
+
+  // Once the thread moves on it isn't stuck, and the next time it is stuck
+  // is reported.
+  WorkerWatchdog::clear_waiting();
+  WorkerWatchdog::idle();
+  EXPECT_TRUE(WorkerWatchdog::check(1000).empty());
+  EXPECT_EQ(0, WorkerWatchdog::stuck());
+
+  WorkerWatchdog::busy();
+  cwtest_advance_time_ms(1500);
+  stuck = WorkerWatchdog::check(1000);
+  ASSERT_EQ(1u, stuck.size());
+  EXPECT_EQ("", stuck[0].activity);
+  EXPECT_EQ("", stuck[0].waiting);
+  EXPECT_EQ(stalls + 2, WorkerWatchdog::stalls());
+}
+
+// Test that timing a Sproutlet's callback sets the thread's activity, and
+// restores it afterwards.
+TEST_F(WorkerWatchdogTest, SproutletActivity)
+{
+  SproutletCpuAccount outer(NULL, "scscf");
+  SproutletCpuAccount inner(NULL, "mmtel");
+  WorkerWatchdog::busy();
+  cwtest_advance_time_ms(1500);
+
+  {
+    SproutletCpu::Timer outer_timer(&outer);
+
+    {
+      SproutletCpu::Timer inner_timer(&inner);
+      std::vector<WorkerWatchdog::Stall> stuck = WorkerWatchdog::check(1000);
+      ASSERT_EQ(1u, stuck.size());
+      EXPECT_EQ("mmtel", stuck[0].activity);
+    }
+
+    EXPECT_EQ(outer.name(), WorkerWatchdog::set_activity(outer.name()));
+  }
+
+  EXPECT_EQ(NULL, WorkerWatchdog::set_activity(NULL));
+}
+
+// Test that a thread that isn't watched is ignored.
+TEST_F(WorkerWatchdogTest, Unregistered)
+{
+  WorkerWatchdog::unregister_thread();
+  WorkerWatchdog::busy();
+  EXPECT_EQ(NULL, WorkerWatchdog::set_activity("scscf"));
+  cwtest_advance_time_ms(1500);
+  EXPECT_TRUE(WorkerWatchdog::check(1000).empty());
+}
@@ -0,0 +1,278 @@
+/**
+ * @file warmup.cpp Warming up Sprout's caches before it takes traffic.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <netinet/in.h>
+#include <string.h>
+#include <strings.h>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+#include "log.h"
+#include "sipresolver.h"
+#include "hssconnection.h"
+#include "warmup.h"
+
+/// How many addresses to resolve for each target.  The resolver caches the
+/// whole NAPTR and SRV records whatever this is, so one is enough.
+static const int TARGETS_TO_RESOLVE = 1;
+
+Warmup::Warmup(SIPResolver* sip_resolver,
+               HSSConnection* hss_connection,
+               int addr_family) :
+  _sip_resolver(sip_resolver),
+  _hss_connection(hss_connection),
+  _addr_family(addr_family)
+{
+}
+
+/// The state of the Homestead fetches, which is shared with their callbacks
+/// so that it outlives a warmup that times out with fetches still in flight.
+struct FetchState
+{
+  std::mutex lock;
+  std::condition_variable cond;
+  int outstanding = 0;
+  int fetched = 0;
+  int failed = 0;
+};
+
+Warmup::Result Warmup::run(const std::vector<std::string>& targets,
+                           const std::vector<std::string>& impus,
+                           int timeout_ms)
+{
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+  Result result = {0, 0, 0, 0, true};
+
+  TRC_STATUS("Warming up: %d next hops to resolve, %d IMPUs to fetch",
+             (_sip_resolver != NULL) ? (int)targets.size() : 0,
+             (_hss_connection != NULL) ? (int)impus.size() : 0);
+
+  if (_sip_resolver != NULL)
+  {
+    for (const std::string& target : targets)
+    {
+      if (std::chrono::steady_clock::now() >= deadline)
+      {
+        result.complete = false;
+        break;
+      }
+
+      Target parsed;
+      std::vector<AddrInfo> addrs;
+
+      if (parse_target(target, parsed))
+      {
+        _sip_resolver->resolve(parsed.host,
+                               _addr_family,
+                               parsed.port,
+                               parsed.transport,
+                               TARGETS_TO_RESOLVE,
+                               addrs,
+                               BaseResolver::ALL_LISTS);
+      }
+
+      if (!addrs.empty())
+      {
+        TRC_DEBUG("Resolved next hop %s", target.c_str());
+        result.targets_resolved++;
+      }
+      else
+      {
+        TRC_WARNING("Failed to resolve next hop %s during warmup",
+                    target.c_str());
+        result.targets_failed++;
+      }
+    }
+  }
+
+  if ((_hss_connection != NULL) && (result.complete))
+  {
+    std::shared_ptr<FetchState> state = std::make_shared<FetchState>();
+
+    for (const std::string& impu : impus)
+    {
+      if (std::chrono::steady_clock::now() >= deadline)
+      {
+        result.complete = false;
+        break;
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(state->lock);
+        if (!state->cond.wait_until(lock, deadline, [&state]()
+              { return state->outstanding < MAX_OUTSTANDING_FETCHES; }))
+        {
+          result.complete = false;
+          break;
+        }
+
+        state->outstanding++;
+      }
+
+      // The callback may run on this thread, if the connection has no
+      // request threads, so the lock mustn't be held here.
+      _hss_connection->get_registration_data_async(
+        impu,
+        [state](HTTPCode rc, HSSConnection::irs_info& irs_info)
+        {
+          std::unique_lock<std::mutex> lock(state->lock);
+          state->outstanding--;
+          if (rc == HTTP_OK)
+          {
+            state->fetched++;
+          }
+          else
+          {
+            state->failed++;
+          }
+          state->cond.notify_all();
+        },
+        0);
+    }
+
+    std::unique_lock<std::mutex> lock(state->lock);
+    if (!state->cond.wait_until(lock, deadline, [&state]()
+          { return state->outstanding == 0; }))
+    {
+      result.complete = false;
+    }
+
+    result.impus_fetched = state->fetched;
+    result.impus_failed = state->failed;
+  }
+
+  if (result.complete)
+  {
+    TRC_STATUS("Warmup complete: resolved %d next hops (%d failed), fetched %d IMPUs (%d failed)",
+               result.targets_resolved,
+               result.targets_failed,
+               result.impus_fetched,
+               result.impus_failed);
+  }
+  else
+  {
+    TRC_WARNING("Warmup timed out after %dms: resolved %d next hops (%d failed), fetched %d IMPUs (%d failed)",
+                timeout_ms,
+                result.targets_resolved,
+                result.targets_failed,
+                result.impus_fetched,
+                result.impus_failed);
+  }
+
+  return result;
+}
+
+bool Warmup::read_impus(const std::string& filename,
+                        std::vector<std::string>& impus)
+{
+  std::ifstream file(filename.c_str());
+  if (!file.is_open())
+  {
+    TRC_ERROR("Failed to open warmup IMPUs file %s", filename.c_str());
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    size_t start = line.find_first_not_of(" \t\r");
+    if ((start == std::string::npos) || (line[start] == '#'))
+    {
+      continue;
+    }
+
+    size_t end = line.find_last_not_of(" \t\r");
+    impus.push_back(line.substr(start, end - start + 1));
+  }
+
+  return true;
+}
+
+bool Warmup::parse_target(const std::string& target, Target& parsed)
+{
+  std::string remainder = target;
+  parsed.port = 0;
+  parsed.transport = -1;
+
+  // Strip the scheme and any user part off a SIP URI, and pick out its
+  // transport parameter.
+  if ((strncasecmp(remainder.c_str(), "sip:", 4) == 0) ||
+      (strncasecmp(remainder.c_str(), "sips:", 5) == 0))
+  {
+    remainder = remainder.substr(remainder.find(':') + 1);
+
+    size_t params = remainder.find(';');
+    if (params != std::string::npos)
+    {
+      std::string params_str = remainder.substr(params);
+      remainder = remainder.substr(0, params);
+
+      if (strcasestr(params_str.c_str(), ";transport=tcp") != NULL)
+      {
+        parsed.transport = IPPROTO_TCP;
+      }
+      else if (strcasestr(params_str.c_str(), ";transport=udp") != NULL)
+      {
+        parsed.transport = IPPROTO_UDP;
+      }
+    }
+
+    size_t at = remainder.find('@');
+    if (at != std::string::npos)
+    {
+      remainder = remainder.substr(at + 1);
+    }
+  }
+
+  // Split the host (which may be a bracketed IPv6 address) from the port.
+  size_t port_start;
+  if ((!remainder.empty()) && (remainder[0] == '['))
+  {
+    size_t close = remainder.find(']');
+    if (close == std::string::npos)
+    {
+      return false;
+    }
+
+    parsed.host = remainder.substr(1, close - 1);
+    port_start = close + 1;
+  }
+  else
+  {
+    port_start = remainder.find(':');
+    parsed.host = remainder.substr(0, port_start);
+  }
+
+  if ((port_start != std::string::npos) && (port_start < remainder.size()))
+  {
+    std::string port_str = remainder.substr(port_start);
+    if ((port_str.size() < 2) ||
+        (port_str[0] != ':') ||
+        (port_str.size() > 6) ||
+        (port_str.find_first_not_of("0123456789", 1) != std::string::npos))
+    {
+      return false;
+    }
+
+    parsed.port = std::stoi(port_str.substr(1));
+    if (parsed.port > 65535)
+    {
+      return false;
+    }
+  }
+
+  return !parsed.host.empty();
+}
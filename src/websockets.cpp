@@ -20,6 +20,7 @@ extern "C" {
 
 #include <string>
 #include <cstring>
+#include <cstdlib>
 
 #include "stack.h"
 #include "log.h"
@@ -29,6 +30,7 @@ extern "C" {
 using websocketpp::server;
 
 static unsigned short ws_port;
+static unsigned int ws_threads;
 
 //
 // mod_ws_transport is the module implementing websockets
@@ -60,6 +62,12 @@ struct ws_transport
   pjsip_rx_data rdata;
   int			is_closing;
   pj_bool_t		is_paused;
+
+  /* Counts of the messages and bytes received and sent on the connection. */
+  pj_atomic_t* rx_msgs;
+  pj_atomic_t* rx_bytes;
+  pj_atomic_t* tx_msgs;
+  pj_atomic_t* tx_bytes;
 };
 
 
@@ -75,13 +83,20 @@ static pj_status_t ws_send_msg(pjsip_transport *transport,
                                void *token,
                                pjsip_transport_callback callback)
 {
-  std::string body(tdata->buf.start);
+  // websocketpp only sends from a string, so print the message into one,
+  // reusing this thread's buffer to save an allocation per message.
+  static thread_local std::string body;
+  pj_size_t len = tdata->buf.cur - tdata->buf.start;
+  body.assign(tdata->buf.start, len);
   TRC_DEBUG("Sending message over WS");
 
   struct ws_transport *ws = (struct ws_transport*)transport;
   server::handler::connection_ptr con = ws->con;
   con->send(body, websocketpp::frame::opcode::TEXT);
 
+  pj_atomic_inc(ws->tx_msgs);
+  pj_atomic_add(ws->tx_bytes, len);
+
   return PJ_SUCCESS;
 }
 
@@ -150,6 +165,16 @@ static pj_status_t ws_transport_create(pjsip_endpoint *endpt,
     goto on_error;
   }
 
+  /* Init message and byte counters. */
+  if ((pj_atomic_create(pool, 0, &tp->rx_msgs) != PJ_SUCCESS) ||
+      (pj_atomic_create(pool, 0, &tp->rx_bytes) != PJ_SUCCESS) ||
+      (pj_atomic_create(pool, 0, &tp->tx_msgs) != PJ_SUCCESS) ||
+      (pj_atomic_create(pool, 0, &tp->tx_bytes) != PJ_SUCCESS))
+  {
+    status = PJ_ENOMEM;
+    goto on_error;
+  }
+
   /* Init lock. */
   status = pj_lock_create_recursive_mutex(pool, pool->obj_name,
       &tp->base.lock);
@@ -256,6 +281,28 @@ on_error:
   return status;
 }
 
+/*
+ * Registers a websockets server thread with PJSIP, if it isn't already.
+ */
+static void register_ws_thread()
+{
+  if (!pj_thread_is_registered())
+  {
+    // As for the HTTP threads, the thread descriptor must outlive the thread
+    // so is allocated from the heap and leaked.  This is okay because the
+    // websockets server runs a fixed pool of threads for the life of the
+    // process.
+    pj_thread_desc* td = (pj_thread_desc*)malloc(sizeof(pj_thread_desc));
+    pj_bzero(*td, sizeof(pj_thread_desc));
+    pj_thread_t *thread = 0;
+
+    if (pj_thread_register("websockets", *td, &thread) != PJ_SUCCESS)
+    {
+      TRC_ERROR("Failed to register websockets thread with pjsip");
+    }
+  }
+}
+
 /*
  * Called when we receive a web socket message
  */
@@ -274,17 +321,21 @@ static pj_bool_t on_ws_data(ws_transport *ws,
   pj_pool_t *pool;
   pj_sockaddr *rem_addr;
 
-  /* Init rdata */
-  pool = pjsip_endpt_create_pool(ws->base.endpt,
-      "rtd%p",
-      PJSIP_POOL_RDATA_LEN,
-      PJSIP_POOL_RDATA_INC);
+  /* Init rdata.  The pool is created for the first message on the
+   * connection, and reset after each one. */
+  pool = ws->rdata.tp_info.pool;
   if (!pool) {
-    TRC_ERROR("Unable to create pool");
-    return PJ_ENOMEM;
-  }
+    pool = pjsip_endpt_create_pool(ws->base.endpt,
+        "rtd%p",
+        PJSIP_POOL_RDATA_LEN,
+        PJSIP_POOL_RDATA_INC);
+    if (!pool) {
+      TRC_ERROR("Unable to create pool");
+      return PJ_ENOMEM;
+    }
 
-  ws->rdata.tp_info.pool = pool;
+    ws->rdata.tp_info.pool = pool;
+  }
 
   ws->rdata.tp_info.transport = &ws->base;
   ws->rdata.tp_info.tp_data = ws;
@@ -297,27 +348,30 @@ static pj_bool_t on_ws_data(ws_transport *ws,
       sizeof(ws->rdata.pkt_info.src_name), 0);
   ws->rdata.pkt_info.src_port = pj_sockaddr_get_port(rem_addr);
 
-  const char *msg_str = msg->get_payload().c_str();
+  // Parse the message straight out of the websocket frame's payload rather
+  // than copying it.  The payload is null-terminated and outlives the call
+  // to the transport manager below, and anything that keeps the message
+  // beyond that (such as the thread dispatcher) clones the rdata.
+  const std::string& payload = msg->get_payload();
+  size_t msg_len = strlen(payload.c_str());
 
-  if (strlen(msg_str) <= PJSIP_MAX_PKT_LEN)
-  {
-    ws->rdata.pkt_info.packet = (char*)pj_pool_alloc(ws->rdata.tp_info.pool, strlen(msg_str) + 1);
-    size_t p_size = strlen(msg_str) + 1;
-    size_t m_size = sizeof(ws->rdata.pkt_info.packet);
-    size_t max_chars = std::min(p_size, m_size);
-    strncpy(ws->rdata.pkt_info.packet, msg_str, max_chars);
-  }
-  else
+  if (msg_len > PJSIP_MAX_PKT_LEN)
   {
-    TRC_ERROR("Dropping incoming websocket message as it is larger than PJSIP_MAX_PKT_LEN, %d", strlen(msg_str));
+    TRC_ERROR("Dropping incoming websocket message as it is larger than PJSIP_MAX_PKT_LEN, %d", msg_len);
+    pj_pool_reset(ws->rdata.tp_info.pool);
     return PJ_FALSE;
   }
 
+  ws->rdata.pkt_info.packet = const_cast<char*>(payload.c_str());
+
   pjsip_rx_data *rdata;
   rdata = &ws->rdata;
 
+  pj_atomic_inc(ws->rx_msgs);
+  pj_atomic_add(ws->rx_bytes, msg_len);
+
   /* Init pkt_info part. */
-  rdata->pkt_info.len = strlen(msg_str);
+  rdata->pkt_info.len = msg_len;
   rdata->pkt_info.zero = 0;
   pj_gettimeofday(&rdata->pkt_info.timestamp);
 
@@ -337,7 +391,8 @@ static pj_bool_t on_ws_data(ws_transport *ws,
    */
   pj_assert(size_eaten == (pj_size_t)rdata->pkt_info.len);
 
-  /* Reset pool. */
+  /* Reset pool, and don't leave the rdata pointing at the frame. */
+  rdata->pkt_info.packet = NULL;
   pj_pool_reset(rdata->tp_info.pool);
 
   return PJ_TRUE;
@@ -369,6 +424,15 @@ static pj_status_t ws_destroy_transport(pjsip_transport *transport)
     ws->base.ref_cnt = NULL;
   }
 
+  pj_atomic_t** counters[] = {&ws->rx_msgs, &ws->rx_bytes, &ws->tx_msgs, &ws->tx_bytes};
+  for (size_t ii = 0; ii < sizeof(counters) / sizeof(counters[0]); ++ii)
+  {
+    if (*counters[ii]) {
+      pj_atomic_destroy(*counters[ii]);
+      *counters[ii] = NULL;
+    }
+  }
+
   if (ws->base.pool) {
     pj_pool_t *pool;
     pool = ws->base.pool;
@@ -383,6 +447,15 @@ static pj_status_t ws_destroy_transport(pjsip_transport *transport)
 /* Setup callbacks for WebSockets events */
 class sip_server_handler : public server::handler {
   public:
+    sip_server_handler()
+    {
+      pthread_mutex_init(&connectionMapLock, NULL);
+    }
+
+    ~sip_server_handler()
+    {
+      pthread_mutex_destroy(&connectionMapLock);
+    }
 
     void validate(connection_ptr con)
     {
@@ -413,6 +486,8 @@ class sip_server_handler : public server::handler {
     }
 
     void on_open(connection_ptr con) {
+      register_ws_thread();
+
       TRC_DEBUG("New web socket connection, creating PJSIP transport");
       pjsip_transport *transport;
       pj_status_t status = ws_transport_create(stack_data.endpt,
@@ -426,16 +501,24 @@ class sip_server_handler : public server::handler {
         TRC_DEBUG("Failed to create WS transport");
       }
 
+      pthread_mutex_lock(&connectionMapLock);
       connectionMap.insert(
           std::pair<connection_ptr, struct ws_transport*>(con, (struct ws_transport*)transport));
+      pthread_mutex_unlock(&connectionMapLock);
     }
 
     void on_message(connection_ptr con, message_ptr msg) {
       ws_transport *transport;
 
+      register_ws_thread();
+
       TRC_DEBUG("Received message from websockets");
 
+      // Frames on any one connection are handled one at a time, so the
+      // transport's rdata is safe to use without further locking.
+      pthread_mutex_lock(&connectionMapLock);
       transport = connectionMap.find(con)->second;
+      pthread_mutex_unlock(&connectionMapLock);
       TRC_DEBUG("Sending message to PJSIP...");
       pj_status_t status = on_ws_data(transport, msg);
       if (status == PJ_TRUE){
@@ -450,8 +533,23 @@ class sip_server_handler : public server::handler {
       ws_transport *transport;
       pjsip_tp_state_callback state_cb;
 
+      register_ws_thread();
+
       TRC_DEBUG("Closing websocket...");
-      transport = connectionMap.find(con)->second;
+      pthread_mutex_lock(&connectionMapLock);
+      std::map<connection_ptr, struct ws_transport*>::iterator it = connectionMap.find(con);
+      transport = it->second;
+      connectionMap.erase(it);
+      pthread_mutex_unlock(&connectionMapLock);
+
+      TRC_INFO("Websocket from %.*s:%d closed - received %ld messages (%ld bytes), sent %ld messages (%ld bytes)",
+               transport->base.remote_name.host.slen,
+               transport->base.remote_name.host.ptr,
+               transport->base.remote_name.port,
+               pj_atomic_get(transport->rx_msgs),
+               pj_atomic_get(transport->rx_bytes),
+               pj_atomic_get(transport->tx_msgs),
+               pj_atomic_get(transport->tx_bytes));
 
       /* Notify application of transport disconnected state */
       state_cb = pjsip_tpmgr_get_state_cb(transport->base.tpmgr);
@@ -474,6 +572,7 @@ class sip_server_handler : public server::handler {
   private:
     static std::string SUBPROTOCOL;
     std::map<connection_ptr, struct ws_transport*> connectionMap;
+    pthread_mutex_t connectionMapLock;
 };
 
 std::string sip_server_handler::SUBPROTOCOL = "sip";
@@ -495,9 +594,10 @@ static int websocket_thread(void* p)
     sip_endpoint.elog().set_level(websocketpp::log::elevel::RERROR);
     sip_endpoint.elog().set_level(websocketpp::log::elevel::FATAL);
 
-    TRC_DEBUG("Starting WebSocket SIP server on port %hu", ws_port);
+    TRC_DEBUG("Starting WebSocket SIP server on port %hu with %u threads",
+              ws_port, ws_threads);
     boost::asio::ip::tcp::endpoint ep(boost::asio::ip::tcp::v4(), ws_port);
-    sip_endpoint.listen(ep);
+    sip_endpoint.listen(ep, ws_threads);
   } catch (std::exception& e) {
     TRC_ERROR("Exception: %s", e.what());
   }
@@ -522,9 +622,10 @@ static pj_bool_t ws_transport_on_start()
   return PJ_SUCCESS;
 }
 
-pj_status_t init_websockets(unsigned short port)
+pj_status_t init_websockets(unsigned short port, unsigned int threads)
 {
   ws_port = port;
+  ws_threads = threads;
 
   pj_status_t status;
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_ws_transport);
@@ -0,0 +1,282 @@
+/**
+ * @file worker_affinity_queue.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "worker_affinity_queue.h"
+
+WorkerAffinityQueue::WorkerAffinityQueue(int num_workers) :
+  _num_workers(num_workers),
+  _lock("worker_affinity_queue"),
+  _queues(num_workers),
+  _conds(num_workers),
+  _idle(num_workers, false),
+  _size(0),
+  _terminated(false),
+  _deadlock_threshold_ms(0),
+  _sweep_depth(0),
+  _sweep_max_age_us(0),
+  _last_service_ms(now_ms())
+{
+  // The condition variables use the monotonic clock, for timed pops.
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+  for (int ii = 0; ii < _num_workers; ++ii)
+  {
+    _queues[ii] = new MultiQueueEventQueueBackend();
+    pthread_cond_init(&_conds[ii], &cond_attr);
+  }
+
+  pthread_condattr_destroy(&cond_attr);
+}
+
+WorkerAffinityQueue::~WorkerAffinityQueue()
+{
+  for (int ii = 0; ii < _num_workers; ++ii)
+  {
+    delete _queues[ii]; _queues[ii] = NULL;
+    pthread_cond_destroy(&_conds[ii]);
+  }
+}
+
+void WorkerAffinityQueue::set_deadlock_threshold(unsigned long threshold_ms)
+{
+  _lock.lock();
+  _deadlock_threshold_ms = threshold_ms;
+  _lock.unlock();
+}
+
+bool WorkerAffinityQueue::is_deadlocked()
+{
+  _lock.lock();
+  bool deadlocked = ((_deadlock_threshold_ms > 0) &&
+                     (_size > 0) &&
+                     ((now_ms() - _last_service_ms) > _deadlock_threshold_ms));
+  _lock.unlock();
+
+  return deadlocked;
+}
+
+void WorkerAffinityQueue::set_expiry_sweep(int depth, unsigned long max_age_us)
+{
+  _lock.lock();
+  _sweep_depth = depth;
+  _sweep_max_age_us = max_age_us;
+  _lock.unlock();
+}
+
+void WorkerAffinityQueue::take_expired(std::vector<SipEvent>& expired)
+{
+  _lock.lock();
+  expired.insert(expired.end(), _expired.begin(), _expired.end());
+  _expired.clear();
+  _lock.unlock();
+}
+
+int WorkerAffinityQueue::push(int worker, const SipEvent& event)
+{
+  _lock.lock();
+
+  if (_size == 0)
+  {
+    // The queue has been empty, so start the deadlock timer from now.
+    _last_service_ms = now_ms();
+  }
+
+  _queues[worker]->push(event);
+  ++_size;
+  int depth = _queues[worker]->size();
+
+  if ((_sweep_depth > 0) && (depth >= _sweep_depth))
+  {
+    int removed = _queues[worker]->remove_expired(_sweep_max_age_us, _expired);
+    _size -= removed;
+    depth -= removed;
+  }
+
+  // Wake up the home worker if it's idle.  Otherwise wake up any idle worker
+  // so it can steal the event.  Clear the idle flag of the worker we wake so
+  // that a subsequent push doesn't just wake the same worker again.
+  int wake = -1;
+
+  if (_idle[worker])
+  {
+    wake = worker;
+  }
+  else
+  {
+    for (int ii = 0; ii < _num_workers; ++ii)
+    {
+      if (_idle[ii])
+      {
+        wake = ii;
+        break;
+      }
+    }
+  }
+
+  if (wake >= 0)
+  {
+    _idle[wake] = false;
+    pthread_cond_signal(&_conds[wake]);
+  }
+
+  _lock.unlock();
+
+  return depth;
+}
+
+bool WorkerAffinityQueue::pop(int worker, SipEvent& event, bool& stolen)
+{
+  bool timed_out;
+  return pop(worker, event, stolen, -1, timed_out);
+}
+
+bool WorkerAffinityQueue::pop(int worker,
+                              SipEvent& event,
+                              bool& stolen,
+                              int timeout_ms,
+                              bool& timed_out)
+{
+  bool rc = false;
+  stolen = false;
+  timed_out = false;
+
+  struct timespec deadline;
+  if (timeout_ms >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  _lock.lock();
+
+  while (!_terminated)
+  {
+    int source = worker;
+
+    if (_queues[worker]->empty())
+    {
+      // Nothing on our own queue, so try to steal from the busiest worker.
+      source = deepest_queue();
+    }
+
+    if (source >= 0)
+    {
+      event = _queues[source]->front();
+      _queues[source]->pop();
+      --_size;
+      _last_service_ms = now_ms();
+      stolen = (source != worker);
+      rc = true;
+      break;
+    }
+
+    if (timed_out)
+    {
+      break;
+    }
+
+    _idle[worker] = true;
+    if (timeout_ms < 0)
+    {
+      _lock.wait(&_conds[worker]);
+    }
+    else if (_lock.timedwait(&_conds[worker], &deadline) == ETIMEDOUT)
+    {
+      // Check the queues one last time before giving up.
+      timed_out = true;
+    }
+    _idle[worker] = false;
+  }
+
+  _lock.unlock();
+
+  return rc;
+}
+
+int WorkerAffinityQueue::size()
+{
+  _lock.lock();
+  int size = _size;
+  _lock.unlock();
+
+  return size;
+}
+
+int WorkerAffinityQueue::size(int worker)
+{
+  _lock.lock();
+  int size = _queues[worker]->size();
+  _lock.unlock();
+
+  return size;
+}
+
+void WorkerAffinityQueue::terminate(std::vector<SipEvent>& remaining)
+{
+  _lock.lock();
+
+  _terminated = true;
+
+  for (int ii = 0; ii < _num_workers; ++ii)
+  {
+    while (!_queues[ii]->empty())
+    {
+      remaining.push_back(_queues[ii]->front());
+      _queues[ii]->pop();
+    }
+
+    pthread_cond_signal(&_conds[ii]);
+  }
+
+  _size = 0;
+
+  remaining.insert(remaining.end(), _expired.begin(), _expired.end());
+  _expired.clear();
+
+  _lock.unlock();
+}
+
+int WorkerAffinityQueue::deepest_queue()
+{
+  int deepest = -1;
+  int deepest_size = 0;
+
+  for (int ii = 0; ii < _num_workers; ++ii)
+  {
+    int size = _queues[ii]->size();
+
+    if (size > deepest_size)
+    {
+      deepest = ii;
+      deepest_size = size;
+    }
+  }
+
+  return deepest;
+}
+
+unsigned long WorkerAffinityQueue::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
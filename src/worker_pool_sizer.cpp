@@ -0,0 +1,56 @@
+/**
+ * @file worker_pool_sizer.cpp Decides how many worker threads to run.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "log.h"
+#include "worker_pool_sizer.h"
+
+const int WorkerPoolSizer::SHRINK_DELAY_SAMPLES;
+
+WorkerPoolSizer::WorkerPoolSizer(int min_workers,
+                                 int max_workers,
+                                 int num_cpus) :
+  _min_workers(min_workers),
+  _max_workers(std::max(min_workers, max_workers)),
+  _num_cpus(std::max(num_cpus, 1)),
+  _idle_samples(0)
+{
+}
+
+int WorkerPoolSizer::target(int workers, int blocked, int queue_depth)
+{
+  int runnable = workers - blocked;
+
+  if ((queue_depth > _num_cpus) && (runnable < _num_cpus))
+  {
+    // Messages are backing up even though the CPUs have spare capacity, so
+    // the workers must be blocked.  Grow by a quarter.
+    _idle_samples = 0;
+    return std::min(_max_workers, workers + std::max(1, workers / 4));
+  }
+
+  if ((queue_depth == 0) && (blocked <= workers / 2))
+  {
+    // Most of the workers are waiting for work.  Once this has been the case
+    // for a while, shrink by an eighth on each sample.
+    if (++_idle_samples >= SHRINK_DELAY_SAMPLES)
+    {
+      return std::max(_min_workers, workers - std::max(1, workers / 8));
+    }
+  }
+  else
+  {
+    _idle_samples = 0;
+  }
+
+  return std::max(_min_workers, std::min(_max_workers, workers));
+}
@@ -0,0 +1,410 @@
+/**
+ * @file worker_watchdog.cpp Detection of worker threads that are stuck.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+#include "metrics.h"
+#include "worker_watchdog.h"
+
+namespace WorkerWatchdog
+{
+  /// The signal sent to a stuck thread to capture its stack.  SIGURG is
+  /// ignored by default, and Sprout doesn't use out-of-band TCP data, so
+  /// nothing else expects it.
+  static const int STACK_SIGNAL = SIGURG;
+
+  /// The most stack frames captured, and how long to wait for them.
+  static const int MAX_FRAMES = 64;
+  static const int STACK_WAIT_MS = 100;
+
+  /// A watched thread's slot.  The thread writes everything except
+  /// reported_ms, which only the watchdog uses.
+  struct Slot
+  {
+    std::atomic<bool> in_use;
+    pthread_t thread;
+    char name[TAG_LENGTH];
+
+    /// When the thread became busy, or 0 if it is idle.
+    std::atomic<uint64_t> busy_since_ms;
+    std::atomic<const char*> activity;
+
+    /// The dependency is guarded by a sequence number, which is odd while
+    /// the dependency is being written.
+    std::atomic<uint32_t> waiting_seq;
+    char waiting[TAG_LENGTH];
+
+    /// The busy_since_ms value the watchdog last reported the thread stuck
+    /// for, so that it reports each stall once.
+    uint64_t reported_ms;
+
+    /// The stack captured by the signal handler, or -1 frames while the
+    /// watchdog is waiting for it.
+    void* frames[MAX_FRAMES];
+    std::atomic<int> num_frames;
+  };
+
+  struct Registry
+  {
+    Registry() :
+      stuck(0),
+      stalls(0),
+      stopping(false),
+      stalls_metric(Metrics::counter("sprout_worker_stalls",
+                                     "Times a worker thread was found stuck on one message"))
+    {
+      for (int ii = 0; ii < MAX_THREADS; ++ii)
+      {
+        slots[ii].in_use = false;
+        slots[ii].busy_since_ms = 0;
+        slots[ii].activity = NULL;
+        slots[ii].waiting_seq = 0;
+        slots[ii].waiting[0] = '\0';
+        slots[ii].reported_ms = 0;
+        slots[ii].num_frames = 0;
+      }
+
+      Metrics::gauge("sprout_stuck_worker_threads",
+                     "Worker threads stuck on one message",
+                     [this]() { return (double)stuck.load(); });
+    }
+
+    Slot slots[MAX_THREADS];
+    std::atomic<int> stuck;
+    std::atomic<uint64_t> stalls;
+
+    /// Serializes registering threads, and starting and stopping the
+    /// watchdog.
+    std::mutex lock;
+    std::condition_variable cond;
+    bool stopping;
+    std::thread watchdog;
+    Metrics::Counter* stalls_metric;
+  };
+
+  static Registry& registry()
+  {
+    static Registry* registry = new Registry();
+    return *registry;
+  }
+
+  static thread_local Slot* tl_slot = NULL;
+
+  static uint64_t now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+  }
+
+  static void copy_tag(char* dest, const char* src)
+  {
+    strncpy(dest, src, TAG_LENGTH - 1);
+    dest[TAG_LENGTH - 1] = '\0';
+  }
+
+  void register_thread(const std::string& name)
+  {
+    Registry& watchdog = registry();
+    std::lock_guard<std::mutex> guard(watchdog.lock);
+
+    for (int ii = 0; ii < MAX_THREADS; ++ii)
+    {
+      Slot& slot = watchdog.slots[ii];
+
+      if (!slot.in_use)
+      {
+        slot.thread = pthread_self();
+        copy_tag(slot.name, name.c_str());
+        slot.busy_since_ms = 0;
+        slot.activity = NULL;
+        slot.waiting[0] = '\0';
+        slot.reported_ms = 0;
+        slot.in_use = true;
+        tl_slot = &slot;
+        return;
+      }
+    }
+
+    TRC_WARNING("Too many threads to watch %s", name.c_str()); // LCOV_EXCL_LINE
+  }
+
+  void unregister_thread()
+  {
+    if (tl_slot != NULL)
+    {
+      Registry& watchdog = registry();
+      std::lock_guard<std::mutex> guard(watchdog.lock);
+      tl_slot->busy_since_ms = 0;
+      tl_slot->in_use = false;
+      tl_slot = NULL;
+    }
+  }
+
+  void busy()
+  {
+    if (tl_slot != NULL)
+    {
+      tl_slot->busy_since_ms.store(now_ms(), std::memory_order_relaxed);
+    }
+  }
+
+  void idle()
+  {
+    if (tl_slot != NULL)
+    {
+      tl_slot->busy_since_ms.store(0, std::memory_order_relaxed);
+      tl_slot->activity.store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  const char* set_activity(const char* activity)
+  {
+    return (tl_slot != NULL) ?
+             tl_slot->activity.exchange(activity, std::memory_order_relaxed) :
+             NULL;
+  }
+
+  void set_waiting(const std::string& dependency)
+  {
+    if (tl_slot != NULL)
+    {
+      tl_slot->waiting_seq.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      copy_tag(tl_slot->waiting, dependency.c_str());
+      tl_slot->waiting_seq.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  void clear_waiting()
+  {
+    set_waiting("");
+  }
+
+  // Reads the dependency a thread is blocked on.  If the thread is changing
+  // it, it isn't blocked for long, so an empty string is returned.
+  static std::string read_waiting(Slot& slot)
+  {
+    uint32_t seq = slot.waiting_seq.load(std::memory_order_acquire);
+    char waiting[TAG_LENGTH];
+    memcpy(waiting, slot.waiting, sizeof(waiting));
+    waiting[TAG_LENGTH - 1] = '\0';
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if ((seq & 1) ||
+        (seq != slot.waiting_seq.load(std::memory_order_relaxed)))
+    {
+      return ""; // LCOV_EXCL_LINE
+    }
+
+    return waiting;
+  }
+
+  // LCOV_EXCL_START - stacks are only captured from the watchdog thread.
+  static void stack_signal_handler(int sig)
+  {
+    if (tl_slot != NULL)
+    {
+      tl_slot->num_frames.store(backtrace(tl_slot->frames, MAX_FRAMES),
+                                std::memory_order_release);
+    }
+  }
+
+  // Signals a stuck thread to capture its stack, and logs it.
+  static void log_stack(Slot& slot)
+  {
+    slot.num_frames.store(-1, std::memory_order_relaxed);
+
+    if ((!slot.in_use.load(std::memory_order_relaxed)) ||
+        (pthread_kill(slot.thread, STACK_SIGNAL) != 0))
+    {
+      return;
+    }
+
+    int num_frames = -1;
+
+    for (int waited_ms = 0;
+         (waited_ms < STACK_WAIT_MS) &&
+         ((num_frames = slot.num_frames.load(std::memory_order_acquire)) < 0);
+         ++waited_ms)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (num_frames < 0)
+    {
+      TRC_WARNING("Timed out capturing the stack of thread %s", slot.name);
+      return;
+    }
+
+    char** symbols = backtrace_symbols(slot.frames, num_frames);
+
+    if (symbols != NULL)
+    {
+      TRC_WARNING("Stack of thread %s:", slot.name);
+
+      for (int ii = 0; ii < num_frames; ++ii)
+      {
+        TRC_WARNING("  %s", symbols[ii]);
+      }
+
+      free(symbols);
+    }
+  }
+  // LCOV_EXCL_STOP
+
+  static std::vector<Stall> check(uint64_t threshold_ms, bool capture_stacks)
+  {
+    Registry& watchdog = registry();
+    std::vector<Stall> stalls;
+    uint64_t now = now_ms();
+    int stuck = 0;
+
+    for (int ii = 0; ii < MAX_THREADS; ++ii)
+    {
+      Slot& slot = watchdog.slots[ii];
+
+      if (!slot.in_use.load(std::memory_order_relaxed))
+      {
+        continue;
+      }
+
+      uint64_t busy_since_ms = slot.busy_since_ms.load(std::memory_order_relaxed);
+
+      if ((busy_since_ms == 0) ||
+          (now < busy_since_ms + threshold_ms))
+      {
+        continue;
+      }
+
+      ++stuck;
+
+      if (slot.reported_ms == busy_since_ms)
+      {
+        continue;
+      }
+
+      slot.reported_ms = busy_since_ms;
+      const char* activity = slot.activity.load(std::memory_order_relaxed);
+      Stall stall = {slot.name,
+                     now - busy_since_ms,
+                     (activity != NULL) ? activity : "",
+                     read_waiting(slot)};
+
+      TRC_WARNING("Thread %s has been busy for %llums (activity: %s, waiting on: %s)",
+                  stall.thread.c_str(),
+                  (unsigned long long)stall.busy_ms,
+                  stall.activity.empty() ? "none" : stall.activity.c_str(),
+                  stall.waiting.empty() ? "nothing" : stall.waiting.c_str());
+      watchdog.stalls++;
+      watchdog.stalls_metric->increment();
+
+      if (capture_stacks)
+      {
+        log_stack(slot); // LCOV_EXCL_LINE
+      }
+
+      stalls.push_back(stall);
+    }
+
+    watchdog.stuck = stuck;
+    return stalls;
+  }
+
+  std::vector<Stall> check(uint64_t threshold_ms)
+  {
+    return check(threshold_ms, false);
+  }
+
+  // LCOV_EXCL_START - the watchdog thread isn't run in UT.
+  static void watchdog_thread(int threshold_ms, bool capture_stacks)
+  {
+    Registry& watchdog = registry();
+    std::unique_lock<std::mutex> lock(watchdog.lock);
+    std::chrono::milliseconds period(std::max(threshold_ms / 4, 100));
+
+    while (!watchdog.cond.wait_for(lock, period, [&watchdog]() { return watchdog.stopping; }))
+    {
+      // Check without the lock, so threads can register while stacks are
+      // captured.
+      lock.unlock();
+      check(threshold_ms, capture_stacks);
+      lock.lock();
+    }
+  }
+
+  void start(int threshold_ms, bool capture_stacks)
+  {
+    if (threshold_ms <= 0)
+    {
+      return;
+    }
+
+    if (capture_stacks)
+    {
+      // Capture a stack once, so that the library backtrace() uses is loaded
+      // before it's first needed in a signal handler.
+      void* frames[1];
+      backtrace(frames, 1);
+
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = &stack_signal_handler;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(STACK_SIGNAL, &action, NULL);
+    }
+
+    Registry& watchdog = registry();
+    std::lock_guard<std::mutex> guard(watchdog.lock);
+    TRC_STATUS("Watching for worker threads busy for more than %dms", threshold_ms);
+    watchdog.stopping = false;
+    watchdog.watchdog = std::thread(watchdog_thread, threshold_ms, capture_stacks);
+  }
+
+  void stop()
+  {
+    Registry& watchdog = registry();
+    {
+      std::lock_guard<std::mutex> guard(watchdog.lock);
+      watchdog.stopping = true;
+      watchdog.cond.notify_all();
+    }
+
+    if (watchdog.watchdog.joinable())
+    {
+      watchdog.watchdog.join();
+    }
+  }
+  // LCOV_EXCL_STOP
+
+  int stuck()
+  {
+    return registry().stuck;
+  }
+
+  uint64_t stalls()
+  {
+    return registry().stalls;
+  }
+}
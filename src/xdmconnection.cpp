@@ -22,13 +22,20 @@
 #include "httpconnection.h"
 #include "xdmconnection.h"
 #include "snmp_continuous_accumulator_table.h"
+#include "stack.h"
+#include "dependency_monitor.h"
+#include "request_deadline.h"
 
 /// Main constructor.
 XDMConnection::XDMConnection(const std::string& server,
                              HttpResolver* resolver,
                              LoadMonitor *load_monitor,
                              SNMP::IPCountTable* xdm_cxn_count,
-                             SNMP::EventAccumulatorTable* xdm_latency):
+                             SNMP::EventAccumulatorTable* xdm_latency,
+                             int http2_connections,
+                             SNMP::IPCountTable* http2_stream_count_tbl,
+                             SNMP::EventAccumulatorTable* http2_rtt_tbl,
+                             bool compression):
   _client(new HttpClient(true,
                          resolver,
                          xdm_cxn_count,
@@ -37,14 +44,31 @@ XDMConnection::XDMConnection(const std::string& server,
                          NULL)),
   _http(new HttpConnection(server,
                            _client)),
-  _latency_tbl(xdm_latency)
+  _http2(NULL),
+  _latency_tbl(xdm_latency),
+  _compression_stats(compression ? new HttpContentDecoder::Stats("xdms") : NULL)
 {
+  if (http2_connections > 0)
+  {
+    _http2 = new MultiplexedHttpClient(server,
+                                       "http",
+                                       http2_connections,
+                                       HTTP2_TIMEOUT_MS,
+                                       load_monitor,
+                                       NULL,
+                                       http2_stream_count_tbl,
+                                       http2_rtt_tbl,
+                                       NULL,
+                                       _compression_stats);
+  }
 }
 
 XDMConnection::~XDMConnection()
 {
+  delete _http2; _http2 = NULL;
   delete _http; _http = NULL;
   delete _client; _client = NULL;
+  delete _compression_stats; _compression_stats = NULL;
 }
 
 bool XDMConnection::get_simservs(const std::string& user,
@@ -52,23 +76,67 @@ bool XDMConnection::get_simservs(const std::string& user,
                                  const std::string& password,
                                  SAS::TrailId trail)
 {
+  if (RequestDeadline::expired())
+  {
+    TRC_INFO("Not fetching simservs for %s as the request's deadline has passed",
+             user.c_str());
+    return false;
+  }
+
   Utils::StopWatch stopWatch;
   stopWatch.start();
 
   std::string url = "/org.etsi.ngn.simservs/users/" + Utils::url_escape(user) + "/simservs.xml";
 
-  HttpResponse response = _http->create_request(HttpClient::RequestType::GET, url)
-                          .set_sas_trail(trail)
-                          .set_username(user)
-                          .send();
-  
-  HTTPCode http_code = response.get_rc();
-  xml_data = response.get_body();
+  HTTPCode http_code;
+
+  if (_http2 != NULL)
+  {
+    // Assert the user's identity, as HttpClient does for set_username.
+    http_code = _http2->send_request("GET",
+                                     url,
+                                     "",
+                                     {"X-XCAP-Asserted-Identity: " + user},
+                                     xml_data,
+                                     trail);
+  }
+  else
+  {
+    HttpRequest req = _http->create_request(HttpClient::RequestType::GET, url);
+    req.set_sas_trail(trail).set_username(user);
+
+    if (_compression_stats != NULL)
+    {
+      req.add_header(HttpContentDecoder::ACCEPT_ENCODING);
+    }
+
+    HttpResponse response = req.send();
+    http_code = response.get_rc();
+    xml_data = response.get_body();
+
+    // HttpClient doesn't give us the body as it arrives, so it's decoded
+    // all at once.
+    if (!HttpContentDecoder::decode(
+                   HttpContentDecoder::content_encoding(response.get_headers()),
+                   xml_data,
+                   _compression_stats))
+    {
+      TRC_WARNING("Failed to decode simservs for %s", user.c_str());
+      xml_data.clear();
+      http_code = HTTP_SERVER_UNAVAILABLE;
+    }
+  }
 
   unsigned long latency_us = 0;
   if (stopWatch.read(latency_us))
   {
     _latency_tbl->accumulate(latency_us);
+
+    if (stack_data.dependency_monitor != NULL)
+    {
+      stack_data.dependency_monitor->request_complete(DependencyMonitor::XDMS,
+                                                      latency_us);
+    }
   }
 
   return (http_code == HTTP_OK);